@@ -0,0 +1,527 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Prints the repaint statistics weston sends through weston_debug_stats,
+ * either summed up once a second per output or one line per frame, or
+ * the clients that cost the most, once a second.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <wayland-client.h>
+#include "weston-debug-stats-client-protocol.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+
+struct stats_output {
+	struct wl_output *output;
+	struct weston_debug_output_stats *stats;
+	uint32_t name;
+	char *make, *model;
+	struct wl_list link;
+
+	/* Summed since the last report */
+	struct timespec report_time;
+	bool seen;
+	uint32_t prev_missed;
+	uint32_t frames, missed;
+	uint64_t repaint_usec, max_repaint_usec;
+	uint64_t idle_usec;
+	uint64_t upload_bytes;
+	uint32_t primary_views, scanout_views, overlay_views, cursor_views;
+	uint32_t input_frames;
+	uint64_t input_to_commit_usec, commit_to_present_usec;
+	uint64_t max_input_usec;
+};
+
+struct stats_client {
+	uint32_t pid;
+	char name[32];
+	bool seen;
+	uint32_t surfaces, views, shm_kib, texture_kib;
+	uint32_t upload_bytes, commits;
+	/* Since the previous update, per second */
+	uint64_t upload_rate;
+	uint32_t commit_rate;
+};
+
+static struct weston_debug_stats *debug_stats;
+static uint32_t debug_stats_version;
+static struct wl_list output_list;
+static int print_frames;
+static int print_clients;
+
+/* Of the previous update and the one coming in */
+static struct wl_array clients, prev_clients;
+static struct timespec prev_update_time;
+
+static void
+print_summary(struct stats_output *output, const struct timespec *now)
+{
+	int64_t msec = timespec_sub_to_msec(now, &output->report_time);
+
+	if (output->frames == 0 || msec <= 0)
+		return;
+
+	printf("%u %s %s: %.1f fps, repaint %.2f ms avg %.2f ms max, "
+	       "idle %.2f ms avg, %u missed, views %u/%u/%u/%u, "
+	       "upload %" PRIu64 " kB/s\n",
+	       output->name, output->make, output->model,
+	       output->frames * 1000.0 / msec,
+	       output->repaint_usec / 1000.0 / output->frames,
+	       output->max_repaint_usec / 1000.0,
+	       output->idle_usec / 1000.0 / output->frames,
+	       output->missed,
+	       output->primary_views, output->scanout_views,
+	       output->overlay_views, output->cursor_views,
+	       output->upload_bytes * 1000 / 1024 / msec);
+	if (output->input_frames > 0)
+		printf("%u %s %s: input to photon %.2f ms avg "
+		       "(%.2f to commit, %.2f to present) %.2f ms max, "
+		       "%u frames\n",
+		       output->name, output->make, output->model,
+		       (output->input_to_commit_usec +
+			output->commit_to_present_usec) / 1000.0 /
+		       output->input_frames,
+		       output->input_to_commit_usec / 1000.0 /
+		       output->input_frames,
+		       output->commit_to_present_usec / 1000.0 /
+		       output->input_frames,
+		       output->max_input_usec / 1000.0,
+		       output->input_frames);
+	fflush(stdout);
+}
+
+static void
+output_stats_frame(void *data, struct weston_debug_output_stats *stats,
+		   uint32_t frames, uint32_t missed_deadlines,
+		   uint32_t repaint_usec, uint32_t idle_usec,
+		   uint32_t primary_views, uint32_t scanout_views,
+		   uint32_t overlay_views, uint32_t cursor_views,
+		   uint32_t upload_bytes)
+{
+	struct stats_output *output = data;
+	struct timespec now;
+
+	if (print_frames) {
+		printf("%u %u %u %u %u %u %u %u %u %u\n",
+		       output->name, frames, missed_deadlines,
+		       repaint_usec, idle_usec, primary_views,
+		       scanout_views, overlay_views, cursor_views,
+		       upload_bytes);
+		fflush(stdout);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (!output->seen) {
+		output->seen = true;
+		output->report_time = now;
+		output->prev_missed = missed_deadlines;
+	}
+
+	output->frames++;
+	output->missed += missed_deadlines - output->prev_missed;
+	output->prev_missed = missed_deadlines;
+	output->repaint_usec += repaint_usec;
+	if (repaint_usec > output->max_repaint_usec)
+		output->max_repaint_usec = repaint_usec;
+	output->idle_usec += idle_usec;
+	output->upload_bytes += upload_bytes;
+	output->primary_views = primary_views;
+	output->scanout_views = scanout_views;
+	output->overlay_views = overlay_views;
+	output->cursor_views = cursor_views;
+
+	if (timespec_sub_to_msec(&now, &output->report_time) < 1000)
+		return;
+
+	print_summary(output, &now);
+
+	output->report_time = now;
+	output->frames = 0;
+	output->missed = 0;
+	output->repaint_usec = 0;
+	output->max_repaint_usec = 0;
+	output->idle_usec = 0;
+	output->upload_bytes = 0;
+	output->input_frames = 0;
+	output->input_to_commit_usec = 0;
+	output->commit_to_present_usec = 0;
+	output->max_input_usec = 0;
+}
+
+/* Summed into the next report of the frame statistics */
+static void
+output_stats_input_latency(void *data,
+			   struct weston_debug_output_stats *stats,
+			   uint32_t input_frames,
+			   uint32_t input_to_commit_usec,
+			   uint32_t commit_to_present_usec)
+{
+	struct stats_output *output = data;
+	uint64_t total = (uint64_t) input_to_commit_usec +
+			 commit_to_present_usec;
+
+	if (print_frames)
+		return;
+
+	output->input_frames++;
+	output->input_to_commit_usec += input_to_commit_usec;
+	output->commit_to_present_usec += commit_to_present_usec;
+	if (total > output->max_input_usec)
+		output->max_input_usec = total;
+}
+
+static const struct weston_debug_output_stats_listener output_stats_listener = {
+	output_stats_frame,
+	output_stats_input_latency
+};
+
+static struct stats_client *
+client_find(struct wl_array *array, uint32_t pid)
+{
+	struct stats_client *c;
+
+	wl_array_for_each(c, array)
+		if (c->pid == pid)
+			return c;
+
+	return NULL;
+}
+
+static void
+client_stats_client(void *data, struct weston_debug_client_stats *stats,
+		    uint32_t pid, uint32_t surfaces, uint32_t views,
+		    uint32_t shm_kib, uint32_t texture_kib,
+		    uint32_t upload_bytes, uint32_t commits)
+{
+	struct stats_client *c;
+	FILE *f;
+	char path[64];
+
+	/* Several connections of a process count as one */
+	c = client_find(&clients, pid);
+	if (!c) {
+		c = wl_array_add(&clients, sizeof *c);
+		if (!c)
+			return;
+		memset(c, 0, sizeof *c);
+		c->pid = pid;
+
+		snprintf(path, sizeof path, "/proc/%u/comm", pid);
+		f = fopen(path, "r");
+		if (!f || !fgets(c->name, sizeof c->name, f))
+			snprintf(c->name, sizeof c->name, "?");
+		c->name[strcspn(c->name, "\n")] = '\0';
+		if (f)
+			fclose(f);
+	}
+
+	c->surfaces += surfaces;
+	c->views += views;
+	c->shm_kib += shm_kib;
+	c->texture_kib += texture_kib;
+	c->upload_bytes += upload_bytes;
+	c->commits += commits;
+}
+
+static int
+compare_clients(const void *a, const void *b)
+{
+	const struct stats_client *ca = a, *cb = b;
+	uint64_t kib_a = (uint64_t) ca->texture_kib + ca->shm_kib;
+	uint64_t kib_b = (uint64_t) cb->texture_kib + cb->shm_kib;
+
+	if (ca->upload_rate != cb->upload_rate)
+		return ca->upload_rate < cb->upload_rate ? 1 : -1;
+	if (ca->commit_rate != cb->commit_rate)
+		return ca->commit_rate < cb->commit_rate ? 1 : -1;
+	if (kib_a != kib_b)
+		return kib_a < kib_b ? 1 : -1;
+
+	return 0;
+}
+
+static void
+client_stats_done(void *data, struct weston_debug_client_stats *stats)
+{
+	struct stats_client *c, *prev;
+	struct wl_array tmp;
+	struct timespec now;
+	int64_t msec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = timespec_sub_to_msec(&now, &prev_update_time);
+
+	wl_array_for_each(c, &clients) {
+		prev = client_find(&prev_clients, c->pid);
+		if (!prev || msec <= 0)
+			continue;
+
+		c->seen = true;
+		/* A connection that went away would make these go
+		 * backwards; skip them for once */
+		if ((int32_t) (c->upload_bytes - prev->upload_bytes) >= 0)
+			c->upload_rate = (uint64_t)
+				(c->upload_bytes - prev->upload_bytes) *
+				1000 / msec;
+		if ((int32_t) (c->commits - prev->commits) >= 0)
+			c->commit_rate = (uint64_t)
+				(c->commits - prev->commits) * 1000 / msec;
+	}
+
+	qsort(clients.data, clients.size / sizeof *c, sizeof *c,
+	      compare_clients);
+
+	if (prev_update_time.tv_sec != 0) {
+		printf("%7s %-16s %8s %5s %10s %10s %11s %9s\n",
+		       "PID", "COMMAND", "SURFACES", "VIEWS", "SHM kB",
+		       "TEXTURE kB", "UPLOAD kB/s", "COMMITS/s");
+		wl_array_for_each(c, &clients) {
+			if (!c->seen)
+				continue;
+			printf("%7u %-16s %8u %5u %10u %10u %11" PRIu64
+			       " %9u\n",
+			       c->pid, c->name, c->surfaces, c->views,
+			       c->shm_kib, c->texture_kib,
+			       c->upload_rate / 1024, c->commit_rate);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	tmp = prev_clients;
+	prev_clients = clients;
+	clients = tmp;
+	clients.size = 0;
+	prev_update_time = now;
+}
+
+static const struct weston_debug_client_stats_listener client_stats_listener = {
+	client_stats_client,
+	client_stats_done
+};
+
+static void
+output_handle_geometry(void *data, struct wl_output *wl_output,
+		       int x, int y, int physical_width, int physical_height,
+		       int subpixel, const char *make, const char *model,
+		       int transform)
+{
+	struct stats_output *output = data;
+
+	free(output->make);
+	free(output->model);
+	output->make = xstrdup(make);
+	output->model = xstrdup(model);
+}
+
+static void
+output_handle_mode(void *data, struct wl_output *wl_output,
+		   uint32_t flags, int width, int height, int refresh)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	output_handle_geometry,
+	output_handle_mode
+};
+
+static void
+output_start(struct stats_output *output)
+{
+	if (!debug_stats || output->stats)
+		return;
+
+	output->stats =
+		weston_debug_stats_get_output_stats(debug_stats,
+						    output->output);
+	weston_debug_output_stats_add_listener(output->stats,
+					       &output_stats_listener, output);
+}
+
+static void
+handle_global(void *data, struct wl_registry *registry,
+	      uint32_t name, const char *interface, uint32_t version)
+{
+	struct stats_output *output;
+
+	if (strcmp(interface, "wl_output") == 0 && !print_clients) {
+		output = xzalloc(sizeof *output);
+		output->name = name;
+		output->make = xstrdup("unknown");
+		output->model = xstrdup("unknown");
+		output->output = wl_registry_bind(registry, name,
+						  &wl_output_interface, 1);
+		wl_output_add_listener(output->output, &output_listener,
+				       output);
+		wl_list_insert(output_list.prev, &output->link);
+		output_start(output);
+	} else if (strcmp(interface, "weston_debug_stats") == 0) {
+		debug_stats_version = version < 2 ? version : 2;
+		debug_stats = wl_registry_bind(registry, name,
+					       &weston_debug_stats_interface,
+					       debug_stats_version);
+		wl_list_for_each(output, &output_list, link)
+			output_start(output);
+	}
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+	struct stats_output *output;
+
+	wl_list_for_each(output, &output_list, link) {
+		if (output->name != name)
+			continue;
+
+		if (output->stats)
+			weston_debug_output_stats_destroy(output->stats);
+		wl_output_destroy(output->output);
+		wl_list_remove(&output->link);
+		free(output->make);
+		free(output->model);
+		free(output);
+		return;
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+	handle_global,
+	handle_global_remove
+};
+
+static void
+usage(const char *name, int exit_code)
+{
+	fprintf(stderr, "usage: %s [--frames | --clients]\n\n"
+		"Prints the repaint statistics of every output once a second:\n"
+		"frame rate, repaint and idle times, missed deadlines, views on\n"
+		"the primary/scanout/overlay/cursor planes and upload rate, and\n"
+		"the latency from input to the presentation of the answer.\n\n"
+		"  -f, --frames\tprint one line per frame instead, with the\n"
+		"\t\toutput, frame count, missed deadlines, repaint usec,\n"
+		"\t\tidle usec, the four view counts and uploaded bytes\n"
+		"  -c, --clients\tprint the clients once a second instead,\n"
+		"\t\twith their surfaces, views, wl_shm buffer and texture\n"
+		"\t\tmemory, upload rate and commit rate, busiest first\n",
+		name);
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "frames", no_argument, NULL, 'f' },
+		{ "clients", no_argument, NULL, 'c' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0, 0, NULL, 0 }
+	};
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct weston_debug_client_stats *client_stats;
+	int c, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "fch", options, NULL)) != -1) {
+		switch (c) {
+		case 'f':
+			print_frames = 1;
+			break;
+		case 'c':
+			print_clients = 1;
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+			break;
+		}
+	}
+
+	display = wl_display_connect(NULL);
+	if (display == NULL) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	wl_list_init(&output_list);
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, NULL);
+	wl_display_roundtrip(display);
+
+	if (debug_stats == NULL) {
+		fprintf(stderr, "the compositor does not expose output "
+			"statistics; set debug-stats=true in the [core]\n"
+			"section of weston.ini\n");
+		return EXIT_FAILURE;
+	}
+
+	if (print_clients) {
+		if (debug_stats_version < 2) {
+			fprintf(stderr, "the compositor does not expose "
+				"client statistics\n");
+			return EXIT_FAILURE;
+		}
+
+		wl_array_init(&clients);
+		wl_array_init(&prev_clients);
+		client_stats =
+			weston_debug_stats_get_client_stats(debug_stats);
+		weston_debug_client_stats_add_listener(client_stats,
+						       &client_stats_listener,
+						       NULL);
+
+		/* The first update only gives the counters to start
+		 * from. */
+		while (ret != -1) {
+			weston_debug_client_stats_update(client_stats);
+			ret = wl_display_roundtrip(display);
+			sleep(1);
+		}
+	}
+
+	while (ret != -1)
+		ret = wl_display_dispatch(display);
+
+	wl_display_disconnect(display);
+
+	return EXIT_SUCCESS;
+}
@@ -24,6 +24,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -114,6 +115,20 @@ struct background {
 	char *image;
 	int type;
 	uint32_t color;
+
+	/* what it looks like at this size and buffer scale */
+	cairo_surface_t *rendered;
+	int32_t rendered_width, rendered_height, rendered_scale;
+
+	/* Renders the size being configured on a worker thread, so that
+	 * the backgrounds of all outputs are scaled in parallel. */
+	struct {
+		struct job job;
+		cairo_surface_t *surface;
+		int32_t width, height, scale;
+		bool queued;
+	} render;
+	int32_t configured_width, configured_height;
 };
 
 struct output {
@@ -297,6 +312,17 @@ panel_trigger_motion_handler(struct widget *widget, struct input *input,
 	return CURSOR_LEFT_PTR;
 }
 
+/* Launchers, triggers and the clock only damage their own part of the
+ * panel, which keeps the rest of the buffer and its upload */
+static void
+panel_widget_schedule_redraw(struct widget *widget)
+{
+	struct rectangle allocation;
+
+	widget_get_allocation(widget, &allocation);
+	widget_schedule_redraw_rect(widget, &allocation);
+}
+
 static void
 panel_launcher_redraw_handler(struct widget *widget, void *data)
 {
@@ -372,7 +398,7 @@ panel_launcher_enter_handler(struct widget *widget, struct input *input,
 	struct panel_launcher *launcher = data;
 
 	launcher->focused = 1;
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 
 	return CURSOR_LEFT_PTR;
 }
@@ -385,7 +411,7 @@ panel_launcher_leave_handler(struct widget *widget,
 
 	launcher->focused = 0;
 	widget_destroy_tooltip(widget);
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 }
 
 static void
@@ -397,7 +423,7 @@ panel_launcher_button_handler(struct widget *widget,
 	struct panel_launcher *launcher;
 
 	launcher = widget_get_user_data(widget);
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		panel_launcher_activate(launcher);
 
@@ -412,7 +438,7 @@ panel_launcher_touch_down_handler(struct widget *widget, struct input *input,
 
 	launcher = widget_get_user_data(widget);
 	launcher->focused = 1;
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 }
 
 static void
@@ -424,7 +450,7 @@ panel_launcher_touch_up_handler(struct widget *widget, struct input *input,
 
 	launcher = widget_get_user_data(widget);
 	launcher->focused = 0;
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 	panel_launcher_activate(launcher);
 }
 
@@ -435,7 +461,7 @@ panel_trigger_enter_handler(struct widget *widget, struct input *input,
 	struct panel_internal_trigger *trigger = data;
 
 	trigger->focused = 1;
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 
 	return CURSOR_LEFT_PTR;
 }
@@ -448,7 +474,7 @@ panel_trigger_leave_handler(struct widget *widget,
 
 	trigger->focused = 0;
 	widget_destroy_tooltip(widget);
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 }
 
 static void
@@ -460,7 +486,7 @@ panel_trigger_button_handler(struct widget *widget,
 	struct panel_internal_trigger *trigger;
 
 	trigger = widget_get_user_data(widget);
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		trigger->handler(trigger, input);
 }
@@ -474,7 +500,7 @@ panel_trigger_touch_down_handler(struct widget *widget, struct input *input,
 
 	trigger = widget_get_user_data(widget);
 	trigger->focused = 1;
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 }
 
 static void
@@ -486,7 +512,7 @@ panel_trigger_touch_up_handler(struct widget *widget, struct input *input,
 
 	trigger = widget_get_user_data(widget);
 	trigger->focused = 0;
-	widget_schedule_redraw(widget);
+	panel_widget_schedule_redraw(widget);
 	trigger->handler(trigger, input);
 }
 
@@ -499,7 +525,7 @@ clock_func(struct task *task, uint32_t events)
 
 	if (read(clock->clock_fd, &exp, sizeof exp) != sizeof exp)
 		abort();
-	widget_schedule_redraw(clock->widget);
+	panel_widget_schedule_redraw(clock->widget);
 }
 
 static void
@@ -812,17 +838,13 @@ panel_create(struct desktop *desktop)
 static cairo_surface_t *
 load_icon_or_fallback(const char *icon)
 {
-	cairo_surface_t *surface = cairo_image_surface_create_from_png(icon);
-	cairo_status_t status;
+	cairo_surface_t *surface = load_cairo_surface(icon);
 	cairo_t *cr;
 
-	status = cairo_surface_status(surface);
-	if (status == CAIRO_STATUS_SUCCESS)
+	if (surface)
 		return surface;
 
-	cairo_surface_destroy(surface);
-	fprintf(stderr, "ERROR loading icon from file '%s', error: '%s'\n",
-		icon, cairo_status_to_string(status));
+	fprintf(stderr, "ERROR loading icon from file '%s'\n", icon);
 
 	/* draw fallback icon */
 	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
@@ -972,28 +994,30 @@ enum {
 	BACKGROUND_TILE
 };
 
-static void
-background_draw(struct widget *widget, void *data)
+/* Scaling a large wallpaper is by far the most expensive part of a
+ * redraw, so it is done once per size and buffer scale and redraws only
+ * copy the result. The image itself is not kept around: it is mapped
+ * back in from the image cache when the output size changes. */
+static cairo_surface_t *
+background_render(struct background *background,
+		  int32_t width, int32_t height, int32_t scale)
 {
-	struct background *background = data;
-	cairo_surface_t *surface, *image;
+	cairo_surface_t *surface, *image = NULL;
 	cairo_pattern_t *pattern;
 	cairo_matrix_t matrix;
 	cairo_t *cr;
 	double im_w, im_h;
 	double sx, sy, s;
 	double tx, ty;
-	struct rectangle allocation;
-
-	surface = window_get_surface(background->window);
 
-	cr = widget_cairo_create(background->widget);
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+					     width * scale, height * scale);
+	cr = cairo_create(surface);
+	cairo_scale(cr, scale, scale);
 	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(cr, 0.0, 0.0, 0.2, 1.0);
 	cairo_paint(cr);
 
-	widget_get_allocation(widget, &allocation);
-	image = NULL;
 	if (background->image)
 		image = load_cairo_surface(background->image);
 	else if (background->color == 0)
@@ -1002,8 +1026,8 @@ background_draw(struct widget *widget, void *data)
 	if (image && background->type != -1) {
 		im_w = cairo_image_surface_get_width(image);
 		im_h = cairo_image_surface_get_height(image);
-		sx = im_w / allocation.width;
-		sy = im_h / allocation.height;
+		sx = im_w / width;
+		sy = im_h / height;
 
 		pattern = cairo_pattern_create_for_surface(image);
 
@@ -1016,8 +1040,8 @@ background_draw(struct widget *widget, void *data)
 		case BACKGROUND_SCALE_CROP:
 			s = (sx < sy) ? sx : sy;
 			/* align center */
-			tx = (im_w - s * allocation.width) * 0.5;
-			ty = (im_h - s * allocation.height) * 0.5;
+			tx = (im_w - s * width) * 0.5;
+			ty = (im_h - s * height) * 0.5;
 			cairo_matrix_init_translate(&matrix, tx, ty);
 			cairo_matrix_scale(&matrix, s, s);
 			cairo_pattern_set_matrix(pattern, &matrix);
@@ -1030,11 +1054,60 @@ background_draw(struct widget *widget, void *data)
 
 		cairo_set_source(cr, pattern);
 		cairo_pattern_destroy (pattern);
-		cairo_surface_destroy(image);
 	} else {
 		set_hex_color(cr, background->color);
 	}
 
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	if (image)
+		cairo_surface_destroy(image);
+
+	return surface;
+}
+
+static void
+background_draw(struct widget *widget, void *data)
+{
+	struct background *background = data;
+	cairo_surface_t *surface;
+	cairo_pattern_t *pattern;
+	cairo_matrix_t matrix;
+	cairo_t *cr;
+	struct rectangle allocation;
+	int32_t scale;
+
+	surface = window_get_surface(background->window);
+
+	widget_get_allocation(widget, &allocation);
+	scale = window_get_buffer_scale(background->window);
+
+	if (!background->rendered ||
+	    background->rendered_width != allocation.width ||
+	    background->rendered_height != allocation.height ||
+	    background->rendered_scale != scale) {
+		if (background->rendered)
+			cairo_surface_destroy(background->rendered);
+		background->rendered = background_render(background,
+							 allocation.width,
+							 allocation.height,
+							 scale);
+		background->rendered_width = allocation.width;
+		background->rendered_height = allocation.height;
+		background->rendered_scale = scale;
+	}
+
+	/* one buffer pixel for one rendered pixel */
+	cr = widget_cairo_create(background->widget);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_translate(cr, allocation.x, allocation.y);
+	pattern = cairo_pattern_create_for_surface(background->rendered);
+	cairo_matrix_init_scale(&matrix, scale, scale);
+	cairo_pattern_set_matrix(pattern, &matrix);
+	cairo_pattern_set_filter(pattern, CAIRO_FILTER_FAST);
+	cairo_set_source(cr, pattern);
+	cairo_pattern_destroy(pattern);
 	cairo_paint(cr);
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
@@ -1043,6 +1116,58 @@ background_draw(struct widget *widget, void *data)
 	check_desktop_ready(background->window);
 }
 
+static void
+background_render_work(struct job *job)
+{
+	struct background *background =
+		container_of(job, struct background, render.job);
+
+	background->render.surface =
+		background_render(background, background->render.width,
+				  background->render.height,
+				  background->render.scale);
+}
+
+static void
+background_render_start(struct background *background)
+{
+	background->render.width = background->configured_width;
+	background->render.height = background->configured_height;
+	background->render.scale =
+		window_get_buffer_scale(background->window);
+
+	background->render.queued = true;
+	display_queue_job(window_get_display(background->window),
+			  &background->render.job);
+}
+
+/* The resize waits for the render, so that the redraw only copies it */
+static void
+background_render_done(struct job *job)
+{
+	struct background *background =
+		container_of(job, struct background, render.job);
+
+	background->render.queued = false;
+	if (background->rendered)
+		cairo_surface_destroy(background->rendered);
+	background->rendered = background->render.surface;
+	background->rendered_width = background->render.width;
+	background->rendered_height = background->render.height;
+	background->rendered_scale = background->render.scale;
+	background->render.surface = NULL;
+
+	if (background->configured_width != background->rendered_width ||
+	    background->configured_height != background->rendered_height) {
+		background_render_start(background);
+		return;
+	}
+
+	widget_schedule_resize(background->widget,
+			       background->rendered_width,
+			       background->rendered_height);
+}
+
 static void
 background_configure(void *data,
 		     struct weston_desktop_shell *desktop_shell,
@@ -1052,7 +1177,14 @@ background_configure(void *data,
 	struct background *background =
 		(struct background *) window_get_user_data(window);
 
-	widget_schedule_resize(background->widget, width, height);
+	background->configured_width = width;
+	background->configured_height = height;
+
+	/* an earlier render will start this one when done */
+	if (background->render.queued)
+		return;
+
+	background_render_start(background);
 }
 
 static void
@@ -1317,9 +1449,16 @@ static const struct weston_desktop_shell_listener listener = {
 static void
 background_destroy(struct background *background)
 {
+	display_cancel_job(window_get_display(background->window),
+			   &background->render.job);
+	if (background->render.surface)
+		cairo_surface_destroy(background->render.surface);
+
 	widget_destroy(background->widget);
 	window_destroy(background->window);
 
+	if (background->rendered)
+		cairo_surface_destroy(background->rendered);
 	free(background->image);
 	free(background);
 }
@@ -1338,6 +1477,8 @@ background_create(struct desktop *desktop)
 	window_set_user_data(background->window, background);
 	widget_set_redraw_handler(background->widget, background_draw);
 	widget_set_transparent(background->widget, 0);
+	background->render.job.work = background_render_work;
+	background->render.job.done = background_render_done;
 
 	s = weston_config_get_section(desktop->config, "shell", NULL, NULL);
 	weston_config_section_get_string(s, "background-image",
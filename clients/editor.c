@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include <linux/input.h>
@@ -44,6 +45,17 @@
 #include "window.h"
 #include "text-input-unstable-v1-client-protocol.h"
 
+/* One line of the text, up to a newline, laid out on its own so that
+ * an edit only lays out the lines it touches again. */
+struct text_paragraph {
+	char *text;
+	uint32_t start, length;
+	bool attributed;
+	PangoLayout *layout;
+	/* in Pango units from the top of the text */
+	int y, height;
+};
+
 struct text_entry {
 	struct widget *widget;
 	struct window *window;
@@ -69,7 +81,18 @@ struct text_entry {
 		bool invalid_delete;
 	} pending_commit;
 	struct zwp_text_input_v1 *text_input;
-	PangoLayout *layout;
+	PangoContext *context;
+	guint context_serial;
+	/* the text with the preedit, as laid out */
+	char *layout_text;
+	struct text_paragraph *paragraphs;
+	int paragraph_count;
+	/* What the last layout update changed, in pixels from the top of
+	 * the text, and the cursor as last drawn */
+	struct {
+		int32_t y1, y2;
+	} damage;
+	struct rectangle drawn_cursor;
 	struct {
 		xkb_mod_mask_t shift_mask;
 	} keysym;
@@ -183,6 +206,9 @@ static void text_entry_reset_preedit(struct text_entry *entry);
 static void text_entry_commit_and_reset(struct text_entry *entry);
 static void text_entry_get_cursor_rectangle(struct text_entry *entry, struct rectangle *rectangle);
 static void text_entry_update(struct text_entry *entry);
+static void text_entry_schedule_redraw(struct text_entry *entry);
+static int text_offset_left(struct rectangle *allocation);
+static int text_offset_top(struct rectangle *allocation);
 
 static void
 text_input_commit_string(void *data,
@@ -220,7 +246,7 @@ text_input_commit_string(void *data,
 
 	memset(&entry->pending_commit, 0, sizeof entry->pending_commit);
 
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 }
 
 static void
@@ -274,7 +300,7 @@ text_input_preedit_string(void *data,
 
 	text_entry_update(entry);
 
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 }
 
 static void
@@ -413,7 +439,7 @@ text_input_keysym(void *data,
 
 		if (!(modifiers & entry->keysym.shift_mask))
 			entry->anchor = entry->cursor;
-		widget_schedule_redraw(entry->widget);
+		text_entry_schedule_redraw(entry);
 
 		return;
 	}
@@ -430,7 +456,7 @@ text_input_keysym(void *data,
 
 		if (!(modifiers & entry->keysym.shift_mask))
 			entry->anchor = entry->cursor;
-		widget_schedule_redraw(entry->widget);
+		text_entry_schedule_redraw(entry);
 
 		return;
 	}
@@ -528,9 +554,10 @@ text_input_text_direction(void *data,
 			  uint32_t direction)
 {
 	struct text_entry *entry = data;
-	PangoContext *context = pango_layout_get_context(entry->layout);
 	PangoDirection pango_direction;
 
+	if (!entry->context)
+		return;
 
 	switch (direction) {
 		case ZWP_TEXT_INPUT_V1_TEXT_DIRECTION_LTR:
@@ -544,7 +571,8 @@ text_input_text_direction(void *data,
 			pango_direction = PANGO_DIRECTION_NEUTRAL;
 	}
 
-	pango_context_set_base_dir(context, pango_direction);
+	pango_context_set_base_dir(entry->context, pango_direction);
+	text_entry_schedule_redraw(entry);
 }
 
 static const struct zwp_text_input_v1_listener text_input_listener = {
@@ -714,12 +742,27 @@ text_entry_create(struct editor *editor, const char *text)
 	return entry;
 }
 
+static void
+text_entry_free_paragraphs(struct text_paragraph *paragraphs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (paragraphs[i].layout)
+			g_object_unref(paragraphs[i].layout);
+		free(paragraphs[i].text);
+	}
+	free(paragraphs);
+}
+
 static void
 text_entry_destroy(struct text_entry *entry)
 {
 	widget_destroy(entry->widget);
 	zwp_text_input_v1_destroy(entry->text_input);
-	g_clear_object(&entry->layout);
+	text_entry_free_paragraphs(entry->paragraphs, entry->paragraph_count);
+	free(entry->layout_text);
+	g_clear_object(&entry->context);
 	free(entry->text);
 	free(entry->preferred_language);
 	free(entry);
@@ -729,14 +772,12 @@ static void
 redraw_handler(struct widget *widget, void *data)
 {
 	struct editor *editor = data;
-	cairo_surface_t *surface;
 	struct rectangle allocation;
 	cairo_t *cr;
 
-	surface = window_get_surface(editor->window);
 	widget_get_allocation(editor->widget, &allocation);
 
-	cr = cairo_create(surface);
+	cr = widget_cairo_create(editor->widget);
 	cairo_rectangle(cr, allocation.x, allocation.y, allocation.width, allocation.height);
 	cairo_clip(cr);
 
@@ -753,7 +794,6 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_paint(cr);
 
 	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
 }
 
 static void
@@ -808,6 +848,220 @@ text_entry_deactivate(struct text_entry *entry,
 				     seat);
 }
 
+static struct text_paragraph *
+text_entry_paragraph_at_index(struct text_entry *entry, uint32_t index)
+{
+	int lo = 0, hi = entry->paragraph_count - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (entry->paragraphs[mid].start <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return &entry->paragraphs[lo];
+}
+
+static struct text_paragraph *
+text_entry_paragraph_at_y(struct text_entry *entry, int y)
+{
+	int lo = 0, hi = entry->paragraph_count - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (entry->paragraphs[mid].y <= y)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return &entry->paragraphs[lo];
+}
+
+struct paragraph_attrs {
+	struct text_paragraph *p;
+	PangoAttrList *list;
+};
+
+static gboolean
+paragraph_collect_attr(PangoAttribute *attr, gpointer data)
+{
+	struct paragraph_attrs *pa = data;
+	PangoAttribute *copy;
+	uint32_t start = pa->p->start, end = pa->p->start + pa->p->length;
+
+	if (attr->end_index <= start || attr->start_index >= end)
+		return FALSE;
+
+	copy = pango_attribute_copy(attr);
+	copy->start_index = MAX(attr->start_index, start) - start;
+	copy->end_index = MIN(attr->end_index, end) - start;
+
+	if (!pa->list)
+		pa->list = pango_attr_list_new();
+	pango_attr_list_insert(pa->list, copy);
+
+	/* only looking */
+	return FALSE;
+}
+
+static void
+text_paragraph_layout(struct text_entry *entry, struct text_paragraph *p,
+		      PangoAttrList *attr_list)
+{
+	struct paragraph_attrs pa = { p, NULL };
+	PangoRectangle extents;
+
+	if (attr_list)
+		pango_attr_list_filter(attr_list, paragraph_collect_attr, &pa);
+	p->attributed = pa.list != NULL;
+
+	p->layout = pango_layout_new(entry->context);
+	pango_layout_set_text(p->layout, p->text, p->length);
+	pango_layout_set_attributes(p->layout, pa.list);
+	if (pa.list)
+		pango_attr_list_unref(pa.list);
+
+	pango_layout_get_extents(p->layout, NULL, &extents);
+	p->height = extents.height;
+}
+
+static bool
+text_paragraph_attributed(struct text_paragraph *p, PangoAttrList *attr_list)
+{
+	struct paragraph_attrs pa = { p, NULL };
+
+	if (!attr_list)
+		return false;
+
+	pango_attr_list_filter(attr_list, paragraph_collect_attr, &pa);
+	if (!pa.list)
+		return false;
+
+	pango_attr_list_unref(pa.list);
+	return true;
+}
+
+/* An old layout is still good if the text is the same and neither the
+ * old nor the new paragraph has selection or preedit attributes. */
+static bool
+text_paragraph_reusable(struct text_paragraph *old, struct text_paragraph *p,
+			PangoAttrList *attr_list)
+{
+	return old->length == p->length && !old->attributed &&
+	       memcmp(old->text, p->text, p->length) == 0 &&
+	       !text_paragraph_attributed(p, attr_list);
+}
+
+/**
+ * Split text into paragraphs and lay out those that changed
+ *
+ * Unchanged paragraphs are found from the start and from the end of the
+ * text, and between, position by position if the number of paragraphs
+ * in the middle did not change. The vertical range from the first to
+ * the last changed paragraph, or to the end if any moved, is left in
+ * entry->damage.
+ */
+static void
+text_entry_layout_paragraphs(struct text_entry *entry, const char *text,
+			     PangoAttrList *attr_list)
+{
+	struct text_paragraph *old = entry->paragraphs, *p;
+	int old_count = entry->paragraph_count, count = 1;
+	int head = 0, tail = 0, i, first = -1, last = -1;
+	bool moved = false, relayout;
+	const char *c, *nl;
+	guint serial;
+
+	entry->damage.y1 = entry->damage.y2 = 0;
+	if (!entry->context)
+		return;
+
+	serial = pango_context_get_serial(entry->context);
+	relayout = serial != entry->context_serial;
+	entry->context_serial = serial;
+
+	for (c = text; (c = strchr(c, '\n')); c++)
+		count++;
+
+	entry->paragraphs = xzalloc(count * sizeof *entry->paragraphs);
+	entry->paragraph_count = count;
+
+	for (c = text, i = 0; i < count; i++) {
+		p = &entry->paragraphs[i];
+		nl = strchr(c, '\n');
+		p->start = c - text;
+		p->length = nl ? (uint32_t) (nl - c) : strlen(c);
+		p->text = strndup(c, p->length);
+		c += p->length + 1;
+	}
+
+	if (!relayout) {
+		while (head < old_count && head < count &&
+		       text_paragraph_reusable(&old[head],
+					       &entry->paragraphs[head],
+					       attr_list))
+			head++;
+		while (tail < old_count - head && tail < count - head &&
+		       text_paragraph_reusable(&old[old_count - 1 - tail],
+					       &entry->paragraphs[count - 1 - tail],
+					       attr_list))
+			tail++;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct text_paragraph *o = NULL;
+
+		p = &entry->paragraphs[i];
+		p->y = i > 0 ? p[-1].y + p[-1].height : 0;
+
+		if (i < head)
+			o = &old[i];
+		else if (i >= count - tail)
+			o = &old[old_count - count + i];
+		else if (!relayout && old_count == count &&
+			 text_paragraph_reusable(&old[i], p, attr_list))
+			o = &old[i];
+
+		if (o) {
+			p->layout = o->layout;
+			p->height = o->height;
+			o->layout = NULL;
+			if (o->y != p->y)
+				moved = true;
+			continue;
+		}
+
+		text_paragraph_layout(entry, p, attr_list);
+		if (first < 0)
+			first = i;
+		last = i;
+		if (old_count != count || relayout ||
+		    old[i].height != p->height)
+			moved = true;
+	}
+
+	if (old_count != count)
+		moved = true;
+
+	text_entry_free_paragraphs(old, old_count);
+
+	if (first < 0 && !moved)
+		return;
+
+	if (first < 0)
+		first = head;
+	entry->damage.y1 = PANGO_PIXELS_FLOOR(entry->paragraphs[first].y);
+	if (moved)
+		entry->damage.y2 = INT32_MAX;
+	else
+		entry->damage.y2 =
+			PANGO_PIXELS_CEIL(entry->paragraphs[last].y +
+					  entry->paragraphs[last].height);
+}
+
 static void
 text_entry_update_layout(struct text_entry *entry)
 {
@@ -862,13 +1116,115 @@ text_entry_update_layout(struct text_entry *entry)
 		pango_attr_list_insert(attr_list, attr);
 	}
 
-	if (entry->layout) {
-		pango_layout_set_text(entry->layout, text, -1);
-		pango_layout_set_attributes(entry->layout, attr_list);
+	text_entry_layout_paragraphs(entry, text, attr_list);
+
+	free(entry->layout_text);
+	entry->layout_text = text;
+	if (attr_list)
+		pango_attr_list_unref(attr_list);
+}
+
+static int
+text_entry_cursor_pos(struct text_entry *entry, uint32_t index,
+		      PangoRectangle *pos)
+{
+	struct text_paragraph *p;
+
+	if (entry->paragraph_count == 0)
+		return -1;
+
+	p = text_entry_paragraph_at_index(entry, index);
+	pango_layout_get_cursor_pos(p->layout, index - p->start, pos, NULL);
+	pos->y += p->y;
+
+	return 0;
+}
+
+/* The byte index in the laid out text closest to x, y, relative to the
+ * top left of the text */
+static uint32_t
+text_entry_index_at(struct text_entry *entry, int32_t x, int32_t y)
+{
+	struct text_paragraph *p;
+	const char *text;
+	int index, trailing;
+
+	if (entry->paragraph_count == 0)
+		return 0;
+
+	p = text_entry_paragraph_at_y(entry, y * PANGO_SCALE);
+	pango_layout_xy_to_index(p->layout,
+				 x * PANGO_SCALE, y * PANGO_SCALE - p->y,
+				 &index, &trailing);
+
+	text = entry->layout_text + p->start;
+	return g_utf8_offset_to_pointer(text + index, trailing) -
+		entry->layout_text;
+}
+
+static bool
+text_entry_get_text_cursor(struct text_entry *entry, struct rectangle *r)
+{
+	PangoRectangle pos;
+
+	if (entry->preedit.text && entry->preedit.cursor < 0)
+		return false;
+
+	if (text_entry_cursor_pos(entry, entry->cursor + entry->preedit.cursor,
+				  &pos) < 0)
+		return false;
+
+	/* the one pixel wide stroke, at any subpixel offset */
+	r->x = PANGO_PIXELS(pos.x) - 1;
+	r->y = PANGO_PIXELS(pos.y) - 1;
+	r->width = 3;
+	r->height = PANGO_PIXELS(pos.height) + 2;
+
+	return true;
+}
+
+/* Lay out what changed and redraw only that, and the cursor where it
+ * was and where it is now. */
+static void
+text_entry_schedule_redraw(struct text_entry *entry)
+{
+	struct rectangle allocation, r;
+	int32_t ox, oy;
+
+	if (!entry->context) {
+		widget_schedule_redraw(entry->widget);
+		return;
+	}
+
+	text_entry_update_layout(entry);
+
+	widget_get_allocation(entry->widget, &allocation);
+	ox = allocation.x + text_offset_left(&allocation);
+	oy = allocation.y + text_offset_top(&allocation);
+
+	if (entry->damage.y1 < entry->damage.y2 &&
+	    oy + entry->damage.y1 < allocation.y + allocation.height) {
+		r.x = allocation.x;
+		r.y = MAX(oy + entry->damage.y1, allocation.y);
+		r.width = allocation.width;
+		r.height = MIN((int64_t) oy + entry->damage.y2,
+			       allocation.y + allocation.height) - r.y;
+		if (r.height > 0)
+			widget_schedule_redraw_rect(entry->widget, &r);
+	}
+
+	if (entry->drawn_cursor.width > 0) {
+		r = entry->drawn_cursor;
+		r.x += ox;
+		r.y += oy;
+		widget_schedule_redraw_rect(entry->widget, &r);
 	}
 
-	free(text);
-	pango_attr_list_unref(attr_list);
+	if (text_entry_get_text_cursor(entry, &r)) {
+		r.x += ox;
+		r.y += oy;
+		widget_schedule_redraw_rect(entry->widget, &r);
+	}
 }
 
 static void
@@ -922,9 +1278,7 @@ text_entry_insert_at_cursor(struct text_entry *entry, const char *text,
 	else
 		entry->cursor += 1 + cursor;
 
-	text_entry_update_layout(entry);
-
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 
 	text_entry_update(entry);
 }
@@ -976,9 +1330,7 @@ text_entry_set_preedit(struct text_entry *entry,
 	entry->preedit.text = strdup(preedit_text);
 	entry->preedit.cursor = preedit_cursor;
 
-	text_entry_update_layout(entry);
-
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 }
 
 static uint32_t
@@ -987,19 +1339,12 @@ text_entry_try_invoke_preedit_action(struct text_entry *entry,
 				     uint32_t button,
 				     enum wl_pointer_button_state state)
 {
-	int index, trailing;
 	uint32_t cursor;
-	const char *text;
 
 	if (!entry->preedit.text)
 		return 0;
 
-	pango_layout_xy_to_index(entry->layout,
-				 x * PANGO_SCALE, y * PANGO_SCALE,
-				 &index, &trailing);
-
-	text = pango_layout_get_text(entry->layout);
-	cursor = g_utf8_offset_to_pointer(text + index, trailing) - text;
+	cursor = text_entry_index_at(entry, x, y);
 
 	if (cursor < entry->cursor ||
 	    cursor > entry->cursor + strlen(entry->preedit.text)) {
@@ -1025,17 +1370,9 @@ text_entry_set_cursor_position(struct text_entry *entry,
 			       int32_t x, int32_t y,
 			       bool move_anchor)
 {
-	int index, trailing;
-	const char *text;
 	uint32_t cursor;
 
-	pango_layout_xy_to_index(entry->layout,
-				 x * PANGO_SCALE, y * PANGO_SCALE,
-				 &index, &trailing);
-
-	text = pango_layout_get_text(entry->layout);
-
-	cursor = g_utf8_offset_to_pointer(text + index, trailing) - text;
+	cursor = text_entry_index_at(entry, x, y);
 
 	if (move_anchor)
 		entry->anchor = cursor;
@@ -1051,9 +1388,7 @@ text_entry_set_cursor_position(struct text_entry *entry,
 
 	entry->cursor = cursor;
 
-	text_entry_update_layout(entry);
-
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 
 	text_entry_update(entry);
 }
@@ -1080,9 +1415,7 @@ text_entry_delete_text(struct text_entry *entry,
 
 	entry->anchor = entry->cursor;
 
-	text_entry_update_layout(entry);
-
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 
 	text_entry_update(entry);
 }
@@ -1105,12 +1438,13 @@ static void
 text_entry_get_cursor_rectangle(struct text_entry *entry, struct rectangle *rectangle)
 {
 	struct rectangle allocation;
-	PangoRectangle extents;
 	PangoRectangle cursor_pos;
 
 	widget_get_allocation(entry->widget, &allocation);
 
-	if (entry->preedit.text && entry->preedit.cursor < 0) {
+	if ((entry->preedit.text && entry->preedit.cursor < 0) ||
+	    text_entry_cursor_pos(entry, entry->cursor + entry->preedit.cursor,
+				  &cursor_pos) < 0) {
 		rectangle->x = 0;
 		rectangle->y = 0;
 		rectangle->width = 0;
@@ -1118,12 +1452,6 @@ text_entry_get_cursor_rectangle(struct text_entry *entry, struct rectangle *rect
 		return;
 	}
 
-
-	pango_layout_get_extents(entry->layout, &extents, NULL);
-	pango_layout_get_cursor_pos(entry->layout,
-				    entry->cursor + entry->preedit.cursor,
-				    &cursor_pos, NULL);
-
 	rectangle->x = allocation.x + (allocation.height / 2) + PANGO_PIXELS(cursor_pos.x);
 	rectangle->y = allocation.y + 10 + PANGO_PIXELS(cursor_pos.y);
 	rectangle->width = PANGO_PIXELS(cursor_pos.width);
@@ -1133,16 +1461,15 @@ text_entry_get_cursor_rectangle(struct text_entry *entry, struct rectangle *rect
 static void
 text_entry_draw_cursor(struct text_entry *entry, cairo_t *cr)
 {
-	PangoRectangle extents;
 	PangoRectangle cursor_pos;
 
-	if (entry->preedit.text && entry->preedit.cursor < 0)
+	if (!text_entry_get_text_cursor(entry, &entry->drawn_cursor)) {
+		entry->drawn_cursor.width = 0;
 		return;
+	}
 
-	pango_layout_get_extents(entry->layout, &extents, NULL);
-	pango_layout_get_cursor_pos(entry->layout,
-				    entry->cursor + entry->preedit.cursor,
-				    &cursor_pos, NULL);
+	text_entry_cursor_pos(entry, entry->cursor + entry->preedit.cursor,
+			      &cursor_pos);
 
 	cairo_set_line_width(cr, 1.0);
 	cairo_move_to(cr, PANGO_PIXELS(cursor_pos.x), PANGO_PIXELS(cursor_pos.y));
@@ -1166,14 +1493,15 @@ static void
 text_entry_redraw_handler(struct widget *widget, void *data)
 {
 	struct text_entry *entry = data;
-	cairo_surface_t *surface;
+	struct text_paragraph *p;
 	struct rectangle allocation;
+	double x1, y1, x2, y2;
 	cairo_t *cr;
+	int i;
 
-	surface = window_get_surface(entry->window);
 	widget_get_allocation(entry->widget, &allocation);
 
-	cr = cairo_create(surface);
+	cr = widget_cairo_create(entry->widget);
 	cairo_rectangle(cr, allocation.x, allocation.y, allocation.width, allocation.height);
 	cairo_clip(cr);
 
@@ -1201,14 +1529,27 @@ text_entry_redraw_handler(struct widget *widget, void *data)
 			text_offset_left(&allocation),
 			text_offset_top(&allocation));
 
-	if (!entry->layout)
-		entry->layout = pango_cairo_create_layout(cr);
+	if (!entry->context)
+		entry->context = pango_cairo_create_context(cr);
 	else
-		pango_cairo_update_layout(cr, entry->layout);
+		pango_cairo_update_context(cr, entry->context);
 
 	text_entry_update_layout(entry);
 
-	pango_cairo_show_layout(cr, entry->layout);
+	/* only the paragraphs in what is being redrawn */
+	cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+	if (entry->paragraph_count > 0) {
+		p = text_entry_paragraph_at_y(entry, y1 * PANGO_SCALE);
+		for (i = p - entry->paragraphs;
+		     i < entry->paragraph_count; i++) {
+			p = &entry->paragraphs[i];
+			if (p->y > y2 * PANGO_SCALE)
+				break;
+
+			cairo_move_to(cr, 0, (double) p->y / PANGO_SCALE);
+			pango_cairo_show_layout(cr, p->layout);
+		}
+	}
 
 	text_entry_draw_cursor(entry, cr);
 
@@ -1216,7 +1557,6 @@ text_entry_redraw_handler(struct widget *widget, void *data)
 	cairo_paint(cr);
 
 	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
 }
 
 static int
@@ -1433,7 +1773,7 @@ key_handler(struct window *window,
 				entry->cursor = new_char - entry->text;
 				if (!(input_get_modifiers(input) & MOD_SHIFT_MASK))
 					entry->anchor = entry->cursor;
-				widget_schedule_redraw(entry->widget);
+				text_entry_schedule_redraw(entry);
 			}
 			break;
 		case XKB_KEY_Right:
@@ -1444,7 +1784,7 @@ key_handler(struct window *window,
 				entry->cursor = new_char - entry->text;
 				if (!(input_get_modifiers(input) & MOD_SHIFT_MASK))
 					entry->anchor = entry->cursor;
-				widget_schedule_redraw(entry->widget);
+				text_entry_schedule_redraw(entry);
 			}
 			break;
 		case XKB_KEY_Up:
@@ -1453,7 +1793,7 @@ key_handler(struct window *window,
 			move_up(entry->text, &entry->cursor);
 			if (!(input_get_modifiers(input) & MOD_SHIFT_MASK))
 				entry->anchor = entry->cursor;
-			widget_schedule_redraw(entry->widget);
+			text_entry_schedule_redraw(entry);
 			break;
 		case XKB_KEY_Down:
 			text_entry_commit_and_reset(entry);
@@ -1461,7 +1801,7 @@ key_handler(struct window *window,
 			move_down(entry->text, &entry->cursor);
 			if (!(input_get_modifiers(input) & MOD_SHIFT_MASK))
 				entry->anchor = entry->cursor;
-			widget_schedule_redraw(entry->widget);
+			text_entry_schedule_redraw(entry);
 			break;
 		case XKB_KEY_Escape:
 			break;
@@ -1475,7 +1815,7 @@ key_handler(struct window *window,
 			break;
 	}
 
-	widget_schedule_redraw(entry->widget);
+	text_entry_schedule_redraw(entry);
 }
 
 static void
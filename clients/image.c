@@ -42,11 +42,47 @@
 
 #include "window.h"
 #include "shared/cairo-util.h"
+#include "shared/helpers.h"
+#include "viewporter-client-protocol.h"
+
+/* Tiles are this many pixels square at every level, level n being the
+ * image downscaled by 2^n. */
+#define TILE_SIZE 512
+/* how many tiles to keep around while they are not shown */
+#define TILE_CACHE_MAX 64
+
+struct viewer {
+	struct display *display;
+	struct wl_subcompositor *subcompositor;
+	struct wp_viewporter *viewporter;
+};
+
+/* A piece of the image at one level, rendered on a worker thread and
+ * shown in a subsurface of its own, scaled and cropped by the
+ * compositor through its viewport. */
+struct tile {
+	struct image *image;
+	int level, tx, ty;
+	int32_t width, height;
+	cairo_surface_t *data;
+
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	struct wp_viewport *viewport;
+
+	struct job job;
+	bool ready;
+	bool mapped;
+	bool wanted;
+	/* image::tile_list, most recently shown first */
+	struct wl_list link;
+};
 
 struct image {
 	struct window *window;
 	struct widget *widget;
 	struct display *display;
+	struct viewer *viewer;
 	char *filename;
 	cairo_surface_t *image;
 	int fullscreen;
@@ -61,8 +97,281 @@ struct image {
 
 	bool initialized;
 	cairo_matrix_t matrix;
+
+	/* the level at which the whole image is a single tile */
+	int top_level;
+	/* that tile, shown below the others while they load */
+	struct tile *backdrop;
+	struct wl_list tile_list;
+	int tile_count;
 };
 
+static int32_t
+level_size(int32_t size, int level)
+{
+	return (size + (1 << level) - 1) >> level;
+}
+
+static void
+tile_render(struct job *job)
+{
+	struct tile *tile = container_of(job, struct tile, job);
+	double scale = ldexp(1.0, -tile->level);
+	cairo_t *cr;
+
+	cr = cairo_create(tile->data);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_scale(cr, scale, scale);
+	cairo_set_source_surface(cr, tile->image->image,
+				 -(double) tile->tx * TILE_SIZE / scale,
+				 -(double) tile->ty * TILE_SIZE / scale);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+	cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	cairo_surface_flush(tile->data);
+}
+
+static void
+tile_ready(struct job *job)
+{
+	struct tile *tile = container_of(job, struct tile, job);
+
+	tile->ready = true;
+	window_schedule_redraw(tile->image->window);
+}
+
+static struct tile *
+tile_create(struct image *image, int level, int tx, int ty)
+{
+	struct viewer *viewer = image->viewer;
+	struct wl_compositor *compositor =
+		display_get_compositor(image->display);
+	struct rectangle rect;
+	struct wl_region *region;
+	struct tile *tile;
+
+	tile = zalloc(sizeof *tile);
+	if (!tile)
+		return NULL;
+
+	tile->image = image;
+	tile->level = level;
+	tile->tx = tx;
+	tile->ty = ty;
+	tile->width = MIN(TILE_SIZE,
+			  level_size(image->width, level) - tx * TILE_SIZE);
+	tile->height = MIN(TILE_SIZE,
+			   level_size(image->height, level) - ty * TILE_SIZE);
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.width = tile->width;
+	rect.height = tile->height;
+	tile->data = display_create_surface(image->display, NULL, &rect,
+					    SURFACE_SHM);
+	if (!tile->data) {
+		free(tile);
+		return NULL;
+	}
+
+	tile->surface = wl_compositor_create_surface(compositor);
+	tile->subsurface =
+		wl_subcompositor_get_subsurface(viewer->subcompositor,
+						tile->surface,
+						window_get_wl_surface(image->window));
+	tile->viewport = wp_viewporter_get_viewport(viewer->viewporter,
+						    tile->surface);
+
+	/* the input is for the window */
+	region = wl_compositor_create_region(compositor);
+	wl_surface_set_input_region(tile->surface, region);
+	wl_region_destroy(region);
+
+	wl_list_insert(&image->tile_list, &tile->link);
+	image->tile_count++;
+
+	tile->job.work = tile_render;
+	tile->job.done = tile_ready;
+	display_queue_job(image->display, &tile->job);
+
+	return tile;
+}
+
+static void
+tile_destroy(struct tile *tile)
+{
+	display_cancel_job(tile->image->display, &tile->job);
+
+	wp_viewport_destroy(tile->viewport);
+	wl_subsurface_destroy(tile->subsurface);
+	wl_surface_destroy(tile->surface);
+	cairo_surface_destroy(tile->data);
+
+	wl_list_remove(&tile->link);
+	tile->image->tile_count--;
+	free(tile);
+}
+
+static struct tile *
+image_get_tile(struct image *image, int level, int tx, int ty)
+{
+	struct tile *tile;
+
+	wl_list_for_each(tile, &image->tile_list, link) {
+		if (tile->level == level && tile->tx == tx && tile->ty == ty) {
+			wl_list_remove(&tile->link);
+			wl_list_insert(&image->tile_list, &tile->link);
+			return tile;
+		}
+	}
+
+	return tile_create(image, level, tx, ty);
+}
+
+static void
+tile_unmap(struct tile *tile)
+{
+	if (!tile->mapped)
+		return;
+
+	wl_surface_attach(tile->surface, NULL, 0, 0);
+	wl_surface_commit(tile->surface);
+	tile->mapped = false;
+}
+
+/* Place the tile where the view matrix puts it, cropped to the widget;
+ * on the next commit of the window, as the subsurface is synchronized */
+static void
+tile_show(struct tile *tile, struct rectangle *allocation)
+{
+	struct image *image = tile->image;
+	double scale = image->matrix.xx * ldexp(1.0, tile->level);
+	double x0, y0, x1, y1;
+	int32_t cx0, cy0, cx1, cy1;
+	wl_fixed_t sx, sy, sw, sh;
+
+	tile->wanted = true;
+	if (!tile->ready)
+		return;
+
+	/* rounded the same way as the edges of the neighbours */
+	x0 = allocation->x + image->matrix.x0 +
+		(double) tile->tx * TILE_SIZE * scale;
+	y0 = allocation->y + image->matrix.y0 +
+		(double) tile->ty * TILE_SIZE * scale;
+	x1 = allocation->x + image->matrix.x0 +
+		(double) (tile->tx * TILE_SIZE + tile->width) * scale;
+	y1 = allocation->y + image->matrix.y0 +
+		(double) (tile->ty * TILE_SIZE + tile->height) * scale;
+
+	cx0 = MAX(lround(x0), allocation->x);
+	cy0 = MAX(lround(y0), allocation->y);
+	cx1 = MIN(lround(x1), allocation->x + allocation->width);
+	cy1 = MIN(lround(y1), allocation->y + allocation->height);
+	if (cx1 <= cx0 || cy1 <= cy0) {
+		tile_unmap(tile);
+		return;
+	}
+
+	sx = wl_fixed_from_double(MAX((cx0 - x0) / scale, 0.0));
+	sy = wl_fixed_from_double(MAX((cy0 - y0) / scale, 0.0));
+	sw = wl_fixed_from_double((cx1 - cx0) / scale);
+	sh = wl_fixed_from_double((cy1 - cy0) / scale);
+	sw = MIN(sw, wl_fixed_from_int(tile->width) - sx);
+	sh = MIN(sh, wl_fixed_from_int(tile->height) - sy);
+	if (sw <= 0 || sh <= 0) {
+		tile_unmap(tile);
+		return;
+	}
+
+	wp_viewport_set_source(tile->viewport, sx, sy, sw, sh);
+	wp_viewport_set_destination(tile->viewport, cx1 - cx0, cy1 - cy0);
+	wl_subsurface_set_position(tile->subsurface, cx0, cy0);
+
+	if (!tile->mapped) {
+		wl_surface_attach(tile->surface,
+				  display_get_buffer_for_surface(image->display,
+								 tile->data),
+				  0, 0);
+		wl_surface_damage(tile->surface, 0, 0,
+				  tile->width, tile->height);
+		tile->mapped = true;
+	}
+	wl_surface_commit(tile->surface);
+}
+
+/**
+ * Show the tiles covering the widget, at the level closest to the
+ * current scale from above
+ *
+ * Missing tiles start rendering and show up when done; the backdrop
+ * covers for them meanwhile. Panning and zooming within a level only
+ * moves and rescales the subsurfaces.
+ */
+static void
+image_update_tiles(struct image *image, struct rectangle *allocation)
+{
+	struct tile *tile, *tmp;
+	double scale = image->matrix.xx, size;
+	int level, tx, ty, tx0, ty0, tx1, ty1, kept;
+
+	if (!image->backdrop)
+		image->backdrop = tile_create(image, image->top_level, 0, 0);
+
+	wl_list_for_each(tile, &image->tile_list, link)
+		tile->wanted = false;
+
+	if (image->backdrop)
+		tile_show(image->backdrop, allocation);
+
+	level = scale < 1.0 ? (int) floor(-log2(scale)) : 0;
+	level = MIN(level, image->top_level);
+	size = TILE_SIZE * scale * ldexp(1.0, level);
+
+	tx0 = MAX(0, (int) floor(-image->matrix.x0 / size));
+	ty0 = MAX(0, (int) floor(-image->matrix.y0 / size));
+	tx1 = MIN((level_size(image->width, level) - 1) / TILE_SIZE,
+		  (int) floor((allocation->width - image->matrix.x0) / size));
+	ty1 = MIN((level_size(image->height, level) - 1) / TILE_SIZE,
+		  (int) floor((allocation->height - image->matrix.y0) / size));
+
+	for (ty = ty0; ty <= ty1; ty++) {
+		for (tx = tx0; tx <= tx1; tx++) {
+			tile = image_get_tile(image, level, tx, ty);
+			if (tile)
+				tile_show(tile, allocation);
+		}
+	}
+
+	kept = 0;
+	wl_list_for_each_safe(tile, tmp, &image->tile_list, link) {
+		if (tile->wanted)
+			continue;
+
+		tile_unmap(tile);
+		if (++kept > TILE_CACHE_MAX && tile != image->backdrop)
+			tile_destroy(tile);
+	}
+}
+
+static void
+image_destroy_tiles(struct image *image)
+{
+	struct tile *tile, *tmp;
+
+	wl_list_for_each_safe(tile, tmp, &image->tile_list, link)
+		tile_destroy(tile);
+	image->backdrop = NULL;
+}
+
+static bool
+image_use_tiles(struct image *image)
+{
+	return image->viewer->subcompositor && image->viewer->viewporter;
+}
+
 static double
 get_scale(struct image *image)
 {
@@ -144,9 +453,19 @@ redraw_handler(struct widget *widget, void *data)
 		image->height = height;
 		cairo_matrix_init_scale(&image->matrix, scale, scale);
 
+		image->top_level = 0;
+		while (level_size(image->width, image->top_level) > TILE_SIZE ||
+		       level_size(image->height, image->top_level) > TILE_SIZE)
+			image->top_level++;
+
 		clamp_view(image);
 	}
 
+	if (image_use_tiles(image)) {
+		image_update_tiles(image, &allocation);
+		goto out;
+	}
+
 	matrix = image->matrix;
 	cairo_matrix_init_translate(&translate, allocation.x, allocation.y);
 	cairo_matrix_multiply(&matrix, &matrix, &translate);
@@ -156,6 +475,7 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 	cairo_paint(cr);
 
+out:
 	cairo_pop_group_to_source(cr);
 	cairo_paint(cr);
 	cairo_destroy(cr);
@@ -348,6 +668,7 @@ close_handler(void *data)
 	if (*image->image_counter == 0)
 		display_exit(image->display);
 
+	image_destroy_tiles(image);
 	widget_destroy(image->widget);
 	window_destroy(image->window);
 
@@ -355,9 +676,10 @@ close_handler(void *data)
 }
 
 static struct image *
-image_create(struct display *display, const char *filename,
+image_create(struct viewer *viewer, const char *filename,
 	     int *image_counter)
 {
+	struct display *display = viewer->display;
 	struct image *image;
 	char *b, *copy, title[512];
 
@@ -383,6 +705,8 @@ image_create(struct display *display, const char *filename,
 	image->widget = window_frame_create(image->window, image);
 	window_set_title(image->window, title);
 	image->display = display;
+	image->viewer = viewer;
+	wl_list_init(&image->tile_list);
 	image->image_counter = image_counter;
 	*image_counter += 1;
 	image->initialized = false;
@@ -405,9 +729,26 @@ image_create(struct display *display, const char *filename,
 	return image;
 }
 
+static void
+global_handler(struct display *display, uint32_t name,
+	       const char *interface, uint32_t version, void *data)
+{
+	struct viewer *viewer = data;
+
+	if (strcmp(interface, "wl_subcompositor") == 0)
+		viewer->subcompositor =
+			display_bind(display, name,
+				     &wl_subcompositor_interface, 1);
+	else if (strcmp(interface, "wp_viewporter") == 0)
+		viewer->viewporter =
+			display_bind(display, name,
+				     &wp_viewporter_interface, 1);
+}
+
 int
 main(int argc, char *argv[])
 {
+	struct viewer viewer = { 0 };
 	struct display *d;
 	int i;
 	int image_counter = 0;
@@ -423,12 +764,20 @@ main(int argc, char *argv[])
 		return -1;
 	}
 
+	viewer.display = d;
+	display_set_user_data(d, &viewer);
+	display_set_global_handler(d, global_handler);
+
 	for (i = 1; i < argc; i++)
-		image_create(d, argv[i], &image_counter);
+		image_create(&viewer, argv[i], &image_counter);
 
 	if (image_counter > 0)
 		display_run(d);
 
+	if (viewer.viewporter)
+		wp_viewporter_destroy(viewer.viewporter);
+	if (viewer.subcompositor)
+		wl_subcompositor_destroy(viewer.subcompositor);
 	display_destroy(d);
 
 	return 0;
@@ -46,12 +46,35 @@ enum run_mode {
 	RUN_MODE_FEEDBACK,
 	RUN_MODE_FEEDBACK_IDLE,
 	RUN_MODE_PRESENT,
+	RUN_MODE_FREE,
 };
 
 static const char * const run_mode_name[] = {
 	[RUN_MODE_FEEDBACK] = "feedback",
 	[RUN_MODE_FEEDBACK_IDLE] = "feedback-idle",
 	[RUN_MODE_PRESENT] = "low-lat present",
+	[RUN_MODE_FREE] = "free-running",
+};
+
+/* commit-to-present latency histogram: 1 ms buckets, last one overflow */
+#define HIST_BUCKETS 100
+#define HIST_BUCKET_USEC 1000
+
+struct stats {
+	unsigned commits;
+	unsigned presented;
+	unsigned discarded;
+	unsigned missed;
+
+	uint64_t c2p_sum;
+	int c2p_min;
+	int c2p_max;
+	unsigned hist[HIST_BUCKETS];
+
+	bool have_last;
+	uint64_t last_seq;
+	uint32_t last_flags;
+	struct timespec last_present;
 };
 
 struct output {
@@ -109,9 +132,20 @@ struct window {
 	struct wl_list feedback_list;
 
 	struct feedback *received_feedback;
+
+	unsigned frame_seq;
+	unsigned frame_limit;
+	bool print_frames;
+	bool done;
+	struct stats stats;
+	struct wl_list link;
 };
 
 #define NSEC_PER_SEC 1000000000
+#define MAX_BUFFER_BYTES (64 * 1024 * 1024)
+
+static int running = 1;
+static int windows_running;
 
 static void
 buffer_release(void *data, struct wl_buffer *buffer)
@@ -220,6 +254,7 @@ create_window(struct display *display, int width, int height,
 
 	window->commit_delay_msecs = commit_delay_msecs;
 	window->mode = mode;
+	window->stats.c2p_min = INT32_MAX;
 	window->callback = NULL;
 	wl_list_init(&window->feedback_list);
 	window->display = display;
@@ -237,7 +272,12 @@ create_window(struct display *display, int width, int height,
 
 	wl_shell_surface_set_toplevel(window->shell_surface);
 
-	window->num_buffers = 60;
+	/* 60 frames of animation, fewer for big surfaces */
+	window->num_buffers = MAX_BUFFER_BYTES / (width * height * 4);
+	if (window->num_buffers > 60)
+		window->num_buffers = 60;
+	if (window->num_buffers < 3)
+		window->num_buffers = 3;
 	window->refresh_nsec = NSEC_PER_SEC / 60; /* 60 Hz guess */
 	window->next = 0;
 	ret = create_shm_buffers(window->display,
@@ -268,7 +308,8 @@ destroy_window(struct window *window)
 		struct feedback *f;
 
 		f = wl_container_of(window->feedback_list.next, f, link);
-		printf("clean up feedback %u\n", f->frame_no);
+		if (window->print_frames)
+			printf("clean up feedback %u\n", f->frame_no);
 		destroy_feedback(f);
 	}
 
@@ -400,6 +441,68 @@ timespec_diff_to_usec(const struct timespec *a, const struct timespec *b)
 	return secs * 1000000 + nsec / 1000;
 }
 
+static void
+window_frame_done(struct window *window)
+{
+	struct stats *st = &window->stats;
+
+	if (window->done || !window->frame_limit ||
+	    st->presented + st->discarded < window->frame_limit)
+		return;
+
+	window->done = true;
+	if (--windows_running == 0)
+		running = 0;
+}
+
+static void
+stats_add_presented(struct stats *st, enum run_mode mode,
+		    const struct feedback *feedback, uint64_t seq,
+		    uint32_t refresh_nsec, uint32_t flags)
+{
+	int c2p = timespec_diff_to_usec(&feedback->present, &feedback->commit);
+	int bucket;
+	int64_t p2p, vblanks = 1;
+
+	st->presented++;
+	st->c2p_sum += c2p;
+	if (c2p < st->c2p_min)
+		st->c2p_min = c2p;
+	if (c2p > st->c2p_max)
+		st->c2p_max = c2p;
+
+	bucket = c2p / HIST_BUCKET_USEC;
+	if (bucket < 0)
+		bucket = 0;
+	if (bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	st->hist[bucket]++;
+
+	/* Every refresh between two presentations that did not show a new
+	 * frame is a miss.  Prefer the MSC when both presentations were
+	 * vsynced, otherwise estimate from the refresh period.  The idle
+	 * mode skips frames on purpose, so it does not count misses. */
+	if (st->have_last && mode != RUN_MODE_FEEDBACK_IDLE) {
+		if ((flags & st->last_flags &
+		     WP_PRESENTATION_FEEDBACK_KIND_VSYNC) &&
+		    seq > st->last_seq) {
+			vblanks = seq - st->last_seq;
+		} else if (refresh_nsec) {
+			p2p = (int64_t)timespec_diff_to_usec(&feedback->present,
+							     &st->last_present);
+			vblanks = (p2p * 1000 + refresh_nsec / 2) /
+				  refresh_nsec;
+		}
+		if (vblanks > 1)
+			st->missed += vblanks - 1;
+	}
+
+	st->have_last = true;
+	st->last_seq = seq;
+	st->last_flags = flags;
+	st->last_present = feedback->present;
+}
+
 static void
 feedback_presented(void *data,
 		   struct wp_presentation_feedback *presentation_feedback,
@@ -436,8 +539,18 @@ feedback_presented(void *data,
 	p2p = timespec_diff_to_usec(&feedback->present, prevpresent);
 	t2p = timespec_diff_to_usec(&feedback->present, &feedback->target);
 
+	if (refresh_nsec)
+		window->refresh_nsec = refresh_nsec;
+
+	if (!window->done)
+		stats_add_presented(&window->stats, window->mode, feedback,
+				    seq, refresh_nsec, flags);
+
 	switch (window->mode) {
 	case RUN_MODE_PRESENT:
+	case RUN_MODE_FREE:
+		if (!window->print_frames)
+			break;
 		printf("%6u: c2p %4u ms, p2p %5d us, t2p %6d us, [%s] "
 			"seq %" PRIu64 "\n", feedback->frame_no, c2p,
 			p2p, t2p,
@@ -445,6 +558,8 @@ feedback_presented(void *data,
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+		if (!window->print_frames)
+			break;
 		printf("%6u: f2c %2u ms, c2p %2u ms, f2p %2u ms, p2p %5d us, "
 			"t2p %6d, [%s], seq %" PRIu64 "\n", feedback->frame_no,
 			f2c, c2p, f2p, p2p, t2p,
@@ -454,6 +569,8 @@ feedback_presented(void *data,
 	if (window->received_feedback)
 		destroy_feedback(window->received_feedback);
 	window->received_feedback = feedback;
+
+	window_frame_done(window);
 }
 
 static void
@@ -461,10 +578,17 @@ feedback_discarded(void *data,
 		   struct wp_presentation_feedback *presentation_feedback)
 {
 	struct feedback *feedback = data;
+	struct window *window = feedback->window;
+
+	if (window->print_frames)
+		printf("discarded %u\n", feedback->frame_no);
 
-	printf("discarded %u\n", feedback->frame_no);
+	if (!window->done)
+		window->stats.discarded++;
 
 	destroy_feedback(feedback);
+
+	window_frame_done(window);
 }
 
 static const struct wp_presentation_feedback_listener feedback_listener = {
@@ -493,11 +617,10 @@ window_emulate_rendering(struct window *window)
 static void
 window_create_feedback(struct window *window, uint32_t frame_stamp)
 {
-	static unsigned seq;
 	struct wp_presentation *pres = window->display->presentation;
 	struct feedback *feedback;
 
-	seq++;
+	window->frame_seq++;
 
 	if (!pres)
 		return;
@@ -511,7 +634,7 @@ window_create_feedback(struct window *window, uint32_t frame_stamp)
 	wp_presentation_feedback_add_listener(feedback->feedback,
 					      &feedback_listener, feedback);
 
-	feedback->frame_no = seq;
+	feedback->frame_no = window->frame_seq;
 
 	clock_gettime(window->display->clk_id, &feedback->commit);
 	feedback->frame_stamp = frame_stamp;
@@ -532,6 +655,7 @@ window_commit_next(struct window *window)
 	wl_surface_damage(window->surface, 0, 0, window->width, window->height);
 	wl_surface_commit(window->surface);
 	buffer->busy = 1;
+	window->stats.commits++;
 }
 
 static const struct wl_callback_listener frame_listener_mode_feedback;
@@ -561,6 +685,34 @@ static const struct wl_callback_listener frame_listener_mode_feedback = {
 	redraw_mode_feedback
 };
 
+static const struct wl_callback_listener frame_listener_mode_free;
+
+/* Commit as fast as the connection allows: every round trip that finds
+ * a free buffer produces a new commit, whatever the refresh rate. */
+static void
+redraw_mode_free(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct window *window = data;
+
+	if (callback)
+		wl_callback_destroy(callback);
+
+	window->callback = wl_display_sync(window->display->display);
+	wl_callback_add_listener(window->callback,
+				 &frame_listener_mode_free, window);
+
+	if (window->buffers[window->next].busy)
+		return;
+
+	window_emulate_rendering(window);
+	window_create_feedback(window, 0);
+	window_commit_next(window);
+}
+
+static const struct wl_callback_listener frame_listener_mode_free = {
+	redraw_mode_free
+};
+
 static const struct wp_presentation_feedback_listener feedkick_listener;
 
 static void
@@ -599,6 +751,7 @@ feedkick_presented(void *data,
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_FREE:
 		assert(0 && "bad mode");
 	}
 }
@@ -620,6 +773,7 @@ feedkick_discarded(void *data,
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_FREE:
 		assert(0 && "bad mode");
 	}
 }
@@ -641,6 +795,7 @@ firstdraw_mode_burst(struct window *window)
 		break;
 	case RUN_MODE_FEEDBACK:
 	case RUN_MODE_FEEDBACK_IDLE:
+	case RUN_MODE_FREE:
 		assert(0 && "bad mode");
 	}
 
@@ -824,7 +979,137 @@ destroy_display(struct display *display)
 	free(display);
 }
 
-static int running = 1;
+static int
+stats_c2p_min(const struct stats *st)
+{
+	return st->presented ? st->c2p_min : 0;
+}
+
+static int
+stats_c2p_mean(const struct stats *st)
+{
+	return st->presented ? (int)(st->c2p_sum / st->presented) : 0;
+}
+
+/* Upper edge, in ms, of the histogram bucket holding the percentile. */
+static int
+stats_percentile_ms(const struct stats *st, unsigned pct)
+{
+	unsigned target = (st->presented * pct + 99) / 100;
+	unsigned sum = 0;
+	int i;
+
+	if (!st->presented)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += st->hist[i];
+		if (sum >= target)
+			break;
+	}
+
+	return (i + 1) * HIST_BUCKET_USEC / 1000;
+}
+
+static int
+stats_hist_length(const struct stats *st)
+{
+	int n = HIST_BUCKETS;
+
+	while (n > 0 && st->hist[n - 1] == 0)
+		n--;
+
+	return n;
+}
+
+static void
+window_print_summary(struct window *window, int index)
+{
+	const struct stats *st = &window->stats;
+	unsigned peak = 0;
+	int i, n, bar;
+
+	printf("window %d: %dx%d, %s, delay %d ms, refresh %d us\n",
+	       index, window->width, window->height,
+	       run_mode_name[window->mode], window->commit_delay_msecs,
+	       window->refresh_nsec / 1000);
+	printf("  commits %u, presented %u, discarded %u, missed %u\n",
+	       st->commits, st->presented, st->discarded, st->missed);
+
+	if (!st->presented)
+		return;
+
+	printf("  c2p min %d us, mean %d us, max %d us, "
+	       "p50 %d ms, p90 %d ms, p99 %d ms\n",
+	       stats_c2p_min(st), stats_c2p_mean(st), st->c2p_max,
+	       stats_percentile_ms(st, 50), stats_percentile_ms(st, 90),
+	       stats_percentile_ms(st, 99));
+
+	n = stats_hist_length(st);
+	for (i = 0; i < n; i++)
+		if (st->hist[i] > peak)
+			peak = st->hist[i];
+
+	for (i = 0; i < n; i++) {
+		bar = st->hist[i] * 50 / peak;
+		printf("  %3d ms%c %6u %.*s\n",
+		       i * HIST_BUCKET_USEC / 1000,
+		       i == HIST_BUCKETS - 1 ? '+' : ' ', st->hist[i], bar,
+		       "##################################################");
+	}
+}
+
+static void
+window_print_json(struct window *window)
+{
+	const struct stats *st = &window->stats;
+	int i, n;
+
+	printf("{\"width\": %d, \"height\": %d, \"refresh_nsec\": %d, "
+	       "\"commits\": %u, \"presented\": %u, \"discarded\": %u, "
+	       "\"missed\": %u, ",
+	       window->width, window->height, window->refresh_nsec,
+	       st->commits, st->presented, st->discarded, st->missed);
+	printf("\"c2p_usec\": {\"min\": %d, \"mean\": %d, \"max\": %d}, ",
+	       stats_c2p_min(st), stats_c2p_mean(st), st->c2p_max);
+	printf("\"c2p_msec_percentile\": {\"50\": %d, \"90\": %d, "
+	       "\"99\": %d}, ",
+	       stats_percentile_ms(st, 50), stats_percentile_ms(st, 90),
+	       stats_percentile_ms(st, 99));
+	printf("\"c2p_histogram\": {\"bucket_usec\": %d, \"counts\": [",
+	       HIST_BUCKET_USEC);
+
+	n = stats_hist_length(st);
+	for (i = 0; i < n; i++)
+		printf("%s%u", i ? ", " : "", st->hist[i]);
+
+	printf("]}}");
+}
+
+static void
+print_summary(struct display *display, struct wl_list *window_list,
+	      bool json)
+{
+	struct window *window;
+	int i = 0;
+
+	if (!json) {
+		wl_list_for_each(window, window_list, link)
+			window_print_summary(window, i++);
+		return;
+	}
+
+	printf("{\"clock_id\": %d, \"windows\": [", (int)display->clk_id);
+	wl_list_for_each(window, window_list, link) {
+		printf("%s\n  {\"mode\": \"%s\", \"commit_delay_msec\": %d, ",
+		       i++ ? "," : "", run_mode_name[window->mode],
+		       window->commit_delay_msecs);
+		printf("\"stats\": ");
+		window_print_json(window);
+		printf("}");
+	}
+	printf("\n]}\n");
+}
 
 static void
 signal_int(int signum)
@@ -840,9 +1125,15 @@ usage(const char *prog, int exit_code)
 		"  -f\t\trun in feedback mode (default)\n"
 		"  -i\t\trun in feedback-idle mode; sleep 1s between frames\n"
 		"  -p\t\trun in low-latency presentation mode\n"
+		"  -r\t\trun free, committing on every round trip\n"
 		"and 'options' may include\n"
 		"  -d msecs\temulate the time used for rendering by a delay \n"
-		"\t\tof the given milliseconds before commit\n\n",
+		"\t\tof the given milliseconds before commit\n"
+		"  -n count\tnumber of surfaces to run (default 1)\n"
+		"  -s WxH\tsurface size (default 250x250)\n"
+		"  -c frames\tstop after this many frames per surface\n"
+		"  -q\t\tdo not print per-frame statistics\n"
+		"  -j\t\tprint the summary as JSON, implies -q\n\n",
 		prog);
 
 	fprintf(stderr, "Printed timing statistics, depending on mode:\n"
@@ -852,7 +1143,9 @@ usage(const char *prog, int exit_code)
 		"  f2p: time from frame callback timestamp to presentation\n"
 		"  p2p: time from previous presentation to this one\n"
 		"  t2p: time from target timestamp to presentation\n"
-		"  seq: MSC\n");
+		"  seq: MSC\n"
+		"On exit a summary per surface lists commits, presented,\n"
+		"discarded and missed frames, and a histogram of c2p.\n");
 
 
 	exit(exit_code);
@@ -863,11 +1156,17 @@ main(int argc, char **argv)
 {
 	struct sigaction sigint;
 	struct display *display;
-	struct window *window;
+	struct window *window, *tmp;
+	struct wl_list window_list;
 	int ret = 0;
 	enum run_mode mode = RUN_MODE_FEEDBACK;
 	int i;
 	int commit_delay_msecs = 0;
+	int num_windows = 1;
+	int width = 250, height = 250;
+	int frame_limit = 0;
+	bool print_frames = true;
+	bool json = false;
 
 	for (i = 1; i < argc; i++) {
 		if (strcmp("-f", argv[i]) == 0)
@@ -876,41 +1175,83 @@ main(int argc, char **argv)
 			mode = RUN_MODE_FEEDBACK_IDLE;
 		else if (strcmp("-p", argv[i]) == 0)
 			mode = RUN_MODE_PRESENT;
+		else if (strcmp("-r", argv[i]) == 0)
+			mode = RUN_MODE_FREE;
+		else if (strcmp("-q", argv[i]) == 0)
+			print_frames = false;
+		else if (strcmp("-j", argv[i]) == 0) {
+			print_frames = false;
+			json = true;
+		}
 		else if ((strcmp("-d", argv[i]) == 0) && (i + 1 < argc)) {
 			i++;
 			commit_delay_msecs = atoi(argv[i]);
 		}
+		else if ((strcmp("-n", argv[i]) == 0) && (i + 1 < argc)) {
+			i++;
+			num_windows = atoi(argv[i]);
+		}
+		else if ((strcmp("-c", argv[i]) == 0) && (i + 1 < argc)) {
+			i++;
+			frame_limit = atoi(argv[i]);
+		}
+		else if ((strcmp("-s", argv[i]) == 0) && (i + 1 < argc)) {
+			i++;
+			if (sscanf(argv[i], "%dx%d", &width, &height) != 2)
+				usage(argv[0], EXIT_FAILURE);
+		}
 		else
 			usage(argv[0], EXIT_FAILURE);
 	}
 
+	if (num_windows < 1 || width < 1 || height < 1 || frame_limit < 0)
+		usage(argv[0], EXIT_FAILURE);
+
 	display = create_display();
-	window = create_window(display, 250, 250, mode, commit_delay_msecs);
-	if (!window)
-		return 1;
+
+	wl_list_init(&window_list);
+	for (i = 0; i < num_windows; i++) {
+		window = create_window(display, width, height, mode,
+				       commit_delay_msecs);
+		if (!window)
+			return 1;
+
+		window->frame_limit = frame_limit;
+		window->print_frames = print_frames;
+		wl_list_insert(window_list.prev, &window->link);
+	}
+	windows_running = num_windows;
 
 	sigint.sa_handler = signal_int;
 	sigemptyset(&sigint.sa_mask);
 	sigint.sa_flags = SA_RESETHAND;
 	sigaction(SIGINT, &sigint, NULL);
 
-	window_prerender(window);
-
-	switch (mode) {
-	case RUN_MODE_FEEDBACK:
-	case RUN_MODE_FEEDBACK_IDLE:
-		redraw_mode_feedback(window, NULL, 0);
-		break;
-	case RUN_MODE_PRESENT:
-		firstdraw_mode_burst(window);
-		break;
+	wl_list_for_each(window, &window_list, link) {
+		window_prerender(window);
+
+		switch (mode) {
+		case RUN_MODE_FEEDBACK:
+		case RUN_MODE_FEEDBACK_IDLE:
+			redraw_mode_feedback(window, NULL, 0);
+			break;
+		case RUN_MODE_PRESENT:
+			firstdraw_mode_burst(window);
+			break;
+		case RUN_MODE_FREE:
+			redraw_mode_free(window, NULL, 0);
+			break;
+		}
 	}
 
 	while (running && ret != -1)
 		ret = wl_display_dispatch(display->display);
 
 	fprintf(stderr, "presentation-shm exiting\n");
-	destroy_window(window);
+	print_summary(display, &window_list, json);
+
+	wl_list_for_each_safe(window, tmp, &window_list, link)
+		destroy_window(window);
 	destroy_display(display);
 
 	return 0;
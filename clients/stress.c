@@ -0,0 +1,1494 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <wayland-client.h>
+#include <wayland-egl.h>
+
+#include <GLES2/gl2.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+#include "shared/config-parser.h"
+#include "shared/os-compatibility.h"
+#include "shared/platform.h"
+#include "shared/timespec-util.h"
+#include "weston-egl-ext.h"
+#include "xdg-shell-unstable-v6-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+
+enum surface_kind {
+	SURFACE_SHM,
+	SURFACE_EGL,
+};
+
+enum damage_pattern {
+	DAMAGE_FULL,
+	DAMAGE_BOX,
+	DAMAGE_STRIPE,
+	DAMAGE_NONE,
+};
+
+static const char * const damage_pattern_name[] = {
+	[DAMAGE_FULL] = "full",
+	[DAMAGE_BOX] = "box",
+	[DAMAGE_STRIPE] = "stripe",
+	[DAMAGE_NONE] = "none",
+};
+
+#define NUM_BUFFERS 3
+#define WARMUP_MSEC 1000
+#define DRAIN_MSEC 200
+
+/* commit-to-present latency histogram: 250 us buckets, last one overflow */
+#define HIST_BUCKETS 400
+#define HIST_BUCKET_USEC 250
+
+struct stats {
+	unsigned commits;
+	/* Commits skipped because every SHM buffer was still busy */
+	unsigned stalled;
+	unsigned presented;
+	unsigned discarded;
+	/* Refreshes a surface should have been updated in, and was not */
+	unsigned missed;
+
+	int64_t c2p_max;
+	unsigned hist[HIST_BUCKETS];
+	int64_t measured_nsec;
+};
+
+struct stress {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *compositor;
+	uint32_t compositor_version;
+	struct wl_subcompositor *subcompositor;
+	struct zxdg_shell_v6 *shell;
+	struct wl_shm *shm;
+	struct wp_presentation *presentation;
+	clockid_t clk_id;
+
+	struct {
+		EGLDisplay dpy;
+		EGLContext ctx;
+		EGLConfig conf;
+		PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+	} egl;
+
+	/* The configuration, from the command line */
+	int total, total_egl;
+	int min_width, min_height, max_width, max_height;
+	enum damage_pattern damage;
+	int transform; /* -1 for a random one per surface */
+	int opacity;
+	int depth;
+	int64_t period_nsec; /* 0 for commits driven by frame callbacks */
+
+	struct wl_list surface_list; /* struct surface::link, top-levels */
+	int shm_count, egl_count;
+
+	bool measuring;
+	struct stats stats;
+	FILE *log;
+};
+
+struct buffer {
+	struct surface *surface;
+	struct wl_buffer *buffer;
+	void *data;
+	bool busy;
+};
+
+struct feedback {
+	struct surface *surface;
+	struct wp_presentation_feedback *feedback;
+	uint32_t frame_no;
+	bool measured;
+	struct timespec commit;
+	struct wl_list link;
+};
+
+struct rect {
+	int x, y, width, height;
+};
+
+struct surface {
+	struct stress *stress;
+	enum surface_kind kind;
+	int index;
+	int width, height;
+	int buffer_width, buffer_height;
+	uint32_t transform;
+
+	struct wl_surface *surface;
+	struct zxdg_surface_v6 *xdg_surface;
+	struct zxdg_toplevel_v6 *xdg_toplevel;
+	struct wl_subsurface *subsurface;
+	/* The next sub-surface down the stack, or NULL */
+	struct surface *child;
+	bool configured;
+
+	struct buffer buffers[NUM_BUFFERS];
+	void *shm_data;
+	size_t shm_size;
+
+	struct wl_egl_window *native;
+	EGLSurface egl_surface;
+
+	struct wl_callback *frame;
+	bool frame_done;
+	bool stalled;
+	struct timespec next_commit;
+	uint32_t frame_no;
+
+	bool have_last;
+	uint64_t last_seq;
+	uint32_t last_flags;
+	struct timespec last_present;
+
+	struct wl_list feedback_list;
+	struct wl_list link;
+};
+
+static int running = 1;
+
+static void
+buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct buffer *buffer = data;
+
+	buffer->busy = false;
+	buffer->surface->stalled = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release
+};
+
+static int
+surface_create_shm_buffers(struct surface *surface)
+{
+	struct stress *stress = surface->stress;
+	struct wl_shm_pool *pool;
+	uint32_t format;
+	int fd, stride, i;
+
+	stride = surface->buffer_width * 4;
+	surface->shm_size = (size_t)stride * surface->buffer_height *
+			    NUM_BUFFERS;
+
+	fd = os_create_anonymous_file(surface->shm_size);
+	if (fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %m\n",
+			surface->shm_size);
+		return -1;
+	}
+
+	surface->shm_data = mmap(NULL, surface->shm_size,
+				 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (surface->shm_data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %m\n");
+		surface->shm_data = NULL;
+		close(fd);
+		return -1;
+	}
+
+	if (stress->opacity < 255)
+		format = WL_SHM_FORMAT_ARGB8888;
+	else
+		format = WL_SHM_FORMAT_XRGB8888;
+
+	pool = wl_shm_create_pool(stress->shm, fd, surface->shm_size);
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		struct buffer *buffer = &surface->buffers[i];
+		int offset = i * stride * surface->buffer_height;
+
+		buffer->surface = surface;
+		buffer->data = (char *)surface->shm_data + offset;
+		buffer->buffer =
+			wl_shm_pool_create_buffer(pool, offset,
+						  surface->buffer_width,
+						  surface->buffer_height,
+						  stride, format);
+		wl_buffer_add_listener(buffer->buffer, &buffer_listener,
+				       buffer);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	return 0;
+}
+
+/* The damage of the next frame, in buffer coordinates */
+static void
+surface_next_damage(struct surface *surface, struct rect *r)
+{
+	int bw = surface->buffer_width;
+	int bh = surface->buffer_height;
+	uint32_t f = surface->frame_no;
+
+	r->x = 0;
+	r->y = 0;
+	r->width = bw;
+	r->height = bh;
+
+	if (f == 0)
+		return;
+
+	switch (surface->stress->damage) {
+	case DAMAGE_BOX:
+		r->width = MAX(bw / 4, 1);
+		r->height = MAX(bh / 4, 1);
+		r->x = (f * 4) % (bw - r->width + 1);
+		r->y = (f * 4) % (bh - r->height + 1);
+		break;
+	case DAMAGE_STRIPE:
+		r->height = MAX(bh / 16, 1);
+		r->y = (f * r->height) % (bh - r->height + 1);
+		break;
+	case DAMAGE_FULL:
+	case DAMAGE_NONE:
+		break;
+	}
+}
+
+/* A color that changes every frame, premultiplied by the opacity */
+static uint32_t
+surface_next_color(struct surface *surface)
+{
+	uint32_t a = surface->stress->opacity;
+	uint32_t r = (surface->frame_no * 7 + surface->index * 40) & 0xff;
+	uint32_t g = (surface->frame_no * 3) & 0xff;
+	uint32_t b = (surface->index * 97 + 64) & 0xff;
+
+	return a << 24 | (r * a / 255) << 16 | (g * a / 255) << 8 |
+	       (b * a / 255);
+}
+
+static bool
+surface_skip_frame(struct surface *surface)
+{
+	return surface->stress->damage == DAMAGE_NONE && surface->frame_no > 0;
+}
+
+/* Paints and attaches the next SHM buffer, without committing. Returns
+ * false if no buffer is free. */
+static bool
+surface_attach_shm(struct surface *surface)
+{
+	struct buffer *buffer = NULL;
+	struct rect r;
+	uint32_t color, *row;
+	int stride = surface->buffer_width;
+	int i, x, y;
+
+	if (surface_skip_frame(surface))
+		return true;
+
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		if (!surface->buffers[i].busy) {
+			buffer = &surface->buffers[i];
+			break;
+		}
+	}
+	if (!buffer)
+		return false;
+
+	surface_next_damage(surface, &r);
+	color = surface_next_color(surface);
+
+	for (y = r.y; y < r.y + r.height; y++) {
+		row = (uint32_t *)buffer->data + y * stride;
+		for (x = r.x; x < r.x + r.width; x++)
+			row[x] = color;
+	}
+
+	wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
+	if (surface->stress->compositor_version >= 4)
+		wl_surface_damage_buffer(surface->surface,
+					 r.x, r.y, r.width, r.height);
+	else
+		wl_surface_damage(surface->surface, 0, 0,
+				  surface->width, surface->height);
+	buffer->busy = true;
+	surface->frame_no++;
+
+	return true;
+}
+
+/* Paints and swaps the EGL surface, which also commits it. Without
+ * EGL_EXT_buffer_age the contents outside the damage are stale, which
+ * is fine as nobody looks at them. */
+static void
+surface_swap_egl(struct surface *surface)
+{
+	struct stress *stress = surface->stress;
+	int bh = surface->buffer_height;
+	uint32_t color;
+	EGLint rect[4];
+	struct rect r;
+	bool partial;
+
+	if (surface_skip_frame(surface)) {
+		wl_surface_commit(surface->surface);
+		return;
+	}
+
+	surface_next_damage(surface, &r);
+	color = surface_next_color(surface);
+	partial = stress->egl.swap_buffers_with_damage &&
+		  (r.width != surface->buffer_width || r.height != bh);
+
+	eglMakeCurrent(stress->egl.dpy, surface->egl_surface,
+		       surface->egl_surface, stress->egl.ctx);
+	glViewport(0, 0, surface->buffer_width, bh);
+
+	/* GL and EGL damage have the origin at the bottom left */
+	rect[0] = r.x;
+	rect[1] = bh - r.y - r.height;
+	rect[2] = r.width;
+	rect[3] = r.height;
+
+	if (partial) {
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(rect[0], rect[1], rect[2], rect[3]);
+	}
+	glClearColor(((color >> 16) & 0xff) / 255.0f,
+		     ((color >> 8) & 0xff) / 255.0f,
+		     (color & 0xff) / 255.0f,
+		     (color >> 24) / 255.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+
+	if (partial)
+		stress->egl.swap_buffers_with_damage(stress->egl.dpy,
+						     surface->egl_surface,
+						     rect, 1);
+	else
+		eglSwapBuffers(stress->egl.dpy, surface->egl_surface);
+
+	surface->frame_no++;
+}
+
+static void
+feedback_destroy(struct feedback *feedback)
+{
+	wp_presentation_feedback_destroy(feedback->feedback);
+	wl_list_remove(&feedback->link);
+	free(feedback);
+}
+
+static void
+feedback_sync_output(void *data,
+		     struct wp_presentation_feedback *presentation_feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+timespec_from_proto(struct timespec *tm, uint32_t tv_sec_hi,
+		    uint32_t tv_sec_lo, uint32_t tv_nsec)
+{
+	tm->tv_sec = ((uint64_t)tv_sec_hi << 32) + tv_sec_lo;
+	tm->tv_nsec = tv_nsec;
+}
+
+/* Counts the refreshes between this presentation of the surface and the
+ * previous one that should have shown a new frame, but did not. With a
+ * fixed commit rate below the refresh rate, a new frame is only expected
+ * every so many refreshes. */
+static unsigned
+surface_count_missed(struct surface *surface, const struct timespec *present,
+		     uint64_t seq, uint32_t refresh_nsec, uint32_t flags)
+{
+	int64_t period = surface->stress->period_nsec;
+	int64_t vblanks, expected = 1;
+
+	if (!surface->have_last)
+		return 0;
+
+	if ((flags & surface->last_flags &
+	     WP_PRESENTATION_FEEDBACK_KIND_VSYNC) && seq > surface->last_seq)
+		vblanks = seq - surface->last_seq;
+	else if (refresh_nsec)
+		vblanks = (timespec_sub_to_nsec(present,
+						&surface->last_present) +
+			   refresh_nsec / 2) / refresh_nsec;
+	else
+		return 0;
+
+	if (period && refresh_nsec)
+		expected = MAX((period + refresh_nsec / 2) / refresh_nsec, 1);
+
+	return vblanks > expected ? vblanks - expected : 0;
+}
+
+static void
+stats_add_c2p(struct stats *stats, int64_t c2p_nsec)
+{
+	int bucket = c2p_nsec / 1000 / HIST_BUCKET_USEC;
+
+	if (bucket < 0)
+		bucket = 0;
+	if (bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	stats->hist[bucket]++;
+
+	if (c2p_nsec > stats->c2p_max)
+		stats->c2p_max = c2p_nsec;
+}
+
+static void
+feedback_presented(void *data,
+		   struct wp_presentation_feedback *presentation_feedback,
+		   uint32_t tv_sec_hi,
+		   uint32_t tv_sec_lo,
+		   uint32_t tv_nsec,
+		   uint32_t refresh_nsec,
+		   uint32_t seq_hi,
+		   uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct feedback *feedback = data;
+	struct surface *surface = feedback->surface;
+	struct stress *stress = surface->stress;
+	uint64_t seq = ((uint64_t)seq_hi << 32) + seq_lo;
+	struct timespec present;
+	int64_t c2p;
+	unsigned missed;
+
+	timespec_from_proto(&present, tv_sec_hi, tv_sec_lo, tv_nsec);
+	c2p = timespec_sub_to_nsec(&present, &feedback->commit);
+	missed = surface_count_missed(surface, &present, seq, refresh_nsec,
+				      flags);
+
+	surface->have_last = true;
+	surface->last_seq = seq;
+	surface->last_flags = flags;
+	surface->last_present = present;
+
+	if (feedback->measured) {
+		stress->stats.presented++;
+		stress->stats.missed += missed;
+		stats_add_c2p(&stress->stats, c2p);
+	}
+
+	if (stress->log)
+		fprintf(stress->log, "%d %s %u %" PRId64 " %" PRId64
+			" %u %" PRIu64 " 0x%x\n", surface->index,
+			surface->kind == SURFACE_EGL ? "egl" : "shm",
+			feedback->frame_no,
+			timespec_to_nsec(&feedback->commit),
+			timespec_to_nsec(&present), refresh_nsec, seq, flags);
+
+	feedback_destroy(feedback);
+}
+
+static void
+feedback_discarded(void *data,
+		   struct wp_presentation_feedback *presentation_feedback)
+{
+	struct feedback *feedback = data;
+	struct surface *surface = feedback->surface;
+	struct stress *stress = surface->stress;
+
+	if (feedback->measured)
+		stress->stats.discarded++;
+
+	if (stress->log)
+		fprintf(stress->log, "%d %s %u %" PRId64 " discarded\n",
+			surface->index,
+			surface->kind == SURFACE_EGL ? "egl" : "shm",
+			feedback->frame_no,
+			timespec_to_nsec(&feedback->commit));
+
+	feedback_destroy(feedback);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+static void
+surface_create_feedback(struct surface *surface)
+{
+	struct stress *stress = surface->stress;
+	struct feedback *feedback;
+
+	if (!stress->presentation)
+		return;
+
+	feedback = zalloc(sizeof *feedback);
+	if (!feedback)
+		return;
+
+	feedback->surface = surface;
+	feedback->frame_no = surface->frame_no;
+	feedback->measured = stress->measuring;
+	feedback->feedback = wp_presentation_feedback(stress->presentation,
+						      surface->surface);
+	wp_presentation_feedback_add_listener(feedback->feedback,
+					      &feedback_listener, feedback);
+	clock_gettime(stress->clk_id, &feedback->commit);
+	wl_list_insert(&surface->feedback_list, &feedback->link);
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct surface *surface = data;
+
+	wl_callback_destroy(callback);
+	surface->frame = NULL;
+	surface->frame_done = true;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+/* Draws and commits a top-level surface and its sub-surfaces. */
+static void
+surface_redraw(struct surface *surface)
+{
+	struct stress *stress = surface->stress;
+	struct surface *child;
+
+	if (surface->kind == SURFACE_SHM && !surface_attach_shm(surface)) {
+		surface->stalled = true;
+		if (stress->measuring)
+			stress->stats.stalled++;
+		return;
+	}
+
+	/* Desynchronized, so each one updates on its own commit */
+	for (child = surface->child; child; child = child->child) {
+		if (surface_attach_shm(child))
+			wl_surface_commit(child->surface);
+		else if (stress->measuring)
+			stress->stats.stalled++;
+	}
+
+	if (stress->period_nsec == 0) {
+		surface->frame = wl_surface_frame(surface->surface);
+		wl_callback_add_listener(surface->frame, &frame_listener,
+					 surface);
+		surface->frame_done = false;
+	}
+
+	surface_create_feedback(surface);
+
+	if (surface->kind == SURFACE_SHM)
+		wl_surface_commit(surface->surface);
+	else
+		surface_swap_egl(surface);
+
+	if (stress->measuring)
+		stress->stats.commits++;
+}
+
+static void
+handle_surface_configure(void *data, struct zxdg_surface_v6 *xdg_surface,
+			 uint32_t serial)
+{
+	struct surface *surface = data;
+
+	zxdg_surface_v6_ack_configure(xdg_surface, serial);
+	surface->configured = true;
+}
+
+static const struct zxdg_surface_v6_listener xdg_surface_listener = {
+	handle_surface_configure
+};
+
+static void
+handle_toplevel_configure(void *data, struct zxdg_toplevel_v6 *toplevel,
+			  int32_t width, int32_t height,
+			  struct wl_array *states)
+{
+	/* The sizes are fixed by the command line */
+}
+
+static void
+handle_toplevel_close(void *data, struct zxdg_toplevel_v6 *xdg_toplevel)
+{
+}
+
+static const struct zxdg_toplevel_v6_listener xdg_toplevel_listener = {
+	handle_toplevel_configure,
+	handle_toplevel_close,
+};
+
+static void
+surface_destroy(struct surface *surface)
+{
+	struct feedback *feedback, *tmp;
+	int i;
+
+	if (surface->child)
+		surface_destroy(surface->child);
+
+	wl_list_for_each_safe(feedback, tmp, &surface->feedback_list, link)
+		feedback_destroy(feedback);
+
+	if (surface->frame)
+		wl_callback_destroy(surface->frame);
+
+	if (surface->egl_surface) {
+		eglMakeCurrent(surface->stress->egl.dpy, EGL_NO_SURFACE,
+			       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		weston_platform_destroy_egl_surface(surface->stress->egl.dpy,
+						    surface->egl_surface);
+	}
+	if (surface->native)
+		wl_egl_window_destroy(surface->native);
+
+	for (i = 0; i < NUM_BUFFERS; i++)
+		if (surface->buffers[i].buffer)
+			wl_buffer_destroy(surface->buffers[i].buffer);
+	if (surface->shm_data)
+		munmap(surface->shm_data, surface->shm_size);
+
+	if (surface->subsurface)
+		wl_subsurface_destroy(surface->subsurface);
+	if (surface->xdg_toplevel)
+		zxdg_toplevel_v6_destroy(surface->xdg_toplevel);
+	if (surface->xdg_surface)
+		zxdg_surface_v6_destroy(surface->xdg_surface);
+	wl_surface_destroy(surface->surface);
+
+	free(surface);
+}
+
+static struct surface *
+surface_create(struct stress *stress, enum surface_kind kind, int index,
+	       int width, int height, uint32_t transform,
+	       struct surface *parent)
+{
+	struct surface *surface;
+	struct wl_region *region;
+	char title[64];
+
+	surface = zalloc(sizeof *surface);
+	if (!surface)
+		return NULL;
+
+	surface->stress = stress;
+	surface->kind = kind;
+	surface->index = index;
+	surface->width = width;
+	surface->height = height;
+	surface->transform = transform;
+	surface->frame_done = true;
+	wl_list_init(&surface->feedback_list);
+
+	/* 90 and 270 degree transforms, flipped or not, swap the axes */
+	if (transform & 1) {
+		surface->buffer_width = height;
+		surface->buffer_height = width;
+	} else {
+		surface->buffer_width = width;
+		surface->buffer_height = height;
+	}
+
+	surface->surface = wl_compositor_create_surface(stress->compositor);
+	if (transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		wl_surface_set_buffer_transform(surface->surface, transform);
+
+	if (stress->opacity == 255) {
+		region = wl_compositor_create_region(stress->compositor);
+		wl_region_add(region, 0, 0, width, height);
+		wl_surface_set_opaque_region(surface->surface, region);
+		wl_region_destroy(region);
+	}
+
+	if (parent) {
+		surface->subsurface =
+			wl_subcompositor_get_subsurface(stress->subcompositor,
+							surface->surface,
+							parent->surface);
+		wl_subsurface_set_position(surface->subsurface,
+					   parent->width / 8,
+					   parent->height / 8);
+		wl_subsurface_set_desync(surface->subsurface);
+		surface->configured = true;
+	} else {
+		surface->xdg_surface =
+			zxdg_shell_v6_get_xdg_surface(stress->shell,
+						      surface->surface);
+		zxdg_surface_v6_add_listener(surface->xdg_surface,
+					     &xdg_surface_listener, surface);
+		surface->xdg_toplevel =
+			zxdg_surface_v6_get_toplevel(surface->xdg_surface);
+		zxdg_toplevel_v6_add_listener(surface->xdg_toplevel,
+					      &xdg_toplevel_listener, surface);
+		snprintf(title, sizeof title, "weston-stress %d %s", index,
+			 kind == SURFACE_EGL ? "egl" : "shm");
+		zxdg_toplevel_v6_set_title(surface->xdg_toplevel, title);
+		wl_surface_commit(surface->surface);
+	}
+
+	if (kind == SURFACE_SHM) {
+		if (surface_create_shm_buffers(surface) < 0)
+			goto err;
+		return surface;
+	}
+
+	surface->native = wl_egl_window_create(surface->surface,
+					       surface->buffer_width,
+					       surface->buffer_height);
+	surface->egl_surface =
+		weston_platform_create_egl_surface(stress->egl.dpy,
+						   stress->egl.conf,
+						   surface->native, NULL);
+	if (surface->egl_surface == EGL_NO_SURFACE) {
+		fprintf(stderr, "failed to create an EGL surface\n");
+		goto err;
+	}
+
+	/* The frame callbacks or the commit rate pace the swaps */
+	eglMakeCurrent(stress->egl.dpy, surface->egl_surface,
+		       surface->egl_surface, stress->egl.ctx);
+	eglSwapInterval(stress->egl.dpy, 0);
+
+	return surface;
+
+err:
+	surface_destroy(surface);
+	return NULL;
+}
+
+static int
+random_between(int min, int max)
+{
+	return min + rand() % (max - min + 1);
+}
+
+/* Adds a top-level surface with its stack of sub-surfaces. EGL surfaces
+ * are spread evenly among the SHM ones. */
+static int
+stress_add_surface(struct stress *stress)
+{
+	int index = stress->shm_count + stress->egl_count;
+	struct surface *surface, *parent;
+	enum surface_kind kind;
+	int width, height, i;
+	uint32_t transform;
+
+	if ((index + 1) * stress->total_egl / stress->total !=
+	    index * stress->total_egl / stress->total)
+		kind = SURFACE_EGL;
+	else
+		kind = SURFACE_SHM;
+
+	width = random_between(stress->min_width, stress->max_width);
+	height = random_between(stress->min_height, stress->max_height);
+	if (stress->transform < 0)
+		transform = rand() % 8;
+	else
+		transform = stress->transform;
+
+	surface = surface_create(stress, kind, index, width, height,
+				 transform, NULL);
+	if (!surface)
+		return -1;
+
+	parent = surface;
+	for (i = 0; i < stress->depth; i++) {
+		width = MAX(parent->width * 3 / 4, 1);
+		height = MAX(parent->height * 3 / 4, 1);
+		parent->child = surface_create(stress, SURFACE_SHM, index,
+					       width, height, transform,
+					       parent);
+		if (!parent->child) {
+			surface_destroy(surface);
+			return -1;
+		}
+		parent = parent->child;
+	}
+
+	wl_list_insert(stress->surface_list.prev, &surface->link);
+	if (kind == SURFACE_EGL)
+		stress->egl_count++;
+	else
+		stress->shm_count++;
+
+	return 0;
+}
+
+/* Redraws the surfaces that are due, and returns the milliseconds until
+ * the next one is, or -1 when only events can make one due. */
+static int
+stress_tick(struct stress *stress, const struct timespec *now)
+{
+	struct surface *surface;
+	int64_t wait, next = -1;
+
+	wl_list_for_each(surface, &stress->surface_list, link) {
+		if (!surface->configured)
+			continue;
+
+		if (stress->period_nsec == 0) {
+			if (surface->frame_done && !surface->stalled)
+				surface_redraw(surface);
+			continue;
+		}
+
+		if (timespec_sub_to_nsec(&surface->next_commit, now) <= 0) {
+			surface_redraw(surface);
+			timespec_add_nsec(&surface->next_commit,
+					  &surface->next_commit,
+					  stress->period_nsec);
+			/* Fell behind: do not try to catch up */
+			if (timespec_sub_to_nsec(&surface->next_commit,
+						 now) <= 0)
+				timespec_add_nsec(&surface->next_commit, now,
+						  stress->period_nsec);
+		}
+
+		wait = timespec_sub_to_nsec(&surface->next_commit, now);
+		if (next < 0 || wait < next)
+			next = wait;
+	}
+
+	if (next < 0)
+		return -1;
+
+	return (next + 999999) / 1000000;
+}
+
+static int
+stress_dispatch(struct stress *stress, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	while (wl_display_prepare_read(stress->display) != 0)
+		if (wl_display_dispatch_pending(stress->display) < 0)
+			return -1;
+
+	ret = wl_display_flush(stress->display);
+	if (ret < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(stress->display);
+		return -1;
+	}
+
+	pfd.fd = wl_display_get_fd(stress->display);
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, timeout);
+
+	if (ret > 0) {
+		if (wl_display_read_events(stress->display) < 0)
+			return -1;
+	} else {
+		wl_display_cancel_read(stress->display);
+	}
+
+	return wl_display_dispatch_pending(stress->display) < 0 ? -1 : 0;
+}
+
+/* Keeps all surfaces going for msec milliseconds, or until interrupted
+ * if msec is 0. */
+static int
+stress_run(struct stress *stress, int64_t msec)
+{
+	struct timespec now, end;
+	int64_t left;
+	int timeout;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec_add_msec(&end, &now, msec);
+
+	while (running) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = timespec_sub_to_msec(&end, &now);
+		if (msec && left <= 0)
+			break;
+
+		timeout = stress_tick(stress, &now);
+		if (msec && (timeout < 0 || timeout > left))
+			timeout = left;
+
+		if (stress_dispatch(stress, timeout) < 0) {
+			fprintf(stderr, "connection to the compositor lost\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+stress_run_phase(struct stress *stress, int64_t msec)
+{
+	struct timespec start, end;
+
+	if (stress_run(stress, WARMUP_MSEC) < 0)
+		return -1;
+
+	memset(&stress->stats, 0, sizeof stress->stats);
+	stress->measuring = true;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (stress_run(stress, msec) < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stress->stats.measured_nsec = timespec_sub_to_nsec(&end, &start);
+	stress->measuring = false;
+
+	if (!running)
+		return 0;
+
+	/* Let the feedback of the last measured commits arrive */
+	return stress_run(stress, DRAIN_MSEC);
+}
+
+/* Upper edge, in ms, of the histogram bucket holding the percentile. */
+static double
+stats_percentile_ms(const struct stats *stats, unsigned pct)
+{
+	unsigned target = (stats->presented * pct + 99) / 100;
+	unsigned sum = 0;
+	int i;
+
+	if (!stats->presented)
+		return 0.0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += stats->hist[i];
+		if (sum >= target)
+			break;
+	}
+
+	return (i + 1) * HIST_BUCKET_USEC / 1000.0;
+}
+
+static double
+stats_missed_percent(const struct stats *stats)
+{
+	unsigned expected = stats->presented + stats->missed;
+
+	return expected ? stats->missed * 100.0 / expected : 0.0;
+}
+
+static void
+stress_print_phase(struct stress *stress, bool json)
+{
+	const struct stats *st = &stress->stats;
+	double seconds = st->measured_nsec / 1e9;
+
+	if (json) {
+		printf("{\"surfaces\": %d, \"shm\": %d, \"egl\": %d, "
+		       "\"seconds\": %.2f, \"commits\": %u, \"stalled\": %u, "
+		       "\"presented\": %u, \"discarded\": %u, "
+		       "\"missed\": %u, \"missed_percent\": %.2f, ",
+		       stress->shm_count + stress->egl_count,
+		       stress->shm_count, stress->egl_count, seconds,
+		       st->commits, st->stalled, st->presented,
+		       st->discarded, st->missed, stats_missed_percent(st));
+		printf("\"c2p_msec\": {\"p50\": %.2f, \"p99\": %.2f, "
+		       "\"max\": %.2f}}\n",
+		       stats_percentile_ms(st, 50),
+		       stats_percentile_ms(st, 99), st->c2p_max / 1e6);
+		fflush(stdout);
+		return;
+	}
+
+	printf("%d surfaces (%d shm, %d egl), %.1f s: %.0f commits/s, "
+	       "%u stalled\n", stress->shm_count + stress->egl_count,
+	       stress->shm_count, stress->egl_count, seconds,
+	       seconds > 0 ? st->commits / seconds : 0.0, st->stalled);
+
+	if (!stress->presentation)
+		return;
+
+	printf("  presented %u, discarded %u, missed %u (%.2f%%), "
+	       "c2p p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+	       st->presented, st->discarded, st->missed,
+	       stats_missed_percent(st), stats_percentile_ms(st, 50),
+	       stats_percentile_ms(st, 99), st->c2p_max / 1e6);
+	fflush(stdout);
+}
+
+static int
+init_egl(struct stress *stress)
+{
+	static const struct {
+		char *extension, *entrypoint;
+	} swap_damage_ext_to_entrypoint[] = {
+		{
+			.extension = "EGL_EXT_swap_buffers_with_damage",
+			.entrypoint = "eglSwapBuffersWithDamageEXT",
+		},
+		{
+			.extension = "EGL_KHR_swap_buffers_with_damage",
+			.entrypoint = "eglSwapBuffersWithDamageKHR",
+		},
+	};
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	static const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_ALPHA_SIZE, 8,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+	const char *extensions;
+	EGLint major, minor, n;
+	unsigned i;
+
+	stress->egl.dpy =
+		weston_platform_get_egl_display(EGL_PLATFORM_WAYLAND_KHR,
+						stress->display, NULL);
+	if (stress->egl.dpy == EGL_NO_DISPLAY ||
+	    !eglInitialize(stress->egl.dpy, &major, &minor)) {
+		fprintf(stderr, "failed to initialize EGL\n");
+		return -1;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API) ||
+	    !eglChooseConfig(stress->egl.dpy, config_attribs,
+			     &stress->egl.conf, 1, &n) || n < 1) {
+		fprintf(stderr, "no suitable EGL config\n");
+		return -1;
+	}
+
+	stress->egl.ctx = eglCreateContext(stress->egl.dpy, stress->egl.conf,
+					   EGL_NO_CONTEXT, context_attribs);
+	if (stress->egl.ctx == EGL_NO_CONTEXT) {
+		fprintf(stderr, "failed to create an EGL context\n");
+		return -1;
+	}
+
+	extensions = eglQueryString(stress->egl.dpy, EGL_EXTENSIONS);
+	if (!extensions)
+		return 0;
+
+	for (i = 0; i < ARRAY_LENGTH(swap_damage_ext_to_entrypoint); i++) {
+		if (!weston_check_egl_extension(extensions,
+				swap_damage_ext_to_entrypoint[i].extension))
+			continue;
+
+		/* The EXTPROC is identical to the KHR one */
+		stress->egl.swap_buffers_with_damage =
+			(PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC)
+			eglGetProcAddress(swap_damage_ext_to_entrypoint[i].entrypoint);
+		break;
+	}
+
+	return 0;
+}
+
+static void
+fini_egl(struct stress *stress)
+{
+	if (stress->egl.dpy == EGL_NO_DISPLAY)
+		return;
+
+	eglMakeCurrent(stress->egl.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
+	eglTerminate(stress->egl.dpy);
+	eglReleaseThread();
+}
+
+static void
+xdg_shell_ping(void *data, struct zxdg_shell_v6 *shell, uint32_t serial)
+{
+	zxdg_shell_v6_pong(shell, serial);
+}
+
+static const struct zxdg_shell_v6_listener xdg_shell_listener = {
+	xdg_shell_ping,
+};
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct stress *stress = data;
+
+	stress->clk_id = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry,
+		       uint32_t name, const char *interface, uint32_t version)
+{
+	struct stress *stress = data;
+
+	if (strcmp(interface, "wl_compositor") == 0) {
+		stress->compositor_version = MIN(version, 4);
+		stress->compositor =
+			wl_registry_bind(registry, name,
+					 &wl_compositor_interface,
+					 stress->compositor_version);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		stress->subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "zxdg_shell_v6") == 0) {
+		stress->shell = wl_registry_bind(registry, name,
+						 &zxdg_shell_v6_interface, 1);
+		zxdg_shell_v6_add_listener(stress->shell, &xdg_shell_listener,
+					   stress);
+	} else if (strcmp(interface, "wl_shm") == 0) {
+		stress->shm = wl_registry_bind(registry, name,
+					       &wl_shm_interface, 1);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		stress->presentation =
+			wl_registry_bind(registry, name,
+					 &wp_presentation_interface, 1);
+		wp_presentation_add_listener(stress->presentation,
+					     &presentation_listener, stress);
+	}
+}
+
+static void
+registry_handle_global_remove(void *data, struct wl_registry *registry,
+			      uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove
+};
+
+static void
+signal_int(int signum)
+{
+	running = 0;
+}
+
+static int32_t option_surfaces = 16;
+static int32_t option_egl = -1;
+static char *option_size;
+static char *option_size_max;
+static char *option_damage;
+static int32_t option_subsurfaces;
+static int32_t option_opacity = 255;
+static char *option_transform;
+static int32_t option_rate;
+static int32_t option_duration = 10;
+static int32_t option_ramp;
+static int32_t option_max_missed = 1;
+static int32_t option_seed = 1;
+static char *option_log;
+static int32_t option_json;
+static int32_t option_help;
+
+static const struct weston_option options[] = {
+	{ WESTON_OPTION_INTEGER, "surfaces", 'n', &option_surfaces },
+	{ WESTON_OPTION_INTEGER, "egl", 'e', &option_egl },
+	{ WESTON_OPTION_STRING, "size", 's', &option_size },
+	{ WESTON_OPTION_STRING, "size-max", 0, &option_size_max },
+	{ WESTON_OPTION_STRING, "damage", 'd', &option_damage },
+	{ WESTON_OPTION_INTEGER, "subsurfaces", 0, &option_subsurfaces },
+	{ WESTON_OPTION_INTEGER, "opacity", 'o', &option_opacity },
+	{ WESTON_OPTION_STRING, "transform", 't', &option_transform },
+	{ WESTON_OPTION_INTEGER, "rate", 'r', &option_rate },
+	{ WESTON_OPTION_INTEGER, "duration", 'T', &option_duration },
+	{ WESTON_OPTION_INTEGER, "ramp", 0, &option_ramp },
+	{ WESTON_OPTION_INTEGER, "max-missed", 0, &option_max_missed },
+	{ WESTON_OPTION_INTEGER, "seed", 0, &option_seed },
+	{ WESTON_OPTION_STRING, "log", 0, &option_log },
+	{ WESTON_OPTION_BOOLEAN, "json", 'j', &option_json },
+	{ WESTON_OPTION_BOOLEAN, "help", 'h', &option_help },
+};
+
+static const char help_text[] =
+"Usage: %s [options]\n"
+"\n"
+"  -n, --surfaces=N\t\ttop-level surfaces to run (16)\n"
+"  -e, --egl=N\t\t\thow many of them render with EGL (half)\n"
+"  -s, --size=WxH\t\tsurface size (256x256)\n"
+"      --size-max=WxH\t\tpick each size at random up to this one\n"
+"  -d, --damage=PATTERN\t\tfull, box, stripe or none (full)\n"
+"      --subsurfaces=DEPTH\tstack of SHM sub-surfaces on each (0)\n"
+"  -o, --opacity=ALPHA\t\t0 to 255; 255 sets an opaque region (255)\n"
+"  -t, --transform=T\t\twl_output transform 0-7, or random (0)\n"
+"  -r, --rate=HZ\t\t\tcommits per second per surface, or 0 to\n"
+"\t\t\t\tcommit on every frame callback (0)\n"
+"  -T, --duration=SECONDS\tmeasure for this long, or 0 until\n"
+"\t\t\t\tinterrupted (10)\n"
+"      --ramp=STEP\t\tstart with STEP surfaces and add STEP\n"
+"\t\t\t\tafter each measurement, up to --surfaces\n"
+"      --max-missed=PERCENT\tstop ramping above this many missed\n"
+"\t\t\t\tframes (1)\n"
+"      --seed=N\t\t\tseed for the random sizes and transforms\n"
+"      --log=FILE\t\twrite every presentation feedback to FILE\n"
+"  -j, --json\t\t\tprint each measurement as a JSON line\n"
+"  -h, --help\t\t\tthis help text\n"
+"\n"
+"Damage patterns, in buffer coordinates:\n"
+"  full\tthe whole buffer, every frame\n"
+"  box\ta quarter size box moving diagonally\n"
+"  stripe\ta full width band of 1/16 the height moving down\n"
+"  none\tcommit without a new buffer after the first frame\n"
+"\n"
+"Each measurement follows a second of warm-up and reports commits,\n"
+"commits stalled on busy SHM buffers, and from presentation feedback\n"
+"the frames presented and discarded, the refreshes that should have\n"
+"shown a new frame but did not (missed), and the commit to present\n"
+"latency. The --log lines are: surface kind frame commit_nsec\n"
+"followed by present_nsec refresh_nsec seq flags, or by discarded.\n";
+
+static int
+parse_size(const char *str, int *width, int *height)
+{
+	if (sscanf(str, "%dx%d", width, height) != 2 ||
+	    *width < 1 || *height < 1)
+		return -1;
+
+	return 0;
+}
+
+static int
+parse_damage(const char *str, enum damage_pattern *damage)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(damage_pattern_name); i++) {
+		if (strcmp(str, damage_pattern_name[i]) == 0) {
+			*damage = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int
+stress_configure(struct stress *stress)
+{
+	char *end;
+
+	stress->total = option_surfaces;
+	stress->total_egl = option_egl < 0 ? option_surfaces / 2 : option_egl;
+	if (stress->total < 1 || stress->total_egl > stress->total) {
+		fprintf(stderr, "bad --surfaces or --egl\n");
+		return -1;
+	}
+
+	if (parse_size(option_size ? option_size : "256x256",
+		       &stress->min_width, &stress->min_height) < 0) {
+		fprintf(stderr, "bad --size\n");
+		return -1;
+	}
+	stress->max_width = stress->min_width;
+	stress->max_height = stress->min_height;
+	if (option_size_max &&
+	    (parse_size(option_size_max,
+			&stress->max_width, &stress->max_height) < 0 ||
+	     stress->max_width < stress->min_width ||
+	     stress->max_height < stress->min_height)) {
+		fprintf(stderr, "bad --size-max\n");
+		return -1;
+	}
+
+	if (option_damage && parse_damage(option_damage, &stress->damage) < 0) {
+		fprintf(stderr, "bad --damage\n");
+		return -1;
+	}
+
+	if (!option_transform) {
+		stress->transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	} else if (strcmp(option_transform, "random") == 0) {
+		stress->transform = -1;
+	} else {
+		stress->transform = strtol(option_transform, &end, 10);
+		if (*end != '\0' || stress->transform < 0 ||
+		    stress->transform > 7) {
+			fprintf(stderr, "bad --transform\n");
+			return -1;
+		}
+	}
+
+	if (option_opacity < 0 || option_opacity > 255 ||
+	    option_subsurfaces < 0 || option_rate < 0 ||
+	    option_duration < 0 || option_ramp < 0) {
+		fprintf(stderr, "bad option value\n");
+		return -1;
+	}
+
+	stress->opacity = option_opacity;
+	stress->depth = option_subsurfaces;
+	stress->period_nsec = option_rate ? NSEC_PER_SEC / option_rate : 0;
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sigaction sigint;
+	struct stress stress = { 0 };
+	struct surface *surface, *tmp;
+	int step, target, first_missing = 0;
+	int ret = 0;
+
+	if (parse_options(options, ARRAY_LENGTH(options), &argc, argv) > 1 ||
+	    option_help) {
+		printf(help_text, argv[0]);
+		return option_help ? 0 : 1;
+	}
+
+	if (stress_configure(&stress) < 0)
+		return 1;
+
+	srand(option_seed);
+	wl_list_init(&stress.surface_list);
+	stress.clk_id = CLOCK_MONOTONIC;
+	stress.egl.dpy = EGL_NO_DISPLAY;
+
+	stress.display = wl_display_connect(NULL);
+	if (!stress.display) {
+		fprintf(stderr, "failed to connect to the compositor: %m\n");
+		return 1;
+	}
+
+	stress.registry = wl_display_get_registry(stress.display);
+	wl_registry_add_listener(stress.registry, &registry_listener,
+				 &stress);
+	wl_display_roundtrip(stress.display);
+	wl_display_roundtrip(stress.display);
+
+	if (!stress.compositor || !stress.shell || !stress.shm ||
+	    (stress.depth && !stress.subcompositor)) {
+		fprintf(stderr, "compositor lacks wl_compositor, "
+			"zxdg_shell_v6, wl_shm or wl_subcompositor\n");
+		ret = 1;
+		goto out;
+	}
+	if (!stress.presentation)
+		fprintf(stderr, "no wp_presentation, frames are not timed\n");
+
+	if (stress.total_egl && init_egl(&stress) < 0) {
+		ret = 1;
+		goto out;
+	}
+
+	if (option_log) {
+		stress.log = fopen(option_log, "w");
+		if (!stress.log) {
+			fprintf(stderr, "cannot open %s: %m\n", option_log);
+			ret = 1;
+			goto out;
+		}
+	}
+
+	sigint.sa_handler = signal_int;
+	sigemptyset(&sigint.sa_mask);
+	sigint.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &sigint, NULL);
+
+	step = option_ramp ? option_ramp : stress.total;
+	for (target = step; ; target += step) {
+		target = MIN(target, stress.total);
+		while (stress.shm_count + stress.egl_count < target) {
+			if (stress_add_surface(&stress) < 0) {
+				ret = 1;
+				goto out;
+			}
+		}
+
+		if (stress_run_phase(&stress, option_duration * 1000LL) < 0) {
+			ret = 1;
+			goto out;
+		}
+		stress_print_phase(&stress, option_json);
+
+		if (!running)
+			break;
+
+		if (option_ramp && stress.presentation &&
+		    stats_missed_percent(&stress.stats) > option_max_missed) {
+			first_missing = target;
+			break;
+		}
+
+		if (target == stress.total)
+			break;
+	}
+
+	if (option_ramp && !option_json && running) {
+		if (first_missing)
+			printf("frames start missing at %d surfaces\n",
+			       first_missing);
+		else
+			printf("no missed frames up to %d surfaces\n",
+			       stress.total);
+	}
+
+out:
+	wl_list_for_each_safe(surface, tmp, &stress.surface_list, link)
+		surface_destroy(surface);
+	fini_egl(&stress);
+
+	if (stress.log)
+		fclose(stress.log);
+	if (stress.presentation)
+		wp_presentation_destroy(stress.presentation);
+	if (stress.shm)
+		wl_shm_destroy(stress.shm);
+	if (stress.shell)
+		zxdg_shell_v6_destroy(stress.shell);
+	if (stress.subcompositor)
+		wl_subcompositor_destroy(stress.subcompositor);
+	if (stress.compositor)
+		wl_compositor_destroy(stress.compositor);
+	wl_registry_destroy(stress.registry);
+	wl_display_flush(stress.display);
+	wl_display_disconnect(stress.display);
+
+	return ret;
+}
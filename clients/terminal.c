@@ -34,6 +34,7 @@
 #include <time.h>
 #include <pty.h>
 #include <ctype.h>
+#include <errno.h>
 #include <cairo.h>
 #include <sys/epoll.h>
 #include <wchar.h>
@@ -428,15 +429,52 @@ enum {
 	SELECT_LINE
 };
 
+/* A line of the log. While it can be drawn or written to it is expanded
+ * to an array of cells, once out of view it is compressed to runs of
+ * attributes and the text in UTF-8. */
+struct terminal_line {
+	struct wl_list link;	/* terminal::expanded_lines, if expanded */
+	uint32_t index;		/* in terminal::lines */
+	int expanded;
+	int width;		/* cells */
+	int cells;		/* cells up to the last with text, if compressed */
+	int runs;		/* attribute runs, if compressed */
+	int length;		/* bytes of text, if compressed */
+	uint32_t storage[];
+};
+
+struct attr_run {
+	struct attr attr;
+	uint16_t count;
+};
+
+/* Cells are compressed to their UTF-8 bytes, or one of these */
+#define CELL_EMPTY	0x00
+#define CELL_WIDE_RIGHT	0x01	/* right half of a double-width character */
+#define CELL_RAW	0x02	/* followed by the four bytes as they are */
+
+#define GLYPH_CACHE_BITS 9
+#define GLYPH_CACHE_SIZE (1 << GLYPH_CACHE_BITS)
+
+/* The glyphs of a character, relative to where it is drawn */
+struct glyph_cache_entry {
+	uint32_t ch;
+	uint8_t bold;
+	uint8_t valid;
+	uint8_t count;
+	cairo_glyph_t glyphs[4];
+};
+
 struct terminal {
 	struct window *window;
 	struct widget *widget;
 	struct display *display;
 	char *title;
-	union utf8_char *data;
+	struct terminal_line **lines; /* buffer_height of them, NULL if blank */
+	struct wl_list expanded_lines;
+	struct attr blank_attr;
 	struct task io_task;
 	char *tab_ruler;
-	struct attr *data_attr;
 	struct attr curr_attr;
 	uint32_t mode;
 	char origin_mode;
@@ -455,6 +493,9 @@ struct terminal {
 	int saved_row, saved_column;
 	int scrolling;
 	int send_cursor_position;
+	int damage_all;	/* terminal_data() changed more than a few rows */
+	char *dirty_rows; /* the rows terminal_data() wrote to */
+	int scroll_rows; /* how far terminal_data() scrolled the buffer */
 	int fd, master;
 	uint32_t modifiers;
 	char escape[MAX_ESCAPE+1];
@@ -469,6 +510,7 @@ struct terminal {
 	cairo_font_extents_t extents;
 	double average_width;
 	cairo_scaled_font_t *font_normal, *font_bold;
+	struct glyph_cache_entry glyph_cache[GLYPH_CACHE_SIZE];
 	uint32_t hide_cursor_serial;
 	int size_in_title;
 
@@ -553,23 +595,264 @@ init_color_table(struct terminal *terminal)
 }
 
 static union utf8_char *
-terminal_get_row(struct terminal *terminal, int row)
+line_data(struct terminal_line *line)
+{
+	return (union utf8_char *) line->storage;
+}
+
+static struct attr *
+line_attr(struct terminal_line *line)
+{
+	return (struct attr *) (line_data(line) + line->width);
+}
+
+static struct attr_run *
+line_runs(struct terminal_line *line)
+{
+	return (struct attr_run *) line->storage;
+}
+
+static unsigned char *
+line_text(struct terminal_line *line)
+{
+	return (unsigned char *) (line_runs(line) + line->runs);
+}
+
+/* How many bytes of c are its UTF-8, 0 if it is not just that */
+static int
+cell_utf8_length(union utf8_char c)
 {
-	int index;
+	int i, len;
+
+	if (c.byte[0] < 0x20)
+		return 0;
+	else if (c.byte[0] < 0x80)
+		len = 1;
+	else if (c.byte[0] < 0xC0)
+		return 0;
+	else if (c.byte[0] < 0xE0)
+		len = 2;
+	else if (c.byte[0] < 0xF0)
+		len = 3;
+	else if (c.byte[0] < 0xF8)
+		len = 4;
+	else
+		return 0;
+
+	for (i = len; i < 4; i++)
+		if (c.byte[i])
+			return 0;
+
+	return len;
+}
+
+static int
+cell_compressed_length(union utf8_char c)
+{
+	int len;
+
+	if (c.ch == 0 || c.ch == 0x200B)
+		return 1;
+
+	len = cell_utf8_length(c);
+
+	return len ? len : 5;
+}
+
+/* Returns the compressed line, or NULL if it is blank */
+static struct terminal_line *
+line_compress(struct terminal *terminal, struct terminal_line *line)
+{
+	union utf8_char *data = line_data(line);
+	struct attr *attr = line_attr(line);
+	struct terminal_line *compressed;
+	struct attr_run *run;
+	unsigned char *text;
+	int i, cells, runs, length, len;
+
+	if (line->width == 0)
+		return NULL;
+
+	cells = line->width;
+	while (cells > 0 && data[cells - 1].ch == 0)
+		cells--;
+
+	runs = 0;
+	for (i = 0; i < line->width; i++)
+		if (i == 0 || memcmp(&attr[i], &attr[i - 1], sizeof *attr))
+			runs++;
+
+	if (cells == 0 && runs == 1 &&
+	    memcmp(&attr[0], &terminal->blank_attr, sizeof *attr) == 0)
+		return NULL;
+
+	/* a run per 64k cells at least */
+	runs += line->width / UINT16_MAX;
+
+	length = 0;
+	for (i = 0; i < cells; i++)
+		length += cell_compressed_length(data[i]);
+
+	compressed = xmalloc(sizeof *compressed +
+			     runs * sizeof(struct attr_run) + length);
+	compressed->index = line->index;
+	compressed->expanded = 0;
+	compressed->width = line->width;
+	compressed->cells = cells;
+	compressed->runs = runs;
+
+	run = line_runs(compressed);
+	run->attr = attr[0];
+	run->count = 0;
+	for (i = 0; i < line->width; i++) {
+		if (memcmp(&attr[i], &run->attr, sizeof *attr) ||
+		    run->count == UINT16_MAX) {
+			run++;
+			run->attr = attr[i];
+			run->count = 0;
+		}
+		run->count++;
+	}
+	compressed->runs = run - line_runs(compressed) + 1;
+
+	text = line_text(compressed);
+	for (i = 0; i < cells; i++) {
+		if (data[i].ch == 0) {
+			*text++ = CELL_EMPTY;
+		} else if (data[i].ch == 0x200B) {
+			*text++ = CELL_WIDE_RIGHT;
+		} else if ((len = cell_utf8_length(data[i]))) {
+			memcpy(text, data[i].byte, len);
+			text += len;
+		} else {
+			*text++ = CELL_RAW;
+			memcpy(text, data[i].byte, 4);
+			text += 4;
+		}
+	}
+	compressed->length = text - line_text(compressed);
+
+	return compressed;
+}
+
+/* Replaces line, compressed, narrower or NULL, with an expanded line as
+ * wide as the widest the terminal has been. */
+static struct terminal_line *
+line_expand(struct terminal *terminal, struct terminal_line *line,
+	    uint32_t index)
+{
+	struct terminal_line *expanded;
+	union utf8_char *data;
+	struct attr *attr;
+	struct attr_run *run;
+	unsigned char *text;
+	int i, j, len, width = terminal->max_width;
+
+	expanded = xmalloc(sizeof *expanded +
+			   width * (sizeof *data + sizeof *attr));
+	expanded->index = index;
+	expanded->expanded = 1;
+	expanded->width = width;
+	expanded->cells = 0;
+	expanded->runs = 0;
+	expanded->length = 0;
+
+	data = line_data(expanded);
+	attr = line_attr(expanded);
+	memset(data, 0, width * sizeof *data);
+	attr_init(attr, terminal->blank_attr, width);
+
+	if (line && line->expanded) {
+		len = MIN(line->width, width);
+		memcpy(data, line_data(line), len * sizeof *data);
+		memcpy(attr, line_attr(line), len * sizeof *attr);
+		wl_list_remove(&line->link);
+	} else if (line) {
+		run = line_runs(line);
+		for (i = 0, j = 0; j < line->runs && i < width; j++) {
+			len = MIN(run[j].count, width - i);
+			attr_init(&attr[i], run[j].attr, len);
+			i += len;
+		}
+
+		text = line_text(line);
+		for (i = 0; i < line->cells && i < width; i++) {
+			if (*text == CELL_EMPTY) {
+				text++;
+			} else if (*text == CELL_WIDE_RIGHT) {
+				data[i].ch = 0x200B;
+				text++;
+			} else if (*text == CELL_RAW) {
+				memcpy(data[i].byte, text + 1, 4);
+				text += 5;
+			} else {
+				/* the lead byte gives the length */
+				if (*text < 0x80)
+					len = 1;
+				else if (*text < 0xE0)
+					len = 2;
+				else if (*text < 0xF0)
+					len = 3;
+				else
+					len = 4;
+				memcpy(data[i].byte, text, len);
+				text += len;
+			}
+		}
+	}
+
+	free(line);
+	wl_list_insert(&terminal->expanded_lines, &expanded->link);
+
+	return expanded;
+}
+
+static struct terminal_line *
+terminal_get_line(struct terminal *terminal, int row)
+{
+	struct terminal_line *line;
+	uint32_t index;
 
 	index = (row + terminal->start) & (terminal->buffer_height - 1);
+	line = terminal->lines[index];
+	if (!line || !line->expanded || line->width < terminal->max_width) {
+		line = line_expand(terminal, line, index);
+		terminal->lines[index] = line;
+	}
 
-	return (void *) terminal->data + index * terminal->data_pitch;
+	return line;
+}
+
+static union utf8_char *
+terminal_get_row(struct terminal *terminal, int row)
+{
+	return line_data(terminal_get_line(terminal, row));
 }
 
 static struct attr*
 terminal_get_attr_row(struct terminal *terminal, int row)
 {
-	int index;
+	return line_attr(terminal_get_line(terminal, row));
+}
 
-	index = (row + terminal->start) & (terminal->buffer_height - 1);
+/* Compress the lines that went out of view, the visible ones were
+ * expanded as they were drawn or written to. */
+static void
+terminal_compress_lines(struct terminal *terminal)
+{
+	struct terminal_line *line, *next;
+	uint32_t row;
 
-	return (void *) terminal->data_attr + index * terminal->attr_pitch;
+	wl_list_for_each_safe(line, next, &terminal->expanded_lines, link) {
+		row = (line->index - terminal->start) &
+			(terminal->buffer_height - 1);
+		if (row < (uint32_t) terminal->height)
+			continue;
+
+		wl_list_remove(&line->link);
+		terminal->lines[line->index] = line_compress(terminal, line);
+		free(line);
+	}
 }
 
 union decoded_attr {
@@ -632,6 +915,20 @@ terminal_scroll_buffer(struct terminal *terminal, int d)
 {
 	int i;
 
+	/* the rows move along on screen, and those scrolled in are new */
+	terminal->scroll_rows += d;
+	if (abs(terminal->scroll_rows) >= terminal->height)
+		terminal->damage_all = 1;
+	if (d > 0 && d < terminal->height) {
+		memmove(terminal->dirty_rows, terminal->dirty_rows + d,
+			terminal->height - d);
+		memset(terminal->dirty_rows + terminal->height - d, 1, d);
+	} else if (d < 0 && -d < terminal->height) {
+		memmove(terminal->dirty_rows - d, terminal->dirty_rows,
+			terminal->height + d);
+		memset(terminal->dirty_rows, 1, -d);
+	}
+
 	terminal->start += d;
 	if (d < 0) {
 		d = 0 - d;
@@ -659,6 +956,8 @@ terminal_scroll_window(struct terminal *terminal, int d)
 	int window_height;
 	int from_row, to_row;
 
+	terminal->damage_all = 1;
+
 	// scrolling range is inclusive
 	window_height = terminal->margin_bottom - terminal->margin_top + 1;
 	d = d % (window_height + 1);
@@ -746,11 +1045,6 @@ static void
 terminal_resize_cells(struct terminal *terminal,
 		      int width, int height)
 {
-	union utf8_char *data;
-	struct attr *data_attr;
-	char *tab_ruler;
-	int data_pitch, attr_pitch;
-	int i, l, total_rows;
 	uint32_t d, uheight = height;
 	struct rectangle allocation;
 	struct winsize ws;
@@ -761,67 +1055,36 @@ terminal_resize_cells(struct terminal *terminal,
 	if (terminal->width == width && terminal->height == height)
 		return;
 
-	if (terminal->data && width <= terminal->max_width) {
-		d = 0;
-		if (height < terminal->height && height <= terminal->row)
-			d = terminal->height - height;
-		else if (height > terminal->height &&
-			 terminal->height - 1 == terminal->row) {
-			d = terminal->height - height;
-			if (terminal->log_size < uheight)
-				d = -terminal->start;
-		}
+	if (!terminal->lines) {
+		terminal->lines = xzalloc(terminal->buffer_height *
+					  sizeof *terminal->lines);
+		terminal->blank_attr = terminal->curr_attr;
+	}
 
-		terminal->start += d;
-		terminal->row -= d;
-	} else {
+	/* lines are widened as they are expanded, and keep what is past
+	 * the right edge for when it grows back */
+	if (width > terminal->max_width) {
 		terminal->max_width = width;
-		data_pitch = width * sizeof(union utf8_char);
-		data = xzalloc(data_pitch * terminal->buffer_height);
-		attr_pitch = width * sizeof(struct attr);
-		data_attr = xmalloc(attr_pitch * terminal->buffer_height);
-		tab_ruler = xzalloc(width);
-		attr_init(data_attr, terminal->curr_attr,
-			  width * terminal->buffer_height);
-
-		if (terminal->data && terminal->data_attr) {
-			if (width > terminal->width)
-				l = terminal->width;
-			else
-				l = width;
-
-			if (terminal->height > height) {
-				total_rows = height;
-				i = 1 + terminal->row - height;
-				if (i > 0) {
-					terminal->start += i;
-					terminal->row = terminal->row - i;
-				}
-			} else {
-				total_rows = terminal->height;
-			}
+		terminal->data_pitch = width * sizeof(union utf8_char);
+		terminal->attr_pitch = width * sizeof(struct attr);
+		terminal->tab_ruler = xrealloc(terminal->tab_ruler, width);
+	}
 
-			for (i = 0; i < total_rows; i++) {
-				memcpy(&data[width * i],
-				       terminal_get_row(terminal, i),
-				       l * sizeof(union utf8_char));
-				memcpy(&data_attr[width * i],
-				       terminal_get_attr_row(terminal, i),
-				       l * sizeof(struct attr));
-			}
+	d = 0;
+	if (height < terminal->height && height <= terminal->row)
+		d = terminal->height - height;
+	else if (height > terminal->height &&
+		 terminal->height - 1 == terminal->row) {
+		d = terminal->height - height;
+		if (terminal->log_size < uheight)
+			d = -terminal->start;
+	}
 
-			free(terminal->data);
-			free(terminal->data_attr);
-			free(terminal->tab_ruler);
-		}
+	terminal->start += d;
+	terminal->row -= d;
 
-		terminal->data_pitch = data_pitch;
-		terminal->attr_pitch = attr_pitch;
-		terminal->data = data;
-		terminal->data_attr = data_attr;
-		terminal->tab_ruler = tab_ruler;
-		terminal->start = 0;
-	}
+	terminal->dirty_rows = xrealloc(terminal->dirty_rows, MAX(height, 1));
+	memset(terminal->dirty_rows, 1, MAX(height, 1));
 
 	terminal->margin_bottom =
 		height - (terminal->height - terminal->margin_bottom);
@@ -1006,10 +1269,49 @@ glyph_run_flush(struct glyph_run *run, union decoded_attr attr)
 	run->attr = attr;
 }
 
+/* Look the glyphs of a character up once per font, the fonts do not
+ * change for the life of the terminal. */
+static struct glyph_cache_entry *
+glyph_cache_lookup(struct terminal *terminal, cairo_scaled_font_t *font,
+		   union utf8_char *c)
+{
+	struct glyph_cache_entry *entry;
+	cairo_glyph_t *glyphs;
+	cairo_status_t status;
+	int num_glyphs, bold;
+
+	bold = font == terminal->font_bold;
+	entry = &terminal->glyph_cache[((c->ch ^ bold) * 2654435761u) >>
+				       (32 - GLYPH_CACHE_BITS)];
+	if (entry->valid && entry->ch == c->ch && entry->bold == bold)
+		return entry;
+
+	glyphs = entry->glyphs;
+	num_glyphs = ARRAY_LENGTH(entry->glyphs);
+	status = cairo_scaled_font_text_to_glyphs(font, 0, 0,
+						  (char *) c->byte, 4,
+						  &glyphs, &num_glyphs,
+						  NULL, NULL, NULL);
+	if (glyphs != entry->glyphs)
+		cairo_glyph_free(glyphs);
+	if (status != CAIRO_STATUS_SUCCESS || glyphs != entry->glyphs) {
+		entry->valid = 0;
+		return NULL;
+	}
+
+	entry->ch = c->ch;
+	entry->bold = bold;
+	entry->count = num_glyphs;
+	entry->valid = 1;
+
+	return entry;
+}
+
 static void
 glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 {
-	int num_glyphs;
+	struct glyph_cache_entry *entry;
+	int i, num_glyphs;
 	cairo_scaled_font_t *font;
 
 	num_glyphs = ARRAY_LENGTH(run->glyphs) - run->count;
@@ -1019,11 +1321,20 @@ glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
 	else
 		font = run->terminal->font_normal;
 
-	cairo_move_to(run->cr, x, y);
-	cairo_scaled_font_text_to_glyphs (font, x, y,
-					  (char *) c->byte, 4,
-					  &run->g, &num_glyphs,
-					  NULL, NULL, NULL);
+	entry = glyph_cache_lookup(run->terminal, font, c);
+	if (entry && entry->count <= num_glyphs) {
+		num_glyphs = entry->count;
+		for (i = 0; i < num_glyphs; i++) {
+			run->g[i].index = entry->glyphs[i].index;
+			run->g[i].x = entry->glyphs[i].x + x;
+			run->g[i].y = entry->glyphs[i].y + y;
+		}
+	} else {
+		cairo_scaled_font_text_to_glyphs (font, x, y,
+						  (char *) c->byte, 4,
+						  &run->g, &num_glyphs,
+						  NULL, NULL, NULL);
+	}
 	run->g += num_glyphs;
 	run->count += num_glyphs;
 }
@@ -1037,11 +1348,12 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_t *cr;
 	int top_margin, side_margin;
 	int row, col, cursor_x, cursor_y;
+	int first_row, end_row;
 	union utf8_char *p_row;
 	union decoded_attr attr;
 	int text_x, text_y;
 	cairo_surface_t *surface;
-	double d;
+	double d, x1, y1, x2, y2;
 	struct glyph_run run;
 	cairo_font_extents_t extents;
 	double average_width;
@@ -1069,8 +1381,14 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_set_line_width(cr, 1.0);
 	cairo_translate(cr, allocation.x + side_margin,
 			allocation.y + top_margin);
+
+	/* only the rows in the redrawn part */
+	cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+	first_row = MAX(0, (int) floor(y1 / extents.height));
+	end_row = MIN(terminal->height, (int) ceil(y2 / extents.height));
+
 	/* paint the background */
-	for (row = 0; row < terminal->height; row++) {
+	for (row = first_row; row < end_row; row++) {
 		p_row = terminal_get_row(terminal, row);
 		for (col = 0; col < terminal->width; col++) {
 			/* get the attributes for this character cell */
@@ -1099,7 +1417,7 @@ redraw_handler(struct widget *widget, void *data)
 
 	/* paint the foreground */
 	glyph_run_init(&run, terminal, cr);
-	for (row = 0; row < terminal->height; row++) {
+	for (row = first_row; row < end_row; row++) {
 		p_row = terminal_get_row(terminal, row);
 		for (col = 0; col < terminal->width; col++) {
 			/* get the attributes for this character cell */
@@ -1149,6 +1467,9 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
+	/* the log may have been scrolled back and forth */
+	terminal_compress_lines(terminal);
+
 	if (terminal->send_cursor_position) {
 		cursor_x = side_margin + allocation.x +
 				terminal->column * average_width;
@@ -1749,16 +2070,18 @@ handle_non_csi_escape(struct terminal *terminal, char code)
 static void
 handle_special_escape(struct terminal *terminal, char special, char code)
 {
-	int i, numChars;
+	union utf8_char *data;
+	int i, row;
 
 	if (special == '#') {
 		switch(code) {
 		case '8':
 			/* fill with 'E', no cheap way to do this */
-			memset(terminal->data, 0, terminal->data_pitch * terminal->height);
-			numChars = terminal->width * terminal->height;
-			for (i = 0; i < numChars; i++) {
-				terminal->data[i].byte[0] = 'E';
+			for (row = 0; row < terminal->height; row++) {
+				data = terminal_get_row(terminal, row);
+				memset(data, 0, terminal->data_pitch);
+				for (i = 0; i < terminal->width; i++)
+					data[i].byte[0] = 'E';
 			}
 			break;
 		default:
@@ -1946,6 +2269,18 @@ handle_special_char(struct terminal *terminal, char c)
 	return 1;
 }
 
+/* The cursor row was written to, it is in the log from now on */
+static void
+terminal_update_end(struct terminal *terminal)
+{
+	if (terminal->row + terminal->start + 1 > terminal->end)
+		terminal->end = terminal->row + terminal->start + 1;
+	if (terminal->end == terminal->buffer_height)
+		terminal->log_size = terminal->buffer_height;
+	else if (terminal->log_size < terminal->buffer_height)
+		terminal->log_size = terminal->end;
+}
+
 static void
 handle_char(struct terminal *terminal, union utf8_char utf8)
 {
@@ -1991,12 +2326,7 @@ handle_char(struct terminal *terminal, union utf8_char utf8)
 	row[terminal->column] = utf8;
 	attr_row[terminal->column++] = terminal->curr_attr;
 
-	if (terminal->row + terminal->start + 1 > terminal->end)
-		terminal->end = terminal->row + terminal->start + 1;
-	if (terminal->end == terminal->buffer_height)
-		terminal->log_size = terminal->buffer_height;
-	else if (terminal->log_size < terminal->buffer_height)
-		terminal->log_size = terminal->end;
+	terminal_update_end(terminal);
 
 	/* cursor jump for wide character. */
 	if (is_wide(utf8))
@@ -2026,14 +2356,128 @@ escape_append_utf8(struct terminal *terminal, union utf8_char utf8)
 	}
 }
 
+/* Rows top to bottom of the screen, the cursor's included */
+static void
+terminal_schedule_redraw_rows(struct terminal *terminal, int top, int bottom)
+{
+	struct rectangle allocation, rect;
+	int top_margin;
+	double height = terminal->extents.height;
+
+	widget_get_allocation(terminal->widget, &allocation);
+	top_margin = (allocation.height - terminal->height * height) / 2;
+
+	rect.x = allocation.x;
+	rect.width = allocation.width;
+	rect.y = allocation.y + top_margin + (int) floor(top * height) - 1;
+	rect.height = (int) ceil((bottom - top + 1) * height) + 2;
+
+	widget_schedule_redraw_rect(terminal->widget, &rect);
+}
+
+/* The length of the run of printable ASCII data starts with */
+static size_t
+ascii_run_length(const char *data, size_t length)
+{
+	const uint64_t ones = 0x0101010101010101ull;
+	const uint64_t highs = ones * 0x80;
+	uint64_t w;
+	size_t i;
+
+	/* eight bytes at a time, until one is below ' ' or above '~' */
+	for (i = 0; i + 8 <= length; i += 8) {
+		memcpy(&w, data + i, sizeof w);
+		if (((w - ones * 0x20) & ~w & highs) ||
+		    (((w + ones) | w) & highs))
+			break;
+	}
+
+	while (i < length &&
+	       (unsigned char) data[i] >= 0x20 &&
+	       (unsigned char) data[i] <= 0x7e)
+		i++;
+
+	return i;
+}
+
+/* Write out a run of printable ASCII a row at a time, rather than going
+ * through the UTF-8 decoder and handle_char() for each character. Only
+ * valid outside of escapes and multibyte characters, with the US
+ * character set and without insert mode. Returns how much of data was
+ * used. */
+static size_t
+terminal_data_ascii(struct terminal *terminal, const char *data, size_t length)
+{
+	union utf8_char *row, utf8;
+	struct attr *attr_row;
+	size_t i, j, n;
+
+	length = ascii_run_length(data, length);
+
+	for (i = 0; i < length; i += n) {
+		utf8.ch = 0;
+		if (terminal->column >= terminal->width) {
+			/* let handle_char() wrap and scroll */
+			utf8.byte[0] = data[i];
+			handle_char(terminal, utf8);
+			terminal->dirty_rows[terminal->row] = 1;
+			n = 1;
+			continue;
+		}
+
+		n = MIN(length - i, (size_t) (terminal->width - terminal->column));
+		row = terminal_get_row(terminal, terminal->row) +
+			terminal->column;
+		attr_row = terminal_get_attr_row(terminal, terminal->row) +
+			terminal->column;
+		for (j = 0; j < n; j++) {
+			utf8.byte[0] = data[i + j];
+			row[j] = utf8;
+			attr_row[j] = terminal->curr_attr;
+		}
+		terminal->column += n;
+		terminal->last_char = utf8;
+
+		terminal_update_end(terminal);
+		terminal->dirty_rows[terminal->row] = 1;
+	}
+
+	if (length > 0)
+		terminal->state_machine.state = utf8state_accept;
+
+	return length;
+}
+
 static void
 terminal_data(struct terminal *terminal, const char *data, size_t length)
 {
 	unsigned int i;
+	size_t n;
 	union utf8_char utf8;
 	enum utf8_state parser_state;
+	struct rectangle allocation, rect;
+	double height = terminal->extents.height;
+	int top, bottom;
+
+	terminal->damage_all = 0;
+	terminal->scroll_rows = 0;
+	memset(terminal->dirty_rows, 0, terminal->height);
+	terminal->dirty_rows[terminal->row] = 1;
 
 	for (i = 0; i < length; i++) {
+		if (terminal->state == escape_state_normal &&
+		    terminal->cs == CS_US &&
+		    !(terminal->mode & MODE_IRM) &&
+		    (terminal->state_machine.state == utf8state_start ||
+		     terminal->state_machine.state == utf8state_accept ||
+		     terminal->state_machine.state == utf8state_reject)) {
+			n = terminal_data_ascii(terminal, data + i, length - i);
+			if (n > 0) {
+				i += n - 1;
+				continue;
+			}
+		}
+
 		parser_state =
 			utf8_next_char(&terminal->state_machine, data[i]);
 		switch(parser_state) {
@@ -2106,6 +2550,9 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 			if (isalpha(utf8.byte[0]) || utf8.byte[0] == '@' ||
 				utf8.byte[0] == '`')
 			{
+				/* only SGR leaves the screen as it is */
+				if (utf8.byte[0] != 'm')
+					terminal->damage_all = 1;
 				terminal->state = escape_state_normal;
 				handle_escape(terminal);
 			} else {
@@ -2114,6 +2561,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 		case escape_state_inner_escape:
 			if (utf8.byte[0] == '\\') {
 				terminal->state = escape_state_normal;
+				terminal->damage_all = 1;
 				if (terminal->outer_state == escape_state_dcs) {
 					handle_dcs(terminal);
 				} else if (terminal->outer_state == escape_state_osc) {
@@ -2141,6 +2589,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 				terminal->state = escape_state_inner_escape;
 			} else if (utf8.byte[0] == '\a' && terminal->state == escape_state_osc) {
 				terminal->state = escape_state_normal;
+				terminal->damage_all = 1;
 				handle_osc(terminal);
 			} else {
 				escape_append_utf8(terminal, utf8);
@@ -2152,6 +2601,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 			escape_append_utf8(terminal, utf8);
 			terminal->state = escape_state_normal;
 			if (isdigit(utf8.byte[0]) || isalpha(utf8.byte[0])) {
+				terminal->damage_all = 1;
 				handle_special_escape(terminal, terminal->escape[1],
 				                      utf8.byte[0]);
 			}
@@ -2170,10 +2620,42 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 			terminal->escape_flags = 0;
 		} else {
 			handle_char(terminal, utf8);
+			terminal->dirty_rows[terminal->row] = 1;
 		} /* if */
 	} /* for */
 
-	window_schedule_redraw(terminal->window);
+	terminal_compress_lines(terminal);
+
+	/* the buffer can only be moved by whole pixels */
+	if (terminal->scroll_rows && height != floor(height))
+		terminal->damage_all = 1;
+
+	if (terminal->damage_all) {
+		window_schedule_redraw(terminal->window);
+		return;
+	}
+
+	if (terminal->scroll_rows) {
+		widget_get_allocation(terminal->widget, &allocation);
+		rect.x = allocation.x;
+		rect.width = allocation.width;
+		rect.y = allocation.y +
+			(int) (allocation.height - terminal->height * height) / 2;
+		rect.height = terminal->height * height;
+		widget_schedule_scroll(terminal->widget, &rect,
+				       -terminal->scroll_rows * (int) height);
+	}
+
+	for (top = 0; top < terminal->height; top = bottom + 1) {
+		if (!terminal->dirty_rows[top]) {
+			bottom = top;
+			continue;
+		}
+		for (bottom = top; bottom + 1 < terminal->height &&
+			     terminal->dirty_rows[bottom + 1]; bottom++)
+			;
+		terminal_schedule_redraw_rows(terminal, top, bottom);
+	}
 }
 
 static void
@@ -2927,6 +3409,7 @@ terminal_create(struct display *display)
 	terminal->margin = 5;
 	terminal->buffer_height = 1024;
 	terminal->end = 1;
+	wl_list_init(&terminal->expanded_lines);
 
 	window_set_user_data(terminal->window, terminal);
 	window_set_key_handler(terminal->window, key_handler);
@@ -2989,6 +3472,8 @@ terminal_create(struct display *display)
 static void
 terminal_destroy(struct terminal *terminal)
 {
+	uint32_t i;
+
 	display_unwatch_fd(terminal->display, terminal->master);
 	window_destroy(terminal->window);
 	close(terminal->master);
@@ -2997,7 +3482,12 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
+	for (i = 0; terminal->lines && i < terminal->buffer_height; i++)
+		free(terminal->lines[i]);
+	free(terminal->lines);
+	free(terminal->tab_ruler);
 	free(terminal->title);
+	free(terminal->dirty_rows);
 	free(terminal);
 }
 
@@ -3006,19 +3496,38 @@ io_handler(struct task *task, uint32_t events)
 {
 	struct terminal *terminal =
 		container_of(task, struct terminal, io_task);
-	char buffer[256];
-	int len;
+	char buffer[64 * 1024];
+	size_t total = 0;
+	ssize_t len;
+	int err = 0;
 
 	if (events & EPOLLHUP) {
 		terminal_destroy(terminal);
 		return;
 	}
 
-	len = read(terminal->master, buffer, sizeof buffer);
-	if (len < 0)
+	/* Take everything there is, up to a full buffer, so a fast
+	 * writer is parsed in large chunks. The redraw happens once per
+	 * frame callback however much was read in between. */
+	while (total < sizeof buffer) {
+		len = read(terminal->master, buffer + total,
+			   sizeof buffer - total);
+		if (len > 0) {
+			total += len;
+		} else {
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 && errno != EAGAIN)
+				err = errno;
+			break;
+		}
+	}
+
+	if (total > 0)
+		terminal_data(terminal, buffer, total);
+
+	if (err)
 		terminal_destroy(terminal);
-	else
-		terminal_data(terminal, buffer, len);
 }
 
 static int
@@ -0,0 +1,252 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Lists the log scopes weston offers through weston_debug_v1, or streams
+ * the named ones to stdout or a file while the compositor runs.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <wayland-client.h>
+#include "weston-debug-client-protocol.h"
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+
+struct debug_stream {
+	struct weston_debug_stream_v1 *obj;
+	char *name;
+	bool available;
+	struct wl_list link;
+};
+
+static struct weston_debug_v1 *debug_iface;
+static struct wl_list stream_list;
+static int list_scopes;
+static int live_streams;
+
+static struct debug_stream *
+stream_find(const char *name)
+{
+	struct debug_stream *stream;
+
+	wl_list_for_each(stream, &stream_list, link)
+		if (strcmp(stream->name, name) == 0)
+			return stream;
+
+	return NULL;
+}
+
+static void
+stream_handle_failure(void *data, struct weston_debug_stream_v1 *obj,
+		      const char *message)
+{
+	struct debug_stream *stream = data;
+
+	fprintf(stderr, "scope '%s' failed: %s\n", stream->name,
+		message ? message : "unknown error");
+	weston_debug_stream_v1_destroy(stream->obj);
+	stream->obj = NULL;
+	live_streams--;
+}
+
+static const struct weston_debug_stream_v1_listener stream_listener = {
+	stream_handle_failure
+};
+
+static void
+debug_handle_available(void *data, struct weston_debug_v1 *debug,
+		       const char *name)
+{
+	struct debug_stream *stream;
+
+	if (list_scopes) {
+		printf("%s\n", name);
+		return;
+	}
+
+	stream = stream_find(name);
+	if (stream)
+		stream->available = true;
+}
+
+static const struct weston_debug_v1_listener debug_listener = {
+	debug_handle_available
+};
+
+static void
+handle_global(void *data, struct wl_registry *registry,
+	      uint32_t name, const char *interface, uint32_t version)
+{
+	if (strcmp(interface, "weston_debug_v1") == 0) {
+		debug_iface = wl_registry_bind(registry, name,
+					       &weston_debug_v1_interface, 1);
+		weston_debug_v1_add_listener(debug_iface, &debug_listener,
+					     NULL);
+	}
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	handle_global,
+	handle_global_remove
+};
+
+/* The compositor writes into its own copy of the fd, so the output
+ * keeps going where ours does, file or terminal. */
+static void
+stream_start(struct debug_stream *stream, int fd)
+{
+	if (!stream->available)
+		fprintf(stderr, "note: scope '%s' has not been created yet, "
+			"waiting for it\n", stream->name);
+
+	stream->obj = weston_debug_v1_subscribe(debug_iface, stream->name, fd);
+	weston_debug_stream_v1_add_listener(stream->obj, &stream_listener,
+					    stream);
+	live_streams++;
+}
+
+static void
+usage(const char *name, int exit_code)
+{
+	fprintf(stderr, "usage: %s [--list] [--output FILE] SCOPE...\n\n"
+		"Streams what weston logs to the given scopes, prefixed with\n"
+		"a timestamp, until interrupted. Weston has to be started\n"
+		"with --debug.\n\n"
+		"  -l, --list\t\tprint the scopes weston knows about and exit\n"
+		"  -o, --output=FILE\twrite to FILE instead of stdout\n",
+		name);
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "list", no_argument, NULL, 'l' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0, 0, NULL, 0 }
+	};
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct debug_stream *stream, *tmp;
+	const char *output = NULL;
+	int c, fd, ret = 0;
+
+	while ((c = getopt_long(argc, argv, "lo:h", options, NULL)) != -1) {
+		switch (c) {
+		case 'l':
+			list_scopes = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (!list_scopes && optind == argc)
+		usage(argv[0], EXIT_FAILURE);
+
+	wl_list_init(&stream_list);
+	for (; optind < argc; optind++) {
+		stream = xzalloc(sizeof *stream);
+		stream->name = xstrdup(argv[optind]);
+		wl_list_insert(stream_list.prev, &stream->link);
+	}
+
+	if (output) {
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0644);
+		if (fd < 0) {
+			fprintf(stderr, "failed to open %s: %m\n", output);
+			return EXIT_FAILURE;
+		}
+	} else {
+		fd = STDOUT_FILENO;
+	}
+
+	display = wl_display_connect(NULL);
+	if (display == NULL) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return EXIT_FAILURE;
+	}
+
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, NULL);
+	wl_display_roundtrip(display);
+
+	if (debug_iface == NULL) {
+		fprintf(stderr, "the compositor does not expose the debug "
+			"protocol; start weston with --debug\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Collect the available events. */
+	wl_display_roundtrip(display);
+
+	if (!list_scopes) {
+		wl_list_for_each(stream, &stream_list, link)
+			stream_start(stream, fd);
+
+		/* The fds have gone out with the requests. */
+		wl_display_flush(display);
+		if (output)
+			close(fd);
+
+		while (ret != -1 && live_streams > 0)
+			ret = wl_display_dispatch(display);
+	}
+
+	wl_list_for_each_safe(stream, tmp, &stream_list, link) {
+		if (stream->obj)
+			weston_debug_stream_v1_destroy(stream->obj);
+		free(stream->name);
+		free(stream);
+	}
+	weston_debug_v1_destroy(debug_iface);
+	wl_registry_destroy(registry);
+	wl_display_disconnect(display);
+
+	return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -39,7 +39,10 @@
 #include <cairo.h>
 #include <sys/mman.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 
 #ifdef HAVE_CAIRO_EGL
@@ -78,6 +81,10 @@ typedef void *EGLContext;
 #include "text-cursor-position-client-protocol.h"
 #include "pointer-constraints-unstable-v1-client-protocol.h"
 #include "relative-pointer-unstable-v1-client-protocol.h"
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+#include <gbm.h>
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#endif
 #include "shared/os-compatibility.h"
 
 #include "window.h"
@@ -96,6 +103,15 @@ struct global {
 	struct wl_list link;
 };
 
+#define DISPLAY_WORKERS_MAX 8
+
+enum job_state {
+	JOB_IDLE = 0,
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE
+};
+
 struct display {
 	struct wl_display *display;
 	struct wl_registry *registry;
@@ -120,6 +136,20 @@ struct display {
 	int epoll_fd;
 	struct wl_list deferred_list;
 
+	/* Started on the first display_queue_job() */
+	struct {
+		pthread_t threads[DISPLAY_WORKERS_MAX];
+		int count;
+		pthread_mutex_t mutex;
+		pthread_cond_t work_cond;
+		pthread_cond_t done_cond;
+		struct wl_list pending_list;
+		struct wl_list done_list;
+		int done_fd;
+		struct task done_task;
+		bool quit;
+	} workers;
+
 	int running;
 
 	struct wl_list global_list;
@@ -129,8 +159,11 @@ struct display {
 
 	struct theme *theme;
 
+	/* Loaded on first use, see display_get_cursor() */
 	struct wl_cursor_theme *cursor_theme;
+	bool cursor_theme_loaded;
 	struct wl_cursor **cursors;
+	uint32_t cursors_looked_up;
 
 	display_output_handler_t output_configure_handler;
 	display_global_handler_t global_handler;
@@ -146,6 +179,19 @@ struct display {
 
 	int has_rgb565;
 	int data_device_manager_version;
+
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+	struct zwp_linux_dmabuf_v1 *dmabuf;
+	uint32_t dmabuf_formats;	/* DMABUF_FORMAT_* */
+	int gbm_fd;
+	struct gbm_device *gbm;
+#endif
+};
+
+enum {
+	DMABUF_FORMAT_ARGB8888 = 1 << 0,
+	DMABUF_FORMAT_XRGB8888 = 1 << 1,
+	DMABUF_FORMAT_RGB565 = 1 << 2,
 };
 
 struct window_output {
@@ -161,19 +207,26 @@ struct toysurface {
 	 * width,height are the new buffer size.
 	 * If flags has SURFACE_HINT_RESIZE set, the user is
 	 * doing continuous resizing.
+	 * If damage is not NULL, only that region, in buffer coordinates,
+	 * is going to be drawn: *preserved is set if the surface already
+	 * holds the previous frame everywhere else, and cleared if it all
+	 * has to be drawn.
 	 * Returns the Cairo surface to draw to.
 	 */
 	cairo_surface_t *(*prepare)(struct toysurface *base, int dx, int dy,
 				    int32_t width, int32_t height, uint32_t flags,
-				    enum wl_output_transform buffer_transform, int32_t buffer_scale);
+				    enum wl_output_transform buffer_transform, int32_t buffer_scale,
+				    const cairo_region_t *damage, int *preserved);
 
 	/*
 	 * Post the surface to the server, returning the server allocation
-	 * rectangle. The Cairo surface from prepare() must be destroyed
-	 * after calling this.
+	 * rectangle. damage is what changed since the previous frame, in
+	 * buffer coordinates, or NULL for everything. The Cairo surface
+	 * from prepare() must be destroyed after calling this.
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     const cairo_region_t *damage,
 		     struct rectangle *server_allocation);
 
 	/*
@@ -220,6 +273,18 @@ struct surface {
 
 	cairo_surface_t *cairo_surface;
 
+	/* What widget_schedule_redraw_rect() asked for, in the coordinates
+	 * of the widget allocations, unless something asked for all of it */
+	cairo_region_t *damage;
+	int damage_all;
+	/* what widget_schedule_scroll() asked for, dy 0 if nothing */
+	struct rectangle scroll_rect;
+	int scroll_dy;
+	/* what the redraw in progress is clipped to, NULL for everything */
+	cairo_region_t *frame_damage;
+	struct rectangle frame_scroll_rect;
+	int frame_scroll_dy;
+
 	struct wl_list link;
 };
 
@@ -354,6 +419,14 @@ struct input {
 	float sx, sy;
 	struct wl_list link;
 
+	/* Pointer motion is coalesced per wl_pointer.frame and delivered
+	 * once from a deferred task, right before the redraws it causes. */
+	bool motion_pending;
+	bool motion_frame_pending;
+	bool motion_task_queued;
+	uint32_t motion_time;
+	struct task motion_task;
+
 	struct widget *focus_widget;
 	struct widget *grab;
 	uint32_t grab_button;
@@ -440,11 +513,29 @@ struct tooltip {
 	float x, y;
 };
 
+/* A wl_shm_pool that grows and takes freed buffers back. Growing maps
+ * the file again at its new size; buffers keep the mapping they were
+ * allocated from until they are destroyed. */
 struct shm_pool {
 	struct wl_shm_pool *pool;
+	int fd;
 	size_t size;
-	size_t used;
+	bool huge;			/* cannot grow */
+	struct shm_pool_mapping *mapping;	/* of the current size */
+	struct wl_list free_list;	/* shm_pool_block::link, by offset */
+	int refcount;
+};
+
+struct shm_pool_mapping {
 	void *data;
+	size_t size;
+	int refcount;
+};
+
+struct shm_pool_block {
+	size_t offset;
+	size_t size;
+	struct wl_list link;
 };
 
 enum {
@@ -561,10 +652,14 @@ to_egl_window_surface(struct toysurface *base)
 static cairo_surface_t *
 egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 			   int32_t width, int32_t height, uint32_t flags,
-			   enum wl_output_transform buffer_transform, int32_t buffer_scale)
+			   enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			   const cairo_region_t *damage, int *preserved)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
 
+	/* without buffer age, the back buffer is undefined */
+	*preserved = 0;
+
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
 
 	wl_egl_window_resize(surface->egl_window, width, height, dx, dy);
@@ -576,6 +671,7 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			const cairo_region_t *damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
@@ -705,6 +801,9 @@ egl_window_surface_create(struct display *display,
 struct shm_surface_data {
 	struct wl_buffer *buffer;
 	struct shm_pool *pool;
+	struct shm_pool_mapping *mapping;
+	size_t offset;
+	size_t length;
 };
 
 struct wl_buffer *
@@ -719,7 +818,13 @@ display_get_buffer_for_surface(struct display *display,
 }
 
 static void
-shm_pool_destroy(struct shm_pool *pool);
+shm_pool_unref(struct shm_pool *pool);
+
+static void
+shm_pool_free(struct shm_pool *pool, size_t offset, size_t size);
+
+static void
+shm_pool_mapping_unref(struct shm_pool_mapping *mapping);
 
 static void
 shm_surface_data_destroy(void *p)
@@ -727,85 +832,221 @@ shm_surface_data_destroy(void *p)
 	struct shm_surface_data *data = p;
 
 	wl_buffer_destroy(data->buffer);
-	if (data->pool)
-		shm_pool_destroy(data->pool);
+	shm_pool_free(data->pool, data->offset, data->length);
+	shm_pool_mapping_unref(data->mapping);
+	shm_pool_unref(data->pool);
 
 	free(data);
 }
 
-static struct wl_shm_pool *
-make_shm_pool(struct display *display, int size, void **data)
+static struct shm_pool_mapping *
+shm_pool_map(struct shm_pool *pool)
 {
-	struct wl_shm_pool *pool;
-	int fd;
+	struct shm_pool_mapping *mapping;
 
-	fd = os_create_anonymous_file(size);
-	if (fd < 0) {
-		fprintf(stderr, "creating a buffer file for %d B failed: %m\n",
-			size);
+	mapping = malloc(sizeof *mapping);
+	if (!mapping)
 		return NULL;
-	}
 
-	*data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (*data == MAP_FAILED) {
+	mapping->data = os_map_buffer_file(pool->fd, pool->size);
+	if (mapping->data == MAP_FAILED) {
 		fprintf(stderr, "mmap failed: %m\n");
-		close(fd);
+		free(mapping);
 		return NULL;
 	}
 
-	pool = wl_shm_create_pool(display->shm, fd, size);
+	mapping->size = pool->size;
+	mapping->refcount = 1;
 
-	close(fd);
+	return mapping;
+}
 
-	return pool;
+static void
+shm_pool_mapping_unref(struct shm_pool_mapping *mapping)
+{
+	if (--mapping->refcount > 0)
+		return;
+
+	munmap(mapping->data, mapping->size);
+	free(mapping);
 }
 
 static struct shm_pool *
 shm_pool_create(struct display *display, size_t size)
 {
-	struct shm_pool *pool = malloc(sizeof *pool);
+	struct shm_pool *pool;
+	struct shm_pool_block *block;
+	off_t file_size = size;
 
-	if (!pool)
+	if (size == 0 || size > INT32_MAX)
 		return NULL;
 
-	pool->pool = make_shm_pool(display, size, &pool->data);
-	if (!pool->pool) {
-		free(pool);
-		return NULL;
+	pool = zalloc(sizeof *pool);
+	block = zalloc(sizeof *block);
+	if (!pool || !block)
+		goto err_free;
+
+	pool->fd = os_create_buffer_file(&file_size, &pool->huge);
+	if (pool->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %m\n",
+			size);
+		goto err_free;
 	}
+	/* rounded up to whole huge pages, the rest is free space */
+	if (file_size <= INT32_MAX)
+		size = file_size;
+
+	/* The compositor maps the pool as well; it may only grow. */
+	os_seal_anonymous_file(pool->fd, false);
 
 	pool->size = size;
-	pool->used = 0;
+	pool->mapping = shm_pool_map(pool);
+	if (!pool->mapping)
+		goto err_close;
+
+	pool->pool = wl_shm_create_pool(display->shm, pool->fd, size);
+
+	block->offset = 0;
+	block->size = size;
+	wl_list_init(&pool->free_list);
+	wl_list_insert(&pool->free_list, &block->link);
+	pool->refcount = 1;
 
 	return pool;
+
+err_close:
+	close(pool->fd);
+err_free:
+	free(block);
+	free(pool);
+	return NULL;
 }
 
-static void *
-shm_pool_allocate(struct shm_pool *pool, size_t size, int *offset)
+static struct shm_pool *
+shm_pool_ref(struct shm_pool *pool)
 {
-	if (pool->used + size > pool->size)
-		return NULL;
-
-	*offset = pool->used;
-	pool->used += size;
+	pool->refcount++;
 
-	return (char *) pool->data + *offset;
+	return pool;
 }
 
-/* destroy the pool. this does not unmap the memory though */
+/* Buffers created from the pool stay valid after this */
 static void
-shm_pool_destroy(struct shm_pool *pool)
+shm_pool_unref(struct shm_pool *pool)
 {
-	munmap(pool->data, pool->size);
+	struct shm_pool_block *block, *next;
+
+	if (--pool->refcount > 0)
+		return;
+
+	wl_list_for_each_safe(block, next, &pool->free_list, link)
+		free(block);
+	shm_pool_mapping_unref(pool->mapping);
 	wl_shm_pool_destroy(pool->pool);
+	close(pool->fd);
 	free(pool);
 }
 
-/* Start allocating from the beginning of the pool again */
+/* Give a range back, merging it with its free neighbours */
 static void
-shm_pool_reset(struct shm_pool *pool)
+shm_pool_free(struct shm_pool *pool, size_t offset, size_t size)
 {
-	pool->used = 0;
+	struct shm_pool_block *block, *prev = NULL, *next = NULL;
+
+	wl_list_for_each(block, &pool->free_list, link) {
+		if (block->offset > offset) {
+			next = block;
+			break;
+		}
+		prev = block;
+	}
+
+	if (prev && prev->offset + prev->size == offset) {
+		prev->size += size;
+		if (next && offset + size == next->offset) {
+			prev->size += next->size;
+			wl_list_remove(&next->link);
+			free(next);
+		}
+		return;
+	}
+
+	if (next && offset + size == next->offset) {
+		next->offset = offset;
+		next->size += size;
+		return;
+	}
+
+	block = malloc(sizeof *block);
+	if (!block)
+		return; /* leaked until the pool goes */
+
+	block->offset = offset;
+	block->size = size;
+	wl_list_insert(prev ? &prev->link : &pool->free_list, &block->link);
+}
+
+static int
+shm_pool_grow(struct shm_pool *pool, size_t size)
+{
+	struct shm_pool_mapping *mapping;
+	size_t old_size = pool->size;
+
+	if (size <= old_size)
+		return 0;
+	if (size > INT32_MAX || pool->huge)
+		return -1;
+
+	if (os_resize_anonymous_file(pool->fd, size) < 0) {
+		fprintf(stderr, "growing a buffer file to %zu B failed: %m\n",
+			size);
+		return -1;
+	}
+
+	pool->size = size;
+	mapping = shm_pool_map(pool);
+	if (!mapping) {
+		pool->size = old_size;
+		return -1;
+	}
+
+	wl_shm_pool_resize(pool->pool, size);
+	shm_pool_mapping_unref(pool->mapping);
+	pool->mapping = mapping;
+	shm_pool_free(pool, old_size, size - old_size);
+
+	return 0;
+}
+
+/* First fit, growing the pool if nothing fits */
+static void *
+shm_pool_allocate(struct shm_pool *pool, size_t size, size_t *offset)
+{
+	struct shm_pool_block *block;
+	int grown = 0;
+
+retry:
+	wl_list_for_each(block, &pool->free_list, link) {
+		if (block->size < size)
+			continue;
+
+		*offset = block->offset;
+		block->offset += size;
+		block->size -= size;
+		if (block->size == 0) {
+			wl_list_remove(&block->link);
+			free(block);
+		}
+
+		return (char *) pool->mapping->data + *offset;
+	}
+
+	if (grown ||
+	    shm_pool_grow(pool, MAX(pool->size * 2, pool->size + size)) < 0)
+		return NULL;
+
+	grown = 1;
+	goto retry;
 }
 
 static int
@@ -827,7 +1068,8 @@ display_create_shm_surface_from_pool(struct display *display,
 	uint32_t format;
 	cairo_surface_t *surface;
 	cairo_format_t cairo_format;
-	int stride, length, offset;
+	int stride;
+	size_t length, offset;
 	void *map;
 
 	data = malloc(sizeof *data);
@@ -840,8 +1082,7 @@ display_create_shm_surface_from_pool(struct display *display,
 		cairo_format = CAIRO_FORMAT_ARGB32;
 
 	stride = cairo_format_stride_for_width (cairo_format, rectangle->width);
-	length = stride * rectangle->height;
-	data->pool = NULL;
+	length = (size_t) stride * rectangle->height;
 	map = shm_pool_allocate(pool, length, &offset);
 
 	if (!map) {
@@ -849,15 +1090,18 @@ display_create_shm_surface_from_pool(struct display *display,
 		return NULL;
 	}
 
+	data->pool = shm_pool_ref(pool);
+	data->mapping = pool->mapping;
+	data->mapping->refcount++;
+	data->offset = offset;
+	data->length = length;
+
 	surface = cairo_image_surface_create_for_data (map,
 						       cairo_format,
 						       rectangle->width,
 						       rectangle->height,
 						       stride);
 
-	cairo_surface_set_user_data(surface, &shm_surface_data_key,
-				    data, shm_surface_data_destroy);
-
 	if (flags & SURFACE_HINT_RGB565 && display->has_rgb565)
 		format = WL_SHM_FORMAT_RGB565;
 	else {
@@ -872,53 +1116,44 @@ display_create_shm_surface_from_pool(struct display *display,
 						 rectangle->height,
 						 stride, format);
 
+	cairo_surface_set_user_data(surface, &shm_surface_data_key,
+				    data, shm_surface_data_destroy);
+
 	return surface;
 }
 
+/* Allocates from the given pool, or from a pool of its own */
 static cairo_surface_t *
 display_create_shm_surface(struct display *display,
 			   struct rectangle *rectangle, uint32_t flags,
-			   struct shm_pool *alternate_pool,
+			   struct shm_pool *pool,
 			   struct shm_surface_data **data_ret)
 {
-	struct shm_surface_data *data;
-	struct shm_pool *pool;
-	cairo_surface_t *surface;
+	cairo_surface_t *surface = NULL;
 
-	if (alternate_pool) {
-		shm_pool_reset(alternate_pool);
+	if (pool)
 		surface = display_create_shm_surface_from_pool(display,
 							       rectangle,
-							       flags,
-							       alternate_pool);
-		if (surface) {
-			data = cairo_surface_get_user_data(surface,
-							   &shm_surface_data_key);
-			goto out;
-		}
-	}
-
-	pool = shm_pool_create(display,
-			       data_length_for_shm_surface(rectangle));
-	if (!pool)
-		return NULL;
-
-	surface =
-		display_create_shm_surface_from_pool(display, rectangle,
-						     flags, pool);
+							       flags, pool);
 
 	if (!surface) {
-		shm_pool_destroy(pool);
-		return NULL;
-	}
+		pool = shm_pool_create(display,
+				       data_length_for_shm_surface(rectangle));
+		if (!pool)
+			return NULL;
 
-	/* make sure we destroy the pool when the surface is destroyed */
-	data = cairo_surface_get_user_data(surface, &shm_surface_data_key);
-	data->pool = pool;
+		/* the surface keeps the pool */
+		surface = display_create_shm_surface_from_pool(display,
+							       rectangle,
+							       flags, pool);
+		shm_pool_unref(pool);
+		if (!surface)
+			return NULL;
+	}
 
-out:
 	if (data_ret)
-		*data_ret = data;
+		*data_ret = cairo_surface_get_user_data(surface,
+							&shm_surface_data_key);
 
 	return surface;
 }
@@ -953,7 +1188,10 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
+	/* what changed since this buffer was last posted, in buffer
+	 * coordinates; NULL if its content is of no use */
+	cairo_region_t *stale;
+
 	int busy;
 };
 
@@ -964,8 +1202,8 @@ shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
 
 	memset(leaf, 0, sizeof *leaf);
 }
@@ -981,6 +1219,10 @@ struct shm_surface {
 
 	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
+	struct shm_surface_leaf *last;	/* posted most recently */
+
+	/* shared by the leaves */
+	struct shm_pool *pool;
 };
 
 static struct shm_surface *
@@ -1032,12 +1274,14 @@ shm_surface_buffer_release(void *data, struct wl_buffer *buffer)
 	}
 	assert(i < MAX_LEAVES && "unknown buffer released");
 
-	/* Leave one free leaf with storage, release others */
-	free_found = 0;
+	/* Leave one free leaf with storage, release others. Keep the
+	 * last posted one if it is free: it has the most recent content. */
+	free_found = surface->last && !surface->last->busy;
 	for (i = 0; i < MAX_LEAVES; i++) {
 		leaf = &surface->leaf[i];
 
-		if (!leaf->cairo_surface || leaf->busy)
+		if (!leaf->cairo_surface || leaf->busy ||
+		    leaf == surface->last)
 			continue;
 
 		if (!free_found)
@@ -1053,10 +1297,106 @@ static const struct wl_buffer_listener shm_surface_buffer_listener = {
 	shm_surface_buffer_release
 };
 
+static size_t
+display_get_max_output_length(struct display *display)
+{
+	struct output *output;
+	size_t length, max = 0;
+
+	wl_list_for_each(output, &display->output_list, link) {
+		length = (size_t) output->allocation.width *
+			 output->allocation.height * 4;
+		max = MAX(max, length);
+	}
+
+	return max;
+}
+
+/* The pool is sized for two buffers of the current size. While the
+ * window is interactively resized, it is sized for the largest output
+ * instead, so that it does not grow frame after frame. A pool left much
+ * bigger than needed after a resize is dropped; it goes away with the
+ * last buffer allocated from it. */
+static void
+shm_surface_update_pool(struct shm_surface *surface, size_t length,
+			int resize_hint)
+{
+	size_t want = 2 * length;
+
+#ifdef USE_RESIZE_POOL
+	if (resize_hint)
+		want = MAX(want,
+			   2 * display_get_max_output_length(surface->display));
+#endif
+
+	if (surface->pool && !resize_hint && surface->pool->size > 2 * want) {
+		shm_pool_unref(surface->pool);
+		surface->pool = NULL;
+	}
+
+	if (!surface->pool)
+		surface->pool = shm_pool_create(surface->display, want);
+	else if (resize_hint)
+		shm_pool_grow(surface->pool, want);
+}
+
+/* Bring the leaf up to date with the last frame outside of damage, by
+ * copying what it missed from the last posted buffer. */
+static int
+shm_surface_leaf_preserve(struct shm_surface *surface,
+			  struct shm_surface_leaf *leaf,
+			  const cairo_region_t *damage)
+{
+	struct shm_surface_leaf *last = surface->last;
+	cairo_rectangle_int_t r;
+	cairo_region_t *copy;
+	cairo_t *cr;
+	int i, n;
+
+	if (!damage)
+		return 0;
+
+	if (leaf == last)
+		return leaf->stale != NULL;
+
+	r.x = 0;
+	r.y = 0;
+	r.width = cairo_image_surface_get_width(leaf->cairo_surface);
+	r.height = cairo_image_surface_get_height(leaf->cairo_surface);
+
+	if (!last || !last->cairo_surface ||
+	    cairo_image_surface_get_width(last->cairo_surface) != r.width ||
+	    cairo_image_surface_get_height(last->cairo_surface) != r.height)
+		return 0;
+
+	if (leaf->stale)
+		copy = cairo_region_copy(leaf->stale);
+	else
+		copy = cairo_region_create_rectangle(&r);
+	cairo_region_subtract(copy, damage);
+
+	n = cairo_region_num_rectangles(copy);
+	if (n > 0) {
+		cr = cairo_create(leaf->cairo_surface);
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cr, last->cairo_surface, 0, 0);
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(copy, i, &r);
+			cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+		}
+		cairo_fill(cr);
+		cairo_destroy(cr);
+	}
+	cairo_region_destroy(copy);
+
+	return 1;
+}
+
 static cairo_surface_t *
 shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int32_t width, int32_t height, uint32_t flags,
-		    enum wl_output_transform buffer_transform, int32_t buffer_scale)
+		    enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		    const cairo_region_t *damage, int *preserved)
 {
 	int resize_hint = !!(flags & SURFACE_HINT_RESIZE);
 	struct shm_surface *surface = to_shm_surface(base);
@@ -1085,13 +1425,6 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
-		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
-	}
-
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
 
 	if (leaf->cairo_surface &&
@@ -1099,29 +1432,26 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	    cairo_image_surface_get_height(leaf->cairo_surface) == height)
 		goto out;
 
+	/* gives its storage back to the pool */
 	if (leaf->cairo_surface)
 		cairo_surface_destroy(leaf->cairo_surface);
-
-#ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
-	}
-#endif
+	leaf->cairo_surface = NULL;
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
+	leaf->stale = NULL;
+	if (surface->last == leaf)
+		surface->last = NULL;
 
 	rect.width = width;
 	rect.height = height;
 
+	shm_surface_update_pool(surface, data_length_for_shm_surface(&rect),
+				resize_hint);
+
 	leaf->cairo_surface =
 		display_create_shm_surface(surface->display, &rect,
 					   surface->flags,
-					   leaf->resize_pool,
+					   surface->pool,
 					   &leaf->data);
 	if (!leaf->cairo_surface)
 		return NULL;
@@ -1130,18 +1460,50 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 			       &shm_surface_buffer_listener, surface);
 
 out:
+	*preserved = shm_surface_leaf_preserve(surface, leaf, damage);
 	surface->current = leaf;
 
 	return cairo_surface_reference(leaf->cairo_surface);
 }
 
+/* Post damage in buffer coordinates, for the software toysurfaces */
+static void
+toysurface_damage(struct wl_surface *surface, int32_t buffer_scale,
+		  const cairo_region_t *damage)
+{
+	cairo_rectangle_int_t r;
+	int i, n, x2, y2;
+
+	n = cairo_region_num_rectangles(damage);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(damage, i, &r);
+
+		if (wl_surface_get_version(surface) >=
+		    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION) {
+			wl_surface_damage_buffer(surface, r.x, r.y,
+						 r.width, r.height);
+			continue;
+		}
+
+		/* only ever called for untransformed buffers */
+		x2 = (r.x + r.width + buffer_scale - 1) / buffer_scale;
+		y2 = (r.y + r.height + buffer_scale - 1) / buffer_scale;
+		r.x /= buffer_scale;
+		r.y /= buffer_scale;
+		wl_surface_damage(surface, r.x, r.y, x2 - r.x, y2 - r.y);
+	}
+}
+
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 const cairo_region_t *damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct shm_surface_leaf *other;
+	int i;
 
 	server_allocation->width =
 		cairo_image_surface_get_width(leaf->cairo_surface);
@@ -1154,10 +1516,33 @@ shm_surface_swap(struct toysurface *base,
 
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	if (damage)
+		toysurface_damage(surface->surface, buffer_scale, damage);
+	else
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
 	wl_surface_commit(surface->surface);
 
+	/* The other buffers now miss what this one got */
+	for (i = 0; i < MAX_LEAVES; i++) {
+		other = &surface->leaf[i];
+		if (other == leaf || !other->stale)
+			continue;
+
+		if (damage) {
+			cairo_region_union(other->stale, damage);
+		} else {
+			cairo_region_destroy(other->stale);
+			other->stale = NULL;
+		}
+	}
+
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
+	leaf->stale = cairo_region_create();
+	surface->last = leaf;
+
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
 		(int)(leaf - &surface->leaf[0]));
 
@@ -1185,6 +1570,9 @@ shm_surface_destroy(struct toysurface *base)
 	for (i = 0; i < MAX_LEAVES; i++)
 		shm_surface_leaf_release(&surface->leaf[i]);
 
+	if (surface->pool)
+		shm_pool_unref(surface->pool);
+
 	free(surface);
 }
 
@@ -1209,6 +1597,390 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	return &surface->base;
 }
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+
+struct dmabuf_surface_leaf {
+	struct gbm_bo *bo;
+	struct wl_buffer *buffer;
+
+	/* what the buffer misses of the shadow, in buffer coordinates;
+	 * NULL if all of it */
+	cairo_region_t *stale;
+
+	int busy;
+};
+
+/*
+ * Drawn by cairo in a shadow image in system memory, which is fast to
+ * read back when blending. What changed is then copied to a linear
+ * buffer object the compositor can texture from as it is, instead of
+ * uploading a wl_shm buffer each frame.
+ */
+struct dmabuf_surface {
+	struct toysurface base;
+	struct display *display;
+	struct wl_surface *surface;
+	uint32_t flags;
+	int dx, dy;
+
+	cairo_format_t cairo_format;
+	uint32_t format;
+	cairo_surface_t *shadow;
+
+	struct dmabuf_surface_leaf leaf[MAX_LEAVES];
+	struct dmabuf_surface_leaf *current;
+};
+
+static struct dmabuf_surface *
+to_dmabuf_surface(struct toysurface *base)
+{
+	return container_of(base, struct dmabuf_surface, base);
+}
+
+static void
+dmabuf_surface_leaf_release(struct dmabuf_surface_leaf *leaf)
+{
+	if (leaf->buffer)
+		wl_buffer_destroy(leaf->buffer);
+	if (leaf->bo)
+		gbm_bo_destroy(leaf->bo);
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
+
+	memset(leaf, 0, sizeof *leaf);
+}
+
+static void
+dmabuf_surface_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct dmabuf_surface *surface = data;
+	struct dmabuf_surface_leaf *leaf;
+	int i, free_found = 0;
+
+	for (i = 0; i < MAX_LEAVES; i++) {
+		leaf = &surface->leaf[i];
+		if (leaf->buffer == buffer) {
+			leaf->busy = 0;
+			break;
+		}
+	}
+	assert(i < MAX_LEAVES && "unknown buffer released");
+
+	/* Leave one free leaf with storage, release others */
+	for (i = 0; i < MAX_LEAVES; i++) {
+		leaf = &surface->leaf[i];
+
+		if (!leaf->bo || leaf->busy)
+			continue;
+
+		if (!free_found)
+			free_found = 1;
+		else
+			dmabuf_surface_leaf_release(leaf);
+	}
+}
+
+static const struct wl_buffer_listener dmabuf_surface_buffer_listener = {
+	dmabuf_surface_buffer_release
+};
+
+static int
+dmabuf_surface_leaf_create(struct dmabuf_surface *surface,
+			   struct dmabuf_surface_leaf *leaf,
+			   int width, int height)
+{
+	struct display *display = surface->display;
+	struct zwp_linux_buffer_params_v1 *params;
+	int fd;
+
+	leaf->bo = gbm_bo_create(display->gbm, width, height, surface->format,
+				 GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+	if (!leaf->bo) {
+		fprintf(stderr, "%s: gbm_bo_create failed: %m\n", __func__);
+		return -1;
+	}
+
+	fd = gbm_bo_get_fd(leaf->bo);
+	if (fd < 0) {
+		fprintf(stderr, "%s: gbm_bo_get_fd failed: %m\n", __func__);
+		dmabuf_surface_leaf_release(leaf);
+		return -1;
+	}
+
+	/* a modifier of 0 is DRM_FORMAT_MOD_LINEAR */
+	params = zwp_linux_dmabuf_v1_create_params(display->dmabuf);
+	zwp_linux_buffer_params_v1_add(params, fd, 0, 0,
+				       gbm_bo_get_stride(leaf->bo), 0, 0);
+	leaf->buffer = zwp_linux_buffer_params_v1_create_immed(params,
+							       width, height,
+							       surface->format,
+							       0);
+	zwp_linux_buffer_params_v1_destroy(params);
+	close(fd);
+
+	wl_buffer_add_listener(leaf->buffer,
+			       &dmabuf_surface_buffer_listener, surface);
+
+	return 0;
+}
+
+/* Copy region, or all of it if NULL, from the shadow to the buffer */
+static int
+dmabuf_surface_leaf_update(struct dmabuf_surface *surface,
+			   struct dmabuf_surface_leaf *leaf,
+			   const cairo_region_t *region)
+{
+	cairo_surface_t *shadow = surface->shadow;
+	cairo_rectangle_int_t r, extents;
+	cairo_region_t *copy;
+	unsigned char *src, *dst;
+	uint32_t stride;
+	void *map_data = NULL;
+	int bpp, src_stride, i, n, y;
+
+	extents.x = 0;
+	extents.y = 0;
+	extents.width = cairo_image_surface_get_width(shadow);
+	extents.height = cairo_image_surface_get_height(shadow);
+
+	if (region)
+		copy = cairo_region_copy(region);
+	else
+		copy = cairo_region_create_rectangle(&extents);
+	cairo_region_intersect_rectangle(copy, &extents);
+
+	if (cairo_region_is_empty(copy)) {
+		cairo_region_destroy(copy);
+		return 0;
+	}
+
+	/* only map what is written to */
+	cairo_region_get_extents(copy, &extents);
+	dst = gbm_bo_map(leaf->bo, extents.x, extents.y,
+			 extents.width, extents.height,
+			 GBM_BO_TRANSFER_READ_WRITE, &stride, &map_data);
+	if (!dst) {
+		cairo_region_destroy(copy);
+		return -1;
+	}
+
+	bpp = surface->cairo_format == CAIRO_FORMAT_RGB16_565 ? 2 : 4;
+	cairo_surface_flush(shadow);
+	src = cairo_image_surface_get_data(shadow);
+	src_stride = cairo_image_surface_get_stride(shadow);
+
+	n = cairo_region_num_rectangles(copy);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(copy, i, &r);
+		for (y = r.y; y < r.y + r.height; y++)
+			memcpy(dst + (y - extents.y) * stride +
+			       (r.x - extents.x) * bpp,
+			       src + y * src_stride + r.x * bpp,
+			       r.width * bpp);
+	}
+
+	gbm_bo_unmap(leaf->bo, map_data);
+	cairo_region_destroy(copy);
+
+	return 0;
+}
+
+static cairo_surface_t *
+dmabuf_surface_prepare(struct toysurface *base, int dx, int dy,
+		       int32_t width, int32_t height, uint32_t flags,
+		       enum wl_output_transform buffer_transform,
+		       int32_t buffer_scale,
+		       const cairo_region_t *damage, int *preserved)
+{
+	struct dmabuf_surface *surface = to_dmabuf_surface(base);
+	struct dmabuf_surface_leaf *leaf = NULL;
+	int i;
+
+	surface->dx = dx;
+	surface->dy = dy;
+
+	for (i = 0; i < MAX_LEAVES; i++) {
+		if (surface->leaf[i].busy)
+			continue;
+
+		if (!leaf || surface->leaf[i].bo)
+			leaf = &surface->leaf[i];
+	}
+
+	if (!leaf) {
+		fprintf(stderr, "%s: all buffers are held by the server.\n",
+			__func__);
+		exit(1);
+		return NULL;
+	}
+
+	surface_to_buffer_size(buffer_transform, buffer_scale,
+			       &width, &height);
+
+	/* the shadow always holds the last frame */
+	*preserved = damage != NULL;
+	if (!surface->shadow ||
+	    cairo_image_surface_get_width(surface->shadow) != width ||
+	    cairo_image_surface_get_height(surface->shadow) != height) {
+		if (surface->shadow)
+			cairo_surface_destroy(surface->shadow);
+		surface->shadow = cairo_image_surface_create(surface->cairo_format,
+							     width, height);
+		if (cairo_surface_status(surface->shadow) !=
+		    CAIRO_STATUS_SUCCESS) {
+			cairo_surface_destroy(surface->shadow);
+			surface->shadow = NULL;
+			return NULL;
+		}
+		*preserved = 0;
+	}
+
+	if (leaf->bo && (gbm_bo_get_width(leaf->bo) != (uint32_t) width ||
+			 gbm_bo_get_height(leaf->bo) != (uint32_t) height))
+		dmabuf_surface_leaf_release(leaf);
+
+	if (!leaf->bo &&
+	    dmabuf_surface_leaf_create(surface, leaf, width, height) < 0)
+		return NULL;
+
+	surface->current = leaf;
+
+	return cairo_surface_reference(surface->shadow);
+}
+
+static void
+dmabuf_surface_swap(struct toysurface *base,
+		    enum wl_output_transform buffer_transform,
+		    int32_t buffer_scale,
+		    const cairo_region_t *damage,
+		    struct rectangle *server_allocation)
+{
+	struct dmabuf_surface *surface = to_dmabuf_surface(base);
+	struct dmabuf_surface_leaf *leaf = surface->current;
+	struct dmabuf_surface_leaf *other;
+	int i;
+
+	server_allocation->width =
+		cairo_image_surface_get_width(surface->shadow);
+	server_allocation->height =
+		cairo_image_surface_get_height(surface->shadow);
+
+	buffer_to_surface_size(buffer_transform, buffer_scale,
+			       &server_allocation->width,
+			       &server_allocation->height);
+
+	/* everything the buffer missed, and this frame */
+	if (leaf->stale && damage)
+		cairo_region_union(leaf->stale, damage);
+	if (dmabuf_surface_leaf_update(surface, leaf,
+				       damage ? leaf->stale : NULL) < 0)
+		fprintf(stderr, "%s: gbm_bo_map failed: %m\n", __func__);
+
+	wl_surface_attach(surface->surface, leaf->buffer,
+			  surface->dx, surface->dy);
+	if (damage)
+		toysurface_damage(surface->surface, buffer_scale, damage);
+	else
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
+	wl_surface_commit(surface->surface);
+
+	/* The other buffers now miss what this one got */
+	for (i = 0; i < MAX_LEAVES; i++) {
+		other = &surface->leaf[i];
+		if (other == leaf || !other->stale)
+			continue;
+
+		if (damage) {
+			cairo_region_union(other->stale, damage);
+		} else {
+			cairo_region_destroy(other->stale);
+			other->stale = NULL;
+		}
+	}
+
+	if (leaf->stale)
+		cairo_region_destroy(leaf->stale);
+	leaf->stale = cairo_region_create();
+
+	leaf->busy = 1;
+	surface->current = NULL;
+}
+
+static int
+dmabuf_surface_acquire(struct toysurface *base, EGLContext ctx)
+{
+	return -1;
+}
+
+static void
+dmabuf_surface_release(struct toysurface *base)
+{
+}
+
+static void
+dmabuf_surface_destroy(struct toysurface *base)
+{
+	struct dmabuf_surface *surface = to_dmabuf_surface(base);
+	int i;
+
+	for (i = 0; i < MAX_LEAVES; i++)
+		dmabuf_surface_leaf_release(&surface->leaf[i]);
+
+	if (surface->shadow)
+		cairo_surface_destroy(surface->shadow);
+
+	free(surface);
+}
+
+/* Returns NULL if the compositor does not take the format it needs */
+static struct toysurface *
+dmabuf_surface_create(struct display *display, struct wl_surface *wl_surface,
+		      uint32_t flags, struct rectangle *rectangle)
+{
+	struct dmabuf_surface *surface;
+	cairo_format_t cairo_format;
+	uint32_t format, needed;
+
+	if (flags & SURFACE_HINT_RGB565 &&
+	    display->dmabuf_formats & DMABUF_FORMAT_RGB565) {
+		cairo_format = CAIRO_FORMAT_RGB16_565;
+		format = GBM_FORMAT_RGB565;
+		needed = DMABUF_FORMAT_RGB565;
+	} else if (flags & SURFACE_OPAQUE) {
+		cairo_format = CAIRO_FORMAT_RGB24;
+		format = GBM_FORMAT_XRGB8888;
+		needed = DMABUF_FORMAT_XRGB8888;
+	} else {
+		cairo_format = CAIRO_FORMAT_ARGB32;
+		format = GBM_FORMAT_ARGB8888;
+		needed = DMABUF_FORMAT_ARGB8888;
+	}
+
+	if (!display->gbm || !(display->dmabuf_formats & needed))
+		return NULL;
+
+	DBG_OBJ(wl_surface, "\n");
+
+	surface = xzalloc(sizeof *surface);
+	surface->base.prepare = dmabuf_surface_prepare;
+	surface->base.swap = dmabuf_surface_swap;
+	surface->base.acquire = dmabuf_surface_acquire;
+	surface->base.release = dmabuf_surface_release;
+	surface->base.destroy = dmabuf_surface_destroy;
+
+	surface->display = display;
+	surface->surface = wl_surface;
+	surface->flags = flags;
+	surface->cairo_format = cairo_format;
+	surface->format = format;
+
+	return &surface->base;
+}
+
+#endif /* HAVE_TOYTOOLKIT_DMABUF */
+
 /*
  * The following correspondences between file names and cursors was copied
  * from: https://bugs.kde.org/attachment.cgi?id=67313
@@ -1333,14 +2105,23 @@ static const struct cursor_alternatives cursors[] = {
 
 static void
 create_cursors(struct display *display)
+{
+	display->cursors =
+		xzalloc(ARRAY_LENGTH(cursors) * sizeof display->cursors[0]);
+}
+
+/* Loading a theme decodes all of its cursors, so it waits until the
+ * client shows its first cursor rather than slowing down its start. */
+static void
+load_cursor_theme(struct display *display)
 {
 	const char *config_file;
 	struct weston_config *config;
 	struct weston_config_section *s;
 	int size;
 	char *theme = NULL;
-	unsigned int i, j;
-	struct wl_cursor *cursor;
+
+	display->cursor_theme_loaded = true;
 
 	config_file = weston_config_get_name_from_env();
 	config = weston_config_parse(config_file);
@@ -1350,69 +2131,224 @@ create_cursors(struct display *display)
 	weston_config_destroy(config);
 
 	display->cursor_theme = wl_cursor_theme_load(theme, size, display->shm);
-	if (!display->cursor_theme) {
+	if (!display->cursor_theme)
 		fprintf(stderr, "could not load theme '%s'\n", theme);
-		return;
-	}
 	free(theme);
-	display->cursors =
-		xmalloc(ARRAY_LENGTH(cursors) * sizeof display->cursors[0]);
+}
 
-	for (i = 0; i < ARRAY_LENGTH(cursors); i++) {
-		cursor = NULL;
-		for (j = 0; !cursor && j < cursors[i].count; ++j)
-			cursor = wl_cursor_theme_get_cursor(
-			    display->cursor_theme, cursors[i].names[j]);
+/* The cursor for one of the CURSOR_* values, looked up in the theme the
+ * first time it is asked for, and kept for all the inputs after that */
+static struct wl_cursor *
+display_get_cursor(struct display *display, int index)
+{
+	struct wl_cursor *cursor = NULL;
+	unsigned int j;
 
-		if (!cursor)
-			fprintf(stderr, "could not load cursor '%s'\n",
-				cursors[i].names[0]);
+	/* CURSOR_BLANK and such are not in the theme */
+	if (index < 0 || index >= (int) ARRAY_LENGTH(cursors))
+		return NULL;
 
-		display->cursors[i] = cursor;
-	}
+	if (display->cursors_looked_up & (1u << index))
+		return display->cursors[index];
+
+	if (!display->cursor_theme_loaded)
+		load_cursor_theme(display);
+
+	for (j = 0; display->cursor_theme && !cursor &&
+		    j < cursors[index].count; ++j)
+		cursor = wl_cursor_theme_get_cursor(display->cursor_theme,
+						    cursors[index].names[j]);
+
+	if (!cursor && display->cursor_theme)
+		fprintf(stderr, "could not load cursor '%s'\n",
+			cursors[index].names[0]);
+
+	display->cursors[index] = cursor;
+	display->cursors_looked_up |= 1u << index;
+
+	return cursor;
 }
 
 static void
 destroy_cursors(struct display *display)
 {
-	wl_cursor_theme_destroy(display->cursor_theme);
+	if (display->cursor_theme)
+		wl_cursor_theme_destroy(display->cursor_theme);
 	free(display->cursors);
 }
 
 struct wl_cursor_image *
 display_get_pointer_image(struct display *display, int pointer)
 {
-	struct wl_cursor *cursor = display->cursors[pointer];
+	struct wl_cursor *cursor = display_get_cursor(display, pointer);
 
 	return cursor ? cursor->images[0] : NULL;
 }
 
+/* Damage is kept in the coordinates of the widget allocations; buffers
+ * are only drawn partially while untransformed. */
+static cairo_region_t *
+surface_damage_to_buffer(struct surface *surface, const cairo_region_t *damage)
+{
+	cairo_rectangle_int_t r, bounds;
+	cairo_region_t *region;
+	int32_t scale = surface->buffer_scale;
+	int i, n;
+
+	region = cairo_region_create();
+	n = cairo_region_num_rectangles(damage);
+	for (i = 0; i < n; i++) {
+		cairo_region_get_rectangle(damage, i, &r);
+		r.x = (r.x - surface->allocation.x) * scale;
+		r.y = (r.y - surface->allocation.y) * scale;
+		r.width *= scale;
+		r.height *= scale;
+		cairo_region_union_rectangle(region, &r);
+	}
+
+	bounds.x = 0;
+	bounds.y = 0;
+	bounds.width = surface->allocation.width * scale;
+	bounds.height = surface->allocation.height * scale;
+	cairo_region_intersect_rectangle(region, &bounds);
+
+	return region;
+}
+
 static void
 surface_flush(struct surface *surface)
 {
+	cairo_region_t *damage;
+	cairo_rectangle_int_t r;
+
 	if (!surface->cairo_surface)
 		return;
 
-	if (surface->opaque_region) {
-		wl_surface_set_opaque_region(surface->surface,
-					     surface->opaque_region);
-		wl_region_destroy(surface->opaque_region);
-		surface->opaque_region = NULL;
-	}
+	if (surface->opaque_region) {
+		wl_surface_set_opaque_region(surface->surface,
+					     surface->opaque_region);
+		wl_region_destroy(surface->opaque_region);
+		surface->opaque_region = NULL;
+	}
+
+	if (surface->input_region) {
+		wl_surface_set_input_region(surface->surface,
+					    surface->input_region);
+		wl_region_destroy(surface->input_region);
+		surface->input_region = NULL;
+	}
+
+	damage = NULL;
+	if (surface->frame_damage) {
+		r.x = surface->frame_scroll_rect.x;
+		r.y = surface->frame_scroll_rect.y;
+		r.width = surface->frame_scroll_rect.width;
+		r.height = surface->frame_scroll_rect.height;
+		if (surface->frame_scroll_dy)
+			cairo_region_union_rectangle(surface->frame_damage, &r);
+		damage = surface_damage_to_buffer(surface,
+						  surface->frame_damage);
+	}
+
+	surface->toysurface->swap(surface->toysurface,
+				  surface->buffer_transform, surface->buffer_scale,
+				  damage, &surface->server_allocation);
+
+	if (damage)
+		cairo_region_destroy(damage);
+	if (surface->frame_damage)
+		cairo_region_destroy(surface->frame_damage);
+	surface->frame_damage = NULL;
+	surface->frame_scroll_dy = 0;
+
+	cairo_surface_destroy(surface->cairo_surface);
+	surface->cairo_surface = NULL;
+}
+
+/* What the buffer does not need from the previous frame: the damage,
+ * and in the scrolled rectangle, whatever only moves into damage. */
+static cairo_region_t *
+surface_preserve_region(struct surface *surface)
+{
+	cairo_rectangle_int_t r;
+	cairo_region_t *region, *moved, *damage;
+
+	if (!surface->frame_scroll_dy)
+		return surface_damage_to_buffer(surface,
+						surface->frame_damage);
+
+	r.x = surface->frame_scroll_rect.x;
+	r.y = surface->frame_scroll_rect.y;
+	r.width = surface->frame_scroll_rect.width;
+	r.height = surface->frame_scroll_rect.height;
+
+	region = cairo_region_copy(surface->frame_damage);
+	moved = cairo_region_copy(surface->frame_damage);
+	cairo_region_subtract_rectangle(region, &r);
+	cairo_region_intersect_rectangle(moved, &r);
+	cairo_region_translate(moved, 0, -surface->frame_scroll_dy);
+	cairo_region_intersect_rectangle(moved, &r);
+	cairo_region_union(region, moved);
+	cairo_region_destroy(moved);
+
+	damage = surface_damage_to_buffer(surface, region);
+	cairo_region_destroy(region);
+
+	return damage;
+}
+
+/* Move the scrolled rectangle of the previous frame, now in the buffer,
+ * by frame_scroll_dy. Returns 0 if the buffer cannot be written to. */
+static int
+surface_scroll_buffer(struct surface *surface)
+{
+	cairo_surface_t *image = surface->cairo_surface;
+	int32_t scale = surface->buffer_scale;
+	unsigned char *data;
+	int x, y, width, height, dy, stride, bpp, i, n;
+
+	if (!surface->frame_scroll_dy)
+		return 1;
+
+	if (!image ||
+	    cairo_surface_get_type(image) != CAIRO_SURFACE_TYPE_IMAGE)
+		return 0;
 
-	if (surface->input_region) {
-		wl_surface_set_input_region(surface->surface,
-					    surface->input_region);
-		wl_region_destroy(surface->input_region);
-		surface->input_region = NULL;
+	x = (surface->frame_scroll_rect.x - surface->allocation.x) * scale;
+	y = (surface->frame_scroll_rect.y - surface->allocation.y) * scale;
+	width = surface->frame_scroll_rect.width * scale;
+	height = surface->frame_scroll_rect.height * scale;
+	dy = surface->frame_scroll_dy * scale;
+
+	if (x < 0 || y < 0 ||
+	    x + width > cairo_image_surface_get_width(image) ||
+	    y + height > cairo_image_surface_get_height(image))
+		return 0;
+
+	if (cairo_image_surface_get_format(image) == CAIRO_FORMAT_RGB16_565)
+		bpp = 2;
+	else
+		bpp = 4;
+
+	cairo_surface_flush(image);
+	data = cairo_image_surface_get_data(image);
+	stride = cairo_image_surface_get_stride(image);
+	data += y * stride + x * bpp;
+
+	n = height - abs(dy);
+	if (dy < 0) {
+		for (i = 0; i < n; i++)
+			memmove(data + i * stride, data + (i - dy) * stride,
+				width * bpp);
+	} else {
+		for (i = n - 1; i >= 0; i--)
+			memmove(data + (i + dy) * stride, data + i * stride,
+				width * bpp);
 	}
 
-	surface->toysurface->swap(surface->toysurface,
-				  surface->buffer_transform, surface->buffer_scale,
-				  &surface->server_allocation);
+	cairo_surface_mark_dirty_rectangle(image, x, y, width, height);
 
-	cairo_surface_destroy(surface->cairo_surface);
-	surface->cairo_surface = NULL;
+	return 1;
 }
 
 int
@@ -1441,6 +2377,8 @@ surface_create_surface(struct surface *surface, uint32_t flags)
 {
 	struct display *display = surface->window->display;
 	struct rectangle allocation = surface->allocation;
+	cairo_region_t *damage = NULL;
+	int preserved = 0;
 
 	if (!surface->toysurface && display->dpy &&
 	    surface->buffer_type == WINDOW_BUFFER_TYPE_EGL_WINDOW) {
@@ -1451,15 +2389,39 @@ surface_create_surface(struct surface *surface, uint32_t flags)
 						  &allocation);
 	}
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+	if (!surface->toysurface &&
+	    surface->buffer_type == WINDOW_BUFFER_TYPE_DMABUF)
+		surface->toysurface = dmabuf_surface_create(display,
+							    surface->surface,
+							    flags,
+							    &allocation);
+#endif
+
 	if (!surface->toysurface)
 		surface->toysurface = shm_surface_create(display,
 							 surface->surface,
 							 flags, &allocation);
 
+	if (surface->frame_damage)
+		damage = surface_preserve_region(surface);
+
 	surface->cairo_surface = surface->toysurface->prepare(
 		surface->toysurface, 0, 0,
 		allocation.width, allocation.height, flags,
-		surface->buffer_transform, surface->buffer_scale);
+		surface->buffer_transform, surface->buffer_scale,
+		damage, &preserved);
+
+	if (damage)
+		cairo_region_destroy(damage);
+
+	/* the buffer has nothing useful to keep, draw it all */
+	if (surface->frame_damage &&
+	    (!preserved || !surface_scroll_buffer(surface))) {
+		cairo_region_destroy(surface->frame_damage);
+		surface->frame_damage = NULL;
+		surface->frame_scroll_dy = 0;
+	}
 }
 
 static void
@@ -1545,6 +2507,11 @@ surface_destroy(struct surface *surface)
 	if (surface->toysurface)
 		surface->toysurface->destroy(surface->toysurface);
 
+	if (surface->damage)
+		cairo_region_destroy(surface->damage);
+	if (surface->frame_damage)
+		cairo_region_destroy(surface->frame_damage);
+
 	wl_list_remove(&surface->link);
 	free(surface);
 }
@@ -1847,6 +2814,19 @@ widget_cairo_create(struct widget *widget)
 
 	cairo_translate(cr, -surface->allocation.x, -surface->allocation.y);
 
+	if (surface->frame_damage) {
+		cairo_rectangle_int_t r;
+		int i, n;
+
+		n = cairo_region_num_rectangles(surface->frame_damage);
+		for (i = 0; i < n; i++) {
+			cairo_region_get_rectangle(surface->frame_damage,
+						   i, &r);
+			cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+		}
+		cairo_clip(cr);
+	}
+
 	return cr;
 }
 
@@ -1993,6 +2973,94 @@ widget_schedule_redraw(struct widget *widget)
 {
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
 	widget->surface->redraw_needed = 1;
+	widget->surface->damage_all = 1;
+	window_schedule_redraw_task(widget->window);
+}
+
+/* Only rect, in the coordinates of the widget allocations, needs to be
+ * redrawn. The redraw handlers of the cairo widgets it overlaps still
+ * run, with widget_cairo_create() clipped to what was asked for. */
+void
+widget_schedule_redraw_rect(struct widget *widget,
+			    const struct rectangle *rect)
+{
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t r;
+
+	DBG_OBJ(surface->surface, "widget %p %dx%d@%d,%d\n", widget,
+		rect->width, rect->height, rect->x, rect->y);
+
+	surface->redraw_needed = 1;
+	if (!surface->damage_all) {
+		if (!surface->damage)
+			surface->damage = cairo_region_create();
+
+		r.x = rect->x;
+		r.y = rect->y;
+		r.width = rect->width;
+		r.height = rect->height;
+		cairo_region_union_rectangle(surface->damage, &r);
+	}
+
+	window_schedule_redraw_task(widget->window);
+}
+
+/* The content of rect, in the coordinates of the widget allocations,
+ * moves by dy. The buffer is shifted before the next redraw, which only
+ * has to fill what was scrolled in, and what else is damaged. */
+void
+widget_schedule_scroll(struct widget *widget,
+		       const struct rectangle *rect, int dy)
+{
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t r, exposed;
+	cairo_region_t *moved;
+
+	DBG_OBJ(surface->surface, "widget %p %dx%d@%d,%d by %d\n", widget,
+		rect->width, rect->height, rect->x, rect->y, dy);
+
+	r.x = rect->x;
+	r.y = rect->y;
+	r.width = rect->width;
+	r.height = rect->height;
+
+	if (surface->damage_all || dy == 0) {
+		/* nothing to do, or it is all redrawn anyway */
+	} else if (surface->scroll_dy &&
+		   (surface->scroll_rect.x != rect->x ||
+		    surface->scroll_rect.y != rect->y ||
+		    surface->scroll_rect.width != rect->width ||
+		    surface->scroll_rect.height != rect->height)) {
+		surface->damage_all = 1;
+	} else {
+		if (!surface->damage)
+			surface->damage = cairo_region_create();
+
+		/* what is already damaged moves along */
+		moved = cairo_region_copy(surface->damage);
+		cairo_region_intersect_rectangle(moved, &r);
+		cairo_region_subtract_rectangle(surface->damage, &r);
+		cairo_region_translate(moved, 0, dy);
+		cairo_region_intersect_rectangle(moved, &r);
+		cairo_region_union(surface->damage, moved);
+		cairo_region_destroy(moved);
+
+		surface->scroll_rect = *rect;
+		surface->scroll_dy += dy;
+
+		exposed = r;
+		if (abs(dy) < r.height) {
+			exposed.height = abs(dy);
+			if (dy < 0)
+				exposed.y = r.y + r.height + dy;
+		}
+		cairo_region_union_rectangle(surface->damage, &exposed);
+
+		if (abs(surface->scroll_dy) >= r.height)
+			surface->scroll_dy = 0;
+	}
+
+	surface->redraw_needed = 1;
 	window_schedule_redraw_task(widget->window);
 }
 
@@ -2722,6 +3790,7 @@ pointer_handle_enter(void *data, struct wl_pointer *pointer,
 		return;
 	}
 
+	input_flush_motion(input);
 	input->display->serial = serial;
 	input->pointer_enter_serial = serial;
 	input->pointer_focus = window;
@@ -2739,27 +3808,23 @@ pointer_handle_leave(void *data, struct wl_pointer *pointer,
 {
 	struct input *input = data;
 
+	input_flush_motion(input);
 	input->display->serial = serial;
 	input_remove_pointer_focus(input);
 }
 
 static void
-pointer_handle_motion(void *data, struct wl_pointer *pointer,
-		      uint32_t time, wl_fixed_t sx_w, wl_fixed_t sy_w)
+input_dispatch_motion(struct input *input)
 {
-	struct input *input = data;
 	struct window *window = input->pointer_focus;
 	struct widget *widget;
 	int cursor;
-	float sx = wl_fixed_to_double(sx_w);
-	float sy = wl_fixed_to_double(sy_w);
+	float sx = input->sx;
+	float sy = input->sy;
 
 	if (!window)
 		return;
 
-	input->sx = sx;
-	input->sy = sy;
-
 	/* when making the window smaller - e.g. after an unmaximise we might
 	 * still have a pending motion event that the compositor has picked
 	 * based on the old surface dimensions. However, if we have an active
@@ -2783,7 +3848,9 @@ pointer_handle_motion(void *data, struct wl_pointer *pointer,
 	if (widget) {
 		if (widget->motion_handler)
 			cursor = widget->motion_handler(input->focus_widget,
-							input, time, sx, sy,
+							input,
+							input->motion_time,
+							sx, sy,
 							widget->user_data);
 		else
 			cursor = widget->default_cursor;
@@ -2793,6 +3860,72 @@ pointer_handle_motion(void *data, struct wl_pointer *pointer,
 	input_set_pointer_image(input, cursor);
 }
 
+static void
+input_pointer_frame(struct input *input)
+{
+	struct widget *widget;
+
+	widget = input->focus_widget;
+	if (input->grab)
+		widget = input->grab;
+	if (widget && widget->pointer_frame_handler)
+		(*widget->pointer_frame_handler)(widget,
+						 input,
+						 widget->user_data);
+}
+
+/* Deliver the coalesced motion, and the frame that closed it, before
+ * any other pointer event so handlers still see them in order. */
+static void
+input_flush_motion(struct input *input)
+{
+	if (input->motion_task_queued) {
+		wl_list_remove(&input->motion_task.link);
+		input->motion_task_queued = false;
+	}
+
+	if (input->motion_pending) {
+		input->motion_pending = false;
+		input_dispatch_motion(input);
+	}
+
+	if (input->motion_frame_pending) {
+		input->motion_frame_pending = false;
+		input_pointer_frame(input);
+	}
+}
+
+static void
+motion_task_run(struct task *task, uint32_t events)
+{
+	struct input *input = container_of(task, struct input, motion_task);
+
+	input->motion_task_queued = false;
+	input_flush_motion(input);
+}
+
+static void
+pointer_handle_motion(void *data, struct wl_pointer *pointer,
+		      uint32_t time, wl_fixed_t sx_w, wl_fixed_t sy_w)
+{
+	struct input *input = data;
+
+	if (!input->pointer_focus)
+		return;
+
+	input->sx = wl_fixed_to_double(sx_w);
+	input->sy = wl_fixed_to_double(sy_w);
+	input->motion_time = time;
+
+	/* Without frame events there is nothing to coalesce against. */
+	if (input->seat_version < WL_POINTER_FRAME_SINCE_VERSION) {
+		input_dispatch_motion(input);
+		return;
+	}
+
+	input->motion_pending = true;
+}
+
 static void
 pointer_handle_button(void *data, struct wl_pointer *pointer, uint32_t serial,
 		      uint32_t time, uint32_t button, uint32_t state_w)
@@ -2801,6 +3934,7 @@ pointer_handle_button(void *data, struct wl_pointer *pointer, uint32_t serial,
 	struct widget *widget;
 	enum wl_pointer_button_state state = state_w;
 
+	input_flush_motion(input);
 	input->display->serial = serial;
 	if (input->focus_widget && input->grab == NULL &&
 	    state == WL_POINTER_BUTTON_STATE_PRESSED)
@@ -2825,6 +3959,7 @@ pointer_handle_axis(void *data, struct wl_pointer *pointer,
 	struct input *input = data;
 	struct widget *widget;
 
+	input_flush_motion(input);
 	widget = input->focus_widget;
 	if (input->grab)
 		widget = input->grab;
@@ -2839,15 +3974,21 @@ static void
 pointer_handle_frame(void *data, struct wl_pointer *pointer)
 {
 	struct input *input = data;
-	struct widget *widget;
 
-	widget = input->focus_widget;
-	if (input->grab)
-		widget = input->grab;
-	if (widget && widget->pointer_frame_handler)
-		(*widget->pointer_frame_handler)(widget,
-						 input,
-						 widget->user_data);
+	if (!input->motion_pending) {
+		input_pointer_frame(input);
+		return;
+	}
+
+	/* Motion-only frames are folded together until the event queue
+	 * has been drained; the task is queued at the tail of the deferred
+	 * list so it runs ahead of any redraw already scheduled. */
+	input->motion_frame_pending = true;
+	if (!input->motion_task_queued) {
+		wl_list_insert(input->display->deferred_list.prev,
+			       &input->motion_task.link);
+		input->motion_task_queued = true;
+	}
 }
 
 static void
@@ -2857,6 +3998,7 @@ pointer_handle_axis_source(void *data, struct wl_pointer *pointer,
 	struct input *input = data;
 	struct widget *widget;
 
+	input_flush_motion(input);
 	widget = input->focus_widget;
 	if (input->grab)
 		widget = input->grab;
@@ -2874,6 +4016,7 @@ pointer_handle_axis_stop(void *data, struct wl_pointer *pointer,
 	struct input *input = data;
 	struct widget *widget;
 
+	input_flush_motion(input);
 	widget = input->focus_widget;
 	if (input->grab)
 		widget = input->grab;
@@ -2891,6 +4034,7 @@ pointer_handle_axis_discrete(void *data, struct wl_pointer *pointer,
 	struct input *input = data;
 	struct widget *widget;
 
+	input_flush_motion(input);
 	widget = input->focus_widget;
 	if (input->grab)
 		widget = input->grab;
@@ -3734,7 +4878,7 @@ input_set_pointer_image_index(struct input *input, int index)
 	if (!input->pointer)
 		return;
 
-	cursor = input->display->cursors[input->current_cursor];
+	cursor = display_get_cursor(input->display, input->current_cursor);
 	if (!cursor)
 		return;
 
@@ -3837,7 +4981,7 @@ pointer_surface_frame_callback(void *data, struct wl_callback *callback,
 	if (input_set_pointer_special(input))
 		return;
 
-	cursor = input->display->cursors[input->current_cursor];
+	cursor = display_get_cursor(input->display, input->current_cursor);
 	if (!cursor)
 		return;
 
@@ -3881,7 +5025,7 @@ cursor_timer_func(struct task *task, uint32_t events)
 	if (read(input->cursor_delay_fd, &exp, sizeof (uint64_t)) != sizeof (uint64_t))
 		return;
 
-	cursor = input->display->cursors[input->current_cursor];
+	cursor = display_get_cursor(input->display, input->current_cursor);
 	if (!cursor)
 		return;
 
@@ -4458,12 +5602,33 @@ window_get_allocation(struct window *window,
 	*allocation = window->main_surface->allocation;
 }
 
+/* A partial redraw is clipped to the damage, so a cairo widget allocated
+ * outside of it has nothing to paint */
+static bool
+widget_outside_damage(struct widget *widget)
+{
+	struct surface *surface = widget->surface;
+	cairo_rectangle_int_t r;
+
+	if (!surface->frame_damage || !widget->use_cairo ||
+	    widget->allocation.width <= 0 || widget->allocation.height <= 0)
+		return false;
+
+	r.x = widget->allocation.x;
+	r.y = widget->allocation.y;
+	r.width = widget->allocation.width;
+	r.height = widget->allocation.height;
+
+	return cairo_region_contains_rectangle(surface->frame_damage, &r) ==
+		CAIRO_REGION_OVERLAP_OUT;
+}
+
 static void
 widget_redraw(struct widget *widget)
 {
 	struct widget *child;
 
-	if (widget->redraw_handler)
+	if (widget->redraw_handler && !widget_outside_damage(widget))
 		widget->redraw_handler(widget, widget->user_data);
 	wl_list_for_each(child, &widget->child_list, link)
 		widget_redraw(child);
@@ -4491,6 +5656,36 @@ static const struct wl_callback_listener listener = {
 	frame_callback
 };
 
+/* Decide what this redraw covers: only the damage if nothing asked for
+ * more, and a buffer can be prepared for it. */
+static void
+surface_take_damage(struct surface *surface)
+{
+	int partial;
+
+	partial = !surface->window->redraw_needed &&
+		  !surface->damage_all && surface->damage &&
+		  !surface->cairo_surface &&
+		  surface->buffer_transform == WL_OUTPUT_TRANSFORM_NORMAL;
+
+	if (surface->frame_damage)
+		cairo_region_destroy(surface->frame_damage);
+	surface->frame_damage = NULL;
+	surface->frame_scroll_dy = 0;
+
+	if (partial) {
+		surface->frame_damage = surface->damage;
+		surface->frame_scroll_rect = surface->scroll_rect;
+		surface->frame_scroll_dy = surface->scroll_dy;
+	} else if (surface->damage) {
+		cairo_region_destroy(surface->damage);
+	}
+
+	surface->damage = NULL;
+	surface->damage_all = 0;
+	surface->scroll_dy = 0;
+}
+
 static int
 surface_redraw(struct surface *surface)
 {
@@ -4510,9 +5705,12 @@ surface_redraw(struct surface *surface)
 		wl_callback_destroy(surface->frame_cb);
 	}
 
+	surface_take_damage(surface);
+
 	if (surface->widget->use_cairo &&
 	    !widget_get_cairo_surface(surface->widget)) {
 		DBG_OBJ(surface->surface, "cancelled due to buffer failure\n");
+		surface->damage_all = 1;
 		return -1;
 	}
 
@@ -4599,8 +5797,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		surface->damage_all = 1;
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -5163,6 +6363,11 @@ get_preferred_buffer_type(struct display *display)
 		return WINDOW_BUFFER_TYPE_EGL_WINDOW;
 #endif
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+	if (display->gbm && !getenv("TOYTOOLKIT_NO_DMABUF"))
+		return WINDOW_BUFFER_TYPE_DMABUF;
+#endif
+
 	return WINDOW_BUFFER_TYPE_SHM;
 }
 
@@ -5845,6 +7050,7 @@ display_add_input(struct display *d, uint32_t id, int display_seat_version)
 
 	input->pointer_surface = wl_compositor_create_surface(d->compositor);
 	input->cursor_task.run = cursor_timer_func;
+	input->motion_task.run = motion_task_run;
 
 	input->cursor_delay_fd = timerfd_create(CLOCK_MONOTONIC,
 						TFD_CLOEXEC | TFD_NONBLOCK);
@@ -5862,6 +7068,9 @@ display_add_input(struct display *d, uint32_t id, int display_seat_version)
 static void
 input_destroy(struct input *input)
 {
+	if (input->motion_task_queued)
+		wl_list_remove(&input->motion_task.link);
+
 	input_remove_keyboard_focus(input);
 	input_remove_pointer_focus(input);
 
@@ -5917,6 +7126,30 @@ struct wl_shm_listener shm_listener = {
 	shm_format
 };
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+static void
+dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf, uint32_t format)
+{
+	struct display *d = data;
+
+	switch (format) {
+	case GBM_FORMAT_ARGB8888:
+		d->dmabuf_formats |= DMABUF_FORMAT_ARGB8888;
+		break;
+	case GBM_FORMAT_XRGB8888:
+		d->dmabuf_formats |= DMABUF_FORMAT_XRGB8888;
+		break;
+	case GBM_FORMAT_RGB565:
+		d->dmabuf_formats |= DMABUF_FORMAT_RGB565;
+		break;
+	}
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_format
+};
+#endif
+
 static void
 xdg_shell_handle_ping(void *data, struct zxdg_shell_v6 *shell, uint32_t serial)
 {
@@ -5942,7 +7175,8 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 
 	if (strcmp(interface, "wl_compositor") == 0) {
 		d->compositor = wl_registry_bind(registry, id,
-						 &wl_compositor_interface, 3);
+						 &wl_compositor_interface,
+						 MIN(version, 4));
 	} else if (strcmp(interface, "wl_output") == 0) {
 		display_add_output(d, id);
 	} else if (strcmp(interface, "wl_seat") == 0) {
@@ -5980,6 +7214,14 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 		d->subcompositor =
 			wl_registry_bind(registry, id,
 					 &wl_subcompositor_interface, 1);
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 &&
+		   version >= ZWP_LINUX_BUFFER_PARAMS_V1_CREATE_IMMED_SINCE_VERSION) {
+		d->dmabuf = wl_registry_bind(registry, id,
+					     &zwp_linux_dmabuf_v1_interface, 2);
+		zwp_linux_dmabuf_v1_add_listener(d->dmabuf,
+						 &dmabuf_listener, d);
+#endif
 	}
 
 	if (d->global_handler)
@@ -6109,6 +7351,52 @@ fini_egl(struct display *display)
 }
 #endif
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+/* The buffers are allocated on the first render node, which is the
+ * GPU the compositor uses on single GPU systems. */
+static int
+init_dmabuf(struct display *d)
+{
+	char path[64];
+	int i, fd;
+
+	if (!d->dmabuf)
+		return -1;
+
+	/* get the formats */
+	if (wl_display_roundtrip(d->display) < 0)
+		return -1;
+
+	for (i = 128; i < 192; i++) {
+		snprintf(path, sizeof path, "/dev/dri/renderD%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		d->gbm = gbm_create_device(fd);
+		if (d->gbm) {
+			d->gbm_fd = fd;
+			return 0;
+		}
+		close(fd);
+	}
+
+	return -1;
+}
+
+static void
+fini_dmabuf(struct display *display)
+{
+	if (display->gbm) {
+		gbm_device_destroy(display->gbm);
+		close(display->gbm_fd);
+	}
+
+	if (display->dmabuf)
+		zwp_linux_dmabuf_v1_destroy(display->dmabuf);
+}
+#endif
+
 static void
 init_dummy_surface(struct display *display)
 {
@@ -6216,6 +7504,10 @@ display_create(int *argc, char *argv[])
 			"falling back to software rendering and wl_shm.\n");
 #endif
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+	init_dmabuf(d);
+#endif
+
 	create_cursors(d);
 
 	d->theme = theme_create();
@@ -6257,6 +7549,8 @@ display_destroy(struct display *display)
 	if (!wl_list_empty(&display->deferred_list))
 		fprintf(stderr, "toytoolkit warning: deferred tasks exist.\n");
 
+	display_stop_workers(display);
+
 	cairo_surface_destroy(display->dummy_surface);
 	free(display->dummy_surface_data);
 
@@ -6273,6 +7567,10 @@ display_destroy(struct display *display)
 		fini_egl(display);
 #endif
 
+#ifdef HAVE_TOYTOOLKIT_DMABUF
+	fini_dmabuf(display);
+#endif
+
 	if (display->subcompositor)
 		wl_subcompositor_destroy(display->subcompositor);
 
@@ -6424,6 +7722,204 @@ display_unwatch_fd(struct display *display, int fd)
 	epoll_ctl(display->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
 }
 
+static void *
+worker_thread(void *data)
+{
+	struct display *display = data;
+	struct job *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&display->workers.mutex);
+	while (!display->workers.quit) {
+		if (wl_list_empty(&display->workers.pending_list)) {
+			pthread_cond_wait(&display->workers.work_cond,
+					  &display->workers.mutex);
+			continue;
+		}
+
+		job = container_of(display->workers.pending_list.prev,
+				   struct job, link);
+		wl_list_remove(&job->link);
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&display->workers.mutex);
+
+		job->work(job);
+
+		pthread_mutex_lock(&display->workers.mutex);
+		job->state = JOB_DONE;
+		wl_list_insert(display->workers.done_list.prev, &job->link);
+		pthread_cond_broadcast(&display->workers.done_cond);
+		if (write(display->workers.done_fd, &one, sizeof one) < 0)
+			fprintf(stderr, "toytoolkit: worker wakeup failed: %m\n");
+	}
+	pthread_mutex_unlock(&display->workers.mutex);
+
+	return NULL;
+}
+
+static void
+handle_jobs_done(struct task *task, uint32_t events)
+{
+	struct display *display =
+		container_of(task, struct display, workers.done_task);
+	struct wl_list done_list;
+	struct job *job;
+	uint64_t count;
+
+	if (read(display->workers.done_fd, &count, sizeof count) < 0 &&
+	    errno != EAGAIN)
+		return;
+
+	wl_list_init(&done_list);
+	pthread_mutex_lock(&display->workers.mutex);
+	wl_list_insert_list(&done_list, &display->workers.done_list);
+	wl_list_init(&display->workers.done_list);
+	wl_list_for_each(job, &done_list, link)
+		job->state = JOB_IDLE;
+	pthread_mutex_unlock(&display->workers.mutex);
+
+	/* done() may queue or cancel other jobs, and free this one */
+	while (!wl_list_empty(&done_list)) {
+		job = container_of(done_list.next, struct job, link);
+		wl_list_remove(&job->link);
+		wl_list_init(&job->link);
+		job->done(job);
+	}
+}
+
+static void
+display_fini_workers(struct display *display)
+{
+	display_unwatch_fd(display, display->workers.done_fd);
+	close(display->workers.done_fd);
+	pthread_cond_destroy(&display->workers.done_cond);
+	pthread_cond_destroy(&display->workers.work_cond);
+	pthread_mutex_destroy(&display->workers.mutex);
+}
+
+static int
+display_start_workers(struct display *display)
+{
+	sigset_t mask, old_mask;
+	long cpus;
+	int i;
+
+	display->workers.done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (display->workers.done_fd < 0)
+		return -1;
+
+	pthread_mutex_init(&display->workers.mutex, NULL);
+	pthread_cond_init(&display->workers.work_cond, NULL);
+	pthread_cond_init(&display->workers.done_cond, NULL);
+	wl_list_init(&display->workers.pending_list);
+	wl_list_init(&display->workers.done_list);
+
+	display->workers.done_task.run = handle_jobs_done;
+	display_watch_fd(display, display->workers.done_fd, EPOLLIN,
+			 &display->workers.done_task);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > DISPLAY_WORKERS_MAX)
+		cpus = DISPLAY_WORKERS_MAX;
+
+	/* Signals are for the main thread, which runs the handlers */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	for (i = 0; i < cpus; i++) {
+		if (pthread_create(&display->workers.threads[i], NULL,
+				   worker_thread, display) != 0)
+			break;
+		display->workers.count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (display->workers.count == 0) {
+		display_fini_workers(display);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+display_stop_workers(struct display *display)
+{
+	int i;
+
+	if (display->workers.count == 0)
+		return;
+
+	pthread_mutex_lock(&display->workers.mutex);
+	display->workers.quit = true;
+	pthread_cond_broadcast(&display->workers.work_cond);
+	pthread_mutex_unlock(&display->workers.mutex);
+
+	for (i = 0; i < display->workers.count; i++)
+		pthread_join(display->workers.threads[i], NULL);
+
+	if (!wl_list_empty(&display->workers.pending_list) ||
+	    !wl_list_empty(&display->workers.done_list))
+		fprintf(stderr, "toytoolkit warning: worker jobs exist.\n");
+
+	display_fini_workers(display);
+}
+
+/** Run a job on one of the display's worker threads
+ *
+ * \param display The display.
+ * \param job The job, which must not be queued already.
+ *
+ * Independent jobs run in parallel, one per CPU up to a limit. When
+ * job->work() returns, job->done() is called from display_run() on
+ * the main thread, which is where the results should be used and
+ * anything involving the Wayland connection happen. If no worker
+ * thread can be started, the job runs right away instead.
+ *
+ * The job must stay valid until done() is called or
+ * display_cancel_job() returns.
+ */
+void
+display_queue_job(struct display *display, struct job *job)
+{
+	if (display->workers.count == 0 &&
+	    display_start_workers(display) < 0) {
+		job->work(job);
+		job->done(job);
+		return;
+	}
+
+	pthread_mutex_lock(&display->workers.mutex);
+	job->state = JOB_PENDING;
+	wl_list_insert(&display->workers.pending_list, &job->link);
+	pthread_cond_signal(&display->workers.work_cond);
+	pthread_mutex_unlock(&display->workers.mutex);
+}
+
+/** Drop a job without calling its done() handler
+ *
+ * \param display The display.
+ * \param job The job, queued or not.
+ *
+ * If a worker thread is running the job, this waits for it to finish.
+ */
+void
+display_cancel_job(struct display *display, struct job *job)
+{
+	if (job->state == JOB_IDLE)
+		return;
+
+	pthread_mutex_lock(&display->workers.mutex);
+	while (job->state == JOB_RUNNING)
+		pthread_cond_wait(&display->workers.done_cond,
+				  &display->workers.mutex);
+	wl_list_remove(&job->link);
+	wl_list_init(&job->link);
+	job->state = JOB_IDLE;
+	pthread_mutex_unlock(&display->workers.mutex);
+}
+
 void
 display_run(struct display *display)
 {
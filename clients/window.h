@@ -45,6 +45,16 @@ struct task {
 	struct wl_list link;
 };
 
+/* Work for the display's worker threads, see display_queue_job() */
+struct job {
+	/* runs on a worker thread, must not call into toytoolkit */
+	void (*work)(struct job *job);
+	/* runs from the main loop once work() has returned */
+	void (*done)(struct job *job);
+	struct wl_list link;
+	int state;
+};
+
 struct rectangle {
 	int32_t x;
 	int32_t y;
@@ -159,6 +169,12 @@ display_watch_fd(struct display *display,
 void
 display_unwatch_fd(struct display *display, int fd);
 
+void
+display_queue_job(struct display *display, struct job *job);
+
+void
+display_cancel_job(struct display *display, struct job *job);
+
 void
 display_run(struct display *d);
 
@@ -419,6 +435,7 @@ widget_get_wl_subsurface(struct widget *widget);
 enum window_buffer_type {
 	WINDOW_BUFFER_TYPE_EGL_WINDOW,
 	WINDOW_BUFFER_TYPE_SHM,
+	WINDOW_BUFFER_TYPE_DMABUF,
 };
 
 void
@@ -606,6 +623,12 @@ widget_set_axis_handlers(struct widget *widget,
 void
 widget_schedule_redraw(struct widget *widget);
 void
+widget_schedule_redraw_rect(struct widget *widget,
+			    const struct rectangle *rect);
+void
+widget_schedule_scroll(struct widget *widget,
+		       const struct rectangle *rect, int dy);
+void
 widget_set_use_cairo(struct widget *widget, int use_cairo);
 
 struct widget *
@@ -38,54 +38,67 @@
 #include "cms-helper.h"
 #include "shared/helpers.h"
 
+/* All colord calls are asynchronous and made from a thread running its
+ * own GLib main context, so that neither a slow nor a missing daemon
+ * holds up the compositor. Profiles are handed back through a pipe and
+ * applied whenever they arrive. Meanwhile, outputs start with the
+ * profile colord last gave for the same monitor, cached on disk by EDID
+ * checksum.
+ */
 struct cms_colord {
 	struct weston_compositor	*ec;
-	CdClient			*client;
-	GHashTable			*devices; /* key = device-id, value = cms_output */
 	GHashTable			*pnp_ids; /* key = pnp-id, value = vendor */
 	gchar				*pnp_ids_data;
+	gchar				*cache_dir; /* NULL if not caching */
+
+	/* only used on the colord thread */
+	GMainContext			*context;
 	GMainLoop			*loop;
 	GThread				*thread;
+	CdClient			*client;
+	gboolean			 connected;
+	GHashTable			*devices; /* key = device-id, value = colord_device */
+
+	/* colord_result, handed to the compositor */
 	GList				*pending;
 	GMutex				 pending_mutex;
 	struct wl_event_source		*source;
 	int				 readfd;
 	int				 writefd;
+
+	struct wl_list			 output_list; /* cms_output::link */
 	struct wl_listener		 destroy_listener;
 	struct wl_listener		 output_created_listener;
 };
 
+/* An output, on the compositor side */
 struct cms_output {
-	CdDevice			*device;
-	guint32				 backlight_value;
 	struct cms_colord		*cms;
-	struct weston_color_profile	*p;
 	struct weston_output		*o;
+	gchar				*device_id;
+	struct weston_color_profile	*p;
 	struct wl_listener		 destroy_listener;
+	struct wl_list			 link;
 };
 
-static gint
-colord_idle_find_output_cb(gconstpointer a, gconstpointer b)
-{
-	struct cms_output *ocms = (struct cms_output *) a;
-	struct weston_output *o = (struct weston_output *) b;
-	return ocms->o == o ? 0 : -1;
-}
-
-static void
-colord_idle_cancel_for_output(struct cms_colord *cms, struct weston_output *o)
-{
-	GList *l;
+/* An output, on the colord thread. Pending calls hold references; the
+ * colord thread is the only one touching the count. */
+struct colord_device {
+	int				 ref_count;
+	struct cms_colord		*cms;
+	gchar				*device_id;
+	guint32				 edid_checksum;
+	GHashTable			*props;
+	CdDevice			*device;
+	GCancellable			*cancellable;
+};
 
-	/* cancel and remove any helpers that match the output */
-	g_mutex_lock(&cms->pending_mutex);
-	l = g_list_find_custom (cms->pending, o, colord_idle_find_output_cb);
-	if (l) {
-		struct cms_output *ocms = l->data;
-		cms->pending = g_list_remove (cms->pending, ocms);
-	}
-	g_mutex_unlock(&cms->pending_mutex);
-}
+/* A profile lookup finished, for colord_dispatch_all_pending() */
+struct colord_result {
+	gchar				*device_id;
+	struct weston_color_profile	*p; /* NULL for none */
+	guint32				 backlight_value;
+};
 
 static bool
 edid_value_valid(const char *str)
@@ -126,120 +139,409 @@ get_output_id(struct cms_colord *cms, struct weston_output *o)
 	return g_string_free(device_id, FALSE);
 }
 
+
+static gchar *
+colord_cache_path(struct cms_colord *cms, guint32 edid_checksum)
+{
+	if (!cms->cache_dir || edid_checksum == 0)
+		return NULL;
+
+	return g_strdup_printf("%s/%08x.icc", cms->cache_dir, edid_checksum);
+}
+
+/* Called on the colord thread */
 static void
-update_device_with_profile_in_idle(struct cms_output *ocms)
+colord_cache_store(struct cms_colord *cms, guint32 edid_checksum,
+		   const gchar *filename)
+{
+	gchar *path;
+	gchar *data = NULL;
+	gsize length;
+	GError *error = NULL;
+
+	path = colord_cache_path(cms, edid_checksum);
+	if (!path)
+		return;
+
+	if (!filename) {
+		unlink(path);
+		g_free(path);
+		return;
+	}
+
+	/* g_file_set_contents() replaces the file atomically */
+	if (!g_file_get_contents(filename, &data, &length, &error) ||
+	    !g_file_set_contents(path, data, length, &error)) {
+		weston_log("colord: failed to cache profile %s: %s\n",
+			   filename, error->message);
+		g_error_free(error);
+	}
+
+	g_free(data);
+	g_free(path);
+}
+
+static struct colord_device *
+colord_device_ref(struct colord_device *dev)
 {
-	gboolean signal_write = FALSE;
+	dev->ref_count++;
+	return dev;
+}
+
+static void
+colord_device_unref(struct colord_device *dev)
+{
+	if (--dev->ref_count > 0)
+		return;
+
+	if (dev->device)
+		g_object_unref(dev->device);
+	g_object_unref(dev->cancellable);
+	g_hash_table_unref(dev->props);
+	g_free(dev->device_id);
+	g_slice_free(struct colord_device, dev);
+}
+
+/* Called on the colord thread */
+static void
+colord_post_result(struct cms_colord *cms, struct colord_device *dev,
+		   struct weston_color_profile *p, guint32 backlight_value)
+{
+	struct colord_result *result;
+	gboolean signal_write;
+	gchar tmp = '\0';
 	ssize_t rc;
-	struct cms_colord *cms = ocms->cms;
 
-	colord_idle_cancel_for_output(cms, ocms->o);
+	result = g_slice_new0(struct colord_result);
+	result->device_id = g_strdup(dev->device_id);
+	result->p = p;
+	result->backlight_value = backlight_value;
+
 	g_mutex_lock(&cms->pending_mutex);
-	if (cms->pending == NULL)
-		signal_write = TRUE;
-	cms->pending = g_list_prepend(cms->pending, ocms);
+	signal_write = cms->pending == NULL;
+	cms->pending = g_list_append(cms->pending, result);
 	g_mutex_unlock(&cms->pending_mutex);
 
 	/* signal we've got updates to do */
 	if (signal_write) {
-		gchar tmp = '\0';
 		rc = write(cms->writefd, &tmp, 1);
-		if (rc == 0)
+		if (rc != 1)
 			weston_log("colord: failed to write to pending fd\n");
 	}
 }
 
 static void
-colord_update_output_from_device (struct cms_output *ocms)
+colord_result_free(struct colord_result *result)
 {
-	CdProfile *profile;
+	weston_cms_destroy_profile(result->p);
+	g_free(result->device_id);
+	g_slice_free(struct colord_result, result);
+}
+
+static void
+colord_profile_connect_cb(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct colord_device *dev = data;
+	CdProfile *profile = CD_PROFILE(source);
+	struct weston_color_profile *p;
 	const gchar *tmp;
-	gboolean ret;
+	const gchar *filename;
 	GError *error = NULL;
+	guint32 backlight_value = 0;
 	gint percentage;
 
-	/* old profile is no longer valid */
-	weston_cms_destroy_profile(ocms->p);
-	ocms->p = NULL;
-
-	ret = cd_device_connect_sync(ocms->device, NULL, &error);
-	if (!ret) {
-		weston_log("colord: failed to connect to device %s: %s\n",
-			   cd_device_get_object_path (ocms->device),
-			   error->message);
+	if (!cd_profile_connect_finish(profile, res, &error)) {
+		if (!g_cancellable_is_cancelled(dev->cancellable))
+			weston_log("colord: failed to connect to profile %s: %s\n",
+				   cd_profile_get_object_path(profile),
+				   error->message);
 		g_error_free(error);
 		goto out;
 	}
-	profile = cd_device_get_default_profile(ocms->device);
-	if (!profile) {
-		weston_log("colord: no assigned color profile for %s\n",
-			   cd_device_get_id (ocms->device));
-		goto out;
-	}
-	ret = cd_profile_connect_sync(profile, NULL, &error);
-	if (!ret) {
-		weston_log("colord: failed to connect to profile %s: %s\n",
-			   cd_profile_get_object_path (profile),
-			   error->message);
-		g_error_free(error);
+
+	if (g_cancellable_is_cancelled(dev->cancellable))
 		goto out;
-	}
 
 	/* get the calibration brightness level (only set for some profiles) */
 	tmp = cd_profile_get_metadata_item(profile, CD_PROFILE_METADATA_SCREEN_BRIGHTNESS);
 	if (tmp != NULL) {
 		percentage = atoi(tmp);
 		if (percentage > 0 && percentage <= 100)
-			ocms->backlight_value = percentage * 255 / 100;
+			backlight_value = percentage * 255 / 100;
 	}
 
-	ocms->p = weston_cms_load_profile(cd_profile_get_filename(profile));
-	if (ocms->p == NULL) {
-		weston_log("colord: warning failed to load profile %s: %s\n",
-			   cd_profile_get_object_path (profile),
-			   error->message);
+	filename = cd_profile_get_filename(profile);
+	p = filename ? weston_cms_load_profile(filename) : NULL;
+	if (p == NULL) {
+		weston_log("colord: warning failed to load profile %s\n",
+			   cd_profile_get_object_path(profile));
+	} else {
+		colord_cache_store(dev->cms, dev->edid_checksum, filename);
+	}
+
+	colord_post_result(dev->cms, dev, p, backlight_value);
+out:
+	g_object_unref(profile);
+	colord_device_unref(dev);
+}
+
+static void
+colord_device_connect_cb(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct colord_device *dev = data;
+	CdDevice *device = CD_DEVICE(source);
+	CdProfile *profile;
+	GError *error = NULL;
+
+	if (!cd_device_connect_finish(device, res, &error)) {
+		if (!g_cancellable_is_cancelled(dev->cancellable))
+			weston_log("colord: failed to connect to device %s: %s\n",
+				   cd_device_get_object_path(device),
+				   error->message);
 		g_error_free(error);
 		goto out;
 	}
+
+	if (g_cancellable_is_cancelled(dev->cancellable))
+		goto out;
+
+	profile = cd_device_get_default_profile(device);
+	if (!profile) {
+		weston_log("colord: no assigned color profile for %s\n",
+			   cd_device_get_id(device));
+		colord_cache_store(dev->cms, dev->edid_checksum, NULL);
+		colord_post_result(dev->cms, dev, NULL, 0);
+		goto out;
+	}
+
+	/* the callback drops the profile reference */
+	cd_profile_connect(profile, dev->cancellable,
+			   colord_profile_connect_cb, colord_device_ref(dev));
 out:
-	update_device_with_profile_in_idle(ocms);
+	colord_device_unref(dev);
+}
+
+static void
+colord_device_update(struct colord_device *dev)
+{
+	cd_device_connect(dev->device, dev->cancellable,
+			  colord_device_connect_cb, colord_device_ref(dev));
 }
 
 static void
-colord_device_changed_cb(CdDevice *device, struct cms_output *ocms)
+colord_device_changed_cb(CdDevice *device, struct colord_device *dev)
 {
 	weston_log("colord: device %s changed, update output\n",
-		   cd_device_get_object_path (ocms->device));
-	colord_update_output_from_device(ocms);
+		   cd_device_get_object_path(device));
+	colord_device_update(dev);
 }
 
 static void
-colord_notifier_output_destroy(struct wl_listener *listener, void *data)
+colord_device_set(struct colord_device *dev, CdDevice *device)
 {
-	struct cms_output *ocms =
-		container_of(listener, struct cms_output, destroy_listener);
-	struct weston_output *o = (struct weston_output *) data;
-	struct cms_colord *cms = ocms->cms;
-	gchar *device_id;
+	dev->device = device;
+	g_signal_connect(dev->device, "changed",
+			 G_CALLBACK(colord_device_changed_cb), dev);
+	colord_device_update(dev);
+}
 
-	device_id = get_output_id(cms, o);
-	g_hash_table_remove (cms->devices, device_id);
-	g_free (device_id);
+static void
+colord_find_device_cb(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct colord_device *dev = data;
+	CdDevice *device;
+	GError *error = NULL;
+
+	device = cd_client_find_device_finish(CD_CLIENT(source), res, &error);
+	if (!device) {
+		if (!g_cancellable_is_cancelled(dev->cancellable))
+			weston_log("colord: failed to find existing device: %s\n",
+				   error->message);
+		g_error_free(error);
+	} else if (g_cancellable_is_cancelled(dev->cancellable)) {
+		g_object_unref(device);
+	} else {
+		colord_device_set(dev, device);
+	}
+
+	colord_device_unref(dev);
 }
 
 static void
-colord_output_created(struct cms_colord *cms, struct weston_output *o)
+colord_create_device_cb(GObject *source, GAsyncResult *res, gpointer data)
 {
+	struct colord_device *dev = data;
+	CdClient *client = CD_CLIENT(source);
 	CdDevice *device;
-	const gchar *tmp;
-	gchar *device_id;
 	GError *error = NULL;
+
+	device = cd_client_create_device_finish(client, res, &error);
+	if (g_error_matches(error, CD_CLIENT_ERROR,
+			    CD_CLIENT_ERROR_ALREADY_EXISTS)) {
+		g_clear_error(&error);
+		/* hand our reference over to the lookup */
+		cd_client_find_device(client, dev->device_id, dev->cancellable,
+				      colord_find_device_cb, dev);
+		return;
+	}
+
+	if (!device) {
+		if (!g_cancellable_is_cancelled(dev->cancellable))
+			weston_log("colord: failed to create new device: %s\n",
+				   error->message);
+		g_error_free(error);
+	} else if (g_cancellable_is_cancelled(dev->cancellable)) {
+		g_object_unref(device);
+	} else {
+		colord_device_set(dev, device);
+	}
+
+	colord_device_unref(dev);
+}
+
+static void
+colord_device_create(struct colord_device *dev)
+{
+	cd_client_create_device(dev->cms->client, dev->device_id,
+				CD_OBJECT_SCOPE_TEMP, dev->props,
+				dev->cancellable, colord_create_device_cb,
+				colord_device_ref(dev));
+}
+
+static void
+colord_delete_device_cb(GObject *source, GAsyncResult *res, gpointer data)
+{
+	GError *error = NULL;
+
+	if (!cd_client_delete_device_finish(CD_CLIENT(source), res, &error)) {
+		weston_log("colord: failed to delete device: %s\n",
+			   error->message);
+		g_error_free(error);
+	}
+}
+
+/* Removed from cms->devices, on the colord thread */
+static void
+colord_device_destroy(gpointer data)
+{
+	struct colord_device *dev = data;
+	struct cms_colord *cms = dev->cms;
+
+	/* calls still in flight only drop their reference */
+	g_cancellable_cancel(dev->cancellable);
+
+	if (dev->device) {
+		g_signal_handlers_disconnect_by_data(dev->device, dev);
+		cd_client_delete_device(cms->client, dev->device, NULL,
+					colord_delete_device_cb, NULL);
+	}
+
+	colord_device_unref(dev);
+}
+
+static void
+colord_client_connect_cb(GObject *source, GAsyncResult *res, gpointer data)
+{
+	struct cms_colord *cms = data;
+	GHashTableIter iter;
+	gpointer dev;
+	GError *error = NULL;
+
+	if (!cd_client_connect_finish(cms->client, res, &error)) {
+		weston_log("colord: failed to contact daemon: %s\n",
+			   error->message);
+		g_error_free(error);
+		return;
+	}
+
+	cms->connected = TRUE;
+
+	/* outputs added while connecting */
+	g_hash_table_iter_init(&iter, cms->devices);
+	while (g_hash_table_iter_next(&iter, NULL, &dev))
+		colord_device_create(dev);
+}
+
+/* Runs on the colord thread, see g_main_context_invoke_full() */
+static gboolean
+colord_device_add_in_thread(gpointer data)
+{
+	struct colord_device *dev = data;
+	struct cms_colord *cms = dev->cms;
+
+	/* replaces, and so deletes, a stale device of the same id */
+	g_hash_table_insert(cms->devices, g_strdup(dev->device_id),
+			    colord_device_ref(dev));
+	if (cms->connected)
+		colord_device_create(dev);
+
+	return G_SOURCE_REMOVE;
+}
+
+struct colord_remove {
+	struct cms_colord *cms;
+	gchar *device_id;
+};
+
+static gboolean
+colord_device_remove_in_thread(gpointer data)
+{
+	struct colord_remove *remove = data;
+
+	g_hash_table_remove(remove->cms->devices, remove->device_id);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+colord_remove_free(gpointer data)
+{
+	struct colord_remove *remove = data;
+
+	g_free(remove->device_id);
+	g_slice_free(struct colord_remove, remove);
+}
+
+static gboolean
+colord_quit_in_thread(gpointer data)
+{
+	struct cms_colord *cms = data;
+
+	g_hash_table_remove_all(cms->devices);
+	g_main_loop_quit(cms->loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gpointer
+colord_run_loop_thread(gpointer data)
+{
+	struct cms_colord *cms = (struct cms_colord *) data;
+
+	/* so that the D-Bus proxies deliver to this thread */
+	g_main_context_push_thread_default(cms->context);
+
+	cms->client = cd_client_new();
+	cd_client_connect(cms->client, NULL, colord_client_connect_cb, cms);
+
+	g_main_loop_run(cms->loop);
+
+	g_hash_table_unref(cms->devices);
+	cms->devices = NULL;
+	g_object_unref(cms->client);
+	cms->client = NULL;
+
+	g_main_context_pop_thread_default(cms->context);
+
+	return NULL;
+}
+
+static GHashTable *
+colord_device_props(struct cms_colord *cms, struct weston_output *o)
+{
 	GHashTable *device_props;
-	struct cms_output *ocms;
+	const gchar *tmp;
 
-	/* create device */
-	device_id = get_output_id(cms, o);
-	weston_log("colord: output added %s\n", device_id);
 	device_props = g_hash_table_new_full(g_str_hash, g_str_equal,
 					     g_free, g_free);
 	g_hash_table_insert (device_props,
@@ -274,49 +576,83 @@ colord_output_created(struct cms_colord *cms, struct weston_output *o)
 				     g_strdup (CD_DEVICE_PROPERTY_EMBEDDED),
 				     NULL);
 	}
-	device = cd_client_create_device_sync(cms->client,
-					      device_id,
-					      CD_OBJECT_SCOPE_TEMP,
-					      device_props,
-					      NULL,
-					      &error);
-	if (g_error_matches (error,
-			     CD_CLIENT_ERROR,
-			     CD_CLIENT_ERROR_ALREADY_EXISTS)) {
-		g_clear_error(&error);
-		device = cd_client_find_device_sync (cms->client,
-						     device_id,
-						     NULL,
-						     &error);
-	}
-	if (!device) {
-		weston_log("colord: failed to create new or "
-			   "find existing device: %s\n",
-			   error->message);
-		g_error_free(error);
-		goto out;
-	}
 
-	/* create object and watch for the output to be destroyed */
+	return device_props;
+}
+
+static void
+cms_output_set_profile(struct cms_output *ocms,
+		       struct weston_color_profile *p)
+{
+	weston_cms_set_color_profile(ocms->o, p);
+
+	/* old profile is no longer valid */
+	weston_cms_destroy_profile(ocms->p);
+	ocms->p = p;
+}
+
+static void
+colord_notifier_output_destroy(struct wl_listener *listener, void *data)
+{
+	struct cms_output *ocms =
+		container_of(listener, struct cms_output, destroy_listener);
+	struct cms_colord *cms = ocms->cms;
+	struct colord_remove *remove;
+
+	weston_log("colord: output unplugged %s\n", ocms->device_id);
+
+	remove = g_slice_new0(struct colord_remove);
+	remove->cms = cms;
+	remove->device_id = g_strdup(ocms->device_id);
+	g_main_context_invoke_full(cms->context, G_PRIORITY_DEFAULT,
+				   colord_device_remove_in_thread, remove,
+				   colord_remove_free);
+
+	wl_list_remove(&ocms->destroy_listener.link);
+	wl_list_remove(&ocms->link);
+	weston_cms_destroy_profile(ocms->p);
+	g_free(ocms->device_id);
+	g_slice_free(struct cms_output, ocms);
+}
+
+static void
+colord_output_created(struct cms_colord *cms, struct weston_output *o)
+{
+	struct cms_output *ocms;
+	struct colord_device *dev;
+	struct weston_color_profile *p = NULL;
+	gchar *cache_path;
+
 	ocms = g_slice_new0(struct cms_output);
 	ocms->cms = cms;
 	ocms->o = o;
-	ocms->device = g_object_ref(device);
+	ocms->device_id = get_output_id(cms, o);
 	ocms->destroy_listener.notify = colord_notifier_output_destroy;
 	wl_signal_add(&o->destroy_signal, &ocms->destroy_listener);
-
-	/* add to local cache */
-	g_hash_table_insert (cms->devices, g_strdup(device_id), ocms);
-	g_signal_connect (ocms->device, "changed",
-			  G_CALLBACK (colord_device_changed_cb), ocms);
-
-	/* get profiles */
-	colord_update_output_from_device (ocms);
-out:
-	g_hash_table_unref (device_props);
-	if (device)
-		g_object_unref (device);
-	g_free (device_id);
+	wl_list_insert(&cms->output_list, &ocms->link);
+	weston_log("colord: output added %s\n", ocms->device_id);
+
+	/* start with what colord said last time, until it answers */
+	cache_path = colord_cache_path(cms, o->edid_checksum);
+	if (cache_path && g_file_test(cache_path, G_FILE_TEST_EXISTS))
+		p = weston_cms_load_profile(cache_path);
+	if (p) {
+		weston_log("colord: using cached profile for %s\n",
+			   ocms->device_id);
+		cms_output_set_profile(ocms, p);
+	}
+	g_free(cache_path);
+
+	dev = g_slice_new0(struct colord_device);
+	dev->ref_count = 1;
+	dev->cms = cms;
+	dev->device_id = g_strdup(ocms->device_id);
+	dev->edid_checksum = o->edid_checksum;
+	dev->props = colord_device_props(cms, o);
+	dev->cancellable = g_cancellable_new();
+	g_main_context_invoke_full(cms->context, G_PRIORITY_DEFAULT,
+				   colord_device_add_in_thread, dev,
+				   (GDestroyNotify) colord_device_unref);
 }
 
 static void
@@ -324,58 +660,61 @@ colord_notifier_output_created(struct wl_listener *listener, void *data)
 {
 	struct weston_output *o = (struct weston_output *) data;
 	struct cms_colord *cms =
-		container_of(listener, struct cms_colord, destroy_listener);
+		container_of(listener, struct cms_colord,
+			     output_created_listener);
 	weston_log("colord: output %s created\n", o->name);
 	colord_output_created(cms, o);
 }
 
-static gpointer
-colord_run_loop_thread(gpointer data)
-{
-	struct cms_colord *cms = (struct cms_colord *) data;
-	struct weston_output *o;
-
-	/* coldplug outputs */
-	wl_list_for_each(o, &cms->ec->output_list, link) {
-		weston_log("colord: output %s coldplugged\n", o->name);
-		colord_output_created(cms, o);
-	}
-
-	g_main_loop_run(cms->loop);
-	return NULL;
-}
-
 static int
 colord_dispatch_all_pending(int fd, uint32_t mask, void *data)
 {
 	gchar tmp;
-	GList *l;
+	GList *pending, *l;
 	ssize_t rc;
 	struct cms_colord *cms = data;
-	struct cms_output *ocms;
+	struct colord_result *result;
+	struct cms_output *ocms, *found;
 
-	weston_log("colord: dispatching events\n");
 	g_mutex_lock(&cms->pending_mutex);
-	for (l = cms->pending; l != NULL; l = l->next) {
-		ocms = l->data;
+	pending = cms->pending;
+	cms->pending = NULL;
+	rc = read(cms->readfd, &tmp, 1);
+	g_mutex_unlock(&cms->pending_mutex);
+	if (rc != 1)
+		weston_log("colord: failed to read from pending fd\n");
+
+	weston_log("colord: dispatching events\n");
+	for (l = pending; l != NULL; l = l->next) {
+		result = l->data;
+
+		/* the output may be gone by now */
+		found = NULL;
+		wl_list_for_each(ocms, &cms->output_list, link) {
+			if (strcmp(ocms->device_id, result->device_id) == 0) {
+				found = ocms;
+				break;
+			}
+		}
+		if (!found) {
+			colord_result_free(result);
+			continue;
+		}
 
 		/* optionally set backlight to calibration value */
-		if (ocms->o->set_backlight && ocms->backlight_value != 0) {
+		if (found->o->set_backlight && result->backlight_value != 0) {
 			weston_log("colord: profile calibration backlight to %i/255\n",
-				   ocms->backlight_value);
-			ocms->o->set_backlight(ocms->o, ocms->backlight_value);
+				   result->backlight_value);
+			found->o->set_backlight(found->o,
+						result->backlight_value);
 		}
 
-		weston_cms_set_color_profile(ocms->o, ocms->p);
+		cms_output_set_profile(found, result->p);
+		result->p = NULL;
+		colord_result_free(result);
 	}
-	g_list_free (cms->pending);
-	cms->pending = NULL;
-	g_mutex_unlock(&cms->pending_mutex);
+	g_list_free(pending);
 
-	/* done */
-	rc = read(cms->readfd, &tmp, 1);
-	if (rc == 0)
-		weston_log("colord: failed to read from pending fd\n");
 	return 1;
 }
 
@@ -428,26 +767,36 @@ colord_load_pnp_ids(struct cms_colord *cms)
 static void
 colord_module_destroy(struct cms_colord *cms)
 {
-	if (cms->loop) {
-		g_main_loop_quit(cms->loop);
+	struct cms_output *ocms, *next;
+
+	if (cms->thread) {
+		g_main_context_invoke(cms->context, colord_quit_in_thread, cms);
+		g_thread_join(cms->thread);
+	} else if (cms->devices) {
+		g_hash_table_unref(cms->devices);
+	}
+	if (cms->loop)
 		g_main_loop_unref(cms->loop);
+	if (cms->context)
+		g_main_context_unref(cms->context);
+
+	wl_list_for_each_safe(ocms, next, &cms->output_list, link) {
+		wl_list_remove(&ocms->destroy_listener.link);
+		wl_list_remove(&ocms->link);
+		weston_cms_destroy_profile(ocms->p);
+		g_free(ocms->device_id);
+		g_slice_free(struct cms_output, ocms);
 	}
-	if (cms->thread)
-		g_thread_join(cms->thread);
 
-	/* cms->devices must be destroyed before other resources, as
-	 * the other resources are needed during output cleanup in
-	 * cms->devices unref.
-	 */
-	if (cms->devices)
-		g_hash_table_unref(cms->devices);
-	if (cms->client)
-		g_object_unref(cms->client);
+	g_list_free_full(cms->pending, (GDestroyNotify) colord_result_free);
+	if (cms->source)
+		wl_event_source_remove(cms->source);
 	if (cms->readfd)
 		close(cms->readfd);
 	if (cms->writefd)
 		close(cms->writefd);
 
+	g_free(cms->cache_dir);
 	g_free(cms->pnp_ids_data);
 	g_hash_table_unref(cms->pnp_ids);
 
@@ -459,51 +808,20 @@ colord_notifier_destroy(struct wl_listener *listener, void *data)
 {
 	struct cms_colord *cms =
 		container_of(listener, struct cms_colord, destroy_listener);
-	colord_module_destroy(cms);
-}
-
-static void
-colord_cms_output_destroy(gpointer data)
-{
-	struct cms_output *ocms = (struct cms_output *) data;
-	struct cms_colord *cms = ocms->cms;
-	struct weston_output *o = ocms->o;
-	gboolean ret;
-	gchar *device_id;
-	GError *error = NULL;
-
-	colord_idle_cancel_for_output(cms, o);
-	device_id = get_output_id(cms, o);
-	weston_log("colord: output unplugged %s\n", device_id);
-
-	wl_list_remove(&ocms->destroy_listener.link);
-	g_signal_handlers_disconnect_by_data(ocms->device, ocms);
-
-	ret = cd_client_delete_device_sync (cms->client,
-					    ocms->device,
-					    NULL,
-					    &error);
-
-	if (!ret) {
-		weston_log("colord: failed to delete device: %s\n",
-			   error->message);
-		g_error_free(error);
-	}
 
-	g_object_unref(ocms->device);
-	g_slice_free(struct cms_output, ocms);
-	g_free (device_id);
+	wl_list_remove(&cms->destroy_listener.link);
+	wl_list_remove(&cms->output_created_listener.link);
+	colord_module_destroy(cms);
 }
 
 WL_EXPORT int
 wet_module_init(struct weston_compositor *ec,
 		int *argc, char *argv[])
 {
-	gboolean ret;
-	GError *error = NULL;
 	int fd[2];
 	struct cms_colord *cms;
 	struct wl_event_loop *loop;
+	struct weston_output *o;
 
 	weston_log("colord: initialized\n");
 
@@ -512,28 +830,13 @@ wet_module_init(struct weston_compositor *ec,
 	if (cms == NULL)
 		return -1;
 	cms->ec = ec;
+	wl_list_init(&cms->output_list);
 #if !GLIB_CHECK_VERSION(2,36,0)
 	g_type_init();
 #endif
-	cms->client = cd_client_new();
-	ret = cd_client_connect_sync(cms->client, NULL, &error);
-	if (!ret) {
-		weston_log("colord: failed to contact daemon: %s\n", error->message);
-		g_error_free(error);
-		colord_module_destroy(cms);
-		return -1;
-	}
 	g_mutex_init(&cms->pending_mutex);
 	cms->devices = g_hash_table_new_full(g_str_hash, g_str_equal,
-					     g_free, colord_cms_output_destroy);
-
-	/* destroy */
-	cms->destroy_listener.notify = colord_notifier_destroy;
-	wl_signal_add(&ec->destroy_signal, &cms->destroy_listener);
-
-	/* devices added */
-	cms->output_created_listener.notify = colord_notifier_output_created;
-	wl_signal_add(&ec->output_created_signal, &cms->output_created_listener);
+					     g_free, colord_device_destroy);
 
 	/* add all the PNP IDs */
 	cms->pnp_ids = g_hash_table_new_full(g_str_hash,
@@ -542,10 +845,14 @@ wet_module_init(struct weston_compositor *ec,
 					     NULL);
 	colord_load_pnp_ids(cms);
 
-	/* setup a thread for the GLib callbacks */
-	cms->loop = g_main_loop_new(NULL, FALSE);
-	cms->thread = g_thread_new("colord CMS main loop",
-				   colord_run_loop_thread, cms);
+	cms->cache_dir = g_build_filename(g_get_user_cache_dir(),
+					  "weston", "colord", NULL);
+	if (g_mkdir_with_parents(cms->cache_dir, 0700) < 0) {
+		weston_log("colord: not caching profiles in %s: %m\n",
+			   cms->cache_dir);
+		g_free(cms->cache_dir);
+		cms->cache_dir = NULL;
+	}
 
 	/* batch device<->profile updates */
 	if (pipe2(fd, O_CLOEXEC) == -1) {
@@ -564,5 +871,26 @@ wet_module_init(struct weston_compositor *ec,
 		colord_module_destroy(cms);
 		return -1;
 	}
+
+	/* setup a thread for the GLib callbacks */
+	cms->context = g_main_context_new();
+	cms->loop = g_main_loop_new(cms->context, FALSE);
+	cms->thread = g_thread_new("colord CMS main loop",
+				   colord_run_loop_thread, cms);
+
+	/* destroy */
+	cms->destroy_listener.notify = colord_notifier_destroy;
+	wl_signal_add(&ec->destroy_signal, &cms->destroy_listener);
+
+	/* devices added */
+	cms->output_created_listener.notify = colord_notifier_output_created;
+	wl_signal_add(&ec->output_created_signal, &cms->output_created_listener);
+
+	/* coldplug outputs */
+	wl_list_for_each(o, &ec->output_list, link) {
+		weston_log("colord: output %s coldplugged\n", o->name);
+		colord_output_created(cms, o);
+	}
+
 	return 0;
 }
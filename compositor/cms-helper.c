@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
@@ -53,6 +54,175 @@ weston_cms_gamma_clear(struct weston_output *o)
 	o->set_gamma(o, o->gamma_size, red, red, red);
 	free(red);
 }
+
+static uint16_t
+cms_curve_value(const cmsToneCurve *first, const cmsToneCurve *then,
+		cmsFloat32Number in)
+{
+	cmsFloat32Number out;
+
+	out = cmsEvalToneCurveFloat(first, in);
+	if (then)
+		out = cmsEvalToneCurveFloat(then, out);
+
+	if (out < 0.0f)
+		out = 0.0f;
+	if (out > 1.0f)
+		out = 1.0f;
+
+	return out * (double) 0xffff;
+}
+
+static uint16_t *
+cms_sample_curve(const cmsToneCurve *first, const cmsToneCurve *then,
+		 uint32_t size)
+{
+	uint16_t *lut;
+	uint32_t i;
+
+	lut = calloc(size, sizeof *lut);
+	if (!lut)
+		return NULL;
+
+	for (i = 0; i < size; i++)
+		lut[i] = cms_curve_value(first, then,
+					 (cmsFloat32Number) i /
+					 (cmsFloat32Number) (size - 1));
+
+	return lut;
+}
+
+/* Columns are the XYZ of the red, green and blue primaries */
+static bool
+cms_read_colorants(cmsHPROFILE profile, double m[9])
+{
+	static const cmsTagSignature tags[3] = {
+		cmsSigRedColorantTag,
+		cmsSigGreenColorantTag,
+		cmsSigBlueColorantTag,
+	};
+	const cmsCIEXYZ *xyz;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		xyz = cmsReadTag(profile, tags[i]);
+		if (!xyz)
+			return false;
+
+		m[0 * 3 + i] = xyz->X;
+		m[1 * 3 + i] = xyz->Y;
+		m[2 * 3 + i] = xyz->Z;
+	}
+
+	return true;
+}
+
+static bool
+cms_invert_3x3(double out[9], const double m[9])
+{
+	double det;
+
+	det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+	      m[1] * (m[3] * m[8] - m[5] * m[6]) +
+	      m[2] * (m[3] * m[7] - m[4] * m[6]);
+	if (det > -1e-9 && det < 1e-9)
+		return false;
+
+	out[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+	out[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+	out[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+	out[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+	out[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+	out[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+	out[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+	out[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+	out[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+
+	return true;
+}
+
+/* Convert sRGB content to the profile in the display hardware: the sRGB
+ * curves to linear light, a matrix from sRGB to the display primaries,
+ * then the inverse of the display curves followed by the VCGT. Only
+ * matrix/shaper profiles can be expressed this way. */
+static int
+weston_cms_set_hw_pipeline(struct weston_output *o,
+			   struct weston_color_profile *p,
+			   const cmsToneCurve **vcgt)
+{
+	static const cmsTagSignature trc_tags[3] = {
+		cmsSigRedTRCTag,
+		cmsSigGreenTRCTag,
+		cmsSigBlueTRCTag,
+	};
+	struct weston_color_pipeline pipeline;
+	cmsHPROFILE srgb;
+	const cmsToneCurve *srgb_trc, *trc;
+	cmsToneCurve *inverse_trc[3] = { NULL, NULL, NULL };
+	double srgb_m[9], out_m[9], out_inv[9], ctm[9];
+	int i, j, k;
+	int ret = -1;
+
+	if (!o->set_color_pipeline || o->degamma_lut_size < 2 ||
+	    o->gamma_lut_size < 2 || !cmsIsMatrixShaper(p->lcms_handle))
+		return -1;
+
+	srgb = cmsCreate_sRGBProfile();
+	if (!srgb)
+		return -1;
+
+	memset(&pipeline, 0, sizeof pipeline);
+
+	if (!cms_read_colorants(srgb, srgb_m) ||
+	    !cms_read_colorants(p->lcms_handle, out_m) ||
+	    !cms_invert_3x3(out_inv, out_m))
+		goto out;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			ctm[i * 3 + j] = 0;
+			for (k = 0; k < 3; k++)
+				ctm[i * 3 + j] += out_inv[i * 3 + k] *
+						  srgb_m[k * 3 + j];
+		}
+	}
+	pipeline.ctm = ctm;
+
+	for (i = 0; i < 3; i++) {
+		srgb_trc = cmsReadTag(srgb, trc_tags[i]);
+		trc = cmsReadTag(p->lcms_handle, trc_tags[i]);
+		if (!srgb_trc || !trc)
+			goto out;
+
+		inverse_trc[i] = cmsReverseToneCurve(trc);
+		if (!inverse_trc[i])
+			goto out;
+
+		pipeline.degamma[i] = cms_sample_curve(srgb_trc, NULL,
+						       o->degamma_lut_size);
+		pipeline.gamma[i] = cms_sample_curve(inverse_trc[i],
+						     vcgt ? vcgt[i] : NULL,
+						     o->gamma_lut_size);
+		if (!pipeline.degamma[i] || !pipeline.gamma[i])
+			goto out;
+	}
+
+	ret = o->set_color_pipeline(o, &pipeline);
+	if (ret == 0)
+		weston_log("Output %s: ICC profile applied by the display\n",
+			   o->name);
+
+out:
+	for (i = 0; i < 3; i++) {
+		free(pipeline.degamma[i]);
+		free(pipeline.gamma[i]);
+		if (inverse_trc[i])
+			cmsFreeToneCurve(inverse_trc[i]);
+	}
+	cmsCloseProfile(srgb);
+
+	return ret;
+}
 #endif
 
 void
@@ -68,16 +238,28 @@ weston_cms_set_color_profile(struct weston_output *o,
 	uint16_t *green = NULL;
 	uint16_t *blue = NULL;
 
-	if (!o->set_gamma)
-		return;
 	if (!p) {
+		if (o->set_color_pipeline)
+			o->set_color_pipeline(o, NULL);
 		weston_cms_gamma_clear(o);
 		return;
 	}
 
 	weston_log("Using ICC profile %s\n", p->filename);
 	vcgt = cmsReadTag (p->lcms_handle, cmsSigVcgtTag);
-	if (vcgt == NULL || vcgt[0] == NULL) {
+	if (vcgt != NULL && vcgt[0] == NULL)
+		vcgt = NULL;
+
+	if (weston_cms_set_hw_pipeline(o, p, vcgt) == 0)
+		return;
+
+	/* Fall back to loading the calibration curves only */
+	if (o->set_color_pipeline)
+		o->set_color_pipeline(o, NULL);
+
+	if (!o->set_gamma)
+		return;
+	if (vcgt == NULL) {
 		weston_cms_gamma_clear(o);
 		return;
 	}
@@ -33,14 +33,20 @@
 #include <signal.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/inotify.h>
 #include <libinput.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #include <linux/limits.h>
 
 #ifdef HAVE_LIBUNWIND
@@ -79,42 +85,308 @@ struct wet_compositor {
 	struct wet_output_config *parsed_options;
 	struct wl_listener pending_output_listener;
 	bool drm_use_current_mode;
+
+	struct timespec start_time;
+	int32_t first_frame_msec; /* -1 until the first frame is up */
+	struct wl_listener first_frame_listener;
+	struct wl_list deferred_modules; /* wet_deferred_module::link */
+	struct wl_event_source *deferred_modules_timer;
+
+	int config_watch_fd;
+	struct wl_event_source *config_watch_source;
+	struct wl_signal config_changed_signal;
+
+	const char *log_scopes_option;
+	struct wl_listener log_scopes_listener;
 };
 
-static FILE *weston_logfile = NULL;
+/* Modules that nothing on screen depends on, loaded once the first frame
+ * is up rather than in its way. */
+static const char * const late_modules[] = {
+	"cms-colord.so",
+	"screen-share.so",
+};
 
-static int cached_tm_mday = -1;
+/* Late modules are loaded at the latest this long after startup, in
+ * case no output ever presents a frame. */
+#define DEFERRED_MODULES_TIMEOUT_MS 3000
 
-static int weston_log_timestamp(void)
+struct wet_deferred_module {
+	char *name;
+	struct wl_list link;
+};
+
+static FILE *weston_logfile = NULL;
+
+/* Day of the last timestamp, for the Date line */
+static int log_tm_mday = -1;
+
+/* Log lines are formatted by the caller and copied into a ring that a
+ * writer thread drains, so a log file on slow storage does not stall
+ * the compositor. When the ring is full, lines are dropped and counted
+ * instead of waited for. Logging to stderr stays synchronous. */
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_LINE_SIZE 512
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	char *ring;
+	/* Free-running byte counts; head is written, tail is drained */
+	size_t head, tail;
+	/* What is in the file, and whether the crash handler took over
+	 * writing; both only change with the log file locked */
+	size_t written;
+	bool crashed;
+	unsigned int dropped;
+	bool running;
+	bool stop;
+} log_writer;
+
+/* Called from any thread that logs, such as the input and render
+ * threads, so nothing here is shared but the day. */
+static int
+log_timestamp(char *buf, size_t size)
 {
 	struct timeval tv;
-	struct tm *brokendown_time;
+	struct tm brokendown_time;
 	char string[128];
+	int l = 0;
 
 	gettimeofday(&tv, NULL);
 
-	brokendown_time = localtime(&tv.tv_sec);
-	if (brokendown_time == NULL)
-		return fprintf(weston_logfile, "[(NULL)localtime] ");
+	if (localtime_r(&tv.tv_sec, &brokendown_time) == NULL)
+		return snprintf(buf, size, "[(NULL)localtime] ");
 
-	if (brokendown_time->tm_mday != cached_tm_mday) {
-		strftime(string, sizeof string, "%Y-%m-%d %Z", brokendown_time);
-		fprintf(weston_logfile, "Date: %s\n", string);
+	if (__atomic_exchange_n(&log_tm_mday, brokendown_time.tm_mday,
+				__ATOMIC_RELAXED) != brokendown_time.tm_mday) {
+		strftime(string, sizeof string, "%Y-%m-%d %Z",
+			 &brokendown_time);
+		l = snprintf(buf, size, "Date: %s\n", string);
+	}
 
-		cached_tm_mday = brokendown_time->tm_mday;
+	strftime(string, sizeof string, "%H:%M:%S", &brokendown_time);
+
+	return l + snprintf(buf + l, size - l, "[%s.%03li] ",
+			    string, tv.tv_usec / 1000);
+}
+
+static int
+log_write(const char *buf, size_t len)
+{
+	size_t offset, n;
+
+	if (!log_writer.running)
+		return fwrite(buf, 1, len, weston_logfile);
+
+	pthread_mutex_lock(&log_writer.mutex);
+
+	if (LOG_RING_SIZE - (log_writer.head - log_writer.tail) < len) {
+		log_writer.dropped++;
+		pthread_mutex_unlock(&log_writer.mutex);
+		return 0;
 	}
 
-	strftime(string, sizeof string, "%H:%M:%S", brokendown_time);
+	offset = log_writer.head % LOG_RING_SIZE;
+	n = MIN(len, LOG_RING_SIZE - offset);
+	memcpy(log_writer.ring + offset, buf, n);
+	memcpy(log_writer.ring, buf + n, len - n);
+	log_writer.head += len;
+
+	pthread_cond_signal(&log_writer.cond);
+	pthread_mutex_unlock(&log_writer.mutex);
 
-	return fprintf(weston_logfile, "[%s.%03li] ", string, tv.tv_usec/1000);
+	return len;
+}
+
+static void
+log_write_ring(size_t tail, size_t head)
+{
+	size_t offset, n;
+
+	offset = tail % LOG_RING_SIZE;
+	n = MIN(head - tail, LOG_RING_SIZE - offset);
+	fwrite(log_writer.ring + offset, 1, n, weston_logfile);
+	fwrite(log_writer.ring, 1, head - tail - n, weston_logfile);
+}
+
+static void *
+log_writer_thread(void *data)
+{
+	size_t head, tail;
+	unsigned int dropped;
+
+	pthread_mutex_lock(&log_writer.mutex);
+	for (;;) {
+		while (log_writer.head == log_writer.tail &&
+		       !log_writer.dropped && !log_writer.stop)
+			pthread_cond_wait(&log_writer.cond, &log_writer.mutex);
+
+		if (log_writer.head == log_writer.tail &&
+		    !log_writer.dropped)
+			break;
+
+		head = log_writer.head;
+		tail = log_writer.tail;
+		dropped = log_writer.dropped;
+		log_writer.dropped = 0;
+
+		/* Writers only append past head, so the range up to it
+		 * stays put while we write it out. */
+		pthread_mutex_unlock(&log_writer.mutex);
+
+		/* The file lock is never held while waiting for the mutex,
+		 * so the crash handler can always get it. */
+		flockfile(weston_logfile);
+		if (log_writer.crashed) {
+			funlockfile(weston_logfile);
+			return NULL;
+		}
+		log_write_ring(tail, head);
+		log_writer.written = head;
+		if (dropped)
+			fprintf(weston_logfile,
+				"Log ring full, dropped %u messages\n",
+				dropped);
+		fflush(weston_logfile);
+		funlockfile(weston_logfile);
+
+		pthread_mutex_lock(&log_writer.mutex);
+		log_writer.tail = head;
+	}
+	pthread_mutex_unlock(&log_writer.mutex);
+
+	return NULL;
+}
+
+static void
+log_writer_atfork_child(void)
+{
+	/* The writer thread does not exist in a forked child */
+	log_writer.running = false;
+}
+
+static void
+log_writer_start(void)
+{
+	static bool atfork_registered;
+	sigset_t mask, old_mask;
+	int ret;
+
+	log_writer.ring = malloc(LOG_RING_SIZE);
+	if (!log_writer.ring)
+		return;
+
+	log_writer.head = 0;
+	log_writer.tail = 0;
+	log_writer.written = 0;
+	log_writer.crashed = false;
+	log_writer.dropped = 0;
+	log_writer.stop = false;
+	pthread_mutex_init(&log_writer.mutex, NULL);
+	pthread_cond_init(&log_writer.cond, NULL);
+
+	/* Signals are handled through the compositor's event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&log_writer.thread, NULL,
+			     log_writer_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0) {
+		pthread_mutex_destroy(&log_writer.mutex);
+		pthread_cond_destroy(&log_writer.cond);
+		free(log_writer.ring);
+		log_writer.ring = NULL;
+		return;
+	}
+
+	if (!atfork_registered) {
+		pthread_atfork(NULL, NULL, log_writer_atfork_child);
+		atfork_registered = true;
+	}
+
+	log_writer.running = true;
+}
+
+static void
+log_writer_stop(void)
+{
+	if (!log_writer.running)
+		return;
+
+	pthread_mutex_lock(&log_writer.mutex);
+	log_writer.stop = true;
+	pthread_cond_signal(&log_writer.cond);
+	pthread_mutex_unlock(&log_writer.mutex);
+
+	pthread_join(log_writer.thread, NULL);
+	log_writer.running = false;
+
+	pthread_mutex_destroy(&log_writer.mutex);
+	pthread_cond_destroy(&log_writer.cond);
+	free(log_writer.ring);
+	log_writer.ring = NULL;
+}
+
+/* For the crash handler: write out what is still queued without taking
+ * the mutex, which the crashing thread may hold, and log synchronously
+ * from here on. Holding the file lock waits out a range the writer
+ * thread is in the middle of, and keeps it from taking another. */
+static void
+log_writer_flush_for_crash(void)
+{
+	if (!log_writer.running)
+		return;
+
+	flockfile(weston_logfile);
+	log_writer.crashed = true;
+	log_writer.running = false;
+	log_write_ring(log_writer.written, log_writer.head);
+	log_writer.written = log_writer.head;
+	fflush(weston_logfile);
+	funlockfile(weston_logfile);
+}
+
+static int
+log_vformat(bool timestamp, const char *prefix, const char *fmt, va_list ap)
+{
+	char line[LOG_LINE_SIZE];
+	char *buf = line;
+	va_list aq;
+	int l = 0, n;
+
+	if (timestamp)
+		l = log_timestamp(line, sizeof line);
+	if (prefix)
+		l += snprintf(line + l, sizeof line - l, "%s", prefix);
+
+	va_copy(aq, ap);
+	n = vsnprintf(line + l, sizeof line - l, fmt, aq);
+	va_end(aq);
+	if (n < 0)
+		return n;
+
+	if ((size_t) n >= sizeof line - l) {
+		buf = malloc(l + n + 1);
+		if (!buf)
+			return -1;
+		memcpy(buf, line, l);
+		vsnprintf(buf + l, n + 1, fmt, ap);
+	}
+
+	n = log_write(buf, l + n);
+
+	if (buf != line)
+		free(buf);
+
+	return n;
 }
 
 static void
 custom_handler(const char *fmt, va_list arg)
 {
-	weston_log_timestamp();
-	fprintf(weston_logfile, "libwayland: ");
-	vfprintf(weston_logfile, fmt, arg);
+	log_vformat(true, "libwayland: ", fmt, arg);
 }
 
 static void
@@ -128,15 +400,19 @@ weston_log_file_open(const char *filename)
 			os_fd_set_cloexec(fileno(weston_logfile));
 	}
 
-	if (weston_logfile == NULL)
+	if (weston_logfile == NULL) {
 		weston_logfile = stderr;
-	else
+	} else {
 		setvbuf(weston_logfile, NULL, _IOLBF, 256);
+		log_writer_start();
+	}
 }
 
 static void
 weston_log_file_close(void)
 {
+	log_writer_stop();
+
 	if ((weston_logfile != stderr) && (weston_logfile != NULL))
 		fclose(weston_logfile);
 	weston_logfile = stderr;
@@ -145,18 +421,13 @@ weston_log_file_close(void)
 static int
 vlog(const char *fmt, va_list ap)
 {
-	int l;
-
-	l = weston_log_timestamp();
-	l += vfprintf(weston_logfile, fmt, ap);
-
-	return l;
+	return log_vformat(true, NULL, fmt, ap);
 }
 
 static int
 vlog_continue(const char *fmt, va_list argp)
 {
-	return vfprintf(weston_logfile, fmt, argp);
+	return log_vformat(false, NULL, fmt, argp);
 }
 
 static struct wl_list child_process_list;
@@ -269,37 +540,79 @@ print_backtrace(void)
 
 #endif
 
-static void
-child_client_exec(int sockfd, const char *path)
+/* The environment of the compositor, with WAYLAND_SOCKET pointing at the
+ * client end of the socket */
+static char **
+client_environ(int sockfd)
 {
-	int clientfd;
-	char s[32];
-	sigset_t allsigs;
+	char **env;
+	size_t i, n = 0;
 
-	/* do not give our signal mask to the new process */
-	sigfillset(&allsigs);
-	sigprocmask(SIG_UNBLOCK, &allsigs, NULL);
+	for (i = 0; environ[i]; i++)
+		n++;
 
-	/* Launch clients as the user. Do not lauch clients with wrong euid.*/
-	if (seteuid(getuid()) == -1) {
-		weston_log("compositor: failed seteuid\n");
-		return;
+	env = calloc(n + 2, sizeof *env);
+	if (!env)
+		return NULL;
+
+	if (asprintf(&env[0], "WAYLAND_SOCKET=%d", sockfd) < 0) {
+		free(env);
+		return NULL;
 	}
 
-	/* SOCK_CLOEXEC closes both ends, so we dup the fd to get a
-	 * non-CLOEXEC fd to pass through exec. */
-	clientfd = dup(sockfd);
-	if (clientfd == -1) {
-		weston_log("compositor: dup failed: %m\n");
-		return;
+	for (i = 0, n = 1; environ[i]; i++)
+		if (strncmp(environ[i], "WAYLAND_SOCKET=", 15) != 0)
+			env[n++] = environ[i];
+
+	return env;
+}
+
+/* posix_spawn() does not copy the address space of the compositor, and
+ * its page tables with it, the way fork() does, which gets expensive
+ * once the GPU buffers are mapped. */
+static pid_t
+spawn_client(int sockfd, const char *path)
+{
+	posix_spawnattr_t attr;
+	sigset_t nosigs;
+	char *argv[] = { (char *) path, NULL };
+	char **env;
+	pid_t pid;
+	int ret;
+
+	env = client_environ(sockfd);
+	if (!env) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	snprintf(s, sizeof s, "%d", clientfd);
-	setenv("WAYLAND_SOCKET", s, 1);
+	/* Do not give our signal mask to the new process, and launch
+	 * clients as the user. */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&nosigs);
+	posix_spawnattr_setsigmask(&attr, &nosigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+					POSIX_SPAWN_RESETIDS);
+
+	/* SOCK_CLOEXEC closes both ends, so the client end is let through
+	 * exec for as long as it takes to spawn. Only this thread starts
+	 * processes, so it cannot leak anywhere else. */
+	ret = fcntl(sockfd, F_SETFD, 0);
+	if (ret == 0)
+		ret = posix_spawn(&pid, path, NULL, &attr, argv, env);
+	else
+		ret = errno;
 
-	if (execl(path, path, NULL) < 0)
-		weston_log("compositor: executing '%s' failed: %m\n",
-			path);
+	posix_spawnattr_destroy(&attr);
+	free(env[0]);
+	free(env);
+
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	return pid;
 }
 
 WL_EXPORT struct wl_client *
@@ -321,22 +634,15 @@ weston_client_launch(struct weston_compositor *compositor,
 		return NULL;
 	}
 
-	pid = fork();
+	pid = spawn_client(sv[1], path);
+	close(sv[1]);
 	if (pid == -1) {
 		close(sv[0]);
-		close(sv[1]);
 		weston_log("weston_client_launch: "
-			"fork failed while launching '%s': %m\n", path);
+			"executing '%s' failed: %m\n", path);
 		return NULL;
 	}
 
-	if (pid == 0) {
-		child_client_exec(sv[1], path);
-		_exit(-1);
-	}
-
-	close(sv[1]);
-
 	client = wl_client_create(compositor->wl_display, sv[0]);
 	if (!client) {
 		close(sv[0]);
@@ -477,6 +783,150 @@ wet_get_config(struct weston_compositor *ec)
 	return compositor->config;
 }
 
+/** Get notified of config sections changed on disk
+ *
+ * The listener is called with the struct weston_config_section that
+ * changed, was added or was removed (and is then empty), once the
+ * config file has been reloaded.
+ */
+WL_EXPORT void
+wet_add_config_changed_listener(struct weston_compositor *ec,
+				struct wl_listener *listener)
+{
+	struct wet_compositor *compositor = to_wet_compositor(ec);
+
+	wl_signal_add(&compositor->config_changed_signal, listener);
+}
+
+static void
+config_section_changed(struct weston_config_section *section,
+		       const char *name, void *data)
+{
+	struct wet_compositor *wet = data;
+
+	weston_log("config: section [%s] changed\n", name);
+	wl_signal_emit(&wet->config_changed_signal, section);
+}
+
+/* The command line overrides weston.ini, scope by scope. */
+static void
+wet_configure_log_scopes(struct wet_compositor *wet)
+{
+	struct weston_config_section *section;
+	char *scopes;
+
+	section = weston_config_get_section(wet->config, "core", NULL, NULL);
+	weston_config_section_get_string(section, "log-scopes", &scopes, NULL);
+	if (scopes && weston_log_scopes_configure(scopes) < 0)
+		weston_log("warning: invalid log-scopes '%s' in config\n",
+			   scopes);
+	free(scopes);
+
+	if (wet->log_scopes_option &&
+	    weston_log_scopes_configure(wet->log_scopes_option) < 0)
+		weston_log("warning: invalid --log-scopes '%s'\n",
+			   wet->log_scopes_option);
+}
+
+static void
+log_scopes_config_changed(struct wl_listener *listener, void *data)
+{
+	struct wet_compositor *wet =
+		container_of(listener, struct wet_compositor,
+			     log_scopes_listener);
+
+	if (data == weston_config_get_section(wet->config, "core", NULL, NULL))
+		wet_configure_log_scopes(wet);
+}
+
+static int
+config_watch_handler(int fd, uint32_t mask, void *data)
+{
+	struct wet_compositor *wet = data;
+	const char *path = weston_config_get_full_path(wet->config);
+	const char *file = strrchr(path, '/') + 1;
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + len;
+		     p += sizeof *event + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->len && strcmp(event->name, file) == 0)
+				changed = true;
+		}
+	}
+
+	if (!changed)
+		return 1;
+
+	if (weston_config_reload(wet->config, config_section_changed, wet) < 0)
+		weston_log("config: failed to reload '%s', "
+			   "keeping the previous config\n", path);
+
+	return 1;
+}
+
+/* Editors either rewrite the file or rename a new one over it, so
+ * watch the directory. */
+static void
+wet_watch_config(struct wet_compositor *wet, struct wl_event_loop *loop)
+{
+	char dir[PATH_MAX];
+	const char *path;
+	char *slash;
+
+	if (!wet->config)
+		return;
+
+	path = weston_config_get_full_path(wet->config);
+	if (strlen(path) >= sizeof dir)
+		return;
+	strcpy(dir, path);
+	slash = strrchr(dir, '/');
+	if (!slash)
+		return;
+	*slash = '\0';
+
+	wet->config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (wet->config_watch_fd < 0)
+		return;
+
+	if (inotify_add_watch(wet->config_watch_fd, dir[0] ? dir : "/",
+			      IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		goto err;
+
+	wet->config_watch_source =
+		wl_event_loop_add_fd(loop, wet->config_watch_fd,
+				     WL_EVENT_READABLE,
+				     config_watch_handler, wet);
+	if (!wet->config_watch_source)
+		goto err;
+
+	return;
+
+err:
+	weston_log("config: not watching '%s' for changes\n", path);
+	close(wet->config_watch_fd);
+	wet->config_watch_fd = -1;
+}
+
+static void
+wet_unwatch_config(struct wet_compositor *wet)
+{
+	if (wet->config_watch_source)
+		wl_event_source_remove(wet->config_watch_source);
+	wet->config_watch_source = NULL;
+
+	if (wet->config_watch_fd >= 0)
+		close(wet->config_watch_fd);
+	wet->config_watch_fd = -1;
+}
+
 static const char xdg_error_message[] =
 	"fatal: environment variable XDG_RUNTIME_DIR is not set.\n";
 
@@ -555,6 +1005,9 @@ usage(int error_code)
 		"  -i, --idle-time=SECS\tIdle time in seconds\n"
 		"  --modules\t\tLoad the comma-separated list of modules\n"
 		"  --log=FILE\t\tLog to the given file\n"
+		"  --log-scopes=SCOPE:LEVEL,...\n"
+		"\t\t\tSet the log level of each scope\n"
+		"  --debug\t\tLet clients stream log scopes with weston-debug\n"
 		"  -c, --config=FILE\tConfig file to load, defaults to weston.ini\n"
 		"  --no-config\t\tDo not read weston.ini\n"
 		"  -h, --help\t\tThis help message\n\n");
@@ -574,6 +1027,7 @@ usage(int error_code)
 		"Options for fbdev-backend.so:\n\n"
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --device=DEVICE\tThe framebuffer device to use\n"
+		"  --double-buffer\tPan between two buffers to avoid tearing\n"
 		"\n");
 #endif
 
@@ -585,7 +1039,11 @@ usage(int error_code)
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
+		"  --use-gl\t\tUse the GL renderer into pbuffers (default: no rendering)\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
+		"  --num-outputs=N\tCreate N virtual outputs (default: 1)\n"
+		"  --refresh=mHz\t\tRefresh rate of the outputs in mHz (default: 60000)\n"
+		"  --jitter=USEC\t\tComplete frames late by up to USEC microseconds\n"
 		"\n");
 #endif
 
@@ -598,6 +1056,7 @@ usage(int error_code)
 		"  --address=ADDR\tThe address to bind\n"
 		"  --port=PORT\t\tThe port to listen on\n"
 		"  --no-clients-resize\tThe RDP peers will be forced to the size of the desktop\n"
+		"  --use-gl\t\tRender with the GL renderer instead of pixman\n"
 		"  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
 		"  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
 		"  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
@@ -642,6 +1101,13 @@ static int on_term_signal(int signal_number, void *data)
 	return 1;
 }
 
+static int on_timeline_signal(int signal_number, void *data)
+{
+	weston_timeline_ring_dump();
+
+	return 1;
+}
+
 static void
 on_caught_signal(int s, siginfo_t *siginfo, void *context)
 {
@@ -653,6 +1119,8 @@ on_caught_signal(int s, siginfo_t *siginfo, void *context)
 	 * will allow weston to switch back to gdb on crash and then
 	 * gdb will catch the crash with SIGTRAP.*/
 
+	log_writer_flush_for_crash();
+
 	weston_log("caught signal: %d\n", s);
 
 	print_backtrace();
@@ -844,6 +1312,161 @@ wet_load_shell(struct weston_compositor *compositor,
 	return 0;
 }
 
+static bool
+wet_module_is_late(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	unsigned int i;
+
+	base = base ? base + 1 : name;
+
+	for (i = 0; i < ARRAY_LENGTH(late_modules); i++)
+		if (strcmp(base, late_modules[i]) == 0)
+			return true;
+
+	return false;
+}
+
+static void
+wet_load_deferred_modules(struct wet_compositor *wet,
+			  struct weston_compositor *ec)
+{
+	struct wet_deferred_module *module, *next;
+	char *argv[] = { "weston", NULL };
+	int argc = 1;
+	int failed = 0;
+
+	if (wet->deferred_modules_timer) {
+		wl_event_source_remove(wet->deferred_modules_timer);
+		wet->deferred_modules_timer = NULL;
+	}
+
+	wl_list_for_each_safe(module, next, &wet->deferred_modules, link) {
+		if (wet_load_module(ec, module->name, &argc, argv) < 0)
+			failed = 1;
+
+		wl_list_remove(&module->link);
+		free(module->name);
+		free(module);
+	}
+
+	/* As fatal as it would have been during startup */
+	if (failed) {
+		weston_log("fatal: failed to load a deferred module\n");
+		ec->exit_code = EXIT_FAILURE;
+		wl_display_terminate(ec->wl_display);
+	}
+}
+
+static int
+deferred_modules_timeout(void *data)
+{
+	struct weston_compositor *ec = data;
+
+	weston_log("no frame presented yet, loading deferred modules\n");
+	wet_load_deferred_modules(to_wet_compositor(ec), ec);
+
+	return 0;
+}
+
+static void
+handle_first_frame(struct wl_listener *listener, void *data)
+{
+	struct wet_compositor *wet =
+		container_of(listener, struct wet_compositor,
+			     first_frame_listener);
+	struct weston_output *output = data;
+	struct timespec now;
+
+	wl_list_remove(&wet->first_frame_listener.link);
+	wl_list_init(&wet->first_frame_listener.link);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wet->first_frame_msec = (now.tv_sec - wet->start_time.tv_sec) * 1000 +
+		(now.tv_nsec - wet->start_time.tv_nsec) / 1000000;
+	weston_log("first frame presented on %s after %d ms\n",
+		   output->name, wet->first_frame_msec);
+
+	wet_load_deferred_modules(wet, output->compositor);
+}
+
+static void
+wet_init_deferred_modules(struct wet_compositor *wet)
+{
+	wet->first_frame_msec = -1;
+	wl_list_init(&wet->first_frame_listener.link);
+	wl_list_init(&wet->deferred_modules);
+	wet->deferred_modules_timer = NULL;
+}
+
+static void
+wet_release_deferred_modules(struct wet_compositor *wet)
+{
+	struct wet_deferred_module *module, *next;
+
+	wl_list_remove(&wet->first_frame_listener.link);
+	wl_list_init(&wet->first_frame_listener.link);
+
+	if (wet->deferred_modules_timer)
+		wl_event_source_remove(wet->deferred_modules_timer);
+	wet->deferred_modules_timer = NULL;
+
+	wl_list_for_each_safe(module, next, &wet->deferred_modules, link) {
+		wl_list_remove(&module->link);
+		free(module->name);
+		free(module);
+	}
+}
+
+static int
+wet_defer_module(struct weston_compositor *ec, const char *name)
+{
+	struct wet_compositor *wet = to_wet_compositor(ec);
+	struct wet_deferred_module *module;
+	struct wl_event_loop *loop;
+
+	module = zalloc(sizeof *module);
+	if (!module)
+		return -1;
+
+	module->name = strdup(name);
+	if (!module->name) {
+		free(module);
+		return -1;
+	}
+
+	if (!wet->deferred_modules_timer) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		wet->deferred_modules_timer =
+			wl_event_loop_add_timer(loop, deferred_modules_timeout,
+						ec);
+		if (!wet->deferred_modules_timer) {
+			free(module->name);
+			free(module);
+			return -1;
+		}
+		wl_event_source_timer_update(wet->deferred_modules_timer,
+					     DEFERRED_MODULES_TIMEOUT_MS);
+	}
+
+	weston_log("Deferring module '%s' until the first frame\n", name);
+	wl_list_insert(wet->deferred_modules.prev, &module->link);
+
+	return 0;
+}
+
+/** Time from startup until the first frame was presented
+ *
+ * \param ec The compositor.
+ * \return The time in milliseconds, or -1 if no frame has been
+ * presented yet.
+ */
+WL_EXPORT int32_t
+wet_get_first_frame_msec(struct weston_compositor *ec)
+{
+	return to_wet_compositor(ec)->first_frame_msec;
+}
+
 static int
 load_modules(struct weston_compositor *ec, const char *modules,
 	     int *argc, char *argv[], int32_t *xwayland)
@@ -865,6 +1488,10 @@ load_modules(struct weston_compositor *ec, const char *modules,
 				   "or set xwayland=true in the [core] section "
 				   "in weston.ini\n");
 			*xwayland = 1;
+		} else if (wet_module_is_late(buffer) &&
+			   !ec->first_frame_presented) {
+			if (wet_defer_module(ec, buffer) < 0)
+				return -1;
 		} else {
 			if (wet_load_module(ec, buffer, argc, argv) < 0)
 				return -1;
@@ -885,7 +1512,27 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_margin;
+	int repaint_adaptive;
+	int low_latency_scanout;
+	int content_rate_switching;
+	int renderer_threads;
+	int offscreen_transform;
+	int pixman_early_release;
+	int pixman_buffers;
+	int texture_evict_timeout;
+	int damage_merge_overdraw;
+	int damage_max_rects;
+	int damage_hash;
+	int resize_sync_timeout;
+	int idle_frame_rate;
+	int idle_dpms_time;
+	int timeline_ring;
+	int timeline_seconds;
 	int vt_switching;
+	int coalesce_motion;
+	int input_thread;
+	int clipboard_max_size;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
@@ -923,6 +1570,138 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "adaptive-repaint",
+				       &repaint_adaptive, false);
+	ec->repaint_adaptive = repaint_adaptive;
+
+	weston_config_section_get_int(s, "repaint-margin", &repaint_margin,
+				      ec->repaint_margin_usec);
+	if (repaint_margin < 0 || repaint_margin > 1000000) {
+		weston_log("Invalid repaint-margin value in config: %d\n",
+			   repaint_margin);
+	} else {
+		ec->repaint_margin_usec = repaint_margin;
+	}
+	if (ec->repaint_adaptive)
+		weston_log("Adaptive repaint window enabled, %d us margin.\n",
+			   ec->repaint_margin_usec);
+
+	weston_config_section_get_bool(s, "low-latency-scanout",
+				       &low_latency_scanout, false);
+	ec->low_latency_scanout = low_latency_scanout;
+
+	weston_config_section_get_bool(s, "content-rate-switching",
+				       &content_rate_switching, false);
+	ec->content_rate_switching = content_rate_switching;
+
+	weston_config_section_get_int(s, "renderer-threads", &renderer_threads,
+				      0);
+	if (renderer_threads < 0 || renderer_threads > 64) {
+		weston_log("Invalid renderer-threads value in config: %d\n",
+			   renderer_threads);
+	} else {
+		ec->renderer_threads = renderer_threads;
+	}
+
+	weston_config_section_get_bool(s, "offscreen-transform",
+				       &offscreen_transform, false);
+	ec->offscreen_transform = offscreen_transform;
+
+	weston_config_section_get_bool(s, "pixman-early-release",
+				       &pixman_early_release, false);
+	ec->pixman_early_release = pixman_early_release;
+
+	weston_config_section_get_int(s, "pixman-buffers", &pixman_buffers, 2);
+	if (pixman_buffers < 2 || pixman_buffers > 4) {
+		weston_log("Invalid pixman-buffers value in config: %d\n",
+			   pixman_buffers);
+	} else {
+		ec->pixman_buffer_count = pixman_buffers;
+	}
+
+	weston_config_section_get_int(s, "texture-evict-timeout",
+				      &texture_evict_timeout, 0);
+	if (texture_evict_timeout < 0) {
+		weston_log("Invalid texture-evict-timeout value in config: "
+			   "%d\n", texture_evict_timeout);
+	} else {
+		ec->texture_evict_timeout = texture_evict_timeout;
+	}
+
+	weston_config_section_get_int(s, "damage-merge-overdraw",
+				      &damage_merge_overdraw, 0);
+	if (damage_merge_overdraw < 0) {
+		weston_log("Invalid damage-merge-overdraw value in config: "
+			   "%d\n", damage_merge_overdraw);
+	} else {
+		ec->damage_merge_overdraw = damage_merge_overdraw;
+	}
+
+	weston_config_section_get_int(s, "damage-max-rects",
+				      &damage_max_rects, 0);
+	if (damage_max_rects < 0) {
+		weston_log("Invalid damage-max-rects value in config: %d\n",
+			   damage_max_rects);
+	} else {
+		ec->damage_max_rects = damage_max_rects;
+	}
+
+	weston_config_section_get_bool(s, "damage-hash", &damage_hash, false);
+	ec->damage_hash = damage_hash;
+
+	weston_config_section_get_int(s, "resize-sync-timeout",
+				      &resize_sync_timeout, 0);
+	if (resize_sync_timeout < 0) {
+		weston_log("Invalid resize-sync-timeout value in config: %d\n",
+			   resize_sync_timeout);
+	} else {
+		ec->resize_sync_timeout = resize_sync_timeout;
+	}
+
+	weston_config_section_get_int(s, "idle-frame-rate",
+				      &idle_frame_rate, 0);
+	if (idle_frame_rate < 0) {
+		weston_log("Invalid idle-frame-rate value in config: %d\n",
+			   idle_frame_rate);
+	} else {
+		ec->idle_frame_rate = idle_frame_rate;
+	}
+
+	weston_config_section_get_int(s, "idle-dpms-time",
+				      &idle_dpms_time, 0);
+	if (idle_dpms_time < 0) {
+		weston_log("Invalid idle-dpms-time value in config: %d\n",
+			   idle_dpms_time);
+	} else {
+		ec->idle_dpms_time = idle_dpms_time;
+	}
+
+	weston_config_section_get_int(s, "clipboard-max-size",
+				      &clipboard_max_size,
+				      ec->clipboard_max_size / 1024);
+	if (clipboard_max_size < 0) {
+		weston_log("Invalid clipboard-max-size value in config: %d\n",
+			   clipboard_max_size);
+	} else {
+		ec->clipboard_max_size = (size_t) clipboard_max_size * 1024;
+	}
+
+	weston_config_section_get_int(s, "timeline-ring", &timeline_ring, 0);
+	weston_config_section_get_int(s, "timeline-snapshot-seconds",
+				      &timeline_seconds, 10);
+	if (timeline_ring > 0 &&
+	    weston_timeline_ring_open(ec, (size_t) timeline_ring * 1024,
+				      timeline_seconds) < 0)
+		return -1;
+
+	s = weston_config_get_section(config, "libinput", NULL, NULL);
+	weston_config_section_get_bool(s, "coalesce_motion",
+				       &coalesce_motion, true);
+	ec->coalesce_motion = coalesce_motion;
+	weston_config_section_get_bool(s, "input_thread",
+				       &input_thread, false);
+	ec->input_thread = input_thread;
+
 	return 0;
 }
 
@@ -1069,6 +1848,19 @@ wet_output_set_transform(struct weston_output *output,
 	weston_output_set_transform(output, transform);
 }
 
+static void
+wet_output_set_occluded_frame_rate(struct weston_output *output,
+				   struct weston_config_section *section)
+{
+	int32_t rate = -1;
+
+	if (section)
+		weston_config_section_get_int(section, "occluded-frame-rate",
+					      &rate, -1);
+
+	weston_output_set_occluded_frame_rate(output, rate);
+}
+
 static int
 wet_configure_windowed_output_from_config(struct weston_output *output,
 					  struct wet_output_config *defaults)
@@ -1114,6 +1906,7 @@ wet_configure_windowed_output_from_config(struct weston_output *output,
 
 	wet_output_set_scale(output, section, defaults->scale, parsed_options->scale);
 	wet_output_set_transform(output, section, defaults->transform, parsed_options->transform);
+	wet_output_set_occluded_frame_rate(output, section);
 
 	if (api->output_set_size(output, width, height) < 0) {
 		weston_log("Cannot configure output \"%s\" using weston_windowed_output_api.\n",
@@ -1150,6 +1943,81 @@ configure_input_device(struct weston_compositor *compositor,
 	}
 }
 
+/* Mirror the output on the one its same-as key names, if that is enabled.
+ * Returns true if the output is not to be enabled on its own: it mirrors
+ * now, or waits for the output it mirrors to be enabled. */
+static bool
+drm_backend_output_same_as(struct weston_output *output,
+			   struct weston_config_section *section,
+			   const struct weston_drm_output_api *api)
+{
+	struct weston_compositor *c = output->compositor;
+	struct weston_output *source;
+	char *same_as;
+	bool done = false;
+
+	weston_config_section_get_string(section, "same-as", &same_as, NULL);
+	if (!same_as)
+		return false;
+
+	wl_list_for_each(source, &c->output_list, link) {
+		if (strcmp(source->name, same_as) != 0)
+			continue;
+
+		done = api->clone(output, source) == 0;
+		if (!done)
+			weston_log("Cannot mirror output %s on %s, "
+				   "enabling it on its own.\n",
+				   same_as, output->name);
+		free(same_as);
+		return done;
+	}
+
+	wl_list_for_each(source, &c->pending_output_list, link) {
+		if (source != output && strcmp(source->name, same_as) == 0) {
+			weston_log("Output %s waits for %s to mirror it.\n",
+				   output->name, same_as);
+			done = true;
+			break;
+		}
+	}
+
+	free(same_as);
+
+	return done;
+}
+
+/* Mirror a just enabled output on the outputs that wait for it */
+static void
+drm_backend_output_attach_clones(struct weston_output *output,
+				 const struct weston_drm_output_api *api)
+{
+	struct weston_config *wc = wet_get_config(output->compositor);
+	struct weston_config_section *section;
+	struct weston_output *clone, *next;
+	char *same_as;
+
+	wl_list_for_each_safe(clone, next,
+			      &output->compositor->pending_output_list, link) {
+		/* Only outputs configured already have their mode set */
+		if (!clone->current_mode)
+			continue;
+
+		section = weston_config_get_section(wc, "output", "name",
+						    clone->name);
+		weston_config_section_get_string(section, "same-as",
+						 &same_as, NULL);
+		if (same_as && strcmp(same_as, output->name) == 0 &&
+		    api->clone(clone, output) < 0) {
+			weston_log("Cannot mirror output %s on %s, "
+				   "enabling it on its own.\n",
+				   output->name, clone->name);
+			weston_output_enable(clone);
+		}
+		free(same_as);
+	}
+}
+
 static void
 drm_backend_output_configure(struct wl_listener *listener, void *data)
 {
@@ -1165,6 +2033,7 @@ drm_backend_output_configure(struct wl_listener *listener, void *data)
 	char *modeline = NULL;
 	char *gbm_format = NULL;
 	char *seat = NULL;
+	double render_scale;
 
 	if (!api) {
 		weston_log("Cannot use weston_drm_output_api.\n");
@@ -1195,6 +2064,7 @@ drm_backend_output_configure(struct wl_listener *listener, void *data)
 
 	wet_output_set_scale(output, section, 1, 0);
 	wet_output_set_transform(output, section, WL_OUTPUT_TRANSFORM_NORMAL, UINT32_MAX);
+	wet_output_set_occluded_frame_rate(output, section);
 
 	weston_config_section_get_string(section,
 					 "gbm-format", &gbm_format, NULL);
@@ -1207,7 +2077,15 @@ drm_backend_output_configure(struct wl_listener *listener, void *data)
 	api->set_seat(output, seat);
 	free(seat);
 
-	weston_output_enable(output);
+	weston_config_section_get_double(section, "render-scale",
+					 &render_scale, 1.0);
+	api->set_render_scale(output, render_scale);
+
+	if (drm_backend_output_same_as(output, section, api))
+		return;
+
+	if (weston_output_enable(output) == 0)
+		drm_backend_output_attach_clones(output, api);
 }
 
 static int
@@ -1217,6 +2095,7 @@ load_drm_backend(struct weston_compositor *c,
 	struct weston_drm_backend_config config = {{ 0, }};
 	struct weston_config_section *section;
 	struct wet_compositor *wet = to_wet_compositor(c);
+	int render_threads;
 	int ret = 0;
 
 	wet->drm_use_current_mode = false;
@@ -1235,6 +2114,9 @@ load_drm_backend(struct weston_compositor *c,
 	weston_config_section_get_string(section,
 					 "gbm-format", &config.gbm_format,
 					 NULL);
+	weston_config_section_get_bool(section, "render-threads",
+				       &render_threads, 0);
+	config.render_threads = render_threads;
 
 	config.base.struct_version = WESTON_DRM_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_drm_backend_config);
@@ -1273,6 +2155,9 @@ load_headless_backend(struct weston_compositor *c,
 	const struct weston_windowed_output_api *api;
 	struct weston_headless_backend_config config = {{ 0, }};
 	int no_outputs = 0;
+	int num_outputs = 1;
+	char name[32];
+	int i;
 	int ret = 0;
 	char *transform = NULL;
 
@@ -1284,8 +2169,12 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "width", 0, &parsed_options->width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &parsed_options->height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
+		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
+		{ WESTON_OPTION_INTEGER, "num-outputs", 0, &num_outputs },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &config.refresh },
+		{ WESTON_OPTION_INTEGER, "jitter", 0, &config.jitter_usec },
 	};
 
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
@@ -1318,8 +2207,16 @@ load_headless_backend(struct weston_compositor *c,
 			return -1;
 		}
 
-		if (api->output_create(c, "headless") < 0)
-			return -1;
+		/* The first output keeps its usual name, for weston.ini */
+		for (i = 0; i < num_outputs; i++) {
+			if (i == 0)
+				snprintf(name, sizeof name, "headless");
+			else
+				snprintf(name, sizeof name, "headless-%d", i);
+
+			if (api->output_create(c, name) < 0)
+				return -1;
+		}
 	}
 
 	return 0;
@@ -1373,6 +2270,7 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->use_gl = 0;
 }
 
 static int
@@ -1395,6 +2293,7 @@ load_rdp_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_STRING,  "address", 0, &config.bind_address },
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_BOOLEAN, "no-clients-resize", 0, &config.no_clients_resize },
+		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
@@ -1429,6 +2328,7 @@ fbdev_backend_output_configure(struct wl_listener *listener, void *data)
 	section = weston_config_get_section(wc, "output", "name", "fbdev");
 
 	wet_output_set_transform(output, section, WL_OUTPUT_TRANSFORM_NORMAL, UINT32_MAX);
+	wet_output_set_occluded_frame_rate(output, section);
 	weston_output_set_scale(output, 1);
 
 	weston_output_enable(output);
@@ -1444,6 +2344,8 @@ load_fbdev_backend(struct weston_compositor *c,
 	const struct weston_option fbdev_options[] = {
 		{ WESTON_OPTION_INTEGER, "tty", 0, &config.tty },
 		{ WESTON_OPTION_STRING, "device", 0, &config.device },
+		{ WESTON_OPTION_BOOLEAN, "double-buffer", 0,
+		  &config.double_buffer },
 	};
 
 	parse_options(fbdev_options, ARRAY_LENGTH(fbdev_options), argc, argv);
@@ -1759,15 +2661,20 @@ int main(int argc, char *argv[])
 	char *cmdline;
 	struct wl_display *display;
 	struct weston_compositor *ec;
-	struct wl_event_source *signals[4];
+	struct wl_event_source *signals[5];
 	struct wl_event_loop *loop;
 	int i, fd;
 	char *backend = NULL;
 	char *shell = NULL;
 	int32_t xwayland = 0;
+	int debug_stats;
+	char *record_sessions = NULL;
+	char *record_clients = NULL;
 	char *modules = NULL;
 	char *option_modules = NULL;
 	char *log = NULL;
+	char *log_scopes = NULL;
+	int32_t debug_protocol = 0;
 	char *server_socket = NULL;
 	int32_t idle_time = -1;
 	int32_t help = 0;
@@ -1792,12 +2699,18 @@ int main(int argc, char *argv[])
 		{ WESTON_OPTION_BOOLEAN, "xwayland", 0, &xwayland },
 		{ WESTON_OPTION_STRING, "modules", 0, &option_modules },
 		{ WESTON_OPTION_STRING, "log", 0, &log },
+		{ WESTON_OPTION_STRING, "log-scopes", 0, &log_scopes },
+		{ WESTON_OPTION_BOOLEAN, "debug", 0, &debug_protocol },
 		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
 		{ WESTON_OPTION_BOOLEAN, "version", 0, &version },
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &noconfig },
 		{ WESTON_OPTION_STRING, "config", 'c', &config_file },
 	};
 
+	/* Start of the boot to first frame time */
+	clock_gettime(CLOCK_MONOTONIC, &user_data.start_time);
+	weston_startup_mark("startup_begin");
+
 	cmdline = copy_command_line(argc, argv);
 	parse_options(core_options, ARRAY_LENGTH(core_options), &argc, argv);
 
@@ -1841,14 +2754,27 @@ int main(int argc, char *argv[])
 	wl_list_init(&child_process_list);
 	signals[3] = wl_event_loop_add_signal(loop, SIGCHLD, sigchld_handler,
 					      NULL);
+	signals[4] = wl_event_loop_add_signal(loop, SIGUSR2,
+					      on_timeline_signal, NULL);
 
-	if (!signals[0] || !signals[1] || !signals[2] || !signals[3])
+	if (!signals[0] || !signals[1] || !signals[2] || !signals[3] ||
+	    !signals[4])
 		goto out_signals;
 
 	if (load_configuration(&config, noconfig, config_file) < 0)
 		goto out_signals;
 	user_data.config = config;
 	user_data.parsed_options = NULL;
+	user_data.config_watch_fd = -1;
+	user_data.config_watch_source = NULL;
+	wl_signal_init(&user_data.config_changed_signal);
+	wet_init_deferred_modules(&user_data);
+
+	user_data.log_scopes_option = log_scopes;
+	wet_configure_log_scopes(&user_data);
+	user_data.log_scopes_listener.notify = log_scopes_config_changed;
+	wl_signal_add(&user_data.config_changed_signal,
+		      &user_data.log_scopes_listener);
 
 	section = weston_config_get_section(config, "core", NULL, NULL);
 
@@ -1865,9 +2791,21 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (debug_protocol &&
+	    weston_compositor_enable_debug_protocol(ec) < 0) {
+		weston_log("fatal: failed to enable the debug protocol\n");
+		goto out;
+	}
+
+	/* Ahead of any module, so that they all see the time */
+	user_data.first_frame_listener.notify = handle_first_frame;
+	wl_signal_add(&ec->first_frame_signal, &user_data.first_frame_listener);
+
 	if (weston_compositor_init_config(ec, config) < 0)
 		goto out;
 
+	wet_watch_config(&user_data, loop);
+
 	weston_config_section_get_bool(section, "require-input",
 				       &require_input, true);
 	ec->require_input = require_input;
@@ -1876,6 +2814,7 @@ int main(int argc, char *argv[])
 		weston_log("fatal: failed to create compositor backend\n");
 		goto out;
 	}
+	weston_startup_mark("startup_backend");
 
 	weston_pending_output_coldplug(ec);
 
@@ -1922,6 +2861,7 @@ int main(int argc, char *argv[])
 
 	if (wet_load_shell(ec, shell, &argc, argv) < 0)
 		goto out;
+	weston_startup_mark("startup_shell");
 
 	weston_config_section_get_string(section, "modules", &modules, "");
 	if (load_modules(ec, modules, &argc, argv, &xwayland) < 0)
@@ -1938,6 +2878,26 @@ int main(int argc, char *argv[])
 			goto out;
 	}
 
+	weston_config_section_get_bool(section, "debug-stats", &debug_stats,
+				       false);
+	if (debug_stats && debug_stats_create(ec) < 0)
+		goto out;
+
+	weston_config_section_get_string(section, "record-sessions",
+					 &record_sessions, NULL);
+	weston_config_section_get_string(section, "record-session-clients",
+					 &record_clients, NULL);
+	if (record_sessions &&
+	    session_recorder_create(ec, record_sessions, record_clients) < 0)
+		goto out;
+
+	if (frame_timing_create(ec) < 0)
+		goto out;
+
+	if (frame_rate_caps_create(ec, config) < 0)
+		goto out;
+	weston_startup_mark("startup_modules");
+
 	section = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_bool(section, "numlock-on", &numlock_on, 0);
 	if (numlock_on) {
@@ -1972,6 +2932,8 @@ int main(int argc, char *argv[])
 out:
 	/* free(NULL) is valid, and it won't be NULL if it's used */
 	free(user_data.parsed_options);
+	wet_release_deferred_modules(&user_data);
+	wet_unwatch_config(&user_data);
 
 	weston_compositor_destroy(ec);
 
@@ -1983,6 +2945,7 @@ out_signals:
 	wl_display_destroy(display);
 
 	weston_log_file_close();
+	weston_log_scopes_destroy();
 
 	if (config)
 		weston_config_destroy(config);
@@ -1992,7 +2955,10 @@ out_signals:
 	free(socket_name);
 	free(option_modules);
 	free(log);
+	free(log_scopes);
 	free(modules);
+	free(record_sessions);
+	free(record_clients);
 
 	return ret;
 }
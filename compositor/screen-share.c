@@ -45,6 +45,10 @@
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+/* DRM_FORMAT_XRGB8888, without depending on libdrm */
+#define SS_DMABUF_FORMAT_XRGB8888 0x34325258
 
 struct shared_output {
 	struct weston_output *output;
@@ -55,8 +59,11 @@ struct shared_output {
 		struct wl_display *display;
 		struct wl_registry *registry;
 		struct wl_compositor *compositor;
+		uint32_t compositor_version;
 		struct wl_shm *shm;
 		uint32_t shm_formats;
+		struct zwp_linux_dmabuf_v1 *dmabuf;
+		int dmabuf_xrgb8888;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_output *output;
 		struct wl_surface *surface;
@@ -74,10 +81,28 @@ struct shared_output {
 		struct wl_list free_buffers;
 	} shm;
 
+	/* Used instead of shm when the output can export its buffers
+	 * and the parent can import them */
+	struct {
+		int enabled;
+		pixman_region32_t damage; /* buffer coordinates, not sent */
+		struct ss_dmabuf_buffer *pending; /* being imported */
+		struct wl_list buffers; /* ss_dmabuf_buffer::link */
+		struct wl_event_source *idle;
+	} dmabuf;
+
 	int cache_dirty;
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	struct wl_list readbacks; /* ss_readback::link */
+	int reading; /* requesting read backs for a frame */
+};
+
+/* A damaged rectangle of the output being read back into cache_image. */
+struct ss_readback {
+	struct shared_output *output; /* NULL once no longer wanted */
+	struct wl_list link;
+	int32_t x, y, width, height;
+	int do_yflip;
 };
 
 struct ss_seat {
@@ -108,6 +133,15 @@ struct ss_shm_buffer {
 	pixman_image_t *pm_image;
 };
 
+struct ss_dmabuf_buffer {
+	struct shared_output *output;
+	struct wl_list link;
+
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wl_buffer *buffer;
+	pixman_region32_t damage;
+};
+
 struct screen_share {
 	struct weston_compositor *compositor;
 	char *command;
@@ -415,6 +449,8 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	struct ss_shm_buffer *sb, *bnext;
 	struct wl_shm_pool *pool;
 	int width, height, stride;
+	off_t size;
+	bool huge;
 	int fd;
 	unsigned char *data;
 
@@ -448,13 +484,14 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		return sb;
 	}
 
-	fd = os_create_anonymous_file(height * stride);
+	size = height * stride;
+	fd = os_create_buffer_file(&size, &huge);
 	if (fd < 0) {
-		weston_log("os_create_anonymous_file: %m\n");
+		weston_log("os_create_buffer_file: %m\n");
 		return NULL;
 	}
 
-	data = mmap(NULL, height * stride, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	data = os_map_buffer_file(fd, size);
 	if (data == MAP_FAILED) {
 		weston_log("mmap: %m\n");
 		goto out_close;
@@ -471,7 +508,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	pixman_region32_init_rect(&sb->damage, 0, 0, width, height);
 
 	sb->data = data;
-	sb->size = height * stride;
+	sb->size = size;
 
 	pool = wl_shm_create_pool(so->parent.shm, fd, sb->size);
 
@@ -496,7 +533,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 out_pixman_error:
 	pixman_region32_fini(&sb->damage);
 out_unmap:
-	munmap(data, height * stride);
+	munmap(data, size);
 out_close:
 	if (fd != -1)
 		close(fd);
@@ -555,45 +592,12 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
 shared_output_update(struct shared_output *so);
 
+static void
+shared_output_update_dmabuf(struct shared_output *so);
+
 static void
 shared_output_frame_callback(void *data, struct wl_callback *cb, uint32_t time)
 {
@@ -620,6 +624,11 @@ shared_output_update(struct shared_output *so)
 	int i, nrects;
 	pixman_transform_t transform;
 
+	if (so->dmabuf.enabled) {
+		shared_output_update_dmabuf(so);
+		return;
+	}
+
 	/* Only update if we need to */
 	if (!so->cache_dirty || so->parent.frame_cb)
 		return;
@@ -656,10 +665,19 @@ shared_output_update(struct shared_output *so)
 	pixman_image_set_transform(sb->pm_image, NULL);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
 
+	/* The shm buffer is untransformed, so buffer and surface
+	 * coordinates are the same. */
 	r = pixman_region32_rectangles(&sb->damage, &nrects);
-	for (i = 0; i < nrects; ++i)
-		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
-				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+	for (i = 0; i < nrects; ++i) {
+		if (so->parent.compositor_version >= 4)
+			wl_surface_damage_buffer(so->parent.surface,
+						 r[i].x1, r[i].y1,
+						 r[i].x2 - r[i].x1,
+						 r[i].y2 - r[i].y1);
+		else
+			wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
+					  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+	}
 
 	wl_surface_attach(so->parent.surface, sb->buffer, 0, 0);
 
@@ -676,6 +694,187 @@ shared_output_update(struct shared_output *so)
 	pixman_region32_init(&sb->damage);
 }
 
+static void
+ss_dmabuf_buffer_destroy(struct ss_dmabuf_buffer *db)
+{
+	if (db->params)
+		zwp_linux_buffer_params_v1_destroy(db->params);
+	if (db->buffer)
+		wl_buffer_destroy(db->buffer);
+	pixman_region32_fini(&db->damage);
+
+	wl_list_remove(&db->link);
+	free(db);
+}
+
+static void
+dmabuf_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	ss_dmabuf_buffer_destroy(data);
+}
+
+static const struct wl_buffer_listener dmabuf_buffer_listener = {
+	dmabuf_buffer_release
+};
+
+/* Go back to reading the output into shm buffers for good. */
+static void
+shared_output_disable_dmabuf(struct shared_output *so)
+{
+	so->dmabuf.enabled = 0;
+
+	if (so->dmabuf.idle)
+		wl_event_source_remove(so->dmabuf.idle);
+	so->dmabuf.idle = NULL;
+
+	/* shm buffers are untransformed; takes effect with their first
+	 * commit */
+	wl_surface_set_buffer_transform(so->parent.surface,
+					WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_surface_set_buffer_scale(so->parent.surface, 1);
+
+	/* Repaint everything so the whole shm buffer gets filled */
+	weston_output_damage(so->output);
+}
+
+static void
+shared_output_present_dmabuf(struct shared_output *so,
+			     struct ss_dmabuf_buffer *db)
+{
+	pixman_box32_t *r;
+	int i, nrects;
+
+	/* The exported buffer is what the output scans out, so let the
+	 * parent apply the output transform and scale. */
+	wl_surface_set_buffer_transform(so->parent.surface,
+					so->output->transform);
+	wl_surface_set_buffer_scale(so->parent.surface,
+				    so->output->current_scale);
+
+	r = pixman_region32_rectangles(&db->damage, &nrects);
+	for (i = 0; i < nrects; ++i)
+		wl_surface_damage_buffer(so->parent.surface, r[i].x1, r[i].y1,
+					 r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+
+	wl_surface_attach(so->parent.surface, db->buffer, 0, 0);
+
+	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
+	wl_callback_add_listener(so->parent.frame_cb,
+				 &shared_output_frame_listener, so);
+
+	wl_surface_commit(so->parent.surface);
+	wl_display_flush(so->parent.display);
+}
+
+static void
+dmabuf_params_created(void *data,
+		      struct zwp_linux_buffer_params_v1 *params,
+		      struct wl_buffer *buffer)
+{
+	struct ss_dmabuf_buffer *db = data;
+	struct shared_output *so = db->output;
+
+	zwp_linux_buffer_params_v1_destroy(db->params);
+	db->params = NULL;
+
+	db->buffer = buffer;
+	wl_buffer_add_listener(buffer, &dmabuf_buffer_listener, db);
+
+	so->dmabuf.pending = NULL;
+	shared_output_present_dmabuf(so, db);
+}
+
+static void
+dmabuf_params_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+	struct ss_dmabuf_buffer *db = data;
+	struct shared_output *so = db->output;
+
+	weston_log("Screen share: parent cannot import the output's "
+		   "dmabufs, falling back to shm\n");
+
+	so->dmabuf.pending = NULL;
+	ss_dmabuf_buffer_destroy(db);
+	shared_output_disable_dmabuf(so);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener dmabuf_params_listener = {
+	dmabuf_params_created,
+	dmabuf_params_failed
+};
+
+/* Hand the parent the buffer the output just rendered, with the damage
+ * accumulated since the last one; no pixels are copied. */
+static void
+shared_output_update_dmabuf(struct shared_output *so)
+{
+	struct ss_dmabuf_buffer *db;
+	int fd, stride;
+
+	if (so->parent.frame_cb || so->dmabuf.pending ||
+	    !pixman_region32_not_empty(&so->dmabuf.damage))
+		return;
+
+	if (so->output->export_dmabuf(so->output, &fd, &stride) < 0) {
+		weston_log("Screen share: cannot export output buffer, "
+			   "falling back to shm\n");
+		shared_output_disable_dmabuf(so);
+		return;
+	}
+
+	db = zalloc(sizeof *db);
+	if (db == NULL) {
+		close(fd);
+		shared_output_destroy(so);
+		return;
+	}
+
+	db->output = so;
+	wl_list_insert(&so->dmabuf.buffers, &db->link);
+	pixman_region32_init(&db->damage);
+	pixman_region32_copy(&db->damage, &so->dmabuf.damage);
+	pixman_region32_fini(&so->dmabuf.damage);
+	pixman_region32_init(&so->dmabuf.damage);
+
+	/* The buffer is imported asynchronously so that a parent unable
+	 * to use it can say so instead of raising a protocol error. */
+	db->params = zwp_linux_dmabuf_v1_create_params(so->parent.dmabuf);
+	zwp_linux_buffer_params_v1_add(db->params, fd, 0, 0, stride, 0, 0);
+	close(fd);
+	zwp_linux_buffer_params_v1_add_listener(db->params,
+						&dmabuf_params_listener, db);
+	zwp_linux_buffer_params_v1_create(db->params,
+					  so->output->current_mode->width,
+					  so->output->current_mode->height,
+					  SS_DMABUF_FORMAT_XRGB8888, 0);
+	so->dmabuf.pending = db;
+
+	wl_display_flush(so->parent.display);
+}
+
+static void
+shared_output_dmabuf_idle(void *data)
+{
+	struct shared_output *so = data;
+
+	so->dmabuf.idle = NULL;
+	shared_output_update_dmabuf(so);
+}
+
+static void
+dmabuf_handle_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf,
+		     uint32_t format)
+{
+	struct shared_output *so = data;
+
+	if (format == SS_DMABUF_FORMAT_XRGB8888)
+		so->parent.dmabuf_xrgb8888 = 1;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_handle_format
+};
+
 static void
 shm_handle_format(void *data, struct wl_shm *wl_shm, uint32_t format)
 {
@@ -695,9 +894,11 @@ registry_handle_global(void *data, struct wl_registry *registry,
 	struct shared_output *so = data;
 
 	if (strcmp(interface, "wl_compositor") == 0) {
+		so->parent.compositor_version = MIN(version, 4);
 		so->parent.compositor =
 			wl_registry_bind(registry,
-					 id, &wl_compositor_interface, 1);
+					 id, &wl_compositor_interface,
+					 so->parent.compositor_version);
 	} else if (strcmp(interface, "wl_output") == 0 && !so->parent.output) {
 		so->parent.output =
 			wl_registry_bind(registry,
@@ -709,6 +910,12 @@ registry_handle_global(void *data, struct wl_registry *registry,
 			wl_registry_bind(registry,
 					 id, &wl_shm_interface, 1);
 		wl_shm_add_listener(so->parent.shm, &shm_listener, so);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
+		so->parent.dmabuf =
+			wl_registry_bind(registry,
+					 id, &zwp_linux_dmabuf_v1_interface, 1);
+		zwp_linux_dmabuf_v1_add_listener(so->parent.dmabuf,
+						 &dmabuf_listener, so);
 	} else if (strcmp(interface, "zwp_fullscreen_shell_v1") == 0) {
 		so->parent.fshell =
 			wl_registry_bind(registry,
@@ -788,6 +995,52 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+/* Forget about read backs still in flight, their pixels are stale. */
+static void
+shared_output_drop_readbacks(struct shared_output *so)
+{
+	struct ss_readback *rb, *next;
+
+	wl_list_for_each_safe(rb, next, &so->readbacks, link) {
+		wl_list_remove(&rb->link);
+		wl_list_init(&rb->link);
+		rb->output = NULL;
+	}
+}
+
+static void
+shared_output_read_done(void *data, void *pixels)
+{
+	struct ss_readback *rb = data;
+	struct shared_output *so = rb->output;
+	int32_t stride;
+	uint32_t *cache_data;
+
+	wl_list_remove(&rb->link);
+
+	if (so && pixels) {
+		cache_data = pixman_image_get_data(so->cache_image);
+		stride = pixman_image_get_stride(so->cache_image) / 4;
+
+		if (rb->do_yflip)
+			pixman_blt(pixels, cache_data, -rb->width, stride,
+				   32, 32, 0, 1 - rb->height, rb->x, rb->y,
+				   rb->width, rb->height);
+		else
+			pixman_blt(pixels, cache_data, rb->width, stride,
+				   32, 32, 0, 0, rb->x, rb->y,
+				   rb->width, rb->height);
+	}
+
+	free(rb);
+
+	/* Send the frame once all of it has arrived. */
+	if (so && !so->reading && wl_list_empty(&so->readbacks)) {
+		so->cache_dirty = 1;
+		shared_output_update(so);
+	}
+}
+
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
@@ -795,10 +1048,11 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		container_of(listener, struct shared_output, frame_listener);
 	pixman_region32_t damage;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
+	struct ss_readback *rb;
+	struct wl_event_loop *loop;
+	int32_t width, height, stride;
 	int i, nrects, do_yflip;
 	pixman_box32_t *r;
-	uint32_t *cache_data;
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
@@ -816,6 +1070,24 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 				  so->output->current_scale,
 				  &damage, &damage);
 
+	/* The frame only lands in the exportable buffer once the
+	 * renderer is done, so send it from an idle callback. */
+	if (so->dmabuf.enabled) {
+		pixman_region32_union(&so->dmabuf.damage,
+				      &so->dmabuf.damage, &damage);
+		pixman_region32_fini(&damage);
+
+		if (!so->dmabuf.idle) {
+			loop = wl_display_get_event_loop(
+				so->output->compositor->wl_display);
+			so->dmabuf.idle =
+				wl_event_loop_add_idle(loop,
+						       shared_output_dmabuf_idle,
+						       so);
+		}
+		return;
+	}
+
 	width = so->output->current_mode->width;
 	height = so->output->current_mode->height;
 	stride = width;
@@ -826,6 +1098,8 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		if (so->cache_image)
 			pixman_image_unref(so->cache_image);
 
+		shared_output_drop_readbacks(so);
+
 		so->cache_image =
 			pixman_image_create_bits(PIXMAN_a8r8g8b8,
 						 width, height, NULL,
@@ -839,44 +1113,49 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		pixman_region32_init_rect(&damage, 0, 0, width, height);
 	}
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
-		shared_output_destroy(so);
-		return;
-	}
-
 	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
-	cache_data = pixman_image_get_data(so->cache_image);
+	/* Renderers without asynchronous read back complete each request
+	 * right away, only send the frame once it has been read entirely. */
+	so->reading = 1;
+
 	r = pixman_region32_rectangles(&damage, &nrects);
 	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
+		rb = zalloc(sizeof *rb);
+		if (rb == NULL) {
+			pixman_region32_fini(&damage);
+			shared_output_destroy(so);
+			return;
+		}
+
+		rb->output = so;
+		rb->x = r[i].x1;
+		rb->y = r[i].y1;
+		rb->width = r[i].x2 - r[i].x1;
+		rb->height = r[i].y2 - r[i].y1;
+		rb->do_yflip = do_yflip;
+		wl_list_insert(so->readbacks.prev, &rb->link);
+
+		if (weston_output_read_pixels_async(so->output,
+				PIXMAN_a8r8g8b8, rb->x,
+				do_yflip ? height - r[i].y2 : rb->y,
+				rb->width, rb->height,
+				shared_output_read_done, rb) < 0) {
+			wl_list_remove(&rb->link);
+			free(rb);
+			pixman_region32_fini(&damage);
+			shared_output_destroy(so);
+			return;
 		}
 	}
 
 	pixman_region32_fini(&damage);
 
-	so->cache_dirty = 1;
-
-	shared_output_update(so);
+	so->reading = 0;
+	if (wl_list_empty(&so->readbacks)) {
+		so->cache_dirty = 1;
+		shared_output_update(so);
+	}
 }
 
 static struct shared_output *
@@ -892,6 +1171,9 @@ shared_output_create(struct weston_output *output, int parent_fd)
 		goto err_close;
 
 	wl_list_init(&so->seat_list);
+	wl_list_init(&so->readbacks);
+	wl_list_init(&so->dmabuf.buffers);
+	pixman_region32_init(&so->dmabuf.damage);
 
 	so->parent.display = wl_display_connect_to_fd(parent_fd);
 	if (!so->parent.display)
@@ -960,6 +1242,13 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
 
+	/* damage_buffer is needed since exported buffers are transformed */
+	so->dmabuf.enabled = output->export_dmabuf && so->parent.dmabuf &&
+			     so->parent.dmabuf_xrgb8888 &&
+			     so->parent.compositor_version >= 4;
+	weston_log("Screen share: sending %s buffers\n",
+		   so->dmabuf.enabled ? "dmabuf" : "shm");
+
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
 	wl_signal_add(&so->output->destroy_signal, &so->output_destroyed);
@@ -976,6 +1265,7 @@ err_display:
 		ss_seat_destroy(seat);
 	wl_display_disconnect(so->parent.display);
 err_alloc:
+	pixman_region32_fini(&so->dmabuf.damage);
 	free(so);
 err_close:
 	close(parent_fd);
@@ -986,6 +1276,7 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	struct ss_dmabuf_buffer *db, *dbnext;
 
 	so->output->disable_planes--;
 
@@ -994,14 +1285,20 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, free_link)
 		ss_shm_buffer_destroy(buffer);
 
+	if (so->dmabuf.idle)
+		wl_event_source_remove(so->dmabuf.idle);
+	wl_list_for_each_safe(db, dbnext, &so->dmabuf.buffers, link)
+		ss_dmabuf_buffer_destroy(db);
+	pixman_region32_fini(&so->dmabuf.damage);
+
 	wl_display_disconnect(so->parent.display);
 	wl_event_source_remove(so->event_source);
 
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
+	shared_output_drop_readbacks(so);
 	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
 
 	free(so);
 }
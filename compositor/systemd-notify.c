@@ -40,6 +40,7 @@ struct systemd_notifier {
 	int watchdog_time;
 	struct wl_event_source *watchdog_source;
 	struct wl_listener compositor_destroy_listener;
+	struct wl_listener first_frame_listener;
 };
 
 static int
@@ -96,6 +97,21 @@ watchdog_handler(void *data)
 	return 1;
 }
 
+static void
+first_frame_handler(struct wl_listener *listener, void *data)
+{
+	struct systemd_notifier *notifier =
+		container_of(listener, struct systemd_notifier,
+			     first_frame_listener);
+	struct weston_output *output = data;
+
+	wl_list_remove(&notifier->first_frame_listener.link);
+	wl_list_init(&notifier->first_frame_listener.link);
+
+	sd_notifyf(0, "STATUS=First frame after %d ms",
+		   wet_get_first_frame_msec(output->compositor));
+}
+
 static void
 weston_compositor_destroy_listener(struct wl_listener *listener, void *data)
 {
@@ -110,6 +126,7 @@ weston_compositor_destroy_listener(struct wl_listener *listener, void *data)
 	if (notifier->watchdog_source)
 		wl_event_source_remove(notifier->watchdog_source);
 
+	wl_list_remove(&notifier->first_frame_listener.link);
 	wl_list_remove(&notifier->compositor_destroy_listener.link);
 	free(notifier);
 }
@@ -132,6 +149,13 @@ wet_module_init(struct weston_compositor *compositor,
 	wl_signal_add(&compositor->destroy_signal,
 		      &notifier->compositor_destroy_listener);
 
+	notifier->first_frame_listener.notify = first_frame_handler;
+	if (compositor->first_frame_presented)
+		wl_list_init(&notifier->first_frame_listener.link);
+	else
+		wl_signal_add(&compositor->first_frame_signal,
+			      &notifier->first_frame_listener);
+
 	if (add_systemd_sockets(compositor) < 0)
 		return -1;
 
@@ -37,6 +37,7 @@
 #include "weston.h"
 #include "text-input-unstable-v1-server-protocol.h"
 #include "input-method-unstable-v1-server-protocol.h"
+#include "weston-input-method-filter-server-protocol.h"
 #include "shared/helpers.h"
 
 struct text_input_manager;
@@ -95,6 +96,11 @@ struct input_method_context {
 	struct input_method *input_method;
 
 	struct wl_resource *keyboard;
+
+	/* Keys the input method declared it does not handle, and those
+	 * of them currently pressed, as uint32_t key codes */
+	struct wl_array passthrough_keys;
+	struct wl_array passed_keys;
 };
 
 struct text_backend {
@@ -110,6 +116,9 @@ struct text_backend {
 
 	struct wl_listener client_listener;
 	struct wl_listener seat_created_listener;
+	struct wl_listener first_frame_listener;
+
+	struct wl_global *filter_global;
 };
 
 static void
@@ -605,17 +614,71 @@ unbind_keyboard(struct wl_resource *resource)
 	context->keyboard = NULL;
 }
 
+static uint32_t *
+key_array_find(struct wl_array *keys, uint32_t key)
+{
+	uint32_t *k;
+
+	wl_array_for_each(k, keys)
+		if (*k == key)
+			return k;
+
+	return NULL;
+}
+
+/* Whether the key goes to the application directly rather than through
+ * the input method; a release follows the way its press went. */
+static bool
+input_method_context_pass_key(struct input_method_context *context,
+			      uint32_t key, uint32_t state_w)
+{
+	uint32_t *k, *last;
+
+	if (state_w == WL_KEYBOARD_KEY_STATE_PRESSED) {
+		if (!key_array_find(&context->passthrough_keys, key))
+			return false;
+
+		if (!key_array_find(&context->passed_keys, key)) {
+			k = wl_array_add(&context->passed_keys, sizeof *k);
+			if (!k)
+				return false;
+			*k = key;
+		}
+
+		return true;
+	}
+
+	k = key_array_find(&context->passed_keys, key);
+	if (!k)
+		return false;
+
+	last = (uint32_t *) ((char *) context->passed_keys.data +
+			     context->passed_keys.size) - 1;
+	*k = *last;
+	context->passed_keys.size -= sizeof *k;
+
+	return true;
+}
+
 static void
 input_method_context_grab_key(struct weston_keyboard_grab *grab,
 			      uint32_t time, uint32_t key, uint32_t state_w)
 {
 	struct weston_keyboard *keyboard = grab->keyboard;
+	struct weston_keyboard_grab *default_grab = &keyboard->default_grab;
+	struct input_method_context *context;
 	struct wl_display *display;
 	uint32_t serial;
 
 	if (!keyboard->input_method_resource)
 		return;
 
+	context = wl_resource_get_user_data(keyboard->input_method_resource);
+	if (input_method_context_pass_key(context, key, state_w)) {
+		default_grab->interface->key(default_grab, time, key, state_w);
+		return;
+	}
+
 	display = wl_client_get_display(
 		wl_resource_get_client(keyboard->input_method_resource));
 	serial = wl_display_next_serial(display);
@@ -632,10 +695,19 @@ input_method_context_grab_modifier(struct weston_keyboard_grab *grab,
 				   uint32_t group)
 {
 	struct weston_keyboard *keyboard = grab->keyboard;
+	struct weston_keyboard_grab *default_grab = &keyboard->default_grab;
+	struct input_method_context *context;
 
 	if (!keyboard->input_method_resource)
 		return;
 
+	context = wl_resource_get_user_data(keyboard->input_method_resource);
+	if (context->passthrough_keys.size > 0)
+		default_grab->interface->modifiers(default_grab, serial,
+						   mods_depressed,
+						   mods_latched, mods_locked,
+						   group);
+
 	wl_keyboard_send_modifiers(keyboard->input_method_resource,
 				   serial, mods_depressed, mods_latched,
 				   mods_locked, group);
@@ -713,6 +785,10 @@ input_method_context_modifiers(struct wl_client *client,
 	struct weston_keyboard *keyboard = weston_seat_get_keyboard(seat);
 	struct weston_keyboard_grab *default_grab = &keyboard->default_grab;
 
+	/* Already delivered directly, see input_method_context_grab_modifier */
+	if (context->passthrough_keys.size > 0)
+		return;
+
 	default_grab->interface->modifiers(default_grab,
 					   serial, mods_depressed,
 					   mods_latched, mods_locked,
@@ -777,6 +853,8 @@ destroy_input_method_context(struct wl_resource *resource)
 	if (context->input_method && context->input_method->context == context)
 		context->input_method->context = NULL;
 
+	wl_array_release(&context->passthrough_keys);
+	wl_array_release(&context->passed_keys);
 	free(context);
 }
 
@@ -806,6 +884,8 @@ input_method_context_create(struct text_input *input,
 	context->input = input;
 	context->input_method = input_method;
 	input_method->context = context;
+	wl_array_init(&context->passthrough_keys);
+	wl_array_init(&context->passed_keys);
 
 
 	zwp_input_method_v1_send_activate(binding, context->resource);
@@ -875,6 +955,61 @@ bind_input_method(struct wl_client *client,
 	input_method->input_method_binding = resource;
 }
 
+static void
+input_method_filter_destroy(struct wl_client *client,
+			    struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+input_method_filter_set_passthrough_keys(struct wl_client *client,
+					 struct wl_resource *resource,
+					 struct wl_resource *context_resource,
+					 struct wl_array *keys)
+{
+	struct input_method_context *context =
+		wl_resource_get_user_data(context_resource);
+
+	context->passthrough_keys.size = 0;
+	if (!wl_array_copy(&context->passthrough_keys, keys))
+		wl_client_post_no_memory(client);
+}
+
+static const struct weston_input_method_filter_interface filter_implementation = {
+	input_method_filter_destroy,
+	input_method_filter_set_passthrough_keys,
+};
+
+static void
+bind_input_method_filter(struct wl_client *client,
+			 void *data,
+			 uint32_t version,
+			 uint32_t id)
+{
+	struct text_backend *text_backend = data;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_input_method_filter_interface,
+				      1, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	if (text_backend->input_method.client != client) {
+		wl_resource_post_error(resource,
+				       WL_DISPLAY_ERROR_INVALID_OBJECT,
+				       "permission to bind "
+				       "weston_input_method_filter denied");
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &filter_implementation,
+				       text_backend, NULL);
+}
+
 static void
 input_method_notifier_destroy(struct wl_listener *listener, void *data)
 {
@@ -986,6 +1121,21 @@ launch_input_method(struct text_backend *text_backend)
 				       &text_backend->client_listener);
 }
 
+/* The input method is not needed to show the desktop, so it is only
+ * started once the first frame is up, out of the way of startup. */
+static void
+handle_first_frame(struct wl_listener *listener, void *data)
+{
+	struct text_backend *text_backend =
+		container_of(listener, struct text_backend,
+			     first_frame_listener);
+
+	wl_list_remove(&text_backend->first_frame_listener.link);
+	wl_list_init(&text_backend->first_frame_listener.link);
+
+	launch_input_method(text_backend);
+}
+
 static void
 text_backend_seat_created(struct text_backend *text_backend,
 			  struct weston_seat *seat)
@@ -1048,6 +1198,11 @@ text_backend_configuration(struct text_backend *text_backend)
 WL_EXPORT void
 text_backend_destroy(struct text_backend *text_backend)
 {
+	wl_list_remove(&text_backend->first_frame_listener.link);
+
+	if (text_backend->filter_global)
+		wl_global_destroy(text_backend->filter_global);
+
 	if (text_backend->input_method.client) {
 		/* disable respawn */
 		wl_list_remove(&text_backend->client_listener.link);
@@ -1080,7 +1235,19 @@ text_backend_init(struct weston_compositor *ec)
 
 	text_input_manager_create(ec);
 
-	launch_input_method(text_backend);
+	text_backend->filter_global =
+		wl_global_create(ec->wl_display,
+				 &weston_input_method_filter_interface, 1,
+				 text_backend, bind_input_method_filter);
+
+	text_backend->first_frame_listener.notify = handle_first_frame;
+	if (ec->first_frame_presented) {
+		wl_list_init(&text_backend->first_frame_listener.link);
+		launch_input_method(text_backend);
+	} else {
+		wl_signal_add(&ec->first_frame_signal,
+			      &text_backend->first_frame_listener);
+	}
 
 	return text_backend;
 }
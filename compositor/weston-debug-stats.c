@@ -0,0 +1,319 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "compositor.h"
+#include "weston.h"
+#include "weston-debug-stats-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+struct debug_stats {
+	struct weston_compositor *compositor;
+	struct wl_global *global;
+	struct wl_listener destroy_listener;
+};
+
+struct debug_output_stats {
+	struct wl_resource *resource;
+	struct weston_output *output;
+	struct wl_listener stats_listener;
+	struct wl_listener input_latency_listener;
+	struct wl_listener output_destroy_listener;
+};
+
+static uint32_t
+nsec_to_usec_clamped(int64_t nsec)
+{
+	if (nsec <= 0)
+		return 0;
+	if (nsec / 1000 > UINT32_MAX)
+		return UINT32_MAX;
+
+	return nsec / 1000;
+}
+
+static uint32_t
+bytes_to_kib_clamped(uint64_t bytes)
+{
+	if (bytes / 1024 > UINT32_MAX)
+		return UINT32_MAX;
+
+	return bytes / 1024;
+}
+
+static void
+output_stats_notify(struct wl_listener *listener, void *data)
+{
+	struct debug_output_stats *ds =
+		container_of(listener, struct debug_output_stats,
+			     stats_listener);
+	const struct weston_output_stats *stats = &ds->output->stats;
+
+	weston_debug_output_stats_send_frame(ds->resource,
+		stats->frames, stats->missed_deadlines,
+		nsec_to_usec_clamped(stats->repaint_nsec),
+		nsec_to_usec_clamped(stats->idle_nsec),
+		stats->primary_views, stats->scanout_views,
+		stats->overlay_views, stats->cursor_views,
+		stats->upload_bytes > UINT32_MAX ?
+			UINT32_MAX : stats->upload_bytes);
+}
+
+static void
+output_input_latency_notify(struct wl_listener *listener, void *data)
+{
+	struct debug_output_stats *ds =
+		container_of(listener, struct debug_output_stats,
+			     input_latency_listener);
+	const struct weston_output_stats *stats = &ds->output->stats;
+
+	if (wl_resource_get_version(ds->resource) <
+	    WESTON_DEBUG_OUTPUT_STATS_INPUT_LATENCY_SINCE_VERSION)
+		return;
+
+	weston_debug_output_stats_send_input_latency(ds->resource,
+		stats->input_frames,
+		nsec_to_usec_clamped(stats->input_to_commit_nsec),
+		nsec_to_usec_clamped(stats->commit_to_present_nsec));
+}
+
+static void
+output_stats_detach(struct debug_output_stats *ds)
+{
+	if (!ds->output)
+		return;
+
+	wl_list_remove(&ds->stats_listener.link);
+	wl_list_remove(&ds->input_latency_listener.link);
+	wl_list_remove(&ds->output_destroy_listener.link);
+	ds->output = NULL;
+}
+
+static void
+output_stats_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct debug_output_stats *ds =
+		container_of(listener, struct debug_output_stats,
+			     output_destroy_listener);
+
+	output_stats_detach(ds);
+}
+
+static void
+output_stats_resource_destroyed(struct wl_resource *resource)
+{
+	struct debug_output_stats *ds = wl_resource_get_user_data(resource);
+
+	output_stats_detach(ds);
+	free(ds);
+}
+
+static void
+output_stats_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_debug_output_stats_interface
+output_stats_implementation = {
+	output_stats_destroy,
+};
+
+static void
+client_stats_send(const struct weston_client_stats *stats, void *data)
+{
+	struct wl_resource *resource = data;
+	pid_t pid;
+
+	wl_client_get_credentials(stats->client, &pid, NULL, NULL);
+
+	/* The counters wrap, as the protocol says */
+	weston_debug_client_stats_send_client(resource, pid,
+		stats->surfaces, stats->views,
+		bytes_to_kib_clamped(stats->shm_bytes),
+		bytes_to_kib_clamped(stats->texture_bytes),
+		(uint32_t) stats->upload_bytes,
+		(uint32_t) stats->commits);
+}
+
+static void
+client_stats_update(struct wl_client *client, struct wl_resource *resource)
+{
+	struct weston_compositor *compositor =
+		wl_resource_get_user_data(resource);
+
+	weston_compositor_for_each_client_stats(compositor,
+						client_stats_send, resource);
+	weston_debug_client_stats_send_done(resource);
+}
+
+static void
+client_stats_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_debug_client_stats_interface
+client_stats_implementation = {
+	client_stats_destroy,
+	client_stats_update,
+};
+
+static void
+debug_stats_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+debug_stats_get_output_stats(struct wl_client *client,
+			     struct wl_resource *resource, uint32_t id,
+			     struct wl_resource *output_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct debug_output_stats *ds;
+
+	ds = zalloc(sizeof *ds);
+	if (ds == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	ds->resource = wl_resource_create(client,
+					  &weston_debug_output_stats_interface,
+					  wl_resource_get_version(resource),
+					  id);
+	if (ds->resource == NULL) {
+		free(ds);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(ds->resource,
+				       &output_stats_implementation, ds,
+				       output_stats_resource_destroyed);
+
+	/* An output already gone just never sends anything */
+	if (!output || output->destroying)
+		return;
+
+	ds->output = output;
+	ds->stats_listener.notify = output_stats_notify;
+	wl_signal_add(&output->stats_signal, &ds->stats_listener);
+	ds->input_latency_listener.notify = output_input_latency_notify;
+	wl_signal_add(&output->input_latency_signal,
+		      &ds->input_latency_listener);
+	ds->output_destroy_listener.notify = output_stats_output_destroyed;
+	wl_signal_add(&output->destroy_signal, &ds->output_destroy_listener);
+}
+
+static void
+debug_stats_get_client_stats(struct wl_client *client,
+			     struct wl_resource *resource, uint32_t id)
+{
+	struct debug_stats *stats = wl_resource_get_user_data(resource);
+	struct wl_resource *client_stats;
+
+	client_stats =
+		wl_resource_create(client, &weston_debug_client_stats_interface,
+				   wl_resource_get_version(resource), id);
+	if (client_stats == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(client_stats,
+				       &client_stats_implementation,
+				       stats->compositor, NULL);
+}
+
+static const struct weston_debug_stats_interface debug_stats_implementation = {
+	debug_stats_destroy,
+	debug_stats_get_output_stats,
+	debug_stats_get_client_stats,
+};
+
+static void
+bind_debug_stats(struct wl_client *client,
+		 void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &weston_debug_stats_interface,
+				      version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &debug_stats_implementation,
+				       data, NULL);
+}
+
+static void
+debug_stats_compositor_destroyed(struct wl_listener *listener, void *data)
+{
+	struct debug_stats *stats =
+		container_of(listener, struct debug_stats, destroy_listener);
+
+	wl_list_remove(&stats->destroy_listener.link);
+	wl_global_destroy(stats->global);
+	free(stats);
+}
+
+/** Advertise the weston_debug_stats global to all clients */
+int
+debug_stats_create(struct weston_compositor *compositor)
+{
+	struct debug_stats *stats;
+
+	stats = zalloc(sizeof *stats);
+	if (stats == NULL)
+		return -1;
+
+	stats->compositor = compositor;
+	stats->global = wl_global_create(compositor->wl_display,
+					 &weston_debug_stats_interface, 2,
+					 stats, bind_debug_stats);
+	if (stats->global == NULL) {
+		free(stats);
+		return -1;
+	}
+
+	stats->destroy_listener.notify = debug_stats_compositor_destroyed;
+	wl_signal_add(&compositor->destroy_signal, &stats->destroy_listener);
+
+	weston_log("Output and client statistics are exposed to all "
+		   "clients.\n");
+
+	return 0;
+}
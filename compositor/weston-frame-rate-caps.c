@@ -0,0 +1,332 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "compositor.h"
+#include "weston.h"
+#include "libweston-desktop/libweston-desktop.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+/*
+ * Applies the [frame-rate-cap] sections of weston.ini to the surfaces of
+ * matching clients, see weston_surface_set_frame_rate_cap(). A section
+ * matches by app-id, by executable, by both, or, with neither, every
+ * client; the first matching section applies.
+ */
+
+struct frame_rate_rule {
+	char *app_id;
+	char *executable;
+	int32_t rate;
+	int32_t unfocused_rate;
+	struct wl_list link;
+};
+
+struct frame_rate_caps {
+	struct weston_compositor *compositor;
+	struct wl_list rule_list;
+	bool needs_app_id;
+
+	struct wl_listener create_surface_listener;
+	struct wl_listener destroy_listener;
+	struct wl_list surface_list;
+};
+
+struct capped_surface {
+	struct frame_rate_caps *caps;
+	struct weston_surface *surface;
+	/* /proc/<pid>/comm of the client */
+	char executable[16];
+	/* The app-id the caps were last chosen for */
+	char *app_id;
+	struct wl_listener commit_listener;
+	struct wl_listener destroy_listener;
+	struct wl_list link;
+};
+
+static const char *
+surface_get_app_id(struct weston_surface *surface)
+{
+	struct weston_desktop_surface *dsurface;
+
+	surface = weston_surface_get_main_surface(surface);
+	if (!weston_surface_is_desktop_surface(surface))
+		return NULL;
+
+	dsurface = weston_surface_get_desktop_surface(surface);
+
+	return weston_desktop_surface_get_app_id(dsurface);
+}
+
+static void
+capped_surface_apply(struct capped_surface *cs, const char *app_id)
+{
+	struct frame_rate_rule *rule;
+
+	wl_list_for_each(rule, &cs->caps->rule_list, link) {
+		if (rule->app_id &&
+		    (!app_id || strcmp(rule->app_id, app_id) != 0))
+			continue;
+		if (rule->executable &&
+		    strcmp(rule->executable, cs->executable) != 0)
+			continue;
+
+		weston_surface_set_frame_rate_cap(cs->surface, rule->rate,
+						  rule->unfocused_rate);
+		return;
+	}
+
+	weston_surface_set_frame_rate_cap(cs->surface, 0, 0);
+}
+
+static void
+capped_surface_destroy(struct capped_surface *cs)
+{
+	wl_list_remove(&cs->commit_listener.link);
+	wl_list_remove(&cs->destroy_listener.link);
+	wl_list_remove(&cs->link);
+	free(cs->app_id);
+	free(cs);
+}
+
+/* Clients set their app-id after creating the surface, and may change
+ * it at any time. */
+static void
+surface_committed(struct wl_listener *listener, void *data)
+{
+	struct capped_surface *cs =
+		container_of(listener, struct capped_surface,
+			     commit_listener);
+	const char *app_id = surface_get_app_id(cs->surface);
+
+	if (app_id == cs->app_id ||
+	    (app_id && cs->app_id && strcmp(app_id, cs->app_id) == 0))
+		return;
+
+	free(cs->app_id);
+	cs->app_id = app_id ? strdup(app_id) : NULL;
+	capped_surface_apply(cs, cs->app_id);
+}
+
+static void
+surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct capped_surface *cs =
+		container_of(listener, struct capped_surface,
+			     destroy_listener);
+
+	capped_surface_destroy(cs);
+}
+
+static void
+read_executable(struct wl_client *client, char *name, size_t name_size)
+{
+	char path[64];
+	FILE *fp;
+	size_t len = 0;
+	pid_t pid;
+
+	name[0] = '\0';
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+
+	snprintf(path, sizeof path, "/proc/%d/comm", (int) pid);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fgets(name, name_size, fp))
+			len = strlen(name);
+		fclose(fp);
+	}
+	if (len > 0 && name[len - 1] == '\n')
+		name[len - 1] = '\0';
+}
+
+static void
+surface_created(struct wl_listener *listener, void *data)
+{
+	struct frame_rate_caps *caps =
+		container_of(listener, struct frame_rate_caps,
+			     create_surface_listener);
+	struct weston_surface *surface = data;
+	struct capped_surface *cs;
+
+	if (!surface->resource)
+		return;
+
+	cs = zalloc(sizeof *cs);
+	if (!cs)
+		return;
+
+	cs->caps = caps;
+	cs->surface = surface;
+	read_executable(wl_resource_get_client(surface->resource),
+			cs->executable, sizeof cs->executable);
+	capped_surface_apply(cs, NULL);
+
+	/* Only app-ids need watching */
+	if (!caps->needs_app_id) {
+		free(cs);
+		return;
+	}
+
+	cs->commit_listener.notify = surface_committed;
+	wl_signal_add(&surface->commit_signal, &cs->commit_listener);
+	cs->destroy_listener.notify = surface_destroyed;
+	wl_signal_add(&surface->destroy_signal, &cs->destroy_listener);
+	wl_list_insert(&caps->surface_list, &cs->link);
+}
+
+static void
+frame_rate_rule_destroy(struct frame_rate_rule *rule)
+{
+	free(rule->app_id);
+	free(rule->executable);
+	free(rule);
+}
+
+static void
+frame_rate_caps_free(struct frame_rate_caps *caps)
+{
+	struct frame_rate_rule *rule, *tmp;
+
+	wl_list_for_each_safe(rule, tmp, &caps->rule_list, link) {
+		wl_list_remove(&rule->link);
+		frame_rate_rule_destroy(rule);
+	}
+	free(caps);
+}
+
+static void
+frame_rate_caps_destroy(struct wl_listener *listener, void *data)
+{
+	struct frame_rate_caps *caps =
+		container_of(listener, struct frame_rate_caps,
+			     destroy_listener);
+	struct capped_surface *cs, *tmp;
+
+	wl_list_for_each_safe(cs, tmp, &caps->surface_list, link)
+		capped_surface_destroy(cs);
+
+	wl_list_remove(&caps->create_surface_listener.link);
+	wl_list_remove(&caps->destroy_listener.link);
+	frame_rate_caps_free(caps);
+}
+
+static int
+frame_rate_caps_add_rule(struct frame_rate_caps *caps,
+			 struct weston_config_section *section)
+{
+	struct frame_rate_rule *rule;
+
+	rule = zalloc(sizeof *rule);
+	if (!rule)
+		return -1;
+
+	weston_config_section_get_string(section, "app-id",
+					 &rule->app_id, NULL);
+	weston_config_section_get_string(section, "executable",
+					 &rule->executable, NULL);
+	weston_config_section_get_int(section, "rate", &rule->rate, 0);
+	weston_config_section_get_int(section, "unfocused-rate",
+				      &rule->unfocused_rate, 0);
+
+	if (rule->rate < 0 || rule->unfocused_rate < 0) {
+		weston_log("Invalid frame-rate-cap rate: %d, %d\n",
+			   rule->rate, rule->unfocused_rate);
+		frame_rate_rule_destroy(rule);
+		return 0;
+	}
+
+	if (rule->app_id)
+		caps->needs_app_id = true;
+
+	weston_log("Frame rate cap for %s%s%s%s: %d Hz, %d Hz unfocused\n",
+		   rule->app_id ? "app-id " : "",
+		   rule->app_id ? rule->app_id : "",
+		   rule->executable ? " executable " : "",
+		   rule->executable ? rule->executable :
+		   (rule->app_id ? "" : "every client"),
+		   rule->rate, rule->unfocused_rate);
+
+	wl_list_insert(caps->rule_list.prev, &rule->link);
+
+	return 0;
+}
+
+/** Apply the [frame-rate-cap] sections of the configuration
+ *
+ * \param compositor The compositor.
+ * \param config The configuration to read.
+ * \return 0 on success, also without any such section; -1 on failure.
+ *
+ * Applies to the surfaces created from now on, until weston exits.
+ */
+int
+frame_rate_caps_create(struct weston_compositor *compositor,
+		       struct weston_config *config)
+{
+	struct frame_rate_caps *caps;
+	struct weston_config_section *section = NULL;
+	const char *section_name;
+
+	caps = zalloc(sizeof *caps);
+	if (!caps)
+		return -1;
+
+	caps->compositor = compositor;
+	wl_list_init(&caps->rule_list);
+	wl_list_init(&caps->surface_list);
+
+	while (weston_config_next_section(config, &section, &section_name)) {
+		if (strcmp(section_name, "frame-rate-cap") != 0)
+			continue;
+
+		if (frame_rate_caps_add_rule(caps, section) < 0) {
+			frame_rate_caps_free(caps);
+			return -1;
+		}
+	}
+
+	if (wl_list_empty(&caps->rule_list)) {
+		free(caps);
+		return 0;
+	}
+
+	caps->create_surface_listener.notify = surface_created;
+	wl_signal_add(&compositor->create_surface_signal,
+		      &caps->create_surface_listener);
+	caps->destroy_listener.notify = frame_rate_caps_destroy;
+	wl_signal_add(&compositor->destroy_signal, &caps->destroy_listener);
+
+	return 0;
+}
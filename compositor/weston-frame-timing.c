@@ -0,0 +1,231 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "compositor.h"
+#include "weston.h"
+#include "weston-frame-timing-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+
+struct frame_timing {
+	struct weston_compositor *compositor;
+	struct wl_global *global;
+	struct wl_listener destroy_listener;
+};
+
+struct output_timing {
+	struct wl_resource *resource;
+	struct weston_output *output;
+	struct wl_listener scheduled_listener;
+	struct wl_listener output_destroy_listener;
+};
+
+static void
+output_timing_send_schedule(struct output_timing *ot)
+{
+	struct weston_output *output = ot->output;
+	uint64_t deadline_sec = output->next_repaint.tv_sec;
+	uint64_t present_sec = output->next_presentation.tv_sec;
+	uint32_t refresh = 0;
+
+	if (!output->vrr_active && output->current_mode->refresh > 0)
+		refresh = 1000000000000LL / output->current_mode->refresh;
+
+	weston_output_timing_send_schedule(ot->resource,
+					   deadline_sec >> 32,
+					   deadline_sec & 0xffffffff,
+					   output->next_repaint.tv_nsec,
+					   present_sec >> 32,
+					   present_sec & 0xffffffff,
+					   output->next_presentation.tv_nsec,
+					   refresh);
+}
+
+static void
+output_timing_scheduled(struct wl_listener *listener, void *data)
+{
+	struct output_timing *ot =
+		container_of(listener, struct output_timing,
+			     scheduled_listener);
+
+	output_timing_send_schedule(ot);
+}
+
+static void
+output_timing_detach(struct output_timing *ot)
+{
+	if (!ot->output)
+		return;
+
+	wl_list_remove(&ot->scheduled_listener.link);
+	wl_list_remove(&ot->output_destroy_listener.link);
+	ot->output = NULL;
+}
+
+static void
+output_timing_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct output_timing *ot =
+		container_of(listener, struct output_timing,
+			     output_destroy_listener);
+
+	output_timing_detach(ot);
+}
+
+static void
+output_timing_resource_destroyed(struct wl_resource *resource)
+{
+	struct output_timing *ot = wl_resource_get_user_data(resource);
+
+	output_timing_detach(ot);
+	free(ot);
+}
+
+static void
+output_timing_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_output_timing_interface
+output_timing_implementation = {
+	output_timing_destroy,
+};
+
+static void
+frame_timing_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+frame_timing_get_output_timing(struct wl_client *client,
+			       struct wl_resource *resource, uint32_t id,
+			       struct wl_resource *output_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct output_timing *ot;
+
+	ot = zalloc(sizeof *ot);
+	if (ot == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	ot->resource = wl_resource_create(client,
+					  &weston_output_timing_interface,
+					  1, id);
+	if (ot->resource == NULL) {
+		free(ot);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(ot->resource,
+				       &output_timing_implementation, ot,
+				       output_timing_resource_destroyed);
+
+	/* An output already gone just never sends anything */
+	if (!output || output->destroying)
+		return;
+
+	ot->output = output;
+	ot->scheduled_listener.notify = output_timing_scheduled;
+	wl_signal_add(&output->repaint_scheduled_signal,
+		      &ot->scheduled_listener);
+	ot->output_destroy_listener.notify = output_timing_output_destroyed;
+	wl_signal_add(&output->destroy_signal, &ot->output_destroy_listener);
+
+	/* Give the last known schedule right away, to start from */
+	if (output->next_presentation.tv_sec != 0 ||
+	    output->next_presentation.tv_nsec != 0)
+		output_timing_send_schedule(ot);
+}
+
+static const struct weston_frame_timing_interface
+frame_timing_implementation = {
+	frame_timing_destroy,
+	frame_timing_get_output_timing,
+};
+
+static void
+bind_frame_timing(struct wl_client *client,
+		  void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &weston_frame_timing_interface,
+				      1, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &frame_timing_implementation,
+				       data, NULL);
+}
+
+static void
+frame_timing_compositor_destroyed(struct wl_listener *listener, void *data)
+{
+	struct frame_timing *timing =
+		container_of(listener, struct frame_timing, destroy_listener);
+
+	wl_list_remove(&timing->destroy_listener.link);
+	wl_global_destroy(timing->global);
+	free(timing);
+}
+
+/** Advertise the weston_frame_timing global to all clients */
+int
+frame_timing_create(struct weston_compositor *compositor)
+{
+	struct frame_timing *timing;
+
+	timing = zalloc(sizeof *timing);
+	if (timing == NULL)
+		return -1;
+
+	timing->compositor = compositor;
+	timing->global = wl_global_create(compositor->wl_display,
+					  &weston_frame_timing_interface, 1,
+					  timing, bind_frame_timing);
+	if (timing->global == NULL) {
+		free(timing);
+		return -1;
+	}
+
+	timing->destroy_listener.notify = frame_timing_compositor_destroyed;
+	wl_signal_add(&compositor->destroy_signal, &timing->destroy_listener);
+
+	return 0;
+}
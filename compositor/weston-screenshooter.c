@@ -40,6 +40,8 @@ struct screenshooter {
 	struct weston_process process;
 	struct wl_listener destroy_listener;
 	struct weston_recorder *recorder;
+	struct weston_hw_recorder *hw_recorder;
+	struct weston_hw_recorder *stream;
 };
 
 static void
@@ -158,6 +160,51 @@ recorder_binding(struct weston_keyboard *keyboard, uint32_t time,
 	}
 }
 
+static void
+hw_recorder_binding(struct weston_keyboard *keyboard, uint32_t time,
+		    uint32_t key, void *data)
+{
+	struct weston_compositor *ec = keyboard->seat->compositor;
+	struct weston_output *output;
+	struct screenshooter *shooter = data;
+
+	if (shooter->hw_recorder) {
+		weston_hw_recorder_stop(shooter->hw_recorder);
+		shooter->hw_recorder = NULL;
+	} else {
+		if (keyboard->focus && keyboard->focus->output)
+			output = keyboard->focus->output;
+		else
+			output = container_of(ec->output_list.next,
+					      struct weston_output, link);
+
+		shooter->hw_recorder = weston_hw_recorder_start(output,
+								"capture");
+	}
+}
+
+static void
+stream_binding(struct weston_keyboard *keyboard, uint32_t time,
+	       uint32_t key, void *data)
+{
+	struct weston_compositor *ec = keyboard->seat->compositor;
+	struct weston_output *output;
+	struct screenshooter *shooter = data;
+
+	if (shooter->stream) {
+		weston_hw_recorder_stop(shooter->stream);
+		shooter->stream = NULL;
+	} else {
+		if (keyboard->focus && keyboard->focus->output)
+			output = keyboard->focus->output;
+		else
+			output = container_of(ec->output_list.next,
+					      struct weston_output, link);
+
+		shooter->stream = weston_hw_recorder_start_stream(output);
+	}
+}
+
 static void
 screenshooter_destroy(struct wl_listener *listener, void *data)
 {
@@ -186,6 +233,10 @@ screenshooter_create(struct weston_compositor *ec)
 					  screenshooter_binding, shooter);
 	weston_compositor_add_key_binding(ec, KEY_R, MODIFIER_SUPER,
 					  recorder_binding, shooter);
+	weston_compositor_add_debug_binding(ec, KEY_Q,
+					    hw_recorder_binding, shooter);
+	weston_compositor_add_debug_binding(ec, KEY_P,
+					    stream_binding, shooter);
 
 	shooter->destroy_listener.notify = screenshooter_destroy;
 	wl_signal_add(&ec->destroy_signal, &shooter->destroy_listener);
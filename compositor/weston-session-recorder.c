@@ -0,0 +1,436 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "compositor.h"
+#include "weston.h"
+#include "linux-dmabuf.h"
+#include "shared/helpers.h"
+#include "shared/session-record-format.h"
+#include "shared/timespec-util.h"
+#include "shared/zalloc.h"
+
+/*
+ * Records what clients commit, with the contents of SHM buffers, into
+ * the format of session-record-format.h, so that the replay benchmark
+ * can put the same load on another weston.
+ */
+
+struct session_recorder {
+	struct weston_compositor *compositor;
+	FILE *fp;
+	struct timespec begin;
+	uint32_t next_id;
+	/* NULL separated process names to record, or NULL for all */
+	char **clients;
+
+	struct wl_listener create_surface_listener;
+	struct wl_listener destroy_listener;
+	struct wl_list surface_list;
+};
+
+struct recorded_surface {
+	struct session_recorder *recorder;
+	struct weston_surface *surface;
+	uint32_t id;
+	struct wl_listener commit_listener;
+	struct wl_listener destroy_listener;
+	struct wl_list link;
+};
+
+static uint64_t
+recorder_now(struct session_recorder *recorder)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return timespec_sub_to_nsec(&now, &recorder->begin);
+}
+
+static void
+recorder_write(struct session_recorder *recorder, const void *data,
+	       size_t size)
+{
+	static const uint8_t zero[8];
+
+	if (!recorder->fp)
+		return;
+
+	if (fwrite(data, size, 1, recorder->fp) != 1 ||
+	    (size % 8 && fwrite(zero, 8 - size % 8, 1, recorder->fp) != 1)) {
+		weston_log("session recorder: write failed, stopping: %m\n");
+		fclose(recorder->fp);
+		recorder->fp = NULL;
+	}
+}
+
+static void
+recorded_surface_destroy(struct recorded_surface *rs)
+{
+	wl_list_remove(&rs->commit_listener.link);
+	wl_list_remove(&rs->destroy_listener.link);
+	wl_list_remove(&rs->link);
+	free(rs);
+}
+
+static void
+surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct recorded_surface *rs =
+		container_of(listener, struct recorded_surface,
+			     destroy_listener);
+	struct session_record record = {
+		.type = SESSION_RECORD_DESTROY,
+		.size = sizeof record,
+		.time_nsec = recorder_now(rs->recorder),
+		.surface_id = rs->id,
+	};
+
+	recorder_write(rs->recorder, &record, sizeof record);
+	recorded_surface_destroy(rs);
+}
+
+static size_t
+round_up_8(size_t size)
+{
+	return (size + 7) & ~(size_t) 7;
+}
+
+/* The damaged rectangles of an SHM buffer with 4 byte pixels, row by
+ * row, padded to 8 bytes at the end */
+static void
+recorder_write_pixels(struct session_recorder *recorder,
+		      struct wl_shm_buffer *shm,
+		      const struct session_record_rect *rects, int n,
+		      size_t pixel_bytes)
+{
+	static const uint8_t zero[8];
+	int32_t stride = wl_shm_buffer_get_stride(shm);
+	const uint8_t *pixels;
+	bool failed = false;
+	int i, row;
+
+	if (!recorder->fp)
+		return;
+
+	wl_shm_buffer_begin_access(shm);
+	pixels = wl_shm_buffer_get_data(shm);
+	for (i = 0; i < n && !failed; i++)
+		for (row = 0; row < rects[i].height && !failed; row++)
+			failed = fwrite(pixels +
+					(size_t) (rects[i].y + row) * stride +
+					rects[i].x * 4,
+					rects[i].width * 4, 1,
+					recorder->fp) != 1;
+	wl_shm_buffer_end_access(shm);
+
+	if (!failed && pixel_bytes % 8)
+		failed = fwrite(zero, 8 - pixel_bytes % 8, 1,
+				recorder->fp) != 1;
+
+	if (failed) {
+		weston_log("session recorder: write failed, stopping: %m\n");
+		fclose(recorder->fp);
+		recorder->fp = NULL;
+	}
+}
+
+static void
+surface_committed(struct wl_listener *listener, void *data)
+{
+	struct recorded_surface *rs =
+		container_of(listener, struct recorded_surface,
+			     commit_listener);
+	struct session_recorder *recorder = rs->recorder;
+	struct weston_surface *surface = rs->surface;
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	struct session_record_commit record = {
+		.base.type = SESSION_RECORD_COMMIT,
+		.base.surface_id = rs->id,
+	};
+	struct wl_shm_buffer *shm = NULL;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct weston_view *view;
+	struct session_record_rect *rects = NULL;
+	pixman_box32_t *boxes;
+	size_t pixel_bytes = 0;
+	float x, y;
+	int i, n = 0;
+
+	record.base.time_nsec = recorder_now(recorder);
+
+	view = wl_list_empty(&surface->views) ? NULL :
+		container_of(surface->views.next, struct weston_view,
+			     surface_link);
+	if (view) {
+		weston_view_to_global_float(view, 0, 0, &x, &y);
+		record.x = x;
+		record.y = y;
+	}
+
+	if (buffer && buffer->resource) {
+		record.width = buffer->width;
+		record.height = buffer->height;
+
+		shm = wl_shm_buffer_get(buffer->resource);
+		dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+		if (shm) {
+			record.buffer_type = SESSION_BUFFER_SHM;
+			record.format = wl_shm_buffer_get_format(shm);
+			record.width = wl_shm_buffer_get_width(shm);
+			record.height = wl_shm_buffer_get_height(shm);
+		} else if (dmabuf) {
+			record.buffer_type = SESSION_BUFFER_DMABUF;
+			record.format = dmabuf->attributes.format;
+			record.modifier = dmabuf->attributes.modifier[0];
+			record.plane_count = dmabuf->attributes.n_planes;
+		} else {
+			record.buffer_type = SESSION_BUFFER_OTHER;
+		}
+
+		boxes = pixman_region32_rectangles(&surface->buffer_damage, &n);
+		rects = zalloc(MAX(n, 1) * sizeof *rects);
+		if (!rects)
+			return;
+
+		for (i = 0; i < n; i++) {
+			rects[i].x = boxes[i].x1;
+			rects[i].y = boxes[i].y1;
+			rects[i].width = boxes[i].x2 - boxes[i].x1;
+			rects[i].height = boxes[i].y2 - boxes[i].y1;
+			pixel_bytes += (size_t) rects[i].width *
+				       rects[i].height * 4;
+		}
+	}
+
+	/* Only 4 byte formats are copied; others replay as solid fills */
+	if (shm && wl_shm_buffer_get_stride(shm) >= record.width * 4 &&
+	    (record.format == WL_SHM_FORMAT_ARGB8888 ||
+	     record.format == WL_SHM_FORMAT_XRGB8888))
+		record.has_pixels = 1;
+	else
+		pixel_bytes = 0;
+
+	record.damage_count = n;
+	record.base.size = sizeof record + n * sizeof *rects +
+			   round_up_8(pixel_bytes);
+
+	recorder_write(recorder, &record, sizeof record);
+	if (n)
+		recorder_write(recorder, rects, n * sizeof *rects);
+
+	if (record.has_pixels && pixel_bytes)
+		recorder_write_pixels(recorder, shm, rects, n, pixel_bytes);
+
+	free(rects);
+}
+
+static bool
+recorder_wants_client(struct session_recorder *recorder,
+		      struct wl_client *client, pid_t *pid, char *name,
+		      size_t name_size)
+{
+	char path[64];
+	FILE *fp;
+	size_t len = 0;
+	char **c;
+
+	name[0] = '\0';
+	wl_client_get_credentials(client, pid, NULL, NULL);
+
+	snprintf(path, sizeof path, "/proc/%d/comm", (int) *pid);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fgets(name, name_size, fp))
+			len = strlen(name);
+		fclose(fp);
+	}
+	if (len > 0 && name[len - 1] == '\n')
+		name[len - 1] = '\0';
+
+	if (!recorder->clients)
+		return true;
+
+	for (c = recorder->clients; *c; c++)
+		if (strcmp(*c, name) == 0)
+			return true;
+
+	return false;
+}
+
+static void
+surface_created(struct wl_listener *listener, void *data)
+{
+	struct session_recorder *recorder =
+		container_of(listener, struct session_recorder,
+			     create_surface_listener);
+	struct weston_surface *surface = data;
+	struct session_record_surface record = {
+		.base.type = SESSION_RECORD_SURFACE,
+		.base.size = sizeof record,
+	};
+	struct recorded_surface *rs;
+	pid_t pid = 0;
+
+	if (!surface->resource ||
+	    !recorder_wants_client(recorder,
+				   wl_resource_get_client(surface->resource),
+				   &pid, record.client_name,
+				   sizeof record.client_name))
+		return;
+
+	rs = zalloc(sizeof *rs);
+	if (!rs)
+		return;
+
+	rs->recorder = recorder;
+	rs->surface = surface;
+	rs->id = ++recorder->next_id;
+	rs->commit_listener.notify = surface_committed;
+	wl_signal_add(&surface->commit_signal, &rs->commit_listener);
+	rs->destroy_listener.notify = surface_destroyed;
+	wl_signal_add(&surface->destroy_signal, &rs->destroy_listener);
+	wl_list_insert(&recorder->surface_list, &rs->link);
+
+	record.base.time_nsec = recorder_now(recorder);
+	record.base.surface_id = rs->id;
+	record.client_pid = pid;
+	recorder_write(recorder, &record, sizeof record);
+}
+
+static void
+recorder_destroy(struct wl_listener *listener, void *data)
+{
+	struct session_recorder *recorder =
+		container_of(listener, struct session_recorder,
+			     destroy_listener);
+	struct recorded_surface *rs, *tmp;
+	char **c;
+
+	wl_list_for_each_safe(rs, tmp, &recorder->surface_list, link)
+		recorded_surface_destroy(rs);
+
+	wl_list_remove(&recorder->create_surface_listener.link);
+	wl_list_remove(&recorder->destroy_listener.link);
+
+	if (recorder->fp)
+		fclose(recorder->fp);
+
+	if (recorder->clients) {
+		for (c = recorder->clients; *c; c++)
+			free(*c);
+		free(recorder->clients);
+	}
+	free(recorder);
+}
+
+static char **
+split_names(const char *list)
+{
+	char **names, *copy, *name, *save = NULL;
+	int count = 0;
+
+	names = zalloc((strlen(list) / 2 + 2) * sizeof *names);
+	copy = strdup(list);
+	if (!names || !copy) {
+		free(names);
+		free(copy);
+		return NULL;
+	}
+
+	for (name = strtok_r(copy, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save))
+		names[count++] = strdup(name);
+
+	free(copy);
+
+	return names;
+}
+
+/** Record the sessions of clients to a file
+ *
+ * \param compositor The compositor.
+ * \param path The file to write, truncated first.
+ * \param clients Comma separated process names to record, or NULL for
+ * every client.
+ *
+ * Surfaces created from now on are recorded, until weston exits.
+ */
+int
+session_recorder_create(struct weston_compositor *compositor,
+			const char *path, const char *clients)
+{
+	struct session_recorder *recorder;
+	struct session_file_header header = {
+		.magic = SESSION_FILE_MAGIC,
+		.version = SESSION_FILE_VERSION,
+	};
+
+	recorder = zalloc(sizeof *recorder);
+	if (!recorder)
+		return -1;
+
+	recorder->fp = fopen(path, "we");
+	if (!recorder->fp) {
+		weston_log("session recorder: cannot open %s: %m\n", path);
+		free(recorder);
+		return -1;
+	}
+
+	if (clients && clients[0]) {
+		recorder->clients = split_names(clients);
+		if (!recorder->clients) {
+			fclose(recorder->fp);
+			free(recorder);
+			return -1;
+		}
+	}
+
+	recorder->compositor = compositor;
+	clock_gettime(CLOCK_MONOTONIC, &recorder->begin);
+	wl_list_init(&recorder->surface_list);
+	recorder_write(recorder, &header, sizeof header);
+
+	recorder->create_surface_listener.notify = surface_created;
+	wl_signal_add(&compositor->create_surface_signal,
+		      &recorder->create_surface_listener);
+	recorder->destroy_listener.notify = recorder_destroy;
+	wl_signal_add(&compositor->destroy_signal,
+		      &recorder->destroy_listener);
+
+	weston_log("recording client sessions to %s\n", path);
+
+	return 0;
+}
@@ -35,6 +35,20 @@ extern "C" {
 void
 screenshooter_create(struct weston_compositor *ec);
 
+int
+debug_stats_create(struct weston_compositor *compositor);
+
+int
+frame_timing_create(struct weston_compositor *compositor);
+
+int
+session_recorder_create(struct weston_compositor *compositor,
+			const char *path, const char *clients);
+
+int
+frame_rate_caps_create(struct weston_compositor *compositor,
+		       struct weston_config *config);
+
 struct weston_process;
 typedef void (*weston_process_cleanup_func_t)(struct weston_process *process,
 					    int status);
@@ -60,6 +74,10 @@ weston_watch_process(struct weston_process *process);
 struct weston_config *
 wet_get_config(struct weston_compositor *compositor);
 
+void
+wet_add_config_changed_listener(struct weston_compositor *compositor,
+				struct wl_listener *listener);
+
 void *
 wet_load_module_entrypoint(const char *name, const char *entrypoint);
 
@@ -80,6 +98,9 @@ module_init(struct weston_compositor *compositor,
 int
 wet_load_xwayland(struct weston_compositor *comp);
 
+int32_t
+wet_get_first_frame_msec(struct weston_compositor *ec);
+
 struct text_backend;
 
 struct text_backend *
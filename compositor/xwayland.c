@@ -42,6 +42,10 @@ struct wet_xwayland {
 	struct wl_client *client;
 	int wm_fd;
 	struct weston_process process;
+
+	int32_t prewarm_delay; /* s after the first frame; -1 never */
+	struct wl_listener first_frame_listener;
+	struct wl_event_source *prewarm_source;
 };
 
 static int
@@ -167,6 +171,45 @@ xserver_cleanup(struct weston_process *process, int status)
 	wxw->client = NULL;
 }
 
+static int
+prewarm_xserver(void *data)
+{
+	struct wet_xwayland *wxw = data;
+
+	wl_event_source_remove(wxw->prewarm_source);
+	wxw->prewarm_source = NULL;
+
+	weston_log("Starting Xwayland ahead of its first client\n");
+	wxw->api->spawn(wxw->xwayland);
+
+	return 0;
+}
+
+static void
+schedule_prewarm(struct wet_xwayland *wxw)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(wxw->compositor->wl_display);
+
+	wxw->prewarm_source = wl_event_loop_add_timer(loop, prewarm_xserver,
+						      wxw);
+	if (wxw->prewarm_source)
+		wl_event_source_timer_update(wxw->prewarm_source,
+					     MAX(wxw->prewarm_delay * 1000, 1));
+}
+
+/* The delay counts from the first frame, to stay out of startup */
+static void
+handle_first_frame(struct wl_listener *listener, void *data)
+{
+	struct wet_xwayland *wxw =
+		container_of(listener, struct wet_xwayland,
+			     first_frame_listener);
+
+	wl_list_remove(&wxw->first_frame_listener.link);
+	schedule_prewarm(wxw);
+}
+
 int
 wet_load_xwayland(struct weston_compositor *comp)
 {
@@ -174,6 +217,8 @@ wet_load_xwayland(struct weston_compositor *comp)
 	struct weston_xwayland *xwayland;
 	struct wet_xwayland *wxw;
 	struct wl_event_loop *loop;
+	struct weston_config_section *section;
+	int subsurface_decorations;
 
 	if (weston_compositor_load_xwayland(comp) < 0)
 		return -1;
@@ -205,5 +250,22 @@ wet_load_xwayland(struct weston_compositor *comp)
 	wxw->sigusr1_source = wl_event_loop_add_signal(loop, SIGUSR1,
 						       handle_sigusr1, wxw);
 
+	section = weston_config_get_section(wet_get_config(comp),
+					    "xwayland", NULL, NULL);
+	weston_config_section_get_bool(section, "subsurface-decorations",
+				       &subsurface_decorations, 0);
+	api->set_subsurface_decorations(xwayland, subsurface_decorations);
+	weston_config_section_get_int(section, "prewarm-delay",
+				      &wxw->prewarm_delay, -1);
+	if (wxw->prewarm_delay >= 0) {
+		if (comp->first_frame_presented) {
+			schedule_prewarm(wxw);
+		} else {
+			wxw->first_frame_listener.notify = handle_first_frame;
+			wl_signal_add(&comp->first_frame_signal,
+				      &wxw->first_frame_listener);
+		}
+	}
+
 	return 0;
 }
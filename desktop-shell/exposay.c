@@ -53,6 +53,13 @@ struct exposay_surface {
 	 * transformation in a steady state - so, we apply our own once the
 	 * animation has finished. */
 	struct weston_transform transform;
+
+	/* A copy of surface at the size of its tile, refreshed when it
+	 * commits damage, shown and animated instead of scaling view.
+	 * NULL if the renderer can't make one. */
+	struct weston_surface *thumbnail;
+	struct weston_view *thumbnail_view;
+	struct wl_listener commit_listener;
 };
 
 static void exposay_set_state(struct desktop_shell *shell,
@@ -63,6 +70,8 @@ static void exposay_check_state(struct desktop_shell *shell);
 static void
 exposay_surface_destroy(struct exposay_surface *esurface)
 {
+	struct weston_view *thumbnail_view = esurface->thumbnail_view;
+
 	wl_list_remove(&esurface->link);
 	wl_list_remove(&esurface->view_destroy_listener.link);
 
@@ -71,6 +80,16 @@ exposay_surface_destroy(struct exposay_surface *esurface)
 	if (esurface->shell->exposay.focus_prev == esurface->view)
 		esurface->shell->exposay.focus_prev = NULL;
 
+	/* Destroying the thumbnail ends a running animation, whose done
+	 * callback sees thumbnail_view cleared and leaves the esurface
+	 * alone. */
+	if (thumbnail_view) {
+		wl_list_remove(&esurface->commit_listener.link);
+		esurface->thumbnail_view = NULL;
+		weston_layer_entry_remove(&thumbnail_view->layer_link);
+		weston_surface_destroy(esurface->thumbnail);
+	}
+
 	free(esurface);
 }
 
@@ -110,11 +129,30 @@ exposay_animate_in_done(struct weston_view_animation *animation, void *data)
 	exposay_in_flight_dec(esurface->shell);
 }
 
+static void
+exposay_thumbnail_in_done(struct weston_view_animation *animation, void *data)
+{
+	struct exposay_surface *esurface = data;
+
+	exposay_in_flight_dec(esurface->shell);
+}
+
 static void
 exposay_animate_in(struct exposay_surface *esurface)
 {
 	exposay_in_flight_inc(esurface->shell);
 
+	/* The thumbnail starts out over the window and shrinks into its
+	 * tile, where it stays without a transformation. */
+	if (esurface->thumbnail_view) {
+		weston_move_scale_run(esurface->thumbnail_view,
+		                      esurface->view->geometry.x - esurface->x,
+		                      esurface->view->geometry.y - esurface->y,
+				      1.0, 1.0 / esurface->scale, 1,
+		                      exposay_thumbnail_in_done, esurface);
+		return;
+	}
+
 	weston_move_scale_run(esurface->view,
 	                      esurface->x - esurface->view->geometry.x,
 	                      esurface->y - esurface->view->geometry.y,
@@ -133,11 +171,32 @@ exposay_animate_out_done(struct weston_view_animation *animation, void *data)
 	exposay_in_flight_dec(shell);
 }
 
+static void
+exposay_thumbnail_out_done(struct weston_view_animation *animation, void *data)
+{
+	struct exposay_surface *esurface = data;
+	struct desktop_shell *shell = esurface->shell;
+
+	if (esurface->thumbnail_view)
+		exposay_surface_destroy(esurface);
+
+	exposay_in_flight_dec(shell);
+}
+
 static void
 exposay_animate_out(struct exposay_surface *esurface)
 {
 	exposay_in_flight_inc(esurface->shell);
 
+	if (esurface->thumbnail_view) {
+		weston_move_scale_run(esurface->thumbnail_view,
+		                      esurface->view->geometry.x - esurface->x,
+		                      esurface->view->geometry.y - esurface->y,
+				      1.0, 1.0 / esurface->scale, 0,
+		                      exposay_thumbnail_out_done, esurface);
+		return;
+	}
+
 	/* Remove the static transformation set up by
 	 * exposay_transform_in_done(). */
 	wl_list_remove(&esurface->transform.link);
@@ -207,6 +266,105 @@ handle_view_destroy(struct wl_listener *listener, void *data)
 	exposay_surface_destroy(esurface);
 }
 
+static void
+exposay_update_thumbnail(struct exposay_surface *esurface)
+{
+	struct weston_surface *thumbnail = esurface->thumbnail;
+
+	if (weston_surface_copy_scaled(thumbnail, esurface->view->surface,
+				       esurface->width,
+				       esurface->height) == 0)
+		return;
+
+	/* Nothing the renderer can copy, e.g. a solid color surface */
+	weston_surface_set_color(thumbnail, 0.2, 0.2, 0.2, 1.0);
+	weston_surface_set_size(thumbnail, esurface->width, esurface->height);
+	weston_surface_damage(thumbnail);
+}
+
+static void
+handle_surface_commit(struct wl_listener *listener, void *data)
+{
+	struct exposay_surface *esurface = container_of(listener,
+						 struct exposay_surface,
+						 commit_listener);
+	struct weston_surface *surface = data;
+
+	if (pixman_region32_not_empty(&surface->damage))
+		exposay_update_thumbnail(esurface);
+}
+
+static int
+exposay_create_thumbnail(struct exposay_surface *esurface)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(esurface->shell->compositor);
+	if (!surface)
+		return -1;
+
+	view = weston_view_create(surface);
+	if (!view) {
+		weston_surface_destroy(surface);
+		return -1;
+	}
+
+	esurface->thumbnail = surface;
+	esurface->thumbnail_view = view;
+	exposay_update_thumbnail(esurface);
+
+	weston_view_set_position(view, esurface->x, esurface->y);
+	weston_layer_entry_insert(&esurface->shell->exposay.layer.view_list,
+				  &view->layer_link);
+
+	esurface->commit_listener.notify = handle_surface_commit;
+	wl_signal_add(&esurface->view->surface->commit_signal,
+		      &esurface->commit_listener);
+
+	return 0;
+}
+
+/* With thumbnails the windows are covered for as long as exposay is
+ * active, by a copy of the output's background, so that repaints draw
+ * neither at full size. They are still on the output and keep getting
+ * frame callbacks, at the occluded frame rate if one is set. */
+static void
+exposay_create_backdrop(struct desktop_shell *shell,
+			struct shell_output *shell_output)
+{
+	struct weston_output *output = shell_output->output;
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(shell->compositor);
+	if (!surface)
+		return;
+
+	view = weston_view_create(surface);
+	if (!view) {
+		weston_surface_destroy(surface);
+		return;
+	}
+
+	if (!shell_output->background_surface ||
+	    weston_surface_copy_scaled(surface,
+				       shell_output->background_surface,
+				       output->width, output->height) < 0) {
+		weston_surface_set_color(surface, 0.0, 0.0, 0.0, 1.0);
+		weston_surface_set_size(surface, output->width, output->height);
+	}
+	pixman_region32_fini(&surface->opaque);
+	pixman_region32_init_rect(&surface->opaque, 0, 0,
+				  output->width, output->height);
+
+	/* Inserted before the thumbnails, so below them; outputs don't
+	 * overlap, so neither do the backdrops. */
+	weston_view_set_position(view, output->x, output->y);
+	weston_layer_entry_insert(&shell->exposay.layer.view_list,
+				  &view->layer_link);
+}
+
 /* Pretty lame layout for now; just tries to make a square.  Should take
  * aspect ratio into account really.  Also needs to be notified of surface
  * addition and removal and adjust layout/animate accordingly. */
@@ -221,6 +379,8 @@ exposay_layout(struct desktop_shell *shell, struct shell_output *shell_output)
 	int w, h;
 	int i;
 	int last_row_removed = 0;
+	bool thumbnails =
+		shell->compositor->renderer->surface_copy_scaled != NULL;
 
 	eoutput->num_surfaces = 0;
 	wl_list_for_each(view, &workspace->layer.view_list.link, layer_link.link) {
@@ -254,6 +414,9 @@ exposay_layout(struct desktop_shell *shell, struct shell_output *shell_output)
 			eoutput->grid_width++;
 	}
 
+	if (thumbnails)
+		exposay_create_backdrop(shell, shell_output);
+
 	last_row_removed = (eoutput->grid_width * eoutput->grid_height) - eoutput->num_surfaces;
 
 	eoutput->hpadding_outer = (output->width / 20);
@@ -321,6 +484,16 @@ exposay_layout(struct desktop_shell *shell, struct shell_output *shell_output)
 
 		esurface->y += (h - esurface->height) / 2;
 
+		esurface->thumbnail = NULL;
+		esurface->thumbnail_view = NULL;
+		if (thumbnails && exposay_create_thumbnail(esurface) < 0) {
+			wl_list_remove(&esurface->link);
+			free(esurface);
+			exposay_set_state(shell, EXPOSAY_TARGET_CANCEL,
+			                  shell->exposay.seat);
+			break;
+		}
+
 		if (shell->exposay.focus_current == esurface->view)
 			highlight = esurface;
 
@@ -553,6 +726,14 @@ exposay_set_inactive(struct desktop_shell *shell)
 	struct weston_seat *seat = shell->exposay.seat;
 	struct weston_keyboard *keyboard = weston_seat_get_keyboard(seat);
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	struct weston_view *view, *next;
+
+	/* The thumbnails went with their exposay surfaces, so only the
+	 * backdrops are left. */
+	wl_list_for_each_safe(view, next, &shell->exposay.layer.view_list.link,
+			      layer_link.link)
+		weston_surface_destroy(view->surface);
+	weston_layer_unset_position(&shell->exposay.layer);
 
 	if (pointer)
 		weston_pointer_end_grab(pointer);
@@ -608,6 +789,8 @@ exposay_transition_active(struct desktop_shell *shell)
 	wl_list_init(&shell->exposay.surface_list);
 
 	lower_fullscreen_layer(shell, NULL);
+	weston_layer_set_position(&shell->exposay.layer,
+				  WESTON_LAYER_POSITION_NORMAL + 1);
 	shell->exposay.grab_kbd.interface = &exposay_kbd_grab;
 	weston_keyboard_start_grab(keyboard,
 	                           &shell->exposay.grab_kbd);
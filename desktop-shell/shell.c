@@ -124,6 +124,7 @@ struct shell_surface {
 	} fullscreen;
 
 	struct weston_transform workspace_transform;
+	struct wl_list workspace_sticky_link; /* workspaces.anim_sticky_list */
 
 	struct weston_output *fullscreen_output;
 	struct weston_output *output;
@@ -523,15 +524,6 @@ focus_surface_committed(struct weston_surface *es, int32_t sx, int32_t sy)
 {
 }
 
-static struct focus_surface *
-get_focus_surface(struct weston_surface *surface)
-{
-	if (surface->committed == focus_surface_committed)
-		return surface->committed_private;
-	else
-		return NULL;
-}
-
 static bool
 is_focus_surface (struct weston_surface *es)
 {
@@ -577,17 +569,11 @@ create_focus_surface(struct weston_compositor *ec,
 	fsurf->view->output = output;
 	fsurf->view->is_mapped = true;
 
-	weston_surface_set_size(surface, output->width, output->height);
-	weston_view_set_position(fsurf->view, output->x, output->y);
-	weston_surface_set_color(surface, 0.0, 0.0, 0.0, 1.0);
-	pixman_region32_fini(&surface->opaque);
-	pixman_region32_init_rect(&surface->opaque, output->x, output->y,
-				  output->width, output->height);
+	/* Empty, the views below are dimmed instead of blending black
+	 * over the whole output */
 	pixman_region32_fini(&surface->input);
 	pixman_region32_init(&surface->input);
 
-	wl_list_init(&fsurf->workspace_transform.link);
-
 	return fsurf;
 }
 
@@ -606,6 +592,65 @@ focus_animation_done(struct weston_view_animation *animation, void *data)
 	ws->focus_animation = NULL;
 }
 
+/* Darken the views below the focus surfaces of a workspace as much as
+ * the focus surfaces would, were they black and covering the output
+ * with their alpha. Only views whose dim changes are repainted. */
+static void
+workspace_update_dim(struct workspace *ws)
+{
+	struct desktop_shell *shell = ws->shell;
+	struct weston_view *view;
+	float keep = 1.0f;
+
+	wl_list_for_each(view, &ws->layer.view_list.link, layer_link.link) {
+		if (is_focus_view(view))
+			keep *= 1.0f - view->alpha;
+		else
+			weston_view_set_dim(view, 1.0f - keep);
+	}
+
+	if (ws != get_current_workspace(shell))
+		return;
+
+	wl_list_for_each(view, &shell->background_layer.view_list.link,
+			 layer_link.link)
+		weston_view_set_dim(view, 1.0f - keep);
+}
+
+static void
+workspace_dim_frame(struct weston_animation *animation,
+		    struct weston_output *output, uint32_t msecs)
+{
+	struct workspace *ws =
+		container_of(animation, struct workspace, dim_animation);
+
+	workspace_update_dim(ws);
+
+	if (!ws->focus_animation) {
+		wl_list_remove(&animation->link);
+		wl_list_init(&animation->link);
+	}
+}
+
+static void
+workspace_animate_dim(struct workspace *ws)
+{
+	struct weston_output *output;
+
+	workspace_update_dim(ws);
+
+	if (!ws->focus_animation || !wl_list_empty(&ws->dim_animation.link))
+		return;
+
+	output = ws->fsurf_front->view->output;
+	if (!output)
+		return;
+
+	ws->dim_animation.frame_counter = 0;
+	wl_list_insert(&output->animation_list, &ws->dim_animation.link);
+	weston_output_schedule_repaint(output);
+}
+
 static void
 focus_state_destroy(struct focus_state *state)
 {
@@ -668,6 +713,7 @@ focus_state_surface_destroy(struct wl_listener *listener, void *data)
 				state->ws->fsurf_front->view,
 				state->ws->fsurf_front->view->alpha, 0.0, 300,
 				focus_animation_done, state->ws);
+			workspace_animate_dim(state->ws);
 		}
 
 		wl_list_remove(&state->link);
@@ -865,6 +911,11 @@ animate_focus_change(struct desktop_shell *shell, struct workspace *ws,
 			ws->fsurf_back->view, 0.4,
 			focus_animation_done, ws);
 	}
+
+	/* It may have been dimmed outside of the workspace layer */
+	if (to)
+		weston_view_set_dim(to, 0.0f);
+	workspace_animate_dim(ws);
 }
 
 static void
@@ -872,6 +923,8 @@ workspace_destroy(struct workspace *ws)
 {
 	struct focus_state *state, *next;
 
+	wl_list_remove(&ws->dim_animation.link);
+
 	wl_list_for_each_safe(state, next, &ws->focus_list, link)
 		focus_state_destroy(state);
 
@@ -906,12 +959,15 @@ workspace_create(struct desktop_shell *shell)
 
 	weston_layer_init(&ws->layer, shell->compositor);
 
+	ws->shell = shell;
 	wl_list_init(&ws->focus_list);
 	wl_list_init(&ws->seat_destroyed_listener.link);
 	ws->seat_destroyed_listener.notify = seat_destroyed;
 	ws->fsurf_front = NULL;
 	ws->fsurf_back = NULL;
 	ws->focus_animation = NULL;
+	ws->dim_animation.frame = workspace_dim_frame;
+	wl_list_init(&ws->dim_animation.link);
 
 	return ws;
 }
@@ -954,60 +1010,88 @@ get_output_height(struct weston_output *output)
 	return abs(output->region.extents.y1 - output->region.extents.y2);
 }
 
-static void
-view_translate(struct workspace *ws, struct weston_view *view, double d)
+/* Workspaces slide by the height of the tallest output, so that they
+ * leave every output entirely. */
+static unsigned int
+get_workspace_height(struct desktop_shell *shell)
 {
-	struct weston_transform *transform;
+	struct weston_output *output;
+	unsigned int height = 0;
 
-	if (is_focus_view(view)) {
-		struct focus_surface *fsurf = get_focus_surface(view->surface);
-		transform = &fsurf->workspace_transform;
-	} else {
-		struct shell_surface *shsurf = get_shell_surface(view->surface);
-		transform = &shsurf->workspace_transform;
-	}
+	wl_list_for_each(output, &shell->compositor->output_list, link)
+		height = MAX(height, get_output_height(output));
+
+	return height;
+}
 
-	if (wl_list_empty(&transform->link))
-		wl_list_insert(view->geometry.transformation_list.prev,
-			       &transform->link);
+static void
+workspace_translate_out(struct desktop_shell *shell,
+			struct workspace *ws, double fraction)
+{
+	unsigned int height = get_workspace_height(shell);
 
-	weston_matrix_init(&transform->matrix);
-	weston_matrix_translate(&transform->matrix,
-				0.0, d, 0.0);
-	weston_view_geometry_dirty(view);
+	weston_layer_set_offset(&ws->layer, 0, lround(height * fraction));
 }
 
 static void
-workspace_translate_out(struct workspace *ws, double fraction)
+workspace_translate_in(struct desktop_shell *shell,
+		       struct workspace *ws, double fraction)
 {
-	struct weston_view *view;
-	unsigned int height;
+	unsigned int height = get_workspace_height(shell);
 	double d;
 
-	wl_list_for_each(view, &ws->layer.view_list.link, layer_link.link) {
-		height = get_output_height(view->surface->output);
-		d = height * fraction;
+	if (fraction > 0)
+		d = -(height - height * fraction);
+	else
+		d = height + height * fraction;
 
-		view_translate(ws, view, d);
-	}
+	weston_layer_set_offset(&ws->layer, 0, lround(d));
 }
 
+/* Surfaces taken along to the new workspace stay in place while the
+ * workspaces slide, by undoing the offset of the layer they are in. */
 static void
-workspace_translate_in(struct workspace *ws, double fraction)
+workspace_translate_sticky(struct desktop_shell *shell)
 {
+	struct shell_surface *shsurf;
+	struct weston_layer *layer;
 	struct weston_view *view;
-	unsigned int height;
-	double d;
 
-	wl_list_for_each(view, &ws->layer.view_list.link, layer_link.link) {
-		height = get_output_height(view->surface->output);
+	wl_list_for_each(shsurf, &shell->workspaces.anim_sticky_list,
+			 workspace_sticky_link) {
+		view = shsurf->view;
+		layer = view->layer_link.layer;
+		if (!layer)
+			continue;
 
-		if (fraction > 0)
-			d = -(height - height * fraction);
-		else
-			d = height + height * fraction;
+		if (wl_list_empty(&shsurf->workspace_transform.link))
+			wl_list_insert(view->geometry.transformation_list.prev,
+				       &shsurf->workspace_transform.link);
 
-		view_translate(ws, view, d);
+		weston_matrix_init(&shsurf->workspace_transform.matrix);
+		weston_matrix_translate(&shsurf->workspace_transform.matrix,
+					-layer->offset_x, -layer->offset_y,
+					0.0);
+		weston_view_geometry_dirty(view);
+	}
+}
+
+static void
+workspace_release_sticky(struct desktop_shell *shell)
+{
+	struct shell_surface *shsurf, *next;
+
+	wl_list_for_each_safe(shsurf, next,
+			      &shell->workspaces.anim_sticky_list,
+			      workspace_sticky_link) {
+		wl_list_remove(&shsurf->workspace_sticky_link);
+		wl_list_init(&shsurf->workspace_sticky_link);
+
+		if (!wl_list_empty(&shsurf->workspace_transform.link)) {
+			wl_list_remove(&shsurf->workspace_transform.link);
+			wl_list_init(&shsurf->workspace_transform.link);
+			weston_view_geometry_dirty(shsurf->view);
+		}
 	}
 }
 
@@ -1030,29 +1114,6 @@ reverse_workspace_change_animation(struct desktop_shell *shell,
 	weston_compositor_schedule_repaint(shell->compositor);
 }
 
-static void
-workspace_deactivate_transforms(struct workspace *ws)
-{
-	struct weston_view *view;
-	struct weston_transform *transform;
-
-	wl_list_for_each(view, &ws->layer.view_list.link, layer_link.link) {
-		if (is_focus_view(view)) {
-			struct focus_surface *fsurf = get_focus_surface(view->surface);
-			transform = &fsurf->workspace_transform;
-		} else {
-			struct shell_surface *shsurf = get_shell_surface(view->surface);
-			transform = &shsurf->workspace_transform;
-		}
-
-		if (!wl_list_empty(&transform->link)) {
-			wl_list_remove(&transform->link);
-			wl_list_init(&transform->link);
-		}
-		weston_view_geometry_dirty(view);
-	}
-}
-
 static void
 finish_workspace_change_animation(struct desktop_shell *shell,
 				  struct workspace *from,
@@ -1070,8 +1131,9 @@ finish_workspace_change_animation(struct desktop_shell *shell,
 		weston_view_damage_below(view);
 
 	wl_list_remove(&shell->workspaces.animation.link);
-	workspace_deactivate_transforms(from);
-	workspace_deactivate_transforms(to);
+	weston_layer_set_offset(&from->layer, 0, 0);
+	weston_layer_set_offset(&to->layer, 0, 0);
+	workspace_release_sticky(shell);
 	shell->workspaces.anim_to = NULL;
 
 	weston_layer_unset_position(&shell->workspaces.anim_from->layer);
@@ -1115,14 +1177,15 @@ animate_workspace_change_frame(struct weston_animation *animation,
 	x = t * (1.0/DEFAULT_WORKSPACE_CHANGE_ANIMATION_LENGTH) * M_PI_2;
 	y = sin(x);
 
+	/* The output keeps repainting while the animation is on its list,
+	 * and the views that move damage the other outputs. */
 	if (t < DEFAULT_WORKSPACE_CHANGE_ANIMATION_LENGTH) {
-		weston_compositor_schedule_repaint(shell->compositor);
-
-		workspace_translate_out(from, shell->workspaces.anim_dir * y);
-		workspace_translate_in(to, shell->workspaces.anim_dir * y);
+		workspace_translate_out(shell, from,
+					shell->workspaces.anim_dir * y);
+		workspace_translate_in(shell, to,
+				       shell->workspaces.anim_dir * y);
+		workspace_translate_sticky(shell);
 		shell->workspaces.anim_current = y;
-
-		weston_compositor_schedule_repaint(shell->compositor);
 	}
 	else
 		finish_workspace_change_animation(shell, from, to);
@@ -1159,7 +1222,8 @@ animate_workspace_change(struct desktop_shell *shell,
 	weston_layer_set_position(&to->layer, WESTON_LAYER_POSITION_NORMAL);
 	weston_layer_set_position(&from->layer, WESTON_LAYER_POSITION_NORMAL - 1);
 
-	workspace_translate_in(to, 0);
+	workspace_translate_in(shell, to, 0);
+	workspace_translate_sticky(shell);
 
 	restore_focus_state(shell, to);
 
@@ -1196,6 +1260,8 @@ change_workspace(struct desktop_shell *shell, unsigned int index)
 	    shell->workspaces.anim_to == from) {
 		restore_focus_state(shell, to);
 		reverse_workspace_change_animation(shell, index, from, to);
+		if (shell->focus_animation_type == ANIMATION_DIM_LAYER)
+			workspace_update_dim(to);
 		return;
 	}
 
@@ -1222,6 +1288,10 @@ change_workspace(struct desktop_shell *shell, unsigned int index)
 		update_workspace(shell, index, from, to);
 	else
 		animate_workspace_change(shell, index, from, to);
+
+	/* The background takes the dim of the new workspace */
+	if (shell->focus_animation_type == ANIMATION_DIM_LAYER)
+		workspace_update_dim(to);
 }
 
 static bool
@@ -1311,9 +1381,9 @@ take_surface_to_workspace_by_seat(struct desktop_shell *shell,
 		update_workspace(shell, index, from, to);
 	else {
 		if (shsurf != NULL &&
-		    wl_list_empty(&shsurf->workspace_transform.link))
+		    wl_list_empty(&shsurf->workspace_sticky_link))
 			wl_list_insert(&shell->workspaces.anim_sticky_list,
-				       &shsurf->workspace_transform.link);
+				       &shsurf->workspace_sticky_link);
 
 		animate_workspace_change(shell, index, from, to);
 	}
@@ -2334,6 +2404,7 @@ desktop_surface_added(struct weston_desktop_surface *desktop_surface,
 	weston_matrix_init(&shsurf->rotation.rotation);
 
 	wl_list_init(&shsurf->workspace_transform.link);
+	wl_list_init(&shsurf->workspace_sticky_link);
 
 	weston_desktop_surface_set_user_data(desktop_surface, shsurf);
 	weston_desktop_surface_set_activated(desktop_surface,
@@ -2354,6 +2425,9 @@ desktop_surface_removed(struct weston_desktop_surface *desktop_surface,
 
 	wl_signal_emit(&shsurf->destroy_signal, shsurf);
 
+	wl_list_remove(&shsurf->workspace_sticky_link);
+	wl_list_init(&shsurf->workspace_sticky_link);
+
 	if (shsurf->fullscreen.black_view)
 		weston_surface_destroy(shsurf->fullscreen.black_view->surface);
 
@@ -4980,6 +5054,7 @@ wet_shell_init(struct weston_compositor *ec,
 
 	shell->exposay.state_cur = EXPOSAY_LAYOUT_INACTIVE;
 	shell->exposay.state_target = EXPOSAY_TARGET_CANCEL;
+	weston_layer_init(&shell->exposay.layer, ec);
 
 	for (i = 0; i < shell->workspaces.num; i++) {
 		pws = wl_array_add(&shell->workspaces.array, sizeof *pws);
@@ -78,6 +78,8 @@ struct exposay {
 	struct weston_seat *seat;
 
 	struct wl_list surface_list;
+	/* Thumbnails and the backdrops covering the workspace */
+	struct weston_layer layer;
 
 	struct weston_keyboard_grab grab_kbd;
 	struct weston_pointer_grab grab_ptr;
@@ -97,7 +99,6 @@ struct exposay {
 struct focus_surface {
 	struct weston_surface *surface;
 	struct weston_view *view;
-	struct weston_transform workspace_transform;
 };
 
 struct workspace {
@@ -106,9 +107,15 @@ struct workspace {
 	struct wl_list focus_list;
 	struct wl_listener seat_destroyed_listener;
 
+	struct desktop_shell *shell;
+
+	/* Never shown, they mark where dimming starts in the layer, see
+	 * workspace_update_dim() */
 	struct focus_surface *fsurf_front;
 	struct focus_surface *fsurf_back;
 	struct weston_view_animation *focus_animation;
+	/* Follows focus_animation with the dim of the views */
+	struct weston_animation dim_animation;
 };
 
 struct shell_output {
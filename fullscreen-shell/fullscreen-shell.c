@@ -261,6 +261,8 @@ fs_output_set_surface(struct fs_output *fsout, struct weston_surface *surface,
 		      enum zwp_fullscreen_shell_v1_present_method method,
 		      int32_t framerate, int presented_for_mode);
 static void
+fs_output_update_black_view(struct fs_output *fsout);
+static void
 fs_output_apply_pending(struct fs_output *fsout);
 static void
 fs_output_clear_pending(struct fs_output *fsout);
@@ -296,6 +298,7 @@ surface_destroyed(struct wl_listener *listener, void *data)
 	fsout->view = NULL;
 	wl_list_remove(&fsout->transform.link);
 	wl_list_init(&fsout->transform.link);
+	fs_output_update_black_view(fsout);
 }
 
 static void
@@ -454,6 +457,57 @@ fs_output_scale_view(struct fs_output *fsout, float width, float height)
 	}
 }
 
+/* Whether the presented surface hides the whole output, so that the
+ * black background would only cost a composition pass for nothing and
+ * keep the surface off the scanout plane. */
+static bool
+fs_output_is_covered(struct fs_output *fsout)
+{
+	struct weston_view *view = fsout->view;
+	struct weston_surface *surface;
+	pixman_box32_t box;
+
+	if (!view || view->alpha != 1.0f)
+		return false;
+
+	surface = view->surface;
+	if (surface->width == 0 || surface->height == 0)
+		return false;
+
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = surface->width;
+	box.y2 = surface->height;
+	if (pixman_region32_contains_rectangle(&surface->opaque, &box) !=
+	    PIXMAN_REGION_IN)
+		return false;
+
+	weston_view_update_transform(view);
+
+	return pixman_region32_contains_rectangle(&view->transform.boundingbox,
+			pixman_region32_extents(&fsout->output->region)) ==
+	       PIXMAN_REGION_IN;
+}
+
+static void
+fs_output_update_black_view(struct fs_output *fsout)
+{
+	struct weston_layer_entry *bottom;
+	struct weston_view *black_view = fsout->black_view;
+	bool shown = black_view->layer_link.layer != NULL;
+
+	if (fs_output_is_covered(fsout)) {
+		if (shown)
+			weston_layer_entry_remove(&black_view->layer_link);
+	} else if (!shown) {
+		bottom = container_of(fsout->shell->layer.view_list.link.prev,
+				      struct weston_layer_entry, link);
+		weston_layer_entry_insert(bottom, &black_view->layer_link);
+		weston_view_geometry_dirty(black_view);
+		weston_surface_damage(black_view->surface);
+	}
+}
+
 static void
 fs_output_configure(struct fs_output *fsout, struct weston_surface *surface);
 
@@ -530,6 +584,7 @@ fs_output_configure_for_mode(struct fs_output *fsout,
 			     struct weston_surface *configured_surface)
 {
 	int32_t surf_x, surf_y, surf_width, surf_height;
+	struct weston_mode *current = fsout->output->current_mode;
 	struct weston_mode mode;
 	int ret;
 
@@ -569,8 +624,13 @@ fs_output_configure_for_mode(struct fs_output *fsout,
 	mode.flags = 0;
 	mode.refresh = fsout->pending.framerate;
 
-	ret = weston_output_mode_switch_to_temporary(fsout->output, &mode,
-					fsout->output->native_scale);
+	/* A mode already matching needs no modeset at all */
+	if (current->width == mode.width && current->height == mode.height &&
+	    (mode.refresh == 0 || current->refresh == mode.refresh))
+		ret = 0;
+	else
+		ret = weston_output_mode_switch_to_temporary(fsout->output,
+				&mode, fsout->output->native_scale);
 
 	if (ret != 0) {
 		/* The mode switch failed.  Clear the pending and
@@ -616,6 +676,8 @@ fs_output_configure(struct fs_output *fsout,
 			fs_output_configure_simple(fsout, surface);
 	}
 
+	fs_output_update_black_view(fsout);
+
 	weston_output_schedule_repaint(fsout->output);
 }
 
@@ -728,6 +790,7 @@ fs_output_set_surface(struct fs_output *fsout, struct weston_surface *surface,
 
 		fsout->surface = NULL;
 
+		fs_output_update_black_view(fsout);
 		weston_output_schedule_repaint(fsout->output);
 	}
 }
@@ -47,7 +47,9 @@ struct weston_desktop_xdg_surface {
 	struct wl_event_source *add_idle;
 	struct wl_event_source *configure_idle;
 	uint32_t configure_serial;
+	bool configure_unacked;
 	struct weston_size requested_size;
+	bool size_deferred;
 	struct {
 		bool maximized;
 		bool fullscreen;
@@ -87,9 +89,11 @@ weston_desktop_xdg_surface_send_configure(void *data)
 	struct wl_array states;
 
 	surface->configure_idle = NULL;
+	surface->size_deferred = false;
 
 	surface->configure_serial =
 		wl_display_next_serial(weston_desktop_get_display(surface->desktop));
+	surface->configure_unacked = true;
 
 	wl_array_init(&states);
 	if (surface->requested_state.maximized) {
@@ -199,6 +203,13 @@ weston_desktop_xdg_surface_set_size(struct weston_desktop_surface *dsurface,
 	    (width == 0 && height == 0))
 		return;
 
+	/* Hold back the sizes of an interactive resize until the client
+	 * caught up with the last configure; see xdg-shell-v6.c. */
+	if (surface->requested_state.resizing && surface->configure_unacked) {
+		surface->size_deferred = true;
+		return;
+	}
+
 	weston_desktop_xdg_surface_schedule_configure(surface);
 }
 
@@ -212,6 +223,12 @@ weston_desktop_xdg_surface_committed(struct weston_desktop_surface *dsurface,
 		weston_desktop_surface_get_surface(surface->surface);
 	bool reconfigure = false;
 
+	if (surface->size_deferred && !surface->configure_unacked)
+		weston_desktop_xdg_surface_schedule_configure(surface);
+
+	if (surface->requested_state.resizing && surface->configure_unacked)
+		weston_surface_defer_repaint(wsurface);
+
 	if (surface->next_state.maximized || surface->next_state.fullscreen)
 		reconfigure = surface->requested_size.width != wsurface->width ||
 			      surface->requested_size.height != wsurface->height;
@@ -415,6 +432,7 @@ weston_desktop_xdg_surface_protocol_ack_configure(struct wl_client *wl_client,
 	if (surface->configure_serial != serial)
 		return;
 
+	surface->configure_unacked = false;
 	surface->next_state = surface->requested_state;
 }
 
@@ -70,6 +70,7 @@ struct weston_desktop_xdg_surface {
 	bool configured;
 	struct wl_event_source *configure_idle;
 	uint32_t configure_serial;
+	bool configure_unacked;
 
 	bool has_next_geometry;
 	struct weston_geometry next_geometry;
@@ -83,6 +84,7 @@ struct weston_desktop_xdg_toplevel {
 	struct wl_resource *resource;
 	bool added;
 	struct weston_size requested_size;
+	bool size_deferred;
 	struct {
 		bool maximized;
 		bool fullscreen;
@@ -522,6 +524,8 @@ weston_desktop_xdg_toplevel_send_configure(struct weston_desktop_xdg_toplevel *t
 	uint32_t *s;
 	struct wl_array states;
 
+	toplevel->size_deferred = false;
+
 	wl_array_init(&states);
 	if (toplevel->requested_state.maximized) {
 		s = wl_array_add(&states, sizeof(uint32_t));
@@ -616,6 +620,16 @@ weston_desktop_xdg_toplevel_set_size(struct weston_desktop_surface *dsurface,
 	    (width == 0 && height == 0))
 		return;
 
+	/* An interactive resize changes the size on every pointer motion.
+	 * A client still busy with the last configure gets only the
+	 * latest size, once it has acked and committed, rather than
+	 * every size the pointer went through. */
+	if (toplevel->requested_state.resizing &&
+	    toplevel->base.configure_unacked) {
+		toplevel->size_deferred = true;
+		return;
+	}
+
 	weston_desktop_xdg_surface_schedule_configure(&toplevel->base);
 }
 
@@ -634,6 +648,16 @@ weston_desktop_xdg_toplevel_committed(struct weston_desktop_xdg_toplevel *toplev
 	if (!wsurface->buffer_ref.buffer)
 		return;
 
+	if (toplevel->size_deferred && !toplevel->base.configure_unacked)
+		weston_desktop_xdg_surface_schedule_configure(&toplevel->base);
+
+	/* A resizing client that has not acked the last configure yet is
+	 * still drawing an older size; the frame with the one asked for
+	 * should follow shortly, so this one need not be shown. */
+	if (toplevel->requested_state.resizing &&
+	    toplevel->base.configure_unacked)
+		weston_surface_defer_repaint(wsurface);
+
 	if (toplevel->next_state.maximized || toplevel->next_state.fullscreen)
 		reconfigure =
 			( ( toplevel->requested_size.width != wsurface->width ) ||
@@ -854,6 +878,7 @@ weston_desktop_xdg_surface_send_configure(void *user_data)
 	surface->configure_idle = NULL;
 	surface->configure_serial =
 		wl_display_next_serial(weston_desktop_get_display(surface->desktop));
+	surface->configure_unacked = true;
 
 	switch (surface->role) {
 	case WESTON_DESKTOP_XDG_SURFACE_ROLE_NONE:
@@ -1024,6 +1049,7 @@ weston_desktop_xdg_surface_protocol_ack_configure(struct wl_client *wl_client,
 		return;
 
 	surface->configured = true;
+	surface->configure_unacked = false;
 
 	switch (surface->role) {
 	case WESTON_DESKTOP_XDG_SURFACE_ROLE_NONE:
@@ -127,6 +127,7 @@ struct weston_view_animation {
 	struct weston_spring spring;
 	struct weston_transform transform;
 	struct wl_listener listener;
+	struct weston_deferred_work destroy_work;
 	float start, stop;
 	weston_view_animation_frame_func_t frame;
 	weston_view_animation_frame_func_t reset;
@@ -141,6 +142,7 @@ weston_view_animation_destroy(struct weston_view_animation *animation)
 	wl_list_remove(&animation->animation.link);
 	wl_list_remove(&animation->listener.link);
 	wl_list_remove(&animation->transform.link);
+	weston_deferred_work_cancel(&animation->destroy_work);
 	if (animation->reset)
 		animation->reset(animation);
 	weston_view_geometry_dirty(animation->view);
@@ -166,8 +168,6 @@ weston_view_animation_frame(struct weston_animation *base,
 	struct weston_view_animation *animation =
 		container_of(base,
 			     struct weston_view_animation, animation);
-	struct weston_compositor *compositor =
-		animation->view->surface->compositor;
 
 	if (base->frame_counter <= 1)
 		animation->spring.timestamp = msecs;
@@ -183,23 +183,18 @@ weston_view_animation_frame(struct weston_animation *base,
 	if (animation->frame)
 		animation->frame(animation);
 
+	/* The output repaints for as long as the animation is on its
+	 * animation_list, and this runs right before the view list is
+	 * rebuilt, so dirtying the geometry is all that is needed. */
 	weston_view_geometry_dirty(animation->view);
-	weston_view_schedule_repaint(animation->view);
-
-	/* The view's output_mask will be zero if its position is
-	 * offscreen. Animations should always run but as they are also
-	 * run off the repaint cycle, if there's nothing to repaint
-	 * the animation stops running. Therefore if we catch this situation
-	 * and schedule a repaint on all outputs it will be avoided.
-	 */
-	if (animation->view->output_mask == 0)
-		weston_compositor_schedule_repaint(compositor);
 }
 
 static void
-idle_animation_destroy(void *data)
+deferred_animation_destroy(struct weston_deferred_work *work)
 {
-	struct weston_view_animation *animation = data;
+	struct weston_view_animation *animation =
+		container_of(work, struct weston_view_animation,
+			     destroy_work);
 
 	weston_view_animation_destroy(animation);
 }
@@ -215,7 +210,6 @@ weston_view_animation_create(struct weston_view *view,
 {
 	struct weston_view_animation *animation;
 	struct weston_compositor *ec = view->surface->compositor;
-	struct wl_event_loop *loop;
 
 	animation = malloc(sizeof *animation);
 	if (!animation)
@@ -229,6 +223,8 @@ weston_view_animation_create(struct weston_view *view,
 	animation->start = start;
 	animation->stop = stop;
 	animation->private = private;
+	animation->destroy_work.run = deferred_animation_destroy;
+	animation->destroy_work.queued = false;
 
 	weston_matrix_init(&animation->transform.matrix);
 	wl_list_insert(&view->geometry.transformation_list,
@@ -242,10 +238,10 @@ weston_view_animation_create(struct weston_view *view,
 	if (view->output) {
 		wl_list_insert(&view->output->animation_list,
 			       &animation->animation.link);
+		weston_output_schedule_repaint(view->output);
 	} else {
 		wl_list_init(&animation->animation.link);
-		loop = wl_display_get_event_loop(ec->wl_display);
-		wl_event_loop_add_idle(loop, idle_animation_destroy, animation);
+		weston_compositor_defer_work(ec, &animation->destroy_work);
 	}
 
 	return animation;
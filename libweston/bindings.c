@@ -40,8 +40,19 @@ struct weston_binding {
 	void *handler;
 	void *data;
 	struct wl_list link;
+	struct wl_list hash_link;
 };
 
+/* Bindings of the same code and modifiers share a bucket, where they
+ * keep the order they were added in. */
+static struct wl_list *
+binding_hash_bucket(struct wl_list *table, uint32_t code, uint32_t modifier)
+{
+	uint32_t hash = code * 2654435761u ^ modifier;
+
+	return &table[(hash ^ hash >> 16) & (WESTON_BINDING_HASH_SIZE - 1)];
+}
+
 static struct weston_binding *
 weston_compositor_add_binding(struct weston_compositor *compositor,
 			      uint32_t key, uint32_t button, uint32_t axis,
@@ -59,6 +70,7 @@ weston_compositor_add_binding(struct weston_compositor *compositor,
 	binding->modifier = modifier;
 	binding->handler = handler;
 	binding->data = data;
+	wl_list_init(&binding->hash_link);
 
 	return binding;
 }
@@ -77,6 +89,9 @@ weston_compositor_add_key_binding(struct weston_compositor *compositor,
 		return NULL;
 
 	wl_list_insert(compositor->key_binding_list.prev, &binding->link);
+	wl_list_insert(binding_hash_bucket(compositor->key_binding_hash,
+					   key, modifier)->prev,
+		       &binding->hash_link);
 
 	return binding;
 }
@@ -113,6 +128,9 @@ weston_compositor_add_button_binding(struct weston_compositor *compositor,
 		return NULL;
 
 	wl_list_insert(compositor->button_binding_list.prev, &binding->link);
+	wl_list_insert(binding_hash_bucket(compositor->button_binding_hash,
+					   button, modifier)->prev,
+		       &binding->hash_link);
 
 	return binding;
 }
@@ -173,6 +191,7 @@ WL_EXPORT void
 weston_binding_destroy(struct weston_binding *binding)
 {
 	wl_list_remove(&binding->link);
+	wl_list_remove(&binding->hash_link);
 	free(binding);
 }
 
@@ -288,15 +307,17 @@ weston_compositor_run_key_binding(struct weston_compositor *compositor,
 	struct weston_binding *b, *tmp;
 	struct weston_surface *focus;
 	struct weston_seat *seat = keyboard->seat;
+	struct wl_list *bucket;
 
 	if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
 		return;
 
 	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = key;
+	compositor->binding_press_serial++;
 
-	wl_list_for_each_safe(b, tmp, &compositor->key_binding_list, link) {
+	bucket = binding_hash_bucket(compositor->key_binding_hash,
+				     key, seat->modifier_state);
+	wl_list_for_each_safe(b, tmp, bucket, hash_link) {
 		if (b->key == key && b->modifier == seat->modifier_state) {
 			weston_key_binding_handler_t handler = b->handler;
 			focus = keyboard->focus;
@@ -334,11 +355,11 @@ weston_compositor_run_modifier_binding(struct weston_compositor *compositor,
 
 		/* Prime the modifier binding. */
 		if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-			b->key = 0;
+			b->key = compositor->binding_press_serial;
 			continue;
 		}
 		/* Ignore the binding if a key was pressed in between. */
-		else if (b->key != 0) {
+		else if (b->key != compositor->binding_press_serial) {
 			return;
 		}
 
@@ -353,15 +374,17 @@ weston_compositor_run_button_binding(struct weston_compositor *compositor,
 				     enum wl_pointer_button_state state)
 {
 	struct weston_binding *b, *tmp;
+	struct wl_list *bucket;
 
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		return;
 
 	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = button;
+	compositor->binding_press_serial++;
 
-	wl_list_for_each_safe(b, tmp, &compositor->button_binding_list, link) {
+	bucket = binding_hash_bucket(compositor->button_binding_hash, button,
+				     pointer->seat->modifier_state);
+	wl_list_for_each_safe(b, tmp, bucket, hash_link) {
 		if (b->button == button &&
 		    b->modifier == pointer->seat->modifier_state) {
 			weston_button_binding_handler_t handler = b->handler;
@@ -397,8 +420,7 @@ weston_compositor_run_axis_binding(struct weston_compositor *compositor,
 	struct weston_binding *b, *tmp;
 
 	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = event->axis;
+	compositor->binding_press_serial++;
 
 	wl_list_for_each_safe(b, tmp, &compositor->axis_binding_list, link) {
 		if (b->axis == event->axis &&
@@ -23,27 +23,67 @@
  * SOFTWARE.
  */
 
+/*
+ * Keeps a copy of the selection, so that it can still be pasted after the
+ * client it came from goes away. Each MIME type the source offers is read
+ * in turn, up to weston_compositor::clipboard_max_size bytes in total.
+ * Small contents stay in memory; larger ones are spliced into an anonymous
+ * file and sent back from it with sendfile(), so they never pass through
+ * the compositor's memory.
+ */
+
 #include "config.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "compositor.h"
 #include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+
+/* Contents larger than this move from memory to an anonymous file */
+#define CLIPBOARD_SPILL_SIZE (64 * 1024)
+
+/* Bytes moved per call when reading or writing a file */
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
+
+struct clipboard_data {
+	char *mime_type;
+	struct wl_array contents;
+	int fd;		/* The contents once spilled, or -1 */
+	size_t size;
+	struct wl_list link;
+};
 
 struct clipboard_source {
 	struct weston_data_source base;
-	struct wl_array contents;
 	struct clipboard *clipboard;
-	struct wl_event_source *event_source;
 	uint32_t serial;
 	int refcount;
+
+	/* Complete contents, one for each of base.mime_types */
+	struct wl_list data_list;
+	size_t total_size;
+
+	/* Source being copied, until all its types are read or it goes */
+	struct weston_data_source *original;
+	struct wl_listener original_destroy_listener;
+	unsigned int next_type;
+
+	/* Type being read */
+	struct clipboard_data *reading;
+	struct wl_event_source *event_source;
 	int fd;
+
+	/* Set the selection to this source once reading is done */
+	bool offer_when_done;
 };
 
 struct clipboard {
@@ -53,60 +93,272 @@ struct clipboard {
 	struct clipboard_source *source;
 };
 
-static void clipboard_client_create(struct clipboard_source *source, int fd);
+static void
+clipboard_client_create(struct clipboard_source *source,
+			struct clipboard_data *data, int fd);
 
 static void
-clipboard_source_unref(struct clipboard_source *source)
+clipboard_data_destroy(struct clipboard_data *data)
 {
-	char **s;
+	if (data->fd >= 0)
+		close(data->fd);
+	wl_array_release(&data->contents);
+	free(data->mime_type);
+	free(data);
+}
 
-	source->refcount--;
-	if (source->refcount > 0)
-		return;
+static int
+clipboard_data_spill(struct clipboard_data *data)
+{
+	const char *p = data->contents.data;
+	size_t offset = 0;
+	ssize_t len;
+	int fd;
+
+	fd = os_create_anonymous_file(data->size);
+	if (fd < 0)
+		return -1;
+
+	while (offset < data->size) {
+		len = pwrite(fd, p + offset, data->size - offset, offset);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			close(fd);
+			return -1;
+		}
+		offset += len;
+	}
+
+	data->fd = fd;
+	wl_array_release(&data->contents);
+	wl_array_init(&data->contents);
+
+	return 0;
+}
+
+/* Moves what can be read from fd into data without blocking. Returns the
+ * number of bytes moved, 0 at the end of the data, or -1 with errno set,
+ * to EAGAIN if there is nothing to read yet. */
+static ssize_t
+clipboard_data_read(struct clipboard_data *data, int fd)
+{
+	char buffer[4096];
+	loff_t offset;
+	ssize_t len;
+	void *p;
+
+	if (data->fd >= 0) {
+		offset = data->size;
+		len = splice(fd, NULL, data->fd, &offset, CLIPBOARD_CHUNK_SIZE,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (len < 0 && errno == EINVAL) {
+			/* The file system does not support splicing */
+			len = read(fd, buffer, sizeof buffer);
+			if (len > 0)
+				len = pwrite(data->fd, buffer, len, data->size);
+		}
+		if (len > 0)
+			data->size += len;
+
+		return len;
+	}
+
+	if (data->contents.alloc - data->contents.size < sizeof buffer) {
+		p = wl_array_add(&data->contents, sizeof buffer);
+		if (p == NULL)
+			return -1;
+		data->contents.size -= sizeof buffer;
+	}
 
+	p = (char *) data->contents.data + data->contents.size;
+	len = read(fd, p, data->contents.alloc - data->contents.size);
+	if (len <= 0)
+		return len;
+
+	data->contents.size += len;
+	data->size = data->contents.size;
+
+	/* Keeps the contents in memory if the file cannot be made */
+	if (data->size > CLIPBOARD_SPILL_SIZE)
+		clipboard_data_spill(data);
+
+	return len;
+}
+
+static void
+clipboard_source_stop_reading(struct clipboard_source *source)
+{
 	if (source->event_source) {
 		wl_event_source_remove(source->event_source);
 		close(source->fd);
+		source->event_source = NULL;
+	}
+
+	if (source->reading) {
+		clipboard_data_destroy(source->reading);
+		source->reading = NULL;
+	}
+
+	if (source->original) {
+		wl_list_remove(&source->original_destroy_listener.link);
+		source->original = NULL;
 	}
+}
+
+static void
+clipboard_source_unref(struct clipboard_source *source)
+{
+	struct clipboard_data *data, *next;
+
+	source->refcount--;
+	if (source->refcount > 0)
+		return;
+
+	clipboard_source_stop_reading(source);
+
 	wl_signal_emit(&source->base.destroy_signal,
 		       &source->base);
-	s = source->base.mime_types.data;
-	free(*s);
+	/* Also frees the strings in base.mime_types */
+	wl_list_for_each_safe(data, next, &source->data_list, link)
+		clipboard_data_destroy(data);
 	wl_array_release(&source->base.mime_types);
-	wl_array_release(&source->contents);
 	free(source);
 }
 
+static void
+clipboard_source_offer(struct clipboard_source *source)
+{
+	struct weston_seat *seat = source->clipboard->seat;
+
+	if (source->base.mime_types.size == 0)
+		return;
+
+	weston_seat_set_selection(seat, &source->base, source->serial);
+}
+
+static int
+clipboard_source_data(int fd, uint32_t mask, void *data);
+
+/* Asks the original source for its next type */
+static void
+clipboard_source_read_next(struct clipboard_source *source)
+{
+	struct wl_display *display = source->clipboard->seat->compositor->wl_display;
+	struct wl_event_loop *loop = wl_display_get_event_loop(display);
+	struct weston_data_source *original = source->original;
+	struct clipboard_data *data;
+	const char **types;
+	int p[2];
+
+	if (original == NULL)
+		return;
+
+	types = original->mime_types.data;
+	if (source->next_type >= original->mime_types.size / sizeof *types)
+		goto done;
+
+	data = zalloc(sizeof *data);
+	if (data == NULL)
+		goto done;
+
+	wl_array_init(&data->contents);
+	data->fd = -1;
+	data->mime_type = strdup(types[source->next_type]);
+	if (data->mime_type == NULL)
+		goto err_data;
+
+	/* Only our end is non-blocking, the client may expect otherwise */
+	if (pipe2(p, O_CLOEXEC) == -1)
+		goto err_data;
+	fcntl(p[0], F_SETFL, O_NONBLOCK);
+
+	source->event_source =
+		wl_event_loop_add_fd(loop, p[0], WL_EVENT_READABLE,
+				     clipboard_source_data, source);
+	if (source->event_source == NULL) {
+		close(p[0]);
+		close(p[1]);
+		goto err_data;
+	}
+
+	source->fd = p[0];
+	source->reading = data;
+	original->send(original, types[source->next_type++], p[1]);
+
+	return;
+
+ err_data:
+	clipboard_data_destroy(data);
+ done:
+	clipboard_source_stop_reading(source);
+}
+
 static int
 clipboard_source_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_source *source = data;
-	struct clipboard *clipboard = source->clipboard;
-	char *p;
-	int len, size;
+	struct weston_compositor *compositor =
+		source->clipboard->seat->compositor;
+	struct clipboard_data *reading = source->reading;
+	ssize_t len;
+	char **s;
 
-	if (source->contents.alloc - source->contents.size < 1024) {
-		wl_array_add(&source->contents, 1024);
-		source->contents.size -= 1024;
-	}
+	len = clipboard_data_read(reading, fd);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+
+	if (len > 0) {
+		if (source->total_size + reading->size <=
+		    compositor->clipboard_max_size)
+			return 1;
 
-	p = source->contents.data + source->contents.size;
-	size = source->contents.alloc - source->contents.size;
-	len = read(fd, p, size);
-	if (len == 0) {
+		weston_log("clipboard: selection larger than %zu bytes, "
+			   "not keeping more of it\n",
+			   compositor->clipboard_max_size);
+		clipboard_source_stop_reading(source);
+	} else if (len < 0) {
+		clipboard_source_stop_reading(source);
+	} else {
 		wl_event_source_remove(source->event_source);
 		close(fd);
 		source->event_source = NULL;
-	} else if (len < 0) {
-		clipboard_source_unref(source);
-		clipboard->source = NULL;
-	} else {
-		source->contents.size += len;
+		source->reading = NULL;
+
+		s = wl_array_add(&source->base.mime_types, sizeof *s);
+		if (s == NULL) {
+			clipboard_data_destroy(reading);
+			clipboard_source_stop_reading(source);
+		} else {
+			*s = reading->mime_type;
+			wl_list_insert(source->data_list.prev, &reading->link);
+			source->total_size += reading->size;
+			clipboard_source_read_next(source);
+		}
+	}
+
+	if (source->event_source == NULL && source->offer_when_done) {
+		source->offer_when_done = false;
+		if (source->clipboard->seat->selection_data_source == NULL)
+			clipboard_source_offer(source);
 	}
 
 	return 1;
 }
 
+static void
+clipboard_source_original_destroyed(struct wl_listener *listener,
+				    void *data)
+{
+	struct clipboard_source *source =
+		container_of(listener, struct clipboard_source,
+			     original_destroy_listener);
+
+	/* What it already sent can still be read */
+	wl_list_remove(&source->original_destroy_listener.link);
+	source->original = NULL;
+}
+
 static void
 clipboard_source_accept(struct weston_data_source *source,
 			uint32_t time, const char *mime_type)
@@ -119,13 +371,16 @@ clipboard_source_send(struct weston_data_source *base,
 {
 	struct clipboard_source *source =
 		container_of(base, struct clipboard_source, base);
-	char **s;
+	struct clipboard_data *data;
 
-	s = source->base.mime_types.data;
-	if (strcmp(mime_type, s[0]) == 0)
-		clipboard_client_create(source, fd);
-	else
-		close(fd);
+	wl_list_for_each(data, &source->data_list, link) {
+		if (strcmp(mime_type, data->mime_type) == 0) {
+			clipboard_client_create(source, data, fd);
+			return;
+		}
+	}
+
+	close(fd);
 }
 
 static void
@@ -135,18 +390,15 @@ clipboard_source_cancel(struct weston_data_source *source)
 
 static struct clipboard_source *
 clipboard_source_create(struct clipboard *clipboard,
-			const char *mime_type, uint32_t serial, int fd)
+			struct weston_data_source *original, uint32_t serial)
 {
-	struct wl_display *display = clipboard->seat->compositor->wl_display;
-	struct wl_event_loop *loop = wl_display_get_event_loop(display);
 	struct clipboard_source *source;
-	char **s;
 
 	source = zalloc(sizeof *source);
 	if (source == NULL)
 		return NULL;
 
-	wl_array_init(&source->contents);
+	wl_list_init(&source->data_list);
 	wl_array_init(&source->base.mime_types);
 	source->base.resource = NULL;
 	source->base.accept = clipboard_source_accept;
@@ -156,53 +408,74 @@ clipboard_source_create(struct clipboard *clipboard,
 	source->refcount = 1;
 	source->clipboard = clipboard;
 	source->serial = serial;
-	source->fd = fd;
-
-	s = wl_array_add(&source->base.mime_types, sizeof *s);
-	if (s == NULL)
-		goto err_add;
-	*s = strdup(mime_type);
-	if (*s == NULL)
-		goto err_strdup;
-	source->event_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     clipboard_source_data, source);
-	if (source->event_source == NULL)
-		goto err_source;
+	source->fd = -1;
 
-	return source;
+	source->original = original;
+	source->original_destroy_listener.notify =
+		clipboard_source_original_destroyed;
+	wl_signal_add(&original->destroy_signal,
+		      &source->original_destroy_listener);
 
- err_source:
-	free(*s);
- err_strdup:
-	wl_array_release(&source->base.mime_types);
- err_add:
-	free(source);
+	clipboard_source_read_next(source);
+	if (source->event_source == NULL) {
+		clipboard_source_unref(source);
+		return NULL;
+	}
 
-	return NULL;
+	return source;
 }
 
 struct clipboard_client {
 	struct wl_event_source *event_source;
 	size_t offset;
 	struct clipboard_source *source;
+	struct clipboard_data *data;
 };
 
+/* Returns the number of bytes written, or -1 with errno set */
+static ssize_t
+clipboard_client_write(struct clipboard_client *client, int fd)
+{
+	struct clipboard_data *data = client->data;
+	size_t remaining = data->size - client->offset;
+	char buffer[4096];
+	off_t offset;
+	ssize_t len;
+
+	if (data->fd < 0)
+		return write(fd, (char *) data->contents.data + client->offset,
+			     remaining);
+
+	offset = client->offset;
+	len = sendfile(fd, data->fd, &offset,
+		       MIN(remaining, CLIPBOARD_CHUNK_SIZE));
+	if (len >= 0 || errno != EINVAL)
+		return len;
+
+	/* sendfile() does not support this pair of fds */
+	len = pread(data->fd, buffer, MIN(remaining, sizeof buffer),
+		    client->offset);
+	if (len <= 0)
+		return -1;
+
+	return write(fd, buffer, len);
+}
+
 static int
 clipboard_client_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_client *client = data;
-	char *p;
-	size_t size;
-	int len;
-
-	size = client->source->contents.size;
-	p = client->source->contents.data;
-	len = write(fd, p + client->offset, size - client->offset);
-	if (len > 0)
-		client->offset += len;
+	ssize_t len = 0;
+
+	if (client->offset < client->data->size) {
+		len = clipboard_client_write(client, fd);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return 1;
+		if (len > 0)
+			client->offset += len;
+	}
 
-	if (client->offset == size || len <= 0) {
+	if (client->offset == client->data->size || len <= 0) {
 		close(fd);
 		wl_event_source_remove(client->event_source);
 		clipboard_source_unref(client->source);
@@ -213,7 +486,8 @@ clipboard_client_data(int fd, uint32_t mask, void *data)
 }
 
 static void
-clipboard_client_create(struct clipboard_source *source, int fd)
+clipboard_client_create(struct clipboard_source *source,
+			struct clipboard_data *data, int fd)
 {
 	struct weston_seat *seat = source->clipboard->seat;
 	struct clipboard_client *client;
@@ -221,14 +495,26 @@ clipboard_client_create(struct clipboard_source *source, int fd)
 		wl_display_get_event_loop(seat->compositor->wl_display);
 
 	client = zalloc(sizeof *client);
-	if (client == NULL)
+	if (client == NULL) {
+		close(fd);
 		return;
+	}
+
+	/* Large contents do not fit in a pipe at once */
+	fcntl(fd, F_SETFL, O_WRONLY | O_NONBLOCK);
 
 	client->source = source;
-	source->refcount++;
+	client->data = data;
 	client->event_source =
 		wl_event_loop_add_fd(loop, fd, WL_EVENT_WRITABLE,
 				     clipboard_client_data, client);
+	if (client->event_source == NULL) {
+		close(fd);
+		free(client);
+		return;
+	}
+
+	source->refcount++;
 }
 
 static void
@@ -238,14 +524,16 @@ clipboard_set_selection(struct wl_listener *listener, void *data)
 		container_of(listener, struct clipboard, selection_listener);
 	struct weston_seat *seat = data;
 	struct weston_data_source *source = seat->selection_data_source;
-	const char **mime_types;
-	int p[2];
 
 	if (source == NULL) {
-		if (clipboard->source)
-			weston_seat_set_selection(seat,
-						  &clipboard->source->base,
-						  clipboard->source->serial);
+		if (clipboard->source == NULL)
+			return;
+
+		/* Offer the types still being read once they are in */
+		if (clipboard->source->event_source)
+			clipboard->source->offer_when_done = true;
+		else
+			clipboard_source_offer(clipboard->source);
 		return;
 	} else if (source->accept == clipboard_source_accept) {
 		/* Callback for our data source. */
@@ -257,20 +545,13 @@ clipboard_set_selection(struct wl_listener *listener, void *data)
 
 	clipboard->source = NULL;
 
-	mime_types = source->mime_types.data;
-
-	if (!mime_types || pipe2(p, O_CLOEXEC) == -1)
+	if (source->mime_types.size == 0 ||
+	    seat->compositor->clipboard_max_size == 0)
 		return;
 
-	source->send(source, mime_types[0], p[1]);
-
 	clipboard->source =
-		clipboard_source_create(clipboard, mime_types[0],
-					seat->selection_serial, p[0]);
-	if (clipboard->source == NULL) {
-		close(p[0]);
-		return;
-	}
+		clipboard_source_create(clipboard, source,
+					seat->selection_serial);
 }
 
 static void
@@ -54,18 +54,25 @@
 #include "gl-renderer.h"
 #include "weston-egl-ext.h"
 #include "pixman-renderer.h"
+#include "timeline.h"
 #include "libbacklight.h"
 #include "libinput-seat.h"
 #include "launcher-util.h"
 #include "vaapi-recorder.h"
+#include "recorder-encoder.h"
 #include "presentation-time-server-protocol.h"
 #include "linux-dmabuf.h"
+#include "linux-explicit-synchronization.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 
 #ifndef DRM_CAP_TIMESTAMP_MONOTONIC
 #define DRM_CAP_TIMESTAMP_MONOTONIC 0x6
 #endif
 
+#ifndef DRM_CAP_ASYNC_PAGE_FLIP
+#define DRM_CAP_ASYNC_PAGE_FLIP 0x7
+#endif
+
 #ifndef DRM_CAP_CURSOR_WIDTH
 #define DRM_CAP_CURSOR_WIDTH 0x8
 #endif
@@ -74,10 +81,168 @@
 #define DRM_CAP_CURSOR_HEIGHT 0x9
 #endif
 
+#ifndef DRM_CAP_CRTC_IN_VBLANK_EVENT
+#define DRM_CAP_CRTC_IN_VBLANK_EVENT 0x12
+#endif
+
+#ifndef DRM_CAP_ADDFB2_MODIFIERS
+#define DRM_CAP_ADDFB2_MODIFIERS 0x10
+#endif
+
+#ifndef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+#define DRM_CLIENT_CAP_WRITEBACK_CONNECTORS 5
+#endif
+
+#ifndef DRM_MODE_CONNECTOR_WRITEBACK
+#define DRM_MODE_CONNECTOR_WRITEBACK 18
+#endif
+
 #ifndef GBM_BO_USE_CURSOR
 #define GBM_BO_USE_CURSOR GBM_BO_USE_CURSOR_64X64
 #endif
 
+/* Buffers a writeback connector cycles through, so that the last
+ * complete frame stays readable while the next one is written */
+#define DRM_WRITEBACK_BUFFERS 3
+
+/* Smallest render scale, as few primary planes scale up by more than 4 */
+#define DRM_RENDER_SCALE_MIN 0.25
+
+/**
+ * Values of the immutable "type" property of KMS planes, as exposed by the
+ * kernel when DRM_CLIENT_CAP_UNIVERSAL_PLANES is set.
+ */
+enum wdrm_plane_type {
+	WDRM_PLANE_TYPE_OVERLAY = 0,
+	WDRM_PLANE_TYPE_PRIMARY = 1,
+	WDRM_PLANE_TYPE_CURSOR = 2,
+};
+
+/**
+ * Bits of the optional "rotation" plane property, fixed by the kernel ABI.
+ * Rotations are counter-clockwise.
+ */
+enum wdrm_plane_rotation {
+	WDRM_PLANE_ROTATE_0 = (1 << 0),
+	WDRM_PLANE_ROTATE_90 = (1 << 1),
+	WDRM_PLANE_ROTATE_180 = (1 << 2),
+	WDRM_PLANE_ROTATE_270 = (1 << 3),
+	WDRM_PLANE_REFLECT_X = (1 << 4),
+	WDRM_PLANE_REFLECT_Y = (1 << 5),
+};
+
+/**
+ * Plane properties used for atomic modesetting
+ */
+enum wdrm_plane_property {
+	WDRM_PLANE_TYPE = 0,
+	WDRM_PLANE_SRC_X,
+	WDRM_PLANE_SRC_Y,
+	WDRM_PLANE_SRC_W,
+	WDRM_PLANE_SRC_H,
+	WDRM_PLANE_CRTC_X,
+	WDRM_PLANE_CRTC_Y,
+	WDRM_PLANE_CRTC_W,
+	WDRM_PLANE_CRTC_H,
+	WDRM_PLANE_FB_ID,
+	WDRM_PLANE_CRTC_ID,
+	WDRM_PLANE__COUNT
+};
+
+/**
+ * Connector properties used for atomic modesetting
+ */
+enum wdrm_connector_property {
+	WDRM_CONNECTOR_CRTC_ID = 0,
+	WDRM_CONNECTOR__COUNT
+};
+
+/**
+ * Writeback connector properties, see struct drm_writeback
+ */
+enum wdrm_writeback_property {
+	WDRM_WRITEBACK_CRTC_ID = 0,
+	WDRM_WRITEBACK_FB_ID,
+	WDRM_WRITEBACK_OUT_FENCE_PTR,
+	WDRM_WRITEBACK_PIXEL_FORMATS,
+	WDRM_WRITEBACK__COUNT
+};
+
+/**
+ * CRTC properties used for atomic modesetting
+ */
+enum wdrm_crtc_property {
+	WDRM_CRTC_MODE_ID = 0,
+	WDRM_CRTC_ACTIVE,
+	WDRM_CRTC__COUNT
+};
+
+/**
+ * Optional CRTC color management properties, which also work without
+ * atomic modesetting
+ */
+enum wdrm_crtc_color_property {
+	WDRM_CRTC_DEGAMMA_LUT = 0,
+	WDRM_CRTC_DEGAMMA_LUT_SIZE,
+	WDRM_CRTC_CTM,
+	WDRM_CRTC_GAMMA_LUT,
+	WDRM_CRTC_GAMMA_LUT_SIZE,
+	WDRM_CRTC_COLOR__COUNT
+};
+
+static const char * const crtc_color_prop_names[] = {
+	[WDRM_CRTC_DEGAMMA_LUT] = "DEGAMMA_LUT",
+	[WDRM_CRTC_DEGAMMA_LUT_SIZE] = "DEGAMMA_LUT_SIZE",
+	[WDRM_CRTC_CTM] = "CTM",
+	[WDRM_CRTC_GAMMA_LUT] = "GAMMA_LUT",
+	[WDRM_CRTC_GAMMA_LUT_SIZE] = "GAMMA_LUT_SIZE",
+};
+
+/* Blob layouts of the color properties, as fixed by the kernel ABI */
+struct wdrm_color_lut {
+	uint16_t red;
+	uint16_t green;
+	uint16_t blue;
+	uint16_t reserved;
+};
+
+struct wdrm_color_ctm {
+	/* S31.32 sign-magnitude, row-major */
+	uint64_t matrix[9];
+};
+
+#ifdef HAVE_DRM_ATOMIC
+static const char * const plane_prop_names[] = {
+	[WDRM_PLANE_TYPE] = "type",
+	[WDRM_PLANE_SRC_X] = "SRC_X",
+	[WDRM_PLANE_SRC_Y] = "SRC_Y",
+	[WDRM_PLANE_SRC_W] = "SRC_W",
+	[WDRM_PLANE_SRC_H] = "SRC_H",
+	[WDRM_PLANE_CRTC_X] = "CRTC_X",
+	[WDRM_PLANE_CRTC_Y] = "CRTC_Y",
+	[WDRM_PLANE_CRTC_W] = "CRTC_W",
+	[WDRM_PLANE_CRTC_H] = "CRTC_H",
+	[WDRM_PLANE_FB_ID] = "FB_ID",
+	[WDRM_PLANE_CRTC_ID] = "CRTC_ID",
+};
+
+static const char * const connector_prop_names[] = {
+	[WDRM_CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+static const char * const crtc_prop_names[] = {
+	[WDRM_CRTC_MODE_ID] = "MODE_ID",
+	[WDRM_CRTC_ACTIVE] = "ACTIVE",
+};
+
+static const char * const writeback_prop_names[] = {
+	[WDRM_WRITEBACK_CRTC_ID] = "CRTC_ID",
+	[WDRM_WRITEBACK_FB_ID] = "WRITEBACK_FB_ID",
+	[WDRM_WRITEBACK_OUT_FENCE_PTR] = "WRITEBACK_OUT_FENCE_PTR",
+	[WDRM_WRITEBACK_PIXEL_FORMATS] = "WRITEBACK_PIXEL_FORMATS",
+};
+#endif
+
 struct drm_backend {
 	struct weston_backend base;
 	struct weston_compositor *compositor;
@@ -104,14 +269,34 @@ struct drm_backend {
 	int min_width, max_width;
 	int min_height, max_height;
 	int no_addfb2;
+	/* AddFB2 takes format modifiers */
+	int fb_modifiers;
 
 	struct wl_list sprite_list;
 	int sprites_are_broken;
 	int sprites_hidden;
 
+	/* struct drm_writeback, only with atomic modesetting */
+	struct wl_list writeback_list;
+
+	/* KMS framebuffers imported from client dmabufs, kept alive for
+	 * as long as the dmabuf exists; see drm_fb_get_from_dmabuf(). */
+	struct wl_list fb_cache_list;
+
+	/* Primary planes, only used with atomic modesetting; see
+	 * drm_output_find_primary_plane(). */
+	struct wl_list primary_plane_list;
+	int atomic_modeset;
+
 	int cursors_are_broken;
 
+	/* Legacy page flips can be done without waiting for vblank */
+	int async_page_flip;
+
 	int use_pixman;
+	/* Outputs render on threads of their own, see render-threads in
+	 * weston.ini */
+	int render_threads;
 
 	struct udev_input input;
 
@@ -119,11 +304,64 @@ struct drm_backend {
 	int32_t cursor_height;
 
 	uint32_t connector;
+
+	/* struct drm_secondary::link, KMS devices we only display on */
+	struct wl_list secondary_list;
+
+	/* struct drm_edid_cache_entry::link, most recently used first */
+	struct wl_list edid_cache_list;
+	int edid_cache_length;
+
+	/* Where drm_assign_planes() put each view, and why */
+	struct weston_log_scope *planes_scope;
+};
+
+/*
+ * A KMS device on the seat other than the one we render with
+ *
+ * Its outputs are composited by the render GPU into linear buffers,
+ * which are imported into this device through PRIME, or copied into
+ * dumb buffers by the CPU if the import fails. They are driven with
+ * legacy modesetting only and get no planes besides the primary one.
+ */
+struct drm_secondary {
+	struct drm_backend *backend;
+	struct wl_list link;
+
+	int id;
+	int fd;
+	char *filename;
+	struct wl_event_source *source;
+
+	int min_width, max_width;
+	int min_height, max_height;
+
+	/* Importing render GPU buffers failed, copy them instead */
+	int prime_broken;
+};
+
+/* Cursor images kept in BOs per output, see drm_output_get_cursor() */
+#define DRM_CURSOR_CACHE_SIZE 8
+
+/* Dumb buffers per output: the pixman renderer uses
+ * weston_compositor::pixman_buffer_count of them, copies of render GPU
+ * frames two. */
+#define DRM_OUTPUT_MAX_DUMB 4
+
+struct drm_cursor {
+	struct gbm_bo *bo;
+	/* What was written to bo, cursor_width x cursor_height */
+	uint32_t *image;
+	int32_t width, height;
+	uint32_t hash;
+	/* drm_output::cursor_serial when last shown, 0 if unused */
+	uint32_t last_used;
 };
 
 struct drm_mode {
 	struct weston_mode base;
 	drmModeModeInfo mode_info;
+	uint32_t blob_id;
 };
 
 struct drm_fb {
@@ -132,62 +370,213 @@ struct drm_fb {
 	int fd;
 	int is_client_buffer;
 	struct weston_buffer_reference buffer_ref;
+	struct weston_buffer_release_reference buffer_release_ref;
+
+	/* KMS format the framebuffer was requested with, and the layout
+	 * modifier it was added with; linear when it was added without */
+	uint32_t format;
+	uint64_t modifier;
+	/* Number of planes currently holding this client fb */
+	int uses;
+
+	/* Used by fbs cached on a linux_dmabuf_buffer */
+	int dmabuf_cached;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_list cache_link;
+
+	/* Used by dmabuf fbs imported directly, without GBM */
+	uint32_t plane_handles[MAX_DMABUF_PLANES];
+	int n_plane_handles;
 
 	/* Used by gbm fbs */
 	struct gbm_bo *bo;
 
 	/* Used by dumb fbs */
 	void *map;
+
+	/* Left on the CRTC by whoever had it before us, not ours to free */
+	int foreign;
+
+	/* A dumb fb of drm_sprite::cursor_fbs, kept across frames; the
+	 * hash of the cursor image in it, see cursor_image_hash() */
+	int sprite_cursor;
+	uint32_t cursor_hash;
+};
+
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * State accumulated over one repaint cycle, for all outputs of a device
+ *
+ * Created by drm_repaint_begin() when atomic modesetting is in use, and
+ * committed to the kernel as a single atomic request by
+ * drm_repaint_flush().
+ */
+struct drm_pending_state {
+	struct drm_backend *backend;
+	drmModeAtomicReq *req;
+	uint32_t flags;
 };
+#endif
 
 struct drm_edid {
 	char eisa_id[13];
 	char monitor_name[13];
 	char pnp_id[5];
 	char serial_number[13];
+	uint32_t checksum; /* FNV-1a of the whole EDID */
+};
+
+/* EDID blobs are immutable, the kernel creates a new one whenever the
+ * EDID changes, so the parse of a blob id stays valid for the device. */
+#define DRM_EDID_CACHE_SIZE 8
+
+struct drm_edid_cache_entry {
+	struct wl_list link;
+	int fd;
+	uint32_t blob_id;
+	int valid;
+	struct drm_edid edid;
+};
+
+struct drm_sprite;
+
+/* A writeback connector, which has the display engine write what a CRTC
+ * scans out, planes included, into a framebuffer of ours */
+struct drm_writeback {
+	struct wl_list link; /* drm_backend::writeback_list */
+	uint32_t connector_id;
+	uint32_t possible_crtcs;
+	uint32_t props[WDRM_WRITEBACK__COUNT];
+	struct drm_output *output; /* the output using it, if any */
+	bool broken; /* the driver refused to attach it */
+};
+
+/* What a drmWaitVBlank() event completes: an overlay update, or a
+ * repaint that had nothing to render or flip (sprite is NULL then). */
+struct drm_vblank_target {
+	struct drm_output *output;
+	struct drm_sprite *sprite;
 };
 
+/* Plane candidates of an output which compete for shared planes */
+#define DRM_PLANE_DEMAND_MAX 4
+
 struct drm_output {
 	struct weston_output base;
 	drmModeConnector *connector;
+	/* The KMS device the output is on, NULL for the render GPU */
+	struct drm_secondary *secondary;
 
 	uint32_t crtc_id; /* object ID to pass to DRM functions */
 	int pipe; /* index of CRTC in resource array / bitmasks */
 	uint32_t connector_id;
+	uint32_t props_crtc[WDRM_CRTC__COUNT];
+	uint32_t props_conn[WDRM_CONNECTOR__COUNT];
+	uint32_t props_color[WDRM_CRTC_COLOR__COUNT];
+	/* CRTC "VRR_ENABLED", and what it was last set to */
+	uint32_t vrr_enabled_prop;
+	bool vrr_enabled;
+	struct drm_sprite *primary_plane;
 	drmModeCrtcPtr original_crtc;
 	struct drm_edid edid;
 	drmModePropertyPtr dpms_prop;
 	uint32_t gbm_format;
+	/* Fraction of the mode resolution to render at, see
+	 * drm_output_set_render_scale() */
+	double render_scale;
 
 	enum dpms_enum dpms;
 
 	int vblank_pending;
+	struct drm_vblank_target skip_vblank;
 	int page_flip_pending;
+	/* next is a client buffer that asked to be shown right away, and
+	 * whether the pending flip went without waiting for vblank */
+	int next_async;
+	int page_flip_async;
+	int atomic_pending;
+	/* Being rendered on its render thread, added to the request by
+	 * drm_repaint_flush() */
+	int render_pending;
 	int destroy_pending;
 	int disable_pending;
+	/* The CRTC lost its mode while the session was away */
+	int modeset_pending;
 
 	struct gbm_surface *gbm_surface;
-	struct gbm_bo *gbm_cursor_bo[2];
+	struct drm_cursor cursors[DRM_CURSOR_CACHE_SIZE];
+	struct drm_cursor *current_cursor;
+	uint32_t cursor_serial;
 	struct weston_plane cursor_plane;
 	struct weston_plane fb_plane;
 	struct weston_view *cursor_view;
-	int current_cursor;
 	struct drm_fb *current, *next;
 	struct backlight *backlight;
 
-	struct drm_fb *dumb[2];
-	pixman_image_t *image[2];
-	int current_image;
-	pixman_region32_t previous_damage;
+	/* Why the last fullscreen view could not be scanned out, so that
+	 * each reason is only logged once in a row */
+	const char *scanout_reject_reason;
 
-	struct vaapi_recorder *recorder;
-	struct wl_listener recorder_frame_listener;
+	struct drm_fb *dumb[DRM_OUTPUT_MAX_DUMB];
+	pixman_image_t *image[DRM_OUTPUT_MAX_DUMB];
+	int dumb_count;
+	int current_image;
+	/* What each dumb buffer lacks of the latest frame, in global
+	 * coordinates: the damage of all frames since it was painted */
+	pixman_region32_t dumb_damage[DRM_OUTPUT_MAX_DUMB];
+	/* Rotation of the primary plane while it shows the dumb buffers,
+	 * which are upright if the plane applies the output transform */
+	uint64_t dumb_rotation;
+
+	/* Mode-sized buffer filled with the color of an opaque solid view
+	 * covering the output, see drm_output_prepare_solid_view() */
+	struct drm_fb *solid_fb;
+	uint32_t solid_pixel;
+
+	/* struct drm_plane_candidate, scratch space for drm_assign_planes() */
+	struct wl_array plane_candidates;
+
+	/* The best plane candidate scores of the last repaint, highest
+	 * first, and when that was; see drm_backend_share_sprites() */
+	uint64_t plane_demand[DRM_PLANE_DEMAND_MAX];
+	int plane_demand_count;
+	int plane_demand_taken;
+	struct timespec plane_demand_time;
+
+	/* Writeback of the frames while writeback_users captures want
+	 * them, see drm_output_enable_writeback(). The connector is
+	 * attached to the CRTC in the last commit and in the one being
+	 * built; the kernel fills in the fence of the buffer written. */
+	struct drm_writeback *writeback;
+	int writeback_users;
+	bool writeback_attached;
+	bool writeback_attach;
+	struct drm_fb *writeback_fb[DRM_WRITEBACK_BUFFERS];
+	int writeback_pending; /* buffer being written, or -1 */
+	int writeback_last; /* last buffer written, or -1 */
+	int32_t writeback_fence;
+	struct wl_event_source *writeback_source;
+
+	/* Outputs mirroring this one, see drm_output_clone(). A clone is
+	 * never enabled itself: its CRTC scans out the framebuffers of
+	 * clone_of, and the frame of clone_of only completes once the
+	 * clone_flips_pending flips of its clones have too. */
+	struct wl_list clone_list;
+	struct wl_list clone_link;
+	struct drm_output *clone_of;
+	int clone_flips_pending;
 };
 
 /*
  * An output has a primary display plane plus zero or more sprites for
  * blending display contents.
  */
+/* A layout a plane can scan out a format in */
+struct drm_plane_modifier {
+	uint32_t format;
+	uint64_t modifier;
+};
+
 struct drm_sprite {
 	struct wl_list link;
 
@@ -196,10 +585,53 @@ struct drm_sprite {
 	struct drm_fb *current, *next;
 	struct drm_output *output;
 	struct drm_backend *backend;
+	struct drm_vblank_target vblank;
 
 	uint32_t possible_crtcs;
 	uint32_t plane_id;
 	uint32_t count_formats;
+	uint32_t props[WDRM_PLANE__COUNT];
+
+	/* Optional "rotation" property, and the enum wdrm_plane_rotation
+	 * bits it supports */
+	uint32_t rotation_prop;
+	uint64_t rotations_supported;
+	uint64_t rotation;
+
+	/* Optional "IN_FENCE_FD" property, and the client acquire fence
+	 * to hand to the kernel with the next commit of this plane */
+	uint32_t in_fence_fd_prop;
+	int in_fence_fd;
+
+	/* Optional "zpos" property, the value the plane comes with, its
+	 * range, and the value to commit. Only a mutable zpos is
+	 * committed. */
+	uint32_t zpos_prop;
+	bool zpos_mutable;
+	uint64_t zpos_default;
+	uint64_t zpos_min, zpos_max;
+	uint64_t zpos;
+
+	/* Format and layout modifier pairs of the optional "IN_FORMATS"
+	 * property, struct drm_plane_modifier */
+	struct wl_array in_formats;
+
+	/* Whether the weston_plane is stacked below the primary plane, and
+	 * the hole that left in the last frame of the primary plane, in
+	 * global coordinates */
+	bool underlay;
+	bool hole;
+	pixman_box32_t underlay_box;
+	pixman_box32_t hole_box;
+
+	/* The only output which may take the plane, while outputs compete
+	 * for it, or NULL for any; see drm_backend_share_sprites() */
+	struct drm_output *reserved;
+	struct drm_output *share_output;
+
+	/* Copies of cursor images, for the pointers of further seats, see
+	 * drm_output_prepare_cursor_sprite_view() */
+	struct drm_fb *cursor_fbs[2];
 
 	int32_t src_x, src_y;
 	uint32_t src_w, src_h;
@@ -225,6 +657,16 @@ to_drm_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct drm_backend, base);
 }
 
+/* The fd of the KMS device driving the output */
+static inline int
+drm_output_fd(struct drm_output *output)
+{
+	if (output->secondary)
+		return output->secondary->fd;
+
+	return to_drm_backend(output->base.compositor)->drm.fd;
+}
+
 static void
 drm_output_set_cursor(struct drm_output *output);
 
@@ -237,19 +679,61 @@ drm_sprite_crtc_supported(struct drm_output *output, struct drm_sprite *sprite)
 	return !!(sprite->possible_crtcs & (1 << output->pipe));
 }
 
+/* Whether the output may put a view on the plane in this repaint */
+static bool
+drm_sprite_available(struct drm_output *output, struct drm_sprite *sprite)
+{
+	struct drm_backend *b = sprite->backend;
+
+	if (!drm_sprite_crtc_supported(output, sprite))
+		return false;
+
+	if (sprite->reserved && sprite->reserved != output)
+		return false;
+
+	/* An atomic commit for this output would otherwise move a plane
+	 * which is still being scanned out on another CRTC. */
+	if (b->atomic_modeset && sprite->current && sprite->output != output)
+		return false;
+
+	return true;
+}
+
+/* Views with an acquire fence can only go on planes which take it along
+ * to the kernel; the renderer waits for the fence otherwise. */
+static int
+drm_sprite_fence_supported(struct drm_sprite *sprite,
+			   struct weston_surface *es)
+{
+	return es->acquire_fence_fd < 0 ||
+		(sprite && sprite->in_fence_fd_prop != 0);
+}
+
+static void
+drm_sprite_set_in_fence(struct drm_sprite *sprite, int fence_fd)
+{
+	if (sprite->in_fence_fd >= 0)
+		close(sprite->in_fence_fd);
+
+	sprite->in_fence_fd = fence_fd >= 0 ? dup(fence_fd) : -1;
+}
+
+/* KMS object IDs are per device, so lookups take the device too; a NULL
+ * dev is the render GPU. */
 static struct drm_output *
-drm_output_find_by_crtc(struct drm_backend *b, uint32_t crtc_id)
+drm_output_find_by_crtc(struct drm_backend *b, struct drm_secondary *dev,
+			uint32_t crtc_id)
 {
 	struct drm_output *output;
 
 	wl_list_for_each(output, &b->compositor->output_list, base.link) {
-		if (output->crtc_id == crtc_id)
+		if (output->secondary == dev && output->crtc_id == crtc_id)
 			return output;
 	}
 
 	wl_list_for_each(output, &b->compositor->pending_output_list,
 			 base.link) {
-		if (output->crtc_id == crtc_id)
+		if (output->secondary == dev && output->crtc_id == crtc_id)
 			return output;
 	}
 
@@ -257,39 +741,248 @@ drm_output_find_by_crtc(struct drm_backend *b, uint32_t crtc_id)
 }
 
 static struct drm_output *
-drm_output_find_by_connector(struct drm_backend *b, uint32_t connector_id)
+drm_output_find_by_connector(struct drm_backend *b, struct drm_secondary *dev,
+			     uint32_t connector_id)
 {
 	struct drm_output *output;
 
 	wl_list_for_each(output, &b->compositor->output_list, base.link) {
-		if (output->connector_id == connector_id)
+		if (output->secondary == dev &&
+		    output->connector_id == connector_id)
 			return output;
 	}
 
 	wl_list_for_each(output, &b->compositor->pending_output_list,
 			 base.link) {
-		if (output->connector_id == connector_id)
+		if (output->secondary == dev &&
+		    output->connector_id == connector_id)
 			return output;
 	}
 
 	return NULL;
 }
 
+/**
+ * Look up a set of KMS object properties by name
+ *
+ * Fills ids with the property IDs of the named properties on the object,
+ * and values (if not NULL) with their current values. Properties which
+ * could not be found are left as 0.
+ *
+ * @param b DRM backend
+ * @param obj_id KMS object ID
+ * @param obj_type DRM_MODE_OBJECT_* type of the object
+ * @param names Property names, indexed by the matching wdrm_*_property enum
+ * @param ids Array of count entries to fill with property IDs
+ * @param values Array of count entries to fill with values, or NULL
+ * @param count Number of properties to look up
+ * @returns 0 if all properties were found, -1 otherwise
+ */
+static int
+drm_object_get_props(struct drm_backend *b, uint32_t obj_id, uint32_t obj_type,
+		     const char * const *names, uint32_t *ids,
+		     uint64_t *values, unsigned int count)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	unsigned int i, j;
+	int ret = 0;
+
+	memset(ids, 0, count * sizeof ids[0]);
+
+	props = drmModeObjectGetProperties(b->drm.fd, obj_id, obj_type);
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(b->drm.fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (strcmp(prop->name, names[j]) != 0)
+				continue;
+
+			ids[j] = prop->prop_id;
+			if (values)
+				values[j] = props->prop_values[i];
+			break;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	for (j = 0; j < count; j++)
+		if (ids[j] == 0)
+			ret = -1;
+
+	return ret;
+}
+
+#if defined(HAVE_DRM_ATOMIC) && defined(HAVE_GBM_MODIFIERS)
+/* Unpack the "IN_FORMATS" blob of a plane into format and modifier
+ * pairs. Each modifier comes with a bitmask of the 64 formats from its
+ * offset on that it applies to. */
+static void
+drm_plane_read_in_formats(struct drm_backend *b, struct drm_sprite *sprite,
+			  uint32_t blob_id)
+{
+	drmModePropertyBlobRes *blob;
+	struct drm_format_modifier_blob *fmt_mod_blob;
+	struct drm_format_modifier *mods;
+	struct drm_plane_modifier *pair;
+	uint32_t *formats;
+	uint32_t i, j;
+
+	blob = drmModeGetPropertyBlob(b->drm.fd, blob_id);
+	if (!blob)
+		return;
+
+	fmt_mod_blob = blob->data;
+	formats = (uint32_t *) ((char *) fmt_mod_blob +
+				fmt_mod_blob->formats_offset);
+	mods = (struct drm_format_modifier *) ((char *) fmt_mod_blob +
+					       fmt_mod_blob->modifiers_offset);
+
+	for (i = 0; i < fmt_mod_blob->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			if (!(mods[i].formats & (1ULL << j)) ||
+			    mods[i].offset + j >= fmt_mod_blob->count_formats)
+				continue;
+
+			pair = wl_array_add(&sprite->in_formats, sizeof *pair);
+			if (!pair)
+				goto out;
+			pair->format = formats[mods[i].offset + j];
+			pair->modifier = mods[i].modifier;
+		}
+	}
+
+out:
+	drmModeFreePropertyBlob(blob);
+}
+#endif
+
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * Look up the optional "rotation", "IN_FENCE_FD", "zpos" and "IN_FORMATS"
+ * properties of a plane
+ *
+ * @param b DRM backend
+ * @param sprite Plane to fill in rotation_prop, rotations_supported,
+ * in_fence_fd_prop, the zpos fields and in_formats of
+ */
+static void
+drm_plane_get_optional_props(struct drm_backend *b, struct drm_sprite *sprite)
+{
+	static const struct {
+		const char *name;
+		uint64_t bit;
+	} rotations[] = {
+		{ "rotate-0", WDRM_PLANE_ROTATE_0 },
+		{ "rotate-90", WDRM_PLANE_ROTATE_90 },
+		{ "rotate-180", WDRM_PLANE_ROTATE_180 },
+		{ "rotate-270", WDRM_PLANE_ROTATE_270 },
+		{ "reflect-x", WDRM_PLANE_REFLECT_X },
+		{ "reflect-y", WDRM_PLANE_REFLECT_Y },
+	};
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	unsigned int i, j;
+	int k;
+
+	sprite->rotation_prop = 0;
+	sprite->rotations_supported = 0;
+	sprite->in_fence_fd_prop = 0;
+	sprite->zpos_prop = 0;
+
+	props = drmModeObjectGetProperties(b->drm.fd, sprite->plane_id,
+					   DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(b->drm.fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (strcmp(prop->name, "IN_FENCE_FD") == 0)
+			sprite->in_fence_fd_prop = prop->prop_id;
+
+#ifdef HAVE_GBM_MODIFIERS
+		if (strcmp(prop->name, "IN_FORMATS") == 0 &&
+		    (prop->flags & DRM_MODE_PROP_BLOB))
+			drm_plane_read_in_formats(b, sprite,
+						  props->prop_values[i]);
+#endif
+
+		if (strcmp(prop->name, "zpos") == 0 &&
+		    (prop->flags & DRM_MODE_PROP_RANGE) &&
+		    prop->count_values == 2) {
+			sprite->zpos_prop = prop->prop_id;
+			sprite->zpos_mutable =
+				!(prop->flags & DRM_MODE_PROP_IMMUTABLE);
+			sprite->zpos_min = prop->values[0];
+			sprite->zpos_max = prop->values[1];
+			sprite->zpos_default = props->prop_values[i];
+			sprite->zpos = sprite->zpos_default;
+		}
+
+		if (strcmp(prop->name, "rotation") == 0 &&
+		    (prop->flags & DRM_MODE_PROP_BITMASK)) {
+			sprite->rotation_prop = prop->prop_id;
+
+			/* Enum values of bitmask properties are bit
+			 * numbers */
+			for (k = 0; k < prop->count_enums; k++) {
+				for (j = 0; j < ARRAY_LENGTH(rotations); j++) {
+					if (strcmp(prop->enums[k].name,
+						   rotations[j].name) != 0 ||
+					    (1ULL << prop->enums[k].value) !=
+					    rotations[j].bit)
+						continue;
+
+					sprite->rotations_supported |=
+						rotations[j].bit;
+				}
+			}
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	sprite->rotation = WDRM_PLANE_ROTATE_0;
+}
+#endif
+
 static void
 drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 {
 	struct drm_fb *fb = data;
+	struct drm_gem_close gem_close;
+	int i;
 
 	if (fb->fb_id)
 		drmModeRmFB(fb->fd, fb->fb_id);
 
 	weston_buffer_reference(&fb->buffer_ref, NULL);
 
+	/* Handles of a bo imported into a secondary device */
+	for (i = 0; i < fb->n_plane_handles; i++) {
+		memset(&gem_close, 0, sizeof gem_close);
+		gem_close.handle = fb->plane_handles[i];
+		drmIoctl(fb->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
+
 	free(data);
 }
 
 static struct drm_fb *
-drm_fb_create_dumb(struct drm_backend *b, int width, int height,
+drm_fb_create_dumb(struct drm_backend *b, int fd, int width, int height,
 		   uint32_t format)
 {
 	struct drm_fb *fb;
@@ -309,6 +1002,9 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 			bpp = 32;
 			depth = 24;
 			break;
+		case GBM_FORMAT_ARGB8888:
+			bpp = depth = 32;
+			break;
 		case GBM_FORMAT_RGB565:
 			bpp = depth = 16;
 			break;
@@ -321,7 +1017,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	create_arg.width = width;
 	create_arg.height = height;
 
-	ret = drmIoctl(b->drm.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg);
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg);
 	if (ret)
 		goto err_fb;
 
@@ -330,7 +1026,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	fb->size = create_arg.size;
 	fb->width = width;
 	fb->height = height;
-	fb->fd = b->drm.fd;
+	fb->fd = fd;
 
 	ret = -1;
 
@@ -341,7 +1037,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 		pitches[0] = fb->stride;
 		offsets[0] = 0;
 
-		ret = drmModeAddFB2(b->drm.fd, width, height,
+		ret = drmModeAddFB2(fd, width, height,
 				    format, handles, pitches, offsets,
 				    &fb->fb_id, 0);
 		if (ret) {
@@ -351,7 +1047,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	}
 
 	if (ret) {
-		ret = drmModeAddFB(b->drm.fd, width, height, depth, bpp,
+		ret = drmModeAddFB(fd, width, height, depth, bpp,
 				   fb->stride, fb->handle, &fb->fb_id);
 	}
 
@@ -364,19 +1060,20 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	if (ret)
 		goto err_add_fb;
 
-	fb->map = mmap(NULL, fb->size, PROT_WRITE,
-		       MAP_SHARED, b->drm.fd, map_arg.offset);
+	/* Readable too, for writeback buffers */
+	fb->map = mmap(NULL, fb->size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, map_arg.offset);
 	if (fb->map == MAP_FAILED)
 		goto err_add_fb;
 
 	return fb;
 
 err_add_fb:
-	drmModeRmFB(b->drm.fd, fb->fb_id);
+	drmModeRmFB(fd, fb->fb_id);
 err_bo:
 	memset(&destroy_arg, 0, sizeof(destroy_arg));
 	destroy_arg.handle = create_arg.handle;
-	drmIoctl(b->drm.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
+	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_arg);
 err_fb:
 	free(fb);
 	return NULL;
@@ -404,6 +1101,15 @@ drm_fb_destroy_dumb(struct drm_fb *fb)
 	free(fb);
 }
 
+/* AddFB2 without modifiers takes linear buffers, and ones whose layout
+ * the kernel driver knows implicitly */
+static bool
+drm_dmabuf_modifier_supported(uint64_t modifier)
+{
+	return modifier == DRM_FORMAT_MOD_LINEAR ||
+	       modifier == DRM_FORMAT_MOD_INVALID;
+}
+
 static struct drm_fb *
 drm_fb_get_from_bo(struct gbm_bo *bo,
 		   struct drm_backend *backend, uint32_t format)
@@ -427,6 +1133,7 @@ drm_fb_get_from_bo(struct gbm_bo *bo,
 	fb->handle = gbm_bo_get_handle(bo).u32;
 	fb->size = fb->stride * fb->height;
 	fb->fd = backend->drm.fd;
+	fb->format = format;
 
 	if (backend->min_width > fb->width ||
 	    fb->width > backend->max_width ||
@@ -438,7 +1145,44 @@ drm_fb_get_from_bo(struct gbm_bo *bo,
 
 	ret = -1;
 
-	if (format && !backend->no_addfb2) {
+#ifdef HAVE_GBM_MODIFIERS
+	/* Without the modifier, the kernel assumes the layout it picks
+	 * itself, which only matches for linear and implicit ones */
+	fb->modifier = gbm_bo_get_modifier(bo);
+	if (format && backend->fb_modifiers &&
+	    fb->modifier != DRM_FORMAT_MOD_INVALID) {
+		uint64_t modifiers[4] = { 0 };
+		int i, n_planes = MIN(gbm_bo_get_plane_count(bo), 4);
+
+		for (i = 0; i < n_planes; i++) {
+			handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+			pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+			offsets[i] = gbm_bo_get_offset(bo, i);
+			modifiers[i] = fb->modifier;
+		}
+
+		ret = drmModeAddFB2WithModifiers(backend->drm.fd, fb->width,
+						 fb->height, format, handles,
+						 pitches, offsets, modifiers,
+						 &fb->fb_id,
+						 DRM_MODE_FB_MODIFIERS);
+		if (ret && !drm_dmabuf_modifier_supported(fb->modifier)) {
+			weston_log("addfb2 with modifier 0x%llx failed: %m\n",
+				   (unsigned long long) fb->modifier);
+			goto err_free;
+		}
+
+		if (ret) {
+			memset(handles, 0, sizeof handles);
+			memset(pitches, 0, sizeof pitches);
+			memset(offsets, 0, sizeof offsets);
+		}
+	}
+	if (ret)
+		fb->modifier = DRM_FORMAT_MOD_LINEAR;
+#endif
+
+	if (ret && format && !backend->no_addfb2) {
 		handles[0] = fb->handle;
 		pitches[0] = fb->stride;
 		offsets[0] = 0;
@@ -471,494 +1215,459 @@ err_free:
 	return NULL;
 }
 
-static void
-drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
+#ifdef HAVE_GBM_BO_MAP
+/**
+ * Import a render GPU bo into a secondary KMS device
+ *
+ * The fb is kept as the bo's user data, like the ones of
+ * drm_fb_get_from_bo(), so each buffer of the gbm surface is only
+ * imported once.
+ */
+static struct drm_fb *
+drm_secondary_fb_get_from_bo(struct gbm_bo *bo, struct drm_secondary *dev,
+			     uint32_t format)
 {
-	assert(fb->buffer_ref.buffer == NULL);
+	struct drm_fb *fb = gbm_bo_get_user_data(bo);
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	int prime_fd, ret;
 
-	fb->is_client_buffer = 1;
+	if (fb)
+		return fb;
 
-	weston_buffer_reference(&fb->buffer_ref, buffer);
-}
+	fb = zalloc(sizeof *fb);
+	if (fb == NULL)
+		return NULL;
 
-static void
-drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
-{
-	if (!fb)
-		return;
+	fb->bo = bo;
+	fb->width = gbm_bo_get_width(bo);
+	fb->height = gbm_bo_get_height(bo);
+	fb->stride = gbm_bo_get_stride(bo);
+	fb->size = fb->stride * fb->height;
+	fb->fd = dev->fd;
+	fb->format = format;
 
-	if (fb->map &&
-            (fb != output->dumb[0] && fb != output->dumb[1])) {
-		drm_fb_destroy_dumb(fb);
-	} else if (fb->bo) {
-		if (fb->is_client_buffer)
-			gbm_bo_destroy(fb->bo);
-		else
-			gbm_surface_release_buffer(output->gbm_surface,
-						   fb->bo);
+	if (dev->min_width > fb->width || fb->width > dev->max_width ||
+	    dev->min_height > fb->height || fb->height > dev->max_height) {
+		weston_log("bo geometry out of bounds for %s\n",
+			   dev->filename);
+		goto err_free;
 	}
-}
 
-static uint32_t
-drm_output_check_scanout_format(struct drm_output *output,
-				struct weston_surface *es, struct gbm_bo *bo)
-{
-	uint32_t format;
-	pixman_region32_t r;
+	prime_fd = gbm_bo_get_fd(bo);
+	if (prime_fd < 0)
+		goto err_free;
 
-	format = gbm_bo_get_format(bo);
+	ret = drmPrimeFDToHandle(dev->fd, prime_fd, &fb->handle);
+	close(prime_fd);
+	if (ret)
+		goto err_free;
 
-	if (format == GBM_FORMAT_ARGB8888) {
-		/* We can scanout an ARGB buffer if the surface's
-		 * opaque region covers the whole output, but we have
-		 * to use XRGB as the KMS format code. */
-		pixman_region32_init_rect(&r, 0, 0,
-					  output->base.width,
-					  output->base.height);
-		pixman_region32_subtract(&r, &r, &es->opaque);
+	fb->plane_handles[0] = fb->handle;
+	fb->n_plane_handles = 1;
 
-		if (!pixman_region32_not_empty(&r))
-			format = GBM_FORMAT_XRGB8888;
-
-		pixman_region32_fini(&r);
+	handles[0] = fb->handle;
+	pitches[0] = fb->stride;
+	if (drmModeAddFB2(dev->fd, fb->width, fb->height, format,
+			  handles, pitches, offsets, &fb->fb_id, 0)) {
+		weston_log("%s: failed to create kms fb for imported bo: %m\n",
+			   dev->filename);
+		drm_fb_destroy_callback(bo, fb);
+		return NULL;
 	}
 
-	if (output->gbm_format == format)
-		return format;
+	gbm_bo_set_user_data(bo, fb, drm_fb_destroy_callback);
 
-	return 0;
+	return fb;
+
+err_free:
+	free(fb);
+	return NULL;
 }
 
-static struct weston_plane *
-drm_output_prepare_scanout_view(struct drm_output *output,
-				struct weston_view *ev)
+/**
+ * Copy a render GPU bo into one of the output's dumb buffers
+ *
+ * Only used when the secondary device cannot import the bo; the bo goes
+ * back to the gbm surface right away.
+ */
+static struct drm_fb *
+drm_output_copy_from_bo(struct drm_output *output, struct gbm_bo *bo)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
-	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct gbm_bo *bo;
-	uint32_t format;
+	int width = gbm_bo_get_width(bo);
+	int height = gbm_bo_get_height(bo);
+	struct drm_fb *fb;
+	uint32_t src_stride;
+	void *map_data = NULL;
+	uint8_t *src, *dst;
+	int i, row;
 
-	/* We use GBM to import buffers. */
-	if (b->gbm == NULL)
-		return NULL;
+	output->dumb_count = 2;
+	for (i = 0; i < output->dumb_count; i++) {
+		if (output->dumb[i])
+			continue;
 
-	if (buffer == NULL)
-		return NULL;
+		output->dumb[i] = drm_fb_create_dumb(b, drm_output_fd(output),
+						     width, height,
+						     output->gbm_format);
+		if (!output->dumb[i]) {
+			weston_log("failed to create dumb buffers to copy "
+				   "into\n");
+			return NULL;
+		}
+	}
 
-	/* Make sure our view is exactly compatible with the output. */
-	if (ev->geometry.x != output->base.x ||
-	    ev->geometry.y != output->base.y)
-		return NULL;
-	if (ev->transform.enabled)
-		return NULL;
-	if (ev->geometry.scissor_enabled)
+	src = gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_READ,
+			 &src_stride, &map_data);
+	if (!src) {
+		weston_log("failed to map render buffer: %m\n");
 		return NULL;
+	}
 
-	if (buffer->width != output->base.current_mode->width ||
-	    buffer->height != output->base.current_mode->height)
-		return NULL;
-	if (viewport->buffer.transform != output->base.transform)
-		return NULL;
+	output->current_image = (output->current_image + 1) %
+				output->dumb_count;
+	fb = output->dumb[output->current_image];
 
-	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   buffer->resource, GBM_BO_USE_SCANOUT);
+	row = MIN(src_stride, fb->stride);
+	dst = fb->map;
+	for (i = 0; i < height; i++)
+		memcpy(dst + i * fb->stride, src + i * src_stride, row);
 
-	/* Unable to use the buffer for scanout */
-	if (!bo)
-		return NULL;
+	gbm_bo_unmap(bo, map_data);
 
-	format = drm_output_check_scanout_format(output, ev->surface, bo);
-	if (format == 0) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
+	return fb;
+}
 
-	output->next = drm_fb_get_from_bo(bo, b, format);
-	if (!output->next) {
-		gbm_bo_destroy(bo);
-		return NULL;
+static struct drm_fb *
+drm_output_secondary_fb(struct drm_output *output, struct gbm_bo *bo)
+{
+	struct drm_secondary *dev = output->secondary;
+	struct drm_fb *fb = NULL;
+
+	if (!dev->prime_broken) {
+		fb = drm_secondary_fb_get_from_bo(bo, dev, output->gbm_format);
+		if (fb)
+			return fb;
+
+		weston_log("%s cannot import buffers from the render GPU, "
+			   "falling back to copying them\n", dev->filename);
+		dev->prime_broken = 1;
 	}
 
-	drm_fb_set_buffer(output->next, buffer);
+	fb = drm_output_copy_from_bo(output, bo);
+	gbm_surface_release_buffer(output->gbm_surface, bo);
 
-	return &output->fb_plane;
+	return fb;
 }
+#endif
 
 static void
-drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
+drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer,
+		  struct weston_buffer_release *buffer_release)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct gbm_bo *bo;
+	fb->is_client_buffer = 1;
 
-	output->base.compositor->renderer->repaint_output(&output->base,
-							  damage);
+	/* The release of the latest commit of the buffer has to wait until
+	 * the fb leaves the screen, like the buffer itself. */
+	weston_buffer_release_reference(&fb->buffer_release_ref,
+					buffer_release);
 
-	bo = gbm_surface_lock_front_buffer(output->gbm_surface);
-	if (!bo) {
-		weston_log("failed to lock front buffer: %m\n");
+	/* A cached dmabuf fb may be held by several planes at once, e.g.
+	 * as both the current and the next buffer of a sprite. */
+	if (fb->uses++ > 0) {
+		assert(fb->buffer_ref.buffer == buffer);
 		return;
 	}
 
-	output->next = drm_fb_get_from_bo(bo, b, output->gbm_format);
-	if (!output->next) {
-		weston_log("failed to get drm_fb for bo\n");
-		gbm_surface_release_buffer(output->gbm_surface, bo);
-		return;
-	}
+	assert(fb->buffer_ref.buffer == NULL);
+	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
 
 static void
-drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
+drm_fb_destroy_dmabuf(struct drm_fb *fb)
 {
-	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
-
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
-
-	pixman_region32_copy(&previous_damage, damage);
-
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
+	struct drm_gem_close gem_close;
+	int i;
 
-	output->current_image ^= 1;
+	if (fb->fb_id)
+		drmModeRmFB(fb->fd, fb->fb_id);
 
-	output->next = output->dumb[output->current_image];
-	pixman_renderer_output_set_buffer(&output->base,
-					  output->image[output->current_image]);
+	weston_buffer_reference(&fb->buffer_ref, NULL);
+	weston_buffer_release_reference(&fb->buffer_release_ref, NULL);
 
-	ec->renderer->repaint_output(&output->base, &total_damage);
+	for (i = 0; i < fb->n_plane_handles; i++) {
+		memset(&gem_close, 0, sizeof gem_close);
+		gem_close.handle = fb->plane_handles[i];
+		drmIoctl(fb->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
 
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
+	free(fb);
 }
 
+/* Destroy a client fb once nothing holds it any more */
 static void
-drm_output_render(struct drm_output *output, pixman_region32_t *damage)
+drm_fb_destroy_client(struct drm_fb *fb)
 {
-	struct weston_compositor *c = output->base.compositor;
-	struct drm_backend *b = to_drm_backend(c);
-
-	if (b->use_pixman)
-		drm_output_render_pixman(output, damage);
+	if (fb->bo)
+		gbm_bo_destroy(fb->bo);
 	else
-		drm_output_render_gl(output, damage);
-
-	pixman_region32_subtract(&c->primary_plane.damage,
-				 &c->primary_plane.damage, damage);
+		drm_fb_destroy_dmabuf(fb);
 }
 
 static void
-drm_output_set_gamma(struct weston_output *output_base,
-		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b)
+drm_fb_dmabuf_destroy(struct linux_dmabuf_buffer *dmabuf)
 {
-	int rc;
-	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *backend =
-		to_drm_backend(output->base.compositor);
+	struct drm_fb *fb = linux_dmabuf_buffer_get_backend_user_data(dmabuf);
 
-	/* check */
-	if (output_base->gamma_size != size)
-		return;
-	if (!output->original_crtc)
-		return;
+	wl_list_remove(&fb->cache_link);
+	fb->dmabuf_cached = 0;
+	fb->dmabuf = NULL;
 
-	rc = drmModeCrtcSetGamma(backend->drm.fd,
-				 output->crtc_id,
-				 size, r, g, b);
-	if (rc)
-		weston_log("set gamma failed: %m\n");
+	/* If the fb is still on screen, the last drm_output_release_fb()
+	 * destroys it. */
+	if (fb->uses == 0)
+		drm_fb_destroy_client(fb);
 }
 
-/* Determine the type of vblank synchronization to use for the output.
+static void
+drm_fb_cache_remove(struct drm_fb *fb)
+{
+	linux_dmabuf_buffer_set_backend_user_data(fb->dmabuf, NULL, NULL);
+	drm_fb_dmabuf_destroy(fb->dmabuf);
+}
+
+/**
+ * Add a dmabuf as a KMS framebuffer without going through GBM
  *
- * The pipe parameter indicates which CRTC is in use.  Knowing this, we
- * can determine which vblank sequence type to use for it.  Traditional
- * cards had only two CRTCs, with CRTC 0 using no special flags, and
- * CRTC 1 using DRM_VBLANK_SECONDARY.  The first bit of the pipe
- * parameter indicates this.
+ * GBM can only wrap single-plane buffers, while display controllers
+ * often scan out multi-planar YUV formats such as NV12 natively. Each
+ * plane's dmabuf is turned into a GEM handle, and all of them are handed
+ * to AddFB2 together.
  *
- * Bits 1-5 of the pipe parameter are 5 bit wide pipe number between
- * 0-31.  If this is non-zero it indicates we're dealing with a
- * multi-gpu situation and we need to calculate the vblank sync
- * using DRM_BLANK_HIGH_CRTC_MASK.
+ * Format modifiers cannot be passed without AddFB2WithModifiers, so only
+ * linear and implicit layouts are accepted; drm_fb_get_from_dmabuf() has
+ * already checked that.
+ *
+ * @param dmabuf The client dmabuf to import
+ * @param b The DRM backend
+ * @param format KMS format to add the framebuffer with
+ * @returns A new framebuffer, or NULL on failure
  */
-static unsigned int
-drm_waitvblank_pipe(struct drm_output *output)
+static struct drm_fb *
+drm_fb_import_dmabuf(struct linux_dmabuf_buffer *dmabuf,
+		     struct drm_backend *b, uint32_t format)
 {
-	if (output->pipe > 1)
-		return (output->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
-				DRM_VBLANK_HIGH_CRTC_MASK;
-	else if (output->pipe > 0)
-		return DRM_VBLANK_SECONDARY;
-	else
-		return 0;
-}
+	struct dmabuf_attributes *attributes = &dmabuf->attributes;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	struct drm_fb *fb;
+	uint32_t handle;
+	int i, j;
 
-static int
-drm_output_repaint(struct weston_output *output_base,
-		   pixman_region32_t *damage)
-{
-	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *backend =
-		to_drm_backend(output->base.compositor);
-	struct drm_sprite *s;
-	struct drm_mode *mode;
-	int ret = 0;
+	if (b->no_addfb2)
+		return NULL;
 
-	if (output->disable_pending || output->destroy_pending)
-		return -1;
+	if (attributes->width < b->min_width ||
+	    attributes->width > b->max_width ||
+	    attributes->height < b->min_height ||
+	    attributes->height > b->max_height)
+		return NULL;
 
-	if (!output->next)
-		drm_output_render(output, damage);
-	if (!output->next)
-		return -1;
+	fb = zalloc(sizeof *fb);
+	if (fb == NULL)
+		return NULL;
 
-	mode = container_of(output->base.current_mode, struct drm_mode, base);
-	if (!output->current ||
-	    output->current->stride != output->next->stride) {
-		ret = drmModeSetCrtc(backend->drm.fd, output->crtc_id,
-				     output->next->fb_id, 0, 0,
-				     &output->connector_id, 1,
-				     &mode->mode_info);
-		if (ret) {
-			weston_log("set mode failed: %m\n");
-			goto err_pageflip;
+	fb->fd = b->drm.fd;
+	fb->width = attributes->width;
+	fb->height = attributes->height;
+	fb->stride = attributes->stride[0];
+	fb->format = format;
+
+	for (i = 0; i < attributes->n_planes; i++) {
+		if (drmPrimeFDToHandle(b->drm.fd, attributes->fd[i],
+				       &handle) < 0) {
+			weston_log("failed to import dmabuf plane %d: %m\n", i);
+			goto err;
 		}
-		output_base->set_dpms(output_base, WESTON_DPMS_ON);
-	}
 
-	if (drmModePageFlip(backend->drm.fd, output->crtc_id,
-			    output->next->fb_id,
-			    DRM_MODE_PAGE_FLIP_EVENT, output) < 0) {
-		weston_log("queueing pageflip failed: %m\n");
-		goto err_pageflip;
-	}
+		/* Planes sharing a dmabuf get the same handle, which must
+		 * be closed only once. */
+		for (j = 0; j < fb->n_plane_handles; j++)
+			if (fb->plane_handles[j] == handle)
+				break;
+		if (j == fb->n_plane_handles)
+			fb->plane_handles[fb->n_plane_handles++] = handle;
 
-	output->page_flip_pending = 1;
+		handles[i] = handle;
+		pitches[i] = attributes->stride[i];
+		offsets[i] = attributes->offset[i];
+	}
 
-	drm_output_set_cursor(output);
+	fb->handle = handles[0];
 
-	/*
-	 * Now, update all the sprite surfaces
-	 */
-	wl_list_for_each(s, &backend->sprite_list, link) {
-		uint32_t flags = 0, fb_id = 0;
-		drmVBlank vbl = {
-			.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
-			.request.sequence = 1,
-		};
+	if (drmModeAddFB2(b->drm.fd, fb->width, fb->height, format,
+			  handles, pitches, offsets, &fb->fb_id, 0)) {
+		weston_log("addfb2 of dmabuf failed: %m\n");
+		goto err;
+	}
 
-		if ((!s->current && !s->next) ||
-		    !drm_sprite_crtc_supported(output, s))
-			continue;
+	return fb;
 
-		if (s->next && !backend->sprites_hidden)
-			fb_id = s->next->fb_id;
+err:
+	drm_fb_destroy_dmabuf(fb);
+	return NULL;
+}
 
-		ret = drmModeSetPlane(backend->drm.fd, s->plane_id,
-				      output->crtc_id, fb_id, flags,
-				      s->dest_x, s->dest_y,
-				      s->dest_w, s->dest_h,
-				      s->src_x, s->src_y,
-				      s->src_w, s->src_h);
-		if (ret)
-			weston_log("setplane failed: %d: %s\n",
-				ret, strerror(errno));
+/**
+ * Get a KMS framebuffer for a client dmabuf
+ *
+ * Importing a dmabuf into GBM and adding it as a KMS framebuffer is
+ * expensive, and clients usually cycle through a small, fixed set of
+ * buffers. The framebuffer is therefore cached on the linux_dmabuf_buffer
+ * and reused for as long as the dmabuf lives; it is only released when
+ * the client destroys the buffer.
+ *
+ * Single-plane buffers go through GBM when it can import dmabufs;
+ * multi-planar ones are added directly, see drm_fb_import_dmabuf().
+ *
+ * @param dmabuf The client dmabuf to import
+ * @param b The DRM backend
+ * @param format KMS format to add the framebuffer with, which may differ
+ *               from the dmabuf format (ARGB used as XRGB)
+ * @returns The cached framebuffer, or NULL on failure
+ */
+static struct drm_fb *
+drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
+		       struct drm_backend *b, uint32_t format)
+{
+	struct drm_fb *fb;
 
-		vbl.request.type |= drm_waitvblank_pipe(output);
+	fb = linux_dmabuf_buffer_get_backend_user_data(dmabuf);
+	if (fb) {
+		if (fb->format == format)
+			return fb;
 
-		/*
-		 * Queue a vblank signal so we know when the surface
-		 * becomes active on the display or has been replaced.
-		 */
-		vbl.request.signal = (unsigned long)s;
-		ret = drmWaitVBlank(backend->drm.fd, &vbl);
-		if (ret) {
-			weston_log("vblank event request failed: %d: %s\n",
-				ret, strerror(errno));
-		}
+		/* The same buffer is wanted with a different format code,
+		 * which we cannot do while it is being scanned out. */
+		if (fb->uses > 0)
+			return NULL;
 
-		s->output = output;
-		output->vblank_pending = 1;
+		drm_fb_cache_remove(fb);
 	}
 
-	return 0;
-
-err_pageflip:
-	output->cursor_view = NULL;
-	if (output->next) {
-		drm_output_release_fb(output, output->next);
-		output->next = NULL;
-	}
+	/* XXX: TODO:
+	 *
+	 * Currently the buffer is rejected if any dmabuf attribute
+	 * flag is set.  This keeps us from passing an inverted /
+	 * interlaced / bottom-first buffer (or any other type that may
+	 * be added in the future) through to an overlay.  Ultimately,
+	 * these types of buffers should be handled through buffer
+	 * transforms and not as spot-checks requiring specific
+	 * knowledge. */
+	if (dmabuf->attributes.flags)
+		return NULL;
 
-	return -1;
-}
+	if (!drm_dmabuf_modifier_supported(dmabuf->attributes.modifier[0]))
+		return NULL;
 
-static void
-drm_output_start_repaint_loop(struct weston_output *output_base)
-{
-	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *backend =
-		to_drm_backend(output_base->compositor);
-	uint32_t fb_id;
-	struct timespec ts, tnow;
-	struct timespec vbl2now;
-	int64_t refresh_nsec;
-	int ret;
-	drmVBlank vbl = {
-		.request.type = DRM_VBLANK_RELATIVE,
-		.request.sequence = 0,
-		.request.signal = 0,
-	};
-
-	if (output->disable_pending || output->destroy_pending)
-		return;
-
-	if (!output->current) {
-		/* We can't page flip if there's no mode set */
-		goto finish_frame;
-	}
-
-	/* Try to get current msc and timestamp via instant query */
-	vbl.request.type |= drm_waitvblank_pipe(output);
-	ret = drmWaitVBlank(backend->drm.fd, &vbl);
+#ifdef HAVE_GBM_FD_IMPORT
+	if (dmabuf->attributes.n_planes == 1 &&
+	    dmabuf->attributes.offset[0] == 0) {
+		struct gbm_import_fd_data gbm_dmabuf = {
+			.fd     = dmabuf->attributes.fd[0],
+			.width  = dmabuf->attributes.width,
+			.height = dmabuf->attributes.height,
+			.stride = dmabuf->attributes.stride[0],
+			.format = dmabuf->attributes.format
+		};
+		struct gbm_bo *bo;
 
-	/* Error ret or zero timestamp means failure to get valid timestamp */
-	if ((ret == 0) && (vbl.reply.tval_sec > 0 || vbl.reply.tval_usec > 0)) {
-		ts.tv_sec = vbl.reply.tval_sec;
-		ts.tv_nsec = vbl.reply.tval_usec * 1000;
+		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_FD, &gbm_dmabuf,
+				   GBM_BO_USE_SCANOUT);
+		if (!bo)
+			return NULL;
 
-		/* Valid timestamp for most recent vblank - not stale?
-		 * Stale ts could happen on Linux 3.17+, so make sure it
-		 * is not older than 1 refresh duration since now.
-		 */
-		weston_compositor_read_presentation_clock(backend->compositor,
-							  &tnow);
-		timespec_sub(&vbl2now, &tnow, &ts);
-		refresh_nsec =
-			millihz_to_nsec(output->base.current_mode->refresh);
-		if (timespec_to_nsec(&vbl2now) < refresh_nsec) {
-			drm_output_update_msc(output, vbl.reply.sequence);
-			weston_output_finish_frame(output_base, &ts,
-						WP_PRESENTATION_FEEDBACK_INVALID);
-			return;
+		fb = drm_fb_get_from_bo(bo, b, format);
+		if (!fb) {
+			gbm_bo_destroy(bo);
+			return NULL;
 		}
+	} else
+#endif
+	{
+		fb = drm_fb_import_dmabuf(dmabuf, b, format);
+		if (!fb)
+			return NULL;
 	}
 
-	/* Immediate query didn't provide valid timestamp.
-	 * Use pageflip fallback.
-	 */
-	fb_id = output->current->fb_id;
-
-	if (drmModePageFlip(backend->drm.fd, output->crtc_id, fb_id,
-			    DRM_MODE_PAGE_FLIP_EVENT, output) < 0) {
-		weston_log("queueing pageflip failed: %m\n");
-		goto finish_frame;
-	}
-
-	return;
+	fb->dmabuf_cached = 1;
+	fb->dmabuf = dmabuf;
+	wl_list_insert(&b->fb_cache_list, &fb->cache_link);
+	linux_dmabuf_buffer_set_backend_user_data(dmabuf, fb,
+						  drm_fb_dmabuf_destroy);
 
-finish_frame:
-	/* if we cannot page-flip, immediately finish frame */
-	weston_compositor_read_presentation_clock(output_base->compositor, &ts);
-	weston_output_finish_frame(output_base, &ts,
-				   WP_PRESENTATION_FEEDBACK_INVALID);
+	return fb;
 }
 
 static void
-drm_output_update_msc(struct drm_output *output, unsigned int seq)
+drm_fb_cache_release(struct drm_backend *b)
 {
-	uint64_t msc_hi = output->base.msc >> 32;
-
-	if (seq < (output->base.msc & 0xffffffff))
-		msc_hi++;
+	struct drm_fb *fb, *next;
 
-	output->base.msc = (msc_hi << 32) + seq;
+	wl_list_for_each_safe(fb, next, &b->fb_cache_list, cache_link)
+		drm_fb_cache_remove(fb);
 }
 
-static void
-vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
-	       void *data)
+static bool
+drm_output_fb_is_dumb(struct drm_output *output, struct drm_fb *fb)
 {
-	struct drm_sprite *s = (struct drm_sprite *)data;
-	struct drm_output *output = s->output;
-	struct timespec ts;
-	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
-			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
-
-	drm_output_update_msc(output, frame);
-	output->vblank_pending = 0;
-
-	drm_output_release_fb(output, s->current);
-	s->current = s->next;
-	s->next = NULL;
+	int i;
 
-	if (!output->page_flip_pending) {
-		ts.tv_sec = sec;
-		ts.tv_nsec = usec * 1000;
-		weston_output_finish_frame(&output->base, &ts, flags);
+	for (i = 0; i < output->dumb_count; i++) {
+		if (fb == output->dumb[i])
+			return true;
 	}
-}
 
-static void
-drm_output_destroy(struct weston_output *base);
+	return false;
+}
 
 static void
-page_flip_handler(int fd, unsigned int frame,
-		  unsigned int sec, unsigned int usec, void *data)
+drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 {
-	struct drm_output *output = data;
-	struct timespec ts;
-	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
-			 WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
-			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
-
-	drm_output_update_msc(output, frame);
-
-	/* We don't set page_flip_pending on start_repaint_loop, in that case
-	 * we just want to page flip to the current buffer to get an accurate
-	 * timestamp */
-	if (output->page_flip_pending) {
-		drm_output_release_fb(output, output->current);
-		output->current = output->next;
-		output->next = NULL;
-	}
-
-	output->page_flip_pending = 0;
+	if (!fb || fb == output->solid_fb || fb->sprite_cursor)
+		return;
 
-	if (output->destroy_pending)
-		drm_output_destroy(&output->base);
-	else if (output->disable_pending)
-		weston_output_disable(&output->base);
-	else if (!output->vblank_pending) {
-		ts.tv_sec = sec;
-		ts.tv_nsec = usec * 1000;
-		weston_output_finish_frame(&output->base, &ts, flags);
+	if (fb->map && !drm_output_fb_is_dumb(output, fb)) {
+		drm_fb_destroy_dumb(fb);
+	} else if (fb->foreign) {
+		free(fb);
+	} else if (fb->is_client_buffer) {
+		assert(fb->uses > 0);
+		if (--fb->uses > 0)
+			return;
 
-		/* We can't call this from frame_notify, because the output's
-		 * repaint needed flag is cleared just after that */
-		if (output->recorder)
-			weston_output_schedule_repaint(&output->base);
+		weston_buffer_reference(&fb->buffer_ref, NULL);
+		weston_buffer_release_reference(&fb->buffer_release_ref, NULL);
+		if (!fb->dmabuf_cached)
+			drm_fb_destroy_client(fb);
+	} else if (fb->bo) {
+		gbm_surface_release_buffer(output->gbm_surface, fb->bo);
 	}
 }
 
 static uint32_t
-drm_output_check_sprite_format(struct drm_sprite *s,
-			       struct weston_view *ev, struct gbm_bo *bo)
+drm_output_check_scanout_format(struct drm_output *output,
+				struct weston_surface *es, uint32_t format)
 {
-	uint32_t i, format;
-
-	format = gbm_bo_get_format(bo);
+	pixman_region32_t r;
 
 	if (format == GBM_FORMAT_ARGB8888) {
-		pixman_region32_t r;
-
+		/* We can scanout an ARGB buffer if the surface's
+		 * opaque region covers the whole output, but we have
+		 * to use XRGB as the KMS format code. */
 		pixman_region32_init_rect(&r, 0, 0,
-					  ev->surface->width,
-					  ev->surface->height);
-		pixman_region32_subtract(&r, &r, &ev->surface->opaque);
+					  output->base.width,
+					  output->base.height);
+		pixman_region32_subtract(&r, &r, &es->opaque);
 
 		if (!pixman_region32_not_empty(&r))
 			format = GBM_FORMAT_XRGB8888;
@@ -966,1463 +1675,5330 @@ drm_output_check_sprite_format(struct drm_sprite *s,
 		pixman_region32_fini(&r);
 	}
 
-	for (i = 0; i < s->count_formats; i++)
-		if (s->formats[i] == format)
-			return format;
+	if (output->gbm_format == format)
+		return format;
+
+	/* Outputs use an alpha format for underlays; opaque buffers are
+	 * scanned out all the same. */
+	if (output->gbm_format == GBM_FORMAT_ARGB8888 &&
+	    format == GBM_FORMAT_XRGB8888)
+		return format;
 
 	return 0;
 }
 
+#ifdef HAVE_DRM_ATOMIC
 static int
-drm_view_transform_supported(struct weston_view *ev)
+drm_output_test_atomic(struct drm_output *output, struct drm_fb *primary_fb);
+#endif
+
+/* Plane source coordinates are 16.16 fixed point */
+static inline uint32_t
+drm_fixed_16_16(double v)
 {
-	return !ev->transform.enabled ||
-		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
+	return v * 65536.0 + 0.5;
 }
 
-static struct weston_plane *
-drm_output_prepare_overlay_view(struct drm_output *output,
-				struct weston_view *ev)
+/* View coordinates of a global point, exact for views without a
+ * transform, which most are */
+static void
+drm_view_from_global(struct weston_view *ev, int32_t x, int32_t y,
+		     double *vx, double *vy)
 {
-	struct weston_compositor *ec = output->base.compositor;
-	struct drm_backend *b = to_drm_backend(ec);
-	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct wl_resource *buffer_resource;
-	struct drm_sprite *s;
-	struct linux_dmabuf_buffer *dmabuf;
-	int found = 0;
-	struct gbm_bo *bo;
-	pixman_region32_t dest_rect, src_rect;
-	pixman_box32_t *box, tbox;
-	uint32_t format;
-	wl_fixed_t sx1, sy1, sx2, sy2;
-
-	if (b->sprites_are_broken)
-		return NULL;
-
-	/* Don't import buffers which span multiple outputs. */
-	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
-
-	/* We can only import GBM buffers. */
-	if (b->gbm == NULL)
-		return NULL;
-
-	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-	buffer_resource = ev->surface->buffer_ref.buffer->resource;
-	if (wl_shm_buffer_get(buffer_resource))
-		return NULL;
-
-	if (viewport->buffer.transform != output->base.transform)
-		return NULL;
-	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
-	if (!drm_view_transform_supported(ev))
-		return NULL;
-
-	if (ev->alpha != 1.0f)
-		return NULL;
-
-	wl_list_for_each(s, &b->sprite_list, link) {
-		if (!drm_sprite_crtc_supported(output, s))
-			continue;
-
-		if (!s->next) {
-			found = 1;
-			break;
-		}
-	}
-
-	/* No sprites available */
-	if (!found)
-		return NULL;
-
-	if ((dmabuf = linux_dmabuf_buffer_get(buffer_resource))) {
-#ifdef HAVE_GBM_FD_IMPORT
-		/* XXX: TODO:
-		 *
-		 * Use AddFB2 directly, do not go via GBM.
-		 * Add support for multiplanar formats.
-		 * Both require refactoring in the DRM-backend to
-		 * support a mix of gbm_bos and drmfbs.
-		 */
-		struct gbm_import_fd_data gbm_dmabuf = {
-			.fd     = dmabuf->attributes.fd[0],
-			.width  = dmabuf->attributes.width,
-			.height = dmabuf->attributes.height,
-			.stride = dmabuf->attributes.stride[0],
-			.format = dmabuf->attributes.format
-		};
-
-                /* XXX: TODO:
-                 *
-                 * Currently the buffer is rejected if any dmabuf attribute
-                 * flag is set.  This keeps us from passing an inverted /
-                 * interlaced / bottom-first buffer (or any other type that may
-                 * be added in the future) through to an overlay.  Ultimately,
-                 * these types of buffers should be handled through buffer
-                 * transforms and not as spot-checks requiring specific
-                 * knowledge. */
-		if (dmabuf->attributes.n_planes != 1 ||
-                    dmabuf->attributes.offset[0] != 0 ||
-		    dmabuf->attributes.flags)
-			return NULL;
-
-		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_FD, &gbm_dmabuf,
-				   GBM_BO_USE_SCANOUT);
-#else
-		return NULL;
-#endif
-	} else {
-		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
-				   buffer_resource, GBM_BO_USE_SCANOUT);
-	}
-	if (!bo)
-		return NULL;
+	float fx, fy;
 
-	format = drm_output_check_sprite_format(s, ev, bo);
-	if (format == 0) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
-
-	s->next = drm_fb_get_from_bo(bo, b, format);
-	if (!s->next) {
-		gbm_bo_destroy(bo);
-		return NULL;
+	if (!ev->transform.enabled) {
+		*vx = x - ev->geometry.x;
+		*vy = y - ev->geometry.y;
+		return;
 	}
 
-	drm_fb_set_buffer(s->next, ev->surface->buffer_ref.buffer);
-
-	box = pixman_region32_extents(&ev->transform.boundingbox);
-	s->plane.x = box->x1;
-	s->plane.y = box->y1;
+	weston_view_from_global_float(ev, x, y, &fx, &fy);
+	*vx = fx;
+	*vy = fy;
+}
 
-	/*
-	 * Calculate the source & dest rects properly based on actual
-	 * position (note the caller has called weston_view_update_transform()
-	 * for us already).
-	 */
-	pixman_region32_init(&dest_rect);
-	pixman_region32_intersect(&dest_rect, &ev->transform.boundingbox,
+/**
+ * Compute the rectangles of a plane showing a view on an output
+ *
+ * The destination rectangle is the part of the view inside the output,
+ * in framebuffer pixels. The source rectangle is where that part comes
+ * from in the buffer. It goes through the full surface-to-buffer
+ * mapping, so that a wp_viewport crop and scale or a buffer scale
+ * differing from the output scale end up as plane scaling, and keeps
+ * the fractional part of it: a crop to odd coordinates of a scaled
+ * buffer does not become a shifted picture.
+ *
+ * @param s The plane to set src_* and dest_* of
+ * @param output The output the view is shown on
+ * @param ev The view, with an up to date transform
+ */
+static void
+drm_sprite_set_view_rects(struct drm_sprite *s, struct drm_output *output,
+			  struct weston_view *ev)
+{
+	struct weston_surface *es = ev->surface;
+	pixman_region32_t visible;
+	pixman_box32_t box, tbox;
+	double sx1, sy1, sx2, sy2;
+	double bx1, by1, bx2, by2;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &ev->transform.boundingbox,
 				  &output->base.region);
-	pixman_region32_translate(&dest_rect, -output->base.x, -output->base.y);
-	box = pixman_region32_extents(&dest_rect);
+	box = *pixman_region32_extents(&visible);
+	pixman_region32_fini(&visible);
+
+	tbox = box;
+	tbox.x1 -= output->base.x;
+	tbox.y1 -= output->base.y;
+	tbox.x2 -= output->base.x;
+	tbox.y2 -= output->base.y;
 	tbox = weston_transformed_rect(output->base.width,
 				       output->base.height,
 				       output->base.transform,
 				       output->base.current_scale,
-				       *box);
+				       tbox);
 	s->dest_x = tbox.x1;
 	s->dest_y = tbox.y1;
 	s->dest_w = tbox.x2 - tbox.x1;
 	s->dest_h = tbox.y2 - tbox.y1;
-	pixman_region32_fini(&dest_rect);
-
-	pixman_region32_init(&src_rect);
-	pixman_region32_intersect(&src_rect, &ev->transform.boundingbox,
-				  &output->base.region);
-	box = pixman_region32_extents(&src_rect);
 
-	weston_view_from_global_fixed(ev,
-				      wl_fixed_from_int(box->x1),
-				      wl_fixed_from_int(box->y1),
-				      &sx1, &sy1);
-	weston_view_from_global_fixed(ev,
-				      wl_fixed_from_int(box->x2),
-				      wl_fixed_from_int(box->y2),
-				      &sx2, &sy2);
+	drm_view_from_global(ev, box.x1, box.y1, &sx1, &sy1);
+	drm_view_from_global(ev, box.x2, box.y2, &sx2, &sy2);
 
 	if (sx1 < 0)
 		sx1 = 0;
 	if (sy1 < 0)
 		sy1 = 0;
-	if (sx2 > wl_fixed_from_int(ev->surface->width))
-		sx2 = wl_fixed_from_int(ev->surface->width);
-	if (sy2 > wl_fixed_from_int(ev->surface->height))
-		sy2 = wl_fixed_from_int(ev->surface->height);
-
-	tbox.x1 = sx1;
-	tbox.y1 = sy1;
-	tbox.x2 = sx2;
-	tbox.y2 = sy2;
-
-	tbox = weston_transformed_rect(wl_fixed_from_int(ev->surface->width),
-				       wl_fixed_from_int(ev->surface->height),
-				       viewport->buffer.transform,
-				       viewport->buffer.scale,
-				       tbox);
-
-	s->src_x = tbox.x1 << 8;
-	s->src_y = tbox.y1 << 8;
-	s->src_w = (tbox.x2 - tbox.x1) << 8;
-	s->src_h = (tbox.y2 - tbox.y1) << 8;
-	pixman_region32_fini(&src_rect);
-
-	return &s->plane;
+	if (sx2 > es->width)
+		sx2 = es->width;
+	if (sy2 > es->height)
+		sy2 = es->height;
+
+	weston_surface_to_buffer_double(es, sx1, sy1, &bx1, &by1);
+	weston_surface_to_buffer_double(es, sx2, sy2, &bx2, &by2);
+
+	s->src_x = drm_fixed_16_16(MIN(bx1, bx2));
+	s->src_y = drm_fixed_16_16(MIN(by1, by2));
+	s->src_w = drm_fixed_16_16(MAX(bx1, bx2)) - s->src_x;
+	s->src_h = drm_fixed_16_16(MAX(by1, by2)) - s->src_y;
 }
 
-static struct weston_plane *
-drm_output_prepare_cursor_view(struct drm_output *output,
-			       struct weston_view *ev)
+/* Whether the view shows its buffer, or a wp_viewport crop of it,
+ * stretched over exactly the output, which the primary plane can do by
+ * scaling on atomic drivers, since it always scans out onto the whole
+ * mode. */
+static bool
+drm_view_is_scaled_fullscreen(struct drm_output *output,
+			      struct weston_view *ev)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct wl_shm_buffer *shmbuf;
+	pixman_box32_t *view_box, *output_box;
 
-	if (b->cursors_are_broken)
-		return NULL;
+	if (!b->atomic_modeset)
+		return false;
 
-	if (output->cursor_view)
-		return NULL;
+	if (ev->transform.matrix.type >= WESTON_MATRIX_TRANSFORM_ROTATE)
+		return false;
 
-	/* Don't import buffers which span multiple outputs. */
-	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
+	view_box = pixman_region32_extents(&ev->transform.boundingbox);
+	output_box = pixman_region32_extents(&output->base.region);
 
-	/* We use GBM to import SHM buffers. */
-	if (b->gbm == NULL)
-		return NULL;
+	return view_box->x1 == output_box->x1 &&
+	       view_box->y1 == output_box->y1 &&
+	       view_box->x2 == output_box->x2 &&
+	       view_box->y2 == output_box->y2;
+}
 
-	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-	shmbuf = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
-	if (!shmbuf)
-		return NULL;
-	if (wl_shm_buffer_get_format(shmbuf) != WL_SHM_FORMAT_ARGB8888)
-		return NULL;
+/**
+ * Have the primary plane scan out the part of the buffer the view shows
+ *
+ * The source rectangle stays on the primary plane for as long as the
+ * client buffer is scanned out, see drm_output_add_atomic(). For a scaled
+ * view, the kernel has the last word on whether the primary plane
+ * scales; the previous source rectangle is kept if it does not.
+ *
+ * @param output The output to scan the view out on, with the view's
+ * framebuffer in next
+ * @param ev The view being scanned out
+ * @param scaled Whether the primary plane has to scale the view
+ * @returns 0 on success, -1 if the primary plane can't show the view
+ */
+static int
+drm_output_set_scanout_rects(struct drm_output *output,
+			     struct weston_view *ev, bool scaled)
+{
+	struct drm_sprite *primary = output->primary_plane;
+	int32_t src_x, src_y;
+	uint32_t src_w, src_h;
 
-	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
-		return NULL;
-	if (ev->transform.enabled &&
-	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
-		return NULL;
-	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
-	if (ev->geometry.scissor_enabled)
-		return NULL;
+	/* Only scaled views need the source rectangle, and those are
+	 * only scanned out with atomic modesetting */
+	if (!primary)
+		return scaled ? -1 : 0;
 
-	if (ev->surface->width > b->cursor_width ||
-	    ev->surface->height > b->cursor_height)
-		return NULL;
+	src_x = primary->src_x;
+	src_y = primary->src_y;
+	src_w = primary->src_w;
+	src_h = primary->src_h;
 
-	output->cursor_view = ev;
+	drm_sprite_set_view_rects(primary, output, ev);
 
-	return &output->cursor_plane;
+#ifdef HAVE_DRM_ATOMIC
+	if (!scaled || drm_output_test_atomic(output, output->next) == 0)
+		return 0;
+#else
+	if (!scaled)
+		return 0;
+#endif
+
+	primary->src_x = src_x;
+	primary->src_y = src_y;
+	primary->src_w = src_w;
+	primary->src_h = src_h;
+
+	return -1;
 }
 
-/**
- * Update the image for the current cursor surface
- *
- * @param b DRM backend structure
- * @param bo GBM buffer object to write into
- * @param ev View to use for cursor image
- */
-static void
-cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
-		 struct weston_view *ev)
+/* Reasons can alternate from frame to frame, so this goes to the
+ * drm-planes debug scope rather than the log. */
+static struct weston_plane *
+drm_output_reject_scanout(struct drm_output *output, struct weston_view *ev,
+			  const char *reason)
 {
-	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
-	uint32_t buf[b->cursor_width * b->cursor_height];
-	int32_t stride;
-	uint8_t *s;
-	int i;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	char label[64] = "unlabeled surface";
 
-	assert(buffer && buffer->shm_buffer);
-	assert(buffer->shm_buffer == wl_shm_buffer_get(buffer->resource));
-	assert(ev->surface->width <= b->cursor_width);
-	assert(ev->surface->height <= b->cursor_height);
+	if (output->scanout_reject_reason == reason)
+		return NULL;
+	output->scanout_reject_reason = reason;
 
-	memset(buf, 0, sizeof buf);
-	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
-	s = wl_shm_buffer_get_data(buffer->shm_buffer);
+	if (!weston_log_scope_is_enabled(b->planes_scope,
+					 WESTON_LOG_LEVEL_DEBUG))
+		return NULL;
 
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < ev->surface->height; i++)
-		memcpy(buf + i * b->cursor_width,
-		       s + i * stride,
-		       ev->surface->width * 4);
-	wl_shm_buffer_end_access(buffer->shm_buffer);
+	if (ev->surface->get_label)
+		ev->surface->get_label(ev->surface, label, sizeof label);
+	weston_log_scope_printf(b->planes_scope, WESTON_LOG_LEVEL_DEBUG,
+				"%s: can't scan out fullscreen %s: %s\n",
+				output->base.name, label, reason);
 
-	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-		weston_log("failed update cursor: %m\n");
+	return NULL;
 }
 
-static void
-drm_output_set_cursor(struct drm_output *output)
+static struct weston_plane *
+drm_output_prepare_scanout_view(struct drm_output *output,
+				struct weston_view *ev)
 {
-	struct weston_view *ev = output->cursor_view;
-	struct weston_buffer *buffer;
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	EGLint handle;
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct linux_dmabuf_buffer *dmabuf;
 	struct gbm_bo *bo;
-	float x, y;
+	uint32_t format;
+	bool scaled = false;
 
-	output->cursor_view = NULL;
-	if (ev == NULL) {
-		drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
-		output->cursor_plane.x = INT32_MIN;
-		output->cursor_plane.y = INT32_MIN;
-		return;
-	}
+	/* A solid view above took the primary plane */
+	if (buffer == NULL || output->next)
+		return NULL;
 
-	buffer = ev->surface->buffer_ref.buffer;
+	/* Only views covering the whole output are worth a log line */
+	if (pixman_region32_contains_rectangle(&ev->transform.boundingbox,
+			pixman_region32_extents(&output->base.region)) !=
+	    PIXMAN_REGION_IN)
+		return NULL;
 
-	if (buffer &&
-	    pixman_region32_not_empty(&output->cursor_plane.damage)) {
-		pixman_region32_fini(&output->cursor_plane.damage);
-		pixman_region32_init(&output->cursor_plane.damage);
-		output->current_cursor ^= 1;
-		bo = output->gbm_cursor_bo[output->current_cursor];
-
-		cursor_bo_update(b, bo, ev);
-		handle = gbm_bo_get_handle(bo).s32;
-		if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
-				b->cursor_width, b->cursor_height)) {
-			weston_log("failed to set cursor: %m\n");
-			b->cursors_are_broken = 1;
-		}
-	}
+	/* Make sure our view is exactly compatible with the output, or
+	 * stretched over it in a way the primary plane can scale. */
+	if (ev->transform.enabled || ev->geometry.x != output->base.x ||
+	    ev->geometry.y != output->base.y ||
+	    buffer->width != output->base.current_mode->width ||
+	    buffer->height != output->base.current_mode->height)
+		scaled = drm_view_is_scaled_fullscreen(output, ev);
 
-	weston_view_to_global_float(ev, 0, 0, &x, &y);
+	if (!scaled && (ev->geometry.x != output->base.x ||
+			ev->geometry.y != output->base.y))
+		return drm_output_reject_scanout(output, ev,
+						 "view is not at the output origin");
 
-	/* From global to output space, output transform is guaranteed to be
-	 * NORMAL by drm_output_prepare_cursor_view().
-	 */
-	x = (x - output->base.x) * output->base.current_scale;
-	y = (y - output->base.y) * output->base.current_scale;
+	/* We use GBM to import buffers. */
+	if (b->gbm == NULL)
+		return drm_output_reject_scanout(output, ev,
+						 "no GBM device (pixman renderer)");
 
-	if (output->cursor_plane.x != x || output->cursor_plane.y != y) {
-		if (drmModeMoveCursor(b->drm.fd, output->crtc_id, x, y)) {
-			weston_log("failed to move cursor: %m\n");
-			b->cursors_are_broken = 1;
+	if (!scaled && ev->transform.enabled)
+		return drm_output_reject_scanout(output, ev,
+						 "view is transformed");
+	if (ev->geometry.scissor_enabled)
+		return drm_output_reject_scanout(output, ev,
+						 "view is clipped");
+	if (ev->dim > 0.0f)
+		return drm_output_reject_scanout(output, ev,
+						 "view is dimmed");
+
+	if (!scaled &&
+	    (buffer->width != output->base.current_mode->width ||
+	     buffer->height != output->base.current_mode->height))
+		return drm_output_reject_scanout(output, ev,
+						 "buffer size differs from the mode");
+	if (viewport->buffer.transform != output->base.transform)
+		return drm_output_reject_scanout(output, ev,
+						 "buffer transform differs from the output");
+
+	if (wl_shm_buffer_get(buffer->resource))
+		return drm_output_reject_scanout(output, ev,
+						 "wl_shm buffer");
+
+	if (!drm_sprite_fence_supported(output->primary_plane, ev->surface))
+		return drm_output_reject_scanout(output, ev,
+						 "acquire fence not supported by the plane");
+
+	if ((dmabuf = linux_dmabuf_buffer_get(buffer->resource))) {
+		format = drm_output_check_scanout_format(output, ev->surface,
+							 dmabuf->attributes.format);
+		if (format == 0)
+			return drm_output_reject_scanout(output, ev,
+							 "buffer format differs from the output");
+
+		output->next = drm_fb_get_from_dmabuf(dmabuf, b, format);
+		if (!output->next)
+			return drm_output_reject_scanout(output, ev,
+							 "dmabuf import failed");
+
+		/* Marks the fb as a client buffer, which keeps the source
+		 * rectangle in the test commit */
+		drm_fb_set_buffer(output->next, buffer,
+				  ev->surface->buffer_release_ref.buffer_release);
+
+		if (drm_output_set_scanout_rects(output, ev, scaled) < 0) {
+			drm_output_release_fb(output, output->next);
+			output->next = NULL;
+			return drm_output_reject_scanout(output, ev,
+							 "primary plane can't scale");
 		}
+		if (output->primary_plane)
+			drm_sprite_set_in_fence(output->primary_plane,
+						ev->surface->acquire_fence_fd);
+		output->next_async = ev->surface->allow_tearing;
+		output->scanout_reject_reason = NULL;
 
-		output->cursor_plane.x = x;
-		output->cursor_plane.y = y;
+		return &output->fb_plane;
 	}
-}
-
-static void
-drm_assign_planes(struct weston_output *output_base)
-{
-	struct drm_backend *b = to_drm_backend(output_base->compositor);
-	struct drm_output *output = to_drm_output(output_base);
-	struct weston_view *ev, *next;
-	pixman_region32_t overlap, surface_overlap;
-	struct weston_plane *primary, *next_plane;
 
-	/*
-	 * Find a surface for each sprite in the output using some heuristics:
-	 * 1) size
-	 * 2) frequency of update
-	 * 3) opacity (though some hw might support alpha blending)
-	 * 4) clipping (this can be fixed with color keys)
-	 *
-	 * The idea is to save on blitting since this should save power.
-	 * If we can get a large video surface on the sprite for example,
-	 * the main display surface may not need to update at all, and
-	 * the client buffer can be used directly for the sprite surface
-	 * as we do for flipping full screen surfaces.
-	 */
-	pixman_region32_init(&overlap);
-	primary = &output_base->compositor->primary_plane;
+	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
+			   buffer->resource, GBM_BO_USE_SCANOUT);
 
-	wl_list_for_each_safe(ev, next, &output_base->compositor->view_list, link) {
-		struct weston_surface *es = ev->surface;
+	/* Unable to use the buffer for scanout */
+	if (!bo)
+		return drm_output_reject_scanout(output, ev,
+						 "buffer can't be imported for scanout");
 
-		/* Test whether this buffer can ever go into a plane:
-		 * non-shm, or small enough to be a cursor.
-		 *
-		 * Also, keep a reference when using the pixman renderer.
-		 * That makes it possible to do a seamless switch to the GL
-		 * renderer and since the pixman renderer keeps a reference
-		 * to the buffer anyway, there is no side effects.
-		 */
-		if (b->use_pixman ||
-		    (es->buffer_ref.buffer &&
-		    (!wl_shm_buffer_get(es->buffer_ref.buffer->resource) ||
-		     (ev->surface->width <= b->cursor_width &&
-		      ev->surface->height <= b->cursor_height))))
-			es->keep_buffer = true;
-		else
-			es->keep_buffer = false;
+	format = drm_output_check_scanout_format(output, ev->surface,
+						 gbm_bo_get_format(bo));
+	if (format == 0) {
+		gbm_bo_destroy(bo);
+		return drm_output_reject_scanout(output, ev,
+						 "buffer format differs from the output");
+	}
 
-		pixman_region32_init(&surface_overlap);
-		pixman_region32_intersect(&surface_overlap, &overlap,
-					  &ev->transform.boundingbox);
+	output->next = drm_fb_get_from_bo(bo, b, format);
+	if (!output->next) {
+		gbm_bo_destroy(bo);
+		return drm_output_reject_scanout(output, ev,
+						 "framebuffer creation failed");
+	}
 
-		next_plane = NULL;
-		if (pixman_region32_not_empty(&surface_overlap))
-			next_plane = primary;
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_cursor_view(output, ev);
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_scanout_view(output, ev);
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_overlay_view(output, ev);
-		if (next_plane == NULL)
-			next_plane = primary;
+	/* Marks the fb as a client buffer, which keeps the source
+	 * rectangle in the test commit */
+	drm_fb_set_buffer(output->next, buffer,
+			  ev->surface->buffer_release_ref.buffer_release);
 
-		weston_view_move_to_plane(ev, next_plane);
+	if (drm_output_set_scanout_rects(output, ev, scaled) < 0) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+		return drm_output_reject_scanout(output, ev,
+						 "primary plane can't scale");
+	}
+	if (output->primary_plane)
+		drm_sprite_set_in_fence(output->primary_plane,
+					ev->surface->acquire_fence_fd);
+	output->next_async = ev->surface->allow_tearing;
+	output->scanout_reject_reason = NULL;
 
-		if (next_plane == primary)
-			pixman_region32_union(&overlap, &overlap,
-					      &ev->transform.boundingbox);
+	return &output->fb_plane;
+}
 
-		if (next_plane == primary ||
-		    next_plane == &output->cursor_plane) {
-			/* cursor plane involves a copy */
-			ev->psf_flags = 0;
-		} else {
-			/* All other planes are a direct scanout of a
-			 * single client buffer.
-			 */
-			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
-		}
+static uint32_t
+drm_color_to_xrgb8888(const float color[4])
+{
+	uint32_t pixel = 0xff000000;
+	float c;
+	int i;
 
-		pixman_region32_fini(&surface_overlap);
+	for (i = 0; i < 3; i++) {
+		c = color[i] < 0.0f ? 0.0f : color[i] > 1.0f ? 1.0f : color[i];
+		pixel |= (uint32_t) (c * 255.0f + 0.5f) << (16 - 8 * i);
 	}
-	pixman_region32_fini(&overlap);
+
+	return pixel;
 }
 
 /**
- * Find the closest-matching mode for a given target
- *
- * Given a target mode, find the most suitable mode amongst the output's
- * current mode list to use, preferring the current mode if possible, to
- * avoid an expensive mode switch.
+ * Scan out an opaque solid color view covering the whole output
  *
- * @param output DRM output
- * @param target_mode Mode to attempt to match
- * @returns Pointer to a mode from the output's mode list
+ * Solid views have no buffer, but one covering the output hides
+ * everything below it, so there is nothing to composite. The primary
+ * plane shows a dumb buffer filled with the color instead, which is
+ * only repainted when the color or the mode changes.
  */
-static struct drm_mode *
-choose_mode (struct drm_output *output, struct weston_mode *target_mode)
+static struct weston_plane *
+drm_output_prepare_solid_view(struct drm_output *output,
+			      struct weston_view *ev)
 {
-	struct drm_mode *tmp_mode = NULL, *mode;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_surface *es = ev->surface;
+	struct weston_mode *mode = output->base.current_mode;
+	uint32_t pixel;
 
-	if (output->base.current_mode->width == target_mode->width &&
-	    output->base.current_mode->height == target_mode->height &&
-	    (output->base.current_mode->refresh == target_mode->refresh ||
-	     target_mode->refresh == 0))
-		return (struct drm_mode *)output->base.current_mode;
+	if (!es->is_solid || es->solid_color[3] < 1.0f || ev->alpha < 1.0f ||
+	    ev->dim > 0.0f)
+		return NULL;
+	if (output->next || ev->transform.enabled ||
+	    ev->geometry.scissor_enabled)
+		return NULL;
+	if (pixman_region32_contains_rectangle(&ev->transform.boundingbox,
+			pixman_region32_extents(&output->base.region)) !=
+	    PIXMAN_REGION_IN)
+		return NULL;
 
-	wl_list_for_each(mode, &output->base.mode_list, base.link) {
-		if (mode->mode_info.hdisplay == target_mode->width &&
-		    mode->mode_info.vdisplay == target_mode->height) {
-			if (mode->base.refresh == target_mode->refresh ||
-			    target_mode->refresh == 0) {
-				return mode;
-			} else if (!tmp_mode)
-				tmp_mode = mode;
-		}
+	if (output->solid_fb &&
+	    (output->solid_fb->width != mode->width ||
+	     output->solid_fb->height != mode->height)) {
+		if (output->solid_fb == output->current)
+			return NULL;
+		drm_fb_destroy_dumb(output->solid_fb);
+		output->solid_fb = NULL;
 	}
 
-	return tmp_mode;
+	pixel = drm_color_to_xrgb8888(es->solid_color);
+	if (!output->solid_fb) {
+		output->solid_fb = drm_fb_create_dumb(b, drm_output_fd(output),
+						      mode->width, mode->height,
+						      GBM_FORMAT_XRGB8888);
+		if (!output->solid_fb)
+			return NULL;
+		output->solid_pixel = ~pixel;
+	}
+
+	/* Changing the pitch would need a modeset */
+	if (output->current && output->current != output->solid_fb &&
+	    output->current->stride != output->solid_fb->stride)
+		return NULL;
+
+	if (output->solid_pixel != pixel) {
+		/* Not while the display reads it */
+		if (output->solid_fb == output->current)
+			return NULL;
+		pixman_fill(output->solid_fb->map,
+			    output->solid_fb->stride / 4, 32, 0, 0,
+			    mode->width, mode->height, pixel);
+		output->solid_pixel = pixel;
+	}
+
+	output->next = output->solid_fb;
+	output->next_async = 0;
+
+	return &output->fb_plane;
 }
 
-static int
-drm_output_init_egl(struct drm_output *output, struct drm_backend *b);
-static void
-drm_output_fini_egl(struct drm_output *output);
-static int
-drm_output_init_pixman(struct drm_output *output, struct drm_backend *b);
+/* Take the frame the renderer finished as the next framebuffer */
 static void
-drm_output_fini_pixman(struct drm_output *output);
-
-static int
-drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mode)
+drm_output_lock_gl_fb(struct drm_output *output)
 {
-	struct drm_output *output;
-	struct drm_mode *drm_mode;
-	struct drm_backend *b;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct gbm_bo *bo;
 
-	if (output_base == NULL) {
-		weston_log("output is NULL.\n");
-		return -1;
-	}
+	gl_renderer->output_finish_frame(&output->base);
 
-	if (mode == NULL) {
-		weston_log("mode is NULL.\n");
-		return -1;
+	bo = gbm_surface_lock_front_buffer(output->gbm_surface);
+	if (!bo) {
+		weston_log("failed to lock front buffer: %m\n");
+		return;
 	}
 
-	b = to_drm_backend(output_base->compositor);
-	output = to_drm_output(output_base);
-	drm_mode  = choose_mode (output, mode);
+#ifdef HAVE_GBM_BO_MAP
+	if (output->secondary) {
+		output->next = drm_output_secondary_fb(output, bo);
+		if (!output->next)
+			weston_log("failed to get drm_fb for %s\n",
+				   output->base.name);
+		return;
+	}
+#endif
 
-	if (!drm_mode) {
-		weston_log("%s, invalid resolution:%dx%d\n", __func__, mode->width, mode->height);
-		return -1;
+	output->next = drm_fb_get_from_bo(bo, b, output->gbm_format);
+	if (!output->next) {
+		weston_log("failed to get drm_fb for bo\n");
+		gbm_surface_release_buffer(output->gbm_surface, bo);
+		return;
 	}
+}
 
-	if (&drm_mode->base == output->base.current_mode)
-		return 0;
+static void
+drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
+{
+	output->base.compositor->renderer->repaint_output(&output->base,
+							  damage);
+	drm_output_lock_gl_fb(output);
+}
 
-	output->base.current_mode->flags = 0;
+/* Paint the next dumb buffer the display is not showing. It only needs
+ * what changed since it was last painted, however many frames ago. */
+static void
+drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	int i, next;
 
-	output->base.current_mode = &drm_mode->base;
-	output->base.current_mode->flags =
-		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
+	next = output->current_image;
+	for (i = 0; i < output->dumb_count; i++) {
+		next = (next + 1) % output->dumb_count;
+		if (output->dumb[next] != output->current)
+			break;
+	}
 
-	/* reset rendering stuff. */
-	drm_output_release_fb(output, output->current);
-	drm_output_release_fb(output, output->next);
-	output->current = output->next = NULL;
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_union(&output->dumb_damage[i],
+				      &output->dumb_damage[i], damage);
 
-	if (b->use_pixman) {
-		drm_output_fini_pixman(output);
-		if (drm_output_init_pixman(output, b) < 0) {
-			weston_log("failed to init output pixman state with "
-				   "new mode\n");
-			return -1;
-		}
-	} else {
-		drm_output_fini_egl(output);
-		if (drm_output_init_egl(output, b) < 0) {
-			weston_log("failed to init output egl state with "
-				   "new mode");
-			return -1;
-		}
-	}
+	output->current_image = next;
+	output->next = output->dumb[next];
+	pixman_renderer_output_set_buffer(&output->base, output->image[next]);
 
-	return 0;
+	ec->renderer->repaint_output(&output->base,
+				     &output->dumb_damage[next]);
+
+	pixman_region32_clear(&output->dumb_damage[next]);
 }
 
-static int
-on_drm_input(int fd, uint32_t mask, void *data)
+static void
+drm_output_render(struct drm_output *output, pixman_region32_t *damage)
 {
-	drmEventContext evctx;
+	struct weston_compositor *c = output->base.compositor;
+	struct drm_backend *b = to_drm_backend(c);
 
-	memset(&evctx, 0, sizeof evctx);
-	evctx.version = DRM_EVENT_CONTEXT_VERSION;
-	evctx.page_flip_handler = page_flip_handler;
-	evctx.vblank_handler = vblank_handler;
-	drmHandleEvent(fd, &evctx);
+	if (b->use_pixman)
+		drm_output_render_pixman(output, damage);
+	else
+		drm_output_render_gl(output, damage);
 
-	return 1;
+	pixman_region32_subtract(&c->primary_plane.damage,
+				 &c->primary_plane.damage, damage);
 }
 
-static int
-init_drm(struct drm_backend *b, struct udev_device *device)
+static void
+drm_output_set_gamma(struct weston_output *output_base,
+		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b)
 {
-	const char *filename, *sysnum;
-	uint64_t cap;
-	int fd, ret;
-	clockid_t clk_id;
-
-	sysnum = udev_device_get_sysnum(device);
-	if (sysnum)
-		b->drm.id = atoi(sysnum);
-	if (!sysnum || b->drm.id < 0) {
-		weston_log("cannot get device sysnum\n");
-		return -1;
-	}
-
-	filename = udev_device_get_devnode(device);
-	fd = weston_launcher_open(b->compositor->launcher, filename, O_RDWR);
-	if (fd < 0) {
-		/* Probably permissions error */
-		weston_log("couldn't open %s, skipping\n",
-			udev_device_get_devnode(device));
-		return -1;
-	}
+	int rc;
+	struct drm_output *output = to_drm_output(output_base);
 
-	weston_log("using %s\n", filename);
+	/* check */
+	if (output_base->gamma_size != size)
+		return;
+	if (!output->original_crtc)
+		return;
 
-	b->drm.fd = fd;
-	b->drm.filename = strdup(filename);
+	rc = drmModeCrtcSetGamma(drm_output_fd(output),
+				 output->crtc_id,
+				 size, r, g, b);
+	if (rc)
+		weston_log("set gamma failed: %m\n");
+}
 
-	ret = drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap);
-	if (ret == 0 && cap == 1)
-		clk_id = CLOCK_MONOTONIC;
-	else
-		clk_id = CLOCK_REALTIME;
+static int
+drm_output_set_color_blob(struct drm_output *output,
+			  enum wdrm_crtc_color_property prop,
+			  const void *data, size_t size)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	uint32_t blob_id = 0;
+	int ret;
 
-	if (weston_compositor_set_presentation_clock(b->compositor, clk_id) < 0) {
-		weston_log("Error: failed to set presentation clock %d.\n",
-			   clk_id);
+	if (data && drmModeCreatePropertyBlob(b->drm.fd, data, size,
+					      &blob_id) != 0)
 		return -1;
-	}
 
-	ret = drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &cap);
-	if (ret == 0)
-		b->cursor_width = cap;
-	else
-		b->cursor_width = 64;
+	ret = drmModeObjectSetProperty(b->drm.fd, output->crtc_id,
+				       DRM_MODE_OBJECT_CRTC,
+				       output->props_color[prop], blob_id);
 
-	ret = drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &cap);
-	if (ret == 0)
-		b->cursor_height = cap;
-	else
-		b->cursor_height = 64;
+	/* The CRTC keeps its own reference */
+	if (blob_id)
+		drmModeDestroyPropertyBlob(b->drm.fd, blob_id);
 
-	return 0;
+	return ret;
 }
 
-static struct gbm_device *
-create_gbm_device(int fd)
+static struct wdrm_color_lut *
+drm_color_lut_create(uint16_t * const *curves, uint32_t size)
 {
-	struct gbm_device *gbm;
+	struct wdrm_color_lut *lut;
+	uint32_t i;
 
-	gl_renderer = weston_load_module("gl-renderer.so",
-					 "gl_renderer_interface");
-	if (!gl_renderer)
+	lut = calloc(size, sizeof *lut);
+	if (!lut)
 		return NULL;
 
-	/* GBM will load a dri driver, but even though they need symbols from
-	 * libglapi, in some version of Mesa they are not linked to it. Since
-	 * only the gl-renderer module links to it, the call above won't make
-	 * these symbols globally available, and loading the DRI driver fails.
-	 * Workaround this by dlopen()'ing libglapi with RTLD_GLOBAL. */
-	dlopen("libglapi.so.0", RTLD_LAZY | RTLD_GLOBAL);
-
-	gbm = gbm_create_device(fd);
+	for (i = 0; i < size; i++) {
+		lut[i].red = curves[0][i];
+		lut[i].green = curves[1][i];
+		lut[i].blue = curves[2][i];
+	}
 
-	return gbm;
+	return lut;
 }
 
-/* When initializing EGL, if the preferred buffer format isn't available
- * we may be able to substitute an ARGB format for an XRGB one.
- *
- * This returns 0 if substitution isn't possible, but 0 might be a
- * legitimate format for other EGL platforms, so the caller is
- * responsible for checking for 0 before calling gl_renderer->create().
+/**
+ * Program the CRTC's degamma LUT, color matrix and gamma LUT
  *
- * This works around https://bugs.freedesktop.org/show_bug.cgi?id=89689
- * but it's entirely possible we'll see this again on other implementations.
+ * The three stages run in the display engine on scanout, so color
+ * correction takes no GPU time at all. Every stage the pipeline uses is
+ * checked to exist before any of them is changed.
  */
 static int
-fallback_format_for(uint32_t format)
-{
-	switch (format) {
-	case GBM_FORMAT_XRGB8888:
-		return GBM_FORMAT_ARGB8888;
-	case GBM_FORMAT_XRGB2101010:
-		return GBM_FORMAT_ARGB2101010;
-	default:
-		return 0;
-	}
-}
-
-static int
-drm_backend_create_gl_renderer(struct drm_backend *b)
+drm_output_set_color_pipeline(struct weston_output *output_base,
+			      const struct weston_color_pipeline *pipeline)
 {
-	EGLint format[3] = {
-		b->gbm_format,
-		fallback_format_for(b->gbm_format),
-		0,
-	};
-	int n_formats = 2;
+	struct drm_output *output = to_drm_output(output_base);
+	uint32_t *props = output->props_color;
+	struct wdrm_color_lut *degamma = NULL, *gamma = NULL;
+	struct wdrm_color_ctm ctm;
+	double v;
+	int ret = 0;
+	int i;
 
-	if (format[1])
-		n_formats = 3;
-	if (gl_renderer->display_create(b->compositor,
-					EGL_PLATFORM_GBM_KHR,
-					(void *)b->gbm,
-					NULL,
-					gl_renderer->opaque_attribs,
-					format,
-					n_formats) < 0) {
+	if (pipeline &&
+	    ((pipeline->degamma[0] && !props[WDRM_CRTC_DEGAMMA_LUT]) ||
+	     (pipeline->ctm && !props[WDRM_CRTC_CTM]) ||
+	     (pipeline->gamma[0] && !props[WDRM_CRTC_GAMMA_LUT])))
 		return -1;
+
+	if (pipeline && pipeline->degamma[0]) {
+		degamma = drm_color_lut_create(pipeline->degamma,
+					       output->base.degamma_lut_size);
+		if (!degamma)
+			return -1;
 	}
 
-	return 0;
-}
+	if (pipeline && pipeline->gamma[0]) {
+		gamma = drm_color_lut_create(pipeline->gamma,
+					     output->base.gamma_lut_size);
+		if (!gamma) {
+			free(degamma);
+			return -1;
+		}
+	}
 
-static int
-init_egl(struct drm_backend *b)
-{
-	b->gbm = create_gbm_device(b->drm.fd);
+	if (pipeline && pipeline->ctm) {
+		for (i = 0; i < 9; i++) {
+			v = pipeline->ctm[i];
+			ctm.matrix[i] = (uint64_t) ((v < 0 ? -v : v) *
+						    (double) (1ULL << 32));
+			if (v < 0)
+				ctm.matrix[i] |= 1ULL << 63;
+		}
+	}
 
-	if (!b->gbm)
-		return -1;
+	if (props[WDRM_CRTC_DEGAMMA_LUT])
+		ret |= drm_output_set_color_blob(output, WDRM_CRTC_DEGAMMA_LUT,
+				degamma, output->base.degamma_lut_size *
+					 sizeof *degamma);
+	if (props[WDRM_CRTC_CTM])
+		ret |= drm_output_set_color_blob(output, WDRM_CRTC_CTM,
+				pipeline && pipeline->ctm ? &ctm : NULL,
+				sizeof ctm);
+	if (props[WDRM_CRTC_GAMMA_LUT])
+		ret |= drm_output_set_color_blob(output, WDRM_CRTC_GAMMA_LUT,
+				gamma, output->base.gamma_lut_size *
+				       sizeof *gamma);
+
+	free(degamma);
+	free(gamma);
 
-	if (drm_backend_create_gl_renderer(b) < 0) {
-		gbm_device_destroy(b->gbm);
+	if (ret) {
+		weston_log("setting the color pipeline failed: %m\n");
 		return -1;
 	}
 
 	return 0;
 }
 
-static int
-init_pixman(struct drm_backend *b)
+/**
+ * Look up whether an output can do variable refresh
+ *
+ * The connector has to report "vrr_capable" and its CRTC to have
+ * "VRR_ENABLED". The core then decides for every repaint whether to use
+ * it, see weston_output::vrr_active.
+ */
+static void
+drm_output_init_vrr(struct drm_output *output, struct drm_backend *b)
 {
-	return pixman_renderer_init(b->compositor);
+	static const char * const conn_names[] = { "vrr_capable" };
+	static const char * const crtc_names[] = { "VRR_ENABLED" };
+	uint32_t capable_prop;
+	uint64_t capable = 0;
+
+	if (drm_object_get_props(b, output->connector_id,
+				 DRM_MODE_OBJECT_CONNECTOR, conn_names,
+				 &capable_prop, &capable, 1) < 0 || !capable)
+		return;
+
+	if (drm_object_get_props(b, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+				 crtc_names, &output->vrr_enabled_prop,
+				 NULL, 1) < 0) {
+		output->vrr_enabled_prop = 0;
+		return;
+	}
+
+	output->base.vrr_capable = true;
 }
 
 /**
- * Add a mode to output's mode list
- *
- * Copy the supplied DRM mode into a Weston mode structure, and add it to the
- * output's mode list.
+ * Look up the color management properties of an output's CRTC
  *
- * @param output DRM output to add mode to
- * @param info DRM mode structure to add
- * @returns Newly-allocated Weston/DRM mode structure
+ * The output only gets a set_color_pipeline hook if the CRTC has at least
+ * a color matrix or a gamma LUT.
  */
-static struct drm_mode *
-drm_output_add_mode(struct drm_output *output, const drmModeModeInfo *info)
+static void
+drm_output_init_color(struct drm_output *output, struct drm_backend *b)
 {
-	struct drm_mode *mode;
-	uint64_t refresh;
+	uint64_t values[WDRM_CRTC_COLOR__COUNT] = { 0 };
 
-	mode = malloc(sizeof *mode);
-	if (mode == NULL)
-		return NULL;
+	drm_object_get_props(b, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+			     crtc_color_prop_names, output->props_color,
+			     values, WDRM_CRTC_COLOR__COUNT);
 
-	mode->base.flags = 0;
-	mode->base.width = info->hdisplay;
-	mode->base.height = info->vdisplay;
+	if (output->props_color[WDRM_CRTC_DEGAMMA_LUT_SIZE] &&
+	    values[WDRM_CRTC_DEGAMMA_LUT_SIZE] > 1)
+		output->base.degamma_lut_size =
+			values[WDRM_CRTC_DEGAMMA_LUT_SIZE];
+	else
+		output->props_color[WDRM_CRTC_DEGAMMA_LUT] = 0;
 
-	/* Calculate higher precision (mHz) refresh rate */
-	refresh = (info->clock * 1000000LL / info->htotal +
-		   info->vtotal / 2) / info->vtotal;
+	if (output->props_color[WDRM_CRTC_GAMMA_LUT_SIZE] &&
+	    values[WDRM_CRTC_GAMMA_LUT_SIZE] > 1)
+		output->base.gamma_lut_size = values[WDRM_CRTC_GAMMA_LUT_SIZE];
+	else
+		output->props_color[WDRM_CRTC_GAMMA_LUT] = 0;
 
-	if (info->flags & DRM_MODE_FLAG_INTERLACE)
-		refresh *= 2;
-	if (info->flags & DRM_MODE_FLAG_DBLSCAN)
-		refresh /= 2;
-	if (info->vscan > 1)
-	    refresh /= info->vscan;
+	if (output->props_color[WDRM_CRTC_CTM] ||
+	    output->props_color[WDRM_CRTC_GAMMA_LUT])
+		output->base.set_color_pipeline = drm_output_set_color_pipeline;
+}
 
-	mode->base.refresh = refresh;
-	mode->mode_info = *info;
+/* Determine the type of vblank synchronization to use for the output.
+ *
+ * The pipe parameter indicates which CRTC is in use.  Knowing this, we
+ * can determine which vblank sequence type to use for it.  Traditional
+ * cards had only two CRTCs, with CRTC 0 using no special flags, and
+ * CRTC 1 using DRM_VBLANK_SECONDARY.  The first bit of the pipe
+ * parameter indicates this.
+ *
+ * Bits 1-5 of the pipe parameter are 5 bit wide pipe number between
+ * 0-31.  If this is non-zero it indicates we're dealing with a
+ * multi-gpu situation and we need to calculate the vblank sync
+ * using DRM_BLANK_HIGH_CRTC_MASK.
+ */
+static unsigned int
+drm_waitvblank_pipe(struct drm_output *output)
+{
+	if (output->pipe > 1)
+		return (output->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				DRM_VBLANK_HIGH_CRTC_MASK;
+	else if (output->pipe > 0)
+		return DRM_VBLANK_SECONDARY;
+	else
+		return 0;
+}
 
-	if (info->type & DRM_MODE_TYPE_PREFERRED)
-		mode->base.flags |= WL_OUTPUT_MODE_PREFERRED;
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * Add the state of a plane to an atomic request
+ *
+ * The source and destination rectangles are taken from the plane itself.
+ * If fb is NULL, the plane is disabled.
+ *
+ * @param req Atomic request to add the plane state to
+ * @param plane Plane to program
+ * @param output Output whose CRTC the plane is attached to
+ * @param fb Framebuffer to show on the plane, or NULL to disable it
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_plane_add_atomic(drmModeAtomicReq *req, struct drm_sprite *plane,
+		     struct drm_output *output, struct drm_fb *fb)
+{
+	uint32_t *props = plane->props;
+	uint32_t id = plane->plane_id;
+	int ret = 0;
 
-	wl_list_insert(output->base.mode_list.prev, &mode->base.link);
+	if (!fb) {
+		ret |= drmModeAtomicAddProperty(req, id,
+						props[WDRM_PLANE_FB_ID], 0) < 0;
+		ret |= drmModeAtomicAddProperty(req, id,
+						props[WDRM_PLANE_CRTC_ID], 0) < 0;
+		return ret ? -1 : 0;
+	}
 
-	return mode;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_FB_ID],
+					fb->fb_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_CRTC_ID],
+					output->crtc_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_SRC_X],
+					plane->src_x) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_SRC_Y],
+					plane->src_y) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_SRC_W],
+					plane->src_w) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_SRC_H],
+					plane->src_h) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_CRTC_X],
+					plane->dest_x) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_CRTC_Y],
+					plane->dest_y) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_CRTC_W],
+					plane->dest_w) < 0;
+	ret |= drmModeAtomicAddProperty(req, id, props[WDRM_PLANE_CRTC_H],
+					plane->dest_h) < 0;
+	if (plane->rotation_prop)
+		ret |= drmModeAtomicAddProperty(req, id, plane->rotation_prop,
+						plane->rotation) < 0;
+	if (plane->zpos_prop && plane->zpos_mutable)
+		ret |= drmModeAtomicAddProperty(req, id, plane->zpos_prop,
+						plane->zpos) < 0;
+	if (plane->in_fence_fd_prop && plane->in_fence_fd >= 0 &&
+	    fb->is_client_buffer)
+		ret |= drmModeAtomicAddProperty(req, id,
+						plane->in_fence_fd_prop,
+						plane->in_fence_fd) < 0;
+
+	return ret ? -1 : 0;
 }
 
+/**
+ * Add the mode of an output and its connector routing to an atomic request
+ *
+ * @param req Atomic request to add the state to
+ * @param output Output whose CRTC to set the current mode on
+ * @param flags Atomic commit flags, updated to allow the modeset
+ * @returns 0 on success, -1 on failure
+ */
 static int
-drm_subpixel_to_wayland(int drm_value)
+drm_output_add_modeset_atomic(drmModeAtomicReq *req,
+			      struct drm_output *output, uint32_t *flags)
 {
-	switch (drm_value) {
-	default:
-	case DRM_MODE_SUBPIXEL_UNKNOWN:
-		return WL_OUTPUT_SUBPIXEL_UNKNOWN;
-	case DRM_MODE_SUBPIXEL_NONE:
-		return WL_OUTPUT_SUBPIXEL_NONE;
-	case DRM_MODE_SUBPIXEL_HORIZONTAL_RGB:
-		return WL_OUTPUT_SUBPIXEL_HORIZONTAL_RGB;
-	case DRM_MODE_SUBPIXEL_HORIZONTAL_BGR:
-		return WL_OUTPUT_SUBPIXEL_HORIZONTAL_BGR;
-	case DRM_MODE_SUBPIXEL_VERTICAL_RGB:
-		return WL_OUTPUT_SUBPIXEL_VERTICAL_RGB;
-	case DRM_MODE_SUBPIXEL_VERTICAL_BGR:
-		return WL_OUTPUT_SUBPIXEL_VERTICAL_BGR;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_mode *mode;
+	int ret = 0;
+
+	mode = container_of(output->base.current_mode, struct drm_mode, base);
+
+	if (mode->blob_id == 0 &&
+	    drmModeCreatePropertyBlob(b->drm.fd, &mode->mode_info,
+				      sizeof(mode->mode_info),
+				      &mode->blob_id) != 0) {
+		weston_log("failed to create mode property blob: %m\n");
+		return -1;
 	}
+
+	ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+					output->props_crtc[WDRM_CRTC_MODE_ID],
+					mode->blob_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+					output->props_crtc[WDRM_CRTC_ACTIVE],
+					1) < 0;
+	ret |= drmModeAtomicAddProperty(req, output->connector_id,
+					output->props_conn[WDRM_CONNECTOR_CRTC_ID],
+					output->crtc_id) < 0;
+	*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	return ret ? -1 : 0;
 }
 
-/* returns a value between 0-255 range, where higher is brighter */
-static uint32_t
-drm_get_backlight(struct drm_output *output)
+/**
+ * Add the primary plane and CRTC state of an output to an atomic request
+ *
+ * @param req Atomic request to add the state to
+ * @param output Output to program
+ * @param fb Framebuffer to scan out from the primary plane
+ * @param flags Atomic commit flags, updated if a modeset is required
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_add_atomic(drmModeAtomicReq *req, struct drm_output *output,
+		      struct drm_fb *fb, uint32_t *flags)
 {
-	long brightness, max_brightness, norm;
+	struct drm_sprite *primary = output->primary_plane;
+	struct drm_mode *mode;
+	int ret = 0;
 
-	brightness = backlight_get_brightness(output->backlight);
-	max_brightness = backlight_get_max_brightness(output->backlight);
+	mode = container_of(output->base.current_mode, struct drm_mode, base);
 
-	/* convert it on a scale of 0 to 255 */
-	norm = (brightness * 255)/(max_brightness);
+	if ((!output->current || output->current->stride != fb->stride ||
+	     output->modeset_pending) &&
+	    drm_output_add_modeset_atomic(req, output, flags) < 0)
+		return -1;
 
-	return (uint32_t) norm;
+	/* Client buffers bring along the source rectangle of their view,
+	 * set by drm_output_prepare_scanout_view() */
+	if (!fb->is_client_buffer) {
+		primary->src_x = 0;
+		primary->src_y = 0;
+		primary->src_w = fb->width << 16;
+		primary->src_h = fb->height << 16;
+	}
+	primary->dest_x = 0;
+	primary->dest_y = 0;
+	primary->dest_w = mode->mode_info.hdisplay;
+	primary->dest_h = mode->mode_info.vdisplay;
+
+	/* Client buffers scanned out are already transformed */
+	if (drm_output_fb_is_dumb(output, fb))
+		primary->rotation = output->dumb_rotation;
+	else
+		primary->rotation = WDRM_PLANE_ROTATE_0;
+
+	if (output->vrr_enabled_prop)
+		ret |= drmModeAtomicAddProperty(req, output->crtc_id,
+						output->vrr_enabled_prop,
+						output->base.vrr_active) < 0;
+
+	if (ret || drm_plane_add_atomic(req, primary, output, fb) < 0)
+		return -1;
+
+	return 0;
 }
 
-/* values accepted are between 0-255 range */
-static void
-drm_set_backlight(struct weston_output *output_base, uint32_t value)
+/**
+ * Add the state of the clones of an output to an atomic request
+ *
+ * Each clone shows the framebuffer of the output on its own primary
+ * plane, which scales it to the mode of the clone. The aspect ratio is
+ * kept, centering the picture between black bars if the shapes differ.
+ *
+ * @param req Atomic request to add the state to
+ * @param output Output whose clones to program, after its own state
+ * @param fb Framebuffer scanned out by the output
+ * @param flags Atomic commit flags, updated if a modeset is required
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_add_clones_atomic(drmModeAtomicReq *req, struct drm_output *output,
+			     struct drm_fb *fb, uint32_t *flags)
 {
-	struct drm_output *output = to_drm_output(output_base);
-	long max_brightness, new_brightness;
+	struct drm_sprite *src = output->primary_plane;
+	struct drm_output *clone;
+	struct drm_sprite *primary;
+	struct drm_mode *mode;
+	uint64_t w, h, src_w, src_h;
 
-	if (!output->backlight)
-		return;
+	src_w = output->base.current_mode->width;
+	src_h = output->base.current_mode->height;
 
-	if (value > 255)
-		return;
+	wl_list_for_each(clone, &output->clone_list, clone_link) {
+		if (clone->modeset_pending &&
+		    drm_output_add_modeset_atomic(req, clone, flags) < 0)
+			return -1;
 
-	max_brightness = backlight_get_max_brightness(output->backlight);
+		mode = container_of(clone->base.current_mode,
+				    struct drm_mode, base);
+		w = mode->mode_info.hdisplay;
+		h = mode->mode_info.vdisplay;
+
+		primary = clone->primary_plane;
+		primary->src_x = src->src_x;
+		primary->src_y = src->src_y;
+		primary->src_w = src->src_w;
+		primary->src_h = src->src_h;
+		primary->rotation = src->rotation;
+
+		if (w * src_h > h * src_w) {
+			primary->dest_w = h * src_w / src_h;
+			primary->dest_h = h;
+		} else {
+			primary->dest_w = w;
+			primary->dest_h = w * src_h / src_w;
+		}
+		primary->dest_x = (w - primary->dest_w) / 2;
+		primary->dest_y = (h - primary->dest_h) / 2;
 
-	/* get denormalized value */
-	new_brightness = (value * max_brightness) / 255;
+		if (drm_plane_add_atomic(req, primary, clone, fb) < 0)
+			return -1;
+	}
 
-	backlight_set_brightness(output->backlight, new_brightness);
+	return 0;
 }
 
-static drmModePropertyPtr
-drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name)
+/**
+ * Check whether the kernel accepts the clones of an output
+ *
+ * Tests the modeset of the clones with the framebuffer the output shows,
+ * which finds clones the primary planes cannot scale for. Until the output
+ * has shown its first frame there is nothing to test with.
+ *
+ * @param output Output whose clones to test
+ * @returns 0 if the configuration is valid, -1 otherwise
+ */
+static int
+drm_output_test_clones(struct drm_output *output)
 {
-	drmModePropertyPtr props;
-	int i;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	drmModeAtomicReq *req;
+	int ret;
 
-	for (i = 0; i < connector->count_props; i++) {
-		props = drmModeGetProperty(fd, connector->props[i]);
-		if (!props)
-			continue;
+	if (!output->current)
+		return 0;
 
-		if (!strcmp(props->name, name))
-			return props;
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
 
-		drmModeFreeProperty(props);
-	}
+	ret = drm_output_add_atomic(req, output, output->current, &flags);
+	ret |= drm_output_add_clones_atomic(req, output, output->current,
+					   &flags);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
 
-	return NULL;
+	drmModeAtomicFree(req);
+
+	return ret ? -1 : 0;
 }
 
-static void
-drm_set_dpms(struct weston_output *output_base, enum dpms_enum level)
+/**
+ * Check whether the planes prepared for an output can be displayed
+ *
+ * Builds an atomic request from the given primary framebuffer and every
+ * sprite which has been assigned a framebuffer for this output, and asks
+ * the kernel whether it would accept it, without committing anything.
+ *
+ * @param output Output to test the plane configuration for
+ * @param primary_fb Framebuffer for the primary plane
+ * @returns 0 if the configuration is valid, -1 otherwise
+ */
+static int
+drm_output_test_atomic(struct drm_output *output, struct drm_fb *primary_fb)
 {
-	struct drm_output *output = to_drm_output(output_base);
-	struct weston_compositor *ec = output_base->compositor;
-	struct drm_backend *b = to_drm_backend(ec);
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_sprite *s;
+	drmModeAtomicReq *req;
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
 	int ret;
 
-	if (!output->dpms_prop)
-		return;
+	/* Without a scanout buffer there is no valid configuration to test
+	 * against; leave everything on the primary plane for this frame. */
+	if (!primary_fb)
+		return -1;
 
-	ret = drmModeConnectorSetProperty(b->drm.fd, output->connector_id,
-				 	  output->dpms_prop->prop_id, level);
-	if (ret) {
-		weston_log("DRM: DPMS: failed property set for %s\n",
-			   output->base.name);
-		return;
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_add_atomic(req, output, primary_fb, &flags);
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output || !s->next)
+			continue;
+
+		ret |= drm_plane_add_atomic(req, s, output, s->next);
 	}
 
-	output->dpms = level;
-}
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, output);
 
-static const char * const connector_type_names[] = {
-	[DRM_MODE_CONNECTOR_Unknown]     = "Unknown",
-	[DRM_MODE_CONNECTOR_VGA]         = "VGA",
-	[DRM_MODE_CONNECTOR_DVII]        = "DVI-I",
-	[DRM_MODE_CONNECTOR_DVID]        = "DVI-D",
-	[DRM_MODE_CONNECTOR_DVIA]        = "DVI-A",
-	[DRM_MODE_CONNECTOR_Composite]   = "Composite",
-	[DRM_MODE_CONNECTOR_SVIDEO]      = "SVIDEO",
-	[DRM_MODE_CONNECTOR_LVDS]        = "LVDS",
-	[DRM_MODE_CONNECTOR_Component]   = "Component",
-	[DRM_MODE_CONNECTOR_9PinDIN]     = "DIN",
-	[DRM_MODE_CONNECTOR_DisplayPort] = "DP",
-	[DRM_MODE_CONNECTOR_HDMIA]       = "HDMI-A",
-	[DRM_MODE_CONNECTOR_HDMIB]       = "HDMI-B",
-	[DRM_MODE_CONNECTOR_TV]          = "TV",
-	[DRM_MODE_CONNECTOR_eDP]         = "eDP",
-#ifdef DRM_MODE_CONNECTOR_DSI
-	[DRM_MODE_CONNECTOR_VIRTUAL]     = "Virtual",
-	[DRM_MODE_CONNECTOR_DSI]         = "DSI",
-#endif
-};
+	drmModeAtomicFree(req);
 
-static char *
-make_connector_name(const drmModeConnector *con)
-{
-	char name[32];
-	const char *type_name = NULL;
+	return ret == 0 ? 0 : -1;
+}
 
-	if (con->connector_type < ARRAY_LENGTH(connector_type_names))
-		type_name = connector_type_names[con->connector_type];
+/**
+ * Make sure writeback buffer i of an output matches the current mode
+ */
+static struct drm_fb *
+drm_output_writeback_buffer(struct drm_output *output, int i)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_fb *fb = output->writeback_fb[i];
+	int width = output->base.current_mode->width;
+	int height = output->base.current_mode->height;
 
-	if (!type_name)
-		type_name = "UNNAMED";
+	if (fb && (fb->width != width || fb->height != height)) {
+		drm_fb_destroy_dumb(fb);
+		fb = NULL;
+	}
 
-	snprintf(name, sizeof name, "%s-%d", type_name, con->connector_type_id);
+	if (!fb)
+		fb = drm_fb_create_dumb(b, b->drm.fd, width, height,
+					GBM_FORMAT_XRGB8888);
+	output->writeback_fb[i] = fb;
 
-	return strdup(name);
+	return fb;
 }
 
-static int
-find_crtc_for_connector(struct drm_backend *b,
-			drmModeRes *resources, drmModeConnector *connector)
+/**
+ * Let go of the writeback connector of an output and its buffers
+ *
+ * The kernel keeps its own reference to a buffer still being written.
+ * If the connector is still attached to the CRTC, it is detached with a
+ * blocking commit of its own.
+ */
+static void
+drm_output_writeback_release(struct drm_output *output)
 {
-	drmModeEncoder *encoder;
-	uint32_t possible_crtcs;
-	int i, j;
-
-	for (j = 0; j < connector->count_encoders; j++) {
-		encoder = drmModeGetEncoder(b->drm.fd, connector->encoders[j]);
-		if (encoder == NULL) {
-			weston_log("Failed to get encoder.\n");
-			return -1;
-		}
-		possible_crtcs = encoder->possible_crtcs;
-		drmModeFreeEncoder(encoder);
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_writeback *wb = output->writeback;
+	drmModeAtomicReq *req;
+	int i;
 
-		for (i = 0; i < resources->count_crtcs; i++) {
-			if (!(possible_crtcs & (1 << i)))
-				continue;
+	if (!wb)
+		return;
 
-			if (drm_output_find_by_crtc(b, resources->crtcs[i]))
-				continue;
+	if (output->writeback_attached) {
+		req = drmModeAtomicAlloc();
+		if (req &&
+		    drmModeAtomicAddProperty(req, wb->connector_id,
+					     wb->props[WDRM_WRITEBACK_CRTC_ID],
+					     0) >= 0)
+			drmModeAtomicCommit(b->drm.fd, req,
+					    DRM_MODE_ATOMIC_ALLOW_MODESET,
+					    NULL);
+		drmModeAtomicFree(req);
+	}
 
-			return i;
-		}
+	if (output->writeback_source)
+		wl_event_source_remove(output->writeback_source);
+	output->writeback_source = NULL;
+	if (output->writeback_fence >= 0)
+		close(output->writeback_fence);
+	output->writeback_fence = -1;
+
+	for (i = 0; i < DRM_WRITEBACK_BUFFERS; i++) {
+		if (output->writeback_fb[i])
+			drm_fb_destroy_dumb(output->writeback_fb[i]);
+		output->writeback_fb[i] = NULL;
 	}
 
-	return -1;
+	output->writeback_pending = -1;
+	output->writeback_last = -1;
+	output->writeback_attached = false;
+	output->writeback_attach = false;
+	output->writeback_users = 0;
+	output->writeback = NULL;
+	wb->output = NULL;
 }
 
-/* Init output state that depends on gl or gbm */
+/* The out fence signals once the display engine wrote the frame */
 static int
-drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
+drm_output_writeback_done(int fd, uint32_t mask, void *data)
 {
-	EGLint format[2] = {
-		output->gbm_format,
-		fallback_format_for(output->gbm_format),
-	};
-	int i, flags, n_formats = 1;
+	struct drm_output *output = data;
 
-	output->gbm_surface = gbm_surface_create(b->gbm,
-					     output->base.current_mode->width,
-					     output->base.current_mode->height,
-					     format[0],
-					     GBM_BO_USE_SCANOUT |
-					     GBM_BO_USE_RENDERING);
-	if (!output->gbm_surface) {
-		weston_log("failed to create gbm surface\n");
-		return -1;
+	wl_event_source_remove(output->writeback_source);
+	output->writeback_source = NULL;
+	close(output->writeback_fence);
+	output->writeback_fence = -1;
+
+	output->writeback_last = output->writeback_pending;
+	output->writeback_pending = -1;
+
+	wl_signal_emit(&output->base.writeback_signal, &output->base);
+
+	return 1;
+}
+
+/**
+ * Add the writeback connector state of an output to an atomic request
+ *
+ * While captures want frames, the connector stays attached to the CRTC,
+ * and every commit that finds no frame still being written has the
+ * display engine write the new one into the next buffer. Attaching and
+ * detaching the connector is a modeset for most drivers, so it only
+ * happens when the first capture starts and the last one stops.
+ *
+ * @param req Atomic request to add the state to
+ * @param output Output being repainted
+ * @param flags Atomic commit flags, updated if a modeset is required
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_add_writeback(drmModeAtomicReq *req, struct drm_output *output,
+			 uint32_t *flags)
+{
+	struct drm_writeback *wb = output->writeback;
+	struct drm_fb *fb;
+	int ret = 0;
+	int i;
+
+	if (!wb || wb->broken)
+		return 0;
+
+	output->writeback_attach = output->writeback_users > 0;
+	if (output->writeback_attach != output->writeback_attached) {
+		ret |= drmModeAtomicAddProperty(req, wb->connector_id,
+						wb->props[WDRM_WRITEBACK_CRTC_ID],
+						output->writeback_attach ?
+						output->crtc_id : 0) < 0;
+		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 	}
 
-	if (format[1])
-		n_formats = 2;
-	if (gl_renderer->output_window_create(&output->base,
-					      (EGLNativeWindowType)output->gbm_surface,
-					      output->gbm_surface,
-					      gl_renderer->opaque_attribs,
-					      format,
-					      n_formats) < 0) {
-		weston_log("failed to create gl renderer output state\n");
-		gbm_surface_destroy(output->gbm_surface);
+	if (!output->writeback_attach || output->writeback_pending >= 0)
+		return ret ? -1 : 0;
+
+	i = (output->writeback_last + 1) % DRM_WRITEBACK_BUFFERS;
+	fb = drm_output_writeback_buffer(output, i);
+	if (!fb)
+		return ret ? -1 : 0;
+
+	output->writeback_fence = -1;
+	ret |= drmModeAtomicAddProperty(req, wb->connector_id,
+					wb->props[WDRM_WRITEBACK_FB_ID],
+					fb->fb_id) < 0;
+	ret |= drmModeAtomicAddProperty(req, wb->connector_id,
+					wb->props[WDRM_WRITEBACK_OUT_FENCE_PTR],
+					(uintptr_t) &output->writeback_fence) < 0;
+	if (ret)
 		return -1;
-	}
 
-	flags = GBM_BO_USE_CURSOR | GBM_BO_USE_WRITE;
+	output->writeback_pending = i;
+
+	return 0;
+}
+
+/**
+ * Add the primary plane, CRTC and overlay state of an output to a repaint
+ *
+ * The state is only submitted to the kernel once every output due in this
+ * repaint cycle has been added; see drm_repaint_flush().
+ *
+ * @param output Output to repaint, with output->next already rendered
+ * @param pending Pending state of the current repaint cycle
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_repaint_atomic(struct drm_output *output,
+			  struct drm_pending_state *pending)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_sprite *s;
+	struct drm_fb *fb;
+	int cursor;
+	int ret;
+
+	/* Remember where this output's state starts, so a failure only
+	 * drops this output from the request. */
+	cursor = drmModeAtomicGetCursor(pending->req);
 
-	for (i = 0; i < 2; i++) {
-		if (output->gbm_cursor_bo[i])
+	ret = drm_output_add_atomic(pending->req, output, output->next,
+				    &pending->flags);
+	ret |= drm_output_add_clones_atomic(pending->req, output, output->next,
+					    &pending->flags);
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output || (!s->current && !s->next))
 			continue;
 
-		output->gbm_cursor_bo[i] =
-			gbm_bo_create(b->gbm, b->cursor_width, b->cursor_height,
-				GBM_FORMAT_ARGB8888, flags);
+		fb = NULL;
+		if (s->next && !b->sprites_hidden)
+			fb = s->next;
+
+		ret |= drm_plane_add_atomic(pending->req, s, output, fb);
 	}
 
-	if (output->gbm_cursor_bo[0] == NULL || output->gbm_cursor_bo[1] == NULL) {
-		weston_log("cursor buffers unavailable, using gl cursors\n");
-		b->cursors_are_broken = 1;
+	ret |= drm_output_add_writeback(pending->req, output,
+					&pending->flags);
+
+	if (ret) {
+		weston_log("failed to build atomic request\n");
+		drmModeAtomicSetCursor(pending->req, cursor);
+		return -1;
 	}
 
+	output->atomic_pending = 1;
+
 	return 0;
 }
 
+/**
+ * Undo the repaint of every output in a repaint cycle
+ *
+ * Drops the framebuffers prepared for the outputs, and finishes their
+ * frames immediately since no page flip event will arrive for them.
+ *
+ * @param b DRM backend
+ */
 static void
-drm_output_fini_egl(struct drm_output *output)
+drm_pending_state_abort(struct drm_backend *b)
 {
-	gl_renderer->output_destroy(&output->base);
-	gbm_surface_destroy(output->gbm_surface);
+	struct drm_output *output;
+	struct drm_sprite *s;
+	struct timespec ts;
+
+	wl_list_for_each(output, &b->compositor->output_list, base.link) {
+		if (!output->atomic_pending)
+			continue;
+
+		output->atomic_pending = 0;
+		output->page_flip_pending = 0;
+
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+
+		output->writeback_pending = -1;
+		if (output->writeback &&
+		    output->writeback_attach && !output->writeback_attached) {
+			weston_log("failed to attach writeback connector %u "
+				   "to output %s, not using it\n",
+				   output->writeback->connector_id,
+				   output->base.name);
+			output->writeback->broken = true;
+			wl_signal_emit(&output->base.writeback_signal,
+				       &output->base);
+		}
+		output->writeback_attach = output->writeback_attached;
+
+		wl_list_for_each(s, &b->sprite_list, link) {
+			if (s->output != output)
+				continue;
+
+			drm_output_release_fb(output, s->next);
+			s->next = NULL;
+		}
+
+		weston_compositor_read_presentation_clock(b->compositor, &ts);
+		weston_output_finish_frame(&output->base, &ts,
+					   WP_PRESENTATION_FEEDBACK_INVALID);
+	}
 }
 
+/**
+ * Start rendering an output on its render thread
+ *
+ * Instead of waiting for the frame, the output is added to the request
+ * by drm_repaint_flush(), so that the outputs repainted after it render
+ * meanwhile.
+ *
+ * @param output Output to repaint
+ * @param damage Damage of the primary plane
+ * @param repaint_data Pending state of the current repaint cycle
+ * @returns 0 if the output is rendering, -1 to render it right away
+ */
 static int
-drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
+drm_output_render_deferred(struct drm_output *output,
+			   pixman_region32_t *damage, void *repaint_data)
 {
-	int w = output->base.current_mode->width;
-	int h = output->base.current_mode->height;
-	uint32_t format = output->gbm_format;
-	uint32_t pixman_format;
-	unsigned int i;
+	struct weston_compositor *c = output->base.compositor;
+	struct drm_backend *b = to_drm_backend(c);
 
-	switch (format) {
-		case GBM_FORMAT_XRGB8888:
-			pixman_format = PIXMAN_x8r8g8b8;
-			break;
-		case GBM_FORMAT_RGB565:
-			pixman_format = PIXMAN_r5g6b5;
-			break;
-		default:
-			weston_log("Unsupported pixman format 0x%x\n", format);
-			return -1;
-	}
+	if (!b->render_threads || !b->atomic_modeset || b->use_pixman ||
+	    output->secondary || !repaint_data)
+		return -1;
 
-	/* FIXME error checking */
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
-		output->dumb[i] = drm_fb_create_dumb(b, w, h, format);
-		if (!output->dumb[i])
-			goto err;
+	c->renderer->repaint_output(&output->base, damage);
+	pixman_region32_subtract(&c->primary_plane.damage,
+				 &c->primary_plane.damage, damage);
 
-		output->image[i] =
-			pixman_image_create_bits(pixman_format, w, h,
-						 output->dumb[i]->map,
-						 output->dumb[i]->stride);
-		if (!output->image[i])
-			goto err;
+	output->next_async = 0;
+	output->render_pending = 1;
+
+	return 0;
+}
+
+/**
+ * Take the frame of an output from its render thread
+ *
+ * With pending state, the output is added to it; without, or if that
+ * fails, the frame is dropped and finished right away, as no page flip
+ * event will arrive for it.
+ *
+ * @param output Output with render_pending set
+ * @param pending Pending state of the current repaint cycle, or NULL
+ */
+static void
+drm_output_finish_render(struct drm_output *output,
+			 struct drm_pending_state *pending)
+{
+	struct timespec ts;
+
+	output->render_pending = 0;
+	drm_output_lock_gl_fb(output);
+
+	if (pending && output->next &&
+	    drm_output_repaint_atomic(output, pending) == 0) {
+		output->page_flip_pending = 1;
+		drm_output_set_cursor(output);
+		return;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
-		goto err;
+	output->cursor_view = NULL;
+	if (output->next) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+	}
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &ts);
+	weston_output_finish_frame(&output->base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
+}
 
-	return 0;
+static void *
+drm_repaint_begin(struct weston_compositor *compositor)
+{
+	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_pending_state *pending;
 
-err:
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
-		if (output->dumb[i])
-			drm_fb_destroy_dumb(output->dumb[i]);
-		if (output->image[i])
-			pixman_image_unref(output->image[i]);
+	pending = zalloc(sizeof *pending);
+	if (!pending)
+		return NULL;
 
-		output->dumb[i] = NULL;
-		output->image[i] = NULL;
+	pending->req = drmModeAtomicAlloc();
+	if (!pending->req) {
+		free(pending);
+		return NULL;
 	}
 
-	return -1;
+	pending->backend = b;
+	pending->flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	return pending;
 }
 
+/**
+ * Close the acquire fences handed to the planes in this repaint cycle
+ *
+ * The kernel keeps its own reference to the fences of a commit, so they
+ * can go as soon as the commit has been submitted or abandoned.
+ *
+ * @param b DRM backend
+ */
 static void
-drm_output_fini_pixman(struct drm_output *output)
+drm_backend_clear_in_fences(struct drm_backend *b)
 {
-	unsigned int i;
+	struct drm_sprite *s;
 
-	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
+	wl_list_for_each(s, &b->sprite_list, link)
+		drm_sprite_set_in_fence(s, -1);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
-		drm_fb_destroy_dumb(output->dumb[i]);
-		pixman_image_unref(output->image[i]);
-		output->dumb[i] = NULL;
-		output->image[i] = NULL;
-	}
+	wl_list_for_each(s, &b->primary_plane_list, link)
+		drm_sprite_set_in_fence(s, -1);
 }
 
 static void
-edid_parse_string(const uint8_t *data, char text[])
+drm_pending_state_free(struct drm_pending_state *pending)
 {
-	int i;
-	int replaced = 0;
+	if (!pending)
+		return;
 
-	/* this is always 12 bytes, but we can't guarantee it's null
-	 * terminated or not junk. */
-	strncpy(text, (const char *) data, 12);
+	drmModeAtomicFree(pending->req);
+	free(pending);
+}
 
-	/* guarantee our new string is null-terminated */
-	text[12] = '\0';
+/**
+ * Submit the state of every output repainted in this cycle in one commit
+ *
+ * All CRTCs driven by this device flip together, and each one reports its
+ * completion through atomic_flip_handler().
+ */
+static void
+drm_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
+{
+	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_pending_state *pending = repaint_data;
+	struct drm_output *output, *clone;
+	int ret;
 
-	/* remove insane chars */
-	for (i = 0; text[i] != '\0'; i++) {
-		if (text[i] == '\n' ||
-		    text[i] == '\r') {
-			text[i] = '\0';
-			break;
-		}
+	if (!pending)
+		return;
+
+	wl_list_for_each(output, &compositor->output_list, base.link)
+		if (output->render_pending)
+			drm_output_finish_render(output, pending);
+
+	if (drmModeAtomicGetCursor(pending->req) == 0) {
+		drm_backend_clear_in_fences(b);
+		drm_pending_state_free(pending);
+		return;
 	}
 
-	/* ensure string is printable */
-	for (i = 0; text[i] != '\0'; i++) {
-		if (!isprint(text[i])) {
-			text[i] = '-';
-			replaced++;
+	ret = drmModeAtomicCommit(b->drm.fd, pending->req, pending->flags, b);
+	drm_backend_clear_in_fences(b);
+	if (ret) {
+		weston_log("atomic commit failed: %m\n");
+		drm_pending_state_abort(b);
+		drm_pending_state_free(pending);
+		return;
+	}
+
+	wl_list_for_each(output, &compositor->output_list, base.link) {
+		if (!output->atomic_pending)
+			continue;
+
+		output->atomic_pending = 0;
+		if (pending->flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+			output->dpms = WESTON_DPMS_ON;
+			output->modeset_pending = 0;
+		}
+
+		wl_list_for_each(clone, &output->clone_list, clone_link) {
+			if (pending->flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+				clone->dpms = WESTON_DPMS_ON;
+				clone->modeset_pending = 0;
+			}
+			clone->page_flip_pending = 1;
+			output->clone_flips_pending++;
+		}
+
+		if (!output->writeback || output->writeback->broken)
+			continue;
+
+		output->writeback_attached = output->writeback_attach;
+		if (!output->writeback_attached) {
+			drm_output_writeback_release(output);
+			continue;
+		}
+
+		if (output->writeback_pending < 0 ||
+		    output->writeback_source)
+			continue;
+
+		if (output->writeback_fence >= 0)
+			output->writeback_source =
+				wl_event_loop_add_fd(
+					wl_display_get_event_loop(compositor->wl_display),
+					output->writeback_fence,
+					WL_EVENT_READABLE,
+					drm_output_writeback_done, output);
+		if (!output->writeback_source) {
+			if (output->writeback_fence >= 0)
+				close(output->writeback_fence);
+			output->writeback_fence = -1;
+			output->writeback_pending = -1;
 		}
 	}
 
-	/* if the string is random junk, ignore the string */
-	if (replaced > 4)
-		text[0] = '\0';
+	drm_pending_state_free(pending);
 }
 
-#define EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING	0xfe
-#define EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME		0xfc
-#define EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER	0xff
-#define EDID_OFFSET_DATA_BLOCKS				0x36
-#define EDID_OFFSET_LAST_BLOCK				0x6c
-#define EDID_OFFSET_PNPID				0x08
-#define EDID_OFFSET_SERIAL				0x0c
+static void
+drm_repaint_cancel(struct weston_compositor *compositor, void *repaint_data)
+{
+	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_output *output;
+
+	wl_list_for_each(output, &compositor->output_list, base.link)
+		if (output->render_pending)
+			drm_output_finish_render(output, NULL);
+
+	drm_pending_state_abort(b);
+	drm_backend_clear_in_fences(b);
+	drm_pending_state_free(repaint_data);
+}
+#endif
 
 static int
-edid_parse(struct drm_edid *edid, const uint8_t *data, size_t length)
+drm_output_set_crtc(struct drm_output *output)
 {
-	int i;
-	uint32_t serial_number;
+	struct drm_mode *mode;
+	int ret;
 
-	/* check header */
-	if (length < 128)
+	mode = container_of(output->base.current_mode, struct drm_mode, base);
+	ret = drmModeSetCrtc(drm_output_fd(output), output->crtc_id,
+			     output->next->fb_id, 0, 0,
+			     &output->connector_id, 1,
+			     &mode->mode_info);
+	if (ret) {
+		weston_log("set mode failed: %m\n");
+		return -1;
+	}
+	output->modeset_pending = 0;
+	output->base.set_dpms(&output->base, WESTON_DPMS_ON);
+
+	return 0;
+}
+
+/* Whether the repaint would flip to what is already on screen: no
+ * damage on the primary plane, no client buffer to scan out and no
+ * overlay in use. Only the cursor may have moved, which takes no flip. */
+static bool
+drm_output_can_skip_flip(struct drm_output *output, pixman_region32_t *damage)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_output *clone;
+	struct drm_sprite *s;
+
+	if (pixman_region32_not_empty(damage) || output->next ||
+	    !output->current || output->current->foreign ||
+	    output->modeset_pending || output->page_flip_pending ||
+	    output->vblank_pending || output->writeback)
+		return false;
+
+	if (output->vrr_enabled_prop &&
+	    output->vrr_enabled != output->base.vrr_active)
+		return false;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output == output && (s->current || s->next))
+			return false;
+	}
+
+	wl_list_for_each(clone, &output->clone_list, clone_link) {
+		if (clone->modeset_pending)
+			return false;
+	}
+
+	return true;
+}
+
+/* Complete the repaint on the next vblank, as if the unchanged frame had
+ * been flipped, so frame callbacks and presentation feedback go out at
+ * the same pace. */
+static int
+drm_output_skip_flip(struct drm_output *output)
+{
+	drmVBlank vbl = {
+		.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
+		.request.sequence = 1,
+	};
+
+	vbl.request.type |= drm_waitvblank_pipe(output);
+	output->skip_vblank.output = output;
+	output->skip_vblank.sprite = NULL;
+	vbl.request.signal = (unsigned long)&output->skip_vblank;
+	if (drmWaitVBlank(drm_output_fd(output), &vbl) < 0)
+		return -1;
+
+	output->vblank_pending = 1;
+	output->base.stats.unchanged_frames++;
+	drm_output_set_cursor(output);
+
+	return 0;
+}
+
+/**
+ * Show the framebuffer just flipped to on an output on its clones too
+ *
+ * Without atomic modesetting every CRTC flips on its own; a clone that
+ * cannot flip is set to the framebuffer directly instead, which blocks,
+ * rather than going on showing a framebuffer the output may paint into.
+ *
+ * @param output Output whose clones to update
+ * @param modeset Whether the output was just set up with drmModeSetCrtc
+ */
+static void
+drm_output_flip_clones(struct drm_output *output, bool modeset)
+{
+	struct drm_output *clone;
+	struct drm_mode *mode;
+	uint32_t fb_id = output->next->fb_id;
+
+	wl_list_for_each(clone, &output->clone_list, clone_link) {
+		if (!modeset && !clone->modeset_pending &&
+		    !clone->page_flip_pending &&
+		    drmModePageFlip(drm_output_fd(clone), clone->crtc_id, fb_id,
+				    DRM_MODE_PAGE_FLIP_EVENT, clone) == 0) {
+			clone->page_flip_pending = 1;
+			output->clone_flips_pending++;
+			continue;
+		}
+
+		mode = container_of(clone->base.current_mode,
+				    struct drm_mode, base);
+		if (drmModeSetCrtc(drm_output_fd(clone), clone->crtc_id, fb_id,
+				   0, 0, &clone->connector_id, 1,
+				   &mode->mode_info) < 0) {
+			weston_log("set mode of clone %s failed: %m\n",
+				   clone->base.name);
+			continue;
+		}
+
+		clone->modeset_pending = 0;
+		clone->dpms = WESTON_DPMS_ON;
+	}
+}
+
+static int
+drm_output_repaint(struct weston_output *output_base,
+		   pixman_region32_t *damage,
+		   void *repaint_data)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *backend =
+		to_drm_backend(output->base.compositor);
+	struct drm_sprite *s;
+	bool modeset = false;
+	int async;
+	int ret = 0;
+
+	if (output->disable_pending || output->destroy_pending)
+		return -1;
+
+	if (drm_output_can_skip_flip(output, damage) &&
+	    drm_output_skip_flip(output) == 0)
+		return 0;
+
+	if (!output->next) {
+#ifdef HAVE_DRM_ATOMIC
+		if (drm_output_render_deferred(output, damage,
+					       repaint_data) == 0)
+			return 0;
+#endif
+		drm_output_render(output, damage);
+	}
+	if (!output->next)
+		return -1;
+
+	/* Only legacy page flips can be asynchronous */
+	async = output->next_async && backend->async_page_flip;
+	output->next_async = 0;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (backend->atomic_modeset && !output->secondary) {
+		if (!repaint_data ||
+		    drm_output_repaint_atomic(output, repaint_data) < 0)
+			goto err_pageflip;
+
+		output->page_flip_pending = 1;
+		drm_output_set_cursor(output);
+
+		return 0;
+	}
+#endif
+
+	if (!output->current ||
+	    output->current->stride != output->next->stride ||
+	    output->modeset_pending) {
+		if (drm_output_set_crtc(output) < 0)
+			goto err_pageflip;
+		async = 0;
+		modeset = true;
+	}
+
+	if (output->vrr_enabled_prop &&
+	    output->vrr_enabled != output->base.vrr_active) {
+		if (drmModeObjectSetProperty(drm_output_fd(output),
+					     output->crtc_id,
+					     DRM_MODE_OBJECT_CRTC,
+					     output->vrr_enabled_prop,
+					     output->base.vrr_active) == 0)
+			output->vrr_enabled = output->base.vrr_active;
+		else
+			weston_log("failed to set VRR_ENABLED: %m\n");
+	}
+
+	/* Drivers may refuse to tear between some pairs of buffers, then
+	 * the flip waits for vblank after all. */
+	if (async &&
+	    drmModePageFlip(drm_output_fd(output), output->crtc_id,
+			    output->next->fb_id,
+			    DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC,
+			    output) < 0)
+		async = 0;
+
+	if (!async) {
+		ret = drmModePageFlip(drm_output_fd(output), output->crtc_id,
+				      output->next->fb_id,
+				      DRM_MODE_PAGE_FLIP_EVENT, output);
+		if (ret < 0 && output->current && output->current->foreign) {
+			/* The driver will not flip away from the adopted
+			 * framebuffer, e.g. because its format differs. */
+			if (drm_output_set_crtc(output) == 0)
+				ret = drmModePageFlip(drm_output_fd(output),
+						      output->crtc_id,
+						      output->next->fb_id,
+						      DRM_MODE_PAGE_FLIP_EVENT,
+						      output);
+		}
+		if (ret < 0) {
+			weston_log("queueing pageflip failed: %m\n");
+			goto err_pageflip;
+		}
+	}
+
+	output->page_flip_pending = 1;
+	output->page_flip_async = async;
+
+	drm_output_flip_clones(output, modeset);
+	drm_output_set_cursor(output);
+
+	/* The sprites all belong to the render GPU */
+	if (output->secondary)
+		return 0;
+
+	/*
+	 * Now, update all the sprite surfaces
+	 */
+	wl_list_for_each(s, &backend->sprite_list, link) {
+		uint32_t flags = 0, fb_id = 0;
+		drmVBlank vbl = {
+			.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT,
+			.request.sequence = 1,
+		};
+
+		if ((!s->current && !s->next) ||
+		    !drm_sprite_crtc_supported(output, s))
+			continue;
+
+		if (s->next && !backend->sprites_hidden)
+			fb_id = s->next->fb_id;
+
+		ret = drmModeSetPlane(backend->drm.fd, s->plane_id,
+				      output->crtc_id, fb_id, flags,
+				      s->dest_x, s->dest_y,
+				      s->dest_w, s->dest_h,
+				      s->src_x, s->src_y,
+				      s->src_w, s->src_h);
+		if (ret)
+			weston_log("setplane failed: %d: %s\n",
+				ret, strerror(errno));
+
+		vbl.request.type |= drm_waitvblank_pipe(output);
+
+		/*
+		 * Queue a vblank signal so we know when the surface
+		 * becomes active on the display or has been replaced.
+		 */
+		s->vblank.output = output;
+		s->vblank.sprite = s;
+		vbl.request.signal = (unsigned long)&s->vblank;
+		ret = drmWaitVBlank(backend->drm.fd, &vbl);
+		if (ret) {
+			weston_log("vblank event request failed: %d: %s\n",
+				ret, strerror(errno));
+		}
+
+		s->output = output;
+		output->vblank_pending = 1;
+	}
+
+	return 0;
+
+err_pageflip:
+	output->cursor_view = NULL;
+	if (output->next) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+	}
+
+	return -1;
+}
+
+static void
+drm_output_start_repaint_loop(struct weston_output *output_base)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *backend =
+		to_drm_backend(output_base->compositor);
+	uint32_t fb_id;
+	struct timespec ts, tnow;
+	struct timespec vbl2now;
+	int64_t refresh_nsec;
+	int ret;
+	drmVBlank vbl = {
+		.request.type = DRM_VBLANK_RELATIVE,
+		.request.sequence = 0,
+		.request.signal = 0,
+	};
+
+	if (output->disable_pending || output->destroy_pending)
+		return;
+
+	if (!output->current) {
+		/* We can't page flip if there's no mode set */
+		goto finish_frame;
+	}
+
+	/* Try to get current msc and timestamp via instant query */
+	vbl.request.type |= drm_waitvblank_pipe(output);
+	ret = drmWaitVBlank(drm_output_fd(output), &vbl);
+
+	/* Error ret or zero timestamp means failure to get valid timestamp */
+	if ((ret == 0) && (vbl.reply.tval_sec > 0 || vbl.reply.tval_usec > 0)) {
+		ts.tv_sec = vbl.reply.tval_sec;
+		ts.tv_nsec = vbl.reply.tval_usec * 1000;
+
+		/* Valid timestamp for most recent vblank - not stale?
+		 * Stale ts could happen on Linux 3.17+, so make sure it
+		 * is not older than 1 refresh duration since now.
+		 */
+		weston_compositor_read_presentation_clock(backend->compositor,
+							  &tnow);
+		timespec_sub(&vbl2now, &tnow, &ts);
+		refresh_nsec =
+			millihz_to_nsec(output->base.current_mode->refresh);
+		/* With variable refresh the last vblank is as old as the
+		 * last flip, and flipping again would only delay the next
+		 * frame by a refresh cycle. */
+		if (timespec_to_nsec(&vbl2now) < refresh_nsec ||
+		    output->base.vrr_active) {
+			drm_output_update_msc(output, vbl.reply.sequence);
+			weston_output_finish_frame(output_base, &ts,
+						WP_PRESENTATION_FEEDBACK_INVALID);
+			return;
+		}
+	}
+
+	/* Immediate query didn't provide valid timestamp.
+	 * Use pageflip fallback.
+	 */
+	fb_id = output->current->fb_id;
+
+	/* With atomic modesetting, every flip event is dispatched through
+	 * atomic_flip_handler(), which expects the backend as user data.
+	 * Secondary devices are always driven with legacy flips. */
+	if (drmModePageFlip(drm_output_fd(output), output->crtc_id, fb_id,
+			    DRM_MODE_PAGE_FLIP_EVENT,
+			    backend->atomic_modeset && !output->secondary ?
+			    (void *) backend : (void *) output) < 0) {
+		weston_log("queueing pageflip failed: %m\n");
+		goto finish_frame;
+	}
+
+	return;
+
+finish_frame:
+	/* if we cannot page-flip, immediately finish frame */
+	weston_compositor_read_presentation_clock(output_base->compositor, &ts);
+	weston_output_finish_frame(output_base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
+}
+
+static void
+drm_output_update_msc(struct drm_output *output, unsigned int seq)
+{
+	uint64_t msc_hi = output->base.msc >> 32;
+
+	if (seq < (output->base.msc & 0xffffffff))
+		msc_hi++;
+
+	output->base.msc = (msc_hi << 32) + seq;
+}
+
+static void
+drm_output_destroy(struct weston_output *base);
+
+static void
+vblank_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
+	       void *data)
+{
+	struct drm_vblank_target *target = data;
+	struct drm_output *output = target->output;
+	struct drm_sprite *s = target->sprite;
+	struct timespec ts;
+	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
+			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
+
+	drm_output_update_msc(output, frame);
+	output->vblank_pending = 0;
+
+	if (s) {
+		drm_output_release_fb(output, s->current);
+		s->current = s->next;
+		s->next = NULL;
+	} else {
+		/* The frame on screen is still the last one flipped */
+		flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
+			WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
+	}
+
+	if (output->page_flip_pending || output->clone_flips_pending)
+		return;
+
+	if (output->destroy_pending)
+		drm_output_destroy(&output->base);
+	else if (output->disable_pending)
+		weston_output_disable(&output->base);
+	else {
+		ts.tv_sec = sec;
+		ts.tv_nsec = usec * 1000;
+		weston_output_finish_frame(&output->base, &ts, flags);
+	}
+}
+
+/* A clone has shown the frame of the output it mirrors, which completes
+ * that frame if the output itself is done with it, like the last event
+ * of the output would. */
+static void
+clone_flip_handler(struct drm_output *clone,
+		   unsigned int sec, unsigned int usec)
+{
+	struct drm_output *output = clone->clone_of;
+	struct timespec ts;
+
+	clone->page_flip_pending = 0;
+	if (output)
+		output->clone_flips_pending--;
+
+	if (clone->destroy_pending)
+		drm_output_destroy(&clone->base);
+	else if (clone->disable_pending)
+		weston_output_disable(&clone->base);
+
+	if (!output || output->clone_flips_pending > 0 ||
+	    output->page_flip_pending || output->vblank_pending)
+		return;
+
+	if (output->destroy_pending)
+		drm_output_destroy(&output->base);
+	else if (output->disable_pending)
+		weston_output_disable(&output->base);
+	else {
+		ts.tv_sec = sec;
+		ts.tv_nsec = usec * 1000;
+		weston_output_finish_frame(&output->base, &ts,
+					   WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
+					   WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
+					   WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK);
+	}
+}
+
+static void
+page_flip_handler(int fd, unsigned int frame,
+		  unsigned int sec, unsigned int usec, void *data)
+{
+	struct drm_output *output = data;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_sprite *s;
+	struct timespec ts;
+	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
+			 WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
+			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
+
+	WESTON_PROBE(drm_page_flip, &output->base, frame, sec, usec);
+
+	/* Only clones flip without being enabled */
+	if (!output->base.enabled) {
+		clone_flip_handler(output, sec, usec);
+		return;
+	}
+
+	drm_output_update_msc(output, frame);
+
+	/* The buffer went up mid-scanout, and the timestamp is only that of
+	 * the vblank before it */
+	if (output->page_flip_async)
+		flags = WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION;
+	output->page_flip_async = 0;
+
+	/* We don't set page_flip_pending on start_repaint_loop, in that case
+	 * we just want to page flip to the current buffer to get an accurate
+	 * timestamp */
+	if (output->page_flip_pending) {
+		drm_output_release_fb(output, output->current);
+		output->current = output->next;
+		output->next = NULL;
+
+		/* With atomic modesetting the sprites were committed along
+		 * with the primary plane, so they complete with this event
+		 * rather than with a separate vblank event. */
+		if (b->atomic_modeset) {
+			wl_list_for_each(s, &b->sprite_list, link) {
+				if (s->output != output)
+					continue;
+
+				drm_output_release_fb(output, s->current);
+				s->current = s->next;
+				s->next = NULL;
+			}
+		}
+	}
+
+	output->page_flip_pending = 0;
+
+	if (output->destroy_pending)
+		drm_output_destroy(&output->base);
+	else if (output->disable_pending)
+		weston_output_disable(&output->base);
+	else if (!output->vblank_pending && !output->clone_flips_pending) {
+		ts.tv_sec = sec;
+		ts.tv_nsec = usec * 1000;
+		weston_output_finish_frame(&output->base, &ts, flags);
+	}
+}
+
+#ifdef HAVE_DRM_ATOMIC
+static void
+atomic_flip_handler(int fd, unsigned int frame, unsigned int sec,
+		    unsigned int usec, unsigned int crtc_id, void *data)
+{
+	struct drm_backend *b = data;
+	struct drm_output *output = drm_output_find_by_crtc(b, NULL, crtc_id);
+
+	/* A single commit may flip several CRTCs; the event tells us which
+	 * one completed. Ignore CRTCs we are not driving. */
+	if (!output || (!output->base.enabled && !output->page_flip_pending))
+		return;
+
+	page_flip_handler(fd, frame, sec, usec, output);
+}
+#endif
+
+static uint32_t
+drm_output_check_sprite_format(struct drm_sprite *s,
+			       struct weston_view *ev, uint32_t format)
+{
+	uint32_t i;
+
+	if (format == GBM_FORMAT_ARGB8888) {
+		pixman_region32_t r;
+
+		pixman_region32_init_rect(&r, 0, 0,
+					  ev->surface->width,
+					  ev->surface->height);
+		pixman_region32_subtract(&r, &r, &ev->surface->opaque);
+
+		if (!pixman_region32_not_empty(&r))
+			format = GBM_FORMAT_XRGB8888;
+
+		pixman_region32_fini(&r);
+	}
+
+	for (i = 0; i < s->count_formats; i++)
+		if (s->formats[i] == format)
+			return format;
+
+	return 0;
+}
+
+static int
+drm_view_transform_supported(struct weston_view *ev)
+{
+	return !ev->transform.enabled ||
+		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
+}
+
+/* Whether the sprite can be stacked above the primary plane of the
+ * output, and the zpos that takes. Without zpos on both, the kernel
+ * keeps overlays above it. */
+static bool
+drm_sprite_overlay_supported(struct drm_output *output, struct drm_sprite *s,
+			     uint64_t *zpos)
+{
+	struct drm_sprite *primary = output->primary_plane;
+
+	*zpos = s->zpos_default;
+	if (!primary || !primary->zpos_prop || !s->zpos_prop ||
+	    s->zpos_default >= primary->zpos_default)
+		return true;
+
+	/* A plane that starts out below the primary plane */
+	if (!s->zpos_mutable)
+		return false;
+
+	*zpos = MIN(primary->zpos_default + 1, s->zpos_max);
+
+	return *zpos > primary->zpos_default;
+}
+
+/* Whether the sprite can be stacked below the primary plane of the
+ * output, and the zpos that takes */
+static bool
+drm_sprite_underlay_supported(struct drm_output *output, struct drm_sprite *s,
+			      uint64_t *zpos)
+{
+	struct drm_sprite *primary = output->primary_plane;
+
+	if (!primary || !primary->zpos_prop || !s->zpos_prop)
+		return false;
+
+	*zpos = s->zpos_mutable ? s->zpos_min : s->zpos_default;
+
+	return *zpos < primary->zpos_default;
+}
+
+/* Stack the weston_plane of the sprite below or above the primary plane,
+ * for the core to leave a hole in the primary plane for its views or
+ * not */
+static void
+drm_sprite_set_underlay(struct drm_sprite *s, bool underlay)
+{
+	struct weston_compositor *ec = s->backend->compositor;
+
+	if (s->underlay == underlay)
+		return;
+
+	s->underlay = underlay;
+	wl_list_remove(&s->plane.link);
+	if (underlay)
+		wl_list_insert(&ec->primary_plane.link, &s->plane.link);
+	else
+		weston_compositor_stack_plane(ec, &s->plane,
+					      &ec->primary_plane);
+}
+
+/**
+ * Put a view on an overlay plane, above the primary plane or below it
+ *
+ * Below the primary plane, the view shows through the transparent hole
+ * the renderer leaves in the primary plane, which needs an output format
+ * with alpha.
+ *
+ * @param output The output the view is shown on
+ * @param ev The view to put on a plane
+ * @param underlay Whether to stack the plane below the primary plane
+ * @returns The plane of the view, or NULL if no plane takes it
+ */
+static struct weston_plane *
+drm_output_prepare_overlay_view(struct drm_output *output,
+				struct weston_view *ev, bool underlay)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_backend *b = to_drm_backend(ec);
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct wl_resource *buffer_resource;
+	struct drm_sprite *s;
+	struct linux_dmabuf_buffer *dmabuf;
+	int found = 0;
+	struct gbm_bo *bo;
+	pixman_box32_t *box;
+	uint32_t format;
+	uint64_t zpos = 0;
+
+	if (b->sprites_are_broken)
+		return NULL;
+
+	/* Don't import buffers which span multiple outputs. */
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	/* We can only import GBM buffers. */
+	if (b->gbm == NULL)
+		return NULL;
+
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return NULL;
+	buffer_resource = ev->surface->buffer_ref.buffer->resource;
+	if (wl_shm_buffer_get(buffer_resource))
+		return NULL;
+
+	if (viewport->buffer.transform != output->base.transform)
+		return NULL;
+	if (!drm_view_transform_supported(ev))
+		return NULL;
+
+	if (ev->alpha != 1.0f || ev->dim > 0.0f)
+		return NULL;
+
+	/* Planes cannot clip to anything but a rectangle of the buffer */
+	if (ev->geometry.scissor_enabled)
+		return NULL;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (!drm_sprite_available(output, s))
+			continue;
+
+		if (!drm_sprite_fence_supported(s, ev->surface))
+			continue;
+
+		if (s->next)
+			continue;
+
+		if (underlay) {
+			if (!drm_sprite_underlay_supported(output, s, &zpos))
+				continue;
+		} else {
+			if (!drm_sprite_overlay_supported(output, s, &zpos))
+				continue;
+		}
+
+		found = 1;
+		break;
+	}
+
+	/* No sprites available */
+	if (!found)
+		return NULL;
+
+	if ((dmabuf = linux_dmabuf_buffer_get(buffer_resource))) {
+		format = drm_output_check_sprite_format(s, ev,
+							dmabuf->attributes.format);
+		if (format == 0)
+			return NULL;
+
+		s->next = drm_fb_get_from_dmabuf(dmabuf, b, format);
+		if (!s->next)
+			return NULL;
+	} else {
+		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
+				   buffer_resource, GBM_BO_USE_SCANOUT);
+		if (!bo)
+			return NULL;
+
+		format = drm_output_check_sprite_format(s, ev,
+							gbm_bo_get_format(bo));
+		if (format == 0) {
+			gbm_bo_destroy(bo);
+			return NULL;
+		}
+
+		s->next = drm_fb_get_from_bo(bo, b, format);
+		if (!s->next) {
+			gbm_bo_destroy(bo);
+			return NULL;
+		}
+	}
+
+	drm_fb_set_buffer(s->next, ev->surface->buffer_ref.buffer,
+			  ev->surface->buffer_release_ref.buffer_release);
+	drm_sprite_set_in_fence(s, ev->surface->acquire_fence_fd);
+
+	box = pixman_region32_extents(&ev->transform.boundingbox);
+	s->plane.x = box->x1;
+	s->plane.y = box->y1;
+	s->underlay_box = *box;
+	s->zpos = zpos;
+
+	/* The caller has called weston_view_update_transform() for us
+	 * already. */
+	drm_sprite_set_view_rects(s, output, ev);
+
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset) {
+		s->output = output;
+
+		if (drm_output_test_atomic(output, output->current) < 0) {
+			drm_output_release_fb(output, s->next);
+			s->next = NULL;
+			return NULL;
+		}
+	}
+#endif
+
+	drm_sprite_set_underlay(s, underlay);
+
+	return &s->plane;
+}
+
+static struct weston_plane *
+drm_output_prepare_cursor_view(struct drm_output *output,
+			       struct weston_view *ev)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct wl_shm_buffer *shmbuf;
+
+	if (b->cursors_are_broken)
+		return NULL;
+
+	if (output->cursor_view)
+		return NULL;
+
+	/* Don't import buffers which span multiple outputs. */
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	/* We use GBM to import SHM buffers. */
+	if (b->gbm == NULL)
+		return NULL;
+
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return NULL;
+	shmbuf = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
+	if (!shmbuf)
+		return NULL;
+	if (wl_shm_buffer_get_format(shmbuf) != WL_SHM_FORMAT_ARGB8888)
+		return NULL;
+
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return NULL;
+	if (ev->transform.enabled &&
+	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
+		return NULL;
+	if (viewport->buffer.scale != output->base.current_scale)
+		return NULL;
+	if (ev->geometry.scissor_enabled)
+		return NULL;
+
+	if (ev->surface->width > b->cursor_width ||
+	    ev->surface->height > b->cursor_height)
+		return NULL;
+
+	output->cursor_view = ev;
+
+	return &output->cursor_plane;
+}
+
+/* FNV-1a over the visible part of a cursor image */
+static uint32_t
+cursor_image_hash(const uint8_t *data, int32_t stride,
+		  int32_t width, int32_t height)
+{
+	uint32_t hash = 2166136261u;
+	int i, j;
+
+	for (i = 0; i < height; i++) {
+		for (j = 0; j < width * 4; j++) {
+			hash ^= data[i * stride + j];
+			hash *= 16777619u;
+		}
+	}
+
+	return hash;
+}
+
+static bool
+cursor_image_equal(struct drm_backend *b, struct drm_cursor *cursor,
+		   const uint8_t *data, int32_t stride,
+		   int32_t width, int32_t height)
+{
+	int i;
+
+	if (cursor->width != width || cursor->height != height)
+		return false;
+
+	for (i = 0; i < height; i++)
+		if (memcmp(cursor->image + i * b->cursor_width,
+			   data + i * stride, width * 4) != 0)
+			return false;
+
+	return true;
+}
+
+/**
+ * Find or prepare a cursor BO holding the image of a cursor surface
+ *
+ * Recently shown images stay in the output's BOs, so toolkits
+ * re-attaching the same image and animated cursors cycling through a
+ * few frames don't have to write the BO again. Otherwise the least
+ * recently used BO that isn't being scanned out is rewritten.
+ *
+ * @param output Output whose cursor plane shows the view
+ * @param ev View to use for cursor image
+ * @returns The cursor holding the image, or NULL on failure
+ */
+static struct drm_cursor *
+drm_output_get_cursor(struct drm_output *output, struct weston_view *ev)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct drm_cursor *cursor, *found = NULL, *victim = NULL;
+	size_t size = b->cursor_width * b->cursor_height * 4;
+	int32_t width = ev->surface->width;
+	int32_t height = ev->surface->height;
+	int32_t stride;
+	uint32_t hash;
+	uint8_t *data;
+	int i;
+
+	assert(buffer && buffer->shm_buffer);
+	assert(buffer->shm_buffer == wl_shm_buffer_get(buffer->resource));
+	assert(width <= b->cursor_width);
+	assert(height <= b->cursor_height);
+
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+
+	hash = cursor_image_hash(data, stride, width, height);
+
+	for (i = 0; i < DRM_CURSOR_CACHE_SIZE; i++) {
+		cursor = &output->cursors[i];
+		if (!cursor->bo)
+			continue;
+
+		if (cursor->image && cursor->hash == hash &&
+		    cursor_image_equal(b, cursor, data, stride,
+				       width, height)) {
+			found = cursor;
+			break;
+		}
+
+		if (cursor == output->current_cursor)
+			continue;
+		if (!victim || cursor->last_used < victim->last_used)
+			victim = cursor;
+	}
+
+	if (!found && victim) {
+		if (!victim->image)
+			victim->image = malloc(size);
+		if (victim->image) {
+			memset(victim->image, 0, size);
+			for (i = 0; i < height; i++)
+				memcpy(victim->image + i * b->cursor_width,
+				       data + i * stride, width * 4);
+
+			victim->width = width;
+			victim->height = height;
+			victim->hash = hash;
+			found = victim;
+
+			if (gbm_bo_write(victim->bo, victim->image, size) < 0)
+				weston_log("failed update cursor: %m\n");
+		}
+	}
+
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	if (found)
+		found->last_used = ++output->cursor_serial;
+
+	return found;
+}
+
+/* The cursor image copy of the sprite showing view, or NULL */
+static struct drm_fb *
+drm_sprite_get_cursor_fb(struct drm_sprite *s, struct weston_view *ev)
+{
+	struct drm_backend *b = s->backend;
+	struct wl_shm_buffer *shmbuf = ev->surface->buffer_ref.buffer->shm_buffer;
+	int32_t width = ev->surface->width;
+	int32_t height = ev->surface->height;
+	struct drm_fb *fb = NULL;
+	int32_t stride, row;
+	uint32_t hash;
+	uint8_t *data;
+	unsigned int i;
+
+	stride = wl_shm_buffer_get_stride(shmbuf);
+	data = wl_shm_buffer_get_data(shmbuf);
+
+	wl_shm_buffer_begin_access(shmbuf);
+
+	hash = cursor_image_hash(data, stride, width, height);
+
+	/* The one on screen can stay, the other one is rewritten */
+	for (i = 0; i < ARRAY_LENGTH(s->cursor_fbs); i++) {
+		if (s->cursor_fbs[i] &&
+		    s->cursor_fbs[i] == s->current &&
+		    s->cursor_fbs[i]->cursor_hash == hash) {
+			fb = s->cursor_fbs[i];
+			break;
+		}
+	}
+
+	for (i = 0; !fb && i < ARRAY_LENGTH(s->cursor_fbs); i++) {
+		if (s->cursor_fbs[i] && s->cursor_fbs[i] == s->current)
+			continue;
+
+		if (!s->cursor_fbs[i]) {
+			s->cursor_fbs[i] =
+				drm_fb_create_dumb(b, b->drm.fd,
+						   b->cursor_width,
+						   b->cursor_height,
+						   GBM_FORMAT_ARGB8888);
+			if (!s->cursor_fbs[i])
+				break;
+			s->cursor_fbs[i]->sprite_cursor = 1;
+			s->cursor_fbs[i]->cursor_hash = ~hash;
+		}
+
+		fb = s->cursor_fbs[i];
+		if (fb->cursor_hash != hash) {
+			memset(fb->map, 0, fb->size);
+			for (row = 0; row < height; row++)
+				memcpy((uint8_t *) fb->map + row * fb->stride,
+				       data + row * stride, width * 4);
+			fb->cursor_hash = hash;
+		}
+	}
+
+	wl_shm_buffer_end_access(shmbuf);
+
+	return fb;
+}
+
+/**
+ * Show the cursor of a further seat on an overlay plane
+ *
+ * There is only one cursor plane per CRTC, which goes to the topmost
+ * pointer. The pointers of other seats can still stay off the primary
+ * plane, so that moving them does not recomposite, by copying their
+ * image into a small buffer of a free overlay plane, like for the
+ * cursor plane.
+ *
+ * @param output The output the view is shown on
+ * @param ev The cursor view
+ * @returns The plane of the view, or NULL if no plane takes it
+ */
+static struct weston_plane *
+drm_output_prepare_cursor_sprite_view(struct drm_output *output,
+				      struct weston_view *ev)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct drm_sprite *s;
+	struct drm_fb *fb;
+	pixman_box32_t *box;
+	uint64_t zpos = 0;
+	int found = 0;
+
+	if (b->sprites_are_broken)
+		return NULL;
+
+	if (!ev->layer_link.layer ||
+	    ev->layer_link.layer->position != WESTON_LAYER_POSITION_CURSOR)
+		return NULL;
+
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	if (!buffer || !buffer->shm_buffer ||
+	    wl_shm_buffer_get_format(buffer->shm_buffer) !=
+	    WL_SHM_FORMAT_ARGB8888)
+		return NULL;
+
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return NULL;
+	if (ev->transform.enabled &&
+	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
+		return NULL;
+	if (viewport->buffer.scale != output->base.current_scale)
+		return NULL;
+	if (ev->geometry.scissor_enabled)
+		return NULL;
+	if (ev->alpha != 1.0f || ev->dim > 0.0f)
+		return NULL;
+
+	if (ev->surface->width > b->cursor_width ||
+	    ev->surface->height > b->cursor_height)
+		return NULL;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (!drm_sprite_available(output, s) || s->next)
+			continue;
+
+		if (!drm_sprite_overlay_supported(output, s, &zpos))
+			continue;
+
+		if (drm_output_check_sprite_format(s, ev,
+						   GBM_FORMAT_ARGB8888) == 0)
+			continue;
+
+		found = 1;
+		break;
+	}
+
+	if (!found)
+		return NULL;
+
+	fb = drm_sprite_get_cursor_fb(s, ev);
+	if (!fb)
+		return NULL;
+	s->next = fb;
+
+	box = pixman_region32_extents(&ev->transform.boundingbox);
+	s->plane.x = box->x1;
+	s->plane.y = box->y1;
+	s->underlay_box = *box;
+	s->zpos = zpos;
+
+	drm_sprite_set_view_rects(s, output, ev);
+
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset) {
+		s->output = output;
+
+		if (drm_output_test_atomic(output, output->current) < 0) {
+			s->next = NULL;
+			return NULL;
+		}
+	}
+#endif
+
+	drm_sprite_set_underlay(s, false);
+
+	return &s->plane;
+}
+
+static int
+drm_output_move_cursor(struct drm_output *output, struct weston_view *ev)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	float x, y;
+
+	weston_view_to_global_float(ev, 0, 0, &x, &y);
+
+	/* From global to output space, output transform is guaranteed to be
+	 * NORMAL by drm_output_prepare_cursor_view().
+	 */
+	x = (x - output->base.x) * output->base.current_scale;
+	y = (y - output->base.y) * output->base.current_scale;
+
+	if (output->cursor_plane.x != x || output->cursor_plane.y != y) {
+		if (drmModeMoveCursor(drm_output_fd(output), output->crtc_id,
+				      x, y)) {
+			weston_log("failed to move cursor: %m\n");
+			b->cursors_are_broken = 1;
+			return -1;
+		}
+
+		output->cursor_plane.x = x;
+		output->cursor_plane.y = y;
+	}
+
+	return 0;
+}
+
+static void
+drm_output_set_cursor(struct drm_output *output)
+{
+	struct weston_view *ev = output->cursor_view;
+	struct weston_buffer *buffer;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_cursor *cursor;
+	EGLint handle;
+
+	output->cursor_view = NULL;
+	if (ev == NULL) {
+		drmModeSetCursor(drm_output_fd(output), output->crtc_id, 0, 0, 0);
+		output->current_cursor = NULL;
+		output->cursor_plane.x = INT32_MIN;
+		output->cursor_plane.y = INT32_MIN;
+		return;
+	}
+
+	buffer = ev->surface->buffer_ref.buffer;
+
+	if (buffer &&
+	    (pixman_region32_not_empty(&output->cursor_plane.damage) ||
+	     !output->current_cursor)) {
+		pixman_region32_fini(&output->cursor_plane.damage);
+		pixman_region32_init(&output->cursor_plane.damage);
+
+		cursor = drm_output_get_cursor(output, ev);
+		if (cursor && cursor != output->current_cursor) {
+			handle = gbm_bo_get_handle(cursor->bo).s32;
+			if (drmModeSetCursor(drm_output_fd(output),
+					     output->crtc_id, handle,
+					     b->cursor_width,
+					     b->cursor_height)) {
+				weston_log("failed to set cursor: %m\n");
+				b->cursors_are_broken = 1;
+			}
+			output->current_cursor = cursor;
+		}
+	}
+
+	drm_output_move_cursor(output, ev);
+}
+
+/**
+ * Move the hardware cursor without repainting
+ *
+ * Called when the pointer sprite moves while it sits on the output's
+ * cursor plane and its image has not changed, so only the CRTC's
+ * cursor position needs updating.
+ *
+ * @param output_base Output whose cursor plane shows the view
+ * @param ev The cursor view
+ * @returns 0 on success, -1 if the view has to be repainted instead
+ */
+static int
+drm_output_move_plane(struct weston_output *output_base,
+		      struct weston_view *ev)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *b = to_drm_backend(output_base->compositor);
+
+	if (ev->plane != &output->cursor_plane || b->cursors_are_broken ||
+	    !output_base->compositor->session_active)
+		return -1;
+
+	return drm_output_move_cursor(output, ev);
+}
+
+/* Weight for drm_view_plane_score() */
+#define DRM_PLANE_SCORE_OPAQUE_WEIGHT 2
+/* An output which has not repainted for this long competes for no plane */
+#define DRM_PLANE_DEMAND_TIMEOUT_NSEC 1000000000LL
+/* How much more another output must offload to take a plane away */
+#define DRM_PLANE_SHARE_HYSTERESIS 2
+
+/**
+ * A view which could take a hardware overlay plane
+ *
+ * Collected in stacking order by drm_assign_planes() before any view is
+ * placed, so that a view can give up a scarce overlay to a more valuable
+ * view further down the stack.
+ */
+struct drm_plane_candidate {
+	struct weston_view *view;
+	uint64_t score;
+	pixman_box32_t box;
+};
+
+/**
+ * Estimate the composition bandwidth saved by putting a view on a plane
+ *
+ * The renderer has to redraw the area of the view every time the view
+ * is damaged, and also whatever is visible through it. Static views are
+ * cheap to composite thanks to damage tracking, so the score is the area
+ * multiplied by the current update rate of the surface, see
+ * weston_surface_get_commit_rate(). Fully opaque views score higher since
+ * lifting them also saves blending against the views below.
+ *
+ * @param output The output the planes are assigned for
+ * @param ev The view to score
+ * @param now The current time in the presentation clock domain
+ * @returns A score, in weighted pixels per second; higher is more valuable
+ */
+static uint64_t
+drm_view_plane_score(struct drm_output *output, struct weston_view *ev,
+		     const struct timespec *now)
+{
+	struct weston_surface *es = ev->surface;
+	pixman_box32_t surface_box = { 0, 0, es->width, es->height };
+	pixman_region32_t r;
+	pixman_box32_t *box;
+	uint64_t score;
+
+	pixman_region32_init(&r);
+	pixman_region32_intersect(&r, &ev->transform.boundingbox,
+				  &output->base.region);
+	box = pixman_region32_extents(&r);
+	score = (uint64_t) (box->x2 - box->x1) * (box->y2 - box->y1);
+	pixman_region32_fini(&r);
+
+	/* Static views still count for their area, to break ties. */
+	score *= 1 + weston_surface_get_commit_rate(es, now) / 1000;
+
+	if (pixman_region32_contains_rectangle(&es->opaque,
+					       &surface_box) == PIXMAN_REGION_IN)
+		score *= DRM_PLANE_SCORE_OPAQUE_WEIGHT;
+
+	return score;
+}
+
+/* Remember the best candidate scores, for the outputs to compete with */
+static void
+drm_output_record_plane_demand(struct drm_output *output, uint64_t score)
+{
+	int i;
+
+	for (i = output->plane_demand_count; i > 0; i--) {
+		if (output->plane_demand[i - 1] >= score)
+			break;
+		if (i < DRM_PLANE_DEMAND_MAX)
+			output->plane_demand[i] = output->plane_demand[i - 1];
+	}
+
+	if (i < DRM_PLANE_DEMAND_MAX)
+		output->plane_demand[i] = score;
+	if (output->plane_demand_count < DRM_PLANE_DEMAND_MAX)
+		output->plane_demand_count++;
+}
+
+/**
+ * Collect the views which may end up on an overlay plane
+ *
+ * This mirrors the cheap rejection tests of
+ * drm_output_prepare_overlay_view(); the expensive ones (buffer import,
+ * format support) are left for the actual assignment. The best scores
+ * are also kept as the demand of the output for shared planes.
+ *
+ * @param output The output to collect candidates for
+ * @param now The current time in the presentation clock domain
+ */
+static void
+drm_output_collect_plane_candidates(struct drm_output *output,
+				    const struct timespec *now)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane_candidate *c;
+	struct weston_view *ev;
+	struct drm_sprite *s;
+	bool supported = false;
+
+	output->plane_candidates.size = 0;
+	output->plane_demand_count = 0;
+	output->plane_demand_time = *now;
+
+	if (b->sprites_are_broken || b->gbm == NULL)
+		return;
+
+	wl_list_for_each(s, &b->sprite_list, link)
+		if (drm_sprite_crtc_supported(output, s))
+			supported = true;
+
+	if (!supported)
+		return;
+
+	wl_list_for_each(ev, &output->base.compositor->view_list, link) {
+		struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+
+		if (ev->output_mask != (1u << output->base.id))
+			continue;
+		if (!buffer || wl_shm_buffer_get(buffer->resource))
+			continue;
+		if (ev->alpha != 1.0f || ev->dim > 0.0f)
+			continue;
+
+		c = wl_array_add(&output->plane_candidates, sizeof *c);
+		if (!c)
+			return;
+
+		c->view = ev;
+		c->score = drm_view_plane_score(output, ev, now);
+		c->box = *pixman_region32_extents(&ev->transform.boundingbox);
+		drm_output_record_plane_demand(output, c->score);
+	}
+}
+
+/* Whether an output currently competes for overlay planes */
+static bool
+drm_output_wants_planes(struct drm_output *output,
+			const struct timespec *now)
+{
+	return !output->secondary && !output->base.disable_planes &&
+	       !output->disable_pending && !output->destroy_pending &&
+	       output->plane_demand_taken < output->plane_demand_count &&
+	       timespec_sub_to_nsec(now, &output->plane_demand_time) <
+	       DRM_PLANE_DEMAND_TIMEOUT_NSEC;
+}
+
+/**
+ * Share the overlay planes between the outputs
+ *
+ * Planes usable on several CRTCs would otherwise go to whichever output
+ * repaints first, and stay there. Instead, the planes are handed out to
+ * the best candidates of all outputs, by the scores of
+ * drm_view_plane_score(): the output with the most composition work to
+ * offload gets the most planes. An output keeps the planes it already
+ * has unless another one scores DRM_PLANE_SHARE_HYSTERESIS times more,
+ * so that planes do not flap between outputs, and an output which has
+ * not repainted for a while wants none.
+ *
+ * A plane handed to another output is only free once the output it is
+ * on has repainted without it, so that output is scheduled for a
+ * repaint. Planes no output wants are left to any output.
+ *
+ * @param b The backend
+ * @param repainting The output in the middle of assigning its planes
+ * @param now The current time in the presentation clock domain
+ */
+static void
+drm_backend_share_sprites(struct drm_backend *b,
+			  struct drm_output *repainting,
+			  const struct timespec *now)
+{
+	struct weston_output *base;
+	struct drm_output *output, *best_output;
+	struct drm_sprite *s, *best_sprite;
+	uint64_t score, best;
+
+	wl_list_for_each(s, &b->sprite_list, link)
+		s->share_output = NULL;
+	wl_list_for_each(base, &b->compositor->output_list, link)
+		to_drm_output(base)->plane_demand_taken = 0;
+
+	do {
+		best = 0;
+		best_output = NULL;
+		best_sprite = NULL;
+
+		wl_list_for_each(base, &b->compositor->output_list, link) {
+			output = to_drm_output(base);
+			if (!drm_output_wants_planes(output, now))
+				continue;
+
+			wl_list_for_each(s, &b->sprite_list, link) {
+				if (s->share_output ||
+				    !drm_sprite_crtc_supported(output, s))
+					continue;
+
+				score = output->plane_demand[
+					output->plane_demand_taken];
+				if (s->reserved == output ||
+				    ((s->current || s->next) &&
+				     s->output == output))
+					score *= DRM_PLANE_SHARE_HYSTERESIS;
+
+				if (score > best) {
+					best = score;
+					best_output = output;
+					best_sprite = s;
+				}
+			}
+		}
+
+		if (best_sprite) {
+			best_sprite->share_output = best_output;
+			best_output->plane_demand_taken++;
+		}
+	} while (best_sprite);
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->share_output && s->share_output != s->reserved &&
+		    (s->current || s->next) && s->output &&
+		    s->output != s->share_output && s->output != repainting)
+			weston_output_schedule_repaint(&s->output->base);
+
+		s->reserved = s->share_output;
+	}
+}
+
+/* Number of overlay planes the output may still put views on */
+static int
+drm_output_count_free_sprites(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_sprite *s;
+	int free_sprites = 0;
+
+	if (b->sprites_are_broken || b->gbm == NULL)
+		return 0;
+
+	wl_list_for_each(s, &b->sprite_list, link)
+		if (drm_sprite_available(output, s) && !s->next)
+			free_sprites++;
+
+	return free_sprites;
+}
+
+static struct drm_plane_candidate *
+drm_output_find_plane_candidate(struct drm_output *output,
+				struct weston_view *ev)
+{
+	struct drm_plane_candidate *c;
+
+	wl_array_for_each(c, &output->plane_candidates)
+		if (c->view == ev)
+			return c;
+
+	return NULL;
+}
+
+static bool
+box_intersects(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+	       a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/**
+ * Decide whether a view should leave the overlay planes to others
+ *
+ * Counts the candidates further down the stack which score higher than
+ * this one and could still use a plane: they are not already forced
+ * onto the primary plane by something composited above them, and they
+ * do not sit below this view (compositing this view on the primary plane
+ * would force them there too). If those alone would use up the free
+ * planes, this view is better composited.
+ *
+ * @param output The output the planes are assigned for
+ * @param cand The candidate entry of the view being placed
+ * @param overlap Region of the views placed on the primary plane so far
+ * @param free_sprites Number of overlay planes still free
+ * @returns True if the view should go to the primary plane
+ */
+static bool
+drm_output_plane_candidate_yields(struct drm_output *output,
+				  struct drm_plane_candidate *cand,
+				  pixman_region32_t *overlap,
+				  int free_sprites)
+{
+	struct drm_plane_candidate *c;
+	int better = 0;
+
+	for (c = cand + 1;
+	     (char *) c < (char *) output->plane_candidates.data +
+			  output->plane_candidates.size;
+	     c++) {
+		if (c->score <= cand->score)
+			continue;
+		if (box_intersects(&c->box, &cand->box))
+			continue;
+		if (pixman_region32_contains_rectangle(overlap, &c->box) !=
+		    PIXMAN_REGION_OUT)
+			continue;
+
+		if (++better >= free_sprites)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Decide whether a view composited over by the primary plane may go below it
+ *
+ * The renderer clears the area of such a view to transparent in the
+ * primary plane, hiding whatever is composited below the view, so only
+ * opaque views qualify. Underlays do not overlap each other, as nothing
+ * orders them among themselves.
+ *
+ * @param output The output the planes are assigned for
+ * @param ev The view overlapping views on the primary plane
+ * @param underlays Region of the views placed below the primary plane
+ * so far
+ * @returns True if the view may try a plane below the primary plane
+ */
+static bool
+drm_output_underlay_allowed(struct drm_output *output, struct weston_view *ev,
+			    pixman_region32_t *underlays)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	pixman_box32_t *box =
+		pixman_region32_extents(&ev->transform.boundingbox);
+
+	if (!b->atomic_modeset || b->use_pixman ||
+	    output->gbm_format != GBM_FORMAT_ARGB8888)
+		return false;
+
+	if (!output->primary_plane || !output->primary_plane->zpos_prop)
+		return false;
+
+	if (pixman_region32_contains_rectangle(&ev->transform.opaque,
+					       box) != PIXMAN_REGION_IN)
+		return false;
+
+	return pixman_region32_contains_rectangle(underlays, box) ==
+		PIXMAN_REGION_OUT;
+}
+
+/* The primary plane has to be repainted wherever an underlay hole shows
+ * up, moves or goes away. A view moving between planes damages only the
+ * plane it leaves, which does not cover all of those. */
+static void
+drm_output_damage_underlay_holes(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	pixman_region32_t *damage =
+		&output->base.compositor->primary_plane.damage;
+	struct drm_sprite *s;
+	bool hole;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		hole = s->next && s->underlay;
+		if (hole == s->hole &&
+		    (!hole || memcmp(&s->hole_box, &s->underlay_box,
+				     sizeof s->hole_box) == 0))
+			continue;
+
+		if (s->hole)
+			pixman_region32_union_rect(damage, damage,
+				s->hole_box.x1, s->hole_box.y1,
+				s->hole_box.x2 - s->hole_box.x1,
+				s->hole_box.y2 - s->hole_box.y1);
+		if (hole)
+			pixman_region32_union_rect(damage, damage,
+				s->underlay_box.x1, s->underlay_box.y1,
+				s->underlay_box.x2 - s->underlay_box.x1,
+				s->underlay_box.y2 - s->underlay_box.y1);
+
+		s->hole = hole;
+		s->hole_box = s->underlay_box;
+	}
+}
+
+/* Outputs on a secondary device show nothing but what the render GPU
+ * composites, so every view goes to the primary plane. */
+static void
+drm_assign_planes_secondary(struct weston_output *output_base)
+{
+	struct drm_backend *b = to_drm_backend(output_base->compositor);
+	struct weston_plane *primary = &output_base->compositor->primary_plane;
+	struct weston_view *ev;
+
+	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
+		/* Views also on other outputs are placed by those */
+		if (ev->output_mask != (1u << output_base->id))
+			continue;
+
+		ev->surface->keep_buffer = b->use_pixman &&
+			!b->compositor->pixman_early_release;
+		weston_view_move_to_plane(ev, primary);
+		ev->psf_flags = 0;
+		ev->plane_miss = WESTON_PLANE_MISS_DISABLED;
+	}
+}
+
+static void
+drm_assign_planes(struct weston_output *output_base)
+{
+	struct drm_backend *b = to_drm_backend(output_base->compositor);
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_plane_candidate *cand;
+	struct weston_view *ev, *next;
+	pixman_region32_t overlap, surface_overlap, underlays;
+	struct weston_plane *primary, *next_plane;
+	const char *reason;
+	enum weston_plane_miss miss;
+	struct timespec now;
+	int free_sprites;
+	bool log, underlay, cursor_sprite;
+
+	/*
+	 * Find a surface for each sprite in the output using some heuristics:
+	 * 1) size
+	 * 2) frequency of update
+	 * 3) opacity (though some hw might support alpha blending)
+	 * 4) clipping (this can be fixed with color keys)
+	 *
+	 * The idea is to save on blitting since this should save power.
+	 * If we can get a large video surface on the sprite for example,
+	 * the main display surface may not need to update at all, and
+	 * the client buffer can be used directly for the sprite surface
+	 * as we do for flipping full screen surfaces.
+	 *
+	 * The first three are folded into a score per view, see
+	 * drm_view_plane_score(). Views are still placed in stacking order,
+	 * but a view passes on the overlay planes when enough higher scoring
+	 * views below it could use them.
+	 *
+	 * An opaque view that the primary plane composites over can still
+	 * go on a plane below the primary plane, showing through a hole in
+	 * it, when the output format has alpha and the planes have zpos.
+	 */
+	pixman_region32_init(&overlap);
+	pixman_region32_init(&underlays);
+	primary = &output_base->compositor->primary_plane;
+	weston_compositor_read_presentation_clock(output_base->compositor, &now);
+	drm_output_collect_plane_candidates(output, &now);
+	drm_backend_share_sprites(b, output, &now);
+	free_sprites = drm_output_count_free_sprites(output);
+	log = weston_log_scope_is_enabled(b->planes_scope,
+					  WESTON_LOG_LEVEL_DEBUG);
+
+	wl_list_for_each_safe(ev, next, &output_base->compositor->view_list, link) {
+		struct weston_surface *es = ev->surface;
+
+		/* Test whether this buffer can ever go into a plane:
+		 * non-shm, or small enough to be a cursor.
+		 *
+		 * Also, keep a reference when using the pixman renderer.
+		 * That makes it possible to do a seamless switch to the GL
+		 * renderer and since the pixman renderer keeps a reference
+		 * to the buffer anyway, there is no side effects. Unless
+		 * it releases buffers early, when holding on to them
+		 * would defeat the point.
+		 */
+		if ((b->use_pixman && !b->compositor->pixman_early_release) ||
+		    (es->buffer_ref.buffer &&
+		    (!wl_shm_buffer_get(es->buffer_ref.buffer->resource) ||
+		     (ev->surface->width <= b->cursor_width &&
+		      ev->surface->height <= b->cursor_height))))
+			es->keep_buffer = true;
+		else
+			es->keep_buffer = false;
+
+		pixman_region32_init(&surface_overlap);
+		pixman_region32_intersect(&surface_overlap, &overlap,
+					  &ev->transform.boundingbox);
+
+		next_plane = NULL;
+		underlay = false;
+		cursor_sprite = false;
+		reason = "no plane takes it";
+		miss = WESTON_PLANE_MISS_NO_PLANE;
+		if (pixman_region32_not_empty(&surface_overlap)) {
+			underlay = drm_output_underlay_allowed(output, ev,
+							       &underlays);
+			if (!underlay)
+				next_plane = primary;
+			reason = "overlaps a view on the primary plane";
+			miss = WESTON_PLANE_MISS_OVERLAP;
+		}
+		if (next_plane == NULL && !underlay)
+			next_plane = drm_output_prepare_cursor_view(output, ev);
+		if (next_plane == NULL && !underlay && free_sprites > 0) {
+			next_plane = drm_output_prepare_cursor_sprite_view(output,
+									   ev);
+			if (next_plane) {
+				free_sprites--;
+				cursor_sprite = true;
+			}
+		}
+		if (next_plane == NULL && !underlay)
+			next_plane = drm_output_prepare_solid_view(output, ev);
+		if (next_plane == NULL && !underlay)
+			next_plane = drm_output_prepare_scanout_view(output, ev);
+		if (next_plane == NULL && free_sprites > 0) {
+			cand = drm_output_find_plane_candidate(output, ev);
+			if (cand &&
+			    !drm_output_plane_candidate_yields(output, cand,
+							       &overlap,
+							       free_sprites))
+				next_plane = drm_output_prepare_overlay_view(output,
+									     ev,
+									     underlay);
+			else if (cand) {
+				reason = "yields to higher scoring views";
+				miss = WESTON_PLANE_MISS_YIELDED;
+			}
+			if (next_plane)
+				free_sprites--;
+		}
+		if (next_plane == NULL)
+			next_plane = primary;
+		weston_view_move_to_plane(ev, next_plane);
+		ev->plane_miss = next_plane == primary ?
+			miss : WESTON_PLANE_MISS_NONE;
+
+		if (next_plane == &output->cursor_plane || cursor_sprite)
+			output_base->stats.cursor_views++;
+		else if (next_plane == &output->fb_plane)
+			output_base->stats.scanout_views++;
+		else if (next_plane != primary)
+			output_base->stats.overlay_views++;
+
+		/* The hole of an underlay hides what is below it as well */
+		underlay = underlay && next_plane != primary;
+		if (next_plane == primary || underlay)
+			pixman_region32_union(&overlap, &overlap,
+					      &ev->transform.boundingbox);
+		if (underlay)
+			pixman_region32_union(&underlays, &underlays,
+					      &ev->transform.boundingbox);
+
+		if (log)
+			weston_log_scope_printf(b->planes_scope,
+						WESTON_LOG_LEVEL_DEBUG,
+						"output %s: view %p: %s%s%s\n",
+						output_base->name, ev,
+						next_plane == &output->cursor_plane ?
+						"cursor" :
+						cursor_sprite ? "cursor overlay" :
+						next_plane == &output->fb_plane ?
+						"scanout" :
+						underlay ? "underlay" :
+						next_plane != primary ?
+						"overlay" : "primary",
+						next_plane == primary ? ", " : "",
+						next_plane == primary ? reason : "");
+
+		if (next_plane == primary ||
+		    next_plane == &output->cursor_plane || cursor_sprite) {
+			/* cursor planes involve a copy */
+			ev->psf_flags = 0;
+		} else {
+			/* All other planes are a direct scanout of a
+			 * single client buffer.
+			 */
+			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+		}
+
+		pixman_region32_fini(&surface_overlap);
+	}
+	pixman_region32_fini(&underlays);
+	pixman_region32_fini(&overlap);
+
+	drm_output_damage_underlay_holes(output);
+}
+
+/**
+ * Find the closest-matching mode for a given target
+ *
+ * Given a target mode, find the most suitable mode amongst the output's
+ * current mode list to use, preferring the current mode if possible, to
+ * avoid an expensive mode switch.
+ *
+ * @param output DRM output
+ * @param target_mode Mode to attempt to match
+ * @returns Pointer to a mode from the output's mode list
+ */
+static struct drm_mode *
+choose_mode (struct drm_output *output, struct weston_mode *target_mode)
+{
+	struct drm_mode *tmp_mode = NULL, *mode;
+
+	if (output->base.current_mode->width == target_mode->width &&
+	    output->base.current_mode->height == target_mode->height &&
+	    (output->base.current_mode->refresh == target_mode->refresh ||
+	     target_mode->refresh == 0))
+		return (struct drm_mode *)output->base.current_mode;
+
+	wl_list_for_each(mode, &output->base.mode_list, base.link) {
+		if (mode->mode_info.hdisplay == target_mode->width &&
+		    mode->mode_info.vdisplay == target_mode->height) {
+			if (mode->base.refresh == target_mode->refresh ||
+			    target_mode->refresh == 0) {
+				return mode;
+			} else if (!tmp_mode)
+				tmp_mode = mode;
+		}
+	}
+
+	return tmp_mode;
+}
+
+static int
+drm_output_init_egl(struct drm_output *output, struct drm_backend *b);
+static void
+drm_output_fini_egl(struct drm_output *output);
+static int
+drm_output_init_pixman(struct drm_output *output, struct drm_backend *b);
+static void
+drm_output_fini_pixman(struct drm_output *output);
+
+static int
+drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mode)
+{
+	struct drm_output *output;
+	struct drm_mode *drm_mode;
+	struct drm_backend *b;
+
+	if (output_base == NULL) {
+		weston_log("output is NULL.\n");
+		return -1;
+	}
+
+	if (mode == NULL) {
+		weston_log("mode is NULL.\n");
+		return -1;
+	}
+
+	b = to_drm_backend(output_base->compositor);
+	output = to_drm_output(output_base);
+	drm_mode  = choose_mode (output, mode);
+
+	if (!drm_mode) {
+		weston_log("%s, invalid resolution:%dx%d\n", __func__, mode->width, mode->height);
+		return -1;
+	}
+
+	if (&drm_mode->base == output->base.current_mode)
+		return 0;
+
+	output->base.current_mode->flags = 0;
+
+	output->base.current_mode = &drm_mode->base;
+	output->base.current_mode->flags =
+		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
+
+	/* reset rendering stuff. */
+	drm_output_release_fb(output, output->current);
+	drm_output_release_fb(output, output->next);
+	output->current = output->next = NULL;
+
+	if (b->use_pixman) {
+		drm_output_fini_pixman(output);
+		if (drm_output_init_pixman(output, b) < 0) {
+			weston_log("failed to init output pixman state with "
+				   "new mode\n");
+			return -1;
+		}
+	} else {
+		drm_output_fini_egl(output);
+		if (drm_output_init_egl(output, b) < 0) {
+			weston_log("failed to init output egl state with "
+				   "new mode");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+on_drm_input(int fd, uint32_t mask, void *data)
+{
+#ifdef HAVE_DRM_ATOMIC
+	struct drm_backend *b = data;
+#endif
+	drmEventContext evctx;
+
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.page_flip_handler = page_flip_handler;
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset)
+		evctx.page_flip_handler2 = atomic_flip_handler;
+#endif
+	evctx.vblank_handler = vblank_handler;
+	drmHandleEvent(fd, &evctx);
+
+	return 1;
+}
+
+/* Secondary devices are only ever driven with legacy KMS, whose events
+ * carry the output as user data. */
+static int
+on_drm_secondary_input(int fd, uint32_t mask, void *data)
+{
+	drmEventContext evctx;
+
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.page_flip_handler = page_flip_handler;
+	evctx.vblank_handler = vblank_handler;
+	drmHandleEvent(fd, &evctx);
+
+	return 1;
+}
+
+static int
+init_drm(struct drm_backend *b, struct udev_device *device)
+{
+	const char *filename, *sysnum;
+	uint64_t cap;
+	int fd, ret;
+	clockid_t clk_id;
+
+	sysnum = udev_device_get_sysnum(device);
+	if (sysnum)
+		b->drm.id = atoi(sysnum);
+	if (!sysnum || b->drm.id < 0) {
+		weston_log("cannot get device sysnum\n");
+		return -1;
+	}
+
+	filename = udev_device_get_devnode(device);
+	fd = weston_launcher_open(b->compositor->launcher, filename, O_RDWR);
+	if (fd < 0) {
+		/* Probably permissions error */
+		weston_log("couldn't open %s, skipping\n",
+			udev_device_get_devnode(device));
+		return -1;
+	}
+
+	weston_log("using %s\n", filename);
+
+	b->drm.fd = fd;
+	b->drm.filename = strdup(filename);
+
+	ret = drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap);
+	if (ret == 0 && cap == 1)
+		clk_id = CLOCK_MONOTONIC;
+	else
+		clk_id = CLOCK_REALTIME;
+
+	if (weston_compositor_set_presentation_clock(b->compositor, clk_id) < 0) {
+		weston_log("Error: failed to set presentation clock %d.\n",
+			   clk_id);
+		return -1;
+	}
+
+#ifdef HAVE_DRM_ATOMIC
+	/* Flip events of a commit spanning several CRTCs can only be told
+	 * apart if the kernel reports the CRTC in the event. */
+	ret = drmGetCap(fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &cap);
+	if (ret != 0 || cap != 1)
+		ret = -1;
+	if (ret == 0 && !getenv("WESTON_DISABLE_ATOMIC")) {
+		ret = drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+		if (ret == 0)
+			ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+		if (ret == 0)
+			b->atomic_modeset = 1;
+		else
+			drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+	}
+#endif
+	weston_log("DRM: %s atomic modesetting\n",
+		   b->atomic_modeset ? "supports" : "does not support");
+
+	ret = drmGetCap(fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap);
+	b->async_page_flip = ret == 0 && cap == 1;
+
+	ret = drmGetCap(fd, DRM_CAP_ADDFB2_MODIFIERS, &cap);
+	b->fb_modifiers = ret == 0 && cap == 1;
+
+	ret = drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &cap);
+	if (ret == 0)
+		b->cursor_width = cap;
+	else
+		b->cursor_width = 64;
+
+	ret = drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &cap);
+	if (ret == 0)
+		b->cursor_height = cap;
+	else
+		b->cursor_height = 64;
+
+	return 0;
+}
+
+static struct gbm_device *
+create_gbm_device(int fd)
+{
+	struct gbm_device *gbm;
+
+	gl_renderer = weston_load_module("gl-renderer.so",
+					 "gl_renderer_interface");
+	if (!gl_renderer)
+		return NULL;
+
+	/* GBM will load a dri driver, but even though they need symbols from
+	 * libglapi, in some version of Mesa they are not linked to it. Since
+	 * only the gl-renderer module links to it, the call above won't make
+	 * these symbols globally available, and loading the DRI driver fails.
+	 * Workaround this by dlopen()'ing libglapi with RTLD_GLOBAL. */
+	dlopen("libglapi.so.0", RTLD_LAZY | RTLD_GLOBAL);
+
+	gbm = gbm_create_device(fd);
+
+	return gbm;
+}
+
+/* When initializing EGL, if the preferred buffer format isn't available
+ * we may be able to substitute an ARGB format for an XRGB one.
+ *
+ * This returns 0 if substitution isn't possible, but 0 might be a
+ * legitimate format for other EGL platforms, so the caller is
+ * responsible for checking for 0 before calling gl_renderer->create().
+ *
+ * This works around https://bugs.freedesktop.org/show_bug.cgi?id=89689
+ * but it's entirely possible we'll see this again on other implementations.
+ */
+static int
+fallback_format_for(uint32_t format)
+{
+	switch (format) {
+	case GBM_FORMAT_XRGB8888:
+		return GBM_FORMAT_ARGB8888;
+	case GBM_FORMAT_XRGB2101010:
+		return GBM_FORMAT_ARGB2101010;
+	default:
+		return 0;
+	}
+}
+
+static int
+drm_backend_create_gl_renderer(struct drm_backend *b)
+{
+	EGLint format[3] = {
+		b->gbm_format,
+		fallback_format_for(b->gbm_format),
+		0,
+	};
+	int n_formats = 2;
+
+	if (format[1])
+		n_formats = 3;
+	if (gl_renderer->display_create(b->compositor,
+					EGL_PLATFORM_GBM_KHR,
+					(void *)b->gbm,
+					NULL,
+					gl_renderer->opaque_attribs,
+					format,
+					n_formats) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+init_egl(struct drm_backend *b)
+{
+	b->gbm = create_gbm_device(b->drm.fd);
+
+	if (!b->gbm)
+		return -1;
+
+	if (drm_backend_create_gl_renderer(b) < 0) {
+		gbm_device_destroy(b->gbm);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+init_pixman(struct drm_backend *b)
+{
+	return pixman_renderer_init(b->compositor);
+}
+
+/**
+ * Add a mode to output's mode list
+ *
+ * Copy the supplied DRM mode into a Weston mode structure, and add it to the
+ * output's mode list.
+ *
+ * @param output DRM output to add mode to
+ * @param info DRM mode structure to add
+ * @returns Newly-allocated Weston/DRM mode structure
+ */
+static struct drm_mode *
+drm_output_add_mode(struct drm_output *output, const drmModeModeInfo *info)
+{
+	struct drm_mode *mode;
+	uint64_t refresh;
+
+	mode = malloc(sizeof *mode);
+	if (mode == NULL)
+		return NULL;
+
+	mode->base.flags = 0;
+	mode->blob_id = 0;
+	mode->base.width = info->hdisplay;
+	mode->base.height = info->vdisplay;
+
+	/* Calculate higher precision (mHz) refresh rate */
+	refresh = (info->clock * 1000000LL / info->htotal +
+		   info->vtotal / 2) / info->vtotal;
+
+	if (info->flags & DRM_MODE_FLAG_INTERLACE)
+		refresh *= 2;
+	if (info->flags & DRM_MODE_FLAG_DBLSCAN)
+		refresh /= 2;
+	if (info->vscan > 1)
+	    refresh /= info->vscan;
+
+	mode->base.refresh = refresh;
+	mode->mode_info = *info;
+
+	if (info->type & DRM_MODE_TYPE_PREFERRED)
+		mode->base.flags |= WL_OUTPUT_MODE_PREFERRED;
+
+	wl_list_insert(output->base.mode_list.prev, &mode->base.link);
+
+	return mode;
+}
+
+static int
+drm_subpixel_to_wayland(int drm_value)
+{
+	switch (drm_value) {
+	default:
+	case DRM_MODE_SUBPIXEL_UNKNOWN:
+		return WL_OUTPUT_SUBPIXEL_UNKNOWN;
+	case DRM_MODE_SUBPIXEL_NONE:
+		return WL_OUTPUT_SUBPIXEL_NONE;
+	case DRM_MODE_SUBPIXEL_HORIZONTAL_RGB:
+		return WL_OUTPUT_SUBPIXEL_HORIZONTAL_RGB;
+	case DRM_MODE_SUBPIXEL_HORIZONTAL_BGR:
+		return WL_OUTPUT_SUBPIXEL_HORIZONTAL_BGR;
+	case DRM_MODE_SUBPIXEL_VERTICAL_RGB:
+		return WL_OUTPUT_SUBPIXEL_VERTICAL_RGB;
+	case DRM_MODE_SUBPIXEL_VERTICAL_BGR:
+		return WL_OUTPUT_SUBPIXEL_VERTICAL_BGR;
+	}
+}
+
+/* returns a value between 0-255 range, where higher is brighter */
+static uint32_t
+drm_get_backlight(struct drm_output *output)
+{
+	long brightness, max_brightness, norm;
+
+	brightness = backlight_get_brightness(output->backlight);
+	max_brightness = backlight_get_max_brightness(output->backlight);
+
+	/* convert it on a scale of 0 to 255 */
+	norm = (brightness * 255)/(max_brightness);
+
+	return (uint32_t) norm;
+}
+
+/* values accepted are between 0-255 range */
+static void
+drm_set_backlight(struct weston_output *output_base, uint32_t value)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	long max_brightness, new_brightness;
+
+	if (!output->backlight)
+		return;
+
+	if (value > 255)
+		return;
+
+	max_brightness = backlight_get_max_brightness(output->backlight);
+
+	/* get denormalized value */
+	new_brightness = (value * max_brightness) / 255;
+
+	backlight_set_brightness(output->backlight, new_brightness);
+}
+
+static drmModePropertyPtr
+drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name)
+{
+	drmModePropertyPtr props;
+	int i;
+
+	for (i = 0; i < connector->count_props; i++) {
+		props = drmModeGetProperty(fd, connector->props[i]);
+		if (!props)
+			continue;
+
+		if (!strcmp(props->name, name))
+			return props;
+
+		drmModeFreeProperty(props);
+	}
+
+	return NULL;
+}
+
+static void
+drm_set_dpms(struct weston_output *output_base, enum dpms_enum level)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_output *clone;
+	int ret;
+
+	wl_list_for_each(clone, &output->clone_list, clone_link) {
+		if (clone->dpms_prop &&
+		    drmModeConnectorSetProperty(drm_output_fd(clone),
+						clone->connector_id,
+						clone->dpms_prop->prop_id,
+						level) == 0)
+			clone->dpms = level;
+	}
+
+	if (!output->dpms_prop)
+		return;
+
+	ret = drmModeConnectorSetProperty(drm_output_fd(output),
+					  output->connector_id,
+				 	  output->dpms_prop->prop_id, level);
+	if (ret) {
+		weston_log("DRM: DPMS: failed property set for %s\n",
+			   output->base.name);
+		return;
+	}
+
+	output->dpms = level;
+}
+
+static const char * const connector_type_names[] = {
+	[DRM_MODE_CONNECTOR_Unknown]     = "Unknown",
+	[DRM_MODE_CONNECTOR_VGA]         = "VGA",
+	[DRM_MODE_CONNECTOR_DVII]        = "DVI-I",
+	[DRM_MODE_CONNECTOR_DVID]        = "DVI-D",
+	[DRM_MODE_CONNECTOR_DVIA]        = "DVI-A",
+	[DRM_MODE_CONNECTOR_Composite]   = "Composite",
+	[DRM_MODE_CONNECTOR_SVIDEO]      = "SVIDEO",
+	[DRM_MODE_CONNECTOR_LVDS]        = "LVDS",
+	[DRM_MODE_CONNECTOR_Component]   = "Component",
+	[DRM_MODE_CONNECTOR_9PinDIN]     = "DIN",
+	[DRM_MODE_CONNECTOR_DisplayPort] = "DP",
+	[DRM_MODE_CONNECTOR_HDMIA]       = "HDMI-A",
+	[DRM_MODE_CONNECTOR_HDMIB]       = "HDMI-B",
+	[DRM_MODE_CONNECTOR_TV]          = "TV",
+	[DRM_MODE_CONNECTOR_eDP]         = "eDP",
+#ifdef DRM_MODE_CONNECTOR_DSI
+	[DRM_MODE_CONNECTOR_VIRTUAL]     = "Virtual",
+	[DRM_MODE_CONNECTOR_DSI]         = "DSI",
+#endif
+};
+
+static char *
+make_connector_name(const drmModeConnector *con)
+{
+	char name[32];
+	const char *type_name = NULL;
+
+	if (con->connector_type < ARRAY_LENGTH(connector_type_names))
+		type_name = connector_type_names[con->connector_type];
+
+	if (!type_name)
+		type_name = "UNNAMED";
+
+	snprintf(name, sizeof name, "%s-%d", type_name, con->connector_type_id);
+
+	return strdup(name);
+}
+
+static int
+find_crtc_for_connector(struct drm_backend *b, struct drm_secondary *dev,
+			drmModeRes *resources, drmModeConnector *connector)
+{
+	drmModeEncoder *encoder;
+	uint32_t possible_crtcs;
+	int fd = dev ? dev->fd : b->drm.fd;
+	int i, j;
+
+	/* Prefer the CRTC already driving the connector, so its
+	 * configuration can be kept, see drm_output_adopt_crtc() */
+	encoder = drmModeGetEncoder(fd, connector->encoder_id);
+	if (encoder) {
+		for (i = 0; i < resources->count_crtcs; i++) {
+			if (encoder->crtc_id == resources->crtcs[i] &&
+			    !drm_output_find_by_crtc(b, dev,
+						     resources->crtcs[i])) {
+				drmModeFreeEncoder(encoder);
+				return i;
+			}
+		}
+		drmModeFreeEncoder(encoder);
+	}
+
+	for (j = 0; j < connector->count_encoders; j++) {
+		encoder = drmModeGetEncoder(fd, connector->encoders[j]);
+		if (encoder == NULL) {
+			weston_log("Failed to get encoder.\n");
+			return -1;
+		}
+		possible_crtcs = encoder->possible_crtcs;
+		drmModeFreeEncoder(encoder);
+
+		for (i = 0; i < resources->count_crtcs; i++) {
+			if (!(possible_crtcs & (1 << i)))
+				continue;
+
+			if (drm_output_find_by_crtc(b, dev, resources->crtcs[i]))
+				continue;
+
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Size of the frames the output renders: the mode size, scaled down by
+ * the render scale which the primary plane then scales up again */
+static void
+drm_output_get_render_size(struct drm_output *output,
+			   int32_t *width, int32_t *height)
+{
+	struct weston_mode *mode = output->base.current_mode;
+
+	*width = MAX(1, (int32_t) (mode->width * output->render_scale + 0.5));
+	*height = MAX(1, (int32_t) (mode->height * output->render_scale + 0.5));
+}
+
+#if defined(HAVE_DRM_ATOMIC) && defined(HAVE_GBM_MODIFIERS)
+/**
+ * Create the gbm surface of an output in a layout the display compresses
+ *
+ * Layouts like AFBC or CCS, which the primary plane advertises through
+ * "IN_FORMATS", save much of the memory bandwidth of scanning out large
+ * modes. The kernel still has to accept the combination with the mode
+ * and any scaling, so a buffer allocated the same way is test-committed
+ * first.
+ *
+ * @param output The output to render for
+ * @param width Width of the buffers to render
+ * @param height Height of the buffers to render
+ * @returns The gbm surface, or NULL to use one with the implicit layout
+ */
+static struct gbm_surface *
+drm_output_create_gbm_surface_with_modifiers(struct drm_output *output,
+					     int32_t width, int32_t height)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_sprite *primary = output->primary_plane;
+	struct gbm_surface *surface = NULL;
+	struct drm_plane_modifier *pair;
+	struct wl_array modifiers;
+	struct gbm_bo *bo;
+	struct drm_fb *fb;
+	uint64_t *mod;
+	int ret;
+
+	if (!b->atomic_modeset || !b->fb_modifiers || output->secondary ||
+	    !primary)
+		return NULL;
+
+	wl_array_init(&modifiers);
+	wl_array_for_each(pair, &primary->in_formats) {
+		if (pair->format != output->gbm_format ||
+		    pair->modifier == DRM_FORMAT_MOD_INVALID)
+			continue;
+
+		mod = wl_array_add(&modifiers, sizeof *mod);
+		if (!mod)
+			goto out;
+		*mod = pair->modifier;
+	}
+
+	/* Nothing to gain over the implicit layout */
+	if (modifiers.size == 0 ||
+	    (modifiers.size == sizeof *mod &&
+	     *(uint64_t *) modifiers.data == DRM_FORMAT_MOD_LINEAR))
+		goto out;
+
+	bo = gbm_bo_create_with_modifiers(b->gbm, width, height,
+					  output->gbm_format, modifiers.data,
+					  modifiers.size / sizeof *mod);
+	if (!bo)
+		goto out;
+
+	/* The fb goes away with the bo */
+	fb = drm_fb_get_from_bo(bo, b, output->gbm_format);
+	ret = fb ? drm_output_test_atomic(output, fb) : -1;
+	if (ret < 0)
+		weston_log("%s: display rejects layout 0x%llx, rendering to "
+			   "the implicit one\n", output->base.name,
+			   (unsigned long long) gbm_bo_get_modifier(bo));
+	gbm_bo_destroy(bo);
+	if (ret < 0)
+		goto out;
+
+	surface = gbm_surface_create_with_modifiers(b->gbm, width, height,
+						    output->gbm_format,
+						    modifiers.data,
+						    modifiers.size / sizeof *mod);
+
+out:
+	wl_array_release(&modifiers);
+	return surface;
+}
+#else
+static struct gbm_surface *
+drm_output_create_gbm_surface_with_modifiers(struct drm_output *output,
+					     int32_t width, int32_t height)
+{
+	return NULL;
+}
+#endif
+
+/* Init output state that depends on gl or gbm */
+static int
+drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
+{
+	EGLint format[2] = {
+		output->gbm_format,
+		fallback_format_for(output->gbm_format),
+	};
+	int32_t width, height;
+	int i, flags, n_formats = 1;
+
+	/* Buffers for another device only need to be rendered to here,
+	 * and have to be in a layout the other device can scan out. */
+	flags = GBM_BO_USE_RENDERING;
+#ifdef HAVE_GBM_BO_MAP
+	if (output->secondary)
+		flags |= GBM_BO_USE_LINEAR;
+	else
+#endif
+		flags |= GBM_BO_USE_SCANOUT;
+
+	drm_output_get_render_size(output, &width, &height);
+	output->gbm_surface =
+		drm_output_create_gbm_surface_with_modifiers(output, width,
+							     height);
+	if (!output->gbm_surface)
+		output->gbm_surface = gbm_surface_create(b->gbm, width, height,
+							 format[0], flags);
+	if (!output->gbm_surface) {
+		weston_log("failed to create gbm surface\n");
+		return -1;
+	}
+
+	if (format[1])
+		n_formats = 2;
+	if (gl_renderer->output_window_create(&output->base,
+					      (EGLNativeWindowType)output->gbm_surface,
+					      output->gbm_surface,
+					      gl_renderer->opaque_attribs,
+					      format,
+					      n_formats) < 0) {
+		weston_log("failed to create gl renderer output state\n");
+		gbm_surface_destroy(output->gbm_surface);
+		return -1;
+	}
+
+	gl_renderer->output_set_render_size(&output->base, width, height);
+
+	/* Frames are only deferred to the atomic commit */
+	if (b->render_threads && b->atomic_modeset && !output->secondary &&
+	    gl_renderer->output_create_render_thread(&output->base) < 0)
+		weston_log("%s renders on the main thread\n",
+			   output->base.name);
+
+	/* The cursor plane of another device cannot use our bos */
+	if (output->secondary)
+		return 0;
+
+	flags = GBM_BO_USE_CURSOR | GBM_BO_USE_WRITE;
+
+	for (i = 0; i < DRM_CURSOR_CACHE_SIZE; i++) {
+		if (output->cursors[i].bo)
+			continue;
+
+		output->cursors[i].bo =
+			gbm_bo_create(b->gbm, b->cursor_width, b->cursor_height,
+				GBM_FORMAT_ARGB8888, flags);
+	}
+
+	/* One to show and one to write the next image into */
+	if (output->cursors[0].bo == NULL || output->cursors[1].bo == NULL) {
+		weston_log("cursor buffers unavailable, using gl cursors\n");
+		b->cursors_are_broken = 1;
+	}
+
+	return 0;
+}
+
+static void
+drm_output_fini_egl(struct drm_output *output)
+{
+	unsigned int i;
+
+	gl_renderer->output_destroy(&output->base);
+	gbm_surface_destroy(output->gbm_surface);
+
+	/* Copies of the frames for a secondary device, if any */
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		if (output->dumb[i])
+			drm_fb_destroy_dumb(output->dumb[i]);
+		output->dumb[i] = NULL;
+	}
+	output->dumb_count = 0;
+}
+
+/**
+ * Find the primary plane rotation that applies an output transform
+ *
+ * @param output Output to transform
+ * @returns The enum wdrm_plane_rotation bits, or 0 if the primary plane
+ * cannot apply the transform
+ */
+static uint64_t
+drm_output_get_plane_rotation(struct drm_output *output)
+{
+	struct drm_sprite *primary = output->primary_plane;
+	uint64_t rotation;
+
+	if (!primary || !primary->rotation_prop)
+		return 0;
+
+	switch (output->base.transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		rotation = WDRM_PLANE_ROTATE_0;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		rotation = WDRM_PLANE_ROTATE_90;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		rotation = WDRM_PLANE_ROTATE_180;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		rotation = WDRM_PLANE_ROTATE_270;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		rotation = WDRM_PLANE_ROTATE_0 | WDRM_PLANE_REFLECT_X;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		rotation = WDRM_PLANE_ROTATE_90 | WDRM_PLANE_REFLECT_X;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		rotation = WDRM_PLANE_ROTATE_180 | WDRM_PLANE_REFLECT_X;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		rotation = WDRM_PLANE_ROTATE_270 | WDRM_PLANE_REFLECT_X;
+		break;
+	default:
+		return 0;
+	}
+
+	if ((primary->rotations_supported & rotation) != rotation)
+		return 0;
+
+	return rotation;
+}
+
+static int
+drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
+{
+	struct weston_compositor *ec = b->compositor;
+	int w = output->base.current_mode->width;
+	int h = output->base.current_mode->height;
+	uint32_t format = output->gbm_format;
+	uint32_t pixman_format;
+	uint32_t flags = PIXMAN_RENDERER_OUTPUT_USE_SHADOW;
+	uint64_t rotation = 0;
+	unsigned int i;
+
+	switch (format) {
+		case GBM_FORMAT_XRGB8888:
+			pixman_format = PIXMAN_x8r8g8b8;
+			break;
+		case GBM_FORMAT_RGB565:
+			pixman_format = PIXMAN_r5g6b5;
+			break;
+		default:
+			weston_log("Unsupported pixman format 0x%x\n", format);
+			return -1;
+	}
+
+	/* Let the primary plane transform upright dumb buffers. The
+	 * plane's source rectangle is in the buffer, before rotation. */
+	output->dumb_rotation = WDRM_PLANE_ROTATE_0;
+	if (b->atomic_modeset && !output->secondary &&
+	    ec->offscreen_transform &&
+	    output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		rotation = drm_output_get_plane_rotation(output);
+	if (rotation) {
+		output->dumb_rotation = rotation;
+		flags |= PIXMAN_RENDERER_OUTPUT_HW_TRANSFORM;
+		w = output->base.width * output->base.current_scale;
+		h = output->base.height * output->base.current_scale;
+		weston_log("Output %s: transformed by the primary plane\n",
+			   output->base.name);
+	}
+
+	output->dumb_count = ec->pixman_buffer_count;
+	if (output->dumb_count < 2)
+		output->dumb_count = 2;
+	if (output->dumb_count > DRM_OUTPUT_MAX_DUMB)
+		output->dumb_count = DRM_OUTPUT_MAX_DUMB;
+
+	/* FIXME error checking */
+	for (i = 0; i < (unsigned int) output->dumb_count; i++) {
+		output->dumb[i] = drm_fb_create_dumb(b, drm_output_fd(output),
+						     w, h, format);
+		if (!output->dumb[i])
+			goto err;
+
+		output->image[i] =
+			pixman_image_create_bits(pixman_format, w, h,
+						 output->dumb[i]->map,
+						 output->dumb[i]->stride);
+		if (!output->image[i])
+			goto err;
+	}
+
+	if (pixman_renderer_output_create(&output->base, flags) < 0)
+		goto err;
+
+	for (i = 0; i < (unsigned int) output->dumb_count; i++)
+		pixman_region32_init_rect(&output->dumb_damage[i],
+					  output->base.x, output->base.y,
+					  output->base.width,
+					  output->base.height);
+
+	return 0;
+
+err:
+	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+		if (output->dumb[i])
+			drm_fb_destroy_dumb(output->dumb[i]);
+		if (output->image[i])
+			pixman_image_unref(output->image[i]);
+
+		output->dumb[i] = NULL;
+		output->image[i] = NULL;
+	}
+	output->dumb_count = 0;
+
+	return -1;
+}
+
+static void
+drm_output_fini_pixman(struct drm_output *output)
+{
+	unsigned int i;
+
+	pixman_renderer_output_destroy(&output->base);
+
+	for (i = 0; i < (unsigned int) output->dumb_count; i++) {
+		pixman_region32_fini(&output->dumb_damage[i]);
+		drm_fb_destroy_dumb(output->dumb[i]);
+		pixman_image_unref(output->image[i]);
+		output->dumb[i] = NULL;
+		output->image[i] = NULL;
+	}
+	output->dumb_count = 0;
+}
+
+static void
+edid_parse_string(const uint8_t *data, char text[])
+{
+	int i;
+	int replaced = 0;
+
+	/* this is always 12 bytes, but we can't guarantee it's null
+	 * terminated or not junk. */
+	strncpy(text, (const char *) data, 12);
+
+	/* guarantee our new string is null-terminated */
+	text[12] = '\0';
+
+	/* remove insane chars */
+	for (i = 0; text[i] != '\0'; i++) {
+		if (text[i] == '\n' ||
+		    text[i] == '\r') {
+			text[i] = '\0';
+			break;
+		}
+	}
+
+	/* ensure string is printable */
+	for (i = 0; text[i] != '\0'; i++) {
+		if (!isprint(text[i])) {
+			text[i] = '-';
+			replaced++;
+		}
+	}
+
+	/* if the string is random junk, ignore the string */
+	if (replaced > 4)
+		text[0] = '\0';
+}
+
+#define EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING	0xfe
+#define EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME		0xfc
+#define EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER	0xff
+#define EDID_OFFSET_DATA_BLOCKS				0x36
+#define EDID_OFFSET_LAST_BLOCK				0x6c
+#define EDID_OFFSET_PNPID				0x08
+#define EDID_OFFSET_SERIAL				0x0c
+
+static int
+edid_parse(struct drm_edid *edid, const uint8_t *data, size_t length)
+{
+	int i;
+	uint32_t serial_number;
+
+	/* check header */
+	if (length < 128)
 		return -1;
 	if (data[0] != 0x00 || data[1] != 0xff)
 		return -1;
 
-	/* decode the PNP ID from three 5 bit words packed into 2 bytes
-	 * /--08--\/--09--\
-	 * 7654321076543210
-	 * |\---/\---/\---/
-	 * R  C1   C2   C3 */
-	edid->pnp_id[0] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x7c) / 4) - 1;
-	edid->pnp_id[1] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x3) * 8) + ((data[EDID_OFFSET_PNPID + 1] & 0xe0) / 32) - 1;
-	edid->pnp_id[2] = 'A' + (data[EDID_OFFSET_PNPID + 1] & 0x1f) - 1;
-	edid->pnp_id[3] = '\0';
+	/* identifies the monitor more precisely than the strings below */
+	edid->checksum = 0x811c9dc5;
+	for (i = 0; i < (int) length; i++) {
+		edid->checksum ^= data[i];
+		edid->checksum *= 0x01000193;
+	}
+
+	/* decode the PNP ID from three 5 bit words packed into 2 bytes
+	 * /--08--\/--09--\
+	 * 7654321076543210
+	 * |\---/\---/\---/
+	 * R  C1   C2   C3 */
+	edid->pnp_id[0] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x7c) / 4) - 1;
+	edid->pnp_id[1] = 'A' + ((data[EDID_OFFSET_PNPID + 0] & 0x3) * 8) + ((data[EDID_OFFSET_PNPID + 1] & 0xe0) / 32) - 1;
+	edid->pnp_id[2] = 'A' + (data[EDID_OFFSET_PNPID + 1] & 0x1f) - 1;
+	edid->pnp_id[3] = '\0';
+
+	/* maybe there isn't a ASCII serial number descriptor, so use this instead */
+	serial_number = (uint32_t) data[EDID_OFFSET_SERIAL + 0];
+	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 1] * 0x100;
+	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 2] * 0x10000;
+	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 3] * 0x1000000;
+	if (serial_number > 0)
+		sprintf(edid->serial_number, "%lu", (unsigned long) serial_number);
+
+	/* parse EDID data */
+	for (i = EDID_OFFSET_DATA_BLOCKS;
+	     i <= EDID_OFFSET_LAST_BLOCK;
+	     i += 18) {
+		/* ignore pixel clock data */
+		if (data[i] != 0)
+			continue;
+		if (data[i+2] != 0)
+			continue;
+
+		/* any useful blocks? */
+		if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME) {
+			edid_parse_string(&data[i+5],
+					  edid->monitor_name);
+		} else if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER) {
+			edid_parse_string(&data[i+5],
+					  edid->serial_number);
+		} else if (data[i+3] == EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING) {
+			edid_parse_string(&data[i+5],
+					  edid->eisa_id);
+		}
+	}
+	return 0;
+}
+
+static const struct drm_edid_cache_entry *
+drm_edid_cache_get(struct drm_backend *b, int fd, uint32_t blob_id)
+{
+	struct drm_edid_cache_entry *entry;
+	drmModePropertyBlobPtr edid_blob;
+
+	wl_list_for_each(entry, &b->edid_cache_list, link) {
+		if (entry->fd == fd && entry->blob_id == blob_id) {
+			wl_list_remove(&entry->link);
+			wl_list_insert(&b->edid_cache_list, &entry->link);
+			return entry;
+		}
+	}
+
+	edid_blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!edid_blob)
+		return NULL;
+
+	if (b->edid_cache_length == DRM_EDID_CACHE_SIZE) {
+		entry = container_of(b->edid_cache_list.prev,
+				     struct drm_edid_cache_entry, link);
+		wl_list_remove(&entry->link);
+		b->edid_cache_length--;
+		free(entry);
+	}
+
+	entry = zalloc(sizeof *entry);
+	if (!entry) {
+		drmModeFreePropertyBlob(edid_blob);
+		return NULL;
+	}
+
+	entry->fd = fd;
+	entry->blob_id = blob_id;
+	/* Remember broken EDIDs too, so they are not fetched again */
+	entry->valid = edid_parse(&entry->edid, edid_blob->data,
+				  edid_blob->length) == 0;
+	drmModeFreePropertyBlob(edid_blob);
+
+	wl_list_insert(&b->edid_cache_list, &entry->link);
+	b->edid_cache_length++;
+
+	return entry;
+}
+
+static void
+drm_edid_cache_release(struct drm_backend *b)
+{
+	struct drm_edid_cache_entry *entry, *next;
+
+	wl_list_for_each_safe(entry, next, &b->edid_cache_list, link)
+		free(entry);
+	wl_list_init(&b->edid_cache_list);
+	b->edid_cache_length = 0;
+}
+
+static void
+find_and_parse_output_edid(struct drm_backend *b,
+			   struct drm_output *output,
+			   drmModeConnector *connector)
+{
+	const struct drm_edid_cache_entry *entry = NULL;
+	drmModePropertyPtr property;
+	int found = 0;
+	int i;
+
+	for (i = 0; i < connector->count_props && !found; i++) {
+		property = drmModeGetProperty(drm_output_fd(output),
+					      connector->props[i]);
+		if (!property)
+			continue;
+		if ((property->flags & DRM_MODE_PROP_BLOB) &&
+		    !strcmp(property->name, "EDID")) {
+			found = 1;
+			if (connector->prop_values[i])
+				entry = drm_edid_cache_get(b,
+							   drm_output_fd(output),
+							   connector->prop_values[i]);
+		}
+		drmModeFreeProperty(property);
+	}
+	if (!entry)
+		return;
+
+	if (entry->valid) {
+		output->edid = entry->edid;
+		weston_log("EDID data '%s', '%s', '%s'\n",
+			   output->edid.pnp_id,
+			   output->edid.monitor_name,
+			   output->edid.serial_number);
+		if (output->edid.pnp_id[0] != '\0')
+			output->base.make = output->edid.pnp_id;
+		if (output->edid.monitor_name[0] != '\0')
+			output->base.model = output->edid.monitor_name;
+		if (output->edid.serial_number[0] != '\0')
+			output->base.serial_number = output->edid.serial_number;
+		output->base.edid_checksum = output->edid.checksum;
+	}
+}
+
+
+
+static int
+parse_modeline(const char *s, drmModeModeInfo *mode)
+{
+	char hsync[16];
+	char vsync[16];
+	float fclock;
+
+	mode->type = DRM_MODE_TYPE_USERDEF;
+	mode->hskew = 0;
+	mode->vscan = 0;
+	mode->vrefresh = 0;
+	mode->flags = 0;
+
+	if (sscanf(s, "%f %hd %hd %hd %hd %hd %hd %hd %hd %15s %15s",
+		   &fclock,
+		   &mode->hdisplay,
+		   &mode->hsync_start,
+		   &mode->hsync_end,
+		   &mode->htotal,
+		   &mode->vdisplay,
+		   &mode->vsync_start,
+		   &mode->vsync_end,
+		   &mode->vtotal, hsync, vsync) != 11)
+		return -1;
+
+	mode->clock = fclock * 1000;
+	if (strcmp(hsync, "+hsync") == 0)
+		mode->flags |= DRM_MODE_FLAG_PHSYNC;
+	else if (strcmp(hsync, "-hsync") == 0)
+		mode->flags |= DRM_MODE_FLAG_NHSYNC;
+	else
+		return -1;
 
-	/* maybe there isn't a ASCII serial number descriptor, so use this instead */
-	serial_number = (uint32_t) data[EDID_OFFSET_SERIAL + 0];
-	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 1] * 0x100;
-	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 2] * 0x10000;
-	serial_number += (uint32_t) data[EDID_OFFSET_SERIAL + 3] * 0x1000000;
-	if (serial_number > 0)
-		sprintf(edid->serial_number, "%lu", (unsigned long) serial_number);
+	if (strcmp(vsync, "+vsync") == 0)
+		mode->flags |= DRM_MODE_FLAG_PVSYNC;
+	else if (strcmp(vsync, "-vsync") == 0)
+		mode->flags |= DRM_MODE_FLAG_NVSYNC;
+	else
+		return -1;
+
+	snprintf(mode->name, sizeof mode->name, "%dx%d@%.3f",
+		 mode->hdisplay, mode->vdisplay, fclock);
+
+	return 0;
+}
+
+static void
+setup_output_seat_constraint(struct drm_backend *b,
+			     struct weston_output *output,
+			     const char *s)
+{
+	if (strcmp(s, "") != 0) {
+		struct weston_pointer *pointer;
+		struct udev_seat *seat;
+
+		seat = udev_seat_get_named(&b->input, s);
+		if (!seat)
+			return;
+
+		seat->base.output = output;
+
+		pointer = weston_seat_get_pointer(&seat->base);
+		if (pointer)
+			weston_pointer_clamp(pointer,
+					     &pointer->x,
+					     &pointer->y);
+	}
+}
+
+static int
+parse_gbm_format(const char *s, uint32_t default_value, uint32_t *gbm_format)
+{
+	int ret = 0;
+
+	if (s == NULL)
+		*gbm_format = default_value;
+	else if (strcmp(s, "xrgb8888") == 0)
+		*gbm_format = GBM_FORMAT_XRGB8888;
+	else if (strcmp(s, "rgb565") == 0)
+		*gbm_format = GBM_FORMAT_RGB565;
+	else if (strcmp(s, "xrgb2101010") == 0)
+		*gbm_format = GBM_FORMAT_XRGB2101010;
+	else if (strcmp(s, "argb8888") == 0)
+		*gbm_format = GBM_FORMAT_ARGB8888;
+	else {
+		weston_log("fatal: unrecognized pixel format: %s\n", s);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Choose suitable mode for an output
+ *
+ * Find the most suitable mode to use for initial setup (or reconfiguration on
+ * hotplug etc) for a DRM output.
+ *
+ * @param output DRM output to choose mode for
+ * @param kind Strategy and preference to use when choosing mode
+ * @param width Desired width for this output
+ * @param height Desired height for this output
+ * @param current_mode Mode currently being displayed on this output
+ * @param modeline Manually-entered mode (may be NULL)
+ * @returns A mode from the output's mode list, or NULL if none available
+ */
+static struct drm_mode *
+drm_output_choose_initial_mode(struct drm_backend *backend,
+			       struct drm_output *output,
+			       enum weston_drm_backend_output_mode mode,
+			       const char *modeline,
+			       const drmModeModeInfo *current_mode)
+{
+	struct drm_mode *preferred = NULL;
+	struct drm_mode *current = NULL;
+	struct drm_mode *configured = NULL;
+	struct drm_mode *best = NULL;
+	struct drm_mode *drm_mode;
+	drmModeModeInfo drm_modeline;
+	int32_t width = 0;
+	int32_t height = 0;
+	uint32_t refresh = 0;
+	int n;
+
+	if (mode == WESTON_DRM_BACKEND_OUTPUT_PREFERRED && modeline) {
+		n = sscanf(modeline, "%dx%d@%d", &width, &height, &refresh);
+		if (n != 2 && n != 3) {
+			width = -1;
+
+			if (parse_modeline(modeline, &drm_modeline) == 0) {
+				configured = drm_output_add_mode(output, &drm_modeline);
+				if (!configured)
+					return NULL;
+			} else {
+				weston_log("Invalid modeline \"%s\" for output %s\n",
+					   modeline, output->base.name);
+			}
+		}
+	}
+
+	wl_list_for_each_reverse(drm_mode, &output->base.mode_list, base.link) {
+		if (width == drm_mode->base.width &&
+		    height == drm_mode->base.height &&
+		    (refresh == 0 || refresh == drm_mode->mode_info.vrefresh))
+			configured = drm_mode;
+
+		if (memcmp(current_mode, &drm_mode->mode_info,
+			   sizeof *current_mode) == 0)
+			current = drm_mode;
+
+		if (drm_mode->base.flags & WL_OUTPUT_MODE_PREFERRED)
+			preferred = drm_mode;
+
+		best = drm_mode;
+	}
+
+	if (current == NULL && current_mode->clock != 0) {
+		current = drm_output_add_mode(output, current_mode);
+		if (!current)
+			return NULL;
+	}
+
+	if (mode == WESTON_DRM_BACKEND_OUTPUT_CURRENT)
+		configured = current;
+
+	if (configured)
+		return configured;
+
+	if (preferred)
+		return preferred;
+
+	if (current)
+		return current;
+
+	if (best)
+		return best;
+
+	weston_log("no available modes for %s\n", output->base.name);
+	return NULL;
+}
+
+static int
+connector_get_current_mode(drmModeConnector *connector, int drm_fd,
+			   drmModeModeInfo *mode)
+{
+	drmModeEncoder *encoder;
+	drmModeCrtc *crtc;
+
+	/* Get the current mode on the crtc that's currently driving
+	 * this connector. */
+	encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
+	memset(mode, 0, sizeof *mode);
+	if (encoder != NULL) {
+		crtc = drmModeGetCrtc(drm_fd, encoder->crtc_id);
+		drmModeFreeEncoder(encoder);
+		if (crtc == NULL)
+			return -1;
+		if (crtc->mode_valid)
+			*mode = crtc->mode;
+		drmModeFreeCrtc(crtc);
+	}
+
+	return 0;
+}
+
+static int
+drm_output_set_mode(struct weston_output *base,
+		    enum weston_drm_backend_output_mode mode,
+		    const char *modeline)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(base->compositor);
+
+	struct drm_mode *drm_mode, *next, *current;
+	drmModeModeInfo crtc_mode;
+	int i;
+
+	output->base.make = "unknown";
+	output->base.model = "unknown";
+	output->base.serial_number = "unknown";
+	wl_list_init(&output->base.mode_list);
+
+	output->original_crtc = drmModeGetCrtc(drm_output_fd(output),
+					       output->crtc_id);
+
+	if (connector_get_current_mode(output->connector,
+				       drm_output_fd(output), &crtc_mode) < 0)
+		goto err_free;
+
+	for (i = 0; i < output->connector->count_modes; i++) {
+		drm_mode = drm_output_add_mode(output, &output->connector->modes[i]);
+		if (!drm_mode)
+			goto err_free;
+	}
+
+	current = drm_output_choose_initial_mode(b, output, mode, modeline, &crtc_mode);
+	if (!current)
+		goto err_free;
+
+	output->base.current_mode = &current->base;
+	output->base.current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
+
+	/* Set native_ fields, so weston_output_mode_switch_to_native() works */
+	output->base.native_mode = output->base.current_mode;
+	output->base.native_scale = output->base.current_scale;
+
+	output->base.mm_width = output->connector->mmWidth;
+	output->base.mm_height = output->connector->mmHeight;
+
+	return 0;
+
+err_free:
+	drmModeFreeCrtc(output->original_crtc);
+	output->original_crtc = NULL;
+
+	wl_list_for_each_safe(drm_mode, next, &output->base.mode_list,
+							base.link) {
+		wl_list_remove(&drm_mode->base.link);
+		free(drm_mode);
+	}
+
+	return -1;
+}
+
+static void
+drm_output_set_gbm_format(struct weston_output *base,
+			  const char *gbm_format)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(base->compositor);
 
-	/* parse EDID data */
-	for (i = EDID_OFFSET_DATA_BLOCKS;
-	     i <= EDID_OFFSET_LAST_BLOCK;
-	     i += 18) {
-		/* ignore pixel clock data */
-		if (data[i] != 0)
-			continue;
-		if (data[i+2] != 0)
-			continue;
+	if (parse_gbm_format(gbm_format, b->gbm_format, &output->gbm_format) == -1)
+		output->gbm_format = b->gbm_format;
+}
 
-		/* any useful blocks? */
-		if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME) {
-			edid_parse_string(&data[i+5],
-					  edid->monitor_name);
-		} else if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER) {
-			edid_parse_string(&data[i+5],
-					  edid->serial_number);
-		} else if (data[i+3] == EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING) {
-			edid_parse_string(&data[i+5],
-					  edid->eisa_id);
-		}
-	}
-	return 0;
+static void
+drm_output_set_seat(struct weston_output *base,
+		    const char *seat)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(base->compositor);
+
+	setup_output_seat_constraint(b, &output->base,
+				     seat ? seat : "");
 }
 
+/**
+ * Render an output below the resolution of its mode
+ *
+ * The output is composited into buffers of the mode size times scale,
+ * which the primary plane scales up to the mode: compositing gets
+ * cheaper with the square of the scale, at the price of sharpness. Input
+ * and the layout of the outputs are not affected. This takes the GL
+ * renderer and atomic modesetting on the render GPU, and a primary plane
+ * able to scale by the factor given.
+ *
+ * @param base Output to configure, before it is enabled
+ * @param scale Fraction of the mode resolution, 1.0 for all of it
+ */
 static void
-find_and_parse_output_edid(struct drm_backend *b,
-			   struct drm_output *output,
-			   drmModeConnector *connector)
+drm_output_set_render_scale(struct weston_output *base, double scale)
 {
-	drmModePropertyBlobPtr edid_blob = NULL;
-	drmModePropertyPtr property;
-	int i;
-	int rc;
+	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(base->compositor);
 
-	for (i = 0; i < connector->count_props && !edid_blob; i++) {
-		property = drmModeGetProperty(b->drm.fd, connector->props[i]);
-		if (!property)
-			continue;
-		if ((property->flags & DRM_MODE_PROP_BLOB) &&
-		    !strcmp(property->name, "EDID")) {
-			edid_blob = drmModeGetPropertyBlob(b->drm.fd,
-							   connector->prop_values[i]);
-		}
-		drmModeFreeProperty(property);
-	}
-	if (!edid_blob)
+	output->render_scale = 1.0;
+
+	if (scale >= 1.0)
 		return;
 
-	rc = edid_parse(&output->edid,
-			edid_blob->data,
-			edid_blob->length);
-	if (!rc) {
-		weston_log("EDID data '%s', '%s', '%s'\n",
-			   output->edid.pnp_id,
-			   output->edid.monitor_name,
-			   output->edid.serial_number);
-		if (output->edid.pnp_id[0] != '\0')
-			output->base.make = output->edid.pnp_id;
-		if (output->edid.monitor_name[0] != '\0')
-			output->base.model = output->edid.monitor_name;
-		if (output->edid.serial_number[0] != '\0')
-			output->base.serial_number = output->edid.serial_number;
+	if (scale < DRM_RENDER_SCALE_MIN) {
+		weston_log("Invalid render scale %.2f for output %s, "
+			   "rendering at full resolution\n",
+			   scale, output->base.name);
+		return;
 	}
-	drmModeFreePropertyBlob(edid_blob);
-}
 
+	if (b->use_pixman || !b->atomic_modeset || output->secondary) {
+		weston_log("Output %s cannot render scaled: that takes the GL "
+			   "renderer and atomic modesetting on the render GPU\n",
+			   output->base.name);
+		return;
+	}
 
+	output->render_scale = scale;
+}
 
-static int
-parse_modeline(const char *s, drmModeModeInfo *mode)
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * Find an unused primary plane which can be attached to an output's CRTC
+ *
+ * @param b DRM backend
+ * @param output Output to find a primary plane for
+ * @returns The primary plane, or NULL if none is available
+ */
+static struct drm_sprite *
+drm_output_find_primary_plane(struct drm_backend *b, struct drm_output *output)
 {
-	char hsync[16];
-	char vsync[16];
-	float fclock;
+	struct drm_sprite *plane;
 
-	mode->type = DRM_MODE_TYPE_USERDEF;
-	mode->hskew = 0;
-	mode->vscan = 0;
-	mode->vrefresh = 0;
-	mode->flags = 0;
+	wl_list_for_each(plane, &b->primary_plane_list, link) {
+		if (plane->output || !drm_sprite_crtc_supported(output, plane))
+			continue;
 
-	if (sscanf(s, "%f %hd %hd %hd %hd %hd %hd %hd %hd %15s %15s",
-		   &fclock,
-		   &mode->hdisplay,
-		   &mode->hsync_start,
-		   &mode->hsync_end,
-		   &mode->htotal,
-		   &mode->vdisplay,
-		   &mode->vsync_start,
-		   &mode->vsync_end,
-		   &mode->vtotal, hsync, vsync) != 11)
+		return plane;
+	}
+
+	return NULL;
+}
+
+/**
+ * Init the output state needed for atomic modesetting
+ *
+ * Looks up the CRTC and connector properties and claims a primary plane
+ * for the output.
+ *
+ * @param output Output to initialize
+ * @param b DRM backend
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_init_atomic(struct drm_output *output, struct drm_backend *b)
+{
+	if (drm_object_get_props(b, output->crtc_id, DRM_MODE_OBJECT_CRTC,
+				 crtc_prop_names, output->props_crtc, NULL,
+				 WDRM_CRTC__COUNT) < 0) {
+		weston_log("CRTC %d lacks atomic properties\n",
+			   output->crtc_id);
 		return -1;
+	}
 
-	mode->clock = fclock * 1000;
-	if (strcmp(hsync, "+hsync") == 0)
-		mode->flags |= DRM_MODE_FLAG_PHSYNC;
-	else if (strcmp(hsync, "-hsync") == 0)
-		mode->flags |= DRM_MODE_FLAG_NHSYNC;
-	else
+	if (drm_object_get_props(b, output->connector_id,
+				 DRM_MODE_OBJECT_CONNECTOR,
+				 connector_prop_names, output->props_conn, NULL,
+				 WDRM_CONNECTOR__COUNT) < 0) {
+		weston_log("connector %d lacks atomic properties\n",
+			   output->connector_id);
 		return -1;
+	}
 
-	if (strcmp(vsync, "+vsync") == 0)
-		mode->flags |= DRM_MODE_FLAG_PVSYNC;
-	else if (strcmp(vsync, "-vsync") == 0)
-		mode->flags |= DRM_MODE_FLAG_NVSYNC;
-	else
+	output->primary_plane = drm_output_find_primary_plane(b, output);
+	if (!output->primary_plane) {
+		weston_log("no primary plane available for CRTC %d\n",
+			   output->crtc_id);
 		return -1;
+	}
 
-	snprintf(mode->name, sizeof mode->name, "%dx%d@%.3f",
-		 mode->hdisplay, mode->vdisplay, fclock);
+	output->primary_plane->output = output;
 
 	return 0;
 }
 
 static void
-setup_output_seat_constraint(struct drm_backend *b,
-			     struct weston_output *output,
-			     const char *s)
+drm_output_fini_atomic(struct drm_output *output, struct drm_backend *b)
 {
-	if (strcmp(s, "") != 0) {
-		struct weston_pointer *pointer;
-		struct udev_seat *seat;
+	struct drm_mode *mode;
 
-		seat = udev_seat_get_named(&b->input, s);
-		if (!seat)
-			return;
+	drm_output_writeback_release(output);
 
-		seat->base.output = output;
+	if (output->primary_plane) {
+		output->primary_plane->output = NULL;
+		output->primary_plane = NULL;
+	}
 
-		pointer = weston_seat_get_pointer(&seat->base);
-		if (pointer)
-			weston_pointer_clamp(pointer,
-					     &pointer->x,
-					     &pointer->y);
+	wl_list_for_each(mode, &output->base.mode_list, base.link) {
+		if (mode->blob_id)
+			drmModeDestroyPropertyBlob(b->drm.fd, mode->blob_id);
+		mode->blob_id = 0;
 	}
 }
 
 static int
-parse_gbm_format(const char *s, uint32_t default_value, uint32_t *gbm_format)
+drm_output_enable_writeback(struct weston_output *base)
 {
-	int ret = 0;
+	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_writeback *wb;
 
-	if (s == NULL)
-		*gbm_format = default_value;
-	else if (strcmp(s, "xrgb8888") == 0)
-		*gbm_format = GBM_FORMAT_XRGB8888;
-	else if (strcmp(s, "rgb565") == 0)
-		*gbm_format = GBM_FORMAT_RGB565;
-	else if (strcmp(s, "xrgb2101010") == 0)
-		*gbm_format = GBM_FORMAT_XRGB2101010;
-	else {
-		weston_log("fatal: unrecognized pixel format: %s\n", s);
-		ret = -1;
+	if (output->writeback) {
+		if (output->writeback->broken)
+			return -1;
+
+		output->writeback_users++;
+		return 0;
 	}
 
-	return ret;
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->output || wb->broken ||
+		    !(wb->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		wb->output = output;
+		output->writeback = wb;
+		output->writeback_users = 1;
+		weston_output_schedule_repaint(base);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static void
+drm_output_disable_writeback(struct weston_output *base)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	if (!output->writeback || --output->writeback_users > 0)
+		return;
+
+	/* The next commit detaches the connector */
+	if (output->writeback_attached && !output->writeback->broken)
+		weston_output_schedule_repaint(base);
+	else
+		drm_output_writeback_release(output);
+}
+
+static struct drm_fb *
+drm_output_writeback_last(struct drm_output *output)
+{
+	struct drm_fb *fb;
+
+	if (!output->writeback || output->writeback->broken ||
+	    output->writeback_last < 0)
+		return NULL;
+
+	fb = output->writeback_fb[output->writeback_last];
+	if (!fb || fb->width != output->base.current_mode->width ||
+	    fb->height != output->base.current_mode->height)
+		return NULL;
+
+	return fb;
+}
+
+static int
+drm_output_read_writeback(struct weston_output *base,
+			  void *pixels, int stride)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_fb *fb = drm_output_writeback_last(output);
+	int y;
+
+	if (!fb)
+		return -1;
+
+	for (y = 0; y < fb->height; y++)
+		memcpy((uint8_t *) pixels + y * stride,
+		       (uint8_t *) fb->map + y * fb->stride,
+		       fb->width * 4);
+
+	return 0;
+}
+
+static int
+drm_output_export_writeback(struct weston_output *base, int *fd, int *stride)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_fb *fb = drm_output_writeback_last(output);
+
+	if (!fb)
+		return -1;
+
+	if (drmPrimeHandleToFD(fb->fd, fb->handle, DRM_CLOEXEC, fd)) {
+		weston_log("failed to create prime fd for writeback buffer\n");
+		return -1;
+	}
+
+	*stride = fb->stride;
+
+	return 0;
 }
 
 /**
- * Choose suitable mode for an output
- *
- * Find the most suitable mode to use for initial setup (or reconfiguration on
- * hotplug etc) for a DRM output.
+ * Find the writeback connectors of the device
  *
- * @param output DRM output to choose mode for
- * @param kind Strategy and preference to use when choosing mode
- * @param width Desired width for this output
- * @param height Desired height for this output
- * @param current_mode Mode currently being displayed on this output
- * @param modeline Manually-entered mode (may be NULL)
- * @returns A mode from the output's mode list, or NULL if none available
+ * The kernel only lists them to clients which ask for them, which is
+ * also why the output code has to skip them. Only connectors which can
+ * write XRGB8888 are used.
  */
-static struct drm_mode *
-drm_output_choose_initial_mode(struct drm_backend *backend,
-			       struct drm_output *output,
-			       enum weston_drm_backend_output_mode mode,
-			       const char *modeline,
-			       const drmModeModeInfo *current_mode)
+static void
+create_writebacks(struct drm_backend *b)
 {
-	struct drm_mode *preferred = NULL;
-	struct drm_mode *current = NULL;
-	struct drm_mode *configured = NULL;
-	struct drm_mode *best = NULL;
-	struct drm_mode *drm_mode;
-	drmModeModeInfo drm_modeline;
-	int32_t width = 0;
-	int32_t height = 0;
-	uint32_t refresh = 0;
-	int n;
+	drmModeRes *resources;
+	drmModeConnector *connector;
+	drmModeEncoder *encoder;
+	drmModePropertyBlobRes *blob;
+	struct drm_writeback *wb;
+	uint64_t values[WDRM_WRITEBACK__COUNT];
+	const uint32_t *formats;
+	unsigned int j;
+	int i;
 
-	if (mode == WESTON_DRM_BACKEND_OUTPUT_PREFERRED && modeline) {
-		n = sscanf(modeline, "%dx%d@%d", &width, &height, &refresh);
-		if (n != 2 && n != 3) {
-			width = -1;
+	if (!b->atomic_modeset ||
+	    drmSetClientCap(b->drm.fd,
+			    DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1) != 0)
+		return;
+
+	resources = drmModeGetResources(b->drm.fd);
+	if (!resources)
+		return;
 
-			if (parse_modeline(modeline, &drm_modeline) == 0) {
-				configured = drm_output_add_mode(output, &drm_modeline);
-				if (!configured)
-					return NULL;
-			} else {
-				weston_log("Invalid modeline \"%s\" for output %s\n",
-					   modeline, output->base.name);
-			}
+	for (i = 0; i < resources->count_connectors; i++) {
+		connector = drmModeGetConnector(b->drm.fd,
+						resources->connectors[i]);
+		if (!connector)
+			continue;
+
+		if (connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK ||
+		    connector->count_encoders < 1) {
+			drmModeFreeConnector(connector);
+			continue;
 		}
-	}
 
-	wl_list_for_each_reverse(drm_mode, &output->base.mode_list, base.link) {
-		if (width == drm_mode->base.width &&
-		    height == drm_mode->base.height &&
-		    (refresh == 0 || refresh == drm_mode->mode_info.vrefresh))
-			configured = drm_mode;
+		wb = zalloc(sizeof *wb);
+		if (!wb) {
+			drmModeFreeConnector(connector);
+			break;
+		}
 
-		if (memcmp(current_mode, &drm_mode->mode_info,
-			   sizeof *current_mode) == 0)
-			current = drm_mode;
+		wb->connector_id = connector->connector_id;
+		encoder = drmModeGetEncoder(b->drm.fd, connector->encoders[0]);
+		if (encoder) {
+			wb->possible_crtcs = encoder->possible_crtcs;
+			drmModeFreeEncoder(encoder);
+		}
+		drmModeFreeConnector(connector);
 
-		if (drm_mode->base.flags & WL_OUTPUT_MODE_PREFERRED)
-			preferred = drm_mode;
+		if (drm_object_get_props(b, wb->connector_id,
+					 DRM_MODE_OBJECT_CONNECTOR,
+					 writeback_prop_names, wb->props,
+					 values, WDRM_WRITEBACK__COUNT) < 0) {
+			free(wb);
+			continue;
+		}
 
-		best = drm_mode;
-	}
+		blob = drmModeGetPropertyBlob(b->drm.fd,
+					      values[WDRM_WRITEBACK_PIXEL_FORMATS]);
+		formats = blob ? blob->data : NULL;
+		for (j = 0; blob && j < blob->length / sizeof *formats; j++)
+			if (formats[j] == GBM_FORMAT_XRGB8888)
+				break;
+		if (!blob || j == blob->length / sizeof *formats) {
+			drmModeFreePropertyBlob(blob);
+			free(wb);
+			continue;
+		}
+		drmModeFreePropertyBlob(blob);
 
-	if (current == NULL && current_mode->clock != 0) {
-		current = drm_output_add_mode(output, current_mode);
-		if (!current)
-			return NULL;
+		weston_log("DRM: writeback connector %u, crtcs 0x%x\n",
+			   wb->connector_id, wb->possible_crtcs);
+		wl_list_insert(b->writeback_list.prev, &wb->link);
 	}
 
-	if (mode == WESTON_DRM_BACKEND_OUTPUT_CURRENT)
-		configured = current;
-
-	if (configured)
-		return configured;
+	drmModeFreeResources(resources);
+}
+#else
+static int
+drm_output_init_atomic(struct drm_output *output, struct drm_backend *b)
+{
+	return -1;
+}
 
-	if (preferred)
-		return preferred;
+static void
+drm_output_fini_atomic(struct drm_output *output, struct drm_backend *b)
+{
+}
 
-	if (current)
-		return current;
+static void
+create_writebacks(struct drm_backend *b)
+{
+}
+#endif
 
-	if (best)
-		return best;
+static void
+destroy_writebacks(struct drm_backend *b)
+{
+	struct drm_writeback *wb, *next;
 
-	weston_log("no available modes for %s\n", output->base.name);
-	return NULL;
+	wl_list_for_each_safe(wb, next, &b->writeback_list, link)
+		free(wb);
 }
 
 static int
-connector_get_current_mode(drmModeConnector *connector, int drm_fd,
-			   drmModeModeInfo *mode)
+drm_output_export_dmabuf(struct weston_output *base, int *fd, int *stride)
 {
-	drmModeEncoder *encoder;
-	drmModeCrtc *crtc;
+	struct drm_output *output = to_drm_output(base);
+	/* A flip still pending holds the newest frame */
+	struct drm_fb *fb = output->next ? output->next : output->current;
 
-	/* Get the current mode on the crtc that's currently driving
-	 * this connector. */
-	encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
-	memset(mode, 0, sizeof *mode);
-	if (encoder != NULL) {
-		crtc = drmModeGetCrtc(drm_fd, encoder->crtc_id);
-		drmModeFreeEncoder(encoder);
-		if (crtc == NULL)
-			return -1;
-		if (crtc->mode_valid)
-			*mode = crtc->mode;
-		drmModeFreeCrtc(crtc);
+	if (!fb || fb->format != GBM_FORMAT_XRGB8888) {
+		weston_log("cannot export front buffer: "
+			   "output format not supported\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (drm_output_fb_is_dumb(output, fb) &&
+	    output->dumb_rotation != WDRM_PLANE_ROTATE_0) {
+		weston_log("cannot export front buffer: "
+			   "transformed by the display\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fb->width != output->base.current_mode->width ||
+	    fb->height != output->base.current_mode->height) {
+		weston_log("cannot export front buffer: "
+			   "scaled by the display\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Only the stride goes along, readers assume a linear layout */
+	if (fb->modifier != DRM_FORMAT_MOD_LINEAR) {
+		weston_log("cannot export front buffer: "
+			   "compressed or tiled layout\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (drmPrimeHandleToFD(fb->fd, fb->handle, DRM_CLOEXEC, fd)) {
+		weston_log("failed to create prime fd for front buffer\n");
+		return -1;
 	}
 
+	*stride = fb->stride;
+
 	return 0;
 }
 
-static int
-drm_output_set_mode(struct weston_output *base,
-		    enum weston_drm_backend_output_mode mode,
-		    const char *modeline)
+#ifdef BUILD_VAAPI_RECORDER
+struct drm_vaapi_encoder {
+	struct recorder_encoder base;
+	struct vaapi_recorder *recorder;
+};
+
+static const struct recorder_encoder_interface drm_vaapi_encoder_interface;
+
+static struct recorder_encoder *
+drm_vaapi_encoder_create(struct weston_output *base,
+			 enum recorder_encoder_input input,
+			 int width, int height, const char *filename)
 {
-	struct drm_output *output = to_drm_output(base);
 	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_vaapi_encoder *encoder;
+	int fd;
+	drm_magic_t magic;
 
-	struct drm_mode *drm_mode, *next, *current;
-	drmModeModeInfo crtc_mode;
-	int i;
-
-	output->base.make = "unknown";
-	output->base.model = "unknown";
-	output->base.serial_number = "unknown";
-	wl_list_init(&output->base.mode_list);
+	encoder = zalloc(sizeof *encoder);
+	if (!encoder)
+		return NULL;
 
-	output->original_crtc = drmModeGetCrtc(b->drm.fd, output->crtc_id);
+	fd = open(b->drm.filename, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		free(encoder);
+		return NULL;
+	}
 
-	if (connector_get_current_mode(output->connector, b->drm.fd, &crtc_mode) < 0)
-		goto err_free;
+	drmGetMagic(fd, &magic);
+	drmAuthMagic(b->drm.fd, magic);
 
-	for (i = 0; i < output->connector->count_modes; i++) {
-		drm_mode = drm_output_add_mode(output, &output->connector->modes[i]);
-		if (!drm_mode)
-			goto err_free;
+	encoder->recorder = vaapi_recorder_create(fd, width, height, filename);
+	if (!encoder->recorder) {
+		close(fd);
+		free(encoder);
+		return NULL;
 	}
 
-	current = drm_output_choose_initial_mode(b, output, mode, modeline, &crtc_mode);
-	if (!current)
-		goto err_free;
-
-	output->base.current_mode = &current->base;
-	output->base.current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
+	encoder->base.interface = &drm_vaapi_encoder_interface;
 
-	/* Set native_ fields, so weston_output_mode_switch_to_native() works */
-	output->base.native_mode = output->base.current_mode;
-	output->base.native_scale = output->base.current_scale;
+	return &encoder->base;
+}
 
-	output->base.mm_width = output->connector->mmWidth;
-	output->base.mm_height = output->connector->mmHeight;
+static int
+drm_vaapi_encoder_frame(struct recorder_encoder *base, int fd, int stride)
+{
+	struct drm_vaapi_encoder *encoder =
+		container_of(base, struct drm_vaapi_encoder, base);
+	int ret;
 
-	return 0;
+	ret = vaapi_recorder_frame(encoder->recorder, fd, stride);
+	if (ret < 0)
+		close(fd);
 
-err_free:
-	drmModeFreeCrtc(output->original_crtc);
-	output->original_crtc = NULL;
+	return ret;
+}
 
-	wl_list_for_each_safe(drm_mode, next, &output->base.mode_list,
-							base.link) {
-		wl_list_remove(&drm_mode->base.link);
-		free(drm_mode);
-	}
+static void
+drm_vaapi_encoder_destroy(struct recorder_encoder *base)
+{
+	struct drm_vaapi_encoder *encoder =
+		container_of(base, struct drm_vaapi_encoder, base);
 
-	return -1;
+	vaapi_recorder_destroy(encoder->recorder);
+	free(encoder);
 }
 
+static const struct recorder_encoder_interface drm_vaapi_encoder_interface = {
+	.name = "libva",
+	.suffix = ".h264",
+	.inputs = RECORDER_ENCODER_INPUT_DMABUF,
+	.create = drm_vaapi_encoder_create,
+	.frame_dmabuf = drm_vaapi_encoder_frame,
+	.destroy = drm_vaapi_encoder_destroy,
+};
+#endif
+
+/* Stop mirroring an output on the CRTC of a clone, which is turned off
+ * and left to drm_output_destroy() to restore. */
 static void
-drm_output_set_gbm_format(struct weston_output *base,
-			  const char *gbm_format)
+drm_output_detach_clone(struct drm_output *clone)
 {
-	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(clone->base.compositor);
+	struct drm_output *output = clone->clone_of;
+
+	wl_list_remove(&clone->clone_link);
+	wl_list_init(&clone->clone_link);
+	clone->clone_of = NULL;
+	output->base.disable_planes--;
+
+	drm_output_fini_atomic(clone, b);
+	drmModeFreeProperty(clone->dpms_prop);
+	clone->dpms_prop = NULL;
+
+	drmModeSetCrtc(drm_output_fd(clone), clone->crtc_id,
+		       0, 0, 0, 0, 0, NULL);
+	weston_log("Output %s no longer mirrors %s\n",
+		   clone->base.name, output->base.name);
+}
+
+/**
+ * Mirror an output on the connector of another, not enabled, output
+ *
+ * The frames of the output are rendered once and scanned out on the CRTC
+ * of the clone as well, scaled to the mode set on the clone with atomic
+ * modesetting; legacy modesetting needs both modes to be the same size.
+ * Only the primary plane can be shared, so the output composites
+ * everything while it has clones. The clone stays a pending output, and
+ * stops mirroring when either of the two goes away.
+ *
+ * @param base Output whose connector is to mirror, with its mode set
+ * @param source_base Enabled output to mirror
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_clone(struct weston_output *base, struct weston_output *source_base)
+{
+	struct drm_output *clone = to_drm_output(base);
+	struct drm_output *output = to_drm_output(source_base);
 	struct drm_backend *b = to_drm_backend(base->compositor);
 
-	if (parse_gbm_format(gbm_format, b->gbm_format, &output->gbm_format) == -1)
-		output->gbm_format = b->gbm_format;
+	if (clone->base.enabled || clone->clone_of ||
+	    !output->base.enabled || !clone->base.current_mode)
+		return -1;
+
+	/* The framebuffers are on the render GPU */
+	if (clone->secondary || output->secondary) {
+		weston_log("Cannot mirror %s on %s: both have to be on the "
+			   "render GPU\n", output->base.name, clone->base.name);
+		return -1;
+	}
+
+	if (!b->atomic_modeset &&
+	    (clone->base.current_mode->width !=
+	     output->base.current_mode->width ||
+	     clone->base.current_mode->height !=
+	     output->base.current_mode->height)) {
+		weston_log("Cannot mirror %s on %s: without atomic "
+			   "modesetting the modes must be the same size\n",
+			   output->base.name, clone->base.name);
+		return -1;
+	}
+
+	if (b->atomic_modeset && drm_output_init_atomic(clone, b) < 0)
+		return -1;
+
+	clone->dpms_prop = drm_get_prop(drm_output_fd(clone),
+					clone->connector, "DPMS");
+	clone->modeset_pending = 1;
+	clone->clone_of = output;
+	wl_list_insert(output->clone_list.prev, &clone->clone_link);
+	output->base.disable_planes++;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset && drm_output_test_clones(output) < 0) {
+		weston_log("Cannot mirror %s on %s: the configuration was "
+			   "rejected\n", output->base.name, clone->base.name);
+		drm_output_detach_clone(clone);
+		return -1;
+	}
+#endif
+
+	weston_log("Output %s mirrors %s (connector %d, crtc %d)\n",
+		   clone->base.name, output->base.name,
+		   clone->connector_id, clone->crtc_id);
+	weston_output_damage(&output->base);
+
+	return 0;
 }
 
+/*
+ * Take over the framebuffer firmware or the previous DRM master left up
+ *
+ * If the CRTC already shows the mode we picked, it stays up until our
+ * first frame is ready, which is then page flipped to without a modeset.
+ */
 static void
-drm_output_set_seat(struct weston_output *base,
-		    const char *seat)
+drm_output_adopt_crtc(struct drm_output *output)
 {
-	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_mode *mode =
+		container_of(output->base.current_mode, struct drm_mode, base);
+	drmModeCrtcPtr crtc = output->original_crtc;
+	struct drm_gem_close gem_close;
+	drmModeEncoder *encoder;
+	drmModeFB *fbinfo;
+	struct drm_fb *fb;
+	uint32_t crtc_id = 0;
+	int fd = drm_output_fd(output);
 
-	setup_output_seat_constraint(b, &output->base,
-				     seat ? seat : "");
+	if (!crtc || !crtc->mode_valid || !crtc->buffer_id ||
+	    memcmp(&crtc->mode, &mode->mode_info, sizeof crtc->mode) != 0)
+		return;
+
+	encoder = drmModeGetEncoder(fd, output->connector->encoder_id);
+	if (encoder) {
+		crtc_id = encoder->crtc_id;
+		drmModeFreeEncoder(encoder);
+	}
+	if (crtc_id != output->crtc_id)
+		return;
+
+	fbinfo = drmModeGetFB(fd, crtc->buffer_id);
+	if (!fbinfo)
+		return;
+
+	/* The handle is only handed out to the DRM master, and not needed */
+	if (fbinfo->handle) {
+		memset(&gem_close, 0, sizeof gem_close);
+		gem_close.handle = fbinfo->handle;
+		drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
+
+	fb = zalloc(sizeof *fb);
+	if (fb) {
+		fb->fb_id = fbinfo->fb_id;
+		fb->stride = fbinfo->pitch;
+		fb->width = fbinfo->width;
+		fb->height = fbinfo->height;
+		fb->fd = fd;
+		fb->foreign = 1;
+		output->current = fb;
+		weston_log("Output %s keeps the current mode, "
+			   "skipping the modeset\n", output->base.name);
+	}
+
+	drmModeFreeFB(fbinfo);
 }
 
 static int
@@ -2432,7 +7008,20 @@ drm_output_enable(struct weston_output *base)
 	struct drm_backend *b = to_drm_backend(base->compositor);
 	struct weston_mode *m;
 
-	output->dpms_prop = drm_get_prop(b->drm.fd, output->connector, "DPMS");
+	if (output->clone_of) {
+		weston_log("Output %s mirrors %s, not enabling it\n",
+			   output->base.name, output->clone_of->base.name);
+		return -1;
+	}
+
+	output->dpms_prop = drm_get_prop(drm_output_fd(output),
+					 output->connector, "DPMS");
+
+	if (b->atomic_modeset && !output->secondary &&
+	    drm_output_init_atomic(output, b) < 0) {
+		weston_log("Failed to init output atomic state\n");
+		goto err_free;
+	}
 
 	if (b->use_pixman) {
 		if (drm_output_init_pixman(output, b) < 0) {
@@ -2444,6 +7033,8 @@ drm_output_enable(struct weston_output *base)
 		goto err_free;
 	}
 
+	drm_output_adopt_crtc(output);
+
 	if (output->backlight) {
 		weston_log("Initialized backlight, device %s\n",
 			   output->backlight->path);
@@ -2457,11 +7048,35 @@ drm_output_enable(struct weston_output *base)
 	output->base.repaint = drm_output_repaint;
 	output->base.assign_planes = drm_assign_planes;
 	output->base.set_dpms = drm_set_dpms;
+	output->base.move_plane = drm_output_move_plane;
 	output->base.switch_mode = drm_output_switch_mode;
+	output->base.export_dmabuf = drm_output_export_dmabuf;
+#ifdef BUILD_VAAPI_RECORDER
+	output->base.recorder_encoder = &drm_vaapi_encoder_interface;
+#endif
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset && !output->secondary &&
+	    !wl_list_empty(&b->writeback_list)) {
+		output->base.enable_writeback = drm_output_enable_writeback;
+		output->base.disable_writeback = drm_output_disable_writeback;
+		output->base.read_writeback = drm_output_read_writeback;
+		output->base.export_writeback = drm_output_export_writeback;
+	}
+#endif
 
 	output->base.gamma_size = output->original_crtc->gamma_size;
 	output->base.set_gamma = drm_output_set_gamma;
 
+	if (output->secondary) {
+		output->base.assign_planes = drm_assign_planes_secondary;
+#ifdef BUILD_VAAPI_RECORDER
+		output->base.recorder_encoder = NULL;
+#endif
+	} else {
+		drm_output_init_color(output, b);
+		drm_output_init_vrr(output, b);
+	}
+
 	output->base.subpixel = drm_subpixel_to_wayland(output->connector->subpixel);
 
 	find_and_parse_output_edid(b, output, output->connector);
@@ -2492,6 +7107,7 @@ drm_output_enable(struct weston_output *base)
 	return 0;
 
 err_free:
+	drm_output_fini_atomic(output, b);
 	drmModeFreeProperty(output->dpms_prop);
 
 	return -1;
@@ -2502,6 +7118,18 @@ drm_output_deinit(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
 	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_output *clone, *next;
+	struct drm_sprite *s;
+
+	wl_list_for_each_safe(clone, next, &output->clone_list, clone_link)
+		drm_output_detach_clone(clone);
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->reserved == output)
+			s->reserved = NULL;
+		if (s->output == output)
+			s->output = NULL;
+	}
 
 	if (b->use_pixman)
 		drm_output_fini_pixman(output);
@@ -2511,20 +7139,42 @@ drm_output_deinit(struct weston_output *base)
 	weston_plane_release(&output->fb_plane);
 	weston_plane_release(&output->cursor_plane);
 
+	if (output->solid_fb) {
+		if (output->current == output->solid_fb)
+			output->current = NULL;
+		drm_fb_destroy_dumb(output->solid_fb);
+		output->solid_fb = NULL;
+	}
+
 	drmModeFreeProperty(output->dpms_prop);
 
+	drm_output_fini_atomic(output, b);
+
 	/* Turn off hardware cursor */
-	drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+	drmModeSetCursor(drm_output_fd(output), output->crtc_id, 0, 0, 0);
+	output->current_cursor = NULL;
+}
+
+static void
+drm_output_fini_cursors(struct drm_output *output)
+{
+	int i;
+
+	for (i = 0; i < DRM_CURSOR_CACHE_SIZE; i++) {
+		if (output->cursors[i].bo)
+			gbm_bo_destroy(output->cursors[i].bo);
+		free(output->cursors[i].image);
+	}
 }
 
 static void
 drm_output_destroy(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
 	drmModeCrtcPtr origcrtc = output->original_crtc;
 
-	if (output->page_flip_pending) {
+	if (output->page_flip_pending || output->vblank_pending ||
+	    output->clone_flips_pending) {
 		output->destroy_pending = 1;
 		weston_log("destroy output while page flip pending\n");
 		return;
@@ -2532,10 +7182,13 @@ drm_output_destroy(struct weston_output *base)
 
 	if (output->base.enabled)
 		drm_output_deinit(&output->base);
+	else if (output->clone_of)
+		drm_output_detach_clone(output);
 
 	if (origcrtc) {
 		/* Restore original CRTC state */
-		drmModeSetCrtc(b->drm.fd, origcrtc->crtc_id, origcrtc->buffer_id,
+		drmModeSetCrtc(drm_output_fd(output), origcrtc->crtc_id,
+			       origcrtc->buffer_id,
 			       origcrtc->x, origcrtc->y,
 			       &output->connector_id, 1, &origcrtc->mode);
 		drmModeFreeCrtc(origcrtc);
@@ -2543,11 +7196,14 @@ drm_output_destroy(struct weston_output *base)
 
 	weston_output_destroy(&output->base);
 
+	drm_output_fini_cursors(output);
 	drmModeFreeConnector(output->connector);
 
 	if (output->backlight)
 		backlight_destroy(output->backlight);
 
+	wl_array_release(&output->plane_candidates);
+
 	free(output);
 }
 
@@ -2555,20 +7211,22 @@ static int
 drm_output_disable(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
 
-	if (output->page_flip_pending) {
+	if (output->page_flip_pending || output->vblank_pending ||
+	    output->clone_flips_pending) {
 		output->disable_pending = 1;
 		return -1;
 	}
 
 	if (output->base.enabled)
 		drm_output_deinit(&output->base);
+	else if (output->clone_of)
+		drm_output_detach_clone(output);
 
 	output->disable_pending = 0;
 
 	weston_log("Disabling output %s\n", output->base.name);
-	drmModeSetCrtc(b->drm.fd, output->crtc_id,
+	drmModeSetCrtc(drm_output_fd(output), output->crtc_id,
 		       0, 0, 0, 0, 0, NULL);
 
 	return 0;
@@ -2582,6 +7240,7 @@ drm_output_disable(struct weston_output *base)
  * is released when output is destroyed.
  *
  * @param b Weston backend structure
+ * @param dev Secondary KMS device the connector is on, or NULL
  * @param resources DRM resources for this device
  * @param connector DRM connector to use for this new output
  * @param drm_device udev device pointer
@@ -2589,14 +7248,16 @@ drm_output_disable(struct weston_output *base)
  */
 static int
 create_output_for_connector(struct drm_backend *b,
+			    struct drm_secondary *dev,
 			    drmModeRes *resources,
 			    drmModeConnector *connector,
 			    struct udev_device *drm_device)
 {
 	struct drm_output *output;
+	char *name;
 	int i;
 
-	i = find_crtc_for_connector(b, resources, connector);
+	i = find_crtc_for_connector(b, dev, resources, connector);
 	if (i < 0) {
 		weston_log("No usable crtc/encoder pair for connector.\n");
 		return -1;
@@ -2607,9 +7268,14 @@ create_output_for_connector(struct drm_backend *b,
 		return -1;
 
 	output->connector = connector;
+	output->secondary = dev;
 	output->crtc_id = resources->crtcs[i];
 	output->pipe = i;
 	output->connector_id = connector->connector_id;
+	output->writeback_pending = -1;
+	output->writeback_last = -1;
+	output->writeback_fence = -1;
+	output->render_scale = 1.0;
 
 	output->backlight = backlight_init(drm_device,
 					   connector->connector_type);
@@ -2619,9 +7285,18 @@ create_output_for_connector(struct drm_backend *b,
 	output->base.disable = drm_output_disable;
 	output->base.name = make_connector_name(connector);
 
+	/* Connector names repeat across devices */
+	if (dev && output->base.name &&
+	    asprintf(&name, "card%d-%s", dev->id, output->base.name) >= 0) {
+		free(output->base.name);
+		output->base.name = name;
+	}
+
 	output->destroy_pending = 0;
 	output->disable_pending = 0;
 	output->original_crtc = NULL;
+	wl_array_init(&output->plane_candidates);
+	wl_list_init(&output->clone_list);
 
 	weston_output_init(&output->base, b->compositor);
 	weston_compositor_add_pending_output(&output->base, b->compositor);
@@ -2635,6 +7310,7 @@ create_sprites(struct drm_backend *b)
 	struct drm_sprite *sprite;
 	drmModePlaneRes *plane_res;
 	drmModePlane *plane;
+	uint64_t values[WDRM_PLANE__COUNT];
 	uint32_t i;
 
 	plane_res = drmModeGetPlaneResources(b->drm.fd);
@@ -2662,12 +7338,44 @@ create_sprites(struct drm_backend *b)
 		sprite->plane_id = plane->plane_id;
 		sprite->current = NULL;
 		sprite->next = NULL;
+		sprite->in_fence_fd = -1;
 		sprite->backend = b;
 		sprite->count_formats = plane->count_formats;
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
 		drmModeFreePlane(plane);
+
+		values[WDRM_PLANE_TYPE] = WDRM_PLANE_TYPE_OVERLAY;
+#ifdef HAVE_DRM_ATOMIC
+		if (b->atomic_modeset &&
+		    drm_object_get_props(b, sprite->plane_id,
+					 DRM_MODE_OBJECT_PLANE,
+					 plane_prop_names, sprite->props,
+					 values, WDRM_PLANE__COUNT) < 0) {
+			weston_log("plane %d lacks atomic properties, "
+				   "ignoring\n", sprite->plane_id);
+			free(sprite);
+			continue;
+		}
+
+		if (b->atomic_modeset)
+			drm_plane_get_optional_props(b, sprite);
+#endif
+
+		/* Cursors keep using the legacy cursor ioctls. */
+		if (values[WDRM_PLANE_TYPE] == WDRM_PLANE_TYPE_CURSOR) {
+			wl_array_release(&sprite->in_formats);
+			free(sprite);
+			continue;
+		}
+
 		weston_plane_init(&sprite->plane, b->compositor, 0, 0);
+
+		if (values[WDRM_PLANE_TYPE] == WDRM_PLANE_TYPE_PRIMARY) {
+			wl_list_insert(&b->primary_plane_list, &sprite->link);
+			continue;
+		}
+
 		weston_compositor_stack_plane(b->compositor, &sprite->plane,
 					      &b->compositor->primary_plane);
 
@@ -2682,6 +7390,7 @@ destroy_sprites(struct drm_backend *backend)
 {
 	struct drm_sprite *sprite, *next;
 	struct drm_output *output;
+	unsigned int i;
 
 	output = container_of(backend->compositor->output_list.next,
 			      struct drm_output, base.link);
@@ -2693,39 +7402,69 @@ destroy_sprites(struct drm_backend *backend)
 				0, 0, 0, 0, 0, 0, 0, 0);
 		drm_output_release_fb(output, sprite->current);
 		drm_output_release_fb(output, sprite->next);
+		for (i = 0; i < ARRAY_LENGTH(sprite->cursor_fbs); i++)
+			if (sprite->cursor_fbs[i])
+				drm_fb_destroy_dumb(sprite->cursor_fbs[i]);
+		drm_sprite_set_in_fence(sprite, -1);
+		weston_plane_release(&sprite->plane);
+		wl_array_release(&sprite->in_formats);
+		free(sprite);
+	}
+
+	wl_list_for_each_safe(sprite, next, &backend->primary_plane_list,
+			      link) {
+		drm_sprite_set_in_fence(sprite, -1);
 		weston_plane_release(&sprite->plane);
+		wl_array_release(&sprite->in_formats);
 		free(sprite);
 	}
 }
 
+/* Writeback connectors show up as connected, but are no displays */
+static bool
+drm_connector_is_connected(drmModeConnector *connector)
+{
+	return connector->connection == DRM_MODE_CONNECTED &&
+	       connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK;
+}
+
 static int
-create_outputs(struct drm_backend *b, struct udev_device *drm_device)
+create_outputs(struct drm_backend *b, struct drm_secondary *dev,
+	       struct udev_device *drm_device)
 {
 	drmModeConnector *connector;
 	drmModeRes *resources;
+	int fd = dev ? dev->fd : b->drm.fd;
 	int i;
 
-	resources = drmModeGetResources(b->drm.fd);
+	resources = drmModeGetResources(fd);
 	if (!resources) {
 		weston_log("drmModeGetResources failed\n");
 		return -1;
 	}
 
-	b->min_width  = resources->min_width;
-	b->max_width  = resources->max_width;
-	b->min_height = resources->min_height;
-	b->max_height = resources->max_height;
+	if (dev) {
+		dev->min_width  = resources->min_width;
+		dev->max_width  = resources->max_width;
+		dev->min_height = resources->min_height;
+		dev->max_height = resources->max_height;
+	} else {
+		b->min_width  = resources->min_width;
+		b->max_width  = resources->max_width;
+		b->min_height = resources->min_height;
+		b->max_height = resources->max_height;
+	}
 
 	for (i = 0; i < resources->count_connectors; i++) {
-		connector = drmModeGetConnector(b->drm.fd,
-						resources->connectors[i]);
+		connector = drmModeGetConnector(fd, resources->connectors[i]);
 		if (connector == NULL)
 			continue;
 
-		if (connector->connection == DRM_MODE_CONNECTED &&
-		    (b->connector == 0 ||
+		/* The connector id only selects on the render GPU */
+		if (drm_connector_is_connected(connector) &&
+		    (dev || b->connector == 0 ||
 		     connector->connector_id == b->connector)) {
-			if (create_output_for_connector(b, resources,
+			if (create_output_for_connector(b, dev, resources,
 							connector, drm_device) < 0) {
 				drmModeFreeConnector(connector);
 				continue;
@@ -2735,7 +7474,7 @@ create_outputs(struct drm_backend *b, struct udev_device *drm_device)
 		}
 	}
 
-	if (wl_list_empty(&b->compositor->output_list) &&
+	if (!dev && wl_list_empty(&b->compositor->output_list) &&
 	    wl_list_empty(&b->compositor->pending_output_list))
 		weston_log("No currently active connector found.\n");
 
@@ -2745,15 +7484,17 @@ create_outputs(struct drm_backend *b, struct udev_device *drm_device)
 }
 
 static void
-update_outputs(struct drm_backend *b, struct udev_device *drm_device)
+update_outputs(struct drm_backend *b, struct drm_secondary *dev,
+	       struct udev_device *drm_device)
 {
 	drmModeConnector *connector;
 	drmModeRes *resources;
 	struct drm_output *output, *next;
 	uint32_t *connected;
+	int fd = dev ? dev->fd : b->drm.fd;
 	int i;
 
-	resources = drmModeGetResources(b->drm.fd);
+	resources = drmModeGetResources(fd);
 	if (!resources) {
 		weston_log("drmModeGetResources failed\n");
 		return;
@@ -2769,28 +7510,28 @@ update_outputs(struct drm_backend *b, struct udev_device *drm_device)
 	for (i = 0; i < resources->count_connectors; i++) {
 		uint32_t connector_id = resources->connectors[i];
 
-		connector = drmModeGetConnector(b->drm.fd, connector_id);
+		connector = drmModeGetConnector(fd, connector_id);
 		if (connector == NULL)
 			continue;
 
-		if (connector->connection != DRM_MODE_CONNECTED) {
+		if (!drm_connector_is_connected(connector)) {
 			drmModeFreeConnector(connector);
 			continue;
 		}
 
-		if (b->connector && (b->connector != connector_id)) {
+		if (!dev && b->connector && (b->connector != connector_id)) {
 			drmModeFreeConnector(connector);
 			continue;
 		}
 
 		connected[i] = connector_id;
 
-		if (drm_output_find_by_connector(b, connector_id)) {
+		if (drm_output_find_by_connector(b, dev, connector_id)) {
 			drmModeFreeConnector(connector);
 			continue;
 		}
 
-		create_output_for_connector(b, resources,
+		create_output_for_connector(b, dev, resources,
 					    connector, drm_device);
 		weston_log("connector %d connected\n", connector_id);
 	}
@@ -2799,6 +7540,9 @@ update_outputs(struct drm_backend *b, struct udev_device *drm_device)
 			      base.link) {
 		bool disconnected = true;
 
+		if (output->secondary != dev)
+			continue;
+
 		for (i = 0; i < resources->count_connectors; i++) {
 			if (connected[i] == output->connector_id) {
 				disconnected = false;
@@ -2817,6 +7561,9 @@ update_outputs(struct drm_backend *b, struct udev_device *drm_device)
 			      base.link) {
 		bool disconnected = true;
 
+		if (output->secondary != dev)
+			continue;
+
 		for (i = 0; i < resources->count_connectors; i++) {
 			if (connected[i] == output->connector_id) {
 				disconnected = false;
@@ -2835,33 +7582,107 @@ update_outputs(struct drm_backend *b, struct udev_device *drm_device)
 	drmModeFreeResources(resources);
 }
 
+/* Re-probes only the connector a hotplug event names. Returns -1 if the
+ * connector is gone and the whole device needs to be rescanned. */
+static int
+update_connector(struct drm_backend *b, struct drm_secondary *dev,
+		 uint32_t connector_id, struct udev_device *drm_device)
+{
+	drmModeConnector *connector;
+	drmModeRes *resources;
+	struct drm_output *output;
+	int fd = dev ? dev->fd : b->drm.fd;
+	bool connected;
+
+	connector = drmModeGetConnector(fd, connector_id);
+	if (connector == NULL)
+		return -1;
+
+	connected = drm_connector_is_connected(connector) &&
+		    (dev || !b->connector || b->connector == connector_id);
+	output = drm_output_find_by_connector(b, dev, connector_id);
+
+	if (connected && !output) {
+		resources = drmModeGetResources(fd);
+		if (!resources) {
+			weston_log("drmModeGetResources failed\n");
+			drmModeFreeConnector(connector);
+			return 0;
+		}
+
+		if (create_output_for_connector(b, dev, resources,
+						connector, drm_device) < 0)
+			drmModeFreeConnector(connector);
+		else
+			weston_log("connector %d connected\n", connector_id);
+
+		drmModeFreeResources(resources);
+		return 0;
+	}
+
+	drmModeFreeConnector(connector);
+
+	if (!connected && output) {
+		weston_log("connector %d disconnected\n", connector_id);
+		drm_output_destroy(&output->base);
+	}
+
+	return 0;
+}
+
+static void
+drm_handle_hotplug(struct drm_backend *b, struct drm_secondary *dev,
+		   struct udev_device *event)
+{
+	const char *val;
+
+	/* Newer kernels say which connector changed */
+	val = udev_device_get_property_value(event, "CONNECTOR");
+	if (val && update_connector(b, dev, strtoul(val, NULL, 10),
+				    event) == 0)
+		return;
+
+	update_outputs(b, dev, event);
+}
+
+/* Returns the card number of the device the hotplug event is for, or -1
+ * if it is not a hotplug event */
 static int
-udev_event_is_hotplug(struct drm_backend *b, struct udev_device *device)
+udev_event_get_hotplug_id(struct udev_device *device)
 {
 	const char *sysnum;
 	const char *val;
 
 	sysnum = udev_device_get_sysnum(device);
-	if (!sysnum || atoi(sysnum) != b->drm.id)
-		return 0;
+	if (!sysnum)
+		return -1;
 
 	val = udev_device_get_property_value(device, "HOTPLUG");
-	if (!val)
-		return 0;
+	if (!val || strcmp(val, "1") != 0)
+		return -1;
 
-	return strcmp(val, "1") == 0;
+	return atoi(sysnum);
 }
 
 static int
 udev_drm_event(int fd, uint32_t mask, void *data)
 {
 	struct drm_backend *b = data;
+	struct drm_secondary *dev;
 	struct udev_device *event;
+	int id;
 
 	event = udev_monitor_receive_device(b->udev_monitor);
 
-	if (udev_event_is_hotplug(b, event))
-		update_outputs(b, event);
+	id = udev_event_get_hotplug_id(event);
+	if (id >= 0 && id == b->drm.id) {
+		drm_handle_hotplug(b, NULL, event);
+	} else if (id >= 0) {
+		wl_list_for_each(dev, &b->secondary_list, link) {
+			if (dev->id == id)
+				drm_handle_hotplug(b, dev, event);
+		}
+	}
 
 	udev_device_unref(event);
 
@@ -2874,10 +7695,30 @@ drm_restore(struct weston_compositor *ec)
 	weston_launcher_restore(ec->launcher);
 }
 
+static void
+drm_flush_input(struct weston_compositor *ec)
+{
+	struct drm_backend *b = to_drm_backend(ec);
+
+	udev_input_flush(&b->input);
+}
+
+static void
+drm_secondary_destroy(struct drm_secondary *dev)
+{
+	if (dev->source)
+		wl_event_source_remove(dev->source);
+	wl_list_remove(&dev->link);
+	close(dev->fd);
+	free(dev->filename);
+	free(dev);
+}
+
 static void
 drm_destroy(struct weston_compositor *ec)
 {
 	struct drm_backend *b = to_drm_backend(ec);
+	struct drm_secondary *dev, *next;
 
 	udev_input_destroy(&b->input);
 
@@ -2887,16 +7728,60 @@ drm_destroy(struct weston_compositor *ec)
 	destroy_sprites(b);
 
 	weston_compositor_shutdown(ec);
+	destroy_writebacks(b);
+
+	drm_fb_cache_release(b);
+	drm_edid_cache_release(b);
 
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
 
 	weston_launcher_destroy(ec->launcher);
 
+	wl_list_for_each_safe(dev, next, &b->secondary_list, link)
+		drm_secondary_destroy(dev);
+
 	close(b->drm.fd);
 	free(b);
 }
 
+/* Whoever had the DRM device while we were away may have left the CRTC
+ * as we had it: then the framebuffer we scanned out is still up and only
+ * what changed in the meantime needs repainting. Otherwise the output is
+ * repainted in full, after a modeset if the mode is not ours any more. */
+static void
+drm_output_resume(struct drm_output *output)
+{
+	struct drm_mode *mode = container_of(output->base.current_mode,
+					     struct drm_mode, base);
+	struct drm_output *clone;
+	drmModeCrtc *crtc;
+	bool same_mode = false;
+	bool same_fb = false;
+
+	crtc = drmModeGetCrtc(drm_output_fd(output), output->crtc_id);
+	if (crtc) {
+		same_mode = crtc->mode_valid &&
+			memcmp(&crtc->mode, &mode->mode_info,
+			       sizeof crtc->mode) == 0;
+		same_fb = output->current &&
+			crtc->buffer_id == output->current->fb_id;
+		drmModeFreeCrtc(crtc);
+	}
+
+	if (!same_mode)
+		output->modeset_pending = 1;
+
+	/* The clones are set up again along with the next frame */
+	wl_list_for_each(clone, &output->clone_list, clone_link)
+		clone->modeset_pending = 1;
+
+	if (same_mode && same_fb)
+		weston_output_schedule_repaint(&output->base);
+	else
+		weston_output_damage(&output->base);
+}
+
 static void
 session_notify(struct wl_listener *listener, void *data)
 {
@@ -2908,7 +7793,8 @@ session_notify(struct wl_listener *listener, void *data)
 	if (compositor->session_active) {
 		weston_log("activating session\n");
 		weston_compositor_wake(compositor);
-		weston_compositor_damage_all(compositor);
+		wl_list_for_each(output, &compositor->output_list, base.link)
+			drm_output_resume(output);
 		udev_input_enable(&b->input);
 	} else {
 		weston_log("deactivating session\n");
@@ -2926,7 +7812,9 @@ session_notify(struct wl_listener *listener, void *data)
 
 		wl_list_for_each(output, &compositor->output_list, base.link) {
 			output->base.repaint_needed = 0;
-			drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+			drmModeSetCursor(drm_output_fd(output),
+					 output->crtc_id, 0, 0, 0);
+			output->current_cursor = NULL;
 		}
 
 		output = container_of(compositor->output_list.next,
@@ -2996,147 +7884,164 @@ find_primary_gpu(struct drm_backend *b, const char *seat)
 	return drm_device;
 }
 
-static void
-planes_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
-	       void *data)
-{
-	struct drm_backend *b = data;
-
-	switch (key) {
-	case KEY_C:
-		b->cursors_are_broken ^= 1;
-		break;
-	case KEY_V:
-		b->sprites_are_broken ^= 1;
-		break;
-	case KEY_O:
-		b->sprites_hidden ^= 1;
-		break;
-	default:
-		break;
-	}
-}
-
-#ifdef BUILD_VAAPI_RECORDER
-static void
-recorder_destroy(struct drm_output *output)
-{
-	vaapi_recorder_destroy(output->recorder);
-	output->recorder = NULL;
-
-	output->base.disable_planes--;
-
-	wl_list_remove(&output->recorder_frame_listener.link);
-	weston_log("[libva recorder] done\n");
-}
-
-static void
-recorder_frame_notify(struct wl_listener *listener, void *data)
+static struct drm_secondary *
+drm_secondary_create(struct drm_backend *b, struct udev_device *device)
 {
-	struct drm_output *output;
-	struct drm_backend *b;
+	struct drm_secondary *dev;
+	struct wl_event_loop *loop;
+	const char *filename, *sysnum;
+	drmModeRes *resources;
+	uint64_t cap;
 	int fd, ret;
 
-	output = container_of(listener, struct drm_output,
-			      recorder_frame_listener);
-	b = to_drm_backend(output->base.compositor);
+	sysnum = udev_device_get_sysnum(device);
+	filename = udev_device_get_devnode(device);
+	if (!sysnum || !filename)
+		return NULL;
 
-	if (!output->recorder)
-		return;
+	fd = weston_launcher_open(b->compositor->launcher, filename, O_RDWR);
+	if (fd < 0) {
+		weston_log("couldn't open %s, skipping\n", filename);
+		return NULL;
+	}
 
-	ret = drmPrimeHandleToFD(b->drm.fd, output->current->handle,
-				 DRM_CLOEXEC, &fd);
-	if (ret) {
-		weston_log("[libva recorder] "
-			   "failed to create prime fd for front buffer\n");
-		return;
+	/* Render-only devices have no KMS resources */
+	resources = drmModeGetResources(fd);
+	if (!resources) {
+		weston_launcher_close(b->compositor->launcher, fd);
+		return NULL;
 	}
+	drmModeFreeResources(resources);
 
-	ret = vaapi_recorder_frame(output->recorder, fd,
-				   output->current->stride);
-	if (ret < 0) {
-		weston_log("[libva recorder] aborted: %m\n");
-		recorder_destroy(output);
+	/* Page flip timestamps have to be in the presentation clock */
+	ret = drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap);
+	if ((ret == 0 && cap == 1) !=
+	    (b->compositor->presentation_clock == CLOCK_MONOTONIC)) {
+		weston_log("%s uses a different clock, skipping\n", filename);
+		weston_launcher_close(b->compositor->launcher, fd);
+		return NULL;
 	}
-}
 
-static void *
-create_recorder(struct drm_backend *b, int width, int height,
-		const char *filename)
-{
-	int fd;
-	drm_magic_t magic;
+	dev = zalloc(sizeof *dev);
+	if (!dev) {
+		weston_launcher_close(b->compositor->launcher, fd);
+		return NULL;
+	}
 
-	fd = open(b->drm.filename, O_RDWR | O_CLOEXEC);
-	if (fd < 0)
+	dev->backend = b;
+	dev->id = atoi(sysnum);
+	dev->fd = fd;
+	dev->filename = strdup(filename);
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	dev->source = wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+					   on_drm_secondary_input, dev);
+	if (!dev->source) {
+		free(dev->filename);
+		free(dev);
+		weston_launcher_close(b->compositor->launcher, fd);
 		return NULL;
+	}
 
-	drmGetMagic(fd, &magic);
-	drmAuthMagic(b->drm.fd, magic);
+	wl_list_insert(b->secondary_list.prev, &dev->link);
+	weston_log("using %s as a secondary display device\n", filename);
 
-	return vaapi_recorder_create(fd, width, height, filename);
+	return dev;
 }
 
+/*
+ * Find secondary GPUs
+ * Every other KMS device on the seat gets its outputs driven with buffers
+ * rendered on the primary GPU.
+ */
 static void
-recorder_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
-		 void *data)
+find_secondary_gpus(struct drm_backend *b, const char *seat)
 {
-	struct drm_backend *b = data;
-	struct drm_output *output;
-	int width, height;
-
-	output = container_of(b->compositor->output_list.next,
-			      struct drm_output, base.link);
+	struct udev_enumerate *e;
+	struct udev_list_entry *entry;
+	const char *path, *device_seat, *sysnum;
+	struct udev_device *device;
+	struct drm_secondary *dev;
 
-	if (!output->recorder) {
-		if (output->gbm_format != GBM_FORMAT_XRGB8888) {
-			weston_log("failed to start vaapi recorder: "
-				   "output format not supported\n");
-			return;
-		}
+#ifndef HAVE_GBM_BO_MAP
+	/* The render GPU has no way to hand its buffers over */
+	if (!b->use_pixman)
+		return;
+#endif
 
-		width = output->base.current_mode->width;
-		height = output->base.current_mode->height;
+	e = udev_enumerate_new(b->udev);
+	udev_enumerate_add_match_subsystem(e, "drm");
+	udev_enumerate_add_match_sysname(e, "card[0-9]*");
 
-		output->recorder =
-			create_recorder(b, width, height, "capture.h264");
-		if (!output->recorder) {
-			weston_log("failed to create vaapi recorder\n");
-			return;
+	udev_enumerate_scan_devices(e);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+		path = udev_list_entry_get_name(entry);
+		device = udev_device_new_from_syspath(b->udev, path);
+		if (!device)
+			continue;
+		device_seat = udev_device_get_property_value(device, "ID_SEAT");
+		if (!device_seat)
+			device_seat = default_seat;
+		sysnum = udev_device_get_sysnum(device);
+		if (strcmp(device_seat, seat) ||
+		    !sysnum || atoi(sysnum) == b->drm.id) {
+			udev_device_unref(device);
+			continue;
 		}
 
-		output->base.disable_planes++;
-
-		output->recorder_frame_listener.notify = recorder_frame_notify;
-		wl_signal_add(&output->base.frame_signal,
-			      &output->recorder_frame_listener);
-
-		weston_output_schedule_repaint(&output->base);
+		dev = drm_secondary_create(b, device);
+		if (dev && create_outputs(b, dev, device) < 0)
+			weston_log("failed to create outputs for %s\n",
+				   dev->filename);
 
-		weston_log("[libva recorder] initialized\n");
-	} else {
-		recorder_destroy(output);
+		udev_device_unref(device);
 	}
+
+	udev_enumerate_unref(e);
 }
-#else
+
 static void
-recorder_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
-		 void *data)
+planes_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
+	       void *data)
 {
-	weston_log("Compiled without libva support\n");
+	struct drm_backend *b = data;
+
+	switch (key) {
+	case KEY_C:
+		b->cursors_are_broken ^= 1;
+		break;
+	case KEY_V:
+		b->sprites_are_broken ^= 1;
+		break;
+	case KEY_O:
+		b->sprites_hidden ^= 1;
+		break;
+	default:
+		break;
+	}
 }
-#endif
 
 static void
 switch_to_gl_renderer(struct drm_backend *b)
 {
 	struct drm_output *output;
 	bool dmabuf_support_inited;
+	bool explicit_sync_inited;
 
 	if (!b->use_pixman)
 		return;
 
+#ifndef HAVE_GBM_BO_MAP
+	if (!wl_list_empty(&b->secondary_list)) {
+		weston_log("Cannot render to secondary devices with GL. "
+			   "Aborting renderer switch\n");
+		return;
+	}
+#endif
+
 	dmabuf_support_inited = !!b->compositor->renderer->import_dmabuf;
+	explicit_sync_inited = !!(b->compositor->capabilities &
+				  WESTON_CAP_EXPLICIT_SYNC);
 
 	weston_log("Switching to GL renderer\n");
 
@@ -3169,6 +8074,64 @@ switch_to_gl_renderer(struct drm_backend *b)
 			weston_log("Error: initializing dmabuf "
 				   "support failed.\n");
 	}
+
+	if (!explicit_sync_inited &&
+	    (b->compositor->capabilities & WESTON_CAP_EXPLICIT_SYNC)) {
+		if (linux_explicit_synchronization_setup(b->compositor) < 0)
+			weston_log("Error: initializing explicit "
+				   "synchronization support failed.\n");
+	}
+}
+
+static bool
+drm_plane_format_supported(struct drm_sprite *s, uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < s->count_formats; i++)
+		if (s->formats[i] == format)
+			return true;
+
+	return false;
+}
+
+/**
+ * Check whether any plane can scan out a dmabuf directly
+ *
+ * ARGB buffers count for planes taking XRGB, as they are scanned out
+ * that way whenever the surface is opaque.
+ *
+ * @param compositor The compositor
+ * @param format DRM format of the dmabuf
+ * @param modifier Layout modifier of the dmabuf
+ * @returns true if a primary or overlay plane takes the buffer
+ */
+static bool
+drm_dmabuf_scanout_supported(struct weston_compositor *compositor,
+			     uint32_t format, uint64_t modifier)
+{
+	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_output *output;
+	struct drm_sprite *s;
+	uint32_t opaque_format = format;
+
+	if (b->gbm == NULL || !drm_dmabuf_modifier_supported(modifier))
+		return false;
+
+	if (format == GBM_FORMAT_ARGB8888)
+		opaque_format = GBM_FORMAT_XRGB8888;
+
+	wl_list_for_each(output, &compositor->output_list, base.link)
+		if (output->gbm_format == opaque_format ||
+		    output->gbm_format == format)
+			return true;
+
+	wl_list_for_each(s, &b->sprite_list, link)
+		if (drm_plane_format_supported(s, format) ||
+		    drm_plane_format_supported(s, opaque_format))
+			return true;
+
+	return false;
 }
 
 static void
@@ -3185,6 +8148,8 @@ static const struct weston_drm_output_api api = {
 	drm_output_set_mode,
 	drm_output_set_gbm_format,
 	drm_output_set_seat,
+	drm_output_clone,
+	drm_output_set_render_scale,
 };
 
 static struct drm_backend *
@@ -3212,11 +8177,14 @@ drm_backend_create(struct weston_compositor *compositor,
 	 * to a fraction. For cursors, it's not so bad, so they are
 	 * enabled.
 	 *
-	 * These can be enabled again when nuclear/atomic support lands.
+	 * Sprites are enabled again below if the device supports atomic
+	 * modesetting.
 	 */
 	b->sprites_are_broken = 1;
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
+	b->render_threads = config->render_threads;
+	b->planes_scope = weston_log_scope_get("drm-planes");
 
 	if (parse_gbm_format(config->gbm_format, GBM_FORMAT_XRGB8888, &b->gbm_format) < 0)
 		goto err_compositor;
@@ -3232,6 +8200,7 @@ drm_backend_create(struct weston_compositor *compositor,
 			   "using weston-launch binary or as root\n");
 		goto err_compositor;
 	}
+	weston_startup_mark("startup_drm_launcher");
 
 	b->udev = udev_new();
 	if (b->udev == NULL) {
@@ -3253,6 +8222,10 @@ drm_backend_create(struct weston_compositor *compositor,
 		weston_log("failed to initialize kms\n");
 		goto err_udev_dev;
 	}
+	weston_startup_mark("startup_drm_kms");
+
+	if (b->atomic_modeset)
+		b->sprites_are_broken = 0;
 
 	if (b->use_pixman) {
 		if (init_pixman(b) < 0) {
@@ -3265,14 +8238,30 @@ drm_backend_create(struct weston_compositor *compositor,
 			goto err_udev_dev;
 		}
 	}
+	weston_startup_mark("startup_drm_renderer");
 
 	b->base.destroy = drm_destroy;
 	b->base.restore = drm_restore;
+	b->base.flush_input = drm_flush_input;
+	b->base.dmabuf_scanout_supported = drm_dmabuf_scanout_supported;
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset) {
+		b->base.repaint_begin = drm_repaint_begin;
+		b->base.repaint_flush = drm_repaint_flush;
+		b->base.repaint_cancel = drm_repaint_cancel;
+	}
+#endif
 
 	weston_setup_vt_switch_bindings(compositor);
 
 	wl_list_init(&b->sprite_list);
+	wl_list_init(&b->primary_plane_list);
+	wl_list_init(&b->fb_cache_list);
+	wl_list_init(&b->secondary_list);
+	wl_list_init(&b->edid_cache_list);
+	wl_list_init(&b->writeback_list);
 	create_sprites(b);
+	create_writebacks(b);
 
 	if (udev_input_init(&b->input,
 			    compositor, b->udev, seat_id,
@@ -3280,13 +8269,17 @@ drm_backend_create(struct weston_compositor *compositor,
 		weston_log("failed to create input devices\n");
 		goto err_sprite;
 	}
+	weston_startup_mark("startup_drm_input");
 
 	b->connector = config->connector;
 
-	if (create_outputs(b, drm_device) < 0) {
+	if (create_outputs(b, NULL, drm_device) < 0) {
 		weston_log("failed to create output for %s\n", path);
 		goto err_udev_input;
 	}
+	weston_startup_mark("startup_drm_outputs");
+
+	find_secondary_gpus(b, seat_id);
 
 	/* A this point we have some idea of whether or not we have a working
 	 * cursor plane. */
@@ -3325,8 +8318,6 @@ drm_backend_create(struct weston_compositor *compositor,
 					    planes_binding, b);
 	weston_compositor_add_debug_binding(compositor, KEY_V,
 					    planes_binding, b);
-	weston_compositor_add_debug_binding(compositor, KEY_Q,
-					    recorder_binding, b);
 	weston_compositor_add_debug_binding(compositor, KEY_W,
 					    renderer_switch_binding, b);
 
@@ -3336,6 +8327,12 @@ drm_backend_create(struct weston_compositor *compositor,
 				   "support failed.\n");
 	}
 
+	if (compositor->capabilities & WESTON_CAP_EXPLICIT_SYNC) {
+		if (linux_explicit_synchronization_setup(compositor) < 0)
+			weston_log("Error: initializing explicit "
+				   "synchronization support failed.\n");
+	}
+
 	compositor->backend = &b->base;
 
 	ret = weston_plugin_api_register(compositor, WESTON_DRM_OUTPUT_API_NAME,
@@ -3359,6 +8356,7 @@ err_sprite:
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
 	destroy_sprites(b);
+	destroy_writebacks(b);
 err_udev_dev:
 	udev_device_unref(drm_device);
 err_launcher:
@@ -35,7 +35,7 @@
 extern "C" {
 #endif
 
-#define WESTON_DRM_BACKEND_CONFIG_VERSION 2
+#define WESTON_DRM_BACKEND_CONFIG_VERSION 3
 
 struct libinput_device;
 
@@ -78,6 +78,25 @@ struct weston_drm_output_api {
 	 */
 	void (*set_seat)(struct weston_output *output,
 			 const char *seat);
+
+	/** Mirror an enabled output on the connector of this one instead
+	 *  of enabling it: the frames of source are scanned out on both.
+	 *  The mode has to be set first; it may differ from the mode of
+	 *  source if the KMS device can scale. The output is not to be
+	 *  enabled while it mirrors.
+	 *
+	 * Returns 0 on success, -1 on failure.
+	 */
+	int (*clone)(struct weston_output *output,
+		     struct weston_output *source);
+
+	/** Render the output at a fraction of the resolution of its mode,
+	 *  between 0.25 and 1.0, and have the display scale it up. Input
+	 *  and the output layout are not affected. Values out of range,
+	 *  or configurations which cannot scale, render at full resolution.
+	 */
+	void (*set_render_scale)(struct weston_output *output,
+				 double scale);
 };
 
 static inline const struct weston_drm_output_api *
@@ -138,6 +157,13 @@ struct weston_drm_backend_config {
 	 */
 	void (*configure_device)(struct weston_compositor *compositor,
 				 struct libinput_device *device);
+
+	/** Whether each output renders on a thread of its own.
+	 *
+	 * Needs atomic modesetting and the OpenGL ES renderer, otherwise
+	 * the outputs render on the main thread.
+	 */
+	bool render_threads;
 };
 
 #ifdef  __cplusplus
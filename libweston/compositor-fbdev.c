@@ -59,6 +59,7 @@ struct fbdev_backend {
 	struct udev *udev;
 	struct udev_input input;
 	uint32_t output_transform;
+	bool double_buffer;
 	struct wl_listener session_listener;
 };
 
@@ -88,9 +89,14 @@ struct fbdev_output {
 	char *device;
 	struct fbdev_screeninfo fb_info;
 	void *fb; /* length is fb_info.buffer_length */
+	int fb_fd; /* kept open only to pan the display */
+	struct fb_var_screeninfo pan_info;
 
 	/* pixman details. */
-	pixman_image_t *hw_surface;
+	bool use_shadow;
+	int n_buffers; /* 2 when double buffered by panning */
+	int current_buffer; /* the one on screen */
+	pixman_image_t *hw_surface[2];
 	uint8_t depth;
 };
 
@@ -117,15 +123,71 @@ fbdev_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
+/* Show the given half of the virtual screen. */
 static int
-fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage)
+fbdev_output_pan(struct fbdev_output *output, int buffer)
+{
+	output->pan_info.xoffset = 0;
+	output->pan_info.yoffset = buffer * output->fb_info.y_resolution;
+	output->pan_info.activate = FB_ACTIVATE_VBL;
+
+	return ioctl(output->fb_fd, FBIOPAN_DISPLAY, &output->pan_info);
+}
+
+static void
+fbdev_output_repaint_double_buffered(struct fbdev_output *output,
+				     pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	pixman_region32_t total_damage, previous_damage;
+	int back = output->current_buffer ^ 1;
+
+	/* The back buffer was last drawn two frames ago, so it also misses
+	 * the damage of the frame on screen. */
+	pixman_region32_init(&total_damage);
+	pixman_region32_init(&previous_damage);
+
+	pixman_region32_copy(&previous_damage, damage);
+
+	pixman_region32_union(&total_damage, damage,
+			      &output->base.previous_damage);
+	pixman_region32_copy(&output->base.previous_damage, &previous_damage);
+
+	pixman_renderer_output_set_buffer(&output->base,
+					  output->hw_surface[back]);
+	ec->renderer->repaint_output(&output->base, &total_damage);
+
+	pixman_region32_fini(&total_damage);
+	pixman_region32_fini(&previous_damage);
+
+	if (fbdev_output_pan(output, back) < 0) {
+		/* Keep drawing into the buffer on screen and redraw it
+		 * completely, since it is a frame behind. */
+		weston_log("Failed to pan frame buffer: %s; "
+			   "disabling double buffering.\n", strerror(errno));
+		output->n_buffers = 1;
+		weston_output_damage(&output->base);
+		return;
+	}
+
+	output->current_buffer = back;
+}
+
+static int
+fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage,
+		     void *repaint_data)
 {
 	struct fbdev_output *output = to_fbdev_output(base);
 	struct weston_compositor *ec = output->base.compositor;
 
 	/* Repaint the damaged region onto the back buffer. */
-	pixman_renderer_output_set_buffer(base, output->hw_surface);
-	ec->renderer->repaint_output(base, damage);
+	if (output->n_buffers == 2) {
+		fbdev_output_repaint_double_buffered(output, damage);
+	} else {
+		pixman_renderer_output_set_buffer(base,
+				output->hw_surface[output->current_buffer]);
+		ec->renderer->repaint_output(base, damage);
+	}
 
 	/* Update the damage region. */
 	pixman_region32_subtract(&ec->primary_plane.damage,
@@ -134,7 +196,8 @@ fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage)
 	/* Schedule the end of the frame. We do not sync this to the frame
 	 * buffer clock because users who want that should be using the DRM
 	 * compositor. FBIO_WAITFORVSYNC blocks and FB_ACTIVATE_VBL requires
-	 * panning, which is broken in most kernel drivers.
+	 * panning, which is broken in most kernel drivers; it is only used
+	 * when double buffering is asked for.
 	 *
 	 * Finish the frame synchronised to the specified refresh rate. The
 	 * refresh rate is given in mHz and the interval in ms. */
@@ -366,34 +429,102 @@ fbdev_frame_buffer_open(struct fbdev_output *output, const char *fb_dev,
 	return fd;
 }
 
-/* Closes the FD on success or failure. */
+/* Grows the virtual screen to twice the visible height, so that frames can
+ * be drawn into one half while the other is shown. Updates the buffer
+ * layout in output->fb_info. */
+static int
+fbdev_frame_buffer_setup_panning(struct fbdev_output *output, int fd)
+{
+	struct fb_var_screeninfo varinfo;
+	struct fb_fix_screeninfo fixinfo;
+
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+		return -1;
+
+	if (varinfo.yres_virtual < varinfo.yres * 2) {
+		varinfo.yres_virtual = varinfo.yres * 2;
+		varinfo.activate = FB_ACTIVATE_NOW;
+
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &varinfo) < 0)
+			return -1;
+	}
+
+	if (ioctl(fd, FBIOGET_FSCREENINFO, &fixinfo) < 0 ||
+	    ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+		return -1;
+
+	if (varinfo.yres_virtual < varinfo.yres * 2 ||
+	    fixinfo.ypanstep == 0 || varinfo.yres % fixinfo.ypanstep != 0 ||
+	    fixinfo.smem_len < fixinfo.line_length * varinfo.yres * 2)
+		return -1;
+
+	/* Start out showing the first half. */
+	varinfo.xoffset = 0;
+	varinfo.yoffset = 0;
+	if (ioctl(fd, FBIOPAN_DISPLAY, &varinfo) < 0)
+		return -1;
+
+	output->fb_info.buffer_length = fixinfo.smem_len;
+	output->fb_info.line_length = fixinfo.line_length;
+	output->pan_info = varinfo;
+
+	return 0;
+}
+
+/* Closes the FD on success or failure, unless it is needed for panning. */
 static int
 fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 {
+	struct fbdev_backend *backend = output->backend;
+	uint8_t *bits;
 	int retval = -1;
+	int prot, i;
 
 	weston_log("Mapping fbdev frame buffer.\n");
 
-	/* Map the frame buffer. Write-only mode, since we don't want to read
-	 * anything back (because it's slow). */
+	output->n_buffers = 1;
+	output->current_buffer = 0;
+
+	if (backend->double_buffer) {
+		if (fbdev_frame_buffer_setup_panning(output, fd) == 0)
+			output->n_buffers = 2;
+		else
+			weston_log("Frame buffer cannot pan, "
+				   "not double buffering.\n");
+	}
+
+	/* Map the frame buffer. Write-only mode if compositing into a
+	 * shadow buffer, since we don't want to read anything back (because
+	 * it's slow). */
+	prot = PROT_WRITE;
+	if (!output->use_shadow)
+		prot |= PROT_READ;
+
 	output->fb = mmap(NULL, output->fb_info.buffer_length,
-	                  PROT_WRITE, MAP_SHARED, fd, 0);
+	                  prot, MAP_SHARED, fd, 0);
 	if (output->fb == MAP_FAILED) {
 		weston_log("Failed to mmap frame buffer: %s\n",
 		           strerror(errno));
+		output->fb = NULL;
 		goto out_close;
 	}
 
-	/* Create a pixman image to wrap the memory mapped frame buffer. */
-	output->hw_surface =
-		pixman_image_create_bits(output->fb_info.pixel_format,
-		                         output->fb_info.x_resolution,
-		                         output->fb_info.y_resolution,
-		                         output->fb,
-		                         output->fb_info.line_length);
-	if (output->hw_surface == NULL) {
-		weston_log("Failed to create surface for frame buffer.\n");
-		goto out_unmap;
+	/* Create pixman images to wrap the memory mapped frame buffer. */
+	for (i = 0; i < output->n_buffers; i++) {
+		bits = (uint8_t *) output->fb +
+		       i * output->fb_info.y_resolution *
+		       output->fb_info.line_length;
+
+		output->hw_surface[i] =
+			pixman_image_create_bits(output->fb_info.pixel_format,
+			                         output->fb_info.x_resolution,
+			                         output->fb_info.y_resolution,
+			                         (uint32_t *) bits,
+			                         output->fb_info.line_length);
+		if (output->hw_surface[i] == NULL) {
+			weston_log("Failed to create surface for frame buffer.\n");
+			goto out_unmap;
+		}
 	}
 
 	/* Success! */
@@ -404,7 +535,9 @@ out_unmap:
 		fbdev_frame_buffer_destroy(output);
 
 out_close:
-	if (fd >= 0)
+	if (retval == 0 && output->n_buffers == 2)
+		output->fb_fd = fd;
+	else if (fd >= 0)
 		close(fd);
 
 	return retval;
@@ -413,8 +546,25 @@ out_close:
 static void
 fbdev_frame_buffer_destroy(struct fbdev_output *output)
 {
+	unsigned int i;
+
 	weston_log("Destroying fbdev frame buffer.\n");
 
+	for (i = 0; i < ARRAY_LENGTH(output->hw_surface); i++) {
+		if (output->hw_surface[i] != NULL) {
+			pixman_image_unref(output->hw_surface[i]);
+			output->hw_surface[i] = NULL;
+		}
+	}
+
+	if (output->fb_fd >= 0) {
+		/* Leave the first half on screen for whoever comes next. */
+		if (output->current_buffer != 0)
+			fbdev_output_pan(output, 0);
+		close(output->fb_fd);
+		output->fb_fd = -1;
+	}
+
 	if (munmap(output->fb, output->fb_info.buffer_length) < 0)
 		weston_log("Failed to munmap frame buffer: %s\n",
 		           strerror(errno));
@@ -440,6 +590,12 @@ fbdev_output_enable(struct weston_output *base)
 		return -1;
 	}
 
+	/* Composite straight into the frame buffer when the shadow buffer
+	 * would only be a plain copy of it. */
+	output->use_shadow =
+		output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+		output->fb_info.pixel_format != PIXMAN_x8r8g8b8;
+
 	if (fbdev_frame_buffer_map(output, fb_fd) < 0) {
 		weston_log("Mapping frame buffer failed.\n");
 		return -1;
@@ -448,7 +604,9 @@ fbdev_output_enable(struct weston_output *base)
 	output->base.start_repaint_loop = fbdev_output_start_repaint_loop;
 	output->base.repaint = fbdev_output_repaint;
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base,
+					  output->use_shadow ?
+					  PIXMAN_RENDERER_OUTPUT_USE_SHADOW : 0) < 0)
 		goto out_hw_surface;
 
 	loop = wl_display_get_event_loop(backend->compositor->wl_display);
@@ -459,12 +617,13 @@ fbdev_output_enable(struct weston_output *base)
 	           output->mode.width, output->mode.height);
 	weston_log_continue(STAMP_SPACE "guessing %d Hz and 96 dpi\n",
 	                    output->mode.refresh / 1000);
+	weston_log_continue(STAMP_SPACE "%s buffered, %s shadow buffer\n",
+	                    output->n_buffers == 2 ? "double" : "single",
+	                    output->use_shadow ? "with" : "without");
 
 	return 0;
 
 out_hw_surface:
-	pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
 	fbdev_frame_buffer_destroy(output);
 
 	return -1;
@@ -485,6 +644,7 @@ fbdev_output_create(struct fbdev_backend *backend,
 
 	output->backend = backend;
 	output->device = strdup(device);
+	output->fb_fd = -1;
 
 	/* Create the frame buffer. */
 	fb_fd = fbdev_frame_buffer_open(output, device, &output->fb_info);
@@ -631,11 +791,6 @@ fbdev_output_disable(struct weston_output *base)
 
 	weston_log("Disabling fbdev output.\n");
 
-	if (output->hw_surface != NULL) {
-		pixman_image_unref(output->hw_surface);
-		output->hw_surface = NULL;
-	}
-
 	fbdev_frame_buffer_destroy(output);
 }
 
@@ -704,6 +859,14 @@ fbdev_restore(struct weston_compositor *compositor)
 	weston_launcher_restore(compositor->launcher);
 }
 
+static void
+fbdev_flush_input(struct weston_compositor *compositor)
+{
+	struct fbdev_backend *backend = to_fbdev_backend(compositor);
+
+	udev_input_flush(&backend->input);
+}
+
 static struct fbdev_backend *
 fbdev_backend_create(struct weston_compositor *compositor,
                      struct weston_fbdev_backend_config *param)
@@ -742,8 +905,10 @@ fbdev_backend_create(struct weston_compositor *compositor,
 
 	backend->base.destroy = fbdev_backend_destroy;
 	backend->base.restore = fbdev_restore;
+	backend->base.flush_input = fbdev_flush_input;
 
 	backend->prev_state = WESTON_COMPOSITOR_ACTIVE;
+	backend->double_buffer = param->double_buffer;
 
 	weston_setup_vt_switch_bindings(compositor);
 
@@ -779,6 +944,7 @@ config_init_to_defaults(struct weston_fbdev_backend_config *config)
 	 * udev, rather than passing a device node in as a parameter. */
 	config->tty = 0; /* default to current tty */
 	config->device = "/dev/fb0"; /* default frame buffer */
+	config->double_buffer = 0;
 }
 
 WL_EXPORT int
@@ -34,7 +34,7 @@ extern "C" {
 
 #include "compositor.h"
 
-#define WESTON_FBDEV_BACKEND_CONFIG_VERSION 2
+#define WESTON_FBDEV_BACKEND_CONFIG_VERSION 3
 
 struct libinput_device;
 
@@ -52,6 +52,13 @@ struct weston_fbdev_backend_config {
 	 */
 	void (*configure_device)(struct weston_compositor *compositor,
 				 struct libinput_device *device);
+
+	/** Double buffer the output by panning the display between two
+	 * halves of a virtual screen twice its height, so that frames are
+	 * never shown half drawn. Falls back to single buffering if the
+	 * driver cannot pan.
+	 */
+	int double_buffer;
 };
 
 #ifdef  __cplusplus
@@ -30,13 +30,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <stdbool.h>
 
 #include "compositor.h"
 #include "compositor-headless.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "pixman-renderer.h"
+#include "gl-renderer.h"
+#include "weston-egl-ext.h"
 #include "presentation-time-server-protocol.h"
 #include "windowed-output-api.h"
 
@@ -46,13 +51,21 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	bool use_gl;
+	int refresh;
+	int jitter_usec;
 };
 
+static struct gl_renderer_interface *gl_renderer;
+
 struct headless_output {
 	struct weston_output base;
 
 	struct weston_mode mode;
+	int finish_frame_fd;
 	struct wl_event_source *finish_frame_timer;
+	/* Completion time of the frame in flight */
+	struct timespec frame_time;
 	uint32_t *image_buf;
 	pixman_image_t *image;
 };
@@ -69,30 +82,73 @@ to_headless_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct headless_backend, base);
 }
 
+/* Virtual vblanks fall on the multiples of the refresh period of the
+ * presentation clock, and the msc counts them. */
+static void
+headless_output_vblank(struct headless_output *output,
+		       const struct timespec *now, int ahead,
+		       struct timespec *vblank)
+{
+	int64_t refresh_nsec = millihz_to_nsec(output->mode.refresh);
+	int64_t count = timespec_to_nsec(now) / refresh_nsec + ahead;
+
+	timespec_from_nsec(vblank, count * refresh_nsec);
+	output->base.msc = count;
+}
+
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_start_repaint_loop(struct weston_output *output_base)
 {
-	struct timespec ts;
+	struct headless_output *output = to_headless_output(output_base);
+	struct timespec now, vblank;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	headless_output_vblank(output, &now, 0, &vblank);
+	weston_output_finish_frame(&output->base, &vblank,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
-finish_frame_handler(void *data)
+finish_frame_handler(int fd, uint32_t mask, void *data)
 {
 	struct headless_output *output = data;
-	struct timespec ts;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof expirations) < 0)
+		return 0;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	weston_output_finish_frame(&output->base, &output->frame_time,
+				   WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
 
 	return 1;
 }
 
+/* Completes the frame at the next virtual vblank, late by up to the
+ * configured jitter. */
+static void
+headless_output_queue_frame(struct headless_output *output)
+{
+	struct headless_backend *b = to_headless_backend(output->base.compositor);
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct timespec now;
+
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	headless_output_vblank(output, &now, 1, &output->frame_time);
+	if (b->jitter_usec > 0)
+		timespec_add_nsec(&output->frame_time, &output->frame_time,
+				  (random() % (b->jitter_usec + 1)) * 1000LL);
+
+	its.it_value = output->frame_time;
+	timerfd_settime(output->finish_frame_fd, TFD_TIMER_ABSTIME,
+			&its, NULL);
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
-		       pixman_region32_t *damage)
+		       pixman_region32_t *damage,
+		       void *repaint_data)
 {
 	struct headless_output *output = to_headless_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
@@ -102,7 +158,7 @@ headless_output_repaint(struct weston_output *output_base,
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	headless_output_queue_frame(output);
 
 	return 0;
 }
@@ -117,11 +173,14 @@ headless_output_disable(struct weston_output *base)
 		return 0;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	close(output->finish_frame_fd);
 
 	if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
 		pixman_image_unref(output->image);
 		free(output->image_buf);
+	} else if (b->use_gl) {
+		gl_renderer->output_destroy(&output->base);
 	}
 
 	return 0;
@@ -145,9 +204,24 @@ headless_output_enable(struct weston_output *base)
 	struct headless_backend *b = to_headless_backend(base->compositor);
 	struct wl_event_loop *loop;
 
+	/* The presentation clock is CLOCK_MONOTONIC, so that virtual
+	 * vblanks can be timed precisely on it. */
+	output->finish_frame_fd = timerfd_create(CLOCK_MONOTONIC,
+						 TFD_CLOEXEC | TFD_NONBLOCK);
+	if (output->finish_frame_fd < 0) {
+		weston_log("failed to create frame timer: %m\n");
+		return -1;
+	}
+
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer =
-		wl_event_loop_add_timer(loop, finish_frame_handler, output);
+		wl_event_loop_add_fd(loop, output->finish_frame_fd,
+				     WL_EVENT_READABLE, finish_frame_handler,
+				     output);
+	if (!output->finish_frame_timer) {
+		close(output->finish_frame_fd);
+		return -1;
+	}
 
 	if (b->use_pixman) {
 		output->image_buf = malloc(output->base.current_mode->width *
@@ -161,11 +235,17 @@ headless_output_enable(struct weston_output *base)
 							 output->image_buf,
 							 output->base.current_mode->width * 4);
 
-		if (pixman_renderer_output_create(&output->base) < 0)
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0)
 			goto err_renderer;
 
 		pixman_renderer_output_set_buffer(&output->base,
 						  output->image);
+	} else if (b->use_gl) {
+		if (gl_renderer->output_pbuffer_create(&output->base,
+						       output->base.current_mode->width,
+						       output->base.current_mode->height) < 0)
+			goto err_malloc;
 	}
 
 	return 0;
@@ -175,6 +255,7 @@ err_renderer:
 	free(output->image_buf);
 err_malloc:
 	wl_event_source_remove(output->finish_frame_timer);
+	close(output->finish_frame_fd);
 
 	return -1;
 }
@@ -184,6 +265,7 @@ headless_output_set_size(struct weston_output *base,
 			 int width, int height)
 {
 	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
 	int output_width, output_height;
 
 	/* We can only be called once. */
@@ -199,7 +281,7 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	output->mode.refresh = b->refresh;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
@@ -265,6 +347,28 @@ static const struct weston_windowed_output_api api = {
 	headless_output_create,
 };
 
+static int
+headless_gl_renderer_init(struct headless_backend *b)
+{
+	gl_renderer = weston_load_module("gl-renderer.so",
+					 "gl_renderer_interface");
+	if (!gl_renderer)
+		return -1;
+
+	/* Outputs are pbuffers, so no window system is needed */
+	if (gl_renderer->display_create(b->compositor,
+					EGL_PLATFORM_SURFACELESS_MESA,
+					NULL,
+					NULL,
+					gl_renderer->pbuffer_attribs,
+					NULL, 0) < 0) {
+		weston_log("failed to initialize the GL renderer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static struct headless_backend *
 headless_backend_create(struct weston_compositor *compositor,
 			struct weston_headless_backend_config *config)
@@ -277,18 +381,35 @@ headless_backend_create(struct weston_compositor *compositor,
 		return NULL;
 
 	b->compositor = compositor;
-	if (weston_compositor_set_presentation_clock_software(compositor) < 0)
+	if (weston_compositor_set_presentation_clock(compositor,
+						     CLOCK_MONOTONIC) < 0) {
+		weston_log("CLOCK_MONOTONIC is not available\n");
 		goto err_free;
+	}
+
+	b->refresh = config->refresh > 0 ? config->refresh : 60000;
+	b->jitter_usec = config->jitter_usec > 0 ? config->jitter_usec : 0;
+	weston_log("headless outputs refresh at %d mHz, %d us jitter\n",
+		   b->refresh, b->jitter_usec);
 
 	b->base.destroy = headless_destroy;
 	b->base.restore = headless_restore;
 
 	b->use_pixman = config->use_pixman;
+#ifdef ENABLE_EGL
+	b->use_gl = config->use_gl && !b->use_pixman;
+#else
+	if (config->use_gl)
+		weston_log("GL renderer not built, not rendering\n");
+#endif
 	if (b->use_pixman) {
 		pixman_renderer_init(compositor);
+	} else if (b->use_gl) {
+		if (headless_gl_renderer_init(b) < 0)
+			goto err_input;
 	}
 
-	if (!b->use_pixman && noop_renderer_init(compositor) < 0)
+	if (!b->use_pixman && !b->use_gl && noop_renderer_init(compositor) < 0)
 		goto err_input;
 
 	compositor->backend = &b->base;
@@ -41,6 +41,18 @@ struct weston_headless_backend_config {
 
 	/** Whether to use the pixman renderer instead of the OpenGL ES renderer. */
 	int use_pixman;
+
+	/** Whether to render with the OpenGL ES renderer into pbuffers
+	 * instead of not rendering at all; ignored with use_pixman. */
+	int use_gl;
+
+	/** Refresh rate of the outputs in mHz, or 0 for 60 Hz. Frames
+	 * complete on virtual vblanks at this rate. */
+	int refresh;
+
+	/** Frames complete late by a random delay of up to this many
+	 * microseconds, to simulate an irregular display. */
+	int jitter_usec;
 };
 
 #ifdef  __cplusplus
@@ -30,6 +30,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -76,15 +79,33 @@
 #include <freerdp/locale/keyboard.h>
 #include <winpr/input.h>
 
+#ifdef HAVE_FREERDP_GFX
+#include <freerdp/channels/wtsvc.h>
+#include <freerdp/server/rdpgfx.h>
+#include <freerdp/codec/h264.h>
+#include <winpr/synch.h>
+#endif
+
 #include "shared/helpers.h"
 #include "compositor.h"
 #include "compositor-rdp.h"
 #include "pixman-renderer.h"
+#include "gl-renderer.h"
+#include "weston-egl-ext.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
 
+/* Tile size of RemoteFX, also used to skip unchanged areas */
+#define RDP_TILE_SIZE 64
+
+/* Graphics pipeline frames sent but not acknowledged by the client
+ * before we stop encoding new ones, letting damage pile up instead. */
+#define RDP_GFX_MAX_FRAMES_IN_FLIGHT 2
+/* Target bit rate of AVC420, in bits per second */
+#define RDP_GFX_AVC_BITRATE (5 * 1000 * 1000)
+
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
 	 * from BGRA32 to B8G8R8A8, but some versions ship with a definition of
@@ -110,6 +131,7 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+	int use_gl;
 };
 
 enum peer_item_flags {
@@ -130,9 +152,86 @@ struct rdp_output {
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
 
+	/* With the GL renderer, the output is a pbuffer and the damaged
+	 * tiles are read back into shadow_surface before the peers get
+	 * them. */
+	struct wl_list readbacks;	/* rdp_readback::link */
+	pixman_region32_t readback_damage;
+	int reading;
+
 	struct wl_list peers;
 };
 
+/* One tile-aligned rectangle being read back from the GL renderer */
+struct rdp_readback {
+	struct rdp_output *output;	/* NULL once the output is gone */
+	pixman_box32_t box;		/* in shadow_surface coordinates */
+	int do_yflip;
+	struct wl_list link;
+};
+
+enum rdp_encoder_codec {
+	RDP_CODEC_RFX,
+	RDP_CODEC_NSC,
+	/* Graphics pipeline, see struct rdp_peer_gfx */
+	RDP_CODEC_GFX_AVC420,
+	RDP_CODEC_GFX_UNCOMPRESSED,
+};
+
+/* RemoteFX and NSCodec encoding runs on a thread per peer, so that one
+ * slow peer cannot hold up the others or the compositor. The thread
+ * encodes from a private copy of what the peer is being sent; damage
+ * arriving meanwhile is merged into the next frame rather than queued,
+ * so a peer that cannot keep up just gets fewer frames. */
+struct rdp_peer_encoder {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int started;
+	int quit;
+
+	int busy;	/* a frame is with the thread or waiting to be sent */
+	int encoded;	/* the thread is done with it */
+	int wakeup_fd;
+	struct wl_event_source *wakeup_source;
+
+	pixman_image_t *frame;	/* contents the peer has, or will have */
+	int frame_valid;
+	pixman_region32_t pending;	/* damage not in a frame yet */
+	pixman_region32_t job;		/* area of the frame being encoded */
+	enum rdp_encoder_codec codec;
+
+	uint32_t frames, coalesced;
+};
+
+#ifdef HAVE_FREERDP_GFX
+/* The RDP graphics pipeline, a dynamic virtual channel replacing the
+ * surface bits updates once the client has confirmed its capabilities.
+ * Frames are H.264 encoded (AVC420) when the client supports it, and
+ * the client acknowledges each one, which paces the encoder. */
+struct rdp_peer_gfx {
+	HANDLE vcm;
+	struct wl_event_source *vcm_source;
+	RdpgfxServerContext *context;
+	struct wl_event_source *context_source;
+	int opened;
+	int ready;	/* capabilities confirmed and surface mapped */
+	int avc420;
+	uint16_t surface_id;
+	int surface_created;
+
+	uint32_t frame_id;	/* of the last frame sent */
+	uint32_t acked_id;	/* of the last frame acknowledged */
+	int acks_suspended;
+
+	H264_CONTEXT *h264;
+	/* Output of the encoder thread; the data belongs to h264 */
+	BYTE *avc_data;
+	UINT32 avc_size;
+	int avc_failed;
+};
+#endif
+
 struct rdp_peer_context {
 	rdpContext _p;
 
@@ -142,11 +241,17 @@ struct rdp_peer_context {
 	wStream *encode_stream;
 	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
+	struct rdp_peer_encoder encoder;
+#ifdef HAVE_FREERDP_GFX
+	struct rdp_peer_gfx gfx;
+#endif
 
 	struct rdp_peers_item item;
 };
 typedef struct rdp_peer_context RdpPeerContext;
 
+static struct gl_renderer_interface *gl_renderer;
+
 static inline struct rdp_output *
 to_rdp_output(struct weston_output *base)
 {
@@ -159,16 +264,15 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+/* Runs on the encoder thread, only touches the peer's codec contexts. */
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_encode_rfx(RdpPeerContext *context, pixman_region32_t *damage,
+		    pixman_image_t *image)
 {
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -176,20 +280,6 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
@@ -210,22 +300,15 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
-
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-
-	update->SurfaceBits(update->context, cmd);
 }
 
-
+/* Runs on the encoder thread, only touches the peer's codec contexts. */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_encode_nsc(RdpPeerContext *context, pixman_region32_t *damage,
+		    pixman_image_t *image)
 {
 	int width, height;
 	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -233,6 +316,22 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
+	ptr = pixman_image_get_data(image) + damage->extents.x1 +
+				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+
+	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
+			width, height,
+			pixman_image_get_stride(image));
+}
+
+static void
+rdp_peer_send_encoded(RdpPeerContext *context, pixman_region32_t *damage,
+		      enum rdp_encoder_codec codec)
+{
+	freerdp_peer *peer = context->item.peer;
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+
 #ifdef HAVE_SKIP_COMPRESSION
 	cmd->skipCompression = TRUE;
 #else
@@ -243,21 +342,166 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->destRight = damage->extents.x2;
 	cmd->destBottom = damage->extents.y2;
 	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
+	cmd->codecID = codec == RDP_CODEC_RFX ?
+		peer->settings->RemoteFxCodecId : peer->settings->NSCodecId;
+	cmd->width = damage->extents.x2 - damage->extents.x1;
+	cmd->height = damage->extents.y2 - damage->extents.y1;
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
 	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
 	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+
 	update->SurfaceBits(update->context, cmd);
 }
 
+#ifdef HAVE_FREERDP_GFX
+/* Runs on the encoder thread, only touches the peer's H.264 context.
+ * The whole frame is encoded, the damage only tells the client which
+ * parts of the decoded picture changed. */
+static void
+rdp_peer_encode_avc420(RdpPeerContext *context, pixman_image_t *image)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+
+	gfx->avc_size = 0;
+	gfx->avc_failed = avc420_compress(gfx->h264,
+			(BYTE *) pixman_image_get_data(image),
+			PIXEL_FORMAT_BGRX32, pixman_image_get_stride(image),
+			pixman_image_get_width(image),
+			pixman_image_get_height(image),
+			&gfx->avc_data, &gfx->avc_size) < 0;
+}
+
+static void
+rdp_peer_send_gfx_avc420(RdpPeerContext *context, pixman_region32_t *damage,
+			 pixman_image_t *image)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	RDPGFX_SURFACE_COMMAND cmd = { 0 };
+	RDPGFX_AVC420_BITMAP_STREAM avc420 = { 0 };
+	RDPGFX_H264_QUANT_QUALITY *quality;
+	RECTANGLE_16 *rects;
+	pixman_box32_t *boxes;
+	int nboxes, i;
+
+	if (gfx->avc_failed) {
+		weston_log("rdp peer %p: H.264 encoding failed\n",
+			   context->item.peer);
+		return;
+	}
+
+	/* The encoder skipped the frame */
+	if (gfx->avc_size == 0)
+		return;
+
+	boxes = pixman_region32_rectangles(damage, &nboxes);
+	rects = calloc(nboxes, sizeof *rects);
+	quality = calloc(nboxes, sizeof *quality);
+	if (!rects || !quality)
+		goto out;
+
+	for (i = 0; i < nboxes; i++) {
+		rects[i].left = boxes[i].x1;
+		rects[i].top = boxes[i].y1;
+		rects[i].right = boxes[i].x2;
+		rects[i].bottom = boxes[i].y2;
+		quality[i].qp = gfx->h264->QP;
+		quality[i].qualityVal = 100 - quality[i].qp;
+	}
+
+	avc420.meta.numRegionRects = nboxes;
+	avc420.meta.regionRects = rects;
+	avc420.meta.quantQualityVals = quality;
+	avc420.data = gfx->avc_data;
+	avc420.length = gfx->avc_size;
+
+	cmd.surfaceId = gfx->surface_id;
+	cmd.codecId = RDPGFX_CODECID_AVC420;
+	cmd.format = PIXEL_FORMAT_BGRX32;
+	cmd.right = pixman_image_get_width(image);
+	cmd.bottom = pixman_image_get_height(image);
+	cmd.width = cmd.right;
+	cmd.height = cmd.bottom;
+	cmd.data = gfx->avc_data;
+	cmd.length = gfx->avc_size;
+	cmd.extra = &avc420;
+
+	gfx->context->SurfaceCommand(gfx->context, &cmd);
+
+out:
+	free(quality);
+	free(rects);
+}
+
+static void
+rdp_peer_send_gfx_uncompressed(RdpPeerContext *context,
+			       pixman_region32_t *damage,
+			       pixman_image_t *image)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	RDPGFX_SURFACE_COMMAND cmd = { 0 };
+	int stride = pixman_image_get_stride(image);
+	const uint8_t *src;
+	pixman_box32_t *boxes;
+	int nboxes, i, y;
+	uint8_t *data;
+
+	boxes = pixman_region32_rectangles(damage, &nboxes);
+	for (i = 0; i < nboxes; i++) {
+		cmd.surfaceId = gfx->surface_id;
+		cmd.codecId = RDPGFX_CODECID_UNCOMPRESSED;
+		cmd.format = PIXEL_FORMAT_BGRX32;
+		cmd.left = boxes[i].x1;
+		cmd.top = boxes[i].y1;
+		cmd.right = boxes[i].x2;
+		cmd.bottom = boxes[i].y2;
+		cmd.width = cmd.right - cmd.left;
+		cmd.height = cmd.bottom - cmd.top;
+		cmd.length = cmd.width * cmd.height * 4;
+
+		data = malloc(cmd.length);
+		if (!data)
+			return;
+
+		src = (const uint8_t *) pixman_image_get_data(image) +
+			cmd.top * stride + cmd.left * 4;
+		for (y = 0; y < (int) cmd.height; y++)
+			memcpy(data + y * cmd.width * 4, src + y * stride,
+			       cmd.width * 4);
+
+		cmd.data = data;
+		gfx->context->SurfaceCommand(gfx->context, &cmd);
+		free(data);
+	}
+}
+
+static void
+rdp_peer_send_gfx(RdpPeerContext *context, pixman_region32_t *damage,
+		  enum rdp_encoder_codec codec, pixman_image_t *image)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	RDPGFX_START_FRAME_PDU start = { 0 };
+	RDPGFX_END_FRAME_PDU end = { 0 };
+
+	start.frameId = ++gfx->frame_id;
+	end.frameId = start.frameId;
+
+	gfx->context->StartFrame(gfx->context, &start);
+	if (codec == RDP_CODEC_GFX_AVC420)
+		rdp_peer_send_gfx_avc420(context, damage, image);
+	else
+		rdp_peer_send_gfx_uncompressed(context, damage, image);
+	gfx->context->EndFrame(gfx->context, &end);
+}
+
+/* Whether to hold off encoding until the client has caught up */
+static int
+rdp_peer_gfx_throttled(struct rdp_peer_gfx *gfx)
+{
+	return gfx->ready && !gfx->acks_suspended &&
+		gfx->frame_id - gfx->acked_id >= RDP_GFX_MAX_FRAMES_IN_FLIGHT;
+}
+#endif
+
 static void
 pixman_image_flipped_subrect(const pixman_box32_t *rect, pixman_image_t *img, BYTE *dest)
 {
@@ -330,19 +574,617 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	update->SurfaceFrameMarker(peer->context, marker);
 }
 
+static inline int
+rdp_tile_align(int v)
+{
+	return (v + RDP_TILE_SIZE - 1) / RDP_TILE_SIZE * RDP_TILE_SIZE;
+}
+
+static int
+rdp_tile_changed(pixman_image_t *src, pixman_image_t *dst,
+		 const pixman_box32_t *tile)
+{
+	int stride = pixman_image_get_stride(src);
+	int size = (tile->x2 - tile->x1) * 4;
+	const uint8_t *a, *b;
+	int y;
+
+	a = (const uint8_t *) pixman_image_get_data(src) +
+		tile->y1 * stride + tile->x1 * 4;
+	b = (const uint8_t *) pixman_image_get_data(dst) +
+		tile->y1 * stride + tile->x1 * 4;
+
+	for (y = tile->y1; y < tile->y2; y++, a += stride, b += stride)
+		if (memcmp(a, b, size) != 0)
+			return 1;
+
+	return 0;
+}
+
+/* Copies the tiles of the pending damage that differ from what the peer
+ * already has into the encoder's frame, and returns them in changed.
+ * Must only be called while the encoder thread is idle. */
+static void
+rdp_peer_encoder_take_damage(struct rdp_peer_encoder *encoder,
+			     pixman_image_t *shadow,
+			     pixman_region32_t *changed)
+{
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+	pixman_region32_t tiles;
+	pixman_box32_t *rects, tile;
+	int i, nrects, x, y;
+
+	/* Grow the damage to whole tiles, so each is visited once */
+	pixman_region32_init(&tiles);
+	rects = pixman_region32_rectangles(&encoder->pending, &nrects);
+	for (i = 0; i < nrects; i++) {
+		tile.x1 = rects[i].x1 - rects[i].x1 % RDP_TILE_SIZE;
+		tile.y1 = rects[i].y1 - rects[i].y1 % RDP_TILE_SIZE;
+		tile.x2 = MIN(rdp_tile_align(rects[i].x2), width);
+		tile.y2 = MIN(rdp_tile_align(rects[i].y2), height);
+		pixman_region32_union_rect(&tiles, &tiles, tile.x1, tile.y1,
+					   tile.x2 - tile.x1,
+					   tile.y2 - tile.y1);
+	}
+	pixman_region32_intersect_rect(&tiles, &tiles, 0, 0, width, height);
+
+	pixman_region32_clear(changed);
+	rects = pixman_region32_rectangles(&tiles, &nrects);
+	for (i = 0; i < nrects; i++) {
+		for (y = rects[i].y1; y < rects[i].y2; y += RDP_TILE_SIZE) {
+			for (x = rects[i].x1; x < rects[i].x2; x += RDP_TILE_SIZE) {
+				tile.x1 = x;
+				tile.y1 = y;
+				tile.x2 = MIN(x + RDP_TILE_SIZE, rects[i].x2);
+				tile.y2 = MIN(y + RDP_TILE_SIZE, rects[i].y2);
+
+				if (encoder->frame_valid &&
+				    !rdp_tile_changed(shadow, encoder->frame,
+						      &tile))
+					continue;
+
+				pixman_image_composite32(PIXMAN_OP_SRC,
+						shadow, NULL, encoder->frame,
+						tile.x1, tile.y1, 0, 0,
+						tile.x1, tile.y1,
+						tile.x2 - tile.x1,
+						tile.y2 - tile.y1);
+				pixman_region32_union_rect(changed, changed,
+						tile.x1, tile.y1,
+						tile.x2 - tile.x1,
+						tile.y2 - tile.y1);
+			}
+		}
+	}
+
+	pixman_region32_fini(&tiles);
+	pixman_region32_clear(&encoder->pending);
+	encoder->frame_valid = 1;
+}
+
+/* Hands the pending damage to the encoder thread, unless it is busy. */
+static void
+rdp_peer_encoder_kick(RdpPeerContext *context)
+{
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	struct rdp_output *output = context->rdpBackend->output;
+	pixman_image_t *shadow = output->shadow_surface;
+	int width = pixman_image_get_width(shadow);
+	int height = pixman_image_get_height(shadow);
+
+	if (encoder->busy || !pixman_region32_not_empty(&encoder->pending))
+		return;
+
+#ifdef HAVE_FREERDP_GFX
+	if (rdp_peer_gfx_throttled(&context->gfx))
+		return;
+#endif
+
+	if (!encoder->frame ||
+	    pixman_image_get_width(encoder->frame) != width ||
+	    pixman_image_get_height(encoder->frame) != height) {
+		if (encoder->frame)
+			pixman_image_unref(encoder->frame);
+		encoder->frame = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							  width, height, NULL,
+							  pixman_image_get_stride(shadow));
+		encoder->frame_valid = 0;
+		if (!encoder->frame)
+			return;
+	}
+
+	/* NSCodec sends the extents of the damage, so start from a
+	 * complete copy */
+	if (!encoder->frame_valid)
+		pixman_region32_union_rect(&encoder->pending, &encoder->pending,
+					   0, 0, width, height);
+
+	rdp_peer_encoder_take_damage(encoder, shadow, &encoder->job);
+	if (!pixman_region32_not_empty(&encoder->job))
+		return;
+
+#ifdef HAVE_FREERDP_GFX
+	if (context->gfx.ready)
+		encoder->codec = context->gfx.avc420 ?
+			RDP_CODEC_GFX_AVC420 : RDP_CODEC_GFX_UNCOMPRESSED;
+	else
+#endif
+	encoder->codec = context->item.peer->settings->RemoteFxCodec ?
+		RDP_CODEC_RFX : RDP_CODEC_NSC;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->busy = 1;
+	encoder->encoded = 0;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+/* Waits for the thread to finish and throws its result away; the damage
+ * goes back to pending. Needed before the codecs are reset. */
+static void
+rdp_peer_encoder_cancel(RdpPeerContext *context)
+{
+	struct rdp_peer_encoder *encoder = &context->encoder;
+
+	if (!encoder->started)
+		return;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (encoder->busy && !encoder->encoded)
+		pthread_cond_wait(&encoder->cond, &encoder->mutex);
+	if (encoder->busy)
+		pixman_region32_union(&encoder->pending, &encoder->pending,
+				      &encoder->job);
+	encoder->busy = 0;
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void *
+rdp_peer_encoder_thread(void *data)
+{
+	RdpPeerContext *context = data;
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&encoder->mutex);
+
+	while (!encoder->quit) {
+		if (!encoder->busy || encoder->encoded) {
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&encoder->mutex);
+
+		switch (encoder->codec) {
+		case RDP_CODEC_RFX:
+			rdp_peer_encode_rfx(context, &encoder->job,
+					    encoder->frame);
+			break;
+		case RDP_CODEC_NSC:
+			rdp_peer_encode_nsc(context, &encoder->job,
+					    encoder->frame);
+			break;
+#ifdef HAVE_FREERDP_GFX
+		case RDP_CODEC_GFX_AVC420:
+			rdp_peer_encode_avc420(context, encoder->frame);
+			break;
+#endif
+		default:
+			/* sent as they are */
+			break;
+		}
+
+		pthread_mutex_lock(&encoder->mutex);
+		encoder->encoded = 1;
+		pthread_cond_broadcast(&encoder->cond);
+
+		if (write(encoder->wakeup_fd, &one, sizeof one) < 0)
+			weston_log("rdp: failed to wake up the compositor: %m\n");
+	}
+
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static int
+rdp_peer_encoder_done(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *context = data;
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	uint64_t count;
+	int encoded;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		return 0;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoded = encoder->busy && encoder->encoded;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if (!encoded)
+		return 0;
+
+#ifdef HAVE_FREERDP_GFX
+	if (encoder->codec == RDP_CODEC_GFX_AVC420 ||
+	    encoder->codec == RDP_CODEC_GFX_UNCOMPRESSED)
+		rdp_peer_send_gfx(context, &encoder->job, encoder->codec,
+				  encoder->frame);
+	else
+#endif
+	rdp_peer_send_encoded(context, &encoder->job, encoder->codec);
+	encoder->frames++;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->busy = 0;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	if ((context->item.flags & RDP_PEER_ACTIVATED) &&
+	    (context->item.flags & RDP_PEER_OUTPUT_ENABLED))
+		rdp_peer_encoder_kick(context);
+
+	return 0;
+}
+
+static int
+rdp_peer_encoder_init(RdpPeerContext *context, struct wl_event_loop *loop)
+{
+	struct rdp_peer_encoder *encoder = &context->encoder;
+
+	pixman_region32_init(&encoder->pending);
+	pixman_region32_init(&encoder->job);
+
+	encoder->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (encoder->wakeup_fd < 0)
+		return -1;
+
+	encoder->wakeup_source =
+		wl_event_loop_add_fd(loop, encoder->wakeup_fd,
+				     WL_EVENT_READABLE,
+				     rdp_peer_encoder_done, context);
+	if (!encoder->wakeup_source)
+		goto err_fd;
+
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->cond, NULL);
+	if (pthread_create(&encoder->thread, NULL,
+			   rdp_peer_encoder_thread, context) != 0)
+		goto err_thread;
+
+	encoder->started = 1;
+
+	return 0;
+
+err_thread:
+	pthread_cond_destroy(&encoder->cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	wl_event_source_remove(encoder->wakeup_source);
+	encoder->wakeup_source = NULL;
+err_fd:
+	close(encoder->wakeup_fd);
+	encoder->wakeup_fd = -1;
+	return -1;
+}
+
+static void
+rdp_peer_encoder_fini(RdpPeerContext *context)
+{
+	struct rdp_peer_encoder *encoder = &context->encoder;
+
+	if (encoder->started) {
+		pthread_mutex_lock(&encoder->mutex);
+		encoder->quit = 1;
+		pthread_cond_broadcast(&encoder->cond);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		pthread_join(encoder->thread, NULL);
+		pthread_cond_destroy(&encoder->cond);
+		pthread_mutex_destroy(&encoder->mutex);
+
+		weston_log("rdp peer %p: %u frames encoded, %u merged "
+			   "into later ones\n", context->item.peer,
+			   encoder->frames, encoder->coalesced);
+	}
+
+	if (encoder->wakeup_source)
+		wl_event_source_remove(encoder->wakeup_source);
+	if (encoder->wakeup_fd >= 0)
+		close(encoder->wakeup_fd);
+	if (encoder->frame)
+		pixman_image_unref(encoder->frame);
+	pixman_region32_fini(&encoder->pending);
+	pixman_region32_fini(&encoder->job);
+}
+
+#ifdef HAVE_FREERDP_GFX
+/* (Re)creates the surface the output is shown on, at the output size.
+ * The client forgets what it had, so the next frame is complete. */
+static int
+rdp_peer_gfx_reset(RdpPeerContext *context)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	struct rdp_peer_encoder *encoder = &context->encoder;
+	struct weston_output *output = &context->rdpBackend->output->base;
+	RdpgfxServerContext *gc = gfx->context;
+	RDPGFX_RESET_GRAPHICS_PDU reset = { 0 };
+	RDPGFX_CREATE_SURFACE_PDU create = { 0 };
+	RDPGFX_DELETE_SURFACE_PDU delete = { 0 };
+	RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU map = { 0 };
+	MONITOR_DEF monitor = { 0 };
+
+	/* The encoder thread may be using the H.264 context */
+	rdp_peer_encoder_cancel(context);
+	gfx->ready = 0;
+
+	if (gfx->surface_created) {
+		delete.surfaceId = gfx->surface_id;
+		gc->DeleteSurface(gc, &delete);
+		gfx->surface_created = 0;
+	}
+
+	monitor.right = output->width - 1;
+	monitor.bottom = output->height - 1;
+	monitor.flags = MONITOR_PRIMARY;
+	reset.width = output->width;
+	reset.height = output->height;
+	reset.monitorCount = 1;
+	reset.monitorDefArray = &monitor;
+	if (gc->ResetGraphics(gc, &reset) != CHANNEL_RC_OK)
+		return -1;
+
+	create.surfaceId = gfx->surface_id;
+	create.width = output->width;
+	create.height = output->height;
+	create.pixelFormat = GFX_PIXEL_FORMAT_XRGB_8888;
+	if (gc->CreateSurface(gc, &create) != CHANNEL_RC_OK)
+		return -1;
+	gfx->surface_created = 1;
+
+	map.surfaceId = gfx->surface_id;
+	if (gc->MapSurfaceToOutput(gc, &map) != CHANNEL_RC_OK)
+		return -1;
+
+	if (gfx->avc420 &&
+	    !h264_context_reset(gfx->h264, output->width, output->height))
+		gfx->avc420 = 0;
+
+	gfx->acked_id = gfx->frame_id;
+	gfx->ready = 1;
+
+	encoder->frame_valid = 0;
+	pixman_region32_union_rect(&encoder->pending, &encoder->pending,
+				   0, 0, output->width, output->height);
+	if ((context->item.flags & RDP_PEER_ACTIVATED) &&
+	    (context->item.flags & RDP_PEER_OUTPUT_ENABLED))
+		rdp_peer_encoder_kick(context);
+
+	return 0;
+}
+
+static UINT
+rdp_peer_gfx_caps_advertise(RdpgfxServerContext *gc,
+			    const RDPGFX_CAPS_ADVERTISE_PDU *advertise)
+{
+	RdpPeerContext *context = gc->custom;
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	RDPGFX_CAPS_CONFIRM_PDU confirm = { 0 };
+	RDPGFX_CAPSET *best = NULL;
+	UINT i, rc;
+	int avc;
+
+	for (i = 0; i < advertise->capsSetCount; i++) {
+		if (!best || advertise->capsSets[i].version > best->version)
+			best = &advertise->capsSets[i];
+	}
+
+	if (!best)
+		return ERROR_INVALID_DATA;
+
+	if (best->version >= RDPGFX_CAPVERSION_10)
+		avc = !(best->flags & RDPGFX_CAPS_FLAG_AVC_DISABLED);
+	else if (best->version == RDPGFX_CAPVERSION_81)
+		avc = !!(best->flags & RDPGFX_CAPS_FLAG_AVC420_ENABLED);
+	else
+		avc = 0;
+	gfx->avc420 = avc && gfx->h264;
+
+	confirm.capsSet = best;
+	rc = gc->CapsConfirm(gc, &confirm);
+	if (rc != CHANNEL_RC_OK)
+		return rc;
+
+	if (rdp_peer_gfx_reset(context) < 0) {
+		weston_log("rdp peer %p: failed to set up the graphics "
+			   "pipeline surface\n", context->item.peer);
+		return ERROR_INTERNAL_ERROR;
+	}
+
+	weston_log("rdp peer %p: graphics pipeline version 0x%x, %s\n",
+		   context->item.peer, best->version,
+		   gfx->avc420 ? "AVC420" : "uncompressed");
+
+	return CHANNEL_RC_OK;
+}
+
+static UINT
+rdp_peer_gfx_frame_acknowledge(RdpgfxServerContext *gc,
+			       const RDPGFX_FRAME_ACKNOWLEDGE_PDU *ack)
+{
+	RdpPeerContext *context = gc->custom;
+	struct rdp_peer_gfx *gfx = &context->gfx;
+
+	gfx->acks_suspended = ack->queueDepth == SUSPEND_FRAME_ACKNOWLEDGEMENT;
+	gfx->acked_id = ack->frameId;
+
+	if ((context->item.flags & RDP_PEER_ACTIVATED) &&
+	    (context->item.flags & RDP_PEER_OUTPUT_ENABLED))
+		rdp_peer_encoder_kick(context);
+
+	return CHANNEL_RC_OK;
+}
+
+static int
+rdp_peer_gfx_activity(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *context = data;
+
+	if (rdpgfx_server_handle_messages(context->gfx.context) !=
+	    CHANNEL_RC_OK)
+		weston_log("rdp peer %p: graphics pipeline error\n",
+			   context->item.peer);
+
+	return 0;
+}
+
+/* Opens the graphics pipeline channel once the client has joined the
+ * dynamic channels, if it advertised support for it. Tried once. */
+static void
+rdp_peer_gfx_open(RdpPeerContext *context)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	freerdp_peer *client = context->item.peer;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(context->rdpBackend->compositor->wl_display);
+	RdpgfxServerContext *gc;
+	int fd;
+
+	if (gfx->opened || !client->settings->SupportGraphicsPipeline)
+		return;
+
+	if (!WTSVirtualChannelManagerIsChannelJoined(gfx->vcm, "drdynvc") ||
+	    WTSVirtualChannelManagerGetDrdynvcState(gfx->vcm) !=
+	    DRDYNVC_STATE_READY)
+		return;
+
+	gfx->opened = 1;
+
+	/* Encoding runs on the encoder thread only */
+	if (!context->encoder.started)
+		return;
+
+	gfx->h264 = h264_context_new(TRUE);
+	if (gfx->h264) {
+		gfx->h264->RateControlMode = H264_RATECONTROL_VBR;
+		gfx->h264->BitRate = RDP_GFX_AVC_BITRATE;
+		gfx->h264->FrameRate = RDP_MODE_FREQ / 1000;
+	} else {
+		weston_log("rdp peer %p: no H.264 encoder\n", client);
+	}
+
+	gc = rdpgfx_server_context_new(gfx->vcm);
+	if (!gc)
+		return;
+
+	gc->custom = context;
+	gc->CapsAdvertise = rdp_peer_gfx_caps_advertise;
+	gc->FrameAcknowledge = rdp_peer_gfx_frame_acknowledge;
+	rdpgfx_server_set_own_thread(gc, FALSE);
+
+	if (!gc->Open(gc)) {
+		weston_log("rdp peer %p: failed to open the graphics "
+			   "pipeline\n", client);
+		rdpgfx_server_context_free(gc);
+		return;
+	}
+
+	fd = GetEventFileDescriptor(rdpgfx_server_get_event_handle(gc));
+	gfx->context_source =
+		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+				     rdp_peer_gfx_activity, context);
+	gfx->context = gc;
+}
+
+static int
+rdp_peer_vcm_activity(int fd, uint32_t mask, void *data)
+{
+	RdpPeerContext *context = data;
+
+	if (!WTSVirtualChannelManagerCheckFileDescriptor(context->gfx.vcm)) {
+		weston_log("rdp peer %p: failed to check the virtual "
+			   "channels\n", context->item.peer);
+		return 0;
+	}
+
+	rdp_peer_gfx_open(context);
+
+	return 0;
+}
+
+static void
+rdp_peer_gfx_init(RdpPeerContext *context, struct wl_event_loop *loop)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+	freerdp_peer *client = context->item.peer;
+	int fd;
+
+	gfx->vcm = WTSOpenServerA((LPSTR) client->context);
+	if (!gfx->vcm) {
+		weston_log("rdp peer %p: no virtual channels\n", client);
+		return;
+	}
+
+	fd = GetEventFileDescriptor(
+			WTSVirtualChannelManagerGetEventHandle(gfx->vcm));
+	gfx->vcm_source = wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+					       rdp_peer_vcm_activity, context);
+	if (!gfx->vcm_source) {
+		WTSCloseServer(gfx->vcm);
+		gfx->vcm = NULL;
+		return;
+	}
+
+	/* Only kept if the client supports it too */
+	client->settings->SupportGraphicsPipeline = TRUE;
+}
+
+static void
+rdp_peer_gfx_fini(RdpPeerContext *context)
+{
+	struct rdp_peer_gfx *gfx = &context->gfx;
+
+	if (gfx->context_source)
+		wl_event_source_remove(gfx->context_source);
+	if (gfx->context) {
+		gfx->context->Close(gfx->context);
+		rdpgfx_server_context_free(gfx->context);
+	}
+	if (gfx->h264)
+		h264_context_free(gfx->h264);
+	if (gfx->vcm_source)
+		wl_event_source_remove(gfx->vcm_source);
+	if (gfx->vcm)
+		WTSCloseServer(gfx->vcm);
+}
+#endif
+
 static void
 rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
+	struct rdp_peer_encoder *encoder = &context->encoder;
 	rdpSettings *settings = peer->settings;
+	int encoded = encoder->started &&
+		(settings->RemoteFxCodec || settings->NSCodec);
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
-	else
+#ifdef HAVE_FREERDP_GFX
+	/* Only ever opened with the encoder running */
+	if (context->gfx.ready)
+		encoded = 1;
+#endif
+
+	if (!encoded) {
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+		return;
+	}
+
+	if (encoder->busy)
+		encoder->coalesced++;
+
+	pixman_region32_union(&encoder->pending, &encoder->pending, region);
+	rdp_peer_encoder_kick(context);
 }
 
 static void
@@ -354,26 +1196,174 @@ rdp_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
-static int
-rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
+static void
+rdp_output_refresh_peers(struct rdp_output *output, pixman_region32_t *region)
 {
-	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
-	struct weston_compositor *ec = output->base.compositor;
 	struct rdp_peers_item *outputPeer;
 
-	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
-	ec->renderer->repaint_output(&output->base, damage);
+	if (!pixman_region32_not_empty(region))
+		return;
 
-	if (pixman_region32_not_empty(damage)) {
-		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+	wl_list_for_each(outputPeer, &output->peers, link) {
+		if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
+				(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
+		{
+			rdp_peer_refresh_region(region, outputPeer->peer);
+		}
+	}
+}
+
+static void
+rdp_output_read_done(void *data, void *pixels)
+{
+	struct rdp_readback *rb = data;
+	struct rdp_output *output = rb->output;
+	int width = rb->box.x2 - rb->box.x1;
+	int height = rb->box.y2 - rb->box.y1;
+	int stride;
+
+	wl_list_remove(&rb->link);
+
+	if (output && pixels) {
+		stride = pixman_image_get_stride(output->shadow_surface) / 4;
+
+		if (rb->do_yflip)
+			pixman_blt(pixels,
+				   pixman_image_get_data(output->shadow_surface),
+				   -width, stride, 32, 32, 0, 1 - height,
+				   rb->box.x1, rb->box.y1, width, height);
+		else
+			pixman_blt(pixels,
+				   pixman_image_get_data(output->shadow_surface),
+				   width, stride, 32, 32, 0, 0,
+				   rb->box.x1, rb->box.y1, width, height);
+
+		pixman_region32_union_rect(&output->readback_damage,
+					   &output->readback_damage,
+					   rb->box.x1, rb->box.y1,
+					   width, height);
+	}
+
+	free(rb);
+
+	/* Hand the frame to the peers once all of it has arrived, so
+	 * they never encode half of a repaint. */
+	if (output && !output->reading && wl_list_empty(&output->readbacks)) {
+		rdp_output_refresh_peers(output, &output->readback_damage);
+		pixman_region32_clear(&output->readback_damage);
+	}
+}
+
+static void
+rdp_output_drop_readbacks(struct rdp_output *output)
+{
+	struct rdp_readback *rb, *tmp;
+
+	/* The renderer still owns them and calls back later; just make
+	 * sure nothing lands in the shadow surface. */
+	wl_list_for_each_safe(rb, tmp, &output->readbacks, link) {
+		wl_list_remove(&rb->link);
+		wl_list_init(&rb->link);
+		rb->output = NULL;
+	}
+	pixman_region32_clear(&output->readback_damage);
+}
+
+/* Queues a read back of every RemoteFX tile the damage touches from the
+ * GL renderer's pbuffer into the shadow surface. */
+static void
+rdp_output_read_tiles(struct rdp_output *output, pixman_region32_t *damage)
+{
+	struct weston_output *base = &output->base;
+	int width = pixman_image_get_width(output->shadow_surface);
+	int height = pixman_image_get_height(output->shadow_surface);
+	pixman_region32_t changed, tiles;
+	pixman_box32_t *rects, tile;
+	struct rdp_readback *rb;
+	int i, nrects, do_yflip;
+
+	pixman_region32_init(&changed);
+	pixman_region32_intersect(&changed, damage, &base->region);
+	pixman_region32_translate(&changed, -base->x, -base->y);
+	weston_transformed_region(base->width, base->height,
+				  base->transform, base->current_scale,
+				  &changed, &changed);
+
+	/* Reading whole tiles costs little more and keeps the number of
+	 * transfers down to what the encoder works in anyway. */
+	pixman_region32_init(&tiles);
+	rects = pixman_region32_rectangles(&changed, &nrects);
+	for (i = 0; i < nrects; i++) {
+		tile.x1 = rects[i].x1 - rects[i].x1 % RDP_TILE_SIZE;
+		tile.y1 = rects[i].y1 - rects[i].y1 % RDP_TILE_SIZE;
+		tile.x2 = MIN(rdp_tile_align(rects[i].x2), width);
+		tile.y2 = MIN(rdp_tile_align(rects[i].y2), height);
+		pixman_region32_union_rect(&tiles, &tiles, tile.x1, tile.y1,
+					   tile.x2 - tile.x1,
+					   tile.y2 - tile.y1);
+	}
+	pixman_region32_intersect_rect(&tiles, &tiles, 0, 0, width, height);
+	pixman_region32_fini(&changed);
+
+	do_yflip = !!(base->compositor->capabilities &
+		      WESTON_CAP_CAPTURE_YFLIP);
+
+	/* Renderers without asynchronous read back complete each request
+	 * right away; only send the frame once all of it has been read. */
+	output->reading = 1;
+
+	rects = pixman_region32_rectangles(&tiles, &nrects);
+	for (i = 0; i < nrects; i++) {
+		rb = zalloc(sizeof *rb);
+		if (!rb)
+			break;
+
+		rb->output = output;
+		rb->box = rects[i];
+		rb->do_yflip = do_yflip;
+		wl_list_insert(output->readbacks.prev, &rb->link);
+
+		if (weston_output_read_pixels_async(base, PIXMAN_a8r8g8b8,
+				rb->box.x1,
+				do_yflip ? height - rb->box.y2 : rb->box.y1,
+				rb->box.x2 - rb->box.x1,
+				rb->box.y2 - rb->box.y1,
+				rdp_output_read_done, rb) < 0) {
+			weston_log("failed to read back RDP output tile\n");
+			wl_list_remove(&rb->link);
+			free(rb);
+			break;
 		}
 	}
 
+	pixman_region32_fini(&tiles);
+
+	output->reading = 0;
+	if (wl_list_empty(&output->readbacks)) {
+		rdp_output_refresh_peers(output, &output->readback_damage);
+		pixman_region32_clear(&output->readback_damage);
+	}
+}
+
+static int
+rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
+		   void *repaint_data)
+{
+	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
+
+	if (b->use_gl) {
+		ec->renderer->repaint_output(&output->base, damage);
+		if (pixman_region32_not_empty(damage))
+			rdp_output_read_tiles(output, damage);
+	} else {
+		pixman_renderer_output_set_buffer(output_base,
+						  output->shadow_surface);
+		ec->renderer->repaint_output(&output->base, damage);
+		rdp_output_refresh_peers(output, damage);
+	}
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
@@ -424,6 +1414,7 @@ static int
 rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 {
 	struct rdp_output *rdpOutput = container_of(output, struct rdp_output, base);
+	struct rdp_backend *b = to_rdp_backend(output->compositor);
 	struct rdp_peers_item *rdpPeer;
 	rdpSettings *settings;
 	pixman_image_t *new_shadow_buffer;
@@ -443,8 +1434,18 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	output->current_mode = local_mode;
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
-	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	if (b->use_gl) {
+		rdp_output_drop_readbacks(rdpOutput);
+		gl_renderer->output_destroy(output);
+		if (gl_renderer->output_pbuffer_create(output,
+						       target_mode->width,
+						       target_mode->height) < 0)
+			weston_log("failed to recreate the RDP output pbuffer\n");
+	} else {
+		pixman_renderer_output_destroy(output);
+		pixman_renderer_output_create(output,
+					      PIXMAN_RENDERER_OUTPUT_USE_SHADOW);
+	}
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -529,7 +1530,19 @@ rdp_output_enable(struct weston_output *base)
 		return -1;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0) {
+	if (b->use_gl) {
+		wl_list_init(&output->readbacks);
+		pixman_region32_init(&output->readback_damage);
+
+		if (gl_renderer->output_pbuffer_create(&output->base,
+						       output->base.current_mode->width,
+						       output->base.current_mode->height) < 0) {
+			pixman_region32_fini(&output->readback_damage);
+			pixman_image_unref(output->shadow_surface);
+			return -1;
+		}
+	} else if (pixman_renderer_output_create(&output->base,
+						 PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0) {
 		pixman_image_unref(output->shadow_surface);
 		return -1;
 	}
@@ -551,8 +1564,14 @@ rdp_output_disable(struct weston_output *base)
 	if (!output->base.enabled)
 		return 0;
 
+	if (b->use_gl) {
+		rdp_output_drop_readbacks(output);
+		gl_renderer->output_destroy(&output->base);
+		pixman_region32_fini(&output->readback_damage);
+	} else {
+		pixman_renderer_output_destroy(&output->base);
+	}
 	pixman_image_unref(output->shadow_surface);
-	pixman_renderer_output_destroy(&output->base);
 
 	wl_event_source_remove(output->finish_frame_timer);
 	b->output = NULL;
@@ -685,6 +1704,8 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	if (!context->encode_stream)
 		goto out_error_stream;
 
+	context->encoder.wakeup_fd = -1;
+
 	FREERDP_CB_RETURN(TRUE);
 
 out_error_nsc:
@@ -714,6 +1735,11 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
+	rdp_peer_encoder_fini(context);
+#ifdef HAVE_FREERDP_GFX
+	rdp_peer_gfx_fini(context);
+#endif
+
 	Stream_Free(context->encode_stream, TRUE);
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
@@ -940,8 +1966,16 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
+	rdp_peer_encoder_cancel(peerCtx);
+	/* The peer has lost what it had been sent */
+	peerCtx->encoder.frame_valid = 0;
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
 	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
+#ifdef HAVE_FREERDP_GFX
+	if (peerCtx->gfx.ready && rdp_peer_gfx_reset(peerCtx) < 0)
+		weston_log("rdp peer %p: failed to resize the graphics "
+			   "pipeline surface\n", client);
+#endif
 
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
@@ -1250,6 +2284,13 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	for ( ; i < MAX_FREERDP_FDS; i++)
 		peerCtx->events[i] = 0;
 
+	if (rdp_peer_encoder_init(peerCtx, loop) < 0)
+		weston_log("unable to start the encoder thread, "
+			   "sending raw updates\n");
+#ifdef HAVE_FREERDP_GFX
+	rdp_peer_gfx_init(peerCtx, loop);
+#endif
+
 	wl_list_insert(&b->output->peers, &peerCtx->item.link);
 	return 0;
 
@@ -1275,6 +2316,28 @@ static const struct weston_rdp_output_api api = {
 	rdp_output_set_size,
 };
 
+static int
+rdp_gl_renderer_init(struct rdp_backend *b)
+{
+	gl_renderer = weston_load_module("gl-renderer.so",
+					 "gl_renderer_interface");
+	if (!gl_renderer)
+		return -1;
+
+	/* The output is a pbuffer, so no window system is needed */
+	if (gl_renderer->display_create(b->compositor,
+					EGL_PLATFORM_SURFACELESS_MESA,
+					NULL,
+					NULL,
+					gl_renderer->pbuffer_attribs,
+					NULL, 0) < 0) {
+		weston_log("failed to initialize the GL renderer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static struct rdp_backend *
 rdp_backend_create(struct weston_compositor *compositor,
 		   struct weston_rdp_backend_config *config)
@@ -1307,8 +2370,13 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (weston_compositor_set_presentation_clock_software(compositor) < 0)
 		goto err_compositor;
 
-	if (pixman_renderer_init(compositor) < 0)
+	b->use_gl = config->use_gl;
+	if (b->use_gl) {
+		if (rdp_gl_renderer_init(b) < 0)
+			goto err_compositor;
+	} else if (pixman_renderer_init(compositor) < 0) {
 		goto err_compositor;
+	}
 
 	if (rdp_backend_create_output(compositor) < 0)
 		goto err_compositor;
@@ -1376,6 +2444,7 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->use_gl = 0;
 }
 
 WL_EXPORT int
@@ -56,7 +56,10 @@
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-unstable-v6-client-protocol.h"
 #include "presentation-time-server-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "linux-dmabuf.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "linux-explicit-synchronization.h"
 #include "windowed-output-api.h"
 
 #define WINDOW_TITLE "Weston Compositor"
@@ -73,6 +76,13 @@ struct wayland_backend {
 		struct zxdg_shell_v6 *xdg_shell;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct wl_subcompositor *subcompositor;
+		struct wp_presentation *presentation;
+		clockid_t presentation_clock_id;
+		bool presentation_clock_valid;
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+		/* struct wayland_dmabuf_format, as advertised by the parent */
+		struct wl_array dmabuf_formats;
 
 		struct wl_list output_list;
 
@@ -114,14 +124,18 @@ struct wayland_output {
 	char *name;
 	struct frame *frame;
 
+	/* The window decorations, shown by the parent compositor from a
+	 * subsurface below the output surface, so that the output surface
+	 * only ever holds what the output composites; see
+	 * wayland_output_update_decoration() */
+	struct {
+		struct wl_surface *surface;
+		struct wl_subsurface *subsurface;
+		struct wayland_decoration_buffer *buffers[2];
+	} decoration;
+
 	struct {
 		struct wl_egl_window *egl_window;
-		struct {
-			cairo_surface_t *top;
-			cairo_surface_t *left;
-			cairo_surface_t *right;
-			cairo_surface_t *bottom;
-		} border;
 	} gl;
 
 	struct {
@@ -133,6 +147,33 @@ struct wayland_output {
 	uint32_t scale;
 
 	struct wl_callback *frame_cb;
+	/* Replaces frame_cb for repaints when the parent compositor
+	 * supports the presentation extension */
+	struct wp_presentation_feedback *feedback;
+
+	/* A client dmabuf filling the output is handed to the parent
+	 * compositor in a subsurface instead of being composited, see
+	 * wayland_output_assign_planes(). */
+	struct {
+		struct weston_plane plane;
+		struct wl_surface *surface;
+		struct wl_subsurface *subsurface;
+		struct weston_view *view;
+		bool attached;
+	} passthrough;
+};
+
+struct wayland_dmabuf_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/* Parent compositor copy of a client dmabuf, cached on the
+ * linux_dmabuf_buffer for as long as the client keeps it */
+struct wayland_dmabuf_buffer {
+	struct wl_buffer *parent_buffer;
+	/* Holds the client buffer while the parent compositor uses it */
+	struct weston_buffer_reference buffer_ref;
 };
 
 struct wayland_parent_output {
@@ -167,9 +208,17 @@ struct wayland_shm_buffer {
 	void *data;
 	size_t size;
 	pixman_region32_t damage;
-	int frame_damaged;
 
 	pixman_image_t *pm_image;
+};
+
+/* A render of the window decorations, kept until they change */
+struct wayland_decoration_buffer {
+	struct wl_buffer *buffer;
+	void *data;
+	size_t size;
+	int32_t width, height;
+	bool busy;
 	cairo_surface_t *c_surface;
 };
 
@@ -222,7 +271,6 @@ to_wayland_backend(struct weston_compositor *base)
 static void
 wayland_shm_buffer_destroy(struct wayland_shm_buffer *buffer)
 {
-	cairo_surface_destroy(buffer->c_surface);
 	pixman_image_unref(buffer->pm_image);
 
 	wl_buffer_destroy(buffer->buffer);
@@ -261,7 +309,8 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 
 	struct wl_shm_pool *pool;
 	int width, height, stride;
-	int32_t fx, fy;
+	off_t size;
+	bool huge;
 	int fd;
 	unsigned char *data;
 
@@ -274,25 +323,22 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 		return sb;
 	}
 
-	if (output->frame) {
-		width = frame_width(output->frame);
-		height = frame_height(output->frame);
-	} else {
-		width = output->base.current_mode->width;
-		height = output->base.current_mode->height;
-	}
+	width = output->base.current_mode->width;
+	height = output->base.current_mode->height;
 
 	stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
 
-	fd = os_create_anonymous_file(height * stride);
+	size = height * stride;
+	fd = os_create_buffer_file(&size, &huge);
 	if (fd < 0) {
 		weston_log("could not create an anonymous file buffer: %m\n");
 		return NULL;
 	}
 
-	data = mmap(NULL, height * stride, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	data = os_map_buffer_file(fd, size);
 	if (data == MAP_FAILED) {
-		weston_log("could not mmap %d memory for data: %m\n", height * stride);
+		weston_log("could not mmap %jd memory for data: %m\n",
+			   (intmax_t) size);
 		close(fd);
 		return NULL;
 	}
@@ -311,10 +357,9 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 
 	pixman_region32_init_rect(&sb->damage, 0, 0,
 				  output->base.width, output->base.height);
-	sb->frame_damaged = 1;
 
 	sb->data = data;
-	sb->size = height * stride;
+	sb->size = size;
 
 	pool = wl_shm_create_pool(shm, fd, sb->size);
 
@@ -328,22 +373,194 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 
 	memset(data, 0, sb->size);
 
-	sb->c_surface =
-		cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
-						    width, height, stride);
-
-	fx = 0;
-	fy = 0;
-	if (output->frame)
-		frame_interior(output->frame, &fx, &fy, 0, 0);
 	sb->pm_image =
 		pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
-					 (uint32_t *)(data + fy * stride) + fx,
-					 stride);
+					 (uint32_t *) data, stride);
 
 	return sb;
 }
 
+static void
+wayland_decoration_buffer_destroy(struct wayland_decoration_buffer *db)
+{
+	cairo_surface_destroy(db->c_surface);
+	wl_buffer_destroy(db->buffer);
+	munmap(db->data, db->size);
+	free(db);
+}
+
+static void
+decoration_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_decoration_buffer *db = data;
+
+	db->busy = false;
+}
+
+static const struct wl_buffer_listener decoration_buffer_listener = {
+	decoration_buffer_release
+};
+
+static struct wayland_decoration_buffer *
+wayland_decoration_buffer_create(struct wayland_backend *b,
+				 int32_t width, int32_t height)
+{
+	struct wayland_decoration_buffer *db;
+	struct wl_shm_pool *pool;
+	int stride, fd;
+
+	db = zalloc(sizeof *db);
+	if (!db)
+		return NULL;
+
+	stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+	db->size = height * stride;
+	db->width = width;
+	db->height = height;
+
+	fd = os_create_anonymous_file(db->size);
+	if (fd < 0) {
+		weston_log("could not create an anonymous file buffer: %m\n");
+		free(db);
+		return NULL;
+	}
+
+	db->data = mmap(NULL, db->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (db->data == MAP_FAILED) {
+		weston_log("could not mmap %zu memory for data: %m\n",
+			   db->size);
+		close(fd);
+		free(db);
+		return NULL;
+	}
+
+	pool = wl_shm_create_pool(b->parent.shm, fd, db->size);
+	db->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride,
+					       WL_SHM_FORMAT_ARGB8888);
+	wl_buffer_add_listener(db->buffer, &decoration_buffer_listener, db);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	db->c_surface =
+		cairo_image_surface_create_for_data(db->data,
+						    CAIRO_FORMAT_ARGB32,
+						    width, height, stride);
+
+	return db;
+}
+
+static void
+wayland_output_destroy_decoration(struct wayland_output *output)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(output->decoration.buffers); i++) {
+		if (output->decoration.buffers[i])
+			wayland_decoration_buffer_destroy(output->decoration.buffers[i]);
+		output->decoration.buffers[i] = NULL;
+	}
+
+	if (output->decoration.subsurface)
+		wl_subsurface_destroy(output->decoration.subsurface);
+	if (output->decoration.surface)
+		wl_surface_destroy(output->decoration.surface);
+	output->decoration.subsurface = NULL;
+	output->decoration.surface = NULL;
+}
+
+/* The decoration surface covers the whole window, with the output
+ * surface on top of its interior. It takes all pointer and touch input,
+ * in frame coordinates like the input code expects. */
+static int
+wayland_output_init_decoration(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+
+	if (!b->parent.subcompositor) {
+		weston_log("wayland-backend: the parent compositor has no "
+			   "subsurfaces, windows are undecorated\n");
+		return -1;
+	}
+
+	output->decoration.surface =
+		wl_compositor_create_surface(b->parent.compositor);
+	if (!output->decoration.surface)
+		return -1;
+	wl_surface_set_user_data(output->decoration.surface, output);
+
+	output->decoration.subsurface =
+		wl_subcompositor_get_subsurface(b->parent.subcompositor,
+						output->decoration.surface,
+						output->parent.surface);
+	if (!output->decoration.subsurface) {
+		wl_surface_destroy(output->decoration.surface);
+		output->decoration.surface = NULL;
+		return -1;
+	}
+	wl_subsurface_place_below(output->decoration.subsurface,
+				  output->parent.surface);
+
+	return 0;
+}
+
+/**
+ * Bring the decorations up to date for the coming output commit
+ *
+ * The frame is only drawn again when it changed, into a buffer the
+ * parent compositor is done with; if there is none, the next repaint
+ * tries again. The subsurface is synchronized, so the new decorations
+ * show together with the output contents they go with.
+ */
+static void
+wayland_output_update_decoration(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct wayland_decoration_buffer *db = NULL;
+	int32_t fwidth, fheight;
+	unsigned int i;
+	cairo_t *cr;
+
+	if (!output->frame || !output->decoration.surface ||
+	    !(frame_status(output->frame) & FRAME_STATUS_REPAINT))
+		return;
+
+	fwidth = frame_width(output->frame);
+	fheight = frame_height(output->frame);
+
+	for (i = 0; i < ARRAY_LENGTH(output->decoration.buffers); i++) {
+		db = output->decoration.buffers[i];
+		if (db && db->busy)
+			continue;
+
+		if (db && (db->width != fwidth || db->height != fheight)) {
+			wayland_decoration_buffer_destroy(db);
+			db = NULL;
+		}
+		if (!db) {
+			db = wayland_decoration_buffer_create(b, fwidth,
+							      fheight);
+			output->decoration.buffers[i] = db;
+		}
+		break;
+	}
+	if (!db || db->busy)
+		return;
+
+	cr = cairo_create(db->c_surface);
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	frame_repaint(output->frame, cr);
+	cairo_destroy(cr);
+	cairo_surface_flush(db->c_surface);
+
+	wl_surface_attach(output->decoration.surface, db->buffer, 0, 0);
+	wl_surface_damage(output->decoration.surface, 0, 0, fwidth, fheight);
+	wl_surface_commit(output->decoration.surface);
+	db->busy = true;
+}
+
 static void
 frame_done(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -354,8 +571,6 @@ frame_done(void *data, struct wl_callback *callback, uint32_t time)
 	wl_callback_destroy(callback);
 	output->frame_cb = NULL;
 
-	/* XXX: use the presentation extension for proper timings */
-
 	/*
 	 * This is the fallback case, where Presentation extension is not
 	 * available from the parent compositor. We do not know the base for
@@ -371,6 +586,89 @@ static const struct wl_callback_listener frame_listener = {
 	frame_done
 };
 
+static void
+feedback_sync_output(void *data,
+		     struct wp_presentation_feedback *feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+feedback_presented(void *data,
+		   struct wp_presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh_ns,
+		   uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct wayland_output *output = data;
+	struct timespec ts;
+
+	assert(feedback == output->feedback);
+	wp_presentation_feedback_destroy(feedback);
+	output->feedback = NULL;
+
+	/* The parent's clock is our presentation clock, see
+	 * wayland_backend_create(), so its timestamps and flags can be
+	 * passed on as they are. */
+	ts.tv_sec = ((uint64_t)tv_sec_hi << 32) | tv_sec_lo;
+	ts.tv_nsec = tv_nsec;
+
+	if (flags & WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION)
+		output->base.msc = ((uint64_t)seq_hi << 32) | seq_lo;
+
+	/* Schedule against the refresh rate of the output we are shown
+	 * on rather than the nominal 60 Hz. */
+	if (refresh_ns > 0 && output->base.current_mode == &output->mode)
+		output->mode.refresh = 1000000000000ULL / refresh_ns;
+
+	weston_output_finish_frame(&output->base, &ts, flags);
+}
+
+static void
+feedback_discarded(void *data,
+		   struct wp_presentation_feedback *feedback)
+{
+	struct wayland_output *output = data;
+	struct timespec ts;
+
+	assert(feedback == output->feedback);
+	wp_presentation_feedback_destroy(feedback);
+	output->feedback = NULL;
+
+	/* Not shown, e.g. because the parent window is hidden; finish the
+	 * frame now as the frame callback path would. */
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	weston_output_finish_frame(&output->base, &ts, 0);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+/* Ask the parent to tell us when the next commit of the output surface
+ * reaches the screen. */
+static void
+wayland_output_request_frame(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+
+	if (b->parent.presentation) {
+		output->feedback =
+			wp_presentation_feedback(b->parent.presentation,
+						 output->parent.surface);
+		wp_presentation_feedback_add_listener(output->feedback,
+						      &feedback_listener,
+						      output);
+	} else {
+		output->frame_cb = wl_surface_frame(output->parent.surface);
+		wl_callback_add_listener(output->frame_cb, &frame_listener,
+					 output);
+	}
+}
+
 static void
 draw_initial_frame(struct wayland_output *output)
 {
@@ -389,78 +687,6 @@ draw_initial_frame(struct wayland_output *output)
 			  output->base.current_mode->height);
 }
 
-#ifdef ENABLE_EGL
-static void
-wayland_output_update_gl_border(struct wayland_output *output)
-{
-	int32_t ix, iy, iwidth, iheight, fwidth, fheight;
-	cairo_t *cr;
-
-	if (!output->frame)
-		return;
-	if (!(frame_status(output->frame) & FRAME_STATUS_REPAINT))
-		return;
-
-	fwidth = frame_width(output->frame);
-	fheight = frame_height(output->frame);
-	frame_interior(output->frame, &ix, &iy, &iwidth, &iheight);
-
-	if (!output->gl.border.top)
-		output->gl.border.top =
-			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-						   fwidth, iy);
-	cr = cairo_create(output->gl.border.top);
-	frame_repaint(output->frame, cr);
-	cairo_destroy(cr);
-	gl_renderer->output_set_border(&output->base, GL_RENDERER_BORDER_TOP,
-				       fwidth, iy,
-				       cairo_image_surface_get_stride(output->gl.border.top) / 4,
-				       cairo_image_surface_get_data(output->gl.border.top));
-
-
-	if (!output->gl.border.left)
-		output->gl.border.left =
-			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-						   ix, 1);
-	cr = cairo_create(output->gl.border.left);
-	cairo_translate(cr, 0, -iy);
-	frame_repaint(output->frame, cr);
-	cairo_destroy(cr);
-	gl_renderer->output_set_border(&output->base, GL_RENDERER_BORDER_LEFT,
-				       ix, 1,
-				       cairo_image_surface_get_stride(output->gl.border.left) / 4,
-				       cairo_image_surface_get_data(output->gl.border.left));
-
-
-	if (!output->gl.border.right)
-		output->gl.border.right =
-			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-						   fwidth - (ix + iwidth), 1);
-	cr = cairo_create(output->gl.border.right);
-	cairo_translate(cr, -(iwidth + ix), -iy);
-	frame_repaint(output->frame, cr);
-	cairo_destroy(cr);
-	gl_renderer->output_set_border(&output->base, GL_RENDERER_BORDER_RIGHT,
-				       fwidth - (ix + iwidth), 1,
-				       cairo_image_surface_get_stride(output->gl.border.right) / 4,
-				       cairo_image_surface_get_data(output->gl.border.right));
-
-
-	if (!output->gl.border.bottom)
-		output->gl.border.bottom =
-			cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-						   fwidth, fheight - (iy + iheight));
-	cr = cairo_create(output->gl.border.bottom);
-	cairo_translate(cr, 0, -(iy + iheight));
-	frame_repaint(output->frame, cr);
-	cairo_destroy(cr);
-	gl_renderer->output_set_border(&output->base, GL_RENDERER_BORDER_BOTTOM,
-				       fwidth, fheight - (iy + iheight),
-				       cairo_image_surface_get_stride(output->gl.border.bottom) / 4,
-				       cairo_image_surface_get_data(output->gl.border.bottom));
-}
-#endif
-
 static void
 wayland_output_start_repaint_loop(struct weston_output *output_base)
 {
@@ -479,6 +705,8 @@ wayland_output_start_repaint_loop(struct weston_output *output_base)
 		draw_initial_frame(output);
 	}
 
+	wayland_output_update_decoration(output);
+
 	output->frame_cb = wl_surface_frame(output->parent.surface);
 	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
 	wl_surface_commit(output->parent.surface);
@@ -486,72 +714,289 @@ wayland_output_start_repaint_loop(struct weston_output *output_base)
 }
 
 #ifdef ENABLE_EGL
-static int
-wayland_output_repaint_gl(struct weston_output *output_base,
-			  pixman_region32_t *damage)
+static void
+dmabuf_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_dmabuf_buffer *db = data;
+
+	weston_buffer_reference(&db->buffer_ref, NULL);
+}
+
+static const struct wl_buffer_listener dmabuf_buffer_listener = {
+	dmabuf_buffer_release
+};
+
+static void
+wayland_dmabuf_buffer_destroy(struct linux_dmabuf_buffer *dmabuf)
+{
+	struct wayland_dmabuf_buffer *db =
+		linux_dmabuf_buffer_get_backend_user_data(dmabuf);
+
+	weston_buffer_reference(&db->buffer_ref, NULL);
+	wl_buffer_destroy(db->parent_buffer);
+	free(db);
+}
+
+static bool
+wayland_backend_parent_takes_dmabuf(struct wayland_backend *b,
+				    const struct dmabuf_attributes *attributes)
+{
+	struct wayland_dmabuf_format *f;
+	uint64_t modifier = attributes->modifier[0];
+
+	wl_array_for_each(f, &b->parent.dmabuf_formats) {
+		if (f->format != attributes->format)
+			continue;
+
+		/* Our clients pass 0 for the implicit layout too */
+		if (f->modifier == modifier ||
+		    (modifier == DRM_FORMAT_MOD_LINEAR &&
+		     f->modifier == DRM_FORMAT_MOD_INVALID))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Get the parent compositor wl_buffer for a client dmabuf
+ *
+ * The dmabuf planes are passed on with create_immed, which the parent
+ * answers with a fatal error on failure; hence only format and modifier
+ * pairs the parent advertised are passed on.
+ *
+ * @param b The wayland backend
+ * @param dmabuf The client dmabuf
+ * @returns The cached parent buffer, or NULL if it cannot be created
+ */
+static struct wayland_dmabuf_buffer *
+wayland_dmabuf_buffer_get(struct wayland_backend *b,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	struct dmabuf_attributes *attributes = &dmabuf->attributes;
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wayland_dmabuf_buffer *db;
+	int i;
+
+	db = linux_dmabuf_buffer_get_backend_user_data(dmabuf);
+	if (db)
+		return db;
+
+	if (!wayland_backend_parent_takes_dmabuf(b, attributes))
+		return NULL;
+
+	db = zalloc(sizeof *db);
+	if (!db)
+		return NULL;
+
+	params = zwp_linux_dmabuf_v1_create_params(b->parent.linux_dmabuf);
+	for (i = 0; i < attributes->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(params, attributes->fd[i], i,
+					       attributes->offset[i],
+					       attributes->stride[i],
+					       attributes->modifier[i] >> 32,
+					       attributes->modifier[i] &
+					       0xffffffff);
+
+	db->parent_buffer =
+		zwp_linux_buffer_params_v1_create_immed(params,
+							attributes->width,
+							attributes->height,
+							attributes->format,
+							attributes->flags);
+	zwp_linux_buffer_params_v1_destroy(params);
+
+	wl_buffer_add_listener(db->parent_buffer, &dmabuf_buffer_listener, db);
+	linux_dmabuf_buffer_set_backend_user_data(dmabuf, db,
+						  wayland_dmabuf_buffer_destroy);
+
+	return db;
+}
+
+/**
+ * Check whether a view can be shown by the parent compositor directly
+ *
+ * The view has to be the topmost one of the output, cover it exactly and
+ * come with a dmabuf matching the output pixel for pixel, so that the
+ * subsurface holding it hides everything the output would composite.
+ */
+static bool
+wayland_output_can_pass_through(struct wayland_output *output,
+				struct weston_view *ev)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct linux_dmabuf_buffer *dmabuf;
+
+	if (!b->parent.subcompositor || !b->parent.linux_dmabuf)
+		return false;
+
+	if (!buffer || !(dmabuf = linux_dmabuf_buffer_get(buffer->resource)))
+		return false;
+
+	if (ev->alpha != 1.0f || ev->dim > 0.0f || ev->transform.enabled ||
+	    ev->geometry.scissor_enabled)
+		return false;
+
+	if (ev->geometry.x != output->base.x ||
+	    ev->geometry.y != output->base.y ||
+	    ev->surface->width != output->base.width ||
+	    ev->surface->height != output->base.height)
+		return false;
+
+	if (buffer->width != output->base.current_mode->width ||
+	    buffer->height != output->base.current_mode->height ||
+	    viewport->buffer.transform != output->base.transform)
+		return false;
+
+	return wayland_dmabuf_buffer_get(b, dmabuf) != NULL;
+}
+
+static void
+wayland_output_assign_planes(struct weston_output *output_base)
 {
 	struct wayland_output *output = to_wayland_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct weston_plane *primary = &ec->primary_plane;
+	struct weston_plane *next_plane;
+	struct weston_view *ev;
+	bool topmost = true;
+
+	output->passthrough.view = NULL;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+
+		/* Keep client dmabufs around for passing them through */
+		ev->surface->keep_buffer = buffer &&
+			!wl_shm_buffer_get(buffer->resource);
+
+		/* Leave the views of other outputs alone, other than taking
+		 * back the one which has moved away from our plane */
+		if (!(ev->output_mask & (1u << output->base.id))) {
+			if (ev->plane == &output->passthrough.plane)
+				weston_view_move_to_plane(ev, primary);
+			continue;
+		}
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+		next_plane = primary;
+		if (topmost && wayland_output_can_pass_through(output, ev)) {
+			next_plane = &output->passthrough.plane;
+			output->passthrough.view = ev;
+			output_base->stats.scanout_views++;
+		}
+		topmost = false;
+
+		weston_view_move_to_plane(ev, next_plane);
+		ev->psf_flags = next_plane == primary ?
+			0 : WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+	}
+}
+
+static int
+wayland_output_init_passthrough(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct wl_region *region;
 
-	wayland_output_update_gl_border(output);
+	output->passthrough.surface =
+		wl_compositor_create_surface(b->parent.compositor);
+	if (!output->passthrough.surface)
+		return -1;
 
-	ec->renderer->repaint_output(&output->base, damage);
+	output->passthrough.subsurface =
+		wl_subcompositor_get_subsurface(b->parent.subcompositor,
+						output->passthrough.surface,
+						output->parent.surface);
+	if (!output->passthrough.subsurface) {
+		wl_surface_destroy(output->passthrough.surface);
+		output->passthrough.surface = NULL;
+		return -1;
+	}
+
+	/* Input keeps going to the output surface underneath */
+	region = wl_compositor_create_region(b->parent.compositor);
+	wl_surface_set_input_region(output->passthrough.surface, region);
+	wl_region_destroy(region);
 
-	pixman_region32_subtract(&ec->primary_plane.damage,
-				 &ec->primary_plane.damage, damage);
 	return 0;
 }
-#endif
 
+/**
+ * Show or hide the passthrough subsurface for the coming output commit
+ *
+ * The subsurface is synchronized, so its state only applies together
+ * with the next commit of the output surface.
+ */
 static void
-wayland_output_update_shm_border(struct wayland_shm_buffer *buffer)
+wayland_output_update_passthrough(struct wayland_output *output)
 {
-	int32_t ix, iy, iwidth, iheight, fwidth, fheight;
-	cairo_t *cr;
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct weston_view *ev = output->passthrough.view;
+	struct wayland_dmabuf_buffer *db;
+
+	if (!ev) {
+		if (output->passthrough.attached) {
+			wl_surface_attach(output->passthrough.surface,
+					  NULL, 0, 0);
+			wl_surface_commit(output->passthrough.surface);
+			output->passthrough.attached = false;
+		}
+		return;
+	}
 
-	if (!buffer->output->frame || !buffer->frame_damaged)
+	if (!output->passthrough.surface &&
+	    wayland_output_init_passthrough(output) < 0)
 		return;
 
-	cr = cairo_create(buffer->c_surface);
-
-	frame_interior(buffer->output->frame, &ix, &iy, &iwidth, &iheight);
-	fwidth = frame_width(buffer->output->frame);
-	fheight = frame_height(buffer->output->frame);
-
-	/* Set the clip so we don't unnecisaraly damage the surface */
-	cairo_move_to(cr, ix, iy);
-	cairo_rel_line_to(cr, iwidth, 0);
-	cairo_rel_line_to(cr, 0, iheight);
-	cairo_rel_line_to(cr, -iwidth, 0);
-	cairo_line_to(cr, ix, iy);
-	cairo_line_to(cr, 0, iy);
-	cairo_line_to(cr, 0, fheight);
-	cairo_line_to(cr, fwidth, fheight);
-	cairo_line_to(cr, fwidth, 0);
-	cairo_line_to(cr, 0, 0);
-	cairo_line_to(cr, 0, iy);
-	cairo_close_path(cr);
-	cairo_clip(cr);
-
-	/* Draw using a pattern so that the final result gets clipped */
-	cairo_push_group(cr);
-	frame_repaint(buffer->output->frame, cr);
-	cairo_pop_group_to_source(cr);
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_paint(cr);
+	db = wayland_dmabuf_buffer_get(b,
+		linux_dmabuf_buffer_get(ev->surface->buffer_ref.buffer->resource));
+	weston_buffer_reference(&db->buffer_ref, ev->surface->buffer_ref.buffer);
 
-	cairo_destroy(cr);
+	wl_surface_attach(output->passthrough.surface, db->parent_buffer, 0, 0);
+	wl_surface_damage(output->passthrough.surface, 0, 0,
+			  output->base.current_mode->width,
+			  output->base.current_mode->height);
+	wl_surface_commit(output->passthrough.surface);
+	output->passthrough.attached = true;
 }
 
+static int
+wayland_output_repaint_gl(struct weston_output *output_base,
+			  pixman_region32_t *damage,
+			  void *repaint_data)
+{
+	struct wayland_output *output = to_wayland_output(output_base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct wayland_backend *b = to_wayland_backend(ec);
+
+	wayland_output_request_frame(output);
+
+	wayland_output_update_passthrough(output);
+	wayland_output_update_decoration(output);
+
+	/* Nothing the parent compositor shows of the output surface has
+	 * changed; commit it only to apply the subsurfaces. */
+	if (output->passthrough.view &&
+	    !pixman_region32_not_empty(damage)) {
+		wl_surface_commit(output->parent.surface);
+		wl_display_flush(b->parent.wl_display);
+	} else {
+		ec->renderer->repaint_output(&output->base, damage);
+	}
+
+	pixman_region32_subtract(&ec->primary_plane.damage,
+				 &ec->primary_plane.damage, damage);
+	return 0;
+}
+#endif
+
 static void
 wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
 {
 	pixman_region32_t damage;
 	pixman_box32_t *rects;
-	int32_t ix, iy, iwidth, iheight, fwidth, fheight;
 	int i, n;
 
 	pixman_region32_init(&damage);
@@ -561,27 +1006,6 @@ wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
 				  sb->output->base.current_scale,
 				  &sb->damage, &damage);
 
-	if (sb->output->frame) {
-		frame_interior(sb->output->frame, &ix, &iy, &iwidth, &iheight);
-		fwidth = frame_width(sb->output->frame);
-		fheight = frame_height(sb->output->frame);
-
-		pixman_region32_translate(&damage, ix, iy);
-
-		if (sb->frame_damaged) {
-			pixman_region32_union_rect(&damage, &damage,
-						   0, 0, fwidth, iy);
-			pixman_region32_union_rect(&damage, &damage,
-						   0, iy, ix, iheight);
-			pixman_region32_union_rect(&damage, &damage,
-						   ix + iwidth, iy,
-						   fwidth - (ix + iwidth), iheight);
-			pixman_region32_union_rect(&damage, &damage,
-						   0, iy + iheight,
-						   fwidth, fheight - (iy + iheight));
-		}
-	}
-
 	rects = pixman_region32_rectangles(&damage, &n);
 	wl_surface_attach(sb->output->parent.surface, sb->buffer, 0, 0);
 	for (i = 0; i < n; ++i)
@@ -589,44 +1013,36 @@ wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
 				  rects[i].y1, rects[i].x2 - rects[i].x1,
 				  rects[i].y2 - rects[i].y1);
 
-	if (sb->output->frame)
-		pixman_region32_fini(&damage);
+	pixman_region32_fini(&damage);
 }
 
 static int
 wayland_output_repaint_pixman(struct weston_output *output_base,
-			      pixman_region32_t *damage)
+			      pixman_region32_t *damage,
+			      void *repaint_data)
 {
 	struct wayland_output *output = to_wayland_output(output_base);
 	struct wayland_backend *b =
 		to_wayland_backend(output->base.compositor);
 	struct wayland_shm_buffer *sb;
 
-	if (output->frame) {
-		if (frame_status(output->frame) & FRAME_STATUS_REPAINT)
-			wl_list_for_each(sb, &output->shm.buffers, link)
-				sb->frame_damaged = 1;
-	}
-
 	wl_list_for_each(sb, &output->shm.buffers, link)
 		pixman_region32_union(&sb->damage, &sb->damage, damage);
 
 	sb = wayland_output_get_shm_buffer(output);
 
-	wayland_output_update_shm_border(sb);
 	pixman_renderer_output_set_buffer(output_base, sb->pm_image);
 	b->compositor->renderer->repaint_output(output_base, &sb->damage);
 
 	wayland_shm_buffer_attach(sb);
+	wayland_output_update_decoration(output);
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+	wayland_output_request_frame(output);
 	wl_surface_commit(output->parent.surface);
 	wl_display_flush(b->parent.wl_display);
 
 	pixman_region32_fini(&sb->damage);
 	pixman_region32_init(&sb->damage);
-	sb->frame_damaged = 0;
 
 	pixman_region32_subtract(&b->compositor->primary_plane.damage,
 				 &b->compositor->primary_plane.damage, damage);
@@ -636,6 +1052,16 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 static void
 wayland_backend_destroy_output_surface(struct wayland_output *output)
 {
+	if (output->passthrough.subsurface)
+		wl_subsurface_destroy(output->passthrough.subsurface);
+	if (output->passthrough.surface)
+		wl_surface_destroy(output->passthrough.surface);
+	output->passthrough.subsurface = NULL;
+	output->passthrough.surface = NULL;
+	output->passthrough.attached = false;
+
+	wayland_output_destroy_decoration(output);
+
 	if (output->parent.xdg_toplevel)
 		zxdg_toplevel_v6_destroy(output->parent.xdg_toplevel);
 
@@ -683,14 +1109,12 @@ wayland_output_disable(struct weston_output *base)
 
 	wayland_backend_destroy_output_surface(output);
 
+	output->passthrough.view = NULL;
+	weston_plane_release(&output->passthrough.plane);
+
 	if (output->frame)
 		frame_destroy(output->frame);
 
-	cairo_surface_destroy(output->gl.border.top);
-	cairo_surface_destroy(output->gl.border.left);
-	cairo_surface_destroy(output->gl.border.right);
-	cairo_surface_destroy(output->gl.border.bottom);
-
 	return 0;
 }
 
@@ -705,6 +1129,8 @@ wayland_output_destroy(struct weston_output *base)
 
 	if (output->frame_cb)
 		wl_callback_destroy(output->frame_cb);
+	if (output->feedback)
+		wp_presentation_feedback_destroy(output->feedback);
 
 	free(output);
 }
@@ -715,19 +1141,10 @@ static const struct wl_shell_surface_listener shell_surface_listener;
 static int
 wayland_output_init_gl_renderer(struct wayland_output *output)
 {
-	int32_t fwidth = 0, fheight = 0;
-
-	if (output->frame) {
-		fwidth = frame_width(output->frame);
-		fheight = frame_height(output->frame);
-	} else {
-		fwidth = output->base.current_mode->width;
-		fheight = output->base.current_mode->height;
-	}
-
 	output->gl.egl_window =
 		wl_egl_window_create(output->parent.surface,
-				     fwidth, fheight);
+				     output->base.current_mode->width,
+				     output->base.current_mode->height);
 	if (!output->gl.egl_window) {
 		weston_log("failure to create wl_egl_window\n");
 		return -1;
@@ -752,7 +1169,8 @@ cleanup_window:
 static int
 wayland_output_init_pixman_renderer(struct wayland_output *output)
 {
-	return pixman_renderer_output_create(&output->base);
+	return pixman_renderer_output_create(&output->base,
+					     PIXMAN_RENDERER_OUTPUT_USE_SHADOW);
 }
 
 static void
@@ -767,62 +1185,46 @@ wayland_output_resize_surface(struct wayland_output *output)
 	width = output->base.current_mode->width;
 	height = output->base.current_mode->height;
 
-	if (output->frame) {
+	/* Without a place to draw it, the frame would only get in the way
+	 * of the input coordinates */
+	if (output->frame && !output->decoration.surface &&
+	    wayland_output_init_decoration(output) < 0) {
+		frame_destroy(output->frame);
+		output->frame = NULL;
+	} else if (!output->frame && output->decoration.surface)
+		wayland_output_destroy_decoration(output);
+
+	/* The output surface only holds the interior of the frame, and
+	 * lets the decoration surface below take the input. */
+	region = wl_compositor_create_region(b->parent.compositor);
+	if (output->decoration.surface) {
 		frame_resize_inside(output->frame, width, height);
+		frame_interior(output->frame, &ix, &iy, NULL, NULL);
+		wl_subsurface_set_position(output->decoration.subsurface,
+					   -ix, -iy);
 
 		frame_input_rect(output->frame, &ix, &iy, &iwidth, &iheight);
-		region = wl_compositor_create_region(b->parent.compositor);
 		wl_region_add(region, ix, iy, iwidth, iheight);
-		wl_surface_set_input_region(output->parent.surface, region);
+		wl_surface_set_input_region(output->decoration.surface,
+					    region);
 		wl_region_destroy(region);
 
-		frame_opaque_rect(output->frame, &ix, &iy, &iwidth, &iheight);
 		region = wl_compositor_create_region(b->parent.compositor);
-		wl_region_add(region, ix, iy, iwidth, iheight);
-		wl_surface_set_opaque_region(output->parent.surface, region);
-		wl_region_destroy(region);
-
-		width = frame_width(output->frame);
-		height = frame_height(output->frame);
 	} else {
-		region = wl_compositor_create_region(b->parent.compositor);
 		wl_region_add(region, 0, 0, width, height);
-		wl_surface_set_input_region(output->parent.surface, region);
-		wl_region_destroy(region);
-
-		region = wl_compositor_create_region(b->parent.compositor);
-		wl_region_add(region, 0, 0, width, height);
-		wl_surface_set_opaque_region(output->parent.surface, region);
-		wl_region_destroy(region);
 	}
+	wl_surface_set_input_region(output->parent.surface, region);
+	wl_region_destroy(region);
+
+	region = wl_compositor_create_region(b->parent.compositor);
+	wl_region_add(region, 0, 0, width, height);
+	wl_surface_set_opaque_region(output->parent.surface, region);
+	wl_region_destroy(region);
 
 #ifdef ENABLE_EGL
-	if (output->gl.egl_window) {
+	if (output->gl.egl_window)
 		wl_egl_window_resize(output->gl.egl_window,
 				     width, height, 0, 0);
-
-		/* These will need to be re-created due to the resize */
-		gl_renderer->output_set_border(&output->base,
-					       GL_RENDERER_BORDER_TOP,
-					       0, 0, 0, NULL);
-		cairo_surface_destroy(output->gl.border.top);
-		output->gl.border.top = NULL;
-		gl_renderer->output_set_border(&output->base,
-					       GL_RENDERER_BORDER_LEFT,
-					       0, 0, 0, NULL);
-		cairo_surface_destroy(output->gl.border.left);
-		output->gl.border.left = NULL;
-		gl_renderer->output_set_border(&output->base,
-					       GL_RENDERER_BORDER_RIGHT,
-					       0, 0, 0, NULL);
-		cairo_surface_destroy(output->gl.border.right);
-		output->gl.border.right = NULL;
-		gl_renderer->output_set_border(&output->base,
-					       GL_RENDERER_BORDER_BOTTOM,
-					       0, 0, 0, NULL);
-		cairo_surface_destroy(output->gl.border.bottom);
-		output->gl.border.bottom = NULL;
-	}
 #endif
 
 	wayland_output_destroy_shm_buffers(output);
@@ -1183,17 +1585,22 @@ wayland_output_enable(struct weston_output *base)
 			goto err_output;
 
 		output->base.repaint = wayland_output_repaint_pixman;
+		output->base.assign_planes = NULL;
 #ifdef ENABLE_EGL
 	} else {
 		if (wayland_output_init_gl_renderer(output) < 0)
 			goto err_output;
 
 		output->base.repaint = wayland_output_repaint_gl;
+		output->base.assign_planes = wayland_output_assign_planes;
 #endif
 	}
 
+	weston_plane_init(&output->passthrough.plane, b->compositor, 0, 0);
+	weston_compositor_stack_plane(b->compositor, &output->passthrough.plane,
+				      &b->compositor->primary_plane);
+
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
-	output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = wayland_output_switch_mode;
@@ -2285,6 +2692,59 @@ static const struct zxdg_shell_v6_listener xdg_shell_listener = {
 	xdg_shell_ping,
 };
 
+static void
+parent_dmabuf_add_format(struct wayland_backend *b, uint32_t format,
+			 uint64_t modifier)
+{
+	struct wayland_dmabuf_format *f;
+
+	f = wl_array_add(&b->parent.dmabuf_formats, sizeof *f);
+	if (!f)
+		return;
+
+	f->format = format;
+	f->modifier = modifier;
+}
+
+static void
+linux_dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *linux_dmabuf,
+		    uint32_t format)
+{
+	/* Version 2 parents only list formats taking the implicit layout;
+	 * version 3 ones repeat them as modifier events. */
+	if (zwp_linux_dmabuf_v1_get_version(linux_dmabuf) <
+	    ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION)
+		parent_dmabuf_add_format(data, format, DRM_FORMAT_MOD_INVALID);
+}
+
+static void
+linux_dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *linux_dmabuf,
+		      uint32_t format, uint32_t modifier_hi,
+		      uint32_t modifier_lo)
+{
+	parent_dmabuf_add_format(data, format,
+				 ((uint64_t) modifier_hi << 32) | modifier_lo);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_listener = {
+	linux_dmabuf_format,
+	linux_dmabuf_modifier
+};
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct wayland_backend *b = data;
+
+	b->parent.presentation_clock_id = clk_id;
+	b->parent.presentation_clock_valid = true;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		       const char *interface, uint32_t version)
@@ -2316,6 +2776,25 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		b->parent.subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "wp_presentation") == 0) {
+		b->parent.presentation =
+			wl_registry_bind(registry, name,
+					 &wp_presentation_interface, 1);
+		wp_presentation_add_listener(b->parent.presentation,
+					     &presentation_listener, b);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 &&
+		   version >= 2) {
+		/* create_immed is needed to forward buffers synchronously */
+		b->parent.linux_dmabuf =
+			wl_registry_bind(registry, name,
+					 &zwp_linux_dmabuf_v1_interface,
+					 MIN(version, 3));
+		zwp_linux_dmabuf_v1_add_listener(b->parent.linux_dmabuf,
+						 &linux_dmabuf_listener, b);
 	}
 }
 
@@ -2386,6 +2865,16 @@ wayland_destroy(struct weston_compositor *ec)
 	if (b->parent.fshell)
 		zwp_fullscreen_shell_v1_release(b->parent.fshell);
 
+	if (b->parent.linux_dmabuf)
+		zwp_linux_dmabuf_v1_destroy(b->parent.linux_dmabuf);
+	wl_array_release(&b->parent.dmabuf_formats);
+
+	if (b->parent.subcompositor)
+		wl_subcompositor_destroy(b->parent.subcompositor);
+
+	if (b->parent.presentation)
+		wp_presentation_destroy(b->parent.presentation);
+
 	if (b->parent.compositor)
 		wl_compositor_destroy(b->parent.compositor);
 
@@ -2480,11 +2969,26 @@ wayland_backend_create(struct weston_compositor *compositor,
 	}
 
 	wl_list_init(&b->parent.output_list);
+	wl_array_init(&b->parent.dmabuf_formats);
 	wl_list_init(&b->input_list);
 	b->parent.registry = wl_display_get_registry(b->parent.wl_display);
 	wl_registry_add_listener(b->parent.registry, &registry_listener, b);
 	wl_display_roundtrip(b->parent.wl_display);
 
+	/* Presentation feedback timestamps are only useful if we can
+	 * read the parent's clock ourselves. */
+	if (b->parent.presentation) {
+		wl_display_roundtrip(b->parent.wl_display);
+		if (!b->parent.presentation_clock_valid ||
+		    weston_compositor_set_presentation_clock(compositor,
+			    b->parent.presentation_clock_id) < 0) {
+			weston_log("Parent presentation clock unusable, "
+				   "falling back to frame callbacks.\n");
+			wp_presentation_destroy(b->parent.presentation);
+			b->parent.presentation = NULL;
+		}
+	}
+
 	create_cursor(b, new_config);
 
 #ifdef ENABLE_EGL
@@ -2542,6 +3046,12 @@ wayland_backend_create(struct weston_compositor *compositor,
 			           "support failed.\n");
 	}
 
+	if (compositor->capabilities & WESTON_CAP_EXPLICIT_SYNC) {
+		if (linux_explicit_synchronization_setup(compositor) < 0)
+			weston_log("Error: initializing explicit "
+			           "synchronization support failed.\n");
+	}
+
 	compositor->backend = &b->base;
 	return b;
 err_display:
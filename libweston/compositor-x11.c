@@ -44,6 +44,9 @@
 #ifdef HAVE_XCB_XKB
 #include <xcb/xkb.h>
 #endif
+#ifdef HAVE_XCB_PRESENT
+#include <xcb/present.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xlib-xcb.h>
@@ -60,10 +63,14 @@
 #include "pixman-renderer.h"
 #include "presentation-time-server-protocol.h"
 #include "linux-dmabuf.h"
+#include "linux-explicit-synchronization.h"
 #include "windowed-output-api.h"
 
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 
+/* SHM pixmaps per output when presenting with the Present extension */
+#define X11_PRESENT_BUFFER_COUNT 2
+
 struct x11_backend {
 	struct weston_backend	 base;
 	struct weston_compositor *compositor;
@@ -81,6 +88,10 @@ struct x11_backend {
 	int			 no_input;
 	int			 use_pixman;
 
+	/* Present extension, used to show the pixman renderer output */
+	int			 has_present;
+	uint8_t			 present_opcode;
+
 	int			 has_net_wm_state_fullscreen;
 
 	/* We could map multi-pointer X to multiple wayland seats, but
@@ -108,6 +119,19 @@ struct x11_backend {
 	} atom;
 };
 
+/* An SHM pixmap the pixman renderer draws into before it is presented */
+struct x11_shm_buffer {
+	xcb_shm_seg_t		segment;
+	xcb_pixmap_t		pixmap;
+	void		       *buf;
+	pixman_image_t	       *image;
+	/* Damage accumulated since the pixmap was last drawn */
+	pixman_region32_t	damage;
+	/* Owned by the X server between PresentPixmap and IdleNotify */
+	bool			busy;
+	uint32_t		serial;
+};
+
 struct x11_output {
 	struct weston_output	base;
 
@@ -118,10 +142,17 @@ struct x11_output {
 	xcb_gc_t		gc;
 	xcb_shm_seg_t		segment;
 	pixman_image_t	       *hw_surface;
-	int			shm_id;
 	void		       *buf;
 	uint8_t			depth;
 	int32_t                 scale;
+
+	/* With the Present extension, the pixman renderer draws into a pool
+	 * of SHM pixmaps instead of hw_surface, and frames complete on
+	 * PresentCompleteNotify instead of finish_frame_timer. */
+	int			use_present;
+	struct x11_shm_buffer	present_buffers[X11_PRESENT_BUFFER_COUNT];
+	uint32_t		present_eid;
+	uint32_t		present_serial;
 };
 
 struct window_delete_data {
@@ -383,13 +414,28 @@ x11_output_start_repaint_loop(struct weston_output *output)
 {
 	struct timespec ts;
 
+#ifdef HAVE_XCB_PRESENT
+	struct x11_output *x11_output = to_x11_output(output);
+	struct x11_backend *b = to_x11_backend(output->compositor);
+
+	/* Ask for the next vblank; the COMPLETE_NOTIFY for it gives us
+	 * a real timestamp to start the repaint loop from. */
+	if (x11_output->use_present) {
+		xcb_present_notify_msc(b->conn, x11_output->window,
+				       ++x11_output->present_serial, 0, 0, 0);
+		xcb_flush(b->conn);
+		return;
+	}
+#endif
+
 	weston_compositor_read_presentation_clock(output->compositor, &ts);
 	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
 x11_output_repaint_gl(struct weston_output *output_base,
-		      pixman_region32_t *damage)
+		      pixman_region32_t *damage,
+		      void *repaint_data)
 {
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
@@ -457,7 +503,8 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 
 static int
 x11_output_repaint_shm(struct weston_output *output_base,
-		       pixman_region32_t *damage)
+		       pixman_region32_t *damage,
+		       void *repaint_data)
 {
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
@@ -489,6 +536,64 @@ x11_output_repaint_shm(struct weston_output *output_base,
 	return 0;
 }
 
+#ifdef HAVE_XCB_PRESENT
+static struct x11_shm_buffer *
+x11_output_get_present_buffer(struct x11_output *output)
+{
+	struct x11_shm_buffer *sb, *oldest = NULL;
+	int i;
+
+	for (i = 0; i < X11_PRESENT_BUFFER_COUNT; i++) {
+		sb = &output->present_buffers[i];
+		if (!sb->busy)
+			return sb;
+		if (!oldest || (int32_t) (sb->serial - oldest->serial) < 0)
+			oldest = sb;
+	}
+
+	/* The server is still holding on to all of them; drawing into
+	 * the one presented longest ago is the least visible tearing. */
+	return oldest;
+}
+
+static int
+x11_output_repaint_present(struct weston_output *output_base,
+			   pixman_region32_t *damage,
+			   void *repaint_data)
+{
+	struct x11_output *output = to_x11_output(output_base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct x11_backend *b = to_x11_backend(ec);
+	struct x11_shm_buffer *sb;
+	int i;
+
+	/* Every pixmap must catch up on what changed since it was last
+	 * drawn, not just on this frame's damage. */
+	for (i = 0; i < X11_PRESENT_BUFFER_COUNT; i++)
+		pixman_region32_union(&output->present_buffers[i].damage,
+				      &output->present_buffers[i].damage,
+				      damage);
+
+	sb = x11_output_get_present_buffer(output);
+
+	pixman_renderer_output_set_buffer(output_base, sb->image);
+	ec->renderer->repaint_output(output_base, &sb->damage);
+
+	pixman_region32_subtract(&ec->primary_plane.damage,
+				 &ec->primary_plane.damage, damage);
+	pixman_region32_clear(&sb->damage);
+
+	sb->serial = ++output->present_serial;
+	sb->busy = true;
+	xcb_present_pixmap(b->conn, output->window, sb->pixmap, sb->serial,
+			   XCB_NONE, XCB_NONE, 0, 0, XCB_NONE, XCB_NONE,
+			   XCB_NONE, XCB_PRESENT_OPTION_NONE, 0, 0, 0, 0, NULL);
+	xcb_flush(b->conn);
+
+	return 0;
+}
+#endif
+
 static int
 finish_frame_handler(void *data)
 {
@@ -501,24 +606,6 @@ finish_frame_handler(void *data)
 	return 1;
 }
 
-static void
-x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
-{
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
-	xcb_free_gc(b->conn, output->gc);
-
-	pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
-	cookie = xcb_shm_detach_checked(b->conn, output->segment);
-	err = xcb_request_check(b->conn, cookie);
-	if (err) {
-		weston_log("xcb_shm_detach failed, error %d\n", err->error_code);
-		free(err);
-	}
-	shmdt(output->buf);
-}
-
 static void
 x11_output_set_wm_protocols(struct x11_backend *b,
 			    struct x11_output *output)
@@ -669,6 +756,126 @@ get_depth_of_visual(xcb_screen_t *screen,
 	return 0;
 }
 
+/**
+ * Create an SHM segment and attach it to the X server
+ *
+ * The segment is marked for removal right away, so that it goes away
+ * with the last of the X server and us detaching it.
+ */
+static int
+x11_shm_segment_create(struct x11_backend *b, size_t size,
+		       xcb_shm_seg_t *segment, void **buf)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+	int shm_id;
+
+	shm_id = shmget(IPC_PRIVATE, size, IPC_CREAT | S_IRWXU);
+	if (shm_id == -1) {
+		weston_log("x11shm: failed to allocate SHM segment\n");
+		return -1;
+	}
+	*buf = shmat(shm_id, NULL, 0 /* read/write */);
+	if (-1 == (long)*buf) {
+		weston_log("x11shm: failed to attach SHM segment\n");
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+	*segment = xcb_generate_id(b->conn);
+	cookie = xcb_shm_attach_checked(b->conn, *segment, shm_id, 1);
+	err = xcb_request_check(b->conn, cookie);
+	if (err) {
+		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
+			   err->error_code, err->major_code, err->minor_code);
+		free(err);
+		shmdt(*buf);
+		shmctl(shm_id, IPC_RMID, NULL);
+		return -1;
+	}
+
+	shmctl(shm_id, IPC_RMID, NULL);
+
+	return 0;
+}
+
+static void
+x11_shm_segment_destroy(struct x11_backend *b, xcb_shm_seg_t segment,
+			void *buf)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+
+	cookie = xcb_shm_detach_checked(b->conn, segment);
+	err = xcb_request_check(b->conn, cookie);
+	if (err) {
+		weston_log("xcb_shm_detach failed, error %d\n", err->error_code);
+		free(err);
+	}
+	shmdt(buf);
+}
+
+#ifdef HAVE_XCB_PRESENT
+static void
+x11_output_fini_present(struct x11_backend *b, struct x11_output *output)
+{
+	struct x11_shm_buffer *sb;
+	int i;
+
+	for (i = 0; i < X11_PRESENT_BUFFER_COUNT; i++) {
+		sb = &output->present_buffers[i];
+		if (!sb->image)
+			continue;
+
+		pixman_image_unref(sb->image);
+		sb->image = NULL;
+		pixman_region32_fini(&sb->damage);
+		xcb_free_pixmap(b->conn, sb->pixmap);
+		x11_shm_segment_destroy(b, sb->segment, sb->buf);
+	}
+
+	output->use_present = 0;
+}
+
+static int
+x11_output_init_present(struct x11_backend *b, struct x11_output *output,
+			pixman_format_code_t format, int width, int height,
+			int stride)
+{
+	struct x11_shm_buffer *sb;
+	int i;
+
+	for (i = 0; i < X11_PRESENT_BUFFER_COUNT; i++) {
+		sb = &output->present_buffers[i];
+		if (x11_shm_segment_create(b, stride * height,
+					   &sb->segment, &sb->buf) < 0) {
+			x11_output_fini_present(b, output);
+			return -1;
+		}
+
+		sb->pixmap = xcb_generate_id(b->conn);
+		xcb_shm_create_pixmap(b->conn, sb->pixmap, output->window,
+				      width, height, output->depth,
+				      sb->segment, 0);
+
+		sb->image = pixman_image_create_bits(format, width, height,
+						     sb->buf, stride);
+		sb->busy = false;
+
+		/* Nothing has been drawn into the pixmap yet */
+		pixman_region32_init(&sb->damage);
+		pixman_region32_copy(&sb->damage, &output->base.region);
+	}
+
+	output->present_eid = xcb_generate_id(b->conn);
+	xcb_present_select_input(b->conn, output->present_eid, output->window,
+				 XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+				 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+	output->use_present = 1;
+
+	return 0;
+}
+#endif
+
 static int
 x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	int width, int height)
@@ -676,8 +883,6 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	xcb_visualtype_t *visual_type;
 	xcb_screen_t *screen;
 	xcb_format_iterator_t fmt;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
 	const xcb_query_extension_reply_t *ext;
 	int bitsperpixel = 0;
 	pixman_format_code_t pixman_format;
@@ -736,39 +941,49 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	}
 
 
-	/* Create SHM segment and attach it */
-	output->shm_id = shmget(IPC_PRIVATE, width * height * (bitsperpixel / 8), IPC_CREAT | S_IRWXU);
-	if (output->shm_id == -1) {
-		weston_log("x11shm: failed to allocate SHM segment\n");
-		return -1;
-	}
-	output->buf = shmat(output->shm_id, NULL, 0 /* read/write */);
-	if (-1 == (long)output->buf) {
-		weston_log("x11shm: failed to attach SHM segment\n");
-		return -1;
+	output->gc = xcb_generate_id(b->conn);
+	xcb_create_gc(b->conn, output->gc, output->window, 0, NULL);
+
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present &&
+	    x11_output_init_present(b, output, pixman_format, width, height,
+				    width * (bitsperpixel / 8)) == 0) {
+		weston_log("x11shm: presenting %d SHM pixmaps with Present\n",
+			   X11_PRESENT_BUFFER_COUNT);
+		return 0;
 	}
-	output->segment = xcb_generate_id(b->conn);
-	cookie = xcb_shm_attach_checked(b->conn, output->segment, output->shm_id, 1);
-	err = xcb_request_check(b->conn, cookie);
-	if (err) {
-		weston_log("x11shm: xcb_shm_attach error %d, op code %d, resource id %d\n",
-			   err->error_code, err->major_code, err->minor_code);
-		free(err);
+#endif
+
+	if (x11_shm_segment_create(b, width * height * (bitsperpixel / 8),
+				   &output->segment, &output->buf) < 0) {
+		xcb_free_gc(b->conn, output->gc);
 		return -1;
 	}
 
-	shmctl(output->shm_id, IPC_RMID, NULL);
-
 	/* Now create pixman image */
 	output->hw_surface = pixman_image_create_bits(pixman_format, width, height, output->buf,
 		width * (bitsperpixel / 8));
 
-	output->gc = xcb_generate_id(b->conn);
-	xcb_create_gc(b->conn, output->gc, output->window, 0, NULL);
-
 	return 0;
 }
 
+static void
+x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
+{
+	xcb_free_gc(b->conn, output->gc);
+
+#ifdef HAVE_XCB_PRESENT
+	if (output->use_present) {
+		x11_output_fini_present(b, output);
+		return;
+	}
+#endif
+
+	pixman_image_unref(output->hw_surface);
+	output->hw_surface = NULL;
+	x11_shm_segment_destroy(b, output->segment, output->buf);
+}
+
 static int
 x11_output_disable(struct weston_output *base)
 {
@@ -913,13 +1128,18 @@ x11_output_enable(struct weston_output *base)
 			weston_log("Failed to initialize SHM for the X11 output\n");
 			goto err;
 		}
-		if (pixman_renderer_output_create(&output->base) < 0) {
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0) {
 			weston_log("Failed to create pixman renderer for output\n");
 			x11_output_deinit_shm(b, output);
 			goto err;
 		}
 
 		output->base.repaint = x11_output_repaint_shm;
+#ifdef HAVE_XCB_PRESENT
+		if (output->use_present)
+			output->base.repaint = x11_output_repaint_present;
+#endif
 	} else {
 		/* eglCreatePlatformWindowSurfaceEXT takes a Window*
 		 * but eglCreateWindowSurface takes a Window. */
@@ -1051,6 +1271,81 @@ x11_backend_find_output(struct x11_backend *b, xcb_window_t window)
 	return NULL;
 }
 
+#ifdef HAVE_XCB_PRESENT
+static void
+x11_output_present_complete(struct x11_output *output,
+			    xcb_present_complete_notify_event_t *ev)
+{
+	struct timespec ts;
+	uint32_t flags;
+
+	if (ev->kind == XCB_PRESENT_COMPLETE_KIND_NOTIFY_MSC) {
+		/* Kicking off the repaint loop; nothing was shown. */
+		flags = WP_PRESENTATION_FEEDBACK_INVALID;
+	} else if (ev->mode == XCB_PRESENT_COMPLETE_MODE_SKIP) {
+		flags = 0;
+	} else {
+		flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
+			WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
+		if (ev->mode == XCB_PRESENT_COMPLETE_MODE_FLIP)
+			flags |= WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION;
+	}
+
+	/* Servers without a real vblank source report a zero UST. */
+	if (ev->ust == 0) {
+		weston_compositor_read_presentation_clock(output->base.compositor,
+							  &ts);
+		flags &= ~WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
+	} else {
+		ts.tv_sec = ev->ust / 1000000;
+		ts.tv_nsec = (ev->ust % 1000000) * 1000;
+	}
+
+	output->base.msc = ev->msc;
+	weston_output_finish_frame(&output->base, &ts, flags);
+}
+
+static void
+x11_output_present_idle(struct x11_output *output,
+			xcb_present_idle_notify_event_t *ev)
+{
+	int i;
+
+	for (i = 0; i < X11_PRESENT_BUFFER_COUNT; i++) {
+		if (output->present_buffers[i].pixmap == ev->pixmap) {
+			output->present_buffers[i].busy = false;
+			return;
+		}
+	}
+}
+
+static void
+x11_backend_handle_present_event(struct x11_backend *b,
+				 xcb_present_generic_event_t *ev)
+{
+	xcb_present_complete_notify_event_t *complete;
+	xcb_present_idle_notify_event_t *idle;
+	struct x11_output *output;
+
+	switch (ev->evtype) {
+	case XCB_PRESENT_COMPLETE_NOTIFY:
+		complete = (xcb_present_complete_notify_event_t *) ev;
+		output = x11_backend_find_output(b, complete->window);
+		if (output && output->use_present)
+			x11_output_present_complete(output, complete);
+		break;
+	case XCB_PRESENT_IDLE_NOTIFY:
+		idle = (xcb_present_idle_notify_event_t *) ev;
+		output = x11_backend_find_output(b, idle->window);
+		if (output && output->use_present)
+			x11_output_present_idle(output, idle);
+		break;
+	default:
+		break;
+	}
+}
+#endif
+
 static void
 x11_backend_delete_window(struct x11_backend *b, xcb_window_t window)
 {
@@ -1507,6 +1802,15 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 		}
 #endif
 
+#ifdef HAVE_XCB_PRESENT
+		if (b->has_present && response_type == XCB_GE_GENERIC) {
+			xcb_present_generic_event_t *present =
+				(xcb_present_generic_event_t *) event;
+			if (present->extension == b->present_opcode)
+				x11_backend_handle_present_event(b, present);
+		}
+#endif
+
 		count++;
 		if (prev != event)
 			free (event);
@@ -1652,6 +1956,58 @@ static const struct weston_windowed_output_api api = {
 	x11_output_create,
 };
 
+static void
+x11_backend_setup_present(struct x11_backend *b)
+{
+#ifndef HAVE_XCB_PRESENT
+	weston_log("XCB-Present not available during build\n");
+	b->has_present = 0;
+#else
+	const xcb_query_extension_reply_t *ext;
+	xcb_present_query_version_reply_t *present_reply;
+	xcb_shm_query_version_reply_t *shm_reply;
+	bool shared_pixmaps;
+
+	b->has_present = 0;
+
+	ext = xcb_get_extension_data(b->conn, &xcb_present_id);
+	if (!ext || !ext->present) {
+		weston_log("Present extension not available on host X11 server\n");
+		return;
+	}
+
+	present_reply = xcb_present_query_version_reply(b->conn,
+		xcb_present_query_version(b->conn,
+					  XCB_PRESENT_MAJOR_VERSION,
+					  XCB_PRESENT_MINOR_VERSION), NULL);
+	if (!present_reply) {
+		weston_log("Failed to query Present extension version\n");
+		return;
+	}
+	free(present_reply);
+
+	/* Presenting needs pixmaps backed by our SHM segments. */
+	shm_reply = xcb_shm_query_version_reply(b->conn,
+		xcb_shm_query_version(b->conn), NULL);
+	shared_pixmaps = shm_reply && shm_reply->shared_pixmaps;
+	free(shm_reply);
+	if (!shared_pixmaps) {
+		weston_log("MIT-SHM pixmaps not available, not using Present\n");
+		return;
+	}
+
+	/* Present reports UST in microseconds of CLOCK_MONOTONIC. */
+	if (weston_compositor_set_presentation_clock(b->compositor,
+						    CLOCK_MONOTONIC) < 0) {
+		weston_log("CLOCK_MONOTONIC not usable, not using Present\n");
+		return;
+	}
+
+	b->present_opcode = ext->major_opcode;
+	b->has_present = 1;
+#endif
+}
+
 static struct x11_backend *
 x11_backend_create(struct weston_compositor *compositor,
 		   struct weston_x11_backend_config *config)
@@ -1699,6 +2055,7 @@ x11_backend_create(struct weston_compositor *compositor,
 			weston_log("Failed to initialize pixman renderer for X11 backend\n");
 			goto err_xdisplay;
 		}
+		x11_backend_setup_present(b);
 	}
 	else if (init_gl_renderer(b) < 0) {
 		goto err_xdisplay;
@@ -1727,6 +2084,12 @@ x11_backend_create(struct weston_compositor *compositor,
 				   "support failed.\n");
 	}
 
+	if (compositor->capabilities & WESTON_CAP_EXPLICIT_SYNC) {
+		if (linux_explicit_synchronization_setup(compositor) < 0)
+			weston_log("Error: initializing explicit "
+				   "synchronization support failed.\n");
+	}
+
 	compositor->backend = &b->base;
 
 	ret = weston_plugin_api_register(compositor, WESTON_WINDOWED_OUTPUT_API_NAME,
@@ -32,6 +32,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <assert.h>
@@ -44,6 +45,7 @@
 #include <unistd.h>
 #include <math.h>
 #include <linux/input.h>
+#include <linux/sockios.h>
 #include <dlfcn.h>
 #include <signal.h>
 #include <setjmp.h>
@@ -54,9 +56,14 @@
 #include "timeline.h"
 
 #include "compositor.h"
+#include "linux-dmabuf.h"
+#include "linux-sync-file.h"
 #include "viewporter-server-protocol.h"
+#include "weston-tearing-control-server-protocol.h"
 #include "presentation-time-server-protocol.h"
+#include "linux-explicit-synchronization-unstable-v1-server-protocol.h"
 #include "shared/helpers.h"
+#include "shared/pool.h"
 #include "shared/os-compatibility.h"
 #include "shared/string-helpers.h"
 #include "shared/timespec-util.h"
@@ -65,6 +72,19 @@
 #include "plugin-registry.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
+#define DEFAULT_REPAINT_MARGIN 1000 /* microseconds */
+#define DEFAULT_CLIPBOARD_MAX_SIZE (64 * 1024 * 1024) /* bytes */
+
+/* Adaptive repaint scheduling: repaint durations are binned in buckets
+ * of this width, and the deadline covers the REPAINT_PERCENTILE of the
+ * recent samples once at least REPAINT_MIN_SAMPLES have been taken. */
+#define REPAINT_BUCKET_NSEC 250000
+#define REPAINT_PERCENTILE 99
+#define REPAINT_MIN_SAMPLES 16
+
+/* Deferred work runs for at most this long per slot, and stops short
+ * of the next repaint deadline by the repaint margin. */
+#define DEFERRED_WORK_BUDGET_NSEC 2000000
 
 static void
 weston_output_transform_scale_init(struct weston_output *output,
@@ -256,15 +276,31 @@ region_init_infinite(pixman_region32_t *region)
 				  UINT32_MAX, UINT32_MAX);
 }
 
+/* pixman regions hold no pointers into themselves, so they can be moved
+ * between owners by value instead of copying their rectangles. */
+static void
+region_swap(pixman_region32_t *a, pixman_region32_t *b)
+{
+	pixman_region32_t tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
 static struct weston_subsurface *
 weston_surface_to_subsurface(struct weston_surface *surface);
 
+/* Shells create and destroy views for every popup, tooltip and
+ * animation; frame callbacks and presentation feedback come and go
+ * with every frame of every client. */
+static struct weston_pool view_pool = WESTON_POOL_INIT(struct weston_view, 64);
+
 WL_EXPORT struct weston_view *
 weston_view_create(struct weston_surface *surface)
 {
 	struct weston_view *view;
 
-	view = zalloc(sizeof *view);
+	view = weston_pool_alloc(&view_pool);
 	if (view == NULL)
 		return NULL;
 
@@ -310,6 +346,11 @@ struct weston_presentation_feedback {
 	uint32_t psf_flags;
 };
 
+static struct weston_pool frame_callback_pool =
+	WESTON_POOL_INIT(struct weston_frame_callback, 256);
+static struct weston_pool feedback_pool =
+	WESTON_POOL_INIT(struct weston_presentation_feedback, 256);
+
 static void
 weston_presentation_feedback_discard(
 		struct weston_presentation_feedback *feedback)
@@ -400,6 +441,7 @@ weston_surface_state_init(struct weston_surface_state *state)
 	pixman_region32_init(&state->damage_buffer);
 	pixman_region32_init(&state->opaque);
 	region_init_infinite(&state->input);
+	state->regions_changed = true;
 
 	wl_list_init(&state->frame_callback_list);
 	wl_list_init(&state->feedback_list);
@@ -409,6 +451,11 @@ weston_surface_state_init(struct weston_surface_state *state)
 	state->buffer_viewport.buffer.src_width = wl_fixed_from_int(-1);
 	state->buffer_viewport.surface.width = -1;
 	state->buffer_viewport.changed = 0;
+
+	state->acquire_fence_fd = -1;
+	state->buffer_release_ref.buffer_release = NULL;
+
+	state->allow_tearing = false;
 }
 
 static void
@@ -430,6 +477,11 @@ weston_surface_state_fini(struct weston_surface_state *state)
 	if (state->buffer)
 		wl_list_remove(&state->buffer_destroy_listener.link);
 	state->buffer = NULL;
+
+	if (state->acquire_fence_fd >= 0)
+		close(state->acquire_fence_fd);
+	state->acquire_fence_fd = -1;
+	weston_buffer_release_reference(&state->buffer_release_ref, NULL);
 }
 
 static void
@@ -447,6 +499,86 @@ weston_surface_state_set_buffer(struct weston_surface_state *state,
 			      &state->buffer_destroy_listener);
 }
 
+/* What is counted as it happens; everything else of weston_client_stats
+ * is summed over surface_list when asked for. */
+struct weston_client_accounting {
+	struct weston_client_stats totals;
+	struct wl_list surface_list;	/* weston_surface::client_accounting_link */
+	struct wl_list link;		/* weston_compositor::client_accounting_list */
+	struct wl_listener client_destroy_listener;
+
+	/* The oldest input sent to the client since its last content
+	 * update */
+	bool input_pending;
+	struct timespec input_time;
+};
+
+static void
+surface_detach_accounting(struct weston_surface *surface)
+{
+	wl_list_remove(&surface->client_accounting_link);
+	wl_list_init(&surface->client_accounting_link);
+	surface->client_accounting = NULL;
+}
+
+static void
+client_accounting_destroy(struct weston_client_accounting *accounting)
+{
+	struct weston_surface *surface, *next;
+
+	wl_list_for_each_safe(surface, next, &accounting->surface_list,
+			      client_accounting_link)
+		surface_detach_accounting(surface);
+
+	wl_list_remove(&accounting->link);
+	free(accounting);
+}
+
+static void
+client_accounting_client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct weston_client_accounting *accounting =
+		container_of(listener, struct weston_client_accounting,
+			     client_destroy_listener);
+
+	client_accounting_destroy(accounting);
+}
+
+static void
+surface_attach_accounting(struct weston_surface *surface,
+			  struct wl_client *client)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct weston_client_accounting *accounting;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client,
+					client_accounting_client_destroyed);
+	if (listener) {
+		accounting = container_of(listener,
+					  struct weston_client_accounting,
+					  client_destroy_listener);
+	} else {
+		/* Not worth failing the surface over */
+		accounting = zalloc(sizeof *accounting);
+		if (!accounting)
+			return;
+
+		accounting->totals.client = client;
+		wl_list_init(&accounting->surface_list);
+		accounting->client_destroy_listener.notify =
+			client_accounting_client_destroyed;
+		wl_client_add_destroy_listener(client,
+				&accounting->client_destroy_listener);
+		wl_list_insert(ec->client_accounting_list.prev,
+			       &accounting->link);
+	}
+
+	surface->client_accounting = accounting;
+	wl_list_insert(accounting->surface_list.prev,
+		       &surface->client_accounting_link);
+}
+
 WL_EXPORT struct weston_surface *
 weston_surface_create(struct weston_compositor *compositor)
 {
@@ -469,7 +601,10 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	weston_surface_state_init(&surface->pending);
 
+	surface->acquire_fence_fd = -1;
+
 	pixman_region32_init(&surface->damage);
+	pixman_region32_init(&surface->buffer_damage);
 	pixman_region32_init(&surface->opaque);
 	region_init_infinite(&surface->input);
 
@@ -480,11 +615,14 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	wl_list_init(&surface->subsurface_list);
 	wl_list_init(&surface->subsurface_list_pending);
+	wl_array_init(&surface->subsurface_tree);
+	surface->subsurface_tree_dirty = true;
 
 	weston_matrix_init(&surface->buffer_to_surface_matrix);
 	weston_matrix_init(&surface->surface_to_buffer_matrix);
 
 	wl_list_init(&surface->pointer_constraints);
+	wl_list_init(&surface->client_accounting_link);
 
 	return surface;
 }
@@ -493,6 +631,12 @@ WL_EXPORT void
 weston_surface_set_color(struct weston_surface *surface,
 		 float red, float green, float blue, float alpha)
 {
+	surface->is_solid = true;
+	surface->solid_color[0] = red;
+	surface->solid_color[1] = green;
+	surface->solid_color[2] = blue;
+	surface->solid_color[3] = alpha;
+
 	surface->compositor->renderer->surface_set_color(surface, red, green, blue, alpha);
 }
 
@@ -522,11 +666,41 @@ weston_view_to_global_float(struct weston_view *view,
 	}
 }
 
+/** Transform points from view to global coordinates
+ *
+ * \param view The view.
+ * \param xy count points as x, y pairs, transformed in place.
+ * \param count The number of points.
+ *
+ * weston_view_to_global_float() for many points at once, checking the
+ * view's transform only once.
+ */
 WL_EXPORT void
-weston_transformed_coord(int width, int height,
-			 enum wl_output_transform transform,
-			 int32_t scale,
-			 float sx, float sy, float *bx, float *by)
+weston_view_to_global_points(struct weston_view *view,
+			     float *xy, unsigned count)
+{
+	unsigned unstable;
+	unsigned i;
+
+	if (!view->transform.enabled) {
+		for (i = 0; i < count; i++) {
+			xy[i * 2] += view->geometry.x;
+			xy[i * 2 + 1] += view->geometry.y;
+		}
+		return;
+	}
+
+	unstable = weston_matrix_transform_points(&view->transform.matrix,
+						  xy, count);
+	if (unstable)
+		weston_log("warning: numerical instability in %s(), "
+			   "%u points\n", __func__, unstable);
+}
+
+static void
+transformed_coord(int width, int height,
+		  enum wl_output_transform transform, int32_t scale,
+		  double sx, double sy, double *bx, double *by)
 {
 	switch (transform) {
 	case WL_OUTPUT_TRANSFORM_NORMAL:
@@ -568,6 +742,19 @@ weston_transformed_coord(int width, int height,
 	*by *= scale;
 }
 
+WL_EXPORT void
+weston_transformed_coord(int width, int height,
+			 enum wl_output_transform transform,
+			 int32_t scale,
+			 float sx, float sy, float *bx, float *by)
+{
+	double x, y;
+
+	transformed_coord(width, height, transform, scale, sx, sy, &x, &y);
+	*bx = x;
+	*by = y;
+}
+
 WL_EXPORT pixman_box32_t
 weston_transformed_rect(int width, int height,
 			enum wl_output_transform transform,
@@ -614,6 +801,7 @@ weston_matrix_transform_region(pixman_region32_t *dest,
 			       pixman_region32_t *src)
 {
 	pixman_box32_t *src_rects, *dest_rects;
+	float *xy, *p1, *p2;
 	int nrects, i;
 
 	src_rects = pixman_region32_rectangles(src, &nrects);
@@ -621,38 +809,45 @@ weston_matrix_transform_region(pixman_region32_t *dest,
 	if (!dest_rects)
 		return;
 
+	/* The two corners of every rectangle, transformed in one go */
+	xy = malloc(nrects * 4 * sizeof(*xy));
+	if (!xy) {
+		free(dest_rects);
+		return;
+	}
+
 	for (i = 0; i < nrects; i++) {
-		struct weston_vector vec1 = {{
-			src_rects[i].x1, src_rects[i].y1, 0, 1
-		}};
-		weston_matrix_transform(matrix, &vec1);
-		vec1.f[0] /= vec1.f[3];
-		vec1.f[1] /= vec1.f[3];
-
-		struct weston_vector vec2 = {{
-			src_rects[i].x2, src_rects[i].y2, 0, 1
-		}};
-		weston_matrix_transform(matrix, &vec2);
-		vec2.f[0] /= vec2.f[3];
-		vec2.f[1] /= vec2.f[3];
-
-		if (vec1.f[0] < vec2.f[0]) {
-			dest_rects[i].x1 = floor(vec1.f[0]);
-			dest_rects[i].x2 = ceil(vec2.f[0]);
+		xy[i * 4] = src_rects[i].x1;
+		xy[i * 4 + 1] = src_rects[i].y1;
+		xy[i * 4 + 2] = src_rects[i].x2;
+		xy[i * 4 + 3] = src_rects[i].y2;
+	}
+
+	weston_matrix_transform_points(matrix, xy, nrects * 2);
+
+	for (i = 0; i < nrects; i++) {
+		p1 = &xy[i * 4];
+		p2 = &xy[i * 4 + 2];
+
+		if (p1[0] < p2[0]) {
+			dest_rects[i].x1 = floor(p1[0]);
+			dest_rects[i].x2 = ceil(p2[0]);
 		} else {
-			dest_rects[i].x1 = floor(vec2.f[0]);
-			dest_rects[i].x2 = ceil(vec1.f[0]);
+			dest_rects[i].x1 = floor(p2[0]);
+			dest_rects[i].x2 = ceil(p1[0]);
 		}
 
-		if (vec1.f[1] < vec2.f[1]) {
-			dest_rects[i].y1 = floor(vec1.f[1]);
-			dest_rects[i].y2 = ceil(vec2.f[1]);
+		if (p1[1] < p2[1]) {
+			dest_rects[i].y1 = floor(p1[1]);
+			dest_rects[i].y2 = ceil(p2[1]);
 		} else {
-			dest_rects[i].y1 = floor(vec2.f[1]);
-			dest_rects[i].y2 = ceil(vec1.f[1]);
+			dest_rects[i].y1 = floor(p2[1]);
+			dest_rects[i].y2 = ceil(p1[1]);
 		}
 	}
 
+	free(xy);
+
 	pixman_region32_clear(dest);
 	pixman_region32_init_rects(dest, dest_rects, nrects);
 	free(dest_rects);
@@ -750,49 +945,121 @@ weston_transformed_region(int width, int height,
 	free(dest_rects);
 }
 
-static void
-viewport_surface_to_buffer(struct weston_surface *surface,
-			   float sx, float sy, float *bx, float *by)
+/* The buffer rectangle the surface shows, or false when there is no
+ * viewport at all. */
+static bool
+viewport_source(struct weston_surface *surface,
+		double *src_x, double *src_y,
+		double *src_width, double *src_height)
 {
 	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
-	double src_width, src_height;
-	double src_x, src_y;
 
 	if (vp->buffer.src_width == wl_fixed_from_int(-1)) {
-		if (vp->surface.width == -1) {
-			*bx = sx;
-			*by = sy;
-			return;
-		}
+		if (vp->surface.width == -1)
+			return false;
 
-		src_x = 0.0;
-		src_y = 0.0;
-		src_width = surface->width_from_buffer;
-		src_height = surface->height_from_buffer;
+		*src_x = 0.0;
+		*src_y = 0.0;
+		*src_width = surface->width_from_buffer;
+		*src_height = surface->height_from_buffer;
 	} else {
-		src_x = wl_fixed_to_double(vp->buffer.src_x);
-		src_y = wl_fixed_to_double(vp->buffer.src_y);
-		src_width = wl_fixed_to_double(vp->buffer.src_width);
-		src_height = wl_fixed_to_double(vp->buffer.src_height);
+		*src_x = wl_fixed_to_double(vp->buffer.src_x);
+		*src_y = wl_fixed_to_double(vp->buffer.src_y);
+		*src_width = wl_fixed_to_double(vp->buffer.src_width);
+		*src_height = wl_fixed_to_double(vp->buffer.src_height);
+	}
+
+	return true;
+}
+
+static void
+viewport_surface_to_buffer(struct weston_surface *surface,
+			   double sx, double sy, double *bx, double *by)
+{
+	double src_width, src_height;
+	double src_x, src_y;
+
+	if (!viewport_source(surface, &src_x, &src_y,
+			     &src_width, &src_height)) {
+		*bx = sx;
+		*by = sy;
+		return;
 	}
 
 	*bx = sx * src_width / surface->width + src_x;
 	*by = sy * src_height / surface->height + src_y;
 }
 
+/** Transform a point from surface coordinates to buffer coordinates
+ *
+ * Like weston_surface_to_buffer_float(), in double precision, for users
+ * that need more than float gives for large buffers, such as plane source
+ * coordinates in 16.16 fixed point.
+ */
 WL_EXPORT void
-weston_surface_to_buffer_float(struct weston_surface *surface,
-			       float sx, float sy, float *bx, float *by)
+weston_surface_to_buffer_double(struct weston_surface *surface,
+				double sx, double sy, double *bx, double *by)
 {
 	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
 
 	/* first transform coordinates if the viewport is set */
 	viewport_surface_to_buffer(surface, sx, sy, bx, by);
 
-	weston_transformed_coord(surface->width_from_buffer,
-				 surface->height_from_buffer,
-				 vp->buffer.transform, vp->buffer.scale,
-				 *bx, *by, bx, by);
+	transformed_coord(surface->width_from_buffer,
+			  surface->height_from_buffer,
+			  vp->buffer.transform, vp->buffer.scale,
+			  *bx, *by, bx, by);
+}
+
+WL_EXPORT void
+weston_surface_to_buffer_float(struct weston_surface *surface,
+			       float sx, float sy, float *bx, float *by)
+{
+	double x, y;
+
+	weston_surface_to_buffer_double(surface, sx, sy, &x, &y);
+	*bx = x;
+	*by = y;
+}
+
+/** Transform points from surface coordinates to buffer coordinates
+ *
+ * \param surface The surface to fetch wp_viewport and buffer
+ * transformation from.
+ * \param xy count points as x, y pairs, transformed in place.
+ * \param count The number of points.
+ *
+ * weston_surface_to_buffer_float() for many points at once, with the
+ * same results, looking up the viewport only once.
+ */
+WL_EXPORT void
+weston_surface_to_buffer_points(struct weston_surface *surface,
+				float *xy, unsigned count)
+{
+	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+	double src_width, src_height;
+	double src_x, src_y;
+	double x, y;
+	bool viewport;
+	unsigned i;
+
+	viewport = viewport_source(surface, &src_x, &src_y,
+				   &src_width, &src_height);
+
+	for (i = 0; i < count; i++) {
+		x = xy[i * 2];
+		y = xy[i * 2 + 1];
+		if (viewport) {
+			x = x * src_width / surface->width + src_x;
+			y = y * src_height / surface->height + src_y;
+		}
+		transformed_coord(surface->width_from_buffer,
+				  surface->height_from_buffer,
+				  vp->buffer.transform, vp->buffer.scale,
+				  x, y, &x, &y);
+		xy[i * 2] = x;
+		xy[i * 2 + 1] = y;
+	}
 }
 
 /** Transform a rectangle from surface coordinates to buffer coordinates
@@ -818,16 +1085,16 @@ weston_surface_to_buffer_rect(struct weston_surface *surface,
 			      pixman_box32_t rect)
 {
 	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
-	float xf, yf;
+	double xf, yf;
 
 	/* first transform box coordinates if the viewport is set */
 	viewport_surface_to_buffer(surface, rect.x1, rect.y1, &xf, &yf);
-	rect.x1 = floorf(xf);
-	rect.y1 = floorf(yf);
+	rect.x1 = floor(xf);
+	rect.y1 = floor(yf);
 
 	viewport_surface_to_buffer(surface, rect.x2, rect.y2, &xf, &yf);
-	rect.x2 = ceilf(xf);
-	rect.y2 = ceilf(yf);
+	rect.x2 = ceil(xf);
+	rect.y2 = ceil(yf);
 
 	return weston_transformed_rect(surface->width_from_buffer,
 				       surface->height_from_buffer,
@@ -835,6 +1102,20 @@ weston_surface_to_buffer_rect(struct weston_surface *surface,
 				       rect);
 }
 
+/* Whether surface and buffer coordinates are the same: no transform,
+ * no scale and no viewport. Damage then needs no conversion at all.
+ */
+static bool
+weston_surface_buffer_is_identity(struct weston_surface *surface)
+{
+	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+
+	return vp->buffer.transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	       vp->buffer.scale == 1 &&
+	       vp->buffer.src_width == wl_fixed_from_int(-1) &&
+	       vp->surface.width == -1;
+}
+
 /** Transform a region from surface coordinates to buffer coordinates
  *
  * \param surface The surface to fetch wp_viewport and buffer transformation
@@ -857,6 +1138,11 @@ weston_surface_to_buffer_region(struct weston_surface *surface,
 	pixman_box32_t *src_rects, *dest_rects;
 	int nrects, i;
 
+	if (weston_surface_buffer_is_identity(surface)) {
+		pixman_region32_copy(buffer_region, surface_region);
+		return;
+	}
+
 	src_rects = pixman_region32_rectangles(surface_region, &nrects);
 	dest_rects = malloc(nrects * sizeof(*dest_rects));
 	if (!dest_rects)
@@ -872,6 +1158,69 @@ weston_surface_to_buffer_region(struct weston_surface *surface,
 	free(dest_rects);
 }
 
+/** Reduce the number of boxes in a damage region
+ *
+ * \param region The region to simplify, in place.
+ * \param overdraw How much area the merged boxes of a band may cover
+ * beyond the original ones, in percent of the latter; 0 merges nothing.
+ * \param max_rects Number of boxes above which the region is replaced
+ * by its extents; 0 for no limit.
+ *
+ * Boxes lying next to each other within a band are joined when the gap
+ * between them is small enough; bands left with identical boxes are then
+ * coalesced by pixman. The result always covers the original region, so
+ * this is only meant for damage, where extra coverage costs some
+ * redundant work but no correctness.
+ */
+WL_EXPORT void
+weston_region_simplify(pixman_region32_t *region, int32_t overdraw,
+		       int32_t max_rects)
+{
+	pixman_box32_t *rects, *out, extents;
+	int64_t covered = 0, area, gap;
+	int i, n, nout = 0;
+
+	rects = pixman_region32_rectangles(region, &n);
+	if (n <= 1)
+		return;
+
+	if (overdraw > 0) {
+		out = malloc(n * sizeof *out);
+		if (!out)
+			return;
+
+		for (i = 0; i < n; i++) {
+			pixman_box32_t *r = &rects[i];
+
+			area = (int64_t) (r->x2 - r->x1) * (r->y2 - r->y1);
+			if (nout > 0 && out[nout - 1].y1 == r->y1 &&
+			    out[nout - 1].y2 == r->y2) {
+				gap = (int64_t) (r->x1 - out[nout - 1].x2) *
+				      (r->y2 - r->y1);
+				if (gap * 100 <= overdraw * (covered + area)) {
+					out[nout - 1].x2 = r->x2;
+					covered += area;
+					continue;
+				}
+			}
+
+			out[nout++] = *r;
+			covered = area;
+		}
+
+		if (nout < n) {
+			pixman_region32_fini(region);
+			pixman_region32_init_rects(region, out, nout);
+		}
+		free(out);
+	}
+
+	if (max_rects > 0 && pixman_region32_n_rects(region) > max_rects) {
+		extents = *pixman_region32_extents(region);
+		pixman_region32_reset(region, &extents);
+	}
+}
+
 WL_EXPORT void
 weston_view_move_to_plane(struct weston_view *view,
 			     struct weston_plane *plane)
@@ -1087,7 +1436,7 @@ view_compute_bbox(struct weston_view *view, const pixman_box32_t *inbox,
 {
 	float min_x = HUGE_VALF,  min_y = HUGE_VALF;
 	float max_x = -HUGE_VALF, max_y = -HUGE_VALF;
-	int32_t s[4][2] = {
+	float s[4][2] = {
 		{ inbox->x1, inbox->y1 },
 		{ inbox->x1, inbox->y2 },
 		{ inbox->x2, inbox->y1 },
@@ -1102,9 +1451,11 @@ view_compute_bbox(struct weston_view *view, const pixman_box32_t *inbox,
 		return;
 	}
 
+	weston_view_to_global_points(view, &s[0][0], 4);
+
 	for (i = 0; i < 4; ++i) {
-		float x, y;
-		weston_view_to_global_float(view, s[i][0], s[i][1], &x, &y);
+		float x = s[i][0], y = s[i][1];
+
 		if (x < min_x)
 			min_x = x;
 		if (x > max_x)
@@ -1121,10 +1472,33 @@ view_compute_bbox(struct weston_view *view, const pixman_box32_t *inbox,
 				  ceilf(max_x) - int_x, ceilf(max_y) - int_y);
 }
 
+/* Only views without a transform parent are moved by their layer's
+ * offset, the others follow their parent. */
+static void
+weston_view_get_layer_offset(struct weston_view *view,
+			     int32_t *x, int32_t *y)
+{
+	struct weston_view *parent = view->geometry.parent;
+	struct weston_layer *layer = view->layer_link.layer;
+
+	if (parent) {
+		*x = parent->transform.offset_x;
+		*y = parent->transform.offset_y;
+	} else if (layer) {
+		*x = layer->offset_x;
+		*y = layer->offset_y;
+	} else {
+		*x = 0;
+		*y = 0;
+	}
+}
+
 static void
 weston_view_update_transform_disable(struct weston_view *view)
 {
 	view->transform.enabled = 0;
+	view->transform.offset_x = 0;
+	view->transform.offset_y = 0;
 
 	/* round off fractions when not transformed */
 	view->geometry.x = roundf(view->geometry.x);
@@ -1185,6 +1559,9 @@ weston_view_update_transform_enable(struct weston_view *view)
 
 	if (parent)
 		weston_matrix_multiply(matrix, &parent->transform.matrix);
+	else if (view->transform.offset_x || view->transform.offset_y)
+		weston_matrix_translate(matrix, view->transform.offset_x,
+					view->transform.offset_y, 0);
 
 	if (weston_matrix_invert(inverse, matrix) < 0) {
 		/* Oops, bad total transformation, not invertible */
@@ -1215,6 +1592,137 @@ weston_view_update_transform_enable(struct weston_view *view)
 	return 0;
 }
 
+/* Views are indexed for picking in a hashed uniform grid over the global
+ * coordinate space. Each bucket holds the views whose bounding box
+ * touches any grid cell hashing to it, so a lookup only has to look at
+ * one bucket plus the few views too large to be worth splitting up.
+ */
+#define PICK_GRID_CELL_SHIFT 8 /* 256x256 pixel cells */
+#define PICK_GRID_BUCKETS 512
+#define PICK_GRID_MAX_CELLS 64
+
+struct weston_pick_grid {
+	struct wl_array buckets[PICK_GRID_BUCKETS];
+	struct wl_array oversized;
+	uint32_t serial;
+	bool broken;
+};
+
+static struct wl_array *
+pick_grid_bucket(struct weston_pick_grid *grid, int32_t cx, int32_t cy)
+{
+	uint32_t hash;
+
+	hash = ((uint32_t) cx * 73856093u) ^ ((uint32_t) cy * 19349663u);
+
+	return &grid->buckets[hash % PICK_GRID_BUCKETS];
+}
+
+static void
+pick_grid_array_add(struct weston_pick_grid *grid, struct wl_array *array,
+		    struct weston_view *view)
+{
+	struct weston_view **v;
+
+	v = wl_array_add(array, sizeof *v);
+	if (!v) {
+		/* Fall back to walking the view list from now on. */
+		grid->broken = true;
+		return;
+	}
+
+	*v = view;
+}
+
+static void
+pick_grid_array_remove(struct wl_array *array, struct weston_view *view)
+{
+	struct weston_view **v, **last;
+
+	wl_array_for_each(v, array) {
+		if (*v == view) {
+			last = (struct weston_view **)
+				((char *) array->data + array->size) - 1;
+			*v = *last;
+			array->size -= sizeof *v;
+			return;
+		}
+	}
+}
+
+static void
+weston_view_pick_index_remove(struct weston_view *view)
+{
+	struct weston_pick_grid *grid = view->surface->compositor->pick_grid;
+	int32_t cx, cy;
+
+	if (!view->pick.indexed)
+		return;
+
+	view->pick.indexed = false;
+
+	if (view->pick.oversized) {
+		pick_grid_array_remove(&grid->oversized, view);
+		return;
+	}
+
+	for (cy = view->pick.y1; cy <= view->pick.y2; cy++)
+		for (cx = view->pick.x1; cx <= view->pick.x2; cx++)
+			pick_grid_array_remove(pick_grid_bucket(grid, cx, cy),
+					       view);
+}
+
+static void
+weston_view_pick_index_update(struct weston_view *view)
+{
+	struct weston_pick_grid *grid = view->surface->compositor->pick_grid;
+	pixman_box32_t *box;
+	int64_t cells;
+	int32_t cx, cy;
+
+	weston_view_pick_index_remove(view);
+
+	view->pick.indexed = true;
+	view->pick.oversized = false;
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	if (box->x1 >= box->x2 || box->y1 >= box->y2) {
+		view->pick.x1 = view->pick.y1 = 0;
+		view->pick.x2 = view->pick.y2 = -1;
+		return;
+	}
+
+	view->pick.x1 = box->x1 >> PICK_GRID_CELL_SHIFT;
+	view->pick.y1 = box->y1 >> PICK_GRID_CELL_SHIFT;
+	view->pick.x2 = (box->x2 - 1) >> PICK_GRID_CELL_SHIFT;
+	view->pick.y2 = (box->y2 - 1) >> PICK_GRID_CELL_SHIFT;
+
+	cells = (int64_t) (view->pick.x2 - view->pick.x1 + 1) *
+		(view->pick.y2 - view->pick.y1 + 1);
+	if (cells > PICK_GRID_MAX_CELLS) {
+		view->pick.oversized = true;
+		pick_grid_array_add(grid, &grid->oversized, view);
+		return;
+	}
+
+	for (cy = view->pick.y1; cy <= view->pick.y2; cy++)
+		for (cx = view->pick.x1; cx <= view->pick.x2; cx++)
+			pick_grid_array_add(grid,
+					    pick_grid_bucket(grid, cx, cy),
+					    view);
+}
+
+static void
+weston_pick_grid_destroy(struct weston_pick_grid *grid)
+{
+	int i;
+
+	for (i = 0; i < PICK_GRID_BUCKETS; i++)
+		wl_array_release(&grid->buckets[i]);
+	wl_array_release(&grid->oversized);
+	free(grid);
+}
+
 static struct weston_layer *
 get_view_layer(struct weston_view *view)
 {
@@ -1223,33 +1731,27 @@ get_view_layer(struct weston_view *view)
 	return view->layer_link.layer;
 }
 
-WL_EXPORT void
-weston_view_update_transform(struct weston_view *view)
+static void
+weston_view_compute_transform(struct weston_view *view)
 {
 	struct weston_view *parent = view->geometry.parent;
 	struct weston_layer *layer;
 	pixman_region32_t mask;
 
-	if (!view->transform.dirty)
-		return;
-
-	if (parent)
-		weston_view_update_transform(parent);
-
-	view->transform.dirty = 0;
-
-	weston_view_damage_below(view);
-
 	pixman_region32_fini(&view->transform.boundingbox);
 	pixman_region32_fini(&view->transform.opaque);
 	pixman_region32_init(&view->transform.opaque);
 
+	weston_view_get_layer_offset(view, &view->transform.offset_x,
+				     &view->transform.offset_y);
+
 	/* transform.position is always in transformation_list */
 	if (view->geometry.transformation_list.next ==
 	    &view->transform.position.link &&
 	    view->geometry.transformation_list.prev ==
 	    &view->transform.position.link &&
-	    !parent) {
+	    !parent &&
+	    !view->transform.offset_x && !view->transform.offset_y) {
 		weston_view_update_transform_disable(view);
 	} else {
 		if (weston_view_update_transform_enable(view) < 0)
@@ -1273,15 +1775,183 @@ weston_view_update_transform(struct weston_view *view)
 		} else {
 			view->geometry.scissor_enabled = false;
 		}
+
+		view->transform.parent_x = parent->transform.matrix.d[12];
+		view->transform.parent_y = parent->transform.matrix.d[13];
 	}
+}
 
-	weston_view_damage_below(view);
+static bool
+box_inside_mask(const pixman_box32_t *box, const pixman_box32_t *mask,
+		int32_t dx, int32_t dy)
+{
+	return (int64_t) box->x1 + dx > mask->x1 &&
+	       (int64_t) box->y1 + dy > mask->y1 &&
+	       (int64_t) box->x2 + dx < mask->x2 &&
+	       (int64_t) box->y2 + dy < mask->y2;
+}
+
+/* When only the layer offset or the position changed, every point of
+ * the view moved by the same amount in global coordinates, so the
+ * matrices and regions can simply be translated instead of transforming
+ * the view again. A view with a parent moves as far as the parent did,
+ * whatever its own transformation; a view without one moves by its own
+ * position change only if its matrix is a plain translation. That does
+ * not work for views clipped by the layer mask, which may uncover parts
+ * the mask cut off, nor for moves by a fraction of a pixel.
+ */
+static int
+weston_view_shift_transform(struct weston_view *view)
+{
+	struct weston_view *parent = view->geometry.parent;
+	struct weston_layer *layer = get_view_layer(view);
+	struct weston_matrix shift;
+	pixman_box32_t *box;
+	float fdx, fdy;
+	int32_t x, y, dx, dy;
 
-	weston_view_assign_output(view);
+	if (!view->transform.enabled)
+		return -1;
 
-	wl_signal_emit(&view->surface->compositor->transform_signal,
-		       view->surface);
-}
+	weston_view_get_layer_offset(view, &x, &y);
+
+	if (parent) {
+		if (view->geometry.x != view->transform.position.matrix.d[12] ||
+		    view->geometry.y != view->transform.position.matrix.d[13])
+			return -1;
+
+		fdx = parent->transform.matrix.d[12] - view->transform.parent_x;
+		fdy = parent->transform.matrix.d[13] - view->transform.parent_y;
+	} else {
+		fdx = x - view->transform.offset_x;
+		fdy = y - view->transform.offset_y;
+
+		if (view->geometry.x != view->transform.position.matrix.d[12] ||
+		    view->geometry.y != view->transform.position.matrix.d[13]) {
+			if (view->transform.matrix.type &
+			    ~WESTON_MATRIX_TRANSFORM_TRANSLATE)
+				return -1;
+
+			fdx += view->geometry.x -
+			       view->transform.position.matrix.d[12];
+			fdy += view->geometry.y -
+			       view->transform.position.matrix.d[13];
+		}
+	}
+
+	dx = fdx;
+	dy = fdy;
+	if (dx != fdx || dy != fdy)
+		return -1;
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	if (layer && (!box_inside_mask(box, &layer->mask, 0, 0) ||
+		      !box_inside_mask(box, &layer->mask, dx, dy)))
+		return -1;
+
+	weston_matrix_translate(&view->transform.matrix, dx, dy, 0);
+
+	weston_matrix_init(&shift);
+	weston_matrix_translate(&shift, -dx, -dy, 0);
+	weston_matrix_multiply(&shift, &view->transform.inverse);
+	view->transform.inverse = shift;
+
+	pixman_region32_translate(&view->transform.boundingbox, dx, dy);
+	pixman_region32_translate(&view->transform.opaque, dx, dy);
+
+	view->transform.position.matrix.d[12] = view->geometry.x;
+	view->transform.position.matrix.d[13] = view->geometry.y;
+	view->transform.offset_x = x;
+	view->transform.offset_y = y;
+	if (parent) {
+		view->transform.parent_x = parent->transform.matrix.d[12];
+		view->transform.parent_y = parent->transform.matrix.d[13];
+	}
+
+	return 0;
+}
+
+WL_EXPORT void
+weston_view_update_transform(struct weston_view *view)
+{
+	struct weston_view *parent = view->geometry.parent;
+	bool offset_only = view->transform.offset_only;
+
+	if (!view->transform.dirty)
+		return;
+
+	if (parent)
+		weston_view_update_transform(parent);
+
+	view->transform.dirty = 0;
+	view->transform.offset_only = false;
+
+	weston_view_damage_below(view);
+
+	if (!offset_only || weston_view_shift_transform(view) < 0)
+		weston_view_compute_transform(view);
+
+	weston_view_damage_below(view);
+
+	weston_view_assign_output(view);
+
+	weston_view_pick_index_update(view);
+
+	wl_signal_emit(&view->surface->compositor->transform_signal,
+		       view->surface);
+}
+
+/** Move a view shown on a plane the output can reposition by itself
+ *
+ * \param view A view whose position just changed.
+ * \return Whether the output moved the plane; nothing has to be
+ * repainted then.
+ *
+ * When this returns false the view has been left for the next repaint
+ * as usual. That is the case when the view is on the primary plane, its
+ * image changed since the last repaint, or it entered or left an output.
+ */
+WL_EXPORT bool
+weston_view_move_on_plane(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	struct weston_output *output = view->output;
+	struct weston_output *o;
+	uint32_t output_mask = view->output_mask;
+
+	if (!view->transform.dirty)
+		return true;
+
+	if (!output || !output->move_plane || !view->plane ||
+	    view->plane == &compositor->primary_plane)
+		return false;
+
+	if (view->geometry.parent ||
+	    !wl_list_empty(&view->geometry.child_list))
+		return false;
+
+	if (pixman_region32_not_empty(&view->surface->damage))
+		return false;
+
+	view->transform.dirty = 0;
+	view->transform.offset_only = false;
+	weston_view_compute_transform(view);
+	weston_view_assign_output(view);
+	weston_view_pick_index_update(view);
+	wl_signal_emit(&compositor->transform_signal, view->surface);
+
+	if (view->output != output || view->output_mask != output_mask ||
+	    output->move_plane(output, view) < 0) {
+		/* The outputs it was on still show it where it was */
+		wl_list_for_each(o, &compositor->output_list, link)
+			if (output_mask & (1u << o->id))
+				weston_output_schedule_repaint(o);
+		weston_view_damage_below(view);
+		return false;
+	}
+
+	return true;
+}
 
 WL_EXPORT void
 weston_view_geometry_dirty(struct weston_view *view)
@@ -1295,16 +1965,38 @@ weston_view_geometry_dirty(struct weston_view *view)
 	 * are not dirty.
 	 */
 
-	if (view->transform.dirty)
+	if (view->transform.dirty && !view->transform.offset_only)
 		return;
 
 	view->transform.dirty = 1;
+	view->transform.offset_only = false;
+	view->surface->compositor->scene_serial++;
 
 	wl_list_for_each(child, &view->geometry.child_list,
 			 geometry.parent_link)
 		weston_view_geometry_dirty(child);
 }
 
+/* Like weston_view_geometry_dirty(), but the view only moved as a
+ * whole: the layer offset it is moved by changed, or an ancestor's
+ * position. */
+static void
+weston_view_offset_dirty(struct weston_view *view)
+{
+	struct weston_view *child;
+
+	if (view->transform.dirty)
+		return;
+
+	view->transform.dirty = 1;
+	view->transform.offset_only = true;
+	view->surface->compositor->scene_serial++;
+
+	wl_list_for_each(child, &view->geometry.child_list,
+			 geometry.parent_link)
+		weston_view_offset_dirty(child);
+}
+
 WL_EXPORT void
 weston_view_to_global_fixed(struct weston_view *view,
 			    wl_fixed_t vx, wl_fixed_t vy,
@@ -1346,6 +2038,37 @@ weston_view_from_global_float(struct weston_view *view,
 	}
 }
 
+/** Transform points from global to view coordinates
+ *
+ * \param view The view.
+ * \param xy count points as x, y pairs, transformed in place.
+ * \param count The number of points.
+ *
+ * weston_view_from_global_float() for many points at once, checking the
+ * view's transform only once.
+ */
+WL_EXPORT void
+weston_view_from_global_points(struct weston_view *view,
+			       float *xy, unsigned count)
+{
+	unsigned unstable;
+	unsigned i;
+
+	if (!view->transform.enabled) {
+		for (i = 0; i < count; i++) {
+			xy[i * 2] -= view->geometry.x;
+			xy[i * 2 + 1] -= view->geometry.y;
+		}
+		return;
+	}
+
+	unstable = weston_matrix_transform_points(&view->transform.inverse,
+						  xy, count);
+	if (unstable)
+		weston_log("warning: numerical instability in %s(), "
+			   "%u points\n", __func__, unstable);
+}
+
 WL_EXPORT void
 weston_view_from_global_fixed(struct weston_view *view,
 			      wl_fixed_t x, wl_fixed_t y,
@@ -1388,6 +2111,23 @@ weston_surface_schedule_repaint(struct weston_surface *surface)
 			weston_output_schedule_repaint(output);
 }
 
+/** Let the commit being applied wait for a later repaint
+ *
+ * \param surface The surface whose committed hook is running.
+ *
+ * For shells that asked the client for a new size and know this commit
+ * does not have it yet: rather than repainting for a frame that is
+ * about to be replaced, the commit is shown with the next repaint,
+ * or after weston_compositor::resize_sync_timeout milliseconds at the
+ * latest. Does nothing when that timeout is 0.
+ */
+WL_EXPORT void
+weston_surface_defer_repaint(struct weston_surface *surface)
+{
+	if (surface->compositor->resize_sync_timeout > 0)
+		surface->repaint_deferred = true;
+}
+
 /**
  * \param view  The view to be repainted
  *
@@ -1417,22 +2157,72 @@ weston_view_schedule_repaint(struct weston_view *view)
 WL_EXPORT void
 weston_surface_damage(struct weston_surface *surface)
 {
+	pixman_box32_t full = { 0, 0, surface->width, surface->height };
+
 	pixman_region32_union_rect(&surface->damage, &surface->damage,
 				   0, 0, surface->width,
 				   surface->height);
 
+	full = weston_surface_to_buffer_rect(surface, full);
+	pixman_region32_union_rect(&surface->buffer_damage,
+				   &surface->buffer_damage,
+				   full.x1, full.y1,
+				   full.x2 - full.x1, full.y2 - full.y1);
+
 	weston_surface_schedule_repaint(surface);
 }
 
+/** Darken a view, for shells to tone down what is not focused
+ *
+ * \param view The view.
+ * \param dim How much of its color to take away, from 0 for none to 1
+ * for black. The view keeps its translucency.
+ *
+ * Only the view is damaged, and its sub-surfaces are darkened along
+ * with it.
+ */
+WL_EXPORT void
+weston_view_set_dim(struct weston_view *view, float dim)
+{
+	struct weston_view *child;
+
+	if (dim < 0.0f)
+		dim = 0.0f;
+	else if (dim > 1.0f)
+		dim = 1.0f;
+
+	if (view->dim != dim) {
+		view->dim = dim;
+		weston_view_damage_below(view);
+	}
+
+	wl_list_for_each(child, &view->geometry.child_list,
+			 geometry.parent_link)
+		if (child->parent_view == view)
+			weston_view_set_dim(child, dim);
+}
+
 WL_EXPORT void
 weston_view_set_position(struct weston_view *view, float x, float y)
 {
+	struct weston_view *child;
+
 	if (view->geometry.x == x && view->geometry.y == y)
 		return;
 
 	view->geometry.x = x;
 	view->geometry.y = y;
-	weston_view_geometry_dirty(view);
+
+	/* Children keep their place relative to the view, and get by
+	 * with a translation as well. */
+	if (!view->transform.dirty || view->transform.offset_only) {
+		view->transform.dirty = 1;
+		view->transform.offset_only = true;
+
+		wl_list_for_each(child, &view->geometry.child_list,
+				 geometry.parent_link)
+			weston_view_offset_dirty(child);
+	}
 }
 
 static void
@@ -1701,38 +2491,98 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static bool
+weston_view_accepts_input(struct weston_view *view,
+			  wl_fixed_t x, wl_fixed_t y,
+			  wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
 	int ix = wl_fixed_to_int(x);
 	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    ix, iy, NULL))
+		return false;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+static void
+pick_grid_find_top(struct weston_pick_grid *grid, struct wl_array *array,
+		   wl_fixed_t x, wl_fixed_t y, struct weston_view **top,
+		   wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view **v;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
+	wl_array_for_each(v, array) {
+		/* Skip views that are not in the current view list, or
+		 * that are stacked below the best match so far. */
+		if ((*v)->pick.serial != grid->serial)
+			continue;
+		if (*top && (*v)->pick.order >= (*top)->pick.order)
 			continue;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+		if (weston_view_accepts_input(*v, x, y, vx, vy))
+			*top = *v;
+	}
+}
+
+/** Find the topmost view accepting input at a global position
+ *
+ * \param compositor The compositor instance.
+ * \param x The x coordinate, in the global space.
+ * \param y The y coordinate, in the global space.
+ * \param vx Set to the x coordinate in the picked view's space.
+ * \param vy Set to the y coordinate in the picked view's space.
+ * \return The view, or NULL if no view accepts input there.
+ *
+ * The result is the same as walking weston_compositor::view_list from
+ * the top, but candidates come from a spatial index that is kept up to
+ * date by weston_view_update_transform().
+ */
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_pick_grid *grid = compositor->pick_grid;
+	struct weston_view *view = NULL;
+	int32_t cx = wl_fixed_to_int(x) >> PICK_GRID_CELL_SHIFT;
+	int32_t cy = wl_fixed_to_int(y) >> PICK_GRID_CELL_SHIFT;
+	wl_fixed_t view_x, view_y;
+
+	if (grid->broken) {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (weston_view_accepts_input(view, x, y, vx, vy))
+				return view;
+		}
+	} else {
+		pick_grid_find_top(grid, pick_grid_bucket(grid, cx, cy),
+				   x, y, &view, &view_x, &view_y);
+		pick_grid_find_top(grid, &grid->oversized,
+				   x, y, &view, &view_x, &view_y);
+
+		if (view) {
+			*vx = view_x;
+			*vy = view_y;
+			return view;
+		}
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1748,6 +2598,13 @@ weston_compositor_repick(struct weston_compositor *compositor)
 	if (!compositor->session_active)
 		return;
 
+	/* Nothing a pick looks at moved since the last one, so every
+	 * pointer focus is still right. */
+	if (compositor->repick_serial == compositor->scene_serial)
+		return;
+
+	compositor->repick_serial = compositor->scene_serial;
+
 	wl_list_for_each(seat, &compositor->seat_list, link)
 		weston_seat_repick(seat);
 }
@@ -1767,6 +2624,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_view_pick_index_remove(view);
+	view->pick.serial = 0;
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1794,6 +2653,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	struct weston_view *view;
 
 	surface->is_mapped = false;
+	surface->compositor->view_list_needs_rebuild = true;
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
@@ -1812,6 +2672,8 @@ weston_surface_reset_pending_buffer(struct weston_surface *surface)
 WL_EXPORT void
 weston_view_destroy(struct weston_view *view)
 {
+	struct weston_output *output;
+
 	wl_signal_emit(&view->destroy_signal, view);
 
 	assert(wl_list_empty(&view->geometry.child_list));
@@ -1823,6 +2685,7 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	weston_view_pick_index_remove(view);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -1833,7 +2696,23 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->surface_link);
 
-	free(view);
+	wl_list_for_each(output, &view->surface->compositor->output_list, link)
+		if (output->scanout_view == view)
+			output->scanout_view = NULL;
+
+	weston_pool_free(&view_pool, view);
+}
+
+/* Size of the square tiles of wl_shm buffers that are hashed, see
+ * weston_compositor::damage_hash */
+#define DAMAGE_HASH_TILE 64
+
+static void
+surface_damage_hash_reset(struct weston_surface *surface)
+{
+	free(surface->damage_hash.flushed);
+	free(surface->damage_hash.pending);
+	memset(&surface->damage_hash, 0, sizeof surface->damage_hash);
 }
 
 WL_EXPORT void
@@ -1847,6 +2726,7 @@ weston_surface_destroy(struct weston_surface *surface)
 		return;
 
 	assert(surface->resource == NULL);
+	assert(surface->client_accounting == NULL);
 
 	wl_signal_emit(&surface->destroy_signal, surface);
 
@@ -1857,10 +2737,19 @@ weston_surface_destroy(struct weston_surface *surface)
 		weston_view_destroy(ev);
 
 	weston_surface_state_fini(&surface->pending);
+	wl_array_release(&surface->subsurface_tree);
 
 	weston_buffer_reference(&surface->buffer_ref, NULL);
+	weston_buffer_release_reference(&surface->buffer_release_ref, NULL);
+	if (surface->acquire_fence_fd >= 0)
+		close(surface->acquire_fence_fd);
+	if (surface->repaint_defer_timer)
+		wl_event_source_remove(surface->repaint_defer_timer);
+
+	surface_damage_hash_reset(surface);
 
 	pixman_region32_fini(&surface->damage);
+	pixman_region32_fini(&surface->buffer_damage);
 	pixman_region32_fini(&surface->opaque);
 	pixman_region32_fini(&surface->input);
 
@@ -1889,9 +2778,26 @@ destroy_surface(struct wl_resource *resource)
 	 * the weston_surface_destroy() call. */
 	surface->resource = NULL;
 
+	/* Whatever keeps the surface around now, it is no longer the
+	 * client's */
+	if (surface->client_accounting)
+		surface_detach_accounting(surface);
+
 	if (surface->viewport_resource)
 		wl_resource_set_user_data(surface->viewport_resource, NULL);
 
+	if (surface->synchronization_resource) {
+		wl_resource_set_user_data(surface->synchronization_resource,
+					  NULL);
+		surface->synchronization_resource = NULL;
+	}
+
+	if (surface->tearing_control_resource) {
+		wl_resource_set_user_data(surface->tearing_control_resource,
+					  NULL);
+		surface->tearing_control_resource = NULL;
+	}
+
 	weston_surface_destroy(surface);
 }
 
@@ -1967,11 +2873,112 @@ weston_buffer_reference(struct weston_buffer_reference *ref,
 	ref->destroy_listener.notify = weston_buffer_reference_handle_destroy;
 }
 
+static void
+weston_buffer_release_reference_handle_destroy(struct wl_listener *listener,
+					       void *data)
+{
+	struct weston_buffer_release_reference *ref =
+		container_of(listener, struct weston_buffer_release_reference,
+			     destroy_listener);
+
+	assert((struct wl_resource *)data == ref->buffer_release->resource);
+	ref->buffer_release = NULL;
+}
+
+static void
+weston_buffer_release_destroy(struct weston_buffer_release *buffer_release)
+{
+	struct wl_resource *resource = buffer_release->resource;
+	int release_fence_fd = buffer_release->fence_fd;
+
+	if (release_fence_fd >= 0) {
+		zwp_linux_buffer_release_v1_send_fenced_release(
+			resource, release_fence_fd);
+	} else {
+		zwp_linux_buffer_release_v1_send_immediate_release(
+			resource);
+	}
+
+	/* Also closes the fence and frees buffer_release */
+	wl_resource_destroy(resource);
+}
+
+/** Hold or drop a zwp_linux_buffer_release_v1 request
+ *
+ * Works like weston_buffer_reference(): the release event is sent when
+ * the last reference is dropped. If the client disconnects first, every
+ * reference is reset to NULL.
+ */
+WL_EXPORT void
+weston_buffer_release_reference(struct weston_buffer_release_reference *ref,
+				struct weston_buffer_release *buffer_release)
+{
+	if (buffer_release == ref->buffer_release)
+		return;
+
+	if (ref->buffer_release) {
+		ref->buffer_release->ref_count--;
+		wl_list_remove(&ref->destroy_listener.link);
+
+		if (ref->buffer_release->ref_count == 0)
+			weston_buffer_release_destroy(ref->buffer_release);
+	}
+
+	if (buffer_release) {
+		buffer_release->ref_count++;
+		wl_resource_add_destroy_listener(buffer_release->resource,
+						 &ref->destroy_listener);
+	}
+
+	ref->buffer_release = buffer_release;
+	ref->destroy_listener.notify =
+		weston_buffer_release_reference_handle_destroy;
+}
+
+/** Pass a buffer release reference on, leaving src empty */
+WL_EXPORT void
+weston_buffer_release_move(struct weston_buffer_release_reference *dest,
+			   struct weston_buffer_release_reference *src)
+{
+	weston_buffer_release_reference(dest, src->buffer_release);
+	weston_buffer_release_reference(src, NULL);
+}
+
+/** Make the release of a buffer wait for one more fence
+ *
+ * Takes ownership of fence_fd. Fences already added are kept, merged
+ * with the new one, so a buffer read by the GPU for several outputs and
+ * scanned out by KMS is only released once all of them are done. If the
+ * kernel can't merge them, the new fence replaces the old one: fences
+ * are added in submission order, so the last one is the best guess.
+ */
+WL_EXPORT void
+weston_buffer_release_add_fence(struct weston_buffer_release *buffer_release,
+				int fence_fd)
+{
+	int merged;
+
+	if (buffer_release->fence_fd < 0) {
+		buffer_release->fence_fd = fence_fd;
+		return;
+	}
+
+	merged = linux_sync_file_merge(buffer_release->fence_fd, fence_fd);
+	if (merged >= 0) {
+		close(fence_fd);
+		fence_fd = merged;
+	}
+
+	close(buffer_release->fence_fd);
+	buffer_release->fence_fd = fence_fd;
+}
+
 static void
 weston_surface_attach(struct weston_surface *surface,
 		      struct weston_buffer *buffer)
 {
 	weston_buffer_reference(&surface->buffer_ref, buffer);
+	surface->is_solid = false;
 
 	if (!buffer) {
 		if (weston_surface_is_mapped(surface))
@@ -2004,12 +3011,81 @@ weston_output_damage(struct weston_output *output)
 	weston_output_schedule_repaint(output);
 }
 
+/** Read back output pixels without waiting for the GPU
+ *
+ * \param output The output to read from.
+ * \param format The pixel format to read back in, 32 bits per pixel.
+ * \param x, y, width, height The area to read, in output buffer
+ * coordinates as for weston_renderer::read_pixels.
+ * \param done Called with the pixels once they are available.
+ * \param data User data passed to done.
+ * \return 0 if done will be called, -1 on failure.
+ *
+ * Meant to be called from the output frame signal. Reads from one
+ * output complete in the order they were requested. Renderers without
+ * an asynchronous read back path read the pixels immediately and call
+ * done before this function returns.
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+	void *pixels;
+
+	if (renderer->read_pixels_async)
+		return renderer->read_pixels_async(output, format,
+						   x, y, width, height,
+						   done, data);
+
+	pixels = malloc(width * height * (PIXMAN_FORMAT_BPP(format) / 8));
+	if (!pixels)
+		return -1;
+
+	if (renderer->read_pixels(output, format, pixels,
+				  x, y, width, height) < 0) {
+		free(pixels);
+		return -1;
+	}
+
+	done(data, pixels);
+	free(pixels);
+
+	return 0;
+}
+
 static void
 surface_flush_damage(struct weston_surface *surface)
 {
+	struct weston_renderer *renderer = surface->compositor->renderer;
+	uint64_t upload_bytes;
+	int32_t i, n;
+
 	if (surface->buffer_ref.buffer &&
-	    wl_shm_buffer_get(surface->buffer_ref.buffer->resource))
-		surface->compositor->renderer->flush_damage(surface);
+	    wl_shm_buffer_get(surface->buffer_ref.buffer->resource)) {
+		upload_bytes = renderer->upload_bytes;
+		renderer->flush_damage(surface);
+		if (surface->client_accounting)
+			surface->client_accounting->totals.upload_bytes +=
+				renderer->upload_bytes - upload_bytes;
+	}
+
+	/* What was hashed at commit is now what the renderer has */
+	if (surface->damage_hash.has_pending) {
+		n = surface->damage_hash.tiles_x * surface->damage_hash.tiles_y;
+		for (i = 0; i < n; i++) {
+			if (!surface->damage_hash.pending[i])
+				continue;
+			surface->damage_hash.flushed[i] =
+				surface->damage_hash.pending[i];
+			surface->damage_hash.pending[i] = 0;
+		}
+		surface->damage_hash.has_pending = false;
+	}
 
 	if (weston_timeline_enabled_ &&
 	    pixman_region32_not_empty(&surface->damage))
@@ -2017,6 +3093,7 @@ surface_flush_damage(struct weston_surface *surface)
 			 TLP_OUTPUT(surface->output), TLP_END);
 
 	pixman_region32_clear(&surface->damage);
+	pixman_region32_clear(&surface->buffer_damage);
 }
 
 static void
@@ -2047,42 +3124,191 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
-static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+/* Whether the pending damage of a surface should be consumed by a repaint
+ * of the given output. A surface shown on other outputs only keeps its
+ * damage, and its buffer, until one of those outputs repaints. Surfaces
+ * that are not on any output are flushed by whichever output comes first,
+ * so that their buffers still get released. Taken from the entry of one
+ * of its views.
+ */
+static bool
+entry_flushes_on_output(const struct weston_view_entry *entry,
+			struct weston_output *output)
 {
-	struct weston_plane *plane;
-	struct weston_view *ev;
-	pixman_region32_t opaque, clip;
+	return entry->surface_output_mask == 0 ||
+	       (entry->surface_output_mask & (1u << output->id));
+}
 
-	pixman_region32_init(&clip);
+/* Accumulate damage and compute clipping for the views of every surface
+ * that is flushed on this output, then flush those surfaces to the
+ * renderer. All views of such a surface take part, even those on other
+ * outputs, because the surface damage is consumed here.
+ */
+/* Whether any of the box is left outside of the hidden region; a view's
+ * bounding box is a single rectangle, so this is exact. */
+static bool
+box_is_visible(pixman_region32_t *hidden, pixman_box32_t *box)
+{
+	if (box->x1 >= box->x2 || box->y1 >= box->y2)
+		return false;
 
-	wl_list_for_each(plane, &ec->plane_list, link) {
-		pixman_region32_copy(&plane->clip, &clip);
+	return pixman_region32_contains_rectangle(hidden, box) !=
+		PIXMAN_REGION_IN;
+}
+
+static void
+output_add_draw_item(struct weston_output *output,
+		     const struct weston_view_entry *entry,
+		     const pixman_box32_t *box)
+{
+	struct weston_draw_item *item;
+
+	item = wl_array_add(&output->draw_items, sizeof *item);
+	if (!item) {
+		weston_log("out of memory for the draw items of %s\n",
+			   output->name);
+		return;
+	}
+
+	item->view = entry->view;
+	item->surface = entry->surface;
+	item->plane = entry->plane;
+	item->alpha = entry->alpha;
+	item->dim = entry->dim;
+	item->box = *box;
+}
+
+/* Views come top first, the renderers want them bottom first */
+static void
+output_reverse_draw_items(struct weston_output *output)
+{
+	struct weston_draw_item *items = output->draw_items.data;
+	struct weston_draw_item tmp;
+	size_t n = output->draw_items.size / sizeof *items;
+	size_t i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = items[i];
+		items[i] = items[n - 1 - i];
+		items[n - 1 - i] = tmp;
+	}
+}
+
+/* Add the view to the draw items if any of it shows on the output, and
+ * hide what it covers from the views below. Returns false once nothing
+ * more can show. */
+static bool
+output_cull_view(struct weston_output *output,
+		 const struct weston_view_entry *entry,
+		 pixman_region32_t *hidden)
+{
+	pixman_box32_t *output_box = pixman_region32_extents(&output->region);
+	pixman_box32_t box;
+
+	box.x1 = MAX(entry->box.x1, output_box->x1);
+	box.y1 = MAX(entry->box.y1, output_box->y1);
+	box.x2 = MIN(entry->box.x2, output_box->x2);
+	box.y2 = MIN(entry->box.y2, output_box->y2);
+
+	if (box_is_visible(hidden, &box))
+		output_add_draw_item(output, entry, &box);
+
+	if (!entry->opaque)
+		return true;
+
+	pixman_region32_union(hidden, hidden,
+			      &entry->view->transform.opaque);
+
+	return box_is_visible(hidden, output_box);
+}
+
+/* Whether the plane is stacked below the primary plane, showing where
+ * that is transparent */
+static bool
+plane_is_underlay(struct weston_compositor *ec, struct weston_plane *plane)
+{
+	struct wl_list *link;
+
+	for (link = ec->primary_plane.link.next;
+	     link != &ec->plane_list; link = link->next)
+		if (link == &plane->link)
+			return true;
+
+	return false;
+}
+
+static void
+compositor_accumulate_damage(struct weston_compositor *ec,
+			     struct weston_output *output)
+{
+	struct weston_view_entry *entry;
+	struct weston_plane *plane;
+	struct weston_surface *es;
+	pixman_region32_t opaque, clip, hidden;
+	bool culling;
+
+	pixman_region32_init(&clip);
+	pixman_region32_init(&hidden);
+	output->draw_items.size = 0;
+
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		pixman_region32_copy(&plane->clip, &clip);
 
 		pixman_region32_init(&opaque);
 
-		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
+		/* Views of the primary plane that nothing shows of, such
+		 * as the windows under a maximized one, are culled here
+		 * so that the renderers do not visit them at all. */
+		culling = plane == &ec->primary_plane;
+		if (culling)
+			pixman_region32_copy(&hidden, &clip);
+
+		wl_array_for_each(entry, &ec->view_entries) {
+			if (entry->plane != plane) {
+				/* Views below the primary plane need a
+				 * hole in it, so the renderers get them
+				 * too, in stacking order. */
+				if (culling && entry->plane &&
+				    plane_is_underlay(ec, entry->plane) &&
+				    entry_flushes_on_output(entry, output))
+					culling = output_cull_view(output,
+								   entry,
+								   &hidden);
+				continue;
+			}
+
+			if (!entry_flushes_on_output(entry, output))
 				continue;
 
-			view_accumulate_damage(ev, &opaque);
+			view_accumulate_damage(entry->view, &opaque);
+
+			if (culling)
+				culling = output_cull_view(output, entry,
+							   &hidden);
 		}
 
 		pixman_region32_union(&clip, &clip, &opaque);
 		pixman_region32_fini(&opaque);
 	}
 
+	pixman_region32_fini(&hidden);
 	pixman_region32_fini(&clip);
 
-	wl_list_for_each(ev, &ec->view_list, link)
-		ev->surface->touched = false;
+	output_reverse_draw_items(output);
+
+	wl_array_for_each(entry, &ec->view_entries)
+		entry->surface->touched = false;
+
+	wl_array_for_each(entry, &ec->view_entries) {
+		es = entry->surface;
+		if (es->touched)
+			continue;
+		es->touched = true;
 
-	wl_list_for_each(ev, &ec->view_list, link) {
-		if (ev->surface->touched)
+		if (!entry_flushes_on_output(entry, output))
 			continue;
-		ev->surface->touched = true;
 
-		surface_flush_damage(ev->surface);
+		surface_flush_damage(es);
 
 		/* Both the renderer and the backend have seen the buffer
 		 * by now. If renderer needs the buffer, it has its own
@@ -2092,8 +3318,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 		 * reference now, and allow early buffer release. This enables
 		 * clients to use single-buffering.
 		 */
-		if (!ev->surface->keep_buffer)
-			weston_buffer_reference(&ev->surface->buffer_ref, NULL);
+		if (!es->keep_buffer)
+			weston_buffer_reference(&es->buffer_ref, NULL);
 	}
 }
 
@@ -2163,6 +3389,7 @@ view_list_add_subsurface_view(struct weston_compositor *compositor,
 	}
 
 	view->parent_view = parent;
+	view->dim = parent->dim;
 	weston_view_update_transform(view);
 	view->is_mapped = true;
 
@@ -2206,11 +3433,64 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Take the hot fields of every view in the list, now that the transforms
+ * are up to date. The planes are only final once the backend assigned
+ * them, weston_output_repaint() takes them again then. */
+static void
+compositor_fill_view_entries(struct weston_compositor *compositor)
+{
+	struct weston_view_entry *entry;
+	struct weston_view *view;
+
+	compositor->view_entries.size = 0;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		entry = wl_array_add(&compositor->view_entries, sizeof *entry);
+		if (!entry) {
+			weston_log("out of memory for the view entries\n");
+			return;
+		}
+
+		entry->view = view;
+		entry->surface = view->surface;
+		entry->plane = view->plane;
+		entry->surface_output = view->surface->output;
+		entry->output_mask = view->output_mask;
+		entry->surface_output_mask = view->surface->output_mask;
+		entry->box =
+			*pixman_region32_extents(&view->transform.boundingbox);
+		entry->alpha = view->alpha;
+		entry->dim = view->dim;
+		entry->opaque =
+			pixman_region32_not_empty(&view->transform.opaque);
+	}
+}
+
+/* Flatten the layers and sub-surface trees into compositor->view_list.
+ *
+ * The list only depends on the layer stacking and on the sub-surface
+ * order and mappedness, so it is only rebuilt when one of those changed
+ * since the last call, as flagged by view_list_needs_rebuild. Otherwise
+ * the existing list is reused, and only the view transforms are brought
+ * up to date. This way all outputs repainting in the same cycle share
+ * one flattening. Either way, view_entries is filled again.
+ */
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
+	struct weston_pick_grid *grid = compositor->pick_grid;
 	struct weston_view *view;
 	struct weston_layer *layer;
+	uint32_t order = 0;
+
+	if (!compositor->view_list_needs_rebuild) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+		compositor_fill_view_entries(compositor);
+		return;
+	}
+
+	compositor->view_list_needs_rebuild = false;
+	compositor->scene_serial++;
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
@@ -2226,6 +3506,20 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Bump the generation, so that views dropped from the list are
+	 * ignored by the pick index, and record the stacking order. */
+	if (++grid->serial == 0)
+		++grid->serial;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->pick.serial = grid->serial;
+		view->pick.order = order++;
+		if (!view->pick.indexed)
+			weston_view_pick_index_update(view);
+	}
+
+	compositor_fill_view_entries(compositor);
 }
 
 static void
@@ -2253,15 +3547,501 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* Whether any part of the view is left visible on the output once the
+ * opaque views above it, on its own plane and on the planes above, are
+ * taken away. Only valid after compositor_accumulate_damage() has
+ * computed the clip for this output.
+ */
+static bool
+view_is_visible_on_output(struct weston_view *view,
+			  struct weston_output *output)
+{
+	pixman_region32_t visible;
+	bool ret;
+
+	if (!(view->output_mask & (1u << output->id)))
+		return false;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &view->transform.boundingbox,
+				  &output->region);
+	pixman_region32_subtract(&visible, &visible, &view->clip);
+	pixman_region32_subtract(&visible, &visible, &view->plane->clip);
+	ret = pixman_region32_not_empty(&visible);
+	pixman_region32_fini(&visible);
+
+	return ret;
+}
+
 static int
-weston_output_repaint(struct weston_output *output)
+output_occluded_frame_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+
+	weston_output_schedule_repaint(output);
+
+	return 0;
+}
+
+/* A frame callback is only sent once per commit, so a slow client cannot
+ * pile them up and they are never held back; just tell who is slow. */
+static void
+output_log_backlogged_client(struct weston_output *output,
+			     struct wl_resource *callback)
 {
 	struct weston_compositor *ec = output->compositor;
+	struct wl_client *client = wl_resource_get_client(callback);
+	pid_t pid;
+	int queued;
+
+	if (!weston_log_scope_is_enabled(ec->clients_scope,
+					 WESTON_LOG_LEVEL_DEBUG) ||
+	    !weston_client_is_backlogged(client, &queued))
+		return;
+
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+	weston_log_scope_printf(ec->clients_scope, WESTON_LOG_LEVEL_DEBUG,
+				"output %s: frame callback for client %d, "
+				"%d bytes queued\n",
+				output->name, (int) pid, queued);
+}
+
+static bool
+compositor_idle_throttled(struct weston_compositor *ec)
+{
+	return ec->state == WESTON_COMPOSITOR_IDLE && ec->idle_frame_rate > 0;
+}
+
+/* Whether the client of the surface has the keyboard focus of any seat */
+static bool
+surface_client_is_focused(struct weston_surface *surface)
+{
+	struct weston_seat *seat;
+	struct weston_keyboard *keyboard;
+	struct wl_client *client;
+
+	if (!surface->resource)
+		return false;
+
+	client = wl_resource_get_client(surface->resource);
+	wl_list_for_each(seat, &surface->compositor->seat_list, link) {
+		keyboard = weston_seat_get_keyboard(seat);
+		if (keyboard && keyboard->focus &&
+		    keyboard->focus->resource &&
+		    wl_resource_get_client(keyboard->focus->resource) == client)
+			return true;
+	}
+
+	return false;
+}
+
+/* The interval the frame rate caps of a surface impose, 0 for none */
+static int64_t
+surface_frame_cap_interval(struct weston_surface *surface)
+{
+	int32_t rate = surface->frame_rate_cap;
+
+	if (surface->unfocused_frame_rate_cap > 0 &&
+	    (rate <= 0 || surface->unfocused_frame_rate_cap < rate) &&
+	    !surface_client_is_focused(surface))
+		rate = surface->unfocused_frame_rate_cap;
+
+	return rate > 0 ? 1000000000LL / rate : 0;
+}
+
+/* Move the frame callbacks of the surfaces synced to this output into
+ * frame_callback_list, to be sent once the repaint is posted.
+ *
+ * A surface none of whose views is visible on the output is throttled to
+ * output->occluded_frame_rate: its callbacks stay queued on the surface
+ * until the interval has passed, or until it becomes visible again. While
+ * the compositor is idle, every surface is throttled to at most
+ * idle_frame_rate as well, and surfaces with a frame rate cap to that.
+ * When callbacks are held back at a non-zero rate, a repaint is scheduled
+ * for when they are due, so that the client does not stall forever.
+ */
+static void
+output_collect_frame_callbacks(struct weston_output *output,
+			       struct wl_list *frame_callback_list)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view_entry *entry;
+	struct weston_surface *es;
+	struct timespec now = { 0 };
+	int64_t occluded_interval = 0, idle_interval = -1;
+	int64_t interval, cap_interval, delay, next_delay = -1;
+	bool occluded = output->occluded_frame_rate >= 0;
+	bool throttle;
+
+	if (compositor_idle_throttled(ec))
+		idle_interval = 1000000000LL / ec->idle_frame_rate;
+	throttle = occluded || idle_interval > 0;
+
+	if (throttle)
+		weston_compositor_read_presentation_clock(ec, &now);
+
+	if (occluded) {
+		if (output->occluded_frame_rate > 0)
+			occluded_interval =
+				1000000000LL / output->occluded_frame_rate;
+
+		/* Reuse touched to flag surfaces with a visible view. */
+		wl_array_for_each(entry, &ec->view_entries)
+			if (entry->surface_output == output)
+				entry->surface->touched = false;
+
+		wl_array_for_each(entry, &ec->view_entries) {
+			if (entry->surface_output == output &&
+			    view_is_visible_on_output(entry->view, output))
+				entry->surface->touched = true;
+		}
+	}
+
+	wl_array_for_each(entry, &ec->view_entries) {
+		/* Note: This operation is safe to do multiple times on the
+		 * same surface.
+		 */
+		if (entry->surface_output != output)
+			continue;
+
+		es = entry->surface;
+
+		/* -1 lets the callbacks through, 0 holds them back. */
+		interval = idle_interval;
+		if (occluded && !es->touched &&
+		    (occluded_interval == 0 || occluded_interval > interval))
+			interval = occluded_interval;
+
+		cap_interval = surface_frame_cap_interval(es);
+		if (cap_interval > 0 && interval != 0 &&
+		    cap_interval > interval) {
+			interval = cap_interval;
+			if (!throttle) {
+				weston_compositor_read_presentation_clock(ec,
+									  &now);
+				throttle = true;
+			}
+		}
+
+		if (interval >= 0 &&
+		    !wl_list_empty(&es->frame_callback_list)) {
+			delay = interval == 0 ? -1 : interval -
+				timespec_sub_to_nsec(&now,
+						     &es->frame_callback_time);
+			if (interval == 0 || delay > 0) {
+				if (delay > 0 &&
+				    (next_delay < 0 || delay < next_delay))
+					next_delay = delay;
+				weston_output_take_feedback_list(output, es);
+				continue;
+			}
+		}
+
+		if (throttle && !wl_list_empty(&es->frame_callback_list))
+			es->frame_callback_time = now;
+
+		wl_list_insert_list(frame_callback_list,
+				    &es->frame_callback_list);
+		wl_list_init(&es->frame_callback_list);
+
+		weston_output_take_feedback_list(output, es);
+	}
+
+	if (next_delay > 0 && output->occluded_frame_timer)
+		wl_event_source_timer_update(output->occluded_frame_timer,
+					     next_delay / 1000000 + 1);
+}
+
+/* The opaque client view filling the whole output, not counting the
+ * pointer cursor, if any: then that client alone decides when the output
+ * needs a new frame. */
+static struct weston_view *
+output_get_fullscreen_client_view(struct weston_output *output)
+{
 	struct weston_view *ev;
+	pixman_region32_t uncovered;
+	bool covered;
+
+	wl_list_for_each(ev, &output->compositor->view_list, link) {
+		if (!(ev->output_mask & (1u << output->id)))
+			continue;
+		if (ev->layer_link.layer &&
+		    ev->layer_link.layer->position ==
+		    WESTON_LAYER_POSITION_CURSOR)
+			continue;
+
+		if (!ev->surface->resource)
+			return NULL;
+
+		pixman_region32_init(&uncovered);
+		pixman_region32_subtract(&uncovered, &output->region,
+					 &ev->transform.opaque);
+		covered = !pixman_region32_not_empty(&uncovered);
+		pixman_region32_fini(&uncovered);
+
+		return covered ? ev : NULL;
+	}
+
+	return NULL;
+}
+
+/* Step all animations of the output to when the frame about to be
+ * repainted is expected on screen. They all see the same clock, so those
+ * started together stay in phase, and whatever geometry they change is
+ * picked up by the view list rebuild of this very repaint.
+ */
+static void
+output_run_animations(struct weston_output *output)
+{
 	struct weston_animation *animation, *next;
+	uint32_t msecs;
+
+	msecs = timespec_to_msec(&output->next_presentation);
+
+	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
+		animation->frame_counter++;
+		animation->frame(animation, output, msecs);
+	}
+}
+
+/* The frame answers the oldest input of the surfaces it shows */
+static void
+output_take_input(struct weston_output *output,
+		  struct weston_surface *surface)
+{
+	surface->input_pending = false;
+
+	if (output->input_frame.pending &&
+	    timespec_sub_to_nsec(&surface->input_time,
+				 &output->input_frame.input_time) >= 0)
+		return;
+
+	output->input_frame.pending = true;
+	output->input_frame.input_time = surface->input_time;
+	output->input_frame.commit_time = surface->input_commit_time;
+}
+
+static void
+output_present_input(struct weston_output *output,
+		     const struct timespec *stamp)
+{
+	if (!output->input_frame.pending)
+		return;
+
+	output->input_frame.pending = false;
+	output->stats.input_frames++;
+	output->stats.input_to_commit_nsec =
+		timespec_sub_to_nsec(&output->input_frame.commit_time,
+				     &output->input_frame.input_time);
+	output->stats.commit_to_present_nsec =
+		timespec_sub_to_nsec(stamp, &output->input_frame.commit_time);
+
+	TL_POINT("core_input_presented", TLP_OUTPUT(output),
+		 TLP_INPUT(&output->input_frame.input_time),
+		 TLP_VBLANK(stamp), TLP_END);
+
+	wl_signal_emit(&output->input_latency_signal, output);
+}
+
+/* How long a content rate must hold before the output follows it */
+#define CONTENT_RATE_SETTLE_NSEC 1000000000LL
+
+/* The rate, in mHz, a surface has been updating its content at over its
+ * whole commit history, or 0 if that is not steady. Commits paced by
+ * frame callbacks land on output refreshes, so each interval may be off
+ * by up to one refresh period, e.g. 24 fps on a 60 Hz output alternates
+ * between 2 and 3 refreshes per commit. */
+static uint32_t
+surface_get_steady_commit_rate(struct weston_surface *surface,
+			       struct weston_output *output,
+			       const struct timespec *now)
+{
+	const struct weston_surface_commit_stats *stats = &surface->commit_stats;
+	const struct timespec *t, *prev;
+	int64_t mean, interval, slack;
+	unsigned int i, first;
+
+	if (stats->count < WESTON_SURFACE_COMMIT_HISTORY ||
+	    output->current_mode->refresh <= 0)
+		return 0;
+
+	first = stats->history_next;
+	prev = &stats->history[(first + WESTON_SURFACE_COMMIT_HISTORY - 1) %
+			       WESTON_SURFACE_COMMIT_HISTORY];
+	mean = timespec_sub_to_nsec(prev, &stats->history[first]) /
+	       (WESTON_SURFACE_COMMIT_HISTORY - 1);
+	if (mean <= 0 || timespec_sub_to_nsec(now, prev) > 2 * mean)
+		return 0;
+
+	slack = millihz_to_nsec(output->current_mode->refresh) + 2000000;
+	for (i = 1; i < WESTON_SURFACE_COMMIT_HISTORY; i++) {
+		prev = &stats->history[(first + i - 1) %
+				       WESTON_SURFACE_COMMIT_HISTORY];
+		t = &stats->history[(first + i) % WESTON_SURFACE_COMMIT_HISTORY];
+		interval = timespec_sub_to_nsec(t, prev);
+		if (interval < mean - slack || interval > mean + slack)
+			return 0;
+	}
+
+	return (uint32_t) (1000000000000LL / mean);
+}
+
+/* The fastest mode of the native size refreshing at a multiple of rate,
+ * but no faster than the native mode. */
+static struct weston_mode *
+output_pick_content_rate_mode(struct weston_output *output, uint32_t rate)
+{
+	struct weston_mode *native = output->native_mode;
+	struct weston_mode *mode, *best = NULL;
+	int64_t multiple, error;
+
+	wl_list_for_each(mode, &output->mode_list, link) {
+		if (mode->width != native->width ||
+		    mode->height != native->height ||
+		    mode->refresh <= 0 ||
+		    mode->refresh > native->refresh + native->refresh / 200)
+			continue;
+
+		multiple = ((int64_t) mode->refresh + rate / 2) / rate;
+		if (multiple < 1)
+			continue;
+		error = mode->refresh - multiple * rate;
+		if (error < 0)
+			error = -error;
+		/* within 0.5%, so that 23.976 fps takes 24 Hz and the like */
+		if (error * 200 > mode->refresh)
+			continue;
+
+		if (!best || mode->refresh > best->refresh ||
+		    (mode->refresh == best->refresh && mode == native))
+			best = mode;
+	}
+
+	return best;
+}
+
+/* Switching modes replaces the buffers the backend is scanning out and
+ * its renderer state, so it can't happen in the middle of a repaint. */
+static void
+output_apply_content_rate_mode(struct weston_output *output)
+{
+	struct weston_mode *mode = output->content_rate.pending;
+
+	output->content_rate.pending = NULL;
+	if (!mode || output->destroying || mode == output->current_mode)
+		return;
+
+	if (mode == output->native_mode) {
+		weston_output_mode_switch_to_native(output);
+		output->content_rate.mode = NULL;
+	} else if (weston_output_mode_switch_to_temporary(output, mode,
+				output->current_scale) == 0) {
+		output->content_rate.mode = mode;
+	} else {
+		weston_output_mode_switch_to_native(output);
+		output->content_rate.mode = NULL;
+	}
+
+	/* The backend starts over with fresh buffers */
+	weston_output_damage(output);
+}
+
+/* A mode switch drops the buffers of the backend, so it must not happen
+ * while a frame is still on its way to the screen: the repaint that just
+ * ran has usually queued one. In that case weston_output_finish_frame()
+ * applies the pending mode once the frame is done. */
+static void
+output_switch_content_rate_mode(struct weston_deferred_work *work)
+{
+	struct weston_output *output =
+		container_of(work, struct weston_output,
+			     content_rate.switch_work);
+
+	if (output->repaint_status == REPAINT_AWAITING_COMPLETION ||
+	    output->repaint_status == REPAINT_BEGIN_FROM_IDLE)
+		return;
+
+	output_apply_content_rate_mode(output);
+}
+
+/* Follow the update rate of the fullscreen client view of an output, if
+ * any, with its refresh rate. A new rate has to hold for a while before
+ * the mode changes, so that the odd dropped frame or a seek does not
+ * cause a mode set; leaving fullscreen goes back to the native mode
+ * right away. Modes the shell switched to are left alone. The switch
+ * itself happens once the frame being repainted has been presented, and
+ * the next repaint uses the new mode. */
+static void
+output_update_content_rate(struct weston_output *output,
+			   struct weston_view *fullscreen)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_mode *mode;
+	struct timespec now;
+	uint32_t rate = 0;
+	int64_t diff;
+
+	if (!ec->content_rate_switching || !output->switch_mode)
+		return;
+
+	/* Somebody else changed the mode since */
+	if (output->content_rate.mode &&
+	    output->current_mode != output->content_rate.mode)
+		output->content_rate.mode = NULL;
+
+	if (!output->content_rate.mode && output->original_mode)
+		return;
+
+	weston_compositor_read_presentation_clock(ec, &now);
+	if (fullscreen)
+		rate = surface_get_steady_commit_rate(fullscreen->surface,
+						      output, &now);
+
+	diff = (int64_t) rate - output->content_rate.rate;
+	if (diff < 0)
+		diff = -diff;
+	if (diff * 50 > output->content_rate.rate || (rate == 0) !=
+	    (output->content_rate.rate == 0)) {
+		output->content_rate.rate = rate;
+		output->content_rate.since = now;
+		if (fullscreen)
+			return;
+	} else if (timespec_sub_to_nsec(&now, &output->content_rate.since) <
+		   CONTENT_RATE_SETTLE_NSEC) {
+		return;
+	}
+
+	mode = rate ? output_pick_content_rate_mode(output, rate) : NULL;
+	if (!mode)
+		mode = output->native_mode;
+	if (mode == output->current_mode) {
+		output->content_rate.pending = NULL;
+		weston_deferred_work_cancel(&output->content_rate.switch_work);
+		return;
+	}
+	if (mode == output->content_rate.pending)
+		return;
+
+	weston_log("Output %s: content at %u.%03u Hz, refreshing at "
+		   "%d.%03d Hz\n", output->name, rate / 1000, rate % 1000,
+		   mode->refresh / 1000, mode->refresh % 1000);
+
+	output->content_rate.pending = mode;
+	output->content_rate.switch_work.run = output_switch_content_rate_mode;
+	weston_compositor_defer_work(ec, &output->content_rate.switch_work);
+}
+
+static int
+weston_output_repaint(struct weston_output *output, void *repaint_data)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *ev, *fullscreen;
+	struct weston_view_entry *entry;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	uint64_t upload_bytes;
+	bool damaged;
 	int r;
 
 	if (output->destroying)
@@ -2269,33 +4049,58 @@ weston_output_repaint(struct weston_output *output)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
+	output_run_animations(output);
+
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
 
+	fullscreen = output_get_fullscreen_client_view(output);
+	output_update_content_rate(output, fullscreen);
+
+	/* Counted by the backend as it assigns planes */
+	output->stats.scanout_views = 0;
+	output->stats.overlay_views = 0;
+	output->stats.cursor_views = 0;
+
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output);
 	} else {
 		wl_list_for_each(ev, &ec->view_list, link) {
 			weston_view_move_to_plane(ev, &ec->primary_plane);
 			ev->psf_flags = 0;
+			ev->plane_miss = output->assign_planes ?
+				WESTON_PLANE_MISS_DISABLED :
+				WESTON_PLANE_MISS_NONE;
 		}
 	}
 
-	wl_list_init(&frame_callback_list);
-	wl_list_for_each(ev, &ec->view_list, link) {
-		/* Note: This operation is safe to do multiple times on the
-		 * same surface.
-		 */
-		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+	/* While idle and throttled, let the display refresh only as often
+	 * as something is drawn, down to its lowest rate. */
+	output->vrr_active = output->vrr_capable &&
+		(fullscreen || compositor_idle_throttled(ec));
+	if (ec->low_latency_scanout && fullscreen &&
+	    fullscreen->plane != &ec->primary_plane)
+		output->scanout_view = fullscreen;
+	else
+		output->scanout_view = NULL;
 
-			weston_output_take_feedback_list(output, ev->surface);
-		}
+	output->stats.primary_views = 0;
+	wl_array_for_each(entry, &ec->view_entries) {
+		entry->plane = entry->view->plane;
+		if (!(entry->output_mask & (1u << output->id)))
+			continue;
+		if (entry->plane == &ec->primary_plane)
+			output->stats.primary_views++;
+		if (entry->surface->input_pending)
+			output_take_input(output, entry->surface);
 	}
 
-	compositor_accumulate_damage(ec);
+	upload_bytes = ec->renderer->upload_bytes;
+	compositor_accumulate_damage(ec, output);
+	output->stats.upload_bytes = ec->renderer->upload_bytes - upload_bytes;
+
+	wl_list_init(&frame_callback_list);
+	output_collect_frame_callbacks(output, &frame_callback_list);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2306,65 +4111,411 @@ weston_output_repaint(struct weston_output *output)
 	if (output->dirty)
 		weston_output_update_matrix(output);
 
-	r = output->repaint(output, &output_damage);
+	/* Backends may skip rendering and flipping entirely when there is
+	 * no damage, the frame callbacks below still go out. */
+	damaged = pixman_region32_not_empty(&output_damage);
+	r = output->repaint(output, &output_damage, repaint_data);
+	output->draw_items.size = 0;
+	ec->view_entries.size = 0;
 
 	pixman_region32_fini(&output_damage);
 
-	output->repaint_needed = 0;
+	/* Animations that are still running need the next frame too. Only
+	 * this output ticks them, whether or not what they move is on it. */
+	output->repaint_needed = !wl_list_empty(&output->animation_list);
 
 	weston_compositor_repick(ec);
 
 	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
+		output_log_backlogged_client(output, cb->resource);
 		wl_callback_send_done(cb->resource, output->frame_time);
 		wl_resource_destroy(cb->resource);
 	}
 
-	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
-		animation->frame_counter++;
-		animation->frame(animation, output, output->frame_time);
-	}
-
 	TL_POINT("core_repaint_posted", TLP_OUTPUT(output), TLP_END);
 
+	weston_log_scope_printf(ec->repaint_scope, WESTON_LOG_LEVEL_DEBUG,
+				"output %s: repainted, %u views on primary, "
+				"%u scanout, %u overlay, %u cursor, "
+				"%" PRIu64 " bytes uploaded%s%s\n",
+				output->name, output->stats.primary_views,
+				output->stats.scanout_views,
+				output->stats.overlay_views,
+				output->stats.cursor_views,
+				output->stats.upload_bytes,
+				damaged ? "" : ", no damage",
+				r != 0 ? ", failed" : "");
+
 	return r;
 }
 
 static void
 weston_output_schedule_repaint_reset(struct weston_output *output)
 {
-	output->repaint_scheduled = 0;
+	output->repaint_status = REPAINT_NOT_SCHEDULED;
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 }
 
+static int
+weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
+			    void *repaint_data)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int ret = 0;
+	int64_t msec_to_repaint;
+
+	/* We're not ready yet; come back to make a decision later. */
+	if (output->repaint_status != REPAINT_SCHEDULED)
+		return ret;
+
+	msec_to_repaint = timespec_sub_to_msec(&output->next_repaint, now);
+	if (msec_to_repaint > 1)
+		return ret;
+
+	/* If we're sleeping, drop the repaint machinery entirely; we will
+	 * explicitly repaint all outputs when we come back. */
+	if (compositor->state == WESTON_COMPOSITOR_SLEEPING ||
+	    compositor->state == WESTON_COMPOSITOR_OFFSCREEN)
+		goto err;
+
+	/* We don't actually need to repaint this output; drop it from
+	 * repaint until something causes damage. */
+	if (!output->repaint_needed)
+		goto err;
+
+	/* If repaint fails, we aren't going to get weston_output_finish_frame
+	 * to trigger a new repaint, so drop it from repaint and hope
+	 * something schedules a successful repaint later. As repainting may
+	 * take some time, re-read our clock as a courtesy to the next
+	 * output. */
+	if (output->stats.finish_time.tv_sec != 0 ||
+	    output->stats.finish_time.tv_nsec != 0)
+		output->stats.idle_nsec =
+			timespec_sub_to_nsec(now, &output->stats.finish_time);
+
+	ret = weston_output_repaint(output, repaint_data);
+	weston_compositor_read_presentation_clock(compositor, now);
+	if (ret != 0)
+		goto err;
+
+	output->repaint_status = REPAINT_AWAITING_COMPLETION;
+	output->repaint_timing.pending = true;
+
+	return ret;
+
+err:
+	weston_output_schedule_repaint_reset(output);
+	return ret;
+}
+
+static void
+output_repaint_timing_add(struct weston_output *output, int64_t nsec)
+{
+	uint32_t *buckets = output->repaint_timing.buckets;
+	uint8_t *history = output->repaint_timing.history;
+	unsigned int next = output->repaint_timing.next;
+	int bucket;
+
+	if (nsec < 0)
+		nsec = 0;
+
+	bucket = MIN(nsec / REPAINT_BUCKET_NSEC,
+		     WESTON_REPAINT_HISTOGRAM_BUCKETS - 1);
+
+	/* Once the history is full, retire the oldest sample. */
+	if (output->repaint_timing.count == WESTON_REPAINT_HISTORY_LENGTH)
+		buckets[history[next]]--;
+	else
+		output->repaint_timing.count++;
+
+	history[next] = bucket;
+	buckets[bucket]++;
+	output->repaint_timing.next = (next + 1) % WESTON_REPAINT_HISTORY_LENGTH;
+}
+
+/** Time to reserve before the next vblank for repainting an output
+ *
+ * With adaptive scheduling, this is the repaint duration not exceeded
+ * by REPAINT_PERCENTILE percent of the recent repaints, plus the last
+ * GPU render time reported by the renderer and the configured margin.
+ * Until enough samples are in, or without adaptive scheduling, the
+ * fixed repaint window is used.
+ */
+static int64_t
+output_repaint_window_nsec(struct weston_output *output, int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	unsigned int target, seen = 0;
+	int64_t window;
+	int i;
+
+	if (!compositor->repaint_adaptive ||
+	    output->repaint_timing.count < REPAINT_MIN_SAMPLES)
+		return (int64_t) compositor->repaint_msec * 1000000;
+
+	target = (output->repaint_timing.count * REPAINT_PERCENTILE + 99) / 100;
+	for (i = 0; i < WESTON_REPAINT_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += output->repaint_timing.buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	window = (int64_t) (i + 1) * REPAINT_BUCKET_NSEC +
+		 output->repaint_timing.gpu_nsec +
+		 (int64_t) compositor->repaint_margin_usec * 1000;
+
+	return MIN(window, refresh_nsec);
+}
+
+static void
+output_repaint_timer_arm(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+	bool any_should_repaint = false;
+	struct timespec now;
+	int64_t msec_to_next = INT64_MAX;
+
+	weston_compositor_read_presentation_clock(compositor, &now);
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		int64_t msec_to_this;
+
+		if (output->repaint_status != REPAINT_SCHEDULED)
+			continue;
+
+		msec_to_this = timespec_sub_to_msec(&output->next_repaint,
+						    &now);
+		if (!any_should_repaint || msec_to_this < msec_to_next)
+			msec_to_next = msec_to_this;
+
+		any_should_repaint = true;
+	}
+
+	if (!any_should_repaint)
+		return;
+
+	/* Even if we should repaint immediately, add the minimum 1 ms delay.
+	 * This is a workaround to allow coalescing multiple output repaints
+	 * particularly from weston_output_finish_frame()
+	 * into the same call, which would not happen if we called
+	 * output_repaint_timer_handler() directly.
+	 */
+	if (msec_to_next < 1)
+		msec_to_next = 1;
+
+	wl_event_source_timer_update(compositor->repaint_timer, msec_to_next);
+}
+
+static void
+output_update_stats(struct weston_output *output, int64_t repaint_nsec)
+{
+	int32_t refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+
+	output->stats.frames++;
+	output->stats.repaint_nsec = repaint_nsec;
+	if (repaint_nsec > output_repaint_window_nsec(output, refresh_nsec))
+		output->stats.missed_deadlines++;
+
+	wl_signal_emit(&output->stats_signal, output);
+}
+
+static bool
+compositor_repaint_scheduled(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (output->repaint_status == REPAINT_SCHEDULED)
+			return true;
+	}
+
+	return false;
+}
+
+/* Left over work runs after the next repaint if one is coming, or else
+ * from the timer, once the dispatch that queued it is done. */
+static void
+deferred_work_arm(struct weston_compositor *compositor)
+{
+	if (wl_list_empty(&compositor->deferred_work_list) ||
+	    compositor_repaint_scheduled(compositor))
+		return;
+
+	wl_event_source_timer_update(compositor->deferred_work_timer, 1);
+}
+
+static int64_t
+deferred_work_budget_nsec(struct weston_compositor *compositor,
+			  const struct timespec *now)
+{
+	struct weston_output *output;
+	int64_t budget = DEFERRED_WORK_BUDGET_NSEC;
+	int64_t slack;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (output->repaint_status != REPAINT_SCHEDULED)
+			continue;
+
+		slack = timespec_sub_to_nsec(&output->next_repaint, now) -
+			(int64_t) compositor->repaint_margin_usec * 1000;
+		budget = MIN(budget, slack);
+	}
+
+	return budget;
+}
+
+/* Runs the deferred work in queueing order until the budget is spent;
+ * work queued meanwhile waits for the next slot. */
+static void
+deferred_work_run(struct weston_compositor *compositor)
+{
+	struct weston_deferred_work *work;
+	struct wl_list pending;
+	struct timespec start, now;
+	int64_t budget;
+
+	weston_compositor_read_presentation_clock(compositor, &start);
+	budget = deferred_work_budget_nsec(compositor, &start);
+	if (budget <= 0) {
+		/* The repaint timer runs it right after the repaint */
+		return;
+	}
+
+	wl_list_init(&pending);
+	wl_list_insert_list(&pending, &compositor->deferred_work_list);
+	wl_list_init(&compositor->deferred_work_list);
+
+	while (!wl_list_empty(&pending)) {
+		work = container_of(pending.next,
+				    struct weston_deferred_work, link);
+		wl_list_remove(&work->link);
+		work->queued = false;
+		work->run(work);
+
+		weston_compositor_read_presentation_clock(compositor, &now);
+		if (timespec_sub_to_nsec(&now, &start) >= budget)
+			break;
+	}
+
+	/* What did not fit goes ahead of what was queued meanwhile */
+	wl_list_insert_list(&compositor->deferred_work_list, &pending);
+
+	deferred_work_arm(compositor);
+}
+
+static int
+deferred_work_timer_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	deferred_work_run(compositor);
+
+	return 0;
+}
+
+/** Run work in the slack after the next repaint
+ *
+ * \param compositor The compositor.
+ * \param work The work to run, queued unless it already is.
+ *
+ * For housekeeping that has no deadline of its own: the work runs after
+ * the outputs due next have been repainted, or on the next turn of the
+ * event loop when no repaint is scheduled. Each slot runs work for a
+ * bounded time only, never past the next repaint deadline; the rest
+ * carries over. The work is taken off the queue before work->run is
+ * called, so it may queue itself again.
+ */
+WL_EXPORT void
+weston_compositor_defer_work(struct weston_compositor *compositor,
+			     struct weston_deferred_work *work)
+{
+	if (work->queued)
+		return;
+
+	wl_list_insert(compositor->deferred_work_list.prev, &work->link);
+	work->queued = true;
+
+	deferred_work_arm(compositor);
+}
+
+/** Take work off the deferred work queue, if it is on it
+ *
+ * \param work The work, which must be zero-initialized or have been
+ * queued with weston_compositor_defer_work() before.
+ */
+WL_EXPORT void
+weston_deferred_work_cancel(struct weston_deferred_work *work)
+{
+	if (!work->queued)
+		return;
+
+	wl_list_remove(&work->link);
+	work->queued = false;
+}
+
+/** Repaint every output whose repaint deadline has been reached
+ *
+ * All outputs due in this timer dispatch are repainted as one group,
+ * bracketed by the backend's repaint_begin and repaint_flush hooks, so
+ * the backend can submit their state to the hardware at once.
+ */
 static int
 output_repaint_timer_handler(void *data)
 {
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	int ret;
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+	struct timespec start, now;
+	void *repaint_data = NULL;
+	int ret = 0;
 
-	/* If we're sleeping, drop the repaint machinery entirely; we will
-	 * explicitly repaint all outputs when we come back. */
-	if (compositor->state == WESTON_COMPOSITOR_SLEEPING ||
-	    compositor->state == WESTON_COMPOSITOR_OFFSCREEN)
-		goto err;
+	if (compositor->backend->flush_input)
+		compositor->backend->flush_input(compositor);
 
-	/* We don't actually need to repaint this output; drop it from
-	 * repaint until something causes damage. */
-	if (!output->repaint_needed)
-		goto err;
+	weston_compositor_read_presentation_clock(compositor, &now);
+	start = now;
 
-	/* If repaint fails, we aren't going to get weston_output_finish_frame
-	 * to trigger a new repaint, so drop it from repaint and hope
-	 * something schedules a successful repaint later. */
-	ret = weston_output_repaint(output);
-	if (ret != 0)
-		goto err;
+	if (compositor->backend->repaint_begin)
+		repaint_data = compositor->backend->repaint_begin(compositor);
 
-	return 0;
+	wl_list_for_each(output, &compositor->output_list, link) {
+		ret = weston_output_maybe_repaint(output, &now, repaint_data);
+		if (ret)
+			break;
+	}
+
+	if (ret == 0) {
+		if (compositor->backend->repaint_flush)
+			compositor->backend->repaint_flush(compositor,
+							   repaint_data);
+	} else {
+		if (compositor->backend->repaint_cancel)
+			compositor->backend->repaint_cancel(compositor,
+							    repaint_data);
+	}
+
+	/* Every output in the group has to wait for the whole group to be
+	 * flushed, so that is the duration recorded for each of them. */
+	weston_compositor_read_presentation_clock(compositor, &now);
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!output->repaint_timing.pending)
+			continue;
+
+		output->repaint_timing.pending = false;
+		if (ret == 0) {
+			output_repaint_timing_add(output,
+				timespec_sub_to_nsec(&now, &start));
+			output_update_stats(output,
+				timespec_sub_to_nsec(&now, &start));
+		}
+	}
+
+	output_repaint_timer_arm(compositor);
+
+	/* The frames are posted, so this is as far from the next deadline
+	 * as the outputs get. */
+	if (!wl_list_empty(&compositor->deferred_work_list))
+		deferred_work_run(compositor);
 
-err:
-	weston_output_schedule_repaint_reset(output);
 	return 0;
 }
 
@@ -2376,47 +4527,115 @@ weston_output_finish_frame(struct weston_output *output,
 	struct weston_compositor *compositor = output->compositor;
 	int32_t refresh_nsec;
 	struct timespec now;
-	struct timespec gone;
-	int msec;
+	int64_t msec_rel;
+	bool first_frame = false;
 
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
 
+	assert(output->repaint_status == REPAINT_AWAITING_COMPLETION ||
+	       output->repaint_status == REPAINT_BEGIN_FROM_IDLE);
+
+	if (output->repaint_status == REPAINT_AWAITING_COMPLETION)
+		output_present_input(output, stamp);
+
+	/* Restarting the repaint loop from idle presents nothing */
+	if (!compositor->first_frame_presented &&
+	    output->repaint_status == REPAINT_AWAITING_COMPLETION) {
+		compositor->first_frame_presented = true;
+		first_frame = true;
+	}
+
+	/* With variable refresh there is no constant rate to report, for
+	 * which the protocol wants 0. */
 	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
 	weston_presentation_feedback_present_list(&output->feedback_list,
-						  output, refresh_nsec, stamp,
-						  output->msc,
+						  output,
+						  output->vrr_active ?
+						  0 : refresh_nsec,
+						  stamp, output->msc,
 						  presented_flags);
 
+	/* The frame is off the backend's hands, so a content rate switch
+	 * held back by output_switch_content_rate_mode() can happen now,
+	 * and the next repaint is timed by the new mode. */
+	if (output->content_rate.pending) {
+		output_apply_content_rate_mode(output);
+		refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	}
+
 	output->frame_time = stamp->tv_sec * 1000 + stamp->tv_nsec / 1000000;
+	timespec_add_nsec(&output->next_presentation, stamp, refresh_nsec);
 
 	weston_compositor_read_presentation_clock(compositor, &now);
-	timespec_sub(&gone, &now, stamp);
-	msec = (refresh_nsec - timespec_to_nsec(&gone)) / 1000000; /* floor */
-	msec -= compositor->repaint_msec;
-
-	if (msec < -1000 || msec > 1000) {
+	output->stats.finish_time = now;
+
+	timespec_add_nsec(&output->next_repaint, stamp,
+			  refresh_nsec -
+			  output_repaint_window_nsec(output, refresh_nsec));
+	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
+
+	/* With variable refresh the display waits for our next flip, so a
+	 * repaint restarted from idle does not have to line up with the
+	 * vblanks of the last frame: once the shortest frame period of
+	 * the mode has passed, repaint right away. A frame that is only
+	 * scanned out is cheap enough to repaint right away too, and still
+	 * make the next vblank. */
+	if ((output->vrr_active || output->scanout_view) &&
+	    presented_flags == WP_PRESENTATION_FEEDBACK_INVALID &&
+	    msec_rel < 0) {
+		output->next_repaint = now;
+		timespec_add_nsec(&output->next_presentation, &now,
+				  output_repaint_window_nsec(output,
+							     refresh_nsec));
+		msec_rel = 0;
+	}
+
+	if (msec_rel < -1000 || msec_rel > 1000) {
 		static bool warned;
 
 		if (!warned)
 			weston_log("Warning: computed repaint delay is "
-				   "insane: %d msec\n", msec);
+				   "insane: %lld msec\n", (long long) msec_rel);
 		warned = true;
 
-		msec = 0;
+		output->next_repaint = now;
 	}
 
 	/* Called from restart_repaint_loop and restart happens already after
 	 * the deadline given by repaint_msec? In that case we delay until
 	 * the deadline of the next frame, to give clients a more predictable
 	 * timing of the repaint cycle to lock on. */
-	if (presented_flags == WP_PRESENTATION_FEEDBACK_INVALID && msec < 0)
-		msec += refresh_nsec / 1000000;
+	if (presented_flags == WP_PRESENTATION_FEEDBACK_INVALID &&
+	    msec_rel < 0) {
+		while (timespec_sub_to_nsec(&output->next_repaint, &now) < 0) {
+			timespec_add_nsec(&output->next_repaint,
+					  &output->next_repaint,
+					  refresh_nsec);
+			timespec_add_nsec(&output->next_presentation,
+					  &output->next_presentation,
+					  refresh_nsec);
+		}
+	}
 
-	if (msec < 1)
-		output_repaint_timer_handler(output);
-	else
-		wl_event_source_timer_update(output->repaint_timer, msec);
+	weston_log_scope_printf(compositor->repaint_scope,
+				WESTON_LOG_LEVEL_DEBUG,
+				"output %s: frame presented at %" PRId64
+				".%09ld, next repaint in %" PRId64 " ms\n",
+				output->name, (int64_t) stamp->tv_sec,
+				stamp->tv_nsec,
+				timespec_sub_to_msec(&output->next_repaint,
+						     &now));
+
+	output->repaint_status = REPAINT_SCHEDULED;
+	output_repaint_timer_arm(compositor);
+
+	wl_signal_emit(&output->repaint_scheduled_signal, output);
+
+	if (first_frame) {
+		weston_startup_finish(output);
+		wl_signal_emit(&compositor->first_frame_signal, output);
+	}
 }
 
 static void
@@ -2424,23 +4643,47 @@ idle_repaint(void *data)
 {
 	struct weston_output *output = data;
 
+	assert(output->repaint_status == REPAINT_BEGIN_FROM_IDLE);
 	output->start_repaint_loop(output);
 }
 
+/* Views changing layers leave the old layer's offset for the new one's */
+static void
+layer_entry_update_offset(struct weston_layer_entry *entry)
+{
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+	int32_t x, y;
+
+	weston_view_get_layer_offset(view, &x, &y);
+	if (x != view->transform.offset_x || y != view->transform.offset_y)
+		weston_view_offset_dirty(view);
+}
+
 WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+
+	if (entry->layer)
+		entry->layer->compositor->view_list_needs_rebuild = true;
+
+	layer_entry_update_offset(entry);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		entry->layer->compositor->view_list_needs_rebuild = true;
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
+
+	layer_entry_update_offset(entry);
 }
 
 
@@ -2457,6 +4700,8 @@ weston_layer_init(struct weston_layer *layer,
 	wl_list_init(&layer->link);
 	wl_list_init(&layer->view_list.link);
 	layer->view_list.layer = layer;
+	layer->offset_x = 0;
+	layer->offset_y = 0;
 	weston_layer_set_mask_infinite(layer);
 }
 
@@ -2474,6 +4719,8 @@ weston_layer_set_position(struct weston_layer *layer,
 {
 	struct weston_layer *below;
 
+	layer->compositor->view_list_needs_rebuild = true;
+
 	wl_list_remove(&layer->link);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
@@ -2497,6 +4744,8 @@ weston_layer_set_position(struct weston_layer *layer,
 WL_EXPORT void
 weston_layer_unset_position(struct weston_layer *layer)
 {
+	layer->compositor->view_list_needs_rebuild = true;
+
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
 }
@@ -2524,6 +4773,33 @@ weston_layer_set_mask_infinite(struct weston_layer *layer)
 				     UINT32_MAX, UINT32_MAX);
 }
 
+/** Move all views of a layer
+ *
+ * \param layer The layer to move.
+ * \param x The horizontal offset, in global coordinates.
+ * \param y The vertical offset, in global coordinates.
+ *
+ * Meant for animating whole layers, like sliding workspaces. The offset
+ * applies on top of the transformations of each view in the layer, and
+ * of their transform children, without touching their transformation
+ * lists. Views whose only change is a new offset are moved by
+ * translating their current transform instead of computing it again.
+ */
+WL_EXPORT void
+weston_layer_set_offset(struct weston_layer *layer, int32_t x, int32_t y)
+{
+	struct weston_view *view;
+
+	if (layer->offset_x == x && layer->offset_y == y)
+		return;
+
+	layer->offset_x = x;
+	layer->offset_y = y;
+
+	wl_list_for_each(view, &layer->view_list.link, layer_link.link)
+		weston_view_offset_dirty(view);
+}
+
 WL_EXPORT void
 weston_output_schedule_repaint(struct weston_output *output)
 {
@@ -2539,11 +4815,16 @@ weston_output_schedule_repaint(struct weston_output *output)
 
 	loop = wl_display_get_event_loop(compositor->wl_display);
 	output->repaint_needed = 1;
-	if (output->repaint_scheduled)
+
+	/* If we already have a repaint scheduled for our idle handler,
+	 * no need to set it again. If the repaint has been called but
+	 * not finished, then weston_output_finish_frame() will notice
+	 * that a repaint is needed and schedule one. */
+	if (output->repaint_status != REPAINT_NOT_SCHEDULED)
 		return;
 
+	output->repaint_status = REPAINT_BEGIN_FROM_IDLE;
 	wl_event_loop_add_idle(loop, idle_repaint, output);
-	output->repaint_scheduled = 1;
 	TL_POINT("core_repaint_enter_loop", TLP_OUTPUT(output), TLP_END);
 }
 
@@ -2623,7 +4904,7 @@ destroy_frame_callback(struct wl_resource *resource)
 	struct weston_frame_callback *cb = wl_resource_get_user_data(resource);
 
 	wl_list_remove(&cb->link);
-	free(cb);
+	weston_pool_free(&frame_callback_pool, cb);
 }
 
 static void
@@ -2633,7 +4914,7 @@ surface_frame(struct wl_client *client,
 	struct weston_frame_callback *cb;
 	struct weston_surface *surface = wl_resource_get_user_data(resource);
 
-	cb = malloc(sizeof *cb);
+	cb = weston_pool_alloc(&frame_callback_pool);
 	if (cb == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
@@ -2642,7 +4923,7 @@ surface_frame(struct wl_client *client,
 	cb->resource = wl_resource_create(client, &wl_callback_interface, 1,
 					  callback);
 	if (cb->resource == NULL) {
-		free(cb);
+		weston_pool_free(&frame_callback_pool, cb);
 		wl_resource_post_no_memory(resource);
 		return;
 	}
@@ -2668,6 +4949,8 @@ surface_set_opaque_region(struct wl_client *client,
 	} else {
 		pixman_region32_clear(&surface->pending.opaque);
 	}
+
+	surface->pending.regions_changed = true;
 }
 
 static void
@@ -2686,6 +4969,8 @@ surface_set_input_region(struct wl_client *client,
 		pixman_region32_fini(&surface->pending.input);
 		region_init_infinite(&surface->pending.input);
 	}
+
+	surface->pending.regions_changed = true;
 }
 
 /* Cause damage to this sub-surface and all its children.
@@ -2706,18 +4991,51 @@ weston_surface_damage_subsurfaces(struct weston_subsurface *sub)
 			weston_surface_damage_subsurfaces(child);
 }
 
+struct weston_subsurface_tree_entry {
+	struct weston_subsurface *sub;
+	/* Index just past the entries of the sub-surface's sub-tree */
+	int end;
+};
+
+/* Unlike weston_surface_get_main_surface(), this also finds the root of
+ * a tree whose parent went away. */
+static struct weston_surface *
+subsurface_tree_root(struct weston_surface *surface)
+{
+	struct weston_subsurface *sub;
+
+	while ((sub = weston_surface_to_subsurface(surface)) && sub->parent)
+		surface = sub->parent;
+
+	return surface;
+}
+
+static void
+weston_surface_invalidate_subsurface_tree(struct weston_surface *surface)
+{
+	subsurface_tree_root(surface)->subsurface_tree_dirty = true;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
+	bool reordered = false;
 
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
-		if (sub->reordered)
+		if (sub->reordered) {
+			reordered = true;
 			weston_surface_damage_subsurfaces(sub);
+		}
+	}
+
+	if (reordered) {
+		surface->compositor->view_list_needs_rebuild = true;
+		weston_surface_invalidate_subsurface_tree(surface);
 	}
 }
 
@@ -2885,11 +5203,13 @@ weston_surface_is_pending_viewport_dst_size_int(
 }
 
 /* Translate pending damage in buffer co-ordinates to surface
- * co-ordinates and union it with a pixman_region32_t.
+ * co-ordinates and union it with a pixman_region32_t. If buffer_dest
+ * is given, the clipped damage is also unioned into it unconverted.
  * This should only be called after the buffer is attached.
  */
 static void
 apply_damage_buffer(pixman_region32_t *dest,
+		    pixman_region32_t *buffer_dest,
 		    struct weston_surface *surface,
 		    struct weston_surface_state *state)
 {
@@ -2907,23 +5227,500 @@ apply_damage_buffer(pixman_region32_t *dest,
 					       &state->damage_buffer,
 					       0, 0, buffer->width,
 					       buffer->height);
-		pixman_region32_init(&buffer_damage);
-		weston_matrix_transform_region(&buffer_damage,
-					       &surface->buffer_to_surface_matrix,
-					       &state->damage_buffer);
-		pixman_region32_union(dest, dest, &buffer_damage);
-		pixman_region32_fini(&buffer_damage);
+		if (buffer_dest)
+			pixman_region32_union(buffer_dest, buffer_dest,
+					      &state->damage_buffer);
+
+		if (weston_surface_buffer_is_identity(surface)) {
+			pixman_region32_union(dest, dest,
+					      &state->damage_buffer);
+		} else {
+			pixman_region32_init(&buffer_damage);
+			weston_matrix_transform_region(&buffer_damage,
+						       &surface->buffer_to_surface_matrix,
+						       &state->damage_buffer);
+			pixman_region32_union(dest, dest, &buffer_damage);
+			pixman_region32_fini(&buffer_damage);
+		}
 	}
 	/* We should clear this on commit even if there was no buffer */
 	pixman_region32_clear(&state->damage_buffer);
 }
 
+/* A new sample moves the commit statistics averages by 1/n of the way */
+#define COMMIT_STATS_EWMA_WEIGHT 8
+/* Longest commit interval taken into account, so that a surface which
+ * was idle for a long time quickly recovers once it updates again. */
+#define COMMIT_STATS_MAX_INTERVAL_NSEC 1000000000LL
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+static uint32_t
+weston_buffer_bytes_per_pixel(struct weston_buffer *buffer)
+{
+	struct wl_shm_buffer *shm;
+
+	shm = buffer ? wl_shm_buffer_get(buffer->resource) : NULL;
+	if (shm && wl_shm_buffer_get_format(shm) == WL_SHM_FORMAT_RGB565)
+		return 2;
+
+	/* Everything else we get is 32 bits per pixel, near enough. */
+	return 4;
+}
+
+/** Note that input was sent to the client of a surface
+ *
+ * \param surface The surface with the focus the input went to.
+ * \param time When the input event happened, in the presentation clock
+ * domain.
+ *
+ * The next content update of any surface of the client is taken as its
+ * answer, and the frame showing it reports the input latency in
+ * weston_output_stats.
+ *
+ * \memberof weston_surface
+ */
+void
+weston_surface_note_input(struct weston_surface *surface,
+			  const struct timespec *time)
+{
+	struct weston_client_accounting *accounting =
+		surface->client_accounting;
+
+	if (!accounting || accounting->input_pending)
+		return;
+
+	accounting->input_pending = true;
+	accounting->input_time = *time;
+}
+
+/* A content update answers the oldest input sent to the client before;
+ * the surface keeps the oldest one until it is shown. */
+static void
+surface_tag_input(struct weston_surface *surface, const struct timespec *now)
+{
+	struct weston_client_accounting *accounting =
+		surface->client_accounting;
+
+	if (!accounting || !accounting->input_pending)
+		return;
+
+	accounting->input_pending = false;
+
+	TL_POINT("core_commit_input", TLP_SURFACE(surface),
+		 TLP_INPUT(&accounting->input_time), TLP_END);
+
+	if (surface->input_pending)
+		return;
+
+	surface->input_pending = true;
+	surface->input_time = accounting->input_time;
+	surface->input_commit_time = *now;
+}
+
+static void
+weston_surface_update_commit_stats(struct weston_surface *surface,
+				   struct weston_surface_state *state,
+				   bool newly_attached)
+{
+	struct weston_surface_commit_stats *stats = &surface->commit_stats;
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	int32_t scale = surface->buffer_viewport.buffer.scale;
+	struct timespec now, *last;
+	uint64_t pixels, bytes;
+	int64_t interval;
+
+	if (!newly_attached &&
+	    !pixman_region32_not_empty(&state->damage_surface) &&
+	    !pixman_region32_not_empty(&state->damage_buffer))
+		return;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+	surface_tag_input(surface, &now);
+
+	pixels = region_area(&state->damage_surface) * scale * scale +
+		 region_area(&state->damage_buffer);
+	if (buffer && pixels > (uint64_t) buffer->width * buffer->height)
+		pixels = (uint64_t) buffer->width * buffer->height;
+	bytes = pixels * weston_buffer_bytes_per_pixel(buffer);
+
+	last = &stats->history[(stats->history_next +
+				WESTON_SURFACE_COMMIT_HISTORY - 1) %
+			       WESTON_SURFACE_COMMIT_HISTORY];
+
+	if (stats->count == 0) {
+		stats->damage_bytes = bytes;
+	} else {
+		interval = timespec_sub_to_nsec(&now, last);
+		if (interval > COMMIT_STATS_MAX_INTERVAL_NSEC)
+			interval = COMMIT_STATS_MAX_INTERVAL_NSEC;
+
+		if (stats->count == 1)
+			stats->interval_nsec = interval;
+		else
+			stats->interval_nsec += (interval - stats->interval_nsec) /
+						COMMIT_STATS_EWMA_WEIGHT;
+
+		stats->damage_bytes += ((int64_t) bytes -
+					(int64_t) stats->damage_bytes) /
+				       COMMIT_STATS_EWMA_WEIGHT;
+	}
+
+	stats->history[stats->history_next] = now;
+	stats->history_next = (stats->history_next + 1) %
+			      WESTON_SURFACE_COMMIT_HISTORY;
+	stats->count++;
+}
+
+/** Limit how often a surface gets frame callbacks
+ *
+ * \param surface The surface to limit.
+ * \param rate The maximum frame callback rate in Hz, 0 for no limit.
+ * \param unfocused_rate The maximum rate while no seat's keyboard focus
+ * is on a surface of the same client, 0 for no limit besides rate.
+ *
+ * Clients drawing from frame callbacks, which is nearly all of them, then
+ * draw no more often than that. The lowest of these, the occluded and the
+ * idle frame rates applies. Presentation feedback is not affected.
+ *
+ * \memberof weston_surface
+ */
+WL_EXPORT void
+weston_surface_set_frame_rate_cap(struct weston_surface *surface,
+				  int32_t rate, int32_t unfocused_rate)
+{
+	surface->frame_rate_cap = rate;
+	surface->unfocused_frame_rate_cap = unfocused_rate;
+}
+
+/** Get the content update statistics of a surface
+ *
+ * \param surface The surface to query.
+ * \return The statistics, owned by the surface.
+ *
+ * The statistics only account for commits which attach a buffer or post
+ * damage, i.e. which change what the surface looks like.
+ *
+ * \memberof weston_surface
+ */
+WL_EXPORT const struct weston_surface_commit_stats *
+weston_surface_get_commit_stats(struct weston_surface *surface)
+{
+	return &surface->commit_stats;
+}
+
+/** Estimate how often a surface currently updates its content
+ *
+ * \param surface The surface to query.
+ * \param now The current time in the presentation clock domain.
+ * \return The update rate in mHz, or 0 if not known.
+ *
+ * This is based on the moving average of the commit interval, but a
+ * surface which has not committed for longer than that interval is
+ * reported at the rate implied by the time since its last commit, so
+ * that the rate decays as soon as a client stops updating.
+ *
+ * \memberof weston_surface
+ */
+WL_EXPORT uint32_t
+weston_surface_get_commit_rate(struct weston_surface *surface,
+			       const struct timespec *now)
+{
+	const struct weston_surface_commit_stats *stats = &surface->commit_stats;
+	const struct timespec *last;
+	int64_t interval, idle;
+
+	if (stats->count < 2 || stats->interval_nsec <= 0)
+		return 0;
+
+	last = &stats->history[(stats->history_next +
+				WESTON_SURFACE_COMMIT_HISTORY - 1) %
+			       WESTON_SURFACE_COMMIT_HISTORY];
+
+	interval = stats->interval_nsec;
+	idle = timespec_sub_to_nsec(now, last);
+	if (idle > interval)
+		interval = idle;
+
+	return (uint32_t) (1000000000000LL / interval);
+}
+
+/** Report the resources and costs of each client
+ *
+ * \param compositor The compositor.
+ * \param func Called with the statistics of each client which created
+ * a surface, in the order they first did.
+ * \param data Passed to func.
+ *
+ * The statistics only live as long as the call, and func must not
+ * create or destroy surfaces.
+ *
+ * \memberof weston_compositor
+ */
+WL_EXPORT void
+weston_compositor_for_each_client_stats(struct weston_compositor *compositor,
+					weston_client_stats_func_t func,
+					void *data)
+{
+	struct weston_renderer *renderer = compositor->renderer;
+	struct weston_client_accounting *accounting;
+	struct weston_client_stats stats;
+	struct weston_surface *surface;
+	struct weston_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+
+	wl_list_for_each(accounting, &compositor->client_accounting_list,
+			 link) {
+		stats = accounting->totals;
+
+		wl_list_for_each(surface, &accounting->surface_list,
+				 client_accounting_link) {
+			stats.surfaces++;
+			stats.views += wl_list_length(&surface->views);
+
+			buffer = surface->buffer_ref.buffer;
+			shm_buffer = buffer ?
+				wl_shm_buffer_get(buffer->resource) : NULL;
+			if (shm_buffer)
+				stats.shm_bytes += (uint64_t)
+					wl_shm_buffer_get_stride(shm_buffer) *
+					wl_shm_buffer_get_height(shm_buffer);
+
+			if (renderer->surface_memory_bytes)
+				stats.texture_bytes +=
+					renderer->surface_memory_bytes(surface);
+		}
+
+		func(&stats, data);
+	}
+}
+
+/* Four independent multiply-xor lanes over 8 byte words, so that the
+ * CPU can run them in parallel. Never returns 0, which means unknown. */
+static uint64_t
+damage_hash_tile(const uint8_t *data, int32_t stride, int32_t bytes,
+		 int32_t rows)
+{
+	const uint64_t prime = 0x100000001b3ull;
+	uint64_t lane[4] = {
+		0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full,
+		0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull
+	};
+	uint64_t word[4], hash;
+	int32_t x, y, i;
+
+	for (y = 0; y < rows; y++, data += stride) {
+		for (x = 0; x + (int32_t) sizeof word <= bytes;
+		     x += sizeof word) {
+			memcpy(word, data + x, sizeof word);
+			for (i = 0; i < 4; i++) {
+				lane[i] = (lane[i] ^ word[i]) * prime;
+				lane[i] ^= lane[i] >> 29;
+			}
+		}
+		for (; x < bytes; x++)
+			lane[0] = (lane[0] ^ data[x]) * prime;
+	}
+
+	hash = lane[0];
+	for (i = 1; i < 4; i++) {
+		hash = (hash ^ lane[i]) * prime;
+		hash ^= hash >> 32;
+	}
+
+	return hash | 1;
+}
+
+static int32_t
+damage_hash_shm_bpp(uint32_t format)
+{
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+	case WL_SHM_FORMAT_ABGR8888:
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_ARGB2101010:
+	case WL_SHM_FORMAT_XRGB2101010:
+	case WL_SHM_FORMAT_ABGR2101010:
+	case WL_SHM_FORMAT_XBGR2101010:
+		return 4;
+	case WL_SHM_FORMAT_RGB565:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static bool
+surface_damage_hash_prepare(struct weston_surface *surface,
+			    struct wl_shm_buffer *shm)
+{
+	int32_t width = wl_shm_buffer_get_width(shm);
+	int32_t height = wl_shm_buffer_get_height(shm);
+	int32_t stride = wl_shm_buffer_get_stride(shm);
+	uint32_t format = wl_shm_buffer_get_format(shm);
+	size_t n;
+
+	if (surface->damage_hash.flushed &&
+	    surface->damage_hash.width == width &&
+	    surface->damage_hash.height == height &&
+	    surface->damage_hash.stride == stride &&
+	    surface->damage_hash.format == format)
+		return true;
+
+	surface_damage_hash_reset(surface);
+
+	surface->damage_hash.width = width;
+	surface->damage_hash.height = height;
+	surface->damage_hash.stride = stride;
+	surface->damage_hash.format = format;
+	surface->damage_hash.tiles_x =
+		(width + DAMAGE_HASH_TILE - 1) / DAMAGE_HASH_TILE;
+	surface->damage_hash.tiles_y =
+		(height + DAMAGE_HASH_TILE - 1) / DAMAGE_HASH_TILE;
+
+	n = (size_t) surface->damage_hash.tiles_x *
+	    surface->damage_hash.tiles_y;
+	surface->damage_hash.flushed = calloc(n, sizeof(uint64_t));
+	surface->damage_hash.pending = calloc(n, sizeof(uint64_t));
+	if (!surface->damage_hash.flushed || !surface->damage_hash.pending) {
+		surface_damage_hash_reset(surface);
+		return false;
+	}
+
+	return true;
+}
+
+/* Clients that damage the whole surface on every commit, whether or not
+ * anything changed, make the renderers upload and repaint all of it.
+ * Hash the damaged tiles of wl_shm buffers, and drop those whose content
+ * is still what the renderer was last flushed from the damage of the
+ * commit. A commit that cannot be hashed forgets the hashes, as the
+ * renderer gets content they do not describe. */
+static void
+surface_drop_unchanged_damage(struct weston_surface *surface,
+			      struct weston_surface_state *state,
+			      bool viewport_changed)
+{
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+	struct wl_shm_buffer *shm = NULL;
+	pixman_region32_t damage, unchanged, surface_unchanged;
+	pixman_box32_t *extents, box;
+	const uint8_t *data;
+	int32_t bpp = 0, tx, ty, i;
+	uint64_t hash;
+
+	if (!surface->compositor->damage_hash)
+		return;
+
+	if (buffer)
+		shm = wl_shm_buffer_get(buffer->resource);
+	if (shm)
+		bpp = damage_hash_shm_bpp(wl_shm_buffer_get_format(shm));
+
+	/* Tiles must map to whole surface pixels */
+	if (!shm || bpp == 0 || viewport_changed ||
+	    vp->buffer.src_width != wl_fixed_from_int(-1) ||
+	    vp->surface.width != -1 ||
+	    DAMAGE_HASH_TILE % vp->buffer.scale != 0 ||
+	    !surface_damage_hash_prepare(surface, shm)) {
+		if (surface->damage_hash.flushed)
+			surface_damage_hash_reset(surface);
+		return;
+	}
+
+	if (!pixman_region32_not_empty(&state->damage_surface) &&
+	    !pixman_region32_not_empty(&state->damage_buffer))
+		return;
+
+	pixman_region32_init(&damage);
+	weston_surface_to_buffer_region(surface, &state->damage_surface,
+					&damage);
+	pixman_region32_union(&damage, &damage, &state->damage_buffer);
+	pixman_region32_intersect_rect(&damage, &damage, 0, 0,
+				       surface->damage_hash.width,
+				       surface->damage_hash.height);
+
+	pixman_region32_init(&unchanged);
+	extents = pixman_region32_extents(&damage);
+
+	wl_shm_buffer_begin_access(shm);
+	data = wl_shm_buffer_get_data(shm);
+	for (ty = extents->y1 / DAMAGE_HASH_TILE;
+	     ty * DAMAGE_HASH_TILE < extents->y2; ty++) {
+		for (tx = extents->x1 / DAMAGE_HASH_TILE;
+		     tx * DAMAGE_HASH_TILE < extents->x2; tx++) {
+			box.x1 = tx * DAMAGE_HASH_TILE;
+			box.y1 = ty * DAMAGE_HASH_TILE;
+			box.x2 = MIN(box.x1 + DAMAGE_HASH_TILE,
+				     surface->damage_hash.width);
+			box.y2 = MIN(box.y1 + DAMAGE_HASH_TILE,
+				     surface->damage_hash.height);
+			if (pixman_region32_contains_rectangle(&damage, &box) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			hash = damage_hash_tile(data +
+						box.y1 * surface->damage_hash.stride +
+						box.x1 * bpp,
+						surface->damage_hash.stride,
+						(box.x2 - box.x1) * bpp,
+						box.y2 - box.y1);
+
+			i = ty * surface->damage_hash.tiles_x + tx;
+			surface->damage_hash.pending[i] = hash;
+			if (surface->damage_hash.flushed[i] == hash)
+				pixman_region32_union_rect(&unchanged,
+							   &unchanged,
+							   box.x1, box.y1,
+							   box.x2 - box.x1,
+							   box.y2 - box.y1);
+		}
+	}
+	wl_shm_buffer_end_access(shm);
+	surface->damage_hash.has_pending = true;
+
+	if (pixman_region32_not_empty(&unchanged)) {
+		pixman_region32_subtract(&state->damage_buffer,
+					 &state->damage_buffer, &unchanged);
+
+		pixman_region32_init(&surface_unchanged);
+		weston_matrix_transform_region(&surface_unchanged,
+					       &surface->buffer_to_surface_matrix,
+					       &unchanged);
+		pixman_region32_subtract(&state->damage_surface,
+					 &state->damage_surface,
+					 &surface_unchanged);
+		pixman_region32_fini(&surface_unchanged);
+	}
+
+	pixman_region32_fini(&unchanged);
+	pixman_region32_fini(&damage);
+}
+
 static void
 weston_surface_commit_state(struct weston_surface *surface,
 			    struct weston_surface_state *state)
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t input;
+	bool newly_attached = state->newly_attached;
+	bool viewport_changed = state->buffer_viewport.changed;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -2931,6 +5728,21 @@ weston_surface_commit_state(struct weston_surface *surface,
 	/* wp_viewport.set_destination */
 	surface->buffer_viewport = state->buffer_viewport;
 
+	/* zwp_surface_synchronization_v1.set_acquire_fence */
+	/* zwp_surface_synchronization_v1.get_release */
+	if (state->newly_attached) {
+		if (surface->acquire_fence_fd >= 0)
+			close(surface->acquire_fence_fd);
+		surface->acquire_fence_fd = state->acquire_fence_fd;
+		state->acquire_fence_fd = -1;
+
+		weston_buffer_release_move(&surface->buffer_release_ref,
+					   &state->buffer_release_ref);
+	}
+
+	/* weston_tearing_control.set_presentation_hint */
+	surface->allow_tearing = state->allow_tearing;
+
 	/* wl_surface.attach */
 	if (state->newly_attached)
 		weston_surface_attach(surface, state->buffer);
@@ -2953,18 +5765,48 @@ weston_surface_commit_state(struct weston_surface *surface,
 	state->buffer_viewport.changed = 0;
 
 	/* wl_surface.damage and wl_surface.damage_buffer */
+	weston_surface_update_commit_stats(surface, state, newly_attached);
+	surface_drop_unchanged_damage(surface, state, viewport_changed);
+
 	if (weston_timeline_enabled_ &&
 	    (pixman_region32_not_empty(&state->damage_surface) ||
 	     pixman_region32_not_empty(&state->damage_buffer)))
 		TL_POINT("core_commit_damage", TLP_SURFACE(surface), TLP_END);
 
-	pixman_region32_union(&surface->damage, &surface->damage,
-			      &state->damage_surface);
+	if (pixman_region32_not_empty(&state->damage_surface)) {
+		pixman_region32_t buffer_damage;
+
+		pixman_region32_init(&buffer_damage);
+		weston_surface_to_buffer_region(surface, &state->damage_surface,
+						&buffer_damage);
+		pixman_region32_union(&surface->buffer_damage,
+				      &surface->buffer_damage, &buffer_damage);
+		pixman_region32_fini(&buffer_damage);
+	}
+
+	if (pixman_region32_not_empty(&surface->damage))
+		pixman_region32_union(&surface->damage, &surface->damage,
+				      &state->damage_surface);
+	else
+		region_swap(&surface->damage, &state->damage_surface);
 
-	apply_damage_buffer(&surface->damage, surface, state);
+	apply_damage_buffer(&surface->damage, &surface->buffer_damage,
+			    surface, state);
 
 	pixman_region32_intersect_rect(&surface->damage, &surface->damage,
 				       0, 0, surface->width, surface->height);
+	if (surface->buffer_ref.buffer)
+		pixman_region32_intersect_rect(&surface->buffer_damage,
+					       &surface->buffer_damage, 0, 0,
+					       surface->buffer_ref.buffer->width,
+					       surface->buffer_ref.buffer->height);
+
+	weston_region_simplify(&surface->damage,
+			       surface->compositor->damage_merge_overdraw,
+			       surface->compositor->damage_max_rects);
+	weston_region_simplify(&surface->buffer_damage,
+			       surface->compositor->damage_merge_overdraw,
+			       surface->compositor->damage_max_rects);
 	pixman_region32_clear(&state->damage_surface);
 
 	/* wl_surface.set_opaque_region */
@@ -2981,9 +5823,17 @@ weston_surface_commit_state(struct weston_surface *surface,
 	pixman_region32_fini(&opaque);
 
 	/* wl_surface.set_input_region */
-	pixman_region32_intersect_rect(&surface->input, &state->input,
+	pixman_region32_init(&input);
+	pixman_region32_intersect_rect(&input, &state->input,
 				       0, 0, surface->width, surface->height);
 
+	if (!pixman_region32_equal(&input, &surface->input)) {
+		pixman_region32_copy(&surface->input, &input);
+		surface->compositor->scene_serial++;
+	}
+
+	pixman_region32_fini(&input);
+
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
 			    &state->frame_callback_list);
@@ -3002,22 +5852,106 @@ weston_surface_commit_state(struct weston_surface *surface,
 	wl_signal_emit(&surface->commit_signal, surface);
 }
 
+/* With low_latency_scanout, pull the repaint of outputs scanning out the
+ * surface forward to now, so the new buffer is flipped to as early as
+ * possible rather than at the repaint deadline. */
+static void
+weston_surface_expedite_scanout(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct weston_output *output;
+	struct timespec now;
+	bool expedited = false;
+
+	if (!ec->low_latency_scanout)
+		return;
+
+	weston_compositor_read_presentation_clock(ec, &now);
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		if (!output->scanout_view ||
+		    output->scanout_view->surface != surface ||
+		    output->repaint_status != REPAINT_SCHEDULED)
+			continue;
+
+		if (timespec_sub_to_nsec(&output->next_repaint, &now) > 0) {
+			output->next_repaint = now;
+			expedited = true;
+		}
+	}
+
+	if (expedited)
+		output_repaint_timer_arm(ec);
+}
+
+static int
+surface_repaint_defer_timeout(void *data)
+{
+	struct weston_surface *surface = data;
+
+	surface->repaint_defer_armed = false;
+	weston_surface_schedule_repaint(surface);
+
+	return 0;
+}
+
+/* Leave the commit to the next repaint, whatever causes it, and make
+ * sure one happens within resize_sync_timeout of the first commit held
+ * back, so a client that never catches up still gets shown. */
+static int
+weston_surface_hold_repaint(struct weston_surface *surface)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct wl_event_loop *loop;
+
+	if (surface->repaint_defer_armed)
+		return 0;
+
+	if (!surface->repaint_defer_timer) {
+		loop = wl_display_get_event_loop(compositor->wl_display);
+		surface->repaint_defer_timer =
+			wl_event_loop_add_timer(loop,
+						surface_repaint_defer_timeout,
+						surface);
+		if (!surface->repaint_defer_timer)
+			return -1;
+	}
+
+	wl_event_source_timer_update(surface->repaint_defer_timer,
+				     compositor->resize_sync_timeout);
+	surface->repaint_defer_armed = true;
+
+	return 0;
+}
+
 static void
 weston_surface_commit(struct weston_surface *surface)
 {
+	WESTON_PROBE(surface_commit, surface);
+
 	weston_surface_commit_state(surface, &surface->pending);
 
 	weston_surface_commit_subsurface_order(surface);
 
+	if (surface->repaint_deferred) {
+		surface->repaint_deferred = false;
+		if (weston_surface_hold_repaint(surface) == 0)
+			return;
+	} else if (surface->repaint_defer_armed) {
+		surface->repaint_defer_armed = false;
+		wl_event_source_timer_update(surface->repaint_defer_timer, 0);
+	}
+
 	weston_surface_schedule_repaint(surface);
+	weston_surface_expedite_scanout(surface);
 }
 
 static void
 weston_subsurface_commit(struct weston_subsurface *sub);
 
 static void
-weston_subsurface_parent_commit(struct weston_subsurface *sub,
-				int parent_is_synchronized);
+weston_surface_commit_subsurfaces(struct weston_surface *surface,
+				  int parent_is_synchronized);
 
 static void
 surface_commit(struct wl_client *client, struct wl_resource *resource)
@@ -3045,17 +5979,40 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 		return;
 	}
 
+	if (surface->pending.acquire_fence_fd >= 0 ||
+	    surface->pending.buffer_release_ref.buffer_release) {
+		assert(surface->synchronization_resource);
+
+		if (!surface->pending.newly_attached ||
+		    !surface->pending.buffer) {
+			wl_resource_post_error(surface->synchronization_resource,
+				ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_NO_BUFFER,
+				"wl_surface@%u no buffer for synchronization",
+				wl_resource_get_id(resource));
+			return;
+		}
+
+		/* Only dmabufs are guaranteed to be read by the GPU or
+		 * KMS, which are what can wait on and signal fences */
+		if (!linux_dmabuf_buffer_get(surface->pending.buffer->resource)) {
+			wl_resource_post_error(surface->synchronization_resource,
+				ZWP_LINUX_SURFACE_SYNCHRONIZATION_V1_ERROR_UNSUPPORTED_BUFFER,
+				"wl_surface@%u unsupported buffer for synchronization",
+				wl_resource_get_id(resource));
+			return;
+		}
+	}
+
+	if (surface->client_accounting)
+		surface->client_accounting->totals.commits++;
+
 	if (sub) {
 		weston_subsurface_commit(sub);
 		return;
 	}
 
 	weston_surface_commit(surface);
-
-	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
-		if (sub->surface != surface)
-			weston_subsurface_parent_commit(sub, 0);
-	}
+	weston_surface_commit_subsurfaces(surface, 0);
 }
 
 static void
@@ -3134,6 +6091,8 @@ compositor_create_surface(struct wl_client *client,
 	wl_resource_set_implementation(surface->resource, &surface_interface,
 				       surface, destroy_surface);
 
+	surface_attach_accounting(surface, client);
+
 	wl_signal_emit(&ec->create_surface_signal, surface);
 }
 
@@ -3236,12 +6195,20 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 	 * translated to correspond to the new surface coordinate system
 	 * origin.
 	 */
-	pixman_region32_translate(&sub->cached.damage_surface,
-				  -surface->pending.sx, -surface->pending.sy);
-	pixman_region32_union(&sub->cached.damage_surface,
-			      &sub->cached.damage_surface,
-			      &surface->pending.damage_surface);
-	pixman_region32_clear(&surface->pending.damage_surface);
+	if (pixman_region32_not_empty(&sub->cached.damage_surface)) {
+		pixman_region32_translate(&sub->cached.damage_surface,
+					  -surface->pending.sx,
+					  -surface->pending.sy);
+		pixman_region32_union(&sub->cached.damage_surface,
+				      &sub->cached.damage_surface,
+				      &surface->pending.damage_surface);
+		pixman_region32_clear(&surface->pending.damage_surface);
+	} else {
+		/* Nothing to merge with, so hand the pending damage over
+		 * and keep the empty region for the next one. */
+		region_swap(&sub->cached.damage_surface,
+			    &surface->pending.damage_surface);
+	}
 
 	if (surface->pending.newly_attached) {
 		sub->cached.newly_attached = 1;
@@ -3251,11 +6218,23 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 					surface->pending.buffer);
 		weston_presentation_feedback_discard_list(
 					&sub->cached.feedback_list);
+
+		/* A cached buffer that never gets shown has no use for
+		 * its fence, and its release goes out right away */
+		if (sub->cached.acquire_fence_fd >= 0)
+			close(sub->cached.acquire_fence_fd);
+		sub->cached.acquire_fence_fd =
+			surface->pending.acquire_fence_fd;
+		surface->pending.acquire_fence_fd = -1;
+
+		weston_buffer_release_move(&sub->cached.buffer_release_ref,
+					   &surface->pending.buffer_release_ref);
 	}
 	sub->cached.sx += surface->pending.sx;
 	sub->cached.sy += surface->pending.sy;
 
-	apply_damage_buffer(&sub->cached.damage_surface, surface, &surface->pending);
+	apply_damage_buffer(&sub->cached.damage_surface, NULL,
+			    surface, &surface->pending);
 
 	sub->cached.buffer_viewport.changed |=
 		surface->pending.buffer_viewport.changed;
@@ -3264,11 +6243,18 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 	sub->cached.buffer_viewport.surface =
 		surface->pending.buffer_viewport.surface;
 
-	weston_surface_reset_pending_buffer(surface);
+	sub->cached.allow_tearing = surface->pending.allow_tearing;
 
-	pixman_region32_copy(&sub->cached.opaque, &surface->pending.opaque);
+	weston_surface_reset_pending_buffer(surface);
 
-	pixman_region32_copy(&sub->cached.input, &surface->pending.input);
+	/* Unlike the damage, the regions stay pending for later commits */
+	if (surface->pending.regions_changed) {
+		pixman_region32_copy(&sub->cached.opaque,
+				     &surface->pending.opaque);
+		pixman_region32_copy(&sub->cached.input,
+				     &surface->pending.input);
+		surface->pending.regions_changed = false;
+	}
 
 	wl_list_insert_list(&sub->cached.frame_callback_list,
 			    &surface->pending.frame_callback_list);
@@ -3301,7 +6287,6 @@ static void
 weston_subsurface_commit(struct weston_subsurface *sub)
 {
 	struct weston_surface *surface = sub->surface;
-	struct weston_subsurface *tmp;
 
 	/* Recursive check for effectively synchronized. */
 	if (weston_subsurface_is_synchronized(sub)) {
@@ -3315,19 +6300,13 @@ weston_subsurface_commit(struct weston_subsurface *sub)
 			weston_surface_commit(surface);
 		}
 
-		wl_list_for_each(tmp, &surface->subsurface_list, parent_link) {
-			if (tmp->surface != surface)
-				weston_subsurface_parent_commit(tmp, 0);
-		}
+		weston_surface_commit_subsurfaces(surface, 0);
 	}
 }
 
 static void
 weston_subsurface_synchronized_commit(struct weston_subsurface *sub)
 {
-	struct weston_surface *surface = sub->surface;
-	struct weston_subsurface *tmp;
-
 	/* From now on, commit_from_cache the whole sub-tree, regardless of
 	 * the synchronized mode of each child. This sub-surface or some
 	 * of its ancestors were synchronized, so we are synchronized
@@ -3337,30 +6316,140 @@ weston_subsurface_synchronized_commit(struct weston_subsurface *sub)
 	if (sub->has_cached_data)
 		weston_subsurface_commit_from_cache(sub);
 
-	wl_list_for_each(tmp, &surface->subsurface_list, parent_link) {
-		if (tmp->surface != surface)
-			weston_subsurface_parent_commit(tmp, 1);
-	}
+	weston_surface_commit_subsurfaces(sub->surface, 1);
 }
 
 static void
-weston_subsurface_parent_commit(struct weston_subsurface *sub,
-				int parent_is_synchronized)
+weston_subsurface_apply_position(struct weston_subsurface *sub)
 {
 	struct weston_view *view;
-	if (sub->position.set) {
-		wl_list_for_each(view, &sub->surface->views, surface_link)
-			weston_view_set_position(view,
-						 sub->position.x,
-						 sub->position.y);
 
-		sub->position.set = 0;
-	}
+	if (!sub->position.set)
+		return;
+
+	wl_list_for_each(view, &sub->surface->views, surface_link)
+		weston_view_set_position(view,
+					 sub->position.x,
+					 sub->position.y);
+
+	sub->position.set = 0;
+}
+
+static void
+weston_subsurface_parent_commit(struct weston_subsurface *sub,
+				int parent_is_synchronized)
+{
+	weston_subsurface_apply_position(sub);
 
 	if (parent_is_synchronized || sub->synchronized)
 		weston_subsurface_synchronized_commit(sub);
 }
 
+static int
+subsurface_tree_add(struct wl_array *tree, struct weston_surface *surface)
+{
+	struct weston_subsurface_tree_entry *entry;
+	struct weston_subsurface *sub;
+	int index;
+
+	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+		if (sub->surface == surface)
+			continue;
+
+		index = tree->size / sizeof *entry;
+		if (!wl_array_add(tree, sizeof *entry))
+			return -1;
+		sub->tree_index = index;
+
+		if (subsurface_tree_add(tree, sub->surface) < 0)
+			return -1;
+
+		/* The array may have moved while adding the sub-tree */
+		entry = (struct weston_subsurface_tree_entry *) tree->data + index;
+		entry->sub = sub;
+		entry->end = tree->size / sizeof *entry;
+	}
+
+	return 0;
+}
+
+static struct wl_array *
+subsurface_tree_get(struct weston_surface *root)
+{
+	if (root->subsurface_tree_dirty) {
+		root->subsurface_tree.size = 0;
+		if (subsurface_tree_add(&root->subsurface_tree, root) < 0)
+			return NULL;
+		root->subsurface_tree_dirty = false;
+	}
+
+	return &root->subsurface_tree;
+}
+
+/* Commit the sub-surfaces below surface whose parent state was just
+ * applied, the same as calling weston_subsurface_parent_commit() on
+ * each child. That walks the tree recursively; this walks its
+ * flattened copy kept on the root, skipping the sub-tree of each
+ * desynchronized sub-surface instead of returning from it.
+ *
+ * Committing from the cache may restack the children of a sub-surface
+ * and so invalidate the copy, but not change which sub-surfaces are in
+ * each sub-tree, so the walk can finish on the stale copy.
+ */
+static void
+weston_surface_commit_subsurfaces(struct weston_surface *surface,
+				  int parent_is_synchronized)
+{
+	struct weston_subsurface_tree_entry *entries;
+	struct weston_surface *root = subsurface_tree_root(surface);
+	struct weston_subsurface *sub;
+	struct wl_array *tree;
+	int i, end, sync_end;
+
+	if (wl_list_empty(&surface->subsurface_list))
+		return;
+
+	tree = subsurface_tree_get(root);
+	if (!tree) {
+		wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+			if (sub->surface != surface)
+				weston_subsurface_parent_commit(sub,
+						parent_is_synchronized);
+		}
+		return;
+	}
+
+	entries = tree->data;
+	if (surface == root) {
+		i = 0;
+		end = tree->size / sizeof *entries;
+	} else {
+		sub = weston_surface_to_subsurface(surface);
+		i = sub->tree_index + 1;
+		end = entries[sub->tree_index].end;
+	}
+
+	/* Entries before sync_end belong to a synchronized sub-tree */
+	sync_end = parent_is_synchronized ? end : i;
+
+	while (i < end) {
+		sub = entries[i].sub;
+		weston_subsurface_apply_position(sub);
+
+		if (i >= sync_end && !sub->synchronized) {
+			i = entries[i].end;
+			continue;
+		}
+
+		if (i >= sync_end)
+			sync_end = entries[i].end;
+
+		if (sub->has_cached_data)
+			weston_subsurface_commit_from_cache(sub);
+		i++;
+	}
+}
+
 static int
 subsurface_get_label(struct weston_surface *surface, char *buf, size_t len)
 {
@@ -3384,6 +6473,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		surface->compositor->view_list_needs_rebuild = true;
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -3520,81 +6610,226 @@ weston_surface_get_bounding_box(struct weston_surface *surface)
 		.height = box->y2 - box->y1,
 	};
 
-	pixman_region32_fini(&region);
+	pixman_region32_fini(&region);
+
+	return geometry;
+}
+
+/** Copy surface contents to system memory.
+ *
+ * \param surface The surface to copy from.
+ * \param target Pointer to the target memory buffer.
+ * \param size Size of the target buffer in bytes.
+ * \param src_x X location on contents to copy from.
+ * \param src_y Y location on contents to copy from.
+ * \param width Width in pixels of the area to copy.
+ * \param height Height in pixels of the area to copy.
+ * \return 0 for success, -1 for failure.
+ *
+ * Surface contents are maintained by the renderer. They can be in a
+ * reserved weston_buffer or as a copy, e.g. a GL texture, or something
+ * else.
+ *
+ * Surface contents are copied into memory pointed to by target,
+ * which has size bytes of space available. The target memory
+ * may be larger than needed, but being smaller returns an error.
+ * The extra bytes in target may or may not be written; their content is
+ * unspecified. Size must be large enough to hold the image.
+ *
+ * The image in the target memory will be arranged in rows from
+ * top to bottom, and pixels on a row from left to right. The pixel
+ * format is PIXMAN_a8b8g8r8, 4 bytes per pixel, and stride is exactly
+ * width * 4.
+ *
+ * Parameters src_x and src_y define the upper-left corner in buffer
+ * coordinates (pixels) to copy from. Parameters width and height
+ * define the size of the area to copy in pixels.
+ *
+ * The rectangle defined by src_x, src_y, width, height must fit in
+ * the surface contents. Otherwise an error is returned.
+ *
+ * Use surface_get_data_size to determine the content size; the
+ * needed target buffer size and rectangle limits.
+ *
+ * CURRENT IMPLEMENTATION RESTRICTIONS:
+ * - the machine must be little-endian due to Pixman formats.
+ *
+ * NOTE: Pixman formats are premultiplied.
+ */
+WL_EXPORT int
+weston_surface_copy_content(struct weston_surface *surface,
+			    void *target, size_t size,
+			    int src_x, int src_y,
+			    int width, int height)
+{
+	struct weston_renderer *rer = surface->compositor->renderer;
+	int cw, ch;
+	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+
+	if (!rer->surface_copy_content)
+		return -1;
+
+	weston_surface_get_content_size(surface, &cw, &ch);
+
+	if (src_x < 0 || src_y < 0)
+		return -1;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	if (src_x + width > cw || src_y + height > ch)
+		return -1;
+
+	if (width * bytespp * height > size)
+		return -1;
+
+	return rer->surface_copy_content(surface, target, size,
+					 src_x, src_y, width, height);
+}
+
+/** Copy surface contents to system memory without waiting for the GPU
+ *
+ * \param surface The surface to copy from.
+ * \param src_x X location on contents to copy from.
+ * \param src_y Y location on contents to copy from.
+ * \param width Width in pixels of the area to copy.
+ * \param height Height in pixels of the area to copy.
+ * \param done Called with the pixels once they are available.
+ * \param data User data passed to done.
+ * \return 0 if done will be called, -1 on failure.
+ *
+ * Like weston_surface_copy_content(), but the renderer only queues the
+ * copy, and done gets the pixels from the event loop once the GPU has
+ * finished it, in the layout described there. Copies complete in the
+ * order they were requested. The pixels are only valid during the call,
+ * so done copies them to where they are needed, e.g. a memfd shared
+ * with a client.
+ *
+ * The content is copied as it is at the time of the call; the surface
+ * may change or go away before done is called. When the renderer cannot
+ * queue the copy, it is made right away and done is called before this
+ * function returns.
+ */
+WL_EXPORT int
+weston_surface_copy_content_async(struct weston_surface *surface,
+				  int src_x, int src_y,
+				  int width, int height,
+				  weston_read_pixels_done_func_t done,
+				  void *data)
+{
+	struct weston_renderer *rer = surface->compositor->renderer;
+	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+	size_t size;
+	void *pixels;
+	int cw, ch;
+
+	weston_surface_get_content_size(surface, &cw, &ch);
+
+	if (src_x < 0 || src_y < 0)
+		return -1;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	if (src_x + width > cw || src_y + height > ch)
+		return -1;
+
+	if (rer->surface_copy_content_async &&
+	    rer->surface_copy_content_async(surface, src_x, src_y,
+					    width, height, done, data) == 0)
+		return 0;
+
+	size = width * bytespp * height;
+	pixels = malloc(size);
+	if (!pixels)
+		return -1;
+
+	if (weston_surface_copy_content(surface, pixels, size,
+					src_x, src_y, width, height) < 0) {
+		free(pixels);
+		return -1;
+	}
+
+	done(data, pixels);
+	free(pixels);
+
+	return 0;
+}
+
+/** Show a scaled down copy of a surface's content on another surface
+ *
+ * \param target An internal surface without a client buffer.
+ * \param surface The surface to copy from.
+ * \param width Width in pixels of the copy.
+ * \param height Height in pixels of the copy.
+ * \return 0 for success, -1 for failure.
+ *
+ * The renderer draws the current content of surface, scaled to the
+ * given size, into storage of its own for target, which is resized to
+ * match. The pixels never leave the renderer, so unlike with
+ * weston_surface_copy_content() keeping a small copy of a large surface
+ * up to date is cheap, and so is drawing it.
+ *
+ * The copy does not follow later commits to surface, and is kept until
+ * the next call or until a buffer or color is set on target.
+ */
+WL_EXPORT int
+weston_surface_copy_scaled(struct weston_surface *target,
+			   struct weston_surface *surface,
+			   int width, int height)
+{
+	struct weston_renderer *rer = surface->compositor->renderer;
+
+	if (!rer->surface_copy_scaled)
+		return -1;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+
+	if (rer->surface_copy_scaled(target, surface, width, height) < 0)
+		return -1;
+
+	weston_surface_set_size(target, width, height);
+	weston_surface_damage(target);
 
-	return geometry;
+	return 0;
 }
 
-/** Copy surface contents to system memory.
+/** Show pixels drawn by the compositor on an internal surface
  *
- * \param surface The surface to copy from.
- * \param target Pointer to the target memory buffer.
- * \param size Size of the target buffer in bytes.
- * \param src_x X location on contents to copy from.
- * \param src_y Y location on contents to copy from.
- * \param width Width in pixels of the area to copy.
- * \param height Height in pixels of the area to copy.
+ * \param surface An internal surface without a client buffer.
+ * \param image The pixels, in PIXMAN_a8r8g8b8.
  * \return 0 for success, -1 for failure.
  *
- * Surface contents are maintained by the renderer. They can be in a
- * reserved weston_buffer or as a copy, e.g. a GL texture, or something
- * else.
- *
- * Surface contents are copied into memory pointed to by target,
- * which has size bytes of space available. The target memory
- * may be larger than needed, but being smaller returns an error.
- * The extra bytes in target may or may not be written; their content is
- * unspecified. Size must be large enough to hold the image.
- *
- * The image in the target memory will be arranged in rows from
- * top to bottom, and pixels on a row from left to right. The pixel
- * format is PIXMAN_a8b8g8r8, 4 bytes per pixel, and stride is exactly
- * width * 4.
- *
- * Parameters src_x and src_y define the upper-left corner in buffer
- * coordinates (pixels) to copy from. Parameters width and height
- * define the size of the area to copy in pixels.
- *
- * The rectangle defined by src_x, src_y, width, height must fit in
- * the surface contents. Otherwise an error is returned.
- *
- * Use surface_get_data_size to determine the content size; the
- * needed target buffer size and rectangle limits.
- *
- * CURRENT IMPLEMENTATION RESTRICTIONS:
- * - the machine must be little-endian due to Pixman formats.
- *
- * NOTE: Pixman formats are premultiplied.
+ * The surface is resized to the image and shows it until the next call
+ * or until a buffer or color is set on it. The image must not change
+ * afterwards, as the renderer may keep reading it, but it can be shown
+ * on any number of surfaces.
  */
 WL_EXPORT int
-weston_surface_copy_content(struct weston_surface *surface,
-			    void *target, size_t size,
-			    int src_x, int src_y,
-			    int width, int height)
+weston_surface_set_image(struct weston_surface *surface,
+			 pixman_image_t *image)
 {
 	struct weston_renderer *rer = surface->compositor->renderer;
-	int cw, ch;
-	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
 
-	if (!rer->surface_copy_content)
+	if (!rer->surface_set_image)
 		return -1;
 
-	weston_surface_get_content_size(surface, &cw, &ch);
-
-	if (src_x < 0 || src_y < 0)
+	if (pixman_image_get_format(image) != PIXMAN_a8r8g8b8)
 		return -1;
 
-	if (width <= 0 || height <= 0)
+	if (rer->surface_set_image(surface, image) < 0)
 		return -1;
 
-	if (src_x + width > cw || src_y + height > ch)
-		return -1;
+	weston_surface_set_size(surface, pixman_image_get_width(image),
+				pixman_image_get_height(image));
+	weston_surface_damage(surface);
 
-	if (width * bytespp * height > size)
-		return -1;
+	/* Maps a sub-surface, as a commit would */
+	if (weston_surface_to_subsurface(surface))
+		subsurface_committed(surface, 0, 0);
 
-	return rer->surface_copy_content(surface, target, size,
-					 src_x, src_y, width, height);
+	return 0;
 }
 
 static void
@@ -3721,6 +6956,10 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	sub->parent->compositor->view_list_needs_rebuild = true;
+	weston_surface_invalidate_subsurface_tree(sub->parent);
+	sub->surface->subsurface_tree_dirty = true;
+
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -3787,6 +7026,9 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+
+	parent->compositor->view_list_needs_rebuild = true;
+	weston_surface_invalidate_subsurface_tree(parent);
 }
 
 static void
@@ -3807,7 +7049,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 
 	assert(sub->surface);
 
-	if (sub->resource) {
+	if (sub->surface != sub->parent) {
 		assert(weston_surface_to_subsurface(sub->surface) == sub);
 		assert(sub->parent_destroy_listener.notify ==
 		       subsurface_handle_parent_destroy);
@@ -3829,6 +7071,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 	} else {
 		/* the dummy weston_subsurface for the parent itself */
 		assert(sub->parent_destroy_listener.notify == NULL);
+		sub->surface->compositor->view_list_needs_rebuild = true;
 		wl_list_remove(&sub->parent_link);
 		wl_list_remove(&sub->parent_link_pending);
 	}
@@ -3872,6 +7115,7 @@ weston_subsurface_create(uint32_t id, struct weston_surface *surface,
 	weston_subsurface_link_surface(sub, surface);
 	weston_subsurface_link_parent(sub, parent);
 	weston_surface_state_init(&sub->cached);
+	surface->pending.regions_changed = true;
 	sub->cached_buffer_ref.buffer = NULL;
 	sub->synchronized = 1;
 
@@ -3896,9 +7140,72 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
 
+	parent->compositor->view_list_needs_rebuild = true;
+
+	return sub;
+}
+
+/** Make a compositor-internal surface a sub-surface
+ *
+ * \param surface The surface, which has no wl_surface resource.
+ * \param parent The surface to follow, client or internal.
+ * \return The sub-surface, or NULL on failure.
+ *
+ * The sub-surface goes on top of its siblings at 0, 0 of the parent,
+ * and is mapped once it has content, for example from
+ * weston_surface_set_image(). It goes away with the surface; if the
+ * parent goes first, the surface is unmapped.
+ */
+WL_EXPORT struct weston_subsurface *
+weston_subsurface_create_internal(struct weston_surface *surface,
+				  struct weston_surface *parent)
+{
+	struct weston_subsurface *sub;
+
+	assert(!surface->resource);
+	assert(surface != parent);
+	assert(!weston_surface_to_subsurface(surface));
+
+	if (wl_list_empty(&parent->subsurface_list) &&
+	    !weston_subsurface_create_for_parent(parent))
+		return NULL;
+
+	sub = zalloc(sizeof *sub);
+	if (sub == NULL)
+		return NULL;
+
+	wl_list_init(&sub->unused_views);
+	weston_subsurface_link_surface(sub, surface);
+	weston_subsurface_link_parent(sub, parent);
+	weston_surface_state_init(&sub->cached);
+	sub->cached_buffer_ref.buffer = NULL;
+
+	surface->committed = subsurface_committed;
+	surface->committed_private = sub;
+	weston_surface_set_label_func(surface, subsurface_get_label);
+
 	return sub;
 }
 
+/** Move a compositor-internal sub-surface
+ *
+ * Like wl_subsurface.set_position, the move happens with the next
+ * commit of the parent.
+ */
+WL_EXPORT void
+weston_subsurface_set_position(struct weston_subsurface *sub,
+			       int32_t x, int32_t y)
+{
+	assert(!sub->resource);
+
+	if (sub->position.x == x && sub->position.y == y)
+		return;
+
+	sub->position.x = x;
+	sub->position.y = y;
+	sub->position.set = 1;
+}
+
 static void
 subcompositor_get_subsurface(struct wl_client *client,
 			     struct wl_resource *resource,
@@ -4004,6 +7311,20 @@ weston_compositor_dpms(struct weston_compositor *compositor,
 			output->set_dpms(output, state);
 }
 
+/* Nothing repaints while the outputs are off, so animations did not
+ * advance. Let them continue from where they stopped, rather than jump
+ * ahead by the time spent asleep. */
+static void
+compositor_resume_animations(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+	struct weston_animation *animation;
+
+	wl_list_for_each(output, &compositor->output_list, link)
+		wl_list_for_each(animation, &output->animation_list, link)
+			animation->frame_counter = 0;
+}
+
 /** Restores the compositor to active status
  *
  * \param compositor The compositor instance
@@ -4027,10 +7348,17 @@ weston_compositor_wake(struct weston_compositor *compositor)
 
 	switch (old_state) {
 	case WESTON_COMPOSITOR_SLEEPING:
-	case WESTON_COMPOSITOR_IDLE:
 	case WESTON_COMPOSITOR_OFFSCREEN:
+		compositor_resume_animations(compositor);
+		/* fall through */
+	case WESTON_COMPOSITOR_IDLE:
+		wl_event_source_timer_update(compositor->idle_dpms_source, 0);
 		weston_compositor_dpms(compositor, WESTON_DPMS_ON);
 		wl_signal_emit(&compositor->wake_signal, compositor);
+		/* Frame callbacks held back while idle are due now. */
+		if (old_state == WESTON_COMPOSITOR_IDLE &&
+		    compositor->idle_frame_rate > 0)
+			weston_compositor_schedule_repaint(compositor);
 		/* fall through */
 	default:
 		wl_event_source_timer_update(compositor->idle_source,
@@ -4104,6 +7432,26 @@ idle_handler(void *data)
 	compositor->state = WESTON_COMPOSITOR_IDLE;
 	wl_signal_emit(&compositor->idle_signal, compositor);
 
+	/* The shell may have put the outputs to sleep already. */
+	if (compositor->state == WESTON_COMPOSITOR_IDLE &&
+	    compositor->idle_dpms_time > 0)
+		wl_event_source_timer_update(compositor->idle_dpms_source,
+					     compositor->idle_dpms_time * 1000);
+
+	return 1;
+}
+
+/* The last idle tier: still idle this long after the idle timeout, the
+ * outputs are powered down. */
+static int
+idle_dpms_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	if (compositor->state == WESTON_COMPOSITOR_IDLE &&
+	    !compositor->idle_inhibit)
+		weston_compositor_sleep(compositor);
+
 	return 1;
 }
 
@@ -4232,20 +7580,20 @@ weston_compositor_reflow_outputs(struct weston_compositor *compositor,
 	}
 }
 
-WL_EXPORT void
-weston_output_update_matrix(struct weston_output *output)
+static void
+output_compute_matrix(struct weston_output *output,
+		      struct weston_matrix *matrix, bool zoomed)
 {
 	float magnification;
 
-	weston_matrix_init(&output->matrix);
-	weston_matrix_translate(&output->matrix, -output->x, -output->y, 0);
+	weston_matrix_init(matrix);
+	weston_matrix_translate(matrix, -output->x, -output->y, 0);
 
-	if (output->zoom.active) {
+	if (zoomed) {
 		magnification = 1 / (1 - output->zoom.spring_z.current);
-		weston_output_update_zoom(output);
-		weston_matrix_translate(&output->matrix, -output->zoom.trans_x,
+		weston_matrix_translate(matrix, -output->zoom.trans_x,
 					-output->zoom.trans_y, 0);
-		weston_matrix_scale(&output->matrix, magnification,
+		weston_matrix_scale(matrix, magnification,
 				    magnification, 1.0);
 	}
 
@@ -4254,8 +7602,8 @@ weston_output_update_matrix(struct weston_output *output)
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		weston_matrix_translate(&output->matrix, -output->width, 0, 0);
-		weston_matrix_scale(&output->matrix, -1, 1, 1);
+		weston_matrix_translate(matrix, -output->width, 0, 0);
+		weston_matrix_scale(matrix, -1, 1, 1);
 		break;
 	}
 
@@ -4266,26 +7614,38 @@ weston_output_update_matrix(struct weston_output *output)
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		weston_matrix_translate(&output->matrix, 0, -output->height, 0);
-		weston_matrix_rotate_xy(&output->matrix, 0, 1);
+		weston_matrix_translate(matrix, 0, -output->height, 0);
+		weston_matrix_rotate_xy(matrix, 0, 1);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		weston_matrix_translate(&output->matrix,
+		weston_matrix_translate(matrix,
 					-output->width, -output->height, 0);
-		weston_matrix_rotate_xy(&output->matrix, -1, 0);
+		weston_matrix_rotate_xy(matrix, -1, 0);
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		weston_matrix_translate(&output->matrix, -output->width, 0, 0);
-		weston_matrix_rotate_xy(&output->matrix, 0, -1);
+		weston_matrix_translate(matrix, -output->width, 0, 0);
+		weston_matrix_rotate_xy(matrix, 0, -1);
 		break;
 	}
 
 	if (output->current_scale != 1)
-		weston_matrix_scale(&output->matrix,
+		weston_matrix_scale(matrix,
 				    output->current_scale,
 				    output->current_scale, 1);
+}
+
+WL_EXPORT void
+weston_output_update_matrix(struct weston_output *output)
+{
+	if (output->zoom.active) {
+		weston_output_update_zoom(output);
+		output_compute_matrix(output, &output->zoom.scene_matrix,
+				      false);
+	}
+
+	output_compute_matrix(output, &output->matrix, output->zoom.active);
 
 	output->dirty = 0;
 
@@ -4392,7 +7752,6 @@ weston_output_transform_coordinate(struct weston_output *output,
  *
  * \param output The weston_output object that needs the changes undone.
  *
- * Removes the repaint timer.
  * Destroys the Wayland global assigned to the output.
  * Destroys pixman regions allocated to the output.
  * Deallocates output's ID and updates compositor's output_id_pool.
@@ -4400,12 +7759,19 @@ weston_output_transform_coordinate(struct weston_output *output,
 static void
 weston_output_enable_undo(struct weston_output *output)
 {
-	wl_event_source_remove(output->repaint_timer);
-
 	wl_global_destroy(output->global);
 
+	if (output->occluded_frame_timer) {
+		wl_event_source_remove(output->occluded_frame_timer);
+		output->occluded_frame_timer = NULL;
+	}
+
+	weston_deferred_work_cancel(&output->content_rate.switch_work);
+	output->content_rate.pending = NULL;
+
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	wl_array_release(&output->draw_items);
 	output->compositor->output_id_pool &= ~(1u << output->id);
 
 	output->enabled = false;
@@ -4472,6 +7838,24 @@ weston_output_set_scale(struct weston_output *output,
 	output->scale = scale;
 }
 
+/** Sets the frame callback rate for occluded surfaces on an output.
+ *
+ * \param output The weston_output object to configure.
+ * \param rate   Maximum frame callback rate in Hz for surfaces synced to
+ *               this output that have no visible view on it. 0 holds the
+ *               callbacks until the surface becomes visible again, and a
+ *               negative value sends them on every repaint like for any
+ *               other surface.
+ *
+ * Presentation feedback is not affected. This may be called at any time.
+ */
+WL_EXPORT void
+weston_output_set_occluded_frame_rate(struct weston_output *output,
+				      int32_t rate)
+{
+	output->occluded_frame_rate = rate;
+}
+
 /** Sets the output transform for a given output.
  *
  * \param output    The weston_output object that the transform is set for.
@@ -4528,6 +7912,7 @@ weston_output_init(struct weston_output *output,
 	output->scale = 0;
 	/* Can't use -1 on uint32_t and 0 is valid enum value */
 	output->transform = UINT32_MAX;
+	output->occluded_frame_rate = -1;
 }
 
 /** Adds weston_output object to pending output list.
@@ -4556,9 +7941,6 @@ weston_compositor_add_pending_output(struct weston_output *output,
  * Sets up the transformation, zoom, and geometry of the output using
  * the properties that need to be configured by the compositor.
  *
- * Establishes a repaint timer for the output with the relevant display
- * object's event loop. See output_repaint_timer_handler().
- *
  * The output is assigned an ID. Weston can support up to 32 distinct
  * outputs, with IDs numbered from 0-31; the compositor's output_id_pool
  * is referred to and used to find the first available ID number, and
@@ -4583,7 +7965,6 @@ weston_output_enable(struct weston_output *output)
 {
 	struct weston_compositor *c = output->compositor;
 	struct weston_output *iterator;
-	struct wl_event_loop *loop;
 	int x = 0, y = 0;
 
 	assert(output->enable);
@@ -4618,16 +7999,18 @@ weston_output_enable(struct weston_output *output)
 	weston_output_damage(output);
 
 	wl_signal_init(&output->frame_signal);
+	wl_signal_init(&output->writeback_signal);
+	wl_array_init(&output->draw_items);
 	wl_signal_init(&output->destroy_signal);
+	wl_signal_init(&output->stats_signal);
+	wl_signal_init(&output->input_latency_signal);
+	wl_signal_init(&output->repaint_scheduled_signal);
+	memset(&output->stats, 0, sizeof output->stats);
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->resource_list);
 	wl_list_init(&output->feedback_list);
 	wl_list_init(&output->link);
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	output->repaint_timer = wl_event_loop_add_timer(loop,
-					output_repaint_timer_handler, output);
-
 	/* Invert the output id pool and look for the lowest numbered
 	 * switch (the least significant bit).  Take that bit's position
 	 * as our ID, and mark it used in the compositor's output_id_pool.
@@ -4639,6 +8022,11 @@ weston_output_enable(struct weston_output *output)
 		wl_global_create(c->wl_display, &wl_output_interface, 3,
 				 output, bind_output);
 
+	output->occluded_frame_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(c->wl_display),
+					output_occluded_frame_timer_handler,
+					output);
+
 	output->enabled = true;
 
 	/* Enable the output (set up the crtc or create a
@@ -4915,6 +8303,119 @@ bind_viewporter(struct wl_client *client,
 				       NULL, NULL);
 }
 
+static void
+destroy_tearing_control(struct wl_resource *resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(resource);
+
+	if (!surface)
+		return;
+
+	surface->tearing_control_resource = NULL;
+	surface->pending.allow_tearing = false;
+}
+
+static void
+tearing_control_destroy(struct wl_client *client,
+			struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+tearing_control_set_presentation_hint(struct wl_client *client,
+				      struct wl_resource *resource,
+				      uint32_t hint)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(resource);
+
+	if (hint != WESTON_TEARING_CONTROL_PRESENTATION_HINT_VSYNC &&
+	    hint != WESTON_TEARING_CONTROL_PRESENTATION_HINT_ASYNC) {
+		wl_resource_post_error(resource,
+			WESTON_TEARING_CONTROL_ERROR_INVALID_HINT,
+			"invalid presentation hint %u", hint);
+		return;
+	}
+
+	/* Nothing left to show if the surface is gone */
+	if (!surface)
+		return;
+
+	surface->pending.allow_tearing =
+		hint == WESTON_TEARING_CONTROL_PRESENTATION_HINT_ASYNC;
+}
+
+static const struct weston_tearing_control_interface
+tearing_control_interface = {
+	tearing_control_destroy,
+	tearing_control_set_presentation_hint
+};
+
+static void
+tearing_control_manager_destroy(struct wl_client *client,
+				struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+tearing_control_manager_get_tearing_control(struct wl_client *client,
+					    struct wl_resource *manager,
+					    uint32_t id,
+					    struct wl_resource *surface_resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct wl_resource *resource;
+
+	if (surface->tearing_control_resource) {
+		wl_resource_post_error(manager,
+			WESTON_TEARING_CONTROL_MANAGER_ERROR_TEARING_CONTROL_EXISTS,
+			"a tearing control for that surface already exists");
+		return;
+	}
+
+	resource = wl_resource_create(client,
+				      &weston_tearing_control_interface,
+				      wl_resource_get_version(manager), id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &tearing_control_interface,
+				       surface, destroy_tearing_control);
+
+	surface->tearing_control_resource = resource;
+}
+
+static const struct weston_tearing_control_manager_interface
+tearing_control_manager_interface = {
+	tearing_control_manager_destroy,
+	tearing_control_manager_get_tearing_control
+};
+
+static void
+bind_tearing_control_manager(struct wl_client *client,
+			     void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_tearing_control_manager_interface,
+				      version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &tearing_control_manager_interface,
+				       NULL, NULL);
+}
+
 static void
 destroy_presentation_feedback(struct wl_resource *feedback_resource)
 {
@@ -4923,7 +8424,7 @@ destroy_presentation_feedback(struct wl_resource *feedback_resource)
 	feedback = wl_resource_get_user_data(feedback_resource);
 
 	wl_list_remove(&feedback->link);
-	free(feedback);
+	weston_pool_free(&feedback_pool, feedback);
 }
 
 static void
@@ -4943,7 +8444,7 @@ presentation_feedback(struct wl_client *client,
 
 	surface = wl_resource_get_user_data(surface_resource);
 
-	feedback = zalloc(sizeof *feedback);
+	feedback = weston_pool_alloc(&feedback_pool);
 	if (feedback == NULL)
 		goto err_calloc;
 
@@ -4961,7 +8462,7 @@ presentation_feedback(struct wl_client *client,
 	return;
 
 err_create:
-	free(feedback);
+	weston_pool_free(&feedback_pool, feedback);
 
 err_calloc:
 	wl_client_post_no_memory(client);
@@ -5035,12 +8536,30 @@ timeline_key_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
 {
 	struct weston_compositor *compositor = data;
 
-	if (weston_timeline_enabled_)
+	if (weston_timeline_is_open())
 		weston_timeline_close();
 	else
 		weston_timeline_open(compositor);
 }
 
+static void
+timeline_dump_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
+			      uint32_t key, void *data)
+{
+	weston_timeline_ring_dump();
+}
+
+static void
+log_debug_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
+			  uint32_t key, void *data)
+{
+	bool enable = !weston_log_get_debug_all();
+
+	weston_log_set_debug_all(enable);
+	weston_log("debug logging of all scopes %s\n",
+		   enable ? "enabled" : "disabled");
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -5055,6 +8574,7 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 {
 	struct weston_compositor *ec;
 	struct wl_event_loop *loop;
+	int i;
 
 	ec = zalloc(sizeof *ec);
 	if (!ec)
@@ -5079,12 +8599,25 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	wl_signal_init(&ec->output_moved_signal);
 	wl_signal_init(&ec->output_resized_signal);
 	wl_signal_init(&ec->session_signal);
+	wl_signal_init(&ec->first_frame_signal);
 	ec->session_active = 1;
 
+	ec->repaint_scope = weston_log_scope_get("repaint");
+	ec->input_scope = weston_log_scope_get("input");
+	ec->clients_scope = weston_log_scope_get("clients");
+	weston_timeline_create_scope();
+
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->repaint_margin_usec = DEFAULT_REPAINT_MARGIN;
+	ec->clipboard_max_size = DEFAULT_CLIPBOARD_MAX_SIZE;
 
 	ec->activate_serial = 1;
+	ec->view_list_needs_rebuild = true;
+
+	ec->pick_grid = zalloc(sizeof *ec->pick_grid);
+	if (!ec->pick_grid)
+		goto fail;
 
 	if (!wl_global_create(ec->wl_display, &wl_compositor_interface, 4,
 			      ec, compositor_bind))
@@ -5102,10 +8635,17 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 			      ec, bind_presentation))
 		goto fail;
 
+	if (!wl_global_create(ec->wl_display,
+			      &weston_tearing_control_manager_interface, 1,
+			      ec, bind_tearing_control_manager))
+		goto fail;
+
 	if (weston_input_init(ec) != 0)
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	wl_array_init(&ec->view_entries);
+	wl_list_init(&ec->client_accounting_list);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -5117,8 +8657,13 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	wl_list_init(&ec->touch_binding_list);
 	wl_list_init(&ec->axis_binding_list);
 	wl_list_init(&ec->debug_binding_list);
+	for (i = 0; i < WESTON_BINDING_HASH_SIZE; i++) {
+		wl_list_init(&ec->key_binding_hash[i]);
+		wl_list_init(&ec->button_binding_hash[i]);
+	}
 
 	wl_list_init(&ec->plugin_api_list);
+	wl_list_init(&ec->xkb_info_list);
 
 	weston_plane_init(&ec->primary_plane, ec, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
@@ -5129,6 +8674,14 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	loop = wl_display_get_event_loop(ec->wl_display);
 	ec->idle_source = wl_event_loop_add_timer(loop, idle_handler, ec);
+	ec->idle_dpms_source = wl_event_loop_add_timer(loop, idle_dpms_handler,
+						       ec);
+	ec->repaint_timer =
+		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
+					ec);
+	wl_list_init(&ec->deferred_work_list);
+	ec->deferred_work_timer =
+		wl_event_loop_add_timer(loop, deferred_work_timer_handler, ec);
 
 	weston_layer_init(&ec->fade_layer, ec);
 	weston_layer_init(&ec->cursor_layer, ec);
@@ -5139,10 +8692,17 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_D,
+					    timeline_dump_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_L,
+					    log_debug_binding_handler, ec);
+
+	weston_startup_mark("startup_compositor");
 
 	return ec;
 
 fail:
+	free(ec->pick_grid);
 	free(ec);
 	return NULL;
 }
@@ -5151,8 +8711,14 @@ WL_EXPORT void
 weston_compositor_shutdown(struct weston_compositor *ec)
 {
 	struct weston_output *output, *next;
+	struct weston_deferred_work *work, *next_work;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->idle_dpms_source);
+	wl_event_source_remove(ec->repaint_timer);
+	wl_event_source_remove(ec->deferred_work_timer);
+	wl_list_for_each_safe(work, next_work, &ec->deferred_work_list, link)
+		weston_deferred_work_cancel(work);
 
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
@@ -5373,6 +8939,8 @@ weston_load_module(const char *name, const char *entrypoint)
 WL_EXPORT void
 weston_compositor_destroy(struct weston_compositor *compositor)
 {
+	struct weston_client_accounting *accounting, *next_accounting;
+
 	/* prevent further rendering while shutting down */
 	compositor->state = WESTON_COMPOSITOR_OFFSCREEN;
 
@@ -5385,6 +8953,21 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_plugin_api_destroy_list(compositor);
 
+	weston_pick_grid_destroy(compositor->pick_grid);
+	wl_array_release(&compositor->view_entries);
+
+	wl_list_for_each_safe(accounting, next_accounting,
+			      &compositor->client_accounting_list, link) {
+		wl_list_remove(&accounting->client_destroy_listener.link);
+		client_accounting_destroy(accounting);
+	}
+
+	/* Frame callbacks and feedback of the clients still connected
+	 * outlive the compositor; those go back into the pools later. */
+	weston_pool_release(&view_pool);
+	weston_pool_release(&frame_callback_pool);
+	weston_pool_release(&feedback_pool);
+
 	free(compositor);
 }
 
@@ -5413,6 +8996,31 @@ weston_compositor_get_user_data(struct weston_compositor *compositor)
 	return compositor->user_data;
 }
 
+/** Tell whether a client has stopped keeping up with its events
+ *
+ * \param client The client to check.
+ * \param queued If not NULL, set to the number of bytes waiting in the
+ * client's socket, or -1 if that could not be queried.
+ * \return Whether more than WESTON_CLIENT_BACKLOG_BYTES are waiting.
+ *
+ * libwayland does not tell how much it buffers for a client, but once
+ * its small buffer is flushed, whatever the client has not read sits in
+ * the kernel's send queue, so that is what is measured here.
+ */
+WL_EXPORT bool
+weston_client_is_backlogged(struct wl_client *client, int *queued)
+{
+	int outq;
+
+	if (ioctl(wl_client_get_fd(client), SIOCOUTQ, &outq) < 0)
+		outq = -1;
+
+	if (queued)
+		*queued = outq;
+
+	return outq > WESTON_CLIENT_BACKLOG_BYTES;
+}
+
 static const char * const backend_map[] = {
 	[WESTON_BACKEND_DRM] =		"drm-backend.so",
 	[WESTON_BACKEND_FBDEV] =	"fbdev-backend.so",
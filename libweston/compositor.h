@@ -72,7 +72,14 @@ struct input_method;
 struct weston_pointer;
 struct linux_dmabuf_buffer;
 struct weston_recorder;
+struct weston_hw_recorder;
+struct recorder_encoder_interface;
 struct weston_pointer_constraint;
+struct weston_pick_grid;
+struct weston_client_accounting;
+
+#define WESTON_REPAINT_HISTOGRAM_BUCKETS 64
+#define WESTON_REPAINT_HISTORY_LENGTH 128
 
 enum weston_keyboard_modifier {
 	MODIFIER_CTRL = (1 << 0),
@@ -106,6 +113,14 @@ struct weston_animation {
 	struct wl_list link;
 };
 
+/* Work that can wait for the slack after a repaint, see
+ * weston_compositor_defer_work() */
+struct weston_deferred_work {
+	void (*run)(struct weston_deferred_work *work);
+	struct wl_list link;
+	bool queued;
+};
+
 enum {
 	WESTON_SPRING_OVERSHOOT,
 	WESTON_SPRING_CLAMP,
@@ -136,6 +151,9 @@ struct weston_output_zoom {
 	struct weston_animation animation_z;
 	struct weston_spring spring_z;
 	struct wl_listener motion_listener;
+	/** Like weston_output::matrix, but leaving out the zoom; kept up
+	 *  to date while the zoom is active. */
+	struct weston_matrix scene_matrix;
 };
 
 /* bit compatible with drm definitions. */
@@ -146,6 +164,102 @@ enum dpms_enum {
 	WESTON_DPMS_OFF
 };
 
+/** Color transformation for the display hardware to apply
+ *
+ * The framebuffer values go through the degamma curves, then the color
+ * matrix and then the gamma curves, all three optional. Curves are
+ * sampled at evenly spaced inputs from 0 to 1, with 0xffff for 1.0; the
+ * sizes come from weston_output::degamma_lut_size and gamma_lut_size.
+ */
+struct weston_color_pipeline {
+	/** Per channel, NULL for none */
+	uint16_t *degamma[3];
+	/** Row-major 3x3 matrix in linear RGB, NULL for none */
+	double *ctm;
+	/** Per channel, NULL for none */
+	uint16_t *gamma[3];
+};
+
+/** Statistics of an output's repaints, for monitoring
+ *
+ * The per-frame fields describe the last repaint; the counters run from
+ * when the output was enabled.
+ */
+struct weston_output_stats {
+	/** Repaints completed */
+	uint64_t frames;
+	/** Repaints that took longer than the repaint window */
+	uint64_t missed_deadlines;
+	/** Repaints without damage the backend completed without
+	 * rendering or flipping */
+	uint64_t unchanged_frames;
+	/** Duration of the repaint, including the backend's flush */
+	int64_t repaint_nsec;
+	/** From the previous weston_output_finish_frame() to the repaint */
+	int64_t idle_nsec;
+	/** Views composited on the primary plane */
+	uint32_t primary_views;
+	/** Views the backend put on the scanout, overlay and cursor planes */
+	uint32_t scanout_views;
+	uint32_t overlay_views;
+	uint32_t cursor_views;
+	/** Bytes of client buffers the renderer uploaded for the repaint */
+	uint64_t upload_bytes;
+
+	/** When the previous frame finished, or zero */
+	struct timespec finish_time;
+
+	/** Presented frames which showed a client's answer to input, see
+	 * input_latency_signal */
+	uint64_t input_frames;
+	/** Of the last of these: from the input event to the commit of
+	 * the client, and from that commit to the presentation */
+	int64_t input_to_commit_nsec;
+	int64_t commit_to_present_nsec;
+};
+
+/** A view as one repaint of an output draws it
+ *
+ * Taken when the core accumulates the damage of the output, after the
+ * backend assigned the planes. The items of a repaint sit next to each
+ * other in weston_output::draw_items, so renderers go through a flat
+ * array rather than the view list, and read what they need of a view
+ * without looking at it again.
+ */
+struct weston_draw_item {
+	struct weston_view *view;
+	struct weston_surface *surface;
+	struct weston_plane *plane;
+	float alpha;
+	float dim;
+	/** The part of the bounding box on the output, global
+	 *  coordinates */
+	pixman_box32_t box;
+};
+
+/** What the per-frame loops of the core read of a view
+ *
+ * Kept in weston_compositor::view_entries, in the order of the view
+ * list, so that going through a few hundred views for every plane of
+ * every output touches a handful of contiguous cache lines rather than
+ * a couple of large structs per view. Filled when the view list is
+ * built, with the plane refreshed once the backend assigned planes, and
+ * only valid during the repaint of an output.
+ */
+struct weston_view_entry {
+	struct weston_view *view;
+	struct weston_surface *surface;
+	struct weston_plane *plane;
+	struct weston_output *surface_output;
+	uint32_t output_mask;
+	uint32_t surface_output_mask;
+	/** Extents of the bounding box, global coordinates */
+	pixman_box32_t box;
+	float alpha;
+	float dim;
+	bool opaque;
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -170,21 +284,108 @@ struct weston_output {
 	pixman_region32_t region;
 
 	pixman_region32_t previous_damage;
+
+	/** True if damage has occurred since the last repaint for this
+	 *  output; if set, a repaint will eventually occur. */
 	int repaint_needed;
-	int repaint_scheduled;
-	struct wl_event_source *repaint_timer;
+
+	/** State of the repaint loop */
+	enum {
+		REPAINT_NOT_SCHEDULED = 0, /**< idle; no repaint will occur */
+		REPAINT_BEGIN_FROM_IDLE, /**< start_repaint_loop scheduled */
+		REPAINT_SCHEDULED, /**< repaint is scheduled to occur */
+		REPAINT_AWAITING_COMPLETION, /**< last repaint not yet finished */
+	} repaint_status;
+
+	/** Statistics of the repaints, see stats_signal */
+	struct weston_output_stats stats;
+	/** Emitted once stats describe a newly completed repaint */
+	struct wl_signal stats_signal;
+	/** Emitted once the input latency in stats describes a newly
+	 * presented frame */
+	struct wl_signal input_latency_signal;
+	/* Input answered by the frame being repainted or presented */
+	struct {
+		bool pending;
+		struct timespec input_time;
+		struct timespec commit_time;
+	} input_frame;
+
+	/** If repaint_status is REPAINT_SCHEDULED, contains the time the
+	 *  next repaint should be run */
+	struct timespec next_repaint;
+	/** Emitted once next_repaint and next_presentation are set for
+	 *  the next repaint */
+	struct wl_signal repaint_scheduled_signal;
+
+	/** Rolling histogram of measured repaint durations, used to place
+	 *  the repaint deadline when weston_compositor::repaint_adaptive
+	 *  is set. */
+	struct {
+		uint32_t buckets[WESTON_REPAINT_HISTOGRAM_BUCKETS];
+		uint8_t history[WESTON_REPAINT_HISTORY_LENGTH];
+		unsigned int count;
+		unsigned int next;
+		bool pending; /**< repainted in the current repaint cycle */
+		int64_t gpu_nsec; /**< last GPU render time from the renderer */
+	} repaint_timing;
+
+	/** Maximum rate, in Hz, of frame callbacks for surfaces that are
+	 *  fully occluded on this output. 0 holds them back until the
+	 *  surface becomes visible, negative disables throttling. */
+	int32_t occluded_frame_rate;
+	struct wl_event_source *occluded_frame_timer;
+
+	/** Refresh rate matching of fullscreen content, with
+	 *  weston_compositor::content_rate_switching */
+	struct {
+		uint32_t rate;		/**< candidate content rate, mHz */
+		struct timespec since;	/**< when the candidate was seen */
+		/** the temporary mode switched to, NULL if none */
+		struct weston_mode *mode;
+		/** the mode to switch to once the repaint is over */
+		struct weston_mode *pending;
+		struct weston_deferred_work switch_work;
+	} content_rate;
+
+	/** Set by the backend if the display can wait for the next frame
+	 *  instead of refreshing at the fixed rate of current_mode. */
+	bool vrr_capable;
+	/** Whether the last repaint asked for variable refresh: the
+	 *  output is capable and a single client view fills it, so its
+	 *  commits pace the repaints. The backend applies it in repaint. */
+	bool vrr_active;
+	/** With weston_compositor::low_latency_scanout, the client view
+	 *  filling the output that the last repaint put on a plane of
+	 *  its own, or NULL. Commits to it are repainted right away. */
+	struct weston_view *scanout_view;
+
+	/** What the repaint draws, as struct weston_draw_item bottom to
+	 *  top: the views of the primary plane that are at least partly
+	 *  visible on the output. Views on planes stacked below the
+	 *  primary plane are listed as well; renderers clear their area to
+	 *  transparent instead. Valid for the duration of a repaint
+	 *  only. */
+	struct wl_array draw_items;
+
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
 	struct wl_signal destroy_signal;
 	int move_x, move_y;
 	uint32_t frame_time; /* presentation timestamp in milliseconds */
+	/** When the frame of the next repaint is expected to be presented;
+	 *  the clock animations on animation_list are stepped to. */
+	struct timespec next_presentation;
 	uint64_t msc;        /* media stream counter */
 	int disable_planes;
 	int destroying;
 	struct wl_list feedback_list;
 
 	char *make, *model, *serial_number;
+	/** Hash of the monitor's EDID, to key per-monitor caches by; 0 if
+	 * the backend has no EDID. */
+	uint32_t edid_checksum;
 	uint32_t subpixel;
 	uint32_t transform;
 	int32_t native_scale;
@@ -198,7 +399,8 @@ struct weston_output {
 
 	void (*start_repaint_loop)(struct weston_output *output);
 	int (*repaint)(struct weston_output *output,
-			pixman_region32_t *damage);
+			pixman_region32_t *damage,
+			void *repaint_data);
 	void (*destroy)(struct weston_output *output);
 	void (*assign_planes)(struct weston_output *output);
 	int (*switch_mode)(struct weston_output *output, struct weston_mode *mode);
@@ -208,6 +410,39 @@ struct weston_output {
 	void (*set_backlight)(struct weston_output *output, uint32_t value);
 	void (*set_dpms)(struct weston_output *output, enum dpms_enum level);
 
+	/** Optional. Moves a view the last repaint put on one of the
+	 * output's own planes to the view's current position, without a
+	 * repaint; returns -1 if it can't. */
+	int (*move_plane)(struct weston_output *output,
+			  struct weston_view *view);
+
+	/** Optional. Exports the buffer holding the most recently
+	 * completed frame as an XRGB8888 dmabuf; the caller owns fd.
+	 * From the frame signal, that is still the previous frame. */
+	int (*export_dmabuf)(struct weston_output *output,
+			     int *fd, int *stride);
+
+	/** Optional. Has the display hardware write the frames it
+	 * composes, planes included, back to memory, so that captures
+	 * need neither keep views off the planes nor read back from the
+	 * renderer. Returns -1 if the output can't; otherwise each call is
+	 * balanced by disable_writeback(). While enabled, writeback_signal
+	 * is emitted with the output whenever such a frame is complete,
+	 * and read_writeback() copies the last one as top-down XRGB8888 of
+	 * the current mode size, or export_writeback() hands out a dmabuf
+	 * of it. The signal is also emitted if writeback stops working,
+	 * after which both fail. */
+	int (*enable_writeback)(struct weston_output *output);
+	void (*disable_writeback)(struct weston_output *output);
+	int (*read_writeback)(struct weston_output *output,
+			      void *pixels, int stride);
+	int (*export_writeback)(struct weston_output *output,
+				int *fd, int *stride);
+	struct wl_signal writeback_signal;
+	/** Optional backend specific encoder, tried before the generic
+	 * ones. */
+	const struct recorder_encoder_interface *recorder_encoder;
+
 	int connection_internal;
 	uint16_t gamma_size;
 	void (*set_gamma)(struct weston_output *output,
@@ -216,6 +451,14 @@ struct weston_output {
 			  uint16_t *g,
 			  uint16_t *b);
 
+	/** Optional. Has the display hardware apply a color pipeline, or
+	 * clears it if pipeline is NULL; returns -1 if the hardware can't
+	 * do all of it, leaving the current one in place. */
+	uint32_t degamma_lut_size;
+	uint32_t gamma_lut_size;
+	int (*set_color_pipeline)(struct weston_output *output,
+				  const struct weston_color_pipeline *pipeline);
+
 	struct weston_timeline_object timeline;
 
 	bool enabled;
@@ -341,6 +584,12 @@ struct weston_pointer_client {
 	struct wl_client *client;
 	struct wl_list pointer_resources;
 	struct wl_list relative_pointer_resources;
+
+	/* Motion held back while the client is backlogged */
+	bool backlogged;
+	bool motion_pending;
+	uint32_t motion_time;
+	uint32_t motion_coalesced;
 };
 
 struct weston_pointer {
@@ -373,6 +622,9 @@ struct weston_pointer {
 	uint32_t button_count;
 
 	struct wl_listener output_destroy_listener;
+
+	/* Sends held back motion once the client has caught up */
+	struct wl_event_source *motion_flush_timer;
 };
 
 
@@ -388,6 +640,10 @@ struct weston_touch {
 	struct wl_signal focus_signal;
 
 	uint32_t num_tp;
+	/* Points down under the default grab, with their pending motion */
+	struct wl_array points;
+	/* Whether an event went out since the last wl_touch.frame */
+	bool frame_needed;
 
 	struct weston_touch_grab *grab;
 	struct weston_touch_grab default_grab;
@@ -531,6 +787,7 @@ weston_touch_start_drag(struct weston_touch *touch,
 			struct wl_client *client);
 
 struct weston_xkb_info {
+	struct wl_list link;	/* weston_compositor::xkb_info_list */
 	struct xkb_keymap *keymap;
 	int keymap_fd;
 	size_t keymap_size;
@@ -583,6 +840,8 @@ struct weston_keyboard {
 		enum weston_led leds;
 	} xkb_state;
 	struct xkb_keymap *pending_keymap;
+	/* Clients that were sent xkb_info, the others get it on enter */
+	struct wl_array keymap_clients;
 };
 
 struct weston_seat {
@@ -617,6 +876,11 @@ struct weston_seat {
 
 	struct input_method *input_method;
 	char *seat_name;
+
+	/* Microseconds of CLOCK_MONOTONIC of the event being notified,
+	 * for backends that know better than the millisecond time they
+	 * pass; notify_key() and notify_button() reset it. */
+	uint64_t event_time_usec;
 };
 
 enum {
@@ -694,6 +958,21 @@ struct weston_layer {
 	enum weston_layer_position position;
 	pixman_box32_t mask;
 	struct weston_layer_entry view_list;
+	int32_t offset_x, offset_y; /* see weston_layer_set_offset() */
+};
+
+/** Why a view was left on the primary plane, for debugging aids */
+enum weston_plane_miss {
+	/** On another plane, or the backend has no planes */
+	WESTON_PLANE_MISS_NONE = 0,
+	/** Planes are disabled on the output */
+	WESTON_PLANE_MISS_DISABLED,
+	/** No plane can show the buffer */
+	WESTON_PLANE_MISS_NO_PLANE,
+	/** Below a view composited on the primary plane */
+	WESTON_PLANE_MISS_OVERLAP,
+	/** The planes went to views more worth it */
+	WESTON_PLANE_MISS_YIELDED,
 };
 
 struct weston_plane {
@@ -704,11 +983,36 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/** Called once pixels requested with weston_output_read_pixels_async()
+ * or weston_surface_copy_content_async() are available, or with pixels
+ * NULL if reading them back failed or the output went away first. The
+ * rows are tightly packed and the data is only valid for the duration
+ * of the call.
+ */
+typedef void (*weston_read_pixels_done_func_t)(void *data, void *pixels);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+	/** Optional. Like read_pixels, but only queues the read back and
+	 * calls done from the event loop once the GPU has finished it,
+	 * in request order. Returns -1, without calling done, if it
+	 * cannot be queued. */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
+	/** Optional. Like read_pixels, but upright, as displayed, and
+	 * into rows stride bytes apart, so that the pixels can go
+	 * straight into a client buffer. */
+	int (*read_pixels_into)(struct weston_output *output,
+				pixman_format_code_t format, void *pixels,
+				int32_t stride, uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -729,9 +1033,48 @@ struct weston_renderer {
 				    int src_x, int src_y,
 				    int width, int height);
 
+	/** Optional. Like surface_copy_content, but only queues the copy
+	 * and calls done from the event loop once the GPU has finished
+	 * it. Returns -1, without calling done, if it cannot be queued. */
+	int (*surface_copy_content_async)(struct weston_surface *surface,
+					  int src_x, int src_y,
+					  int width, int height,
+					  weston_read_pixels_done_func_t done,
+					  void *data);
+
+	/** Optional. See weston_surface_copy_scaled() */
+	int (*surface_copy_scaled)(struct weston_surface *target,
+				   struct weston_surface *surface,
+				   int width, int height);
+
+	/** Optional. See weston_surface_set_image() */
+	int (*surface_set_image)(struct weston_surface *surface,
+				 pixman_image_t *image);
+
 	/** See weston_compositor_import_dmabuf() */
 	bool (*import_dmabuf)(struct weston_compositor *ec,
 			      struct linux_dmabuf_buffer *buffer);
+
+	/** On return, \p formats is a malloc'd array of the DRM formats
+	 * import_dmabuf accepts, to be freed by the caller. */
+	void (*query_dmabuf_formats)(struct weston_compositor *ec,
+				     int **formats, int *num_formats);
+
+	/** On return, \p modifiers is a malloc'd array of the modifiers
+	 * import_dmabuf accepts for \p format, or NULL when the renderer
+	 * only takes the implicit layout. */
+	void (*query_dmabuf_modifiers)(struct weston_compositor *ec,
+				       int format, uint64_t **modifiers,
+				       int *num_modifiers);
+
+	/** Optional. Bytes the renderer holds for the surface on top of
+	 * the client's buffer, such as texture copies of wl_shm buffers.
+	 * See weston_client_stats. */
+	uint64_t (*surface_memory_bytes)(struct weston_surface *surface);
+
+	/** Running total of the bytes flush_damage has uploaded, for
+	 * weston_output_stats */
+	uint64_t upload_bytes;
 };
 
 enum weston_capability {
@@ -749,6 +1092,14 @@ enum weston_capability {
 
 	/* renderer supports weston_view_set_mask() clipping */
 	WESTON_CAP_VIEW_CLIP_MASK		= 0x0010,
+
+	/* renderer magnifies zoomed outputs from an unzoomed copy of the
+	 * scene, so zooming and panning need no damage */
+	WESTON_CAP_ZOOM_OFFSCREEN		= 0x0020,
+
+	/* renderer can wait on acquire fences and produce release fences
+	 * for client buffers */
+	WESTON_CAP_EXPLICIT_SYNC		= 0x0040,
 };
 
 /* Configuration struct for a backend.
@@ -790,11 +1141,65 @@ struct weston_backend_config {
 struct weston_backend {
 	void (*destroy)(struct weston_compositor *compositor);
 	void (*restore)(struct weston_compositor *compositor);
+
+	/** Begin a repaint sequence
+	 *
+	 * Provides the backend with explicit markers around repaint
+	 * sequences, which may allow the backend to aggregate state
+	 * application. This call will be bracketed by the repaint_flush (on
+	 * success), or repaint_cancel (when any output in the grouping fails
+	 * repaint).
+	 *
+	 * Returns an opaque pointer, which the backend may use as private
+	 * data referring to the repaint cycle, which is passed to each
+	 * output's repaint hook and to repaint_flush or repaint_cancel.
+	 */
+	void * (*repaint_begin)(struct weston_compositor *compositor);
+
+	/** Cancel a repaint sequence
+	 *
+	 * Cancels a repaint sequence, when an error has occurred during
+	 * one output's repaint; see repaint_begin.
+	 *
+	 * @param repaint_data Data returned by repaint_begin
+	 */
+	void (*repaint_cancel)(struct weston_compositor *compositor,
+			       void *repaint_data);
+
+	/** Conclude a repaint sequence
+	 *
+	 * Called on successful completion of a repaint sequence; see
+	 * repaint_begin.
+	 *
+	 * @param repaint_data Data returned by repaint_begin
+	 */
+	void (*repaint_flush)(struct weston_compositor *compositor,
+			      void *repaint_data);
+
+	/** Process input read but not yet delivered
+	 *
+	 * Called before each repaint sequence, so that backends reading
+	 * input off the main loop can pass it on in time for the repaint.
+	 * May be NULL.
+	 */
+	void (*flush_input)(struct weston_compositor *compositor);
+
+	/** Check whether any output can scan out a dmabuf directly
+	 *
+	 * Lets linux_dmabuf advertise the format and modifier pairs which
+	 * can bypass composition ahead of the ones the renderer alone
+	 * takes. May be NULL.
+	 */
+	bool (*dmabuf_scanout_supported)(struct weston_compositor *compositor,
+					 uint32_t format, uint64_t modifier);
 };
 
 struct weston_desktop_xwayland;
 struct weston_desktop_xwayland_interface;
 
+/* Buckets of the key and button binding tables, a power of two */
+#define WESTON_BINDING_HASH_SIZE 64
+
 struct weston_compositor {
 	struct wl_signal destroy_signal;
 
@@ -825,6 +1230,11 @@ struct weston_compositor {
 	struct wl_signal session_signal;
 	int session_active;
 
+	/* Emitted once, when the first repainted frame of any output has
+	 * been presented; callback argument: that output. */
+	struct wl_signal first_frame_signal;
+	bool first_frame_presented;
+
 	struct weston_layer fade_layer;
 	struct weston_layer cursor_layer;
 
@@ -833,6 +1243,21 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	/* Set when layer stacking or sub-surface order changed, so that
+	 * view_list has to be flattened again before the next repaint. */
+	bool view_list_needs_rebuild;
+	/* Bumped whenever something a pointer pick depends on changes:
+	 * view geometry, input regions or stacking order. The seats are
+	 * repicked after a repaint only if it moved since repick_serial. */
+	uint32_t scene_serial;
+	uint32_t repick_serial;
+	/* struct weston_view_entry, one per view_list entry, during the
+	 * repaint of an output */
+	struct wl_array view_entries;
+	struct weston_pick_grid *pick_grid;
+	/* struct weston_client_accounting::link, of the clients which
+	 * created surfaces */
+	struct wl_list client_accounting_list;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -840,15 +1265,31 @@ struct weston_compositor {
 	struct wl_list touch_binding_list;
 	struct wl_list axis_binding_list;
 	struct wl_list debug_binding_list;
+	/* Key and button bindings, also hashed by code and modifiers so
+	 * that an event only looks at the bindings it could trigger */
+	struct wl_list key_binding_hash[WESTON_BINDING_HASH_SIZE];
+	struct wl_list button_binding_hash[WESTON_BINDING_HASH_SIZE];
+	/* Bumped on every key, button and axis press, to tell whether
+	 * anything was pressed while a modifier was held */
+	uint32_t binding_press_serial;
 
 	uint32_t state;
 	struct wl_event_source *idle_source;
 	uint32_t idle_inhibit;
 	int idle_time;			/* timeout, s */
+	/* Frame callback rate while idle, Hz; 0 for no limit */
+	int32_t idle_frame_rate;
+	/* Time from idle to DPMS off, s; 0 for never */
+	int32_t idle_dpms_time;
+	struct wl_event_source *idle_dpms_source;
 
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
 	/* Repaint state. */
+	struct wl_event_source *repaint_timer;
+	/* struct weston_deferred_work::link, in queueing order */
+	struct wl_list deferred_work_list;
+	struct wl_event_source *deferred_work_timer;
 	struct weston_plane primary_plane;
 	uint32_t capabilities; /* combination of enum weston_capability */
 
@@ -867,6 +1308,8 @@ struct weston_compositor {
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
 	struct weston_xkb_info *xkb_info;
+	/* Keymaps in use, one per content */
+	struct wl_list xkb_info_list;
 
 	/* Raw keyboard processing (no libxkbcommon initialization or handling) */
 	int use_xkbcommon;
@@ -879,6 +1322,64 @@ struct weston_compositor {
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
 
+	/* Place the repaint deadline from measured repaint times, leaving
+	 * repaint_margin_usec of slack, instead of using repaint_msec. */
+	bool repaint_adaptive;
+	int32_t repaint_margin_usec;
+
+	/* Repaint an output as soon as the client it scans out directly
+	 * commits, instead of at the repaint deadline; opt-in. */
+	bool low_latency_scanout;
+
+	/* Switch an output showing a fullscreen client updating at a steady
+	 * rate to a mode refreshing at a multiple of it; opt-in. */
+	bool content_rate_switching;
+
+	/* Number of threads the renderer may repaint an output with; only
+	 * the pixman renderer uses more than one. */
+	int32_t renderer_threads;
+
+	/* Composite rotated and flipped outputs upright, applying the
+	 * output transform in one final pass; pixman renderer only. */
+	bool offscreen_transform;
+
+	/* Seconds a surface may go unseen before the GL renderer frees
+	 * its textures; 0 keeps them. */
+	int32_t texture_evict_timeout;
+
+	/* Have the pixman renderer copy the damage of wl_shm buffers and
+	 * release them right away, instead of reading from them until
+	 * the next commit. */
+	bool pixman_early_release;
+	/* Dumb buffers per output for the DRM backend's pixman path */
+	int32_t pixman_buffer_count;
+
+	/* Committed damage is simplified before upload and repaint: boxes
+	 * of a band are merged while the overdraw stays within
+	 * damage_merge_overdraw percent, and more than damage_max_rects
+	 * boxes fall back to their extents; 0 disables either. */
+	int32_t damage_merge_overdraw;
+	int32_t damage_max_rects;
+	/* Hash the tiles of wl_shm buffers a commit damages, and drop the
+	 * tiles whose content did not change from the damage. */
+	bool damage_hash;
+
+	/* Milliseconds the repaint of a resizing surface may be held back
+	 * waiting for the client to catch up with the size asked for;
+	 * 0 repaints every commit. */
+	int32_t resize_sync_timeout;
+
+	/* Merge the relative pointer motion a device reports within one
+	 * input dispatch into a single motion event. */
+	bool coalesce_motion;
+
+	/* Read libinput devices on a thread of their own */
+	bool input_thread;
+
+	/* Largest selection, in bytes over all its types, the clipboard
+	 * keeps a copy of for when its source goes away; 0 keeps none. */
+	size_t clipboard_max_size;
+
 	unsigned int activate_serial;
 
 	struct wl_global *pointer_constraints;
@@ -891,6 +1392,10 @@ struct weston_compositor {
 	/* Whether to let the compositor run without any input device. */
 	bool require_input;
 
+	/* Log scopes weston-debug can subscribe to */
+	struct weston_log_scope *repaint_scope;
+	struct weston_log_scope *input_scope;
+	struct weston_log_scope *clients_scope;
 };
 
 struct weston_buffer {
@@ -912,6 +1417,23 @@ struct weston_buffer_reference {
 	struct wl_listener destroy_listener;
 };
 
+/** A zwp_linux_buffer_release_v1 request for one commit of a buffer
+ *
+ * Everything still reading the buffer of that commit holds a
+ * weston_buffer_release_reference; the release event goes out when the
+ * last one is dropped, carrying fence_fd if a fence was added.
+ */
+struct weston_buffer_release {
+	struct wl_resource *resource;
+	uint32_t ref_count;
+	int fence_fd; /* -1 if the buffer can be reused right away */
+};
+
+struct weston_buffer_release_reference {
+	struct weston_buffer_release *buffer_release;
+	struct wl_listener destroy_listener;
+};
+
 struct weston_buffer_viewport {
 	struct {
 		/* wl_surface.set_buffer_transform */
@@ -989,6 +1511,7 @@ struct weston_view {
 
 	pixman_region32_t clip;          /* See weston_view_damage_below() */
 	float alpha;                     /* part of geometry, see below */
+	float dim;                       /* see weston_view_set_dim() */
 
 	void *renderer_state;
 
@@ -1036,8 +1559,28 @@ struct weston_view {
 		struct weston_matrix inverse;
 
 		struct weston_transform position; /* matrix from x, y */
+
+		/* Layer offset included in matrix, either the view's own
+		 * layer's or inherited from the parent */
+		int32_t offset_x, offset_y;
+		/* Only the layer offset changed while dirty */
+		bool offset_only;
+		/* Translation of the parent's matrix this one was built
+		 * with, to tell how far the parent moved since */
+		float parent_x, parent_y;
 	} transform;
 
+	/* Spatial index state used by weston_compositor_pick_view(),
+	 * private to compositor.c.
+	 */
+	struct {
+		uint32_t serial; /* view_list generation the view is in */
+		uint32_t order;  /* position in weston_compositor::view_list */
+		bool indexed;
+		bool oversized;
+		int32_t x1, y1, x2, y2; /* covered grid cells, inclusive */
+	} pick;
+
 	/*
 	 * The primary output for this view.
 	 * Used for picking the output for driving internal animations on the
@@ -1054,9 +1597,58 @@ struct weston_view {
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
 
+	/* enum weston_plane_miss, set along with the plane */
+	uint32_t plane_miss;
+
 	bool is_mapped;
 };
 
+#define WESTON_SURFACE_COMMIT_HISTORY 8
+
+/** Content update statistics of a surface
+ *
+ * Updated on every commit which attaches a buffer or posts damage.
+ * Timestamps are in the presentation clock domain.
+ *
+ * \sa weston_surface_get_commit_stats, weston_surface_get_commit_rate
+ */
+struct weston_surface_commit_stats {
+	/** Number of content commits so far */
+	uint32_t count;
+	/** Moving average of the interval between commits, 0 if unknown */
+	int64_t interval_nsec;
+	/** Moving average of the damaged buffer bytes per commit */
+	uint64_t damage_bytes;
+	/** Time of the most recent commits, oldest at history_next */
+	struct timespec history[WESTON_SURFACE_COMMIT_HISTORY];
+	unsigned int history_next;
+};
+
+/** Resources and costs attributed to a client
+ *
+ * Covers the wl_surfaces the client created, for as long as they have
+ * their resource.
+ *
+ * \sa weston_compositor_for_each_client_stats
+ */
+struct weston_client_stats {
+	struct wl_client *client;
+	/** Surfaces, and views of them */
+	uint32_t surfaces;
+	uint32_t views;
+	/** Size of the wl_shm buffers attached to its surfaces */
+	uint64_t shm_bytes;
+	/** Memory the renderer holds for its surfaces, such as textures */
+	uint64_t texture_bytes;
+	/** Bytes the renderer uploaded from its buffers so far */
+	uint64_t upload_bytes;
+	/** wl_surface.commit requests so far */
+	uint64_t commits;
+};
+
+typedef void (*weston_client_stats_func_t)(
+	const struct weston_client_stats *stats, void *data);
+
 struct weston_surface_state {
 	/* wl_surface.attach */
 	int newly_attached;
@@ -1076,6 +1668,10 @@ struct weston_surface_state {
 	/* wl_surface.set_input_region */
 	pixman_region32_t input;
 
+	/* The opaque or input region was set since it was last copied to
+	 * the sub-surface cache */
+	bool regions_changed;
+
 	/* wl_surface.frame */
 	struct wl_list frame_callback_list;
 
@@ -1087,6 +1683,15 @@ struct weston_surface_state {
 	/* wp_viewport.set_source */
 	/* wp_viewport.set_destination */
 	struct weston_buffer_viewport buffer_viewport;
+
+	/* zwp_surface_synchronization_v1.set_acquire_fence */
+	int acquire_fence_fd;
+
+	/* zwp_surface_synchronization_v1.get_release */
+	struct weston_buffer_release_reference buffer_release_ref;
+
+	/* weston_tearing_control.set_presentation_hint */
+	bool allow_tearing;
 };
 
 struct weston_surface_activation_data {
@@ -1114,6 +1719,14 @@ struct weston_pointer_constraint {
 	wl_fixed_t hint_y_pending;
 	bool hint_is_pending;
 
+	/* Borders of the surface input region intersected with region,
+	 * built on commit when that changes. Horizontal borders are
+	 * sorted by y and vertical ones by x. */
+	pixman_region32_t outline_region;
+	struct wl_array outline_horizontal;
+	struct wl_array outline_vertical;
+	bool outline_valid;
+
 	struct wl_listener pointer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener surface_commit_listener;
@@ -1128,6 +1741,9 @@ struct weston_surface {
 
 	/** Damage in local coordinates from the client, for tex upload. */
 	pixman_region32_t damage;
+	/** The same damage in buffer coordinates, worked out once at
+	 * commit so renderers can copy from the buffer directly. */
+	pixman_region32_t buffer_damage;
 
 	pixman_region32_t opaque;        /* part of geometry, see below */
 	pixman_region32_t input;
@@ -1165,10 +1781,28 @@ struct weston_surface {
 	int32_t width_from_buffer; /* before applying viewport */
 	int32_t height_from_buffer;
 	bool keep_buffer; /* for backends to prevent early release */
+	/* Set by weston_surface_set_color() until a buffer is attached,
+	 * for backends to show the color without the renderer */
+	bool is_solid;
+	float solid_color[4]; /* red, green, blue, alpha */
 
 	/* wp_viewport resource for this surface */
 	struct wl_resource *viewport_resource;
 
+	/* zwp_surface_synchronization_v1 resource for this surface */
+	struct wl_resource *synchronization_resource;
+
+	/* weston_tearing_control resource for this surface */
+	struct wl_resource *tearing_control_resource;
+	/* The client accepts tearing to have its buffers shown sooner;
+	 * backends may then flip to them without waiting for vblank. */
+	bool allow_tearing;
+
+	/* Fence the buffer must be waited on before reading it, -1 if
+	 * none, and the release request of its commit */
+	int acquire_fence_fd;
+	struct weston_buffer_release_reference buffer_release_ref;
+
 	/* All the pending state, that wl_surface.commit will apply. */
 	struct weston_surface_state pending;
 
@@ -1186,6 +1820,13 @@ struct weston_surface {
 	 */
 	void (*committed)(struct weston_surface *es, int32_t sx, int32_t sy);
 	void *committed_private;
+
+	/* Set by the committed hook through weston_surface_defer_repaint()
+	 * for a commit that need not be shown right away; the timer shows
+	 * it after weston_compositor::resize_sync_timeout at the latest. */
+	bool repaint_deferred;
+	bool repaint_defer_armed;
+	struct wl_event_source *repaint_defer_timer;
 	int (*get_label)(struct weston_surface *surface, char *buf, size_t len);
 
 	/* Parent's list of its sub-surfaces, weston_subsurface:parent_link.
@@ -1195,6 +1836,14 @@ struct weston_surface {
 	struct wl_list subsurface_list; /* weston_subsurface::parent_link */
 	struct wl_list subsurface_list_pending; /* ...::parent_link_pending */
 
+	/* On the root of a sub-surface tree, all its sub-surfaces in
+	 * committed stacking order, each followed by its own sub-tree, so
+	 * parent commits walk an array instead of recursing. Rebuilt on
+	 * demand after restacking or sub-surface creation or destruction.
+	 */
+	struct wl_array subsurface_tree; /* struct weston_subsurface_tree_entry */
+	bool subsurface_tree_dirty;
+
 	/*
 	 * For tracking protocol role assignments. Different roles may
 	 * have the same configure hook, e.g. in shell.c. Configure hook
@@ -1208,11 +1857,46 @@ struct weston_surface {
 
 	bool is_mapped;
 
+	struct weston_surface_commit_stats commit_stats;
+
+	/* Of the client which created the surface; NULL for internal
+	 * surfaces and once the resource is gone */
+	struct weston_client_accounting *client_accounting;
+	struct wl_list client_accounting_link;
+
+	/* The oldest input the content not yet shown answers, and when
+	 * that content was committed */
+	bool input_pending;
+	struct timespec input_time;
+	struct timespec input_commit_time;
+
+	/* Per tile content hashes of the wl_shm buffer for
+	 * weston_compositor::damage_hash: of what the renderer was last
+	 * flushed, and of what commits damaged since; 0 if not known. */
+	struct {
+		int32_t width, height, stride;
+		uint32_t format;
+		int32_t tiles_x, tiles_y;
+		uint64_t *flushed;
+		uint64_t *pending;
+		bool has_pending;
+	} damage_hash;
+
+	/* When frame callbacks were last sent, for occlusion throttling */
+	struct timespec frame_callback_time;
+
+	/* Frame callback rate limits in Hz, 0 for none, see
+	 * weston_surface_set_frame_rate_cap() */
+	int32_t frame_rate_cap;
+	int32_t unfocused_frame_rate_cap;
+
 	/* An list of per seat pointer constraints. */
 	struct wl_list pointer_constraints;
 };
 
 struct weston_subsurface {
+	/* NULL for the parent itself and for compositor-internal
+	 * sub-surfaces, see weston_subsurface_create_internal() */
 	struct wl_resource *resource;
 
 	/* guaranteed to be valid and non-NULL */
@@ -1242,6 +1926,9 @@ struct weston_subsurface {
 
 	/* Used for constructing the view tree */
 	struct wl_list unused_views;
+
+	/* Entry in the root surface's subsurface_tree, if not dirty */
+	int tree_index;
 };
 
 enum weston_key_state_update {
@@ -1261,6 +1948,9 @@ weston_version(int *major, int *minor, int *micro);
 void
 weston_view_update_transform(struct weston_view *view);
 
+bool
+weston_view_move_on_plane(struct weston_view *view);
+
 void
 weston_view_geometry_dirty(struct weston_view *view);
 
@@ -1271,11 +1961,17 @@ weston_view_to_global_fixed(struct weston_view *view,
 void
 weston_view_to_global_float(struct weston_view *view,
 			    float sx, float sy, float *x, float *y);
+void
+weston_view_to_global_points(struct weston_view *view,
+			     float *xy, unsigned count);
 
 void
 weston_view_from_global_float(struct weston_view *view,
 			      float x, float y, float *vx, float *vy);
 void
+weston_view_from_global_points(struct weston_view *view,
+			       float *xy, unsigned count);
+void
 weston_view_from_global(struct weston_view *view,
 			int32_t x, int32_t y, int32_t *vx, int32_t *vy);
 void
@@ -1286,6 +1982,12 @@ weston_view_from_global_fixed(struct weston_view *view,
 void
 weston_surface_to_buffer_float(struct weston_surface *surface,
 			       float x, float y, float *bx, float *by);
+void
+weston_surface_to_buffer_points(struct weston_surface *surface,
+				float *xy, unsigned count);
+void
+weston_surface_to_buffer_double(struct weston_surface *surface,
+				double x, double y, double *bx, double *by);
 pixman_box32_t
 weston_surface_to_buffer_rect(struct weston_surface *surface,
 			      pixman_box32_t rect);
@@ -1295,6 +1997,10 @@ weston_surface_to_buffer_region(struct weston_surface *surface,
 				pixman_region32_t *surface_region,
 				pixman_region32_t *buffer_region);
 
+void
+weston_region_simplify(pixman_region32_t *region, int32_t overdraw,
+		       int32_t max_rects);
+
 void
 weston_spring_init(struct weston_spring *spring,
 		   double k, double current, double target);
@@ -1372,6 +2078,9 @@ weston_layer_set_mask(struct weston_layer *layer, int x, int y, int width, int h
 void
 weston_layer_set_mask_infinite(struct weston_layer *layer);
 
+void
+weston_layer_set_offset(struct weston_layer *layer, int32_t x, int32_t y);
+
 void
 weston_plane_init(struct weston_plane *plane,
 			struct weston_compositor *ec,
@@ -1395,9 +2104,21 @@ void
 weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_output_damage(struct weston_output *output);
+int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
+weston_compositor_defer_work(struct weston_compositor *compositor,
+			     struct weston_deferred_work *work);
+void
+weston_deferred_work_cancel(struct weston_deferred_work *work);
+void
 weston_compositor_fade(struct weston_compositor *compositor, float tint);
 void
 weston_compositor_damage_all(struct weston_compositor *compositor);
@@ -1538,6 +2259,9 @@ void
 weston_view_set_mask(struct weston_view *view,
 		     int x, int y, int width, int height);
 
+void
+weston_view_set_dim(struct weston_view *view, float dim);
+
 void
 weston_view_set_mask_infinite(struct weston_view *view);
 
@@ -1550,6 +2274,26 @@ weston_view_schedule_repaint(struct weston_view *view);
 bool
 weston_surface_is_mapped(struct weston_surface *surface);
 
+const struct weston_surface_commit_stats *
+weston_surface_get_commit_stats(struct weston_surface *surface);
+
+void
+weston_surface_set_frame_rate_cap(struct weston_surface *surface,
+				  int32_t rate, int32_t unfocused_rate);
+
+uint32_t
+weston_surface_get_commit_rate(struct weston_surface *surface,
+			       const struct timespec *now);
+
+void
+weston_surface_note_input(struct weston_surface *surface,
+			  const struct timespec *time);
+
+void
+weston_compositor_for_each_client_stats(struct weston_compositor *compositor,
+					weston_client_stats_func_t func,
+					void *data);
+
 void
 weston_surface_set_size(struct weston_surface *surface,
 			int32_t width, int32_t height);
@@ -1557,6 +2301,9 @@ weston_surface_set_size(struct weston_surface *surface,
 void
 weston_surface_schedule_repaint(struct weston_surface *surface);
 
+void
+weston_surface_defer_repaint(struct weston_surface *surface);
+
 void
 weston_surface_damage(struct weston_surface *surface);
 
@@ -1601,6 +2348,22 @@ weston_surface_copy_content(struct weston_surface *surface,
 			    int src_x, int src_y,
 			    int width, int height);
 
+int
+weston_surface_copy_content_async(struct weston_surface *surface,
+				  int src_x, int src_y,
+				  int width, int height,
+				  weston_read_pixels_done_func_t done,
+				  void *data);
+
+int
+weston_surface_copy_scaled(struct weston_surface *target,
+			   struct weston_surface *surface,
+			   int width, int height);
+
+int
+weston_surface_set_image(struct weston_surface *surface,
+			 pixman_image_t *image);
+
 struct weston_buffer *
 weston_buffer_from_resource(struct wl_resource *resource);
 
@@ -1608,6 +2371,18 @@ void
 weston_buffer_reference(struct weston_buffer_reference *ref,
 			struct weston_buffer *buffer);
 
+void
+weston_buffer_release_reference(struct weston_buffer_release_reference *ref,
+				struct weston_buffer_release *buffer_release);
+
+void
+weston_buffer_release_move(struct weston_buffer_release_reference *dest,
+			   struct weston_buffer_release_reference *src);
+
+void
+weston_buffer_release_add_fence(struct weston_buffer_release *buffer_release,
+				int fence_fd);
+
 uint32_t
 weston_compositor_get_time(void);
 
@@ -1633,6 +2408,12 @@ void
 weston_compositor_exit(struct weston_compositor *ec);
 void *
 weston_compositor_get_user_data(struct weston_compositor *compositor);
+
+/* Unread bytes in a client's socket above which it is considered slow. */
+#define WESTON_CLIENT_BACKLOG_BYTES (64 * 1024)
+
+bool
+weston_client_is_backlogged(struct wl_client *client, int *queued);
 int
 weston_compositor_set_presentation_clock(struct weston_compositor *compositor,
 					 clockid_t clk_id);
@@ -1720,6 +2501,70 @@ int
 weston_log_continue(const char *fmt, ...)
 	__attribute__ ((format (printf, 1, 2)));
 
+enum weston_log_level {
+	WESTON_LOG_LEVEL_ERROR,
+	WESTON_LOG_LEVEL_WARNING,
+	WESTON_LOG_LEVEL_INFO,
+	WESTON_LOG_LEVEL_DEBUG,
+};
+
+struct weston_log_scope;
+
+/** Receives every message of a log scope, formatted */
+struct weston_log_subscriber {
+	void (*write)(struct weston_log_subscriber *sub,
+		      const char *data, size_t len);
+	struct wl_list link;
+};
+
+struct weston_log_scope *
+weston_log_scope_get(const char *name);
+const char *
+weston_log_scope_get_name(struct weston_log_scope *scope);
+struct weston_log_scope *
+weston_log_scope_iterate(struct weston_log_scope *scope);
+bool
+weston_log_scope_has_subscribers(struct weston_log_scope *scope);
+void
+weston_log_scope_add_subscriber(struct weston_log_scope *scope,
+				struct weston_log_subscriber *sub);
+void
+weston_log_scope_remove_subscriber(struct weston_log_scope *scope,
+				   struct weston_log_subscriber *sub);
+void
+weston_log_scope_add_subscription_listener(struct weston_log_scope *scope,
+					   struct wl_listener *listener);
+void
+weston_log_scope_write(struct weston_log_scope *scope,
+		       const char *data, size_t len);
+bool
+weston_log_scope_is_enabled(struct weston_log_scope *scope,
+			    enum weston_log_level level);
+int
+weston_log_scopes_configure(const char *spec);
+void
+weston_log_set_debug_all(bool enable);
+bool
+weston_log_get_debug_all(void);
+void
+weston_log_scopes_destroy(void);
+int
+weston_log_scope_vprintf(struct weston_log_scope *scope,
+			 enum weston_log_level level,
+			 const char *fmt, va_list ap);
+int
+weston_log_scope_vprintf_continue(struct weston_log_scope *scope,
+				  enum weston_log_level level,
+				  const char *fmt, va_list ap);
+int
+weston_log_scope_printf(struct weston_log_scope *scope,
+			enum weston_log_level level,
+			const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+int
+weston_compositor_enable_debug_protocol(struct weston_compositor *compositor);
+
 enum {
 	TTY_ENTER_VT,
 	TTY_LEAVE_VT
@@ -1752,6 +2597,12 @@ struct weston_recorder *
 weston_recorder_start(struct weston_output *output, const char *filename);
 void
 weston_recorder_stop(struct weston_recorder *recorder);
+struct weston_hw_recorder *
+weston_hw_recorder_start(struct weston_output *output, const char *basename);
+struct weston_hw_recorder *
+weston_hw_recorder_start_stream(struct weston_output *output);
+void
+weston_hw_recorder_stop(struct weston_hw_recorder *recorder);
 
 struct clipboard *
 clipboard_create(struct weston_seat *seat);
@@ -1797,6 +2648,14 @@ void
 weston_surface_set_color(struct weston_surface *surface,
 			 float red, float green, float blue, float alpha);
 
+struct weston_subsurface *
+weston_subsurface_create_internal(struct weston_surface *surface,
+				  struct weston_surface *parent);
+
+void
+weston_subsurface_set_position(struct weston_subsurface *sub,
+			       int32_t x, int32_t y);
+
 void
 weston_surface_destroy(struct weston_surface *surface);
 
@@ -1868,10 +2727,30 @@ weston_seat_set_keyboard_focus(struct weston_seat *seat,
 int
 weston_compositor_load_xwayland(struct weston_compositor *compositor);
 
+int
+weston_timeline_ring_open(struct weston_compositor *compositor,
+			  size_t size, int snapshot_seconds);
+
+int
+weston_timeline_ring_dump(void);
+
+void
+weston_startup_mark(const char *name);
+
+void
+weston_startup_add_time(const char *name, const struct timespec *since);
+
+void
+weston_startup_finish(struct weston_output *output);
+
 void
 weston_output_set_scale(struct weston_output *output,
 			int32_t scale);
 
+void
+weston_output_set_occluded_frame_rate(struct weston_output *output,
+				      int32_t rate);
+
 void
 weston_output_set_transform(struct weston_output *output,
 			    uint32_t transform);
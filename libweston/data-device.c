@@ -46,6 +46,19 @@ struct weston_drag {
 	struct wl_listener icon_destroy_listener;
 	int32_t dx, dy;
 	struct weston_keyboard_grab keyboard_grab;
+
+	/* Where picking is known to return focus_region_view */
+	pixman_region32_t focus_region;
+	struct weston_view *focus_region_view;
+	struct wl_listener focus_region_view_listener;
+	bool in_motion;
+
+	/* Motion is sent at most once per refresh of the focus output */
+	struct wl_event_source *motion_source;
+	bool motion_armed;
+	bool motion_pending;
+	uint32_t motion_time;
+	wl_fixed_t motion_x, motion_y;
 };
 
 struct weston_pointer_drag {
@@ -503,6 +516,9 @@ weston_drag_set_focus(struct weston_drag *drag,
 		return;
 	}
 
+	/* Coordinates of a held back motion belong to the old focus */
+	drag->motion_pending = false;
+
 	if (drag->focus_resource) {
 		wl_data_device_send_leave(drag->focus_resource);
 		wl_list_remove(&drag->focus_listener.link);
@@ -558,6 +574,183 @@ weston_drag_set_focus(struct weston_drag *drag,
 	drag->focus_resource = resource;
 }
 
+static void
+drag_clear_focus_region(struct weston_drag *drag)
+{
+	pixman_region32_clear(&drag->focus_region);
+	if (drag->focus_region_view)
+		wl_list_remove(&drag->focus_region_view_listener.link);
+	drag->focus_region_view = NULL;
+}
+
+static void
+destroy_drag_focus_region_view(struct wl_listener *listener, void *data)
+{
+	struct weston_drag *drag =
+		container_of(listener, struct weston_drag,
+			     focus_region_view_listener);
+
+	drag_clear_focus_region(drag);
+}
+
+static void
+drag_update_focus_region(struct weston_drag *drag,
+			 struct weston_compositor *compositor,
+			 struct weston_view *view)
+{
+	struct weston_view *above;
+	float fx, fy;
+	int32_t x, y;
+
+	drag_clear_focus_region(drag);
+
+	if (!view || (view->transform.enabled &&
+		      view->transform.matrix.type &
+		      ~WESTON_MATRIX_TRANSFORM_TRANSLATE))
+		return;
+
+	weston_view_to_global_float(view, 0, 0, &fx, &fy);
+	x = (int32_t) fx;
+	y = (int32_t) fy;
+	if (x != fx || y != fy)
+		return;
+
+	pixman_region32_intersect_rect(&drag->focus_region,
+				       &view->surface->input, 0, 0,
+				       view->surface->width,
+				       view->surface->height);
+	if (view->geometry.scissor_enabled)
+		pixman_region32_intersect(&drag->focus_region,
+					  &drag->focus_region,
+					  &view->geometry.scissor);
+	pixman_region32_translate(&drag->focus_region, x, y);
+
+	/* Anything stacked above that takes input could steal the pick;
+	 * the cursor and the drag icon never do. */
+	wl_list_for_each(above, &compositor->view_list, link) {
+		if (above == view)
+			break;
+		if (!pixman_region32_not_empty(&above->surface->input))
+			continue;
+		pixman_region32_subtract(&drag->focus_region,
+					 &drag->focus_region,
+					 &above->transform.boundingbox);
+	}
+
+	drag->focus_region_view = view;
+	drag->focus_region_view_listener.notify =
+		destroy_drag_focus_region_view;
+	wl_signal_add(&view->destroy_signal,
+		      &drag->focus_region_view_listener);
+}
+
+static struct weston_view *
+drag_pick_view(struct weston_drag *drag, struct weston_compositor *compositor,
+	       wl_fixed_t x, wl_fixed_t y, wl_fixed_t *sx, wl_fixed_t *sy)
+{
+	struct weston_view *view;
+
+	/* Repicks after scene changes come outside of motion and always
+	 * do the full lookup, which also refreshes the cached region. */
+	if (drag->in_motion && drag->focus_region_view &&
+	    !drag->focus_region_view->transform.dirty &&
+	    weston_view_is_mapped(drag->focus_region_view) &&
+	    pixman_region32_contains_point(&drag->focus_region,
+					   wl_fixed_to_int(x),
+					   wl_fixed_to_int(y), NULL)) {
+		view = drag->focus_region_view;
+		weston_view_from_global_fixed(view, x, y, sx, sy);
+		return view;
+	}
+
+	view = weston_compositor_pick_view(compositor, x, y, sx, sy);
+	drag_update_focus_region(drag, compositor, view);
+
+	return view;
+}
+
+static void
+drag_send_motion(struct weston_drag *drag)
+{
+	struct weston_output *output;
+	int32_t refresh = 0;
+
+	wl_data_device_send_motion(drag->focus_resource, drag->motion_time,
+				   drag->motion_x, drag->motion_y);
+	drag->motion_pending = false;
+
+	output = drag->focus->output;
+	if (output && output->current_mode)
+		refresh = output->current_mode->refresh;
+	if (refresh <= 0)
+		refresh = 60000;
+
+	/* refresh is in mHz */
+	wl_event_source_timer_update(drag->motion_source,
+				     MAX(1000000 / refresh, 1));
+	drag->motion_armed = true;
+}
+
+static int
+drag_motion_timer(void *data)
+{
+	struct weston_drag *drag = data;
+
+	drag->motion_armed = false;
+	if (drag->motion_pending && drag->focus_resource)
+		drag_send_motion(drag);
+
+	return 0;
+}
+
+static void
+drag_queue_motion(struct weston_drag *drag, uint32_t time,
+		  wl_fixed_t sx, wl_fixed_t sy)
+{
+	drag->motion_time = time;
+	drag->motion_x = sx;
+	drag->motion_y = sy;
+	drag->motion_pending = true;
+
+	if (!drag->motion_armed)
+		drag_send_motion(drag);
+}
+
+/* The target must see the last position before the drop */
+static void
+drag_flush_motion(struct weston_drag *drag)
+{
+	if (drag->motion_pending && drag->focus_resource)
+		wl_data_device_send_motion(drag->focus_resource,
+					   drag->motion_time,
+					   drag->motion_x, drag->motion_y);
+	drag->motion_pending = false;
+}
+
+static int
+weston_drag_init(struct weston_drag *drag, struct weston_compositor *compositor)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(compositor->wl_display);
+
+	drag->motion_source = wl_event_loop_add_timer(loop, drag_motion_timer,
+						      drag);
+	if (!drag->motion_source)
+		return -1;
+
+	pixman_region32_init(&drag->focus_region);
+
+	return 0;
+}
+
+static void
+weston_drag_fini(struct weston_drag *drag)
+{
+	drag_clear_focus_region(drag);
+	wl_event_source_remove(drag->motion_source);
+	pixman_region32_fini(&drag->focus_region);
+}
+
 static void
 drag_grab_focus(struct weston_pointer_grab *grab)
 {
@@ -567,9 +760,8 @@ drag_grab_focus(struct weston_pointer_grab *grab)
 	struct weston_view *view;
 	wl_fixed_t sx, sy;
 
-	view = weston_compositor_pick_view(pointer->seat->compositor,
-					   pointer->x, pointer->y,
-					   &sx, &sy);
+	view = drag_pick_view(&drag->base, pointer->seat->compositor,
+			      pointer->x, pointer->y, &sx, &sy);
 	if (drag->base.focus != view)
 		weston_drag_set_focus(&drag->base, pointer->seat, view, sx, sy);
 }
@@ -584,7 +776,9 @@ drag_grab_motion(struct weston_pointer_grab *grab, uint32_t time,
 	float fx, fy;
 	wl_fixed_t sx, sy;
 
+	drag->base.in_motion = true;
 	weston_pointer_move(pointer, event);
+	drag->base.in_motion = false;
 
 	if (drag->base.icon) {
 		fx = wl_fixed_to_double(pointer->x) + drag->base.dx;
@@ -598,7 +792,7 @@ drag_grab_motion(struct weston_pointer_grab *grab, uint32_t time,
 					      pointer->x, pointer->y,
 					      &sx, &sy);
 
-		wl_data_device_send_motion(drag->base.focus_resource, time, sx, sy);
+		drag_queue_motion(&drag->base, time, sx, sy);
 	}
 }
 
@@ -618,6 +812,7 @@ data_device_end_drag_grab(struct weston_drag *drag,
 	}
 
 	weston_drag_set_focus(drag, seat, NULL, 0, 0);
+	weston_drag_fini(drag);
 }
 
 static void
@@ -648,6 +843,7 @@ drag_grab_button(struct weston_pointer_grab *grab,
 		if (drag->base.focus_resource &&
 		    data_source->accepted &&
 		    data_source->current_dnd_action) {
+			drag_flush_motion(&drag->base);
 			wl_data_device_send_drop(drag->base.focus_resource);
 
 			if (wl_resource_get_version(data_source->resource) >=
@@ -740,8 +936,10 @@ drag_grab_touch_up(struct weston_touch_grab *grab,
 	if (touch_id != touch->grab_touch_id)
 		return;
 
-	if (touch_drag->base.focus_resource)
+	if (touch_drag->base.focus_resource) {
+		drag_flush_motion(&touch_drag->base);
 		wl_data_device_send_drop(touch_drag->base.focus_resource);
+	}
 	if (touch_drag->base.data_source)
 		wl_list_remove(&touch_drag->base.data_source_listener.link);
 	data_device_end_touch_drag_grab(touch_drag);
@@ -754,9 +952,9 @@ drag_grab_touch_focus(struct weston_touch_drag *drag)
 	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 
-	view = weston_compositor_pick_view(touch->seat->compositor,
-				touch->grab_x, touch->grab_y,
-				&view_x, &view_y);
+	view = drag_pick_view(&drag->base, touch->seat->compositor,
+			      touch->grab_x, touch->grab_y,
+			      &view_x, &view_y);
 	if (drag->base.focus != view)
 		weston_drag_set_focus(&drag->base, touch->seat,
 				view, view_x, view_y);
@@ -775,7 +973,9 @@ drag_grab_touch_motion(struct weston_touch_grab *grab, uint32_t time,
 	if (touch_id != touch->grab_touch_id)
 		return;
 
+	touch_drag->base.in_motion = true;
 	drag_grab_touch_focus(touch_drag);
+	touch_drag->base.in_motion = false;
 	if (touch_drag->base.icon) {
 		fx = wl_fixed_to_double(touch->grab_x) + touch_drag->base.dx;
 		fy = wl_fixed_to_double(touch->grab_y) + touch_drag->base.dy;
@@ -787,8 +987,7 @@ drag_grab_touch_motion(struct weston_touch_grab *grab, uint32_t time,
 		weston_view_from_global_fixed(touch_drag->base.focus,
 					touch->grab_x, touch->grab_y,
 					&view_x, &view_y);
-		wl_data_device_send_motion(touch_drag->base.focus_resource, time,
-					view_x, view_y);
+		drag_queue_motion(&touch_drag->base, time, view_x, view_y);
 	}
 }
 
@@ -903,6 +1102,11 @@ weston_pointer_start_drag(struct weston_pointer *pointer,
 	if (drag == NULL)
 		return -1;
 
+	if (weston_drag_init(&drag->base, pointer->seat->compositor) < 0) {
+		free(drag);
+		return -1;
+	}
+
 	drag->grab.interface = &pointer_drag_grab_interface;
 	drag->base.keyboard_grab.interface = &keyboard_drag_grab_interface;
 	drag->base.client = client;
@@ -911,6 +1115,7 @@ weston_pointer_start_drag(struct weston_pointer *pointer,
 	if (icon) {
 		drag->base.icon = weston_view_create(icon);
 		if (drag->base.icon == NULL) {
+			weston_drag_fini(&drag->base);
 			free(drag);
 			return -1;
 		}
@@ -965,6 +1170,11 @@ weston_touch_start_drag(struct weston_touch *touch,
 	if (drag == NULL)
 		return -1;
 
+	if (weston_drag_init(&drag->base, touch->seat->compositor) < 0) {
+		free(drag);
+		return -1;
+	}
+
 	drag->grab.interface = &touch_drag_grab_interface;
 	drag->base.client = client;
 	drag->base.data_source = source;
@@ -972,6 +1182,7 @@ weston_touch_start_drag(struct weston_touch *touch,
 	if (icon) {
 		drag->base.icon = weston_view_create(icon);
 		if (drag->base.icon == NULL) {
+			weston_drag_fini(&drag->base);
 			free(drag);
 			return -1;
 		}
@@ -35,32 +35,209 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <inttypes.h>
 #include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 
 #include "gl-renderer.h"
+#include "timeline.h"
 #include "vertex-clipping.h"
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
+#include "linux-explicit-synchronization.h"
 
 #include "shared/helpers.h"
 #include "shared/platform.h"
+#include "shared/timespec-util.h"
 #include "weston-egl-ext.h"
 
+/* What a fragment shader samples, and how it turns it into a colour */
+enum gl_shader_texture_variant {
+	SHADER_VARIANT_NONE = 0,
+	SHADER_VARIANT_RGBX,
+	SHADER_VARIANT_RGBA,
+	SHADER_VARIANT_BGRX,	/* red and blue swapped, for 10 bpc XRGB */
+	SHADER_VARIANT_BGRA,
+	SHADER_VARIANT_Y_U_V,
+	SHADER_VARIANT_Y_UV,
+	SHADER_VARIANT_Y_XUXV,
+	SHADER_VARIANT_SOLID,
+	SHADER_VARIANT_EXTERNAL,
+	SHADER_VARIANT_COUNT
+};
+
+/* Specialisations of each variant, compiled in rather than branched on */
+#define SHADER_FLAG_NO_VIEW_ALPHA	(1 << 0) /* view alpha is 1.0 */
+#define SHADER_FLAG_DEBUG		(1 << 1) /* green tint, see KEY_S */
+#define SHADER_FLAG_DIM			(1 << 2) /* view dim is not 0 */
+#define SHADER_FLAG_COUNT		(1 << 3)
+
+#define SHADER_KEY_COUNT (SHADER_VARIANT_COUNT * SHADER_FLAG_COUNT)
+
 struct gl_shader {
 	GLuint program;
 	GLuint vertex_shader, fragment_shader;
 	GLint proj_uniform;
 	GLint tex_uniforms[3];
 	GLint alpha_uniform;
+	GLint dim_uniform;
 	GLint color_uniform;
-	const char *vertex_source, *fragment_source;
 };
 
+/* Tokens and entry points of GL_OES_get_program_binary, used to keep
+ * linked shader programs on disk across restarts. */
+#ifndef GL_OES_get_program_binary
+#define GL_PROGRAM_BINARY_LENGTH_OES		0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS_OES	0x87FE
+
+typedef void (GL_APIENTRYP PFNGLGETPROGRAMBINARYOESPROC)
+	(GLuint program, GLsizei bufSize, GLsizei *length,
+	 GLenum *binaryFormat, void *binary);
+typedef void (GL_APIENTRYP PFNGLPROGRAMBINARYOESPROC)
+	(GLuint program, GLenum binaryFormat, const void *binary,
+	 GLint length);
+#endif
+
+/* Header of the program binaries in the shader cache directory */
+#define SHADER_CACHE_MAGIC 0x57535043 /* "WSPC" */
+
+struct gl_shader_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+};
+
+/* GL_EXT_texture_type_2_10_10_10_REV, for 10 bits per channel wl_shm
+ * buffers uploaded as they are */
+#ifndef GL_EXT_texture_type_2_10_10_10_REV
+#define GL_UNSIGNED_INT_2_10_10_10_REV_EXT	0x8368
+#endif
+
 #define BUFFER_DAMAGE_COUNT 2
 
+/* Timer queries in flight per output. Results are only read back once
+ * available, which normally takes a frame or two. */
+#define GPU_TIMER_QUERY_COUNT 3
+
+/* Tokens and entry points from OpenGL ES 3.0, used for streaming wl_shm
+ * uploads through pixel buffer objects. Only the GLES2 headers are
+ * included, so the functions are resolved with eglGetProcAddress. */
+#ifndef GL_ES_VERSION_3_0
+typedef struct __GLsync *GLsync;
+typedef khronos_uint64_t GLuint64;
+
+#define GL_PIXEL_PACK_BUFFER			0x88EB
+#define GL_PIXEL_UNPACK_BUFFER			0x88EC
+#define GL_STREAM_DRAW				0x88E0
+#define GL_STREAM_READ				0x88E1
+#define GL_MAP_READ_BIT				0x0001
+#define GL_MAP_WRITE_BIT			0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT		0x0008
+#define GL_MAP_UNSYNCHRONIZED_BIT		0x0020
+#define GL_SYNC_GPU_COMMANDS_COMPLETE		0x9117
+#define GL_TIMEOUT_EXPIRED			0x911B
+#define GL_WAIT_FAILED				0x911D
+#endif
+
+typedef void *(*gl_map_buffer_range_func_t)(GLenum target, GLintptr offset,
+					    GLsizeiptr length,
+					    GLbitfield access);
+typedef GLboolean (*gl_unmap_buffer_func_t)(GLenum target);
+typedef GLsync (*gl_fence_sync_func_t)(GLenum condition, GLbitfield flags);
+typedef GLenum (*gl_client_wait_sync_func_t)(GLsync sync, GLbitfield flags,
+					     GLuint64 timeout);
+typedef void (*gl_delete_sync_func_t)(GLsync sync);
+
+/* GL_EXT_texture_storage, for allocating wl_shm textures once */
+typedef void (*gl_tex_storage_2d_func_t)(GLenum target, GLsizei levels,
+					 GLenum internalformat,
+					 GLsizei width, GLsizei height);
+#ifndef GL_BGRA8_EXT
+#define GL_BGRA8_EXT				0x93A1
+#endif
+#ifndef GL_RGBA8_OES
+#define GL_RGBA8_OES				0x8058
+#endif
+#ifndef GL_RGB10_A2_EXT
+#define GL_RGB10_A2_EXT				0x8059
+#endif
+#ifndef GL_LUMINANCE8_EXT
+#define GL_LUMINANCE8_EXT			0x8040
+#endif
+#ifndef GL_LUMINANCE8_ALPHA8_EXT
+#define GL_LUMINANCE8_ALPHA8_EXT		0x8045
+#endif
+
+/* Textures of destroyed or resized wl_shm surfaces are kept for reuse
+ * up to this many bytes, the least recently released dropped first. */
+#define TEXTURE_POOL_MAX_BYTES (32 * 1024 * 1024)
+
+/* An unused texture in gl_renderer::texture_pool, with storage of the
+ * given size and format */
+struct gl_pooled_texture {
+	struct wl_list link;
+	GLuint tex;
+	GLsizei width, height;
+	GLenum format;
+	GLenum type;
+};
+
+/* Number of pixel buffer objects cycled through for wl_shm uploads. A
+ * slot is only reused once the GPU has signalled its fence, so the
+ * compositor never waits for a previous transfer to complete. */
+#define UPLOAD_SLOT_COUNT 4
+
+/* Above this many damage rectangles, or when the rectangles cover most
+ * of their bounding box, upload the bounding box in one go instead. */
+#define UPLOAD_MAX_RECTS 16
+
+struct gl_upload_slot {
+	GLuint pbo;
+	GLsizeiptr size;
+	GLsync fence;
+};
+
+/* How often to check a read back fence when the driver cannot give us
+ * a native fence fd to wait on from the event loop. */
+#define READBACK_POLL_INTERVAL_MS 1
+
+/* An asynchronous read back of output pixels into a pixel buffer object.
+ * The GPU completes them in submission order, and so do we. */
+struct gl_readback {
+	struct gl_renderer *renderer;
+	struct weston_output *output; /* NULL for surface captures */
+	struct wl_list link; /* gl_output_state::readbacks or
+			      * gl_renderer::captures */
+	GLuint pbo;
+	GLsizeiptr size;
+	int fence_fd; /* -1 if not available */
+	struct wl_event_source *fence_source;
+	GLsync fence; /* polled when there is no fence fd */
+	weston_read_pixels_done_func_t done;
+	void *data;
+};
+
+/* Surface contents are drawn into one of these to be read back. The
+ * most recently used come first, and only this many are kept. */
+#define CAPTURE_FBO_CACHE_SIZE 4
+
+struct gl_capture_fbo {
+	struct wl_list link; /* gl_renderer::capture_fbos */
+	GLuint fbo;
+	GLuint tex;
+	int width, height;
+};
+
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
 	BORDER_TOP_DIRTY = 1 << GL_RENDERER_BORDER_TOP,
@@ -78,6 +255,25 @@ struct gl_border_image {
 	void *data;
 };
 
+/* Frames the repaint debug overlay counts repaints over */
+#define REPAINT_HEAT_FRAMES 60
+/* Size of the squares repaints are counted in, in global pixels */
+#define REPAINT_HEAT_CELL 16
+/* Number of colors between rarely and always repainted */
+#define REPAINT_HEAT_LEVELS 8
+
+/* What the repaint debug overlay knows about an output's last frames */
+struct gl_repaint_heat {
+	pixman_region32_t frames[REPAINT_HEAT_FRAMES];
+	int next;
+	int32_t x, y;		/* global position of the first cell */
+	int width, height;	/* in cells */
+	uint8_t *counts;	/* frames each cell was repainted in */
+};
+
+struct gl_render_thread;
+struct gl_frame;
+
 struct gl_output_state {
 	EGLSurface egl_surface;
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
@@ -87,13 +283,53 @@ struct gl_output_state {
 	enum gl_border_status border_status;
 
 	struct weston_matrix output_matrix;
+
+	GLuint timer_queries[GPU_TIMER_QUERY_COUNT];
+	bool timer_query_busy[GPU_TIMER_QUERY_COUNT];
+	int timer_query_next;
+
+	/* GPU timestamps of the start of the timed frames, and the MSC
+	 * they were repainted at, for the timeline */
+	GLuint timestamp_queries[GPU_TIMER_QUERY_COUNT];
+	bool timestamp_busy[GPU_TIMER_QUERY_COUNT];
+	uint64_t timestamp_msc[GPU_TIMER_QUERY_COUNT];
+
+	/* Timeline clock minus GPU clock, and when that was measured */
+	int64_t gpu_clock_offset;
+	struct timespec gpu_clock_time;
+
+	struct wl_list readbacks;
+	struct wl_event_source *readback_timer;
+
+	/* While the output is zoomed, the unzoomed scene, repainted where
+	 * damaged and magnified onto the output from there */
+	struct {
+		GLuint fbo;
+		GLuint tex;
+		int width, height;
+	} zoom;
+
+	/* Size of the EGL surface when the output renders below the
+	 * resolution of its mode and the backend scales it up, else 0 */
+	int32_t render_width, render_height;
+
+	/* Only while the repaint debug overlay is on */
+	struct gl_repaint_heat *heat;
+
+	/* Draws the frames of this output when it has one, see
+	 * gl_renderer_output_create_render_thread() */
+	struct gl_render_thread *thread;
+	/* While the views are taken down for it, the frame of the thread */
+	struct gl_frame *record;
 };
 
 enum buffer_type {
 	BUFFER_TYPE_NULL,
 	BUFFER_TYPE_SOLID, /* internal solid color surfaces without a buffer */
 	BUFFER_TYPE_SHM,
-	BUFFER_TYPE_EGL
+	BUFFER_TYPE_EGL,
+	BUFFER_TYPE_COPY, /* internal surfaces showing a scaled copy */
+	BUFFER_TYPE_IMAGE /* internal surfaces showing a pixman image */
 };
 
 struct gl_renderer;
@@ -110,6 +346,20 @@ enum import_type {
 	IMPORT_TYPE_GL_CONVERSION
 };
 
+/* The EGLImages of a wl_drm or other EGL buffer, kept until the buffer
+ * is destroyed: clients cycle through a few of them, and importing one
+ * again on every attach is expensive on some drivers. */
+struct egl_buffer_image {
+	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	struct wl_list link;	/* gl_renderer::egl_buffer_images */
+
+	int num_planes;
+	struct egl_image *images[3];	/* NULL for planes that failed */
+	GLenum target;
+	enum gl_shader_texture_variant shader_variant;
+};
+
 struct dmabuf_image {
 	struct linux_dmabuf_buffer *dmabuf;
 	int num_images;
@@ -118,7 +368,7 @@ struct dmabuf_image {
 
 	enum import_type import_type;
 	GLenum target;
-	struct gl_shader *shader;
+	enum gl_shader_texture_variant shader_variant;
 };
 
 struct yuv_plane_descriptor {
@@ -138,12 +388,12 @@ struct yuv_format_descriptor {
 
 struct gl_surface_state {
 	GLfloat color[4];
-	struct gl_shader *shader;
+	enum gl_shader_texture_variant shader_variant;
 
 	GLuint textures[3];
 	int num_textures;
 	bool needs_full_upload;
-	pixman_region32_t texture_damage;
+	pixman_region32_t texture_damage; /* buffer coordinates */
 
 	/* These are only used by SHM surfaces to detect when we need
 	 * to do a full upload to specify a new internal texture
@@ -155,7 +405,13 @@ struct gl_surface_state {
 	GLenum target;
 	int num_images;
 
+	/* The textures came from gl_renderer::texture_pool, with storage
+	 * of pooled_width x pooled_height in gl_format, and go back to it */
+	bool textures_pooled;
+	GLsizei pooled_width[3], pooled_height[3];
+
 	struct weston_buffer_reference buffer_ref;
+	struct weston_buffer_release_reference buffer_release_ref;
 	enum buffer_type buffer_type;
 	int pitch; /* in pixels */
 	int height; /* in pixels */
@@ -168,6 +424,14 @@ struct gl_surface_state {
 
 	struct weston_surface *surface;
 
+	/* gl_renderer::evict_list, least recently shown first; not linked
+	 * while evicted or not a wl_shm surface */
+	struct wl_list evict_link;
+	struct timespec shown_time;
+	/* Contents of the freed textures, pitch x height RGBA, while
+	 * evicted */
+	void *evicted_pixels;
+
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
@@ -176,8 +440,10 @@ struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
 	int fan_debug;
+	int repaint_debug;
 	struct weston_binding *fragment_binding;
 	struct weston_binding *fan_binding;
+	struct weston_binding *repaint_debug_binding;
 
 	EGLDisplay egl_display;
 	EGLContext egl_context;
@@ -187,11 +453,13 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
 	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
 	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+	PFNEGLSETDAMAGEREGIONKHRPROC set_damage_region;
 	PFNEGLCREATEPLATFORMWINDOWSURFACEEXTPROC create_platform_window;
 
 	int has_unpack_subimage;
@@ -200,6 +468,7 @@ struct gl_renderer {
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
 	int has_bind_display;
+	struct wl_list egl_buffer_images;
 
 	int has_egl_image_external;
 
@@ -212,21 +481,153 @@ struct gl_renderer {
 	int has_dmabuf_import;
 	struct wl_list dmabuf_images;
 
-	int has_gl_texture_rg;
+	int has_dmabuf_import_modifiers;
+	PFNEGLQUERYDMABUFFORMATSEXTPROC query_dmabuf_formats;
+	PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_dmabuf_modifiers;
 
-	struct gl_shader texture_shader_rgba;
-	struct gl_shader texture_shader_rgbx;
-	struct gl_shader texture_shader_egl_external;
-	struct gl_shader texture_shader_y_uv;
-	struct gl_shader texture_shader_y_u_v;
-	struct gl_shader texture_shader_y_xuxv;
-	struct gl_shader invert_color_shader;
-	struct gl_shader solid_shader;
+	int has_gl_texture_rg;
+	int has_texture_type_2_10_10_10_rev;
+
+	int has_disjoint_timer_query;
+	PFNGLGENQUERIESEXTPROC gen_queries;
+	PFNGLDELETEQUERIESEXTPROC delete_queries;
+	PFNGLBEGINQUERYEXTPROC begin_query;
+	PFNGLENDQUERYEXTPROC end_query;
+	PFNGLGETQUERYOBJECTIVEXTPROC get_query_object_iv;
+	PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_object_ui64v;
+
+	int has_gpu_timestamps;
+	PFNGLQUERYCOUNTEREXTPROC query_counter;
+	PFNGLGETINTEGER64VEXTPROC get_integer64v;
+
+	gl_tex_storage_2d_func_t tex_storage_2d;
+	struct wl_list texture_pool; /* gl_pooled_texture::link */
+	uint64_t texture_pool_bytes;
+
+	int has_pbo;
+	gl_map_buffer_range_func_t map_buffer_range;
+	gl_unmap_buffer_func_t unmap_buffer;
+	gl_fence_sync_func_t fence_sync;
+	gl_client_wait_sync_func_t client_wait_sync;
+	gl_delete_sync_func_t delete_sync;
+	struct gl_upload_slot upload_slots[UPLOAD_SLOT_COUNT];
+	int upload_next;
+
+	struct wl_list capture_fbos; /* gl_capture_fbo::link */
+	struct wl_list captures; /* gl_readback::link, of surfaces */
+	struct wl_event_source *capture_timer;
+
+	int has_native_fence_sync;
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_native_fence_fd;
+
+	int has_wait_sync;
+	PFNEGLWAITSYNCKHRPROC wait_sync;
+
+	/* Compiled on first use, indexed by variant and flags */
+	struct gl_shader *shaders[SHADER_KEY_COUNT];
 	struct gl_shader *current_shader;
 
+	int has_program_binary;
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	char *shader_cache_dir; /* NULL if programs are not kept */
+	uint64_t shader_cache_salt; /* identifies the driver */
+
 	struct wl_signal destroy_signal;
 
 	struct wl_listener output_destroy_listener;
+
+	/* Textures of wl_shm surfaces not shown for this long are freed;
+	 * 0 disables eviction. */
+	int32_t evict_timeout_msec;
+	struct wl_list evict_list;
+	struct wl_event_source *evict_timer;
+	/* epoll fd watching the memory pressure trigger, or -1 */
+	int pressure_fd;
+	struct wl_event_source *pressure_source;
+
+	struct wl_list render_threads; /* gl_render_thread::link */
+};
+
+/* The state a batch of triangle fans is drawn with */
+struct gl_draw_state {
+	enum gl_shader_texture_variant variant;
+	uint32_t flags;
+	GLfloat color[4];
+	GLfloat alpha;
+	GLfloat dim;
+	bool blend;
+	GLenum target;
+	int num_textures;
+	GLuint textures[3];
+	GLint filter;
+};
+
+/* A draw taken down for a render thread. The fans are in the vertices
+ * and vtxcnt of the frame. */
+struct gl_draw_op {
+	struct gl_draw_state state;
+	/* Acquire fence of a client buffer to wait for first, or
+	 * EGL_NO_SYNC_KHR */
+	EGLSyncKHR acquire;
+	int first_vertex;
+	int first_fan, nfans;
+	/* Rectangles to clear to state.color instead of drawing fans */
+	int first_clear, nclears;
+};
+
+/* What a render thread needs to draw a frame of its output, taken from
+ * the scene on the main thread; nothing in here points back into it. */
+struct gl_frame {
+	/* Set by the thread when it could make the output current */
+	bool bound;
+	EGLint buffer_age;
+
+	/* Work of the main context the draws depend on, such as texture
+	 * uploads, or EGL_NO_SYNC_KHR */
+	EGLSyncKHR uploads;
+	GLint viewport[4];
+	GLfloat projection[16];
+	struct wl_array ops;		/* struct gl_draw_op */
+	struct wl_array vertices;	/* GLfloat x, y, s, t */
+	struct wl_array vtxcnt;		/* unsigned int per fan */
+	struct wl_array clears;		/* GLint x, y, width, height */
+	/* The draw items of the output, for the release fences */
+	struct wl_array items;
+	EGLint *damage_rects, n_damage_rects;
+	EGLint *swap_rects, n_swap_rects;
+	uint64_t pixels;
+
+	/* Results */
+	EGLBoolean swapped;
+	int fence_fd;	/* after the draws, or -1 */
+};
+
+/* A thread with its own context, sharing textures with the renderer's,
+ * that draws the frames of one output. It runs one job at a time. */
+struct gl_render_thread {
+	struct gl_renderer *renderer;
+	struct wl_list link; /* gl_renderer::render_threads */
+	EGLSurface surface;
+	EGLContext context;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	void (*job)(struct gl_render_thread *rt); /* NULL when idle */
+	bool quit;
+
+	/* Programs hold their uniforms, so the thread has its own */
+	struct gl_shader *shaders[SHADER_KEY_COUNT];
+	struct gl_shader *current_shader;
+	struct wl_array indices;
+
+	struct gl_frame frame;
+	/* Drawn or being drawn, gl_renderer_output_finish_frame() not
+	 * called yet */
+	bool frame_pending;
 };
 
 static PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
@@ -250,6 +651,24 @@ get_output_state(struct weston_output *output)
 static int
 gl_renderer_create_surface(struct weston_surface *surface);
 
+static void
+gl_surface_restore(struct gl_renderer *gr, struct gl_surface_state *gs);
+
+static void
+gl_surface_drop_evicted(struct gl_surface_state *gs);
+
+static void
+output_mark_views_shown(struct weston_output *output);
+
+static bool
+output_is_render_scaled(struct weston_output *output);
+
+static EGLint *
+output_damage_to_egl_rects(struct weston_output *output,
+			   pixman_region32_t *damage,
+			   enum gl_border_status border_status,
+			   EGLint *nrects, uint64_t *pixels);
+
 static inline struct gl_surface_state *
 get_surface_state(struct weston_surface *surface)
 {
@@ -374,10 +793,57 @@ gl_renderer_print_egl_error_state(void)
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define min(a, b) (((a) > (b)) ? (b) : (a))
 
+/* A surface rectangle transformed into global coordinates, computed
+ * once per surface rectangle rather than once per clip rectangle. */
+struct gl_quad {
+	struct polygon8 polygon;
+	GLfloat min_x, max_x, min_y, max_y;
+	bool axis_aligned;
+};
+
+static void
+gl_quad_init(struct gl_quad *quad, struct weston_view *ev,
+	     pixman_box32_t *surf_rect)
+{
+	struct polygon8 *surf = &quad->polygon;
+	float xy[4][2] = {
+		{ surf_rect->x1, surf_rect->y1 },
+		{ surf_rect->x2, surf_rect->y1 },
+		{ surf_rect->x2, surf_rect->y2 },
+		{ surf_rect->x1, surf_rect->y2 },
+	};
+	int i;
+
+	/* transform surface to screen space: */
+	weston_view_to_global_points(ev, &xy[0][0], 4);
+
+	for (i = 0; i < 4; i++) {
+		surf->x[i] = xy[i][0];
+		surf->y[i] = xy[i][1];
+	}
+	surf->n = 4;
+
+	/* find bounding box: */
+	quad->min_x = quad->max_x = surf->x[0];
+	quad->min_y = quad->max_y = surf->y[0];
+
+	for (i = 1; i < surf->n; i++) {
+		quad->min_x = min(quad->min_x, surf->x[i]);
+		quad->max_x = max(quad->max_x, surf->x[i]);
+		quad->min_y = min(quad->min_y, surf->y[i]);
+		quad->max_y = max(quad->max_y, surf->y[i]);
+	}
+
+	/* Scaled, flipped or quarter turned surfaces stay rectangles
+	 * whose edges are parallel to the clip rectangle edges. */
+	quad->axis_aligned = !ev->transform.enabled ||
+			     polygon8_is_axis_aligned(surf);
+}
+
 /*
  * Compute the boundary vertices of the intersection of the global coordinate
- * aligned rectangle 'rect', and an arbitrary quadrilateral produced from
- * 'surf_rect' when transformed from surface coordinates into global coordinates.
+ * aligned rectangle 'rect', and an arbitrary quadrilateral 'quad', a surface
+ * rectangle transformed from surface coordinates into global coordinates.
  * The vertices are written to 'ex' and 'ey', and the return value is the
  * number of vertices. Vertices are produced in clockwise winding order.
  * Guarantees to produce either zero vertices, or 3-8 vertices with non-zero
@@ -385,51 +851,30 @@ gl_renderer_print_egl_error_state(void)
  */
 static int
 calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
-		pixman_box32_t *surf_rect, GLfloat *ex, GLfloat *ey)
+		const struct gl_quad *quad, GLfloat *ex, GLfloat *ey)
 {
 
 	struct clip_context ctx;
-	int i, n;
-	GLfloat min_x, max_x, min_y, max_y;
-	struct polygon8 surf = {
-		{ surf_rect->x1, surf_rect->x2, surf_rect->x2, surf_rect->x1 },
-		{ surf_rect->y1, surf_rect->y1, surf_rect->y2, surf_rect->y2 },
-		4
-	};
+	int n;
+	struct polygon8 surf = quad->polygon;
 
 	ctx.clip.x1 = rect->x1;
 	ctx.clip.y1 = rect->y1;
 	ctx.clip.x2 = rect->x2;
 	ctx.clip.y2 = rect->y2;
 
-	/* transform surface to screen space: */
-	for (i = 0; i < surf.n; i++)
-		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
-					    &surf.x[i], &surf.y[i]);
-
-	/* find bounding box: */
-	min_x = max_x = surf.x[0];
-	min_y = max_y = surf.y[0];
-
-	for (i = 1; i < surf.n; i++) {
-		min_x = min(min_x, surf.x[i]);
-		max_x = max(max_x, surf.x[i]);
-		min_y = min(min_y, surf.y[i]);
-		max_y = max(max_y, surf.y[i]);
-	}
-
 	/* First, simple bounding box check to discard early transformed
 	 * surface rects that do not intersect with the clip region:
 	 */
-	if ((min_x >= ctx.clip.x2) || (max_x <= ctx.clip.x1) ||
-	    (min_y >= ctx.clip.y2) || (max_y <= ctx.clip.y1))
+	if ((quad->min_x >= ctx.clip.x2) || (quad->max_x <= ctx.clip.x1) ||
+	    (quad->min_y >= ctx.clip.y2) || (quad->max_y <= ctx.clip.y1))
 		return 0;
 
 	/* Simple case, bounding box edges are parallel to surface edges,
 	 * there will be only four edges.  We just need to clip the surface
 	 * vertices to the clip rect bounds:
 	 */
-	if (!ev->transform.enabled)
+	if (quad->axis_aligned)
 		return clip_simple(&ctx, &surf, ex, ey);
 
 	/* Transformed case: use a general polygon clipping algorithm to
@@ -506,11 +951,22 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
+	struct gl_quad *quads;
 	int i, j, k, nrects, nsurf, raw_nrects;
 	bool used_band_compression;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
 	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
 
+	if (nsurf == 0)
+		return 0;
+
+	quads = malloc(nsurf * sizeof *quads);
+	if (!quads)
+		return 0;
+
+	for (j = 0; j < nsurf; j++)
+		gl_quad_init(&quads[j], ev, &surf_rects[j]);
+
 	if (raw_nrects < 4) {
 		used_band_compression = false;
 		nrects = raw_nrects;
@@ -531,9 +987,8 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
 		for (j = 0; j < nsurf; j++) {
-			pixman_box32_t *surf_rect = &surf_rects[j];
-			GLfloat sx, sy, bx, by;
 			GLfloat ex[8], ey[8];          /* edge points in screen space */
+			GLfloat xy[8][2];
 			int n;
 
 			/* The transformed surface, after clipping to the clip region,
@@ -550,26 +1005,31 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 			 * form the intersection of the clip rect and the transformed
 			 * surface.
 			 */
-			n = calculate_edges(ev, rect, surf_rect, ex, ey);
+			n = calculate_edges(ev, rect, &quads[j], ex, ey);
 			if (n < 3)
 				continue;
 
+			/* edge points back to buffer space, all at once: */
+			for (k = 0; k < n; k++) {
+				xy[k][0] = ex[k];
+				xy[k][1] = ey[k];
+			}
+			weston_view_from_global_points(ev, &xy[0][0], n);
+			weston_surface_to_buffer_points(ev->surface,
+							&xy[0][0], n);
+
 			/* emit edge points: */
 			for (k = 0; k < n; k++) {
-				weston_view_from_global_float(ev, ex[k], ey[k],
-							      &sx, &sy);
 				/* position: */
 				*(v++) = ex[k];
 				*(v++) = ey[k];
 				/* texcoord: */
-				weston_surface_to_buffer_float(ev->surface,
-							       sx, sy,
-							       &bx, &by);
-				*(v++) = bx * inv_width;
+				*(v++) = xy[k][0] * inv_width;
 				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
+					*(v++) = xy[k][1] * inv_height;
 				} else {
-					*(v++) = (gs->height - by) * inv_height;
+					*(v++) = (gs->height - xy[k][1]) *
+						 inv_height;
 				}
 			}
 
@@ -579,14 +1039,52 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 
 	if (used_band_compression)
 		free(rects);
+	free(quads);
 	return nvtx;
 }
 
+static struct gl_shader *
+gl_renderer_get_shader(struct gl_renderer *gr, struct gl_shader **shaders,
+		       enum gl_shader_texture_variant variant, uint32_t flags);
+
+static void
+shader_release(struct gl_shader *shader);
+
+/** Make the program for a shader variant current
+ *
+ * \param gr The renderer.
+ * \param variant What the program samples.
+ * \param flags SHADER_FLAG_* specialisations, the debug one is added
+ * here while fragment shader debugging is on.
+ * \return The shader, or NULL if it failed to build.
+ */
+static struct gl_shader *
+use_shader(struct gl_renderer *gr, enum gl_shader_texture_variant variant,
+	   uint32_t flags)
+{
+	struct gl_shader *shader;
+
+	if (gr->fragment_shader_debug)
+		flags |= SHADER_FLAG_DEBUG;
+
+	shader = gl_renderer_get_shader(gr, gr->shaders, variant, flags);
+	if (!shader)
+		return NULL;
+
+	if (gr->current_shader == shader)
+		return shader;
+	glUseProgram(shader->program);
+	gr->current_shader = shader;
+
+	return shader;
+}
+
 static void
 triangle_fan_debug(struct weston_view *view, int first, int count)
 {
 	struct weston_compositor *compositor = view->surface->compositor;
 	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_shader *shader, *previous;
 	int i;
 	GLushort *buffer;
 	GLushort *index;
@@ -614,14 +1112,75 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 		*index++ = first + i;
 	}
 
-	glUseProgram(gr->solid_shader.program);
-	glUniform4fv(gr->solid_shader.color_uniform, 1,
-			color[color_idx++ % ARRAY_LENGTH(color)]);
-	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
-	glUseProgram(gr->current_shader->program);
+	previous = gr->current_shader;
+	shader = use_shader(gr, SHADER_VARIANT_SOLID, 0);
+	if (shader) {
+		glUniform4fv(shader->color_uniform, 1,
+				color[color_idx++ % ARRAY_LENGTH(color)]);
+		glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
+	}
+	if (previous) {
+		glUseProgram(previous->program);
+		gr->current_shader = previous;
+	}
 	free(buffer);
 }
 
+/* Vertices addressable by the GLushort indices of a batch */
+#define BATCH_MAX_VERTICES 65536
+
+/** Draw the triangle fans of texture_region() in one call
+ *
+ * \param indices Scratch space for the index list.
+ * \param vtxcnt The number of vertices of each fan, which follow each
+ * other from the first vertex of the current attribute arrays.
+ * \param nfans The number of fans.
+ *
+ * Every fan is split into triangles of a single indexed triangle list,
+ * so a region made of many rectangles costs one draw call instead of
+ * one per rectangle. Falls back to a draw per fan when the vertices
+ * do not fit 16-bit indices.
+ */
+static void
+draw_triangle_fans(struct wl_array *indices, const unsigned int *vtxcnt,
+		   int nfans)
+{
+	unsigned int nvtx = 0, ntri = 0, j;
+	GLushort *index;
+	int i, first;
+
+	for (i = 0; i < nfans; i++) {
+		nvtx += vtxcnt[i];
+		ntri += vtxcnt[i] - 2;
+	}
+
+	index = NULL;
+	if (nvtx <= BATCH_MAX_VERTICES)
+		index = wl_array_add(indices, ntri * 3 * sizeof *index);
+
+	if (!index) {
+		for (i = 0, first = 0; i < nfans; i++) {
+			glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
+			first += vtxcnt[i];
+		}
+		return;
+	}
+
+	for (i = 0, first = 0; i < nfans; i++) {
+		for (j = 1; j + 1 < vtxcnt[i]; j++) {
+			*index++ = first;
+			*index++ = first + j;
+			*index++ = first + j + 1;
+		}
+		first += vtxcnt[i];
+	}
+
+	glDrawElements(GL_TRIANGLES, ntri * 3, GL_UNSIGNED_SHORT,
+		       indices->data);
+
+	indices->size = 0;
+}
+
 static void
 repaint_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
@@ -653,11 +1212,14 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
 	glEnableVertexAttribArray(1);
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
+	if (gr->fan_debug) {
+		for (i = 0, first = 0; i < nfans; i++) {
+			glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
 			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
+			first += vtxcnt[i];
+		}
+	} else {
+		draw_triangle_fans(&gr->indices, vtxcnt, nfans);
 	}
 
 	glDisableVertexAttribArray(1);
@@ -690,142 +1252,415 @@ use_output(struct weston_output *output)
 	return 0;
 }
 
-static int
-shader_init(struct gl_shader *shader, struct gl_renderer *gr,
-		   const char *vertex_source, const char *fragment_source);
-
-static void
-use_shader(struct gl_renderer *gr, struct gl_shader *shader)
-{
-	if (!shader->program) {
-		int ret;
-
-		ret =  shader_init(shader, gr,
-				   shader->vertex_source,
-				   shader->fragment_source);
-
-		if (ret < 0)
-			weston_log("warning: failed to compile shader\n");
-	}
-
-	if (gr->current_shader == shader)
-		return;
-	glUseProgram(shader->program);
-	gr->current_shader = shader;
-}
-
 static void
 shader_uniforms(struct gl_shader *shader,
-		struct weston_view *view,
-		struct weston_output *output)
+		const struct gl_draw_state *state,
+		const GLfloat *projection)
 {
 	int i;
-	struct gl_surface_state *gs = get_surface_state(view->surface);
-	struct gl_output_state *go = get_output_state(output);
 
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, projection);
+	glUniform4fv(shader->color_uniform, 1, state->color);
+	glUniform1f(shader->alpha_uniform, state->alpha);
+	glUniform1f(shader->dim_uniform, state->dim);
 
-	for (i = 0; i < gs->num_textures; i++)
+	for (i = 0; i < state->num_textures; i++)
 		glUniform1i(shader->tex_uniforms[i], i);
 }
 
 static void
-draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+bind_textures(const struct gl_draw_state *state)
 {
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(ev->surface);
-	/* repaint bounding region in global coordinates: */
-	pixman_region32_t repaint;
-	/* opaque region in surface coordinates: */
-	pixman_region32_t surface_opaque;
-	/* non-opaque region in surface coordinates: */
-	pixman_region32_t surface_blend;
-	GLint filter;
 	int i;
 
-	/* In case of a runtime switch of renderers, we may not have received
-	 * an attach for this surface since the switch. In that case we don't
-	 * have a valid buffer or a proper shader set up so skip rendering. */
-	if (!gs->shader)
-		return;
+	for (i = 0; i < state->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(state->target, state->textures[i]);
+		glTexParameteri(state->target, GL_TEXTURE_MIN_FILTER,
+				state->filter);
+		glTexParameteri(state->target, GL_TEXTURE_MAG_FILTER,
+				state->filter);
+	}
+}
 
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
+/* Note the part of a view in both regions down for the render thread,
+ * as repaint_region() would draw it */
+static void
+record_region(struct gl_frame *frame, struct weston_view *ev,
+	      const struct gl_draw_state *state,
+	      pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	size_t nops = frame->ops.size;
+	size_t nvertices = frame->vertices.size;
+	size_t nvtxcnt = frame->vtxcnt.size;
+	struct gl_draw_op *op;
+	void *vertices, *vtxcnt;
+	int nfans;
 
-	if (!pixman_region32_not_empty(&repaint))
+	nfans = texture_region(ev, region, surf_region);
+	if (nfans == 0)
 		goto out;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
+	op = wl_array_add(&frame->ops, sizeof *op);
+	vertices = wl_array_add(&frame->vertices, gr->vertices.size);
+	vtxcnt = wl_array_add(&frame->vtxcnt, gr->vtxcnt.size);
+	if (!op || !vertices || !vtxcnt) {
+		frame->ops.size = nops;
+		frame->vertices.size = nvertices;
+		frame->vtxcnt.size = nvtxcnt;
+		goto out;
 	}
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
+	op->state = *state;
+	if (gr->fragment_shader_debug)
+		op->state.flags |= SHADER_FLAG_DEBUG;
+	op->acquire = EGL_NO_SYNC_KHR;
+	op->first_vertex = nvertices / (4 * sizeof(GLfloat));
+	op->first_fan = nvtxcnt / sizeof(unsigned int);
+	op->nfans = nfans;
+	op->nclears = 0;
+	memcpy(vertices, gr->vertices.data, gr->vertices.size);
+	memcpy(vtxcnt, gr->vtxcnt.data, gr->vtxcnt.size);
 
-	if (ev->transform.enabled || output->zoom.active ||
-	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
-	else
-		filter = GL_NEAREST;
+out:
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+}
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+/* Draw the part of a view in both regions with the given state, or note
+ * it down when the output is recording a frame for its render thread */
+static void
+draw_region(struct weston_output *output, struct weston_view *ev,
+	    const struct gl_draw_state *state,
+	    pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_shader *shader;
+
+	if (go->record) {
+		record_region(go->record, ev, state, region, surf_region);
+		return;
 	}
 
-	/* blended region is whole surface minus opaque region: */
-	pixman_region32_init_rect(&surface_blend, 0, 0,
-				  ev->surface->width, ev->surface->height);
-	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_blend, &surface_blend,
-					  &ev->geometry.scissor);
-	pixman_region32_subtract(&surface_blend, &surface_blend,
-				 &ev->surface->opaque);
+	shader = use_shader(gr, state->variant, state->flags);
+	if (!shader)
+		return;
+	shader_uniforms(shader, state, go->output_matrix.d);
+	bind_textures(state);
 
-	/* XXX: Should we be using ev->transform.opaque here? */
-	pixman_region32_init(&surface_opaque);
-	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_opaque,
-					  &ev->surface->opaque,
-					  &ev->geometry.scissor);
+	if (state->blend)
+		glEnable(GL_BLEND);
 	else
-		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
-
-	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
-			/* Special case for RGBA textures with possibly
-			 * bad data in alpha channel: use the shader
-			 * that forces texture alpha = 1.0.
-			 * Xwayland surfaces need this.
-			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
-		}
+		glDisable(GL_BLEND);
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
+	repaint_region(ev, region, surf_region);
+}
 
-		repaint_region(ev, &repaint, &surface_opaque);
-	}
+/* Clear rectangles, in window coordinates, to a color */
+static void
+clear_rects(const GLfloat *color, const GLint *rects, int nrects)
+{
+	int i;
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+	glDisable(GL_BLEND);
+	glEnable(GL_SCISSOR_TEST);
+	glClearColor(color[0], color[1], color[2], color[3]);
+	for (i = 0; i < nrects; i++) {
+		glScissor(rects[4 * i], rects[4 * i + 1],
+			  rects[4 * i + 2], rects[4 * i + 3]);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	glDisable(GL_SCISSOR_TEST);
+}
+
+/* Note a clear down for the render thread */
+static void
+record_clear(struct gl_frame *frame, const GLfloat *color,
+	     const EGLint *rects, int nrects)
+{
+	size_t nops = frame->ops.size;
+	size_t nclears = frame->clears.size;
+	struct gl_draw_op *op;
+	GLint *clears;
+	int i;
+
+	op = wl_array_add(&frame->ops, sizeof *op);
+	clears = wl_array_add(&frame->clears, nrects * 4 * sizeof *clears);
+	if (!op || !clears) {
+		frame->ops.size = nops;
+		frame->clears.size = nclears;
+		return;
+	}
+
+	memset(op, 0, sizeof *op);
+	memcpy(op->state.color, color, sizeof op->state.color);
+	op->acquire = EGL_NO_SYNC_KHR;
+	op->first_clear = nclears / (4 * sizeof *clears);
+	op->nclears = nrects;
+	for (i = 0; i < nrects * 4; i++)
+		clears[i] = rects[i];
+}
+
+/* An opaque solid color view that is only moved, to a whole pixel,
+ * covers whole pixels of the framebuffer: clear its part of the repaint
+ * to the color rather than drawing it with the solid shader. Returns
+ * false if the view has to be drawn. */
+static bool
+draw_view_clear(const struct weston_draw_item *item,
+		struct weston_output *output,
+		pixman_region32_t *repaint) /* in global coordinates */
+{
+	struct weston_view *ev = item->view;
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_surface_state *gs = get_surface_state(item->surface);
+	struct gl_output_state *go = get_output_state(output);
+	pixman_region32_t region;
+	EGLint *rects, nrects;
+	uint64_t pixels;
+	GLfloat color[4];
+	int i;
+
+	if (gs->shader_variant != SHADER_VARIANT_SOLID ||
+	    gs->color[3] < 1.0f || item->alpha < 1.0f)
+		return false;
+
+	if (ev->transform.enabled ||
+	    ev->geometry.x != (int) ev->geometry.x ||
+	    ev->geometry.y != (int) ev->geometry.y)
+		return false;
+
+	/* Magnified or scaled rendering does not map global pixels to
+	 * framebuffer pixels one to one, and the debug modes want to see
+	 * the triangles */
+	if (output->zoom.active || output_is_render_scaled(output) ||
+	    gr->fan_debug || gr->fragment_shader_debug)
+		return false;
+
+	pixman_region32_init_rect(&region, 0, 0,
+				  item->surface->width, item->surface->height);
+	if (ev->geometry.scissor_enabled)
+		pixman_region32_intersect(&region, &region,
+					  &ev->geometry.scissor);
+	pixman_region32_translate(&region, ev->geometry.x, ev->geometry.y);
+	pixman_region32_intersect(&region, &region, repaint);
+
+	if (!pixman_region32_not_empty(&region)) {
+		pixman_region32_fini(&region);
+		return true;
+	}
+
+	rects = output_damage_to_egl_rects(output, &region, BORDER_STATUS_CLEAN,
+					   &nrects, &pixels);
+	pixman_region32_fini(&region);
+	if (!rects)
+		return false;
+
+	for (i = 0; i < 3; i++)
+		color[i] = gs->color[i] * (1.0f - item->dim);
+	color[3] = gs->color[3];
+
+	if (go->record)
+		record_clear(go->record, color, rects, nrects);
+	else
+		clear_rects(color, rects, nrects);
+
+	free(rects);
+
+	return true;
+}
+
+/* Make the GPU wait for the client's acquire fence before sampling the
+ * buffer. The wait is queued in the command stream, the CPU never
+ * blocks on it. With deferred set, the fence is returned there for a
+ * render thread to wait on instead, or EGL_NO_SYNC_KHR if there is
+ * none. */
+static int
+ensure_surface_buffer_is_ready(struct gl_renderer *gr,
+			       struct gl_surface_state *gs,
+			       EGLSyncKHR *deferred)
+{
+	EGLint attribs[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
+		-1,
+		EGL_NONE
+	};
+	struct weston_surface *surface = gs->surface;
+	EGLSyncKHR sync;
+	EGLint wait_ret;
+
+	if (deferred)
+		*deferred = EGL_NO_SYNC_KHR;
+
+	if (!gs->buffer_ref.buffer || surface->acquire_fence_fd < 0)
+		return 0;
+
+	/* Fences are only accepted when the protocol is advertised, which
+	 * needs both extensions. */
+	assert(gr->has_native_fence_sync && gr->has_wait_sync);
+
+	attribs[1] = dup(surface->acquire_fence_fd);
+	if (attribs[1] == -1) {
+		linux_explicit_synchronization_send_server_error(
+			surface->resource, "failed to dup acquire fence");
+		return -1;
+	}
+
+	/* EGL owns the fd from here on, if it succeeds */
+	sync = gr->create_sync(gr->egl_display,
+			       EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+	if (sync == EGL_NO_SYNC_KHR) {
+		close(attribs[1]);
+		linux_explicit_synchronization_send_server_error(
+			surface->resource, "failed to import acquire fence");
+		return -1;
+	}
+
+	if (deferred) {
+		*deferred = sync;
+		return 0;
+	}
+
+	wait_ret = gr->wait_sync(gr->egl_display, sync, 0);
+	gr->destroy_sync(gr->egl_display, sync);
+
+	if (wait_ret == EGL_FALSE) {
+		linux_explicit_synchronization_send_server_error(
+			surface->resource, "failed to wait on acquire fence");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+draw_view(const struct weston_draw_item *item, struct weston_output *output,
+	  pixman_region32_t *damage) /* in global coordinates */
+{
+	struct weston_view *ev = item->view;
+	struct weston_compositor *ec = item->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(item->surface);
+	struct gl_output_state *go = get_output_state(output);
+	/* repaint bounding region in global coordinates: */
+	pixman_region32_t repaint;
+	/* opaque region in surface coordinates: */
+	pixman_region32_t surface_opaque;
+	/* non-opaque region in surface coordinates: */
+	pixman_region32_t surface_blend;
+	struct gl_draw_state state;
+	struct gl_draw_op *op;
+	struct gl_shader *shader;
+	EGLSyncKHR acquire;
+	int i;
+
+	/* In case of a runtime switch of renderers, we may not have received
+	 * an attach for this surface since the switch. In that case we don't
+	 * have a valid buffer or a proper shader set up so skip rendering. */
+	if (gs->shader_variant == SHADER_VARIANT_NONE)
+		return;
+
+	pixman_region32_init_rect(&repaint, item->box.x1, item->box.y1,
+				  item->box.x2 - item->box.x1,
+				  item->box.y2 - item->box.y1);
+	pixman_region32_intersect(&repaint, &repaint, damage);
+	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
+
+	if (!pixman_region32_not_empty(&repaint))
+		goto out;
+
+	if (draw_view_clear(item, output, &repaint))
+		goto out;
+
+	gl_surface_restore(gr, gs);
+
+	if (!go->record) {
+		if (ensure_surface_buffer_is_ready(gr, gs, NULL) < 0)
+			goto out;
+	} else {
+		if (ensure_surface_buffer_is_ready(gr, gs, &acquire) < 0)
+			goto out;
+
+		op = NULL;
+		if (acquire != EGL_NO_SYNC_KHR)
+			op = wl_array_add(&go->record->ops, sizeof *op);
+		if (op) {
+			memset(op, 0, sizeof *op);
+			op->acquire = acquire;
+		} else if (acquire != EGL_NO_SYNC_KHR) {
+			gr->destroy_sync(gr->egl_display, acquire);
+			goto out;
+		}
+	}
+
+	state.variant = gs->shader_variant;
+	state.flags = item->alpha < 1.0 ? 0 : SHADER_FLAG_NO_VIEW_ALPHA;
+	if (item->dim > 0.0f)
+		state.flags |= SHADER_FLAG_DIM;
+	memcpy(state.color, gs->color, sizeof state.color);
+	state.alpha = item->alpha;
+	state.dim = item->dim;
+	state.target = gs->target;
+	state.num_textures = gs->num_textures;
+	for (i = 0; i < gs->num_textures; i++)
+		state.textures[i] = gs->textures[i];
+
+	if (ev->transform.enabled || (output->zoom.active && !go->zoom.fbo) ||
+	    output->current_scale != item->surface->buffer_viewport.buffer.scale ||
+	    output_is_render_scaled(output))
+		state.filter = GL_LINEAR;
+	else
+		state.filter = GL_NEAREST;
+
+	if (!go->record) {
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+		if (gr->fan_debug) {
+			shader = use_shader(gr, SHADER_VARIANT_SOLID, 0);
+			if (shader)
+				shader_uniforms(shader, &state,
+						go->output_matrix.d);
+		}
+	}
+
+	/* blended region is whole surface minus opaque region: */
+	pixman_region32_init_rect(&surface_blend, 0, 0,
+				  item->surface->width, item->surface->height);
+	if (ev->geometry.scissor_enabled)
+		pixman_region32_intersect(&surface_blend, &surface_blend,
+					  &ev->geometry.scissor);
+	pixman_region32_subtract(&surface_blend, &surface_blend,
+				 &item->surface->opaque);
+
+	/* XXX: Should we be using ev->transform.opaque here? */
+	pixman_region32_init(&surface_opaque);
+	if (ev->geometry.scissor_enabled)
+		pixman_region32_intersect(&surface_opaque,
+					  &item->surface->opaque,
+					  &ev->geometry.scissor);
+	else
+		pixman_region32_copy(&surface_opaque, &item->surface->opaque);
+
+	if (pixman_region32_not_empty(&surface_opaque)) {
+		/* Special case for RGBA textures with possibly
+		 * bad data in alpha channel: use the shader
+		 * that forces texture alpha = 1.0.
+		 * Xwayland surfaces need this.
+		 */
+		if (gs->shader_variant == SHADER_VARIANT_RGBA)
+			state.variant = SHADER_VARIANT_RGBX;
+		else if (gs->shader_variant == SHADER_VARIANT_BGRA)
+			state.variant = SHADER_VARIANT_BGRX;
+		state.blend = item->alpha < 1.0;
+
+		draw_region(output, ev, &state, &repaint, &surface_opaque);
+	}
+
+	if (pixman_region32_not_empty(&surface_blend)) {
+		state.variant = gs->shader_variant;
+		state.blend = true;
+		draw_region(output, ev, &state, &repaint, &surface_blend);
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -835,15 +1670,60 @@ out:
 	pixman_region32_fini(&repaint);
 }
 
+/* A view on a plane below the primary plane shows through where the
+ * primary plane is transparent, so clear its area to that, covering
+ * whatever lower views drew there. */
+static void
+draw_view_hole(const struct weston_draw_item *item,
+	       struct weston_output *output,
+	       pixman_region32_t *damage) /* in global coordinates */
+{
+	struct weston_view *ev = item->view;
+	struct gl_draw_state state = {
+		.variant = SHADER_VARIANT_SOLID,
+		.flags = SHADER_FLAG_NO_VIEW_ALPHA,
+		.color = { 0.0f, 0.0f, 0.0f, 0.0f },
+		.alpha = 1.0f,
+		.blend = false,
+	};
+	pixman_region32_t repaint;
+	pixman_region32_t surface_region;
+
+	pixman_region32_init_rect(&repaint, item->box.x1, item->box.y1,
+				  item->box.x2 - item->box.x1,
+				  item->box.y2 - item->box.y1);
+	pixman_region32_intersect(&repaint, &repaint, damage);
+	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
+
+	if (!pixman_region32_not_empty(&repaint))
+		goto out;
+
+	pixman_region32_init_rect(&surface_region, 0, 0,
+				  item->surface->width, item->surface->height);
+	if (ev->geometry.scissor_enabled)
+		pixman_region32_intersect(&surface_region, &surface_region,
+					  &ev->geometry.scissor);
+	draw_region(output, ev, &state, &repaint, &surface_region);
+	pixman_region32_fini(&surface_region);
+
+out:
+	pixman_region32_fini(&repaint);
+}
+
 static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
-	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_compositor *ec = output->compositor;
+	struct weston_draw_item *item;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	/* Only the views the core found to be visible: those of the
+	 * primary plane, and holes for those below it */
+	wl_array_for_each(item, &output->draw_items) {
+		if (item->plane == &ec->primary_plane)
+			draw_view(item, output, damage);
+		else
+			draw_view_hole(item, output, damage);
+	}
 }
 
 static void
@@ -931,7 +1811,7 @@ draw_output_borders(struct weston_output *output,
 {
 	struct gl_output_state *go = get_output_state(output);
 	struct gl_renderer *gr = get_renderer(output->compositor);
-	struct gl_shader *shader = &gr->texture_shader_rgba;
+	struct gl_shader *shader;
 	struct gl_border_image *top, *bottom, *left, *right;
 	struct weston_matrix matrix;
 	int full_width, full_height;
@@ -948,7 +1828,10 @@ draw_output_borders(struct weston_output *output,
 	full_height = output->current_mode->height + top->height + bottom->height;
 
 	glDisable(GL_BLEND);
-	use_shader(gr, shader);
+	shader = use_shader(gr, SHADER_VARIANT_RGBA,
+			    SHADER_FLAG_NO_VIEW_ALPHA);
+	if (!shader)
+		return;
 
 	glViewport(0, 0, full_width, full_height);
 
@@ -1016,25 +1899,35 @@ output_get_border_damage(struct weston_output *output,
 					   full_width, bottom->height);
 }
 
-static void
-output_get_damage(struct weston_output *output,
-		  pixman_region32_t *buffer_damage, uint32_t *border_damage)
+/* The age of the back buffer, 0 if unknown. Only the thread the
+ * surface is current to can ask. */
+static EGLint
+output_query_buffer_age(struct gl_renderer *gr, EGLSurface surface)
 {
-	struct gl_output_state *go = get_output_state(output);
-	struct gl_renderer *gr = get_renderer(output->compositor);
 	EGLint buffer_age = 0;
 	EGLBoolean ret;
-	int i;
 
-	if (gr->has_egl_buffer_age) {
-		ret = eglQuerySurface(gr->egl_display, go->egl_surface,
-				      EGL_BUFFER_AGE_EXT, &buffer_age);
-		if (ret == EGL_FALSE) {
-			weston_log("buffer age query failed.\n");
-			gl_renderer_print_egl_error_state();
-		}
+	if (!gr->has_egl_buffer_age)
+		return 0;
+
+	ret = eglQuerySurface(gr->egl_display, surface,
+			      EGL_BUFFER_AGE_EXT, &buffer_age);
+	if (ret == EGL_FALSE) {
+		weston_log("buffer age query failed.\n");
+		gl_renderer_print_egl_error_state();
+		return 0;
 	}
 
+	return buffer_age;
+}
+
+static void
+output_get_damage(struct weston_output *output, EGLint buffer_age,
+		  pixman_region32_t *buffer_damage, uint32_t *border_damage)
+{
+	struct gl_output_state *go = get_output_state(output);
+	int i;
+
 	if (buffer_age == 0 || buffer_age - 1 > BUFFER_DAMAGE_COUNT) {
 		pixman_region32_copy(buffer_damage, &output->region);
 		*border_damage = BORDER_ALL_DIRTY;
@@ -1074,1149 +1967,3981 @@ output_rotate_damage(struct weston_output *output,
 	go->border_damage[go->buffer_damage_index] = border_status;
 }
 
-/* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
- * unavailable, so we're assuming the background has no transparency
- * and that everything with a blend, like drop shadows, will have something
- * opaque (like the background) drawn underneath it.
- *
- * Depending on the underlying hardware, violating that assumption could
- * result in seeing through to another display plane.
+/* Convert damage in global coordinates, plus the damaged borders, into a
+ * list of EGL rectangles in framebuffer coordinates, with the origin at
+ * the bottom-left corner as EGL_KHR_partial_update and
+ * EGL_KHR_swap_buffers_with_damage expect. The number of pixels covered
+ * is returned in pixels.
  */
+/* Size the output renders at, without the borders */
 static void
-gl_renderer_repaint_output(struct weston_output *output,
-			      pixman_region32_t *output_damage)
+output_get_render_size(struct weston_output *output,
+		       int32_t *width, int32_t *height)
 {
 	struct gl_output_state *go = get_output_state(output);
-	struct weston_compositor *compositor = output->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
-	EGLBoolean ret;
-	static int errored;
-	int i, nrects, buffer_height;
-	EGLint *egl_damage, *d;
-	pixman_box32_t *rects;
-	pixman_region32_t buffer_damage, total_damage;
-	enum gl_border_status border_damage = BORDER_STATUS_CLEAN;
-
-	if (use_output(output) < 0)
-		return;
-
-	/* Calculate the viewport */
-	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
-		   go->borders[GL_RENDERER_BORDER_BOTTOM].height,
-		   output->current_mode->width,
-		   output->current_mode->height);
-
-	/* Calculate the global GL matrix */
-	go->output_matrix = output->matrix;
-	weston_matrix_translate(&go->output_matrix,
-				-(output->current_mode->width / 2.0),
-				-(output->current_mode->height / 2.0), 0);
-	weston_matrix_scale(&go->output_matrix,
-			    2.0 / output->current_mode->width,
-			    -2.0 / output->current_mode->height, 1);
 
-	/* if debugging, redraw everything outside the damage to clean up
-	 * debug lines from the previous draw on this buffer:
-	 */
-	if (gr->fan_debug) {
-		pixman_region32_t undamaged;
-		pixman_region32_init(&undamaged);
-		pixman_region32_subtract(&undamaged, &output->region,
-					 output_damage);
-		gr->fan_debug = 0;
-		repaint_views(output, &undamaged);
-		gr->fan_debug = 1;
-		pixman_region32_fini(&undamaged);
+	if (go->render_width > 0) {
+		*width = go->render_width;
+		*height = go->render_height;
+	} else {
+		*width = output->current_mode->width;
+		*height = output->current_mode->height;
 	}
+}
 
-	pixman_region32_init(&total_damage);
-	pixman_region32_init(&buffer_damage);
-
-	output_get_damage(output, &buffer_damage, &border_damage);
-	output_rotate_damage(output, output_damage, go->border_status);
-
-	pixman_region32_union(&total_damage, &buffer_damage, output_damage);
-	border_damage |= go->border_status;
+static bool
+output_is_render_scaled(struct weston_output *output)
+{
+	return get_output_state(output)->render_width > 0;
+}
 
-	repaint_views(output, &total_damage);
+/* Scale a region in mode pixels down to the render size, rounding out */
+static void
+output_scale_region_to_render(struct weston_output *output,
+			      pixman_region32_t *region)
+{
+	int64_t w = output->current_mode->width;
+	int64_t h = output->current_mode->height;
+	pixman_region32_t scaled;
+	pixman_box32_t *rects;
+	int32_t rw, rh, x1, y1, x2, y2;
+	int i, n;
 
-	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&buffer_damage);
+	output_get_render_size(output, &rw, &rh);
 
-	draw_output_borders(output, border_damage);
+	pixman_region32_init(&scaled);
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++) {
+		x1 = rects[i].x1 * rw / w;
+		y1 = rects[i].y1 * rh / h;
+		x2 = (rects[i].x2 * rw + w - 1) / w;
+		y2 = (rects[i].y2 * rh + h - 1) / h;
+		pixman_region32_union_rect(&scaled, &scaled,
+					   x1, y1, x2 - x1, y2 - y1);
+	}
 
-	pixman_region32_copy(&output->previous_damage, output_damage);
-	wl_signal_emit(&output->frame_signal, output);
+	pixman_region32_copy(region, &scaled);
+	pixman_region32_fini(&scaled);
+}
 
-	if (gr->swap_buffers_with_damage) {
-		pixman_region32_init(&buffer_damage);
-		weston_transformed_region(output->width, output->height,
-					  output->transform,
-					  output->current_scale,
-					  output_damage, &buffer_damage);
-
-		if (output_has_borders(output)) {
-			pixman_region32_translate(&buffer_damage,
-						  go->borders[GL_RENDERER_BORDER_LEFT].width,
-						  go->borders[GL_RENDERER_BORDER_TOP].height);
-			output_get_border_damage(output, go->border_status,
-						 &buffer_damage);
-		}
+/* Below the resolution of the mode, the edges of the damage cut through
+ * render pixels, which then change outside of it as well. Grow the damage
+ * by a render pixel, which is at most that many pixels of global space. */
+static void
+output_expand_render_damage(struct weston_output *output,
+			    pixman_region32_t *damage)
+{
+	pixman_region32_t grown;
+	pixman_box32_t *rects;
+	int32_t rw, rh, margin;
+	int i, n;
 
-		rects = pixman_region32_rectangles(&buffer_damage, &nrects);
-		egl_damage = malloc(nrects * 4 * sizeof(EGLint));
+	output_get_render_size(output, &rw, &rh);
+	margin = MAX((output->current_mode->width + rw - 1) / rw,
+		     (output->current_mode->height + rh - 1) / rh);
+
+	pixman_region32_init(&grown);
+	rects = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++)
+		pixman_region32_union_rect(&grown, &grown,
+					   rects[i].x1 - margin,
+					   rects[i].y1 - margin,
+					   rects[i].x2 - rects[i].x1 + 2 * margin,
+					   rects[i].y2 - rects[i].y1 + 2 * margin);
+
+	pixman_region32_intersect(damage, &grown, &output->region);
+	pixman_region32_fini(&grown);
+}
 
-		buffer_height = go->borders[GL_RENDERER_BORDER_TOP].height +
-				output->current_mode->height +
-				go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+static EGLint *
+output_damage_to_egl_rects(struct weston_output *output,
+			   pixman_region32_t *damage,
+			   enum gl_border_status border_status,
+			   EGLint *nrects, uint64_t *pixels)
+{
+	struct gl_output_state *go = get_output_state(output);
+	pixman_region32_t buffer_damage;
+	pixman_box32_t *rects;
+	EGLint *egl_damage, *d;
+	int32_t render_width, render_height;
+	int i, n, buffer_height;
 
-		d = egl_damage;
-		for (i = 0; i < nrects; ++i) {
-			*d++ = rects[i].x1;
-			*d++ = buffer_height - rects[i].y2;
-			*d++ = rects[i].x2 - rects[i].x1;
-			*d++ = rects[i].y2 - rects[i].y1;
-		}
-		ret = gr->swap_buffers_with_damage(gr->egl_display,
-						   go->egl_surface,
-						   egl_damage, nrects);
-		free(egl_damage);
-		pixman_region32_fini(&buffer_damage);
-	} else {
-		ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
+	pixman_region32_init(&buffer_damage);
+	pixman_region32_copy(&buffer_damage, damage);
+	pixman_region32_translate(&buffer_damage, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				  output->transform,
+				  output->current_scale,
+				  &buffer_damage, &buffer_damage);
+	if (output_is_render_scaled(output))
+		output_scale_region_to_render(output, &buffer_damage);
+
+	if (output_has_borders(output)) {
+		pixman_region32_translate(&buffer_damage,
+					  go->borders[GL_RENDERER_BORDER_LEFT].width,
+					  go->borders[GL_RENDERER_BORDER_TOP].height);
+		output_get_border_damage(output, border_status,
+					 &buffer_damage);
 	}
 
-	if (ret == EGL_FALSE && !errored) {
-		errored = 1;
-		weston_log("Failed in eglSwapBuffers.\n");
-		gl_renderer_print_egl_error_state();
+	output_get_render_size(output, &render_width, &render_height);
+	buffer_height = go->borders[GL_RENDERER_BORDER_TOP].height +
+			render_height +
+			go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	rects = pixman_region32_rectangles(&buffer_damage, &n);
+	egl_damage = malloc(n * 4 * sizeof(EGLint));
+	if (!egl_damage)
+		n = 0;
+
+	*pixels = 0;
+	d = egl_damage;
+	for (i = 0; i < n; ++i) {
+		*d++ = rects[i].x1;
+		*d++ = buffer_height - rects[i].y2;
+		*d++ = rects[i].x2 - rects[i].x1;
+		*d++ = rects[i].y2 - rects[i].y1;
+		*pixels += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			   (rects[i].y2 - rects[i].y1);
 	}
+	*nrects = n;
 
-	go->border_status = BORDER_STATUS_CLEAN;
+	pixman_region32_fini(&buffer_damage);
+
+	return egl_damage;
 }
 
-static int
-gl_renderer_read_pixels(struct weston_output *output,
-			       pixman_format_code_t format, void *pixels,
-			       uint32_t x, uint32_t y,
-			       uint32_t width, uint32_t height)
+static uint64_t
+output_buffer_pixels(struct weston_output *output)
 {
-	GLenum gl_format;
 	struct gl_output_state *go = get_output_state(output);
+	int32_t width, height;
 
-	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
-	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+	output_get_render_size(output, &width, &height);
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
-		return -1;
+	return (uint64_t) (go->borders[GL_RENDERER_BORDER_LEFT].width +
+			   width +
+			   go->borders[GL_RENDERER_BORDER_RIGHT].width) *
+	       (go->borders[GL_RENDERER_BORDER_TOP].height +
+		height +
+		go->borders[GL_RENDERER_BORDER_BOTTOM].height);
+}
+
+/* With EGL_KHR_partial_update, tell the driver which parts of the back
+ * buffer we are going to draw to, so that a tiling GPU only needs to
+ * load and resolve those tiles. This has to happen after the buffer age
+ * query and before the first draw call. Returns the number of pixels
+ * the driver has to resolve.
+ */
+static uint64_t
+output_set_damage_region(struct weston_output *output,
+			 pixman_region32_t *damage,
+			 enum gl_border_status border_status)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLint *egl_damage, nrects;
+	uint64_t pixels;
+	EGLBoolean ret;
+
+	if (!gr->set_damage_region || gr->fan_debug)
+		return output_buffer_pixels(output);
+
+	egl_damage = output_damage_to_egl_rects(output, damage, border_status,
+						&nrects, &pixels);
+
+	/* Without a call, the whole buffer is considered damaged. */
+	if (nrects == 0) {
+		free(egl_damage);
+		return output_buffer_pixels(output);
 	}
 
-	if (use_output(output) < 0)
-		return -1;
+	ret = gr->set_damage_region(gr->egl_display, go->egl_surface,
+				    egl_damage, nrects);
+	free(egl_damage);
 
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(x, y, width, height, gl_format,
-		     GL_UNSIGNED_BYTE, pixels);
+	if (ret == EGL_FALSE) {
+		weston_log("eglSetDamageRegionKHR failed.\n");
+		gl_renderer_print_egl_error_state();
+		return output_buffer_pixels(output);
+	}
 
-	return 0;
+	return pixels;
 }
 
+/* Put the GPU work of a finished frame on the timeline. The points are
+ * only emitted now that the results are in, a frame or two after the
+ * repaint, and carry the GPU times mapped onto the timeline clock.
+ */
 static void
-gl_renderer_flush_damage(struct weston_surface *surface)
+output_emit_gpu_timeline(struct weston_output *output, GLuint64 timestamp,
+			 GLuint64 elapsed, uint64_t msc)
 {
-	struct gl_renderer *gr = get_renderer(surface->compositor);
-	struct gl_surface_state *gs = get_surface_state(surface);
-	struct weston_buffer *buffer = gs->buffer_ref.buffer;
-	struct weston_view *view;
-	bool texture_used;
-	pixman_box32_t *rectangles;
-	void *data;
-	int i, j, n;
+	struct gl_output_state *go = get_output_state(output);
+	struct timespec begin, end;
+	int64_t nsec = (int64_t) timestamp + go->gpu_clock_offset;
 
-	pixman_region32_union(&gs->texture_damage,
-			      &gs->texture_damage, &surface->damage);
+	timespec_from_nsec(&begin, nsec);
+	timespec_from_nsec(&end, nsec + elapsed);
 
-	if (!buffer)
-		return;
+	TL_POINT("renderer_gpu_begin", TLP_OUTPUT(output), TLP_GPU(&begin),
+		 TLP_MSC(&msc), TLP_END);
+	TL_POINT("renderer_gpu_end", TLP_OUTPUT(output), TLP_GPU(&end),
+		 TLP_MSC(&msc), TLP_END);
+}
 
-	/* Avoid upload, if the texture won't be used this time.
-	 * We still accumulate the damage in texture_damage, and
-	 * hold the reference to the buffer, in case the surface
-	 * migrates back to the primary plane.
-	 */
-	texture_used = false;
-	wl_list_for_each(view, &surface->views, surface_link) {
-		if (view->plane == &surface->compositor->primary_plane) {
-			texture_used = true;
-			break;
-		}
+/* Read back the GPU time of finished frames, without waiting for the
+ * ones still in flight, and hand the most recent one to the core for
+ * adaptive repaint scheduling.
+ */
+static void
+output_collect_gpu_time(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	GLint available, disjoint;
+	GLuint64 elapsed, timestamp;
+	int i, q;
+
+	/* Walk from the oldest query, so the newest result wins. */
+	for (i = 0; i < GPU_TIMER_QUERY_COUNT; i++) {
+		q = (go->timer_query_next + i) % GPU_TIMER_QUERY_COUNT;
+		if (!go->timer_query_busy[q])
+			continue;
+
+		gr->get_query_object_iv(go->timer_queries[q],
+					GL_QUERY_RESULT_AVAILABLE_EXT,
+					&available);
+		if (available && go->timestamp_busy[q])
+			gr->get_query_object_iv(go->timestamp_queries[q],
+						GL_QUERY_RESULT_AVAILABLE_EXT,
+						&available);
+		if (!available)
+			continue;
+
+		go->timer_query_busy[q] = false;
+
+		/* Results spanning a disjoint event are meaningless. */
+		glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+		gr->get_query_object_ui64v(go->timer_queries[q],
+					   GL_QUERY_RESULT_EXT, &elapsed);
+		if (!disjoint)
+			output->repaint_timing.gpu_nsec = elapsed;
+
+		if (!go->timestamp_busy[q])
+			continue;
+
+		go->timestamp_busy[q] = false;
+		gr->get_query_object_ui64v(go->timestamp_queries[q],
+					   GL_QUERY_RESULT_EXT, &timestamp);
+
+		/* The GPU clock may have jumped, so measure it again */
+		if (disjoint)
+			go->gpu_clock_time.tv_sec = 0;
+		else
+			output_emit_gpu_timeline(output, timestamp, elapsed,
+						 go->timestamp_msc[q]);
 	}
-	if (!texture_used)
+}
+
+/* GPU timestamps are on a clock of their own. Sample it together with
+ * the timeline clock to map one onto the other, once a second, since
+ * reading the GPU clock synchronously is not free.
+ */
+static void
+output_calibrate_gpu_clock(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct timespec now;
+	GLint64 gpu_now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (go->gpu_clock_time.tv_sec != 0 &&
+	    timespec_sub_to_msec(&now, &go->gpu_clock_time) < 1000)
 		return;
 
-	if (!pixman_region32_not_empty(&gs->texture_damage) &&
-	    !gs->needs_full_upload)
-		goto done;
+	gr->get_integer64v(GL_TIMESTAMP_EXT, &gpu_now);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	go->gpu_clock_offset = timespec_to_nsec(&now) - gpu_now;
+	go->gpu_clock_time = now;
+}
 
-	if (!gr->has_unpack_subimage) {
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		for (j = 0; j < gs->num_textures; j++) {
-			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
-			glTexImage2D(GL_TEXTURE_2D, 0,
-				     gs->gl_format[j],
-				     gs->pitch / gs->hsub[j],
-				     buffer->height / gs->vsub[j],
-				     0,
-				     gs->gl_format[j],
-				     gs->gl_pixel_type,
-				     data + gs->offset[j]);
-		}
-		wl_shm_buffer_end_access(buffer->shm_buffer);
+/* Start timing the GPU work of this frame. Returns false if no query
+ * object is free, in which case the frame is not measured. While the
+ * timeline is on, the start of the frame is also timestamped.
+ */
+static bool
+output_begin_gpu_timer(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	int q = go->timer_query_next;
 
-		goto done;
+	if (!go->timer_queries[0]) {
+		gr->gen_queries(GPU_TIMER_QUERY_COUNT, go->timer_queries);
+		if (gr->has_gpu_timestamps)
+			gr->gen_queries(GPU_TIMER_QUERY_COUNT,
+					go->timestamp_queries);
 	}
 
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+	if (go->timer_query_busy[q])
+		return false;
 
-	if (gs->needs_full_upload) {
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		for (j = 0; j < gs->num_textures; j++) {
-			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
-			glTexImage2D(GL_TEXTURE_2D, 0,
-				     gs->gl_format[j],
-				     gs->pitch / gs->hsub[j],
-				     buffer->height / gs->vsub[j],
-				     0,
-				     gs->gl_format[j],
-				     gs->gl_pixel_type,
-				     data + gs->offset[j]);
-		}
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-		goto done;
+	if (gr->has_gpu_timestamps && weston_timeline_enabled_) {
+		output_calibrate_gpu_clock(output);
+		gr->query_counter(go->timestamp_queries[q], GL_TIMESTAMP_EXT);
+		go->timestamp_busy[q] = true;
+		go->timestamp_msc[q] = output->msc;
 	}
 
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
+	gr->begin_query(GL_TIME_ELAPSED_EXT, go->timer_queries[q]);
+	go->timer_query_busy[q] = true;
+	go->timer_query_next = (q + 1) % GPU_TIMER_QUERY_COUNT;
 
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+	return true;
+}
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		for (j = 0; j < gs->num_textures; j++) {
-			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
-			glTexSubImage2D(GL_TEXTURE_2D, 0,
-					r.x1 / gs->hsub[j],
-					r.y1 / gs->vsub[j],
-					(r.x2 - r.x1) / gs->hsub[j],
-					(r.y2 - r.y1) / gs->vsub[j],
-					gs->gl_format[j],
-					gs->gl_pixel_type,
-					data + gs->offset[j]);
-		}
+static void
+output_set_projection(struct weston_output *output,
+		      const struct weston_matrix *matrix)
+{
+	struct gl_output_state *go = get_output_state(output);
+
+	go->output_matrix = *matrix;
+	weston_matrix_translate(&go->output_matrix,
+				-(output->current_mode->width / 2.0),
+				-(output->current_mode->height / 2.0), 0);
+	weston_matrix_scale(&go->output_matrix,
+			    2.0 / output->current_mode->width,
+			    -2.0 / output->current_mode->height, 1);
+}
+
+static void
+output_release_zoom(struct gl_output_state *go)
+{
+	if (!go->zoom.fbo)
+		return;
+
+	glDeleteFramebuffers(1, &go->zoom.fbo);
+	glDeleteTextures(1, &go->zoom.tex);
+	go->zoom.fbo = 0;
+	go->zoom.tex = 0;
+}
+
+/* Make sure the output has a scene texture while it is zoomed, and only
+ * then. Returns false if the output is not zoomed, or if the texture
+ * can't be made, in which case the views are drawn magnified directly.
+ * fresh is set if the texture has no content yet. */
+static bool
+output_update_zoom(struct weston_output *output, bool *fresh)
+{
+	struct gl_output_state *go = get_output_state(output);
+	int32_t width, height;
+	static bool warned;
+	GLenum status;
+
+	*fresh = false;
+	output_get_render_size(output, &width, &height);
+
+	if (!output->zoom.active) {
+		output_release_zoom(go);
+		return false;
 	}
-	wl_shm_buffer_end_access(buffer->shm_buffer);
 
-done:
-	pixman_region32_fini(&gs->texture_damage);
-	pixman_region32_init(&gs->texture_damage);
-	gs->needs_full_upload = false;
+	if (go->zoom.fbo &&
+	    go->zoom.width == width && go->zoom.height == height)
+		return true;
 
-	weston_buffer_reference(&gs->buffer_ref, NULL);
+	output_release_zoom(go);
+
+	glGenTextures(1, &go->zoom.tex);
+	glBindTexture(GL_TEXTURE_2D, go->zoom.tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &go->zoom.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, go->zoom.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, go->zoom.tex, 0);
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		if (!warned)
+			weston_log("%s: fbo error: %#x\n", __func__, status);
+		warned = true;
+		output_release_zoom(go);
+		return false;
+	}
+
+	go->zoom.width = width;
+	go->zoom.height = height;
+	*fresh = true;
+
+	return true;
 }
 
+/* Bring the unzoomed scene up to date where it is damaged */
 static void
-ensure_textures(struct gl_surface_state *gs, int num_textures)
+repaint_zoom_scene(struct weston_output *output, pixman_region32_t *damage)
 {
-	int i;
+	struct gl_output_state *go = get_output_state(output);
 
-	if (num_textures <= gs->num_textures)
+	glBindFramebuffer(GL_FRAMEBUFFER, go->zoom.fbo);
+	glViewport(0, 0, go->zoom.width, go->zoom.height);
+	output_set_projection(output, &output->zoom.scene_matrix);
+
+	repaint_views(output, damage);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Magnify the zoomed area of the scene texture onto all of the output */
+static void
+draw_output_zoom(struct weston_output *output)
+{
+	static const GLushort indices[] = { 0, 1, 3, 3, 1, 2 };
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	GLfloat width = go->zoom.width;
+	GLfloat height = go->zoom.height;
+	GLfloat verts[] = {
+		0.0f, 0.0f,
+		width, 0.0f,
+		width, height,
+		0.0f, height
+	};
+	static const GLfloat texcoord[] = {
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		1.0f, 0.0f,
+		0.0f, 0.0f
+	};
+	struct weston_matrix matrix;
+	struct gl_shader *shader;
+
+	/* From unzoomed to zoomed output buffer coordinates */
+	weston_matrix_invert(&matrix, &output->zoom.scene_matrix);
+	weston_matrix_multiply(&matrix, &output->matrix);
+	output_set_projection(output, &matrix);
+
+	glDisable(GL_BLEND);
+	shader = use_shader(gr, SHADER_VARIANT_RGBA,
+			    SHADER_FLAG_NO_VIEW_ALPHA);
+	if (!shader)
 		return;
 
-	for (i = gs->num_textures; i < num_textures; i++) {
-		glGenTextures(1, &gs->textures[i]);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target,
-				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(gs->target,
-				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	}
-	gs->num_textures = num_textures;
-	glBindTexture(gs->target, 0);
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform1i(shader->tex_uniforms[0], 0);
+	glUniform1f(shader->alpha_uniform, 1);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, go->zoom.tex);
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoord);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
 }
 
+/* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
+ * unavailable, so we're assuming the background has no transparency
+ * and that everything with a blend, like drop shadows, will have something
+ * opaque (like the background) drawn underneath it.
+ *
+ * Depending on the underlying hardware, violating that assumption could
+ * result in seeing through to another display plane.
+ */
+static int
+gl_renderer_create_fence_fd(struct gl_renderer *gr);
+
+/* Give every client buffer read for this output a release fence that
+ * signals once the GPU is done with the frame, so the client can reuse
+ * the buffer without waiting for the next one to be attached and shown.
+ * The items are the draw items of the frame. The fence of a frame drawn
+ * elsewhere is passed in fence_fd, which is taken over; with -1, one is
+ * created when needed. */
 static void
-gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
-		       struct wl_shm_buffer *shm_buffer)
+update_buffer_release_fences(struct weston_output *output,
+			     struct wl_array *items, int fence_fd)
 {
-	struct weston_compositor *ec = es->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(es);
-	GLenum gl_format[3] = {0, 0, 0};
-	GLenum gl_pixel_type;
-	int pitch;
-	int num_planes;
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct weston_buffer_release *buffer_release;
+	struct gl_surface_state *gs;
+	struct weston_draw_item *item;
+	int fd;
 
-	buffer->shm_buffer = shm_buffer;
-	buffer->width = wl_shm_buffer_get_width(shm_buffer);
-	buffer->height = wl_shm_buffer_get_height(shm_buffer);
+	wl_array_for_each(item, items) {
+		/* The backend releases what it scans out itself */
+		if (item->plane != &output->compositor->primary_plane)
+			continue;
 
-	num_planes = 1;
-	gs->offset[0] = 0;
-	gs->hsub[0] = 1;
-	gs->vsub[0] = 1;
+		gs = get_surface_state(item->surface);
+		buffer_release = gs->buffer_release_ref.buffer_release;
+		if (!buffer_release)
+			continue;
 
-	switch (wl_shm_buffer_get_format(shm_buffer)) {
-	case WL_SHM_FORMAT_XRGB8888:
-		gs->shader = &gr->texture_shader_rgbx;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
-		gl_format[0] = GL_BGRA_EXT;
-		gl_pixel_type = GL_UNSIGNED_BYTE;
-		break;
-	case WL_SHM_FORMAT_ARGB8888:
-		gs->shader = &gr->texture_shader_rgba;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
-		gl_format[0] = GL_BGRA_EXT;
-		gl_pixel_type = GL_UNSIGNED_BYTE;
-		break;
-	case WL_SHM_FORMAT_RGB565:
-		gs->shader = &gr->texture_shader_rgbx;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
-		gl_format[0] = GL_RGB;
-		gl_pixel_type = GL_UNSIGNED_SHORT_5_6_5;
-		break;
-	case WL_SHM_FORMAT_YUV420:
-		gs->shader = &gr->texture_shader_y_u_v;
-		pitch = wl_shm_buffer_get_stride(shm_buffer);
-		gl_pixel_type = GL_UNSIGNED_BYTE;
-		num_planes = 3;
-		gs->offset[1] = gs->offset[0] + (pitch / gs->hsub[0]) *
-				(buffer->height / gs->vsub[0]);
-		gs->hsub[1] = 2;
-		gs->vsub[1] = 2;
-		gs->offset[2] = gs->offset[1] + (pitch / gs->hsub[1]) *
-				(buffer->height / gs->vsub[1]);
-		gs->hsub[2] = 2;
-		gs->vsub[2] = 2;
-		if (gr->has_gl_texture_rg) {
-			gl_format[0] = GL_R8_EXT;
-			gl_format[1] = GL_R8_EXT;
-			gl_format[2] = GL_R8_EXT;
-		} else {
-			gl_format[0] = GL_LUMINANCE;
-			gl_format[1] = GL_LUMINANCE;
-			gl_format[2] = GL_LUMINANCE;
-		}
-		break;
-	case WL_SHM_FORMAT_NV12:
-		gs->shader = &gr->texture_shader_y_xuxv;
-		pitch = wl_shm_buffer_get_stride(shm_buffer);
-		gl_pixel_type = GL_UNSIGNED_BYTE;
-		num_planes = 2;
-		gs->offset[1] = gs->offset[0] + (pitch / gs->hsub[0]) *
-				(buffer->height / gs->vsub[0]);
-		gs->hsub[1] = 2;
-		gs->vsub[1] = 2;
-		if (gr->has_gl_texture_rg) {
-			gl_format[0] = GL_R8_EXT;
-			gl_format[1] = GL_RG8_EXT;
-		} else {
-			gl_format[0] = GL_LUMINANCE;
-			gl_format[1] = GL_LUMINANCE_ALPHA;
+		if (fence_fd < 0)
+			fence_fd = gl_renderer_create_fence_fd(gr);
+
+		fd = fence_fd >= 0 ? dup(fence_fd) : -1;
+		if (fd < 0) {
+			/* Releasing the buffer without a fence would let
+			 * the client overwrite it while the GPU reads it */
+			linux_explicit_synchronization_send_server_error(
+				buffer_release->resource,
+				"failed to create release fence");
+			continue;
 		}
-		break;
-	case WL_SHM_FORMAT_YUYV:
-		gs->shader = &gr->texture_shader_y_xuxv;
-		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
-		gl_pixel_type = GL_UNSIGNED_BYTE;
-		num_planes = 2;
-		gs->hsub[1] = 2;
-		gs->vsub[1] = 1;
-		if (gr->has_gl_texture_rg)
-			gl_format[0] = GL_RG8_EXT;
-		else
-			gl_format[0] = GL_LUMINANCE_ALPHA;
-		gl_format[1] = GL_BGRA_EXT;
-		break;
-	default:
-		weston_log("warning: unknown shm buffer format: %08x\n",
-			   wl_shm_buffer_get_format(shm_buffer));
-		return;
+
+		weston_buffer_release_add_fence(buffer_release, fd);
 	}
 
-	/* Only allocate a texture if it doesn't match existing one.
-	 * If a switch from DRM allocated buffer to a SHM buffer is
-	 * happening, we need to allocate a new texture buffer. */
-	if (pitch != gs->pitch ||
-	    buffer->height != gs->height ||
-	    gl_format[0] != gs->gl_format[0] ||
-	    gl_format[1] != gs->gl_format[1] ||
-	    gl_format[2] != gs->gl_format[2] ||
-	    gl_pixel_type != gs->gl_pixel_type ||
-	    gs->buffer_type != BUFFER_TYPE_SHM) {
-		gs->pitch = pitch;
-		gs->height = buffer->height;
-		gs->target = GL_TEXTURE_2D;
-		gs->gl_format[0] = gl_format[0];
-		gs->gl_format[1] = gl_format[1];
-		gs->gl_format[2] = gl_format[2];
-		gs->gl_pixel_type = gl_pixel_type;
-		gs->buffer_type = BUFFER_TYPE_SHM;
-		gs->needs_full_upload = true;
-		gs->y_inverted = 1;
+	if (fence_fd >= 0)
+		close(fence_fd);
+}
 
-		gs->surface = es;
+static void
+render_thread_wait(struct gl_render_thread *rt)
+{
+	pthread_mutex_lock(&rt->mutex);
+	while (rt->job)
+		pthread_cond_wait(&rt->cond, &rt->mutex);
+	pthread_mutex_unlock(&rt->mutex);
+}
 
-		ensure_textures(gs, num_planes);
+static void
+render_thread_submit(struct gl_render_thread *rt,
+		     void (*job)(struct gl_render_thread *rt))
+{
+	pthread_mutex_lock(&rt->mutex);
+	while (rt->job)
+		pthread_cond_wait(&rt->cond, &rt->mutex);
+	rt->job = job;
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->mutex);
+}
+
+/* Let the render threads finish what they are drawing, before the main
+ * context changes or drops textures they may be reading from. */
+static void
+gl_renderer_wait_render_threads(struct gl_renderer *gr)
+{
+	struct gl_render_thread *rt;
+
+	wl_list_for_each(rt, &gr->render_threads, link)
+		render_thread_wait(rt);
+}
+
+static void *
+render_thread_main(void *data)
+{
+	struct gl_render_thread *rt = data;
+	struct gl_renderer *gr = rt->renderer;
+	void (*job)(struct gl_render_thread *rt);
+	sigset_t mask;
+	int i;
+
+	/* Signals are for the event loop of the main thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&rt->mutex);
+	for (;;) {
+		while (!rt->job && !rt->quit)
+			pthread_cond_wait(&rt->cond, &rt->mutex);
+		if (!rt->job)
+			break;
+
+		job = rt->job;
+		pthread_mutex_unlock(&rt->mutex);
+		job(rt);
+		pthread_mutex_lock(&rt->mutex);
+
+		rt->job = NULL;
+		pthread_cond_broadcast(&rt->cond);
 	}
+	pthread_mutex_unlock(&rt->mutex);
+
+	if (eglMakeCurrent(gr->egl_display, rt->surface, rt->surface,
+			   rt->context)) {
+		for (i = 0; i < SHADER_KEY_COUNT; i++)
+			if (rt->shaders[i])
+				shader_release(rt->shaders[i]);
+		eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+			       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	}
+	for (i = 0; i < SHADER_KEY_COUNT; i++)
+		free(rt->shaders[i]);
+	eglReleaseThread();
+
+	return NULL;
 }
 
+/* Make the output current to the render thread and ask for the age of
+ * its back buffer, which the main thread needs for the damage. The
+ * output stays current until the frame is drawn. */
 static void
-gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
-		       uint32_t format)
+render_thread_begin(struct gl_render_thread *rt)
 {
-	struct weston_compositor *ec = es->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(es);
-	EGLint attribs[3];
-	int i, num_planes;
+	struct gl_renderer *gr = rt->renderer;
+	struct gl_frame *frame = &rt->frame;
 
-	buffer->legacy_buffer = (struct wl_buffer *)buffer->resource;
-	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
-			 EGL_WIDTH, &buffer->width);
-	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
-			 EGL_HEIGHT, &buffer->height);
-	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
-			 EGL_WAYLAND_Y_INVERTED_WL, &buffer->y_inverted);
+	frame->bound = eglMakeCurrent(gr->egl_display, rt->surface,
+				      rt->surface, rt->context);
+	if (!frame->bound)
+		return;
 
-	for (i = 0; i < gs->num_images; i++) {
-		egl_image_unref(gs->images[i]);
-		gs->images[i] = NULL;
+	frame->buffer_age = output_query_buffer_age(gr, rt->surface);
+}
+
+static struct gl_shader *
+render_thread_use_shader(struct gl_render_thread *rt,
+			 enum gl_shader_texture_variant variant,
+			 uint32_t flags)
+{
+	struct gl_shader *shader;
+
+	shader = gl_renderer_get_shader(rt->renderer, rt->shaders,
+					variant, flags);
+	if (!shader)
+		return NULL;
+
+	if (rt->current_shader != shader) {
+		glUseProgram(shader->program);
+		rt->current_shader = shader;
 	}
-	gs->num_images = 0;
-	gs->target = GL_TEXTURE_2D;
-	switch (format) {
-	case EGL_TEXTURE_RGB:
-	case EGL_TEXTURE_RGBA:
-	default:
-		num_planes = 1;
-		gs->shader = &gr->texture_shader_rgba;
-		break;
-	case EGL_TEXTURE_EXTERNAL_WL:
-		num_planes = 1;
-		gs->target = GL_TEXTURE_EXTERNAL_OES;
-		gs->shader = &gr->texture_shader_egl_external;
-		break;
-	case EGL_TEXTURE_Y_UV_WL:
-		num_planes = 2;
-		gs->shader = &gr->texture_shader_y_uv;
-		break;
-	case EGL_TEXTURE_Y_U_V_WL:
-		num_planes = 3;
-		gs->shader = &gr->texture_shader_y_u_v;
-		break;
-	case EGL_TEXTURE_Y_XUXV_WL:
-		num_planes = 2;
-		gs->shader = &gr->texture_shader_y_xuxv;
-		break;
+
+	return shader;
+}
+
+static void
+render_thread_draw(struct gl_render_thread *rt)
+{
+	struct gl_renderer *gr = rt->renderer;
+	struct gl_frame *frame = &rt->frame;
+	struct gl_draw_op *op;
+	struct gl_shader *shader;
+	unsigned int *vtxcnt = frame->vtxcnt.data;
+	GLfloat *v;
+
+	if (frame->uploads != EGL_NO_SYNC_KHR) {
+		gr->wait_sync(gr->egl_display, frame->uploads, 0);
+		gr->destroy_sync(gr->egl_display, frame->uploads);
+		frame->uploads = EGL_NO_SYNC_KHR;
 	}
 
-	ensure_textures(gs, num_planes);
-	for (i = 0; i < num_planes; i++) {
-		attribs[0] = EGL_WAYLAND_PLANE_WL;
-		attribs[1] = i;
-		attribs[2] = EGL_NONE;
-		gs->images[i] = egl_image_create(gr,
-						 EGL_WAYLAND_BUFFER_WL,
-						 buffer->legacy_buffer,
-						 attribs);
-		if (!gs->images[i]) {
-			weston_log("failed to create img for plane %d\n", i);
+	if (frame->n_damage_rects > 0)
+		gr->set_damage_region(gr->egl_display, rt->surface,
+				      frame->damage_rects,
+				      frame->n_damage_rects);
+
+	glViewport(frame->viewport[0], frame->viewport[1],
+		   frame->viewport[2], frame->viewport[3]);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	wl_array_for_each(op, &frame->ops) {
+		if (op->acquire != EGL_NO_SYNC_KHR) {
+			gr->wait_sync(gr->egl_display, op->acquire, 0);
+			gr->destroy_sync(gr->egl_display, op->acquire);
+			op->acquire = EGL_NO_SYNC_KHR;
+		}
+
+		if (op->nclears > 0) {
+			clear_rects(op->state.color,
+				    (GLint *) frame->clears.data +
+				    op->first_clear * 4, op->nclears);
 			continue;
 		}
-		gs->num_images++;
 
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		gr->image_target_texture_2d(gs->target,
-					    gs->images[i]->image);
+		if (op->nfans == 0)
+			continue;
+
+		shader = render_thread_use_shader(rt, op->state.variant,
+						  op->state.flags);
+		if (!shader)
+			continue;
+		shader_uniforms(shader, &op->state, frame->projection);
+		bind_textures(&op->state);
+
+		if (op->state.blend)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+
+		v = (GLfloat *) frame->vertices.data + op->first_vertex * 4;
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+				      4 * sizeof *v, &v[0]);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+				      4 * sizeof *v, &v[2]);
+		glEnableVertexAttribArray(1);
+
+		draw_triangle_fans(&rt->indices, &vtxcnt[op->first_fan],
+				   op->nfans);
+
+		glDisableVertexAttribArray(1);
+		glDisableVertexAttribArray(0);
 	}
 
-	gs->pitch = buffer->width;
-	gs->height = buffer->height;
-	gs->buffer_type = BUFFER_TYPE_EGL;
-	gs->y_inverted = buffer->y_inverted;
+	frame->fence_fd = gl_renderer_create_fence_fd(gr);
+
+	if (gr->swap_buffers_with_damage)
+		frame->swapped =
+			gr->swap_buffers_with_damage(gr->egl_display,
+						     rt->surface,
+						     frame->swap_rects,
+						     frame->n_swap_rects);
+	else
+		frame->swapped = eglSwapBuffers(gr->egl_display, rt->surface);
+
+	/* Leave the output to the main thread until the next frame */
+	eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
 }
 
 static void
-gl_renderer_destroy_dmabuf(struct linux_dmabuf_buffer *dmabuf)
+gl_frame_reset(struct gl_renderer *gr, struct gl_frame *frame)
 {
-	struct dmabuf_image *image = dmabuf->user_data;
+	struct gl_draw_op *op;
+
+	wl_array_for_each(op, &frame->ops)
+		if (op->acquire != EGL_NO_SYNC_KHR)
+			gr->destroy_sync(gr->egl_display, op->acquire);
+	if (frame->uploads != EGL_NO_SYNC_KHR)
+		gr->destroy_sync(gr->egl_display, frame->uploads);
+	if (frame->fence_fd >= 0)
+		close(frame->fence_fd);
+
+	free(frame->damage_rects);
+	free(frame->swap_rects);
+
+	frame->bound = false;
+	frame->uploads = EGL_NO_SYNC_KHR;
+	frame->ops.size = 0;
+	frame->vertices.size = 0;
+	frame->vtxcnt.size = 0;
+	frame->clears.size = 0;
+	frame->items.size = 0;
+	frame->damage_rects = NULL;
+	frame->n_damage_rects = 0;
+	frame->swap_rects = NULL;
+	frame->n_swap_rects = 0;
+	frame->pixels = 0;
+	frame->swapped = EGL_FALSE;
+	frame->fence_fd = -1;
+}
 
-	dmabuf_image_destroy(image);
+/* What the render thread cannot do, the main thread draws itself: the
+ * frame listeners read the back buffer before the swap, and zoom,
+ * borders, read-backs and fan debugging use the main context's own
+ * objects. */
+static bool
+output_can_render_threaded(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+
+	return go->thread &&
+	       !output->zoom.active && !go->zoom.fbo &&
+	       !output_has_borders(output) &&
+	       !gr->fan_debug && !gr->repaint_debug &&
+	       wl_list_empty(&go->readbacks) &&
+	       wl_list_empty(&output->frame_signal.listener_list);
 }
 
-static struct egl_image *
-import_simple_dmabuf(struct gl_renderer *gr,
-                     struct dmabuf_attributes *attributes)
+/* Take down what the frame draws, and hand it to the render thread of
+ * the output. The main thread goes on with the next output meanwhile,
+ * until gl_renderer_output_finish_frame(). GPU timing is left out, the
+ * queries belong to the main context. Returns -1 if the main thread has
+ * to draw the frame itself. */
+static int
+output_repaint_threaded(struct weston_output *output,
+			pixman_region32_t *output_damage)
 {
-	struct egl_image *image;
-	EGLint attribs[30];
-	int atti = 0;
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_render_thread *rt = go->thread;
+	struct gl_frame *frame = &rt->frame;
+	pixman_region32_t buffer_damage, total_damage, render_damage;
+	/* what changes on the output, in global coordinates */
+	pixman_region32_t *damage = output_damage;
+	enum gl_border_status border_damage = BORDER_STATUS_CLEAN;
+	int32_t render_width, render_height;
+	uint64_t swap_pixels;
 
-	/* This requires the Mesa commit in
-	 * Mesa 10.3 (08264e5dad4df448e7718e782ad9077902089a07) or
-	 * Mesa 10.2.7 (55d28925e6109a4afd61f109e845a8a51bd17652).
-	 * Otherwise Mesa closes the fd behind our back and re-importing
-	 * will fail.
-	 * https://bugs.freedesktop.org/show_bug.cgi?id=76188
-	 */
+	if (!output_can_render_threaded(output))
+		return -1;
 
-	attribs[atti++] = EGL_WIDTH;
-	attribs[atti++] = attributes->width;
-	attribs[atti++] = EGL_HEIGHT;
-	attribs[atti++] = attributes->height;
-	attribs[atti++] = EGL_LINUX_DRM_FOURCC_EXT;
-	attribs[atti++] = attributes->format;
-	/* XXX: Add modifier here when supported */
+	/* The output can only be current to one thread at a time, and
+	 * the main context still needs one for the uploads */
+	if (!eglMakeCurrent(gr->egl_display, gr->dummy_surface,
+			    gr->dummy_surface, gr->egl_context))
+		return -1;
 
-	if (attributes->n_planes > 0) {
-		attribs[atti++] = EGL_DMA_BUF_PLANE0_FD_EXT;
-		attribs[atti++] = attributes->fd[0];
-		attribs[atti++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
-		attribs[atti++] = attributes->offset[0];
-		attribs[atti++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
-		attribs[atti++] = attributes->stride[0];
+	render_thread_submit(rt, render_thread_begin);
+	render_thread_wait(rt);
+	if (!frame->bound) {
+		gl_frame_reset(gr, frame);
+		return -1;
 	}
 
-	if (attributes->n_planes > 1) {
-		attribs[atti++] = EGL_DMA_BUF_PLANE1_FD_EXT;
-		attribs[atti++] = attributes->fd[1];
-		attribs[atti++] = EGL_DMA_BUF_PLANE1_OFFSET_EXT;
-		attribs[atti++] = attributes->offset[1];
-		attribs[atti++] = EGL_DMA_BUF_PLANE1_PITCH_EXT;
-		attribs[atti++] = attributes->stride[1];
+	pixman_region32_init(&render_damage);
+	if (output_is_render_scaled(output)) {
+		pixman_region32_copy(&render_damage, output_damage);
+		output_expand_render_damage(output, &render_damage);
+		damage = &render_damage;
 	}
 
-	if (attributes->n_planes > 2) {
-		attribs[atti++] = EGL_DMA_BUF_PLANE2_FD_EXT;
-		attribs[atti++] = attributes->fd[2];
-		attribs[atti++] = EGL_DMA_BUF_PLANE2_OFFSET_EXT;
-		attribs[atti++] = attributes->offset[2];
-		attribs[atti++] = EGL_DMA_BUF_PLANE2_PITCH_EXT;
-		attribs[atti++] = attributes->stride[2];
+	output_mark_views_shown(output);
+
+	pixman_region32_init(&total_damage);
+	pixman_region32_init(&buffer_damage);
+
+	output_get_damage(output, frame->buffer_age,
+			  &buffer_damage, &border_damage);
+	output_rotate_damage(output, damage, go->border_status);
+
+	pixman_region32_union(&total_damage, &buffer_damage, damage);
+
+	frame->pixels = output_buffer_pixels(output);
+	if (gr->set_damage_region) {
+		frame->damage_rects =
+			output_damage_to_egl_rects(output, &total_damage,
+						   border_damage,
+						   &frame->n_damage_rects,
+						   &swap_pixels);
+		if (frame->n_damage_rects > 0)
+			frame->pixels = swap_pixels;
 	}
 
-	attribs[atti++] = EGL_NONE;
+	output_get_render_size(output, &render_width, &render_height);
+	frame->viewport[0] = 0;
+	frame->viewport[1] = 0;
+	frame->viewport[2] = render_width;
+	frame->viewport[3] = render_height;
 
-	image = egl_image_create(gr, EGL_LINUX_DMA_BUF_EXT, NULL,
-				 attribs);
+	output_set_projection(output, &output->matrix);
+	memcpy(frame->projection, go->output_matrix.d,
+	       sizeof frame->projection);
 
-	return image;
+	go->record = frame;
+	repaint_views(output, &total_damage);
+	go->record = NULL;
+
+	if (wl_array_copy(&frame->items, &output->draw_items) < 0)
+		weston_log("out of memory, %s releases buffers without "
+			   "fences\n", output->name);
+
+	pixman_region32_fini(&total_damage);
+	pixman_region32_fini(&buffer_damage);
+
+	pixman_region32_copy(&output->previous_damage, damage);
+
+	if (gr->swap_buffers_with_damage) {
+		frame->swap_rects =
+			output_damage_to_egl_rects(output, damage,
+						   go->border_status,
+						   &frame->n_swap_rects,
+						   &swap_pixels);
+		if (!gr->set_damage_region)
+			frame->pixels = swap_pixels;
+	}
+
+	/* Texture uploads and restores of the main context */
+	frame->uploads = gr->create_sync(gr->egl_display,
+					 EGL_SYNC_FENCE_KHR, NULL);
+	if (frame->uploads != EGL_NO_SYNC_KHR)
+		glFlush();
+	else
+		glFinish();
+
+	go->border_status = BORDER_STATUS_CLEAN;
+	pixman_region32_fini(&render_damage);
+
+	rt->frame_pending = true;
+	render_thread_submit(rt, render_thread_draw);
+
+	return 0;
 }
 
-/* The kernel header drm_fourcc.h defines the DRM formats below.  We duplicate
- * some of the definitions here so that building Weston won't require
- * bleeding-edge kernel headers.
- */
-#ifndef DRM_FORMAT_R8
-#define DRM_FORMAT_R8            fourcc_code('R', '8', ' ', ' ') /* [7:0] R */
-#endif
+/* Wait for the render thread to be done with the frame of the output,
+ * and finish it as gl_renderer_repaint_output() does after drawing.
+ * Nothing to do if the main thread drew it. */
+static void
+gl_renderer_output_finish_frame(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_render_thread *rt = go->thread;
+	static int errored;
 
-#ifndef DRM_FORMAT_GR88
-#define DRM_FORMAT_GR88          fourcc_code('G', 'R', '8', '8') /* [15:0] G:R 8:8 little endian */
-#endif
+	if (!rt || !rt->frame_pending)
+		return;
 
-struct yuv_format_descriptor yuv_formats[] = {
-	{
-		.format = DRM_FORMAT_YUYV,
-		.input_planes = 1,
-		.output_planes = 2,
-		.texture_type = EGL_TEXTURE_Y_XUXV_WL,
-		{{
-			.width_divisor = 1,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_GR88,
-			.plane_index = 0
-		}, {
-			.width_divisor = 2,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_ARGB8888,
-			.plane_index = 0
-		}}
-	}, {
-		.format = DRM_FORMAT_NV12,
-		.input_planes = 2,
-		.output_planes = 2,
-		.texture_type = EGL_TEXTURE_Y_UV_WL,
-		{{
-			.width_divisor = 1,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 0
-		}, {
-			.width_divisor = 2,
-			.height_divisor = 2,
-			.format = DRM_FORMAT_GR88,
-			.plane_index = 1
-		}}
-	}, {
-		.format = DRM_FORMAT_YUV420,
-		.input_planes = 3,
-		.output_planes = 3,
-		.texture_type = EGL_TEXTURE_Y_U_V_WL,
-		{{
-			.width_divisor = 1,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 0
-		}, {
-			.width_divisor = 2,
-			.height_divisor = 2,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 1
-		}, {
-			.width_divisor = 2,
-			.height_divisor = 2,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 2
-		}}
-	}, {
-		.format = DRM_FORMAT_YUV444,
-		.input_planes = 3,
-		.output_planes = 3,
-		.texture_type = EGL_TEXTURE_Y_U_V_WL,
-		{{
-			.width_divisor = 1,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 0
-		}, {
-			.width_divisor = 1,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 1
-		}, {
-			.width_divisor = 1,
-			.height_divisor = 1,
-			.format = DRM_FORMAT_R8,
-			.plane_index = 2
-		}}
+	render_thread_wait(rt);
+	rt->frame_pending = false;
+
+	/* The output's own items are gone by now */
+	update_buffer_release_fences(output, &rt->frame.items,
+				     rt->frame.fence_fd);
+	rt->frame.fence_fd = -1;
+
+	wl_signal_emit(&output->frame_signal, output);
+
+	TL_POINT("renderer_resolve", TLP_OUTPUT(output),
+		 TLP_PIXELS(&rt->frame.pixels), TLP_END);
+
+	if (rt->frame.swapped == EGL_FALSE && !errored) {
+		errored = 1;
+		weston_log("Failed in eglSwapBuffers on the render thread "
+			   "of %s.\n", output->name);
 	}
-};
 
-static struct egl_image *
-import_dmabuf_single_plane(struct gl_renderer *gr,
-                           const struct dmabuf_attributes *attributes,
-                           struct yuv_plane_descriptor *descriptor)
+	gl_frame_reset(gr, &rt->frame);
+}
+
+/* Repaint debug overlay
+ *
+ * Every part of the output is tinted by how many of the last frames
+ * repainted it, from blue for a few to red for all of them. Views on
+ * planes other than the primary one get a frame around them, in a
+ * color per plane. Views left on the primary plane get a frame inside
+ * them saying why, see repaint_debug_binding(). The overlay is drawn on
+ * every frame, so the whole output is repainted while it is on.
+ */
+
+static void
+repaint_heat_destroy(struct gl_repaint_heat *heat)
 {
-	struct dmabuf_attributes plane;
-	struct egl_image *image;
-	char fmt[4];
+	int i;
 
-	plane.width = attributes->width / descriptor->width_divisor;
-	plane.height = attributes->height / descriptor->height_divisor;
-	plane.format = descriptor->format;
-	plane.n_planes = 1;
-	plane.fd[0] = attributes->fd[descriptor->plane_index];
-	plane.offset[0] = attributes->offset[descriptor->plane_index];
-	plane.stride[0] = attributes->stride[descriptor->plane_index];
-	plane.modifier[0] = attributes->modifier[descriptor->plane_index];
+	for (i = 0; i < REPAINT_HEAT_FRAMES; i++)
+		pixman_region32_fini(&heat->frames[i]);
+	free(heat->counts);
+	free(heat);
+}
 
-	image = import_simple_dmabuf(gr, &plane);
-	if (!image) {
-		weston_log("Failed to import plane %d as %.4s\n",
-		           descriptor->plane_index,
-		           dump_format(descriptor->format, fmt));
+static struct gl_repaint_heat *
+repaint_heat_create(struct weston_output *output)
+{
+	struct gl_repaint_heat *heat;
+	int i;
+
+	heat = zalloc(sizeof *heat);
+	if (!heat)
+		return NULL;
+
+	heat->x = output->x;
+	heat->y = output->y;
+	heat->width = (output->width + REPAINT_HEAT_CELL - 1) /
+		REPAINT_HEAT_CELL;
+	heat->height = (output->height + REPAINT_HEAT_CELL - 1) /
+		REPAINT_HEAT_CELL;
+	heat->counts = zalloc(heat->width * heat->height);
+	if (!heat->counts) {
+		free(heat);
 		return NULL;
 	}
 
-	return image;
+	for (i = 0; i < REPAINT_HEAT_FRAMES; i++)
+		pixman_region32_init(&heat->frames[i]);
+
+	return heat;
 }
 
-static bool
-import_yuv_dmabuf(struct gl_renderer *gr,
-                  struct dmabuf_image *image)
+/* Add delta to the count of every cell region touches */
+static void
+repaint_heat_count(struct gl_repaint_heat *heat, pixman_region32_t *region,
+		   int delta)
 {
-	unsigned i;
-	int j;
-	int ret;
-	struct yuv_format_descriptor *format = NULL;
-	struct dmabuf_attributes *attributes = &image->dmabuf->attributes;
-	char fmt[4];
+	pixman_box32_t *rects;
+	int nrects, i, x, y, x1, y1, x2, y2;
 
-	for (i = 0; i < ARRAY_LENGTH(yuv_formats); ++i) {
-		if (yuv_formats[i].format == attributes->format) {
-			format = &yuv_formats[i];
-			break;
-		}
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++) {
+		x1 = (rects[i].x1 - heat->x) / REPAINT_HEAT_CELL;
+		y1 = (rects[i].y1 - heat->y) / REPAINT_HEAT_CELL;
+		x2 = (rects[i].x2 - heat->x + REPAINT_HEAT_CELL - 1) /
+			REPAINT_HEAT_CELL;
+		y2 = (rects[i].y2 - heat->y + REPAINT_HEAT_CELL - 1) /
+			REPAINT_HEAT_CELL;
+
+		for (y = y1; y < y2; y++)
+			for (x = x1; x < x2; x++)
+				heat->counts[y * heat->width + x] += delta;
 	}
+}
 
-	if (!format) {
-		weston_log("Error during import, and no known conversion for format "
-		           "%.4s in the renderer",
-		           dump_format(attributes->format, fmt));
-		return false;
+/* Remember what the core asked to be repainted, before the overlay
+ * makes it the whole output */
+static void
+output_record_repaint(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_repaint_heat *heat = go->heat;
+	pixman_region32_t *frame;
+
+	if (heat && (heat->x != output->x || heat->y != output->y ||
+		     heat->width * REPAINT_HEAT_CELL < output->width ||
+		     heat->height * REPAINT_HEAT_CELL < output->height ||
+		     (heat->width - 1) * REPAINT_HEAT_CELL >= output->width ||
+		     (heat->height - 1) * REPAINT_HEAT_CELL >= output->height)) {
+		repaint_heat_destroy(heat);
+		go->heat = heat = NULL;
 	}
 
-	if (attributes->n_planes != format->input_planes) {
-		weston_log("%.4s dmabuf must contain %d plane%s (%d provided)",
-		           dump_format(format->format, fmt),
-		           format->input_planes,
-		           (format->input_planes > 1) ? "s" : "",
-		           attributes->n_planes);
-		return false;
+	if (!heat) {
+		go->heat = heat = repaint_heat_create(output);
+		if (!heat)
+			return;
 	}
 
-	for (j = 0; j < format->output_planes; ++j) {
-		image->images[j] = import_dmabuf_single_plane(gr, attributes,
-		                                              &format->plane[j]);
-		if (!image->images[j]) {
-			while (j) {
-				ret = egl_image_unref(image->images[--j]);
-				assert(ret == 0);
+	/* The oldest frame drops out of the count */
+	frame = &heat->frames[heat->next];
+	repaint_heat_count(heat, frame, -1);
+	pixman_region32_intersect(frame, damage, &output->region);
+	repaint_heat_count(heat, frame, 1);
+	heat->next = (heat->next + 1) % REPAINT_HEAT_FRAMES;
+}
+
+static void
+append_quad(struct wl_array *verts, int32_t x1, int32_t y1,
+	    int32_t x2, int32_t y2)
+{
+	GLfloat *v;
+
+	v = wl_array_add(verts, 12 * sizeof *v);
+	if (!v)
+		return;
+
+	v[0] = x1; v[1] = y1;
+	v[2] = x2; v[3] = y1;
+	v[4] = x2; v[5] = y2;
+	v[6] = x1; v[7] = y1;
+	v[8] = x2; v[9] = y2;
+	v[10] = x1; v[11] = y2;
+}
+
+/* A frame of width w along box, outside it or inside it */
+static void
+append_frame(struct wl_array *verts, const pixman_box32_t *box, int w,
+	     bool outside)
+{
+	int32_t x1 = box->x1, y1 = box->y1, x2 = box->x2, y2 = box->y2;
+
+	if (outside) {
+		x1 -= w;
+		y1 -= w;
+		x2 += w;
+		y2 += w;
+	}
+
+	append_quad(verts, x1, y1, x2, y1 + w);
+	append_quad(verts, x1, y2 - w, x2, y2);
+	append_quad(verts, x1, y1 + w, x1 + w, y2 - w);
+	append_quad(verts, x2 - w, y1 + w, x2, y2 - w);
+}
+
+static void
+draw_quads(struct gl_shader *shader, struct wl_array *verts,
+	   const GLfloat *color)
+{
+	if (verts->size == 0)
+		return;
+
+	glUniform4fv(shader->color_uniform, 1, color);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts->data);
+	glDrawArrays(GL_TRIANGLES, 0, verts->size / (2 * sizeof(GLfloat)));
+	verts->size = 0;
+}
+
+static void
+draw_repaint_debug(struct weston_output *output)
+{
+	/* premultiplied */
+	static const GLfloat plane_colors[][4] = {
+		{ 0.0, 0.8, 0.0, 0.8 },
+		{ 0.0, 0.8, 0.8, 0.8 },
+		{ 0.8, 0.8, 0.8, 0.8 },
+		{ 0.0, 0.4, 0.8, 0.8 },
+	};
+	static const GLfloat miss_colors[][4] = {
+		[WESTON_PLANE_MISS_DISABLED] = { 0.4, 0.4, 0.4, 0.8 },
+		[WESTON_PLANE_MISS_NO_PLANE] = { 0.8, 0.0, 0.0, 0.8 },
+		[WESTON_PLANE_MISS_OVERLAP] = { 0.8, 0.8, 0.0, 0.8 },
+		[WESTON_PLANE_MISS_YIELDED] = { 0.8, 0.0, 0.8, 0.8 },
+	};
+	const GLfloat heat_alpha = 0.35f;
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_repaint_heat *heat = go->heat;
+	struct gl_shader *shader;
+	struct weston_plane *plane;
+	struct weston_view *ev;
+	struct wl_array verts;
+	GLfloat color[4], t;
+	int level, x, y, count, i;
+	uint32_t miss;
+
+	shader = use_shader(gr, SHADER_VARIANT_SOLID,
+			    SHADER_FLAG_NO_VIEW_ALPHA);
+	if (!shader)
+		return;
+
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE,
+			   go->output_matrix.d);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glEnableVertexAttribArray(0);
+	wl_array_init(&verts);
+
+	for (level = 1; heat && level <= REPAINT_HEAT_LEVELS; level++) {
+		for (y = 0; y < heat->height; y++) {
+			for (x = 0; x < heat->width; x++) {
+				count = heat->counts[y * heat->width + x];
+				if (count == 0 ||
+				    (count * REPAINT_HEAT_LEVELS +
+				     REPAINT_HEAT_FRAMES - 1) /
+				    REPAINT_HEAT_FRAMES != level)
+					continue;
+
+				append_quad(&verts,
+					    heat->x + x * REPAINT_HEAT_CELL,
+					    heat->y + y * REPAINT_HEAT_CELL,
+					    heat->x + (x + 1) * REPAINT_HEAT_CELL,
+					    heat->y + (y + 1) * REPAINT_HEAT_CELL);
 			}
-			return false;
 		}
+
+		t = (GLfloat) level / REPAINT_HEAT_LEVELS;
+		color[0] = t * heat_alpha;
+		color[1] = 0.0f;
+		color[2] = (1.0f - t) * heat_alpha;
+		color[3] = heat_alpha;
+		draw_quads(shader, &verts, color);
 	}
 
-	image->num_images = format->output_planes;
+	/* The content of a view on a plane hides what is drawn over it
+	 * here, so those are framed from outside. */
+	i = 0;
+	wl_list_for_each(plane, &compositor->plane_list, link) {
+		if (plane == &compositor->primary_plane)
+			continue;
 
-	switch (format->texture_type) {
-	case EGL_TEXTURE_Y_XUXV_WL:
-		image->shader = &gr->texture_shader_y_xuxv;
-		break;
-	case EGL_TEXTURE_Y_UV_WL:
-		image->shader = &gr->texture_shader_y_uv;
-		break;
-	case EGL_TEXTURE_Y_U_V_WL:
-		image->shader = &gr->texture_shader_y_u_v;
-		break;
-	default:
-		assert(false);
+		wl_list_for_each(ev, &compositor->view_list, link) {
+			if (ev->plane == plane &&
+			    (ev->output_mask & (1u << output->id)))
+				append_frame(&verts, &ev->transform.boundingbox,
+					     3, true);
+		}
+		draw_quads(shader, &verts,
+			   plane_colors[i++ % ARRAY_LENGTH(plane_colors)]);
 	}
 
-	return true;
+	for (miss = WESTON_PLANE_MISS_DISABLED;
+	     miss < ARRAY_LENGTH(miss_colors); miss++) {
+		wl_list_for_each(ev, &compositor->view_list, link) {
+			if (ev->plane == &compositor->primary_plane &&
+			    ev->plane_miss == miss &&
+			    (ev->output_mask & (1u << output->id)))
+				append_frame(&verts, &ev->transform.boundingbox,
+					     3, false);
+		}
+		draw_quads(shader, &verts, miss_colors[miss]);
+	}
+
+	wl_array_release(&verts);
+	glDisableVertexAttribArray(0);
 }
 
-static GLenum
-choose_texture_target(struct dmabuf_attributes *attributes)
+static void
+gl_renderer_repaint_output(struct weston_output *output,
+			      pixman_region32_t *output_damage)
 {
-	if (attributes->n_planes > 1)
-		return GL_TEXTURE_EXTERNAL_OES;
-
-	switch (attributes->format & ~DRM_FORMAT_BIG_ENDIAN) {
-	case DRM_FORMAT_YUYV:
-	case DRM_FORMAT_YVYU:
-	case DRM_FORMAT_UYVY:
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	EGLBoolean ret;
+	static int errored;
+	EGLint *egl_damage, nrects;
+	pixman_region32_t buffer_damage, total_damage, render_damage;
+	/* what changes on the output, in global coordinates */
+	pixman_region32_t *damage = output_damage;
+	enum gl_border_status border_damage = BORDER_STATUS_CLEAN;
+	int32_t render_width, render_height;
+	uint64_t pixels, swap_pixels;
+	bool timing_gpu = false;
+	bool zoomed, fresh;
+
+	if (go->thread) {
+		gl_renderer_output_finish_frame(output);
+		if (output_repaint_threaded(output, output_damage) == 0)
+			return;
+	}
+
+	if (use_output(output) < 0)
+		return;
+
+	pixman_region32_init(&render_damage);
+	if (output_is_render_scaled(output)) {
+		pixman_region32_copy(&render_damage, output_damage);
+		output_expand_render_damage(output, &render_damage);
+		damage = &render_damage;
+	}
+
+	output_mark_views_shown(output);
+
+	if (gr->repaint_debug) {
+		output_record_repaint(output, output_damage);
+		damage = &output->region;
+	}
+
+	if (gr->has_disjoint_timer_query) {
+		output_collect_gpu_time(output);
+		timing_gpu = output_begin_gpu_timer(output);
+	}
+
+	/* A zoomed output changes all over with every frame. That is also
+	 * true when the views are drawn magnified directly, as the core
+	 * leaves damaging the output to the renderer while zoomed. */
+	zoomed = output_update_zoom(output, &fresh);
+	if (output->zoom.active)
+		damage = &output->region;
+
+	pixman_region32_init(&total_damage);
+	pixman_region32_init(&buffer_damage);
+
+	output_get_damage(output,
+			  output_query_buffer_age(gr, go->egl_surface),
+			  &buffer_damage, &border_damage);
+	output_rotate_damage(output, damage, go->border_status);
+
+	pixman_region32_union(&total_damage, &buffer_damage, damage);
+	border_damage |= go->border_status;
+
+	pixels = output_set_damage_region(output, &total_damage,
+					  border_damage);
+
+	if (zoomed)
+		repaint_zoom_scene(output,
+				   fresh ? &output->region : output_damage);
+
+	/* Calculate the viewport */
+	output_get_render_size(output, &render_width, &render_height);
+	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
+		   go->borders[GL_RENDERER_BORDER_BOTTOM].height,
+		   render_width, render_height);
+
+	/* Calculate the global GL matrix */
+	output_set_projection(output, &output->matrix);
+
+	/* if debugging, redraw everything outside the damage to clean up
+	 * debug lines from the previous draw on this buffer:
+	 */
+	if (gr->fan_debug && !zoomed) {
+		pixman_region32_t undamaged;
+		pixman_region32_init(&undamaged);
+		pixman_region32_subtract(&undamaged, &output->region,
+					 output_damage);
+		gr->fan_debug = 0;
+		repaint_views(output, &undamaged);
+		gr->fan_debug = 1;
+		pixman_region32_fini(&undamaged);
+	}
+
+	if (zoomed)
+		draw_output_zoom(output);
+	else
+		repaint_views(output, &total_damage);
+
+	if (gr->repaint_debug && !zoomed)
+		draw_repaint_debug(output);
+
+	pixman_region32_fini(&total_damage);
+	pixman_region32_fini(&buffer_damage);
+
+	draw_output_borders(output, border_damage);
+
+	if (timing_gpu)
+		gr->end_query(GL_TIME_ELAPSED_EXT);
+
+	update_buffer_release_fences(output, &output->draw_items, -1);
+
+	pixman_region32_copy(&output->previous_damage, damage);
+	wl_signal_emit(&output->frame_signal, output);
+
+	if (gr->swap_buffers_with_damage) {
+		egl_damage = output_damage_to_egl_rects(output, damage,
+							go->border_status,
+							&nrects, &swap_pixels);
+		ret = gr->swap_buffers_with_damage(gr->egl_display,
+						   go->egl_surface,
+						   egl_damage, nrects);
+		free(egl_damage);
+
+		/* Without partial update, only the swap damage tells the
+		 * driver what it needs to present. */
+		if (!gr->set_damage_region)
+			pixels = swap_pixels;
+	} else {
+		ret = eglSwapBuffers(gr->egl_display, go->egl_surface);
+	}
+
+	TL_POINT("renderer_resolve", TLP_OUTPUT(output),
+		 TLP_PIXELS(&pixels), TLP_END);
+
+	if (ret == EGL_FALSE && !errored) {
+		errored = 1;
+		weston_log("Failed in eglSwapBuffers.\n");
+		gl_renderer_print_egl_error_state();
+	}
+
+	go->border_status = BORDER_STATUS_CLEAN;
+	pixman_region32_fini(&render_damage);
+}
+
+static int
+read_format_to_gl(pixman_format_code_t format, GLenum *gl_format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		*gl_format = GL_BGRA_EXT;
+		return 0;
+	case PIXMAN_a8b8g8r8:
+		*gl_format = GL_RGBA;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Read an area given in mode pixels from an output rendering below that
+ * resolution, scaling the render buffer up like the backend does, only
+ * with the nearest pixel. */
+static int
+read_pixels_render_scaled(struct weston_output *output, GLenum gl_format,
+			  uint32_t *pixels, uint32_t x, uint32_t y,
+			  uint32_t width, uint32_t height)
+{
+	uint64_t w = output->current_mode->width;
+	uint64_t h = output->current_mode->height;
+	int32_t rw, rh;
+	uint32_t *render, *src;
+	uint32_t i, j;
+
+	output_get_render_size(output, &rw, &rh);
+
+	render = malloc((size_t) rw * rh * 4);
+	if (!render)
+		return -1;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, rw, rh, gl_format, GL_UNSIGNED_BYTE, render);
+
+	for (j = 0; j < height; j++) {
+		src = render + (y + j) * rh / h * rw;
+		for (i = 0; i < width; i++)
+			*pixels++ = src[(x + i) * rw / w];
+	}
+
+	free(render);
+
+	return 0;
+}
+
+static int
+gl_renderer_read_pixels(struct weston_output *output,
+			       pixman_format_code_t format, void *pixels,
+			       uint32_t x, uint32_t y,
+			       uint32_t width, uint32_t height)
+{
+	GLenum gl_format;
+	struct gl_output_state *go = get_output_state(output);
+
+	gl_renderer_wait_render_threads(get_renderer(output->compositor));
+
+	if (output_is_render_scaled(output)) {
+		if (read_format_to_gl(format, &gl_format) < 0 ||
+		    use_output(output) < 0)
+			return -1;
+
+		return read_pixels_render_scaled(output, gl_format, pixels,
+						 x, y, width, height);
+	}
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	if (read_format_to_gl(format, &gl_format) < 0)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, pixels);
+
+	return 0;
+}
+
+static void
+gl_readback_destroy(struct gl_renderer *gr, struct gl_readback *rb)
+{
+	wl_list_remove(&rb->link);
+
+	if (rb->fence_source)
+		wl_event_source_remove(rb->fence_source);
+	if (rb->fence_fd >= 0)
+		close(rb->fence_fd);
+	if (rb->fence)
+		gr->delete_sync(rb->fence);
+
+	glDeleteBuffers(1, &rb->pbo);
+	free(rb);
+}
+
+static bool
+gl_readback_is_ready(struct gl_renderer *gr, struct gl_readback *rb)
+{
+	struct pollfd pfd;
+
+	if (rb->fence_fd >= 0) {
+		pfd.fd = rb->fence_fd;
+		pfd.events = POLLIN;
+		return poll(&pfd, 1, 0) != 0;
+	}
+
+	/* On GL_WAIT_FAILED, mapping the buffer waits for us. */
+	return gr->client_wait_sync(rb->fence, 0, 0) != GL_TIMEOUT_EXPIRED;
+}
+
+/* Hand every finished read back at the head of the queue to its owner.
+ * Stops at the first one still in flight, so completions stay in the
+ * order the reads were issued in. */
+static void
+gl_process_readbacks(struct gl_renderer *gr, struct wl_list *queue,
+		     struct wl_event_source *timer)
+{
+	struct gl_readback *rb;
+	void *pixels;
+
+	while (!wl_list_empty(queue)) {
+		rb = container_of(queue->next, struct gl_readback, link);
+		if (!gl_readback_is_ready(gr, rb))
+			break;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		pixels = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0,
+					      rb->size, GL_MAP_READ_BIT);
+		if (!pixels)
+			weston_log("failed to map read back buffer\n");
+
+		rb->done(rb->data, pixels);
+
+		if (pixels)
+			gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		gl_readback_destroy(gr, rb);
+	}
+
+	if (!wl_list_empty(queue)) {
+		rb = container_of(queue->next, struct gl_readback, link);
+		if (rb->fence_fd < 0)
+			wl_event_source_timer_update(timer,
+						     READBACK_POLL_INTERVAL_MS);
+	}
+}
+
+static void
+gl_output_process_readbacks(struct weston_output *output)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+
+	if (use_output(output) < 0)
+		return;
+
+	gl_process_readbacks(gr, &go->readbacks, go->readback_timer);
+}
+
+/* Surface captures were drawn with whatever was current, and only need
+ * the context for mapping their buffers. */
+static void
+gl_renderer_process_captures(struct gl_renderer *gr)
+{
+	gl_process_readbacks(gr, &gr->captures, gr->capture_timer);
+}
+
+static int
+gl_readback_fence_handler(int fd, uint32_t mask, void *data)
+{
+	struct gl_readback *rb = data;
+
+	/* The fence stays readable once signalled, stop listening. */
+	wl_event_source_remove(rb->fence_source);
+	rb->fence_source = NULL;
+
+	if (rb->output)
+		gl_output_process_readbacks(rb->output);
+	else
+		gl_renderer_process_captures(rb->renderer);
+
+	return 0;
+}
+
+static int
+gl_readback_timer_handler(void *data)
+{
+	gl_output_process_readbacks(data);
+
+	return 0;
+}
+
+static int
+gl_capture_timer_handler(void *data)
+{
+	gl_renderer_process_captures(data);
+
+	return 0;
+}
+
+/* Export a fence for everything submitted so far as a file descriptor
+ * the event loop can wait on. Returns -1 if the driver cannot. */
+static int
+gl_renderer_create_fence_fd(struct gl_renderer *gr)
+{
+	EGLSyncKHR sync;
+	int fd;
+
+	if (!gr->has_native_fence_sync)
+		return -1;
+
+	sync = gr->create_sync(gr->egl_display,
+			       EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+	if (sync == EGL_NO_SYNC_KHR)
+		return -1;
+
+	/* The fd is only created once the fence has been flushed. */
+	glFlush();
+
+	fd = gr->dup_native_fence_fd(gr->egl_display, sync);
+	gr->destroy_sync(gr->egl_display, sync);
+
+	return fd == EGL_NO_NATIVE_FENCE_FD_ANDROID ? -1 : fd;
+}
+
+/* Queue a read back of size bytes at the end of queue, with a pixel
+ * buffer object for glReadPixels() to write into. */
+static struct gl_readback *
+gl_readback_create(struct gl_renderer *gr, struct wl_list *queue,
+		   GLsizeiptr size, weston_read_pixels_done_func_t done,
+		   void *data)
+{
+	struct gl_readback *rb;
+
+	rb = zalloc(sizeof *rb);
+	if (!rb)
+		return NULL;
+
+	rb->renderer = gr;
+	rb->fence_fd = -1;
+	rb->size = size;
+	rb->done = done;
+	rb->data = data;
+	wl_list_insert(queue->prev, &rb->link);
+
+	glGenBuffers(1, &rb->pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, rb->size, NULL, GL_STREAM_READ);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return rb;
+}
+
+/* Fence the read back just issued for rb, and have it processed from
+ * the event loop once the fence signals, or from timer otherwise.
+ * Destroys rb on failure. */
+static int
+gl_readback_submit(struct gl_renderer *gr, struct gl_readback *rb,
+		   struct wl_event_loop *loop, struct wl_event_source *timer)
+{
+	rb->fence_fd = gl_renderer_create_fence_fd(gr);
+	if (rb->fence_fd >= 0) {
+		rb->fence_source =
+			wl_event_loop_add_fd(loop, rb->fence_fd,
+					     WL_EVENT_READABLE,
+					     gl_readback_fence_handler, rb);
+		if (rb->fence_source)
+			return 0;
+
+		close(rb->fence_fd);
+		rb->fence_fd = -1;
+	}
+
+	rb->fence = gr->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	if (!rb->fence) {
+		gl_readback_destroy(gr, rb);
+		return -1;
+	}
+	glFlush();
+
+	wl_event_source_timer_update(timer, READBACK_POLL_INTERVAL_MS);
+
+	return 0;
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(output->compositor->wl_display);
+	struct gl_readback *rb;
+	GLenum gl_format;
+	void *pixels;
+
+	/* Without pixel buffer objects nothing is ever queued, so reading
+	 * synchronously keeps the completions in order. Reads of outputs
+	 * rendering below their resolution are scaled on the CPU anyway. */
+	if (!gr->has_pbo || output_is_render_scaled(output)) {
+		pixels = malloc(width * height * 4);
+		if (!pixels)
+			return -1;
+
+		if (gl_renderer_read_pixels(output, format, pixels,
+					    x, y, width, height) < 0) {
+			free(pixels);
+			return -1;
+		}
+
+		done(data, pixels);
+		free(pixels);
+
+		return 0;
+	}
+
+	if (read_format_to_gl(format, &gl_format) < 0)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	if (!go->readback_timer) {
+		go->readback_timer =
+			wl_event_loop_add_timer(loop,
+						gl_readback_timer_handler,
+						output);
+		if (!go->readback_timer)
+			return -1;
+	}
+
+	rb = gl_readback_create(gr, &go->readbacks,
+				(GLsizeiptr) width * height * 4, done, data);
+	if (!rb)
+		return -1;
+	rb->output = output;
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return gl_readback_submit(gr, rb, loop, go->readback_timer);
+}
+
+static int
+gl_format_bytes_per_pixel(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (format) {
+	case GL_BGRA_EXT:
+	case GL_RGBA:
+		return 4;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* Find a pixel buffer object that the GPU is done reading from, and make
+ * sure it can hold at least size bytes. Returns NULL, without blocking,
+ * if every slot still has a transfer in flight.
+ */
+static struct gl_upload_slot *
+gl_renderer_get_upload_slot(struct gl_renderer *gr, GLsizeiptr size)
+{
+	struct gl_upload_slot *slot;
+	GLenum status;
+	int i, idx;
+
+	for (i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+		idx = (gr->upload_next + i) % UPLOAD_SLOT_COUNT;
+		slot = &gr->upload_slots[idx];
+
+		if (slot->fence) {
+			status = gr->client_wait_sync(slot->fence, 0, 0);
+			if (status == GL_TIMEOUT_EXPIRED)
+				continue;
+
+			gr->delete_sync(slot->fence);
+			slot->fence = NULL;
+
+			/* We cannot tell whether the buffer is idle, so
+			 * orphan its storage below rather than writing
+			 * to it unsynchronized. */
+			if (status == GL_WAIT_FAILED)
+				slot->size = 0;
+		}
+
+		if (!slot->pbo)
+			glGenBuffers(1, &slot->pbo);
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+		if (slot->size < size) {
+			slot->size = (size + 0xffff) & ~0xffff;
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, slot->size,
+				     NULL, GL_STREAM_DRAW);
+		}
+
+		gr->upload_next = (idx + 1) % UPLOAD_SLOT_COUNT;
+
+		return slot;
+	}
+
+	return NULL;
+}
+
+/* Upload the damaged parts of a wl_shm buffer through a pixel buffer
+ * object. The damage is coalesced into at most UPLOAD_MAX_RECTS boxes,
+ * packed tightly into the buffer object and then transferred to the
+ * textures by the GPU, so glTexSubImage2D does not have to copy from
+ * client memory synchronously.
+ *
+ * Returns false if no buffer object was available, in which case the
+ * caller must fall back to uploading directly from the wl_shm pool.
+ */
+static bool
+gl_renderer_upload_damage_pbo(struct gl_renderer *gr,
+			      struct weston_surface *surface,
+			      struct gl_surface_state *gs,
+			      struct weston_buffer *buffer)
+{
+	pixman_box32_t boxes[UPLOAD_MAX_RECTS];
+	GLintptr offsets[UPLOAD_MAX_RECTS][3];
+	struct gl_upload_slot *slot;
+	pixman_box32_t *rectangles;
+	pixman_box32_t extents;
+	int64_t area = 0, extents_area;
+	GLsizeiptr size = 0;
+	int bpp[3];
+	int n, nboxes, i, j, row;
+	int x, y, w, h, stride, row_bytes;
+	uint8_t *data, *src, *dst, *map;
+
+	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
+	extents = *pixman_region32_extents(&gs->texture_damage);
+
+	for (i = 0; i < n && i < UPLOAD_MAX_RECTS; i++) {
+		boxes[i] = rectangles[i];
+		area += (int64_t) (boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+	}
+	nboxes = i;
+
+	extents_area = (int64_t) (extents.x2 - extents.x1) *
+		       (extents.y2 - extents.y1);
+	if (n > UPLOAD_MAX_RECTS || area * 2 >= extents_area) {
+		boxes[0] = extents;
+		nboxes = 1;
+	}
+
+	for (j = 0; j < gs->num_textures; j++)
+		bpp[j] = gl_format_bytes_per_pixel(gs->gl_format[j],
+						   gs->gl_pixel_type);
+
+	/* Rows are padded to the default GL_UNPACK_ALIGNMENT of 4. */
+	for (i = 0; i < nboxes; i++) {
+		for (j = 0; j < gs->num_textures; j++) {
+			w = (boxes[i].x2 - boxes[i].x1) / gs->hsub[j];
+			h = (boxes[i].y2 - boxes[i].y1) / gs->vsub[j];
+			offsets[i][j] = size;
+			size += ((w * bpp[j] + 3) & ~3) * h;
+		}
+	}
+
+	if (size == 0)
+		return true;
+
+	slot = gl_renderer_get_upload_slot(gr, size);
+	if (!slot)
+		return false;
+
+	map = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size,
+				   GL_MAP_WRITE_BIT |
+				   GL_MAP_INVALIDATE_BUFFER_BIT |
+				   GL_MAP_UNSYNCHRONIZED_BIT);
+	if (!map) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < nboxes; i++) {
+		for (j = 0; j < gs->num_textures; j++) {
+			x = boxes[i].x1 / gs->hsub[j];
+			y = boxes[i].y1 / gs->vsub[j];
+			w = (boxes[i].x2 - boxes[i].x1) / gs->hsub[j];
+			h = (boxes[i].y2 - boxes[i].y1) / gs->vsub[j];
+			stride = gs->pitch / gs->hsub[j] * bpp[j];
+			row_bytes = (w * bpp[j] + 3) & ~3;
+
+			src = data + gs->offset[j] + y * stride + x * bpp[j];
+			dst = map + offsets[i][j];
+			for (row = 0; row < h; row++)
+				memcpy(dst + row * row_bytes,
+				       src + row * stride, w * bpp[j]);
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	/* The store was corrupted while mapped; let the caller retry
+	 * from client memory. */
+	if (!gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER)) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+
+	for (i = 0; i < nboxes; i++) {
+		for (j = 0; j < gs->num_textures; j++) {
+			w = (boxes[i].x2 - boxes[i].x1) / gs->hsub[j];
+			h = (boxes[i].y2 - boxes[i].y1) / gs->vsub[j];
+			if (w == 0 || h == 0)
+				continue;
+
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0,
+					boxes[i].x1 / gs->hsub[j],
+					boxes[i].y1 / gs->vsub[j],
+					w, h,
+					gs->gl_format[j],
+					gs->gl_pixel_type,
+					(void *) offsets[i][j]);
+		}
+	}
+
+	slot->fence = gr->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	gr->base.upload_bytes += size;
+
+	return true;
+}
+
+static void
+gl_renderer_destroy_upload_slots(struct gl_renderer *gr)
+{
+	struct gl_upload_slot *slot;
+	int i;
+
+	for (i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+		slot = &gr->upload_slots[i];
+
+		if (slot->fence)
+			gr->delete_sync(slot->fence);
+		if (slot->pbo)
+			glDeleteBuffers(1, &slot->pbo);
+	}
+}
+
+/* Bytes of plane j of a buffer area, as counted in weston_output_stats */
+static uint64_t
+gl_surface_upload_size(struct gl_surface_state *gs, int j,
+		       int width, int height)
+{
+	return (uint64_t) (width / gs->hsub[j]) * (height / gs->vsub[j]) *
+		gl_format_bytes_per_pixel(gs->gl_format[j],
+					  gs->gl_pixel_type);
+}
+
+static uint64_t
+gl_renderer_surface_memory_bytes(struct weston_surface *surface)
+{
+	struct gl_surface_state *gs = surface->renderer_state;
+	uint64_t bytes = 0;
+	int j;
+
+	/* EGL and dmabuf buffers are sampled in place, and evicted
+	 * surfaces have no textures until shown again. */
+	if (!gs || gs->buffer_type != BUFFER_TYPE_SHM || gs->evicted_pixels)
+		return 0;
+
+	for (j = 0; j < gs->num_textures; j++)
+		bytes += gl_surface_upload_size(gs, j, gs->pitch, gs->height);
+
+	return bytes;
+}
+
+static void
+gl_renderer_flush_damage(struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct weston_buffer *buffer = gs->buffer_ref.buffer;
+	struct weston_view *view;
+	bool texture_used;
+	pixman_box32_t *rectangles;
+	void *data;
+	int i, j, n;
+
+	pixman_region32_union(&gs->texture_damage,
+			      &gs->texture_damage, &surface->buffer_damage);
+
+	if (!buffer)
+		return;
+
+	/* Avoid upload, if the texture won't be used this time.
+	 * We still accumulate the damage in texture_damage, and
+	 * hold the reference to the buffer, in case the surface
+	 * migrates back to the primary plane.
+	 */
+	texture_used = false;
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (view->plane == &surface->compositor->primary_plane) {
+			texture_used = true;
+			break;
+		}
+	}
+	if (!texture_used)
+		return;
+
+	if (!pixman_region32_not_empty(&gs->texture_damage) &&
+	    !gs->needs_full_upload)
+		goto done;
+
+	gl_renderer_wait_render_threads(gr);
+
+	if (gr->has_pbo && !gs->needs_full_upload &&
+	    gl_renderer_upload_damage_pbo(gr, surface, gs, buffer))
+		goto done;
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	if (!gr->has_unpack_subimage) {
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		for (j = 0; j < gs->num_textures; j++) {
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+					gs->pitch / gs->hsub[j],
+					buffer->height / gs->vsub[j],
+					gs->gl_format[j],
+					gs->gl_pixel_type,
+					data + gs->offset[j]);
+			gr->base.upload_bytes +=
+				gl_surface_upload_size(gs, j, gs->pitch,
+						       buffer->height);
+		}
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+
+		goto done;
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+
+	if (gs->needs_full_upload) {
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+		wl_shm_buffer_begin_access(buffer->shm_buffer);
+		for (j = 0; j < gs->num_textures; j++) {
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+					gs->pitch / gs->hsub[j],
+					buffer->height / gs->vsub[j],
+					gs->gl_format[j],
+					gs->gl_pixel_type,
+					data + gs->offset[j]);
+			gr->base.upload_bytes +=
+				gl_surface_upload_size(gs, j, gs->pitch,
+						       buffer->height);
+		}
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+		goto done;
+	}
+
+	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r = rectangles[i];
+
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
+		for (j = 0; j < gs->num_textures; j++) {
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0,
+					r.x1 / gs->hsub[j],
+					r.y1 / gs->vsub[j],
+					(r.x2 - r.x1) / gs->hsub[j],
+					(r.y2 - r.y1) / gs->vsub[j],
+					gs->gl_format[j],
+					gs->gl_pixel_type,
+					data + gs->offset[j]);
+			gr->base.upload_bytes +=
+				gl_surface_upload_size(gs, j, r.x2 - r.x1,
+						       r.y2 - r.y1);
+		}
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+done:
+	pixman_region32_fini(&gs->texture_damage);
+	pixman_region32_init(&gs->texture_damage);
+	gs->needs_full_upload = false;
+
+	weston_buffer_reference(&gs->buffer_ref, NULL);
+}
+
+/* Sized format for immutable storage of textures uploaded with the given
+ * format and type, or 0 to allocate them with glTexImage2D() */
+static GLenum
+gl_format_sized(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return GL_RGB565;
+	if (type == GL_UNSIGNED_INT_2_10_10_10_REV_EXT)
+		return GL_RGB10_A2_EXT;
+
+	switch (format) {
+	case GL_BGRA_EXT:
+		return GL_BGRA8_EXT;
+	case GL_RGBA:
+		return GL_RGBA8_OES;
+	case GL_LUMINANCE:
+		return GL_LUMINANCE8_EXT;
+	case GL_LUMINANCE_ALPHA:
+		return GL_LUMINANCE8_ALPHA8_EXT;
+	default:
+		/* GL_R8_EXT and GL_RG8_EXT are also passed as the upload
+		 * format, which immutable storage does not allow. */
+		return 0;
+	}
+}
+
+static uint64_t
+gl_pooled_texture_bytes(const struct gl_pooled_texture *t)
+{
+	return (uint64_t) t->width * t->height *
+		gl_format_bytes_per_pixel(t->format, t->type);
+}
+
+static void
+gl_pooled_texture_destroy(struct gl_renderer *gr, struct gl_pooled_texture *t)
+{
+	gr->texture_pool_bytes -= gl_pooled_texture_bytes(t);
+	glDeleteTextures(1, &t->tex);
+	wl_list_remove(&t->link);
+	free(t);
+}
+
+/* A texture with storage for width x height of format and type, from
+ * the pool if it has one, else new. */
+static GLuint
+gl_texture_pool_get(struct gl_renderer *gr, GLsizei width, GLsizei height,
+		    GLenum format, GLenum type)
+{
+	struct gl_pooled_texture *t;
+	GLenum sized;
+	GLuint tex;
+
+	wl_list_for_each(t, &gr->texture_pool, link) {
+		if (t->width != width || t->height != height ||
+		    t->format != format || t->type != type)
+			continue;
+
+		tex = t->tex;
+		gr->texture_pool_bytes -= gl_pooled_texture_bytes(t);
+		wl_list_remove(&t->link);
+		free(t);
+		return tex;
+	}
+
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	sized = gr->tex_storage_2d ? gl_format_sized(format, type) : 0;
+	if (sized)
+		gr->tex_storage_2d(GL_TEXTURE_2D, 1, sized, width, height);
+	else
+		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+			     format, type, NULL);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return tex;
+}
+
+static void
+gl_texture_pool_put(struct gl_renderer *gr, GLuint tex,
+		    GLsizei width, GLsizei height, GLenum format, GLenum type)
+{
+	struct gl_pooled_texture *t;
+
+	t = zalloc(sizeof *t);
+	if (!t) {
+		glDeleteTextures(1, &tex);
+		return;
+	}
+
+	t->tex = tex;
+	t->width = width;
+	t->height = height;
+	t->format = format;
+	t->type = type;
+	wl_list_insert(&gr->texture_pool, &t->link);
+	gr->texture_pool_bytes += gl_pooled_texture_bytes(t);
+
+	while (gr->texture_pool_bytes > TEXTURE_POOL_MAX_BYTES) {
+		t = container_of(gr->texture_pool.prev,
+				 struct gl_pooled_texture, link);
+		gl_pooled_texture_destroy(gr, t);
+	}
+}
+
+static void
+gl_texture_pool_clear(struct gl_renderer *gr)
+{
+	struct gl_pooled_texture *t, *tmp;
+
+	wl_list_for_each_safe(t, tmp, &gr->texture_pool, link)
+		gl_pooled_texture_destroy(gr, t);
+}
+
+/* Gives the surface's textures back to the pool, or deletes them if they
+ * are not from it. gl_format still has to describe them. */
+static void
+gl_surface_release_textures(struct gl_renderer *gr,
+			    struct gl_surface_state *gs)
+{
+	int j;
+
+	if (gs->textures_pooled) {
+		for (j = 0; j < gs->num_textures; j++)
+			gl_texture_pool_put(gr, gs->textures[j],
+					    gs->pooled_width[j],
+					    gs->pooled_height[j],
+					    gs->gl_format[j],
+					    gs->gl_pixel_type);
+	} else {
+		glDeleteTextures(gs->num_textures, gs->textures);
+	}
+
+	gs->num_textures = 0;
+	gs->textures_pooled = false;
+}
+
+static void
+ensure_textures(struct gl_surface_state *gs, int num_textures)
+{
+	int i;
+
+	/* Pooled textures may have immutable storage, which nothing else
+	 * can be put into. */
+	if (gs->textures_pooled)
+		gl_surface_release_textures(get_renderer(gs->surface->compositor),
+					    gs);
+
+	if (num_textures <= gs->num_textures)
+		return;
+
+	for (i = gs->num_textures; i < num_textures; i++) {
+		glGenTextures(1, &gs->textures[i]);
+		glBindTexture(gs->target, gs->textures[i]);
+		glTexParameteri(gs->target,
+				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(gs->target,
+				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	gs->num_textures = num_textures;
+	glBindTexture(gs->target, 0);
+}
+
+static void
+gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
+		       struct wl_shm_buffer *shm_buffer)
+{
+	struct weston_compositor *ec = es->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(es);
+	GLenum gl_format[3] = {0, 0, 0};
+	GLenum gl_pixel_type;
+	int pitch;
+	int num_planes;
+	int i;
+
+	buffer->shm_buffer = shm_buffer;
+	buffer->width = wl_shm_buffer_get_width(shm_buffer);
+	buffer->height = wl_shm_buffer_get_height(shm_buffer);
+
+	num_planes = 1;
+	gs->offset[0] = 0;
+	gs->hsub[0] = 1;
+	gs->vsub[0] = 1;
+
+	switch (wl_shm_buffer_get_format(shm_buffer)) {
+	case WL_SHM_FORMAT_XRGB8888:
+		gs->shader_variant = SHADER_VARIANT_RGBX;
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
+		gl_format[0] = GL_BGRA_EXT;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		break;
+	case WL_SHM_FORMAT_ARGB8888:
+		gs->shader_variant = SHADER_VARIANT_RGBA;
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
+		gl_format[0] = GL_BGRA_EXT;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		break;
+	case WL_SHM_FORMAT_XBGR8888:
+		gs->shader_variant = SHADER_VARIANT_RGBX;
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
+		gl_format[0] = GL_RGBA;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		break;
+	case WL_SHM_FORMAT_ABGR8888:
+		gs->shader_variant = SHADER_VARIANT_RGBA;
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
+		gl_format[0] = GL_RGBA;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		break;
+	case WL_SHM_FORMAT_RGB565:
+		gs->shader_variant = SHADER_VARIANT_RGBX;
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
+		gl_format[0] = GL_RGB;
+		gl_pixel_type = GL_UNSIGNED_SHORT_5_6_5;
+		break;
+	/* GL only has the 2:10:10:10 layout with red in the low bits, the
+	 * shader swaps red and blue back for the XRGB ones. */
+	case WL_SHM_FORMAT_XBGR2101010:
+	case WL_SHM_FORMAT_ABGR2101010:
+	case WL_SHM_FORMAT_XRGB2101010:
+	case WL_SHM_FORMAT_ARGB2101010:
+		if (!gr->has_texture_type_2_10_10_10_rev)
+			goto unknown;
+		switch (wl_shm_buffer_get_format(shm_buffer)) {
+		case WL_SHM_FORMAT_XBGR2101010:
+			gs->shader_variant = SHADER_VARIANT_RGBX;
+			break;
+		case WL_SHM_FORMAT_ABGR2101010:
+			gs->shader_variant = SHADER_VARIANT_RGBA;
+			break;
+		case WL_SHM_FORMAT_XRGB2101010:
+			gs->shader_variant = SHADER_VARIANT_BGRX;
+			break;
+		default:
+			gs->shader_variant = SHADER_VARIANT_BGRA;
+			break;
+		}
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
+		gl_format[0] = GL_RGBA;
+		gl_pixel_type = GL_UNSIGNED_INT_2_10_10_10_REV_EXT;
+		break;
+	case WL_SHM_FORMAT_YUV420:
+		gs->shader_variant = SHADER_VARIANT_Y_U_V;
+		pitch = wl_shm_buffer_get_stride(shm_buffer);
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		num_planes = 3;
+		gs->offset[1] = gs->offset[0] + (pitch / gs->hsub[0]) *
+				(buffer->height / gs->vsub[0]);
+		gs->hsub[1] = 2;
+		gs->vsub[1] = 2;
+		gs->offset[2] = gs->offset[1] + (pitch / gs->hsub[1]) *
+				(buffer->height / gs->vsub[1]);
+		gs->hsub[2] = 2;
+		gs->vsub[2] = 2;
+		if (gr->has_gl_texture_rg) {
+			gl_format[0] = GL_R8_EXT;
+			gl_format[1] = GL_R8_EXT;
+			gl_format[2] = GL_R8_EXT;
+		} else {
+			gl_format[0] = GL_LUMINANCE;
+			gl_format[1] = GL_LUMINANCE;
+			gl_format[2] = GL_LUMINANCE;
+		}
+		break;
+	case WL_SHM_FORMAT_NV12:
+		gs->shader_variant = SHADER_VARIANT_Y_XUXV;
+		pitch = wl_shm_buffer_get_stride(shm_buffer);
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		num_planes = 2;
+		gs->offset[1] = gs->offset[0] + (pitch / gs->hsub[0]) *
+				(buffer->height / gs->vsub[0]);
+		gs->hsub[1] = 2;
+		gs->vsub[1] = 2;
+		if (gr->has_gl_texture_rg) {
+			gl_format[0] = GL_R8_EXT;
+			gl_format[1] = GL_RG8_EXT;
+		} else {
+			gl_format[0] = GL_LUMINANCE;
+			gl_format[1] = GL_LUMINANCE_ALPHA;
+		}
+		break;
+	case WL_SHM_FORMAT_YUYV:
+		gs->shader_variant = SHADER_VARIANT_Y_XUXV;
+		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
+		gl_pixel_type = GL_UNSIGNED_BYTE;
+		num_planes = 2;
+		gs->hsub[1] = 2;
+		gs->vsub[1] = 1;
+		if (gr->has_gl_texture_rg)
+			gl_format[0] = GL_RG8_EXT;
+		else
+			gl_format[0] = GL_LUMINANCE_ALPHA;
+		gl_format[1] = GL_BGRA_EXT;
+		break;
+	default:
+	unknown:
+		weston_log("warning: unknown shm buffer format: %08x\n",
+			   wl_shm_buffer_get_format(shm_buffer));
+		return;
+	}
+
+	/* Only allocate a texture if it doesn't match existing one.
+	 * If a switch from DRM allocated buffer to a SHM buffer is
+	 * happening, we need to allocate a new texture buffer. */
+	if (pitch != gs->pitch ||
+	    buffer->height != gs->height ||
+	    gl_format[0] != gs->gl_format[0] ||
+	    gl_format[1] != gs->gl_format[1] ||
+	    gl_format[2] != gs->gl_format[2] ||
+	    gl_pixel_type != gs->gl_pixel_type ||
+	    gs->buffer_type != BUFFER_TYPE_SHM ||
+	    !gs->textures_pooled) {
+		gl_surface_release_textures(gr, gs);
+
+		gs->pitch = pitch;
+		gs->height = buffer->height;
+		gs->target = GL_TEXTURE_2D;
+		gs->gl_format[0] = gl_format[0];
+		gs->gl_format[1] = gl_format[1];
+		gs->gl_format[2] = gl_format[2];
+		gs->gl_pixel_type = gl_pixel_type;
+		gs->buffer_type = BUFFER_TYPE_SHM;
+		gs->needs_full_upload = true;
+		gs->y_inverted = 1;
+
+		gs->surface = es;
+
+		for (i = 0; i < num_planes; i++) {
+			gs->pooled_width[i] = pitch / gs->hsub[i];
+			gs->pooled_height[i] = buffer->height / gs->vsub[i];
+			gs->textures[i] =
+				gl_texture_pool_get(gr, gs->pooled_width[i],
+						    gs->pooled_height[i],
+						    gl_format[i],
+						    gl_pixel_type);
+		}
+		gs->num_textures = num_planes;
+		gs->textures_pooled = true;
+	}
+}
+
+static void
+egl_buffer_image_destroy(struct egl_buffer_image *image)
+{
+	int i;
+
+	for (i = 0; i < image->num_planes; i++) {
+		if (image->images[i])
+			egl_image_unref(image->images[i]);
+	}
+
+	wl_list_remove(&image->buffer_destroy_listener.link);
+	wl_list_remove(&image->link);
+	free(image);
+}
+
+static void
+egl_buffer_image_handle_buffer_destroy(struct wl_listener *listener,
+				       void *data)
+{
+	struct egl_buffer_image *image =
+		container_of(listener, struct egl_buffer_image,
+			     buffer_destroy_listener);
+
+	egl_buffer_image_destroy(image);
+}
+
+static struct egl_buffer_image *
+egl_buffer_image_get(struct weston_buffer *buffer)
+{
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 egl_buffer_image_handle_buffer_destroy);
+	if (!listener)
+		return NULL;
+
+	return container_of(listener, struct egl_buffer_image,
+			    buffer_destroy_listener);
+}
+
+/* Import an EGL buffer of the given EGL_TEXTURE_FORMAT, and fill in the
+ * size of the weston_buffer, which stays valid for its lifetime. */
+static struct egl_buffer_image *
+egl_buffer_image_create(struct gl_renderer *gr, struct weston_buffer *buffer,
+			EGLint format)
+{
+	struct egl_buffer_image *image;
+	EGLint attribs[3];
+	int i;
+
+	image = zalloc(sizeof *image);
+	if (!image)
+		return NULL;
+
+	buffer->legacy_buffer = (struct wl_buffer *)buffer->resource;
+	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
+			 EGL_WIDTH, &buffer->width);
+	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
+			 EGL_HEIGHT, &buffer->height);
+	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
+			 EGL_WAYLAND_Y_INVERTED_WL, &buffer->y_inverted);
+
+	image->buffer = buffer;
+	image->target = GL_TEXTURE_2D;
+	switch (format) {
+	case EGL_TEXTURE_RGB:
+	case EGL_TEXTURE_RGBA:
+	default:
+		image->num_planes = 1;
+		image->shader_variant = SHADER_VARIANT_RGBA;
+		break;
+	case EGL_TEXTURE_EXTERNAL_WL:
+		image->num_planes = 1;
+		image->target = GL_TEXTURE_EXTERNAL_OES;
+		image->shader_variant = SHADER_VARIANT_EXTERNAL;
+		break;
+	case EGL_TEXTURE_Y_UV_WL:
+		image->num_planes = 2;
+		image->shader_variant = SHADER_VARIANT_Y_UV;
+		break;
+	case EGL_TEXTURE_Y_U_V_WL:
+		image->num_planes = 3;
+		image->shader_variant = SHADER_VARIANT_Y_U_V;
+		break;
+	case EGL_TEXTURE_Y_XUXV_WL:
+		image->num_planes = 2;
+		image->shader_variant = SHADER_VARIANT_Y_XUXV;
+		break;
+	}
+
+	for (i = 0; i < image->num_planes; i++) {
+		attribs[0] = EGL_WAYLAND_PLANE_WL;
+		attribs[1] = i;
+		attribs[2] = EGL_NONE;
+		image->images[i] = egl_image_create(gr,
+						    EGL_WAYLAND_BUFFER_WL,
+						    buffer->legacy_buffer,
+						    attribs);
+		if (!image->images[i])
+			weston_log("failed to create img for plane %d\n", i);
+	}
+
+	image->buffer_destroy_listener.notify =
+		egl_buffer_image_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal,
+		      &image->buffer_destroy_listener);
+	wl_list_insert(&gr->egl_buffer_images, &image->link);
+
+	return image;
+}
+
+/* Only the texture binding is redone for a buffer seen before. */
+static void
+gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
+		       struct egl_buffer_image *image)
+{
+	struct weston_compositor *ec = es->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(es);
+	int i;
+
+	for (i = 0; i < gs->num_images; i++) {
+		egl_image_unref(gs->images[i]);
+		gs->images[i] = NULL;
+	}
+	gs->num_images = 0;
+	gs->target = image->target;
+	gs->shader_variant = image->shader_variant;
+
+	ensure_textures(gs, image->num_planes);
+	for (i = 0; i < image->num_planes; i++) {
+		if (!image->images[i])
+			continue;
+
+		gs->images[gs->num_images++] = egl_image_ref(image->images[i]);
+
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		gr->image_target_texture_2d(gs->target,
+					    image->images[i]->image);
+	}
+
+	gs->pitch = buffer->width;
+	gs->height = buffer->height;
+	gs->buffer_type = BUFFER_TYPE_EGL;
+	gs->y_inverted = buffer->y_inverted;
+}
+
+static void
+gl_renderer_destroy_dmabuf(struct linux_dmabuf_buffer *dmabuf)
+{
+	struct dmabuf_image *image = dmabuf->user_data;
+
+	dmabuf_image_destroy(image);
+}
+
+static struct egl_image *
+import_simple_dmabuf(struct gl_renderer *gr,
+                     struct dmabuf_attributes *attributes)
+{
+	struct egl_image *image;
+	EGLint attribs[50];
+	int atti = 0;
+	bool has_modifier;
+
+	/* Linear and implicit layouts are imported without a modifier, as
+	 * they always have been; other modifiers need the EGL extension. */
+	has_modifier = attributes->modifier[0] != DRM_FORMAT_MOD_INVALID &&
+		       attributes->modifier[0] != DRM_FORMAT_MOD_LINEAR;
+	if (has_modifier && !gr->has_dmabuf_import_modifiers)
+		return NULL;
+
+	/* This requires the Mesa commit in
+	 * Mesa 10.3 (08264e5dad4df448e7718e782ad9077902089a07) or
+	 * Mesa 10.2.7 (55d28925e6109a4afd61f109e845a8a51bd17652).
+	 * Otherwise Mesa closes the fd behind our back and re-importing
+	 * will fail.
+	 * https://bugs.freedesktop.org/show_bug.cgi?id=76188
+	 */
+
+	attribs[atti++] = EGL_WIDTH;
+	attribs[atti++] = attributes->width;
+	attribs[atti++] = EGL_HEIGHT;
+	attribs[atti++] = attributes->height;
+	attribs[atti++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[atti++] = attributes->format;
+
+	if (attributes->n_planes > 0) {
+		attribs[atti++] = EGL_DMA_BUF_PLANE0_FD_EXT;
+		attribs[atti++] = attributes->fd[0];
+		attribs[atti++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+		attribs[atti++] = attributes->offset[0];
+		attribs[atti++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
+		attribs[atti++] = attributes->stride[0];
+		if (has_modifier) {
+			attribs[atti++] = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+			attribs[atti++] = attributes->modifier[0] & 0xffffffff;
+			attribs[atti++] = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+			attribs[atti++] = attributes->modifier[0] >> 32;
+		}
+	}
+
+	if (attributes->n_planes > 1) {
+		attribs[atti++] = EGL_DMA_BUF_PLANE1_FD_EXT;
+		attribs[atti++] = attributes->fd[1];
+		attribs[atti++] = EGL_DMA_BUF_PLANE1_OFFSET_EXT;
+		attribs[atti++] = attributes->offset[1];
+		attribs[atti++] = EGL_DMA_BUF_PLANE1_PITCH_EXT;
+		attribs[atti++] = attributes->stride[1];
+		if (has_modifier) {
+			attribs[atti++] = EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT;
+			attribs[atti++] = attributes->modifier[1] & 0xffffffff;
+			attribs[atti++] = EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT;
+			attribs[atti++] = attributes->modifier[1] >> 32;
+		}
+	}
+
+	if (attributes->n_planes > 2) {
+		attribs[atti++] = EGL_DMA_BUF_PLANE2_FD_EXT;
+		attribs[atti++] = attributes->fd[2];
+		attribs[atti++] = EGL_DMA_BUF_PLANE2_OFFSET_EXT;
+		attribs[atti++] = attributes->offset[2];
+		attribs[atti++] = EGL_DMA_BUF_PLANE2_PITCH_EXT;
+		attribs[atti++] = attributes->stride[2];
+		if (has_modifier) {
+			attribs[atti++] = EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT;
+			attribs[atti++] = attributes->modifier[2] & 0xffffffff;
+			attribs[atti++] = EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT;
+			attribs[atti++] = attributes->modifier[2] >> 32;
+		}
+	}
+
+	if (gr->has_dmabuf_import_modifiers && attributes->n_planes > 3) {
+		attribs[atti++] = EGL_DMA_BUF_PLANE3_FD_EXT;
+		attribs[atti++] = attributes->fd[3];
+		attribs[atti++] = EGL_DMA_BUF_PLANE3_OFFSET_EXT;
+		attribs[atti++] = attributes->offset[3];
+		attribs[atti++] = EGL_DMA_BUF_PLANE3_PITCH_EXT;
+		attribs[atti++] = attributes->stride[3];
+		if (has_modifier) {
+			attribs[atti++] = EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT;
+			attribs[atti++] = attributes->modifier[3] & 0xffffffff;
+			attribs[atti++] = EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT;
+			attribs[atti++] = attributes->modifier[3] >> 32;
+		}
+	}
+
+	attribs[atti++] = EGL_NONE;
+
+	image = egl_image_create(gr, EGL_LINUX_DMA_BUF_EXT, NULL,
+				 attribs);
+
+	return image;
+}
+
+/* The kernel header drm_fourcc.h defines the DRM formats below.  We duplicate
+ * some of the definitions here so that building Weston won't require
+ * bleeding-edge kernel headers.
+ */
+#ifndef DRM_FORMAT_R8
+#define DRM_FORMAT_R8            fourcc_code('R', '8', ' ', ' ') /* [7:0] R */
+#endif
+
+#ifndef DRM_FORMAT_GR88
+#define DRM_FORMAT_GR88          fourcc_code('G', 'R', '8', '8') /* [15:0] G:R 8:8 little endian */
+#endif
+
+struct yuv_format_descriptor yuv_formats[] = {
+	{
+		.format = DRM_FORMAT_YUYV,
+		.input_planes = 1,
+		.output_planes = 2,
+		.texture_type = EGL_TEXTURE_Y_XUXV_WL,
+		{{
+			.width_divisor = 1,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_GR88,
+			.plane_index = 0
+		}, {
+			.width_divisor = 2,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_ARGB8888,
+			.plane_index = 0
+		}}
+	}, {
+		.format = DRM_FORMAT_NV12,
+		.input_planes = 2,
+		.output_planes = 2,
+		.texture_type = EGL_TEXTURE_Y_UV_WL,
+		{{
+			.width_divisor = 1,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 0
+		}, {
+			.width_divisor = 2,
+			.height_divisor = 2,
+			.format = DRM_FORMAT_GR88,
+			.plane_index = 1
+		}}
+	}, {
+		.format = DRM_FORMAT_YUV420,
+		.input_planes = 3,
+		.output_planes = 3,
+		.texture_type = EGL_TEXTURE_Y_U_V_WL,
+		{{
+			.width_divisor = 1,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 0
+		}, {
+			.width_divisor = 2,
+			.height_divisor = 2,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 1
+		}, {
+			.width_divisor = 2,
+			.height_divisor = 2,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 2
+		}}
+	}, {
+		.format = DRM_FORMAT_YUV444,
+		.input_planes = 3,
+		.output_planes = 3,
+		.texture_type = EGL_TEXTURE_Y_U_V_WL,
+		{{
+			.width_divisor = 1,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 0
+		}, {
+			.width_divisor = 1,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 1
+		}, {
+			.width_divisor = 1,
+			.height_divisor = 1,
+			.format = DRM_FORMAT_R8,
+			.plane_index = 2
+		}}
+	}
+};
+
+static struct egl_image *
+import_dmabuf_single_plane(struct gl_renderer *gr,
+                           const struct dmabuf_attributes *attributes,
+                           struct yuv_plane_descriptor *descriptor)
+{
+	struct dmabuf_attributes plane;
+	struct egl_image *image;
+	char fmt[4];
+
+	plane.width = attributes->width / descriptor->width_divisor;
+	plane.height = attributes->height / descriptor->height_divisor;
+	plane.format = descriptor->format;
+	plane.n_planes = 1;
+	plane.fd[0] = attributes->fd[descriptor->plane_index];
+	plane.offset[0] = attributes->offset[descriptor->plane_index];
+	plane.stride[0] = attributes->stride[descriptor->plane_index];
+	plane.modifier[0] = attributes->modifier[descriptor->plane_index];
+
+	image = import_simple_dmabuf(gr, &plane);
+	if (!image) {
+		weston_log("Failed to import plane %d as %.4s\n",
+		           descriptor->plane_index,
+		           dump_format(descriptor->format, fmt));
+		return NULL;
+	}
+
+	return image;
+}
+
+static bool
+import_yuv_dmabuf(struct gl_renderer *gr,
+                  struct dmabuf_image *image)
+{
+	unsigned i;
+	int j;
+	int ret;
+	struct yuv_format_descriptor *format = NULL;
+	struct dmabuf_attributes *attributes = &image->dmabuf->attributes;
+	char fmt[4];
+
+	for (i = 0; i < ARRAY_LENGTH(yuv_formats); ++i) {
+		if (yuv_formats[i].format == attributes->format) {
+			format = &yuv_formats[i];
+			break;
+		}
+	}
+
+	if (!format) {
+		weston_log("Error during import, and no known conversion for format "
+		           "%.4s in the renderer",
+		           dump_format(attributes->format, fmt));
+		return false;
+	}
+
+	if (attributes->n_planes != format->input_planes) {
+		weston_log("%.4s dmabuf must contain %d plane%s (%d provided)",
+		           dump_format(format->format, fmt),
+		           format->input_planes,
+		           (format->input_planes > 1) ? "s" : "",
+		           attributes->n_planes);
+		return false;
+	}
+
+	for (j = 0; j < format->output_planes; ++j) {
+		image->images[j] = import_dmabuf_single_plane(gr, attributes,
+		                                              &format->plane[j]);
+		if (!image->images[j]) {
+			while (j) {
+				ret = egl_image_unref(image->images[--j]);
+				assert(ret == 0);
+			}
+			return false;
+		}
+	}
+
+	image->num_images = format->output_planes;
+
+	switch (format->texture_type) {
+	case EGL_TEXTURE_Y_XUXV_WL:
+		image->shader_variant = SHADER_VARIANT_Y_XUXV;
+		break;
+	case EGL_TEXTURE_Y_UV_WL:
+		image->shader_variant = SHADER_VARIANT_Y_UV;
+		break;
+	case EGL_TEXTURE_Y_U_V_WL:
+		image->shader_variant = SHADER_VARIANT_Y_U_V;
+		break;
+	default:
+		assert(false);
+	}
+
+	return true;
+}
+
+static GLenum
+choose_texture_target(struct dmabuf_attributes *attributes)
+{
+	if (attributes->n_planes > 1)
+		return GL_TEXTURE_EXTERNAL_OES;
+
+	switch (attributes->format & ~DRM_FORMAT_BIG_ENDIAN) {
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_YVYU:
+	case DRM_FORMAT_UYVY:
 	case DRM_FORMAT_VYUY:
 	case DRM_FORMAT_AYUV:
 		return GL_TEXTURE_EXTERNAL_OES;
 	default:
-		return GL_TEXTURE_2D;
+		return GL_TEXTURE_2D;
+	}
+}
+
+static struct dmabuf_image *
+import_dmabuf(struct gl_renderer *gr,
+	      struct linux_dmabuf_buffer *dmabuf)
+{
+	struct egl_image *egl_image;
+	struct dmabuf_image *image;
+
+	image = dmabuf_image_create();
+	image->dmabuf = dmabuf;
+
+	egl_image = import_simple_dmabuf(gr, &dmabuf->attributes);
+	if (egl_image) {
+		image->num_images = 1;
+		image->images[0] = egl_image;
+		image->import_type = IMPORT_TYPE_DIRECT;
+		image->target = choose_texture_target(&dmabuf->attributes);
+
+		switch (image->target) {
+		case GL_TEXTURE_2D:
+			image->shader_variant = SHADER_VARIANT_RGBA;
+			break;
+		default:
+			image->shader_variant = SHADER_VARIANT_EXTERNAL;
+		}
+	} else {
+		if (!import_yuv_dmabuf(gr, image)) {
+			dmabuf_image_destroy(image);
+			return NULL;
+		}
+		image->import_type = IMPORT_TYPE_GL_CONVERSION;
+		image->target = GL_TEXTURE_2D;
+	}
+
+	return image;
+}
+
+static bool
+gl_renderer_import_dmabuf(struct weston_compositor *ec,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct dmabuf_image *image;
+	int i;
+
+	assert(gr->has_dmabuf_import);
+
+	/* All planes of a buffer share one layout */
+	for (i = 1; i < dmabuf->attributes.n_planes; i++) {
+		if (dmabuf->attributes.modifier[i] !=
+		    dmabuf->attributes.modifier[0])
+			return false;
+	}
+
+	/* reject all flags we do not recognize or handle */
+	if (dmabuf->attributes.flags & ~ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT)
+		return false;
+
+	image = import_dmabuf(gr, dmabuf);
+	if (!image)
+		return false;
+
+	wl_list_insert(&gr->dmabuf_images, &image->link);
+	linux_dmabuf_buffer_set_user_data(dmabuf, image,
+		gl_renderer_destroy_dmabuf);
+
+	return true;
+}
+
+static void
+gl_renderer_query_dmabuf_formats(struct weston_compositor *wc,
+				 int **formats, int *num_formats)
+{
+	struct gl_renderer *gr = get_renderer(wc);
+	static const int fallback_formats[] = {
+		DRM_FORMAT_ARGB8888,
+		DRM_FORMAT_XRGB8888,
+	};
+	bool fallback = false;
+	EGLint num;
+
+	assert(gr->has_dmabuf_import);
+
+	if (!gr->has_dmabuf_import_modifiers ||
+	    !gr->query_dmabuf_formats(gr->egl_display, 0, NULL, &num) ||
+	    num <= 0) {
+		num = ARRAY_LENGTH(fallback_formats);
+		fallback = true;
+	}
+
+	*formats = calloc(num, sizeof(int));
+	if (*formats == NULL) {
+		*num_formats = 0;
+		return;
+	}
+
+	if (fallback) {
+		memcpy(*formats, fallback_formats, sizeof(fallback_formats));
+	} else if (!gr->query_dmabuf_formats(gr->egl_display, num,
+					     *formats, &num)) {
+		free(*formats);
+		*formats = NULL;
+		num = 0;
+	}
+
+	*num_formats = num;
+}
+
+static void
+gl_renderer_query_dmabuf_modifiers(struct weston_compositor *wc, int format,
+				   uint64_t **modifiers, int *num_modifiers)
+{
+	struct gl_renderer *gr = get_renderer(wc);
+	EGLint num;
+
+	assert(gr->has_dmabuf_import);
+
+	*modifiers = NULL;
+	*num_modifiers = 0;
+
+	if (!gr->has_dmabuf_import_modifiers ||
+	    !gr->query_dmabuf_modifiers(gr->egl_display, format, 0, NULL,
+					NULL, &num) ||
+	    num <= 0)
+		return;
+
+	*modifiers = calloc(num, sizeof(uint64_t));
+	if (*modifiers == NULL)
+		return;
+
+	if (!gr->query_dmabuf_modifiers(gr->egl_display, format, num,
+					(EGLuint64KHR *) *modifiers, NULL,
+					&num)) {
+		free(*modifiers);
+		*modifiers = NULL;
+		return;
+	}
+
+	*num_modifiers = num;
+}
+
+static bool
+import_known_dmabuf(struct gl_renderer *gr,
+                    struct dmabuf_image *image)
+{
+	switch (image->import_type) {
+	case IMPORT_TYPE_DIRECT:
+		image->images[0] = import_simple_dmabuf(gr, &image->dmabuf->attributes);
+		if (!image->images[0])
+			return false;
+		break;
+
+	case IMPORT_TYPE_GL_CONVERSION:
+		if (!import_yuv_dmabuf(gr, image))
+			return false;
+		break;
+
+	default:
+		weston_log("Invalid import type for dmabuf\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void
+gl_renderer_attach_dmabuf(struct weston_surface *surface,
+			  struct weston_buffer *buffer,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct dmabuf_image *image;
+	int i;
+	int ret;
+
+	if (!gr->has_dmabuf_import) {
+		linux_dmabuf_buffer_send_server_error(dmabuf,
+				"EGL dmabuf import not supported");
+		return;
+	}
+
+	buffer->width = dmabuf->attributes.width;
+	buffer->height = dmabuf->attributes.height;
+
+	/*
+	 * GL-renderer uses the OpenGL convention of texture coordinates, where
+	 * the origin is at bottom-left. Because dmabuf buffers have the origin
+	 * at top-left, we must invert the Y_INVERT flag to get the image right.
+	 */
+	buffer->y_inverted =
+		!(dmabuf->attributes.flags & ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT);
+
+	for (i = 0; i < gs->num_images; i++)
+		egl_image_unref(gs->images[i]);
+	gs->num_images = 0;
+
+	/*
+	 * We try to always hold an imported EGLImage from the dmabuf
+	 * to prevent the client from preventing re-imports. But, we also
+	 * need to re-import every time the contents may change because
+	 * GL driver's caching may need flushing.
+	 *
+	 * Here we release the cache reference which has to be final.
+	 */
+	image = linux_dmabuf_buffer_get_user_data(dmabuf);
+
+	/* The dmabuf_image should have been created during the import */
+	assert(image != NULL);
+
+	for (i = 0; i < image->num_images; ++i) {
+		ret = egl_image_unref(image->images[i]);
+		assert(ret == 0);
+	}
+
+	if (!import_known_dmabuf(gr, image)) {
+		linux_dmabuf_buffer_send_server_error(dmabuf, "EGL dmabuf import failed");
+		return;
+	}
+
+	gs->num_images = image->num_images;
+	for (i = 0; i < gs->num_images; ++i)
+		gs->images[i] = egl_image_ref(image->images[i]);
+
+	gs->target = image->target;
+	ensure_textures(gs, gs->num_images);
+	for (i = 0; i < gs->num_images; ++i) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		gr->image_target_texture_2d(gs->target, gs->images[i]->image);
+	}
+
+	gs->shader_variant = image->shader_variant;
+	gs->pitch = buffer->width;
+	gs->height = buffer->height;
+	gs->buffer_type = BUFFER_TYPE_EGL;
+	gs->y_inverted = buffer->y_inverted;
+}
+
+static void
+gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
+{
+	struct weston_compositor *ec = es->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(es);
+	struct wl_shm_buffer *shm_buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct egl_buffer_image *egl_image = NULL;
+	EGLint format;
+	int i;
+
+	gl_renderer_wait_render_threads(gr);
+
+	/* Nothing of the evicted contents is shown any more */
+	gl_surface_drop_evicted(gs);
+
+	weston_buffer_reference(&gs->buffer_ref, buffer);
+	weston_buffer_release_reference(&gs->buffer_release_ref,
+					es->buffer_release_ref.buffer_release);
+
+	if (!buffer) {
+		for (i = 0; i < gs->num_images; i++) {
+			egl_image_unref(gs->images[i]);
+			gs->images[i] = NULL;
+		}
+		gs->num_images = 0;
+		gl_surface_release_textures(gr, gs);
+		gs->buffer_type = BUFFER_TYPE_NULL;
+		gs->y_inverted = 1;
+		return;
+	}
+
+	shm_buffer = wl_shm_buffer_get(buffer->resource);
+
+	if (!shm_buffer && gr->has_bind_display) {
+		egl_image = egl_buffer_image_get(buffer);
+		if (!egl_image &&
+		    gr->query_buffer(gr->egl_display,
+				     (void *)buffer->resource,
+				     EGL_TEXTURE_FORMAT, &format))
+			egl_image = egl_buffer_image_create(gr, buffer, format);
+	}
+
+	if (shm_buffer)
+		gl_renderer_attach_shm(es, buffer, shm_buffer);
+	else if (egl_image)
+		gl_renderer_attach_egl(es, buffer, egl_image);
+	else if ((dmabuf = linux_dmabuf_buffer_get(buffer->resource)))
+		gl_renderer_attach_dmabuf(es, buffer, dmabuf);
+	else {
+		weston_log("unhandled buffer type!\n");
+		weston_buffer_reference(&gs->buffer_ref, NULL);
+		weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
+		gs->buffer_type = BUFFER_TYPE_NULL;
+		gs->y_inverted = 1;
+	}
+}
+
+static void
+gl_renderer_surface_set_color(struct weston_surface *surface,
+		 float red, float green, float blue, float alpha)
+{
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+
+	gs->color[0] = red;
+	gs->color[1] = green;
+	gs->color[2] = blue;
+	gs->color[3] = alpha;
+	gs->buffer_type = BUFFER_TYPE_SOLID;
+	gs->pitch = 1;
+	gs->height = 1;
+
+	gs->shader_variant = SHADER_VARIANT_SOLID;
+}
+
+static void
+gl_renderer_surface_get_content_size(struct weston_surface *surface,
+				     int *width, int *height)
+{
+	struct gl_surface_state *gs = get_surface_state(surface);
+
+	if (gs->buffer_type == BUFFER_TYPE_NULL) {
+		*width = 0;
+		*height = 0;
+	} else {
+		*width = gs->pitch;
+		*height = gs->height;
+	}
+}
+
+static uint32_t
+pack_color(pixman_format_code_t format, float *c)
+{
+	uint8_t r = round(c[0] * 255.0f);
+	uint8_t g = round(c[1] * 255.0f);
+	uint8_t b = round(c[2] * 255.0f);
+	uint8_t a = round(c[3] * 255.0f);
+
+	switch (format) {
+	case PIXMAN_a8b8g8r8:
+		return (a << 24) | (b << 16) | (g << 8) | r;
+	default:
+		assert(0);
+		return 0;
+	}
+}
+
+/* Draw the surface's content over the whole of the bound framebuffer,
+ * which must be width x height. */
+static int
+draw_surface(struct gl_renderer *gr, struct gl_surface_state *gs,
+	     int width, int height, GLint filter)
+{
+	static const GLfloat verts[4 * 2] = {
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		1.0f, 1.0f,
+		0.0f, 1.0f
+	};
+	static const GLfloat projmat_normal[16] = { /* transpose */
+		 2.0f,  0.0f, 0.0f, 0.0f,
+		 0.0f,  2.0f, 0.0f, 0.0f,
+		 0.0f,  0.0f, 1.0f, 0.0f,
+		-1.0f, -1.0f, 0.0f, 1.0f
+	};
+	static const GLfloat projmat_yinvert[16] = { /* transpose */
+		 2.0f,  0.0f, 0.0f, 0.0f,
+		 0.0f, -2.0f, 0.0f, 0.0f,
+		 0.0f,  0.0f, 1.0f, 0.0f,
+		-1.0f,  1.0f, 0.0f, 1.0f
+	};
+	struct gl_shader *shader;
+	const GLfloat *proj;
+	int i;
+
+	glViewport(0, 0, width, height);
+	glDisable(GL_BLEND);
+	shader = use_shader(gr, gs->shader_variant, SHADER_FLAG_NO_VIEW_ALPHA);
+	if (!shader)
+		return -1;
+
+	if (gs->y_inverted)
+		proj = projmat_normal;
+	else
+		proj = projmat_yinvert;
+
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, proj);
+	glUniform1f(shader->alpha_uniform, 1.0f);
+
+	for (i = 0; i < gs->num_textures; i++) {
+		glUniform1i(shader->tex_uniforms[i], i);
+
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+	}
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glEnableVertexAttribArray(0);
+
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glEnableVertexAttribArray(1);
+
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	return 0;
+}
+
+/* Bind a new framebuffer for tex, and check that it can be drawn to.
+ * Returns 0 on failure. */
+static GLuint
+framebuffer_for_texture(GLuint tex)
+{
+	GLuint fbo;
+	GLenum status;
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, tex, 0);
+
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		weston_log("%s: fbo error: %#x\n", __func__, status);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &fbo);
+		return 0;
+	}
+
+	return fbo;
+}
+
+/* Draw the surface's content over the whole of tex, which must be
+ * width x height, and return the framebuffer left bound to it for
+ * reading back, or 0 on failure. */
+static GLuint
+draw_surface_to_texture(struct gl_renderer *gr, struct gl_surface_state *gs,
+			GLuint tex, int width, int height, GLint filter)
+{
+	GLuint fbo;
+
+	fbo = framebuffer_for_texture(tex);
+	if (!fbo)
+		return 0;
+
+	if (draw_surface(gr, gs, width, height, filter) < 0) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &fbo);
+		return 0;
 	}
+
+	return fbo;
 }
 
-static struct dmabuf_image *
-import_dmabuf(struct gl_renderer *gr,
-	      struct linux_dmabuf_buffer *dmabuf)
+static void
+gl_capture_fbo_destroy(struct gl_capture_fbo *cf)
 {
-	struct egl_image *egl_image;
-	struct dmabuf_image *image;
+	wl_list_remove(&cf->link);
+	glDeleteFramebuffers(1, &cf->fbo);
+	glDeleteTextures(1, &cf->tex);
+	free(cf);
+}
 
-	image = dmabuf_image_create();
-	image->dmabuf = dmabuf;
+/* Bind a framebuffer of the given size to draw surface contents into
+ * for reading back. Captures of the same size, like the thumbnails of
+ * a window switcher, keep using the same one. */
+static struct gl_capture_fbo *
+gl_capture_fbo_get(struct gl_renderer *gr, int width, int height)
+{
+	struct gl_capture_fbo *cf;
+	int count = 0;
+
+	wl_list_for_each(cf, &gr->capture_fbos, link) {
+		if (cf->width == width && cf->height == height) {
+			wl_list_remove(&cf->link);
+			wl_list_insert(&gr->capture_fbos, &cf->link);
+			glBindFramebuffer(GL_FRAMEBUFFER, cf->fbo);
+			return cf;
+		}
+		count++;
+	}
 
-	egl_image = import_simple_dmabuf(gr, &dmabuf->attributes);
-	if (egl_image) {
-		image->num_images = 1;
-		image->images[0] = egl_image;
-		image->import_type = IMPORT_TYPE_DIRECT;
-		image->target = choose_texture_target(&dmabuf->attributes);
+	if (count >= CAPTURE_FBO_CACHE_SIZE)
+		gl_capture_fbo_destroy(container_of(gr->capture_fbos.prev,
+						    struct gl_capture_fbo,
+						    link));
 
-		switch (image->target) {
-		case GL_TEXTURE_2D:
-			image->shader = &gr->texture_shader_rgba;
-			break;
-		default:
-			image->shader = &gr->texture_shader_egl_external;
-		}
-	} else {
-		if (!import_yuv_dmabuf(gr, image)) {
-			dmabuf_image_destroy(image);
-			return NULL;
-		}
-		image->import_type = IMPORT_TYPE_GL_CONVERSION;
-		image->target = GL_TEXTURE_2D;
+	cf = zalloc(sizeof *cf);
+	if (!cf)
+		return NULL;
+
+	glGenTextures(1, &cf->tex);
+	glBindTexture(GL_TEXTURE_2D, cf->tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	cf->fbo = framebuffer_for_texture(cf->tex);
+	if (!cf->fbo) {
+		glDeleteTextures(1, &cf->tex);
+		free(cf);
+		return NULL;
 	}
 
-	return image;
+	cf->width = width;
+	cf->height = height;
+	wl_list_insert(&gr->capture_fbos, &cf->link);
+
+	return cf;
 }
 
-static bool
-gl_renderer_import_dmabuf(struct weston_compositor *ec,
-			  struct linux_dmabuf_buffer *dmabuf)
+static void
+gl_capture_fbo_clear(struct gl_renderer *gr)
 {
-	struct gl_renderer *gr = get_renderer(ec);
-	struct dmabuf_image *image;
-	int i;
+	struct gl_capture_fbo *cf, *tmp;
 
-	assert(gr->has_dmabuf_import);
+	wl_list_for_each_safe(cf, tmp, &gr->capture_fbos, link)
+		gl_capture_fbo_destroy(cf);
+}
 
-	for (i = 0; i < dmabuf->attributes.n_planes; i++) {
-		/* EGL import does not have modifiers */
-		if (dmabuf->attributes.modifier[i] != 0)
-			return false;
+/* Draw the surface's whole content into a capture framebuffer, left
+ * bound for reading back from. Contents that are not in a texture
+ * cannot be drawn, returns -1 for those. */
+static int
+gl_surface_draw_capture(struct weston_surface *surface)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	int cw, ch;
+
+	switch (gs->buffer_type) {
+	case BUFFER_TYPE_NULL:
+	case BUFFER_TYPE_SOLID:
+		return -1;
+	case BUFFER_TYPE_SHM:
+		gl_renderer_flush_damage(surface);
+		gl_surface_restore(gr, gs);
+		/* fall through */
+	case BUFFER_TYPE_EGL:
+	case BUFFER_TYPE_COPY:
+	case BUFFER_TYPE_IMAGE:
+		break;
 	}
 
-	/* reject all flags we do not recognize or handle */
-	if (dmabuf->attributes.flags & ~ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT)
-		return false;
+	gl_renderer_surface_get_content_size(surface, &cw, &ch);
 
-	image = import_dmabuf(gr, dmabuf);
-	if (!image)
-		return false;
+	if (!gl_capture_fbo_get(gr, cw, ch))
+		return -1;
 
-	wl_list_insert(&gr->dmabuf_images, &image->link);
-	linux_dmabuf_buffer_set_user_data(dmabuf, image,
-		gl_renderer_destroy_dmabuf);
+	if (draw_surface(gr, gs, cw, ch, GL_NEAREST) < 0) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return -1;
+	}
 
-	return true;
+	return 0;
 }
 
-static bool
-import_known_dmabuf(struct gl_renderer *gr,
-                    struct dmabuf_image *image)
+static int
+gl_renderer_surface_copy_content(struct weston_surface *surface,
+				 void *target, size_t size,
+				 int src_x, int src_y,
+				 int width, int height)
 {
-	switch (image->import_type) {
-	case IMPORT_TYPE_DIRECT:
-		image->images[0] = import_simple_dmabuf(gr, &image->dmabuf->attributes);
-		if (!image->images[0])
-			return false;
-		break;
+	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
+	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
 
-	case IMPORT_TYPE_GL_CONVERSION:
-		if (!import_yuv_dmabuf(gr, image))
-			return false;
-		break;
+	gl_renderer_wait_render_threads(gr);
 
-	default:
-		weston_log("Invalid import type for dmabuf\n");
-		return false;
+	if (gs->buffer_type == BUFFER_TYPE_SOLID) {
+		*(uint32_t *)target = pack_color(format, gs->color);
+		return 0;
 	}
 
-	return true;
+	if (gl_surface_draw_capture(surface) < 0)
+		return -1;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, bytespp);
+	glReadPixels(src_x, src_y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, target);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return 0;
 }
 
-static void
-gl_renderer_attach_dmabuf(struct weston_surface *surface,
-			  struct weston_buffer *buffer,
-			  struct linux_dmabuf_buffer *dmabuf)
+static int
+gl_renderer_surface_copy_content_async(struct weston_surface *surface,
+				       int src_x, int src_y,
+				       int width, int height,
+				       weston_read_pixels_done_func_t done,
+				       void *data)
 {
+	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
-	struct dmabuf_image *image;
-	int i;
-	int ret;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(surface->compositor->wl_display);
+	struct gl_readback *rb;
 
-	if (!gr->has_dmabuf_import) {
-		linux_dmabuf_buffer_send_server_error(dmabuf,
-				"EGL dmabuf import not supported");
-		return;
+	/* Solid colors are copied right away by the caller */
+	if (!gr->has_pbo || gs->buffer_type == BUFFER_TYPE_SOLID)
+		return -1;
+
+	if (!gr->capture_timer) {
+		gr->capture_timer =
+			wl_event_loop_add_timer(loop,
+						gl_capture_timer_handler, gr);
+		if (!gr->capture_timer)
+			return -1;
 	}
 
-	buffer->width = dmabuf->attributes.width;
-	buffer->height = dmabuf->attributes.height;
+	gl_renderer_wait_render_threads(gr);
 
-	/*
-	 * GL-renderer uses the OpenGL convention of texture coordinates, where
-	 * the origin is at bottom-left. Because dmabuf buffers have the origin
-	 * at top-left, we must invert the Y_INVERT flag to get the image right.
-	 */
-	buffer->y_inverted =
-		!(dmabuf->attributes.flags & ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT);
+	if (gl_surface_draw_capture(surface) < 0)
+		return -1;
 
-	for (i = 0; i < gs->num_images; i++)
-		egl_image_unref(gs->images[i]);
-	gs->num_images = 0;
+	rb = gl_readback_create(gr, &gr->captures,
+				(GLsizeiptr) width * height * 4, done, data);
+	if (!rb) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return -1;
+	}
 
-	/*
-	 * We try to always hold an imported EGLImage from the dmabuf
-	 * to prevent the client from preventing re-imports. But, we also
-	 * need to re-import every time the contents may change because
-	 * GL driver's caching may need flushing.
-	 *
-	 * Here we release the cache reference which has to be final.
-	 */
-	image = linux_dmabuf_buffer_get_user_data(dmabuf);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(src_x, src_y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	/* The dmabuf_image should have been created during the import */
-	assert(image != NULL);
+	return gl_readback_submit(gr, rb, loop, gr->capture_timer);
+}
 
-	for (i = 0; i < image->num_images; ++i) {
-		ret = egl_image_unref(image->images[i]);
-		assert(ret == 0);
+static int
+gl_renderer_surface_copy_scaled(struct weston_surface *target,
+				struct weston_surface *surface,
+				int width, int height)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_surface_state *ts = get_surface_state(target);
+	GLuint fbo;
+	int i;
+
+	gl_renderer_wait_render_threads(gr);
+
+	switch (gs->buffer_type) {
+	case BUFFER_TYPE_NULL:
+	case BUFFER_TYPE_SOLID:
+		return -1;
+	case BUFFER_TYPE_SHM:
+		gl_renderer_flush_damage(surface);
+		gl_surface_restore(gr, gs);
+		/* fall through */
+	case BUFFER_TYPE_EGL:
+	case BUFFER_TYPE_COPY:
+	case BUFFER_TYPE_IMAGE:
+		break;
 	}
 
-	if (!import_known_dmabuf(gr, image)) {
-		linux_dmabuf_buffer_send_server_error(dmabuf, "EGL dmabuf import failed");
-		return;
+	/* The copy is a texture of the target's own, rendered to like a
+	 * client buffer would have been uploaded. */
+	if (ts->buffer_type != BUFFER_TYPE_COPY ||
+	    ts->pitch != width || ts->height != height) {
+		weston_buffer_reference(&ts->buffer_ref, NULL);
+		for (i = 0; i < ts->num_images; i++) {
+			egl_image_unref(ts->images[i]);
+			ts->images[i] = NULL;
+		}
+		ts->num_images = 0;
+		gl_surface_release_textures(gr, ts);
+
+		ts->target = GL_TEXTURE_2D;
+		ensure_textures(ts, 1);
+		glBindTexture(GL_TEXTURE_2D, ts->textures[0]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height,
+			     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		ts->buffer_type = BUFFER_TYPE_COPY;
+		ts->shader_variant = SHADER_VARIANT_RGBA;
+		ts->pitch = width;
+		ts->height = height;
+		ts->y_inverted = 1;
 	}
 
-	gs->num_images = image->num_images;
-	for (i = 0; i < gs->num_images; ++i)
-		gs->images[i] = egl_image_ref(image->images[i]);
+	/* Same filtering as drawing the surface scaled down on an output */
+	fbo = draw_surface_to_texture(gr, gs, ts->textures[0],
+				      width, height, GL_LINEAR);
+	if (!fbo)
+		return -1;
 
-	gs->target = image->target;
-	ensure_textures(gs, gs->num_images);
-	for (i = 0; i < gs->num_images; ++i) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		gr->image_target_texture_2d(gs->target, gs->images[i]->image);
-	}
+	glDeleteFramebuffers(1, &fbo);
 
-	gs->shader = image->shader;
-	gs->pitch = buffer->width;
-	gs->height = buffer->height;
-	gs->buffer_type = BUFFER_TYPE_EGL;
-	gs->y_inverted = buffer->y_inverted;
+	return 0;
 }
 
-static void
-gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
+static int
+gl_renderer_surface_set_image(struct weston_surface *surface,
+			      pixman_image_t *image)
 {
-	struct weston_compositor *ec = es->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(es);
-	struct wl_shm_buffer *shm_buffer;
-	struct linux_dmabuf_buffer *dmabuf;
-	EGLint format;
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
 	int i;
 
-	weston_buffer_reference(&gs->buffer_ref, buffer);
+	if (stride != width * 4 && !gr->has_unpack_subimage)
+		return -1;
 
-	if (!buffer) {
+	gl_renderer_wait_render_threads(gr);
+
+	/* Like a scaled copy, the image goes into a texture of the
+	 * surface's own, PIXMAN_a8r8g8b8 being WL_SHM_FORMAT_ARGB8888. */
+	if (gs->buffer_type != BUFFER_TYPE_IMAGE) {
+		gl_surface_drop_evicted(gs);
+		weston_buffer_reference(&gs->buffer_ref, NULL);
+		weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
 		for (i = 0; i < gs->num_images; i++) {
 			egl_image_unref(gs->images[i]);
 			gs->images[i] = NULL;
 		}
 		gs->num_images = 0;
-		glDeleteTextures(gs->num_textures, gs->textures);
-		gs->num_textures = 0;
-		gs->buffer_type = BUFFER_TYPE_NULL;
+		gl_surface_release_textures(gr, gs);
+
+		gs->target = GL_TEXTURE_2D;
+		ensure_textures(gs, 1);
+
+		gs->buffer_type = BUFFER_TYPE_IMAGE;
+		gs->shader_variant = SHADER_VARIANT_RGBA;
 		gs->y_inverted = 1;
-		return;
 	}
 
-	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	gs->pitch = width;
+	gs->height = height;
 
-	if (shm_buffer)
-		gl_renderer_attach_shm(es, buffer, shm_buffer);
-	else if (gr->has_bind_display &&
-		 gr->query_buffer(gr->egl_display, (void *)buffer->resource,
-				  EGL_TEXTURE_FORMAT, &format))
-		gl_renderer_attach_egl(es, buffer, format);
-	else if ((dmabuf = linux_dmabuf_buffer_get(buffer->resource)))
-		gl_renderer_attach_dmabuf(es, buffer, dmabuf);
-	else {
-		weston_log("unhandled buffer type!\n");
-		weston_buffer_reference(&gs->buffer_ref, NULL);
-		gs->buffer_type = BUFFER_TYPE_NULL;
-		gs->y_inverted = 1;
+	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, stride / 4);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
 	}
-}
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT, width, height, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE,
+		     pixman_image_get_data(image));
+	if (gr->has_unpack_subimage)
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-static void
-gl_renderer_surface_set_color(struct weston_surface *surface,
-		 float red, float green, float blue, float alpha)
-{
-	struct gl_surface_state *gs = get_surface_state(surface);
-	struct gl_renderer *gr = get_renderer(surface->compositor);
+	gr->base.upload_bytes += (uint64_t) stride * height;
 
-	gs->color[0] = red;
-	gs->color[1] = green;
-	gs->color[2] = blue;
-	gs->color[3] = alpha;
-	gs->buffer_type = BUFFER_TYPE_SOLID;
-	gs->pitch = 1;
-	gs->height = 1;
+	return 0;
+}
+
+/* Texture eviction
+ *
+ * The texture of a wl_shm surface holds the only copy of its contents,
+ * since the buffer goes back to the client once uploaded. A surface
+ * that has not been shown on any output for evict_timeout_msec, like a
+ * minimized window, has its texture read back into regular memory and
+ * freed. It is uploaded again from there when the surface is drawn,
+ * unless a new buffer comes first.
+ */
+
+static void
+gl_surface_mark_shown(struct gl_renderer *gr, struct gl_surface_state *gs,
+		      const struct timespec *now)
+{
+	if (gr->evict_timeout_msec == 0 ||
+	    gs->buffer_type != BUFFER_TYPE_SHM || gs->num_textures == 0)
+		return;
 
-	gs->shader = &gr->solid_shader;
+	gs->shown_time = *now;
+	wl_list_remove(&gs->evict_link);
+	wl_list_insert(gr->evict_list.prev, &gs->evict_link);
 }
 
 static void
-gl_renderer_surface_get_content_size(struct weston_surface *surface,
-				     int *width, int *height)
+output_mark_views_shown(struct weston_output *output)
 {
-	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct weston_draw_item *item;
+	struct timespec now;
 
-	if (gs->buffer_type == BUFFER_TYPE_NULL) {
-		*width = 0;
-		*height = 0;
-	} else {
-		*width = gs->pitch;
-		*height = gs->height;
-	}
+	if (gr->evict_timeout_msec == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wl_array_for_each(item, &output->draw_items)
+		gl_surface_mark_shown(gr, get_surface_state(item->surface),
+				      &now);
 }
 
-static uint32_t
-pack_color(pixman_format_code_t format, float *c)
+static void
+gl_surface_drop_evicted(struct gl_surface_state *gs)
 {
-	uint8_t r = round(c[0] * 255.0f);
-	uint8_t g = round(c[1] * 255.0f);
-	uint8_t b = round(c[2] * 255.0f);
-	uint8_t a = round(c[3] * 255.0f);
-
-	switch (format) {
-	case PIXMAN_a8b8g8r8:
-		return (a << 24) | (b << 16) | (g << 8) | r;
-	default:
-		assert(0);
-		return 0;
-	}
+	wl_list_remove(&gs->evict_link);
+	wl_list_init(&gs->evict_link);
+	free(gs->evicted_pixels);
+	gs->evicted_pixels = NULL;
 }
 
 static int
-gl_renderer_surface_copy_content(struct weston_surface *surface,
-				 void *target, size_t size,
-				 int src_x, int src_y,
-				 int width, int height)
+gl_surface_evict(struct gl_renderer *gr, struct gl_surface_state *gs)
 {
-	static const GLfloat verts[4 * 2] = {
-		0.0f, 0.0f,
-		1.0f, 0.0f,
-		1.0f, 1.0f,
-		0.0f, 1.0f
-	};
-	static const GLfloat projmat_normal[16] = { /* transpose */
-		 2.0f,  0.0f, 0.0f, 0.0f,
-		 0.0f,  2.0f, 0.0f, 0.0f,
-		 0.0f,  0.0f, 1.0f, 0.0f,
-		-1.0f, -1.0f, 0.0f, 1.0f
-	};
-	static const GLfloat projmat_yinvert[16] = { /* transpose */
-		 2.0f,  0.0f, 0.0f, 0.0f,
-		 0.0f, -2.0f, 0.0f, 0.0f,
-		 0.0f,  0.0f, 1.0f, 0.0f,
-		-1.0f,  1.0f, 0.0f, 1.0f
-	};
-	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
-	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
-	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
-	struct gl_renderer *gr = get_renderer(surface->compositor);
-	struct gl_surface_state *gs = get_surface_state(surface);
-	int cw, ch;
+	size_t size = (size_t) gs->pitch * gs->height * 4;
+	void *pixels;
 	GLuint fbo;
 	GLuint tex;
-	GLenum status;
-	const GLfloat *proj;
-	int i;
-
-	gl_renderer_surface_get_content_size(surface, &cw, &ch);
 
-	switch (gs->buffer_type) {
-	case BUFFER_TYPE_NULL:
+	pixels = malloc(size);
+	if (!pixels)
 		return -1;
-	case BUFFER_TYPE_SOLID:
-		*(uint32_t *)target = pack_color(format, gs->color);
-		return 0;
-	case BUFFER_TYPE_SHM:
-		gl_renderer_flush_damage(surface);
-		/* fall through */
-	case BUFFER_TYPE_EGL:
-		break;
-	}
 
 	glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cw, ch,
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gs->pitch, gs->height,
 		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
-	glGenFramebuffers(1, &fbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			       GL_TEXTURE_2D, tex, 0);
-
-	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	if (status != GL_FRAMEBUFFER_COMPLETE) {
-		weston_log("%s: fbo error: %#x\n", __func__, status);
-		glDeleteFramebuffers(1, &fbo);
+	fbo = draw_surface_to_texture(gr, gs, tex, gs->pitch, gs->height,
+				      GL_NEAREST);
+	if (!fbo) {
 		glDeleteTextures(1, &tex);
+		free(pixels);
 		return -1;
 	}
 
-	glViewport(0, 0, cw, ch);
-	glDisable(GL_BLEND);
-	use_shader(gr, gs->shader);
-	if (gs->y_inverted)
-		proj = projmat_normal;
-	else
-		proj = projmat_yinvert;
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, gs->pitch, gs->height, GL_RGBA,
+		     GL_UNSIGNED_BYTE, pixels);
 
-	glUniformMatrix4fv(gs->shader->proj_uniform, 1, GL_FALSE, proj);
-	glUniform1f(gs->shader->alpha_uniform, 1.0f);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &tex);
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glUniform1i(gs->shader->tex_uniforms[i], i);
+	/* Not into the pool: the point is to free the memory */
+	glDeleteTextures(gs->num_textures, gs->textures);
+	gs->num_textures = 0;
+	gs->textures_pooled = false;
 
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	/* Whatever buffer comes next is uploaded in full, into new
+	 * textures. */
+	gs->gl_format[0] = 0;
+	gs->gl_format[1] = 0;
+	gs->gl_format[2] = 0;
+
+	wl_list_remove(&gs->evict_link);
+	wl_list_init(&gs->evict_link);
+	gs->evicted_pixels = pixels;
+
+	return 0;
+}
+
+static void
+gl_surface_restore(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	if (!gs->evicted_pixels)
+		return;
+
+	gs->target = GL_TEXTURE_2D;
+	ensure_textures(gs, 1);
+
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
 	}
+	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gs->pitch, gs->height,
+		     0, GL_RGBA, GL_UNSIGNED_BYTE, gs->evicted_pixels);
+	gr->base.upload_bytes += (uint64_t) gs->pitch * gs->height * 4;
+
+	/* The read back copy is RGBA whatever the wl_shm format was, so
+	 * the next buffer does not match it and is uploaded in full. */
+	gs->shader_variant = SHADER_VARIANT_RGBA;
+	gs->gl_format[0] = GL_RGBA;
+	gs->gl_pixel_type = GL_UNSIGNED_BYTE;
+	gs->hsub[0] = 1;
+	gs->vsub[0] = 1;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
-	glEnableVertexAttribArray(0);
+	free(gs->evicted_pixels);
+	gs->evicted_pixels = NULL;
+}
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
-	glEnableVertexAttribArray(1);
+/* Evicts the surfaces not shown for max_age_msec or longer, and returns
+ * how many bytes of textures that freed. */
+static uint64_t
+gl_renderer_evict(struct weston_compositor *ec, int32_t max_age_msec)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs, *tmp;
+	struct weston_view *view;
+	struct timespec now;
+	uint64_t freed = 0;
+	EGLSurface draw = EGL_NO_SURFACE, read = EGL_NO_SURFACE;
+	bool current = false;
+
+	gl_renderer_wait_render_threads(gr);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* A surface that is on an output but was not repainted lately is
+	 * still shown. */
+	wl_list_for_each(view, &ec->view_list, link) {
+		if (view->output_mask)
+			gl_surface_mark_shown(gr,
+					      get_surface_state(view->surface),
+					      &now);
+	}
 
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	wl_list_for_each_safe(gs, tmp, &gr->evict_list, evict_link) {
+		if (timespec_sub_to_msec(&now, &gs->shown_time) < max_age_msec)
+			break;
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
+		/* Not uploaded yet, the buffer is still ours */
+		if (gs->buffer_ref.buffer)
+			continue;
 
-	glPixelStorei(GL_PACK_ALIGNMENT, bytespp);
-	glReadPixels(src_x, src_y, width, height, gl_format,
-		     GL_UNSIGNED_BYTE, target);
+		/* Off the output surfaces, and back as it was after */
+		if (!current) {
+			draw = eglGetCurrentSurface(EGL_DRAW);
+			read = eglGetCurrentSurface(EGL_READ);
+			if (!eglMakeCurrent(gr->egl_display, gr->dummy_surface,
+					    gr->dummy_surface,
+					    gr->egl_context))
+				return freed;
+			current = true;
+		}
 
-	glDeleteFramebuffers(1, &fbo);
-	glDeleteTextures(1, &tex);
+		if (gl_surface_evict(gr, gs) < 0)
+			break;
+
+		freed += (uint64_t) gs->pitch * gs->height * 4;
+	}
+
+	/* Pooled textures are not shown at all */
+	if (!wl_list_empty(&gr->texture_pool)) {
+		if (!current) {
+			draw = eglGetCurrentSurface(EGL_DRAW);
+			read = eglGetCurrentSurface(EGL_READ);
+			if (!eglMakeCurrent(gr->egl_display, gr->dummy_surface,
+					    gr->dummy_surface,
+					    gr->egl_context))
+				return freed;
+			current = true;
+		}
+
+		freed += gr->texture_pool_bytes;
+		gl_texture_pool_clear(gr);
+	}
+
+	if (current)
+		eglMakeCurrent(gr->egl_display, draw, read, gr->egl_context);
+
+	return freed;
+}
+
+static int
+evict_timer_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs;
+	struct timespec now;
+	int64_t next_msec = gr->evict_timeout_msec;
+
+	gl_renderer_evict(ec, gr->evict_timeout_msec);
+
+	/* Come back when the least recently shown surface is due */
+	if (!wl_list_empty(&gr->evict_list)) {
+		gs = container_of(gr->evict_list.next,
+				  struct gl_surface_state, evict_link);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		next_msec = gr->evict_timeout_msec -
+			timespec_sub_to_msec(&now, &gs->shown_time);
+		if (next_msec < 1000)
+			next_msec = 1000;
+	}
+
+	wl_event_source_timer_update(gr->evict_timer, next_msec);
+
+	return 0;
+}
+
+static int
+memory_pressure_handler(int fd, uint32_t mask, void *data)
+{
+	struct weston_compositor *ec = data;
+	struct epoll_event ev;
+	uint64_t freed;
+
+	/* The event loop polling the trigger already cleared it; this only
+	 * makes sure. */
+	epoll_wait(fd, &ev, 1, 0);
+
+	freed = gl_renderer_evict(ec, 1);
+	if (freed > 0)
+		weston_log("Memory pressure: freed %" PRIu64 " kB of "
+			   "textures of hidden surfaces\n", freed / 1024);
 
 	return 0;
 }
 
+/* Kernel pressure stall information: woken when tasks stall on memory
+ * for 150 ms within 2 s. The trigger only signals POLLPRI, which the
+ * event loop does not watch for, so it goes through an epoll fd of its
+ * own that becomes readable instead. */
+static void
+gl_renderer_watch_memory_pressure(struct weston_compositor *ec)
+{
+	static const char trigger[] = "some 150000 2000000";
+	struct gl_renderer *gr = get_renderer(ec);
+	struct epoll_event ev = { .events = EPOLLPRI };
+	int psi_fd;
+
+	gr->pressure_fd = -1;
+
+	psi_fd = open("/proc/pressure/memory",
+		      O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (psi_fd < 0)
+		return;
+
+	if (write(psi_fd, trigger, sizeof trigger) < 0) {
+		weston_log("Cannot watch memory pressure: %m\n");
+		close(psi_fd);
+		return;
+	}
+
+	/* The epoll fd keeps the trigger alive */
+	gr->pressure_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (gr->pressure_fd < 0 ||
+	    epoll_ctl(gr->pressure_fd, EPOLL_CTL_ADD, psi_fd, &ev) < 0)
+		goto err;
+
+	gr->pressure_source =
+		wl_event_loop_add_fd(wl_display_get_event_loop(ec->wl_display),
+				     gr->pressure_fd, WL_EVENT_READABLE,
+				     memory_pressure_handler, ec);
+	if (!gr->pressure_source)
+		goto err;
+
+	close(psi_fd);
+	return;
+
+err:
+	if (gr->pressure_fd >= 0)
+		close(gr->pressure_fd);
+	gr->pressure_fd = -1;
+	close(psi_fd);
+}
+
+static void
+gl_renderer_setup_eviction(struct weston_compositor *ec)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+
+	wl_list_init(&gr->evict_list);
+	gr->pressure_fd = -1;
+
+	if (ec->texture_evict_timeout <= 0)
+		return;
+
+	gr->evict_timeout_msec = ec->texture_evict_timeout * 1000;
+	gr->evict_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(ec->wl_display),
+					evict_timer_handler, ec);
+	if (!gr->evict_timer) {
+		gr->evict_timeout_msec = 0;
+		return;
+	}
+	wl_event_source_timer_update(gr->evict_timer, gr->evict_timeout_msec);
+
+	gl_renderer_watch_memory_pressure(ec);
+}
+
 static void
 surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 {
 	int i;
 
+	gl_renderer_wait_render_threads(gr);
+
 	wl_list_remove(&gs->surface_destroy_listener.link);
 	wl_list_remove(&gs->renderer_destroy_listener.link);
 
 	gs->surface->renderer_state = NULL;
 
-	glDeleteTextures(gs->num_textures, gs->textures);
+	gl_surface_drop_evicted(gs);
+	gl_surface_release_textures(gr, gs);
 
 	for (i = 0; i < gs->num_images; i++)
 		egl_image_unref(gs->images[i]);
 
 	weston_buffer_reference(&gs->buffer_ref, NULL);
+	weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
 	pixman_region32_fini(&gs->texture_damage);
 	free(gs);
 }
@@ -2268,6 +5993,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 
 	gs->surface = surface;
 
+	wl_list_init(&gs->evict_link);
 	pixman_region32_init(&gs->texture_damage);
 	surface->renderer_state = gs;
 
@@ -2302,13 +6028,19 @@ static const char vertex_shader[] =
 
 /* Declare common fragment shader uniforms */
 #define FRAGMENT_CONVERT_YUV						\
-	"  y *= alpha;\n"						\
-	"  u *= alpha;\n"						\
-	"  v *= alpha;\n"						\
 	"  gl_FragColor.r = y + 1.59602678 * v;\n"			\
 	"  gl_FragColor.g = y - 0.39176229 * u - 0.81296764 * v;\n"	\
 	"  gl_FragColor.b = y + 2.01723214 * u;\n"			\
-	"  gl_FragColor.a = alpha;\n"
+	"  gl_FragColor.a = 1.0;\n"
+
+/* The fragment shaders below leave the unmultiplied colour of the
+ * fragment in gl_FragColor; the pieces that follow are added according
+ * to the SHADER_FLAG_* bits of the variant. */
+static const char fragment_alpha[] =
+	"  gl_FragColor = alpha * gl_FragColor;\n";
+
+static const char fragment_dim[] =
+	"  gl_FragColor.rgb *= 1.0 - dim;\n";
 
 static const char fragment_debug[] =
 	"  gl_FragColor = vec4(0.0, 0.3, 0.0, 0.2) + gl_FragColor * 0.8;\n";
@@ -2321,9 +6053,10 @@ static const char texture_fragment_shader_rgba[] =
 	"varying vec2 v_texcoord;\n"
 	"uniform sampler2D tex;\n"
 	"uniform float alpha;\n"
+	"uniform float dim;\n"
 	"void main()\n"
 	"{\n"
-	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
+	"   gl_FragColor = texture2D(tex, v_texcoord);\n"
 	;
 
 static const char texture_fragment_shader_rgbx[] =
@@ -2331,10 +6064,34 @@ static const char texture_fragment_shader_rgbx[] =
 	"varying vec2 v_texcoord;\n"
 	"uniform sampler2D tex;\n"
 	"uniform float alpha;\n"
+	"uniform float dim;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_FragColor.rgb = texture2D(tex, v_texcoord).rgb;\n"
+	"   gl_FragColor.a = 1.0;\n"
+	;
+
+static const char texture_fragment_shader_bgra[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"uniform float alpha;\n"
+	"uniform float dim;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_FragColor = texture2D(tex, v_texcoord).bgra;\n"
+	;
+
+static const char texture_fragment_shader_bgrx[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"uniform float alpha;\n"
+	"uniform float dim;\n"
 	"void main()\n"
 	"{\n"
-	"   gl_FragColor.rgb = alpha * texture2D(tex, v_texcoord).rgb\n;"
-	"   gl_FragColor.a = alpha;\n"
+	"   gl_FragColor.rgb = texture2D(tex, v_texcoord).bgr;\n"
+	"   gl_FragColor.a = 1.0;\n"
 	;
 
 static const char texture_fragment_shader_egl_external[] =
@@ -2343,9 +6100,10 @@ static const char texture_fragment_shader_egl_external[] =
 	"varying vec2 v_texcoord;\n"
 	"uniform samplerExternalOES tex;\n"
 	"uniform float alpha;\n"
+	"uniform float dim;\n"
 	"void main()\n"
 	"{\n"
-	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
+	"   gl_FragColor = texture2D(tex, v_texcoord);\n"
 	;
 
 static const char texture_fragment_shader_y_uv[] =
@@ -2354,6 +6112,7 @@ static const char texture_fragment_shader_y_uv[] =
 	"uniform sampler2D tex1;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform float alpha;\n"
+	"uniform float dim;\n"
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
@@ -2368,6 +6127,7 @@ static const char texture_fragment_shader_y_u_v[] =
 	"uniform sampler2D tex2;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform float alpha;\n"
+	"uniform float dim;\n"
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
@@ -2381,6 +6141,7 @@ static const char texture_fragment_shader_y_xuxv[] =
 	"uniform sampler2D tex1;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform float alpha;\n"
+	"uniform float dim;\n"
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
@@ -2388,73 +6149,270 @@ static const char texture_fragment_shader_y_xuxv[] =
 	FRAGMENT_CONVERT_YUV
 	;
 
-static const char solid_fragment_shader[] =
-	"precision mediump float;\n"
-	"uniform vec4 color;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * color\n;"
-	;
+static const char solid_fragment_shader[] =
+	"precision mediump float;\n"
+	"uniform vec4 color;\n"
+	"uniform float alpha;\n"
+	"uniform float dim;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_FragColor = color;\n"
+	;
+
+static const char *fragment_shaders[SHADER_VARIANT_COUNT] = {
+	[SHADER_VARIANT_RGBX] = texture_fragment_shader_rgbx,
+	[SHADER_VARIANT_RGBA] = texture_fragment_shader_rgba,
+	[SHADER_VARIANT_BGRX] = texture_fragment_shader_bgrx,
+	[SHADER_VARIANT_BGRA] = texture_fragment_shader_bgra,
+	[SHADER_VARIANT_Y_U_V] = texture_fragment_shader_y_u_v,
+	[SHADER_VARIANT_Y_UV] = texture_fragment_shader_y_uv,
+	[SHADER_VARIANT_Y_XUXV] = texture_fragment_shader_y_xuxv,
+	[SHADER_VARIANT_SOLID] = solid_fragment_shader,
+	[SHADER_VARIANT_EXTERNAL] = texture_fragment_shader_egl_external,
+};
+
+static int
+compile_shader(GLenum type, int count, const char **sources)
+{
+	GLuint s;
+	char msg[512];
+	GLint status;
+
+	s = glCreateShader(type);
+	glShaderSource(s, count, sources, NULL);
+	glCompileShader(s);
+	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
+		weston_log("shader info: %s\n", msg);
+		return GL_NONE;
+	}
+
+	return s;
+}
+
+/* 64-bit FNV-1a, chained through hash */
+static uint64_t
+shader_cache_hash_string(uint64_t hash, const char *str)
+{
+	for (; str && *str; str++) {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static char *
+shader_cache_path(struct gl_renderer *gr, uint64_t hash, const char *suffix)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%016" PRIx64 "%s",
+		     gr->shader_cache_dir, hash, suffix) < 0)
+		return NULL;
+
+	return path;
+}
+
+/** Load a linked program from the shader cache
+ *
+ * \param gr The renderer.
+ * \param program The program object to load into.
+ * \param hash The hash of the program sources.
+ * \return 0 if the program was loaded and linked, -1 otherwise.
+ */
+static int
+shader_cache_load(struct gl_renderer *gr, GLuint program, uint64_t hash)
+{
+	struct gl_shader_cache_header header;
+	struct stat st;
+	char *path;
+	void *data = NULL;
+	GLint status = GL_FALSE;
+	int fd;
+
+	if (!gr->shader_cache_dir)
+		return -1;
+
+	path = shader_cache_path(gr, hash, ".bin");
+	if (!path)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 ||
+	    read(fd, &header, sizeof header) != (ssize_t) sizeof header ||
+	    header.magic != SHADER_CACHE_MAGIC ||
+	    st.st_size != (off_t) (sizeof header + header.length))
+		goto out;
+
+	data = malloc(header.length);
+	if (!data || read(fd, data, header.length) != (ssize_t) header.length)
+		goto out;
+
+	/* A driver update may reject the binary; it is compiled from
+	 * source then, and the cache entry rewritten. */
+	gr->program_binary(program, header.format, data, header.length);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+out:
+	free(data);
+	close(fd);
+
+	return status ? 0 : -1;
+}
 
+/* Like mkdir -p; $XDG_CACHE_HOME itself may not exist yet on a fresh
+ * system. */
 static int
-compile_shader(GLenum type, int count, const char **sources)
+shader_cache_mkdir(const char *dir)
 {
-	GLuint s;
-	char msg[512];
-	GLint status;
+	char *path, *p;
+	int ret = -1;
 
-	s = glCreateShader(type);
-	glShaderSource(s, count, sources, NULL);
-	glCompileShader(s);
-	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
-	if (!status) {
-		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
-		weston_log("shader info: %s\n", msg);
-		return GL_NONE;
+	path = strdup(dir);
+	if (!path)
+		return -1;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST)
+			goto out;
+		*p = '/';
 	}
 
-	return s;
+	if (mkdir(path, 0700) == 0 || errno == EEXIST)
+		ret = 0;
+
+out:
+	free(path);
+
+	return ret;
+}
+
+/* Write to a temporary file and rename it, so that a compositor
+ * starting up concurrently never reads half a binary. */
+static void
+shader_cache_store(struct gl_renderer *gr, GLuint program, uint64_t hash)
+{
+	struct gl_shader_cache_header header;
+	char *path = NULL, *tmp = NULL;
+	void *data = NULL;
+	GLint length = 0;
+	GLsizei written;
+	GLenum format;
+	int fd = -1;
+	bool ok = false;
+
+	if (!gr->shader_cache_dir)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	data = malloc(length);
+	if (!data)
+		return;
+
+	gr->get_program_binary(program, length, &written, &format, data);
+	if (written <= 0)
+		goto out;
+
+	path = shader_cache_path(gr, hash, ".bin");
+	tmp = shader_cache_path(gr, hash, ".tmp");
+	if (!path || !tmp)
+		goto out;
+
+	if (shader_cache_mkdir(gr->shader_cache_dir) < 0)
+		goto out;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto out;
+
+	header.magic = SHADER_CACHE_MAGIC;
+	header.format = format;
+	header.length = written;
+
+	ok = write(fd, &header, sizeof header) == (ssize_t) sizeof header &&
+	     write(fd, data, written) == written;
+	close(fd);
+
+	if (!ok || rename(tmp, path) < 0)
+		unlink(tmp);
+
+out:
+	free(tmp);
+	free(path);
+	free(data);
+}
+
+static void
+shader_release(struct gl_shader *shader)
+{
+	glDeleteShader(shader->vertex_shader);
+	glDeleteShader(shader->fragment_shader);
+	glDeleteProgram(shader->program);
+
+	shader->vertex_shader = 0;
+	shader->fragment_shader = 0;
+	shader->program = 0;
 }
 
 static int
-shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
-		   const char *vertex_source, const char *fragment_source)
+shader_init(struct gl_shader *shader, struct gl_renderer *gr,
+	    enum gl_shader_texture_variant variant, uint32_t flags)
 {
+	const char *vertex_source = vertex_shader;
+	const char *sources[5];
 	char msg[512];
 	GLint status;
-	int count;
-	const char *sources[3];
-
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	uint64_t hash;
+	int count = 0;
+	int i;
 
-	if (renderer->fragment_shader_debug) {
-		sources[0] = fragment_source;
-		sources[1] = fragment_debug;
-		sources[2] = fragment_brace;
-		count = 3;
-	} else {
-		sources[0] = fragment_source;
-		sources[1] = fragment_brace;
-		count = 2;
-	}
+	sources[count++] = fragment_shaders[variant];
+	if (!(flags & SHADER_FLAG_NO_VIEW_ALPHA))
+		sources[count++] = fragment_alpha;
+	if (flags & SHADER_FLAG_DIM)
+		sources[count++] = fragment_dim;
+	if (flags & SHADER_FLAG_DEBUG)
+		sources[count++] = fragment_debug;
+	sources[count++] = fragment_brace;
 
-	shader->fragment_shader =
-		compile_shader(GL_FRAGMENT_SHADER, count, sources);
+	hash = shader_cache_hash_string(gr->shader_cache_salt, vertex_source);
+	for (i = 0; i < count; i++)
+		hash = shader_cache_hash_string(hash, sources[i]);
 
 	shader->program = glCreateProgram();
-	glAttachShader(shader->program, shader->vertex_shader);
-	glAttachShader(shader->program, shader->fragment_shader);
-	glBindAttribLocation(shader->program, 0, "position");
-	glBindAttribLocation(shader->program, 1, "texcoord");
 
-	glLinkProgram(shader->program);
-	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
-	if (!status) {
-		glGetProgramInfoLog(shader->program, sizeof msg, NULL, msg);
-		weston_log("link info: %s\n", msg);
-		return -1;
+	if (shader_cache_load(gr, shader->program, hash) < 0) {
+		shader->vertex_shader =
+			compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+		shader->fragment_shader =
+			compile_shader(GL_FRAGMENT_SHADER, count, sources);
+
+		glAttachShader(shader->program, shader->vertex_shader);
+		glAttachShader(shader->program, shader->fragment_shader);
+		glBindAttribLocation(shader->program, 0, "position");
+		glBindAttribLocation(shader->program, 1, "texcoord");
+
+		glLinkProgram(shader->program);
+		glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+		if (!status) {
+			glGetProgramInfoLog(shader->program, sizeof msg,
+					    NULL, msg);
+			weston_log("link info: %s\n", msg);
+			shader_release(shader);
+			return -1;
+		}
+
+		shader_cache_store(gr, shader->program, hash);
 	}
 
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
@@ -2462,21 +6420,56 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
 	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
+	shader->dim_uniform = glGetUniformLocation(shader->program, "dim");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
 
 	return 0;
 }
 
-static void
-shader_release(struct gl_shader *shader)
+/** Get the program of a shader variant, building it on first use
+ *
+ * \param gr The renderer.
+ * \param shaders The programs of the current context, indexed by
+ * variant and flags.
+ * \param variant What the program samples.
+ * \param flags SHADER_FLAG_* specialisations.
+ * \return The shader, or NULL if it failed to build.
+ *
+ * Programs come from the on-disk cache when the driver supports
+ * GL_OES_get_program_binary, and are compiled otherwise. A variant that
+ * failed to build is retried on every use, and logged each time.
+ */
+static struct gl_shader *
+gl_renderer_get_shader(struct gl_renderer *gr, struct gl_shader **shaders,
+		       enum gl_shader_texture_variant variant, uint32_t flags)
 {
-	glDeleteShader(shader->vertex_shader);
-	glDeleteShader(shader->fragment_shader);
-	glDeleteProgram(shader->program);
+	int key = variant * SHADER_FLAG_COUNT + flags;
+	struct gl_shader *shader;
+	struct timespec start;
 
-	shader->vertex_shader = 0;
-	shader->fragment_shader = 0;
-	shader->program = 0;
+	assert(variant > SHADER_VARIANT_NONE && variant < SHADER_VARIANT_COUNT);
+	assert(flags < SHADER_FLAG_COUNT);
+
+	if (shaders[key])
+		return shaders[key];
+
+	shader = zalloc(sizeof *shader);
+	if (!shader)
+		return NULL;
+
+	/* Shaders are built when first drawn with, so the ones the first
+	 * frame needs count towards startup. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (shader_init(shader, gr, variant, flags) < 0) {
+		weston_log("warning: failed to compile shader\n");
+		free(shader);
+		return NULL;
+	}
+	weston_startup_add_time("shaders", &start);
+
+	shaders[key] = shader;
+
+	return shader;
 }
 
 static void
@@ -2656,6 +6649,20 @@ gl_renderer_output_set_border(struct weston_output *output,
 	go->border_status |= 1 << side;
 }
 
+static void
+gl_renderer_output_set_render_size(struct weston_output *output,
+				   int32_t width, int32_t height)
+{
+	struct gl_output_state *go = get_output_state(output);
+
+	if (width == output->current_mode->width &&
+	    height == output->current_mode->height)
+		width = height = 0;
+
+	go->render_width = width;
+	go->render_height = height;
+}
+
 static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface);
 
@@ -2715,6 +6722,8 @@ gl_renderer_output_create(struct weston_output *output,
 	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_init(&go->buffer_damage[i]);
 
+	wl_list_init(&go->readbacks);
+
 	output->renderer_state = go;
 
 	return 0;
@@ -2750,22 +6759,197 @@ gl_renderer_output_window_create(struct weston_output *output,
 	return ret;
 }
 
+static int
+gl_renderer_output_pbuffer_create(struct weston_output *output,
+				  int width, int height)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	EGLSurface egl_surface;
+	EGLint surface_type;
+	int ret;
+	const EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	/* The display was created with gl_renderer_pbuffer_attribs, so the
+	 * context's own config is good for pbuffers. */
+	if (!eglGetConfigAttrib(gr->egl_display, gr->egl_config,
+				EGL_SURFACE_TYPE, &surface_type) ||
+	    !(surface_type & EGL_PBUFFER_BIT)) {
+		weston_log("EGL config does not support pbuffers\n");
+		return -1;
+	}
+
+	egl_surface = eglCreatePbufferSurface(gr->egl_display, gr->egl_config,
+					      pbuffer_attribs);
+	if (egl_surface == EGL_NO_SURFACE) {
+		weston_log("failed to create egl pbuffer surface\n");
+		gl_renderer_print_egl_error_state();
+		return -1;
+	}
+
+	ret = gl_renderer_output_create(output, egl_surface);
+	if (ret < 0)
+		weston_platform_destroy_egl_surface(gr->egl_display, egl_surface);
+
+	return ret;
+}
+
+/* Draw the frames of the output on a thread of its own, with a context
+ * sharing the renderer's textures, so that a slow output does not hold
+ * up the others. The backend has to call output_finish_frame before it
+ * uses a frame. */
+static int
+gl_renderer_output_create_render_thread(struct weston_output *output)
+{
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_render_thread *rt;
+	EGLConfig context_config;
+
+	if (go->thread)
+		return 0;
+
+	/* The draws wait for the uploads of the main context and for the
+	 * client fences on the GPU, not on either thread */
+	if (!gr->has_wait_sync) {
+		weston_log("render threads need EGL_KHR_wait_sync\n");
+		return -1;
+	}
+
+	rt = zalloc(sizeof *rt);
+	if (!rt)
+		return -1;
+
+	rt->renderer = gr;
+	rt->surface = go->egl_surface;
+	rt->frame.uploads = EGL_NO_SYNC_KHR;
+	rt->frame.fence_fd = -1;
+	wl_array_init(&rt->frame.ops);
+	wl_array_init(&rt->frame.vertices);
+	wl_array_init(&rt->frame.vtxcnt);
+	wl_array_init(&rt->frame.clears);
+	wl_array_init(&rt->frame.items);
+	wl_array_init(&rt->indices);
+
+	context_config = gr->egl_config;
+	if (gr->has_configless_context)
+		context_config = EGL_NO_CONFIG_KHR;
+
+	rt->context = eglCreateContext(gr->egl_display, context_config,
+				       gr->egl_context, context_attribs);
+	if (rt->context == EGL_NO_CONTEXT) {
+		weston_log("failed to create render thread context\n");
+		gl_renderer_print_egl_error_state();
+		goto err_free;
+	}
+
+	pthread_mutex_init(&rt->mutex, NULL);
+	pthread_cond_init(&rt->cond, NULL);
+
+	if (pthread_create(&rt->thread, NULL, render_thread_main, rt) != 0) {
+		weston_log("failed to start render thread\n");
+		goto err_context;
+	}
+
+	wl_list_insert(&gr->render_threads, &rt->link);
+	go->thread = rt;
+
+	return 0;
+
+err_context:
+	pthread_cond_destroy(&rt->cond);
+	pthread_mutex_destroy(&rt->mutex);
+	eglDestroyContext(gr->egl_display, rt->context);
+err_free:
+	free(rt);
+	return -1;
+}
+
+static void
+render_thread_destroy(struct gl_render_thread *rt)
+{
+	struct gl_renderer *gr = rt->renderer;
+
+	pthread_mutex_lock(&rt->mutex);
+	rt->quit = true;
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->mutex);
+	pthread_join(rt->thread, NULL);
+
+	gl_frame_reset(gr, &rt->frame);
+	wl_array_release(&rt->frame.ops);
+	wl_array_release(&rt->frame.vertices);
+	wl_array_release(&rt->frame.vtxcnt);
+	wl_array_release(&rt->frame.clears);
+	wl_array_release(&rt->frame.items);
+	wl_array_release(&rt->indices);
+
+	eglDestroyContext(gr->egl_display, rt->context);
+	pthread_cond_destroy(&rt->cond);
+	pthread_mutex_destroy(&rt->mutex);
+	wl_list_remove(&rt->link);
+	free(rt);
+}
+
 static void
 gl_renderer_output_destroy(struct weston_output *output)
 {
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
+	struct gl_readback *rb;
 	int i;
 
+	/* The thread lets go of the surface once it is done with it */
+	if (go->thread) {
+		eglMakeCurrent(gr->egl_display, gr->dummy_surface,
+			       gr->dummy_surface, gr->egl_context);
+		render_thread_destroy(go->thread);
+	}
+
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	/* Nothing will be read back from this output any more. */
+	if (!wl_list_empty(&go->readbacks))
+		use_output(output);
+	while (!wl_list_empty(&go->readbacks)) {
+		rb = container_of(go->readbacks.next,
+				  struct gl_readback, link);
+		rb->done(rb->data, NULL);
+		gl_readback_destroy(gr, rb);
+	}
+
+	if (go->readback_timer)
+		wl_event_source_remove(go->readback_timer);
+
+	if (go->timer_queries[0])
+		gr->delete_queries(GPU_TIMER_QUERY_COUNT, go->timer_queries);
+	if (go->timestamp_queries[0])
+		gr->delete_queries(GPU_TIMER_QUERY_COUNT,
+				   go->timestamp_queries);
+
+	if (go->zoom.fbo) {
+		use_output(output);
+		output_release_zoom(go);
+	}
+
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       EGL_NO_CONTEXT);
 
 	weston_platform_destroy_egl_surface(gr->egl_display, go->egl_surface);
 
+	if (go->heat)
+		repaint_heat_destroy(go->heat);
+
 	free(go);
 }
 
@@ -2780,12 +6964,38 @@ gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
+	struct egl_buffer_image *egl_image, *egl_next;
+	struct gl_readback *rb;
+	int i;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	if (gr->evict_timer)
+		wl_event_source_remove(gr->evict_timer);
+	if (gr->pressure_source)
+		wl_event_source_remove(gr->pressure_source);
+	if (gr->pressure_fd >= 0)
+		close(gr->pressure_fd);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
+	if (gr->has_pbo)
+		gl_renderer_destroy_upload_slots(gr);
+
+	gl_texture_pool_clear(gr);
+
+	/* Nothing will be captured any more. */
+	while (!wl_list_empty(&gr->captures)) {
+		rb = container_of(gr->captures.next,
+				  struct gl_readback, link);
+		rb->done(rb->data, NULL);
+		gl_readback_destroy(gr, rb);
+	}
+	if (gr->capture_timer)
+		wl_event_source_remove(gr->capture_timer);
+	gl_capture_fbo_clear(gr);
+
 	/* Work around crash in egl_dri2.c's dri2_make_current() - when does this apply? */
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -2795,6 +7005,10 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(image, next, &gr->dmabuf_images, link)
 		dmabuf_image_destroy(image);
 
+	wl_list_for_each_safe(egl_image, egl_next, &gr->egl_buffer_images,
+			      link)
+		egl_buffer_image_destroy(egl_image);
+
 	if (gr->dummy_surface != EGL_NO_SURFACE)
 		weston_platform_destroy_egl_surface(gr->egl_display,
 						    gr->dummy_surface);
@@ -2806,11 +7020,19 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
+
+	/* The programs went away with the context. */
+	for (i = 0; i < SHADER_KEY_COUNT; i++)
+		free(gr->shaders[i]);
+	free(gr->shader_cache_dir);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
+	if (gr->repaint_debug_binding)
+		weston_binding_destroy(gr->repaint_debug_binding);
 
 	free(gr);
 }
@@ -2879,7 +7101,17 @@ gl_renderer_setup_egl_extensions(struct weston_compositor *ec)
 
 	if (weston_check_egl_extension(extensions, "EGL_EXT_buffer_age"))
 		gr->has_egl_buffer_age = 1;
-	else
+
+	/* EGL_KHR_partial_update also exposes the buffer age, through a
+	 * token with the same value. */
+	if (weston_check_egl_extension(extensions, "EGL_KHR_partial_update")) {
+		gr->set_damage_region =
+			(void *) eglGetProcAddress("eglSetDamageRegionKHR");
+		if (gr->set_damage_region)
+			gr->has_egl_buffer_age = 1;
+	}
+
+	if (!gr->has_egl_buffer_age)
 		weston_log("warning: EGL_EXT_buffer_age not supported. "
 			   "Performance could be affected.\n");
 
@@ -2908,9 +7140,40 @@ gl_renderer_setup_egl_extensions(struct weston_compositor *ec)
 	if (weston_check_egl_extension(extensions, "EGL_EXT_image_dma_buf_import"))
 		gr->has_dmabuf_import = 1;
 
+	if (weston_check_egl_extension(extensions,
+				"EGL_EXT_image_dma_buf_import_modifiers")) {
+		gr->query_dmabuf_formats =
+			(void *) eglGetProcAddress("eglQueryDmaBufFormatsEXT");
+		gr->query_dmabuf_modifiers =
+			(void *) eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+		if (gr->query_dmabuf_formats && gr->query_dmabuf_modifiers)
+			gr->has_dmabuf_import_modifiers = 1;
+	}
+
 	if (weston_check_egl_extension(extensions, "GL_EXT_texture_rg"))
 		gr->has_gl_texture_rg = 1;
 
+	if (weston_check_egl_extension(extensions, "EGL_KHR_fence_sync") &&
+	    weston_check_egl_extension(extensions,
+				       "EGL_ANDROID_native_fence_sync")) {
+		gr->create_sync =
+			(void *) eglGetProcAddress("eglCreateSyncKHR");
+		gr->destroy_sync =
+			(void *) eglGetProcAddress("eglDestroySyncKHR");
+		gr->dup_native_fence_fd =
+			(void *) eglGetProcAddress("eglDupNativeFenceFDANDROID");
+		if (gr->create_sync && gr->destroy_sync &&
+		    gr->dup_native_fence_fd)
+			gr->has_native_fence_sync = 1;
+	}
+
+	if (gr->has_native_fence_sync &&
+	    weston_check_egl_extension(extensions, "EGL_KHR_wait_sync")) {
+		gr->wait_sync = (void *) eglGetProcAddress("eglWaitSyncKHR");
+		if (gr->wait_sync)
+			gr->has_wait_sync = 1;
+	}
+
 	renderer_setup_egl_client_extensions(gr);
 
 	return 0;
@@ -2936,6 +7199,16 @@ static const EGLint gl_renderer_alpha_attribs[] = {
 	EGL_NONE
 };
 
+static const EGLint gl_renderer_pbuffer_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RED_SIZE, 1,
+	EGL_GREEN_SIZE, 1,
+	EGL_BLUE_SIZE, 1,
+	EGL_ALPHA_SIZE, 0,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	EGL_NONE
+};
+
 
 /** Checks whether a platform EGL client extension is supported
  *
@@ -3009,6 +7282,8 @@ platform_to_extension(EGLenum platform)
 		return "wayland";
 	case EGL_PLATFORM_X11_KHR:
 		return "x11";
+	case EGL_PLATFORM_SURFACELESS_MESA:
+		return "surfaceless";
 	default:
 		assert(0 && "bad EGL platform enum");
 	}
@@ -3086,14 +7361,20 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 		return -1;
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_async = gl_renderer_read_pixels_async;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
+	gr->base.surface_memory_bytes = gl_renderer_surface_memory_bytes;
 	gr->base.attach = gl_renderer_attach;
 	gr->base.surface_set_color = gl_renderer_surface_set_color;
 	gr->base.destroy = gl_renderer_destroy;
 	gr->base.surface_get_content_size =
 		gl_renderer_surface_get_content_size;
 	gr->base.surface_copy_content = gl_renderer_surface_copy_content;
+	gr->base.surface_copy_content_async =
+		gl_renderer_surface_copy_content_async;
+	gr->base.surface_copy_scaled = gl_renderer_surface_copy_scaled;
+	gr->base.surface_set_image = gl_renderer_surface_set_image;
 	gr->egl_display = NULL;
 
 	/* extension_suffix is supported */
@@ -3141,13 +7422,28 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 	ec->capabilities |= WESTON_CAP_ROTATION_ANY;
 	ec->capabilities |= WESTON_CAP_CAPTURE_YFLIP;
 	ec->capabilities |= WESTON_CAP_VIEW_CLIP_MASK;
+	ec->capabilities |= WESTON_CAP_ZOOM_OFFSCREEN;
 
 	if (gl_renderer_setup_egl_extensions(ec) < 0)
 		goto fail_with_error;
 
 	wl_list_init(&gr->dmabuf_images);
-	if (gr->has_dmabuf_import)
+	wl_list_init(&gr->texture_pool);
+	wl_list_init(&gr->capture_fbos);
+	wl_list_init(&gr->captures);
+	wl_list_init(&gr->render_threads);
+	wl_list_init(&gr->egl_buffer_images);
+	if (gr->has_dmabuf_import) {
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
+		gr->base.query_dmabuf_formats =
+			gl_renderer_query_dmabuf_formats;
+		gr->base.query_dmabuf_modifiers =
+			gl_renderer_query_dmabuf_modifiers;
+	}
+
+	if (gr->has_dmabuf_import && gr->has_native_fence_sync &&
+	    gr->has_wait_sync)
+		ec->capabilities |= WESTON_CAP_EXPLICIT_SYNC;
 
 	if (gr->has_surfaceless_context) {
 		weston_log("EGL_KHR_surfaceless_context available\n");
@@ -3161,6 +7457,8 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 	}
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_XBGR8888);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_ABGR8888);
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUV420);
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_NV12);
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_YUYV);
@@ -3191,36 +7489,39 @@ gl_renderer_display(struct weston_compositor *ec)
 	return get_renderer(ec)->egl_display;
 }
 
-static int
-compile_shaders(struct weston_compositor *ec)
+/* Programs are kept in $XDG_CACHE_HOME/weston, keyed by their sources
+ * and by the driver strings, since binaries only load on the driver
+ * that produced them. */
+static void
+shader_cache_init(struct gl_renderer *gr)
 {
-	struct gl_renderer *gr = get_renderer(ec);
-
-	gr->texture_shader_rgba.vertex_source = vertex_shader;
-	gr->texture_shader_rgba.fragment_source = texture_fragment_shader_rgba;
-
-	gr->texture_shader_rgbx.vertex_source = vertex_shader;
-	gr->texture_shader_rgbx.fragment_source = texture_fragment_shader_rgbx;
-
-	gr->texture_shader_egl_external.vertex_source = vertex_shader;
-	gr->texture_shader_egl_external.fragment_source =
-		texture_fragment_shader_egl_external;
-
-	gr->texture_shader_y_uv.vertex_source = vertex_shader;
-	gr->texture_shader_y_uv.fragment_source = texture_fragment_shader_y_uv;
+	const char *dir, *home;
+	int ret;
 
-	gr->texture_shader_y_u_v.vertex_source = vertex_shader;
-	gr->texture_shader_y_u_v.fragment_source =
-		texture_fragment_shader_y_u_v;
+	if (!gr->has_program_binary)
+		return;
 
-	gr->texture_shader_y_xuxv.vertex_source = vertex_shader;
-	gr->texture_shader_y_xuxv.fragment_source =
-		texture_fragment_shader_y_xuxv;
+	dir = getenv("XDG_CACHE_HOME");
+	home = getenv("HOME");
+	if (dir && dir[0] == '/')
+		ret = asprintf(&gr->shader_cache_dir, "%s/weston", dir);
+	else if (home)
+		ret = asprintf(&gr->shader_cache_dir, "%s/.cache/weston", home);
+	else
+		return;
 
-	gr->solid_shader.vertex_source = vertex_shader;
-	gr->solid_shader.fragment_source = solid_fragment_shader;
+	if (ret < 0) {
+		gr->shader_cache_dir = NULL;
+		return;
+	}
 
-	return 0;
+	gr->shader_cache_salt = 0xcbf29ce484222325ULL;
+	gr->shader_cache_salt = shader_cache_hash_string(gr->shader_cache_salt,
+				(const char *) glGetString(GL_VENDOR));
+	gr->shader_cache_salt = shader_cache_hash_string(gr->shader_cache_salt,
+				(const char *) glGetString(GL_RENDERER));
+	gr->shader_cache_salt = shader_cache_hash_string(gr->shader_cache_salt,
+				(const char *) glGetString(GL_VERSION));
 }
 
 static void
@@ -3231,20 +7532,10 @@ fragment_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
 	struct gl_renderer *gr = get_renderer(ec);
 	struct weston_output *output;
 
+	/* use_shader() picks the debug variants from now on, the others
+	 * stay cached for when debugging is turned off again. */
 	gr->fragment_shader_debug ^= 1;
 
-	shader_release(&gr->texture_shader_rgba);
-	shader_release(&gr->texture_shader_rgbx);
-	shader_release(&gr->texture_shader_egl_external);
-	shader_release(&gr->texture_shader_y_uv);
-	shader_release(&gr->texture_shader_y_u_v);
-	shader_release(&gr->texture_shader_y_xuxv);
-	shader_release(&gr->solid_shader);
-
-	/* Force use_shader() to call glUseProgram(), since we need to use
-	 * the recompiled version of the shader. */
-	gr->current_shader = NULL;
-
 	wl_list_for_each(output, &ec->output_list, link)
 		weston_output_damage(output);
 }
@@ -3260,13 +7551,47 @@ fan_debug_repaint_binding(struct weston_keyboard *keyboard, uint32_t time,
 	weston_compositor_damage_all(compositor);
 }
 
+static void
+repaint_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
+		      uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct weston_output *output;
+	struct gl_output_state *go;
+
+	gr->repaint_debug = !gr->repaint_debug;
+
+	if (gr->repaint_debug) {
+		weston_log("repaint debug: blue to red for views repainted "
+			   "in few to all of the last %d frames; frames "
+			   "around views on planes, and inside views left on "
+			   "the primary plane: gray planes disabled, red no "
+			   "plane takes it, yellow overlapped, magenta "
+			   "yielded to other views\n", REPAINT_HEAT_FRAMES);
+	} else {
+		wl_list_for_each(output, &compositor->output_list, link) {
+			go = get_output_state(output);
+			if (go && go->heat) {
+				repaint_heat_destroy(go->heat);
+				go->heat = NULL;
+			}
+		}
+	}
+
+	weston_compositor_damage_all(compositor);
+}
+
 static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	const char *extensions;
+	const char *version;
 	EGLConfig context_config;
 	EGLBoolean ret;
+	PFNGLGETQUERYIVEXTPROC get_queryiv;
+	GLint bits = 0;
 
 	static const EGLint context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -3324,13 +7649,100 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (weston_check_egl_extension(extensions, "GL_EXT_unpack_subimage"))
 		gr->has_unpack_subimage = 1;
 
+	if (weston_check_egl_extension(extensions, "GL_EXT_texture_storage"))
+		gr->tex_storage_2d =
+			(void *) eglGetProcAddress("glTexStorage2DEXT");
+
+	/* Only known once there is a context, so these are added to the
+	 * wl_shm formats here rather than with the others. */
+	if (weston_check_egl_extension(extensions,
+				       "GL_EXT_texture_type_2_10_10_10_REV")) {
+		gr->has_texture_type_2_10_10_10_rev = 1;
+		wl_display_add_shm_format(ec->wl_display,
+					  WL_SHM_FORMAT_XRGB2101010);
+		wl_display_add_shm_format(ec->wl_display,
+					  WL_SHM_FORMAT_ARGB2101010);
+		wl_display_add_shm_format(ec->wl_display,
+					  WL_SHM_FORMAT_XBGR2101010);
+		wl_display_add_shm_format(ec->wl_display,
+					  WL_SHM_FORMAT_ABGR2101010);
+	}
+
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	if (weston_check_egl_extension(extensions,
+				       "GL_EXT_disjoint_timer_query")) {
+		gr->gen_queries =
+			(void *) eglGetProcAddress("glGenQueriesEXT");
+		gr->delete_queries =
+			(void *) eglGetProcAddress("glDeleteQueriesEXT");
+		gr->begin_query =
+			(void *) eglGetProcAddress("glBeginQueryEXT");
+		gr->end_query = (void *) eglGetProcAddress("glEndQueryEXT");
+		gr->get_query_object_iv =
+			(void *) eglGetProcAddress("glGetQueryObjectivEXT");
+		gr->get_query_object_ui64v =
+			(void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+
+		if (gr->gen_queries && gr->delete_queries &&
+		    gr->begin_query && gr->end_query &&
+		    gr->get_query_object_iv && gr->get_query_object_ui64v)
+			gr->has_disjoint_timer_query = 1;
+
+		gr->query_counter =
+			(void *) eglGetProcAddress("glQueryCounterEXT");
+		gr->get_integer64v =
+			(void *) eglGetProcAddress("glGetInteger64vEXT");
+		get_queryiv = (void *) eglGetProcAddress("glGetQueryivEXT");
+
+		/* Implementations without a GPU clock report 0 bits */
+		if (gr->has_disjoint_timer_query &&
+		    gr->query_counter && gr->get_integer64v && get_queryiv) {
+			get_queryiv(GL_TIMESTAMP_EXT,
+				    GL_QUERY_COUNTER_BITS_EXT, &bits);
+			if (bits > 0)
+				gr->has_gpu_timestamps = 1;
+		}
+	}
+
+	/* Pixel buffer objects and fence syncs are core in GLES 3.0, and
+	 * most drivers hand out a 3.x context when asked for 2.0. */
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && strncmp(version, "OpenGL ES ", 10) == 0 &&
+	    version[10] >= '3') {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->fence_sync = (void *) eglGetProcAddress("glFenceSync");
+		gr->client_wait_sync =
+			(void *) eglGetProcAddress("glClientWaitSync");
+		gr->delete_sync = (void *) eglGetProcAddress("glDeleteSync");
+
+		if (gr->map_buffer_range && gr->unmap_buffer &&
+		    gr->fence_sync && gr->client_wait_sync &&
+		    gr->delete_sync)
+			gr->has_pbo = 1;
+	}
+
+	if (weston_check_egl_extension(extensions,
+				       "GL_OES_get_program_binary")) {
+		GLint formats = 0;
+
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+		gr->get_program_binary =
+			(void *) eglGetProcAddress("glGetProgramBinaryOES");
+		gr->program_binary =
+			(void *) eglGetProcAddress("glProgramBinaryOES");
+
+		if (formats > 0 &&
+		    gr->get_program_binary && gr->program_binary)
+			gr->has_program_binary = 1;
+	}
+
 	glActiveTexture(GL_TEXTURE0);
 
-	if (compile_shaders(ec))
-		return -1;
+	shader_cache_init(gr);
 
 	gr->fragment_binding =
 		weston_compositor_add_debug_binding(ec, KEY_S,
@@ -3340,18 +7752,47 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->repaint_debug_binding =
+		weston_compositor_add_debug_binding(ec, KEY_G,
+						    repaint_debug_binding,
+						    ec);
 
 	gr->output_destroy_listener.notify = output_handle_destroy;
 	wl_signal_add(&ec->output_destroyed_signal,
 		      &gr->output_destroy_listener);
 
+	gl_renderer_setup_eviction(ec);
+
 	weston_log("GL ES 2 renderer features:\n");
 	weston_log_continue(STAMP_SPACE "read-back format: %s\n",
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBO: %s\n",
+			    gr->has_pbo ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "immutable wl_shm textures: %s\n",
+			    gr->tex_storage_2d ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    !gr->has_pbo ? "no" :
+			    gr->has_native_fence_sync ? "yes, fence fd" :
+			    "yes, polled");
+	weston_log_continue(STAMP_SPACE "GPU render timing: %s\n",
+			    gr->has_gpu_timestamps ? "yes, with timestamps" :
+			    gr->has_disjoint_timer_query ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "shader cache: %s\n",
+			    gr->shader_cache_dir ? gr->shader_cache_dir : "no");
+	weston_log_continue(STAMP_SPACE "EGL partial update: %s\n",
+			    gr->set_damage_region ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "explicit sync: %s\n",
+			    ec->capabilities & WESTON_CAP_EXPLICIT_SYNC ?
+			    "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
+	if (gr->evict_timeout_msec)
+		weston_log_continue(STAMP_SPACE "texture eviction: after "
+				    "%d s%s\n", ec->texture_evict_timeout,
+				    gr->pressure_source ?
+				    ", and on memory pressure" : "");
 
 
 	return 0;
@@ -3360,12 +7801,17 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 WL_EXPORT struct gl_renderer_interface gl_renderer_interface = {
 	.opaque_attribs = gl_renderer_opaque_attribs,
 	.alpha_attribs = gl_renderer_alpha_attribs,
+	.pbuffer_attribs = gl_renderer_pbuffer_attribs,
 
 	.display_create = gl_renderer_display_create,
 	.display = gl_renderer_display,
 	.output_window_create = gl_renderer_output_window_create,
+	.output_pbuffer_create = gl_renderer_output_pbuffer_create,
 	.output_destroy = gl_renderer_output_destroy,
 	.output_surface = gl_renderer_output_surface,
 	.output_set_border = gl_renderer_output_set_border,
+	.output_set_render_size = gl_renderer_output_set_render_size,
+	.output_create_render_thread = gl_renderer_output_create_render_thread,
+	.output_finish_frame = gl_renderer_output_finish_frame,
 	.print_egl_error_state = gl_renderer_print_egl_error_state
 };
@@ -59,6 +59,7 @@ enum gl_renderer_border_side {
 struct gl_renderer_interface {
 	const EGLint *opaque_attribs;
 	const EGLint *alpha_attribs;
+	const EGLint *pbuffer_attribs;
 
 	int (*display_create)(struct weston_compositor *ec,
 			      EGLenum platform,
@@ -77,6 +78,11 @@ struct gl_renderer_interface {
 				    const EGLint *visual_id,
 				    const int n_ids);
 
+	/* Renders the output offscreen; the display must have been created
+	 * with pbuffer_attribs. */
+	int (*output_pbuffer_create)(struct weston_output *output,
+				     int width, int height);
+
 	void (*output_destroy)(struct weston_output *output);
 
 	EGLSurface (*output_surface)(struct weston_output *output);
@@ -113,6 +119,26 @@ struct gl_renderer_interface {
 				  int32_t width, int32_t height,
 				  int32_t tex_width, unsigned char *data);
 
+	/* Renders the output at width x height rather than at the size of
+	 * its mode, into an EGL surface of that size, which the backend
+	 * scales up to the mode. The mode size returns to rendering at full
+	 * resolution. Outputs with borders cannot render scaled.
+	 */
+	void (*output_set_render_size)(struct weston_output *output,
+				       int32_t width, int32_t height);
+
+	/* Draws the frames of the output on a thread of its own, with a
+	 * context of its own sharing the textures, while the main thread
+	 * goes on with other outputs. repaint_output then returns before
+	 * the frame is drawn, and the backend calls output_finish_frame
+	 * before it takes the front buffer. Frames that read back pixels,
+	 * zoom, or have borders are still drawn on the main thread.
+	 * Returns -1 if the EGL implementation cannot.
+	 */
+	int (*output_create_render_thread)(struct weston_output *output);
+
+	void (*output_finish_frame)(struct weston_output *output);
+
 	void (*print_egl_error_state)(void);
 };
 
@@ -0,0 +1,466 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "compositor.h"
+#include "recorder-encoder.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+/* Read backs in flight before frames are dropped */
+#define HW_RECORDER_MAX_READBACKS 2
+
+struct hw_recorder_readback {
+	struct weston_hw_recorder *recorder;
+	struct wl_list link;
+};
+
+struct weston_hw_recorder {
+	struct weston_output *output;
+	const struct recorder_encoder_interface *interface;
+	struct recorder_encoder *encoder;
+	enum recorder_encoder_input input;
+	int width, height;
+	int frames, dropped;
+
+	/* Frames come from the display hardware writing them back, see
+	 * weston_output::enable_writeback; pixels is for encoders taking
+	 * them in memory. */
+	bool writeback;
+	void *pixels;
+
+	struct wl_list readbacks;
+	int reading;
+
+	struct wl_listener frame_listener;
+	struct wl_listener output_destroy_listener;
+	struct wl_event_source *repaint_source;
+};
+
+/* Tried in order after the backend's own encoder, if any */
+static const struct recorder_encoder_interface *generic_encoders[] = {
+#ifdef BUILD_V4L2_RECORDER
+	&v4l2_recorder_encoder,
+#endif
+	&y4m_recorder_encoder,
+};
+
+static void
+hw_recorder_shutdown(struct weston_hw_recorder *recorder)
+{
+	struct hw_recorder_readback *readback, *next;
+
+	if (!recorder->encoder)
+		return;
+
+	/* Read backs still in flight complete into nothing */
+	wl_list_for_each_safe(readback, next, &recorder->readbacks, link) {
+		readback->recorder = NULL;
+		wl_list_remove(&readback->link);
+		wl_list_init(&readback->link);
+	}
+
+	if (recorder->repaint_source)
+		wl_event_source_remove(recorder->repaint_source);
+	recorder->repaint_source = NULL;
+
+	recorder->interface->destroy(recorder->encoder);
+	recorder->encoder = NULL;
+
+	wl_list_remove(&recorder->frame_listener.link);
+	wl_list_remove(&recorder->output_destroy_listener.link);
+	if (recorder->writeback)
+		recorder->output->disable_writeback(recorder->output);
+	else
+		recorder->output->disable_planes--;
+	free(recorder->pixels);
+	recorder->pixels = NULL;
+
+	weston_log("[%s recorder] done, %d frames, %d dropped\n",
+		   recorder->interface->name,
+		   recorder->frames, recorder->dropped);
+}
+
+static void
+hw_recorder_abort(struct weston_hw_recorder *recorder)
+{
+	weston_log("[%s recorder] aborted: %s\n",
+		   recorder->interface->name, strerror(errno));
+	hw_recorder_shutdown(recorder);
+}
+
+static void
+hw_recorder_read_done(void *data, void *pixels)
+{
+	struct hw_recorder_readback *readback = data;
+	struct weston_hw_recorder *recorder = readback->recorder;
+	struct weston_compositor *compositor;
+	int stride, ret;
+
+	wl_list_remove(&readback->link);
+	free(readback);
+
+	if (!recorder)
+		return;
+
+	recorder->reading--;
+
+	if (!pixels) {
+		recorder->dropped++;
+		return;
+	}
+
+	compositor = recorder->output->compositor;
+	stride = recorder->width * 4;
+	if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+		pixels = (uint8_t *) pixels + (recorder->height - 1) * stride;
+		stride = -stride;
+	}
+
+	ret = recorder->interface->frame_memory(recorder->encoder,
+						pixels, stride);
+	if (ret < 0)
+		hw_recorder_abort(recorder);
+	else
+		recorder->frames++;
+}
+
+static int
+hw_recorder_read_frame(struct weston_hw_recorder *recorder)
+{
+	struct hw_recorder_readback *readback;
+
+	if (recorder->reading >= HW_RECORDER_MAX_READBACKS) {
+		recorder->dropped++;
+		return 0;
+	}
+
+	readback = zalloc(sizeof *readback);
+	if (!readback)
+		return -1;
+
+	readback->recorder = recorder;
+	wl_list_insert(recorder->readbacks.prev, &readback->link);
+	recorder->reading++;
+
+	/* done may run before this returns, and free readback */
+	if (weston_output_read_pixels_async(recorder->output,
+					    PIXMAN_a8r8g8b8, 0, 0,
+					    recorder->width,
+					    recorder->height,
+					    hw_recorder_read_done,
+					    readback) < 0) {
+		recorder->reading--;
+		wl_list_remove(&readback->link);
+		free(readback);
+		recorder->dropped++;
+	}
+
+	return 0;
+}
+
+/* A frame the writeback has just completed, planes included */
+static int
+hw_recorder_writeback_frame(struct weston_hw_recorder *recorder)
+{
+	struct weston_output *output = recorder->output;
+	int fd, stride, ret;
+
+	if (recorder->input == RECORDER_ENCODER_INPUT_DMABUF) {
+		if (output->export_writeback(output, &fd, &stride) < 0) {
+			recorder->dropped++;
+			return 0;
+		}
+		ret = recorder->interface->frame_dmabuf(recorder->encoder,
+							fd, stride);
+	} else {
+		stride = recorder->width * 4;
+		if (!recorder->pixels)
+			recorder->pixels = malloc(stride * recorder->height);
+		if (!recorder->pixels)
+			return -1;
+		if (output->read_writeback(output, recorder->pixels,
+					   stride) < 0) {
+			recorder->dropped++;
+			return 0;
+		}
+		ret = recorder->interface->frame_memory(recorder->encoder,
+							recorder->pixels,
+							stride);
+	}
+
+	if (ret == 0)
+		recorder->frames++;
+
+	return ret;
+}
+
+static void
+hw_recorder_repaint(void *data)
+{
+	struct weston_hw_recorder *recorder = data;
+
+	recorder->repaint_source = NULL;
+	weston_output_schedule_repaint(recorder->output);
+}
+
+static void
+hw_recorder_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_hw_recorder *recorder =
+		container_of(listener, struct weston_hw_recorder,
+			     frame_listener);
+	struct weston_output *output = recorder->output;
+	struct wl_event_loop *loop;
+	int fd, stride, ret;
+
+	if (recorder->writeback) {
+		ret = hw_recorder_writeback_frame(recorder);
+	} else if (recorder->input == RECORDER_ENCODER_INPUT_DMABUF) {
+		ret = output->export_dmabuf(output, &fd, &stride);
+		if (ret == 0) {
+			ret = recorder->interface->frame_dmabuf(
+				recorder->encoder, fd, stride);
+			if (ret == 0)
+				recorder->frames++;
+		}
+	} else {
+		ret = hw_recorder_read_frame(recorder);
+	}
+
+	if (ret < 0) {
+		hw_recorder_abort(recorder);
+		return;
+	}
+
+	/* A read back completing right away may have aborted recording */
+	if (!recorder->encoder)
+		return;
+
+	/* Video encoders expect a constant frame rate, so keep the output
+	 * repainting. This can't happen from the frame signal itself,
+	 * because the output's repaint needed flag is cleared after it. */
+	if (!recorder->repaint_source) {
+		loop = wl_display_get_event_loop(output->compositor->wl_display);
+		recorder->repaint_source =
+			wl_event_loop_add_idle(loop, hw_recorder_repaint,
+					       recorder);
+	}
+}
+
+static void
+hw_recorder_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct weston_hw_recorder *recorder =
+		container_of(listener, struct weston_hw_recorder,
+			     output_destroy_listener);
+
+	hw_recorder_shutdown(recorder);
+}
+
+static int
+hw_recorder_create_encoder(struct weston_hw_recorder *recorder,
+			   const struct recorder_encoder_interface *interface,
+			   const char *basename)
+{
+	struct weston_output *output = recorder->output;
+	char filename[256];
+
+	if ((interface->inputs & RECORDER_ENCODER_INPUT_DMABUF) &&
+	    output->export_dmabuf)
+		recorder->input = RECORDER_ENCODER_INPUT_DMABUF;
+	else if (interface->inputs & RECORDER_ENCODER_INPUT_MEMORY)
+		recorder->input = RECORDER_ENCODER_INPUT_MEMORY;
+	else
+		return -1;
+
+	snprintf(filename, sizeof filename, "%s%s",
+		 basename, interface->suffix);
+
+	recorder->encoder = interface->create(output, recorder->input,
+					      recorder->width,
+					      recorder->height, filename);
+	if (!recorder->encoder)
+		return -1;
+
+	recorder->interface = interface;
+	weston_log("[%s recorder] recording %s from %s\n",
+		   interface->name, filename,
+		   recorder->input == RECORDER_ENCODER_INPUT_DMABUF ?
+		   "dmabuf" : "read back");
+
+	return 0;
+}
+
+static struct weston_hw_recorder *
+hw_recorder_create(struct weston_output *output)
+{
+	struct weston_hw_recorder *recorder;
+
+	recorder = zalloc(sizeof *recorder);
+	if (recorder == NULL)
+		return NULL;
+
+	recorder->output = output;
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+	wl_list_init(&recorder->readbacks);
+
+	return recorder;
+}
+
+static void
+hw_recorder_attach(struct weston_hw_recorder *recorder)
+{
+	struct weston_output *output = recorder->output;
+
+	/* Planes bypass the buffer that ends up in the recording, unless
+	 * the display hardware writes back what it shows */
+	recorder->frame_listener.notify = hw_recorder_frame_notify;
+	if (output->enable_writeback &&
+	    output->enable_writeback(output) == 0) {
+		recorder->writeback = true;
+		wl_signal_add(&output->writeback_signal,
+			      &recorder->frame_listener);
+	} else {
+		output->disable_planes++;
+		wl_signal_add(&output->frame_signal,
+			      &recorder->frame_listener);
+	}
+	recorder->output_destroy_listener.notify = hw_recorder_output_destroyed;
+	wl_signal_add(&output->destroy_signal,
+		      &recorder->output_destroy_listener);
+
+	weston_output_damage(output);
+}
+
+/** Start encoding an output to a video file
+ *
+ * \param output The output to record.
+ * \param basename The file to write, without extension; each encoder
+ * appends its own.
+ * \return The recorder, or NULL if no encoder could be set up.
+ *
+ * Uses the backend's own encoder if it has one, and otherwise the first
+ * of the generic ones that works on this system, ending with an
+ * uncompressed software fallback. Encoders take dmabufs of the
+ * presented buffers from backends that can export them and read back
+ * pixels everywhere else, so this works on any renderer.
+ */
+WL_EXPORT struct weston_hw_recorder *
+weston_hw_recorder_start(struct weston_output *output, const char *basename)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_hw_recorder *recorder;
+	unsigned int i;
+
+	recorder = hw_recorder_create(output);
+	if (recorder == NULL)
+		return NULL;
+
+	if (!output->recorder_encoder ||
+	    hw_recorder_create_encoder(recorder, output->recorder_encoder,
+				       basename) < 0) {
+		for (i = 0; i < ARRAY_LENGTH(generic_encoders); i++) {
+			/* Read back pixels are XRGB8888 only if the
+			 * renderer reads that format natively. */
+			if (!output->export_dmabuf &&
+			    compositor->read_format != PIXMAN_a8r8g8b8)
+				break;
+			if (hw_recorder_create_encoder(recorder,
+						       generic_encoders[i],
+						       basename) == 0)
+				break;
+		}
+	}
+
+	if (!recorder->encoder) {
+		weston_log("failed to start hardware recorder on %s\n",
+			   output->name);
+		free(recorder);
+		return NULL;
+	}
+
+	hw_recorder_attach(recorder);
+
+	return recorder;
+}
+
+/** Stream an output to PipeWire
+ *
+ * \param output The output to stream.
+ * \return The recorder, or NULL if libweston was built without
+ * PipeWire support, PipeWire is not running or the renderer cannot read
+ * back XRGB8888.
+ *
+ * The output shows up as a video source node named after it, which
+ * screen cast portals and other PipeWire clients can connect to. Frames
+ * are only copied while a consumer is streaming; stop with
+ * weston_hw_recorder_stop().
+ */
+WL_EXPORT struct weston_hw_recorder *
+weston_hw_recorder_start_stream(struct weston_output *output)
+{
+#ifdef BUILD_PIPEWIRE_RECORDER
+	struct weston_hw_recorder *recorder;
+	char name[256];
+
+	if (output->compositor->read_format != PIXMAN_a8r8g8b8)
+		return NULL;
+
+	recorder = hw_recorder_create(output);
+	if (recorder == NULL)
+		return NULL;
+
+	snprintf(name, sizeof name, "weston-%s", output->name);
+	if (hw_recorder_create_encoder(recorder, &pipewire_recorder_encoder,
+				       name) < 0) {
+		weston_log("failed to start PipeWire stream on %s\n",
+			   output->name);
+		free(recorder);
+		return NULL;
+	}
+
+	hw_recorder_attach(recorder);
+
+	return recorder;
+#else
+	return NULL;
+#endif
+}
+
+WL_EXPORT void
+weston_hw_recorder_stop(struct weston_hw_recorder *recorder)
+{
+	hw_recorder_shutdown(recorder);
+	free(recorder);
+}
@@ -35,10 +35,13 @@
 #include <values.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
 
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
 #include "compositor.h"
+#include "timeline.h"
 #include "relative-pointer-unstable-v1-server-protocol.h"
 #include "pointer-constraints-unstable-v1-server-protocol.h"
 
@@ -54,6 +57,10 @@ enum motion_direction {
 	MOTION_DIRECTION_NEGATIVE_Y = 1 << 3,
 };
 
+/* How often a backlogged client with motion held back is checked for
+ * having caught up, when no other event comes along */
+#define POINTER_MOTION_FLUSH_MSEC 16
+
 struct vec2d {
 	double x, y;
 };
@@ -71,6 +78,9 @@ struct border {
 static void
 maybe_warp_confined_pointer(struct weston_pointer_constraint *constraint);
 
+static void
+pointer_constraint_update_outline(struct weston_pointer_constraint *constraint);
+
 static void
 empty_region(pixman_region32_t *region)
 {
@@ -378,21 +388,109 @@ pointer_send_relative_motion(struct weston_pointer *pointer,
 	}
 }
 
+static void
+pointer_client_set_backlogged(struct weston_pointer *pointer,
+			      struct weston_pointer_client *pointer_client,
+			      bool backlogged, int queued)
+{
+	struct weston_compositor *ec = pointer->seat->compositor;
+	pid_t pid;
+
+	if (pointer_client->backlogged == backlogged)
+		return;
+
+	wl_client_get_credentials(pointer_client->client, &pid, NULL, NULL);
+	weston_log_scope_printf(ec->clients_scope, WESTON_LOG_LEVEL_DEBUG,
+				"client %d %s: %d bytes queued, "
+				"%u motion events coalesced\n",
+				(int) pid, backlogged ? "is backlogged" :
+				"caught up", queued,
+				pointer_client->motion_coalesced);
+
+	pointer_client->backlogged = backlogged;
+	if (!backlogged)
+		pointer_client->motion_coalesced = 0;
+}
+
+/* A client that does not read its events only needs to learn where the
+ * pointer ended up, so while it is backlogged motion is held back until
+ * another event goes out or the client catches up; the flush timer
+ * notices the latter if the pointer stops moving. */
 static void
 pointer_send_motion(struct weston_pointer *pointer, uint32_t time,
 		    wl_fixed_t sx, wl_fixed_t sy)
 {
-	struct wl_list *resource_list;
+	struct weston_pointer_client *pointer_client = pointer->focus_client;
 	struct wl_resource *resource;
+	bool backlogged;
+	int queued;
 
-	if (!pointer->focus_client)
+	if (!pointer_client ||
+	    wl_list_empty(&pointer_client->pointer_resources))
 		return;
 
-	resource_list = &pointer->focus_client->pointer_resources;
-	wl_resource_for_each(resource, resource_list)
+	backlogged = weston_client_is_backlogged(pointer_client->client,
+						 &queued);
+	pointer_client_set_backlogged(pointer, pointer_client,
+				      backlogged, queued);
+	if (backlogged) {
+		pointer_client->motion_pending = true;
+		pointer_client->motion_time = time;
+		pointer_client->motion_coalesced++;
+		wl_event_source_timer_update(pointer->motion_flush_timer,
+					     POINTER_MOTION_FLUSH_MSEC);
+		return;
+	}
+
+	pointer_client->motion_pending = false;
+	wl_resource_for_each(resource, &pointer_client->pointer_resources)
 		wl_pointer_send_motion(resource, time, sx, sy);
 }
 
+/* Send the motion held back by pointer_send_motion, so that the events
+ * following it happen at the right place. */
+static void
+pointer_flush_motion(struct weston_pointer *pointer)
+{
+	struct weston_pointer_client *pointer_client = pointer->focus_client;
+	struct wl_resource *resource;
+
+	if (!pointer_client || !pointer_client->motion_pending)
+		return;
+
+	pointer_client->motion_pending = false;
+	wl_resource_for_each(resource, &pointer_client->pointer_resources)
+		wl_pointer_send_motion(resource, pointer_client->motion_time,
+				       pointer->sx, pointer->sy);
+}
+
+static int
+pointer_motion_flush_timer_handler(void *data)
+{
+	struct weston_pointer *pointer = data;
+	struct weston_pointer_client *pointer_client = pointer->focus_client;
+	bool backlogged;
+	int queued;
+
+	if (!pointer_client || !pointer_client->motion_pending)
+		return 0;
+
+	backlogged = weston_client_is_backlogged(pointer_client->client,
+						 &queued);
+	pointer_client_set_backlogged(pointer, pointer_client,
+				      backlogged, queued);
+	if (backlogged) {
+		wl_event_source_timer_update(pointer->motion_flush_timer,
+					     POINTER_MOTION_FLUSH_MSEC);
+		return 0;
+	}
+
+	pointer_flush_motion(pointer);
+	weston_pointer_send_frame(pointer);
+
+	return 0;
+}
+
 WL_EXPORT void
 weston_pointer_send_motion(struct weston_pointer *pointer, uint32_t time,
 			   struct weston_pointer_motion_event *event)
@@ -465,6 +563,8 @@ weston_pointer_send_button(struct weston_pointer *pointer,
 	if (!weston_pointer_has_focus_resource(pointer))
 		return;
 
+	pointer_flush_motion(pointer);
+
 	resource_list = &pointer->focus_client->pointer_resources;
 	serial = wl_display_next_serial(display);
 	wl_resource_for_each(resource, resource_list)
@@ -515,6 +615,8 @@ weston_pointer_send_axis(struct weston_pointer *pointer,
 	if (!weston_pointer_has_focus_resource(pointer))
 		return;
 
+	pointer_flush_motion(pointer);
+
 	resource_list = &pointer->focus_client->pointer_resources;
 	wl_resource_for_each(resource, resource_list) {
 		if (event->has_discrete &&
@@ -553,6 +655,8 @@ weston_pointer_send_axis_source(struct weston_pointer *pointer,
 	if (!weston_pointer_has_focus_resource(pointer))
 		return;
 
+	pointer_flush_motion(pointer);
+
 	resource_list = &pointer->focus_client->pointer_resources;
 	wl_resource_for_each(resource, resource_list) {
 		if (wl_resource_get_version(resource) >=
@@ -577,7 +681,8 @@ pointer_send_frame(struct wl_resource *resource)
  *
  * For every resource that is currently in focus, send a wl_pointer.frame event.
  * The focused resources are the wl_pointer resources of the client which
- * currently has the surface with pointer focus.
+ * currently has the surface with pointer focus. A frame that would only
+ * close motion held back for a backlogged client is not sent either.
  */
 WL_EXPORT void
 weston_pointer_send_frame(struct weston_pointer *pointer)
@@ -588,6 +693,10 @@ weston_pointer_send_frame(struct weston_pointer *pointer)
 	if (!weston_pointer_has_focus_resource(pointer))
 		return;
 
+	if (pointer->focus_client->motion_pending &&
+	    wl_list_empty(&pointer->focus_client->relative_pointer_resources))
+		return;
+
 	resource_list = &pointer->focus_client->pointer_resources;
 	wl_resource_for_each(resource, resource_list)
 		pointer_send_frame(resource);
@@ -680,13 +789,102 @@ weston_touch_send_down(struct weston_touch *touch, uint32_t time,
 			wl_touch_send_down(resource, serial, time,
 					   touch->focus->surface->resource,
 					   touch_id, sx, sy);
+	touch->frame_needed = true;
+}
+
+/* A touch point the default grab has sent a down for. */
+struct touch_point {
+	int touch_id;
+	/* Latest motion, in global coordinates, not sent yet */
+	bool motion_pending;
+	uint32_t time;
+	wl_fixed_t x, y;
+	/* Last position sent, in surface coordinates */
+	wl_fixed_t sx, sy;
+};
+
+static struct touch_point *
+touch_find_point(struct weston_touch *touch, int touch_id)
+{
+	struct touch_point *point;
+
+	wl_array_for_each(point, &touch->points) {
+		if (point->touch_id == touch_id)
+			return point;
+	}
+
+	return NULL;
+}
+
+static void
+touch_remove_point(struct weston_touch *touch, int touch_id)
+{
+	struct touch_point *point = touch_find_point(touch, touch_id);
+	struct touch_point *last;
+
+	if (!point)
+		return;
+
+	last = (struct touch_point *)
+		((char *) touch->points.data + touch->points.size) - 1;
+	*point = *last;
+	touch->points.size -= sizeof *point;
+}
+
+/* Send the motion the default grab gathered since the last frame: at most
+ * one event per touch point, and none for points whose surface position
+ * did not change. */
+static void
+touch_flush_motion(struct weston_touch *touch)
+{
+	struct touch_point *point;
+	struct wl_resource *resource;
+	wl_fixed_t sx, sy;
+
+	wl_array_for_each(point, &touch->points) {
+		if (!point->motion_pending)
+			continue;
+		point->motion_pending = false;
+
+		if (!weston_touch_has_focus_resource(touch))
+			continue;
+
+		weston_view_from_global_fixed(touch->focus,
+					      point->x, point->y, &sx, &sy);
+		if (sx == point->sx && sy == point->sy)
+			continue;
+
+		point->sx = sx;
+		point->sy = sy;
+		wl_resource_for_each(resource, &touch->focus_resource_list)
+			wl_touch_send_motion(resource, point->time,
+					     point->touch_id, sx, sy);
+		touch->frame_needed = true;
+	}
 }
 
 static void
 default_grab_touch_down(struct weston_touch_grab *grab, uint32_t time,
 			int touch_id, wl_fixed_t x, wl_fixed_t y)
 {
-	weston_touch_send_down(grab->touch, time, touch_id, x, y);
+	struct weston_touch *touch = grab->touch;
+	struct touch_point *point;
+
+	touch_flush_motion(touch);
+	weston_touch_send_down(touch, time, touch_id, x, y);
+
+	point = touch_find_point(touch, touch_id);
+	if (!point)
+		point = wl_array_add(&touch->points, sizeof *point);
+	if (!point)
+		return;
+
+	point->touch_id = touch_id;
+	point->motion_pending = false;
+	point->sx = point->sy = 0;
+	if (touch->focus)
+		weston_view_from_global_fixed(touch->focus, x, y,
+					      &point->sx, &point->sy);
 }
 
 /** Send wl_touch.up events to focused resources.
@@ -714,12 +912,15 @@ weston_touch_send_up(struct weston_touch *touch, uint32_t time, int touch_id)
 	serial = wl_display_next_serial(display);
 	wl_resource_for_each(resource, resource_list)
 		wl_touch_send_up(resource, serial, time, touch_id);
+	touch->frame_needed = true;
 }
 
 static void
 default_grab_touch_up(struct weston_touch_grab *grab,
 		      uint32_t time, int touch_id)
 {
+	touch_flush_motion(grab->touch);
+	touch_remove_point(grab->touch, touch_id);
 	weston_touch_send_up(grab->touch, time, touch_id);
 }
 
@@ -753,13 +954,26 @@ weston_touch_send_motion(struct weston_touch *touch, uint32_t time,
 		wl_touch_send_motion(resource, time,
 				     touch_id, sx, sy);
 	}
+	touch->frame_needed = true;
 }
 
+/* Motion is only sent at the end of the frame it belongs to, so that a
+ * point moving several times within one frame costs a single event. */
 static void
 default_grab_touch_motion(struct weston_touch_grab *grab, uint32_t time,
 			  int touch_id, wl_fixed_t x, wl_fixed_t y)
 {
-	weston_touch_send_motion(grab->touch, time, touch_id, x, y);
+	struct touch_point *point = touch_find_point(grab->touch, touch_id);
+
+	if (!point) {
+		weston_touch_send_motion(grab->touch, time, touch_id, x, y);
+		return;
+	}
+
+	point->motion_pending = true;
+	point->time = time;
+	point->x = x;
+	point->y = y;
 }
 
 
@@ -769,13 +983,18 @@ default_grab_touch_motion(struct weston_touch_grab *grab, uint32_t time,
  *
  * For every resource that is currently in focus, send a wl_touch.frame event.
  * The focused resources are the wl_touch resources of the client which
- * currently has the surface with touch focus.
+ * currently has the surface with touch focus. Nothing is sent if no down, up
+ * or motion event went out since the last frame.
  */
 WL_EXPORT void
 weston_touch_send_frame(struct weston_touch *touch)
 {
 	struct wl_resource *resource;
 
+	if (!touch->frame_needed)
+		return;
+	touch->frame_needed = false;
+
 	if (!weston_touch_has_focus_resource(touch))
 		return;
 
@@ -786,6 +1005,7 @@ weston_touch_send_frame(struct weston_touch *touch)
 static void
 default_grab_touch_frame(struct weston_touch_grab *grab)
 {
+	touch_flush_motion(grab->touch);
 	weston_touch_send_frame(grab->touch);
 }
 
@@ -1032,11 +1252,22 @@ WL_EXPORT struct weston_pointer *
 weston_pointer_create(struct weston_seat *seat)
 {
 	struct weston_pointer *pointer;
+	struct wl_event_loop *loop;
 
 	pointer = zalloc(sizeof *pointer);
 	if (pointer == NULL)
 		return NULL;
 
+	loop = wl_display_get_event_loop(seat->compositor->wl_display);
+	pointer->motion_flush_timer =
+		wl_event_loop_add_timer(loop,
+					pointer_motion_flush_timer_handler,
+					pointer);
+	if (pointer->motion_flush_timer == NULL) {
+		free(pointer);
+		return NULL;
+	}
+
 	wl_list_init(&pointer->pointer_clients);
 	weston_pointer_set_default_grab(pointer,
 					seat->compositor->default_pointer_grab);
@@ -1079,6 +1310,7 @@ weston_pointer_destroy(struct weston_pointer *pointer)
 	wl_list_remove(&pointer->focus_resource_listener.link);
 	wl_list_remove(&pointer->focus_view_listener.link);
 	wl_list_remove(&pointer->output_destroy_listener.link);
+	wl_event_source_remove(pointer->motion_flush_timer);
 	free(pointer);
 }
 
@@ -1107,6 +1339,7 @@ weston_keyboard_create(void)
 	wl_list_init(&keyboard->focus_resource_listener.link);
 	keyboard->focus_resource_listener.notify = keyboard_focus_resource_destroyed;
 	wl_array_init(&keyboard->keys);
+	wl_array_init(&keyboard->keymap_clients);
 	keyboard->default_grab.interface = &default_keyboard_grab_interface;
 	keyboard->default_grab.keyboard = keyboard;
 	keyboard->grab = &keyboard->default_grab;
@@ -1133,6 +1366,7 @@ weston_keyboard_destroy(struct weston_keyboard *keyboard)
 #endif
 
 	wl_array_release(&keyboard->keys);
+	wl_array_release(&keyboard->keymap_clients);
 	wl_list_remove(&keyboard->focus_resource_listener.link);
 	free(keyboard);
 }
@@ -1162,6 +1396,7 @@ weston_touch_create(void)
 	touch->default_grab.touch = touch;
 	touch->grab = &touch->default_grab;
 	wl_signal_init(&touch->focus_signal);
+	wl_array_init(&touch->points);
 
 	return touch;
 }
@@ -1173,6 +1408,7 @@ weston_touch_destroy(struct weston_touch *touch)
 
 	wl_list_remove(&touch->focus_view_listener.link);
 	wl_list_remove(&touch->focus_resource_listener.link);
+	wl_array_release(&touch->points);
 	free(touch);
 }
 
@@ -1247,6 +1483,8 @@ weston_pointer_set_focus(struct weston_pointer *pointer,
 			}
 		}
 
+		/* The next enter carries the position. */
+		pointer->focus_client->motion_pending = false;
 		pointer->focus_client = NULL;
 	}
 
@@ -1313,6 +1551,57 @@ send_enter_to_resource_list(struct wl_list *list,
 	}
 }
 
+static bool
+keyboard_client_has_keymap(struct weston_keyboard *keyboard,
+			   struct wl_client *client)
+{
+	struct wl_client **c;
+
+	wl_array_for_each(c, &keyboard->keymap_clients) {
+		if (*c == client)
+			return true;
+	}
+
+	return false;
+}
+
+/* A client that went away may leave its entry behind, but any client
+ * created since then got the current keymap when binding anyway. */
+static void
+keyboard_set_client_has_keymap(struct weston_keyboard *keyboard,
+			       struct wl_client *client)
+{
+	struct wl_client **c;
+
+	if (keyboard_client_has_keymap(keyboard, client))
+		return;
+
+	c = wl_array_add(&keyboard->keymap_clients, sizeof *c);
+	if (c)
+		*c = client;
+}
+
+/* Keymap changes only go out to the focused client; the others are sent
+ * the keymap when they get the focus. */
+static void
+keyboard_send_keymap_on_enter(struct weston_keyboard *keyboard,
+			      struct wl_client *client)
+{
+	struct weston_xkb_info *xkb_info = keyboard->xkb_info;
+	struct wl_resource *resource;
+
+	if (!keyboard->seat->compositor->use_xkbcommon || !xkb_info ||
+	    keyboard_client_has_keymap(keyboard, client))
+		return;
+
+	wl_resource_for_each(resource, &keyboard->focus_resource_list)
+		wl_keyboard_send_keymap(resource,
+					WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+					xkb_info->keymap_fd,
+					xkb_info->keymap_size);
+	keyboard_set_client_has_keymap(keyboard, client);
+}
+
 WL_EXPORT void
 weston_keyboard_set_focus(struct weston_keyboard *keyboard,
 			  struct weston_surface *surface)
@@ -1343,6 +1632,7 @@ weston_keyboard_set_focus(struct weston_keyboard *keyboard,
 		move_resources_for_client(focus_resource_list,
 					  &keyboard->resource_list,
 					  surface_client);
+		keyboard_send_keymap_on_enter(keyboard, surface_client);
 		send_enter_to_resource_list(focus_resource_list,
 					    keyboard,
 					    surface,
@@ -1406,6 +1696,10 @@ weston_pointer_cancel_grab(struct weston_pointer *pointer)
 WL_EXPORT void
 weston_touch_start_grab(struct weston_touch *touch, struct weston_touch_grab *grab)
 {
+	/* Motion gathered by the default grab belongs before the grab. */
+	if (touch->grab == &touch->default_grab)
+		touch_flush_motion(touch);
+
 	touch->grab = grab;
 	grab->touch = touch;
 }
@@ -1492,7 +1786,9 @@ weston_pointer_move_to(struct weston_pointer *pointer,
 		weston_view_set_position(pointer->sprite,
 					 ix - pointer->hotspot_x,
 					 iy - pointer->hotspot_y);
-		weston_view_schedule_repaint(pointer->sprite);
+		/* A sprite on a cursor plane moves without a repaint */
+		if (!weston_view_move_on_plane(pointer->sprite))
+			weston_view_schedule_repaint(pointer->sprite);
 	}
 
 	pointer->grab->interface->focus(pointer->grab);
@@ -1553,6 +1849,28 @@ weston_pointer_handle_output_destroy(struct wl_listener *listener, void *data)
 	weston_pointer_move_to(pointer, fx, fy);
 }
 
+/* Tell the client that has the focus the input went to when the event
+ * happened, for the input latency of the frame showing its answer */
+static void
+seat_note_input(struct weston_seat *seat, struct weston_surface *focus,
+		uint64_t time_usec)
+{
+	struct weston_compositor *ec = seat->compositor;
+	struct timespec time;
+
+	if (!focus)
+		return;
+
+	/* Backends time events on CLOCK_MONOTONIC, which only compares
+	 * with the presentation timestamps if that is their clock too */
+	if (time_usec != 0 && ec->presentation_clock == CLOCK_MONOTONIC)
+		timespec_from_nsec(&time, time_usec * 1000);
+	else
+		weston_compositor_read_presentation_clock(ec, &time);
+
+	weston_surface_note_input(focus, &time);
+}
+
 WL_EXPORT void
 notify_motion(struct weston_seat *seat,
 	      uint32_t time,
@@ -1560,9 +1878,21 @@ notify_motion(struct weston_seat *seat,
 {
 	struct weston_compositor *ec = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	bool abs = event->mask & WESTON_POINTER_MOTION_ABS;
+
+	weston_log_scope_printf(ec->input_scope, WESTON_LOG_LEVEL_DEBUG,
+				"%s: motion %u: %s %.2f,%.2f\n", seat->seat_name,
+				time, abs ? "to" : "by",
+				abs ? event->x : event->dx,
+				abs ? event->y : event->dy);
+	WESTON_PROBE(input_motion, seat, time, event->mask);
 
 	weston_compositor_wake(ec);
 	pointer->grab->interface->motion(pointer->grab, time, event);
+
+	if (pointer->focus)
+		seat_note_input(seat, pointer->focus->surface,
+				event->time_usec);
 }
 
 static void
@@ -1609,6 +1939,10 @@ notify_motion_absolute(struct weston_seat *seat,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 	struct weston_pointer_motion_event event = { 0 };
 
+	weston_log_scope_printf(ec->input_scope, WESTON_LOG_LEVEL_DEBUG,
+				"%s: motion %u: to %.2f,%.2f\n", seat->seat_name,
+				time, x, y);
+
 	weston_compositor_wake(ec);
 
 	event = (struct weston_pointer_motion_event) {
@@ -1618,6 +1952,9 @@ notify_motion_absolute(struct weston_seat *seat,
 	};
 
 	pointer->grab->interface->motion(pointer->grab, time, &event);
+
+	if (pointer->focus)
+		seat_note_input(seat, pointer->focus->surface, 0);
 }
 
 static unsigned int
@@ -1655,6 +1992,16 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 {
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	uint64_t time_usec = seat->event_time_usec;
+
+	seat->event_time_usec = 0;
+
+	weston_log_scope_printf(compositor->input_scope,
+				WESTON_LOG_LEVEL_DEBUG,
+				"%s: button %u: 0x%x %s\n", seat->seat_name,
+				time, button,
+				state == WL_POINTER_BUTTON_STATE_PRESSED ?
+				"pressed" : "released");
 
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
@@ -1675,6 +2022,9 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 
 	pointer->grab->interface->button(pointer->grab, time, button, state);
 
+	if (pointer->focus)
+		seat_note_input(seat, pointer->focus->surface, time_usec);
+
 	if (pointer->button_count == 1)
 		pointer->grab_serial =
 			wl_display_get_serial(compositor->wl_display);
@@ -1687,6 +2037,11 @@ notify_axis(struct weston_seat *seat, uint32_t time,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	weston_log_scope_printf(compositor->input_scope,
+				WESTON_LOG_LEVEL_DEBUG,
+				"%s: axis %u: %u %+.2f\n", seat->seat_name,
+				time, event->axis, event->value);
+
 	weston_compositor_wake(compositor);
 
 	if (weston_compositor_run_axis_binding(compositor, pointer,
@@ -1885,7 +2240,8 @@ send_modifiers(struct wl_resource *resource, uint32_t serial, struct weston_keyb
 }
 
 static struct weston_xkb_info *
-weston_xkb_info_create(struct xkb_keymap *keymap);
+weston_xkb_info_create(struct weston_compositor *ec,
+		       struct xkb_keymap *keymap);
 
 static void
 update_keymap(struct weston_seat *seat)
@@ -1896,8 +2252,10 @@ update_keymap(struct weston_seat *seat)
 	struct xkb_state *state;
 	xkb_mod_mask_t latched_mods;
 	xkb_mod_mask_t locked_mods;
+	bool changed;
 
-	xkb_info = weston_xkb_info_create(keyboard->pending_keymap);
+	xkb_info = weston_xkb_info_create(seat->compositor,
+					  keyboard->pending_keymap);
 
 	xkb_keymap_unref(keyboard->pending_keymap);
 	keyboard->pending_keymap = NULL;
@@ -1924,24 +2282,34 @@ update_keymap(struct weston_seat *seat)
 			      locked_mods,
 			      0, 0, 0);
 
+	/* Keymaps are shared by content, so switching to an identical one
+	 * hands back the same xkb_info and there is nothing to send. */
+	changed = xkb_info != keyboard->xkb_info;
 	weston_xkb_info_destroy(keyboard->xkb_info);
 	keyboard->xkb_info = xkb_info;
 
 	xkb_state_unref(keyboard->xkb_state.state);
 	keyboard->xkb_state.state = state;
 
-	wl_resource_for_each(resource, &keyboard->resource_list)
-		send_keymap(resource, xkb_info);
-	wl_resource_for_each(resource, &keyboard->focus_resource_list)
-		send_keymap(resource, xkb_info);
+	if (changed) {
+		keyboard->keymap_clients.size = 0;
+		wl_resource_for_each(resource, &keyboard->focus_resource_list)
+			send_keymap(resource, xkb_info);
+		if (!wl_list_empty(&keyboard->focus_resource_list)) {
+			resource = wl_resource_from_link(
+				keyboard->focus_resource_list.next);
+			keyboard_set_client_has_keymap(keyboard,
+				wl_resource_get_client(resource));
+		}
+	}
 
 	notify_modifiers(seat, wl_display_next_serial(seat->compositor->wl_display));
 
 	if (!latched_mods && !locked_mods)
 		return;
 
-	wl_resource_for_each(resource, &keyboard->resource_list)
-		send_modifiers(resource, wl_display_get_serial(seat->compositor->wl_display), keyboard);
+	/* The other clients get the modifiers on enter, along with the
+	 * keymap they refer to. */
 	wl_resource_for_each(resource, &keyboard->focus_resource_list)
 		send_modifiers(resource, wl_display_get_serial(seat->compositor->wl_display), keyboard);
 }
@@ -1971,8 +2339,18 @@ notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_keyboard *keyboard = weston_seat_get_keyboard(seat);
 	struct weston_keyboard_grab *grab = keyboard->grab;
+	uint64_t time_usec = seat->event_time_usec;
 	uint32_t *k, *end;
 
+	seat->event_time_usec = 0;
+
+	weston_log_scope_printf(compositor->input_scope,
+				WESTON_LOG_LEVEL_DEBUG,
+				"%s: key %u: %u %s\n", seat->seat_name, time, key,
+				state == WL_KEYBOARD_KEY_STATE_PRESSED ?
+				"pressed" : "released");
+	WESTON_PROBE(input_key, seat, time, key, state);
+
 	if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 	} else {
@@ -2003,6 +2381,9 @@ notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 
 	grab->interface->key(grab, time, key, state);
 
+	if (keyboard->focus)
+		seat_note_input(seat, keyboard->focus, time_usec);
+
 	if (keyboard->pending_keymap &&
 	    keyboard->keys.size == 0)
 		update_keymap(seat);
@@ -2146,6 +2527,9 @@ weston_touch_set_focus(struct weston_touch *touch, struct weston_view *view)
 		wl_signal_add(&view->destroy_signal, &touch->focus_view_listener);
 	}
 	touch->focus = view;
+
+	/* The points of the old focus are over with it. */
+	touch->points.size = 0;
 }
 
 /**
@@ -2168,6 +2552,13 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 	wl_fixed_t x = wl_fixed_from_double(double_x);
 	wl_fixed_t y = wl_fixed_from_double(double_y);
 
+	weston_log_scope_printf(ec->input_scope, WESTON_LOG_LEVEL_DEBUG,
+				"%s: touch %u: id %d %s at %.2f,%.2f\n",
+				seat->seat_name, time, touch_id,
+				touch_type == WL_TOUCH_DOWN ? "down" :
+				touch_type == WL_TOUCH_UP ? "up" : "motion",
+				double_x, double_y);
+
 	/* Update grab's global coordinates. */
 	if (touch_id == touch->grab_touch_id && touch_type != WL_TOUCH_UP) {
 		touch->grab_x = x;
@@ -2494,6 +2885,7 @@ seat_get_keyboard(struct wl_client *client, struct wl_resource *resource,
 		wl_keyboard_send_keymap(cr, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
 					keyboard->xkb_info->keymap_fd,
 					keyboard->xkb_info->keymap_size);
+		keyboard_set_client_has_keymap(keyboard, client);
 	} else {
 		int null_fd = open("/dev/null", O_RDONLY);
 		wl_keyboard_send_keymap(cr, WL_KEYBOARD_KEYMAP_FORMAT_NO_KEYMAP,
@@ -2719,6 +3111,7 @@ weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 		return;
 
 	xkb_keymap_unref(xkb_info->keymap);
+	wl_list_remove(&xkb_info->link);
 
 	if (xkb_info->keymap_area)
 		munmap(xkb_info->keymap_area, xkb_info->keymap_size);
@@ -2748,17 +3141,81 @@ weston_compositor_xkb_destroy(struct weston_compositor *ec)
 	xkb_context_unref(ec->xkb_context);
 }
 
+/* Write the keymap into a file all clients are sent, sealed where the
+ * file allows it so that none of them can change it under the others,
+ * and keep it mapped read-only to compare with later keymaps. */
+static int
+xkb_info_create_keymap_file(struct weston_xkb_info *xkb_info,
+			    const char *keymap_str)
+{
+	char *area;
+
+	xkb_info->keymap_fd = os_create_anonymous_file(xkb_info->keymap_size);
+	if (xkb_info->keymap_fd < 0) {
+		weston_log("creating a keymap file for %lu bytes failed: %m\n",
+			(unsigned long) xkb_info->keymap_size);
+		return -1;
+	}
+
+	area = mmap(NULL, xkb_info->keymap_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, xkb_info->keymap_fd, 0);
+	if (area == MAP_FAILED)
+		goto err_mmap;
+	strcpy(area, keymap_str);
+	munmap(area, xkb_info->keymap_size);
+
+	os_seal_anonymous_file(xkb_info->keymap_fd, true);
+
+	area = mmap(NULL, xkb_info->keymap_size, PROT_READ,
+		    MAP_SHARED, xkb_info->keymap_fd, 0);
+	if (area == MAP_FAILED)
+		goto err_mmap;
+	xkb_info->keymap_area = area;
+
+	return 0;
+
+err_mmap:
+	weston_log("failed to mmap() %lu bytes\n",
+		(unsigned long) xkb_info->keymap_size);
+	close(xkb_info->keymap_fd);
+	return -1;
+}
+
 static struct weston_xkb_info *
-weston_xkb_info_create(struct xkb_keymap *keymap)
+weston_xkb_info_create(struct weston_compositor *ec,
+		       struct xkb_keymap *keymap)
 {
-	struct weston_xkb_info *xkb_info = zalloc(sizeof *xkb_info);
-	if (xkb_info == NULL)
+	struct weston_xkb_info *xkb_info;
+	char *keymap_str;
+	size_t keymap_size;
+
+	keymap_str = xkb_keymap_get_as_string(keymap,
+					      XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (keymap_str == NULL) {
+		weston_log("failed to get string version of keymap\n");
 		return NULL;
+	}
+	keymap_size = strlen(keymap_str) + 1;
+
+	wl_list_for_each(xkb_info, &ec->xkb_info_list, link) {
+		if (xkb_info->keymap_size == keymap_size &&
+		    memcmp(xkb_info->keymap_area, keymap_str,
+			   keymap_size) == 0) {
+			free(keymap_str);
+			xkb_info->ref_count++;
+			return xkb_info;
+		}
+	}
+
+	xkb_info = zalloc(sizeof *xkb_info);
+	if (xkb_info == NULL) {
+		free(keymap_str);
+		return NULL;
+	}
 
 	xkb_info->keymap = xkb_keymap_ref(keymap);
 	xkb_info->ref_count = 1;
-
-	char *keymap_str;
+	xkb_info->keymap_size = keymap_size;
 
 	xkb_info->shift_mod = xkb_keymap_mod_get_index(xkb_info->keymap,
 						       XKB_MOD_NAME_SHIFT);
@@ -2784,42 +3241,17 @@ weston_xkb_info_create(struct xkb_keymap *keymap)
 	xkb_info->scroll_led = xkb_keymap_led_get_index(xkb_info->keymap,
 							XKB_LED_NAME_SCROLL);
 
-	keymap_str = xkb_keymap_get_as_string(xkb_info->keymap,
-					      XKB_KEYMAP_FORMAT_TEXT_V1);
-	if (keymap_str == NULL) {
-		weston_log("failed to get string version of keymap\n");
-		goto err_keymap;
-	}
-	xkb_info->keymap_size = strlen(keymap_str) + 1;
-
-	xkb_info->keymap_fd = os_create_anonymous_file(xkb_info->keymap_size);
-	if (xkb_info->keymap_fd < 0) {
-		weston_log("creating a keymap file for %lu bytes failed: %m\n",
-			(unsigned long) xkb_info->keymap_size);
-		goto err_keymap_str;
-	}
-
-	xkb_info->keymap_area = mmap(NULL, xkb_info->keymap_size,
-				     PROT_READ | PROT_WRITE,
-				     MAP_SHARED, xkb_info->keymap_fd, 0);
-	if (xkb_info->keymap_area == MAP_FAILED) {
-		weston_log("failed to mmap() %lu bytes\n",
-			(unsigned long) xkb_info->keymap_size);
-		goto err_dev_zero;
+	if (xkb_info_create_keymap_file(xkb_info, keymap_str) < 0) {
+		free(keymap_str);
+		xkb_keymap_unref(xkb_info->keymap);
+		free(xkb_info);
+		return NULL;
 	}
-	strcpy(xkb_info->keymap_area, keymap_str);
 	free(keymap_str);
 
-	return xkb_info;
+	wl_list_insert(&ec->xkb_info_list, &xkb_info->link);
 
-err_dev_zero:
-	close(xkb_info->keymap_fd);
-err_keymap_str:
-	free(keymap_str);
-err_keymap:
-	xkb_keymap_unref(xkb_info->keymap);
-	free(xkb_info);
-	return NULL;
+	return xkb_info;
 }
 
 static int
@@ -2843,7 +3275,7 @@ weston_compositor_build_global_keymap(struct weston_compositor *ec)
 		return -1;
 	}
 
-	ec->xkb_info = weston_xkb_info_create(keymap);
+	ec->xkb_info = weston_xkb_info_create(ec, keymap);
 	xkb_keymap_unref(keymap);
 	if (ec->xkb_info == NULL)
 		return -1;
@@ -2905,7 +3337,9 @@ weston_seat_init_keyboard(struct weston_seat *seat, struct xkb_keymap *keymap)
 #ifdef ENABLE_XKBCOMMON
 	if (seat->compositor->use_xkbcommon) {
 		if (keymap != NULL) {
-			keyboard->xkb_info = weston_xkb_info_create(keymap);
+			keyboard->xkb_info =
+				weston_xkb_info_create(seat->compositor,
+						       keymap);
 			if (keyboard->xkb_info == NULL)
 				goto err;
 		} else {
@@ -3302,6 +3736,9 @@ weston_pointer_constraint_destroy(struct weston_pointer_constraint *constraint)
 
 	wl_resource_set_user_data(constraint->resource, NULL);
 	pixman_region32_fini(&constraint->region);
+	pixman_region32_fini(&constraint->outline_region);
+	wl_array_release(&constraint->outline_horizontal);
+	wl_array_release(&constraint->outline_vertical);
 	wl_list_remove(&constraint->link);
 	free(constraint);
 }
@@ -3517,6 +3954,10 @@ pointer_constraint_surface_committed(struct wl_listener *listener, void *data)
 		pixman_region32_init(&constraint->region_pending);
 	}
 
+	/* The input region may have changed as well */
+	if (constraint->outline_valid)
+		pointer_constraint_update_outline(constraint);
+
 	if (constraint->hint_is_pending) {
 		constraint->hint_is_pending = false;
 
@@ -3548,6 +3989,9 @@ weston_pointer_constraint_create(struct weston_surface *surface,
 	constraint->lifetime = lifetime;
 	pixman_region32_init(&constraint->region);
 	pixman_region32_init(&constraint->region_pending);
+	pixman_region32_init(&constraint->outline_region);
+	wl_array_init(&constraint->outline_horizontal);
+	wl_array_init(&constraint->outline_vertical);
 	wl_list_insert(&surface->pointer_constraints, &constraint->link);
 	constraint->surface = surface;
 	constraint->pointer = pointer;
@@ -4114,36 +4558,6 @@ is_border_blocking_directions(struct border *border,
 	return (~border->blocking_dir & directions) != directions;
 }
 
-static struct border *
-get_closest_border(struct wl_array *borders,
-		   struct line *motion,
-		   uint32_t directions)
-{
-	struct border *border;
-	struct vec2d intersection;
-	struct vec2d delta;
-	double distance_2;
-	struct border *closest_border = NULL;
-	double closest_distance_2 = DBL_MAX;
-
-	wl_array_for_each(border, borders) {
-		if (!is_border_blocking_directions(border, directions))
-			continue;
-
-		if (!lines_intersect(&border->line, motion, &intersection))
-			continue;
-
-		delta = vec2d_subtract(intersection, motion->a);
-		distance_2 = delta.x*delta.x + delta.y*delta.y;
-		if (distance_2 < closest_distance_2) {
-			closest_border = border;
-			closest_distance_2 = distance_2;
-		}
-	}
-
-	return closest_border;
-}
-
 static void
 clamp_to_border(struct border *border,
 		struct line *motion,
@@ -4152,7 +4566,7 @@ clamp_to_border(struct border *border,
 	/*
 	 * When clamping either rightward or downward motions, the motion needs
 	 * to be clamped so that the destination coordinate does not end up on
-	 * the border (see weston_pointer_clamp_event_to_region). Do this by
+	 * the border (see weston_pointer_clamp_event_to_constraint). Do this by
 	 * clamping such motions to the border minus the smallest possible
 	 * wl_fixed_t value.
 	 */
@@ -4190,18 +4604,174 @@ get_motion_directions(struct line *motion)
 	return directions;
 }
 
+static int
+compare_borders_y(const void *a, const void *b)
+{
+	const struct border *border_a = a;
+	const struct border *border_b = b;
+
+	if (border_a->line.a.y < border_b->line.a.y)
+		return -1;
+	return border_a->line.a.y > border_b->line.a.y;
+}
+
+static int
+compare_borders_x(const void *a, const void *b)
+{
+	const struct border *border_a = a;
+	const struct border *border_b = b;
+
+	if (border_a->line.a.x < border_b->line.a.x)
+		return -1;
+	return border_a->line.a.x > border_b->line.a.x;
+}
+
 static void
-weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
-				     struct weston_pointer_motion_event *event,
-				     pixman_region32_t *region,
-				     wl_fixed_t *clamped_x,
-				     wl_fixed_t *clamped_y)
+pointer_constraint_update_outline(struct weston_pointer_constraint *constraint)
 {
+	pixman_region32_t confine_region;
+	struct wl_array borders;
+	struct border *border, *copy;
+
+	pixman_region32_init(&confine_region);
+	pixman_region32_intersect(&confine_region,
+				  &constraint->surface->input,
+				  &constraint->region);
+
+	if (constraint->outline_valid &&
+	    pixman_region32_equal(&confine_region,
+				  &constraint->outline_region)) {
+		pixman_region32_fini(&confine_region);
+		return;
+	}
+
+	pixman_region32_copy(&constraint->outline_region, &confine_region);
+	pixman_region32_fini(&confine_region);
+
+	/*
+	 * Generate borders given the confine region we are to use. The borders
+	 * are defined to be the outer region of the allowed area. This means
+	 * top/left borders are "within" the allowed area, while bottom/right
+	 * borders are outside. This needs to be considered when clamping
+	 * confined motion vectors.
+	 */
+	wl_array_init(&borders);
+	if (pixman_region32_not_empty(&constraint->outline_region))
+		region_to_outline(&constraint->outline_region, &borders);
+
+	constraint->outline_horizontal.size = 0;
+	constraint->outline_vertical.size = 0;
+	wl_array_for_each(border, &borders) {
+		if (is_border_horizontal(border))
+			copy = wl_array_add(&constraint->outline_horizontal,
+					    sizeof *copy);
+		else
+			copy = wl_array_add(&constraint->outline_vertical,
+					    sizeof *copy);
+		if (copy)
+			*copy = *border;
+	}
+	wl_array_release(&borders);
+
+	qsort(constraint->outline_horizontal.data,
+	      constraint->outline_horizontal.size / sizeof *border,
+	      sizeof *border, compare_borders_y);
+	qsort(constraint->outline_vertical.data,
+	      constraint->outline_vertical.size / sizeof *border,
+	      sizeof *border, compare_borders_x);
+
+	constraint->outline_valid = true;
+}
+
+/* Index of the first border at or after pos, borders sorted by x or y */
+static size_t
+find_first_border(struct wl_array *borders, bool horizontal, double pos)
+{
+	struct border *data = borders->data;
+	size_t low = 0, high = borders->size / sizeof *data, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if ((horizontal ? data[mid].line.a.y : data[mid].line.a.x) < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* The closest border among those between pos1 and pos2 in the sort
+ * order of borders, which are the only ones the motion may cross. */
+static void
+get_closest_border_in_range(struct wl_array *borders, bool horizontal,
+			    double pos1, double pos2,
+			    struct line *motion, uint32_t directions,
+			    struct border **closest_border,
+			    double *closest_distance_2)
+{
+	struct border *data = borders->data;
+	size_t count = borders->size / sizeof *data;
+	struct border *border;
+	struct vec2d intersection;
+	struct vec2d delta;
+	double distance_2;
+	size_t i;
+
+	for (i = find_first_border(borders, horizontal, MIN(pos1, pos2));
+	     i < count; i++) {
+		border = &data[i];
+		if ((horizontal ? border->line.a.y : border->line.a.x) >
+		    MAX(pos1, pos2))
+			break;
+
+		if (!is_border_blocking_directions(border, directions))
+			continue;
+
+		if (!lines_intersect(&border->line, motion, &intersection))
+			continue;
+
+		delta = vec2d_subtract(intersection, motion->a);
+		distance_2 = delta.x*delta.x + delta.y*delta.y;
+		if (distance_2 < *closest_distance_2) {
+			*closest_border = border;
+			*closest_distance_2 = distance_2;
+		}
+	}
+}
+
+static struct border *
+get_closest_border(struct weston_pointer_constraint *constraint,
+		   struct line *motion,
+		   uint32_t directions)
+{
+	struct border *closest_border = NULL;
+	double closest_distance_2 = DBL_MAX;
+
+	get_closest_border_in_range(&constraint->outline_horizontal, true,
+				    motion->a.y, motion->b.y,
+				    motion, directions,
+				    &closest_border, &closest_distance_2);
+	get_closest_border_in_range(&constraint->outline_vertical, false,
+				    motion->a.x, motion->b.x,
+				    motion, directions,
+				    &closest_border, &closest_distance_2);
+
+	return closest_border;
+}
+
+static void
+weston_pointer_clamp_event_to_constraint(
+	struct weston_pointer_constraint *constraint,
+	struct weston_pointer_motion_event *event,
+	wl_fixed_t *clamped_x,
+	wl_fixed_t *clamped_y)
+{
+	struct weston_pointer *pointer = constraint->pointer;
 	wl_fixed_t x, y;
 	wl_fixed_t sx, sy;
 	wl_fixed_t old_sx = pointer->sx;
 	wl_fixed_t old_sy = pointer->sy;
-	struct wl_array borders;
 	struct line motion;
 	struct border *closest_border;
 	float new_x_f, new_y_f;
@@ -4210,16 +4780,8 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 	weston_pointer_motion_to_abs(pointer, event, &x, &y);
 	weston_view_from_global_fixed(pointer->focus, x, y, &sx, &sy);
 
-	wl_array_init(&borders);
-
-	/*
-	 * Generate borders given the confine region we are to use. The borders
-	 * are defined to be the outer region of the allowed area. This means
-	 * top/left borders are "within" the allowed area, while bottom/right
-	 * borders are outside. This needs to be considered when clamping
-	 * confined motion vectors.
-	 */
-	region_to_outline(region, &borders);
+	if (!constraint->outline_valid)
+		pointer_constraint_update_outline(constraint);
 
 	motion = (struct line) {
 		.a = (struct vec2d) {
@@ -4234,7 +4796,7 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 	directions = get_motion_directions(&motion);
 
 	while (directions) {
-		closest_border = get_closest_border(&borders,
+		closest_border = get_closest_border(constraint,
 						    &motion,
 						    directions);
 		if (closest_border)
@@ -4248,8 +4810,6 @@ weston_pointer_clamp_event_to_region(struct weston_pointer *pointer,
 				    &new_x_f, &new_y_f);
 	*clamped_x = wl_fixed_from_double(new_x_f);
 	*clamped_y = wl_fixed_from_double(new_y_f);
-
-	wl_array_release(&borders);
 }
 
 static double
@@ -4328,36 +4888,33 @@ maybe_warp_confined_pointer(struct weston_pointer_constraint *constraint)
 	if (!is_within_constraint_region(constraint, sx, sy)) {
 		double xf = wl_fixed_to_double(sx);
 		double yf = wl_fixed_to_double(sy);
-		pixman_region32_t confine_region;
-		struct wl_array borders;
+		struct wl_array *outlines[] = {
+			&constraint->outline_horizontal,
+			&constraint->outline_vertical,
+		};
 		struct border *border;
 		double closest_distance_2 = DBL_MAX;
 		struct border *closest_border = NULL;
+		unsigned int i;
 
-		wl_array_init(&borders);
-
-		pixman_region32_init(&confine_region);
-		pixman_region32_intersect(&confine_region,
-					  &constraint->view->surface->input,
-					  &constraint->region);
-		region_to_outline(&confine_region, &borders);
-		pixman_region32_fini(&confine_region);
+		pointer_constraint_update_outline(constraint);
 
-		wl_array_for_each(border, &borders) {
-			double distance_2;
+		for (i = 0; i < ARRAY_LENGTH(outlines); i++) {
+			wl_array_for_each(border, outlines[i]) {
+				double distance_2;
 
-			distance_2 = point_to_border_distance_2(border, xf, yf);
-			if (distance_2 < closest_distance_2) {
-				closest_border = border;
-				closest_distance_2 = distance_2;
+				distance_2 = point_to_border_distance_2(border,
+									xf, yf);
+				if (distance_2 < closest_distance_2) {
+					closest_border = border;
+					closest_distance_2 = distance_2;
+				}
 			}
 		}
 		assert(closest_border);
 
 		warp_to_behind_border(closest_border, &sx, &sy);
 
-		wl_array_release(&borders);
-
 		weston_view_to_global_fixed(constraint->view, sx, sy, &x, &y);
 		weston_pointer_move_to(constraint->pointer, x, y);
 	}
@@ -4371,25 +4928,15 @@ confined_pointer_grab_pointer_motion(struct weston_pointer_grab *grab,
 	struct weston_pointer_constraint *constraint =
 		container_of(grab, struct weston_pointer_constraint, grab);
 	struct weston_pointer *pointer = grab->pointer;
-	struct weston_surface *surface;
 	wl_fixed_t x, y;
 	wl_fixed_t old_sx = pointer->sx;
 	wl_fixed_t old_sy = pointer->sy;
-	pixman_region32_t confine_region;
 
 	assert(pointer->focus);
 	assert(pointer->focus->surface == constraint->surface);
 
-	surface = pointer->focus->surface;
-
-	pixman_region32_init(&confine_region);
-	pixman_region32_intersect(&confine_region,
-				  &surface->input,
-				  &constraint->region);
-	weston_pointer_clamp_event_to_region(pointer, event,
-					     &confine_region, &x, &y);
+	weston_pointer_clamp_event_to_constraint(constraint, event, &x, &y);
 	weston_pointer_move_to(pointer, x, y);
-	pixman_region32_fini(&confine_region);
 
 	weston_view_from_global_fixed(pointer->focus, x, y,
 				      &pointer->sx, &pointer->sy);
@@ -39,6 +39,11 @@ struct launcher_interface {
 	void (* restore) (struct weston_launcher *launcher);
 	/* Get the number of the VT weston is running in */
 	int (* get_vt) (struct weston_launcher *launcher);
+	/* Optional: start opening a device that open() is about to be
+	 * asked for, so that several opens can be in flight at once */
+	void (* prefetch) (struct weston_launcher *launcher, const char *path);
+	/* Optional: give up on the prefetched devices nobody opened */
+	void (* prefetch_done) (struct weston_launcher *launcher);
 };
 
 struct weston_launcher {
@@ -58,33 +58,90 @@ struct launcher_logind {
 	struct wl_event_source *dbus_ctx;
 	char *spath;
 	DBusPendingCall *pending_active;
+	/* struct logind_prefetch::link */
+	struct wl_list prefetch_list;
 };
 
+/* A TakeDevice call sent ahead of launcher_logind_open() */
+struct logind_prefetch {
+	struct wl_list link;
+	dev_t devnum;
+	DBusPendingCall *pending;
+};
+
+static DBusMessage *
+launcher_logind_take_device_message(struct launcher_logind *wl,
+				    uint32_t major, uint32_t minor)
+{
+	DBusMessage *m;
+
+	m = dbus_message_new_method_call("org.freedesktop.login1",
+					 wl->spath,
+					 "org.freedesktop.login1.Session",
+					 "TakeDevice");
+	if (!m)
+		return NULL;
+
+	if (!dbus_message_append_args(m,
+				      DBUS_TYPE_UINT32, &major,
+				      DBUS_TYPE_UINT32, &minor,
+				      DBUS_TYPE_INVALID)) {
+		dbus_message_unref(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+/* The reply to a prefetched TakeDevice for the device, waiting for it if
+ * it has not come in yet, or NULL if the device was not prefetched */
+static DBusMessage *
+launcher_logind_steal_prefetched(struct launcher_logind *wl, dev_t devnum,
+				 bool *prefetched)
+{
+	struct logind_prefetch *prefetch;
+	DBusMessage *reply;
+
+	*prefetched = false;
+	wl_list_for_each(prefetch, &wl->prefetch_list, link) {
+		if (prefetch->devnum != devnum)
+			continue;
+
+		dbus_pending_call_block(prefetch->pending);
+		reply = dbus_pending_call_steal_reply(prefetch->pending);
+		dbus_pending_call_unref(prefetch->pending);
+		wl_list_remove(&prefetch->link);
+		free(prefetch);
+		*prefetched = true;
+
+		return reply;
+	}
+
+	return NULL;
+}
+
 static int
 launcher_logind_take_device(struct launcher_logind *wl, uint32_t major,
 			  uint32_t minor, bool *paused_out)
 {
 	DBusMessage *m, *reply;
-	bool b;
+	bool b, prefetched;
 	int r, fd;
 	dbus_bool_t paused;
 
-	m = dbus_message_new_method_call("org.freedesktop.login1",
-					 wl->spath,
-					 "org.freedesktop.login1.Session",
-					 "TakeDevice");
+	reply = launcher_logind_steal_prefetched(wl, makedev(major, minor),
+						 &prefetched);
+	if (prefetched) {
+		if (!reply)
+			return -ENODEV;
+		m = NULL;
+		goto parse;
+	}
+
+	m = launcher_logind_take_device_message(wl, major, minor);
 	if (!m)
 		return -ENOMEM;
 
-	b = dbus_message_append_args(m,
-				     DBUS_TYPE_UINT32, &major,
-				     DBUS_TYPE_UINT32, &minor,
-				     DBUS_TYPE_INVALID);
-	if (!b) {
-		r = -ENOMEM;
-		goto err_unref;
-	}
-
 	reply = dbus_connection_send_with_reply_and_block(wl->dbus, m,
 							  -1, NULL);
 	if (!reply) {
@@ -92,6 +149,7 @@ launcher_logind_take_device(struct launcher_logind *wl, uint32_t major,
 		goto err_unref;
 	}
 
+parse:
 	b = dbus_message_get_args(reply, NULL,
 				  DBUS_TYPE_UNIX_FD, &fd,
 				  DBUS_TYPE_BOOLEAN, &paused,
@@ -108,7 +166,8 @@ launcher_logind_take_device(struct launcher_logind *wl, uint32_t major,
 err_reply:
 	dbus_message_unref(reply);
 err_unref:
-	dbus_message_unref(m);
+	if (m)
+		dbus_message_unref(m);
 	return r;
 }
 
@@ -229,6 +288,67 @@ launcher_logind_close(struct weston_launcher *launcher, int fd)
 				     minor(st.st_rdev));
 }
 
+static void
+launcher_logind_prefetch(struct weston_launcher *launcher, const char *path)
+{
+	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct logind_prefetch *prefetch;
+	DBusPendingCall *pending;
+	DBusMessage *m;
+	struct stat st;
+	bool b;
+
+	if (stat(path, &st) < 0 || !S_ISCHR(st.st_mode))
+		return;
+
+	wl_list_for_each(prefetch, &wl->prefetch_list, link)
+		if (prefetch->devnum == st.st_rdev)
+			return;
+
+	prefetch = zalloc(sizeof *prefetch);
+	if (!prefetch)
+		return;
+
+	m = launcher_logind_take_device_message(wl, major(st.st_rdev),
+						minor(st.st_rdev));
+	if (!m) {
+		free(prefetch);
+		return;
+	}
+
+	b = dbus_connection_send_with_reply(wl->dbus, m, &pending, -1);
+	dbus_message_unref(m);
+	if (!b || !pending) {
+		free(prefetch);
+		return;
+	}
+
+	prefetch->devnum = st.st_rdev;
+	prefetch->pending = pending;
+	wl_list_insert(wl->prefetch_list.prev, &prefetch->link);
+
+	dbus_connection_flush(wl->dbus);
+}
+
+/* Devices that were prefetched but never opened, e.g. because libinput
+ * ignores them, are handed back. logind answers in order, so the release
+ * comes after the device was taken. */
+static void
+launcher_logind_prefetch_done(struct weston_launcher *launcher)
+{
+	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct logind_prefetch *prefetch, *tmp;
+
+	wl_list_for_each_safe(prefetch, tmp, &wl->prefetch_list, link) {
+		dbus_pending_call_cancel(prefetch->pending);
+		dbus_pending_call_unref(prefetch->pending);
+		launcher_logind_release_device(wl, major(prefetch->devnum),
+					       minor(prefetch->devnum));
+		wl_list_remove(&prefetch->link);
+		free(prefetch);
+	}
+}
+
 static void
 launcher_logind_restore(struct weston_launcher *launcher)
 {
@@ -734,6 +854,7 @@ launcher_logind_connect(struct weston_launcher **out, struct weston_compositor *
 	wl->base.iface = &launcher_logind_iface;
 	wl->compositor = compositor;
 	wl->sync_drm = sync_drm;
+	wl_list_init(&wl->prefetch_list);
 
 	wl->seat = strdup(seat_id);
 	if (!wl->seat) {
@@ -822,6 +943,7 @@ launcher_logind_destroy(struct weston_launcher *launcher)
 		dbus_pending_call_unref(wl->pending_active);
 	}
 
+	launcher_logind_prefetch_done(launcher);
 	launcher_logind_release_control(wl);
 	launcher_logind_destroy_dbus(wl);
 	weston_dbus_close(wl->dbus, wl->dbus_ctx);
@@ -845,4 +967,6 @@ struct launcher_interface launcher_logind_iface = {
 	launcher_logind_activate_vt,
 	launcher_logind_restore,
 	launcher_logind_get_vt,
+	launcher_logind_prefetch,
+	launcher_logind_prefetch_done,
 };
@@ -80,6 +80,27 @@ weston_launcher_close(struct weston_launcher *launcher, int fd)
 	launcher->iface->close(launcher, fd);
 }
 
+/** Announce a device that weston_launcher_open() will be called for
+ *
+ * Launchers that go through a remote service can start opening it right
+ * away, so that opening a number of devices costs one round trip rather
+ * than one per device. Must be followed by weston_launcher_prefetch_done()
+ * once the devices have been opened.
+ */
+WL_EXPORT void
+weston_launcher_prefetch(struct weston_launcher *launcher, const char *path)
+{
+	if (launcher->iface->prefetch)
+		launcher->iface->prefetch(launcher, path);
+}
+
+WL_EXPORT void
+weston_launcher_prefetch_done(struct weston_launcher *launcher)
+{
+	if (launcher->iface->prefetch_done)
+		launcher->iface->prefetch_done(launcher);
+}
+
 WL_EXPORT int
 weston_launcher_activate_vt(struct weston_launcher *launcher, int vt)
 {
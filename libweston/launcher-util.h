@@ -46,6 +46,12 @@ weston_launcher_open(struct weston_launcher *launcher,
 void
 weston_launcher_close(struct weston_launcher *launcher, int fd);
 
+void
+weston_launcher_prefetch(struct weston_launcher *launcher, const char *path);
+
+void
+weston_launcher_prefetch_done(struct weston_launcher *launcher);
+
 int
 weston_launcher_activate_vt(struct weston_launcher *launcher, int vt);
 
@@ -39,8 +39,17 @@
 
 #include "compositor.h"
 #include "libinput-device.h"
+#include "libinput-seat.h"
 #include "shared/helpers.h"
 
+/* libinput is also used by the input thread, if there is one */
+static struct udev_input *
+evdev_device_get_input(struct evdev_device *device)
+{
+	return libinput_get_user_data(
+		libinput_device_get_context(device->device));
+}
+
 void
 evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 {
@@ -53,7 +62,9 @@ evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 	if (weston_leds & LED_SCROLL_LOCK)
 		leds |= LIBINPUT_LED_SCROLL_LOCK;
 
+	udev_input_lock(evdev_device_get_input(device));
 	libinput_device_led_update(device->device, leds);
+	udev_input_unlock(evdev_device_get_input(device));
 }
 
 static void
@@ -74,6 +85,8 @@ handle_keyboard_key(struct libinput_device *libinput_device,
 	     seat_key_count != 0))
 		return;
 
+	device->seat->event_time_usec =
+		libinput_event_keyboard_get_time_usec(keyboard_event);
 	notify_key(device->seat,
 		   libinput_event_keyboard_get_time(keyboard_event),
 		   libinput_event_keyboard_get_key(keyboard_event),
@@ -111,6 +124,63 @@ handle_pointer_motion(struct libinput_device *libinput_device,
 	return true;
 }
 
+/** Add a relative motion event to what its device has queued
+ *
+ * \param event A LIBINPUT_EVENT_POINTER_MOTION event.
+ * \param pending_list Where the device is added with its first queued
+ * event; evdev_device_flush_motion() must be called for each device on
+ * it before any other event is processed.
+ *
+ * Accelerated and unaccelerated deltas are summed separately, so
+ * relative pointer clients still receive the full raw motion, and the
+ * merged event carries the time of the latest one.
+ */
+void
+evdev_device_queue_motion(struct libinput_event *event,
+			  struct wl_list *pending_list)
+{
+	struct libinput_device *libinput_device =
+		libinput_event_get_device(event);
+	struct evdev_device *device =
+		libinput_device_get_user_data(libinput_device);
+	struct libinput_event_pointer *pointer_event =
+		libinput_event_get_pointer_event(event);
+	struct weston_pointer_motion_event *motion = &device->motion.event;
+
+	if (!device->motion.pending) {
+		*motion = (struct weston_pointer_motion_event) {
+			.mask = WESTON_POINTER_MOTION_REL |
+				WESTON_POINTER_MOTION_REL_UNACCEL,
+		};
+		device->motion.pending = true;
+		wl_list_insert(pending_list->prev, &device->motion.link);
+	}
+
+	device->motion.time = libinput_event_pointer_get_time(pointer_event);
+	motion->time_usec = libinput_event_pointer_get_time_usec(pointer_event);
+	motion->dx += libinput_event_pointer_get_dx(pointer_event);
+	motion->dy += libinput_event_pointer_get_dy(pointer_event);
+	motion->dx_unaccel +=
+		libinput_event_pointer_get_dx_unaccelerated(pointer_event);
+	motion->dy_unaccel +=
+		libinput_event_pointer_get_dy_unaccelerated(pointer_event);
+}
+
+void
+evdev_device_flush_motion(struct evdev_device *device)
+{
+	if (!device->motion.pending)
+		return;
+
+	device->motion.pending = false;
+	wl_list_remove(&device->motion.link);
+	wl_list_init(&device->motion.link);
+
+	notify_motion(device->seat, device->motion.time,
+		      &device->motion.event);
+	notify_pointer_frame(device->seat);
+}
+
 static bool
 handle_pointer_motion_absolute(
 	struct libinput_device *libinput_device,
@@ -159,6 +229,8 @@ handle_pointer_button(struct libinput_device *libinput_device,
 	     seat_button_count != 0))
 		return false;
 
+	device->seat->event_time_usec =
+		libinput_event_pointer_get_time_usec(pointer_event);
 	notify_button(device->seat,
 		      libinput_event_pointer_get_time(pointer_event),
 		      libinput_event_pointer_get_button(pointer_event),
@@ -459,16 +531,18 @@ evdev_device_set_calibration(struct evdev_device *device)
 	if (width == 0 || height == 0)
 		return;
 
+	udev_input_lock(evdev_device_get_input(device));
+
 	/* If libinput has a pre-set calibration matrix, don't override it */
 	if (!libinput_device_config_calibration_has_matrix(device->device) ||
 	    libinput_device_config_calibration_get_default_matrix(
 							  device->device,
 							  calibration) != 0)
-		return;
+		goto unlock;
 
 	udev = udev_new();
 	if (!udev)
-		return;
+		goto unlock;
 
 	udev_device = udev_device_new_from_subsystem_sysname(udev,
 							     "input",
@@ -516,6 +590,8 @@ out:
 	if (udev_device)
 		udev_device_unref(udev_device);
 	udev_unref(udev);
+unlock:
+	udev_input_unlock(evdev_device_get_input(device));
 }
 
 void
@@ -546,6 +622,7 @@ evdev_device_create(struct libinput_device *libinput_device,
 
 	device->seat = seat;
 	wl_list_init(&device->link);
+	wl_list_init(&device->motion.link);
 	device->device = libinput_device;
 
 	if (libinput_device_has_capability(libinput_device,
@@ -582,6 +659,7 @@ evdev_device_destroy(struct evdev_device *device)
 
 	if (device->output)
 		wl_list_remove(&device->output_destroy_listener.link);
+	wl_list_remove(&device->motion.link);
 	wl_list_remove(&device->link);
 	libinput_device_unref(device->device);
 	free(device->devnode);
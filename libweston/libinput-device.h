@@ -50,6 +50,14 @@ struct evdev_device {
 	char *devnode;
 	char *output_name;
 	int fd;
+
+	/* Relative motion not yet passed on, see evdev_device_queue_motion() */
+	struct {
+		bool pending;
+		uint32_t time;
+		struct weston_pointer_motion_event event;
+		struct wl_list link;
+	} motion;
 };
 
 void
@@ -62,6 +70,13 @@ evdev_device_create(struct libinput_device *libinput_device,
 int
 evdev_device_process_event(struct libinput_event *event);
 
+void
+evdev_device_queue_motion(struct libinput_event *event,
+			  struct wl_list *pending_list);
+
+void
+evdev_device_flush_motion(struct evdev_device *device);
+
 void
 evdev_device_set_output(struct evdev_device *device,
 			struct weston_output *output);
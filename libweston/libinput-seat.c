@@ -31,6 +31,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <libinput.h>
 #include <libudev.h>
 
@@ -42,6 +46,8 @@
 
 static void
 process_events(struct udev_input *input);
+static void
+udev_input_stop_thread(struct udev_input *input);
 static struct udev_seat *
 udev_seat_create(struct udev_input *input, const char *seat_name);
 static void
@@ -134,6 +140,7 @@ udev_input_disable(struct udev_input *input)
 	if (input->suspended)
 		return;
 
+	udev_input_stop_thread(input);
 	libinput_suspend(input->libinput);
 	process_events(input);
 	input->suspended = 1;
@@ -163,23 +170,90 @@ udev_input_process_event(struct libinput_event *event)
 }
 
 static void
-process_event(struct libinput_event *event)
+flush_motion(struct udev_input *input)
+{
+	struct evdev_device *device, *next;
+
+	wl_list_for_each_safe(device, next, &input->pending_motion_list,
+			      motion.link)
+		evdev_device_flush_motion(device);
+}
+
+static void
+process_event(struct udev_input *input, struct libinput_event *event)
 {
+	/* Relative motion is held back until something else happens or
+	 * the batch ends, so events keep their order across devices. */
+	if (input->compositor->coalesce_motion &&
+	    libinput_event_get_type(event) == LIBINPUT_EVENT_POINTER_MOTION) {
+		evdev_device_queue_motion(event, &input->pending_motion_list);
+		return;
+	}
+
+	flush_motion(input);
+
 	if (udev_input_process_event(event))
 		return;
 	if (evdev_device_process_event(event))
 		return;
 }
 
+/** Take an event the input thread queued, oldest first */
+static struct libinput_event *
+ring_pop(struct udev_input *input)
+{
+	uint32_t head = input->thread.head;
+	struct libinput_event *event;
+
+	if (head == __atomic_load_n(&input->thread.tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	event = input->thread.ring[head % UDEV_INPUT_RING_SIZE];
+	__atomic_store_n(&input->thread.head, head + 1, __ATOMIC_RELEASE);
+
+	return event;
+}
+
+static bool
+ring_full(struct udev_input *input)
+{
+	return input->thread.tail -
+		__atomic_load_n(&input->thread.head, __ATOMIC_ACQUIRE) ==
+		UDEV_INPUT_RING_SIZE;
+}
+
+/* Only called by the input thread, after checking ring_full() */
+static void
+ring_push(struct udev_input *input, struct libinput_event *event)
+{
+	uint32_t tail = input->thread.tail;
+
+	input->thread.ring[tail % UDEV_INPUT_RING_SIZE] = event;
+	__atomic_store_n(&input->thread.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
 static void
 process_events(struct udev_input *input)
 {
 	struct libinput_event *event;
 
+	udev_input_lock(input);
+
+	/* Events the input thread took out of libinput come before any
+	 * it left queued there when the ring was full. */
+	while ((event = ring_pop(input))) {
+		process_event(input, event);
+		libinput_event_destroy(event);
+	}
+
 	while ((event = libinput_get_event(input->libinput))) {
-		process_event(event);
+		process_event(input, event);
 		libinput_event_destroy(event);
 	}
+
+	flush_motion(input);
+
+	udev_input_unlock(input);
 }
 
 static int
@@ -201,6 +275,165 @@ libinput_source_dispatch(int fd, uint32_t mask, void *data)
 	return udev_input_dispatch(input) != 0;
 }
 
+static void *
+input_thread_function(void *data)
+{
+	struct udev_input *input = data;
+	struct libinput_event *event;
+	struct pollfd fds[2];
+	uint64_t wake = 1;
+	bool queued;
+
+	fds[0].fd = libinput_get_fd(input->libinput);
+	fds[0].events = POLLIN;
+	fds[1].fd = input->thread.stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, ARRAY_LENGTH(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			weston_log("libinput: input thread poll failed: %m\n");
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		/* Reading the devices as they become readable keeps the
+		 * kernel buffers from overflowing and libinput's timers
+		 * accurate while the compositor is busy. */
+		queued = false;
+		udev_input_lock(input);
+		if (libinput_dispatch(input->libinput) != 0)
+			weston_log("libinput: Failed to dispatch libinput\n");
+		/* What does not fit is left in libinput for
+		 * process_events(), which drains the ring first. */
+		while (!ring_full(input) &&
+		       (event = libinput_get_event(input->libinput))) {
+			ring_push(input, event);
+			queued = true;
+		}
+		udev_input_unlock(input);
+
+		if (queued && write(input->thread.wake_fd,
+				    &wake, sizeof wake) < 0)
+			weston_log("libinput: input thread wake failed: %m\n");
+	}
+
+	return NULL;
+}
+
+static int
+input_thread_wake(int fd, uint32_t mask, void *data)
+{
+	struct udev_input *input = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		return 0;
+
+	process_events(input);
+
+	return 0;
+}
+
+static int
+udev_input_start_thread(struct udev_input *input)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(input->compositor->wl_display);
+	sigset_t mask, old_mask;
+	int ret;
+
+	input->thread.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	input->thread.stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (input->thread.wake_fd < 0 || input->thread.stop_fd < 0)
+		goto err_fds;
+
+	input->thread.wake_source =
+		wl_event_loop_add_fd(loop, input->thread.wake_fd,
+				     WL_EVENT_READABLE, input_thread_wake,
+				     input);
+	if (!input->thread.wake_source)
+		goto err_fds;
+
+	/* Signals are handled through the compositor's event loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&input->thread.thread, NULL,
+			     input_thread_function, input);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0)
+		goto err_source;
+
+	input->thread.running = true;
+
+	return 0;
+
+err_source:
+	wl_event_source_remove(input->thread.wake_source);
+	input->thread.wake_source = NULL;
+err_fds:
+	if (input->thread.wake_fd >= 0)
+		close(input->thread.wake_fd);
+	if (input->thread.stop_fd >= 0)
+		close(input->thread.stop_fd);
+	weston_log("libinput: failed to start input thread\n");
+
+	return -1;
+}
+
+/* Events the thread had queued stay in the ring for process_events() */
+static void
+udev_input_stop_thread(struct udev_input *input)
+{
+	uint64_t stop = 1;
+
+	if (!input->thread.running)
+		return;
+
+	if (write(input->thread.stop_fd, &stop, sizeof stop) < 0)
+		weston_log("libinput: input thread stop failed: %m\n");
+	pthread_join(input->thread.thread, NULL);
+	input->thread.running = false;
+
+	wl_event_source_remove(input->thread.wake_source);
+	input->thread.wake_source = NULL;
+	close(input->thread.wake_fd);
+	close(input->thread.stop_fd);
+}
+
+/** Process what the input thread has read so far
+ *
+ * Called right before the compositor repaints, so that the pointer
+ * position and client input are as recent as possible even if the
+ * thread's wakeup has not been dispatched yet.
+ */
+void
+udev_input_flush(struct udev_input *input)
+{
+	if (input->thread.running && !input->suspended)
+		process_events(input);
+}
+
+/** Serialize use of libinput with the input thread
+ *
+ * The lock is recursive, so code run from event processing may take it
+ * again.
+ */
+void
+udev_input_lock(struct udev_input *input)
+{
+	pthread_mutex_lock(&input->libinput_mutex);
+}
+
+void
+udev_input_unlock(struct udev_input *input)
+{
+	pthread_mutex_unlock(&input->libinput_mutex);
+}
+
 static int
 open_restricted(const char *path, int flags, void *user_data)
 {
@@ -224,34 +457,83 @@ const struct libinput_interface libinput_interface = {
 	close_restricted,
 };
 
+/* libinput opens the devices of the seat one after the other, and with
+ * logind each open is a round trip. Have the launcher start opening all
+ * of them up front, so that they are mostly open by the time libinput
+ * asks. */
+static void
+udev_input_prefetch_devices(struct udev_input *input)
+{
+	struct weston_launcher *launcher = input->compositor->launcher;
+	struct udev_enumerate *e;
+	struct udev_list_entry *entry;
+	struct udev_device *device;
+	const char *seat, *devnode;
+
+	if (!launcher)
+		return;
+
+	e = udev_enumerate_new(input->udev);
+	if (!e)
+		return;
+
+	udev_enumerate_add_match_subsystem(e, "input");
+	udev_enumerate_add_match_sysname(e, "event[0-9]*");
+	udev_enumerate_scan_devices(e);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+		device = udev_device_new_from_syspath(input->udev,
+					udev_list_entry_get_name(entry));
+		if (!device)
+			continue;
+
+		seat = udev_device_get_property_value(device, "ID_SEAT");
+		devnode = udev_device_get_devnode(device);
+		if (devnode && strcmp(seat ? seat : "seat0",
+				      input->seat_id) == 0)
+			weston_launcher_prefetch(launcher, devnode);
+
+		udev_device_unref(device);
+	}
+	udev_enumerate_unref(e);
+}
+
+static void
+udev_input_prefetch_done(struct udev_input *input)
+{
+	if (input->compositor->launcher)
+		weston_launcher_prefetch_done(input->compositor->launcher);
+}
+
 int
 udev_input_enable(struct udev_input *input)
 {
 	struct wl_event_loop *loop;
 	struct weston_compositor *c = input->compositor;
-	int fd;
+	int fd, r;
 	struct udev_seat *seat;
 	int devices_found = 0;
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = libinput_get_fd(input->libinput);
-	input->libinput_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     libinput_source_dispatch, input);
-	if (!input->libinput_source) {
-		return -1;
-	}
-
 	if (input->suspended) {
-		if (libinput_resume(input->libinput) != 0) {
-			wl_event_source_remove(input->libinput_source);
-			input->libinput_source = NULL;
+		udev_input_prefetch_devices(input);
+		r = libinput_resume(input->libinput);
+		udev_input_prefetch_done(input);
+		if (r != 0)
 			return -1;
-		}
 		input->suspended = 0;
 		process_events(input);
 	}
 
+	if (!c->input_thread || udev_input_start_thread(input) < 0) {
+		loop = wl_display_get_event_loop(c->wl_display);
+		fd = libinput_get_fd(input->libinput);
+		input->libinput_source =
+			wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+					     libinput_source_dispatch, input);
+		if (!input->libinput_source) {
+			return -1;
+		}
+	}
+
 	wl_list_for_each(seat, &input->compositor->seat_list, base.link) {
 		evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
 
@@ -273,6 +555,7 @@ udev_input_enable(struct udev_input *input)
 			"\t- seats misconfigured "
 			"(Weston backend option 'seat', "
 			"udev device property ID_SEAT)\n");
+		udev_input_stop_thread(input);
 		return -1;
 	}
 
@@ -294,19 +577,27 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 {
 	enum libinput_log_priority priority = LIBINPUT_LOG_PRIORITY_INFO;
 	const char *log_priority = NULL;
+	pthread_mutexattr_t attr;
+	int r;
 
 	memset(input, 0, sizeof *input);
 
 	input->compositor = c;
 	input->configure_device = configure_device;
+	input->udev = udev_ref(udev);
+	input->seat_id = strdup(seat_id);
+	wl_list_init(&input->pending_motion_list);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&input->libinput_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
 
 	log_priority = getenv("WESTON_LIBINPUT_LOG_PRIORITY");
 
 	input->libinput = libinput_udev_create_context(&libinput_interface,
 						       input, udev);
-	if (!input->libinput) {
-		return -1;
-	}
+	if (!input->libinput || !input->seat_id)
+		goto err_libinput;
 
 	libinput_log_set_handler(input->libinput, &libinput_log_func);
 
@@ -322,25 +613,43 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 
 	libinput_log_set_priority(input->libinput, priority);
 
-	if (libinput_udev_assign_seat(input->libinput, seat_id) != 0) {
-		libinput_unref(input->libinput);
-		return -1;
-	}
+	udev_input_prefetch_devices(input);
+	r = libinput_udev_assign_seat(input->libinput, seat_id);
+	udev_input_prefetch_done(input);
+	if (r != 0)
+		goto err_libinput;
 
 	process_events(input);
 
 	return udev_input_enable(input);
+
+err_libinput:
+	if (input->libinput)
+		libinput_unref(input->libinput);
+	pthread_mutex_destroy(&input->libinput_mutex);
+	free(input->seat_id);
+	udev_unref(input->udev);
+	return -1;
 }
 
 void
 udev_input_destroy(struct udev_input *input)
 {
 	struct udev_seat *seat, *next;
+	struct libinput_event *event;
+
+	udev_input_stop_thread(input);
+	while ((event = ring_pop(input)))
+		libinput_event_destroy(event);
 
-	wl_event_source_remove(input->libinput_source);
+	if (input->libinput_source)
+		wl_event_source_remove(input->libinput_source);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
 	libinput_unref(input->libinput);
+	pthread_mutex_destroy(&input->libinput_mutex);
+	free(input->seat_id);
+	udev_unref(input->udev);
 }
 
 static void
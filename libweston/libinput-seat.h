@@ -29,6 +29,8 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <pthread.h>
 #include <libudev.h>
 
 #include "compositor.h"
@@ -44,12 +46,36 @@ struct udev_seat {
 typedef void (*udev_configure_device_t)(struct weston_compositor *compositor,
 					struct libinput_device *device);
 
+#define UDEV_INPUT_RING_SIZE 256
+
 struct udev_input {
 	struct libinput *libinput;
+	struct udev *udev;
+	char *seat_id;
 	struct wl_event_source *libinput_source;
 	struct weston_compositor *compositor;
 	int suspended;
 	udev_configure_device_t configure_device;
+	/* evdev_device.motion.link of devices with queued motion */
+	struct wl_list pending_motion_list;
+
+	/* libinput is not thread safe; see udev_input_lock() */
+	pthread_mutex_t libinput_mutex;
+
+	/* Reads libinput instead of libinput_source if the compositor
+	 * asks for an input thread. */
+	struct {
+		bool running;
+		pthread_t thread;
+		int wake_fd;
+		int stop_fd;
+		struct wl_event_source *wake_source;
+
+		/* Single producer, single consumer: only the thread
+		 * advances tail and only the compositor head. */
+		struct libinput_event *ring[UDEV_INPUT_RING_SIZE];
+		uint32_t head, tail;
+	} thread;
 };
 
 int
@@ -64,6 +90,12 @@ udev_input_init(struct udev_input *input,
 		udev_configure_device_t configure_device);
 void
 udev_input_destroy(struct udev_input *input);
+void
+udev_input_flush(struct udev_input *input);
+void
+udev_input_lock(struct udev_input *input);
+void
+udev_input_unlock(struct udev_input *input);
 
 struct udev_seat *
 udev_seat_get_named(struct udev_input *u,
@@ -136,19 +136,25 @@ destroy_linux_dmabuf_wl_buffer(struct wl_resource *resource)
 	assert(buffer->buffer_resource == resource);
 	assert(!buffer->params_resource);
 
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
+
 	if (buffer->user_data_destroy_func)
 		buffer->user_data_destroy_func(buffer);
 
 	linux_dmabuf_buffer_destroy(buffer);
 }
 
+/* A buffer_id of 0 means the wl_buffer is created for the created event,
+ * otherwise it gets that id, as requested by create_immed. */
 static void
-params_create(struct wl_client *client,
-	      struct wl_resource *params_resource,
-	      int32_t width,
-	      int32_t height,
-	      uint32_t format,
-	      uint32_t flags)
+params_create_common(struct wl_client *client,
+		     struct wl_resource *params_resource,
+		     uint32_t buffer_id,
+		     int32_t width,
+		     int32_t height,
+		     uint32_t format,
+		     uint32_t flags)
 {
 	struct linux_dmabuf_buffer *buffer;
 	int i;
@@ -263,7 +269,7 @@ params_create(struct wl_client *client,
 
 	buffer->buffer_resource = wl_resource_create(client,
 						     &wl_buffer_interface,
-						     1, 0);
+						     1, buffer_id);
 	if (!buffer->buffer_resource) {
 		wl_resource_post_no_memory(params_resource);
 		goto err_buffer;
@@ -273,27 +279,70 @@ params_create(struct wl_client *client,
 				       &linux_dmabuf_buffer_implementation,
 				       buffer, destroy_linux_dmabuf_wl_buffer);
 
-	zwp_linux_buffer_params_v1_send_created(params_resource,
-						buffer->buffer_resource);
+	/* send 'created' event when the request is not for an immediate
+	 * import, ie buffer_id is zero */
+	if (buffer_id == 0)
+		zwp_linux_buffer_params_v1_send_created(params_resource,
+							buffer->buffer_resource);
 
 	return;
 
 err_buffer:
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
+
 	if (buffer->user_data_destroy_func)
 		buffer->user_data_destroy_func(buffer);
 
 err_failed:
-	zwp_linux_buffer_params_v1_send_failed(params_resource);
+	if (buffer_id == 0)
+		zwp_linux_buffer_params_v1_send_failed(params_resource);
+	else
+		/* since the behavior is left implementation defined by the
+		 * protocol in case of create_immed failure due to an unknown
+		 * cause, we choose to treat it as a fatal error and immediately
+		 * kill the client instead of creating an invalid handle and
+		 * waiting for it to be used.
+		 */
+		wl_resource_post_error(params_resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER,
+			"importing the supplied dmabufs failed");
 
 err_out:
 	linux_dmabuf_buffer_destroy(buffer);
 }
 
+static void
+params_create(struct wl_client *client,
+	      struct wl_resource *params_resource,
+	      int32_t width,
+	      int32_t height,
+	      uint32_t format,
+	      uint32_t flags)
+{
+	params_create_common(client, params_resource, 0, width, height, format,
+			     flags);
+}
+
+static void
+params_create_immed(struct wl_client *client,
+		    struct wl_resource *params_resource,
+		    uint32_t buffer_id,
+		    int32_t width,
+		    int32_t height,
+		    uint32_t format,
+		    uint32_t flags)
+{
+	params_create_common(client, params_resource, buffer_id, width, height,
+			     format, flags);
+}
+
 static const struct zwp_linux_buffer_params_v1_interface
 zwp_linux_buffer_params_implementation = {
 	params_destroy,
 	params_add,
-	params_create
+	params_create,
+	params_create_immed
 };
 
 static void
@@ -415,11 +464,131 @@ linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer)
 	return buffer->user_data;
 }
 
+/** Set backend-private data
+ *
+ * Set the backend user data for the linux_dmabuf_buffer. This is a separate
+ * slot from the renderer-private user data, so that a backend can attach
+ * its own imports (e.g. a KMS framebuffer) to the same buffer. As with
+ * the renderer slot, it is invalid to overwrite a non-NULL pointer with a
+ * new non-NULL pointer.
+ *
+ * The destructor is called before the renderer-private destructor when
+ * the linux_dmabuf_buffer gets destroyed.
+ *
+ * \param buffer The linux_dmabuf_buffer object to set for.
+ * \param data The new backend-private data pointer.
+ * \param func Destructor function to be called for the backend-private
+ *             data when the linux_dmabuf_buffer gets destroyed.
+ *
+ * \sa linux_dmabuf_buffer_set_user_data
+ */
+WL_EXPORT void
+linux_dmabuf_buffer_set_backend_user_data(struct linux_dmabuf_buffer *buffer,
+					  void *data,
+					  dmabuf_user_data_destroy_func func)
+{
+	assert(data == NULL || buffer->backend_user_data == NULL);
+
+	buffer->backend_user_data = data;
+	buffer->backend_user_data_destroy_func = func;
+}
+
+/** Get backend-private data
+ *
+ * \param buffer The linux_dmabuf_buffer to query.
+ * \return Backend-private data pointer.
+ *
+ * \sa linux_dmabuf_buffer_set_backend_user_data
+ */
+WL_EXPORT void *
+linux_dmabuf_buffer_get_backend_user_data(struct linux_dmabuf_buffer *buffer)
+{
+	return buffer->backend_user_data;
+}
+
 static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_implementation = {
 	linux_dmabuf_destroy,
 	linux_dmabuf_create_params
 };
 
+static bool
+linux_dmabuf_scanout_supported(struct weston_compositor *compositor,
+			       uint32_t format, uint64_t modifier)
+{
+	struct weston_backend *backend = compositor->backend;
+
+	if (!backend || !backend->dmabuf_scanout_supported)
+		return false;
+
+	return backend->dmabuf_scanout_supported(compositor, format, modifier);
+}
+
+/** Advertise the format and modifier pairs the renderer can import
+ *
+ * \param resource The zwp_linux_dmabuf_v1 resource to send the events to.
+ * \param compositor The compositor whose renderer imports the buffers.
+ * \param scanout Send only the pairs which the backend can scan out if
+ * true, only the others if false.
+ *
+ * Version 3 clients get a modifier event for every pair, with
+ * DRM_FORMAT_MOD_INVALID standing for the implicit layout when the
+ * renderer takes no explicit modifiers; older ones get a format event for
+ * every format usable without a modifier.
+ */
+static void
+linux_dmabuf_send_formats(struct wl_resource *resource,
+			  struct weston_compositor *compositor,
+			  bool scanout)
+{
+	struct weston_renderer *renderer = compositor->renderer;
+	uint64_t modifier_invalid = DRM_FORMAT_MOD_INVALID;
+	uint64_t *modifiers;
+	int *formats;
+	int num_formats, num_modifiers;
+	bool implicit;
+	int i, j;
+
+	if (!renderer->query_dmabuf_formats)
+		return;
+
+	renderer->query_dmabuf_formats(compositor, &formats, &num_formats);
+
+	for (i = 0; i < num_formats; i++) {
+		renderer->query_dmabuf_modifiers(compositor, formats[i],
+						 &modifiers, &num_modifiers);
+
+		implicit = num_modifiers == 0;
+		if (implicit) {
+			num_modifiers = 1;
+			modifiers = &modifier_invalid;
+		}
+
+		for (j = 0; j < num_modifiers; j++) {
+			if (linux_dmabuf_scanout_supported(compositor,
+							   formats[i],
+							   modifiers[j]) !=
+			    scanout)
+				continue;
+
+			if (wl_resource_get_version(resource) >=
+			    ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION)
+				zwp_linux_dmabuf_v1_send_modifier(resource,
+					formats[i],
+					modifiers[j] >> 32,
+					modifiers[j] & 0xffffffff);
+			else if (implicit ||
+				 modifiers[j] == DRM_FORMAT_MOD_LINEAR)
+				zwp_linux_dmabuf_v1_send_format(resource,
+								formats[i]);
+		}
+
+		if (!implicit)
+			free(modifiers);
+	}
+
+	free(formats);
+}
+
 static void
 bind_linux_dmabuf(struct wl_client *client,
 		  void *data, uint32_t version, uint32_t id)
@@ -437,9 +606,10 @@ bind_linux_dmabuf(struct wl_client *client,
 	wl_resource_set_implementation(resource, &linux_dmabuf_implementation,
 				       compositor, NULL);
 
-	/* EGL_EXT_image_dma_buf_import does not provide a way to query the
-	 * supported pixel formats. */
-	/* XXX: send formats */
+	/* Formats which some output can scan out go first, so that
+	 * clients picking the first usable entry can bypass composition. */
+	linux_dmabuf_send_formats(resource, compositor, true);
+	linux_dmabuf_send_formats(resource, compositor, false);
 }
 
 /** Advertise linux_dmabuf support
@@ -457,7 +627,7 @@ WL_EXPORT int
 linux_dmabuf_setup(struct weston_compositor *compositor)
 {
 	if (!wl_global_create(compositor->wl_display,
-			      &zwp_linux_dmabuf_v1_interface, 1,
+			      &zwp_linux_dmabuf_v1_interface, 3,
 			      compositor, bind_linux_dmabuf))
 		return -1;
 
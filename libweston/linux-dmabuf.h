@@ -30,6 +30,14 @@
 
 #define MAX_DMABUF_PLANES 4
 
+/* Same as in drm_fourcc.h, which libweston itself does not depend on */
+#ifndef DRM_FORMAT_MOD_INVALID
+#define DRM_FORMAT_MOD_INVALID ((1ULL << 56) - 1)
+#endif
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0
+#endif
+
 struct linux_dmabuf_buffer;
 typedef void (*dmabuf_user_data_destroy_func)(
 			struct linux_dmabuf_buffer *buffer);
@@ -55,20 +63,12 @@ struct linux_dmabuf_buffer {
 	void *user_data;
 	dmabuf_user_data_destroy_func user_data_destroy_func;
 
-	/* XXX:
-	 *
-	 * Add backend private data. This would be for the backend
-	 * to do all additional imports it might ever use in advance.
-	 * The basic principle, even if not implemented in drivers today,
-	 * is that dmabufs are first attached, but the actual allocation
-	 * is deferred to first use. This would allow the exporter and all
-	 * attachers to agree on how to allocate.
-	 *
-	 * The DRM backend would use this to create drmFBs for each
-	 * dmabuf_buffer, just in case at some point it would become
-	 * feasible to scan it out directly. This would improve the
-	 * possibilities to successfully scan out, avoiding compositing.
+	/* Backend-private data, e.g. the DRM backend caches the KMS
+	 * framebuffer imported for this dmabuf here, so that subsequent
+	 * scanout attempts of the same buffer do not have to re-import it.
 	 */
+	void *backend_user_data;
+	dmabuf_user_data_destroy_func backend_user_data_destroy_func;
 };
 
 int
@@ -84,6 +84,13 @@ linux_dmabuf_buffer_set_user_data(struct linux_dmabuf_buffer *buffer,
 void *
 linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer);
 
+void
+linux_dmabuf_buffer_set_backend_user_data(struct linux_dmabuf_buffer *buffer,
+					  void *data,
+					  dmabuf_user_data_destroy_func func);
+void *
+linux_dmabuf_buffer_get_backend_user_data(struct linux_dmabuf_buffer *buffer);
+
 void
 linux_dmabuf_buffer_send_server_error(struct linux_dmabuf_buffer *buffer,
 				      const char *msg);
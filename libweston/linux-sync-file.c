@@ -0,0 +1,83 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "linux-sync-file.h"
+#include "linux-sync-file-uapi.h"
+
+static int
+sync_ioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+
+	return ret;
+}
+
+/** Check whether a file descriptor is a sync_file
+ *
+ * \param fd The file descriptor to check.
+ * \return true if the kernel knows fd as a sync_file.
+ */
+bool
+linux_sync_file_is_valid(int fd)
+{
+	struct sync_file_info info;
+
+	memset(&info, 0, sizeof info);
+
+	return sync_ioctl(fd, SYNC_IOC_FILE_INFO, &info) == 0 &&
+	       info.num_fences > 0;
+}
+
+/** Merge two sync_files into a new one
+ *
+ * The new fence signals once both fd1 and fd2 have signalled. Neither
+ * input is closed.
+ *
+ * \return The new sync_file, or -1 on failure.
+ */
+int
+linux_sync_file_merge(int fd1, int fd2)
+{
+	struct sync_merge_data data;
+
+	memset(&data, 0, sizeof data);
+	strcpy(data.name, "weston release");
+	data.fd2 = fd2;
+
+	if (sync_ioctl(fd1, SYNC_IOC_MERGE, &data) < 0)
+		return -1;
+
+	return data.fence;
+}
@@ -25,20 +25,59 @@
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
 
 #include <wayland-util.h>
 
 #include "compositor.h"
+#include "shared/os-compatibility.h"
+#include "shared/zalloc.h"
 
 static log_func_t log_handler = 0;
 static log_func_t log_continue_handler = 0;
 
+/** A named source of log messages, such as "xwm" or "drm"
+ *
+ * Messages logged through a scope are only formatted when the scope is
+ * enabled for their level, so debug messages cost a comparison while
+ * the scope is at its default level.
+ *
+ * Subscribers, such as streams of the weston_debug_v1 protocol, get
+ * every message of the scope whatever its level.
+ */
+struct weston_log_scope {
+	char *name;
+	enum weston_log_level level;
+	struct wl_list link;
+	struct wl_list subscriber_list; /* weston_log_subscriber::link */
+	struct wl_signal subscription_signal;
+};
+
+static struct wl_list log_scope_list = {
+	&log_scope_list, &log_scope_list
+};
+static enum weston_log_level log_default_level = WESTON_LOG_LEVEL_INFO;
+/* Scopes are written from the input and render threads too, while
+ * subscribers come and go on the main thread */
+static pthread_mutex_t log_subscriber_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool log_debug_all;
+
+static const char * const log_level_names[] = {
+	[WESTON_LOG_LEVEL_ERROR] = "error",
+	[WESTON_LOG_LEVEL_WARNING] = "warning",
+	[WESTON_LOG_LEVEL_INFO] = "info",
+	[WESTON_LOG_LEVEL_DEBUG] = "debug",
+};
+
 /** Install the log handler
  *
  * The given functions will be called to output text as passed to the
@@ -96,3 +135,346 @@ weston_log_continue(const char *fmt, ...)
 
 	return l;
 }
+
+/** Find a log scope by name, creating it if needed
+ *
+ * \param name The name of the scope, as used in the log-scopes setting.
+ * \return The scope, which lives until weston_log_scopes_destroy(), or
+ * NULL if out of memory.
+ *
+ * A new scope starts at the level given to it by
+ * weston_log_scopes_configure(), or at WESTON_LOG_LEVEL_INFO.
+ */
+WL_EXPORT struct weston_log_scope *
+weston_log_scope_get(const char *name)
+{
+	struct weston_log_scope *scope;
+
+	wl_list_for_each(scope, &log_scope_list, link)
+		if (strcmp(scope->name, name) == 0)
+			return scope;
+
+	scope = zalloc(sizeof *scope);
+	if (!scope)
+		return NULL;
+
+	scope->name = strdup(name);
+	if (!scope->name) {
+		free(scope);
+		return NULL;
+	}
+
+	scope->level = log_default_level;
+	wl_list_init(&scope->subscriber_list);
+	wl_signal_init(&scope->subscription_signal);
+	wl_list_insert(log_scope_list.prev, &scope->link);
+
+	return scope;
+}
+
+WL_EXPORT const char *
+weston_log_scope_get_name(struct weston_log_scope *scope)
+{
+	return scope->name;
+}
+
+/** Iterate over all log scopes
+ *
+ * \param scope The previous scope, or NULL to start.
+ * \return The next scope, or NULL after the last one.
+ */
+WL_EXPORT struct weston_log_scope *
+weston_log_scope_iterate(struct weston_log_scope *scope)
+{
+	struct wl_list *link = scope ? scope->link.next : log_scope_list.next;
+
+	if (link == &log_scope_list)
+		return NULL;
+
+	return container_of(link, struct weston_log_scope, link);
+}
+
+static bool
+log_scope_logs_level(struct weston_log_scope *scope,
+		     enum weston_log_level level)
+{
+	if (log_debug_all)
+		return true;
+
+	if (!scope)
+		return level <= log_default_level;
+
+	return level <= scope->level;
+}
+
+WL_EXPORT bool
+weston_log_scope_has_subscribers(struct weston_log_scope *scope)
+{
+	return scope && !wl_list_empty(&scope->subscriber_list);
+}
+
+/** Whether a message would go anywhere
+ *
+ * Callers with expensive messages to put together check this first.
+ */
+WL_EXPORT bool
+weston_log_scope_is_enabled(struct weston_log_scope *scope,
+			    enum weston_log_level level)
+{
+	return log_scope_logs_level(scope, level) ||
+	       weston_log_scope_has_subscribers(scope);
+}
+
+/** Start passing all messages of a scope to a subscriber
+ *
+ * The subscriber's write function is called with each message until
+ * weston_log_scope_remove_subscriber(), from whichever thread logged
+ * the message and with the subscribers locked: it must not add or
+ * remove subscribers itself.
+ */
+WL_EXPORT void
+weston_log_scope_add_subscriber(struct weston_log_scope *scope,
+				struct weston_log_subscriber *sub)
+{
+	pthread_mutex_lock(&log_subscriber_mutex);
+	wl_list_insert(scope->subscriber_list.prev, &sub->link);
+	pthread_mutex_unlock(&log_subscriber_mutex);
+
+	wl_signal_emit(&scope->subscription_signal, scope);
+}
+
+/** Stop passing messages to a subscriber
+ *
+ * Once this returns, the subscriber's write function is not running and
+ * won't be called again.
+ */
+WL_EXPORT void
+weston_log_scope_remove_subscriber(struct weston_log_scope *scope,
+				   struct weston_log_subscriber *sub)
+{
+	pthread_mutex_lock(&log_subscriber_mutex);
+	wl_list_remove(&sub->link);
+	wl_list_init(&sub->link);
+	pthread_mutex_unlock(&log_subscriber_mutex);
+
+	wl_signal_emit(&scope->subscription_signal, scope);
+}
+
+/** Get notified when a scope gains or loses subscribers
+ *
+ * The listener is called with the scope, after the change.
+ */
+WL_EXPORT void
+weston_log_scope_add_subscription_listener(struct weston_log_scope *scope,
+					   struct wl_listener *listener)
+{
+	wl_signal_add(&scope->subscription_signal, listener);
+}
+
+/** Pass raw data to the subscribers of a scope, not to the log */
+WL_EXPORT void
+weston_log_scope_write(struct weston_log_scope *scope,
+		       const char *data, size_t len)
+{
+	struct weston_log_subscriber *sub;
+
+	if (!scope)
+		return;
+
+	pthread_mutex_lock(&log_subscriber_mutex);
+	wl_list_for_each(sub, &scope->subscriber_list, link)
+		sub->write(sub, data, len);
+	pthread_mutex_unlock(&log_subscriber_mutex);
+}
+
+static void
+log_scope_vwrite(struct weston_log_scope *scope, bool timestamp,
+		 const char *fmt, va_list ap)
+{
+	struct timespec ts;
+	char *msg, *line;
+	int len;
+
+	if (vasprintf(&msg, fmt, ap) < 0)
+		return;
+
+	if (timestamp) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		len = asprintf(&line, "[%" PRId64 ".%06ld] %s",
+			       (int64_t) ts.tv_sec, ts.tv_nsec / 1000, msg);
+		free(msg);
+		if (len < 0)
+			return;
+		msg = line;
+	}
+
+	weston_log_scope_write(scope, msg, strlen(msg));
+	free(msg);
+}
+
+static int
+log_level_from_string(const char *str, size_t len,
+		      enum weston_log_level *level)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(log_level_names); i++) {
+		if (strlen(log_level_names[i]) == len &&
+		    strncmp(log_level_names[i], str, len) == 0) {
+			*level = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/** Set the levels of log scopes
+ *
+ * \param spec A comma-separated list of scope:level pairs, for example
+ * "xwm:debug,drm:warning". The scope name "*" sets the level of every
+ * scope, including those created later; the pairs apply in order.
+ * \return 0 on success, -1 if spec could not be parsed. The pairs before
+ * the bad one are applied.
+ *
+ * Levels are error, warning, info and debug. This can be called at any
+ * time; it takes effect for the next message.
+ */
+WL_EXPORT int
+weston_log_scopes_configure(const char *spec)
+{
+	struct weston_log_scope *scope;
+	enum weston_log_level level;
+	const char *p, *colon, *end;
+	char *name;
+
+	for (p = spec; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ',');
+		colon = memchr(p, ':', end - p);
+		if (!colon || colon == p ||
+		    log_level_from_string(colon + 1, end - colon - 1,
+					  &level) < 0)
+			return -1;
+
+		if (colon - p == 1 && *p == '*') {
+			log_default_level = level;
+			wl_list_for_each(scope, &log_scope_list, link)
+				scope->level = level;
+			continue;
+		}
+
+		name = strndup(p, colon - p);
+		if (!name)
+			return -1;
+		scope = weston_log_scope_get(name);
+		free(name);
+		if (!scope)
+			return -1;
+		scope->level = level;
+	}
+
+	return 0;
+}
+
+/** Log everything at debug level, whatever the scopes are set to
+ *
+ * Meant to be toggled at runtime, from a debug binding.
+ */
+WL_EXPORT void
+weston_log_set_debug_all(bool enable)
+{
+	log_debug_all = enable;
+}
+
+WL_EXPORT bool
+weston_log_get_debug_all(void)
+{
+	return log_debug_all;
+}
+
+WL_EXPORT void
+weston_log_scopes_destroy(void)
+{
+	struct weston_log_scope *scope, *next;
+	struct weston_log_subscriber *sub, *sub_next;
+
+	wl_list_for_each_safe(scope, next, &log_scope_list, link) {
+		wl_list_for_each_safe(sub, sub_next,
+				      &scope->subscriber_list, link)
+			wl_list_init(&sub->link);
+		wl_list_remove(&scope->link);
+		free(scope->name);
+		free(scope);
+	}
+}
+
+WL_EXPORT int
+weston_log_scope_vprintf(struct weston_log_scope *scope,
+			 enum weston_log_level level,
+			 const char *fmt, va_list ap)
+{
+	va_list aq;
+	int l;
+
+	if (weston_log_scope_has_subscribers(scope)) {
+		va_copy(aq, ap);
+		log_scope_vwrite(scope, true, fmt, aq);
+		va_end(aq);
+	}
+
+	if (!log_scope_logs_level(scope, level))
+		return 0;
+
+	if (scope)
+		l = weston_log("%s: ", scope->name);
+	else
+		l = weston_log("%s", "");
+	if (level <= WESTON_LOG_LEVEL_WARNING)
+		l += weston_log_continue("%s: ", log_level_names[level]);
+
+	return l + weston_vlog_continue(fmt, ap);
+}
+
+/** Continue the line of the last message logged through a scope */
+WL_EXPORT int
+weston_log_scope_vprintf_continue(struct weston_log_scope *scope,
+				  enum weston_log_level level,
+				  const char *fmt, va_list ap)
+{
+	va_list aq;
+
+	if (weston_log_scope_has_subscribers(scope)) {
+		va_copy(aq, ap);
+		log_scope_vwrite(scope, false, fmt, aq);
+		va_end(aq);
+	}
+
+	if (!log_scope_logs_level(scope, level))
+		return 0;
+
+	return weston_vlog_continue(fmt, ap);
+}
+
+/** Log a message through a scope
+ *
+ * \param scope The scope, or NULL for messages without one.
+ * \param level How important the message is.
+ *
+ * The message is dropped without formatting it unless the scope is
+ * enabled for level. It starts a new line, prefixed with the scope
+ * name and, for errors and warnings, the level.
+ */
+WL_EXPORT int
+weston_log_scope_printf(struct weston_log_scope *scope,
+			enum weston_log_level level,
+			const char *fmt, ...)
+{
+	int l;
+	va_list argp;
+
+	va_start(argp, fmt);
+	l = weston_log_scope_vprintf(scope, level, fmt, argp);
+	va_end(argp);
+
+	return l;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Streams an output to PipeWire as a video source node, for screen
+ * casting and remote support. Frames go into buffers PipeWire shares
+ * with the consumers, so they are copied once, and not at all while
+ * nobody is consuming the stream.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/buffer/meta.h>
+#include <spa/param/video/format-utils.h>
+#include <spa/pod/builder.h>
+
+#include "compositor.h"
+#include "recorder-encoder.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+/* Buffers negotiated with the consumers */
+#define PIPEWIRE_RECORDER_MIN_BUFFERS 2
+#define PIPEWIRE_RECORDER_MAX_BUFFERS 8
+
+struct pipewire_recorder {
+	struct recorder_encoder base;
+
+	/* PipeWire runs its own loop on a thread of its own; everything
+	 * below is only touched with the loop locked. */
+	struct pw_thread_loop *loop;
+	struct pw_context *context;
+	struct pw_core *core;
+	struct pw_stream *stream;
+	struct spa_hook stream_listener;
+
+	int width, height;
+	bool streaming;
+	uint64_t seq;
+};
+
+static void
+pipewire_recorder_state_changed(void *data, enum pw_stream_state old,
+				enum pw_stream_state state, const char *error)
+{
+	struct pipewire_recorder *recorder = data;
+
+	recorder->streaming = state == PW_STREAM_STATE_STREAMING;
+
+	if (state == PW_STREAM_STATE_ERROR)
+		weston_log("[pipewire recorder] stream error: %s\n",
+			   error ? error : "unknown");
+}
+
+/* Once the consumers agreed on the format, ask for buffers of the whole
+ * frame, with a header for the sequence number and time stamp. */
+static void
+pipewire_recorder_param_changed(void *data, uint32_t id,
+				const struct spa_pod *format)
+{
+	struct pipewire_recorder *recorder = data;
+	uint8_t buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof buffer);
+	const struct spa_pod *params[2];
+	int stride = recorder->width * 4;
+
+	if (id != SPA_PARAM_Format || !format)
+		return;
+
+	params[0] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+		SPA_PARAM_BUFFERS_buffers,
+			SPA_POD_CHOICE_RANGE_Int(PIPEWIRE_RECORDER_MIN_BUFFERS,
+						 PIPEWIRE_RECORDER_MIN_BUFFERS,
+						 PIPEWIRE_RECORDER_MAX_BUFFERS),
+		SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+		SPA_PARAM_BUFFERS_size, SPA_POD_Int(stride * recorder->height),
+		SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride),
+		SPA_PARAM_BUFFERS_dataType,
+			SPA_POD_CHOICE_FLAGS_Int((1 << SPA_DATA_MemFd) |
+						 (1 << SPA_DATA_MemPtr)));
+	params[1] = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+		SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+		SPA_PARAM_META_size,
+			SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+	pw_stream_update_params(recorder->stream, params,
+				ARRAY_LENGTH(params));
+}
+
+static const struct pw_stream_events pipewire_recorder_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = pipewire_recorder_state_changed,
+	.param_changed = pipewire_recorder_param_changed,
+};
+
+static void
+pipewire_recorder_destroy(struct recorder_encoder *encoder)
+{
+	struct pipewire_recorder *recorder =
+		container_of(encoder, struct pipewire_recorder, base);
+
+	if (recorder->loop) {
+		pw_thread_loop_lock(recorder->loop);
+		if (recorder->stream)
+			pw_stream_destroy(recorder->stream);
+		if (recorder->core)
+			pw_core_disconnect(recorder->core);
+		pw_thread_loop_unlock(recorder->loop);
+		pw_thread_loop_stop(recorder->loop);
+	}
+
+	if (recorder->context)
+		pw_context_destroy(recorder->context);
+	if (recorder->loop)
+		pw_thread_loop_destroy(recorder->loop);
+
+	free(recorder);
+}
+
+static int
+pipewire_recorder_connect(struct pipewire_recorder *recorder,
+			  struct weston_output *output, const char *name)
+{
+	uint8_t buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof buffer);
+	const struct spa_pod *params[1];
+
+	recorder->core = pw_context_connect(recorder->context, NULL, 0);
+	if (!recorder->core) {
+		weston_log("[pipewire recorder] cannot connect to PipeWire: "
+			   "%s\n", strerror(errno));
+		return -1;
+	}
+
+	recorder->stream =
+		pw_stream_new(recorder->core, name,
+			      pw_properties_new(PW_KEY_MEDIA_CLASS,
+						"Video/Source",
+						PW_KEY_NODE_DESCRIPTION,
+						output->name,
+						NULL));
+	if (!recorder->stream)
+		return -1;
+
+	pw_stream_add_listener(recorder->stream, &recorder->stream_listener,
+			       &pipewire_recorder_stream_events, recorder);
+
+	/* Frames come whenever the output repaints, so the frame rate is
+	 * variable. */
+	params[0] = spa_format_video_raw_build(&b, SPA_PARAM_EnumFormat,
+		&SPA_VIDEO_INFO_RAW_INIT(
+			.format = SPA_VIDEO_FORMAT_BGRx,
+			.size = SPA_RECTANGLE(recorder->width,
+					      recorder->height),
+			.framerate = SPA_FRACTION(0, 1),
+			.max_framerate = SPA_FRACTION(
+				output->current_mode->refresh / 1000, 1)));
+
+	return pw_stream_connect(recorder->stream, PW_DIRECTION_OUTPUT,
+				 PW_ID_ANY,
+				 PW_STREAM_FLAG_DRIVER |
+				 PW_STREAM_FLAG_ALLOC_BUFFERS |
+				 PW_STREAM_FLAG_MAP_BUFFERS,
+				 params, ARRAY_LENGTH(params));
+}
+
+static struct recorder_encoder *
+pipewire_recorder_create(struct weston_output *output,
+			 enum recorder_encoder_input input,
+			 int width, int height, const char *filename)
+{
+	struct pipewire_recorder *recorder;
+	int ret;
+
+	recorder = zalloc(sizeof *recorder);
+	if (!recorder)
+		return NULL;
+
+	recorder->width = width;
+	recorder->height = height;
+
+	pw_init(NULL, NULL);
+
+	recorder->loop = pw_thread_loop_new("weston-pipewire", NULL);
+	if (!recorder->loop)
+		goto err;
+
+	recorder->context =
+		pw_context_new(pw_thread_loop_get_loop(recorder->loop),
+			       NULL, 0);
+	if (!recorder->context)
+		goto err;
+
+	if (pw_thread_loop_start(recorder->loop) < 0)
+		goto err;
+
+	pw_thread_loop_lock(recorder->loop);
+	ret = pipewire_recorder_connect(recorder, output, filename);
+	pw_thread_loop_unlock(recorder->loop);
+	if (ret < 0)
+		goto err;
+
+	return &recorder->base;
+
+err:
+	pipewire_recorder_destroy(&recorder->base);
+	return NULL;
+}
+
+static int
+pipewire_recorder_frame_memory(struct recorder_encoder *encoder,
+			       const void *pixels, int stride)
+{
+	struct pipewire_recorder *recorder =
+		container_of(encoder, struct pipewire_recorder, base);
+	struct spa_meta_header *header;
+	struct pw_buffer *buffer;
+	struct spa_data *d;
+	struct timespec now;
+	const uint8_t *src = pixels;
+	uint8_t *dst;
+	int row = recorder->width * 4;
+	int y;
+
+	pw_thread_loop_lock(recorder->loop);
+
+	/* Nobody is watching, or all buffers are still with the
+	 * consumers: drop the frame. */
+	if (!recorder->streaming ||
+	    !(buffer = pw_stream_dequeue_buffer(recorder->stream))) {
+		pw_thread_loop_unlock(recorder->loop);
+		return 0;
+	}
+
+	d = &buffer->buffer->datas[0];
+	dst = d->data;
+	if (dst && d->maxsize >= (uint32_t) (row * recorder->height)) {
+		for (y = 0; y < recorder->height; y++)
+			memcpy(dst + y * row, src + y * stride, row);
+
+		d->chunk->offset = 0;
+		d->chunk->size = row * recorder->height;
+		d->chunk->stride = row;
+	} else {
+		d->chunk->size = 0;
+	}
+
+	header = spa_buffer_find_meta_data(buffer->buffer, SPA_META_Header,
+					   sizeof *header);
+	if (header) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		header->pts = SPA_TIMESPEC_TO_NSEC(&now);
+		header->flags = 0;
+		header->seq = recorder->seq++;
+		header->dts_offset = 0;
+	}
+
+	pw_stream_queue_buffer(recorder->stream, buffer);
+	pw_stream_trigger_process(recorder->stream);
+
+	pw_thread_loop_unlock(recorder->loop);
+
+	return 0;
+}
+
+const struct recorder_encoder_interface pipewire_recorder_encoder = {
+	.name = "pipewire",
+	.suffix = "",
+	.inputs = RECORDER_ENCODER_INPUT_MEMORY,
+	.create = pipewire_recorder_create,
+	.frame_memory = pipewire_recorder_frame_memory,
+	.destroy = pipewire_recorder_destroy,
+};
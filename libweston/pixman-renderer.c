@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
@@ -39,21 +40,54 @@
 
 struct pixman_output_state {
 	void *shadow_buffer;
-	pixman_image_t *shadow_image;
+	pixman_image_t *shadow_image; /* NULL if drawing to hw_buffer */
 	pixman_image_t *hw_buffer;
+
+	/* Views are composited upright, leaving the output transform to
+	 * the final copy or to the display; see
+	 * pixman_renderer_output_create(). */
+	bool upright;
+	bool hw_upright; /* hw_buffer is upright too */
+	struct weston_matrix upright_to_hw; /* in pixels */
+	struct weston_matrix hw_to_upright;
+	pixman_transform_t hw_to_upright_transform;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t solid_color; /* if image is a solid fill */
 	struct weston_buffer_reference buffer_ref;
 
+	/* With early release, the contents the client buffers were
+	 * copied into; image refers to it once the buffer is gone. */
+	pixman_image_t *copy;
+
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* The images a repaint pass draws into. Pixman keeps the clip region
+ * and the transform in the image, so every band of a threaded repaint
+ * works on its own images pointing at the shared pixels.
+ */
+struct pixman_repaint_target {
+	pixman_image_t *shadow;
+	pixman_image_t *hw_buffer;
+	bool private_sources; /* wrap surface images before use */
+};
+
+struct pixman_band {
+	struct weston_output *output;
+	pixman_region32_t damage; /* in global coordinates */
+	struct pixman_repaint_target target;
+};
+
+/* Outputs with less damage than this are repainted on one thread */
+#define THREADED_REPAINT_MIN_AREA (256 * 256)
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -61,7 +95,24 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	/* Copy the damage of wl_shm buffers and release them on flush */
+	bool early_release;
+
 	struct wl_signal destroy_signal;
+
+	/* Worker pool for the threaded repaint, see repaint_bands() */
+	struct {
+		int n_threads; /* workers, not counting the compositor thread */
+		pthread_t *threads;
+		pthread_mutex_t lock;
+		pthread_cond_t work_cond;
+		pthread_cond_t done_cond;
+		struct pixman_band *bands;
+		int n_bands;
+		int next_band;
+		int bands_done;
+		bool quit;
+	} workers;
 };
 
 static inline struct pixman_output_state *
@@ -89,12 +140,14 @@ get_renderer(struct weston_compositor *ec)
 }
 
 static int
-pixman_renderer_read_pixels(struct weston_output *output,
-			       pixman_format_code_t format, void *pixels,
-			       uint32_t x, uint32_t y,
-			       uint32_t width, uint32_t height)
+pixman_renderer_read(struct weston_output *output,
+		     pixman_format_code_t format, void *pixels, int32_t stride,
+		     uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		     bool yflip)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	int32_t hw_width = output->current_mode->width;
+	int32_t hw_height = output->current_mode->height;
 	pixman_transform_t transform;
 	pixman_image_t *out_buf;
 
@@ -107,15 +160,27 @@ pixman_renderer_read_pixels(struct weston_output *output,
 		width,
 		height,
 		pixels,
-		(PIXMAN_FORMAT_BPP(format) / 8) * width);
+		stride);
+
+	if (yflip) {
+		pixman_transform_init_translate(&transform,
+				pixman_int_to_fixed (x),
+				pixman_int_to_fixed (y - hw_height));
+		pixman_transform_scale(&transform, NULL,
+				       pixman_fixed_1,
+				       pixman_fixed_minus_1);
+	} else {
+		pixman_transform_init_translate(&transform,
+						pixman_int_to_fixed (x),
+						pixman_int_to_fixed (y));
+	}
+
+	/* Callers expect the pixels as displayed, transform included */
+	if (po->hw_upright)
+		pixman_transform_multiply(&transform,
+					  &po->hw_to_upright_transform,
+					  &transform);
 
-	/* Caller expects vflipped source image */
-	pixman_transform_init_translate(&transform,
-					pixman_int_to_fixed (x),
-					pixman_int_to_fixed (y - pixman_image_get_height (po->hw_buffer)));
-	pixman_transform_scale(&transform, NULL,
-			       pixman_fixed_1,
-			       pixman_fixed_minus_1);
 	pixman_image_set_transform(po->hw_buffer, &transform);
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
@@ -125,8 +190,8 @@ pixman_renderer_read_pixels(struct weston_output *output,
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 hw_width, /* width */
+				 hw_height /* height */);
 	pixman_image_set_transform(po->hw_buffer, NULL);
 
 	pixman_image_unref(out_buf);
@@ -134,6 +199,28 @@ pixman_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int
+pixman_renderer_read_pixels(struct weston_output *output,
+			       pixman_format_code_t format, void *pixels,
+			       uint32_t x, uint32_t y,
+			       uint32_t width, uint32_t height)
+{
+	/* Caller expects vflipped source image */
+	return pixman_renderer_read(output, format, pixels,
+				    (PIXMAN_FORMAT_BPP(format) / 8) * width,
+				    x, y, width, height, true);
+}
+
+static int
+pixman_renderer_read_pixels_into(struct weston_output *output,
+				 pixman_format_code_t format, void *pixels,
+				 int32_t stride, uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height)
+{
+	return pixman_renderer_read(output, format, pixels, stride,
+				    x, y, width, height, false);
+}
+
 static void
 region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 {
@@ -148,6 +235,33 @@ region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 	}
 }
 
+/** Transform a global region into the image the views are drawn into
+ *
+ * That is the hardware buffer, or the upright shadow image when the
+ * output transform is left to the final pass.
+ */
+static void
+region_global_to_target(struct weston_output *output,
+			pixman_region32_t *region)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_matrix matrix;
+
+	if (!po->upright) {
+		region_global_to_output(output, region);
+	} else if (output->zoom.active) {
+		matrix = output->matrix;
+		weston_matrix_multiply(&matrix, &po->hw_to_upright);
+		weston_matrix_transform_region(region, &matrix, region);
+	} else {
+		pixman_region32_translate(region, -output->x, -output->y);
+		weston_transformed_region(output->width, output->height,
+					  WL_OUTPUT_TRANSFORM_NORMAL,
+					  output->current_scale,
+					  region, region);
+	}
+}
+
 #define D2F(v) pixman_double_to_fixed((double)v)
 
 static void
@@ -172,12 +286,18 @@ pixman_renderer_compute_transform(pixman_transform_t *transform_out,
 				  struct weston_view *ev,
 				  struct weston_output *output)
 {
+	struct pixman_output_state *po = get_output_state(output);
 	struct weston_matrix matrix;
 
 	/* Set up the source transformation based on the surface
 	   position, the output position/transform/scale and the client
 	   specified buffer transform/scale */
-	matrix = output->inverse_matrix;
+	if (po->upright) {
+		matrix = po->upright_to_hw;
+		weston_matrix_multiply(&matrix, &output->inverse_matrix);
+	} else {
+		matrix = output->inverse_matrix;
+	}
 
 	if (ev->transform.enabled) {
 		weston_matrix_multiply(&matrix, &ev->transform.inverse);
@@ -221,6 +341,26 @@ region_intersect_only_translation(pixman_region32_t *result_global,
 	pixman_region32_intersect(result_global, result_global, global);
 }
 
+/* A new image sharing the pixels, but not the state, of the given one */
+static pixman_image_t *
+image_wrap_bits(pixman_image_t *image)
+{
+	return pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						 pixman_image_get_width(image),
+						 pixman_image_get_height(image),
+						 pixman_image_get_data(image),
+						 pixman_image_get_stride(image));
+}
+
+static pixman_image_t *
+surface_state_wrap_image(struct pixman_surface_state *ps)
+{
+	if (!pixman_image_get_data(ps->image))
+		return pixman_image_create_solid_fill(&ps->solid_color);
+
+	return image_wrap_bits(ps->image);
+}
+
 static void
 composite_whole(pixman_op_t op,
 		pixman_image_t *src,
@@ -246,7 +386,8 @@ composite_whole(pixman_op_t op,
 }
 
 static void
-composite_clipped(pixman_image_t *src,
+composite_clipped(pixman_op_t op,
+		  pixman_image_t *src,
 		  pixman_image_t *mask,
 		  pixman_image_t *dest,
 		  const pixman_transform_t *transform,
@@ -263,9 +404,10 @@ composite_clipped(pixman_image_t *src,
 	void *src_data;
 	int i;
 
-	/* Hardcoded to use PIXMAN_OP_OVER, because sampling outside of
-	 * a Pixman image produces (0,0,0,0) instead of discarding the
-	 * fragment.
+	/* Only for operators that leave the destination alone where the
+	 * source is (0,0,0,0), like PIXMAN_OP_OVER, because sampling
+	 * outside of a Pixman image produces that instead of discarding
+	 * the fragment.
 	 */
 
 	dest_width = pixman_image_get_width(dest);
@@ -297,7 +439,7 @@ composite_clipped(pixman_image_t *src,
 		pixman_image_set_transform(boximg, &adj);
 
 		pixman_image_set_filter(boximg, filter, NULL, 0);
-		pixman_image_composite32(PIXMAN_OP_OVER, boximg, mask, dest,
+		pixman_image_composite32(op, boximg, mask, dest,
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
@@ -316,6 +458,22 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+static void
+composite(pixman_op_t op,
+	  pixman_image_t *src,
+	  pixman_image_t *mask,
+	  pixman_image_t *dest,
+	  const pixman_transform_t *transform,
+	  pixman_filter_t filter,
+	  pixman_region32_t *src_clip)
+{
+	if (src_clip)
+		composite_clipped(op, src, mask, dest, transform, filter,
+				  src_clip);
+	else
+		composite_whole(op, src, mask, dest, transform, filter);
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
@@ -323,10 +481,12 @@ composite_clipped(pixman_image_t *src,
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
- * \param pixman_op Compositing operator, either SRC or OVER.
+ * \param pixman_op Compositing operator, either SRC or OVER. Always
+ *                  OVER with a source clip.
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_repaint_target *target,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
@@ -334,15 +494,23 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
 	pixman_image_t *mask_image;
+	pixman_image_t *dim_image;
 	pixman_color_t mask = { 0, };
 
+	if (target->private_sources)
+		src_image = surface_state_wrap_image(ps);
+	else
+		src_image = pixman_image_ref(ps->image);
+	if (!src_image)
+		return;
+
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(target->shadow, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -361,16 +529,35 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
-	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
-				  &transform, filter, source_clip);
-	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+	/* Dimming darkens the color but not the coverage, which takes a
+	 * component alpha mask. Blending then has to be done in two steps,
+	 * taking the coverage out of the destination and adding the
+	 * darkened source. */
+	if (ev->dim > 0.0) {
+		mask.alpha = 0xffff * ev->alpha;
+		mask.red = mask.green = mask.blue = mask.alpha * (1.0 - ev->dim);
+		dim_image = pixman_image_create_solid_fill(&mask);
+		pixman_image_set_component_alpha(dim_image, 1);
+
+		if (pixman_op == PIXMAN_OP_OVER) {
+			composite(PIXMAN_OP_OUT_REVERSE, src_image, mask_image,
+				  target->shadow, &transform, filter,
+				  source_clip);
+			pixman_op = PIXMAN_OP_ADD;
+		}
+		if (mask_image)
+			pixman_image_unref(mask_image);
+		mask_image = dim_image;
+	}
+
+	composite(pixman_op, src_image, mask_image, target->shadow,
+		  &transform, filter, source_clip);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
 
+	pixman_image_unref(src_image);
+
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
@@ -378,18 +565,66 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		pixman_image_composite32(PIXMAN_OP_OVER,
 					 pr->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 target->shadow, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (target->shadow), /* width */
+					 pixman_image_get_height (target->shadow) /* height */);
+
+	pixman_image_set_clip_region32 (target->shadow, NULL);
+}
+
+/* An opaque solid color view is filled into its part of the repaint,
+ * which pixman does far faster than compositing a solid image. Returns
+ * false if the view has to be composited. */
+static bool
+draw_view_fill(struct weston_view *view, struct weston_output *output,
+	       struct pixman_repaint_target *target,
+	       pixman_region32_t *repaint_global)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_surface_state *ps = get_surface_state(view->surface);
+	pixman_region32_t surf_region;
+	pixman_region32_t repaint_output;
+	pixman_color_t color = ps->solid_color;
+	pixman_box32_t *boxes;
+	int n;
+
+	if (pixman_image_get_data(ps->image) ||
+	    ps->solid_color.alpha != 0xffff || view->alpha < 1.0 ||
+	    pr->repaint_debug)
+		return false;
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_region32_init_rect(&surf_region, 0, 0,
+				  view->surface->width, view->surface->height);
+	if (view->geometry.scissor_enabled)
+		pixman_region32_intersect(&surf_region, &surf_region,
+					  &view->geometry.scissor);
+
+	pixman_region32_init(&repaint_output);
+	region_intersect_only_translation(&repaint_output, repaint_global,
+					  &surf_region, view);
+	region_global_to_target(output, &repaint_output);
+
+	color.red *= 1.0 - view->dim;
+	color.green *= 1.0 - view->dim;
+	color.blue *= 1.0 - view->dim;
+
+	boxes = pixman_region32_rectangles(&repaint_output, &n);
+	if (n > 0)
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, target->shadow,
+					&color, n, boxes);
+
+	pixman_region32_fini(&repaint_output);
+	pixman_region32_fini(&surf_region);
+
+	return true;
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_repaint_target *target,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -398,6 +633,9 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 	/* region to be painted in output coordinates: */
 	pixman_region32_t repaint_output;
 
+	if (draw_view_fill(view, output, target, repaint_global))
+		return;
+
 	pixman_region32_init(&repaint_output);
 
 	/* Blended region is whole surface minus opaque region,
@@ -415,10 +653,10 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  repaint_global,
 							  &surface->opaque,
 							  view);
-			region_global_to_output(output, &repaint_output);
+			region_global_to_target(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, target, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -426,9 +664,9 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 		region_intersect_only_translation(&repaint_output,
 						  repaint_global,
 						  &surface_blend, view);
-		region_global_to_output(output, &repaint_output);
+		region_global_to_target(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, target, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -439,6 +677,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_repaint_target *target,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -462,9 +701,9 @@ draw_view_source_clipped(struct weston_view *view,
 
 	pixman_region32_init(&repaint_output);
 	pixman_region32_copy(&repaint_output, repaint_global);
-	region_global_to_output(output, &repaint_output);
+	region_global_to_target(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, target, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -473,10 +712,12 @@ draw_view_source_clipped(struct weston_view *view,
 }
 
 static void
-draw_view(struct weston_view *ev, struct weston_output *output,
+draw_view(const struct weston_draw_item *item, struct weston_output *output,
+	  struct pixman_repaint_target *target,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
-	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	struct weston_view *ev = item->view;
+	struct pixman_surface_state *ps = get_surface_state(item->surface);
 	/* repaint bounding region in global coordinates: */
 	pixman_region32_t repaint;
 
@@ -484,9 +725,10 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!ps->image)
 		return;
 
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
+	pixman_region32_init_rect(&repaint, item->box.x1, item->box.y1,
+				  item->box.x2 - item->box.x1,
+				  item->box.y2 - item->box.y1);
+	pixman_region32_intersect(&repaint, &repaint, damage);
 	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
 
 	if (!pixman_region32_not_empty(&repaint))
@@ -500,7 +742,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, target, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -509,61 +751,454 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, target, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output,
+		 struct pixman_repaint_target *target,
+		 pixman_region32_t *damage)
 {
-	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_draw_item *item;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	/* Only the primary plane views the core found to be visible;
+	 * backends put nothing below the primary plane with pixman */
+	wl_array_for_each(item, &output->draw_items)
+		if (item->plane == &output->compositor->primary_plane)
+			draw_view(item, output, target, damage);
 }
 
+/** Copy the damage from the shadow image into the hardware buffer
+ *
+ * For an upright shadow image of a transformed output, this is also the
+ * one pass that applies the output transform, unless the hardware
+ * buffer is upright as well.
+ */
 static void
-copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
+copy_to_hw_buffer(struct weston_output *output,
+		  struct pixman_repaint_target *target,
+		  pixman_region32_t *region)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	bool transform = po->upright && !po->hw_upright;
 	pixman_region32_t output_region;
 
 	pixman_region32_init(&output_region);
 	pixman_region32_copy(&output_region, region);
 
-	region_global_to_output(output, &output_region);
+	if (po->hw_upright)
+		region_global_to_target(output, &output_region);
+	else
+		region_global_to_output(output, &output_region);
 
-	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
+	pixman_image_set_clip_region32 (target->hw_buffer, &output_region);
 	pixman_region32_fini(&output_region);
 
+	if (transform) {
+		/* Whole pixel rotations and flips; the nearest filter
+		 * keeps pixman on its fast rotation paths. */
+		pixman_image_set_transform(target->shadow,
+					   &po->hw_to_upright_transform);
+		pixman_image_set_filter(target->shadow,
+					PIXMAN_FILTER_NEAREST, NULL, 0);
+	}
+
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->shadow_image, /* src */
+				 target->shadow, /* src */
 				 NULL /* mask */,
-				 po->hw_buffer, /* dest */
+				 target->hw_buffer, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->hw_buffer), /* width */
-				 pixman_image_get_height (po->hw_buffer) /* height */);
+				 pixman_image_get_width (target->hw_buffer), /* width */
+				 pixman_image_get_height (target->hw_buffer) /* height */);
+
+	if (transform)
+		pixman_image_set_transform(target->shadow, NULL);
+
+	pixman_image_set_clip_region32 (target->hw_buffer, NULL);
+}
+
+static void
+repaint_band(struct pixman_band *band)
+{
+	struct pixman_output_state *po = get_output_state(band->output);
+
+	repaint_surfaces(band->output, &band->target, &band->damage);
+	if (po->shadow_image)
+		copy_to_hw_buffer(band->output, &band->target, &band->damage);
+}
+
+/* Take bands off the queue until there are none left. Called with the
+ * lock held, returns with it held. */
+static void
+workers_run_bands(struct pixman_renderer *pr)
+{
+	int i;
+
+	while (pr->workers.next_band < pr->workers.n_bands) {
+		i = pr->workers.next_band++;
+		pthread_mutex_unlock(&pr->workers.lock);
+
+		repaint_band(&pr->workers.bands[i]);
+
+		pthread_mutex_lock(&pr->workers.lock);
+		if (++pr->workers.bands_done == pr->workers.n_bands)
+			pthread_cond_signal(&pr->workers.done_cond);
+	}
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct pixman_renderer *pr = data;
+
+	pthread_mutex_lock(&pr->workers.lock);
+	while (!pr->workers.quit) {
+		workers_run_bands(pr);
+		pthread_cond_wait(&pr->workers.work_cond, &pr->workers.lock);
+	}
+	pthread_mutex_unlock(&pr->workers.lock);
+
+	return NULL;
+}
+
+/** Repaint the damage in horizontal bands, in parallel
+ *
+ * \param output The output being repainted.
+ * \param damage The damage to repaint, in global coordinates.
+ * \return True if the damage was repainted, false if it is to be done
+ *         on the compositor thread alone.
+ *
+ * The damage is split into one band per thread, each composited and
+ * copied to the hardware buffer by the worker pool and the compositor
+ * thread together. The call returns once every band is done, so the
+ * rest of the repaint, and frame timing, is unaffected.
+ *
+ * Everything the bands read, the view list, surface regions and client
+ * buffers, is left untouched by the compositor while they run; surface
+ * images are wrapped per draw since drawing sets their transform.
+ */
+static bool
+repaint_bands(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_view *view;
+	struct pixman_band *band;
+	pixman_box32_t *extents;
+	int n_bands, i, y1, y2, height;
+	bool ret = false;
+
+	if (pr->workers.n_threads == 0)
+		return false;
+
+	extents = pixman_region32_extents(damage);
+	height = extents->y2 - extents->y1;
+	if ((int64_t) (extents->x2 - extents->x1) * height <
+	    THREADED_REPAINT_MIN_AREA)
+		return false;
+
+	n_bands = MIN(pr->workers.n_threads + 1, height);
+
+	/* Surface state is created lazily; do it here, not in a band. */
+	wl_list_for_each(view, &output->compositor->view_list, link)
+		get_surface_state(view->surface);
+
+	band = zalloc(n_bands * sizeof *band);
+	if (!band)
+		return false;
+
+	for (i = 0; i < n_bands; i++) {
+		y1 = extents->y1 + height * i / n_bands;
+		y2 = extents->y1 + height * (i + 1) / n_bands;
+
+		band[i].output = output;
+		pixman_region32_init(&band[i].damage);
+		pixman_region32_intersect_rect(&band[i].damage, damage,
+					       extents->x1, y1,
+					       extents->x2 - extents->x1,
+					       y2 - y1);
+		band[i].target.shadow = image_wrap_bits(po->shadow_image ?
+							po->shadow_image :
+							po->hw_buffer);
+		band[i].target.hw_buffer = image_wrap_bits(po->hw_buffer);
+		band[i].target.private_sources = true;
+
+		if (!band[i].target.shadow || !band[i].target.hw_buffer) {
+			n_bands = i + 1;
+			goto out;
+		}
+	}
+
+	pthread_mutex_lock(&pr->workers.lock);
+	pr->workers.bands = band;
+	pr->workers.n_bands = n_bands;
+	pr->workers.next_band = 0;
+	pr->workers.bands_done = 0;
+	pthread_cond_broadcast(&pr->workers.work_cond);
+
+	workers_run_bands(pr);
+	while (pr->workers.bands_done < n_bands)
+		pthread_cond_wait(&pr->workers.done_cond, &pr->workers.lock);
+
+	pr->workers.bands = NULL;
+	pr->workers.n_bands = 0;
+	pr->workers.next_band = 0;
+	pthread_mutex_unlock(&pr->workers.lock);
+
+	ret = true;
+
+out:
+	for (i = 0; i < n_bands; i++) {
+		if (band[i].target.shadow)
+			pixman_image_unref(band[i].target.shadow);
+		if (band[i].target.hw_buffer)
+			pixman_image_unref(band[i].target.hw_buffer);
+		pixman_region32_fini(&band[i].damage);
+	}
+	free(band);
+
+	return ret;
+}
 
-	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
+static void
+workers_init(struct pixman_renderer *pr, int n_threads)
+{
+	int i;
+
+	pthread_mutex_init(&pr->workers.lock, NULL);
+	pthread_cond_init(&pr->workers.work_cond, NULL);
+	pthread_cond_init(&pr->workers.done_cond, NULL);
+
+	if (n_threads <= 0)
+		return;
+
+	pr->workers.threads = zalloc(n_threads * sizeof(pthread_t));
+	if (!pr->workers.threads)
+		return;
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&pr->workers.threads[i], NULL,
+				   worker_thread, pr) != 0) {
+			weston_log("Pixman renderer: failed to start repaint "
+				   "thread: %m\n");
+			break;
+		}
+		pr->workers.n_threads++;
+	}
+
+	if (pr->workers.n_threads > 0)
+		weston_log("Pixman renderer: repainting with %d threads.\n",
+			   pr->workers.n_threads + 1);
+}
+
+static void
+workers_fini(struct pixman_renderer *pr)
+{
+	int i;
+
+	pthread_mutex_lock(&pr->workers.lock);
+	pr->workers.quit = true;
+	pthread_cond_broadcast(&pr->workers.work_cond);
+	pthread_mutex_unlock(&pr->workers.lock);
+
+	for (i = 0; i < pr->workers.n_threads; i++)
+		pthread_join(pr->workers.threads[i], NULL);
+	free(pr->workers.threads);
+
+	pthread_cond_destroy(&pr->workers.done_cond);
+	pthread_cond_destroy(&pr->workers.work_cond);
+	pthread_mutex_destroy(&pr->workers.lock);
+}
+
+/* Whether the opaque region of the view can be copied straight into the
+ * hardware buffer: source pixels map 1:1 onto output pixels, and both
+ * sides are 32 bits per pixel in the same channel order.
+ */
+static bool
+view_can_blit_direct(struct weston_view *ev, struct weston_output *output,
+		     int32_t *buffer_dx, int32_t *buffer_dy)
+{
+	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	pixman_format_code_t src, dst;
+	float view_x, view_y;
+
+	if (!ps->image || ev->alpha < 1.0)
+		return false;
+
+	if (!view_transformation_is_translation(ev))
+		return false;
+
+	if (vp->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    vp->buffer.scale != output->current_scale ||
+	    vp->buffer.src_width != wl_fixed_from_int(-1) ||
+	    vp->surface.width != -1)
+		return false;
+
+	/* Copied bit for bit: the colour channels have to be laid out
+	 * the same, only alpha may differ from x. */
+	src = pixman_image_get_format(ps->image);
+	dst = pixman_image_get_format(po->hw_buffer);
+	if (PIXMAN_FORMAT_BPP(src) != 32 || PIXMAN_FORMAT_BPP(dst) != 32 ||
+	    PIXMAN_FORMAT_TYPE(src) != PIXMAN_FORMAT_TYPE(dst) ||
+	    PIXMAN_FORMAT_R(src) != PIXMAN_FORMAT_R(dst) ||
+	    PIXMAN_FORMAT_G(src) != PIXMAN_FORMAT_G(dst) ||
+	    PIXMAN_FORMAT_B(src) != PIXMAN_FORMAT_B(dst))
+		return false;
+
+	weston_view_to_global_float(ev, 0, 0, &view_x, &view_y);
+	if (view_x != (int32_t) view_x || view_y != (int32_t) view_y)
+		return false;
+
+	/* Buffer pixel = output pixel + (buffer_dx, buffer_dy) */
+	*buffer_dx = (output->x - (int32_t) view_x) * output->current_scale;
+	*buffer_dy = (output->y - (int32_t) view_y) * output->current_scale;
+
+	return true;
+}
+
+static void
+blit_direct(struct weston_view *ev, struct weston_output *output,
+	    pixman_region32_t *region, /* in output coordinates */
+	    int32_t buffer_dx, int32_t buffer_dy)
+{
+	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_box32_t *boxes;
+	int n_box, i;
+
+	if (ps->buffer_ref.buffer)
+		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
+
+	boxes = pixman_region32_rectangles(region, &n_box);
+	for (i = 0; i < n_box; i++) {
+		int32_t w = boxes[i].x2 - boxes[i].x1;
+		int32_t h = boxes[i].y2 - boxes[i].y1;
+
+		/* pixman_blt() uses the SIMD (SSE2, NEON, ...) copy
+		 * routines pixman was built with. */
+		if (pixman_blt(pixman_image_get_data(ps->image),
+			       pixman_image_get_data(po->hw_buffer),
+			       pixman_image_get_stride(ps->image) / 4,
+			       pixman_image_get_stride(po->hw_buffer) / 4,
+			       32, 32,
+			       boxes[i].x1 + buffer_dx, boxes[i].y1 + buffer_dy,
+			       boxes[i].x1, boxes[i].y1, w, h))
+			continue;
+
+		pixman_image_set_transform(ps->image, NULL);
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 ps->image, /* src */
+					 NULL /* mask */,
+					 po->hw_buffer, /* dest */
+					 boxes[i].x1 + buffer_dx,
+					 boxes[i].y1 + buffer_dy, /* src_x, src_y */
+					 0, 0, /* mask_x, mask_y */
+					 boxes[i].x1, boxes[i].y1, /* dest_x, dest_y */
+					 w, h);
+	}
+
+	if (ps->buffer_ref.buffer)
+		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
+}
+
+/** Copy topmost opaque views straight into the hardware buffer
+ *
+ * \param output The output being repainted.
+ * \param damage The damage to repaint, in global coordinates.
+ * \param direct Returns the part of the damage that was painted, in
+ *               global coordinates.
+ *
+ * Where the topmost view of the primary plane is an opaque, integer
+ * translated and unscaled view, nothing below it can show through.
+ * Those pixels are copied from the client buffer into the hardware
+ * buffer directly, which skips compositing them into the shadow buffer
+ * and copying them again.
+ */
+static void
+repaint_opaque_direct(struct weston_output *output, pixman_region32_t *damage,
+		      pixman_region32_t *direct)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_view *ev;
+	pixman_region32_t covered, opaque;
+	int32_t buffer_dx, buffer_dy;
+
+	if (output->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    output->zoom.active)
+		return;
+
+	pixman_region32_init(&covered);
+	pixman_region32_init(&opaque);
+
+	wl_list_for_each(ev, &compositor->view_list, link) {
+		if (ev->plane != &compositor->primary_plane)
+			continue;
+
+		if (view_can_blit_direct(ev, output, &buffer_dx, &buffer_dy) &&
+		    pixman_region32_not_empty(&ev->surface->opaque)) {
+			region_intersect_only_translation(&opaque, damage,
+							  &ev->surface->opaque,
+							  ev);
+			pixman_region32_subtract(&opaque, &opaque, &covered);
+
+			if (pixman_region32_not_empty(&opaque)) {
+				pixman_region32_union(direct, direct, &opaque);
+				region_global_to_output(output, &opaque);
+				blit_direct(ev, output, &opaque,
+					    buffer_dx, buffer_dy);
+			}
+		}
+
+		pixman_region32_union(&covered, &covered,
+				      &ev->transform.boundingbox);
+	}
+
+	pixman_region32_fini(&opaque);
+	pixman_region32_fini(&covered);
 }
 
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_repaint_target target;
+	pixman_region32_t direct, composited;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	pixman_region32_init(&direct);
+	pixman_region32_init(&composited);
+
+	if (!pr->repaint_debug)
+		repaint_opaque_direct(output, output_damage, &direct);
+
+	/* The shadow buffer is only ever read back within the damage, so
+	 * it is fine for it to go stale where the views were blitted. */
+	pixman_region32_subtract(&composited, output_damage, &direct);
+	if (pixman_region32_not_empty(&composited) &&
+	    !repaint_bands(output, &composited)) {
+		target.shadow = po->shadow_image ?
+				po->shadow_image : po->hw_buffer;
+		target.hw_buffer = po->hw_buffer;
+		target.private_sources = false;
+
+		repaint_surfaces(output, &target, &composited);
+		if (po->shadow_image)
+			copy_to_hw_buffer(output, &target, &composited);
+	}
+
+	pixman_region32_fini(&composited);
+	pixman_region32_fini(&direct);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -571,10 +1206,67 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	/* Actual flip should be done by caller */
 }
 
+/* Copies the damage, or all of the buffer if the copy does not fit it
+ * any more, into the surface's copy, which then stands in for the
+ * buffer. */
 static void
 pixman_renderer_flush_damage(struct weston_surface *surface)
 {
-	/* No-op for pixman renderer */
+	struct pixman_renderer *pr = get_renderer(surface->compositor);
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct weston_buffer *buffer = ps->buffer_ref.buffer;
+	pixman_format_code_t format;
+	pixman_box32_t *rects, r;
+	bool full = false;
+	int width, height;
+	int i, n;
+
+	if (!pr->early_release || !buffer || !ps->image)
+		return;
+
+	format = pixman_image_get_format(ps->image);
+	width = pixman_image_get_width(ps->image);
+	height = pixman_image_get_height(ps->image);
+
+	if (!ps->copy ||
+	    pixman_image_get_format(ps->copy) != format ||
+	    pixman_image_get_width(ps->copy) != width ||
+	    pixman_image_get_height(ps->copy) != height) {
+		if (ps->copy)
+			pixman_image_unref(ps->copy);
+		ps->copy = pixman_image_create_bits(format, width, height,
+						    NULL, 0);
+		if (!ps->copy)
+			return;
+		full = true;
+	}
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	rects = pixman_region32_rectangles(&surface->buffer_damage, &n);
+	if (full)
+		n = 1;
+	for (i = 0; i < n; i++) {
+		if (full) {
+			r.x1 = 0;
+			r.y1 = 0;
+			r.x2 = width;
+			r.y2 = height;
+		} else {
+			r = rects[i];
+		}
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 ps->image, NULL, ps->copy,
+					 r.x1, r.y1, 0, 0, r.x1, r.y1,
+					 r.x2 - r.x1, r.y2 - r.y1);
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	pixman_image_unref(ps->image);
+	ps->image = pixman_image_ref(ps->copy);
+
+	wl_list_remove(&ps->buffer_destroy_listener.link);
+	ps->buffer_destroy_listener.notify = NULL;
+	weston_buffer_reference(&ps->buffer_ref, NULL);
 }
 
 static void
@@ -612,8 +1304,14 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		ps->image = NULL;
 	}
 
-	if (!buffer)
+	if (!buffer) {
+		/* Whatever comes next is copied in full */
+		if (ps->copy) {
+			pixman_image_unref(ps->copy);
+			ps->copy = NULL;
+		}
 		return;
+	}
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
 
@@ -630,9 +1328,27 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	case WL_SHM_FORMAT_ARGB8888:
 		pixman_format = PIXMAN_a8r8g8b8;
 		break;
+	case WL_SHM_FORMAT_XBGR8888:
+		pixman_format = PIXMAN_x8b8g8r8;
+		break;
+	case WL_SHM_FORMAT_ABGR8888:
+		pixman_format = PIXMAN_a8b8g8r8;
+		break;
 	case WL_SHM_FORMAT_RGB565:
 		pixman_format = PIXMAN_r5g6b5;
 		break;
+	case WL_SHM_FORMAT_XRGB2101010:
+		pixman_format = PIXMAN_x2r10g10b10;
+		break;
+	case WL_SHM_FORMAT_ARGB2101010:
+		pixman_format = PIXMAN_a2r10g10b10;
+		break;
+	case WL_SHM_FORMAT_XBGR2101010:
+		pixman_format = PIXMAN_x2b10g10r10;
+		break;
+	case WL_SHM_FORMAT_ABGR2101010:
+		pixman_format = PIXMAN_a2b10g10r10;
+		break;
 	default:
 		weston_log("Unsupported SHM buffer format\n");
 		weston_buffer_reference(&ps->buffer_ref, NULL);
@@ -671,6 +1387,8 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	if (ps->copy)
+		pixman_image_unref(ps->copy);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	free(ps);
 }
@@ -741,6 +1459,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 		ps->image = NULL;
 	}
 
+	ps->solid_color = color;
 	ps->image = pixman_image_create_solid_fill(&color);
 }
 
@@ -751,6 +1470,7 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	workers_fini(pr);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -803,6 +1523,75 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	return 0;
 }
 
+static int
+pixman_renderer_surface_copy_scaled(struct weston_surface *target,
+				    struct weston_surface *surface,
+				    int width, int height)
+{
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct pixman_surface_state *ts = get_surface_state(target);
+	pixman_transform_t transform;
+	pixman_image_t *image;
+	int cw, ch;
+
+	pixman_renderer_surface_get_content_size(surface, &cw, &ch);
+	if (cw == 0 || ch == 0)
+		return -1;
+
+	/* Reuse the previous copy's pixels if the size did not change */
+	image = ts->image;
+	if (!image || ts->buffer_ref.buffer ||
+	    !pixman_image_get_data(image) ||
+	    pixman_image_get_width(image) != width ||
+	    pixman_image_get_height(image) != height) {
+		image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						 width, height, NULL, 0);
+		if (!image)
+			return -1;
+	}
+
+	pixman_transform_init_scale(&transform,
+				    pixman_double_to_fixed((double) cw / width),
+				    pixman_double_to_fixed((double) ch / height));
+
+	if (ps->buffer_ref.buffer)
+		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
+
+	pixman_image_set_transform(ps->image, &transform);
+	pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 ps->image,	/* src */
+				 NULL,		/* mask */
+				 image,		/* dest */
+				 0, 0,		/* src_x, src_y */
+				 0, 0,		/* mask_x, mask_y */
+				 0, 0,		/* dest_x, dest_y */
+				 width, height);
+	pixman_image_set_transform(ps->image, NULL);
+
+	if (ps->buffer_ref.buffer)
+		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
+
+	if (image != ts->image) {
+		pixman_renderer_attach(target, NULL);
+		ts->image = image;
+	}
+
+	return 0;
+}
+
+static int
+pixman_renderer_surface_set_image(struct weston_surface *surface,
+				  pixman_image_t *image)
+{
+	struct pixman_surface_state *ps = get_surface_state(surface);
+
+	pixman_renderer_attach(surface, NULL);
+	ps->image = pixman_image_ref(image);
+
+	return 0;
+}
+
 static void
 debug_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
 	      void *data)
@@ -835,7 +1624,9 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
+	renderer->early_release = ec->pixman_early_release;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
+	renderer->base.read_pixels_into = pixman_renderer_read_pixels_into;
 	renderer->base.repaint_output = pixman_renderer_repaint_output;
 	renderer->base.flush_damage = pixman_renderer_flush_damage;
 	renderer->base.attach = pixman_renderer_attach;
@@ -845,6 +1636,9 @@ pixman_renderer_init(struct weston_compositor *ec)
 		pixman_renderer_surface_get_content_size;
 	renderer->base.surface_copy_content =
 		pixman_renderer_surface_copy_content;
+	renderer->base.surface_copy_scaled =
+		pixman_renderer_surface_copy_scaled;
+	renderer->base.surface_set_image = pixman_renderer_surface_set_image;
 	ec->renderer = &renderer->base;
 	ec->capabilities |= WESTON_CAP_ROTATION_ANY;
 	ec->capabilities |= WESTON_CAP_CAPTURE_YFLIP;
@@ -854,10 +1648,20 @@ pixman_renderer_init(struct weston_compositor *ec)
 		weston_compositor_add_debug_binding(ec, KEY_R,
 						    debug_binding, ec);
 
+	/* Packed RGB formats Pixman reads directly. Its YUV ones are left
+	 * out: they cannot be cut into per-box images or copied into. */
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_XBGR8888);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_ABGR8888);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_XRGB2101010);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_ARGB2101010);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_XBGR2101010);
+	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_ABGR2101010);
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	workers_init(renderer, ec->renderer_threads - 1);
+
 	return 0;
 }
 
@@ -876,19 +1680,116 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+/** Set up compositing upright, without the output transform
+ *
+ * The views are drawn as if the output was not rotated or flipped, so
+ * pixman composites them on its plain translation paths rather than
+ * through a rotating transform per view. The output transform is then
+ * applied to the damage once, in copy_to_hw_buffer(), or by the display
+ * if the hardware buffer is upright as well.
+ */
+static void
+output_state_init_upright(struct pixman_output_state *po,
+			  struct weston_output *output, bool hw_upright)
+{
+	struct weston_matrix *m = &po->upright_to_hw;
+	int32_t width = output->width * output->current_scale;
+	int32_t height = output->height * output->current_scale;
+	pixman_transform_t *pt = &po->hw_to_upright_transform;
+	struct weston_matrix *inv = &po->hw_to_upright;
+
+	po->upright = true;
+	po->hw_upright = hw_upright;
+
+	/* The output transform of output_compute_matrix() in compositor.c,
+	 * in pixels of the upright image */
+	weston_matrix_init(m);
+
+	switch (output->transform) {
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		weston_matrix_translate(m, -width, 0, 0);
+		weston_matrix_scale(m, -1, 1, 1);
+		break;
+	}
+
+	switch (output->transform) {
+	default:
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		weston_matrix_translate(m, 0, -height, 0);
+		weston_matrix_rotate_xy(m, 0, 1);
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		weston_matrix_translate(m, -width, -height, 0);
+		weston_matrix_rotate_xy(m, -1, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		weston_matrix_translate(m, -width, 0, 0);
+		weston_matrix_rotate_xy(m, 0, -1);
+		break;
+	}
+
+	weston_matrix_invert(inv, m);
+	weston_matrix_to_pixman_transform(pt, inv);
+}
+
+/** Create the renderer state of an output
+ *
+ * \param output The output to render.
+ * \param flags A bitmask of enum pixman_renderer_output_flags.
+ * \return 0 on success, -1 on failure.
+ *
+ * Without PIXMAN_RENDERER_OUTPUT_USE_SHADOW the views are composited
+ * straight into the buffer given to pixman_renderer_output_set_buffer(),
+ * which saves copying the damage on every repaint. That buffer is read
+ * back while blending, so it has to be reasonably fast to read from.
+ *
+ * With PIXMAN_RENDERER_OUTPUT_HW_TRANSFORM, the buffer is upright and the
+ * display applies the output transform. Otherwise, if the compositor's
+ * offscreen_transform is set, a rotated or flipped output is composited
+ * upright into a shadow image, which is transformed while copying it to
+ * the buffer.
+ */
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po;
+	bool transformed;
 	int w, h;
 
 	po = zalloc(sizeof *po);
 	if (po == NULL)
 		return -1;
 
+	transformed = output->transform != WL_OUTPUT_TRANSFORM_NORMAL;
+	if (transformed && (flags & PIXMAN_RENDERER_OUTPUT_HW_TRANSFORM)) {
+		output_state_init_upright(po, output, true);
+	} else if (transformed && output->compositor->offscreen_transform) {
+		output_state_init_upright(po, output, false);
+		flags |= PIXMAN_RENDERER_OUTPUT_USE_SHADOW;
+	}
+
+	if (!(flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW)) {
+		output->renderer_state = po;
+		return 0;
+	}
+
 	/* set shadow image transformation */
-	w = output->current_mode->width;
-	h = output->current_mode->height;
+	if (po->upright) {
+		w = output->width * output->current_scale;
+		h = output->height * output->current_scale;
+	} else {
+		w = output->current_mode->width;
+		h = output->current_mode->height;
+	}
 
 	po->shadow_buffer = malloc(w * h * 4);
 
@@ -917,7 +1818,8 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
@@ -30,8 +30,18 @@
 int
 pixman_renderer_init(struct weston_compositor *ec);
 
+enum pixman_renderer_output_flags {
+	/* Composite into a shadow image and copy the damage to the
+	 * hardware buffer, instead of compositing into it directly.
+	 * Needed when reading the hardware buffer back is slow. */
+	PIXMAN_RENDERER_OUTPUT_USE_SHADOW = (1 << 0),
+	/* The hardware buffer is upright, and the display rotates and
+	 * flips it as the output transform says. */
+	PIXMAN_RENDERER_OUTPUT_HW_TRANSFORM = (1 << 1),
+};
+
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
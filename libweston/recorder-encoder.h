@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _RECORDER_ENCODER_H_
+#define _RECORDER_ENCODER_H_
+
+#include <stdint.h>
+
+struct weston_output;
+struct recorder_encoder_interface;
+
+/** Ways an encoder can be handed frames */
+enum recorder_encoder_input {
+	/** A dmabuf of the buffer the backend presented */
+	RECORDER_ENCODER_INPUT_DMABUF = 1 << 0,
+	/** Pixels read back by the renderer */
+	RECORDER_ENCODER_INPUT_MEMORY = 1 << 1,
+};
+
+/** Embedded at the start of each encoder's own state */
+struct recorder_encoder {
+	const struct recorder_encoder_interface *interface;
+};
+
+/** A video encoder usable by weston_hw_recorder_start()
+ *
+ * Frames are always XRGB8888 and the size of the output's current
+ * mode. Encoders do their work on a thread of their own, so the frame
+ * entry points only queue the frame and must not block for long; if
+ * the encoder is still busy with the previous one it may drop either.
+ */
+struct recorder_encoder_interface {
+	const char *name;
+	/** Appended to the file name passed to the recorder */
+	const char *suffix;
+	/** Bitmask of enum recorder_encoder_input */
+	uint32_t inputs;
+
+	/** Returns NULL if the encoder is not available on this system,
+	 * in which case the next one is tried. input is the single
+	 * enum recorder_encoder_input frames will be passed as. */
+	struct recorder_encoder *(*create)(struct weston_output *output,
+					   enum recorder_encoder_input input,
+					   int width, int height,
+					   const char *filename);
+	/** Takes ownership of fd, also on failure. */
+	int (*frame_dmabuf)(struct recorder_encoder *encoder,
+			    int fd, int stride);
+	/** The pixels are only valid during the call; stride may be
+	 * negative for bottom-up images. */
+	int (*frame_memory)(struct recorder_encoder *encoder,
+			    const void *pixels, int stride);
+	void (*destroy)(struct recorder_encoder *encoder);
+};
+
+#ifdef BUILD_PIPEWIRE_RECORDER
+extern const struct recorder_encoder_interface pipewire_recorder_encoder;
+#endif
+#ifdef BUILD_V4L2_RECORDER
+extern const struct recorder_encoder_interface v4l2_recorder_encoder;
+#endif
+extern const struct recorder_encoder_interface y4m_recorder_encoder;
+
+#endif /* _RECORDER_ENCODER_H_ */
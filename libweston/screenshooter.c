@@ -33,6 +33,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "compositor.h"
 #include "shared/helpers.h"
@@ -41,29 +47,46 @@
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
+	struct wl_listener buffer_destroy_listener;
 	struct weston_buffer *buffer;
+	pixman_format_code_t format;
+	uint32_t capabilities;
+	int width, height;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra_yflip(uint8_t *dst, int dst_stride,
+		uint8_t *src, int src_stride, int height, int bytes)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		memcpy(dst, src, bytes);
+		dst += dst_stride;
+		src -= src_stride;
 	}
 }
 
 static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra(uint8_t *dst, int dst_stride,
+	  uint8_t *src, int src_stride, int height, int bytes)
 {
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
+	uint8_t *end;
+
+	if (dst_stride == src_stride) {
+		memcpy(dst, src, height * dst_stride);
+		return;
+	}
+
+	end = dst + height * dst_stride;
+	while (dst < end) {
+		memcpy(dst, src, bytes);
+		dst += dst_stride;
+		src += src_stride;
+	}
 }
 
 static void
@@ -84,79 +107,83 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba_yflip(uint8_t *dst, int dst_stride,
+		uint8_t *src, int src_stride, int height, int bytes)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		copy_row_swap_RB(dst, src, bytes);
+		dst += dst_stride;
+		src -= src_stride;
 	}
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba(uint8_t *dst, int dst_stride,
+	  uint8_t *src, int src_stride, int height, int bytes)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+		copy_row_swap_RB(dst, src, bytes);
+		dst += dst_stride;
+		src += src_stride;
 	}
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_read_done(void *data, void *pixels)
 {
-	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	struct screenshooter_frame_listener *l = data;
+	int32_t stride, src_stride, bytes;
+	uint8_t *d, *s;
+	int yflip = l->capabilities & WESTON_CAP_CAPTURE_YFLIP;
+
+	/* The client destroyed the buffer while the read was in flight,
+	 * and has already been told about it. */
+	if (!l->buffer) {
+		free(l);
+		return;
+	}
 
-	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	wl_list_remove(&l->buffer_destroy_listener.link);
 
-	if (pixels == NULL) {
+	if (!pixels) {
 		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
 		free(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
+	bytes = l->width * (PIXMAN_FORMAT_BPP(l->format) / 8);
+	src_stride = bytes;
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	s = (uint8_t *) pixels + src_stride * (l->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
-	switch (compositor->read_format) {
+	switch (l->format) {
 	case PIXMAN_a8r8g8b8:
 	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
+		if (yflip)
+			copy_bgra_yflip(d, stride, s, src_stride,
+					l->height, bytes);
 		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
+			copy_bgra(d, stride, pixels, src_stride,
+				  l->height, bytes);
 		break;
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
+		if (yflip)
+			copy_rgba_yflip(d, stride, s, src_stride,
+					l->height, bytes);
 		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+			copy_rgba(d, stride, pixels, src_stride,
+				  l->height, bytes);
 		break;
 	default:
 		break;
@@ -165,7 +192,136 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&l->buffer_destroy_listener.link);
+	l->buffer = NULL;
+	l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+}
+
+/* Renderers that can write upright pixels into any stride fill the
+ * client buffer directly, with no copy in between. */
+static int
+screenshooter_read_into_buffer(struct screenshooter_frame_listener *l,
+			       struct weston_output *output)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+	struct wl_shm_buffer *shm_buffer = l->buffer->shm_buffer;
+	uint32_t shm_format = wl_shm_buffer_get_format(shm_buffer);
+	int ret;
+
+	if (!renderer->read_pixels_into ||
+	    (shm_format != WL_SHM_FORMAT_ARGB8888 &&
+	     shm_format != WL_SHM_FORMAT_XRGB8888))
+		return -1;
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	ret = renderer->read_pixels_into(output, PIXMAN_a8r8g8b8,
+					 wl_shm_buffer_get_data(shm_buffer),
+					 wl_shm_buffer_get_stride(shm_buffer),
+					 0, 0, l->width, l->height);
+	wl_shm_buffer_end_access(shm_buffer);
+
+	return ret;
+}
+
+static void
+screenshooter_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+
+	output->disable_planes--;
+	wl_list_remove(&listener->link);
+
+	if (!l->buffer) {
+		free(l);
+		return;
+	}
+
+	/* The copy into the client buffer happens once the pixels are
+	 * back, so remember what they will look like. */
+	l->format = compositor->read_format;
+	l->capabilities = compositor->capabilities;
+	l->width = output->current_mode->width;
+	l->height = output->current_mode->height;
+
+	if (screenshooter_read_into_buffer(l, output) == 0) {
+		wl_list_remove(&l->buffer_destroy_listener.link);
+		l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+		free(l);
+		return;
+	}
+
+	if (weston_output_read_pixels_async(output, l->format,
+					    0, 0, l->width, l->height,
+					    screenshooter_read_done, l) < 0) {
+		wl_list_remove(&l->buffer_destroy_listener.link);
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		free(l);
+	}
+}
+
+/* The display hardware wrote the frame back, planes included, so the
+ * renderer has nothing to read back. */
+static void
+screenshooter_writeback_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = data;
+	struct wl_shm_buffer *shm_buffer;
+	uint8_t *d;
+	uint32_t *row;
+	int32_t stride;
+	int x, y, ret;
+
+	wl_list_remove(&listener->link);
+
+	if (!l->buffer) {
+		output->disable_writeback(output);
+		free(l);
+		return;
+	}
+
+	shm_buffer = l->buffer->shm_buffer;
+	stride = wl_shm_buffer_get_stride(shm_buffer);
+	d = wl_shm_buffer_get_data(shm_buffer);
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	ret = output->read_writeback(output, d, stride);
+	/* The X of XRGB8888 is undefined */
+	for (y = 0; ret == 0 && y < output->current_mode->height; y++) {
+		row = (uint32_t *) (d + y * stride);
+		for (x = 0; x < output->current_mode->width; x++)
+			row[x] |= 0xff000000;
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+
+	output->disable_writeback(output);
+
+	if (ret < 0) {
+		l->listener.notify = screenshooter_frame_notify;
+		wl_signal_add(&output->frame_signal, &l->listener);
+		output->disable_planes++;
+		weston_output_schedule_repaint(output);
+		return;
+	}
+
+	wl_list_remove(&l->buffer_destroy_listener.link);
+	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
 	free(l);
 }
 
@@ -191,7 +347,7 @@ weston_screenshooter_shoot(struct weston_output *output,
 		return -1;
 	}
 
-	l = malloc(sizeof *l);
+	l = zalloc(sizeof *l);
 	if (l == NULL) {
 		done(data, WESTON_SCREENSHOOTER_NO_MEMORY);
 		return -1;
@@ -200,22 +356,82 @@ weston_screenshooter_shoot(struct weston_output *output,
 	l->buffer = buffer;
 	l->done = done;
 	l->data = data;
-	l->listener.notify = screenshooter_frame_notify;
-	wl_signal_add(&output->frame_signal, &l->listener);
-	output->disable_planes++;
+	l->buffer_destroy_listener.notify =
+		screenshooter_buffer_destroy_notify;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+
+	if (output->enable_writeback &&
+	    output->enable_writeback(output) == 0) {
+		l->listener.notify = screenshooter_writeback_notify;
+		wl_signal_add(&output->writeback_signal, &l->listener);
+	} else {
+		l->listener.notify = screenshooter_frame_notify;
+		wl_signal_add(&output->frame_signal, &l->listener);
+		output->disable_planes++;
+	}
 	weston_output_schedule_repaint(output);
 
 	return 0;
 }
 
+/* Frames captured ahead of the encoder. When all of them are still
+ * waiting to be encoded, the damage of the frames that could not be
+ * captured is carried over into the next one. */
+#define RECORDER_FRAME_COUNT 3
+
+/* Encoded frames are batched into blocks of about this size, each one
+ * compressed and written out with a single system call. */
+#define RECORDER_BLOCK_SIZE (1024 * 1024)
+
+/* A full frame is written at least this often, so that decoders can
+ * seek without replaying the whole recording. */
+#define RECORDER_KEYFRAME_INTERVAL_MS 5000
+
+/* A captured frame: the pixels of its damage rectangles, tightly packed
+ * one after another. Owned by the compositor thread while it is being
+ * read back and by the encoder thread once queued. */
+struct weston_recorder_frame {
+	struct weston_recorder *recorder;
+	struct wl_list link; /* weston_recorder::free_frames or ::queue */
+	uint32_t *pixels;
+	uint32_t msecs;
+	int do_yflip;
+	pixman_box32_t *rects;
+	int rects_size;
+	int nrects;	/* rectangles requested */
+	int next;	/* rectangles completed */
+	int ncaptured;	/* rectangles with pixels, packed at the front */
+	size_t filled;	/* pixels stored for them */
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
-	int fd;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int destroying;
+	int pending; /* frames with read backs in flight */
+	pixman_region32_t carried_damage;
+	struct weston_recorder_frame frames[RECORDER_FRAME_COUNT];
+
+	pthread_t worker;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	struct wl_list free_frames;
+	struct wl_list queue;
+	int stopping;
+
+	/* Only touched by the encoder thread while it runs */
+	uint32_t *frame;
+	int stride, height;
+	uint8_t *block, *compressed;
+	size_t block_len, block_size, compressed_size;
+	struct wcap_block_header_v3 block_header;
+	uint32_t compression;
+	uint32_t key_msecs;
+	struct wl_array index; /* of struct wcap_index_entry */
+	uint64_t total;
+	int fd;
+	int count;
+	int error;
 };
 
 static uint32_t *
@@ -249,9 +465,430 @@ component_delta(uint32_t next, uint32_t prev)
 	return (dr << 16) | (dg << 8) | (db << 0);
 }
 
+static void
+weston_recorder_write(struct weston_recorder *recorder,
+		      struct iovec *v, int n)
+{
+	ssize_t ret;
+
+	if (recorder->error)
+		return;
+
+	ret = writev(recorder->fd, v, n);
+	if (ret < 0)
+		recorder->error = errno;
+	else
+		recorder->total += ret;
+}
+
+/* Compress and write out the frames encoded so far. */
+static void
+weston_recorder_flush_block(struct weston_recorder *recorder)
+{
+	struct wcap_block_header_v3 header = recorder->block_header;
+	struct wcap_index_entry *entry;
+	static const uint8_t padding[8];
+	struct iovec v[3];
+
+	if (recorder->block_len == 0)
+		return;
+
+	if (header.flags & WCAP_BLOCK_KEYFRAME) {
+		entry = wl_array_add(&recorder->index, sizeof *entry);
+		if (entry) {
+			entry->offset = recorder->total;
+			entry->frame = header.frame;
+			entry->msecs = header.first_msecs;
+		}
+	}
+
+	header.size = recorder->block_len;
+	header.compressed_size = recorder->block_len;
+	v[1].iov_base = recorder->block;
+
+#ifdef HAVE_LZ4
+	if (recorder->compression == WCAP_COMPRESSION_LZ4) {
+		int len;
+
+		len = LZ4_compress_default((const char *) recorder->block,
+					   (char *) recorder->compressed,
+					   recorder->block_len,
+					   recorder->compressed_size);
+		/* Store blocks that do not shrink as they are */
+		if (len > 0 && (size_t) len < recorder->block_len) {
+			header.compressed_size = len;
+			v[1].iov_base = recorder->compressed;
+		}
+	}
+#endif
+
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_len = header.compressed_size;
+	v[2].iov_base = (void *) padding;
+	v[2].iov_len = -header.compressed_size & 7;
+	weston_recorder_write(recorder, v, 3);
+
+	recorder->block_len = 0;
+	recorder->block_header.frame += recorder->block_header.nframes;
+	recorder->block_header.nframes = 0;
+	recorder->block_header.flags = 0;
+}
+
+/* Close the file with the keyframe index, see wcap/README. */
+static void
+weston_recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_index_trailer trailer;
+	struct iovec v[2];
+
+	trailer.offset = recorder->total;
+	trailer.count = recorder->index.size / sizeof(struct wcap_index_entry);
+	trailer.nframes = recorder->count;
+	trailer.last_msecs = recorder->block_header.last_msecs;
+	trailer.magic = WCAP_INDEX_MAGIC;
+
+	v[0].iov_base = recorder->index.data;
+	v[0].iov_len = recorder->index.size;
+	v[1].iov_base = &trailer;
+	v[1].iov_len = sizeof trailer;
+	weston_recorder_write(recorder, v, 2);
+}
+
+/* Make room for size more bytes in the current block. */
+static int
+weston_recorder_reserve(struct weston_recorder *recorder, size_t size)
+{
+	size_t block_size;
+	uint8_t *block, *compressed;
+
+	if (recorder->block_len + size <= recorder->block_size)
+		return 0;
+
+	block_size = recorder->block_len + size;
+	block = realloc(recorder->block, block_size);
+	if (!block)
+		return -1;
+	recorder->block = block;
+	recorder->block_size = block_size;
+
+#ifdef HAVE_LZ4
+	if (recorder->compression == WCAP_COMPRESSION_LZ4) {
+		compressed = realloc(recorder->compressed,
+				     LZ4_compressBound(block_size));
+		if (!compressed)
+			return -1;
+		recorder->compressed = compressed;
+		recorder->compressed_size = LZ4_compressBound(block_size);
+	}
+#else
+	(void) compressed;
+#endif
+
+	return 0;
+}
+
+/* Encode one damage rectangle against the previous frame. */
+static uint32_t *
+weston_recorder_encode_rect(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame,
+			    pixman_box32_t *r, uint32_t *pixels, uint32_t *p)
+{
+	int j, k, width, height, run, y_orig;
+	uint32_t delta, prev, *d, *s, next;
+
+	width = r->x2 - r->x1;
+	height = r->y2 - r->y1;
+
+	run = prev = 0; /* quiet gcc */
+	for (j = 0; j < height; j++) {
+		if (frame->do_yflip)
+			s = pixels + width * j;
+		else
+			s = pixels + width * (height - j - 1);
+		y_orig = r->y2 - j - 1;
+		d = recorder->frame + recorder->stride * y_orig + r->x1;
+
+		for (k = 0; k < width; k++) {
+			next = *s++;
+			delta = component_delta(next, *d);
+			*d++ = next;
+			if (run == 0 || delta == prev) {
+				run++;
+			} else {
+				p = output_run(p, prev, run);
+				run = 1;
+			}
+			prev = delta;
+		}
+	}
+
+	return output_run(p, prev, run);
+}
+
+/* Store the captured rectangles in the encoder's copy of the frame,
+ * without encoding them. */
+static void
+weston_recorder_apply_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
+{
+	pixman_box32_t *r;
+	uint32_t *pixels = frame->pixels, *s, *d;
+	int i, j, width, height;
+
+	for (i = 0; i < frame->ncaptured; i++) {
+		r = &frame->rects[i];
+		width = r->x2 - r->x1;
+		height = r->y2 - r->y1;
+
+		for (j = 0; j < height; j++) {
+			if (frame->do_yflip)
+				s = pixels + width * j;
+			else
+				s = pixels + width * (height - j - 1);
+			d = recorder->frame +
+				recorder->stride * (r->y2 - j - 1) + r->x1;
+			memcpy(d, s, width * 4);
+		}
+
+		pixels += width * height;
+	}
+}
+
+/* Encode the whole of the current frame against a black one, bottom
+ * row first like any other rectangle. */
+static uint32_t *
+weston_recorder_encode_keyframe(struct weston_recorder *recorder,
+				int height, uint32_t *p)
+{
+	uint32_t delta, prev, *s, *end;
+	int j, run;
+
+	run = prev = 0; /* quiet gcc */
+	for (j = height - 1; j >= 0; j--) {
+		s = recorder->frame + recorder->stride * j;
+		end = s + recorder->stride;
+
+		while (s < end) {
+			delta = component_delta(*s++, 0);
+			if (run == 0 || delta == prev) {
+				run++;
+			} else {
+				p = output_run(p, prev, run);
+				run = 1;
+			}
+			prev = delta;
+		}
+	}
+
+	return output_run(p, prev, run);
+}
+
+/* Append a frame to the current block, in the wcap version 1 frame
+ * layout. Runs on the encoder thread. */
+static void
+weston_recorder_encode_frame(struct weston_recorder *recorder,
+			     struct weston_recorder_frame *frame)
+{
+	struct wcap_frame_header *header;
+	struct wcap_rectangle *rects;
+	uint32_t *pixels, *p;
+	int i, height, keyframe;
+	size_t size;
+
+	height = recorder->height;
+	keyframe = recorder->count == 0 ||
+		frame->msecs - recorder->key_msecs >=
+			RECORDER_KEYFRAME_INTERVAL_MS;
+
+	/* Keyframes start a block, that is where decoders can seek to. */
+	if (keyframe) {
+		weston_recorder_flush_block(recorder);
+		size = sizeof *header + sizeof *rects +
+			recorder->stride * height * 4;
+	} else {
+		size = sizeof *header + frame->ncaptured * sizeof *rects +
+			frame->filled * 4;
+	}
+
+	/* The run-length encoding never takes more than a word per pixel */
+	if (weston_recorder_reserve(recorder, size) < 0) {
+		recorder->error = ENOMEM;
+		return;
+	}
+
+	if (recorder->block_header.nframes == 0)
+		recorder->block_header.first_msecs = frame->msecs;
+	recorder->block_header.last_msecs = frame->msecs;
+	recorder->block_header.nframes++;
+
+	header = (void *) (recorder->block + recorder->block_len);
+	header->msecs = frame->msecs;
+
+	if (keyframe) {
+		weston_recorder_apply_frame(recorder, frame);
+
+		header->nrects = 1 | WCAP_FRAME_KEYFRAME;
+		rects = (void *) (header + 1);
+		rects->x1 = 0;
+		rects->y1 = 0;
+		rects->x2 = recorder->stride;
+		rects->y2 = height;
+		p = weston_recorder_encode_keyframe(recorder, height,
+						    (uint32_t *) (rects + 1));
+
+		recorder->block_header.flags |= WCAP_BLOCK_KEYFRAME;
+		recorder->key_msecs = frame->msecs;
+		goto done;
+	}
+
+	header->nrects = frame->ncaptured;
+
+	rects = (void *) (header + 1);
+	for (i = 0; i < frame->ncaptured; i++) {
+		rects[i].x1 = frame->rects[i].x1;
+		rects[i].y1 = frame->rects[i].y1;
+		rects[i].x2 = frame->rects[i].x2;
+		rects[i].y2 = frame->rects[i].y2;
+	}
+
+	p = (uint32_t *) (rects + frame->ncaptured);
+	pixels = frame->pixels;
+	for (i = 0; i < frame->ncaptured; i++) {
+		p = weston_recorder_encode_rect(recorder, frame,
+						&frame->rects[i], pixels, p);
+		pixels += (frame->rects[i].x2 - frame->rects[i].x1) *
+			  (frame->rects[i].y2 - frame->rects[i].y1);
+	}
+
+done:
+	recorder->block_len = (uint8_t *) p - recorder->block;
+	recorder->count++;
+
+	if (recorder->block_len >= RECORDER_BLOCK_SIZE)
+		weston_recorder_flush_block(recorder);
+}
+
+static void *
+weston_recorder_worker(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+
+	for (;;) {
+		while (wl_list_empty(&recorder->queue) && !recorder->stopping)
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+
+		/* Only leave once everything queued has been encoded */
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
+
+		weston_recorder_encode_frame(recorder, frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		wl_list_insert(&recorder->free_frames, &frame->link);
+	}
+
+	pthread_mutex_unlock(&recorder->mutex);
+
+	weston_recorder_flush_block(recorder);
+	weston_recorder_write_index(recorder);
+
+	return NULL;
+}
+
 static void
 weston_recorder_destroy(struct weston_recorder *recorder);
 
+static void
+weston_recorder_frame_finish(struct weston_recorder_frame *frame)
+{
+	struct weston_recorder *recorder = frame->recorder;
+
+	pthread_mutex_lock(&recorder->mutex);
+	if (frame->ncaptured > 0) {
+		wl_list_insert(recorder->queue.prev, &frame->link);
+		pthread_cond_signal(&recorder->queue_cond);
+	} else {
+		wl_list_insert(&recorder->free_frames, &frame->link);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	recorder->pending--;
+	if (recorder->destroying && recorder->pending == 0)
+		weston_recorder_destroy(recorder);
+}
+
+static void
+weston_recorder_read_done(void *data, void *pixels)
+{
+	struct weston_recorder_frame *frame = data;
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *r = &frame->rects[frame->next++];
+	size_t size = (r->x2 - r->x1) * (r->y2 - r->y1);
+
+	if (pixels) {
+		memcpy(frame->pixels + frame->filled, pixels, size * 4);
+		frame->filled += size;
+		frame->rects[frame->ncaptured++] = *r;
+	} else {
+		/* Try again with the next frame */
+		pixman_region32_union_rect(&recorder->carried_damage,
+					   &recorder->carried_damage,
+					   r->x1, r->y1,
+					   r->x2 - r->x1, r->y2 - r->y1);
+	}
+
+	if (frame->next == frame->nrects)
+		weston_recorder_frame_finish(frame);
+}
+
+/* Requesting the read back of rectangle i failed. Leave it and the
+ * following ones for the next frame. */
+static void
+weston_recorder_read_failed(struct weston_recorder_frame *frame, int i)
+{
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *r;
+	int j;
+
+	for (j = i; j < frame->nrects; j++) {
+		r = &frame->rects[j];
+		pixman_region32_union_rect(&recorder->carried_damage,
+					   &recorder->carried_damage,
+					   r->x1, r->y1,
+					   r->x2 - r->x1, r->y2 - r->y1);
+	}
+
+	frame->nrects = i;
+	if (frame->next == i)
+		weston_recorder_frame_finish(frame);
+}
+
+static struct weston_recorder_frame *
+weston_recorder_get_frame(struct weston_recorder *recorder)
+{
+	struct weston_recorder_frame *frame = NULL;
+
+	pthread_mutex_lock(&recorder->mutex);
+	if (!wl_list_empty(&recorder->free_frames)) {
+		frame = container_of(recorder->free_frames.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return frame;
+}
+
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -259,25 +896,16 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
-	pixman_box32_t *r;
+	struct weston_recorder_frame *frame;
+	pixman_box32_t *r, *rects;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
+	int i, n, y_orig;
 
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	if (recorder->destroying) {
+		if (recorder->pending == 0)
+			weston_recorder_destroy(recorder);
+		return;
+	}
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -289,88 +917,87 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->carried_damage);
+	pixman_region32_fini(&recorder->carried_damage);
+	pixman_region32_init(&recorder->carried_damage);
+
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	/* The encoder is behind, catch up with the next frame. */
+	frame = weston_recorder_get_frame(recorder);
+	if (!frame) {
+		pixman_region32_copy(&recorder->carried_damage,
+				     &transformed_damage);
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	if (frame->rects_size < n) {
+		rects = realloc(frame->rects, n * sizeof *rects);
+		if (!rects) {
+			weston_log("%s: out of memory\n", __func__);
+			pixman_region32_copy(&recorder->carried_damage,
+					     &transformed_damage);
+			pthread_mutex_lock(&recorder->mutex);
+			wl_list_insert(&recorder->free_frames, &frame->link);
+			pthread_mutex_unlock(&recorder->mutex);
+			goto out;
+		}
+		frame->rects = rects;
+		frame->rects_size = n;
+	}
+
+	frame->msecs = output->frame_time;
+	frame->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	frame->nrects = n;
+	frame->next = 0;
+	frame->ncaptured = 0;
+	frame->filled = 0;
+	memcpy(frame->rects, r, n * sizeof *r);
+	recorder->pending++;
 
 	for (i = 0; i < n; i++) {
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
+		r = &frame->rects[i];
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
+		if (frame->do_yflip)
+			y_orig = output->current_mode->height - r->y2;
 		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
+			y_orig = r->y1;
+
+		if (weston_output_read_pixels_async(output,
+				compositor->read_format,
+				r->x1, y_orig, r->x2 - r->x1, r->y2 - r->y1,
+				weston_recorder_read_done, frame) < 0) {
+			weston_log("%s: failed to read back frame\n",
+				   __func__);
+			weston_recorder_read_failed(frame, i);
+			break;
 		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
-
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
 	}
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
-
-	if (recorder->destroying)
-		weston_recorder_destroy(recorder);
 }
 
 static void
 weston_recorder_free(struct weston_recorder *recorder)
 {
+	int i;
+
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
-	free(recorder->rect);
+	for (i = 0; i < RECORDER_FRAME_COUNT; i++) {
+		free(recorder->frames[i].pixels);
+		free(recorder->frames[i].rects);
+	}
+	pixman_region32_fini(&recorder->carried_damage);
+	wl_array_release(&recorder->index);
+	free(recorder->compressed);
+	free(recorder->block);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -380,11 +1007,11 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
-	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	struct weston_recorder_frame *frame;
+	int i, stride, size;
+	struct wcap_header header;
+	struct wcap_header_v2 header_v2;
+	struct iovec v[2];
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -392,26 +1019,35 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
+	pixman_region32_init(&recorder->carried_damage);
+	wl_array_init(&recorder->index);
+	wl_list_init(&recorder->free_frames);
+	wl_list_init(&recorder->queue);
+
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->stride = stride;
+	recorder->height = output->current_mode->height;
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if (recorder->frame == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
+	for (i = 0; i < RECORDER_FRAME_COUNT; i++) {
+		frame = &recorder->frames[i];
+		frame->recorder = recorder;
+		frame->pixels = malloc(size);
+		if (frame->pixels == NULL) {
 			weston_log("%s: out of memory\n", __func__);
 			goto err_recorder;
 		}
+		wl_list_insert(&recorder->free_frames, &frame->link);
 	}
 
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -426,6 +1062,17 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
+#ifdef HAVE_LZ4
+	recorder->compression = WCAP_COMPRESSION_LZ4;
+#else
+	recorder->compression = WCAP_COMPRESSION_NONE;
+#endif
+
+	if (weston_recorder_reserve(recorder, RECORDER_BLOCK_SIZE) < 0) {
+		weston_log("%s: out of memory\n", __func__);
+		goto err_recorder;
+	}
+
 	recorder->fd = open(filename,
 			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 
@@ -436,7 +1083,24 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 
 	header.width = output->current_mode->width;
 	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	header_v2.version = WCAP_VERSION;
+	header_v2.compression = recorder->compression;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = &header_v2;
+	v[1].iov_len = sizeof header_v2;
+	weston_recorder_write(recorder, v, 2);
+
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+	if (pthread_create(&recorder->worker, NULL,
+			   weston_recorder_worker, recorder) != 0) {
+		weston_log("failed to start recorder thread: %m\n");
+		pthread_cond_destroy(&recorder->queue_cond);
+		pthread_mutex_destroy(&recorder->mutex);
+		close(recorder->fd);
+		goto err_recorder;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
@@ -454,8 +1118,25 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	recorder->output->disable_planes--;
+
+	/* Wait for the encoder to write out everything captured */
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->stopping = 1;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	pthread_join(recorder->worker, NULL);
+	pthread_cond_destroy(&recorder->queue_cond);
+	pthread_mutex_destroy(&recorder->mutex);
+
+	if (recorder->error)
+		weston_log("recorder failed to write the file: %s\n",
+			   strerror(recorder->error));
+	weston_log("recorder stopped, total file size %dM, %d frames\n",
+		   (int) (recorder->total / (1024 * 1024)), recorder->count);
+
+	close(recorder->fd);
 	weston_recorder_free(recorder);
 }
 
@@ -480,8 +1161,7 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder\n");
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
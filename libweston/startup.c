@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "timeline.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/*
+ * Startup phases, from main() to the first frame on screen. Each mark
+ * ends the phase named after it, which runs from the previous mark.
+ * There is only one startup per process, so the table is global like
+ * the timeline's.
+ */
+
+#define STARTUP_PREFIX "startup_"
+
+struct startup_mark {
+	const char *name;
+	struct timespec time;
+};
+
+struct startup_extra {
+	const char *name;
+	int64_t nsec;
+};
+
+static struct {
+	struct startup_mark marks[24];
+	unsigned num_marks;
+	struct startup_extra extras[8];
+	unsigned num_extras;
+	bool done;
+} startup_;
+
+/** Mark the end of a startup phase
+ *
+ * \param name A string literal starting with "startup_"; it is also the
+ * name of the timeline point fired here.
+ *
+ * Does nothing once the first frame has been presented.
+ */
+WL_EXPORT void
+weston_startup_mark(const char *name)
+{
+	struct startup_mark *mark;
+
+	if (startup_.done)
+		return;
+
+	TL_POINT(name, TLP_END);
+
+	if (startup_.num_marks == ARRAY_LENGTH(startup_.marks))
+		return;
+
+	mark = &startup_.marks[startup_.num_marks++];
+	mark->name = name;
+	clock_gettime(CLOCK_MONOTONIC, &mark->time);
+}
+
+/** Add the time since \p since to a startup cost
+ *
+ * \param name A string literal; calls with the same one add up.
+ * \param since When the work started, in CLOCK_MONOTONIC.
+ *
+ * For work that is done in pieces and on demand, like compiling
+ * shaders, so that it does not fit a phase of its own.
+ */
+WL_EXPORT void
+weston_startup_add_time(const char *name, const struct timespec *since)
+{
+	struct startup_extra *extra = NULL;
+	struct timespec now;
+	unsigned i;
+
+	if (startup_.done)
+		return;
+
+	for (i = 0; i < startup_.num_extras; i++)
+		if (strcmp(startup_.extras[i].name, name) == 0)
+			extra = &startup_.extras[i];
+
+	if (!extra) {
+		if (startup_.num_extras == ARRAY_LENGTH(startup_.extras))
+			return;
+		extra = &startup_.extras[startup_.num_extras++];
+		extra->name = name;
+		extra->nsec = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	extra->nsec += timespec_sub_to_nsec(&now, since);
+}
+
+static double
+nsec_to_msec(int64_t nsec)
+{
+	return nsec / 1000000.0;
+}
+
+/** Close the startup with the first frame, and log where the time went
+ *
+ * One line, "startup timing on <output> (ms):" followed by name=value
+ * for each phase, the total and the extra costs, for scripts to pick
+ * apart.
+ */
+void
+weston_startup_finish(struct weston_output *output)
+{
+	const struct startup_mark *prev, *mark;
+	char line[1024];
+	size_t len = 0;
+	unsigned i;
+
+	if (startup_.done)
+		return;
+
+	weston_startup_mark(STARTUP_PREFIX "first_frame");
+	startup_.done = true;
+
+	if (startup_.num_marks < 2)
+		return;
+
+	for (i = 1; i < startup_.num_marks && len < sizeof line; i++) {
+		prev = &startup_.marks[i - 1];
+		mark = &startup_.marks[i];
+		len += snprintf(line + len, sizeof line - len, " %s=%.2f",
+				mark->name + strlen(STARTUP_PREFIX),
+				nsec_to_msec(timespec_sub_to_nsec(&mark->time,
+								  &prev->time)));
+	}
+
+	mark = &startup_.marks[startup_.num_marks - 1];
+	if (len < sizeof line)
+		len += snprintf(line + len, sizeof line - len, " total=%.2f",
+				nsec_to_msec(timespec_sub_to_nsec(&mark->time,
+						&startup_.marks[0].time)));
+
+	for (i = 0; i < startup_.num_extras && len < sizeof line; i++)
+		len += snprintf(line + len, sizeof line - len, " %s=%.2f",
+				startup_.extras[i].name,
+				nsec_to_msec(startup_.extras[i].nsec));
+
+	weston_log("startup timing on %s (ms):%s\n", output->name, line);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_FORMAT_H
+#define WESTON_TIMELINE_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Binary timeline dumps, as written by weston_timeline_ring_dump() and
+ * turned back into the JSON timeline format by weston-timeline-convert.
+ *
+ * A dump is a struct timeline_file_header followed by records, each
+ * starting with a struct timeline_record. Record sizes are a multiple
+ * of 8 bytes, and all values are in host byte order.
+ *
+ * Point names are interned: every name is written once, at the start
+ * of the dump. Objects are described before the first point that
+ * refers to them; once the ring overwrites a description, it is written
+ * again on the object's next use, so the oldest points of a dump may
+ * come before the description of their objects.
+ */
+
+#define TIMELINE_FILE_MAGIC 0x4c544e57 /* "WNTL" */
+#define TIMELINE_FILE_VERSION 1
+
+/* String length of a missing name or description, printed as null */
+#define TIMELINE_STRING_NULL 0xffffffff
+
+struct timeline_file_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+enum timeline_record_type {
+	/** Unused space to skip */
+	TIMELINE_RECORD_PAD = 0,
+	/** struct timeline_record_string, giving a point name */
+	TIMELINE_RECORD_NAME,
+	/** struct timeline_record_string, describing a weston_output */
+	TIMELINE_RECORD_OUTPUT,
+	/** struct timeline_record_string, describing a weston_surface */
+	TIMELINE_RECORD_SURFACE,
+	/** struct timeline_record_point */
+	TIMELINE_RECORD_POINT,
+};
+
+struct timeline_record {
+	uint32_t type;
+	/* In bytes, including this header */
+	uint32_t size;
+};
+
+struct timeline_record_string {
+	struct timeline_record base;
+	/* Name or object id; 0 is invalid */
+	uint32_t id;
+	/* Id of the main surface of a sub-surface, otherwise 0 */
+	uint32_t main_surface;
+	/* Excluding the terminating NUL, or TIMELINE_STRING_NULL */
+	uint32_t length;
+	char string[];
+};
+
+struct timeline_record_arg {
+	/* enum timeline_type */
+	uint32_t type;
+	/* Object id of TLT_OUTPUT and TLT_SURFACE */
+	uint32_t id;
+	/* Nanoseconds of TLT_VBLANK, TLT_GPU and TLT_INPUT, the value of
+	 * TLT_PIXELS and TLT_MSC */
+	uint64_t value;
+};
+
+struct timeline_record_point {
+	struct timeline_record base;
+	uint32_t name;
+	uint32_t padding;
+	/* Nanoseconds on CLOCK_MONOTONIC */
+	uint64_t time;
+	/* As many as fit in base.size */
+	struct timeline_record_arg args[];
+};
+
+#endif /* WESTON_TIMELINE_FORMAT_H */
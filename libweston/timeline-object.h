@@ -27,6 +27,8 @@
 #ifndef WESTON_TIMELINE_OBJECT_H
 #define WESTON_TIMELINE_OBJECT_H
 
+#include <stdint.h>
+
 /*
  * This struct can be embedded in objects related to timeline output.
  * It must be initialized to all-zero. Afterwards, the timeline code
@@ -50,6 +52,18 @@ struct weston_timeline_object {
 	 * events.
 	 */
 	unsigned force_refresh;
+
+	/*
+	 * Object id in the binary timeline ring, which lives as long as
+	 * the compositor and so has ids of its own. 0 is invalid.
+	 */
+	unsigned ring_id;
+
+	/*
+	 * Ring position of the last object description. Once the ring
+	 * has overwritten it, the description is written again.
+	 */
+	uint64_t ring_pos;
 };
 
 #endif /* WESTON_TIMELINE_OBJECT_H */
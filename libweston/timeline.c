@@ -27,25 +27,76 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
+#include "timeline-format.h"
 #include "compositor.h"
 #include "file-util.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Arguments beyond this are dropped from ring records */
+#define TIMELINE_RING_MAX_ARGS 8
+
+/*
+ * Always-on binary timeline: records in the format of timeline-format.h
+ * are written into memory and only reach a file when a snapshot is
+ * asked for, so writing a point costs no syscalls. Records never wrap
+ * around the end of the ring; the space left there is padded instead.
+ */
+struct timeline_ring {
+	uint8_t *data;
+	/* A power of two */
+	size_t size;
+
+	/* Bytes ever written, and the position of the oldest record
+	 * still in the ring. These never go back, so positions from an
+	 * earlier ring are always older than its tail. */
+	uint64_t head;
+	uint64_t tail;
+
+	/* Interned point names, indexed by name id - 1 */
+	struct wl_array names;
+
+	int snapshot_seconds;
+	struct wl_listener compositor_destroy_listener;
+};
 
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+	struct timeline_ring ring;
+
+	/* Gets the same JSON as the file, while subscribed to */
+	struct weston_log_scope *scope;
+	struct wl_listener scope_listener;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
+static void
+timeline_update_enabled(void)
+{
+	weston_timeline_enabled_ = timeline_.file || timeline_.ring.data ||
+		weston_log_scope_has_subscribers(timeline_.scope);
+}
+
+static void
+timeline_new_series(void)
+{
+	if (++timeline_.series == 0)
+		++timeline_.series;
+}
+
 static int
 weston_timeline_do_open(void)
 {
@@ -82,10 +133,17 @@ timeline_notify_destroy(struct wl_listener *listener, void *data)
 	weston_timeline_close();
 }
 
+/** Whether the JSON timeline log is being written */
+int
+weston_timeline_is_open(void)
+{
+	return timeline_.file != NULL;
+}
+
 void
 weston_timeline_open(struct weston_compositor *compositor)
 {
-	if (weston_timeline_enabled_)
+	if (timeline_.file)
 		return;
 
 	if (weston_timeline_do_open() < 0)
@@ -95,27 +153,51 @@ weston_timeline_open(struct weston_compositor *compositor)
 	wl_signal_add(&compositor->destroy_signal,
 		      &timeline_.compositor_destroy_listener);
 
-	if (++timeline_.series == 0)
-		++timeline_.series;
-
-	weston_timeline_enabled_ = 1;
+	timeline_new_series();
+	timeline_update_enabled();
 }
 
 void
 weston_timeline_close(void)
 {
-	if (!weston_timeline_enabled_)
+	if (!timeline_.file)
 		return;
 
-	weston_timeline_enabled_ = 0;
-
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
 	fclose(timeline_.file);
 	timeline_.file = NULL;
+	timeline_update_enabled();
 	weston_log("Timeline log file closed.\n");
 }
 
+/* Objects are described again for a new subscriber, which has not
+ * seen them yet. */
+static void
+timeline_scope_subscription(struct wl_listener *listener, void *data)
+{
+	if (weston_log_scope_has_subscribers(timeline_.scope))
+		timeline_new_series();
+
+	timeline_update_enabled();
+}
+
+/** Offer the JSON timeline as the "timeline" log scope */
+void
+weston_timeline_create_scope(void)
+{
+	if (timeline_.scope)
+		return;
+
+	timeline_.scope = weston_log_scope_get("timeline");
+	if (!timeline_.scope)
+		return;
+
+	timeline_.scope_listener.notify = timeline_scope_subscription;
+	weston_log_scope_add_subscription_listener(timeline_.scope,
+						   &timeline_.scope_listener);
+}
+
 struct timeline_emit_context {
 	FILE *cur;
 	FILE *out;
@@ -143,8 +225,10 @@ check_series(struct timeline_emit_context *ctx,
 		return 1;
 	}
 
+	/* The ring goes second and clears it, when it is on */
 	if (to->force_refresh) {
-		to->force_refresh = 0;
+		if (!timeline_.ring.data)
+			to->force_refresh = 0;
 		return 1;
 	}
 
@@ -232,40 +316,95 @@ emit_vblank_timestamp(struct timeline_emit_context *ctx, void *obj)
 	return 1;
 }
 
+static int
+emit_pixel_count(struct timeline_emit_context *ctx, void *obj)
+{
+	uint64_t *pixels = obj;
+
+	fprintf(ctx->cur, "\"pixels\":%" PRIu64, *pixels);
+
+	return 1;
+}
+
+static int
+emit_gpu_timestamp(struct timeline_emit_context *ctx, void *obj)
+{
+	struct timespec *ts = obj;
+
+	fprintf(ctx->cur, "\"gpu\":[%" PRId64 ", %ld]",
+		(int64_t)ts->tv_sec, ts->tv_nsec);
+
+	return 1;
+}
+
+static int
+emit_input_timestamp(struct timeline_emit_context *ctx, void *obj)
+{
+	struct timespec *ts = obj;
+
+	fprintf(ctx->cur, "\"input\":[%" PRId64 ", %ld]",
+		(int64_t)ts->tv_sec, ts->tv_nsec);
+
+	return 1;
+}
+
+static int
+emit_msc(struct timeline_emit_context *ctx, void *obj)
+{
+	uint64_t *msc = obj;
+
+	fprintf(ctx->cur, "\"msc\":%" PRIu64, *msc);
+
+	return 1;
+}
+
 typedef int (*type_func)(struct timeline_emit_context *ctx, void *obj);
 
 static const type_func type_dispatch[] = {
 	[TLT_OUTPUT] = emit_weston_output,
 	[TLT_SURFACE] = emit_weston_surface,
 	[TLT_VBLANK] = emit_vblank_timestamp,
+	[TLT_PIXELS] = emit_pixel_count,
+	[TLT_GPU] = emit_gpu_timestamp,
+	[TLT_MSC] = emit_msc,
+	[TLT_INPUT] = emit_input_timestamp,
 };
 
-WL_EXPORT void
-weston_timeline_point(const char *name, ...)
+static void
+timeline_log_point(const char *name, const struct timespec *ts,
+		   va_list argp)
 {
-	va_list argp;
-	struct timespec ts;
 	enum timeline_type otype;
 	void *obj;
 	char buf[512];
+	char *tee_buf = NULL;
+	size_t tee_len = 0;
 	struct timeline_emit_context ctx;
-
-	clock_gettime(timeline_.clk_id, &ts);
-
-	ctx.out = timeline_.file;
+	bool tee = weston_log_scope_has_subscribers(timeline_.scope);
+
+	/* With a subscriber, the entry and any object descriptions are
+	 * put together in memory and then handed to both. */
+	if (tee)
+		ctx.out = open_memstream(&tee_buf, &tee_len);
+	else
+		ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
 
-	if (!ctx.cur) {
+	if (!ctx.cur || !ctx.out) {
 		weston_log("Timeline error in fmemopen, closing.\n");
+		if (ctx.cur)
+			fclose(ctx.cur);
+		if (tee && ctx.out)
+			fclose(ctx.out);
+		free(tee_buf);
 		weston_timeline_close();
 		return;
 	}
 
 	fprintf(ctx.cur, "{ \"T\":[%" PRId64 ", %ld], \"N\":\"%s\"",
-		(int64_t)ts.tv_sec, ts.tv_nsec, name);
+		(int64_t)ts->tv_sec, ts->tv_nsec, name);
 
-	va_start(argp, name);
 	while (1) {
 		otype = va_arg(argp, enum timeline_type);
 		if (otype == TLT_END)
@@ -277,7 +416,6 @@ weston_timeline_point(const char *name, ...)
 			type_dispatch[otype](&ctx, obj);
 		}
 	}
-	va_end(argp);
 
 	fprintf(ctx.cur, " }\n");
 	fflush(ctx.cur);
@@ -289,4 +427,381 @@ weston_timeline_point(const char *name, ...)
 	}
 
 	fclose(ctx.cur);
+
+	if (!tee)
+		return;
+
+	fclose(ctx.out);
+	if (timeline_.file)
+		fwrite(tee_buf, 1, tee_len, timeline_.file);
+	weston_log_scope_write(timeline_.scope, tee_buf, tee_len);
+	free(tee_buf);
+}
+
+static struct timeline_record *
+timeline_ring_claim(struct timeline_ring *ring, uint32_t type, size_t size)
+{
+	struct timeline_record *record;
+
+	while (ring->head + size > ring->tail + ring->size) {
+		record = (void *) &ring->data[ring->tail & (ring->size - 1)];
+		ring->tail += record->size;
+	}
+
+	record = (void *) &ring->data[ring->head & (ring->size - 1)];
+	record->type = type;
+	record->size = size;
+	ring->head += size;
+
+	return record;
+}
+
+static void *
+timeline_ring_reserve(struct timeline_ring *ring, uint32_t type, size_t size)
+{
+	size_t offset = ring->head & (ring->size - 1);
+
+	size = (size + 7) & ~(size_t) 7;
+	if (offset + size > ring->size)
+		timeline_ring_claim(ring, TIMELINE_RECORD_PAD,
+				    ring->size - offset);
+
+	return timeline_ring_claim(ring, type, size);
+}
+
+static void
+timeline_ring_write_string(struct timeline_ring *ring, uint32_t type,
+			   struct weston_timeline_object *to,
+			   uint32_t main_surface, const char *str)
+{
+	struct timeline_record_string *record;
+	size_t length = str ? strlen(str) : 0;
+
+	record = timeline_ring_reserve(ring, type,
+				       sizeof *record + length + 1);
+	record->id = to->ring_id;
+	record->main_surface = main_surface;
+	record->length = str ? length : TIMELINE_STRING_NULL;
+	memcpy(record->string, str ? str : "", length + 1);
+
+	to->ring_pos = ring->head - record->base.size;
+}
+
+static int
+timeline_ring_check_object(struct timeline_ring *ring,
+			   struct weston_timeline_object *to)
+{
+	/* Also when the last description has been overwritten */
+	int describe = to->force_refresh || to->ring_pos < ring->tail;
+
+	to->force_refresh = 0;
+
+	if (to->ring_id == 0) {
+		to->ring_id = timeline_new_id();
+		describe = 1;
+	}
+
+	return describe;
+}
+
+static uint32_t
+timeline_ring_describe_output(struct timeline_ring *ring,
+			      struct weston_output *o)
+{
+	if (timeline_ring_check_object(ring, &o->timeline))
+		timeline_ring_write_string(ring, TIMELINE_RECORD_OUTPUT,
+					   &o->timeline, 0, o->name);
+
+	return o->timeline.ring_id;
+}
+
+static uint32_t
+timeline_ring_describe_surface(struct timeline_ring *ring,
+			       struct weston_surface *s)
+{
+	struct weston_surface *mains;
+	uint32_t main_id = 0;
+	char d[512];
+
+	if (!timeline_ring_check_object(ring, &s->timeline))
+		return s->timeline.ring_id;
+
+	mains = weston_surface_get_main_surface(s);
+	if (mains != s)
+		main_id = timeline_ring_describe_surface(ring, mains);
+
+	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
+		d[0] = '\0';
+
+	timeline_ring_write_string(ring, TIMELINE_RECORD_SURFACE,
+				   &s->timeline, main_id, d[0] ? d : NULL);
+
+	return s->timeline.ring_id;
+}
+
+static uint32_t
+timeline_ring_intern_name(struct timeline_ring *ring, const char *name)
+{
+	const char **names = ring->names.data;
+	size_t count = ring->names.size / sizeof *names;
+	const char **p;
+	size_t i;
+
+	/* Names are string literals, so comparing pointers is enough;
+	 * a name seen through two pointers just gets two ids. */
+	for (i = 0; i < count; i++)
+		if (names[i] == name)
+			return i + 1;
+
+	p = wl_array_add(&ring->names, sizeof *p);
+	if (!p)
+		return 0;
+	*p = name;
+
+	return count + 1;
+}
+
+static void
+timeline_ring_point(struct timeline_ring *ring, const char *name,
+		    const struct timespec *ts, va_list argp)
+{
+	struct timeline_record_arg args[TIMELINE_RING_MAX_ARGS];
+	struct timeline_record_point *point;
+	enum timeline_type otype;
+	void *obj;
+	unsigned n = 0;
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		if (n == ARRAY_LENGTH(args))
+			continue;
+
+		args[n].id = 0;
+		args[n].value = 0;
+		switch (otype) {
+		case TLT_OUTPUT:
+			args[n].id = timeline_ring_describe_output(ring, obj);
+			break;
+		case TLT_SURFACE:
+			args[n].id = timeline_ring_describe_surface(ring, obj);
+			break;
+		case TLT_VBLANK:
+		case TLT_GPU:
+		case TLT_INPUT:
+			args[n].value = timespec_to_nsec(obj);
+			break;
+		case TLT_PIXELS:
+		case TLT_MSC:
+			args[n].value = *(uint64_t *) obj;
+			break;
+		default:
+			continue;
+		}
+		args[n++].type = otype;
+	}
+
+	point = timeline_ring_reserve(ring, TIMELINE_RECORD_POINT,
+				      sizeof *point + n * sizeof args[0]);
+	point->name = timeline_ring_intern_name(ring, name);
+	point->padding = 0;
+	point->time = timespec_to_nsec(ts);
+	memcpy(point->args, args, n * sizeof args[0]);
+}
+
+WL_EXPORT void
+weston_timeline_point(const char *name, ...)
+{
+	va_list argp, ring_argp;
+	struct timespec ts;
+
+	clock_gettime(timeline_.clk_id, &ts);
+
+	va_start(argp, name);
+	va_copy(ring_argp, argp);
+
+	if (timeline_.file || weston_log_scope_has_subscribers(timeline_.scope))
+		timeline_log_point(name, &ts, argp);
+	if (timeline_.ring.data)
+		timeline_ring_point(&timeline_.ring, name, &ts, ring_argp);
+
+	va_end(ring_argp);
+	va_end(argp);
+}
+
+static void
+timeline_ring_close(struct timeline_ring *ring)
+{
+	wl_list_remove(&ring->compositor_destroy_listener.link);
+	munmap(ring->data, ring->size);
+	ring->data = NULL;
+	wl_array_release(&ring->names);
+	timeline_update_enabled();
+}
+
+static void
+timeline_ring_notify_destroy(struct wl_listener *listener, void *data)
+{
+	timeline_ring_close(&timeline_.ring);
+}
+
+/** Start recording the timeline into memory
+ *
+ * \param compositor The compositor, whose destruction stops recording.
+ * \param size The size of the ring in bytes, rounded up to a power of
+ * two; the oldest records are overwritten once it is full.
+ * \param snapshot_seconds How far back weston_timeline_ring_dump()
+ * goes, or 0 for everything still in the ring.
+ * \return 0 on success, -1 on failure.
+ *
+ * The ring is cheap enough to keep on all the time, alongside the JSON
+ * log, and is only written out to a file on weston_timeline_ring_dump().
+ */
+WL_EXPORT int
+weston_timeline_ring_open(struct weston_compositor *compositor,
+			  size_t size, int snapshot_seconds)
+{
+	struct timeline_ring *ring = &timeline_.ring;
+	size_t ring_size = 64 * 1024;
+
+	if (ring->data)
+		return 0;
+
+	while (ring_size < size)
+		ring_size *= 2;
+
+	/* Populated up front, so points don't fault pages in */
+	ring->data = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ring->data == MAP_FAILED) {
+		ring->data = NULL;
+		weston_log("Cannot allocate timeline ring: %m\n");
+		return -1;
+	}
+
+	ring->size = ring_size;
+	ring->tail = ring->head;
+	ring->snapshot_seconds = snapshot_seconds;
+	wl_array_init(&ring->names);
+
+	ring->compositor_destroy_listener.notify = timeline_ring_notify_destroy;
+	wl_signal_add(&compositor->destroy_signal,
+		      &ring->compositor_destroy_listener);
+
+	timeline_update_enabled();
+
+	weston_log("Recording timeline into a %zu kB ring\n",
+		   ring_size / 1024);
+
+	return 0;
+}
+
+static int
+timeline_ring_dump_names(struct timeline_ring *ring, FILE *fp)
+{
+	const char **name;
+	struct timeline_record_string record;
+	uint32_t id = 0;
+	size_t length;
+	static const char padding[8];
+	size_t size;
+
+	wl_array_for_each(name, &ring->names) {
+		length = strlen(*name);
+		size = (sizeof record + length + 1 + 7) & ~(size_t) 7;
+
+		record.base.type = TIMELINE_RECORD_NAME;
+		record.base.size = size;
+		record.id = ++id;
+		record.main_surface = 0;
+		record.length = length;
+
+		if (fwrite(&record, sizeof record, 1, fp) != 1 ||
+		    fwrite(*name, 1, length, fp) != length ||
+		    fwrite(padding, 1, size - sizeof record - length, fp) !=
+		    size - sizeof record - length)
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Write the recent part of the timeline ring to a file
+ *
+ * \return 0 on success, -1 if the ring is not on or writing failed.
+ *
+ * Writes the points of the last snapshot_seconds passed to
+ * weston_timeline_ring_open() to a new weston-timeline-*.bin in the
+ * current directory, which weston-timeline-convert turns into the
+ * usual JSON timeline.
+ */
+WL_EXPORT int
+weston_timeline_ring_dump(void)
+{
+	struct timeline_ring *ring = &timeline_.ring;
+	const char *prefix = "weston-timeline-";
+	const char *suffix = ".bin";
+	struct timeline_file_header header;
+	struct timeline_record *record;
+	struct timeline_record_point *point;
+	struct timespec now;
+	uint64_t pos, window, since = 0;
+	char fname[1000];
+	FILE *fp;
+	int ret = 0;
+
+	if (!ring->data)
+		return -1;
+
+	clock_gettime(timeline_.clk_id, &now);
+	window = (uint64_t) ring->snapshot_seconds * NSEC_PER_SEC;
+	if (window > 0 && (uint64_t) timespec_to_nsec(&now) > window)
+		since = timespec_to_nsec(&now) - window;
+
+	fp = file_create_dated(prefix, suffix, fname, sizeof(fname));
+	if (!fp) {
+		weston_log("Cannot open '%s*%s' for writing: %s\n",
+			   prefix, suffix,
+			   errno == ETIME ? "failure in datetime formatting" :
+			   strerror(errno));
+		return -1;
+	}
+
+	header.magic = TIMELINE_FILE_MAGIC;
+	header.version = TIMELINE_FILE_VERSION;
+	if (fwrite(&header, sizeof header, 1, fp) != 1 ||
+	    timeline_ring_dump_names(ring, fp) < 0)
+		ret = -1;
+
+	/* Object descriptions are kept regardless of their age, for the
+	 * points that follow them. */
+	for (pos = ring->tail; ret == 0 && pos < ring->head;
+	     pos += record->size) {
+		record = (void *) &ring->data[pos & (ring->size - 1)];
+		if (record->type == TIMELINE_RECORD_PAD)
+			continue;
+
+		if (record->type == TIMELINE_RECORD_POINT) {
+			point = (struct timeline_record_point *) record;
+			if (point->time < since)
+				continue;
+		}
+
+		if (fwrite(record, record->size, 1, fp) != 1)
+			ret = -1;
+	}
+
+	if (fclose(fp) != 0)
+		ret = -1;
+
+	if (ret < 0)
+		weston_log("Failed to write timeline snapshot '%s': %m\n",
+			   fname);
+	else
+		weston_log("Wrote timeline snapshot '%s'\n", fname);
+
+	return ret;
 }
@@ -37,11 +37,21 @@ weston_timeline_open(struct weston_compositor *compositor);
 void
 weston_timeline_close(void);
 
+int
+weston_timeline_is_open(void);
+
+void
+weston_timeline_create_scope(void);
+
 enum timeline_type {
 	TLT_END = 0,
 	TLT_OUTPUT,
 	TLT_SURFACE,
 	TLT_VBLANK,
+	TLT_PIXELS,
+	TLT_GPU,
+	TLT_MSC,
+	TLT_INPUT,
 };
 
 #define TYPEVERIFY(type, arg) ({			\
@@ -53,8 +63,30 @@ enum timeline_type {
 #define TLP_OUTPUT(o) TLT_OUTPUT, TYPEVERIFY(struct weston_output *, (o))
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_PIXELS(p) TLT_PIXELS, TYPEVERIFY(const uint64_t *, (p))
+#define TLP_GPU(t) TLT_GPU, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_MSC(m) TLT_MSC, TYPEVERIFY(const uint64_t *, (m))
+#define TLP_INPUT(t) TLT_INPUT, TYPEVERIFY(const struct timespec *, (t))
+
+/* Static probes for perf, bpftrace and SystemTap, in the "weston"
+ * provider. Each one is a single nop until a tracer attaches, so they
+ * stay compiled in. */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define WESTON_PROBE(name, ...) STAP_PROBEV(weston, name, ##__VA_ARGS__)
+#else
+#define WESTON_PROBE(name, ...) do { } while (0)
+#endif
+
+/* Every timeline point also fires weston:timeline, with the point's
+ * name, and the type and pointer of its first object (TLT_END and NULL
+ * if there is none). */
+#define TL_PROBE_(name, type, obj, ...) \
+	WESTON_PROBE(timeline, name, type, obj)
+#define TL_PROBE(...) TL_PROBE_(__VA_ARGS__)
 
 #define TL_POINT(...) do { \
+	TL_PROBE(__VA_ARGS__); \
 	if (weston_timeline_enabled_) \
 		weston_timeline_point(__VA_ARGS__); \
 } while (0)
@@ -0,0 +1,826 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * H.264 recorder using a V4L2 memory-to-memory encoder, as found on
+ * most ARM SoCs and some desktop GPUs. The encoder is fed XRGB8888
+ * frames on its OUTPUT queue, either by importing the backend's
+ * dmabuf directly or by copying read back pixels into buffers mapped
+ * from the device, and the bitstream dequeued from the CAPTURE queue
+ * is written to the file as is.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/videodev2.h>
+
+#include "compositor.h"
+#include "recorder-encoder.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+#define V4L2_RECORDER_MAX_DEVICES	64
+#define V4L2_RECORDER_OUTPUT_BUFFERS	4
+#define V4L2_RECORDER_CAPTURE_BUFFERS	4
+#define V4L2_RECORDER_TIMEOUT_MS	1000
+
+struct v4l2_recorder_buffer {
+	void *data;
+	size_t length;
+	int dmabuf_fd;
+	int queued;
+};
+
+struct v4l2_recorder {
+	struct recorder_encoder base;
+
+	int fd, output_fd;
+	int width, height;
+	enum v4l2_memory memory;
+	uint32_t pixelformat;
+	uint32_t bytesperline;
+	int streaming;
+
+	int error;
+	int destroying;
+	pthread_t worker_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t input_cond;
+
+	struct {
+		int valid;
+		int dmabuf_fd;
+		int stride;
+		/* Memory input is double buffered so that the compositor
+		 * can copy the next frame while the worker uploads this
+		 * one. */
+		uint8_t *data, *spare;
+	} input;
+
+	struct v4l2_recorder_buffer output[V4L2_RECORDER_OUTPUT_BUFFERS];
+	struct v4l2_recorder_buffer capture[V4L2_RECORDER_CAPTURE_BUFFERS];
+	unsigned int output_count, capture_count;
+};
+
+static int
+xioctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int
+device_has_format(int fd, enum v4l2_buf_type type, uint32_t pixelformat)
+{
+	struct v4l2_fmtdesc desc;
+
+	memset(&desc, 0, sizeof desc);
+	desc.type = type;
+
+	while (xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0) {
+		if (desc.pixelformat == pixelformat)
+			return 1;
+		desc.index++;
+	}
+
+	return 0;
+}
+
+static int
+set_output_format(struct v4l2_recorder *r, uint32_t pixelformat,
+		  uint32_t stride)
+{
+	struct v4l2_format fmt;
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	fmt.fmt.pix_mp.width = r->width;
+	fmt.fmt.pix_mp.height = r->height;
+	fmt.fmt.pix_mp.pixelformat = pixelformat;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = stride;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = stride * r->height;
+
+	if (xioctl(r->fd, VIDIOC_S_FMT, &fmt) < 0)
+		return -1;
+
+	/* Drivers silently substitute what they can do instead */
+	if (fmt.fmt.pix_mp.pixelformat != pixelformat ||
+	    fmt.fmt.pix_mp.width != (uint32_t) r->width ||
+	    fmt.fmt.pix_mp.height != (uint32_t) r->height ||
+	    fmt.fmt.pix_mp.num_planes != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->pixelformat = pixelformat;
+	r->bytesperline = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+
+	return 0;
+}
+
+static void
+set_control(int fd, uint32_t id, int32_t value)
+{
+	struct v4l2_control ctrl;
+
+	ctrl.id = id;
+	ctrl.value = value;
+
+	/* Best effort, not every encoder exposes every control */
+	xioctl(fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+static int
+setup_device(struct v4l2_recorder *r, int refresh)
+{
+	struct v4l2_format fmt;
+	struct v4l2_streamparm parm;
+	/* V4L2_PIX_FMT_XBGR32 has the byte order of DRM's XRGB8888; the
+	 * deprecated BGR32 is the same layout on older drivers. */
+	static const uint32_t formats[] = {
+		V4L2_PIX_FMT_XBGR32,
+		V4L2_PIX_FMT_BGR32,
+	};
+	unsigned int i;
+
+	if (!device_has_format(r->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			       V4L2_PIX_FMT_H264))
+		return -1;
+
+	/* Stateful encoders want the coded format set first */
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	fmt.fmt.pix_mp.width = r->width;
+	fmt.fmt.pix_mp.height = r->height;
+	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	fmt.fmt.pix_mp.num_planes = 1;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = r->width * r->height;
+	if (xioctl(r->fd, VIDIOC_S_FMT, &fmt) < 0 ||
+	    fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_H264)
+		return -1;
+
+	for (i = 0; i < ARRAY_LENGTH(formats); i++) {
+		if (set_output_format(r, formats[i], r->width * 4) == 0)
+			break;
+	}
+	if (i == ARRAY_LENGTH(formats))
+		return -1;
+
+	if (refresh > 0) {
+		memset(&parm, 0, sizeof parm);
+		parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		parm.parm.output.timeperframe.numerator = 1000;
+		parm.parm.output.timeperframe.denominator = refresh;
+		xioctl(r->fd, VIDIOC_S_PARM, &parm);
+
+		set_control(r->fd, V4L2_CID_MPEG_VIDEO_GOP_SIZE,
+			    (refresh + 999) / 1000);
+	}
+
+	return 0;
+}
+
+static int
+open_device(struct v4l2_recorder *r, int refresh)
+{
+	struct v4l2_capability cap;
+	char path[32];
+	uint32_t caps;
+	int i;
+
+	for (i = 0; i < V4L2_RECORDER_MAX_DEVICES; i++) {
+		snprintf(path, sizeof path, "/dev/video%d", i);
+		r->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (r->fd < 0)
+			continue;
+
+		memset(&cap, 0, sizeof cap);
+		if (xioctl(r->fd, VIDIOC_QUERYCAP, &cap) == 0) {
+			caps = cap.capabilities;
+			if (caps & V4L2_CAP_DEVICE_CAPS)
+				caps = cap.device_caps;
+
+			if ((caps & V4L2_CAP_VIDEO_M2M_MPLANE) &&
+			    (caps & V4L2_CAP_STREAMING) &&
+			    setup_device(r, refresh) == 0) {
+				weston_log("[v4l2 recorder] using %s (%s)\n",
+					   path, (const char *) cap.card);
+				return 0;
+			}
+		}
+
+		close(r->fd);
+		r->fd = -1;
+	}
+
+	return -1;
+}
+
+static int
+map_buffers(struct v4l2_recorder *r, enum v4l2_buf_type type,
+	    struct v4l2_recorder_buffer *buffers, unsigned int count)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		memset(&buf, 0, sizeof buf);
+		memset(&plane, 0, sizeof plane);
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		buf.m.planes = &plane;
+		buf.length = 1;
+
+		if (xioctl(r->fd, VIDIOC_QUERYBUF, &buf) < 0)
+			return -1;
+
+		buffers[i].length = plane.length;
+		buffers[i].data = mmap(NULL, plane.length,
+				       PROT_READ | PROT_WRITE, MAP_SHARED,
+				       r->fd, plane.m.mem_offset);
+		if (buffers[i].data == MAP_FAILED) {
+			buffers[i].data = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+queue_capture_buffer(struct v4l2_recorder *r, unsigned int index)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+
+	memset(&buf, 0, sizeof buf);
+	memset(&plane, 0, sizeof plane);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	buf.m.planes = &plane;
+	buf.length = 1;
+
+	if (xioctl(r->fd, VIDIOC_QBUF, &buf) < 0)
+		return -1;
+
+	r->capture[index].queued = 1;
+
+	return 0;
+}
+
+static int
+request_buffers(struct v4l2_recorder *r, enum v4l2_buf_type type,
+		enum v4l2_memory memory, unsigned int count)
+{
+	struct v4l2_requestbuffers req;
+
+	memset(&req, 0, sizeof req);
+	req.type = type;
+	req.memory = memory;
+	req.count = count;
+
+	if (xioctl(r->fd, VIDIOC_REQBUFS, &req) < 0)
+		return -1;
+
+	return MIN(req.count, count);
+}
+
+/* The OUTPUT format can only be final once the stride of the incoming
+ * buffers is known, so streaming starts with the first frame. */
+static int
+start_streaming(struct v4l2_recorder *r, int stride)
+{
+	enum v4l2_buf_type type;
+	unsigned int i;
+	int count;
+
+	if (r->memory == V4L2_MEMORY_DMABUF) {
+		if (set_output_format(r, r->pixelformat, stride) < 0)
+			return -1;
+		if (r->bytesperline != (uint32_t) stride) {
+			weston_log("[v4l2 recorder] encoder needs stride %u, "
+				   "buffer has %d\n", r->bytesperline, stride);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	count = request_buffers(r, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+				r->memory, V4L2_RECORDER_OUTPUT_BUFFERS);
+	if (count <= 0)
+		return -1;
+	r->output_count = count;
+
+	if (r->memory == V4L2_MEMORY_MMAP &&
+	    map_buffers(r, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+			r->output, r->output_count) < 0)
+		return -1;
+
+	count = request_buffers(r, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+				V4L2_MEMORY_MMAP,
+				V4L2_RECORDER_CAPTURE_BUFFERS);
+	if (count <= 0)
+		return -1;
+	r->capture_count = count;
+
+	if (map_buffers(r, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+			r->capture, r->capture_count) < 0)
+		return -1;
+
+	for (i = 0; i < r->capture_count; i++)
+		if (queue_capture_buffer(r, i) < 0)
+			return -1;
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	if (xioctl(r->fd, VIDIOC_STREAMON, &type) < 0)
+		return -1;
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (xioctl(r->fd, VIDIOC_STREAMON, &type) < 0)
+		return -1;
+
+	r->streaming = 1;
+
+	return 0;
+}
+
+/* Returns 1 once the encoder signalled the end of the stream. */
+static int
+dequeue_buffers(struct v4l2_recorder *r)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+	struct v4l2_recorder_buffer *b;
+
+	for (;;) {
+		memset(&buf, 0, sizeof buf);
+		memset(&plane, 0, sizeof plane);
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		buf.memory = r->memory;
+		buf.m.planes = &plane;
+		buf.length = 1;
+
+		if (xioctl(r->fd, VIDIOC_DQBUF, &buf) < 0) {
+			if (errno == EAGAIN || errno == EPIPE)
+				break;
+			return -1;
+		}
+
+		b = &r->output[buf.index];
+		b->queued = 0;
+		if (b->dmabuf_fd >= 0) {
+			close(b->dmabuf_fd);
+			b->dmabuf_fd = -1;
+		}
+	}
+
+	for (;;) {
+		memset(&buf, 0, sizeof buf);
+		memset(&plane, 0, sizeof plane);
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.m.planes = &plane;
+		buf.length = 1;
+
+		if (xioctl(r->fd, VIDIOC_DQBUF, &buf) < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EPIPE)
+				return 1;
+			return -1;
+		}
+
+		b = &r->capture[buf.index];
+		b->queued = 0;
+
+		if (plane.bytesused > plane.data_offset &&
+		    write_all(r->output_fd,
+			      (uint8_t *) b->data + plane.data_offset,
+			      plane.bytesused - plane.data_offset) < 0)
+			return -1;
+
+		if (buf.flags & V4L2_BUF_FLAG_LAST)
+			return 1;
+
+		if (queue_capture_buffer(r, buf.index) < 0)
+			return -1;
+	}
+}
+
+static int
+wait_device(struct v4l2_recorder *r, short events)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = r->fd;
+	pfd.events = events;
+
+	do {
+		ret = poll(&pfd, 1, V4L2_RECORDER_TIMEOUT_MS);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int
+get_free_output_buffer(struct v4l2_recorder *r)
+{
+	unsigned int i;
+
+	for (;;) {
+		for (i = 0; i < r->output_count; i++)
+			if (!r->output[i].queued)
+				return i;
+
+		if (wait_device(r, POLLOUT | POLLIN) < 0)
+			return -1;
+		if (dequeue_buffers(r) != 0)
+			return -1;
+	}
+}
+
+static int
+encode_frame(struct v4l2_recorder *r, int dmabuf_fd, int stride,
+	     const uint8_t *pixels)
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
+	struct v4l2_recorder_buffer *b;
+	uint8_t *dst;
+	int index, y;
+
+	if (!r->streaming && start_streaming(r, stride) < 0)
+		goto err;
+
+	index = get_free_output_buffer(r);
+	if (index < 0)
+		goto err;
+	b = &r->output[index];
+
+	memset(&buf, 0, sizeof buf);
+	memset(&plane, 0, sizeof plane);
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.memory = r->memory;
+	buf.index = index;
+	buf.field = V4L2_FIELD_NONE;
+	buf.m.planes = &plane;
+	buf.length = 1;
+
+	if (r->memory == V4L2_MEMORY_DMABUF) {
+		plane.m.fd = dmabuf_fd;
+		plane.length = stride * r->height;
+		plane.bytesused = plane.length;
+	} else {
+		dst = b->data;
+		for (y = 0; y < r->height; y++) {
+			memcpy(dst, pixels, r->width * 4);
+			dst += r->bytesperline;
+			pixels += r->width * 4;
+		}
+		plane.length = b->length;
+		plane.bytesused = r->bytesperline * r->height;
+	}
+
+	if (xioctl(r->fd, VIDIOC_QBUF, &buf) < 0)
+		goto err;
+
+	b->queued = 1;
+	b->dmabuf_fd = dmabuf_fd;
+
+	return dequeue_buffers(r) < 0 ? -1 : 0;
+
+err:
+	if (dmabuf_fd >= 0)
+		close(dmabuf_fd);
+	return -1;
+}
+
+/* Ask the encoder for the frames it still holds and wait for them. */
+static void
+drain_encoder(struct v4l2_recorder *r)
+{
+	struct v4l2_encoder_cmd cmd;
+	int ret;
+
+	if (!r->streaming || r->error)
+		return;
+
+	memset(&cmd, 0, sizeof cmd);
+	cmd.cmd = V4L2_ENC_CMD_STOP;
+	if (xioctl(r->fd, VIDIOC_ENCODER_CMD, &cmd) < 0)
+		return;
+
+	do {
+		if (wait_device(r, POLLIN) < 0)
+			break;
+		ret = dequeue_buffers(r);
+	} while (ret == 0);
+}
+
+static void *
+worker_thread_function(void *data)
+{
+	struct v4l2_recorder *r = data;
+	uint8_t *pixels;
+	int fd, stride, ret;
+
+	pthread_mutex_lock(&r->mutex);
+
+	while (!r->destroying) {
+		if (!r->input.valid) {
+			pthread_cond_wait(&r->input_cond, &r->mutex);
+			continue;
+		}
+
+		fd = r->input.dmabuf_fd;
+		stride = r->input.stride;
+		pixels = r->input.data;
+		r->input.dmabuf_fd = -1;
+		r->input.data = r->input.spare;
+		r->input.spare = pixels;
+		r->input.valid = 0;
+
+		if (r->error) {
+			if (fd >= 0)
+				close(fd);
+			continue;
+		}
+
+		pthread_mutex_unlock(&r->mutex);
+		ret = encode_frame(r, fd, stride, pixels);
+		pthread_mutex_lock(&r->mutex);
+
+		if (ret < 0 && !r->error) {
+			r->error = errno ? errno : EIO;
+			weston_log("[v4l2 recorder] encoding failed: %s\n",
+				   strerror(r->error));
+		}
+	}
+
+	pthread_mutex_unlock(&r->mutex);
+
+	drain_encoder(r);
+
+	return NULL;
+}
+
+static void
+v4l2_recorder_release(struct v4l2_recorder *r)
+{
+	enum v4l2_buf_type type;
+	unsigned int i;
+
+	if (r->streaming) {
+		type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		xioctl(r->fd, VIDIOC_STREAMOFF, &type);
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		xioctl(r->fd, VIDIOC_STREAMOFF, &type);
+	}
+
+	for (i = 0; i < V4L2_RECORDER_OUTPUT_BUFFERS; i++) {
+		if (r->output[i].data)
+			munmap(r->output[i].data, r->output[i].length);
+		if (r->output[i].dmabuf_fd >= 0)
+			close(r->output[i].dmabuf_fd);
+	}
+
+	for (i = 0; i < V4L2_RECORDER_CAPTURE_BUFFERS; i++)
+		if (r->capture[i].data)
+			munmap(r->capture[i].data, r->capture[i].length);
+
+	if (r->input.dmabuf_fd >= 0)
+		close(r->input.dmabuf_fd);
+	free(r->input.data);
+	free(r->input.spare);
+
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->output_fd >= 0)
+		close(r->output_fd);
+}
+
+static struct recorder_encoder *
+v4l2_recorder_create(struct weston_output *output,
+		     enum recorder_encoder_input input,
+		     int width, int height, const char *filename)
+{
+	struct v4l2_recorder *r;
+	size_t size = (size_t) width * height * 4;
+	unsigned int i;
+
+	r = zalloc(sizeof *r);
+	if (r == NULL)
+		return NULL;
+
+	r->base.interface = &v4l2_recorder_encoder;
+	r->width = width;
+	r->height = height;
+	r->fd = -1;
+	r->output_fd = -1;
+	r->input.dmabuf_fd = -1;
+	for (i = 0; i < V4L2_RECORDER_OUTPUT_BUFFERS; i++)
+		r->output[i].dmabuf_fd = -1;
+
+	/* Import the backend's buffers directly, or copy read back
+	 * pixels into device memory. */
+	if (input == RECORDER_ENCODER_INPUT_DMABUF) {
+		r->memory = V4L2_MEMORY_DMABUF;
+	} else {
+		r->memory = V4L2_MEMORY_MMAP;
+		r->input.data = malloc(size);
+		r->input.spare = malloc(size);
+		if (!r->input.data || !r->input.spare)
+			goto err;
+	}
+
+	if (open_device(r, output->current_mode->refresh) < 0)
+		goto err;
+
+	r->output_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			    0644);
+	if (r->output_fd < 0)
+		goto err;
+
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->input_cond, NULL);
+	if (pthread_create(&r->worker_thread, NULL,
+			   worker_thread_function, r) != 0) {
+		pthread_mutex_destroy(&r->mutex);
+		pthread_cond_destroy(&r->input_cond);
+		goto err;
+	}
+
+	return &r->base;
+
+err:
+	v4l2_recorder_release(r);
+	free(r);
+
+	return NULL;
+}
+
+static void
+v4l2_recorder_destroy(struct recorder_encoder *encoder)
+{
+	struct v4l2_recorder *r =
+		container_of(encoder, struct v4l2_recorder, base);
+
+	pthread_mutex_lock(&r->mutex);
+	r->destroying = 1;
+	pthread_cond_signal(&r->input_cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	pthread_join(r->worker_thread, NULL);
+
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->input_cond);
+
+	v4l2_recorder_release(r);
+	free(r);
+}
+
+static int
+v4l2_recorder_queue(struct v4l2_recorder *r, int fd, int stride,
+		    const uint8_t *pixels)
+{
+	uint8_t *dst;
+	int y, ret = 0;
+
+	pthread_mutex_lock(&r->mutex);
+
+	if (r->error) {
+		errno = r->error;
+		ret = -1;
+		goto unlock;
+	}
+
+	/* The worker has not picked up the previous frame yet; replace it
+	 * rather than holding the compositor up. */
+	if (r->input.dmabuf_fd >= 0)
+		close(r->input.dmabuf_fd);
+
+	r->input.dmabuf_fd = fd;
+	r->input.stride = pixels ? r->width * 4 : stride;
+	fd = -1;
+
+	if (pixels) {
+		dst = r->input.data;
+		for (y = 0; y < r->height; y++) {
+			memcpy(dst, pixels, r->width * 4);
+			dst += r->width * 4;
+			pixels += stride;
+		}
+	}
+
+	r->input.valid = 1;
+	pthread_cond_signal(&r->input_cond);
+
+unlock:
+	pthread_mutex_unlock(&r->mutex);
+
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+static int
+v4l2_recorder_frame_dmabuf(struct recorder_encoder *encoder,
+			   int fd, int stride)
+{
+	struct v4l2_recorder *r =
+		container_of(encoder, struct v4l2_recorder, base);
+
+	return v4l2_recorder_queue(r, fd, stride, NULL);
+}
+
+static int
+v4l2_recorder_frame_memory(struct recorder_encoder *encoder,
+			   const void *pixels, int stride)
+{
+	struct v4l2_recorder *r =
+		container_of(encoder, struct v4l2_recorder, base);
+
+	return v4l2_recorder_queue(r, -1, stride, pixels);
+}
+
+const struct recorder_encoder_interface v4l2_recorder_encoder = {
+	.name = "v4l2",
+	.suffix = ".h264",
+	.inputs = RECORDER_ENCODER_INPUT_DMABUF | RECORDER_ENCODER_INPUT_MEMORY,
+	.create = v4l2_recorder_create,
+	.frame_dmabuf = v4l2_recorder_frame_dmabuf,
+	.frame_memory = v4l2_recorder_frame_memory,
+	.destroy = v4l2_recorder_destroy,
+};
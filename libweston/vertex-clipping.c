@@ -278,6 +278,36 @@ clip_polygon_bottom(struct clip_context *ctx, const struct polygon8 *src,
 	return ctx->vertices.x - dst_x;
 }
 
+/* Whether the polygon is a rectangle with edges parallel to the axes,
+ * such as a surface rectangle under a transform made of translations,
+ * scaling and rotations by multiples of 90 degrees. Such a polygon is
+ * clipped exactly by clip_simple().
+ */
+int
+polygon8_is_axis_aligned(const struct polygon8 *polygon)
+{
+	const float *x = polygon->x, *y = polygon->y;
+
+	if (polygon->n != 4)
+		return 0;
+
+	/* Edges alternate between vertical and horizontal, starting with
+	 * either one. */
+	if (float_difference(x[0], x[1]) == 0.0f &&
+	    float_difference(y[1], y[2]) == 0.0f &&
+	    float_difference(x[2], x[3]) == 0.0f &&
+	    float_difference(y[3], y[0]) == 0.0f)
+		return 1;
+
+	if (float_difference(y[0], y[1]) == 0.0f &&
+	    float_difference(x[1], x[2]) == 0.0f &&
+	    float_difference(y[2], y[3]) == 0.0f &&
+	    float_difference(x[3], x[0]) == 0.0f)
+		return 1;
+
+	return 0;
+}
+
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define min(a, b) (((a) > (b)) ? (b) : (a))
 #define clip(x, a, b)  min(max(x, a), b)
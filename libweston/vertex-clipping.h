@@ -51,6 +51,9 @@ struct clip_context {
 float
 float_difference(float a, float b);
 
+int
+polygon8_is_axis_aligned(const struct polygon8 *polygon);
+
 int
 clip_simple(struct clip_context *ctx,
 	    struct polygon8 *surf,
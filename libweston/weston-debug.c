@@ -0,0 +1,270 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "compositor.h"
+#include "weston-debug-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+/*
+ * The weston_debug_v1 protocol: each stream subscribes to one log scope
+ * and writes what is logged there into the client's fd.
+ */
+
+struct weston_debug_stream {
+	struct weston_log_subscriber base;
+	struct weston_log_scope *scope;
+	struct wl_resource *resource;
+	int fd;
+
+	/* A write failing on another thread hands the error to the main
+	 * loop through this eventfd */
+	int error_fd;
+	struct wl_event_source *error_source;
+	int error;
+};
+
+static void
+stream_close(struct weston_debug_stream *stream)
+{
+	if (stream->error_source) {
+		wl_event_source_remove(stream->error_source);
+		stream->error_source = NULL;
+	}
+	if (stream->error_fd >= 0) {
+		close(stream->error_fd);
+		stream->error_fd = -1;
+	}
+
+	if (stream->fd < 0)
+		return;
+
+	weston_log_scope_remove_subscriber(stream->scope, &stream->base);
+	close(stream->fd);
+	stream->fd = -1;
+}
+
+static int
+stream_handle_error(int fd, uint32_t mask, void *data)
+{
+	struct weston_debug_stream *stream = data;
+	eventfd_t count;
+
+	eventfd_read(fd, &count);
+	weston_debug_stream_v1_send_failure(stream->resource,
+		strerror(__atomic_load_n(&stream->error, __ATOMIC_ACQUIRE)));
+	stream_close(stream);
+
+	return 0;
+}
+
+/* A reader that went away must not kill the compositor with SIGPIPE,
+ * and a slow one must not stall it. This runs on whichever thread
+ * logged, so failures are reported from the main loop. */
+static void
+stream_write(struct weston_log_subscriber *sub, const char *data, size_t len)
+{
+	struct weston_debug_stream *stream =
+		container_of(sub, struct weston_debug_stream, base);
+	const struct timespec zero = { 0, 0 };
+	sigset_t pipe_mask, old_mask;
+	ssize_t ret;
+	int err;
+
+	if (__atomic_load_n(&stream->error, __ATOMIC_RELAXED))
+		return;
+
+	sigemptyset(&pipe_mask);
+	sigaddset(&pipe_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_mask, &old_mask);
+
+	do {
+		ret = write(stream->fd, data, len);
+		if (ret > 0) {
+			data += ret;
+			len -= ret;
+		}
+	} while (len > 0 && (ret > 0 || (ret < 0 && errno == EINTR)));
+	err = errno;
+
+	if (ret < 0 && err == EPIPE)
+		sigtimedwait(&pipe_mask, NULL, &zero);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret >= 0 || err == EAGAIN)
+		return;
+
+	__atomic_store_n(&stream->error, err, __ATOMIC_RELEASE);
+	eventfd_write(stream->error_fd, 1);
+}
+
+static void
+stream_destroy(struct wl_resource *resource)
+{
+	struct weston_debug_stream *stream =
+		wl_resource_get_user_data(resource);
+
+	stream_close(stream);
+	free(stream);
+}
+
+static void
+stream_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_debug_stream_v1_interface stream_interface = {
+	stream_handle_destroy,
+};
+
+static void
+debug_subscribe(struct wl_client *client, struct wl_resource *resource,
+		const char *name, int32_t streamfd, uint32_t new_stream_id)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(wl_client_get_display(client));
+	struct weston_debug_stream *stream;
+	int flags;
+
+	stream = zalloc(sizeof *stream);
+	if (!stream) {
+		close(streamfd);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	stream->fd = -1;
+	stream->error_fd = -1;
+	stream->resource =
+		wl_resource_create(client, &weston_debug_stream_v1_interface,
+				   wl_resource_get_version(resource),
+				   new_stream_id);
+	if (!stream->resource) {
+		close(streamfd);
+		free(stream);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(stream->resource, &stream_interface,
+				       stream, stream_destroy);
+
+	stream->scope = weston_log_scope_get(name);
+	if (!stream->scope) {
+		close(streamfd);
+		weston_debug_stream_v1_send_failure(stream->resource,
+						    "out of memory");
+		return;
+	}
+
+	flags = fcntl(streamfd, F_GETFL);
+	if (flags < 0 || fcntl(streamfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		close(streamfd);
+		weston_debug_stream_v1_send_failure(stream->resource,
+						    strerror(errno));
+		return;
+	}
+
+	stream->error_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stream->error_fd >= 0)
+		stream->error_source =
+			wl_event_loop_add_fd(loop, stream->error_fd,
+					     WL_EVENT_READABLE,
+					     stream_handle_error, stream);
+	if (!stream->error_source) {
+		close(streamfd);
+		weston_debug_stream_v1_send_failure(stream->resource,
+						    strerror(errno));
+		stream_close(stream);
+		return;
+	}
+
+	stream->fd = streamfd;
+	stream->base.write = stream_write;
+	weston_log_scope_add_subscriber(stream->scope, &stream->base);
+}
+
+static void
+debug_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_debug_v1_interface debug_interface = {
+	debug_destroy,
+	debug_subscribe,
+};
+
+static void
+bind_debug(struct wl_client *client, void *data, uint32_t version,
+	   uint32_t id)
+{
+	struct weston_log_scope *scope = NULL;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &weston_debug_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &debug_interface,
+				       data, NULL);
+
+	while ((scope = weston_log_scope_iterate(scope)))
+		weston_debug_v1_send_available(resource,
+					       weston_log_scope_get_name(scope));
+}
+
+/** Advertise the weston_debug_v1 global
+ *
+ * Any client can then read whatever the compositor logs, input events
+ * included, so only do this when asked for explicitly.
+ */
+WL_EXPORT int
+weston_compositor_enable_debug_protocol(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_debug_v1_interface, 1,
+			      compositor, bind_debug))
+		return -1;
+
+	weston_log("WARNING: the debug protocol is enabled; any client can "
+		   "read what the compositor logs, including input.\n");
+
+	return 0;
+}
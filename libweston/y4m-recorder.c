@@ -0,0 +1,337 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Software fallback for the hardware recorders: frames read back by
+ * the renderer are converted to I420 on a worker thread and written
+ * as a YUV4MPEG2 stream, which any encoder can take as input.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "compositor.h"
+#include "recorder-encoder.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+struct y4m_recorder {
+	struct recorder_encoder base;
+
+	int output_fd;
+	int width, height;
+	int chroma_width, chroma_height;
+
+	int error;
+	int destroying;
+	pthread_t worker_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t input_cond;
+
+	struct {
+		int valid;
+		/* Filled by the compositor while the worker converts
+		 * the spare one. */
+		uint32_t *data, *spare;
+	} input;
+
+	uint8_t *yuv;
+	size_t yuv_size;
+};
+
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	ssize_t ret;
+
+	while (size > 0) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/* BT.601, limited range */
+static inline uint8_t
+rgb_to_y(int r, int g, int b)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static inline uint8_t
+rgb_to_u(int r, int g, int b)
+{
+	return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+
+static inline uint8_t
+rgb_to_v(int r, int g, int b)
+{
+	return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static void
+convert_frame(struct y4m_recorder *r, const uint32_t *pixels)
+{
+	uint8_t *y_plane = r->yuv;
+	uint8_t *u_plane = y_plane + r->width * r->height;
+	uint8_t *v_plane = u_plane + r->chroma_width * r->chroma_height;
+	const uint32_t *row0, *row1;
+	uint32_t p[4];
+	int x, y, i, cr, cg, cb;
+
+	for (y = 0; y < r->height; y++) {
+		for (x = 0; x < r->width; x++) {
+			p[0] = pixels[y * r->width + x];
+			y_plane[y * r->width + x] =
+				rgb_to_y((p[0] >> 16) & 0xff,
+					 (p[0] >> 8) & 0xff, p[0] & 0xff);
+		}
+	}
+
+	/* Chroma is the average of each 2x2 block, repeating the last
+	 * row or column for odd sizes. */
+	for (y = 0; y < r->chroma_height; y++) {
+		row0 = pixels + 2 * y * r->width;
+		row1 = 2 * y + 1 < r->height ? row0 + r->width : row0;
+
+		for (x = 0; x < r->chroma_width; x++) {
+			p[0] = row0[2 * x];
+			p[2] = row1[2 * x];
+			if (2 * x + 1 < r->width) {
+				p[1] = row0[2 * x + 1];
+				p[3] = row1[2 * x + 1];
+			} else {
+				p[1] = p[0];
+				p[3] = p[2];
+			}
+
+			cr = cg = cb = 0;
+			for (i = 0; i < 4; i++) {
+				cr += (p[i] >> 16) & 0xff;
+				cg += (p[i] >> 8) & 0xff;
+				cb += p[i] & 0xff;
+			}
+			cr = (cr + 2) / 4;
+			cg = (cg + 2) / 4;
+			cb = (cb + 2) / 4;
+
+			u_plane[y * r->chroma_width + x] = rgb_to_u(cr, cg, cb);
+			v_plane[y * r->chroma_width + x] = rgb_to_v(cr, cg, cb);
+		}
+	}
+}
+
+static void *
+worker_thread_function(void *data)
+{
+	static const char frame_header[] = "FRAME\n";
+	struct y4m_recorder *r = data;
+	uint32_t *pixels;
+	int ret;
+
+	pthread_mutex_lock(&r->mutex);
+
+	while (!r->destroying) {
+		if (!r->input.valid) {
+			pthread_cond_wait(&r->input_cond, &r->mutex);
+			continue;
+		}
+
+		pixels = r->input.data;
+		r->input.data = r->input.spare;
+		r->input.spare = pixels;
+		r->input.valid = 0;
+
+		if (r->error)
+			continue;
+
+		pthread_mutex_unlock(&r->mutex);
+
+		convert_frame(r, pixels);
+		ret = write_all(r->output_fd, frame_header,
+				sizeof frame_header - 1);
+		if (ret == 0)
+			ret = write_all(r->output_fd, r->yuv, r->yuv_size);
+
+		pthread_mutex_lock(&r->mutex);
+
+		if (ret < 0) {
+			r->error = errno;
+			weston_log("[y4m recorder] write failed: %m\n");
+		}
+	}
+
+	pthread_mutex_unlock(&r->mutex);
+
+	return NULL;
+}
+
+static struct recorder_encoder *
+y4m_recorder_create(struct weston_output *output,
+		    enum recorder_encoder_input input,
+		    int width, int height, const char *filename)
+{
+	struct y4m_recorder *r;
+	size_t size = (size_t) width * height * 4;
+	char header[128];
+	int32_t refresh = output->current_mode->refresh;
+	int len;
+
+	r = zalloc(sizeof *r);
+	if (r == NULL)
+		return NULL;
+
+	r->base.interface = &y4m_recorder_encoder;
+	r->width = width;
+	r->height = height;
+	r->chroma_width = (width + 1) / 2;
+	r->chroma_height = (height + 1) / 2;
+	r->yuv_size = (size_t) width * height +
+		2 * r->chroma_width * r->chroma_height;
+
+	r->input.data = malloc(size);
+	r->input.spare = malloc(size);
+	r->yuv = malloc(r->yuv_size);
+	if (!r->input.data || !r->input.spare || !r->yuv)
+		goto err_free;
+
+	r->output_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			    0644);
+	if (r->output_fd < 0)
+		goto err_free;
+
+	/* The stream is paced by the output, which the hardware recorder
+	 * keeps repainting; refresh is in mHz. */
+	len = snprintf(header, sizeof header,
+		       "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C420jpeg\n",
+		       width, height, refresh > 0 ? refresh : 60000);
+	if (write_all(r->output_fd, header, len) < 0)
+		goto err_fd;
+
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->input_cond, NULL);
+	if (pthread_create(&r->worker_thread, NULL,
+			   worker_thread_function, r) != 0) {
+		pthread_mutex_destroy(&r->mutex);
+		pthread_cond_destroy(&r->input_cond);
+		goto err_fd;
+	}
+
+	return &r->base;
+
+err_fd:
+	close(r->output_fd);
+err_free:
+	free(r->input.data);
+	free(r->input.spare);
+	free(r->yuv);
+	free(r);
+
+	return NULL;
+}
+
+static void
+y4m_recorder_destroy(struct recorder_encoder *encoder)
+{
+	struct y4m_recorder *r =
+		container_of(encoder, struct y4m_recorder, base);
+
+	pthread_mutex_lock(&r->mutex);
+	r->destroying = 1;
+	pthread_cond_signal(&r->input_cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	pthread_join(r->worker_thread, NULL);
+
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->input_cond);
+
+	close(r->output_fd);
+	free(r->input.data);
+	free(r->input.spare);
+	free(r->yuv);
+	free(r);
+}
+
+static int
+y4m_recorder_frame_memory(struct recorder_encoder *encoder,
+			  const void *pixels, int stride)
+{
+	struct y4m_recorder *r =
+		container_of(encoder, struct y4m_recorder, base);
+	const uint8_t *src = pixels;
+	uint32_t *dst;
+	int y, ret = 0;
+
+	pthread_mutex_lock(&r->mutex);
+
+	if (r->error) {
+		errno = r->error;
+		ret = -1;
+		goto unlock;
+	}
+
+	/* Overwrites a frame the worker has not picked up yet */
+	dst = r->input.data;
+	for (y = 0; y < r->height; y++) {
+		memcpy(dst, src, r->width * 4);
+		dst += r->width;
+		src += stride;
+	}
+
+	r->input.valid = 1;
+	pthread_cond_signal(&r->input_cond);
+
+unlock:
+	pthread_mutex_unlock(&r->mutex);
+
+	return ret;
+}
+
+const struct recorder_encoder_interface y4m_recorder_encoder = {
+	.name = "y4m",
+	.suffix = ".y4m",
+	.inputs = RECORDER_ENCODER_INPUT_MEMORY,
+	.create = y4m_recorder_create,
+	.frame_memory = y4m_recorder_frame_memory,
+	.destroy = y4m_recorder_destroy,
+};
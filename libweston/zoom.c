@@ -34,6 +34,19 @@
 #include "text-cursor-position-server-protocol.h"
 #include "shared/helpers.h"
 
+/* The output matrix changed. Unless the renderer can zoom into what it
+ * already has, every view needs to be drawn again. */
+static void
+zoom_changed(struct weston_output *output)
+{
+	output->dirty = 1;
+
+	if (output->compositor->capabilities & WESTON_CAP_ZOOM_OFFSCREEN)
+		weston_output_schedule_repaint(output);
+	else
+		weston_output_damage(output);
+}
+
 static void
 weston_zoom_frame_z(struct weston_animation *animation,
 		struct weston_output *output, uint32_t msecs)
@@ -60,8 +73,7 @@ weston_zoom_frame_z(struct weston_animation *animation,
 		wl_list_init(&animation->link);
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	zoom_changed(output);
 }
 
 static void
@@ -114,8 +126,7 @@ weston_zoom_transition(struct weston_output *output)
 		}
 	}
 
-	output->dirty = 1;
-	weston_output_damage(output);
+	zoom_changed(output);
 }
 
 WL_EXPORT void
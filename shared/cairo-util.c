@@ -36,6 +36,7 @@
 #include "cairo-util.h"
 
 #include "shared/helpers.h"
+#include "shared/zalloc.h"
 #include "image-loader.h"
 #include "config-parser.h"
 
@@ -49,17 +50,64 @@ surface_flush_device(cairo_surface_t *surface)
 		cairo_device_flush(device);
 }
 
+/* Blurs one row or column of premultiplied ARGB pixels with a box of
+ * 2 * radius + 1 taps, keeping a running sum so the cost per pixel does
+ * not depend on the radius.  Pixels outside the line count as
+ * transparent, and those in [margin, n - margin) are copied unchanged. */
+static void
+box_blur_line(const uint32_t *s, uint32_t *d, int n, int step,
+	      int radius, int margin)
+{
+	uint32_t sum[4] = { 0, 0, 0, 0 };
+	uint32_t p, size, half;
+	int i, c;
+
+	size = 2 * radius + 1;
+	half = size / 2;
+
+	for (i = 0; i < radius && i < n; i++) {
+		p = s[i * step];
+		for (c = 0; c < 4; c++)
+			sum[c] += (p >> (c * 8)) & 0xff;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i + radius < n) {
+			p = s[(i + radius) * step];
+			for (c = 0; c < 4; c++)
+				sum[c] += (p >> (c * 8)) & 0xff;
+		}
+		if (i - radius - 1 >= 0) {
+			p = s[(i - radius - 1) * step];
+			for (c = 0; c < 4; c++)
+				sum[c] -= (p >> (c * 8)) & 0xff;
+		}
+
+		if (margin <= i && i < n - margin) {
+			d[i * step] = s[i * step];
+			continue;
+		}
+
+		p = 0;
+		for (c = 0; c < 4; c++)
+			p |= ((sum[c] + half) / size) << (c * 8);
+		d[i * step] = p;
+	}
+}
+
+/* Three box passes approximate the Gaussian shadow kernel we used to
+ * apply directly; the radii give a variance close to the old 71-tap
+ * kernel's.  Each pass is separable, horizontal then vertical. */
 static int
 blur_surface(cairo_surface_t *surface, int margin)
 {
-	int32_t width, height, stride, x, y, z, w;
+	static const int radius[] = { 5, 5, 6 };
+	int32_t width, height, stride;
 	uint8_t *src, *dst;
-	uint32_t *s, *d, a, p;
-	int i, j, k, size, half;
-	uint32_t kernel[71];
-	double f;
+	unsigned int pass;
+	int i;
 
-	size = ARRAY_LENGTH(kernel);
+	cairo_surface_flush(surface);
 	width = cairo_image_surface_get_width(surface);
 	height = cairo_image_surface_get_height(surface);
 	stride = cairo_image_surface_get_stride(surface);
@@ -69,67 +117,16 @@ blur_surface(cairo_surface_t *surface, int margin)
 	if (dst == NULL)
 		return -1;
 
-	half = size / 2;
-	a = 0;
-	for (i = 0; i < size; i++) {
-		f = (i - half);
-		kernel[i] = exp(- f * f / ARRAY_LENGTH(kernel)) * 10000;
-		a += kernel[i];
-	}
-
-	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (src + i * stride);
-		d = (uint32_t *) (dst + i * stride);
-		for (j = 0; j < width; j++) {
-			if (margin < j && j < width - margin) {
-				d[j] = s[j];
-				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (j - half + k < 0 || j - half + k >= width)
-					continue;
-				p = s[j - half + k];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
-		}
-	}
+	for (pass = 0; pass < ARRAY_LENGTH(radius); pass++) {
+		for (i = 0; i < height; i++)
+			box_blur_line((uint32_t *) (src + i * stride),
+				      (uint32_t *) (dst + i * stride),
+				      width, 1, radius[pass], margin);
 
-	for (i = 0; i < height; i++) {
-		s = (uint32_t *) (dst + i * stride);
-		d = (uint32_t *) (src + i * stride);
-		for (j = 0; j < width; j++) {
-			if (margin <= i && i < height - margin) {
-				d[j] = s[j];
-				continue;
-			}
-
-			x = 0;
-			y = 0;
-			z = 0;
-			w = 0;
-			for (k = 0; k < size; k++) {
-				if (i - half + k < 0 || i - half + k >= height)
-					continue;
-				s = (uint32_t *) (dst + (i - half + k) * stride);
-				p = s[j];
-
-				x += (p >> 24) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >> 8) & 0xff) * kernel[k];
-				w += (p & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
-		}
+		for (i = 0; i < width; i++)
+			box_blur_line((uint32_t *) dst + i,
+				      (uint32_t *) src + i,
+				      height, stride / 4, radius[pass], margin);
 	}
 
 	free(dst);
@@ -340,10 +337,19 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius)
 	cairo_close_path(cr);
 }
 
+static const cairo_user_data_key_t pixman_image_key;
+
+static void
+unref_pixman_image(void *data)
+{
+	pixman_image_unref(data);
+}
+
 cairo_surface_t *
 load_cairo_surface(const char *filename)
 {
 	pixman_image_t *image;
+	cairo_surface_t *surface;
 	int width, height, stride;
 	void *data;
 
@@ -357,8 +363,47 @@ load_cairo_surface(const char *filename)
 	height = pixman_image_get_height(image);
 	stride = pixman_image_get_stride(image);
 
-	return cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
-						   width, height, stride);
+	surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
+						      width, height, stride);
+
+	/* The pixels belong to the image, which may be a cache mapping */
+	if (cairo_surface_set_user_data(surface, &pixman_image_key, image,
+					unref_pixman_image) !=
+	    CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(surface);
+		pixman_image_unref(image);
+		return NULL;
+	}
+
+	return surface;
+}
+
+/* The shadow is drawn 4 pixels outside the frame with 64 pixel corners,
+ * so it reaches 60 pixels into the frame from each edge. */
+#define THEME_SHADOW_OFFSET 4
+#define THEME_SHADOW_SIZE 64
+#define THEME_DECORATION_CACHE_SIZE 8
+
+/* A frame without its title, rendered once at the smallest size where
+ * no two corners overlap plus one stretchable row and column.  Larger
+ * frames are assembled from its nine slices. */
+struct theme_decoration {
+	struct wl_list link;
+	uint32_t flags;
+	int scale;
+	cairo_device_t *device;
+	int left, right, top, bottom;
+	cairo_surface_t *surface;
+};
+
+static void
+theme_decoration_destroy(struct theme_decoration *d)
+{
+	wl_list_remove(&d->link);
+	cairo_surface_destroy(d->surface);
+	if (d->device)
+		cairo_device_destroy(d->device);
+	free(d);
 }
 
 void
@@ -395,6 +440,8 @@ theme_create(void)
 	t->width = 1;
 	t->titlebar_height = 32;
 	t->frame_radius = 2;
+	wl_list_init(&t->decoration_list);
+	t->decoration_count = 0;
 	t->shadow = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 128, 128);
 	cr = cairo_create(t->shadow);
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
@@ -449,33 +496,31 @@ theme_create(void)
 void
 theme_destroy(struct theme *t)
 {
+	struct theme_decoration *d, *next;
+
+	wl_list_for_each_safe(d, next, &t->decoration_list, link)
+		theme_decoration_destroy(d);
 	cairo_surface_destroy(t->active_frame);
 	cairo_surface_destroy(t->inactive_frame);
 	cairo_surface_destroy(t->shadow);
 	free(t);
 }
 
-void
-theme_render_frame(struct theme *t,
-		   cairo_t *cr, int width, int height,
-		   const char *title, struct wl_list *buttons,
-		   uint32_t flags)
+static void
+theme_render_decoration(struct theme *t, cairo_t *cr, int width, int height,
+			int top_margin, uint32_t flags)
 {
-	cairo_text_extents_t extents;
-	cairo_font_extents_t font_extents;
 	cairo_surface_t *source;
-	int x, y, margin, top_margin;
-
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_rgba(cr, 0, 0, 0, 0);
-	cairo_paint(cr);
+	int margin;
 
 	if (flags & THEME_FRAME_MAXIMIZED)
 		margin = 0;
 	else {
 		render_shadow(cr, t->shadow,
-		              -4, -4, width + 8, height + 8,
-		              64, 64);
+			      -THEME_SHADOW_OFFSET, -THEME_SHADOW_OFFSET,
+			      width + 2 * THEME_SHADOW_OFFSET,
+			      height + 2 * THEME_SHADOW_OFFSET,
+			      THEME_SHADOW_SIZE, THEME_SHADOW_SIZE);
 		margin = t->margin;
 	}
 
@@ -484,15 +529,194 @@ theme_render_frame(struct theme *t,
 	else
 		source = t->inactive_frame;
 
-	if (title || !wl_list_empty(buttons))
-		top_margin = t->titlebar_height;
+	tile_source(cr, source,
+		    margin, margin,
+		    width - margin * 2, height - margin * 2,
+		    t->width, top_margin);
+}
+
+/* Decorations for a device-backed target, such as an X window, are
+ * kept on that device so drawing a frame does not upload any pixels. */
+static struct theme_decoration *
+theme_get_decoration(struct theme *t, cairo_surface_t *target,
+		     uint32_t flags, int top_margin, int scale)
+{
+	struct theme_decoration *d;
+	cairo_device_t *device;
+	int margin, shadow, width, height;
+	cairo_t *cr;
+
+	device = cairo_surface_get_device(target);
+
+	wl_list_for_each(d, &t->decoration_list, link) {
+		if (d->flags == flags && d->scale == scale &&
+		    d->device == device) {
+			wl_list_remove(&d->link);
+			wl_list_insert(&t->decoration_list, &d->link);
+			return d;
+		}
+	}
+
+	d = zalloc(sizeof *d);
+	if (d == NULL)
+		return NULL;
+
+	if (flags & THEME_FRAME_MAXIMIZED) {
+		margin = 0;
+		shadow = 0;
+	} else {
+		margin = t->margin;
+		shadow = THEME_SHADOW_SIZE - THEME_SHADOW_OFFSET;
+	}
+
+	d->flags = flags;
+	d->scale = scale;
+	d->left = MAX(shadow, margin + t->width);
+	d->right = d->left;
+	d->top = MAX(shadow, margin + top_margin);
+	d->bottom = d->left;
+	width = d->left + d->right + 1;
+	height = d->top + d->bottom + 1;
+
+	if (device)
+		d->surface =
+			cairo_surface_create_similar(target,
+						     CAIRO_CONTENT_COLOR_ALPHA,
+						     width * scale,
+						     height * scale);
+	else
+		d->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							width * scale,
+							height * scale);
+	cr = cairo_create(d->surface);
+	cairo_scale(cr, scale, scale);
+	theme_render_decoration(t, cr, width, height, top_margin, flags);
+	if (cairo_status(cr) != CAIRO_STATUS_SUCCESS) {
+		cairo_destroy(cr);
+		cairo_surface_destroy(d->surface);
+		free(d);
+		return NULL;
+	}
+	cairo_destroy(cr);
+
+	if (device)
+		d->device = cairo_device_reference(device);
+
+	wl_list_insert(&t->decoration_list, &d->link);
+	if (++t->decoration_count > THEME_DECORATION_CACHE_SIZE) {
+		theme_decoration_destroy(container_of(t->decoration_list.prev,
+						      struct theme_decoration,
+						      link));
+		t->decoration_count--;
+	}
+
+	return d;
+}
+
+/* Maps the sw x sh rectangle at (sx, sy) of the decoration onto the
+ * dw x dh rectangle at (dx, dy) of the frame. */
+static void
+theme_blit_slice(cairo_t *cr, cairo_pattern_t *pattern, int scale,
+		 int sx, int sy, int sw, int sh,
+		 int dx, int dy, int dw, int dh)
+{
+	cairo_matrix_t matrix;
+
+	if (dw <= 0 || dh <= 0)
+		return;
+
+	cairo_matrix_init_scale(&matrix, scale, scale);
+	cairo_matrix_translate(&matrix, sx, sy);
+	cairo_matrix_scale(&matrix, (double) sw / dw, (double) sh / dh);
+	cairo_matrix_translate(&matrix, -dx, -dy);
+	cairo_pattern_set_matrix(pattern, &matrix);
+	cairo_rectangle(cr, dx, dy, dw, dh);
+	cairo_fill(cr);
+}
+
+static void
+theme_draw_decoration(struct theme_decoration *d, cairo_t *cr,
+		      int width, int height)
+{
+	cairo_pattern_t *pattern;
+	int l = d->left, r = d->right, t = d->top, b = d->bottom;
+	int mw = width - l - r, mh = height - t - b;
+
+	pattern = cairo_pattern_create_for_surface(d->surface);
+	cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+	cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+	cairo_set_source(cr, pattern);
+
+	theme_blit_slice(cr, pattern, d->scale, 0, 0, l, t, 0, 0, l, t);
+	theme_blit_slice(cr, pattern, d->scale, l, 0, 1, t, l, 0, mw, t);
+	theme_blit_slice(cr, pattern, d->scale,
+			 l + 1, 0, r, t, width - r, 0, r, t);
+
+	theme_blit_slice(cr, pattern, d->scale, 0, t, l, 1, 0, t, l, mh);
+	theme_blit_slice(cr, pattern, d->scale, l, t, 1, 1, l, t, mw, mh);
+	theme_blit_slice(cr, pattern, d->scale,
+			 l + 1, t, r, 1, width - r, t, r, mh);
+
+	theme_blit_slice(cr, pattern, d->scale,
+			 0, t + 1, l, b, 0, height - b, l, b);
+	theme_blit_slice(cr, pattern, d->scale,
+			 l, t + 1, 1, b, l, height - b, mw, b);
+	theme_blit_slice(cr, pattern, d->scale,
+			 l + 1, t + 1, r, b, width - r, height - b, r, b);
+
+	cairo_pattern_destroy(pattern);
+}
+
+/* The decorations are cached per device pixel density, so a frame drawn
+ * through a scaled or rotated cairo_t still maps them 1:1. */
+static int
+theme_get_scale(cairo_t *cr)
+{
+	double dx = 1, dy = 0;
+
+	cairo_user_to_device_distance(cr, &dx, &dy);
+
+	return MAX(1, (int) ceil(sqrt(dx * dx + dy * dy) - 0.001));
+}
+
+void
+theme_render_frame(struct theme *t,
+		   cairo_t *cr, int width, int height,
+		   const char *title, struct wl_list *buttons,
+		   uint32_t flags)
+{
+	cairo_text_extents_t extents;
+	cairo_font_extents_t font_extents;
+	struct theme_decoration *d;
+	uint32_t key;
+	int x, y, margin, top_margin;
+
+	if (flags & THEME_FRAME_MAXIMIZED)
+		margin = 0;
 	else
+		margin = t->margin;
+
+	key = flags & (THEME_FRAME_ACTIVE | THEME_FRAME_MAXIMIZED);
+	if (title || !wl_list_empty(buttons)) {
+		top_margin = t->titlebar_height;
+	} else {
 		top_margin = t->width;
+		key |= THEME_FRAME_NO_TITLE;
+	}
 
-	tile_source(cr, source,
-	            margin, margin,
-	            width - margin * 2, height - margin * 2,
-	            t->width, top_margin);
+	/* The interior is transparent in the decoration, so copying the
+	 * slices also clears whatever was drawn there before. */
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	d = theme_get_decoration(t, cairo_get_target(cr), key, top_margin,
+				 theme_get_scale(cr));
+	if (d && width > d->left + d->right && height > d->top + d->bottom) {
+		theme_draw_decoration(d, cr, width, height);
+	} else {
+		cairo_set_source_rgba(cr, 0, 0, 0, 0);
+		cairo_paint(cr);
+		theme_render_decoration(t, cr, width, height,
+					top_margin, flags);
+	}
 
 	if (title || !wl_list_empty(buttons)) {
 		cairo_rectangle (cr, margin + t->width, margin,
@@ -57,6 +57,10 @@ struct theme {
 	int margin;
 	int width;
 	int titlebar_height;
+
+	/* Pre-rendered decorations, most recently used first */
+	struct wl_list decoration_list;
+	int decoration_count;
 };
 
 struct theme *
@@ -176,6 +180,9 @@ frame_status(struct frame *frame);
 void
 frame_status_clear(struct frame *frame, enum frame_status status);
 
+uint32_t
+frame_appearance(struct frame *frame);
+
 /* May set FRAME_STATUS_REPAINT */
 enum theme_location
 frame_pointer_enter(struct frame *frame, void *pointer, int x, int y);
@@ -27,6 +27,7 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -42,79 +43,143 @@
 #include "config-parser.h"
 #include "helpers.h"
 #include "string-helpers.h"
+#include "zalloc.h"
+
+/* Values the typed getters parsed an entry to, so that a key read over
+ * and over is only parsed once */
+enum config_value_type {
+	CONFIG_VALUE_INT,
+	CONFIG_VALUE_UINT,
+	CONFIG_VALUE_COLOR,
+	CONFIG_VALUE_DOUBLE,
+	CONFIG_VALUE_BOOL,
+	CONFIG_VALUE__COUNT
+};
+
+struct config_cached_value {
+	bool valid;
+	int error; /* errno of a failed parse, or 0 */
+	union {
+		int32_t i;
+		uint32_t u;
+		double d;
+		int b;
+	} v;
+};
 
 struct weston_config_entry {
 	char *key;
 	char *value;
+	uint32_t hash;
+	struct weston_config_entry *hash_next;
+	struct config_cached_value cache[CONFIG_VALUE__COUNT];
 	struct wl_list link;
 };
 
+/* Both sections and their entries are looked up through chained hash
+ * tables of power of two sizes, which grow to keep about one item per
+ * bucket. Only the first entry of a duplicated key is in the table, as
+ * that is the one a lookup returns. */
 struct weston_config_section {
 	char *name;
+	uint32_t hash;
+	struct weston_config_section *hash_next;
+	struct weston_config_section *next_same_name;
 	struct wl_list entry_list;
+	struct weston_config_entry **buckets;
+	uint32_t n_buckets;
+	uint32_t n_entries;
+	bool matched;	/* reload bookkeeping */
+	bool changed;
 	struct wl_list link;
 };
 
 struct weston_config {
 	struct wl_list section_list;
+	/* emptied by weston_config_reload(), kept for pointers to them */
+	struct wl_list removed_list;
+	struct weston_config_section **buckets;
+	uint32_t n_buckets;
+	uint32_t n_sections;
 	char path[PATH_MAX];
 };
 
-static int
-open_config_file(struct weston_config *c, const char *name)
+#define CONFIG_MIN_BUCKETS 8
+
+static uint32_t
+config_hash(const char *str)
 {
-	const char *config_dir  = getenv("XDG_CONFIG_HOME");
-	const char *home_dir	= getenv("HOME");
-	const char *config_dirs = getenv("XDG_CONFIG_DIRS");
-	const char *p, *next;
-	int fd;
+	uint32_t hash = 0x811c9dc5;
 
-	if (name[0] == '/') {
-		snprintf(c->path, sizeof c->path, "%s", name);
-		return open(name, O_RDONLY | O_CLOEXEC);
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 0x01000193;
 	}
 
-	/* Precedence is given to config files in the home directory,
-	 * and then to directories listed in XDG_CONFIG_DIRS and
-	 * finally to the current working directory. */
+	return hash;
+}
 
-	/* $XDG_CONFIG_HOME */
-	if (config_dir) {
-		snprintf(c->path, sizeof c->path, "%s/%s", config_dir, name);
-		fd = open(c->path, O_RDONLY | O_CLOEXEC);
-		if (fd >= 0)
-			return fd;
-	}
+/* Double the buckets once there are more items than buckets. If that
+ * fails, the table keeps working with longer chains. */
+static void
+section_table_grow(struct weston_config_section *section)
+{
+	struct weston_config_entry **buckets, *e, *next;
+	uint32_t n_buckets, i;
 
-	/* $HOME/.config */
-	if (home_dir) {
-		snprintf(c->path, sizeof c->path,
-			 "%s/.config/%s", home_dir, name);
-		fd = open(c->path, O_RDONLY | O_CLOEXEC);
-		if (fd >= 0)
-			return fd;
+	if (section->n_entries < section->n_buckets)
+		return;
+
+	n_buckets = section->n_buckets ?
+		    section->n_buckets * 2 : CONFIG_MIN_BUCKETS;
+	buckets = calloc(n_buckets, sizeof *buckets);
+	if (!buckets)
+		return;
+
+	for (i = 0; i < section->n_buckets; i++) {
+		for (e = section->buckets[i]; e; e = next) {
+			next = e->hash_next;
+			e->hash_next = buckets[e->hash & (n_buckets - 1)];
+			buckets[e->hash & (n_buckets - 1)] = e;
+		}
 	}
 
-	/* For each $XDG_CONFIG_DIRS: weston/<config_file> */
-	if (!config_dirs)
-		config_dirs = "/etc/xdg";  /* See XDG base dir spec. */
+	free(section->buckets);
+	section->buckets = buckets;
+	section->n_buckets = n_buckets;
+}
 
-	for (p = config_dirs; *p != '\0'; p = next) {
-		next = strchrnul(p, ':');
-		snprintf(c->path, sizeof c->path,
-			 "%.*s/weston/%s", (int)(next - p), p, name);
-		fd = open(c->path, O_RDONLY | O_CLOEXEC);
-		if (fd >= 0)
-			return fd;
+/* Makes room for n section names; returns -1 if out of memory, leaving
+ * the table as it was */
+static int
+config_table_reserve(struct weston_config *config, uint32_t n)
+{
+	struct weston_config_section **buckets, *s, *next;
+	uint32_t n_buckets, i;
 
-		if (*next == ':')
-			next++;
+	n_buckets = config->n_buckets ? config->n_buckets : CONFIG_MIN_BUCKETS;
+	while (n_buckets < n)
+		n_buckets *= 2;
+	if (n_buckets == config->n_buckets)
+		return 0;
+
+	buckets = calloc(n_buckets, sizeof *buckets);
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < config->n_buckets; i++) {
+		for (s = config->buckets[i]; s; s = next) {
+			next = s->hash_next;
+			s->hash_next = buckets[s->hash & (n_buckets - 1)];
+			buckets[s->hash & (n_buckets - 1)] = s;
+		}
 	}
 
-	/* Current working directory. */
-	snprintf(c->path, sizeof c->path, "./%s", name);
+	free(config->buckets);
+	config->buckets = buckets;
+	config->n_buckets = n_buckets;
 
-	return open(c->path, O_RDONLY | O_CLOEXEC);
+	return 0;
 }
 
 static struct weston_config_entry *
@@ -122,16 +187,40 @@ config_section_get_entry(struct weston_config_section *section,
 			 const char *key)
 {
 	struct weston_config_entry *e;
+	uint32_t hash;
 
-	if (section == NULL)
+	if (section == NULL || section->n_buckets == 0)
 		return NULL;
-	wl_list_for_each(e, &section->entry_list, link)
-		if (strcmp(e->key, key) == 0)
+
+	hash = config_hash(key);
+	for (e = section->buckets[hash & (section->n_buckets - 1)];
+	     e; e = e->hash_next)
+		if (e->hash == hash && strcmp(e->key, key) == 0)
 			return e;
 
 	return NULL;
 }
 
+/* The first section of the given name; the others follow through
+ * next_same_name, in file order. */
+static struct weston_config_section *
+config_get_first_section(struct weston_config *config, const char *name)
+{
+	struct weston_config_section *s;
+	uint32_t hash;
+
+	if (config->n_buckets == 0)
+		return NULL;
+
+	hash = config_hash(name);
+	for (s = config->buckets[hash & (config->n_buckets - 1)];
+	     s; s = s->hash_next)
+		if (s->hash == hash && strcmp(s->name, name) == 0)
+			return s;
+
+	return NULL;
+}
+
 WL_EXPORT
 struct weston_config_section *
 weston_config_get_section(struct weston_config *config, const char *section,
@@ -142,9 +231,8 @@ weston_config_get_section(struct weston_config *config, const char *section,
 
 	if (config == NULL)
 		return NULL;
-	wl_list_for_each(s, &config->section_list, link) {
-		if (strcmp(s->name, section) != 0)
-			continue;
+	for (s = config_get_first_section(config, section);
+	     s; s = s->next_same_name) {
 		if (key == NULL)
 			return s;
 		e = config_section_get_entry(s, key);
@@ -155,6 +243,26 @@ weston_config_get_section(struct weston_config *config, const char *section,
 	return NULL;
 }
 
+/* Look up an entry and its cached value of the given type. Returns
+ * NULL, setting errno, if the key is missing. */
+static struct config_cached_value *
+config_section_get_cached(struct weston_config_section *section,
+			  const char *key, enum config_value_type type,
+			  struct weston_config_entry **entry_out)
+{
+	struct weston_config_entry *entry;
+
+	entry = config_section_get_entry(section, key);
+	if (entry == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	*entry_out = entry;
+
+	return &entry->cache[type];
+}
+
 WL_EXPORT
 int
 weston_config_section_get_int(struct weston_config_section *section,
@@ -162,19 +270,29 @@ weston_config_section_get_int(struct weston_config_section *section,
 			      int32_t *value, int32_t default_value)
 {
 	struct weston_config_entry *entry;
+	struct config_cached_value *c;
 
-	entry = config_section_get_entry(section, key);
-	if (entry == NULL) {
+	c = config_section_get_cached(section, key, CONFIG_VALUE_INT, &entry);
+	if (c == NULL) {
 		*value = default_value;
-		errno = ENOENT;
 		return -1;
 	}
 
-	if (!safe_strtoint(entry->value, value)) {
+	if (!c->valid) {
+		c->valid = true;
+		c->error = 0;
+		if (!safe_strtoint(entry->value, &c->v.i))
+			c->error = errno;
+	}
+
+	if (c->error) {
 		*value = default_value;
+		errno = c->error;
 		return -1;
 	}
 
+	*value = c->v.i;
+
 	return 0;
 }
 
@@ -186,31 +304,37 @@ weston_config_section_get_uint(struct weston_config_section *section,
 {
 	long int ret;
 	struct weston_config_entry *entry;
+	struct config_cached_value *c;
 	char *end;
 
-	entry = config_section_get_entry(section, key);
-	if (entry == NULL) {
+	c = config_section_get_cached(section, key, CONFIG_VALUE_UINT, &entry);
+	if (c == NULL) {
 		*value = default_value;
-		errno = ENOENT;
 		return -1;
 	}
 
-	errno = 0;
-	ret = strtol(entry->value, &end, 0);
-	if (errno != 0 || end == entry->value || *end != '\0') {
-		*value = default_value;
-		errno = EINVAL;
-		return -1;
+	if (!c->valid) {
+		c->valid = true;
+		c->error = 0;
+
+		errno = 0;
+		ret = strtol(entry->value, &end, 0);
+		if (errno != 0 || end == entry->value || *end != '\0')
+			c->error = EINVAL;
+		/* check range */
+		else if (ret < 0 || ret > INT_MAX)
+			c->error = ERANGE;
+		else
+			c->v.u = ret;
 	}
 
-	/* check range */
-	if (ret < 0 || ret > INT_MAX) {
+	if (c->error) {
 		*value = default_value;
-		errno = ERANGE;
+		errno = c->error;
 		return -1;
 	}
 
-	*value = ret;
+	*value = c->v.u;
 
 	return 0;
 }
@@ -222,34 +346,41 @@ weston_config_section_get_color(struct weston_config_section *section,
 				uint32_t *color, uint32_t default_color)
 {
 	struct weston_config_entry *entry;
+	struct config_cached_value *c;
 	int len;
 	char *end;
 
-	entry = config_section_get_entry(section, key);
-	if (entry == NULL) {
+	c = config_section_get_cached(section, key, CONFIG_VALUE_COLOR, &entry);
+	if (c == NULL) {
 		*color = default_color;
-		errno = ENOENT;
 		return -1;
 	}
 
-	len = strlen(entry->value);
-	if (len == 1 && entry->value[0] == '0') {
-		*color = 0;
-		return 0;
-	} else if (len != 8 && len != 10) {
-		*color = default_color;
-		errno = EINVAL;
-		return -1;
+	if (!c->valid) {
+		c->valid = true;
+		c->error = 0;
+
+		len = strlen(entry->value);
+		if (len == 1 && entry->value[0] == '0') {
+			c->v.u = 0;
+		} else if (len != 8 && len != 10) {
+			c->error = EINVAL;
+		} else {
+			errno = 0;
+			c->v.u = strtoul(entry->value, &end, 16);
+			if (errno != 0 || end == entry->value || *end != '\0')
+				c->error = EINVAL;
+		}
 	}
 
-	errno = 0;
-	*color = strtoul(entry->value, &end, 16);
-	if (errno != 0 || end == entry->value || *end != '\0') {
+	if (c->error) {
 		*color = default_color;
-		errno = EINVAL;
+		errno = c->error;
 		return -1;
 	}
 
+	*color = c->v.u;
+
 	return 0;
 }
 
@@ -260,22 +391,30 @@ weston_config_section_get_double(struct weston_config_section *section,
 				 double *value, double default_value)
 {
 	struct weston_config_entry *entry;
+	struct config_cached_value *c;
 	char *end;
 
-	entry = config_section_get_entry(section, key);
-	if (entry == NULL) {
+	c = config_section_get_cached(section, key, CONFIG_VALUE_DOUBLE,
+				      &entry);
+	if (c == NULL) {
 		*value = default_value;
-		errno = ENOENT;
 		return -1;
 	}
 
-	*value = strtod(entry->value, &end);
-	if (*end != '\0') {
+	if (!c->valid) {
+		c->valid = true;
+		c->v.d = strtod(entry->value, &end);
+		c->error = *end != '\0' ? EINVAL : 0;
+	}
+
+	if (c->error) {
 		*value = default_value;
-		errno = EINVAL;
+		errno = c->error;
 		return -1;
 	}
 
+	*value = c->v.d;
+
 	return 0;
 }
 
@@ -309,27 +448,93 @@ weston_config_section_get_bool(struct weston_config_section *section,
 			       int *value, int default_value)
 {
 	struct weston_config_entry *entry;
+	struct config_cached_value *c;
 
-	entry = config_section_get_entry(section, key);
-	if (entry == NULL) {
+	c = config_section_get_cached(section, key, CONFIG_VALUE_BOOL, &entry);
+	if (c == NULL) {
 		*value = default_value;
-		errno = ENOENT;
 		return -1;
 	}
 
-	if (strcmp(entry->value, "false") == 0)
-		*value = 0;
-	else if (strcmp(entry->value, "true") == 0)
-		*value = 1;
-	else {
+	if (!c->valid) {
+		c->valid = true;
+		c->error = 0;
+		if (strcmp(entry->value, "false") == 0)
+			c->v.b = 0;
+		else if (strcmp(entry->value, "true") == 0)
+			c->v.b = 1;
+		else
+			c->error = EINVAL;
+	}
+
+	if (c->error) {
 		*value = default_value;
-		errno = EINVAL;
+		errno = c->error;
 		return -1;
 	}
 
+	*value = c->v.b;
+
 	return 0;
 }
 
+static int
+open_config_file(struct weston_config *c, const char *name)
+{
+	const char *config_dir  = getenv("XDG_CONFIG_HOME");
+	const char *home_dir	= getenv("HOME");
+	const char *config_dirs = getenv("XDG_CONFIG_DIRS");
+	const char *p, *next;
+	int fd;
+
+	if (name[0] == '/') {
+		snprintf(c->path, sizeof c->path, "%s", name);
+		return open(name, O_RDONLY | O_CLOEXEC);
+	}
+
+	/* Precedence is given to config files in the home directory,
+	 * and then to directories listed in XDG_CONFIG_DIRS and
+	 * finally to the current working directory. */
+
+	/* $XDG_CONFIG_HOME */
+	if (config_dir) {
+		snprintf(c->path, sizeof c->path, "%s/%s", config_dir, name);
+		fd = open(c->path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+	}
+
+	/* $HOME/.config */
+	if (home_dir) {
+		snprintf(c->path, sizeof c->path,
+			 "%s/.config/%s", home_dir, name);
+		fd = open(c->path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+	}
+
+	/* For each $XDG_CONFIG_DIRS: weston/<config_file> */
+	if (!config_dirs)
+		config_dirs = "/etc/xdg";  /* See XDG base dir spec. */
+
+	for (p = config_dirs; *p != '\0'; p = next) {
+		next = strchrnul(p, ':');
+		snprintf(c->path, sizeof c->path,
+			 "%.*s/weston/%s", (int)(next - p), p, name);
+		fd = open(c->path, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+
+		if (*next == ':')
+			next++;
+	}
+
+	/* Current working directory. */
+	snprintf(c->path, sizeof c->path, "./%s", name);
+
+	return open(c->path, O_RDONLY | O_CLOEXEC);
+}
+
 WL_EXPORT
 const char *
 weston_config_get_libexec_dir(void)
@@ -354,12 +559,58 @@ weston_config_get_name_from_env(void)
 	return "weston.ini";
 }
 
+/* Returns -1 if there is no memory for the table */
+static int
+config_index_section(struct weston_config *config,
+		     struct weston_config_section *section)
+{
+	struct weston_config_section *s;
+	uint32_t i;
+
+	section->hash_next = NULL;
+	section->next_same_name = NULL;
+
+	s = config_get_first_section(config, section->name);
+	if (s) {
+		while (s->next_same_name)
+			s = s->next_same_name;
+		s->next_same_name = section;
+		return 0;
+	}
+
+	if (config_table_reserve(config, config->n_sections + 1) < 0)
+		return -1;
+
+	i = section->hash & (config->n_buckets - 1);
+	section->hash_next = config->buckets[i];
+	config->buckets[i] = section;
+	config->n_sections++;
+
+	return 0;
+}
+
+static void
+config_reindex(struct weston_config *config)
+{
+	struct weston_config_section *s;
+
+	if (config->buckets)
+		memset(config->buckets, 0,
+		       config->n_buckets * sizeof config->buckets[0]);
+	config->n_sections = 0;
+
+	/* weston_config_reload() made room for every name beforehand, so
+	 * this can't fail */
+	wl_list_for_each(s, &config->section_list, link)
+		config_index_section(config, s);
+}
+
 static struct weston_config_section *
 config_add_section(struct weston_config *config, const char *name)
 {
 	struct weston_config_section *section;
 
-	section = malloc(sizeof *section);
+	section = zalloc(sizeof *section);
 	if (section == NULL)
 		return NULL;
 
@@ -369,7 +620,15 @@ config_add_section(struct weston_config *config, const char *name)
 		return NULL;
 	}
 
+	section->hash = config_hash(name);
 	wl_list_init(&section->entry_list);
+
+	if (config_index_section(config, section) < 0) {
+		free(section->name);
+		free(section);
+		return NULL;
+	}
+
 	wl_list_insert(config->section_list.prev, &section->link);
 
 	return section;
@@ -380,8 +639,9 @@ section_add_entry(struct weston_config_section *section,
 		  const char *key, const char *value)
 {
 	struct weston_config_entry *entry;
+	uint32_t i;
 
-	entry = malloc(sizeof *entry);
+	entry = zalloc(sizeof *entry);
 	if (entry == NULL)
 		return NULL;
 
@@ -398,44 +658,92 @@ section_add_entry(struct weston_config_section *section,
 		return NULL;
 	}
 
+	entry->hash = config_hash(key);
+
+	/* a duplicated key is never looked up */
+	if (!config_section_get_entry(section, key)) {
+		section->n_entries++;
+		section_table_grow(section);
+		if (section->n_buckets == 0) {
+			section->n_entries--;
+			free(entry->value);
+			free(entry->key);
+			free(entry);
+			return NULL;
+		}
+
+		i = entry->hash & (section->n_buckets - 1);
+		entry->hash_next = section->buckets[i];
+		section->buckets[i] = entry;
+	}
+
 	wl_list_insert(section->entry_list.prev, &entry->link);
 
 	return entry;
 }
 
-struct weston_config *
-weston_config_parse(const char *name)
+static void
+section_clear(struct weston_config_section *section)
+{
+	struct weston_config_entry *e, *next_e;
+
+	wl_list_for_each_safe(e, next_e, &section->entry_list, link) {
+		free(e->key);
+		free(e->value);
+		free(e);
+	}
+	wl_list_init(&section->entry_list);
+
+	free(section->buckets);
+	section->buckets = NULL;
+	section->n_buckets = 0;
+	section->n_entries = 0;
+}
+
+static void
+section_destroy(struct weston_config_section *section)
+{
+	section_clear(section);
+	free(section->name);
+	free(section);
+}
+
+static struct weston_config *
+config_create(void)
 {
-	FILE *fp;
-	char line[512], *p;
-	struct stat filestat;
 	struct weston_config *config;
-	struct weston_config_section *section = NULL;
-	int i, fd;
 
-	config = malloc(sizeof *config);
+	config = zalloc(sizeof *config);
 	if (config == NULL)
 		return NULL;
 
 	wl_list_init(&config->section_list);
+	wl_list_init(&config->removed_list);
 
-	fd = open_config_file(config, name);
-	if (fd == -1) {
-		free(config);
-		return NULL;
-	}
+	return config;
+}
+
+/* Takes over fd. Returns -1 if the file can't be read or is malformed,
+ * leaving what was parsed so far in config. */
+static int
+config_parse_fd(struct weston_config *config, int fd)
+{
+	FILE *fp;
+	char line[512], *p;
+	struct stat filestat;
+	struct weston_config_section *section = NULL;
+	int i;
 
 	if (fstat(fd, &filestat) < 0 ||
 	    !S_ISREG(filestat.st_mode)) {
 		close(fd);
-		free(config);
-		return NULL;
+		return -1;
 	}
 
 	fp = fdopen(fd, "r");
 	if (fp == NULL) {
-		free(config);
-		return NULL;
+		close(fd);
+		return -1;
 	}
 
 	while (fgets(line, sizeof line, fp)) {
@@ -449,8 +757,7 @@ weston_config_parse(const char *name)
 				fprintf(stderr, "malformed "
 					"section header: %s\n", line);
 				fclose(fp);
-				weston_config_destroy(config);
-				return NULL;
+				return -1;
 			}
 			p[0] = '\0';
 			section = config_add_section(config, &line[1]);
@@ -461,8 +768,7 @@ weston_config_parse(const char *name)
 				fprintf(stderr, "malformed "
 					"config line: %s\n", line);
 				fclose(fp);
-				weston_config_destroy(config);
-				return NULL;
+				return -1;
 			}
 
 			p[0] = '\0';
@@ -481,9 +787,184 @@ weston_config_parse(const char *name)
 
 	fclose(fp);
 
+	return 0;
+}
+
+struct weston_config *
+weston_config_parse(const char *name)
+{
+	struct weston_config *config;
+	int fd;
+
+	config = config_create();
+	if (config == NULL)
+		return NULL;
+
+	fd = open_config_file(config, name);
+	if (fd == -1) {
+		free(config);
+		return NULL;
+	}
+
+	if (config_parse_fd(config, fd) < 0) {
+		weston_config_destroy(config);
+		return NULL;
+	}
+
 	return config;
 }
 
+static bool
+section_equal(struct weston_config_section *a,
+	      struct weston_config_section *b)
+{
+	struct weston_config_entry *ea, *eb;
+
+	if (wl_list_length(&a->entry_list) != wl_list_length(&b->entry_list))
+		return false;
+
+	eb = container_of(b->entry_list.next, struct weston_config_entry, link);
+	wl_list_for_each(ea, &a->entry_list, link) {
+		if (strcmp(ea->key, eb->key) != 0 ||
+		    strcmp(ea->value, eb->value) != 0)
+			return false;
+		eb = container_of(eb->link.next,
+				  struct weston_config_entry, link);
+	}
+
+	return true;
+}
+
+static void
+section_swap_entries(struct weston_config_section *a,
+		     struct weston_config_section *b)
+{
+	struct weston_config_entry **buckets = a->buckets;
+	uint32_t n_buckets = a->n_buckets;
+	uint32_t n_entries = a->n_entries;
+	struct wl_list tmp;
+
+	wl_list_init(&tmp);
+	wl_list_insert_list(&tmp, &a->entry_list);
+	wl_list_init(&a->entry_list);
+	wl_list_insert_list(&a->entry_list, &b->entry_list);
+	wl_list_init(&b->entry_list);
+	wl_list_insert_list(&b->entry_list, &tmp);
+
+	a->buckets = b->buckets;
+	a->n_buckets = b->n_buckets;
+	a->n_entries = b->n_entries;
+	b->buckets = buckets;
+	b->n_buckets = n_buckets;
+	b->n_entries = n_entries;
+}
+
+/** Read the config file again, updating only what changed
+ *
+ * \param config The config to update, from the file it was parsed from.
+ * \param changed Called for each section whose entries changed, which
+ *                was added or which was removed, after the whole config
+ *                is updated; may be NULL.
+ * \param data Passed to changed.
+ * \return 0 on success, -1 if the file could not be read or parsed, in
+ *         which case the config is left as it was.
+ *
+ * Sections are matched by name and by their order among the sections
+ * of that name. Pointers to sections stay valid: a changed section
+ * gets the new entries, and a removed one is left empty. Pointers to
+ * sections added by a reload are valid until the config is destroyed.
+ */
+WL_EXPORT
+int
+weston_config_reload(struct weston_config *config,
+		     weston_config_changed_func_t changed, void *data)
+{
+	struct weston_config *fresh;
+	struct weston_config_section *s, *next_s, *o, *f;
+	struct wl_list removed;
+	int fd;
+
+	if (config == NULL)
+		return -1;
+
+	fresh = config_create();
+	if (fresh == NULL)
+		return -1;
+
+	fd = open(config->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || config_parse_fd(fresh, fd) < 0) {
+		weston_config_destroy(fresh);
+		return -1;
+	}
+
+	/* Every section name left after the update is one of fresh's, so
+	 * with room for those reindexing needs no memory. */
+	if (config_table_reserve(config, fresh->n_sections) < 0) {
+		weston_config_destroy(fresh);
+		return -1;
+	}
+
+	/* Pair up the sections of each name in order. A matched fresh
+	 * section is left holding the old entries. */
+	wl_list_for_each(s, &config->section_list, link) {
+		s->matched = false;
+		s->changed = false;
+	}
+
+	wl_list_for_each(s, &config->section_list, link) {
+		if (config_get_first_section(config, s->name) != s)
+			continue;
+
+		f = config_get_first_section(fresh, s->name);
+		for (o = s; o; o = o->next_same_name) {
+			if (f == NULL)
+				break;
+
+			o->matched = true;
+			f->matched = true;
+			if (!section_equal(o, f)) {
+				section_swap_entries(o, f);
+				o->changed = true;
+			}
+			f = f->next_same_name;
+		}
+	}
+
+	wl_list_init(&removed);
+	wl_list_for_each_safe(s, next_s, &config->section_list, link) {
+		if (s->matched)
+			continue;
+
+		section_clear(s);
+		wl_list_remove(&s->link);
+		wl_list_insert(removed.prev, &s->link);
+	}
+
+	wl_list_for_each_safe(s, next_s, &fresh->section_list, link) {
+		if (s->matched)
+			continue;
+
+		wl_list_remove(&s->link);
+		wl_list_insert(config->section_list.prev, &s->link);
+		s->changed = true;
+	}
+
+	weston_config_destroy(fresh);
+	config_reindex(config);
+
+	if (changed) {
+		wl_list_for_each(s, &config->section_list, link)
+			if (s->changed)
+				changed(s, s->name, data);
+		wl_list_for_each(s, &removed, link)
+			changed(s, s->name, data);
+	}
+
+	wl_list_insert_list(config->removed_list.prev, &removed);
+
+	return 0;
+}
+
 const char *
 weston_config_get_full_path(struct weston_config *config)
 {
@@ -518,20 +999,15 @@ void
 weston_config_destroy(struct weston_config *config)
 {
 	struct weston_config_section *s, *next_s;
-	struct weston_config_entry *e, *next_e;
 
 	if (config == NULL)
 		return;
 
-	wl_list_for_each_safe(s, next_s, &config->section_list, link) {
-		wl_list_for_each_safe(e, next_e, &s->entry_list, link) {
-			free(e->key);
-			free(e->value);
-			free(e);
-		}
-		free(s->name);
-		free(s);
-	}
+	wl_list_for_each_safe(s, next_s, &config->section_list, link)
+		section_destroy(s);
+	wl_list_for_each_safe(s, next_s, &config->removed_list, link)
+		section_destroy(s);
 
+	free(config->buckets);
 	free(config);
 }
@@ -118,6 +118,13 @@ weston_config_get_full_path(struct weston_config *config);
 void
 weston_config_destroy(struct weston_config *config);
 
+typedef void (*weston_config_changed_func_t)(struct weston_config_section *section,
+					     const char *name, void *data);
+
+int
+weston_config_reload(struct weston_config *config,
+		     weston_config_changed_func_t changed, void *data);
+
 int weston_config_next_section(struct weston_config *config,
 			       struct weston_config_section **section,
 			       const char **name);
@@ -380,6 +380,11 @@ frame_set_title(struct frame *frame, const char *title)
 {
 	char *dup = NULL;
 
+	/* An unchanged title needs no repaint */
+	if (title == frame->title ||
+	    (title && frame->title && strcmp(title, frame->title) == 0))
+		return 0;
+
 	if (title) {
 		dup = strdup(title);
 		if (!dup)
@@ -401,6 +406,9 @@ frame_set_flag(struct frame *frame, enum frame_flag flag)
 	if (flag & FRAME_FLAG_MAXIMIZED && !(frame->flags & FRAME_FLAG_MAXIMIZED))
 		frame->geometry_dirty = 1;
 
+	if ((frame->flags & flag) == flag)
+		return;
+
 	frame->flags |= flag;
 	frame->status |= FRAME_STATUS_REPAINT;
 }
@@ -411,6 +419,9 @@ frame_unset_flag(struct frame *frame, enum frame_flag flag)
 	if (flag & FRAME_FLAG_MAXIMIZED && frame->flags & FRAME_FLAG_MAXIMIZED)
 		frame->geometry_dirty = 1;
 
+	if (!(frame->flags & flag))
+		return;
+
 	frame->flags &= ~flag;
 	frame->status |= FRAME_STATUS_REPAINT;
 }
@@ -418,6 +429,9 @@ frame_unset_flag(struct frame *frame, enum frame_flag flag)
 void
 frame_resize(struct frame *frame, int32_t width, int32_t height)
 {
+	if (frame->width == width && frame->height == height)
+		return;
+
 	frame->width = width;
 	frame->height = height;
 
@@ -605,6 +619,26 @@ frame_status_clear(struct frame *frame, enum frame_status status)
 	frame->status &= ~status;
 }
 
+/* What frame_repaint() draws depends on besides the size and the title:
+ * the flags, the buttons and which of them are hovered or pressed.
+ * Frames of one theme that agree on all of these look the same. */
+uint32_t
+frame_appearance(struct frame *frame)
+{
+	struct frame_button *button;
+	uint32_t appearance = frame->flags;
+
+	wl_list_for_each(button, &frame->buttons, link) {
+		appearance |= button->status_effect << 8;
+		if (button->press_count)
+			appearance |= button->status_effect << 16;
+		else if (button->hover_count)
+			appearance |= button->status_effect << 24;
+	}
+
+	return appearance;
+}
+
 static struct frame_button *
 frame_find_button(struct frame *frame, int x, int y)
 {
@@ -29,8 +29,15 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <png.h>
 #include <pixman.h>
 
@@ -149,43 +156,29 @@ load_jpeg(FILE *fp)
 
 #endif
 
-static inline int
-multiply_alpha(int alpha, int color)
-{
-    int temp = (alpha * color) + 0x80;
-
-    return ((temp + (temp >> 8)) >> 8);
-}
-
+/* Premultiplies red and blue together in the two halves of a word,
+ * rounding like (alpha * color + 127) / 255, without branches so that
+ * the compiler can vectorize the loop. */
 static void
 premultiply_data(png_structp   png,
 		 png_row_infop row_info,
 		 png_bytep     data)
 {
-    unsigned int i;
-    png_bytep p;
-
-    for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
-	png_byte  alpha = p[3];
-	uint32_t w;
-
-	if (alpha == 0) {
-		w = 0;
-	} else {
-		png_byte red   = p[0];
-		png_byte green = p[1];
-		png_byte blue  = p[2];
-
-		if (alpha != 0xff) {
-			red   = multiply_alpha(alpha, red);
-			green = multiply_alpha(alpha, green);
-			blue  = multiply_alpha(alpha, blue);
-		}
-		w = (alpha << 24) | (red << 16) | (green << 8) | (blue << 0);
-	}
+	png_size_t i;
+	png_bytep p;
+	uint32_t a, rb, g, w;
 
-	* (uint32_t *) p = w;
-    }
+	for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
+		a = p[3];
+
+		rb = ((uint32_t) p[0] << 16 | p[2]) * a + 0x00800080;
+		rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+		g = p[1] * a + 0x80;
+		g = (g + (g >> 8)) & 0xff00;
+
+		w = a << 24 | rb | g;
+		memcpy(p, &w, sizeof w);
+	}
 }
 
 static void
@@ -313,6 +306,7 @@ load_webp(FILE *fp)
 	int len;
 	VP8StatusCode status;
 	WebPIDecoder *idec;
+	pixman_image_t *image;
 
 	if (!WebPInitDecoderConfig(&config)) {
 		fprintf(stderr, "Library version mismatch!\n");
@@ -329,7 +323,7 @@ load_webp(FILE *fp)
 		return NULL;
 	}
 
-	config.output.colorspace = MODE_BGRA;
+	config.output.colorspace = MODE_bgrA;
 	config.output.u.RGBA.stride = stride_for_width(config.input.width);
 	config.output.u.RGBA.size =
 		config.output.u.RGBA.stride * config.input.height;
@@ -362,11 +356,20 @@ load_webp(FILE *fp)
 	WebPIDelete(idec);
 	WebPFreeDecBuffer(&config.output);
 
-	return pixman_image_create_bits(PIXMAN_a8r8g8b8,
-					config.input.width,
-					config.input.height,
-					(uint32_t *) config.output.u.RGBA.rgba,
-					config.output.u.RGBA.stride);
+	image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					 config.input.width,
+					 config.input.height,
+					 (uint32_t *) config.output.u.RGBA.rgba,
+					 config.output.u.RGBA.stride);
+	if (!image) {
+		free(config.output.u.RGBA.rgba);
+		return NULL;
+	}
+
+	pixman_image_set_destroy_function(image, pixman_image_destroy_func,
+					  config.output.u.RGBA.rgba);
+
+	return image;
 }
 
 #else
@@ -393,8 +396,8 @@ static const struct image_loader loaders[] = {
 	{ { 'R', 'I', 'F', 'F' }, 4, load_webp }
 };
 
-pixman_image_t *
-load_image(const char *filename)
+static pixman_image_t *
+decode_image(const char *filename)
 {
 	pixman_image_t *image = NULL;
 	unsigned char header[4];
@@ -438,3 +441,281 @@ load_image(const char *filename)
 
 	return image;
 }
+
+/* Decoded images are kept in $XDG_CACHE_HOME/weston/images, one file per
+ * source path, so that a client starting up or adding an output maps the
+ * pixels instead of decoding them again. The mapping is private: pages
+ * stay shared through the page cache, between clients too, until someone
+ * draws on them. */
+
+#define IMAGE_CACHE_MAGIC	0x474d4957	/* "WIMG" */
+#define IMAGE_CACHE_VERSION	1
+#define IMAGE_CACHE_DATA_OFFSET	4096		/* page aligned pixels */
+
+struct image_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint32_t format;
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+};
+
+struct image_cache_mapping {
+	void *addr;
+	size_t size;
+};
+
+static void
+image_cache_header_init(struct image_cache_header *header,
+			const struct stat *src)
+{
+	memset(header, 0, sizeof *header);
+	header->magic = IMAGE_CACHE_MAGIC;
+	header->version = IMAGE_CACHE_VERSION;
+	header->src_dev = src->st_dev;
+	header->src_ino = src->st_ino;
+	header->src_size = src->st_size;
+	header->src_mtime_sec = src->st_mtim.tv_sec;
+	header->src_mtime_nsec = src->st_mtim.tv_nsec;
+}
+
+static int
+image_cache_dir(char *dir, size_t len)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int n;
+
+	if (cache_home && cache_home[0] == '/')
+		n = snprintf(dir, len, "%s/weston", cache_home);
+	else if (home && home[0] == '/')
+		n = snprintf(dir, len, "%s/.cache/weston", home);
+	else
+		return -1;
+
+	if (n < 0 || (size_t) n >= len)
+		return -1;
+
+	return 0;
+}
+
+static int
+image_cache_path(const char *filename, char *path, size_t len)
+{
+	char dir[PATH_MAX];
+	char *real;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const char *c;
+	int n;
+
+	if (image_cache_dir(dir, sizeof dir) < 0)
+		return -1;
+
+	real = realpath(filename, NULL);
+	if (!real)
+		return -1;
+
+	for (c = real; *c; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 0x100000001b3ull;
+	}
+	free(real);
+
+	n = snprintf(path, len, "%s/images/%016llx",
+		     dir, (unsigned long long) hash);
+	if (n < 0 || (size_t) n >= len)
+		return -1;
+
+	return 0;
+}
+
+static void
+image_cache_unmap(pixman_image_t *image, void *data)
+{
+	struct image_cache_mapping *mapping = data;
+
+	munmap(mapping->addr, mapping->size);
+	free(mapping);
+}
+
+static pixman_image_t *
+image_cache_load(const char *path, const struct stat *src)
+{
+	struct image_cache_header expected, header;
+	struct image_cache_mapping *mapping;
+	pixman_image_t *image;
+	struct stat st;
+	size_t size;
+	void *addr;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	image_cache_header_init(&expected, src);
+	if (pread(fd, &header, sizeof header, 0) != sizeof header ||
+	    memcmp(&header, &expected,
+		   offsetof(struct image_cache_header, format)) != 0 ||
+	    (header.format != PIXMAN_a8r8g8b8 &&
+	     header.format != PIXMAN_x8r8g8b8) ||
+	    header.width <= 0 || header.height <= 0 ||
+	    header.stride < header.width * 4 || header.stride % 4 != 0 ||
+	    fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	size = IMAGE_CACHE_DATA_OFFSET +
+	       (size_t) header.stride * header.height;
+	if ((size_t) st.st_size < size) {
+		close(fd);
+		return NULL;
+	}
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	mapping = malloc(sizeof *mapping);
+	if (!mapping) {
+		munmap(addr, size);
+		return NULL;
+	}
+	mapping->addr = addr;
+	mapping->size = size;
+
+	image = pixman_image_create_bits(header.format,
+					 header.width, header.height,
+					 (uint32_t *) ((char *) addr +
+						       IMAGE_CACHE_DATA_OFFSET),
+					 header.stride);
+	if (!image) {
+		image_cache_unmap(NULL, mapping);
+		return NULL;
+	}
+
+	pixman_image_set_destroy_function(image, image_cache_unmap, mapping);
+
+	return image;
+}
+
+static int
+write_all(int fd, const void *data, size_t len, off_t offset)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Written to a temporary file and renamed, so that a concurrent reader
+ * sees either the old entry or the complete new one. */
+static void
+image_cache_store(const char *path, const struct stat *src,
+		  pixman_image_t *image)
+{
+	struct image_cache_header header;
+	char dir[PATH_MAX], tmp[PATH_MAX + 8];
+	const char *data;
+	size_t row;
+	int fd, y, n;
+
+	image_cache_header_init(&header, src);
+	header.format = pixman_image_get_format(image);
+	header.width = pixman_image_get_width(image);
+	header.height = pixman_image_get_height(image);
+	header.stride = pixman_image_get_stride(image);
+	data = (const char *) pixman_image_get_data(image);
+
+	if ((header.format != PIXMAN_a8r8g8b8 &&
+	     header.format != PIXMAN_x8r8g8b8) ||
+	    header.stride <= 0 || !data)
+		return;
+
+	if (image_cache_dir(dir, sizeof dir) < 0)
+		return;
+	mkdir(dir, 0700);
+	n = snprintf(tmp, sizeof tmp, "%s/images", dir);
+	if (n < 0 || (size_t) n >= sizeof tmp)
+		return;
+	mkdir(tmp, 0700);
+
+	n = snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+	if (n < 0 || (size_t) n >= sizeof tmp)
+		return;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	row = (size_t) header.width * 4;
+	if (write_all(fd, &header, sizeof header, 0) < 0)
+		goto err;
+	for (y = 0; y < header.height; y++) {
+		if (write_all(fd, data + (size_t) y * header.stride, row,
+			      IMAGE_CACHE_DATA_OFFSET +
+			      (off_t) y * header.stride) < 0)
+			goto err;
+	}
+	/* the padding after the last row */
+	if (ftruncate(fd, IMAGE_CACHE_DATA_OFFSET +
+			  (off_t) header.stride * header.height) < 0)
+		goto err;
+
+	close(fd);
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+
+	return;
+
+err:
+	close(fd);
+	unlink(tmp);
+}
+
+pixman_image_t *
+load_image(const char *filename)
+{
+	pixman_image_t *image;
+	char path[PATH_MAX];
+	struct stat src;
+	bool cache;
+
+	if (!filename || !*filename)
+		return NULL;
+
+	cache = stat(filename, &src) == 0 && S_ISREG(src.st_mode) &&
+		image_cache_path(filename, path, sizeof path) == 0;
+
+	if (cache) {
+		image = image_cache_load(path, &src);
+		if (image)
+			return image;
+	}
+
+	image = decode_image(filename);
+
+	if (image && cache)
+		image_cache_store(path, &src, image);
+
+	return image;
+}
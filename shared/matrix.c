@@ -59,24 +59,107 @@ weston_matrix_init(struct weston_matrix *matrix)
 	memcpy(matrix, &identity, sizeof identity);
 }
 
+/* Nothing but translations, scales and rotations in the xy plane: the
+ * last row is 0 0 0 1. */
+#define MATRIX_AFFINE_TYPES (WESTON_MATRIX_TRANSFORM_TRANSLATE | \
+			     WESTON_MATRIX_TRANSFORM_SCALE | \
+			     WESTON_MATRIX_TRANSFORM_ROTATE)
+
+/*
+ * The type specific paths below add up the same products in the same
+ * order as the general 4x4 ones, only leaving out those known to be
+ * zero, so for finite input they agree with them exactly, up to the sign
+ * of zero.
+ */
+
+typedef float matrix_v4sf __attribute__((vector_size(16)));
+
+static inline matrix_v4sf
+matrix_load_v4sf(const float *f)
+{
+	matrix_v4sf v;
+
+	memcpy(&v, f, sizeof v);
+	return v;
+}
+
+static inline void
+matrix_store_v4sf(float *f, matrix_v4sf v)
+{
+	memcpy(f, &v, sizeof v);
+}
+
+static void
+matrix_multiply_affine(struct weston_matrix *tmp,
+		       const struct weston_matrix *m,
+		       const struct weston_matrix *n)
+{
+	const float *col;
+	unsigned c, r;
+
+	for (c = 0; c < 4; c++) {
+		col = m->d + c * 4;
+		for (r = 0; r < 3; r++)
+			tmp->d[c * 4 + r] = col[0] * n->d[r] +
+					    col[1] * n->d[4 + r] +
+					    col[2] * n->d[8 + r];
+		tmp->d[c * 4 + 3] = 0;
+	}
+
+	for (r = 0; r < 3; r++)
+		tmp->d[12 + r] += n->d[12 + r];
+	tmp->d[15] = 1;
+}
+
+static void
+matrix_multiply_general(struct weston_matrix *tmp,
+			const struct weston_matrix *m,
+			const struct weston_matrix *n)
+{
+	matrix_v4sf n0 = matrix_load_v4sf(n->d + 0);
+	matrix_v4sf n1 = matrix_load_v4sf(n->d + 4);
+	matrix_v4sf n2 = matrix_load_v4sf(n->d + 8);
+	matrix_v4sf n3 = matrix_load_v4sf(n->d + 12);
+	const float *col;
+	unsigned c;
+
+	for (c = 0; c < 4; c++) {
+		col = m->d + c * 4;
+		matrix_store_v4sf(tmp->d + c * 4,
+				  n0 * col[0] + n1 * col[1] +
+				  n2 * col[2] + n3 * col[3]);
+	}
+}
+
 /* m <- n * m, that is, m is multiplied on the LEFT. */
 WL_EXPORT void
 weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
 {
 	struct weston_matrix tmp;
-	const float *row, *column;
-	div_t d;
-	int i, j;
-
-	for (i = 0; i < 16; i++) {
-		tmp.d[i] = 0;
-		d = div(i, 4);
-		row = m->d + d.quot * 4;
-		column = n->d + d.rem;
-		for (j = 0; j < 4; j++)
-			tmp.d[i] += row[j] * column[j * 4];
+	unsigned type = m->type | n->type;
+
+	if (n->type == 0)
+		return;
+
+	if (m->type == 0) {
+		memcpy(m, n, sizeof *m);
+		return;
+	}
+
+	if ((type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE) == 0) {
+		m->d[12] += n->d[12];
+		m->d[13] += n->d[13];
+		m->d[14] += n->d[14];
+		m->type = type;
+		return;
 	}
-	tmp.type = m->type | n->type;
+
+	if ((type & ~MATRIX_AFFINE_TYPES) == 0)
+		matrix_multiply_affine(&tmp, m, n);
+	else
+		matrix_multiply_general(&tmp, m, n);
+
+	tmp.type = type;
 	memcpy(m, &tmp, sizeof tmp);
 }
 
@@ -117,18 +200,95 @@ weston_matrix_rotate_xy(struct weston_matrix *matrix, float cos, float sin)
 WL_EXPORT void
 weston_matrix_transform(struct weston_matrix *matrix, struct weston_vector *v)
 {
-	int i, j;
+	const float *d = matrix->d;
 	struct weston_vector t;
+	unsigned i;
 
-	for (i = 0; i < 4; i++) {
-		t.f[i] = 0;
-		for (j = 0; j < 4; j++)
-			t.f[i] += v->f[j] * matrix->d[i + j * 4];
+	if (matrix->type == 0)
+		return;
+
+	if ((matrix->type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE) == 0) {
+		for (i = 0; i < 3; i++)
+			v->f[i] += v->f[3] * d[12 + i];
+		return;
+	}
+
+	if ((matrix->type & ~MATRIX_AFFINE_TYPES) == 0) {
+		for (i = 0; i < 3; i++)
+			t.f[i] = v->f[0] * d[i] + v->f[1] * d[4 + i] +
+				 v->f[2] * d[8 + i] + v->f[3] * d[12 + i];
+		t.f[3] = v->f[3];
+	} else {
+		matrix_store_v4sf(t.f,
+				  matrix_load_v4sf(d + 0) * v->f[0] +
+				  matrix_load_v4sf(d + 4) * v->f[1] +
+				  matrix_load_v4sf(d + 8) * v->f[2] +
+				  matrix_load_v4sf(d + 12) * v->f[3]);
 	}
 
 	*v = t;
 }
 
+/** Transform points in the z = 0 plane
+ *
+ * \param matrix The matrix to transform with.
+ * \param xy count points as x, y pairs, transformed in place, including
+ * the division by w.
+ * \param count The number of points.
+ * \return How many points ended up with w too close to zero to divide
+ * by; those are set to 0, 0.
+ *
+ * Like weston_matrix_transform() on each point in turn, but the path for
+ * the matrix type is picked once, and the loops are simple enough for
+ * the compiler to vectorise.
+ */
+WL_EXPORT unsigned
+weston_matrix_transform_points(const struct weston_matrix *matrix,
+			       float *xy, unsigned count)
+{
+	const float *d = matrix->d;
+	unsigned unstable = 0;
+	unsigned i;
+	float x, y, w;
+
+	if (matrix->type == 0)
+		return 0;
+
+	if ((matrix->type & ~WESTON_MATRIX_TRANSFORM_TRANSLATE) == 0) {
+		for (i = 0; i < count; i++) {
+			xy[i * 2] += d[12];
+			xy[i * 2 + 1] += d[13];
+		}
+		return 0;
+	}
+
+	if ((matrix->type & ~MATRIX_AFFINE_TYPES) == 0) {
+		for (i = 0; i < count; i++) {
+			x = xy[i * 2];
+			y = xy[i * 2 + 1];
+			xy[i * 2] = x * d[0] + y * d[4] + d[12];
+			xy[i * 2 + 1] = x * d[1] + y * d[5] + d[13];
+		}
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		x = xy[i * 2];
+		y = xy[i * 2 + 1];
+		w = x * d[3] + y * d[7] + d[15];
+		if (fabsf(w) < 1e-6) {
+			xy[i * 2] = 0;
+			xy[i * 2 + 1] = 0;
+			unstable++;
+			continue;
+		}
+		xy[i * 2] = (x * d[0] + y * d[4] + d[12]) / w;
+		xy[i * 2 + 1] = (x * d[1] + y * d[5] + d[13]) / w;
+	}
+
+	return unstable;
+}
+
 static inline void
 swap_rows(double *a, double *b)
 {
@@ -256,6 +416,36 @@ inverse_transform(const double *LU, const unsigned *p, float *v)
 		v[j] = b[j];
 }
 
+/*
+ * Scales and translations only: the diagonal and the last column. This
+ * is what the LU decomposition comes down to for such a matrix, with
+ * the same divisions in double precision.
+ */
+static int
+matrix_invert_scale_translate(struct weston_matrix *inverse,
+			      const struct weston_matrix *matrix)
+{
+	double diag[3];
+	double t[3];
+	unsigned i;
+
+	for (i = 0; i < 3; i++) {
+		diag[i] = matrix->d[i * 5];
+		if (fabs(diag[i]) < 1e-9)
+			return -1; /* zero pivot, not invertible */
+		t[i] = matrix->d[12 + i];
+	}
+
+	weston_matrix_init(inverse);
+	for (i = 0; i < 3; i++) {
+		inverse->d[i * 5] = 1.0 / diag[i];
+		inverse->d[12 + i] = -t[i] / diag[i];
+	}
+	inverse->type = matrix->type;
+
+	return 0;
+}
+
 WL_EXPORT int
 weston_matrix_invert(struct weston_matrix *inverse,
 		     const struct weston_matrix *matrix)
@@ -264,6 +454,10 @@ weston_matrix_invert(struct weston_matrix *inverse,
 	unsigned perm[4];	/* permutation */
 	unsigned c;
 
+	if ((matrix->type & ~(WESTON_MATRIX_TRANSFORM_TRANSLATE |
+			      WESTON_MATRIX_TRANSFORM_SCALE)) == 0)
+		return matrix_invert_scale_translate(inverse, matrix);
+
 	if (matrix_invert(LU, perm, matrix) < 0)
 		return -1;
 
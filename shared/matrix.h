@@ -38,6 +38,9 @@ enum weston_matrix_transform_type {
 	WESTON_MATRIX_TRANSFORM_OTHER		= (1 << 3),
 };
 
+/* type is the set of transformations d was built from, and picks the
+ * code path used on it: code filling in d by hand has to set it to
+ * match, WESTON_MATRIX_TRANSFORM_OTHER when in doubt. */
 struct weston_matrix {
 	float d[16];
 	unsigned int type;
@@ -60,6 +63,9 @@ void
 weston_matrix_rotate_xy(struct weston_matrix *matrix, float cos, float sin);
 void
 weston_matrix_transform(struct weston_matrix *matrix, struct weston_vector *v);
+unsigned
+weston_matrix_transform_points(const struct weston_matrix *matrix,
+			       float *xy, unsigned count);
 
 int
 weston_matrix_invert(struct weston_matrix *inverse,
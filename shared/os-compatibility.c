@@ -31,6 +31,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -136,7 +138,9 @@ create_tmpfile_cloexec(char *tmpname)
  * The file should not have a permanent backing store like a disk,
  * but may have if XDG_RUNTIME_DIR is not properly implemented in OS.
  *
- * The file name is deleted from the file system.
+ * The file name is deleted from the file system. Where memfd_create() is
+ * available, the file has no name to begin with, and the caller may seal
+ * it with F_ADD_SEALS.
  *
  * The file is suitable for buffer sharing between processes by
  * transmitting the file descriptor over Unix sockets using the
@@ -157,25 +161,31 @@ os_create_anonymous_file(off_t size)
 	int fd;
 	int ret;
 
-	path = getenv("XDG_RUNTIME_DIR");
-	if (!path) {
-		errno = ENOENT;
-		return -1;
-	}
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("weston-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+#endif
+	{
+		path = getenv("XDG_RUNTIME_DIR");
+		if (!path) {
+			errno = ENOENT;
+			return -1;
+		}
 
-	name = malloc(strlen(path) + sizeof(template));
-	if (!name)
-		return -1;
+		name = malloc(strlen(path) + sizeof(template));
+		if (!name)
+			return -1;
 
-	strcpy(name, path);
-	strcat(name, template);
+		strcpy(name, path);
+		strcat(name, template);
 
-	fd = create_tmpfile_cloexec(name);
+		fd = create_tmpfile_cloexec(name);
 
-	free(name);
+		free(name);
 
-	if (fd < 0)
-		return -1;
+		if (fd < 0)
+			return -1;
+	}
 
 #ifdef HAVE_POSIX_FALLOCATE
 	ret = posix_fallocate(fd, 0, size);
@@ -195,6 +205,133 @@ os_create_anonymous_file(off_t size)
 	return fd;
 }
 
+/*
+ * Grow a file made by os_create_anonymous_file(), with the same
+ * guarantee about disk space.
+ */
+int
+os_resize_anonymous_file(int fd, off_t size)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+	int ret;
+
+	ret = posix_fallocate(fd, 0, size);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+#else
+	return ftruncate(fd, size);
+#endif
+}
+
+/*
+ * Seal a file made by os_create_anonymous_file() so that it can no
+ * longer shrink, and whoever has it mapped can rely on the mapping. With
+ * frozen, the contents and size cannot change at all anymore, and no
+ * more seals can be added.
+ *
+ * Fails with EINVAL when the file does not support sealing, which is the
+ * case for files that did not come from memfd_create().
+ */
+int
+os_seal_anonymous_file(int fd, bool frozen)
+{
+#ifdef F_ADD_SEALS
+	int seals = F_SEAL_SHRINK;
+
+	if (frozen)
+		seals |= F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SEAL;
+
+	return fcntl(fd, F_ADD_SEALS, seals);
+#else
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+#if defined(HAVE_MEMFD_CREATE) && defined(MFD_HUGETLB)
+static int
+create_huge_file(off_t *size)
+{
+	struct stat st;
+	off_t aligned;
+	int fd;
+
+	fd = memfd_create("weston-shared",
+			  MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+	if (fd < 0)
+		return -1;
+
+	/* hugetlbfs reports the huge page size as the block size */
+	if (fstat(fd, &st) < 0 || st.st_blksize <= 0) {
+		close(fd);
+		return -1;
+	}
+	aligned = (*size + st.st_blksize - 1) / st.st_blksize * st.st_blksize;
+
+	/* Takes the pages from the reserved huge pages now, and fails if
+	 * there are not enough of them. */
+	if (fallocate(fd, 0, 0, aligned) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	*size = aligned;
+
+	return fd;
+}
+#endif
+
+/*
+ * Create a file for a buffer shared with the compositor, like
+ * os_create_anonymous_file().
+ *
+ * From OS_LARGE_BUFFER_SIZE up, the file is taken from the reserved
+ * huge pages if there are enough of them. The size is then rounded up
+ * to whole huge pages, and *size updated. Such a file cannot grow, as
+ * the other side would fail to remap it; *huge tells.
+ */
+int
+os_create_buffer_file(off_t *size, bool *huge)
+{
+	int fd;
+
+	*huge = false;
+
+#if defined(HAVE_MEMFD_CREATE) && defined(MFD_HUGETLB)
+	if (*size >= OS_LARGE_BUFFER_SIZE) {
+		fd = create_huge_file(size);
+		if (fd >= 0) {
+			*huge = true;
+			return fd;
+		}
+	}
+#endif
+
+	return os_create_anonymous_file(*size);
+}
+
+/*
+ * Map a file made by os_create_buffer_file() for reading and writing.
+ * Large buffers are prefaulted, rather than faulting page by page on
+ * the first frame drawn. Returns MAP_FAILED on failure, like mmap().
+ */
+void *
+os_map_buffer_file(int fd, size_t size)
+{
+	int flags = MAP_SHARED;
+
+#ifdef MAP_POPULATE
+	if (size >= OS_LARGE_BUFFER_SIZE)
+		flags |= MAP_POPULATE;
+#endif
+
+	return mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+}
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *s, int c)
@@ -28,6 +28,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 #ifdef HAVE_EXECINFO_H
@@ -52,6 +53,22 @@ os_epoll_create_cloexec(void);
 int
 os_create_anonymous_file(off_t size);
 
+int
+os_resize_anonymous_file(int fd, off_t size);
+
+int
+os_seal_anonymous_file(int fd, bool frozen);
+
+/* Buffers from this size up are backed by huge pages where possible, and
+ * prefaulted when mapped: their page faults on first touch add up. */
+#define OS_LARGE_BUFFER_SIZE (4 * 1024 * 1024)
+
+int
+os_create_buffer_file(off_t *size, bool *huge);
+
+void *
+os_map_buffer_file(int fd, size_t size);
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *s, int c);
@@ -0,0 +1,100 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_POOL_H
+#define WESTON_POOL_H
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A free list of equally sized objects, for the small ones that are
+ * created and destroyed every frame. Freed objects are kept for reuse,
+ * up to max_free of them, instead of going back to malloc. Not thread
+ * safe. */
+struct weston_pool {
+	size_t size;
+	unsigned int max_free;
+	unsigned int free_count;
+	void *free_list;
+};
+
+#define WESTON_POOL_INIT(type, max) \
+	{ sizeof(type) > sizeof(void *) ? sizeof(type) : sizeof(void *), \
+	  (max), 0, NULL }
+
+/* Returns a zeroed object, like zalloc() */
+static inline void *
+weston_pool_alloc(struct weston_pool *pool)
+{
+	void *object = pool->free_list;
+
+	if (!object)
+		return calloc(1, pool->size);
+
+	pool->free_list = *(void **) object;
+	pool->free_count--;
+	memset(object, 0, pool->size);
+
+	return object;
+}
+
+static inline void
+weston_pool_free(struct weston_pool *pool, void *object)
+{
+	if (!object)
+		return;
+
+	if (pool->free_count >= pool->max_free) {
+		free(object);
+		return;
+	}
+
+	*(void **) object = pool->free_list;
+	pool->free_list = object;
+	pool->free_count++;
+}
+
+/* Gives the kept objects back to malloc; the pool stays usable */
+static inline void
+weston_pool_release(struct weston_pool *pool)
+{
+	void *object;
+
+	while ((object = pool->free_list)) {
+		pool->free_list = *(void **) object;
+		free(object);
+	}
+	pool->free_count = 0;
+}
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* WESTON_POOL_H */
@@ -0,0 +1,109 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_SESSION_RECORD_FORMAT_H
+#define WESTON_SESSION_RECORD_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Client sessions as recorded by weston's session recorder, and
+ * replayed by the replay benchmark.
+ *
+ * A recording is a struct session_file_header followed by records,
+ * each starting with a struct session_record. Record sizes are a
+ * multiple of 8 bytes, and all values are in host byte order.
+ */
+
+#define SESSION_FILE_MAGIC 0x52535357 /* "WSSR" */
+#define SESSION_FILE_VERSION 1
+
+struct session_file_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+enum session_record_type {
+	/** struct session_record_surface, for a new wl_surface */
+	SESSION_RECORD_SURFACE = 1,
+	/** struct session_record, for a destroyed wl_surface */
+	SESSION_RECORD_DESTROY,
+	/** struct session_record_commit */
+	SESSION_RECORD_COMMIT,
+};
+
+enum session_buffer_type {
+	SESSION_BUFFER_NONE = 0,
+	SESSION_BUFFER_SHM,
+	SESSION_BUFFER_DMABUF,
+	/** wl_drm, EGL streams and the like, recorded by size only */
+	SESSION_BUFFER_OTHER,
+};
+
+struct session_record {
+	uint32_t type;
+	/* In bytes, including this header */
+	uint32_t size;
+	/* Since the recording started, CLOCK_MONOTONIC */
+	uint64_t time_nsec;
+	/* Never reused within a recording; 0 is invalid */
+	uint32_t surface_id;
+	uint32_t pad;
+};
+
+struct session_record_surface {
+	struct session_record base;
+	uint32_t client_pid;
+	/* The client's process name, NUL terminated */
+	char client_name[20];
+};
+
+struct session_record_rect {
+	int32_t x, y, width, height;
+};
+
+/*
+ * Followed by damage_count struct session_record_rect, in buffer
+ * coordinates. For SHM buffers of 4 bytes per pixel, the pixels of
+ * each rectangle follow, width * 4 bytes per row with no padding.
+ */
+struct session_record_commit {
+	struct session_record base;
+	/* Top left of the surface in the global space */
+	int32_t x, y;
+	uint32_t buffer_type;
+	/* wl_shm format, or DRM fourcc for dmabuf */
+	uint32_t format;
+	int32_t width, height;
+	/* dmabuf only */
+	uint64_t modifier;
+	uint32_t plane_count;
+	uint32_t damage_count;
+	/* Whether pixels follow the damage */
+	uint32_t has_pixels;
+	uint32_t pad;
+};
+
+#endif /* WESTON_SESSION_RECORD_FORMAT_H */
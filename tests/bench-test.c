@@ -0,0 +1,541 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Performance scenarios, run by "make bench" rather than as part of the
+ * test suite. Each scenario appends one JSON object per line to
+ * $WESTON_BENCH_OUTPUT, or prints it to stdout, with the repaint times
+ * weston reported through weston_debug_stats while it ran.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+#include "weston-test-client-helper.h"
+#include "weston-debug-stats-client-protocol.h"
+
+#define BENCH_SURFACE_SIZE 128
+#define BENCH_SUBSURFACE_SIZE 32
+#define BENCH_POINTER_MOTIONS 2000
+
+char *server_parameters = "--width=1024 --height=640";
+
+/* weston-tests-env asks for the server parameters in a process of its
+ * own, with the same environment weston and the scenarios get. */
+static void __attribute__((constructor))
+bench_select_renderer(void)
+{
+	const char *renderer = getenv("WESTON_BENCH_RENDERER");
+
+	if (!renderer || strcmp(renderer, "pixman") == 0)
+		server_parameters = "--use-pixman --width=1024 --height=640";
+	else if (strcmp(renderer, "gl") == 0)
+		server_parameters = "--use-gl --width=1024 --height=640";
+}
+
+struct bench {
+	struct client *client;
+	struct weston_debug_output_stats *stats;
+
+	struct timespec begin;
+	struct wl_array repaint_usec;	/* uint32_t per repaint */
+	bool seen;
+	uint32_t first_missed, last_missed;
+	uint32_t commits;
+};
+
+struct bench_surface {
+	struct wl_surface *wl_surface;
+	struct wl_subsurface *wl_subsurface;
+	struct buffer *buffer;
+	int width, height;
+};
+
+static void
+stats_handle_frame(void *data, struct weston_debug_output_stats *stats,
+		   uint32_t frames, uint32_t missed_deadlines,
+		   uint32_t repaint_usec, uint32_t idle_usec,
+		   uint32_t primary_views, uint32_t scanout_views,
+		   uint32_t overlay_views, uint32_t cursor_views,
+		   uint32_t upload_bytes)
+{
+	struct bench *bench = data;
+	uint32_t *sample;
+
+	if (!bench->seen)
+		bench->first_missed = missed_deadlines;
+	bench->seen = true;
+	bench->last_missed = missed_deadlines;
+
+	sample = wl_array_add(&bench->repaint_usec, sizeof *sample);
+	assert(sample);
+	*sample = repaint_usec;
+}
+
+static const struct weston_debug_output_stats_listener stats_listener = {
+	stats_handle_frame
+};
+
+static int
+bench_frames(void)
+{
+	const char *frames = getenv("WESTON_BENCH_FRAMES");
+
+	if (frames && atoi(frames) > 0)
+		return atoi(frames);
+
+	return 300;
+}
+
+static void
+bench_init(struct bench *bench, struct client *client)
+{
+	struct global *g;
+	struct weston_debug_stats *debug_stats = NULL;
+
+	memset(bench, 0, sizeof *bench);
+	bench->client = client;
+	wl_array_init(&bench->repaint_usec);
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, weston_debug_stats_interface.name))
+			continue;
+
+		debug_stats = wl_registry_bind(client->wl_registry, g->name,
+					       &weston_debug_stats_interface, 1);
+	}
+
+	if (!debug_stats)
+		skip("weston_debug_stats not available, set debug-stats\n");
+
+	bench->stats = weston_debug_stats_get_output_stats(debug_stats,
+						client->output->wl_output);
+	weston_debug_output_stats_add_listener(bench->stats,
+					       &stats_listener, bench);
+	weston_debug_stats_destroy(debug_stats);
+	client_roundtrip(client);
+}
+
+/* Drops what was measured while the scenario was being set up */
+static void
+bench_start(struct bench *bench)
+{
+	client_roundtrip(bench->client);
+
+	bench->repaint_usec.size = 0;
+	bench->seen = false;
+	bench->commits = 0;
+	clock_gettime(CLOCK_MONOTONIC, &bench->begin);
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *) a;
+	uint32_t ub = *(const uint32_t *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* Nearest rank, on sorted samples */
+static uint32_t
+percentile(const uint32_t *samples, size_t count, int p)
+{
+	if (count == 0)
+		return 0;
+
+	return samples[(count - 1) * p / 100];
+}
+
+static pid_t
+get_server_pid(struct client *client)
+{
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+
+	if (getsockopt(wl_display_get_fd(client->wl_display), SOL_SOCKET,
+		       SO_PEERCRED, &cred, &len) < 0)
+		return -1;
+
+	return cred.pid;
+}
+
+/* Resident and peak resident set of the compositor, in kB */
+static void
+get_server_memory(struct client *client, long *rss, long *hwm)
+{
+	char path[64], line[256];
+	pid_t pid = get_server_pid(client);
+	FILE *fp;
+
+	*rss = *hwm = -1;
+	if (pid < 0)
+		return;
+
+	snprintf(path, sizeof path, "/proc/%d/status", (int) pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof line, fp)) {
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			*rss = strtol(line + 6, NULL, 10);
+		else if (strncmp(line, "VmHWM:", 6) == 0)
+			*hwm = strtol(line + 6, NULL, 10);
+	}
+
+	fclose(fp);
+}
+
+/* extra holds scenario specific members, each starting with a comma */
+static void
+bench_report(struct bench *bench, const char *extra)
+{
+	const char *renderer = getenv("WESTON_BENCH_RENDERER");
+	const char *path = getenv("WESTON_BENCH_OUTPUT");
+	uint32_t *samples = bench->repaint_usec.data;
+	size_t count = bench->repaint_usec.size / sizeof *samples;
+	struct timespec end;
+	double seconds;
+	long rss, hwm;
+	FILE *fp = stdout;
+
+	client_roundtrip(bench->client);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = timespec_sub_to_nsec(&end, &bench->begin) / 1e9;
+
+	qsort(samples, count, sizeof *samples, compare_uint32);
+	get_server_memory(bench->client, &rss, &hwm);
+
+	if (path) {
+		fp = fopen(path, "a");
+		assert(fp && "cannot open WESTON_BENCH_OUTPUT");
+	}
+
+	fprintf(fp, "{\"scenario\":\"%s\",\"renderer\":\"%s\","
+		"\"seconds\":%.3f,\"frames\":%zu,\"fps\":%.2f,"
+		"\"commits_per_second\":%.1f,"
+		"\"repaint_usec_p50\":%u,\"repaint_usec_p99\":%u,"
+		"\"repaint_usec_max\":%u,\"missed_deadlines\":%u,"
+		"\"rss_kb\":%ld,\"peak_rss_kb\":%ld%s}\n",
+		get_test_name(), renderer ? renderer : "pixman",
+		seconds, count, seconds > 0 ? count / seconds : 0,
+		seconds > 0 ? bench->commits / seconds : 0,
+		percentile(samples, count, 50),
+		percentile(samples, count, 99),
+		count ? samples[count - 1] : 0,
+		bench->last_missed - bench->first_missed,
+		rss, hwm, extra ? extra : "");
+
+	if (fp != stdout)
+		fclose(fp);
+
+	weston_debug_output_stats_destroy(bench->stats);
+	wl_array_release(&bench->repaint_usec);
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	int *pending = data;
+
+	(*pending)--;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static void
+bench_surface_init(struct bench_surface *surface, struct client *client,
+		   int width, int height)
+{
+	surface->wl_surface =
+		wl_compositor_create_surface(client->wl_compositor);
+	assert(surface->wl_surface);
+
+	surface->width = width;
+	surface->height = height;
+	surface->buffer = create_shm_buffer_a8r8g8b8(client, width, height);
+}
+
+static void
+bench_surface_fini(struct bench_surface *surface)
+{
+	if (surface->wl_subsurface)
+		wl_subsurface_destroy(surface->wl_subsurface);
+	wl_surface_destroy(surface->wl_surface);
+	buffer_destroy(surface->buffer);
+}
+
+/* New contents every frame, so that the renderer uploads each commit */
+static void
+bench_surface_commit(struct bench_surface *surface, uint32_t frame,
+		     int *pending)
+{
+	pixman_color_t color;
+	pixman_image_t *solid;
+	struct wl_callback *callback;
+
+	color.red = (frame * 0x0400) & 0xffff;
+	color.green = 0x8000;
+	color.blue = 0xffff - color.red;
+	color.alpha = 0xffff;
+
+	solid = pixman_image_create_solid_fill(&color);
+	pixman_image_composite32(PIXMAN_OP_SRC, solid, NULL,
+				 surface->buffer->image, 0, 0, 0, 0, 0, 0,
+				 surface->width, surface->height);
+	pixman_image_unref(solid);
+
+	wl_surface_attach(surface->wl_surface, surface->buffer->proxy, 0, 0);
+	wl_surface_damage(surface->wl_surface, 0, 0,
+			  surface->width, surface->height);
+
+	if (pending) {
+		callback = wl_surface_frame(surface->wl_surface);
+		wl_callback_add_listener(callback, &frame_listener, pending);
+		(*pending)++;
+	}
+
+	wl_surface_commit(surface->wl_surface);
+}
+
+static void
+wait_frames(struct client *client, int *pending)
+{
+	while (*pending > 0)
+		assert(wl_display_dispatch(client->wl_display) >= 0);
+}
+
+struct surfaces_arg {
+	int count;
+	int degrees;
+};
+
+/* count surfaces of BENCH_SURFACE_SIZE, each committing once a frame */
+static void
+run_surfaces(const struct surfaces_arg *arg)
+{
+	struct client *client = create_client();
+	struct bench_surface *surfaces;
+	struct bench bench;
+	char extra[64];
+	int frames = bench_frames();
+	int columns = (client->output->width - BENCH_SURFACE_SIZE) / 112 + 1;
+	int i, frame, pending = 0;
+	int x, y;
+
+	bench_init(&bench, client);
+
+	surfaces = xzalloc(arg->count * sizeof *surfaces);
+	for (i = 0; i < arg->count; i++) {
+		bench_surface_init(&surfaces[i], client,
+				   BENCH_SURFACE_SIZE, BENCH_SURFACE_SIZE);
+
+		/* Spread over the output, overlapping once it is full */
+		x = (i % columns) * 112;
+		y = (i / columns * 96) %
+			(client->output->height - BENCH_SURFACE_SIZE);
+		weston_test_move_surface(client->test->weston_test,
+					 surfaces[i].wl_surface, x, y);
+		if (arg->degrees)
+			weston_test_rotate_surface(client->test->weston_test,
+						   surfaces[i].wl_surface,
+						   arg->degrees);
+		bench_surface_commit(&surfaces[i], 0, &pending);
+	}
+	wait_frames(client, &pending);
+
+	bench_start(&bench);
+	for (frame = 1; frame <= frames; frame++) {
+		for (i = 0; i < arg->count; i++)
+			bench_surface_commit(&surfaces[i], frame, &pending);
+		bench.commits += arg->count;
+		wait_frames(client, &pending);
+	}
+
+	snprintf(extra, sizeof extra, ",\"surfaces\":%d,\"degrees\":%d",
+		 arg->count, arg->degrees);
+	bench_report(&bench, extra);
+
+	for (i = 0; i < arg->count; i++)
+		bench_surface_fini(&surfaces[i]);
+	free(surfaces);
+}
+
+static const struct surfaces_arg shm_surfaces_args[] = {
+	{ 1, 0 },
+	{ 16, 0 },
+	{ 64, 0 },
+};
+
+TEST_P(shm_surfaces, shm_surfaces_args)
+{
+	run_surfaces(data);
+}
+
+static const struct surfaces_arg rotated_views_args[] = {
+	{ 16, 90 },
+	{ 16, 30 },
+};
+
+TEST_P(rotated_views, rotated_views_args)
+{
+	run_surfaces(data);
+}
+
+static struct wl_subcompositor *
+get_subcompositor(struct client *client)
+{
+	struct global *g;
+	struct wl_subcompositor *sub = NULL;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, "wl_subcompositor"))
+			continue;
+
+		sub = wl_registry_bind(client->wl_registry, g->name,
+				       &wl_subcompositor_interface, 1);
+	}
+
+	assert(sub && "no wl_subcompositor found");
+
+	return sub;
+}
+
+static const int subsurfaces_args[] = { 16, 256 };
+
+/* One parent with count desynchronized children, all committing once
+ * a frame; only the parent asks for frame callbacks. */
+TEST_P(subsurfaces, subsurfaces_args)
+{
+	const int *count = data;
+	struct client *client = create_client();
+	struct wl_subcompositor *subco = get_subcompositor(client);
+	struct bench_surface parent, *children;
+	struct bench bench;
+	char extra[32];
+	int frames = bench_frames();
+	int columns = 512 / BENCH_SUBSURFACE_SIZE;
+	int i, frame, pending = 0;
+
+	bench_init(&bench, client);
+
+	bench_surface_init(&parent, client, 512, 512);
+	weston_test_move_surface(client->test->weston_test,
+				 parent.wl_surface, 64, 64);
+
+	children = xzalloc(*count * sizeof *children);
+	for (i = 0; i < *count; i++) {
+		bench_surface_init(&children[i], client,
+				   BENCH_SUBSURFACE_SIZE,
+				   BENCH_SUBSURFACE_SIZE);
+		children[i].wl_subsurface =
+			wl_subcompositor_get_subsurface(subco,
+							children[i].wl_surface,
+							parent.wl_surface);
+		wl_subsurface_set_position(children[i].wl_subsurface,
+					   (i % columns) * BENCH_SUBSURFACE_SIZE,
+					   (i / columns % columns) *
+					   BENCH_SUBSURFACE_SIZE);
+		wl_subsurface_set_desync(children[i].wl_subsurface);
+		bench_surface_commit(&children[i], 0, NULL);
+	}
+	bench_surface_commit(&parent, 0, &pending);
+	wait_frames(client, &pending);
+
+	bench_start(&bench);
+	for (frame = 1; frame <= frames; frame++) {
+		for (i = 0; i < *count; i++)
+			bench_surface_commit(&children[i], frame, NULL);
+		bench_surface_commit(&parent, frame, &pending);
+		bench.commits += *count + 1;
+		wait_frames(client, &pending);
+	}
+
+	snprintf(extra, sizeof extra, ",\"subsurfaces\":%d", *count);
+	bench_report(&bench, extra);
+
+	for (i = 0; i < *count; i++)
+		bench_surface_fini(&children[i]);
+	free(children);
+	bench_surface_fini(&parent);
+	wl_subcompositor_destroy(subco);
+}
+
+/* Motions as fast as the client can send them, each waited for */
+TEST(pointer_storm)
+{
+	struct client *client;
+	struct pointer *pointer;
+	struct bench bench;
+	struct timespec sent, received;
+	uint32_t latency[BENCH_POINTER_MOTIONS];
+	char extra[128];
+	int i, x, y;
+
+	client = create_client_and_test_surface(0, 0, 1024, 640);
+	pointer = client->input->pointer;
+	assert(pointer);
+
+	bench_init(&bench, client);
+	weston_test_move_pointer(client->test->weston_test, 1, 1);
+	bench_start(&bench);
+
+	for (i = 0; i < BENCH_POINTER_MOTIONS; i++) {
+		x = 2 + (i * 7) % 1000;
+		y = 2 + (i * 13) % 600;
+
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		weston_test_move_pointer(client->test->weston_test, x, y);
+		while (pointer->x != x || pointer->y != y)
+			assert(wl_display_dispatch(client->wl_display) >= 0);
+		clock_gettime(CLOCK_MONOTONIC, &received);
+
+		latency[i] = timespec_sub_to_nsec(&received, &sent) / 1000;
+	}
+
+	qsort(latency, BENCH_POINTER_MOTIONS, sizeof latency[0],
+	      compare_uint32);
+	snprintf(extra, sizeof extra,
+		 ",\"motions\":%d,\"motion_usec_p50\":%u,"
+		 "\"motion_usec_p99\":%u",
+		 BENCH_POINTER_MOTIONS,
+		 percentile(latency, BENCH_POINTER_MOTIONS, 50),
+		 percentile(latency, BENCH_POINTER_MOTIONS, 99));
+	bench_report(&bench, extra);
+}
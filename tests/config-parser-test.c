@@ -639,3 +639,87 @@ ZUC_TEST(config_test, section_from_null)
 	section = weston_config_get_section(NULL, "bucket", NULL, NULL);
 	ZUC_ASSERT_NULL(section);
 }
+
+static void
+count_changed(struct weston_config_section *section, const char *name,
+	      void *data)
+{
+	int *count = data;
+
+	(*count)++;
+}
+
+static int
+write_config(const char *file, const char *text)
+{
+	FILE *fp;
+	int ret;
+
+	fp = fopen(file, "w");
+	if (!fp)
+		return -1;
+	ret = fputs(text, fp);
+	fclose(fp);
+
+	return ret < 0 ? -1 : 0;
+}
+
+ZUC_TEST(config_test, reload)
+{
+	struct weston_config *config = NULL;
+	struct weston_config_section *core, *out_a, *out_b, *gone;
+	char file[] = "/tmp/weston-config-parser-test-XXXXXX";
+	char *str = NULL;
+	int count = 0;
+	int fd, n;
+
+	fd = mkstemp(file);
+	ZUC_ASSERT_NE(-1, fd);
+	close(fd);
+
+	ZUC_ASSERTG_EQ(0, write_config(file,
+				       "[core]\nnumber=1\n"
+				       "[output]\nname=A\n"
+				       "[output]\nname=B\n"
+				       "[gone]\nkey=value\n"), out);
+	config = weston_config_parse(file);
+	ZUC_ASSERTG_NOT_NULL(config, out);
+
+	core = weston_config_get_section(config, "core", NULL, NULL);
+	out_a = weston_config_get_section(config, "output", "name", "A");
+	out_b = weston_config_get_section(config, "output", "name", "B");
+	gone = weston_config_get_section(config, "gone", NULL, NULL);
+	ZUC_ASSERTG_NOT_NULL(out_b, out);
+	weston_config_section_get_int(core, "number", &n, 0);
+	ZUC_ASSERTG_EQ(1, n, out);
+
+	ZUC_ASSERTG_EQ(0, write_config(file,
+				       "[core]\nnumber=2\n"
+				       "[output]\nname=A\n"
+				       "[output]\nname=C\n"
+				       "[new]\nkey=value\n"), out);
+	ZUC_ASSERTG_EQ(0, weston_config_reload(config, count_changed, &count),
+		       out);
+
+	/* core, the second output, new and gone */
+	ZUC_ASSERTG_EQ(4, count, out);
+
+	weston_config_section_get_int(core, "number", &n, 0);
+	ZUC_ASSERTG_EQ(2, n, out);
+	ZUC_ASSERTG_EQ(out_a, weston_config_get_section(config, "output",
+							"name", "A"), out);
+	ZUC_ASSERTG_EQ(out_b, weston_config_get_section(config, "output",
+							"name", "C"), out);
+	ZUC_ASSERTG_NOT_NULL(weston_config_get_section(config, "new",
+						       NULL, NULL), out);
+	ZUC_ASSERTG_NULL(weston_config_get_section(config, "gone",
+						   NULL, NULL), out);
+
+	weston_config_section_get_string(gone, "key", &str, "default");
+	ZUC_ASSERTG_STREQ("default", str, out);
+
+out:
+	free(str);
+	weston_config_destroy(config);
+	unlink(file);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "weston-test-client-helper.h"
+
+#define WIDTH 16
+#define HEIGHT 8
+#define FUZZ 2
+
+/* One pixel differs from the background by delta in one channel */
+static pixman_image_t *
+make_image(int x, int y, int shift, int delta)
+{
+	pixman_image_t *image;
+	uint32_t *pixels;
+	int stride; /* in pixels */
+	int i;
+
+	image = pixman_image_create_bits(PIXMAN_a8r8g8b8, WIDTH, HEIGHT,
+					 NULL, 0);
+	assert(image);
+
+	pixels = pixman_image_get_data(image);
+	stride = pixman_image_get_stride(image) / 4;
+	for (i = 0; i < stride * HEIGHT; i++)
+		pixels[i] = 0x80808080;
+
+	pixels[y * stride + x] += (uint32_t)delta << shift;
+
+	return image;
+}
+
+static bool
+images_match(int shift, int delta, const struct rectangle *clip, int fuzz)
+{
+	pixman_image_t *a = make_image(0, 0, 0, 0);
+	pixman_image_t *b = make_image(WIDTH - 1, HEIGHT - 1, shift, delta);
+	bool match;
+
+	match = check_images_match_fuzzy(a, b, clip, fuzz);
+	printf("channel at bit %d off by %d, fuzz %d: %s\n",
+	       shift, delta, fuzz, match ? "match" : "no match");
+
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+
+	return match;
+}
+
+TEST(image_match_fuzz_boundary)
+{
+	int shift;
+
+	/* Every channel, in either direction */
+	for (shift = 0; shift < 32; shift += 8) {
+		assert(images_match(shift, FUZZ, NULL, FUZZ));
+		assert(images_match(shift, -FUZZ, NULL, FUZZ));
+		assert(!images_match(shift, FUZZ + 1, NULL, FUZZ));
+		assert(!images_match(shift, -FUZZ - 1, NULL, FUZZ));
+	}
+}
+
+TEST(image_match_exact)
+{
+	pixman_image_t *a = make_image(0, 0, 0, 0);
+	pixman_image_t *b = make_image(3, 2, 16, 1);
+
+	assert(images_match(0, 0, NULL, 0));
+	assert(!images_match(0, 1, NULL, 0));
+
+	/* check_images_match() allows no difference at all */
+	assert(check_images_match(a, a, NULL));
+	assert(!check_images_match(a, b, NULL));
+
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+}
+
+TEST(image_match_fuzz_clip)
+{
+	/* The differing pixel is in the last column and row */
+	struct rectangle inside = { 0, 0, WIDTH, HEIGHT };
+	struct rectangle outside = { 0, 0, WIDTH - 1, HEIGHT - 1 };
+
+	assert(!images_match(8, FUZZ + 1, &inside, FUZZ));
+	assert(images_match(8, FUZZ + 1, &outside, FUZZ));
+	assert(images_match(8, FUZZ + 1, &outside, 0));
+}
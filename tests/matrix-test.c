@@ -182,6 +182,7 @@ randomize_matrix(struct weston_matrix *m)
 #else
 		m->d[i] = frand();
 #endif
+	m->type = WESTON_MATRIX_TRANSFORM_OTHER;
 }
 
 /* Take a matrix, compute inverse, multiply together
@@ -243,6 +244,142 @@ test(void)
 	return TEST_FAIL;
 }
 
+/* The plain 4x4 versions, which the type specific paths of
+ * weston_matrix_multiply() etc. have to agree with. */
+static void
+reference_multiply(struct weston_matrix *m, const struct weston_matrix *n)
+{
+	struct weston_matrix tmp;
+	unsigned i, j;
+
+	for (i = 0; i < 16; i++) {
+		tmp.d[i] = 0;
+		for (j = 0; j < 4; j++)
+			tmp.d[i] += m->d[(i / 4) * 4 + j] * n->d[i % 4 + j * 4];
+	}
+	tmp.type = m->type | n->type;
+	*m = tmp;
+}
+
+static void
+reference_transform(const struct weston_matrix *m, struct weston_vector *v)
+{
+	struct weston_vector t;
+	unsigned i, j;
+
+	for (i = 0; i < 4; i++) {
+		t.f[i] = 0;
+		for (j = 0; j < 4; j++)
+			t.f[i] += v->f[j] * m->d[i + j * 4];
+	}
+	*v = t;
+}
+
+static int
+reference_invert(struct weston_matrix *inverse, const struct weston_matrix *m)
+{
+	struct inverse_matrix q;
+	unsigned c;
+
+	if (matrix_invert(q.LU, q.perm, m) < 0)
+		return -1;
+
+	weston_matrix_init(inverse);
+	for (c = 0; c < 4; ++c)
+		inverse_transform(q.LU, q.perm, &inverse->d[c * 4]);
+	inverse->type = m->type;
+
+	return 0;
+}
+
+/* Exact, but a zero of either sign is fine. */
+static int
+floats_agree(const float *a, const float *b, unsigned count)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		if (a[i] != b[i])
+			return 0;
+
+	return 1;
+}
+
+/* A matrix of the given type, built the way the compositor does. */
+static void
+random_typed_matrix(struct weston_matrix *m, unsigned type)
+{
+	double angle;
+
+	weston_matrix_init(m);
+
+	if (type & WESTON_MATRIX_TRANSFORM_OTHER) {
+		randomize_matrix(m);
+		return;
+	}
+
+	if (type & WESTON_MATRIX_TRANSFORM_SCALE)
+		weston_matrix_scale(m, frand() * 4.0, frand() * 4.0, 1.0);
+	if (type & WESTON_MATRIX_TRANSFORM_ROTATE) {
+		angle = frand() * M_PI;
+		weston_matrix_rotate_xy(m, cos(angle), sin(angle));
+	}
+	if (type & WESTON_MATRIX_TRANSFORM_TRANSLATE)
+		weston_matrix_translate(m, frand() * 2000.0, frand() * 2000.0,
+					frand());
+}
+
+static int
+test_type_paths(void)
+{
+	struct weston_matrix m, n, a, b;
+	struct weston_vector v, w;
+	unsigned mt, nt, i;
+	int fails = 0;
+	int ra, rb;
+
+	printf("\nComparing the type specific paths with the 4x4 ones...\n");
+
+	for (i = 0; i < 10000; i++) {
+		mt = i % 16;
+		nt = (i / 16) % 16;
+		random_typed_matrix(&m, mt);
+		random_typed_matrix(&n, nt);
+
+		a = m;
+		b = m;
+		weston_matrix_multiply(&a, &n);
+		reference_multiply(&b, &n);
+		if (!floats_agree(a.d, b.d, 16) || a.type != b.type) {
+			printf("multiply mismatch, types %#x %#x\n", mt, nt);
+			fails++;
+		}
+
+		v.f[0] = frand() * 2000.0;
+		v.f[1] = frand() * 2000.0;
+		v.f[2] = frand();
+		v.f[3] = i & 1 ? 1.0 : frand();
+		w = v;
+		weston_matrix_transform(&m, &v);
+		reference_transform(&m, &w);
+		if (!floats_agree(v.f, w.f, 4)) {
+			printf("transform mismatch, type %#x\n", mt);
+			fails++;
+		}
+
+		ra = weston_matrix_invert(&a, &m);
+		rb = reference_invert(&b, &m);
+		if (ra != rb || (ra == 0 && !floats_agree(a.d, b.d, 16))) {
+			printf("invert mismatch, type %#x\n", mt);
+			fails++;
+		}
+	}
+
+	printf("%d mismatches.\n", fails);
+
+	return fails;
+}
+
 static int running;
 static void
 stopme(int n)
@@ -414,6 +551,9 @@ int main(void)
 	print_matrix(&M);
 	printf("max abs error: %g, original determinant %g\n", errsup, det);
 
+	if (test_type_paths() != 0)
+		return 1;
+
 	test_loop_precision();
 	test_loop_speed_matrixvector();
 	test_loop_speed_inversetransform();
@@ -0,0 +1,575 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the geometry helpers on the repaint path, of the
+ * XWM window lookup, of the per-frame object pools and of the view walks
+ * of damage accumulation, run by "make bench" rather than as part of the
+ * test suite.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pixman.h>
+
+#include "zunitc/zunitc.h"
+#include "zunitc/zunitc_bench.h"
+#include "compositor.h"
+#include "vertex-clipping.h"
+#include "xwayland/hash.h"
+#include "shared/pool.h"
+
+/* Scale, rotation and translation, like a typical view transform */
+static void
+view_matrix(struct weston_matrix *m, float degrees)
+{
+	float angle = degrees * M_PI / 180.0f;
+
+	weston_matrix_init(m);
+	weston_matrix_translate(m, -64.0f, -48.0f, 0.0f);
+	weston_matrix_scale(m, 1.5f, 1.25f, 1.0f);
+	weston_matrix_rotate_xy(m, cosf(angle), sinf(angle));
+	weston_matrix_translate(m, 300.0f, 200.0f, 0.0f);
+}
+
+static void
+bench_matrix_multiply(void *data, uint64_t iterations)
+{
+	const struct weston_matrix *n = data;
+	struct weston_matrix m;
+	uint64_t i;
+
+	weston_matrix_init(&m);
+	for (i = 0; i < iterations; i++) {
+		weston_matrix_multiply(&m, n);
+		zuc_bench_escape(&m);
+	}
+}
+
+ZUC_TEST(matrix_bench, multiply)
+{
+	struct weston_matrix n;
+
+	view_matrix(&n, 30.0f);
+	ZUC_ASSERT_TRUE(zuc_bench_run("weston_matrix_multiply",
+				      bench_matrix_multiply, &n, NULL));
+}
+
+static void
+bench_matrix_invert(void *data, uint64_t iterations)
+{
+	const struct weston_matrix *m = data;
+	struct weston_matrix inverse;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		weston_matrix_invert(&inverse, m);
+		zuc_bench_escape(&inverse);
+	}
+}
+
+ZUC_TEST(matrix_bench, invert)
+{
+	struct weston_matrix m;
+
+	view_matrix(&m, 30.0f);
+	ZUC_ASSERT_TRUE(zuc_bench_run("weston_matrix_invert",
+				      bench_matrix_invert, &m, NULL));
+}
+
+static void
+bench_matrix_transform(void *data, uint64_t iterations)
+{
+	struct weston_matrix *m = data;
+	struct weston_vector v = {{ 10.0f, 20.0f, 0.0f, 1.0f }};
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++) {
+		weston_matrix_transform(m, &v);
+		zuc_bench_escape(&v);
+	}
+}
+
+ZUC_TEST(matrix_bench, transform)
+{
+	struct weston_matrix m;
+
+	view_matrix(&m, 0.0f);
+	ZUC_ASSERT_TRUE(zuc_bench_run("weston_matrix_transform",
+				      bench_matrix_transform, &m, NULL));
+}
+
+struct clip_bench {
+	struct clip_context ctx;
+	struct polygon8 polygon;
+};
+
+static void
+bench_clip_transformed(void *data, uint64_t iterations)
+{
+	struct clip_bench *b = data;
+	float x[8], y[8];
+	uint64_t i;
+	int n;
+
+	for (i = 0; i < iterations; i++) {
+		n = clip_transformed(&b->ctx, &b->polygon, x, y);
+		zuc_bench_escape(x);
+		zuc_bench_escape(y);
+		zuc_bench_escape(&n);
+	}
+}
+
+ZUC_TEST(clip_bench, rotated_quad)
+{
+	struct clip_bench b;
+	struct weston_matrix m;
+	struct weston_vector v;
+	static const float quad[4][2] = {
+		{ 0.0f, 0.0f }, { 128.0f, 0.0f },
+		{ 128.0f, 96.0f }, { 0.0f, 96.0f },
+	};
+	int i;
+
+	/* A rotated view crossing every edge of the clip box */
+	view_matrix(&m, 30.0f);
+	for (i = 0; i < 4; i++) {
+		v = (struct weston_vector) {{ quad[i][0], quad[i][1], 0, 1 }};
+		weston_matrix_transform(&m, &v);
+		b.polygon.x[i] = v.f[0];
+		b.polygon.y[i] = v.f[1];
+	}
+	b.polygon.n = 4;
+
+	memset(&b.ctx, 0, sizeof b.ctx);
+	b.ctx.clip.x1 = 250.0f;
+	b.ctx.clip.y1 = 150.0f;
+	b.ctx.clip.x2 = 350.0f;
+	b.ctx.clip.y2 = 250.0f;
+
+	ZUC_ASSERT_TRUE(zuc_bench_run("clip_transformed",
+				      bench_clip_transformed, &b, NULL));
+}
+
+struct region_bench {
+	pixman_region32_t src, dest;
+	struct weston_matrix matrix;
+};
+
+/* Damage of 64 scattered rectangles */
+static void
+region_bench_init(struct region_bench *b)
+{
+	int i;
+
+	pixman_region32_init(&b->src);
+	pixman_region32_init(&b->dest);
+	for (i = 0; i < 64; i++)
+		pixman_region32_union_rect(&b->src, &b->src,
+					   (i % 8) * 120, (i / 8) * 90,
+					   100, 70);
+}
+
+static void
+region_bench_fini(struct region_bench *b)
+{
+	pixman_region32_fini(&b->src);
+	pixman_region32_fini(&b->dest);
+}
+
+static void
+bench_matrix_transform_region(void *data, uint64_t iterations)
+{
+	struct region_bench *b = data;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++)
+		weston_matrix_transform_region(&b->dest, &b->matrix, &b->src);
+}
+
+ZUC_TEST(region_bench, matrix_transform_region)
+{
+	struct region_bench b;
+
+	region_bench_init(&b);
+
+	/* Buffer to surface coordinates of a scaled, 90° buffer */
+	weston_matrix_init(&b.matrix);
+	weston_matrix_rotate_xy(&b.matrix, 0.0f, 1.0f);
+	weston_matrix_translate(&b.matrix, 720.0f, 0.0f, 0.0f);
+	weston_matrix_scale(&b.matrix, 0.5f, 0.5f, 1.0f);
+
+	ZUC_ASSERT_TRUE(zuc_bench_run("weston_matrix_transform_region",
+				      bench_matrix_transform_region, &b,
+				      NULL));
+
+	region_bench_fini(&b);
+}
+
+static void
+bench_transformed_region(void *data, uint64_t iterations)
+{
+	struct region_bench *b = data;
+	uint64_t i;
+
+	for (i = 0; i < iterations; i++)
+		weston_transformed_region(1024, 768, WL_OUTPUT_TRANSFORM_90, 2,
+					  &b->src, &b->dest);
+}
+
+ZUC_TEST(region_bench, transformed_region)
+{
+	struct region_bench b;
+
+	region_bench_init(&b);
+	ZUC_ASSERT_TRUE(zuc_bench_run("weston_transformed_region",
+				      bench_transformed_region, &b, NULL));
+	region_bench_fini(&b);
+}
+
+struct hash_bench {
+	struct hash_table *ht;
+	uint32_t live, oldest, next;
+};
+
+/* X windows coming and going, as with popups and tooltips: each iteration
+ * destroys the oldest window, creates one with the next id and looks up
+ * a few of the live ones, like the events for them would. */
+static void
+bench_hash_churn(void *data, uint64_t iterations)
+{
+	struct hash_bench *b = data;
+	static int window;
+	uint64_t i;
+	uint32_t j;
+	void *found;
+
+	for (i = 0; i < iterations; i++) {
+		hash_table_remove(b->ht, b->oldest++);
+		hash_table_insert(b->ht, b->next++, &window);
+		for (j = 0; j < 4; j++) {
+			found = hash_table_lookup(b->ht, b->oldest +
+						  (i * 31 + j * 977) % b->live);
+			zuc_bench_escape(&found);
+		}
+	}
+}
+
+static void
+hash_bench_run(const char *name, uint32_t live)
+{
+	struct hash_bench b;
+	static int window;
+
+	b.ht = hash_table_create();
+	ZUC_ASSERT_NOT_NULL(b.ht);
+
+	/* Resource ids of the first X client */
+	b.live = live;
+	b.oldest = b.next = 0x200000;
+	while (b.next - b.oldest < live)
+		hash_table_insert(b.ht, b.next++, &window);
+
+	ZUC_ASSERT_TRUE(zuc_bench_run(name, bench_hash_churn, &b, NULL));
+
+	hash_table_destroy(b.ht);
+}
+
+ZUC_TEST(hash_bench, churn_100)
+{
+	hash_bench_run("hash_table_churn_100", 100);
+}
+
+ZUC_TEST(hash_bench, churn_10000)
+{
+	hash_bench_run("hash_table_churn_10000", 10000);
+}
+
+/* Like weston_frame_callback */
+struct pool_bench_object {
+	void *resource;
+	void *link[2];
+};
+
+#define POOL_BENCH_CLIENTS 32
+
+/* One frame: every client asks for a frame callback, which is sent and
+ * destroyed once the frame is up. */
+static void
+bench_pool_frame(void *data, uint64_t iterations)
+{
+	struct weston_pool *pool = data;
+	struct pool_bench_object *objects[POOL_BENCH_CLIENTS];
+	uint64_t i;
+	int j;
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < POOL_BENCH_CLIENTS; j++) {
+			if (pool)
+				objects[j] = weston_pool_alloc(pool);
+			else
+				objects[j] = calloc(1, sizeof *objects[j]);
+			zuc_bench_escape(objects[j]);
+		}
+		for (j = 0; j < POOL_BENCH_CLIENTS; j++) {
+			if (pool)
+				weston_pool_free(pool, objects[j]);
+			else
+				free(objects[j]);
+		}
+	}
+}
+
+ZUC_TEST(pool_bench, frame_malloc)
+{
+	ZUC_ASSERT_TRUE(zuc_bench_run("frame_callbacks_malloc",
+				      bench_pool_frame, NULL, NULL));
+}
+
+ZUC_TEST(pool_bench, frame_pool)
+{
+	struct weston_pool pool =
+		WESTON_POOL_INIT(struct pool_bench_object, 256);
+
+	ZUC_ASSERT_TRUE(zuc_bench_run("frame_callbacks_pool",
+				      bench_pool_frame, &pool, NULL));
+	weston_pool_release(&pool);
+}
+
+/* Views as the compositor has them during a repaint: each in its own
+ * allocations, scattered over the heap between the other things clients
+ * make the compositor allocate, and threaded on view_list. */
+struct view_walk_bench {
+	struct wl_list view_list;
+	struct wl_array view_entries;
+	struct weston_plane planes[3];
+	struct weston_view **views;
+	void **filler;
+	int n;
+};
+
+#define VIEW_WALK_FILLER_SIZE 2048
+
+static void
+view_walk_bench_fini(struct view_walk_bench *b)
+{
+	struct weston_view *view;
+	int i;
+
+	for (i = 0; i < b->n; i++) {
+		view = b->views[i];
+		pixman_region32_fini(&view->transform.boundingbox);
+		pixman_region32_fini(&view->transform.opaque);
+		free(view->surface);
+		free(view);
+		free(b->filler[i]);
+	}
+	free(b->views);
+	free(b->filler);
+	wl_array_release(&b->view_entries);
+}
+
+/* Returns 0, or -1 with everything freed if an allocation failed */
+static int
+view_walk_bench_init(struct view_walk_bench *b, int n)
+{
+	struct weston_view_entry *entry;
+	struct weston_view *view;
+	void *filler;
+	int i, x, y;
+
+	memset(b, 0, sizeof *b);
+	wl_list_init(&b->view_list);
+	wl_array_init(&b->view_entries);
+	b->views = calloc(n, sizeof *b->views);
+	b->filler = calloc(n, sizeof *b->filler);
+	if (!b->views || !b->filler)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		view = zalloc(sizeof *view);
+		filler = malloc(VIEW_WALK_FILLER_SIZE);
+		if (view)
+			view->surface = zalloc(sizeof *view->surface);
+		if (!view || !view->surface || !filler) {
+			if (view)
+				free(view->surface);
+			free(view);
+			free(filler);
+			goto err;
+		}
+
+		/* Mostly on the primary plane, every 16th on an overlay
+		 * and every 64th on the cursor plane */
+		view->plane = &b->planes[i % 64 == 0 ? 2 : i % 16 == 0];
+		view->output_mask = 1;
+		view->surface->output_mask = 1;
+		view->alpha = 1.0f;
+
+		x = (i * 37) % 1800;
+		y = (i * 53) % 1000;
+		pixman_region32_init_rect(&view->transform.boundingbox,
+					  x, y, 120, 80);
+		pixman_region32_init(&view->transform.opaque);
+		if (i % 2)
+			pixman_region32_copy(&view->transform.opaque,
+					     &view->transform.boundingbox);
+
+		wl_list_insert(b->view_list.prev, &view->link);
+		b->views[i] = view;
+		b->filler[i] = filler;
+		b->n++;
+	}
+
+	/* As compositor_fill_view_entries() does */
+	wl_list_for_each(view, &b->view_list, link) {
+		entry = wl_array_add(&b->view_entries, sizeof *entry);
+		if (!entry)
+			goto err;
+		entry->view = view;
+		entry->surface = view->surface;
+		entry->plane = view->plane;
+		entry->surface_output = view->surface->output;
+		entry->output_mask = view->output_mask;
+		entry->surface_output_mask = view->surface->output_mask;
+		entry->box =
+			*pixman_region32_extents(&view->transform.boundingbox);
+		entry->alpha = view->alpha;
+		entry->dim = view->dim;
+		entry->opaque =
+			pixman_region32_not_empty(&view->transform.opaque);
+	}
+
+	return 0;
+
+err:
+	view_walk_bench_fini(b);
+	return -1;
+}
+
+/* The fields compositor_accumulate_damage() and output_cull_view() look
+ * at for every view, once per plane, as they were read before the view
+ * entries */
+static void
+bench_view_walk_list(void *data, uint64_t iterations)
+{
+	struct view_walk_bench *b = data;
+	struct weston_view *view;
+	pixman_box32_t *box;
+	uint64_t i;
+	int64_t area;
+	int p;
+
+	for (i = 0; i < iterations; i++) {
+		area = 0;
+		for (p = 0; p < 3; p++) {
+			wl_list_for_each(view, &b->view_list, link) {
+				if (view->plane != &b->planes[p])
+					continue;
+				if (!(view->surface->output_mask & 1))
+					continue;
+
+				box = pixman_region32_extents(
+					&view->transform.boundingbox);
+				area += (box->x2 - box->x1) *
+					(box->y2 - box->y1);
+				if (pixman_region32_not_empty(
+					&view->transform.opaque))
+					area++;
+			}
+		}
+		zuc_bench_escape(&area);
+	}
+}
+
+/* The same, through the view entries */
+static void
+bench_view_walk_entries(void *data, uint64_t iterations)
+{
+	struct view_walk_bench *b = data;
+	struct weston_view_entry *entry;
+	uint64_t i;
+	int64_t area;
+	int p;
+
+	for (i = 0; i < iterations; i++) {
+		area = 0;
+		for (p = 0; p < 3; p++) {
+			wl_array_for_each(entry, &b->view_entries) {
+				if (entry->plane != &b->planes[p])
+					continue;
+				if (!(entry->surface_output_mask & 1))
+					continue;
+
+				area += (entry->box.x2 - entry->box.x1) *
+					(entry->box.y2 - entry->box.y1);
+				if (entry->opaque)
+					area++;
+			}
+		}
+		zuc_bench_escape(&area);
+	}
+}
+
+static bool
+view_walk_bench_run(struct view_walk_bench *b)
+{
+	char name[64];
+
+	snprintf(name, sizeof name, "view_walk_list_%d", b->n);
+	if (!zuc_bench_run(name, bench_view_walk_list, b, NULL))
+		return false;
+
+	snprintf(name, sizeof name, "view_walk_entries_%d", b->n);
+	return zuc_bench_run(name, bench_view_walk_entries, b, NULL);
+}
+
+ZUC_TEST(view_walk_bench, views_500)
+{
+	struct view_walk_bench b;
+	bool ok;
+
+	ZUC_ASSERT_EQ(0, view_walk_bench_init(&b, 500));
+	ok = view_walk_bench_run(&b);
+	view_walk_bench_fini(&b);
+	ZUC_ASSERT_TRUE(ok);
+}
+
+ZUC_TEST(view_walk_bench, views_2000)
+{
+	struct view_walk_bench b;
+	bool ok;
+
+	ZUC_ASSERT_EQ(0, view_walk_bench_init(&b, 2000));
+	ok = view_walk_bench_run(&b);
+	view_walk_bench_fini(&b);
+	ZUC_ASSERT_TRUE(ok);
+}
@@ -0,0 +1,537 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays a session recorded with weston.ini's record-sessions against
+ * the headless backend, run by "make bench-replay". The commits of the
+ * recording are issued at their recorded times, from one client, and
+ * one JSON object goes to $WESTON_BENCH_OUTPUT, or stdout, with the
+ * repaint times and frame intervals weston reported meanwhile.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared/helpers.h"
+#include "shared/session-record-format.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+#include "weston-test-client-helper.h"
+#include "weston-debug-stats-client-protocol.h"
+
+/* Buffers per surface, before waiting for one to be released */
+#define REPLAY_MAX_BUFFERS 4
+
+char *server_parameters = "--width=1920 --height=1080";
+
+static void __attribute__((constructor))
+replay_select_renderer(void)
+{
+	const char *renderer = getenv("WESTON_BENCH_RENDERER");
+
+	if (!renderer || strcmp(renderer, "pixman") == 0)
+		server_parameters = "--use-pixman --width=1920 --height=1080";
+	else if (strcmp(renderer, "gl") == 0)
+		server_parameters = "--use-gl --width=1920 --height=1080";
+}
+
+struct replay_buffer {
+	struct buffer *buffer;
+	bool busy;
+};
+
+struct replay_surface {
+	uint32_t id;
+	struct wl_surface *wl_surface;
+	/* What the client has drawn so far, at the recorded size */
+	pixman_image_t *contents;
+	uint32_t format;
+	struct replay_buffer buffers[REPLAY_MAX_BUFFERS];
+	int buffer_count;
+	int32_t x, y;
+	bool placed;
+	struct wl_list link;
+};
+
+struct replay {
+	struct client *client;
+	struct weston_debug_output_stats *stats;
+	struct wl_list surface_list;
+
+	struct wl_array repaint_usec;	/* uint32_t per repaint */
+	struct wl_array interval_usec;	/* uint32_t between repaints */
+	struct timespec last_frame;
+	bool seen;
+	uint32_t first_missed, last_missed;
+
+	uint32_t commits, surfaces;
+	uint64_t pixel_bytes;
+	uint32_t fill;
+};
+
+static void
+stats_handle_frame(void *data, struct weston_debug_output_stats *stats,
+		   uint32_t frames, uint32_t missed_deadlines,
+		   uint32_t repaint_usec, uint32_t idle_usec,
+		   uint32_t primary_views, uint32_t scanout_views,
+		   uint32_t overlay_views, uint32_t cursor_views,
+		   uint32_t upload_bytes)
+{
+	struct replay *replay = data;
+	struct timespec now;
+	uint32_t *sample;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (!replay->seen) {
+		replay->first_missed = missed_deadlines;
+	} else {
+		sample = wl_array_add(&replay->interval_usec, sizeof *sample);
+		assert(sample);
+		*sample = timespec_sub_to_nsec(&now, &replay->last_frame) /
+			  1000;
+	}
+	replay->seen = true;
+	replay->last_missed = missed_deadlines;
+	replay->last_frame = now;
+
+	sample = wl_array_add(&replay->repaint_usec, sizeof *sample);
+	assert(sample);
+	*sample = repaint_usec;
+}
+
+static const struct weston_debug_output_stats_listener stats_listener = {
+	stats_handle_frame
+};
+
+static void
+replay_init(struct replay *replay, struct client *client)
+{
+	struct global *g;
+	struct weston_debug_stats *debug_stats = NULL;
+
+	memset(replay, 0, sizeof *replay);
+	replay->client = client;
+	wl_list_init(&replay->surface_list);
+	wl_array_init(&replay->repaint_usec);
+	wl_array_init(&replay->interval_usec);
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, weston_debug_stats_interface.name))
+			continue;
+
+		debug_stats = wl_registry_bind(client->wl_registry, g->name,
+					       &weston_debug_stats_interface, 1);
+	}
+
+	if (!debug_stats)
+		skip("weston_debug_stats not available, set debug-stats\n");
+
+	replay->stats = weston_debug_stats_get_output_stats(debug_stats,
+						client->output->wl_output);
+	weston_debug_output_stats_add_listener(replay->stats,
+					       &stats_listener, replay);
+	weston_debug_stats_destroy(debug_stats);
+	client_roundtrip(client);
+}
+
+static void
+buffer_handle_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct replay_buffer *rb = data;
+
+	rb->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_handle_release
+};
+
+static struct replay_surface *
+replay_surface_find(struct replay *replay, uint32_t id)
+{
+	struct replay_surface *rs;
+
+	wl_list_for_each(rs, &replay->surface_list, link)
+		if (rs->id == id)
+			return rs;
+
+	return NULL;
+}
+
+static void
+replay_surface_drop_buffers(struct replay_surface *rs)
+{
+	int i;
+
+	for (i = 0; i < rs->buffer_count; i++)
+		buffer_destroy(rs->buffers[i].buffer);
+	rs->buffer_count = 0;
+
+	if (rs->contents)
+		pixman_image_unref(rs->contents);
+	rs->contents = NULL;
+}
+
+static void
+replay_surface_destroy(struct replay_surface *rs)
+{
+	replay_surface_drop_buffers(rs);
+	wl_surface_destroy(rs->wl_surface);
+	wl_list_remove(&rs->link);
+	free(rs);
+}
+
+/* A buffer the compositor is done with, with the contents copied in */
+static struct buffer *
+replay_surface_get_buffer(struct replay *replay, struct replay_surface *rs)
+{
+	struct client *client = replay->client;
+	int width = pixman_image_get_width(rs->contents);
+	int height = pixman_image_get_height(rs->contents);
+	struct replay_buffer *rb = NULL;
+	int i;
+
+	while (!rb) {
+		for (i = 0; i < rs->buffer_count; i++)
+			if (!rs->buffers[i].busy)
+				rb = &rs->buffers[i];
+
+		if (!rb && rs->buffer_count < REPLAY_MAX_BUFFERS) {
+			rb = &rs->buffers[rs->buffer_count++];
+			if (rs->format == WL_SHM_FORMAT_XRGB8888)
+				rb->buffer = create_shm_buffer_x8r8g8b8(client,
+									width,
+									height);
+			else
+				rb->buffer = create_shm_buffer_a8r8g8b8(client,
+									width,
+									height);
+			wl_buffer_add_listener(rb->buffer->proxy,
+					       &buffer_listener, rb);
+		}
+
+		if (!rb)
+			assert(wl_display_dispatch(client->wl_display) >= 0);
+	}
+
+	pixman_image_composite32(PIXMAN_OP_SRC, rs->contents, NULL,
+				 rb->buffer->image, 0, 0, 0, 0, 0, 0,
+				 width, height);
+	rb->busy = true;
+
+	return rb->buffer;
+}
+
+/* Recorded pixels where there are some, a fill changing with every
+ * commit otherwise */
+static void
+replay_surface_draw(struct replay *replay, struct replay_surface *rs,
+		    const struct session_record_commit *commit,
+		    const struct session_record_rect *rects,
+		    const uint8_t *pixels)
+{
+	pixman_color_t color;
+	pixman_image_t *image;
+	uint32_t i;
+
+	color.red = (replay->fill * 0x0400) & 0xffff;
+	color.green = 0x8000;
+	color.blue = 0xffff - color.red;
+	color.alpha = 0xffff;
+	replay->fill++;
+
+	for (i = 0; i < commit->damage_count; i++) {
+		if (rects[i].width <= 0 || rects[i].height <= 0)
+			continue;
+
+		if (commit->has_pixels) {
+			image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							 rects[i].width,
+							 rects[i].height,
+							 (uint32_t *) pixels,
+							 rects[i].width * 4);
+			pixels += (size_t) rects[i].width *
+				  rects[i].height * 4;
+			replay->pixel_bytes += (size_t) rects[i].width *
+					       rects[i].height * 4;
+		} else {
+			image = pixman_image_create_solid_fill(&color);
+		}
+
+		pixman_image_composite32(PIXMAN_OP_SRC, image, NULL,
+					 rs->contents, 0, 0, 0, 0,
+					 rects[i].x, rects[i].y,
+					 rects[i].width, rects[i].height);
+		pixman_image_unref(image);
+	}
+}
+
+static void
+replay_commit(struct replay *replay, const struct session_record_commit *commit)
+{
+	struct client *client = replay->client;
+	struct replay_surface *rs;
+	const struct session_record_rect *rects =
+		(const struct session_record_rect *) (commit + 1);
+	struct buffer *buffer;
+	uint32_t format;
+	uint32_t i;
+
+	rs = replay_surface_find(replay, commit->base.surface_id);
+	if (!rs)
+		return;
+
+	if (commit->buffer_type == SESSION_BUFFER_NONE ||
+	    commit->width <= 0 || commit->height <= 0) {
+		wl_surface_attach(rs->wl_surface, NULL, 0, 0);
+		wl_surface_commit(rs->wl_surface);
+		replay->commits++;
+		return;
+	}
+
+	/* Everything but XRGB, dmabufs included, replays as ARGB */
+	format = commit->buffer_type == SESSION_BUFFER_SHM &&
+		 commit->format == WL_SHM_FORMAT_XRGB8888 ?
+		 WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+
+	if (!rs->contents ||
+	    pixman_image_get_width(rs->contents) != commit->width ||
+	    pixman_image_get_height(rs->contents) != commit->height ||
+	    rs->format != format) {
+		replay_surface_drop_buffers(rs);
+		rs->format = format;
+		rs->contents = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							commit->width,
+							commit->height,
+							NULL, 0);
+		assert(rs->contents);
+	}
+
+	replay_surface_draw(replay, rs, commit, rects,
+			    (const uint8_t *) (rects + commit->damage_count));
+	buffer = replay_surface_get_buffer(replay, rs);
+
+	if (!rs->placed || rs->x != commit->x || rs->y != commit->y) {
+		weston_test_move_surface(client->test->weston_test,
+					 rs->wl_surface, commit->x, commit->y);
+		rs->x = commit->x;
+		rs->y = commit->y;
+		rs->placed = true;
+	}
+
+	wl_surface_attach(rs->wl_surface, buffer->proxy, 0, 0);
+	for (i = 0; i < commit->damage_count; i++)
+		wl_surface_damage_buffer(rs->wl_surface,
+					 rects[i].x, rects[i].y,
+					 rects[i].width, rects[i].height);
+	wl_surface_commit(rs->wl_surface);
+	replay->commits++;
+}
+
+/* Handles events until the given time since begin */
+static void
+replay_wait(struct replay *replay, const struct timespec *begin,
+	    uint64_t time_nsec)
+{
+	struct wl_display *display = replay->client->wl_display;
+	struct pollfd pfd = {
+		.fd = wl_display_get_fd(display),
+		.events = POLLIN,
+	};
+	struct timespec now;
+	int64_t left;
+
+	while (1) {
+		assert(wl_display_dispatch_pending(display) >= 0);
+		assert(wl_display_flush(display) >= 0 || errno == EAGAIN);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = time_nsec - timespec_sub_to_nsec(&now, begin);
+		if (left <= 0)
+			return;
+
+		if (poll(&pfd, 1, (left + 999999) / 1000000) > 0)
+			assert(wl_display_dispatch(display) >= 0);
+	}
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *) a;
+	uint32_t ub = *(const uint32_t *) b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* Nearest rank, after sorting the samples */
+static uint32_t
+percentile(struct wl_array *array, int p)
+{
+	uint32_t *samples = array->data;
+	size_t count = array->size / sizeof *samples;
+
+	if (count == 0)
+		return 0;
+
+	qsort(samples, count, sizeof *samples, compare_uint32);
+
+	return samples[(count - 1) * p / 100];
+}
+
+static void
+replay_report(struct replay *replay, const char *file, double recorded,
+	      double replayed)
+{
+	const char *renderer = getenv("WESTON_BENCH_RENDERER");
+	const char *path = getenv("WESTON_BENCH_OUTPUT");
+	size_t frames = replay->repaint_usec.size / sizeof(uint32_t);
+	const char *name = strrchr(file, '/');
+	FILE *fp = stdout;
+
+	if (path) {
+		fp = fopen(path, "a");
+		assert(fp && "cannot open WESTON_BENCH_OUTPUT");
+	}
+
+	fprintf(fp, "{\"scenario\":\"replay\",\"recording\":\"%s\","
+		"\"renderer\":\"%s\",\"recorded_seconds\":%.3f,"
+		"\"seconds\":%.3f,\"surfaces\":%u,\"commits\":%u,"
+		"\"pixel_bytes\":%llu,\"frames\":%zu,"
+		"\"repaint_usec_p50\":%u,\"repaint_usec_p99\":%u,"
+		"\"repaint_usec_max\":%u,\"frame_interval_usec_p50\":%u,"
+		"\"frame_interval_usec_p99\":%u,\"missed_deadlines\":%u}\n",
+		name ? name + 1 : file, renderer ? renderer : "pixman",
+		recorded, replayed, replay->surfaces, replay->commits,
+		(unsigned long long) replay->pixel_bytes, frames,
+		percentile(&replay->repaint_usec, 50),
+		percentile(&replay->repaint_usec, 99),
+		percentile(&replay->repaint_usec, 100),
+		percentile(&replay->interval_usec, 50),
+		percentile(&replay->interval_usec, 99),
+		replay->last_missed - replay->first_missed);
+
+	if (fp != stdout)
+		fclose(fp);
+}
+
+static void *
+read_recording(const char *file, size_t *size)
+{
+	FILE *fp = fopen(file, "r");
+	void *data;
+	long len;
+
+	assert(fp && "cannot open WESTON_REPLAY_FILE");
+	assert(fseek(fp, 0, SEEK_END) == 0);
+	len = ftell(fp);
+	assert(len >= (long) sizeof(struct session_file_header));
+	rewind(fp);
+
+	data = xmalloc(len);
+	assert(fread(data, len, 1, fp) == 1);
+	fclose(fp);
+
+	*size = len;
+
+	return data;
+}
+
+TEST(replay)
+{
+	const char *file = getenv("WESTON_REPLAY_FILE");
+	const struct session_file_header *header;
+	const struct session_record *record;
+	struct replay_surface *rs, *tmp;
+	struct client *client;
+	struct replay replay;
+	struct timespec begin, end;
+	uint64_t last_time = 0;
+	uint8_t *data;
+	size_t size, pos;
+
+	if (!file)
+		skip("set WESTON_REPLAY_FILE to a recording to replay\n");
+
+	data = read_recording(file, &size);
+	header = (const struct session_file_header *) data;
+	assert(header->magic == SESSION_FILE_MAGIC);
+	assert(header->version == SESSION_FILE_VERSION);
+
+	client = create_client();
+	replay_init(&replay, client);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	for (pos = sizeof *header; pos + sizeof *record <= size;
+	     pos += record->size) {
+		record = (const struct session_record *) (data + pos);
+		assert(record->size >= sizeof *record &&
+		       pos + record->size <= size);
+
+		replay_wait(&replay, &begin, record->time_nsec);
+		last_time = record->time_nsec;
+
+		switch (record->type) {
+		case SESSION_RECORD_SURFACE:
+			rs = xzalloc(sizeof *rs);
+			rs->id = record->surface_id;
+			rs->wl_surface =
+				wl_compositor_create_surface(client->wl_compositor);
+			wl_list_insert(&replay.surface_list, &rs->link);
+			replay.surfaces++;
+			break;
+		case SESSION_RECORD_DESTROY:
+			rs = replay_surface_find(&replay, record->surface_id);
+			if (rs)
+				replay_surface_destroy(rs);
+			break;
+		case SESSION_RECORD_COMMIT:
+			replay_commit(&replay,
+				      (const struct session_record_commit *)
+				      record);
+			break;
+		}
+	}
+
+	client_roundtrip(client);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	replay_report(&replay, file, last_time / 1e9,
+		      timespec_sub_to_nsec(&end, &begin) / 1e9);
+
+	wl_list_for_each_safe(rs, tmp, &replay.surface_list, link)
+		replay_surface_destroy(rs);
+	weston_debug_output_stats_destroy(replay.stats);
+	wl_array_release(&replay.repaint_usec);
+	wl_array_release(&replay.interval_usec);
+	free(data);
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Soak run by "make soak" rather than as part of the test suite. It
+ * churns clients, surfaces with regions and presentation feedback,
+ * subsurfaces and outputs for $WESTON_SOAK_SECONDS, sampling the
+ * compositor's resident set, data segment and open fds as it goes, and
+ * fails if they grew past the limits below once warmed up. The samples
+ * go one JSON object per line to $WESTON_SOAK_OUTPUT, or stdout.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+#include "weston-test-client-helper.h"
+#include "presentation-time-client-protocol.h"
+
+#define SOAK_CLIENTS 8
+#define SOAK_SURFACES 32
+#define SOAK_SUBSURFACES 16
+#define SOAK_SIZE 64
+
+char *server_parameters = "--use-pixman --width=640 --height=480";
+
+struct soak_sample {
+	long rss_kb;
+	long data_kb;
+	int fds;
+};
+
+struct soak {
+	pid_t server;
+	struct timespec begin;
+	int seconds;
+	int sample_seconds;
+	int warmup_seconds;
+
+	long max_rss_kb;
+	long max_data_kb;
+	int max_fds;
+
+	bool have_baseline;
+	struct soak_sample baseline;
+	/* Lowest of each since the last report; leaks keep it rising,
+	 * while transient peaks do not. */
+	struct soak_sample low;
+	int next_report;
+	unsigned rounds;
+	FILE *out;
+};
+
+static int
+env_int(const char *name, int fallback)
+{
+	const char *value = getenv(name);
+
+	if (value && atoi(value) > 0)
+		return atoi(value);
+
+	return fallback;
+}
+
+static pid_t
+get_server_pid(struct client *client)
+{
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+
+	if (getsockopt(wl_display_get_fd(client->wl_display), SOL_SOCKET,
+		       SO_PEERCRED, &cred, &len) < 0)
+		return -1;
+
+	return cred.pid;
+}
+
+static void
+soak_sample(struct soak *soak, struct soak_sample *sample)
+{
+	char path[64], line[256];
+	struct dirent *entry;
+	DIR *dir;
+	FILE *fp;
+
+	sample->rss_kb = sample->data_kb = -1;
+	sample->fds = 0;
+
+	snprintf(path, sizeof path, "/proc/%d/status", (int) soak->server);
+	fp = fopen(path, "r");
+	assert(fp && "compositor is gone");
+	while (fgets(line, sizeof line, fp)) {
+		if (strncmp(line, "VmRSS:", 6) == 0)
+			sample->rss_kb = strtol(line + 6, NULL, 10);
+		else if (strncmp(line, "VmData:", 7) == 0)
+			sample->data_kb = strtol(line + 7, NULL, 10);
+	}
+	fclose(fp);
+
+	snprintf(path, sizeof path, "/proc/%d/fd", (int) soak->server);
+	dir = opendir(path);
+	assert(dir);
+	while ((entry = readdir(dir)))
+		if (entry->d_name[0] != '.')
+			sample->fds++;
+	closedir(dir);
+}
+
+static int
+soak_elapsed(struct soak *soak)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return timespec_sub_to_msec(&now, &soak->begin) / 1000;
+}
+
+static void
+soak_check(struct soak *soak, const struct soak_sample *s, int elapsed)
+{
+	const struct soak_sample *b = &soak->baseline;
+
+	fprintf(soak->out, "{\"seconds\":%d,\"rounds\":%u,\"rss_kb\":%ld,"
+		"\"data_kb\":%ld,\"fds\":%d,\"rss_growth_kb\":%ld,"
+		"\"data_growth_kb\":%ld,\"fd_growth\":%d}\n",
+		elapsed, soak->rounds, s->rss_kb, s->data_kb, s->fds,
+		s->rss_kb - b->rss_kb, s->data_kb - b->data_kb,
+		s->fds - b->fds);
+	fflush(soak->out);
+
+	if (s->rss_kb - b->rss_kb > soak->max_rss_kb ||
+	    s->data_kb - b->data_kb > soak->max_data_kb ||
+	    s->fds - b->fds > soak->max_fds) {
+		fprintf(stderr, "compositor grew from %ld kB RSS, %ld kB data "
+			"and %d fds to %ld kB, %ld kB and %d after %d s\n",
+			b->rss_kb, b->data_kb, b->fds,
+			s->rss_kb, s->data_kb, s->fds, elapsed);
+		assert(0 && "compositor keeps growing");
+	}
+}
+
+/* Returns false once the time is up */
+static bool
+soak_round_done(struct soak *soak)
+{
+	struct soak_sample s;
+	int elapsed = soak_elapsed(soak);
+
+	soak->rounds++;
+	soak_sample(soak, &s);
+
+	if (elapsed < soak->warmup_seconds)
+		return true;
+
+	if (!soak->have_baseline) {
+		soak->baseline = soak->low = s;
+		soak->have_baseline = true;
+		soak->next_report = elapsed + soak->sample_seconds;
+		return true;
+	}
+
+	soak->low.rss_kb = MIN(soak->low.rss_kb, s.rss_kb);
+	soak->low.data_kb = MIN(soak->low.data_kb, s.data_kb);
+	soak->low.fds = MIN(soak->low.fds, s.fds);
+
+	if (elapsed >= soak->next_report || elapsed >= soak->seconds) {
+		soak_check(soak, &soak->low, elapsed);
+		soak->low = s;
+		soak->next_report = elapsed + soak->sample_seconds;
+	}
+
+	return elapsed < soak->seconds;
+}
+
+/* data, if set, points to where the caller keeps the feedback */
+static void
+feedback_done(void *data, struct wp_presentation_feedback *feedback)
+{
+	struct wp_presentation_feedback **slot = data;
+
+	if (slot)
+		*slot = NULL;
+	wp_presentation_feedback_destroy(feedback);
+}
+
+static void
+feedback_sync_output(void *data, struct wp_presentation_feedback *feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh_nsec, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	feedback_done(data, feedback);
+}
+
+static void
+feedback_discarded(void *data, struct wp_presentation_feedback *feedback)
+{
+	feedback_done(data, feedback);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	int *pending = data;
+
+	(*pending)--;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static void *
+bind_global(struct client *client, const struct wl_interface *interface)
+{
+	struct global *g;
+
+	wl_list_for_each(g, &client->global_list, link)
+		if (strcmp(g->interface, interface->name) == 0)
+			return wl_registry_bind(client->wl_registry, g->name,
+						interface, 1);
+
+	assert(0 && "global not found");
+	return NULL;
+}
+
+/* Attaches new contents with regions set, asking for presentation
+ * feedback and, when pending is given, a frame callback. Returns the
+ * feedback, which destroys itself when it is done. */
+static struct wp_presentation_feedback *
+commit_surface(struct client *client, struct wl_surface *surface,
+	       struct buffer *buffer, struct wp_presentation *presentation,
+	       int *pending)
+{
+	struct wp_presentation_feedback *feedback = NULL;
+	struct wl_callback *callback;
+	struct wl_region *region;
+
+	region = wl_compositor_create_region(client->wl_compositor);
+	wl_region_add(region, 0, 0, SOAK_SIZE, SOAK_SIZE);
+	wl_region_subtract(region, 8, 8, 16, 16);
+	wl_region_add(region, 40, 8, 8, 48);
+	wl_surface_set_opaque_region(surface, region);
+	wl_surface_set_input_region(surface, region);
+	wl_region_destroy(region);
+
+	wl_surface_attach(surface, buffer->proxy, 0, 0);
+	wl_surface_damage(surface, 0, 0, SOAK_SIZE, SOAK_SIZE);
+
+	if (presentation) {
+		feedback = wp_presentation_feedback(presentation, surface);
+		wp_presentation_feedback_add_listener(feedback,
+						      &feedback_listener,
+						      NULL);
+	}
+
+	if (pending) {
+		callback = wl_surface_frame(surface);
+		wl_callback_add_listener(callback, &frame_listener, pending);
+		(*pending)++;
+	}
+
+	wl_surface_commit(surface);
+
+	return feedback;
+}
+
+static void
+wait_frames(struct client *client, int *pending)
+{
+	while (*pending > 0)
+		assert(wl_display_dispatch(client->wl_display) >= 0);
+}
+
+/* Clients that show a surface for a frame and go away, some of them
+ * with feedback still pending. */
+static void
+churn_clients(void)
+{
+	struct client *clients[SOAK_CLIENTS];
+	struct wp_presentation_feedback *feedback[SOAK_CLIENTS];
+	struct wp_presentation *presentation;
+	int i, pending = 0;
+
+	for (i = 0; i < SOAK_CLIENTS; i++)
+		clients[i] = create_client_and_test_surface(i * 48, i * 32,
+							    SOAK_SIZE,
+							    SOAK_SIZE);
+
+	for (i = 0; i < SOAK_CLIENTS; i++) {
+		presentation = bind_global(clients[i],
+					   &wp_presentation_interface);
+		feedback[i] = commit_surface(clients[i],
+					     clients[i]->surface->wl_surface,
+					     clients[i]->surface->buffer,
+					     presentation,
+					     i % 2 ? NULL : &pending);
+		wp_presentation_feedback_set_user_data(feedback[i],
+						       &feedback[i]);
+		wp_presentation_destroy(presentation);
+		wait_frames(clients[i], &pending);
+	}
+
+	for (i = 0; i < SOAK_CLIENTS; i++) {
+		if (feedback[i])
+			wp_presentation_feedback_destroy(feedback[i]);
+		client_destroy(clients[i]);
+	}
+}
+
+/* Surfaces created, shown and destroyed by one client */
+static void
+churn_surfaces(struct client *client, struct wp_presentation *presentation)
+{
+	struct wl_surface *surfaces[SOAK_SURFACES];
+	struct buffer *buffer;
+	int i, pending = 0;
+
+	buffer = create_shm_buffer_a8r8g8b8(client, SOAK_SIZE, SOAK_SIZE);
+
+	for (i = 0; i < SOAK_SURFACES; i++) {
+		surfaces[i] = wl_compositor_create_surface(client->wl_compositor);
+		weston_test_move_surface(client->test->weston_test,
+					 surfaces[i], (i % 8) * 72,
+					 (i / 8) * 72);
+		commit_surface(client, surfaces[i], buffer, presentation,
+			       &pending);
+	}
+	wait_frames(client, &pending);
+
+	/* Half of them go with feedback still pending */
+	for (i = 0; i < SOAK_SURFACES; i += 2)
+		commit_surface(client, surfaces[i], buffer, presentation,
+			       NULL);
+
+	for (i = 0; i < SOAK_SURFACES; i++)
+		wl_surface_destroy(surfaces[i]);
+	buffer_destroy(buffer);
+	client_roundtrip(client);
+}
+
+/* A parent gaining and losing desynchronized and synchronized children */
+static void
+churn_subsurfaces(struct client *client, struct wl_subcompositor *subco,
+		  struct wp_presentation *presentation)
+{
+	struct wl_surface *parent, *children[SOAK_SUBSURFACES];
+	struct wl_subsurface *subs[SOAK_SUBSURFACES];
+	struct buffer *buffer;
+	int i, pending = 0;
+
+	buffer = create_shm_buffer_a8r8g8b8(client, SOAK_SIZE, SOAK_SIZE);
+
+	parent = wl_compositor_create_surface(client->wl_compositor);
+	weston_test_move_surface(client->test->weston_test, parent, 32, 32);
+
+	for (i = 0; i < SOAK_SUBSURFACES; i++) {
+		children[i] = wl_compositor_create_surface(client->wl_compositor);
+		subs[i] = wl_subcompositor_get_subsurface(subco, children[i],
+							  parent);
+		wl_subsurface_set_position(subs[i], (i % 4) * 24,
+					   (i / 4) * 24);
+		if (i % 2)
+			wl_subsurface_set_desync(subs[i]);
+		if (i > 0)
+			wl_subsurface_place_below(subs[i], children[i - 1]);
+		commit_surface(client, children[i], buffer, NULL, NULL);
+	}
+	commit_surface(client, parent, buffer, presentation, &pending);
+	wait_frames(client, &pending);
+
+	for (i = 0; i < SOAK_SUBSURFACES; i++) {
+		wl_subsurface_destroy(subs[i]);
+		wl_surface_destroy(children[i]);
+	}
+	wl_surface_destroy(parent);
+	buffer_destroy(buffer);
+	client_roundtrip(client);
+}
+
+/* An output plugged in and out again. No other client of ours may be
+ * connected: it would bind the new wl_output after it was gone. */
+static void
+churn_output(unsigned round)
+{
+	struct client *client = create_client();
+	char name[32];
+
+	snprintf(name, sizeof name, "soak-%u", round);
+	weston_test_add_output(client->test->weston_test, name);
+	client_roundtrip(client);
+	weston_test_remove_output(client->test->weston_test, name);
+	client_roundtrip(client);
+
+	client_destroy(client);
+}
+
+static void
+churn_client_objects(void)
+{
+	struct client *client = create_client();
+	struct wl_subcompositor *subco;
+	struct wp_presentation *presentation;
+
+	subco = bind_global(client, &wl_subcompositor_interface);
+	presentation = bind_global(client, &wp_presentation_interface);
+
+	churn_surfaces(client, presentation);
+	churn_subsurfaces(client, subco, presentation);
+
+	wp_presentation_destroy(presentation);
+	wl_subcompositor_destroy(subco);
+	client_destroy(client);
+}
+
+TEST(soak)
+{
+	struct client *client = create_client();
+	const char *path = getenv("WESTON_SOAK_OUTPUT");
+	struct soak soak = { 0 };
+
+	soak.server = get_server_pid(client);
+	assert(soak.server > 0);
+	client_destroy(client);
+
+	soak.seconds = env_int("WESTON_SOAK_SECONDS", 600);
+	soak.sample_seconds = env_int("WESTON_SOAK_SAMPLE_SECONDS", 10);
+	soak.warmup_seconds = env_int("WESTON_SOAK_WARMUP_SECONDS", 30);
+	soak.max_rss_kb = env_int("WESTON_SOAK_MAX_RSS_GROWTH_KB", 4096);
+	soak.max_data_kb = env_int("WESTON_SOAK_MAX_DATA_GROWTH_KB", 4096);
+	soak.max_fds = env_int("WESTON_SOAK_MAX_FD_GROWTH", 4);
+	soak.out = stdout;
+	if (path) {
+		soak.out = fopen(path, "a");
+		assert(soak.out && "cannot open WESTON_SOAK_OUTPUT");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &soak.begin);
+
+	do {
+		churn_clients();
+		churn_client_objects();
+		churn_output(soak.rounds);
+	} while (soak_round_done(&soak));
+
+	if (soak.out != stdout)
+		fclose(soak.out);
+}
@@ -132,56 +132,38 @@ unpremultiply_and_swap_a8b8g8r8_to_PAMrgba(void *pixels, size_t size)
 	}
 }
 
+struct surface_shot {
+	struct weston_surface *surface; /* for logging only */
+	int width, height;
+	char desc[512];
+};
+
 static void
-trigger_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
-		void *data)
+surface_shot_done(void *data, void *shot_pixels)
 {
 	const char *prefix = "surfaceshot-";
 	const char *suffix = ".pam";
-	char fname[1024];
-	struct weston_surface *surface;
-	struct weston_seat *seat = keyboard->seat;
-	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
-	int width, height;
-	char desc[512];
-	void *pixels;
+	struct surface_shot *shot = data;
 	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
+	char fname[1024];
+	void *pixels = NULL;
 	size_t sz;
 	int ret;
 	FILE *fp;
 
-	if (!pointer || !pointer->focus)
-		return;
-
-	surface = pointer->focus->surface;
-
-	weston_surface_get_content_size(surface, &width, &height);
-
-	if (!surface->get_label ||
-	    surface->get_label(surface, desc, sizeof(desc)) < 0)
-		snprintf(desc, sizeof(desc), "(unknown)");
-
-	weston_log("surface screenshot of %p: '%s', %dx%d\n",
-		   surface, desc, width, height);
-
-	sz = width * bytespp * height;
-	if (sz == 0) {
-		weston_log("no content for %p\n", surface);
-		return;
+	if (!shot_pixels) {
+		weston_log("shooting surface %p failed\n", shot->surface);
+		goto out;
 	}
 
+	/* Only valid during the call, and not ours to convert in place */
+	sz = shot->width * bytespp * shot->height;
 	pixels = malloc(sz);
 	if (!pixels) {
 		weston_log("%s: failed to malloc %zu B\n", __func__, sz);
-		return;
-	}
-
-	ret = weston_surface_copy_content(surface, pixels, sz,
-					  0, 0, width, height);
-	if (ret < 0) {
-		weston_log("shooting surface %p failed\n", surface);
 		goto out;
 	}
+	memcpy(pixels, shot_pixels, sz);
 
 	unpremultiply_and_swap_a8b8g8r8_to_PAMrgba(pixels, sz);
 
@@ -202,15 +184,67 @@ trigger_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
 		goto out;
 	}
 
-	ret = write_PAM_image_rgba(fp, width, height, pixels, sz, desc);
+	ret = write_PAM_image_rgba(fp, shot->width, shot->height,
+				   pixels, sz, shot->desc);
 	if (fclose(fp) != 0 || ret < 0)
-		weston_log("writing surface %p screenshot failed.\n", surface);
+		weston_log("writing surface %p screenshot failed.\n",
+			   shot->surface);
 	else
 		weston_log("successfully shot surface %p into '%s'\n",
-			   surface, fname);
+			   shot->surface, fname);
 
 out:
 	free(pixels);
+	free(shot);
+}
+
+static void
+trigger_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
+		void *data)
+{
+	struct weston_surface *surface;
+	struct weston_seat *seat = keyboard->seat;
+	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
+	struct surface_shot *shot;
+	int width, height;
+
+	if (!pointer || !pointer->focus)
+		return;
+
+	surface = pointer->focus->surface;
+
+	weston_surface_get_content_size(surface, &width, &height);
+
+	shot = zalloc(sizeof *shot);
+	if (!shot) {
+		weston_log("%s: out of memory\n", __func__);
+		return;
+	}
+
+	shot->surface = surface;
+	shot->width = width;
+	shot->height = height;
+
+	if (!surface->get_label ||
+	    surface->get_label(surface, shot->desc, sizeof(shot->desc)) < 0)
+		snprintf(shot->desc, sizeof(shot->desc), "(unknown)");
+
+	weston_log("surface screenshot of %p: '%s', %dx%d\n",
+		   surface, shot->desc, width, height);
+
+	if (width == 0 || height == 0) {
+		weston_log("no content for %p\n", surface);
+		free(shot);
+		return;
+	}
+
+	/* The file is written once the GPU is done, without stalling the
+	 * compositor until then. */
+	if (weston_surface_copy_content_async(surface, 0, 0, width, height,
+					      surface_shot_done, shot) < 0) {
+		weston_log("shooting surface %p failed\n", surface);
+		free(shot);
+	}
 }
 
 WL_EXPORT int
@@ -0,0 +1,139 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+
+#include "shared/timespec-util.h"
+
+#include "weston-test-runner.h"
+
+TEST(test_timespec_sub)
+{
+	struct timespec a, b, r;
+
+	a.tv_sec = 1;
+	a.tv_nsec = 1;
+	b.tv_sec = 0;
+	b.tv_nsec = 2;
+	timespec_sub(&r, &a, &b);
+
+	assert(r.tv_sec == 0);
+	assert(r.tv_nsec == NSEC_PER_SEC - 1);
+}
+
+TEST(test_timespec_to_nsec)
+{
+	struct timespec a;
+
+	a.tv_sec = 4;
+	a.tv_nsec = 4;
+	assert(timespec_to_nsec(&a) == (NSEC_PER_SEC * 4ULL) + 4);
+}
+
+TEST(test_timespec_to_msec)
+{
+	struct timespec a;
+
+	a.tv_sec = 4;
+	a.tv_nsec = 4000000;
+	assert(timespec_to_msec(&a) == (4000ULL) + 4);
+}
+
+TEST(test_timespec_add_nsec)
+{
+	struct timespec a, r;
+
+	a.tv_sec = 0;
+	a.tv_nsec = NSEC_PER_SEC - 1;
+	timespec_add_nsec(&r, &a, 1);
+	assert(r.tv_sec == 1);
+	assert(r.tv_nsec == 0);
+
+	timespec_add_nsec(&r, &a, 2);
+	assert(r.tv_sec == 1);
+	assert(r.tv_nsec == 1);
+
+	timespec_add_nsec(&r, &a, (NSEC_PER_SEC * 2ULL));
+	assert(r.tv_sec == 2);
+	assert(r.tv_nsec == NSEC_PER_SEC - 1);
+
+	timespec_add_nsec(&r, &a, (NSEC_PER_SEC * 2ULL) + 2);
+	assert(r.tv_sec == 3);
+	assert(r.tv_nsec == 1);
+
+	r.tv_sec = 4;
+	r.tv_nsec = 0;
+	timespec_add_nsec(&r, &r, -1);
+	assert(r.tv_sec == 3);
+	assert(r.tv_nsec == NSEC_PER_SEC - 1);
+
+	a.tv_sec = 1;
+	a.tv_nsec = 1;
+	timespec_add_nsec(&r, &a, -2);
+	assert(r.tv_sec == 0);
+	assert(r.tv_nsec == NSEC_PER_SEC - 1);
+}
+
+TEST(test_timespec_add_msec)
+{
+	struct timespec a, r;
+
+	a.tv_sec = 1000;
+	a.tv_nsec = 1;
+	timespec_add_msec(&r, &a, 2002);
+	assert(r.tv_sec == 1002);
+	assert(r.tv_nsec == 2000001);
+
+	timespec_add_msec(&r, &a, -1);
+	assert(r.tv_sec == 999);
+	assert(r.tv_nsec == 999000001);
+}
+
+TEST(test_timespec_sub_to_nsec)
+{
+	struct timespec a, b;
+
+	a.tv_sec = 1000;
+	a.tv_nsec = 1;
+	b.tv_sec = 1;
+	b.tv_nsec = 2;
+	assert((999L * NSEC_PER_SEC) - 1 == timespec_sub_to_nsec(&a, &b));
+}
+
+TEST(test_timespec_sub_to_msec)
+{
+	struct timespec a, b;
+
+	a.tv_sec = 1000;
+	a.tv_nsec = 2000000L;
+	b.tv_sec = 2;
+	b.tv_nsec = 1000000L;
+	assert((998 * 1000) + 1 == timespec_sub_to_msec(&a, &b));
+}
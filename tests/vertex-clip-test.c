@@ -221,3 +221,125 @@ TEST(float_difference_same)
 	assert(float_difference(1.0f, 1.0f) == 0.0f);
 }
 
+
+struct axis_aligned_test_data
+{
+	struct polygon8 polygon;
+	int axis_aligned;
+};
+
+const struct axis_aligned_test_data axis_aligned_test_data[] =
+{
+	/* Untransformed rectangle */
+	{
+		{
+			{ INSIDE_X1, INSIDE_X2, INSIDE_X2, INSIDE_X1 },
+			{ INSIDE_Y1, INSIDE_Y1, INSIDE_Y2, INSIDE_Y2 },
+			4
+		},
+		1
+	},
+	/* Rotated by 90 degrees, starting with a vertical edge */
+	{
+		{
+			{ INSIDE_X2, INSIDE_X2, INSIDE_X1, INSIDE_X1 },
+			{ INSIDE_Y1, INSIDE_Y2, INSIDE_Y2, INSIDE_Y1 },
+			4
+		},
+		1
+	},
+	/* Rotated by 90 degrees with rounding error in the matrix */
+	{
+		{
+			{ INSIDE_X2, INSIDE_X2 + 1.0e-6f, INSIDE_X1, INSIDE_X1 - 1.0e-6f },
+			{ INSIDE_Y1, INSIDE_Y2, INSIDE_Y2 + 1.0e-6f, INSIDE_Y1 },
+			4
+		},
+		1
+	},
+	/* Diamond */
+	{
+		{
+			{ BOUNDING_BOX_LEFT_X - 25, BOUNDING_BOX_LEFT_X + 25, BOUNDING_BOX_RIGHT_X + 25, BOUNDING_BOX_RIGHT_X - 25 },
+			{ BOUNDING_BOX_BOTTOM_Y + 25, BOUNDING_BOX_TOP_Y + 25, BOUNDING_BOX_TOP_Y - 25, BOUNDING_BOX_BOTTOM_Y - 25 },
+			4
+		},
+		0
+	},
+	/* Slightly sheared rectangle */
+	{
+		{
+			{ INSIDE_X1, INSIDE_X2, INSIDE_X2 + 1.0f, INSIDE_X1 + 1.0f },
+			{ INSIDE_Y1, INSIDE_Y1, INSIDE_Y2, INSIDE_Y2 },
+			4
+		},
+		0
+	},
+	/* Not a quadrilateral */
+	{
+		{
+			{ INSIDE_X1, INSIDE_X2, INSIDE_X2 },
+			{ INSIDE_Y1, INSIDE_Y1, INSIDE_Y2 },
+			3
+		},
+		0
+	}
+};
+
+TEST_P(polygon_axis_aligned, axis_aligned_test_data)
+{
+	struct axis_aligned_test_data *tdata = data;
+
+	assert(polygon8_is_axis_aligned(&tdata->polygon) ==
+	       tdata->axis_aligned);
+}
+
+static void
+polygon_extents(const float *x, const float *y, int n,
+		float *x1, float *y1, float *x2, float *y2)
+{
+	int i;
+
+	*x1 = *x2 = x[0];
+	*y1 = *y2 = y[0];
+	for (i = 1; i < n; i++) {
+		*x1 = MIN(*x1, x[i]);
+		*x2 = MAX(*x2, x[i]);
+		*y1 = MIN(*y1, y[i]);
+		*y2 = MAX(*y2, y[i]);
+	}
+}
+
+/* The axis-aligned fast path must clip to the same rectangle as the
+ * general polygon clipper. */
+TEST_P(clip_simple_matches_transformed, test_data)
+{
+	struct vertex_clip_test_data *tdata = data;
+	struct clip_context ctx;
+	struct polygon8 polygon;
+	float simple_x[8], simple_y[8];
+	float transformed_x[8], transformed_y[8];
+	float sx1, sy1, sx2, sy2, tx1, ty1, tx2, ty2;
+	int n_simple, n_transformed;
+
+	if (!polygon8_is_axis_aligned(&tdata->surface))
+		return;
+
+	populate_clip_context(&ctx);
+	deep_copy_polygon8(&tdata->surface, &polygon);
+	n_simple = clip_simple(&ctx, &polygon, simple_x, simple_y);
+
+	deep_copy_polygon8(&tdata->surface, &polygon);
+	n_transformed = clip_polygon(&ctx, &polygon,
+				     transformed_x, transformed_y);
+
+	assert(n_simple == 4);
+	assert(n_transformed == 4);
+
+	polygon_extents(simple_x, simple_y, n_simple,
+			&sx1, &sy1, &sx2, &sy2);
+	polygon_extents(transformed_x, transformed_y, n_transformed,
+			&tx1, &ty1, &tx2, &ty2);
+
+	assert(sx1 == tx1 && sy1 == ty1 && sx2 == tx2 && sy2 == ty2);
+}
@@ -463,6 +463,13 @@ create_shm_buffer_a8r8g8b8(struct client *client, int width, int height)
 				 PIXMAN_a8r8g8b8, WL_SHM_FORMAT_ARGB8888);
 }
 
+struct buffer *
+create_shm_buffer_x8r8g8b8(struct client *client, int width, int height)
+{
+	return create_shm_buffer(client, width, height,
+				 PIXMAN_x8r8g8b8, WL_SHM_FORMAT_XRGB8888);
+}
+
 void
 buffer_destroy(struct buffer *buf)
 {
@@ -716,8 +723,25 @@ handle_global(void *data, struct wl_registry *registry,
 	}
 }
 
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+	struct client *client = data;
+	struct global *global, *tmp;
+
+	wl_list_for_each_safe(global, tmp, &client->global_list, link) {
+		if (global->name != name)
+			continue;
+
+		wl_list_remove(&global->link);
+		free(global->interface);
+		free(global);
+	}
+}
+
 static const struct wl_registry_listener registry_listener = {
-	handle_global
+	handle_global,
+	handle_global_remove
 };
 
 void
@@ -906,6 +930,53 @@ create_client_and_test_surface(int x, int y, int width, int height)
 	return client;
 }
 
+/* Disconnects and frees everything create_client() and
+ * create_client_and_test_surface() made, for tests that go through
+ * many clients. */
+void
+client_destroy(struct client *client)
+{
+	struct input *input, *itmp;
+	struct global *global, *gtmp;
+
+	if (client->surface) {
+		wl_surface_destroy(client->surface->wl_surface);
+		if (client->surface->buffer)
+			buffer_destroy(client->surface->buffer);
+		free(client->surface);
+	}
+
+	wl_list_for_each_safe(input, itmp, &client->inputs, link) {
+		input->caps = 0;
+		input_update_devices(input);
+		free(input->seat_name);
+		input_destroy(input);
+	}
+
+	if (client->output) {
+		wl_output_destroy(client->output->wl_output);
+		free(client->output);
+	}
+
+	if (client->test) {
+		weston_test_destroy(client->test->weston_test);
+		free(client->test);
+	}
+
+	wl_list_for_each_safe(global, gtmp, &client->global_list, link) {
+		wl_list_remove(&global->link);
+		free(global->interface);
+		free(global);
+	}
+
+	if (client->wl_shm)
+		wl_shm_destroy(client->wl_shm);
+	wl_compositor_destroy(client->wl_compositor);
+	wl_registry_destroy(client->wl_registry);
+	wl_display_disconnect(client->wl_display);
+	free(client);
+}
+
 static const char*
 output_path(void)
 {
@@ -1065,27 +1136,47 @@ image_iter_get_row(struct image_iterator *it, int y)
 	return (uint32_t *)(it->data + y * it->stride);
 }
 
+static bool
+pixel_within_fuzz(uint32_t a, uint32_t b, int fuzz)
+{
+	int shift, diff;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		diff = (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+		if (abs(diff) > fuzz)
+			return false;
+	}
+
+	return true;
+}
+
 /**
- * Test if a given region within two images are pixel-identical.
+ * Test if a given region within two images match, allowing for rounding
  *
- * Returns true if the two images pixel-wise identical, and false otherwise.
+ * Returns true if no channel of any pixel differs by more than fuzz
+ * between the two images, and false otherwise.
  *
  * \param img_a First image.
  * \param img_b Second image.
  * \param clip_rect The region of interest, or NULL for comparing the whole
  * images.
+ * \param fuzz The largest difference allowed per 8-bit channel.
+ *
+ * Rows are compared with memcmp() first, which libc does many pixels at
+ * a time; only rows that differ are looked at pixel by pixel.
  *
  * This function hard-fails if clip_rect is not inside both images. If clip_rect
  * is given, the images do not have to match in size, otherwise size mismatch
  * will be a hard failure.
  */
 bool
-check_images_match(pixman_image_t *img_a, pixman_image_t *img_b,
-		   const struct rectangle *clip_rect)
+check_images_match_fuzzy(pixman_image_t *img_a, pixman_image_t *img_b,
+			 const struct rectangle *clip_rect, int fuzz)
 {
 	struct image_iterator it_a;
 	struct image_iterator it_b;
 	pixman_box32_t box;
+	size_t row_bytes;
 	int x, y;
 	uint32_t *pix_a;
 	uint32_t *pix_b;
@@ -1095,12 +1186,20 @@ check_images_match(pixman_image_t *img_a, pixman_image_t *img_b,
 	image_iter_init(&it_a, img_a);
 	image_iter_init(&it_b, img_b);
 
+	row_bytes = (box.x2 - box.x1) * sizeof *pix_a;
+
 	for (y = box.y1; y < box.y2; y++) {
 		pix_a = image_iter_get_row(&it_a, y) + box.x1;
 		pix_b = image_iter_get_row(&it_b, y) + box.x1;
 
+		if (memcmp(pix_a, pix_b, row_bytes) == 0)
+			continue;
+
+		if (fuzz <= 0)
+			return false;
+
 		for (x = box.x1; x < box.x2; x++) {
-			if (*pix_a != *pix_b)
+			if (!pixel_within_fuzz(*pix_a, *pix_b, fuzz))
 				return false;
 
 			pix_a++;
@@ -1111,6 +1210,27 @@ check_images_match(pixman_image_t *img_a, pixman_image_t *img_b,
 	return true;
 }
 
+/**
+ * Test if a given region within two images are pixel-identical.
+ *
+ * Returns true if the two images pixel-wise identical, and false otherwise.
+ *
+ * \param img_a First image.
+ * \param img_b Second image.
+ * \param clip_rect The region of interest, or NULL for comparing the whole
+ * images.
+ *
+ * This function hard-fails if clip_rect is not inside both images. If clip_rect
+ * is given, the images do not have to match in size, otherwise size mismatch
+ * will be a hard failure.
+ */
+bool
+check_images_match(pixman_image_t *img_a, pixman_image_t *img_b,
+		   const struct rectangle *clip_rect)
+{
+	return check_images_match_fuzzy(img_a, img_b, clip_rect, 0);
+}
+
 /**
  * Tint a color
  *
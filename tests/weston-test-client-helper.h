@@ -158,9 +158,15 @@ create_client(void);
 struct client *
 create_client_and_test_surface(int x, int y, int width, int height);
 
+void
+client_destroy(struct client *client);
+
 struct buffer *
 create_shm_buffer_a8r8g8b8(struct client *client, int width, int height);
 
+struct buffer *
+create_shm_buffer_x8r8g8b8(struct client *client, int width, int height);
+
 void
 buffer_destroy(struct buffer *buf);
 
@@ -199,6 +205,10 @@ bool
 check_images_match(pixman_image_t *img_a, pixman_image_t *img_b,
 		   const struct rectangle *clip);
 
+bool
+check_images_match_fuzzy(pixman_image_t *img_a, pixman_image_t *img_b,
+			 const struct rectangle *clip, int fuzz);
+
 pixman_image_t *
 visualize_image_difference(pixman_image_t *img_a, pixman_image_t *img_b,
 			   const struct rectangle *clip_rect);
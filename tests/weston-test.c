@@ -31,9 +31,11 @@
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 
 #include "compositor.h"
 #include "compositor/weston.h"
+#include "windowed-output-api.h"
 #include "weston-test-server-protocol.h"
 
 #ifdef ENABLE_EGL
@@ -56,6 +58,8 @@ struct weston_test_surface {
 	struct weston_view *view;
 	int32_t x, y;
 	struct weston_test *test;
+	int32_t degrees;
+	struct weston_transform rotation;
 };
 
 static void
@@ -103,6 +107,23 @@ test_surface_committed(struct weston_surface *surface, int32_t sx, int32_t sy)
 	weston_view_set_position(test_surface->view,
 				 test_surface->x, test_surface->y);
 
+	wl_list_remove(&test_surface->rotation.link);
+	wl_list_init(&test_surface->rotation.link);
+	if (test_surface->degrees % 360 != 0) {
+		struct weston_matrix *matrix = &test_surface->rotation.matrix;
+		float cx = 0.5f * surface->width;
+		float cy = 0.5f * surface->height;
+		double angle = test_surface->degrees * M_PI / 180.0;
+
+		weston_matrix_init(matrix);
+		weston_matrix_translate(matrix, -cx, -cy, 0.0f);
+		weston_matrix_rotate_xy(matrix, cos(angle), sin(angle));
+		weston_matrix_translate(matrix, cx, cy, 0.0f);
+		wl_list_insert(&test_surface->view->geometry.transformation_list,
+			       &test_surface->rotation.link);
+	}
+	weston_view_geometry_dirty(test_surface->view);
+
 	weston_view_update_transform(test_surface->view);
 
 	test_surface->surface->is_mapped = true;
@@ -133,6 +154,9 @@ move_surface(struct wl_client *client, struct wl_resource *resource,
 			return;
 		}
 
+		test_surface->degrees = 0;
+		wl_list_init(&test_surface->rotation.link);
+
 		surface->committed_private = test_surface;
 		surface->committed = test_surface_committed;
 	}
@@ -486,6 +510,54 @@ capture_screenshot(struct wl_client *client,
 				     capture_screenshot_done, resource);
 }
 
+static void
+rotate_surface(struct wl_client *client, struct wl_resource *resource,
+	       struct wl_resource *surface_resource, int32_t degrees)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct weston_test_surface *test_surface;
+
+	if (surface->committed != test_surface_committed) {
+		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
+				       "surface was not moved with move_surface");
+		return;
+	}
+
+	test_surface = surface->committed_private;
+	test_surface->degrees = degrees;
+}
+
+static void
+add_output(struct wl_client *client, struct wl_resource *resource,
+	   const char *name)
+{
+	struct weston_test *test = wl_resource_get_user_data(resource);
+	const struct weston_windowed_output_api *api =
+		weston_windowed_output_get_api(test->compositor);
+
+	if (!api)
+		return;
+
+	if (api->output_create(test->compositor, name) < 0)
+		wl_client_post_no_memory(client);
+}
+
+static void
+remove_output(struct wl_client *client, struct wl_resource *resource,
+	      const char *name)
+{
+	struct weston_test *test = wl_resource_get_user_data(resource);
+	struct weston_output *output;
+
+	wl_list_for_each(output, &test->compositor->output_list, link) {
+		if (strcmp(output->name, name) == 0) {
+			output->destroy(output);
+			return;
+		}
+	}
+}
+
 static const struct weston_test_interface test_implementation = {
 	move_surface,
 	move_pointer,
@@ -495,6 +567,9 @@ static const struct weston_test_interface test_implementation = {
 	device_release,
 	device_add,
 	capture_screenshot,
+	rotate_surface,
+	add_output,
+	remove_output,
 };
 
 static void
@@ -0,0 +1,452 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Turns a binary timeline snapshot written by weston_timeline_ring_dump()
+ * into the JSON timeline log format, for the existing timeline tools.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "timeline.h"
+#include "timeline-format.h"
+
+#define NSEC_PER_SEC 1000000000
+
+enum object_state {
+	OBJECT_UNSEEN = 0,
+	OBJECT_DESCRIBED,
+	OBJECT_REFERENCED,
+	OBJECT_HOISTED,
+};
+
+struct object {
+	enum object_state state;
+	/* Latest description seen so far */
+	const struct timeline_record_string *description;
+};
+
+struct converter {
+	FILE *out;
+	/* Interned point names, indexed by name id */
+	const char **names;
+	uint32_t names_count;
+	/* Indexed by object id */
+	struct object *objects;
+	uint32_t objects_count;
+};
+
+static void
+usage(int exit_code)
+{
+	fprintf(stderr, "usage: weston-timeline-convert "
+		"SNAPSHOT [OUTPUT]\n\n"
+		"\tWrites the JSON timeline of a binary weston timeline "
+		"snapshot\n\tto OUTPUT, or to standard output.\n");
+	exit(exit_code);
+}
+
+static void
+print_quoted_string(FILE *fp, const struct timeline_record_string *record)
+{
+	if (record->length == TIMELINE_STRING_NULL) {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fprintf(fp, "\"%.*s\"", (int) record->length, record->string);
+}
+
+static int
+add_name(struct converter *c, const struct timeline_record_string *record)
+{
+	const char **names;
+	uint32_t i;
+
+	if (record->id >= c->names_count) {
+		names = realloc(c->names, (record->id + 1) * sizeof *names);
+		if (!names)
+			return -1;
+		for (i = c->names_count; i <= record->id; i++)
+			names[i] = NULL;
+		c->names = names;
+		c->names_count = record->id + 1;
+	}
+
+	c->names[record->id] = record->length == TIMELINE_STRING_NULL ?
+		NULL : record->string;
+
+	return 0;
+}
+
+static void
+print_object(struct converter *c, const struct timeline_record_string *record)
+{
+	if (record->base.type == TIMELINE_RECORD_OUTPUT) {
+		fprintf(c->out, "{ \"id\":%u, "
+			"\"type\":\"weston_output\", \"name\":", record->id);
+		print_quoted_string(c->out, record);
+		fprintf(c->out, " }\n");
+		return;
+	}
+
+	fprintf(c->out, "{ \"id\":%u, "
+		"\"type\":\"weston_surface\", \"desc\":", record->id);
+	print_quoted_string(c->out, record);
+	if (record->main_surface)
+		fprintf(c->out, ", \"main_surface\":%u", record->main_surface);
+	fprintf(c->out, " }\n");
+}
+
+static void
+print_nsec(FILE *fp, uint64_t nsec)
+{
+	fprintf(fp, "[%" PRId64 ", %ld]", (int64_t) (nsec / NSEC_PER_SEC),
+		(long) (nsec % NSEC_PER_SEC));
+}
+
+static void
+print_point(struct converter *c, const struct timeline_record_point *point)
+{
+	const struct timeline_record_arg *arg;
+	const char *name = NULL;
+	size_t i, count;
+
+	if (point->name < c->names_count)
+		name = c->names[point->name];
+
+	fprintf(c->out, "{ \"T\":");
+	print_nsec(c->out, point->time);
+	fprintf(c->out, ", \"N\":\"%s\"", name ? name : "unknown");
+
+	count = (point->base.size - sizeof *point) / sizeof *arg;
+	for (i = 0; i < count; i++) {
+		arg = &point->args[i];
+
+		switch (arg->type) {
+		case TLT_OUTPUT:
+			fprintf(c->out, ", \"wo\":%u", arg->id);
+			break;
+		case TLT_SURFACE:
+			fprintf(c->out, ", \"ws\":%u", arg->id);
+			break;
+		case TLT_VBLANK:
+			fprintf(c->out, ", \"vblank\":");
+			print_nsec(c->out, arg->value);
+			break;
+		case TLT_PIXELS:
+			fprintf(c->out, ", \"pixels\":%" PRIu64, arg->value);
+			break;
+		case TLT_GPU:
+			fprintf(c->out, ", \"gpu\":");
+			print_nsec(c->out, arg->value);
+			break;
+		case TLT_MSC:
+			fprintf(c->out, ", \"msc\":%" PRIu64, arg->value);
+			break;
+		case TLT_INPUT:
+			fprintf(c->out, ", \"input\":");
+			print_nsec(c->out, arg->value);
+			break;
+		default:
+			break;
+		}
+	}
+
+	fprintf(c->out, " }\n");
+}
+
+static int
+check_record(const struct timeline_record *record, size_t avail)
+{
+	size_t min;
+
+	if (avail < sizeof *record || record->size > avail ||
+	    record->size % 8 != 0)
+		return -1;
+
+	switch (record->type) {
+	case TIMELINE_RECORD_NAME:
+	case TIMELINE_RECORD_OUTPUT:
+	case TIMELINE_RECORD_SURFACE:
+		min = sizeof(struct timeline_record_string);
+		if (record->size < min + 1)
+			return -1;
+		if (((const struct timeline_record_string *) record)->length !=
+		    TIMELINE_STRING_NULL &&
+		    ((const struct timeline_record_string *) record)->length >
+		    record->size - min - 1)
+			return -1;
+		return 0;
+	case TIMELINE_RECORD_POINT:
+		min = sizeof(struct timeline_record_point);
+		break;
+	default:
+		min = sizeof *record;
+		break;
+	}
+
+	return record->size < min ? -1 : 0;
+}
+
+static struct object *
+get_object(struct converter *c, uint32_t id)
+{
+	struct object *objects;
+	uint32_t count;
+
+	if (id >= c->objects_count) {
+		count = c->objects_count ? c->objects_count : 256;
+		while (count <= id)
+			count *= 2;
+		objects = realloc(c->objects, count * sizeof *objects);
+		if (!objects)
+			return NULL;
+		memset(objects + c->objects_count, 0,
+		       (count - c->objects_count) * sizeof *objects);
+		c->objects = objects;
+		c->objects_count = count;
+	}
+
+	return &c->objects[id];
+}
+
+static void
+print_hoisted_object(struct converter *c,
+		     const struct timeline_record_string *record)
+{
+	struct object *main_surface = NULL;
+
+	/* Its main surface has to be described before it, too */
+	if (record->main_surface < c->objects_count)
+		main_surface = &c->objects[record->main_surface];
+	if (main_surface && main_surface->description &&
+	    main_surface->state != OBJECT_HOISTED) {
+		print_object(c, main_surface->description);
+		main_surface->state = OBJECT_HOISTED;
+	}
+
+	print_object(c, record);
+}
+
+/*
+ * The oldest points of a snapshot may refer to objects whose description
+ * the ring had already overwritten; those objects are described again on
+ * their next use, so print that description ahead of everything.
+ */
+static int
+hoist_object(struct converter *c, const struct timeline_record *record)
+{
+	const struct timeline_record_string *description;
+	const struct timeline_record_point *point;
+	struct object *object;
+	size_t i, count;
+
+	switch (record->type) {
+	case TIMELINE_RECORD_OUTPUT:
+	case TIMELINE_RECORD_SURFACE:
+		description = (const void *) record;
+		object = get_object(c, description->id);
+		if (!object)
+			return -1;
+		object->description = description;
+		if (object->state == OBJECT_REFERENCED) {
+			print_hoisted_object(c, description);
+			object->state = OBJECT_HOISTED;
+		} else if (object->state == OBJECT_UNSEEN) {
+			object->state = OBJECT_DESCRIBED;
+		}
+		break;
+	case TIMELINE_RECORD_POINT:
+		point = (const void *) record;
+		count = (point->base.size - sizeof *point) /
+			sizeof point->args[0];
+		for (i = 0; i < count; i++) {
+			if (point->args[i].type != TLT_OUTPUT &&
+			    point->args[i].type != TLT_SURFACE)
+				continue;
+			object = get_object(c, point->args[i].id);
+			if (!object)
+				return -1;
+			if (object->state == OBJECT_UNSEEN)
+				object->state = OBJECT_REFERENCED;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int
+convert_record(struct converter *c, const struct timeline_record *record)
+{
+	switch (record->type) {
+	case TIMELINE_RECORD_NAME:
+		return add_name(c, (const void *) record);
+	case TIMELINE_RECORD_OUTPUT:
+	case TIMELINE_RECORD_SURFACE:
+		print_object(c, (const void *) record);
+		break;
+	case TIMELINE_RECORD_POINT:
+		print_point(c, (const void *) record);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int
+for_each_record(struct converter *c, const uint8_t *data, size_t size,
+		int (*func)(struct converter *c,
+			    const struct timeline_record *record))
+{
+	const struct timeline_record *record;
+	size_t pos;
+
+	for (pos = sizeof(struct timeline_file_header); pos < size;
+	     pos += record->size) {
+		record = (const void *) (data + pos);
+		if (check_record(record, size - pos) < 0) {
+			fprintf(stderr, "truncated or corrupt record at "
+				"offset %zu\n", pos);
+			return -1;
+		}
+
+		if (func(c, record) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+convert(struct converter *c, const uint8_t *data, size_t size)
+{
+	const struct timeline_file_header *header = (const void *) data;
+
+	if (size < sizeof *header || header->magic != TIMELINE_FILE_MAGIC) {
+		fprintf(stderr, "not a weston timeline snapshot\n");
+		return -1;
+	}
+
+	if (header->version != TIMELINE_FILE_VERSION) {
+		fprintf(stderr, "unsupported timeline snapshot version %u\n",
+			header->version);
+		return -1;
+	}
+
+	if (for_each_record(c, data, size, hoist_object) < 0)
+		return -1;
+
+	return for_each_record(c, data, size, convert_record);
+}
+
+static uint8_t *
+read_file(const char *filename, size_t *size)
+{
+	FILE *fp;
+	uint8_t *data = NULL, *p;
+	size_t alloc = 0, len = 0, n;
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return NULL;
+
+	do {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 1024 * 1024;
+			p = realloc(data, alloc);
+			if (!p) {
+				free(data);
+				fclose(fp);
+				return NULL;
+			}
+			data = p;
+		}
+		n = fread(data + len, 1, alloc - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(fp)) {
+		free(data);
+		fclose(fp);
+		return NULL;
+	}
+
+	fclose(fp);
+	*size = len;
+
+	return data;
+}
+
+int main(int argc, char *argv[])
+{
+	struct converter c = { 0 };
+	uint8_t *data;
+	size_t size;
+	int ret;
+
+	if (argc < 2 || argc > 3)
+		usage(EXIT_FAILURE);
+	if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)
+		usage(EXIT_SUCCESS);
+
+	data = read_file(argv[1], &size);
+	if (!data) {
+		fprintf(stderr, "failed to read %s: %s\n",
+			argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	c.out = argc == 3 ? fopen(argv[2], "w") : stdout;
+	if (!c.out) {
+		fprintf(stderr, "failed to open %s: %s\n",
+			argv[2], strerror(errno));
+		free(data);
+		return EXIT_FAILURE;
+	}
+
+	ret = convert(&c, data, size);
+
+	if (c.out != stdout && fclose(c.out) != 0)
+		ret = -1;
+
+	free(c.names);
+	free(c.objects);
+	free(data);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
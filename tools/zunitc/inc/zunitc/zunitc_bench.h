@@ -0,0 +1,107 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef Z_UNIT_C_BENCH_H
+#define Z_UNIT_C_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file
+ * Timing loops for microbenchmarks run as zunitc tests.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Timings of a benchmark, in nanoseconds per iteration.
+ */
+struct zuc_bench_result {
+	/** Iterations in each timed sample. */
+	uint64_t iterations;
+	/** Number of timed samples. */
+	int samples;
+	double min;
+	double median;
+	double p99;
+	double mean;
+	double stddev;
+	/** Cache misses per iteration over the timed samples, or a
+	 * negative value if the hardware counter is not available. */
+	double cache_misses;
+};
+
+/**
+ * Function timed by zuc_bench_run().
+ *
+ * @param data the pointer passed to zuc_bench_run().
+ * @param iterations how many times to run the benchmarked code.
+ */
+typedef void (*zuc_bench_func_t)(void *data, uint64_t iterations);
+
+/**
+ * Times a function and reports the result.
+ *
+ * The function is first run with a growing number of iterations until
+ * one call takes about 10 ms, which also warms up caches and branch
+ * predictors, then run for another 100 ms untimed, and finally timed
+ * for 50 samples of that many iterations.
+ *
+ * Where the kernel and the CPU allow it, the cache misses of the timed
+ * samples are counted as well, with the perf hardware counter.
+ *
+ * The result is printed as one line of JSON, to stdout or appended to
+ * the file named by the ZUC_BENCH_OUTPUT environment variable.
+ *
+ * @param name name of the benchmark in the report.
+ * @param func the function to time.
+ * @param data passed to func.
+ * @param result where to store the timings, or NULL.
+ * @return true on success, false if the report could not be written.
+ */
+bool
+zuc_bench_run(const char *name, zuc_bench_func_t func, void *data,
+	      struct zuc_bench_result *result);
+
+/**
+ * Keeps the compiler from optimizing away the computation of a value
+ * that the benchmark does not otherwise use.
+ *
+ * @param p pointer to the value.
+ */
+static inline void
+zuc_bench_escape(const void *p)
+{
+	__asm__ __volatile__ ("" : : "g" (p) : "memory");
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Z_UNIT_C_BENCH_H */
@@ -0,0 +1,192 @@
+/*
+ * Copyright © 2017 Weston contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zunitc/zunitc_bench.h"
+
+#define NSEC_PER_MSEC 1000000LL
+
+/* Length of one timed sample */
+#define ZUC_BENCH_SAMPLE_NSEC (10 * NSEC_PER_MSEC)
+/* Untimed run after calibration */
+#define ZUC_BENCH_WARMUP_NSEC (100 * NSEC_PER_MSEC)
+#define ZUC_BENCH_SAMPLES 50
+
+static int64_t
+time_batch(zuc_bench_func_t func, void *data, uint64_t iterations)
+{
+	struct timespec begin, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	func(data, iterations);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (int64_t)(end.tv_sec - begin.tv_sec) * 1000000000LL +
+		end.tv_nsec - begin.tv_nsec;
+}
+
+/* Finds how many iterations make one sample */
+static uint64_t
+calibrate(zuc_bench_func_t func, void *data)
+{
+	uint64_t iterations = 1;
+	int64_t elapsed;
+
+	for (;;) {
+		elapsed = time_batch(func, data, iterations);
+		if (elapsed >= ZUC_BENCH_SAMPLE_NSEC / 4)
+			break;
+		iterations *= 2;
+	}
+
+	iterations = iterations * ZUC_BENCH_SAMPLE_NSEC / elapsed;
+
+	return iterations > 0 ? iterations : 1;
+}
+
+/* Returns a disabled counter of this thread's cache misses in user space,
+ * or -1 where there is no such counter, as in most virtual machines or
+ * with perf_event_paranoid above 2 */
+static int
+open_cache_miss_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+
+	return da < db ? -1 : da > db;
+}
+
+static bool
+report(const char *name, const struct zuc_bench_result *r)
+{
+	const char *path = getenv("ZUC_BENCH_OUTPUT");
+	FILE *fp = stdout;
+	bool ok;
+
+	if (path) {
+		fp = fopen(path, "a");
+		if (!fp)
+			return false;
+	}
+
+	fprintf(fp, "{\"benchmark\":\"%s\",\"iterations\":%llu,"
+		"\"samples\":%d,\"ns_min\":%.2f,\"ns_median\":%.2f,"
+		"\"ns_p99\":%.2f,\"ns_mean\":%.2f,\"ns_stddev\":%.2f",
+		name, (unsigned long long) r->iterations, r->samples,
+		r->min, r->median, r->p99, r->mean, r->stddev);
+	if (r->cache_misses >= 0.0)
+		fprintf(fp, ",\"cache_misses\":%.3f", r->cache_misses);
+	fprintf(fp, "}\n");
+
+	ok = !ferror(fp);
+	if (fp != stdout)
+		ok = fclose(fp) == 0 && ok;
+	else
+		fflush(fp);
+
+	return ok;
+}
+
+bool
+zuc_bench_run(const char *name, zuc_bench_func_t func, void *data,
+	      struct zuc_bench_result *result)
+{
+	struct zuc_bench_result r = { 0 };
+	double samples[ZUC_BENCH_SAMPLES];
+	double sum = 0.0, var = 0.0;
+	int64_t warmed = 0;
+	uint64_t misses;
+	int counter;
+	int i;
+
+	r.iterations = calibrate(func, data);
+	r.samples = ZUC_BENCH_SAMPLES;
+
+	while (warmed < ZUC_BENCH_WARMUP_NSEC)
+		warmed += time_batch(func, data, r.iterations);
+
+	counter = open_cache_miss_counter();
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	for (i = 0; i < r.samples; i++) {
+		samples[i] = (double) time_batch(func, data, r.iterations) /
+			r.iterations;
+		sum += samples[i];
+	}
+
+	r.cache_misses = -1.0;
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter, &misses, sizeof misses) == sizeof misses)
+			r.cache_misses = (double) misses /
+				((double) r.iterations * r.samples);
+		close(counter);
+	}
+
+	qsort(samples, r.samples, sizeof samples[0], compare_double);
+
+	r.mean = sum / r.samples;
+	for (i = 0; i < r.samples; i++)
+		var += (samples[i] - r.mean) * (samples[i] - r.mean);
+	r.stddev = sqrt(var / (r.samples - 1));
+	r.min = samples[0];
+	r.median = samples[r.samples / 2];
+	r.p99 = samples[(r.samples - 1) * 99 / 100];
+
+	if (result)
+		*result = r;
+
+	return report(name, &r);
+}
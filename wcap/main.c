@@ -36,6 +36,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
@@ -55,25 +56,18 @@ write_png(struct wcap_decoder *decoder, const char *filename)
 	cairo_surface_destroy(surface);
 }
 
+/* The format is known per recording only, so the conversions below take
+ * the channel positions as constants and get specialized for each of the
+ * two formats, which leaves their inner loops free of branches and lets
+ * the compiler vectorize them. */
 static inline int
-rgb_to_yuv(uint32_t format, uint32_t p, int *u, int *v)
+rgb_to_yuv(uint32_t p, int rshift, int bshift, int *u, int *v)
 {
 	int r, g, b, y;
 
-	switch (format) {
-	case WCAP_FORMAT_XRGB8888:
-		r = (p >> 16) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 0) & 0xff;
-		break;
-	case WCAP_FORMAT_XBGR8888:
-		r = (p >> 0) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 16) & 0xff;
-		break;
-	default:
-		assert(0);
-	}
+	r = (p >> rshift) & 0xff;
+	g = (p >> 8) & 0xff;
+	b = (p >> bshift) & 0xff;
 
 	y = (19595 * r + 38469 * g + 7472 * b) >> 16;
 	if (y > 255)
@@ -98,126 +92,460 @@ int clamp_uv(int u)
 		return clamp;
 }
 
-static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+static inline void
+convert_to_yv12_shifted(const uint32_t *frame, int width, int height,
+			unsigned char *out, int rshift, int bshift)
 {
 	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
-	int i, u_accum, v_accum, stride0, stride1;
-	uint32_t format = decoder->format;
+	const uint32_t *p1, *p2;
+	int i, x, u_accum, v_accum, stride0, stride1;
 
-	stride0 = decoder->width;
-	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
+	stride0 = width;
+	stride1 = width / 2;
+	for (i = 0; i < height; i += 2) {
 		y1 = out + stride0 * i;
 		y2 = y1 + stride0;
-		v = out + stride0 * decoder->height + stride1 * i / 2;
-		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
+		v = out + stride0 * height + stride1 * i / 2;
+		u = v + stride1 * height / 2;
+		p1 = frame + width * i;
+		p2 = p1 + width;
 
-		while (p1 < end) {
+		for (x = 0; x < stride1; x++) {
 			u_accum = 0;
 			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
-			u[0] = clamp_uv(u_accum);
-			v[0] = clamp_uv(v_accum);
-
-			y1 += 2;
-			p1 += 2;
-			y2 += 2;
-			p2 += 2;
-			u++;
-			v++;
+			y1[2 * x] = rgb_to_yuv(p1[2 * x], rshift, bshift,
+					       &u_accum, &v_accum);
+			y1[2 * x + 1] = rgb_to_yuv(p1[2 * x + 1], rshift, bshift,
+						   &u_accum, &v_accum);
+			y2[2 * x] = rgb_to_yuv(p2[2 * x], rshift, bshift,
+					       &u_accum, &v_accum);
+			y2[2 * x + 1] = rgb_to_yuv(p2[2 * x + 1], rshift, bshift,
+						   &u_accum, &v_accum);
+			u[x] = clamp_uv(u_accum);
+			v[x] = clamp_uv(v_accum);
 		}
 	}
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yv12(const uint32_t *frame, int width, int height,
+		uint32_t format, unsigned char *out)
 {
+	if (format == WCAP_FORMAT_XRGB8888)
+		convert_to_yv12_shifted(frame, width, height, out, 16, 0);
+	else if (format == WCAP_FORMAT_XBGR8888)
+		convert_to_yv12_shifted(frame, width, height, out, 0, 16);
+	else
+		assert(0);
+}
 
+static inline void
+convert_to_yuv444_shifted(const uint32_t *frame, int width, int height,
+			  unsigned char *out, int rshift, int bshift)
+{
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
+	const uint32_t *rp;
 	int u, v;
-	int i, stride, psize;
-	uint32_t format = decoder->format;
+	int i, x, psize;
 
-	stride = decoder->width;
-	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
-		yp = out + stride * i;
+	psize = width * height;
+	for (i = 0; i < height; i++) {
+		yp = out + width * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
-		while (rp < end) {
+		rp = frame + width * i;
+		for (x = 0; x < width; x++) {
 			u = 0;
 			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
+			yp[x] = rgb_to_yuv(rp[x], rshift, bshift, &u, &v);
+			up[x] = clamp_uv(u/.3);
+			vp[x] = clamp_uv(v/.3);
 		}
 	}
 }
 
+static void
+convert_to_yuv444(const uint32_t *frame, int width, int height,
+		  uint32_t format, unsigned char *out)
+{
+	if (format == WCAP_FORMAT_XRGB8888)
+		convert_to_yuv444_shifted(frame, width, height, out, 16, 0);
+	else if (format == WCAP_FORMAT_XBGR8888)
+		convert_to_yuv444_shifted(frame, width, height, out, 0, 16);
+	else
+		assert(0);
+}
+
+static int
+yuv_frame_size(struct wcap_decoder *decoder, int depth)
+{
+	if (depth == 444)
+		return decoder->width * decoder->height * 3;
+	else
+		return decoder->width * decoder->height * 3 / 2;
+}
+
+static void
+convert_yuv_frame(const uint32_t *frame, int width, int height,
+		  uint32_t format, int depth, unsigned char *out)
+{
+	if (depth == 444)
+		convert_to_yuv444(frame, width, height, format, out);
+	else
+		convert_to_yv12(frame, width, height, format, out);
+}
+
 static void
 output_yuv_frame(struct wcap_decoder *decoder, int depth)
 {
 	static unsigned char *out;
-	int size;
+	int size = yuv_frame_size(decoder, depth);
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
-	}
 	if (out == NULL)
 		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
-	}
+	convert_yuv_frame(decoder->frame, decoder->width, decoder->height,
+			  decoder->format, depth, out);
 
 	printf("FRAME\n");
 	fwrite(out, 1, size, stdout);
 }
 
+/* Frames have to be reconstructed one after the other, each one being
+ * the previous one plus damage, but once a frame is complete, converting
+ * and writing it out is independent of the others. So the main thread
+ * decodes into a ring of slots, a number of threads convert whatever
+ * slot is decoded, and one more writes the slots out in order. */
+enum yuv_slot_state {
+	YUV_SLOT_FREE,
+	YUV_SLOT_DECODED,
+	YUV_SLOT_CONVERTING,
+	YUV_SLOT_CONVERTED,
+};
+
+struct yuv_slot {
+	enum yuv_slot_state state;
+	uint32_t *frame;
+	unsigned char *out;
+};
+
+struct yuv_pipeline {
+	int width, height, depth, size;
+	uint32_t format;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+
+	struct yuv_slot *slots;
+	int nslots;
+	int queued;	/* frames handed to the pipeline */
+	int written;	/* frames written out */
+
+	pthread_t *threads;
+	int nthreads;
+	pthread_t writer;
+};
+
+static void *
+yuv_pipeline_convert(void *data)
+{
+	struct yuv_pipeline *pipeline = data;
+	struct yuv_slot *slot;
+	int i;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	for (;;) {
+		slot = NULL;
+		for (i = 0; i < pipeline->nslots; i++) {
+			if (pipeline->slots[i].state == YUV_SLOT_DECODED) {
+				slot = &pipeline->slots[i];
+				break;
+			}
+		}
+
+		if (!slot) {
+			if (pipeline->done)
+				break;
+			pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+			continue;
+		}
+
+		slot->state = YUV_SLOT_CONVERTING;
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		convert_yuv_frame(slot->frame, pipeline->width,
+				  pipeline->height, pipeline->format,
+				  pipeline->depth, slot->out);
+
+		pthread_mutex_lock(&pipeline->mutex);
+		slot->state = YUV_SLOT_CONVERTED;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return NULL;
+}
+
+static void *
+yuv_pipeline_write(void *data)
+{
+	struct yuv_pipeline *pipeline = data;
+	struct yuv_slot *slot;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	for (;;) {
+		slot = &pipeline->slots[pipeline->written % pipeline->nslots];
+		if (slot->state != YUV_SLOT_CONVERTED) {
+			if (pipeline->done &&
+			    pipeline->written == pipeline->queued)
+				break;
+			pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		printf("FRAME\n");
+		fwrite(slot->out, 1, pipeline->size, stdout);
+
+		pthread_mutex_lock(&pipeline->mutex);
+		slot->state = YUV_SLOT_FREE;
+		pipeline->written++;
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return NULL;
+}
+
+static void
+yuv_pipeline_destroy(struct yuv_pipeline *pipeline)
+{
+	int i;
+
+	for (i = 0; i < pipeline->nslots; i++) {
+		free(pipeline->slots[i].frame);
+		free(pipeline->slots[i].out);
+	}
+	free(pipeline->slots);
+	free(pipeline->threads);
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->mutex);
+	free(pipeline);
+}
+
+static struct yuv_pipeline *
+yuv_pipeline_create(struct wcap_decoder *decoder, int depth, int jobs)
+{
+	struct yuv_pipeline *pipeline;
+	int i;
+
+	pipeline = calloc(1, sizeof *pipeline);
+	if (pipeline == NULL)
+		return NULL;
+
+	pipeline->width = decoder->width;
+	pipeline->height = decoder->height;
+	pipeline->format = decoder->format;
+	pipeline->depth = depth;
+	pipeline->size = yuv_frame_size(decoder, depth);
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+
+	/* Enough slots to keep every thread busy while the writer and the
+	 * decoder are at work on others */
+	pipeline->nslots = jobs * 2;
+	pipeline->slots = calloc(pipeline->nslots, sizeof *pipeline->slots);
+	pipeline->threads = calloc(jobs, sizeof *pipeline->threads);
+	if (pipeline->slots == NULL || pipeline->threads == NULL)
+		goto err;
+
+	for (i = 0; i < pipeline->nslots; i++) {
+		pipeline->slots[i].frame =
+			malloc(decoder->width * decoder->height * 4);
+		pipeline->slots[i].out = malloc(pipeline->size);
+		if (!pipeline->slots[i].frame || !pipeline->slots[i].out)
+			goto err;
+	}
+
+	if (pthread_create(&pipeline->writer, NULL,
+			   yuv_pipeline_write, pipeline) != 0)
+		goto err;
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&pipeline->threads[i], NULL,
+				   yuv_pipeline_convert, pipeline) != 0)
+			break;
+		pipeline->nthreads++;
+	}
+
+	if (pipeline->nthreads == 0) {
+		fprintf(stderr, "failed to start conversion threads\n");
+		pipeline->done = 1;
+		pthread_join(pipeline->writer, NULL);
+		goto err;
+	}
+
+	return pipeline;
+
+err:
+	yuv_pipeline_destroy(pipeline);
+	return NULL;
+}
+
+/* Hand the current frame of the decoder to the pipeline, once a slot is
+ * free again. */
+static void
+yuv_pipeline_queue(struct yuv_pipeline *pipeline,
+		   struct wcap_decoder *decoder)
+{
+	struct yuv_slot *slot =
+		&pipeline->slots[pipeline->queued % pipeline->nslots];
+
+	pthread_mutex_lock(&pipeline->mutex);
+	while (slot->state != YUV_SLOT_FREE)
+		pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	memcpy(slot->frame, decoder->frame,
+	       decoder->width * decoder->height * 4);
+
+	pthread_mutex_lock(&pipeline->mutex);
+	slot->state = YUV_SLOT_DECODED;
+	pipeline->queued++;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/* Wait for all queued frames to be written out. */
+static void
+yuv_pipeline_finish(struct yuv_pipeline *pipeline)
+{
+	int i;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->done = 1;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	for (i = 0; i < pipeline->nthreads; i++)
+		pthread_join(pipeline->threads[i], NULL);
+	pthread_join(pipeline->writer, NULL);
+	yuv_pipeline_destroy(pipeline);
+}
+
 static void
 usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--start=<ms>] [--end=<ms>]\n"
+		"\t[--jobs=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--start=<ms>\t\tonly decode from this many ms into the\n"
+		"\t\t\t\trecording on\n"
+		"\t--end=<ms>\t\tonly decode up to this many ms into the\n"
+		"\t\t\t\trecording\n"
+		"\t--jobs=<n>\t\twrite pngs, or convert yuv4mpeg2 frames,\n"
+		"\t\t\t\tfrom n threads in parallel\n\n");
 
 	exit(exit_code);
 }
 
+struct decode_job {
+	const char *filename;
+	pthread_t thread;
+	uint32_t first_msecs, frame_time;
+	int first, last; /* frame numbers, inclusive */
+	int written;
+};
+
+/* Write out frames first to last as pngs, with a decoder of our own. */
+static void *
+decode_job_run(void *data)
+{
+	struct decode_job *job = data;
+	struct wcap_decoder *decoder;
+	char filename[200];
+	int i;
+
+	decoder = wcap_decoder_create(job->filename);
+	if (decoder == NULL)
+		return NULL;
+
+	for (i = job->first; i <= job->last; i++) {
+		if (!wcap_decoder_seek(decoder, job->first_msecs +
+				       i * job->frame_time))
+			break;
+
+		snprintf(filename, sizeof filename, "wcap-frame-%d.png", i);
+		write_png(decoder, filename);
+		job->written++;
+	}
+
+	wcap_decoder_destroy(decoder);
+
+	return NULL;
+}
+
+/* Split the frames between jobs, each one starting from the keyframe
+ * closest to its range. */
+static int
+decode_parallel(const char *filename, int jobs, uint32_t first_msecs,
+		uint32_t frame_time, int first, int last)
+{
+	struct decode_job *job;
+	int i, n, per_job, written = 0;
+
+	job = calloc(jobs, sizeof *job);
+	if (job == NULL)
+		return 0;
+
+	n = last - first + 1;
+	per_job = (n + jobs - 1) / jobs;
+	for (i = 0; i < jobs; i++) {
+		job[i].filename = filename;
+		job[i].first_msecs = first_msecs;
+		job[i].frame_time = frame_time;
+		job[i].first = first + i * per_job;
+		job[i].last = job[i].first + per_job - 1;
+		if (job[i].last > last)
+			job[i].last = last;
+		if (pthread_create(&job[i].thread, NULL,
+				   decode_job_run, &job[i]) != 0) {
+			fprintf(stderr, "failed to start decoding thread\n");
+			decode_job_run(&job[i]);
+			job[i].thread = 0;
+		}
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (job[i].thread)
+			pthread_join(job[i].thread, NULL);
+		written += job[i].written;
+	}
+
+	free(job);
+
+	return written;
+}
+
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
-	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	struct yuv_pipeline *pipeline = NULL;
+	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0;
+	int num = 30, denom = 1, jobs = 1, first, last;
+	int start_msecs = 0, end_msecs = -1;
 	char filename[200];
 	char *mode;
-	uint32_t msecs, frame_time;
+	uint32_t first_msecs, last_msecs, frame_time;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2-444") == 0) {
@@ -234,6 +562,12 @@ int main(int argc, char *argv[])
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
 			;
+		} else if (sscanf(argv[i], "--start=%d", &start_msecs) == 1) {
+			;
+		} else if (sscanf(argv[i], "--end=%d", &end_msecs) == 1) {
+			;
+		} else if (sscanf(argv[i], "--jobs=%d", &jobs) == 1) {
+			;
 		} else if (strcmp(argv[i], "--") == 0) {
 			break;
 		} else if (argv[i][0] == '-') {
@@ -248,10 +582,15 @@ int main(int argc, char *argv[])
 
 	if (argc != 2)
 		usage(EXIT_FAILURE);
-	if (denom == 0) {
+	if (denom == 0 || num <= 0) {
 		fprintf(stderr, "invalid rate, denom can not be 0\n");
 		exit(EXIT_FAILURE);
 	}
+	if (start_msecs < 0 || jobs < 1 ||
+	    (end_msecs >= 0 && end_msecs < start_msecs)) {
+		fprintf(stderr, "invalid range or number of jobs\n");
+		exit(EXIT_FAILURE);
+	}
 
 	decoder = wcap_decoder_create(argv[1]);
 	if (decoder == NULL) {
@@ -279,27 +618,70 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
-	i = 0;
-	has_frame = wcap_decoder_get_frame(decoder);
-	msecs = decoder->msecs;
+	if (!wcap_decoder_get_frame(decoder)) {
+		fprintf(stderr, "wcap file: size %dx%d, 0 frames\n",
+			decoder->width, decoder->height);
+		wcap_decoder_destroy(decoder);
+		return EXIT_SUCCESS;
+	}
+
+	/* Frame i is the screen as it was frame_time * i ms after the
+	 * first frame of the recording. */
+	first_msecs = decoder->msecs;
 	frame_time = 1000 * denom / num;
-	while (has_frame) {
+	if (frame_time == 0)
+		frame_time = 1;
+
+	first = start_msecs / frame_time;
+	last = end_msecs >= 0 ? (int) (end_msecs / frame_time) : -1;
+	if (!all && !yuv4mpeg2 && output_frame >= 0) {
+		first = last = output_frame;
+	}
+
+	/* Parallel decoding needs to know where the recording ends up
+	 * front, which only version 3 files say. */
+	last_msecs = decoder->last_msecs;
+	if (jobs > 1 && !yuv4mpeg2 && (all || output_frame >= 0) &&
+	    (last >= 0 || last_msecs >= first_msecs)) {
+		if (last < 0 || first_msecs + last * frame_time > last_msecs)
+			last = (last_msecs - first_msecs) / frame_time;
+
+		i = last >= first ?
+			decode_parallel(argv[1], jobs, first_msecs,
+					frame_time, first, last) : 0;
+		fprintf(stderr, "wrote %d frames\n", i);
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (yuv4mpeg2 && jobs > 1)
+		pipeline = yuv_pipeline_create(decoder, yuv4mpeg2, jobs);
+
+	for (i = first; last < 0 || i <= last; i++) {
+		if (!wcap_decoder_seek(decoder, first_msecs + i * frame_time))
+			break;
+
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
 				 "wcap-frame-%d.png", i);
 			write_png(decoder, filename);
 			fprintf(stderr, "wrote %s\n", filename);
 		}
-		if (yuv4mpeg2)
+		if (pipeline)
+			yuv_pipeline_queue(pipeline, decoder);
+		else if (yuv4mpeg2)
 			output_yuv_frame(decoder, yuv4mpeg2);
-		i++;
-		msecs += frame_time;
-		while (decoder->msecs < msecs && has_frame)
-			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
-	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
-		decoder->width, decoder->height, i);
+	if (pipeline)
+		yuv_pipeline_finish(pipeline);
+
+	if (first == 0 && last < 0)
+		fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
+			decoder->width, decoder->height, i);
+	else
+		fprintf(stderr, "decoded frames %d to %d\n", first, i - 1);
 
 	wcap_decoder_destroy(decoder);
 
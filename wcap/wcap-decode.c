@@ -38,6 +38,10 @@
 
 #include <cairo.h>
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
 #include "wcap-decode.h"
 
 static void
@@ -85,28 +89,260 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 	decoder->p = p;
 }
 
+/* Make the frames of the block at decoder->next_block available at
+ * decoder->p. Returns 0 at the end of the file or if the block cannot be
+ * decoded. */
+static int
+wcap_decoder_next_block(struct wcap_decoder *decoder)
+{
+	struct wcap_block_header_v3 header;
+	size_t header_size, padded_size;
+	char *data;
+
+	if (decoder->version >= 3)
+		header_size = sizeof header;
+	else
+		header_size = sizeof(struct wcap_block_header);
+
+	if ((char *) decoder->map_end - (char *) decoder->next_block <
+	    (ssize_t) header_size)
+		return 0;
+
+	/* Version 2 blocks are not aligned */
+	memcpy(&header, decoder->next_block, header_size);
+	data = (char *) decoder->next_block + header_size;
+
+	padded_size = header.compressed_size;
+	if (decoder->version >= 3)
+		padded_size = (padded_size + 7) & ~7;
+
+	if ((char *) decoder->map_end - data < (ssize_t) padded_size) {
+		fprintf(stderr, "truncated wcap block\n");
+		return 0;
+	}
+
+	decoder->next_block = data + padded_size;
+
+	if (header.compressed_size == header.size &&
+	    ((uintptr_t) data & 3) == 0) {
+		decoder->p = data;
+		decoder->end = data + header.size;
+		return 1;
+	}
+
+	if (decoder->block_size < header.size) {
+		free(decoder->block);
+		decoder->block = malloc(header.size);
+		if (decoder->block == NULL) {
+			decoder->block_size = 0;
+			fprintf(stderr, "out of memory\n");
+			return 0;
+		}
+		decoder->block_size = header.size;
+	}
+
+	if (header.compressed_size == header.size) {
+		memcpy(decoder->block, data, header.size);
+	} else {
+		switch (decoder->compression) {
+#ifdef HAVE_LZ4
+		case WCAP_COMPRESSION_LZ4:
+			if (LZ4_decompress_safe(data, decoder->block,
+						header.compressed_size,
+						header.size) !=
+			    (int) header.size) {
+				fprintf(stderr, "corrupt lz4 block\n");
+				return 0;
+			}
+			break;
+#endif
+		default:
+			fprintf(stderr, "unsupported wcap compression %u\n",
+				decoder->compression);
+			return 0;
+		}
+	}
+
+	decoder->p = decoder->block;
+	decoder->end = (char *) decoder->block + header.size;
+
+	return 1;
+}
+
+/* Find the header of the next frame without decoding it. */
+static struct wcap_frame_header *
+wcap_decoder_peek(struct wcap_decoder *decoder)
+{
+	while (decoder->p == decoder->end)
+		if (decoder->version < 2 ||
+		    !wcap_decoder_next_block(decoder))
+			return NULL;
+
+	return decoder->p;
+}
+
 int
 wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	uint32_t i, nrects;
 
-	if (decoder->p == decoder->end)
+	header = wcap_decoder_peek(decoder);
+	if (header == NULL)
 		return 0;
 
-	header = decoder->p;
 	decoder->msecs = header->msecs;
 	decoder->count++;
 
+	nrects = header->nrects;
+	if (decoder->version >= 3 && (nrects & WCAP_FRAME_KEYFRAME)) {
+		nrects &= ~WCAP_FRAME_KEYFRAME;
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+	}
+
 	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
+	decoder->p = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++)
 		wcap_decoder_decode_rectangle(decoder, &rects[i]);
 
 	return 1;
 }
 
+/* Go back to before the first frame. */
+static void
+wcap_decoder_rewind(struct wcap_decoder *decoder)
+{
+	decoder->count = 0;
+	decoder->msecs = 0;
+	memset(decoder->frame, 0, decoder->width * decoder->height * 4);
+
+	if (decoder->version >= 2) {
+		decoder->next_block = decoder->start;
+		decoder->p = decoder->end = decoder->start;
+	} else {
+		decoder->p = decoder->start;
+	}
+}
+
+/* The last keyframe at or before msecs, or NULL. */
+static struct wcap_index_entry *
+wcap_decoder_find_keyframe(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	uint32_t lo = 0, hi = decoder->index_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (decoder->index[mid].msecs <= msecs)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > 0 ? &decoder->index[lo - 1] : NULL;
+}
+
+/** Decode up to the last frame at or before msecs
+ *
+ * Jumps to the closest keyframe when going backwards or when that saves
+ * decoding frames, so the cost does not depend on where in the recording
+ * msecs is. Returns 1 with that frame in decoder->frame, or 0 if msecs
+ * is before the first or after the last frame.
+ */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t msecs)
+{
+	struct wcap_index_entry *key;
+	struct wcap_frame_header *next;
+
+	key = wcap_decoder_find_keyframe(decoder, msecs);
+
+	if (key && (key->frame >= decoder->count ||
+		    (decoder->count > 0 && decoder->msecs > msecs))) {
+		decoder->next_block = (char *) decoder->map + key->offset;
+		decoder->p = decoder->end = decoder->next_block;
+		decoder->count = key->frame;
+	} else if (decoder->count > 0 && decoder->msecs > msecs) {
+		wcap_decoder_rewind(decoder);
+	}
+
+	while ((next = wcap_decoder_peek(decoder)) && next->msecs <= msecs)
+		wcap_decoder_get_frame(decoder);
+
+	if (decoder->count == 0)
+		return 0;
+
+	return next != NULL || decoder->msecs == msecs;
+}
+
+/* Use the index at the end of the file, or when the recording was cut
+ * short, rebuild it from the block headers. */
+static int
+wcap_decoder_load_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer trailer;
+	struct wcap_block_header_v3 header;
+	struct wcap_index_entry *entry;
+	size_t size, count = 0, alloc = 0;
+	char *p, *end;
+
+	size = (char *) decoder->map_end - (char *) decoder->start;
+	if (size >= sizeof trailer) {
+		memcpy(&trailer, (char *) decoder->map_end - sizeof trailer,
+		       sizeof trailer);
+		if (trailer.magic == WCAP_INDEX_MAGIC &&
+		    trailer.count <= (size - sizeof trailer) / sizeof *entry &&
+		    trailer.offset == decoder->size - sizeof trailer -
+				      trailer.count * sizeof *entry) {
+			decoder->index = malloc(trailer.count * sizeof *entry);
+			if (decoder->index == NULL && trailer.count > 0)
+				return -1;
+			memcpy(decoder->index,
+			       (char *) decoder->map + trailer.offset,
+			       trailer.count * sizeof *entry);
+			decoder->index_count = trailer.count;
+			decoder->nframes = trailer.nframes;
+			decoder->last_msecs = trailer.last_msecs;
+			decoder->map_end = (char *) decoder->map +
+				trailer.offset;
+			return 0;
+		}
+	}
+
+	p = decoder->start;
+	end = decoder->map_end;
+	while (end - p >= (ssize_t) sizeof header) {
+		memcpy(&header, p, sizeof header);
+		size = (header.compressed_size + 7) & ~7;
+		if ((size_t) (end - p) - sizeof header < size)
+			break;
+
+		if (header.flags & WCAP_BLOCK_KEYFRAME) {
+			if (count == alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				entry = realloc(decoder->index,
+						alloc * sizeof *entry);
+				if (entry == NULL)
+					return -1;
+				decoder->index = entry;
+			}
+			entry = &decoder->index[count++];
+			entry->offset = p - (char *) decoder->map;
+			entry->frame = header.frame;
+			entry->msecs = header.first_msecs;
+		}
+
+		decoder->nframes = header.frame + header.nframes;
+		decoder->last_msecs = header.last_msecs;
+		p += sizeof header + size;
+	}
+
+	decoder->index_count = count;
+
+	return 0;
+}
+
 struct wcap_decoder *
 wcap_decoder_create(const char *filename)
 {
@@ -115,7 +351,7 @@ wcap_decoder_create(const char *filename)
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = calloc(1, sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -131,6 +367,7 @@ wcap_decoder_create(const char *filename)
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
 	if (decoder->map == MAP_FAILED) {
 		fprintf(stderr, "mmap failed\n");
+		close(decoder->fd);
 		free(decoder);
 		return NULL;
 	}
@@ -142,16 +379,41 @@ wcap_decoder_create(const char *filename)
 	decoder->height = header->height;
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
+	decoder->map_end = decoder->end;
+	decoder->version = 1;
+
+	if (header->magic == WCAP_HEADER_MAGIC_V2) {
+		struct wcap_header_v2 *v2 = decoder->p;
+
+		decoder->version = v2->version;
+		decoder->compression = v2->compression;
+		decoder->next_block = v2 + 1;
+		decoder->p = decoder->end = decoder->next_block;
+	} else if (header->magic != WCAP_HEADER_MAGIC) {
+		fprintf(stderr, "not a wcap file\n");
+		goto err_map;
+	}
+	decoder->start = decoder->p;
+
+	if (decoder->version >= 3 && wcap_decoder_load_index(decoder) < 0) {
+		fprintf(stderr, "out of memory\n");
+		goto err_map;
+	}
 
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
-	if (decoder->frame == NULL) {
-		free(decoder);
-		return NULL;
-	}
+	if (decoder->frame == NULL)
+		goto err_map;
 	memset(decoder->frame, 0, frame_size);
 
 	return decoder;
+
+err_map:
+	free(decoder->index);
+	munmap(decoder->map, decoder->size);
+	close(decoder->fd);
+	free(decoder);
+	return NULL;
 }
 
 void
@@ -159,6 +421,8 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->index);
+	free(decoder->block);
 	free(decoder->frame);
 	free(decoder);
 }
@@ -29,6 +29,16 @@
 #include <stdint.h>
 
 #define WCAP_HEADER_MAGIC	0x57434150
+#define WCAP_HEADER_MAGIC_V2	0x57434132
+
+/* Current version written after a WCAP_HEADER_MAGIC_V2 header. */
+#define WCAP_VERSION		3
+
+/* Last word of a version 3 file that was closed properly */
+#define WCAP_INDEX_MAGIC	0x57434958
+
+#define WCAP_COMPRESSION_NONE	0
+#define WCAP_COMPRESSION_LZ4	1
 
 #define WCAP_FORMAT_XRGB8888	0x34325258
 #define WCAP_FORMAT_XBGR8888	0x34324258
@@ -41,11 +51,57 @@ struct wcap_header {
 	uint32_t width, height;
 };
 
+/* Follows struct wcap_header when the magic is WCAP_HEADER_MAGIC_V2. */
+struct wcap_header_v2 {
+	uint32_t version;
+	uint32_t compression;
+};
+
+/* Since version 2, frames are grouped in blocks, each starting with this
+ * header. A block with compressed_size equal to size is stored as is. */
+struct wcap_block_header {
+	uint32_t size;
+	uint32_t compressed_size;
+};
+
+/* Version 3 block header. The data is padded to a multiple of 8 bytes,
+ * and a block with WCAP_BLOCK_KEYFRAME starts with a keyframe. */
+struct wcap_block_header_v3 {
+	uint32_t size;
+	uint32_t compressed_size;
+	uint32_t frame;		/* number of the first frame */
+	uint32_t nframes;
+	uint32_t first_msecs, last_msecs;
+	uint32_t flags;
+	uint32_t padding;
+};
+
+#define WCAP_BLOCK_KEYFRAME	(1 << 0)
+
+/* Version 3 files end with an entry per keyframe block and a trailer. */
+struct wcap_index_entry {
+	uint64_t offset;	/* of the block header in the file */
+	uint32_t frame;
+	uint32_t msecs;
+};
+
+struct wcap_index_trailer {
+	uint64_t offset;	/* of the first index entry */
+	uint32_t count;
+	uint32_t nframes;
+	uint32_t last_msecs;
+	uint32_t magic;
+};
+
 struct wcap_frame_header {
 	uint32_t msecs;
 	uint32_t nrects;
 };
 
+/* Set in nrects of a version 3 keyframe, which is decoded against a
+ * frame of all 0x00000000 pixels rather than the previous one. */
+#define WCAP_FRAME_KEYFRAME	(1u << 31)
+
 struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
@@ -54,6 +110,13 @@ struct wcap_decoder {
 	int fd;
 	size_t size;
 	void *map, *p, *end;
+	void *start, *next_block, *map_end;
+	void *block;
+	size_t block_size;
+	uint32_t version, compression;
+	struct wcap_index_entry *index;
+	uint32_t index_count;
+	uint32_t nframes, last_msecs; /* 0 if unknown */
 	uint32_t *frame;
 	uint32_t format;
 	uint32_t msecs;
@@ -62,6 +125,7 @@ struct wcap_decoder {
 };
 
 int wcap_decoder_get_frame(struct wcap_decoder *decoder);
+int wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t msecs);
 struct wcap_decoder *wcap_decoder_create(const char *filename);
 void wcap_decoder_destroy(struct wcap_decoder *decoder);
 
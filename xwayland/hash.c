@@ -1,5 +1,6 @@
 /*
  * Copyright © 2009 Intel Corporation
+ * Copyright © 2017 Weston contributors
  * Copyright © 1988-2004 Keith Packard and Bart Massey.
  *
  * Permission is hereby granted, free of charge, to any person obtaining a
@@ -32,6 +33,14 @@
  *    Keith Packard <keithp@keithp.com>
  */
 
+/*
+ * Open addressing with Robin Hood linear probing: an entry displaces any
+ * it passes that is closer to its home slot, which keeps probe sequences
+ * short and lets lookups stop early. Removal shifts the following entries
+ * back instead of leaving tombstones, so churn never degrades the table
+ * or forces a rehash.
+ */
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -41,81 +50,50 @@
 
 struct hash_entry {
 	uint32_t hash;
-	void *data;
+	void *data;	/* NULL for free slots */
 };
 
 struct hash_table {
 	struct hash_entry *table;
-	uint32_t size;
-	uint32_t rehash;
-	uint32_t max_entries;
-	uint32_t size_index;
+	uint32_t size;	/* power of two */
+	uint32_t shift;	/* 32 - log2(size) */
 	uint32_t entries;
-	uint32_t deleted_entries;
 };
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+#define HASH_TABLE_MIN_SIZE 8
 
-/*
- * From Knuth -- a good choice for hash/rehash values is p, p-2 where
- * p and p-2 are both prime.  These tables are sized to have an extra 10%
- * free to avoid exponential performance degradation as the hash table fills
- */
-
-static const uint32_t deleted_data;
-
-static const struct {
-   uint32_t max_entries, size, rehash;
-} hash_sizes[] = {
-    { 2,		5,		3	  },
-    { 4,		7,		5	  },
-    { 8,		13,		11	  },
-    { 16,		19,		17	  },
-    { 32,		43,		41        },
-    { 64,		73,		71        },
-    { 128,		151,		149       },
-    { 256,		283,		281       },
-    { 512,		571,		569       },
-    { 1024,		1153,		1151      },
-    { 2048,		2269,		2267      },
-    { 4096,		4519,		4517      },
-    { 8192,		9013,		9011      },
-    { 16384,		18043,		18041     },
-    { 32768,		36109,		36107     },
-    { 65536,		72091,		72089     },
-    { 131072,		144409,		144407    },
-    { 262144,		288361,		288359    },
-    { 524288,		576883,		576881    },
-    { 1048576,		1153459,	1153457   },
-    { 2097152,		2307163,	2307161   },
-    { 4194304,		4613893,	4613891   },
-    { 8388608,		9227641,	9227639   },
-    { 16777216,		18455029,	18455027  },
-    { 33554432,		36911011,	36911009  },
-    { 67108864,		73819861,	73819859  },
-    { 134217728,	147639589,	147639587 },
-    { 268435456,	295279081,	295279079 },
-    { 536870912,	590559793,	590559791 },
-    { 1073741824,	1181116273,	1181116271},
-    { 2147483648ul,	2362232233ul,	2362232231ul}
-};
-
-static int
-entry_is_free(struct hash_entry *entry)
+/* X resource ids of a client share their high bits and are allocated
+ * sequentially, so spread them with a Fibonacci hash. */
+static inline uint32_t
+hash_table_home(const struct hash_table *ht, uint32_t hash)
 {
-	return entry->data == NULL;
+	return (hash * 2654435769u) >> ht->shift;
 }
 
-static int
-entry_is_deleted(struct hash_entry *entry)
+static inline uint32_t
+hash_table_distance(const struct hash_table *ht, uint32_t hash, uint32_t i)
 {
-	return entry->data == &deleted_data;
+	return (i - hash_table_home(ht, hash)) & (ht->size - 1);
 }
 
 static int
-entry_is_present(struct hash_entry *entry)
+hash_table_alloc(struct hash_table *ht, uint32_t size)
 {
-	return entry->data != NULL && entry->data != &deleted_data;
+	uint32_t shift = 32;
+	uint32_t n;
+
+	for (n = size; n > 1; n >>= 1)
+		shift--;
+
+	ht->table = calloc(size, sizeof(*ht->table));
+	if (ht->table == NULL)
+		return -1;
+
+	ht->size = size;
+	ht->shift = shift;
+	ht->entries = 0;
+
+	return 0;
 }
 
 struct hash_table *
@@ -127,15 +105,7 @@ hash_table_create(void)
 	if (ht == NULL)
 		return NULL;
 
-	ht->size_index = 0;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
-	ht->table = calloc(ht->size, sizeof(*ht->table));
-	ht->entries = 0;
-	ht->deleted_entries = 0;
-
-	if (ht->table == NULL) {
+	if (hash_table_alloc(ht, HASH_TABLE_MIN_SIZE) < 0) {
 		free(ht);
 		return NULL;
 	}
@@ -157,36 +127,35 @@ hash_table_destroy(struct hash_table *ht)
 }
 
 /**
- * Finds a hash table entry with the given key and hash of that key.
+ * Finds the slot holding the given hash.
  *
- * Returns NULL if no entry is found.  Note that the data pointer may be
- * modified by the user.
+ * Returns -1 if there is none.
  */
-static void *
+static int64_t
 hash_table_search(struct hash_table *ht, uint32_t hash)
 {
-	uint32_t hash_address;
+	uint32_t mask = ht->size - 1;
+	uint32_t i = hash_table_home(ht, hash);
+	uint32_t dist;
 
-	hash_address = hash % ht->size;
-	do {
-		uint32_t double_hash;
-
-		struct hash_entry *entry = ht->table + hash_address;
-
-		if (entry_is_free(entry)) {
-			return NULL;
-		} else if (entry_is_present(entry) && entry->hash == hash) {
-			return entry;
-		}
+	for (dist = 0; ; dist++, i = (i + 1) & mask) {
+		struct hash_entry *entry = ht->table + i;
 
-		double_hash = 1 + hash % ht->rehash;
+		/* Had it been there, it would have displaced this one */
+		if (entry->data == NULL ||
+		    hash_table_distance(ht, entry->hash, i) < dist)
+			return -1;
 
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
-
-	return NULL;
+		if (entry->hash == hash)
+			return i;
+	}
 }
 
+/**
+ * Calls func on every element, in no particular order.
+ *
+ * func must not insert or remove entries.
+ */
 void
 hash_table_for_each(struct hash_table *ht,
 		    hash_table_iterator_func_t func, void *data)
@@ -196,7 +165,7 @@ hash_table_for_each(struct hash_table *ht,
 
 	for (i = 0; i < ht->size; i++) {
 		entry = ht->table + i;
-		if (entry_is_present(entry))
+		if (entry->data != NULL)
 			func(entry->data, data);
 	}
 }
@@ -204,106 +173,118 @@ hash_table_for_each(struct hash_table *ht,
 void *
 hash_table_lookup(struct hash_table *ht, uint32_t hash)
 {
-	struct hash_entry *entry;
+	int64_t i;
 
-	entry = hash_table_search(ht, hash);
-	if (entry != NULL)
-		return entry->data;
+	i = hash_table_search(ht, hash);
+	if (i < 0)
+		return NULL;
 
-	return NULL;
+	return ht->table[i].data;
 }
 
+/* The caller makes sure hash is not in the table yet, and that there is
+ * a free slot. */
 static void
-hash_table_rehash(struct hash_table *ht, unsigned int new_size_index)
+hash_table_place(struct hash_table *ht, uint32_t hash, void *data)
 {
-	struct hash_table old_ht;
-	struct hash_entry *table, *entry;
-
-	if (new_size_index >= ARRAY_SIZE(hash_sizes))
-		return;
+	struct hash_entry entry = { hash, data }, tmp;
+	uint32_t mask = ht->size - 1;
+	uint32_t i = hash_table_home(ht, hash);
+	uint32_t dist, d;
+
+	for (dist = 0; ; dist++, i = (i + 1) & mask) {
+		if (ht->table[i].data == NULL) {
+			ht->table[i] = entry;
+			ht->entries++;
+			return;
+		}
 
-	table = calloc(hash_sizes[new_size_index].size, sizeof(*ht->table));
-	if (table == NULL)
-		return;
+		d = hash_table_distance(ht, ht->table[i].hash, i);
+		if (d < dist) {
+			tmp = ht->table[i];
+			ht->table[i] = entry;
+			entry = tmp;
+			dist = d;
+		}
+	}
+}
 
-	old_ht = *ht;
+static int
+hash_table_resize(struct hash_table *ht, uint32_t size)
+{
+	struct hash_table old_ht = *ht;
+	struct hash_entry *entry;
 
-	ht->table = table;
-	ht->size_index = new_size_index;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
-	ht->entries = 0;
-	ht->deleted_entries = 0;
+	if (hash_table_alloc(ht, size) < 0) {
+		*ht = old_ht;
+		return -1;
+	}
 
 	for (entry = old_ht.table;
 	     entry != old_ht.table + old_ht.size;
 	     entry++) {
-		if (entry_is_present(entry)) {
-			hash_table_insert(ht, entry->hash, entry->data);
-		}
+		if (entry->data != NULL)
+			hash_table_place(ht, entry->hash, entry->data);
 	}
 
 	free(old_ht.table);
+
+	return 0;
 }
 
 /**
- * Inserts the data with the given hash into the table.
+ * Inserts the data with the given hash into the table, replacing any
+ * data already there for that hash.
  *
- * Note that insertion may rearrange the table on a resize or rehash,
- * so previously found hash_entries are no longer valid after this function.
+ * Returns -1 if the table needed to grow and that failed.
  */
 int
 hash_table_insert(struct hash_table *ht, uint32_t hash, void *data)
 {
-	uint32_t hash_address;
+	int64_t i;
 
-	if (ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index + 1);
-	} else if (ht->deleted_entries + ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index);
+	i = hash_table_search(ht, hash);
+	if (i >= 0) {
+		ht->table[i].data = data;
+		return 0;
 	}
 
-	hash_address = hash % ht->size;
-	do {
-		struct hash_entry *entry = ht->table + hash_address;
-		uint32_t double_hash;
-
-		if (!entry_is_present(entry)) {
-			if (entry_is_deleted(entry))
-				ht->deleted_entries--;
-			entry->hash = hash;
-			entry->data = data;
-			ht->entries++;
-			return 0;
-		}
-
-		double_hash = 1 + hash % ht->rehash;
+	/* Probe sequences stay short up to 7/8 full */
+	if ((uint64_t) (ht->entries + 1) * 8 > (uint64_t) ht->size * 7 &&
+	    (ht->size > UINT32_MAX / 2 ||
+	     hash_table_resize(ht, ht->size * 2) < 0) &&
+	    ht->entries + 1 >= ht->size)
+		return -1;
 
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
+	hash_table_place(ht, hash, data);
 
-	/* We could hit here if a required resize failed. An unchecked-malloc
-	 * application could ignore this result.
-	 */
-	return -1;
+	return 0;
 }
 
 /**
- * This function deletes the given hash table entry.
- *
- * Note that deletion doesn't otherwise modify the table, so an iteration over
- * the table deleting entries is safe.
+ * Removes the data with the given hash from the table, if any.
  */
 void
 hash_table_remove(struct hash_table *ht, uint32_t hash)
 {
-	struct hash_entry *entry;
+	uint32_t mask = ht->size - 1;
+	uint32_t i, next;
+	int64_t found;
 
-	entry = hash_table_search(ht, hash);
-	if (entry != NULL) {
-		entry->data = (void *) &deleted_data;
-		ht->entries--;
-		ht->deleted_entries++;
+	found = hash_table_search(ht, hash);
+	if (found < 0)
+		return;
+
+	/* Shift back the entries that were displaced past this slot, until
+	 * one that is already home or a free slot. */
+	for (i = found; ; i = next) {
+		next = (i + 1) & mask;
+		if (ht->table[next].data == NULL ||
+		    hash_table_distance(ht, ht->table[next].hash, next) == 0)
+			break;
+		ht->table[i] = ht->table[next];
 	}
+
+	ht->table[i].data = NULL;
+	ht->entries--;
 }
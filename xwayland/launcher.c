@@ -342,11 +342,33 @@ weston_xwayland_xserver_exited(struct weston_xwayland *xwayland,
 	}
 }
 
+static void
+weston_xwayland_spawn(struct weston_xwayland *xwayland)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+
+	if (!wxs->loop || wxs->pid != 0)
+		return;
+
+	weston_xserver_handle_event(-1, 0, wxs);
+}
+
+static void
+weston_xwayland_set_subsurface_decorations(struct weston_xwayland *xwayland,
+					   bool enabled)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+
+	wxs->subsurface_decorations = enabled;
+}
+
 const struct weston_xwayland_api api = {
 	weston_xwayland_get,
 	weston_xwayland_listen,
 	weston_xwayland_xserver_loaded,
 	weston_xwayland_xserver_exited,
+	weston_xwayland_spawn,
+	weston_xwayland_set_subsurface_decorations,
 };
 extern const struct weston_xwayland_surface_api surface_api;
 
@@ -98,20 +98,11 @@ weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 }
 
 static void
-weston_wm_get_incr_chunk(struct weston_wm *wm)
+weston_wm_incr_chunk_reply(struct weston_wm *wm, void *data,
+			   xcb_window_t window, uint32_t arg)
 {
-	xcb_get_property_cookie_t cookie;
-	xcb_get_property_reply_t *reply;
-
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
+	xcb_get_property_reply_t *reply = data;
 
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
 	if (reply == NULL)
 		return;
 
@@ -128,6 +119,25 @@ weston_wm_get_incr_chunk(struct weston_wm *wm)
 	}
 }
 
+static void
+weston_wm_get_incr_chunk(struct weston_wm *wm)
+{
+	xcb_get_property_cookie_t cookie;
+
+	/* The next chunk is only set once this one is deleted, after it
+	 * has been written out, so there is at most one in flight. */
+	cookie = xcb_get_property(wm->conn,
+				  0, /* delete */
+				  wm->selection_window,
+				  wm->atom.wl_selection,
+				  XCB_GET_PROPERTY_TYPE_ANY,
+				  0, /* offset */
+				  0x1fffffff /* length */);
+	weston_wm_expect_reply(wm, cookie.sequence,
+			       weston_wm_incr_chunk_reply,
+			       wm->selection_window, 0);
+}
+
 struct x11_data_source {
 	struct weston_data_source base;
 	struct weston_wm *wm;
@@ -168,26 +178,17 @@ data_source_cancel(struct weston_data_source *source)
 }
 
 static void
-weston_wm_get_selection_targets(struct weston_wm *wm)
+weston_wm_selection_targets_reply(struct weston_wm *wm, void *data,
+				  xcb_window_t window, uint32_t arg)
 {
+	xcb_get_property_reply_t *reply = data;
 	struct x11_data_source *source;
 	struct weston_compositor *compositor;
 	struct weston_seat *seat = weston_wm_pick_seat(wm);
-	xcb_get_property_cookie_t cookie;
-	xcb_get_property_reply_t *reply;
 	xcb_atom_t *value;
 	char **p;
 	uint32_t i;
 
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  4096 /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
 	if (reply == NULL)
 		return;
 
@@ -228,10 +229,9 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 }
 
 static void
-weston_wm_get_selection_data(struct weston_wm *wm)
+weston_wm_get_selection_targets(struct weston_wm *wm)
 {
 	xcb_get_property_cookie_t cookie;
-	xcb_get_property_reply_t *reply;
 
 	cookie = xcb_get_property(wm->conn,
 				  1, /* delete */
@@ -239,9 +239,17 @@ weston_wm_get_selection_data(struct weston_wm *wm)
 				  wm->atom.wl_selection,
 				  XCB_GET_PROPERTY_TYPE_ANY,
 				  0, /* offset */
-				  0x1fffffff /* length */);
+				  4096 /* length */);
+	weston_wm_expect_reply(wm, cookie.sequence,
+			       weston_wm_selection_targets_reply,
+			       wm->selection_window, 0);
+}
 
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+static void
+weston_wm_selection_data_reply(struct weston_wm *wm, void *data,
+			       xcb_window_t window, uint32_t arg)
+{
+	xcb_get_property_reply_t *reply = data;
 
 	dump_property(wm, wm->atom.wl_selection, reply);
 
@@ -258,6 +266,23 @@ weston_wm_get_selection_data(struct weston_wm *wm)
 	}
 }
 
+static void
+weston_wm_get_selection_data(struct weston_wm *wm)
+{
+	xcb_get_property_cookie_t cookie;
+
+	cookie = xcb_get_property(wm->conn,
+				  1, /* delete */
+				  wm->selection_window,
+				  wm->atom.wl_selection,
+				  XCB_GET_PROPERTY_TYPE_ANY,
+				  0, /* offset */
+				  0x1fffffff /* length */);
+	weston_wm_expect_reply(wm, cookie.sequence,
+			       weston_wm_selection_data_reply,
+			       wm->selection_window, 0);
+}
+
 static void
 weston_wm_handle_selection_notify(struct weston_wm *wm,
 				xcb_generic_event_t *event)
@@ -376,8 +401,8 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 		wl_array_release(&wm->source_data);
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
+	weston_log("read %d (available %d, mask 0x%x) bytes\n",
+		len, available, mask);
 
 	wm->source_data.size = current + len;
 	if (wm->source_data.size >= incr_chunk_size) {
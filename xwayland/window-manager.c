@@ -38,6 +38,7 @@
 #include <limits.h>
 #include <assert.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <xcb/xcbext.h>
 #include <linux/input.h>
 
 #include "compositor.h"
@@ -48,6 +49,10 @@
 #include "hash.h"
 #include "shared/helpers.h"
 
+#ifndef static_assert
+#define static_assert(cond, msg)
+#endif
+
 struct wm_size_hints {
 	uint32_t flags;
 	int32_t x, y;
@@ -132,19 +137,86 @@ struct weston_output_weak_ref {
 	struct wl_listener destroy_listener;
 };
 
+/* Properties cached on weston_wm_window, in the order they are read */
+enum wm_window_property {
+	WM_PROPERTY_CLASS,
+	WM_PROPERTY_NAME,
+	WM_PROPERTY_TRANSIENT_FOR,
+	WM_PROPERTY_PROTOCOLS,
+	WM_PROPERTY_NORMAL_HINTS,
+	WM_PROPERTY_NET_WM_STATE,
+	WM_PROPERTY_WINDOW_TYPE,
+	WM_PROPERTY_NET_WM_NAME,
+	WM_PROPERTY_PID,
+	WM_PROPERTY_MOTIF_HINTS,
+	WM_PROPERTY_CLIENT_MACHINE,
+	WM_PROPERTY_COUNT
+};
+
+#define WM_PROPERTIES_ALL ((1u << WM_PROPERTY_COUNT) - 1)
+
+/* What the frame window currently shows */
+enum wm_decoration {
+	WM_DECORATION_INVALID,
+	WM_DECORATION_NONE,
+	WM_DECORATION_FRAME,
+	WM_DECORATION_SHADOW,
+};
+
+/* With subsurface_decorations, the decoration is drawn in these parts of
+ * the frame window around the X window, each a sub-surface */
+enum wm_decoration_piece {
+	WM_DECORATION_PIECE_TOP,
+	WM_DECORATION_PIECE_BOTTOM,
+	WM_DECORATION_PIECE_LEFT,
+	WM_DECORATION_PIECE_RIGHT,
+	WM_DECORATION_PIECE_COUNT
+};
+
+/* Bytes of decoration images kept around while no window shows them */
+#define WM_DECORATION_IMAGES_UNUSED_MAX (4 * 1024 * 1024)
+
+/* A piece of decoration for a frame of some size and appearance. The
+ * image does not change once drawn, so any number of windows show it. */
+struct wm_decoration_image {
+	struct wl_list link; /* weston_wm::decoration_images */
+	int ref_count;
+	enum wm_decoration decoration;
+	int frame_width, frame_height;
+	struct weston_geometry rect; /* within the frame window */
+	uint32_t appearance;
+	char *title; /* for the top piece of a frame */
+	pixman_image_t *image;
+};
+
+struct wm_decoration_piece_surface {
+	struct weston_surface *surface;
+	struct weston_subsurface *sub;
+	struct wm_decoration_image *image;
+};
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
 	xcb_window_t frame_id;
 	struct frame *frame;
 	cairo_surface_t *cairo_surface;
+	enum wm_decoration drawn_decoration;
+	int drawn_width, drawn_height;
+	/* The surface the pieces are sub-surfaces of, with
+	 * subsurface_decorations */
+	struct weston_surface *decoration_parent;
+	struct wm_decoration_piece_surface pieces[WM_DECORATION_PIECE_COUNT];
 	uint32_t surface_id;
 	struct weston_surface *surface;
 	struct weston_desktop_xwayland_surface *shsurf;
 	struct wl_listener surface_destroy_listener;
-	struct wl_event_source *repaint_source;
+	struct weston_deferred_work repaint_work;
 	struct wl_event_source *configure_source;
-	int properties_dirty;
+	/* Bitmask of enum wm_window_property to read again */
+	uint32_t properties_dirty;
+	/* Property requests whose replies are still to come */
+	int properties_pending;
 	int pid;
 	char *machine;
 	char *class;
@@ -156,6 +228,11 @@ struct weston_wm_window {
 	int x;
 	int y;
 	bool pos_dirty;
+	/* What the window manager last configured, for dropping the
+	 * configures that would not change anything */
+	int configured_x, configured_y;
+	int configured_width, configured_height;
+	int configured_frame_width, configured_frame_height;
 	int map_request_x;
 	int map_request_y;
 	struct weston_output_weak_ref legacy_fullscreen_output;
@@ -178,9 +255,36 @@ get_wm_window(struct weston_surface *surface);
 static void
 weston_wm_set_net_active_window(struct weston_wm *wm, xcb_window_t window);
 
+static void
+weston_wm_flush(void *data)
+{
+	struct weston_wm *wm = data;
+
+	wm->flush_source = NULL;
+	xcb_flush(wm->conn);
+}
+
+/* Requests wait in the xcb buffer until the event loop goes idle, so
+ * that activating, restacking or configuring many windows in a row
+ * reaches the X server in one write rather than one per window */
+static void
+weston_wm_schedule_flush(struct weston_wm *wm)
+{
+	if (wm->flush_source)
+		return;
+
+	wm->flush_source = wl_event_loop_add_idle(wm->server->loop,
+						  weston_wm_flush, wm);
+	if (!wm->flush_source)
+		xcb_flush(wm->conn);
+}
+
 static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window);
 
+static void
+weston_wm_window_destroy_decoration_pieces(struct weston_wm_window *window);
+
 static int
 legacy_fullscreen(struct weston_wm *wm,
 		  struct weston_wm_window *window,
@@ -190,38 +294,38 @@ static void
 xserver_map_shell_surface(struct weston_wm_window *window,
 			  struct weston_surface *surface);
 
+/* Enabled at runtime with log-scopes=xwm:debug, or by subscribing to
+ * the xwm scope with weston-debug. WM_DEBUG also enables the property
+ * dumps, which wait for the X server. */
+static struct weston_log_scope *wm_log_scope;
+
 static int __attribute__ ((format (printf, 1, 2)))
 wm_log(const char *fmt, ...)
 {
-#ifdef WM_DEBUG
 	int l;
 	va_list argp;
 
 	va_start(argp, fmt);
-	l = weston_vlog(fmt, argp);
+	l = weston_log_scope_vprintf(wm_log_scope, WESTON_LOG_LEVEL_DEBUG,
+				     fmt, argp);
 	va_end(argp);
 
 	return l;
-#else
-	return 0;
-#endif
 }
 
 static int __attribute__ ((format (printf, 1, 2)))
 wm_log_continue(const char *fmt, ...)
 {
-#ifdef WM_DEBUG
 	int l;
 	va_list argp;
 
 	va_start(argp, fmt);
-	l = weston_vlog_continue(fmt, argp);
+	l = weston_log_scope_vprintf_continue(wm_log_scope,
+					      WESTON_LOG_LEVEL_DEBUG,
+					      fmt, argp);
 	va_end(argp);
 
 	return l;
-#else
-	return 0;
-#endif
 }
 
 static void
@@ -385,6 +489,12 @@ dump_property(struct weston_wm *wm,
 	int width, len;
 	uint32_t i;
 
+#ifndef WM_DEBUG
+	/* Nothing is logged, but get_atom_name() would still wait for the
+	 * X server, on every selection transfer chunk. */
+	return;
+#endif
+
 	width = wm_log_continue("%s: ", get_atom_name(wm->conn, property));
 	if (reply == NULL) {
 		wm_log_continue("(no reply)\n");
@@ -427,6 +537,7 @@ dump_property(struct weston_wm *wm,
 	}
 }
 
+#ifdef WM_DEBUG
 static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
@@ -442,6 +553,102 @@ read_and_dump_property(struct weston_wm *wm,
 
 	free(reply);
 }
+#endif
+
+struct weston_wm_reply {
+	unsigned int sequence;
+	weston_wm_reply_func_t func;
+	xcb_window_t window;
+	uint32_t arg;
+	struct wl_list link;
+};
+
+/* Handle the reply to request sequence once it arrives, in request order,
+ * instead of waiting for the X server. A sequence of 0 runs func with a
+ * NULL reply once all the replies queued before are handled. */
+void
+weston_wm_expect_reply(struct weston_wm *wm, unsigned int sequence,
+		       weston_wm_reply_func_t func,
+		       xcb_window_t window, uint32_t arg)
+{
+	struct weston_wm_reply *r;
+
+	r = zalloc(sizeof *r);
+	if (r == NULL) {
+		weston_log("failed to allocate XWM reply\n");
+		if (sequence)
+			xcb_discard_reply(wm->conn, sequence);
+		return;
+	}
+
+	r->sequence = sequence;
+	r->func = func;
+	r->window = window;
+	r->arg = arg;
+	wl_list_insert(wm->pending_replies.prev, &r->link);
+}
+
+static bool
+weston_wm_dispatch_reply(struct weston_wm *wm, bool block)
+{
+	struct weston_wm_reply *r;
+	xcb_generic_error_t *error = NULL;
+	void *reply = NULL;
+
+	if (wl_list_empty(&wm->pending_replies))
+		return false;
+
+	r = container_of(wm->pending_replies.next,
+			 struct weston_wm_reply, link);
+	if (r->sequence == 0)
+		; /* nothing to wait for */
+	else if (block)
+		reply = xcb_wait_for_reply(wm->conn, r->sequence, &error);
+	else if (!xcb_poll_for_reply(wm->conn, r->sequence, &reply, &error))
+		return false;
+
+	/* func may queue more */
+	wl_list_remove(&r->link);
+	r->func(wm, reply, r->window, r->arg);
+
+	free(error);
+	free(r);
+
+	return true;
+}
+
+/* Handles the replies to requests the X server processed no later than
+ * sequence, which it sent before the event with that sequence number. */
+static int
+weston_wm_dispatch_replies_before(struct weston_wm *wm, uint32_t sequence)
+{
+	struct weston_wm_reply *r;
+	int count = 0;
+
+	while (!wl_list_empty(&wm->pending_replies)) {
+		r = container_of(wm->pending_replies.next,
+				 struct weston_wm_reply, link);
+		if (r->sequence != 0 && (int32_t) (r->sequence - sequence) > 0)
+			break;
+		if (!weston_wm_dispatch_reply(wm, false))
+			break;
+		count++;
+	}
+
+	return count;
+}
+
+/* Returns the number of replies handled */
+static int
+weston_wm_dispatch_replies(struct weston_wm *wm)
+{
+	int count = 0;
+
+	while (weston_wm_dispatch_reply(wm, false))
+		count++;
+
+	return count;
+}
 
 /* We reuse some predefined, but otherwise useles atoms
  * as local type placeholders that never touch the X11 server,
@@ -452,17 +659,20 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
-static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+struct wm_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	void *ptr;
+};
+
+static struct wm_property
+weston_wm_window_property(struct weston_wm_window *window,
+			  enum wm_window_property property)
 {
 	struct weston_wm *wm = window->wm;
 
 #define F(field) (&window->field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		void *ptr;
-	} props[] = {
+	const struct wm_property props[] = {
 		{ XCB_ATOM_WM_CLASS,           XCB_ATOM_STRING,            F(class) },
 		{ XCB_ATOM_WM_NAME,            XCB_ATOM_STRING,            F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR,   XCB_ATOM_WINDOW,            F(transient_for) },
@@ -477,44 +687,44 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
-	void *p;
+	static_assert(ARRAY_LENGTH(props) == WM_PROPERTY_COUNT,
+		      "props[] must follow enum wm_window_property");
+
+	return props[property];
+}
+
+static void
+weston_wm_window_set_property(struct weston_wm_window *window,
+			      enum wm_window_property property,
+			      xcb_get_property_reply_t *reply)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_property prop = weston_wm_window_property(window, property);
+	void *p = prop.ptr;
 	uint32_t *xid;
 	xcb_atom_t *atom;
 	uint32_t i;
 	char name[1024];
 
-	if (!window->properties_dirty)
-		return;
-	window->properties_dirty = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
-
-	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
-	window->size_hints.flags = 0;
-	window->motif_hints.flags = 0;
-	window->delete_window = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
-		if (!reply)
-			/* Bad window, typically */
-			continue;
-		if (reply->type == XCB_ATOM_NONE) {
-			/* No such property */
-			free(reply);
-			continue;
-		}
-
-		p = props[i].ptr;
+	switch (property) {
+	case WM_PROPERTY_MOTIF_HINTS:
+		window->decorate = window->override_redirect ?
+			0 : MWM_DECOR_EVERYTHING;
+		window->motif_hints.flags = 0;
+		break;
+	case WM_PROPERTY_NORMAL_HINTS:
+		window->size_hints.flags = 0;
+		break;
+	case WM_PROPERTY_PROTOCOLS:
+		window->delete_window = 0;
+		break;
+	default:
+		break;
+	}
 
-		switch (props[i].type) {
+	/* Bad window, typically, or no such property */
+	if (reply && reply->type != XCB_ATOM_NONE) {
+		switch (prop.type) {
 		case XCB_ATOM_WM_CLIENT_MACHINE:
 		case XCB_ATOM_STRING:
 			/* FIXME: We're using this for both string and
@@ -574,16 +784,16 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 				else
 					window->decorate =
 						window->motif_hints.decorations;
-				weston_wm_window_schedule_repaint(window);
 			}
 			break;
 		default:
 			break;
 		}
-		free(reply);
 	}
 
-	if (window->pid > 0) {
+	/* The PID and client machine are always read together, the machine
+	 * last. */
+	if (property == WM_PROPERTY_CLIENT_MACHINE && window->pid > 0) {
 		gethostname(name, sizeof(name));
 		for (i = 0; i < sizeof(name); i++) {
 			if (name[i] == '\0')
@@ -600,6 +810,99 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	}
 }
 
+static void
+weston_wm_window_property_reply(struct weston_wm *wm, void *reply,
+				xcb_window_t id, uint32_t property)
+{
+	struct weston_wm_window *window;
+
+	if (!wm_lookup_window(wm, id, &window)) {
+		free(reply);
+		return;
+	}
+
+	weston_wm_window_set_property(window, property, reply);
+	free(reply);
+
+	if (window->properties_pending > 0 &&
+	    --window->properties_pending == 0)
+		weston_wm_window_schedule_repaint(window);
+}
+
+/* Request the properties that changed since they were last read; they are
+ * stored, and the window repainted, as the replies come in. All requests
+ * go out together, so this costs a single round trip. */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	xcb_get_property_cookie_t cookie;
+	uint32_t dirty, i;
+
+	dirty = window->properties_dirty;
+	window->properties_dirty = 0;
+
+	for (i = 0; i < WM_PROPERTY_COUNT; i++) {
+		if (!(dirty & (1u << i)))
+			continue;
+
+		cookie = xcb_get_property(wm->conn,
+					  0, /* delete */
+					  window->id,
+					  weston_wm_window_property(window, i).atom,
+					  XCB_ATOM_ANY, 0, 2048);
+		weston_wm_expect_reply(wm, cookie.sequence,
+				       weston_wm_window_property_reply,
+				       window->id, i);
+		window->properties_pending++;
+	}
+}
+
+/* Like weston_wm_window_fetch_properties(), but waits for the X server.
+ * Replies queued earlier are handled first, in order. */
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+
+	weston_wm_window_fetch_properties(window);
+
+	while (window->properties_pending > 0 &&
+	       weston_wm_dispatch_reply(wm, true))
+		;
+}
+
+/* Which cached properties a PropertyNotify for atom invalidates */
+static uint32_t
+weston_wm_property_dirty_mask(struct weston_wm *wm, xcb_atom_t atom)
+{
+	/* Both names go to window->name and _NET_WM_NAME takes precedence,
+	 * so a change to either needs both read again. */
+	if (atom == XCB_ATOM_WM_NAME || atom == wm->atom.net_wm_name)
+		return (1u << WM_PROPERTY_NAME) |
+			(1u << WM_PROPERTY_NET_WM_NAME);
+	if (atom == XCB_ATOM_WM_CLASS)
+		return 1u << WM_PROPERTY_CLASS;
+	if (atom == XCB_ATOM_WM_TRANSIENT_FOR)
+		return 1u << WM_PROPERTY_TRANSIENT_FOR;
+	if (atom == wm->atom.wm_protocols)
+		return 1u << WM_PROPERTY_PROTOCOLS;
+	if (atom == wm->atom.wm_normal_hints)
+		return 1u << WM_PROPERTY_NORMAL_HINTS;
+	if (atom == wm->atom.net_wm_state)
+		return 1u << WM_PROPERTY_NET_WM_STATE;
+	if (atom == wm->atom.net_wm_window_type)
+		return 1u << WM_PROPERTY_WINDOW_TYPE;
+	if (atom == wm->atom.motif_wm_hints)
+		return 1u << WM_PROPERTY_MOTIF_HINTS;
+	/* The PID is only trusted if the client runs on this machine */
+	if (atom == wm->atom.net_wm_pid || atom == wm->atom.wm_client_machine)
+		return (1u << WM_PROPERTY_PID) |
+			(1u << WM_PROPERTY_CLIENT_MACHINE);
+
+	return 0;
+}
+
 #undef TYPE_WM_PROTOCOLS
 #undef TYPE_MOTIF_WM_HINTS
 #undef TYPE_NET_WM_STATE
@@ -715,12 +1018,18 @@ weston_wm_handle_configure_request(struct weston_wm *wm, xcb_generic_event_t *ev
 	}
 
 	xcb_configure_window(wm->conn, window->id, mask, values);
+	window->configured_x = x;
+	window->configured_y = y;
+	window->configured_width = window->width;
+	window->configured_height = window->height;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
 	values[0] = width;
 	values[1] = height;
 	mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
 	xcb_configure_window(wm->conn, window->frame_id, mask, values);
+	window->configured_frame_width = width;
+	window->configured_frame_height = height;
 
 	weston_wm_window_schedule_repaint(window);
 }
@@ -860,7 +1169,7 @@ westom_wm_window_set_activate(struct weston_wm *wm, struct weston_wm_window *win
 		weston_wm_window_schedule_repaint(wm->focus_window);
 	}
 
-	xcb_flush(wm->conn);
+	weston_wm_schedule_flush(wm);
 }
 
 static void
@@ -930,7 +1239,9 @@ static void
 weston_wm_window_create_frame(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
-	uint32_t values[3];
+	uint32_t values[4];
+	uint32_t mask = 0;
+	int n = 0;
 	int x, y, width, height;
 	int buttons = FRAME_BUTTON_CLOSE;
 
@@ -945,8 +1256,14 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	weston_wm_window_get_frame_size(window, &width, &height);
 	weston_wm_window_get_child_position(window, &x, &y);
 
-	values[0] = wm->screen->black_pixel;
-	values[1] =
+	/* The compositor draws the decoration over a transparent frame */
+	if (wm->subsurface_decorations) {
+		mask |= XCB_CW_BACK_PIXEL;
+		values[n++] = 0;
+	}
+	mask |= XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK | XCB_CW_COLORMAP;
+	values[n++] = wm->screen->black_pixel;
+	values[n++] =
 		XCB_EVENT_MASK_KEY_PRESS |
 		XCB_EVENT_MASK_KEY_RELEASE |
 		XCB_EVENT_MASK_BUTTON_PRESS |
@@ -956,7 +1273,7 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 		XCB_EVENT_MASK_LEAVE_WINDOW |
 		XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
 		XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
-	values[2] = wm->colormap;
+	values[n++] = wm->colormap;
 
 	window->frame_id = xcb_generate_id(wm->conn);
 	xcb_create_window(wm->conn,
@@ -968,9 +1285,7 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	                  0,
 	                  XCB_WINDOW_CLASS_INPUT_OUTPUT,
 	                  wm->visual_id,
-	                  XCB_CW_BORDER_PIXEL |
-	                  XCB_CW_EVENT_MASK |
-	                  XCB_CW_COLORMAP, values);
+	                  mask, values);
 
 	xcb_reparent_window(wm->conn, window->id, window->frame_id, x, y);
 
@@ -978,12 +1293,11 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	xcb_configure_window(wm->conn, window->id,
 			     XCB_CONFIG_WINDOW_BORDER_WIDTH, values);
 
-	window->cairo_surface =
-		cairo_xcb_surface_create_with_xrender_format(wm->conn,
-							     wm->screen,
-							     window->frame_id,
-							     &wm->format_rgba,
-							     width, height);
+	if (!wm->subsurface_decorations)
+		window->cairo_surface =
+			cairo_xcb_surface_create_with_xrender_format(
+				wm->conn, wm->screen, window->frame_id,
+				&wm->format_rgba, width, height);
 
 	hash_table_insert(wm->window_hash, window->frame_id, window);
 }
@@ -1011,25 +1325,17 @@ weston_wm_window_set_virtual_desktop(struct weston_wm_window *window,
 	}
 }
 
+/* Runs once the properties requested at MapRequest time are in */
 static void
-weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
+weston_wm_window_map_requested(struct weston_wm *wm, void *reply,
+			       xcb_window_t id, uint32_t arg)
 {
-	xcb_map_request_event_t *map_request =
-		(xcb_map_request_event_t *) event;
 	struct weston_wm_window *window;
 	struct weston_output *output;
 
-	if (our_resource(wm, map_request->window)) {
-		wm_log("XCB_MAP_REQUEST (window %d, ours)\n",
-		       map_request->window);
-		return;
-	}
-
-	if (!wm_lookup_window(wm, map_request->window, &window))
+	if (!wm_lookup_window(wm, id, &window))
 		return;
 
-	weston_wm_window_read_properties(window);
-
 	/* For a new Window, MapRequest happens before the Window is realized
 	 * in Xwayland. We do the real xcb_map_window() here as a response to
 	 * MapRequest. The Window will get realized (wl_surface created in
@@ -1065,15 +1371,41 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 					   output);
 	}
 
-	xcb_map_window(wm->conn, map_request->window);
+	xcb_map_window(wm->conn, window->id);
 	xcb_map_window(wm->conn, window->frame_id);
 
+	/* The X server does not keep the contents of unmapped windows */
+	window->drawn_decoration = WM_DECORATION_INVALID;
+
 	/* Mapped in the X server, we can draw immediately.
 	 * Cannot set pending state though, no weston_surface until
 	 * xserver_map_shell_surface() time. */
 	weston_wm_window_schedule_repaint(window);
 }
 
+static void
+weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
+{
+	xcb_map_request_event_t *map_request =
+		(xcb_map_request_event_t *) event;
+	struct weston_wm_window *window;
+
+	if (our_resource(wm, map_request->window)) {
+		wm_log("XCB_MAP_REQUEST (window %d, ours)\n",
+		       map_request->window);
+		return;
+	}
+
+	if (!wm_lookup_window(wm, map_request->window, &window))
+		return;
+
+	/* The window type and decorations are needed to map the window,
+	 * but a slow client must not stall the compositor meanwhile. */
+	weston_wm_window_fetch_properties(window);
+	weston_wm_expect_reply(wm, 0, weston_wm_window_map_requested,
+			       window->id, 0);
+}
+
 static void
 weston_wm_handle_map_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 {
@@ -1126,6 +1458,7 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 		wl_list_remove(&window->surface_destroy_listener.link);
 	window->surface = NULL;
 	window->shsurf = NULL;
+	weston_wm_window_destroy_decoration_pieces(window);
 
 	weston_wm_window_set_wm_state(window, ICCCM_WITHDRAWN_STATE);
 	weston_wm_window_set_virtual_desktop(window, -1);
@@ -1133,23 +1466,330 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	xcb_unmap_window(wm->conn, window->frame_id);
 }
 
+static size_t
+decoration_image_size(struct wm_decoration_image *di)
+{
+	return (size_t) pixman_image_get_stride(di->image) *
+		pixman_image_get_height(di->image);
+}
+
+static void
+weston_wm_decoration_image_destroy(struct weston_wm *wm,
+				   struct wm_decoration_image *di)
+{
+	if (di->ref_count == 0)
+		wm->decoration_images_unused -= decoration_image_size(di);
+
+	wl_list_remove(&di->link);
+	pixman_image_unref(di->image);
+	free(di->title);
+	free(di);
+}
+
+static void
+weston_wm_decoration_image_unref(struct weston_wm *wm,
+				 struct wm_decoration_image *di)
+{
+	struct wm_decoration_image *prev;
+
+	if (--di->ref_count > 0)
+		return;
+
+	wm->decoration_images_unused += decoration_image_size(di);
+
+	wl_list_for_each_reverse_safe(di, prev, &wm->decoration_images, link) {
+		if (wm->decoration_images_unused <=
+		    WM_DECORATION_IMAGES_UNUSED_MAX)
+			break;
+		if (di->ref_count == 0)
+			weston_wm_decoration_image_destroy(wm, di);
+	}
+}
+
+static bool
+decoration_image_matches(struct wm_decoration_image *di,
+			 enum wm_decoration decoration,
+			 int frame_width, int frame_height,
+			 const struct weston_geometry *rect,
+			 uint32_t appearance, const char *title)
+{
+	if (di->decoration != decoration ||
+	    di->frame_width != frame_width ||
+	    di->frame_height != frame_height ||
+	    di->rect.x != rect->x || di->rect.y != rect->y ||
+	    di->rect.width != rect->width ||
+	    di->rect.height != rect->height ||
+	    di->appearance != appearance)
+		return false;
+
+	if (!di->title || !title)
+		return di->title == title;
+
+	return strcmp(di->title, title) == 0;
+}
+
+/* Returns a reference to the image of the given piece of the window's
+ * decoration, drawing it only if no window has shown it lately */
+static struct wm_decoration_image *
+weston_wm_window_get_decoration_image(struct weston_wm_window *window,
+				      enum wm_decoration decoration,
+				      enum wm_decoration_piece piece,
+				      int frame_width, int frame_height,
+				      const struct weston_geometry *rect)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_decoration_image *di;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	uint32_t appearance = 0;
+	const char *title = NULL;
+
+	if (decoration == WM_DECORATION_FRAME) {
+		appearance = frame_appearance(window->frame);
+		if (piece == WM_DECORATION_PIECE_TOP)
+			title = window->name;
+	}
+
+	wl_list_for_each(di, &wm->decoration_images, link) {
+		if (!decoration_image_matches(di, decoration,
+					      frame_width, frame_height,
+					      rect, appearance, title))
+			continue;
+
+		if (di->ref_count++ == 0)
+			wm->decoration_images_unused -=
+				decoration_image_size(di);
+		wl_list_remove(&di->link);
+		wl_list_insert(&wm->decoration_images, &di->link);
+		return di;
+	}
+
+	di = zalloc(sizeof *di);
+	if (!di)
+		return NULL;
+
+	di->image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+					     rect->width, rect->height,
+					     NULL, 0);
+	if (title)
+		di->title = strdup(title);
+	if (!di->image || (title && !di->title)) {
+		if (di->image)
+			pixman_image_unref(di->image);
+		free(di);
+		return NULL;
+	}
+
+	wm_log("XWM: draw decoration image %dx%d, win %d\n",
+	       rect->width, rect->height, window->id);
+
+	surface = cairo_image_surface_create_for_data(
+		(unsigned char *) pixman_image_get_data(di->image),
+		CAIRO_FORMAT_ARGB32, rect->width, rect->height,
+		pixman_image_get_stride(di->image));
+	cr = cairo_create(surface);
+	cairo_translate(cr, -rect->x, -rect->y);
+
+	if (decoration == WM_DECORATION_FRAME)
+		frame_repaint(window->frame, cr);
+	else
+		render_shadow(cr, wm->theme->shadow,
+			      -4, -4, frame_width + 8, frame_height + 8,
+			      64, 64);
+
+	cairo_destroy(cr);
+	cairo_surface_destroy(surface);
+
+	di->ref_count = 1;
+	di->decoration = decoration;
+	di->frame_width = frame_width;
+	di->frame_height = frame_height;
+	di->rect = *rect;
+	di->appearance = appearance;
+	wl_list_insert(&wm->decoration_images, &di->link);
+
+	return di;
+}
+
+static void
+weston_wm_window_destroy_decoration_pieces(struct weston_wm_window *window)
+{
+	struct wm_decoration_piece_surface *piece;
+	int i;
+
+	for (i = 0; i < WM_DECORATION_PIECE_COUNT; i++) {
+		piece = &window->pieces[i];
+		if (piece->surface)
+			weston_surface_destroy(piece->surface);
+		if (piece->image)
+			weston_wm_decoration_image_unref(window->wm,
+							 piece->image);
+		piece->surface = NULL;
+		piece->sub = NULL;
+		piece->image = NULL;
+	}
+
+	window->decoration_parent = NULL;
+	window->drawn_decoration = WM_DECORATION_INVALID;
+}
+
+static int
+weston_wm_window_create_decoration_piece(struct weston_wm_window *window,
+					 struct wm_decoration_piece_surface *piece)
+{
+	piece->surface =
+		weston_surface_create(window->wm->server->compositor);
+	if (!piece->surface)
+		return -1;
+
+	piece->sub = weston_subsurface_create_internal(piece->surface,
+						       window->surface);
+	if (!piece->sub) {
+		weston_surface_destroy(piece->surface);
+		piece->surface = NULL;
+		return -1;
+	}
+
+	/* Pointer events go to the frame window underneath */
+	pixman_region32_fini(&piece->surface->input);
+	pixman_region32_init(&piece->surface->input);
+
+	return 0;
+}
+
+static void
+weston_wm_window_set_decoration_piece(struct weston_wm_window *window,
+				      enum wm_decoration decoration,
+				      enum wm_decoration_piece i,
+				      int frame_width, int frame_height,
+				      const struct weston_geometry *rect)
+{
+	struct wm_decoration_piece_surface *piece = &window->pieces[i];
+	struct wm_decoration_image *di = NULL;
+
+	if (decoration != WM_DECORATION_NONE &&
+	    rect->width > 0 && rect->height > 0)
+		di = weston_wm_window_get_decoration_image(window, decoration,
+							   i, frame_width,
+							   frame_height, rect);
+
+	/* Same image, so also the same position */
+	if (di && di == piece->image) {
+		weston_wm_decoration_image_unref(window->wm, di);
+		return;
+	}
+
+	if (di && !piece->surface &&
+	    weston_wm_window_create_decoration_piece(window, piece) < 0) {
+		weston_wm_decoration_image_unref(window->wm, di);
+		di = NULL;
+	}
+
+	if (di && weston_surface_set_image(piece->surface, di->image) < 0) {
+		weston_wm_decoration_image_unref(window->wm, di);
+		di = NULL;
+	}
+
+	if (di)
+		weston_subsurface_set_position(piece->sub, rect->x, rect->y);
+	else if (piece->surface && weston_surface_is_mapped(piece->surface))
+		weston_surface_unmap(piece->surface);
+
+	if (piece->image)
+		weston_wm_decoration_image_unref(window->wm, piece->image);
+	piece->image = di;
+}
+
+/* Shows the decoration in the parts of the frame window around the X
+ * window; like the rest of the surface, they move on the next commit
+ * from Xwayland. */
+static void
+weston_wm_window_set_decoration_pieces(struct weston_wm_window *window,
+				       enum wm_decoration decoration,
+				       int width, int height)
+{
+	struct weston_geometry rects[WM_DECORATION_PIECE_COUNT];
+	int x, y, i;
+
+	weston_wm_window_get_child_position(window, &x, &y);
+
+	rects[WM_DECORATION_PIECE_TOP] = (struct weston_geometry) {
+		0, 0, width, y
+	};
+	rects[WM_DECORATION_PIECE_BOTTOM] = (struct weston_geometry) {
+		0, y + window->height, width, height - y - window->height
+	};
+	rects[WM_DECORATION_PIECE_LEFT] = (struct weston_geometry) {
+		0, y, x, window->height
+	};
+	rects[WM_DECORATION_PIECE_RIGHT] = (struct weston_geometry) {
+		x + window->width, y, width - x - window->width, window->height
+	};
+
+	for (i = 0; i < WM_DECORATION_PIECE_COUNT; i++)
+		weston_wm_window_set_decoration_piece(window, decoration, i,
+						      width, height,
+						      &rects[i]);
+
+	window->decoration_parent = window->surface;
+}
+
 static void
 weston_wm_window_draw_decoration(struct weston_wm_window *window)
 {
+	enum wm_decoration decoration;
 	cairo_t *cr;
 	int width, height;
 
+	weston_wm_window_get_frame_size(window, &width, &height);
+
+	if (window->fullscreen) {
+		decoration = WM_DECORATION_NONE;
+	} else if (window->decorate) {
+		decoration = WM_DECORATION_FRAME;
+		frame_set_title(window->frame, window->name);
+	} else {
+		decoration = WM_DECORATION_SHADOW;
+	}
+
+	/* Any pieces are on a surface that has since gone */
+	if (window->wm->subsurface_decorations &&
+	    window->decoration_parent != window->surface)
+		weston_wm_window_destroy_decoration_pieces(window);
+
+	/* Most repaints follow property or state changes that leave the
+	 * frame as it is; redrawing it anyway would send the whole
+	 * decoration to the X server again. */
+	if (decoration == window->drawn_decoration &&
+	    width == window->drawn_width && height == window->drawn_height &&
+	    !(decoration == WM_DECORATION_FRAME &&
+	      frame_status(window->frame) & FRAME_STATUS_REPAINT))
+		return;
+
+	if (window->wm->subsurface_decorations && !window->surface)
+		return;
+
 	wm_log("XWM: draw decoration, win %d\n", window->id);
 
-	weston_wm_window_get_frame_size(window, &width, &height);
+	window->drawn_decoration = decoration;
+	window->drawn_width = width;
+	window->drawn_height = height;
+
+	if (window->wm->subsurface_decorations) {
+		weston_wm_window_set_decoration_pieces(window, decoration,
+						       width, height);
+		if (decoration == WM_DECORATION_FRAME)
+			frame_status_clear(window->frame,
+					   FRAME_STATUS_REPAINT);
+		return;
+	}
 
 	cairo_xcb_surface_set_size(window->cairo_surface, width, height);
 	cr = cairo_create(window->cairo_surface);
 
-	if (window->fullscreen) {
+	if (decoration == WM_DECORATION_NONE) {
 		/* nothing */
-	} else if (window->decorate) {
-		frame_set_title(window->frame, window->name);
+	} else if (decoration == WM_DECORATION_FRAME) {
 		frame_repaint(window->frame, cr);
 	} else {
 		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
@@ -1162,7 +1802,7 @@ weston_wm_window_draw_decoration(struct weston_wm_window *window)
 
 	cairo_destroy(cr);
 	cairo_surface_flush(window->cairo_surface);
-	xcb_flush(window->wm->conn);
+	weston_wm_schedule_flush(window->wm);
 }
 
 static void
@@ -1219,13 +1859,13 @@ weston_wm_window_set_pending_state(struct weston_wm_window *window)
 }
 
 static void
-weston_wm_window_do_repaint(void *data)
+weston_wm_window_do_repaint(struct weston_deferred_work *work)
 {
-	struct weston_wm_window *window = data;
-
-	window->repaint_source = NULL;
+	struct weston_wm_window *window =
+		container_of(work, struct weston_wm_window, repaint_work);
 
-	weston_wm_window_read_properties(window);
+	/* Draws with what we have, and again once the replies are in */
+	weston_wm_window_fetch_properties(window);
 
 	weston_wm_window_draw_decoration(window);
 	weston_wm_window_set_pending_state(window);
@@ -1267,14 +1907,16 @@ weston_wm_window_schedule_repaint(struct weston_wm_window *window)
 		return;
 	}
 
-	if (window->repaint_source)
+	if (window->repaint_work.queued)
 		return;
 
 	wm_log("XWM: schedule repaint, win %d\n", window->id);
 
-	window->repaint_source =
-		wl_event_loop_add_idle(wm->server->loop,
-		                       weston_wm_window_do_repaint, window);
+	/* The decoration only shows once Xwayland has committed the frame
+	 * window, so it need not be drawn ahead of the next repaint */
+	window->repaint_work.run = weston_wm_window_do_repaint;
+	weston_compositor_defer_work(wm->server->compositor,
+				     &window->repaint_work);
 }
 
 static void
@@ -1287,8 +1929,16 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!wm_lookup_window(wm, property_notify->window, &window))
 		return;
 
-	window->properties_dirty = 1;
+	window->properties_dirty |=
+		weston_wm_property_dirty_mask(wm, property_notify->atom);
+
+	/* Unmapped windows are read when mapped. Fetching now makes it
+	 * likely that xserver_map_shell_surface() need not wait. */
+	if (window->frame_id != XCB_WINDOW_NONE || window->surface)
+		weston_wm_window_fetch_properties(window);
 
+#ifdef WM_DEBUG
+	/* Each of these waits for the X server */
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
 	if (property_notify->state == XCB_PROPERTY_DELETE)
 		wm_log_continue("deleted %s\n",
@@ -1296,10 +1946,22 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	else
 		read_and_dump_property(wm, property_notify->window,
 				       property_notify->atom);
+#endif
+}
 
-	if (property_notify->atom == wm->atom.net_wm_name ||
-	    property_notify->atom == XCB_ATOM_WM_NAME)
-		weston_wm_window_schedule_repaint(window);
+static void
+weston_wm_window_geometry_reply(struct weston_wm *wm, void *data,
+				xcb_window_t id, uint32_t arg)
+{
+	xcb_get_geometry_reply_t *reply = data;
+	struct weston_wm_window *window;
+
+	/* technically we should use XRender and check the visual format's
+	alpha_mask, but checking depth is simpler and works in all known cases */
+	if (reply && wm_lookup_window(wm, id, &window))
+		window->has_alpha = reply->depth == 32;
+
+	free(reply);
 }
 
 static void
@@ -1309,7 +1971,6 @@ weston_wm_window_create(struct weston_wm *wm,
 	struct weston_wm_window *window;
 	uint32_t values[1];
 	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1318,6 +1979,8 @@ weston_wm_window_create(struct weston_wm *wm,
 	}
 
 	geometry_cookie = xcb_get_geometry(wm->conn, id);
+	weston_wm_expect_reply(wm, geometry_cookie.sequence,
+			       weston_wm_window_geometry_reply, id, 0);
 
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
                     XCB_EVENT_MASK_FOCUS_CHANGE;
@@ -1325,7 +1988,7 @@ weston_wm_window_create(struct weston_wm *wm,
 
 	window->wm = wm;
 	window->id = id;
-	window->properties_dirty = 1;
+	window->properties_dirty = WM_PROPERTIES_ALL;
 	window->override_redirect = override;
 	window->width = width;
 	window->height = height;
@@ -1336,13 +1999,6 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->map_request_y = INT_MIN; /* out of range for valid positions */
 	weston_output_weak_ref_init(&window->legacy_fullscreen_output);
 
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if (geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
-
 	hash_table_insert(wm->window_hash, id, window);
 }
 
@@ -1353,10 +2009,10 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 
 	weston_output_weak_ref_clear(&window->legacy_fullscreen_output);
 
-	if (window->repaint_source)
-		wl_event_source_remove(window->repaint_source);
+	weston_deferred_work_cancel(&window->repaint_work);
 	if (window->cairo_surface)
 		cairo_surface_destroy(window->cairo_surface);
+	weston_wm_window_destroy_decoration_pieces(window);
 
 	if (window->frame_id) {
 		xcb_reparent_window(wm->conn, window->id, wm->wm_window, 0, 0);
@@ -1377,11 +2033,32 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 	free(window);
 }
 
+/* position holds the int16_t x and y from CreateNotify */
+static void
+weston_wm_window_parent_geometry_reply(struct weston_wm *wm, void *data,
+				       xcb_window_t id, uint32_t position)
+{
+	xcb_get_geometry_reply_t *parent = data;
+	struct weston_wm_window *window;
+	int16_t x = position & 0xffff;
+	int16_t y = position >> 16;
+
+	/* A ConfigureNotify handled meanwhile has the final position */
+	if (parent && wm_lookup_window(wm, id, &window) &&
+	    window->x == x && window->y == y) {
+		window->x += parent->x;
+		window->y += parent->y;
+	}
+
+	free(parent);
+}
+
 static void
 weston_wm_handle_create_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 {
 	xcb_create_notify_event_t *create_notify =
 		(xcb_create_notify_event_t *) event;
+	xcb_get_geometry_cookie_t parent_geometry_cookie;
 
 	wm_log("XCB_CREATE_NOTIFY (window %d, at (%d, %d), width %d, height %d%s%s)\n",
 	       create_notify->window,
@@ -1393,13 +2070,18 @@ weston_wm_handle_create_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	if (our_resource(wm, create_notify->window))
 		return;
 
-	xcb_get_geometry_cookie_t parent_geometry_cookie = xcb_get_geometry(wm->conn, create_notify->parent);
-	xcb_get_geometry_reply_t* parent = xcb_get_geometry_reply(wm->conn, parent_geometry_cookie, NULL);
-
 	weston_wm_window_create(wm, create_notify->window,
 				create_notify->width, create_notify->height,
-				parent->x + create_notify->x, parent->y + create_notify->y,
+				create_notify->x, create_notify->y,
 				create_notify->override_redirect);
+
+	parent_geometry_cookie = xcb_get_geometry(wm->conn,
+						  create_notify->parent);
+	weston_wm_expect_reply(wm, parent_geometry_cookie.sequence,
+			       weston_wm_window_parent_geometry_reply,
+			       create_notify->window,
+			       (uint16_t) create_notify->x |
+			       (uint32_t) (uint16_t) create_notify->y << 16);
 }
 
 static void
@@ -1664,6 +2346,11 @@ surface_destroy(struct wl_listener *listener, void *data)
 	 * Don't try to use it later. */
 	window->shsurf = NULL;
 	window->surface = NULL;
+
+	/* The pieces are unmapped with their parent. Destroying them
+	 * here would remove their listeners from the signal being
+	 * emitted, so that waits for the next surface or the unmap. */
+	window->decoration_parent = NULL;
 }
 
 static void
@@ -1706,6 +2393,8 @@ weston_wm_handle_client_message(struct weston_wm *wm,
 		(xcb_client_message_event_t *) event;
 	struct weston_wm_window *window;
 
+#ifdef WM_DEBUG
+	/* get_atom_name() waits for the X server */
 	wm_log("XCB_CLIENT_MESSAGE (%s %d %d %d %d %d win %d)\n",
 	       get_atom_name(wm->conn, client_message->type),
 	       client_message->data.data32[0],
@@ -1714,6 +2403,7 @@ weston_wm_handle_client_message(struct weston_wm *wm,
 	       client_message->data.data32[3],
 	       client_message->data.data32[4],
 	       client_message->window);
+#endif
 
 	/* The window may get created and destroyed before we actually
 	 * handle the message.  If it doesn't exist, bail.
@@ -1820,23 +2510,33 @@ static const struct cursor_alternatives cursors[] = {
 
 static void
 weston_wm_create_cursors(struct weston_wm *wm)
+{
+	wm->cursors = calloc(ARRAY_LENGTH(cursors), sizeof(xcb_cursor_t));
+	wm->cursors_loaded = 0;
+	wm->last_cursor = -1;
+}
+
+/* Decoding a cursor from the theme files is slow, and most are only
+ * needed once a window gets resized, so each is loaded on first use */
+static xcb_cursor_t
+weston_wm_get_cursor(struct weston_wm *wm, int cursor)
 {
 	const char *name;
-	int i, count = ARRAY_LENGTH(cursors);
 	size_t j;
 
-	wm->cursors = malloc(count * sizeof(xcb_cursor_t));
-	for (i = 0; i < count; i++) {
-		for (j = 0; j < cursors[i].count; j++) {
-			name = cursors[i].names[j];
-			wm->cursors[i] =
-				xcb_cursor_library_load_cursor(wm, name);
-			if (wm->cursors[i] != (xcb_cursor_t)-1)
-				break;
-		}
+	if (wm->cursors_loaded & (1u << cursor))
+		return wm->cursors[cursor];
+
+	wm->cursors[cursor] = (xcb_cursor_t)-1;
+	for (j = 0; j < cursors[cursor].count; j++) {
+		name = cursors[cursor].names[j];
+		wm->cursors[cursor] = xcb_cursor_library_load_cursor(wm, name);
+		if (wm->cursors[cursor] != (xcb_cursor_t)-1)
+			break;
 	}
+	wm->cursors_loaded |= 1u << cursor;
 
-	wm->last_cursor = -1;
+	return wm->cursors[cursor];
 }
 
 static void
@@ -1845,7 +2545,9 @@ weston_wm_destroy_cursors(struct weston_wm *wm)
 	uint8_t i;
 
 	for (i = 0; i < ARRAY_LENGTH(cursors); i++)
-		xcb_free_cursor(wm->conn, wm->cursors[i]);
+		if ((wm->cursors_loaded & (1u << i)) &&
+		    wm->cursors[i] != (xcb_cursor_t)-1)
+			xcb_free_cursor(wm->conn, wm->cursors[i]);
 
 	free(wm->cursors);
 }
@@ -1888,10 +2590,10 @@ weston_wm_window_set_cursor(struct weston_wm *wm, xcb_window_t window_id,
 
 	wm->last_cursor = cursor;
 
-	cursor_value_list = wm->cursors[cursor];
+	cursor_value_list = weston_wm_get_cursor(wm, cursor);
 	xcb_change_window_attributes (wm->conn, window_id,
 				      XCB_CW_CURSOR, &cursor_value_list);
-	xcb_flush(wm->conn);
+	weston_wm_schedule_flush(wm);
 }
 
 static void
@@ -2068,6 +2770,11 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 	int count = 0;
 
 	while (event = xcb_poll_for_event(wm->conn), event != NULL) {
+		/* Handlers may depend on state the replies set, e.g. a
+		 * selection transfer switching to INCR. */
+		count += weston_wm_dispatch_replies_before(wm,
+							   event->full_sequence);
+
 		if (weston_wm_handle_selection_event(wm, event)) {
 			free(event);
 			count++;
@@ -2136,6 +2843,9 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
+	/* Reading the events also read whatever replies came after them */
+	count += weston_wm_dispatch_replies(wm);
+
 	if (count != 0)
 		xcb_flush(wm->conn);
 
@@ -2179,6 +2889,19 @@ weston_wm_get_visual_and_colormap(struct weston_wm *wm)
 			    wm->colormap, wm->screen->root, wm->visual_id);
 }
 
+static void
+weston_wm_xfixes_version_reply(struct weston_wm *wm, void *data,
+			       xcb_window_t window, uint32_t arg)
+{
+	xcb_xfixes_query_version_reply_t *reply = data;
+
+	if (reply)
+		weston_log("xfixes version: %d.%d\n",
+			   reply->major_version, reply->minor_version);
+
+	free(reply);
+}
+
 static void
 weston_wm_get_resources(struct weston_wm *wm)
 {
@@ -2256,7 +2979,6 @@ weston_wm_get_resources(struct weston_wm *wm)
 #undef F
 
 	xcb_xfixes_query_version_cookie_t xfixes_cookie;
-	xcb_xfixes_query_version_reply_t *xfixes_reply;
 	xcb_intern_atom_cookie_t cookies[ARRAY_LENGTH(atoms)];
 	xcb_intern_atom_reply_t *reply;
 	xcb_render_query_pict_formats_reply_t *formats_reply;
@@ -2274,26 +2996,28 @@ weston_wm_get_resources(struct weston_wm *wm)
 					      strlen(atoms[i].name),
 					      atoms[i].name);
 
-	for (i = 0; i < ARRAY_LENGTH(atoms); i++) {
-		reply = xcb_intern_atom_reply (wm->conn, cookies[i], NULL);
-		*(xcb_atom_t *) ((char *) wm + atoms[i].offset) = reply->atom;
-		free(reply);
-	}
-
+	/* Everything above is answered in the same round trip as the
+	 * extension query waited for here. The xfixes version is only
+	 * logged, so it does not cost a round trip of its own. */
 	wm->xfixes = xcb_get_extension_data(wm->conn, &xcb_xfixes_id);
-	if (!wm->xfixes || !wm->xfixes->present)
+	if (!wm->xfixes || !wm->xfixes->present) {
 		weston_log("xfixes not available\n");
-
-	xfixes_cookie = xcb_xfixes_query_version(wm->conn,
+	} else {
+		xfixes_cookie =
+			xcb_xfixes_query_version(wm->conn,
 						 XCB_XFIXES_MAJOR_VERSION,
 						 XCB_XFIXES_MINOR_VERSION);
-	xfixes_reply = xcb_xfixes_query_version_reply(wm->conn,
-						      xfixes_cookie, NULL);
-
-	weston_log("xfixes version: %d.%d\n",
-	       xfixes_reply->major_version, xfixes_reply->minor_version);
+		weston_wm_expect_reply(wm, xfixes_cookie.sequence,
+				       weston_wm_xfixes_version_reply,
+				       XCB_WINDOW_NONE, 0);
+	}
 
-	free(xfixes_reply);
+	for (i = 0; i < ARRAY_LENGTH(atoms); i++) {
+		reply = xcb_intern_atom_reply (wm->conn, cookies[i], NULL);
+		*(xcb_atom_t *) ((char *) wm + atoms[i].offset) =
+			reply ? reply->atom : XCB_ATOM_NONE;
+		free(reply);
+	}
 
 	formats_reply = xcb_render_query_pict_formats_reply(wm->conn,
 							    formats_cookie, 0);
@@ -2385,7 +3109,13 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	if (wm == NULL)
 		return NULL;
 
+#ifdef WM_DEBUG
+	weston_log_scopes_configure("xwm:debug");
+#endif
+	wm_log_scope = weston_log_scope_get("xwm");
+
 	wm->server = wxs;
+	wl_list_init(&wm->pending_replies);
 	wm->window_hash = hash_table_create();
 	if (wm->window_hash == NULL) {
 		free(wm);
@@ -2426,6 +3156,9 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 					  XCB_COMPOSITE_REDIRECT_MANUAL);
 
 	wm->theme = theme_create();
+	wl_list_init(&wm->decoration_images);
+	wm->subsurface_decorations = wxs->subsurface_decorations &&
+		wxs->compositor->renderer->surface_set_image != NULL;
 
 	supported[0] = wm->atom.net_wm_moveresize;
 	supported[1] = wm->atom.net_wm_state;
@@ -2472,10 +3205,30 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	return wm;
 }
 
+/* The frame and the X window of a window both map to it */
+static void
+weston_wm_window_destroy_decoration_cb(void *element, void *data)
+{
+	weston_wm_window_destroy_decoration_pieces(element);
+}
+
 void
 weston_wm_destroy(struct weston_wm *wm)
 {
+	struct weston_wm_reply *r, *next;
+	struct wm_decoration_image *di, *next_di;
+
+	wl_list_for_each_safe(r, next, &wm->pending_replies, link)
+		free(r);
+
+	if (wm->flush_source)
+		wl_event_source_remove(wm->flush_source);
+
 	/* FIXME: Free windows in hash. */
+	hash_table_for_each(wm->window_hash,
+			    weston_wm_window_destroy_decoration_cb, NULL);
+	wl_list_for_each_safe(di, next_di, &wm->decoration_images, link)
+		weston_wm_decoration_image_destroy(wm, di);
 	hash_table_destroy(wm->window_hash);
 	weston_wm_destroy_cursors(wm);
 	xcb_disconnect(wm->conn);
@@ -2515,29 +3268,44 @@ weston_wm_window_configure(void *data)
 	uint32_t values[4];
 	int x, y, width, height;
 
+	window->configure_source = NULL;
+
 	weston_wm_window_get_child_position(window, &x, &y);
-	values[0] = x;
-	values[1] = y;
-	values[2] = window->width;
-	values[3] = window->height;
-	xcb_configure_window(wm->conn,
-			     window->id,
-			     XCB_CONFIG_WINDOW_X |
-			     XCB_CONFIG_WINDOW_Y |
-			     XCB_CONFIG_WINDOW_WIDTH |
-			     XCB_CONFIG_WINDOW_HEIGHT,
-			     values);
+	if (x != window->configured_x || y != window->configured_y ||
+	    window->width != window->configured_width ||
+	    window->height != window->configured_height) {
+		values[0] = x;
+		values[1] = y;
+		values[2] = window->width;
+		values[3] = window->height;
+		xcb_configure_window(wm->conn,
+				     window->id,
+				     XCB_CONFIG_WINDOW_X |
+				     XCB_CONFIG_WINDOW_Y |
+				     XCB_CONFIG_WINDOW_WIDTH |
+				     XCB_CONFIG_WINDOW_HEIGHT,
+				     values);
+		window->configured_x = x;
+		window->configured_y = y;
+		window->configured_width = window->width;
+		window->configured_height = window->height;
+	}
 
 	weston_wm_window_get_frame_size(window, &width, &height);
-	values[0] = width;
-	values[1] = height;
-	xcb_configure_window(wm->conn,
-			     window->frame_id,
-			     XCB_CONFIG_WINDOW_WIDTH |
-			     XCB_CONFIG_WINDOW_HEIGHT,
-			     values);
+	if (width != window->configured_frame_width ||
+	    height != window->configured_frame_height) {
+		values[0] = width;
+		values[1] = height;
+		xcb_configure_window(wm->conn,
+				     window->frame_id,
+				     XCB_CONFIG_WINDOW_WIDTH |
+				     XCB_CONFIG_WINDOW_HEIGHT,
+				     values);
+		window->configured_frame_width = width;
+		window->configured_frame_height = height;
+	}
 
-	window->configure_source = NULL;
+	weston_wm_schedule_flush(wm);
 
 	weston_wm_window_schedule_repaint(window);
 }
@@ -2601,7 +3369,7 @@ send_position(struct weston_surface *surface, int32_t x, int32_t y)
 		mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y;
 
 		xcb_configure_window(wm->conn, window->frame_id, mask, values);
-		xcb_flush(wm->conn);
+		weston_wm_schedule_flush(wm);
 	}
 }
 
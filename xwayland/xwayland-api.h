@@ -109,6 +109,33 @@ struct weston_xwayland_api {
 	 */
 	void
 	(*xserver_exited)(struct weston_xwayland *xwayland, int exit_status);
+
+	/** Start the Xwayland server without waiting for an X client.
+	 *
+	 * Calls the spawn function passed to \a listen right away, as the
+	 * first X connection would. Does nothing if the server is already
+	 * running, or if \a listen was not called or failed.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 */
+	void
+	(*spawn)(struct weston_xwayland *xwayland);
+
+	/** Choose how X window decorations are drawn.
+	 *
+	 * By default the window manager paints the decorations into the X
+	 * frame window. When enabled, and if the renderer supports it, they
+	 * are drawn by the compositor as sub-surfaces of the frame window
+	 * instead, from images shared between windows of the same size and
+	 * state. Takes effect when the window manager is next started, that
+	 * is with the next Xwayland server.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 * \param enabled Whether to draw the decorations as sub-surfaces.
+	 */
+	void
+	(*set_subsurface_decorations)(struct weston_xwayland *xwayland,
+				      bool enabled);
 };
 
 /** Retrieve the API object for the libweston Xwayland module.
@@ -51,19 +51,28 @@ struct weston_xserver {
 	struct wl_listener destroy_listener;
 	weston_xwayland_spawn_xserver_func_t spawn_func;
 	void *user_data;
+	bool subsurface_decorations;
 };
 
 struct weston_wm {
 	xcb_connection_t *conn;
 	const xcb_query_extension_reply_t *xfixes;
 	struct wl_event_source *source;
+	/* Flushes the requests once the event loop goes idle */
+	struct wl_event_source *flush_source;
 	xcb_screen_t *screen;
 	struct hash_table *window_hash;
 	struct weston_xserver *server;
 	xcb_window_t wm_window;
 	struct weston_wm_window *focus_window;
 	struct theme *theme;
+	/* Decorations drawn by the compositor, from images shared
+	 * between the windows, most recently used first */
+	bool subsurface_decorations;
+	struct wl_list decoration_images;
+	size_t decoration_images_unused; /* bytes */
 	xcb_cursor_t *cursors;
+	uint32_t cursors_loaded; /* loaded on first use, by cursor_type */
 	int last_cursor;
 	xcb_render_pictforminfo_t format_rgb, format_rgba;
 	xcb_visualid_t visual_id;
@@ -72,6 +81,8 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	/* Requests whose replies are handled as they arrive */
+	struct wl_list pending_replies;
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
@@ -164,6 +175,17 @@ dump_property(struct weston_wm *wm, xcb_atom_t property,
 const char *
 get_atom_name(xcb_connection_t *c, xcb_atom_t atom);
 
+/* Reply handlers get the window by id rather than by pointer, as it may
+ * have been destroyed by the time the reply arrives. reply is NULL if the
+ * request failed, typically for that same reason; handlers free it. */
+typedef void (*weston_wm_reply_func_t)(struct weston_wm *wm, void *reply,
+				       xcb_window_t window, uint32_t arg);
+
+void
+weston_wm_expect_reply(struct weston_wm *wm, unsigned int sequence,
+		       weston_wm_reply_func_t func,
+		       xcb_window_t window, uint32_t arg);
+
 void
 weston_wm_selection_init(struct weston_wm *wm);
 int